@@ -0,0 +1,355 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+// The compactions of a memory node, run on input tables built in its own
+// pools, without any compute node. It needs the RDMA device of the memory
+// node, or a build with WITH_RDMA_EMULATION.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "db/dbformat.h"
+#include "db/version_edit.h"
+#include "db/version_set.h"
+#include "dLSM/env.h"
+#include "dLSM/filter_policy.h"
+#include "memory_node/memory_node_keeper.h"
+#include "table/table_builder_bams.h"
+#include "table/table_builder_memoryside.h"
+#include "util/random.h"
+#include "util/testutil.h"
+
+// Comma-separated list of the distributions of the inputs to compact
+//      random     -- the level 0 keys are random, half of them are new
+//      sequential -- the level 0 keys follow the ones of level 1
+//      overwrite  -- every level 0 key overwrites a level 1 key
+//      deletes    -- every level 0 key deletes a level 1 key
+static const char* FLAGS_benchmarks = "random,sequential,overwrite,deletes";
+
+// Number of entries in the inputs of a compaction, half of them in level 0
+static int FLAGS_num = 1000000;
+
+// Number of input tables in level 0 and in level 1
+static int FLAGS_l0_files = 4;
+static int FLAGS_l1_files = 8;
+
+// Size of each key and value
+static int FLAGS_key_size = 20;
+static int FLAGS_value_size = 400;
+
+// Subcompactions of a compaction, 0 to compact on one thread with
+// DoCompactionWork. The memory node only splits compactions of at least 4
+// level 0 and 2 level 1 tables.
+static int FLAGS_subcompactions = 4;
+
+// Compactions run for every distribution
+static int FLAGS_repeats = 3;
+
+namespace dLSM {
+
+namespace {
+
+// The entries of an input table, sorted.
+typedef std::vector<std::tuple<uint64_t, SequenceNumber, ValueType>> Entries;
+
+// Values cut from a random string, like RandomGenerator of db_bench.
+class ValueGenerator {
+ public:
+  ValueGenerator() {
+    Random rnd(301);
+    std::string piece;
+    while (data_.size() < 1048576) {
+      test::RandomString(&rnd, 100, &piece);
+      data_.append(piece);
+    }
+  }
+
+  Slice Generate(size_t len) {
+    if (pos_ + len > data_.size()) {
+      pos_ = 0;
+    }
+    pos_ += len;
+    return Slice(data_.data() + pos_ - len, len);
+  }
+
+ private:
+  std::string data_;
+  size_t pos_ = 0;
+};
+
+class CompactionBenchmark {
+ public:
+  CompactionBenchmark()
+      : icmp_(BytewiseComparator()),
+        options_(true),
+        keeper_(new Memory_Node_Keeper(FLAGS_subcompactions > 0, 19843, 88)) {
+    RDMA_Manager::node_id = 0;
+    options_.comparator = &icmp_;
+    options_.filter_policy =
+        new InternalFilterPolicy(NewBloomFilterPolicy(options_.bloom_bits));
+    if (FLAGS_subcompactions > 0) {
+      keeper_->SetMaxSubcompactions(FLAGS_subcompactions);
+    }
+  }
+
+  ~CompactionBenchmark() {
+    delete options_.filter_policy;
+    delete keeper_;
+  }
+
+  void Run() {
+    std::printf("Entries:    %d in %d + %d tables\n", FLAGS_num,
+                FLAGS_l0_files, FLAGS_l1_files);
+    std::printf("Keys:       %d bytes each\n", FLAGS_key_size);
+    std::printf("Values:     %d bytes each\n", FLAGS_value_size);
+    std::printf("Subcompactions: %d\n", FLAGS_subcompactions);
+    std::printf("------------------------------------------------\n");
+    const char* benchmarks = FLAGS_benchmarks;
+    while (benchmarks != nullptr) {
+      const char* sep = std::strchr(benchmarks, ',');
+      Slice name;
+      if (sep == nullptr) {
+        name = benchmarks;
+        benchmarks = nullptr;
+      } else {
+        name = Slice(benchmarks, sep - benchmarks);
+        benchmarks = sep + 1;
+      }
+      if (name != Slice("random") && name != Slice("sequential") &&
+          name != Slice("overwrite") && name != Slice("deletes")) {
+        if (!name.empty()) {
+          std::fprintf(stderr, "unknown benchmark '%s'\n",
+                       name.ToString().c_str());
+        }
+        continue;
+      }
+      for (int i = 0; i < FLAGS_repeats; i++) {
+        RunCompaction(name);
+      }
+    }
+  }
+
+ private:
+  // The level 1 entries are the even keys, with the oldest sequences.
+  void GenerateInputs(const Slice& name, std::vector<Entries>* l0,
+                      std::vector<Entries>* l1) {
+    const uint64_t n1 = FLAGS_num / 2;
+    const uint64_t n0 = FLAGS_num - n1;
+    Random64 rand(rand_.Next());
+    SequenceNumber seq = 1;
+    l1->assign(FLAGS_l1_files, Entries());
+    for (uint64_t i = 0; i < n1; i++) {
+      (*l1)[i * FLAGS_l1_files / n1].emplace_back(2 * i, seq++, kTypeValue);
+    }
+    l0->assign(FLAGS_l0_files, Entries());
+    for (int f = 0; f < FLAGS_l0_files; f++) {
+      Entries& entries = (*l0)[f];
+      const uint64_t count = n0 / FLAGS_l0_files;
+      for (uint64_t i = 0; i < count; i++) {
+        uint64_t key;
+        ValueType type = kTypeValue;
+        if (name == Slice("sequential")) {
+          key = 2 * n1 + f * count + i;
+        } else if (name == Slice("random")) {
+          key = rand.Uniform(4 * n1);
+        } else {
+          key = 2 * rand.Uniform(n1);
+          if (name == Slice("deletes")) {
+            type = kTypeDeletion;
+          }
+        }
+        entries.emplace_back(key, 0, type);
+      }
+      // One entry per key in a table, the later tables are newer.
+      std::sort(entries.begin(), entries.end());
+      entries.erase(std::unique(entries.begin(), entries.end(),
+                                [](const Entries::value_type& a,
+                                   const Entries::value_type& b) {
+                                  return std::get<0>(a) == std::get<0>(b);
+                                }),
+                    entries.end());
+      for (auto& entry : entries) {
+        std::get<1>(entry) = seq++;
+      }
+    }
+  }
+
+  std::shared_ptr<RemoteMemTableMetaData> BuildTable(const Entries& entries,
+                                                     int level) {
+#ifndef BYTEADDRESSABLE
+    TableBuilder* builder = new TableBuilder_Memoryside(
+        options_, Compact, Memory_Node_Keeper::rdma_mg);
+#endif
+#ifdef BYTEADDRESSABLE
+    TableBuilder* builder = new TableBuilder_BAMS(
+        options_, Compact, Memory_Node_Keeper::rdma_mg, level);
+#endif
+    auto meta = std::make_shared<RemoteMemTableMetaData>(1);
+    meta->largest_seq = 0;
+    char key[64];
+    for (const auto& entry : entries) {
+      std::snprintf(key, sizeof(key), "%0*llu", FLAGS_key_size,
+                    static_cast<unsigned long long>(std::get<0>(entry)));
+      InternalKey ikey(Slice(key, FLAGS_key_size), std::get<1>(entry),
+                       std::get<2>(entry));
+      if (builder->NumEntries() == 0) {
+        meta->smallest = ikey;
+      }
+      meta->largest = ikey;
+      meta->largest_seq = std::max(meta->largest_seq, std::get<1>(entry));
+      builder->Add(ikey.Encode(), std::get<2>(entry) == kTypeValue
+                                      ? values_.Generate(FLAGS_value_size)
+                                      : Slice());
+    }
+    builder->Finish();
+    builder->get_datablocks_map(meta->remote_data_mrs);
+    builder->get_dataindexblocks_map(meta->remote_dataindex_mrs);
+    builder->get_filter_map(meta->remote_filter_mrs);
+    meta->number = next_file_number_++;
+    meta->level = level;
+    meta->creator_node_id = RDMA_Manager::node_id;
+    meta->shard_target_node_id = RDMA_Manager::node_id;
+    meta->file_size = builder->FileSize();
+    meta->num_entries = builder->NumEntries();
+    meta->num_deletions = builder->NumDeletions();
+    delete builder;
+    return meta;
+  }
+
+  // Give the chunks of a table back to the pool, as the garbage collection
+  // of the memory node does.
+  void ReleaseTable(const std::shared_ptr<RemoteMemTableMetaData>& meta) {
+    for (auto* chunks : {&meta->remote_data_mrs, &meta->remote_dataindex_mrs,
+                         &meta->remote_filter_mrs}) {
+      for (auto& chunk : *chunks) {
+        Memory_Node_Keeper::rdma_mg->Deallocate_Local_RDMA_Slot(
+            chunk.second->addr, FlushBuffer);
+      }
+    }
+  }
+
+  void RunCompaction(const Slice& name) {
+    std::vector<Entries> l0;
+    std::vector<Entries> l1;
+    GenerateInputs(name, &l0, &l1);
+    Compaction c(&options_);
+    c.SetLevel(0);
+    uint64_t bytes_read = 0;
+    uint64_t entries_read = 0;
+    for (int which = 0; which < 2; which++) {
+      for (const Entries& entries : which == 0 ? l0 : l1) {
+        if (entries.empty()) {
+          continue;
+        }
+        c.inputs_[which].push_back(BuildTable(entries, which));
+        bytes_read += c.inputs_[which].back()->file_size;
+        entries_read += entries.size();
+      }
+    }
+    std::string encoded;
+    c.EncodeTo(&encoded);
+
+    uint64_t cpu_before[Memory_Node_Keeper::kNumCompactionStages];
+    for (int s = 0; s < Memory_Node_Keeper::kNumCompactionStages; s++) {
+      cpu_before[s] = keeper_->CompactionStageCpuMicros(
+          static_cast<Memory_Node_Keeper::CompactionStage>(s));
+    }
+    std::vector<std::shared_ptr<RemoteMemTableMetaData>> outputs;
+    const uint64_t start_micros = Env::Default()->NowMicros();
+    Status s = keeper_->CompactLocally(encoded, &outputs);
+    const uint64_t micros = Env::Default()->NowMicros() - start_micros;
+    uint64_t cpu[Memory_Node_Keeper::kNumCompactionStages];
+    for (int s = 0; s < Memory_Node_Keeper::kNumCompactionStages; s++) {
+      cpu[s] = keeper_->CompactionStageCpuMicros(
+                   static_cast<Memory_Node_Keeper::CompactionStage>(s)) -
+               cpu_before[s];
+    }
+
+    uint64_t bytes_written = 0;
+    uint64_t entries_written = 0;
+    for (auto& meta : outputs) {
+      bytes_written += meta->file_size;
+      entries_written += meta->num_entries;
+    }
+    if (!s.ok()) {
+      std::fprintf(stderr, "%-10s : %s\n", name.ToString().c_str(),
+                   s.ToString().c_str());
+    } else {
+      const double secs = std::max<uint64_t>(micros, 1) * 1e-6;
+      std::printf(
+          "%-10s : %8.1f MB/s in, %11.3f micros/entry; %.1f MB in, %.1f MB "
+          "out, %llu of %llu entries kept, %zu tables\n",
+          name.ToString().c_str(), bytes_read / 1048576.0 / secs,
+          static_cast<double>(micros) / std::max<uint64_t>(entries_read, 1),
+          bytes_read / 1048576.0, bytes_written / 1048576.0,
+          static_cast<unsigned long long>(entries_written),
+          static_cast<unsigned long long>(entries_read), outputs.size());
+      std::printf(
+          "             cpu: merge %.3f s, build %.3f s, publish %.3f s, "
+          "serial %.3f s\n",
+          cpu[Memory_Node_Keeper::kMergeStage] * 1e-6,
+          cpu[Memory_Node_Keeper::kBuildStage] * 1e-6,
+          cpu[Memory_Node_Keeper::kPublishStage] * 1e-6,
+          cpu[Memory_Node_Keeper::kSerialStage] * 1e-6);
+    }
+    std::fflush(stdout);
+    for (int which = 0; which < 2; which++) {
+      for (auto& meta : c.inputs_[which]) {
+        ReleaseTable(meta);
+      }
+    }
+    for (auto& meta : outputs) {
+      ReleaseTable(meta);
+    }
+  }
+
+  const InternalKeyComparator icmp_;
+  Options options_;
+  Memory_Node_Keeper* keeper_;
+  ValueGenerator values_;
+  Random64 rand_{301};
+  uint64_t next_file_number_ = 1;
+};
+
+}  // namespace
+
+}  // namespace dLSM
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    int n;
+    char junk;
+    if (dLSM::Slice(argv[i]).starts_with("--benchmarks=")) {
+      FLAGS_benchmarks = argv[i] + std::strlen("--benchmarks=");
+    } else if (sscanf(argv[i], "--num=%d%c", &n, &junk) == 1) {
+      FLAGS_num = n;
+    } else if (sscanf(argv[i], "--l0_files=%d%c", &n, &junk) == 1 && n > 0) {
+      FLAGS_l0_files = n;
+    } else if (sscanf(argv[i], "--l1_files=%d%c", &n, &junk) == 1 && n > 0) {
+      FLAGS_l1_files = n;
+    } else if (sscanf(argv[i], "--key_size=%d%c", &n, &junk) == 1 &&
+               n >= 8 && n < 64) {
+      FLAGS_key_size = n;
+    } else if (sscanf(argv[i], "--value_size=%d%c", &n, &junk) == 1) {
+      FLAGS_value_size = n;
+    } else if (sscanf(argv[i], "--subcompactions=%d%c", &n, &junk) == 1) {
+      FLAGS_subcompactions = n;
+    } else if (sscanf(argv[i], "--repeats=%d%c", &n, &junk) == 1) {
+      FLAGS_repeats = n;
+    } else {
+      std::fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
+      std::exit(1);
+    }
+  }
+
+  dLSM::CompactionBenchmark benchmark;
+  benchmark.Run();
+  return 0;
+}
@@ -8,6 +8,7 @@
 #include <sys/types.h>
 
 #include <atomic>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 
@@ -17,13 +18,17 @@
 #include "dLSM/db.h"
 #include "dLSM/env.h"
 #include "dLSM/filter_policy.h"
+#include "dLSM/perf_context.h"
 #include "dLSM/write_batch.h"
+#include "db/trace.h"
 #include "port/port.h"
 #include "util/crc32c.h"
 #include "util/histogram.h"
+#include "util/logging.h"
 #include "util/mutexlock.h"
 #include "util/random.h"
 #include "util/testutil.h"
+#include "util/timeline.h"
 
 // Comma-separated list of operations to run in the specified order
 //   Actual benchmarks:
@@ -43,10 +48,19 @@
 //      seekordered   -- N ordered seeks
 //      open          -- cost of opening a DB
 //      crc32c        -- repeated crc32c of 4K of data
+//      ycsbload      -- load N records per thread for the YCSB workloads
+//      ycsba         -- YCSB A: 50% reads, 50% updates, zipfian keys
+//      ycsbb         -- YCSB B: 95% reads, 5% updates, zipfian keys
+//      ycsbc         -- YCSB C: 100% reads, zipfian keys
+//      ycsbd         -- YCSB D: 95% reads, 5% inserts, latest keys
+//      ycsbe         -- YCSB E: 95% short scans, 5% inserts, zipfian keys
+//      ycsbf         -- YCSB F: 50% reads, 50% read-modify-writes, zipfian
+//      replay        -- replay the trace of --trace_file
 //   Meta operations:
 //      compact     -- Compact the entire DB
 //      stats       -- Print DB stats
 //      sstables    -- Print sstable info
+//      rdmastats   -- Print the RDMA transport statistics
 //      heapprofile -- Dump a heap profile (if supported by this port)
 static const char* FLAGS_benchmarks =
     "fillseq,"
@@ -93,6 +107,14 @@ static bool FLAGS_comparisons = false;
 // (initialized to default value by "main")
 static int FLAGS_write_buffer_size = 0;
 
+// If true, the immutables waiting for a flush are merged in memory, see
+// Options::merge_immutables.
+static bool FLAGS_merge_immutables = false;
+
+// If true, the level 0 tables are built on the memory node, see
+// Options::offload_flush.
+static bool FLAGS_offload_flush = false;
+
 // Number of bytes written to each file.
 // (initialized to default value by "main")
 static int FLAGS_max_file_size = 0;
@@ -105,13 +127,40 @@ static int FLAGS_block_size = 0;
 // Negative means use no table_cache.
 static int FLAGS_cache_size = -1;
 
+// If true, the block cache and the table cache are CLOCK caches with TinyLFU
+// admission, see NewClockCache().
+static bool FLAGS_clock_cache = false;
+
 // Maximum number of files to keep open at the same time (use default if == 0)
 static int FLAGS_open_files = 0;
 
 static int FLAGS_block_restart_interval = 1;
+// The records an index entry of a byte addressable table covers.
+static int FLAGS_index_interval = 1;
+// Key the sparse index entries by separators between the groups.
+static bool FLAGS_index_key_separators = false;
+// The index entries between the restarts of the index keys, 0 for the
+// default.
+static int FLAGS_index_restart_interval = 0;
+// The values of the byte addressable tables of this level and the deeper
+// ones are compressed with snappy. Negative keeps them raw.
+static int FLAGS_compression_start_level = -1;
+// The values of at least this many bytes are kept out of the tables, 0 keeps
+// them all in.
+static int FLAGS_min_blob_size = 0;
 // Bloom filter bits per key.
 // Negative means use default settings.
 static int FLAGS_bloom_bits = 10;
+// Options::adaptive_bloom_bits.
+static bool FLAGS_adaptive_bloom_bits = false;
+// Options::read_compaction_sample.
+static int FLAGS_read_compaction_sample = 0;
+// Options::dynamic_level_bytes.
+static bool FLAGS_dynamic_level_bytes = false;
+// Options::memtable_rep: 0 skiplist, 1 hash, 2 vector.
+static int FLAGS_memtable_rep = 0;
+// Options::memtable_numa_partitions.
+static int FLAGS_memtable_numa_partitions = 1;
 
 // Common key prefix length.
 static int FLAGS_key_prefix = 0;
@@ -134,8 +183,59 @@ static bool FLAGS_reuse_logs = false;
 static const char* FLAGS_db = nullptr;
 
 static int FLAGS_readwritepercent = 90;
+
+// The skew of the zipfian and latest key distributions, in (0, 1).
+static double FLAGS_ycsb_theta = 0.99;
+
+// If not null, the key distribution of every YCSB workload: "uniform",
+// "zipfian" or "latest".
+static const char* FLAGS_ycsb_distribution = nullptr;
+
+// If not null, the percentages of reads, updates, inserts, scans and
+// read-modify-writes of every YCSB workload, e.g. "50,50,0,0,0".
+static const char* FLAGS_ycsb_mix = nullptr;
+
+// The scans of the YCSB workloads read up to this many records.
+static int FLAGS_ycsb_max_scan_length = 100;
+
+// The sizes of the values the YCSB workloads write: "fixed" at
+// --value_size, or "uniform" or "zipfian" (the small ones the most likely)
+// in [--value_size_min, --value_size_max].
+static const char* FLAGS_value_size_distribution = "fixed";
+static int FLAGS_value_size_min = 100;
+static int FLAGS_value_size_max = 1000;
 static int FLAGS_ops_between_duration_checks = 2000;
 static int FLAGS_duration = 0;
+
+// If larger than 0, the threads issue the operations open loop, at this
+// many per second all together, rather than each as fast as it can. The
+// latencies are measured from when an operation was meant to start, so that
+// the time it queued behind the slow ones counts.
+static double FLAGS_open_loop_rate = 0;
+
+// The open loop issues the operations at exponentially distributed
+// intervals if true, at fixed ones otherwise.
+static bool FLAGS_poisson = true;
+
+// If not null, the operations on the DB are recorded into this trace, see
+// DB::StartTrace(). A benchmark which opens a fresh DB starts it over.
+static const char* FLAGS_trace_output = nullptr;
+
+// The trace the replay benchmark replays.
+static const char* FLAGS_trace_file = nullptr;
+
+// The replay issues the operations at the times they were recorded at,
+// divided by this, or as fast as it can if 0.
+static double FLAGS_trace_replay_speed = 1.0;
+
+// If larger than 0, the random reads record their PerfContext and print it
+// for the Get() calls which took at least this many microseconds.
+static int FLAGS_slow_get_micros = 0;
+
+// If not null, the background jobs of the DB, the flushes and the
+// compactions, are recorded and written to this file as a Chrome trace once
+// the benchmarks are done, see util/timeline.h.
+static const char* FLAGS_timeline_output = nullptr;
 namespace dLSM {
 
 namespace {
@@ -240,6 +340,67 @@ class RandomGenerator {
   }
 };
 
+// Draws ranks in [0, items) with the zipfian skew "theta", rank 0 the most
+// likely, as the YCSB generator of Gray et al. does. The items can grow
+// between the draws, which only adds to the zeta sum.
+class ZipfianGenerator {
+ public:
+  ZipfianGenerator(uint64_t items, double theta)
+      : theta_(theta),
+        alpha_(1.0 / (1.0 - theta)),
+        zeta2_(1.0 + std::pow(0.5, theta)),
+        items_(0),
+        zetan_(0) {
+    Grow(items);
+  }
+
+  uint64_t Next(Random64* rand, uint64_t items) {
+    if (items > items_) {
+      Grow(items);
+    }
+    const double u = static_cast<double>(rand->Next() >> 11) * 0x1.0p-53;
+    const double uz = u * zetan_;
+    if (uz < 1.0) {
+      return 0;
+    }
+    if (uz < zeta2_) {
+      return 1;
+    }
+    const uint64_t rank = static_cast<uint64_t>(
+        items_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+    return std::min(rank, items_ - 1);
+  }
+
+ private:
+  void Grow(uint64_t items) {
+    for (uint64_t i = items_; i < items; i++) {
+      zetan_ += 1.0 / std::pow(static_cast<double>(i + 1), theta_);
+    }
+    items_ = items;
+    eta_ = (1.0 - std::pow(2.0 / items_, 1.0 - theta_)) /
+           (1.0 - zeta2_ / zetan_);
+  }
+
+  const double theta_;
+  const double alpha_;
+  const double zeta2_;
+  uint64_t items_;
+  double zetan_;
+  double eta_;
+};
+
+// The FNV-1a hash of the bytes of "v", which YCSB scrambles its zipfian
+// ranks with.
+static uint64_t FNVHash64(uint64_t v) {
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (int i = 0; i < 8; i++) {
+    hash ^= v & 0xFF;
+    hash *= 0x100000001B3ull;
+    v >>= 8;
+  }
+  return hash;
+}
+
 class KeyBuffer {
  public:
   KeyBuffer() {
@@ -282,6 +443,12 @@ static void AppendWithSpace(std::string* str, Slice msg) {
   str->append(msg.data(), msg.size());
 }
 
+// The operations of the YCSB workloads, reported apart.
+enum OpType { kRead, kUpdate, kInsert, kScan, kReadModifyWrite, kNumOpTypes };
+
+static const char* const kOpTypeNames[kNumOpTypes] = {"read", "update",
+                                                      "insert", "scan", "rmw"};
+
 class Stats {
  private:
   double start_;
@@ -292,6 +459,8 @@ class Stats {
   int64_t bytes_;
   double last_op_finish_;
   Histogram hist_;
+  Histogram op_hist_[kNumOpTypes];
+  int64_t op_done_[kNumOpTypes];
   std::string message_;
 
  public:
@@ -300,6 +469,10 @@ class Stats {
   void Start() {
     next_report_ = 100;
     hist_.Clear();
+    for (int i = 0; i < kNumOpTypes; i++) {
+      op_hist_[i].Clear();
+      op_done_[i] = 0;
+    }
     done_ = 0;
     bytes_ = 0;
     seconds_ = 0;
@@ -309,6 +482,10 @@ class Stats {
 
   void Merge(const Stats& other) {
     hist_.Merge(other.hist_);
+    for (int i = 0; i < kNumOpTypes; i++) {
+      op_hist_[i].Merge(other.op_hist_[i]);
+      op_done_[i] += other.op_done_[i];
+    }
     done_ += other.done_;
     bytes_ += other.bytes_;
     seconds_ += other.seconds_;
@@ -326,6 +503,10 @@ class Stats {
 
   void AddMessage(Slice msg) { AppendWithSpace(&message_, msg); }
 
+  // Measure the next operation from "intended_start", rather than from the
+  // end of the last one.
+  void StartOp(double intended_start) { last_op_finish_ = intended_start; }
+
   void FinishedSingleOp() {
     if (FLAGS_histogram) {
       double now = g_env->NowMicros();
@@ -359,6 +540,13 @@ class Stats {
     }
   }
 
+  // An operation of "type" which took "micros".
+  void FinishedOp(OpType type, double micros) {
+    op_hist_[type].Add(micros);
+    op_done_[type]++;
+    FinishedSingleOp();
+  }
+
   void AddBytes(int64_t n) { bytes_ += n; }
 
   void Report(const Slice& name) {
@@ -381,9 +569,21 @@ class Stats {
     std::fprintf(stdout, "%-12s : %11.3f micros/op; %ld ops/sec;%s%s\n",
                  name.ToString().c_str(), seconds_ * 1e6 / done_, (long)(done_/elapsed),
                  (extra.empty() ? "" : " "), extra.c_str());
+    for (int i = 0; i < kNumOpTypes; i++) {
+      if (op_done_[i] == 0) continue;
+      const Histogram& hist = op_hist_[i];
+      std::fprintf(stdout,
+                   "  %-10s : %ld ops; %ld ops/sec; micros/op avg %.1f "
+                   "P50 %.1f P99 %.1f P99.9 %.1f\n",
+                   kOpTypeNames[i], (long)op_done_[i],
+                   (long)(op_done_[i] / elapsed), hist.Average(),
+                   hist.Median(), hist.Percentile(99),
+                   hist.Percentile(99.9));
+    }
 
     if (FLAGS_histogram) {
-      std::fprintf(stdout, "Microseconds per op:\n%s\n",
+      std::fprintf(stdout, "Microseconds per op:\n%s\n%s\n",
+                   hist_.PercentileString().c_str(),
                    hist_.ToString().c_str());
     }
     std::fflush(stdout);
@@ -410,6 +610,59 @@ struct SharedState {
       : cv(&mu), total(total), num_initialized(0), num_done(0), start(false) {}
 };
 
+// The start times of the operations of one thread in the open loop.
+class OpenLoopSchedule {
+ public:
+  OpenLoopSchedule(double ops_per_second, uint64_t seed)
+      : interval_micros_(1e6 / ops_per_second),
+        rand_(seed),
+        next_(g_env->NowMicros()),
+        late_(0) {}
+
+  // Wait for the intended start of the next operation and return it. An
+  // operation which could not start in time does not push back the ones
+  // after it: they start at once until the schedule is met again.
+  double Wait() {
+    if (FLAGS_poisson) {
+      const double u = (static_cast<double>(rand_.Next() >> 11) + 1) *
+                       0x1.0p-53;
+      next_ += -std::log(u) * interval_micros_;
+    } else {
+      next_ += interval_micros_;
+    }
+    double now = g_env->NowMicros();
+    if (now < next_) {
+      // Sleep for most of the wait and spin for the rest, as the sleeps are
+      // not precise enough for the short intervals.
+      if (next_ - now > 200) {
+        g_env->SleepForMicroseconds(static_cast<int>(next_ - now - 100));
+      }
+      while (g_env->NowMicros() < next_) {
+      }
+    } else {
+      late_ = std::max(late_, now - next_);
+    }
+    return next_;
+  }
+
+  // The longest any operation started after its intended time.
+  double late() const { return late_; }
+
+ private:
+  const double interval_micros_;
+  Random64 rand_;
+  double next_;
+  double late_;
+};
+
+// The operation mix and key distribution of a YCSB workload.
+struct YCSBWorkload {
+  enum Distribution { kUniform, kZipfian, kLatest };
+  // The percentages of the operations, in OpType order.
+  int mix[kNumOpTypes];
+  Distribution distribution;
+};
+
 // Per-thread state for concurrent executions of the same benchmark.
 struct ThreadState {
   int tid;      // 0..n-1 when running in n threads
@@ -417,10 +670,22 @@ struct ThreadState {
 //  Random rand;
   Stats stats;
   SharedState* shared;
+  // Null unless --open_loop_rate is set.
+  std::unique_ptr<OpenLoopSchedule> schedule;
 
   ThreadState(int index, int seed) : tid(index), rand(seed), shared(nullptr) {}
 };
 
+// The charge of an entry of the block cache, which holds the KV records of
+// the byte addressable tables and the blocks of the others.
+static size_t ExpectedCacheEntrySize() {
+#ifdef BYTEADDRESSABLE
+  return FLAGS_key_size + FLAGS_value_size;
+#else
+  return FLAGS_block_size;
+#endif
+}
+
 }  // namespace
 
 class Benchmark {
@@ -437,6 +702,13 @@ class Benchmark {
   CountComparator count_comparator_;
   int total_thread_count_;
   std::vector<std::string> validation_keys;
+  YCSBWorkload ycsb_;
+  // The records of the YCSB workloads, the loaded ones and the inserted
+  // ones. Record i has the key of GenerateKeyFromInt(i).
+  std::atomic<uint64_t> ycsb_records_;
+  // The records of --trace_file, and when the replay of them started.
+  std::vector<TraceRecord> trace_;
+  std::atomic<uint64_t> replay_start_{0};
 
   void PrintHeader() {
     const int kKeySize = 16 + FLAGS_key_prefix;
@@ -518,7 +790,10 @@ class Benchmark {
 
  public:
   Benchmark()
-      : cache_(FLAGS_cache_size >= 0 ? NewLRUCache(FLAGS_cache_size) : nullptr),
+      : cache_(FLAGS_cache_size < 0 ? nullptr
+               : FLAGS_clock_cache
+                   ? NewClockCache(FLAGS_cache_size, ExpectedCacheEntrySize())
+                   : NewLRUCache(FLAGS_cache_size)),
         filter_policy_(FLAGS_bloom_bits >= 0
                            ? NewBloomFilterPolicy(FLAGS_bloom_bits)
                            : nullptr),
@@ -529,7 +804,8 @@ class Benchmark {
         reads_(FLAGS_reads < 0 ? FLAGS_num : FLAGS_reads),
         heap_counter_(0),
         count_comparator_(BytewiseComparator()),
-        total_thread_count_(0) {
+        total_thread_count_(0),
+        ycsb_records_(static_cast<uint64_t>(FLAGS_num) * FLAGS_threads) {
     std::vector<std::string> files;
     g_env->GetChildren(FLAGS_db, &files);
     for (size_t i = 0; i < files.size(); i++) {
@@ -544,6 +820,14 @@ class Benchmark {
 
   ~Benchmark() {
     delete db_;
+    if (FLAGS_timeline_output != nullptr) {
+      Status s = Timeline::DumpToFile(
+          FLAGS_timeline_output, RDMA_Manager::node_id,
+          "compute node " + std::to_string(RDMA_Manager::node_id));
+      if (!s.ok()) {
+        std::fprintf(stderr, "timeline error: %s\n", s.ToString().c_str());
+      }
+    }
     delete cache_;
     delete filter_policy_;
   }
@@ -682,6 +966,18 @@ class Benchmark {
       } else if (name == Slice("readwhilewriting")) {
         num_threads++;  // Add extra thread for writing
         method = &Benchmark::ReadWhileWriting;
+      } else if (name == Slice("ycsbload")) {
+        fresh_db = true;
+        method = &Benchmark::YCSBLoad;
+      } else if (name.starts_with("ycsb") && name.size() == 5 &&
+                 name[4] >= 'a' && name[4] <= 'f') {
+        if (SetYCSBWorkload(name[4])) {
+          method = &Benchmark::YCSB;
+        }
+      } else if (name == Slice("replay")) {
+        if (LoadTrace()) {
+          method = &Benchmark::Replay;
+        }
       } else if (name == Slice("compact")) {
         method = &Benchmark::Compact;
       } else if (name == Slice("crc32c")) {
@@ -696,6 +992,8 @@ class Benchmark {
         PrintStats("dLSM.stats");
       } else if (name == Slice("sstables")) {
         PrintStats("dLSM.sstables");
+      } else if (name == Slice("rdmastats")) {
+        PrintStats("dLSM.rdma");
       } else {
         if (!name.empty()) {  // No error message for empty name
           std::fprintf(stderr, "unknown benchmark '%s'\n",
@@ -757,8 +1055,18 @@ class Benchmark {
     }
     printf("Threads start to run\n");
     thread->stats.Start();
+    if (FLAGS_open_loop_rate > 0) {
+      thread->schedule.reset(new OpenLoopSchedule(
+          FLAGS_open_loop_rate / shared->total, 2000 + thread->tid));
+    }
     (arg->bm->*(arg->method))(thread);
     thread->stats.Stop();
+    if (thread->schedule != nullptr) {
+      char msg[100];
+      std::snprintf(msg, sizeof(msg), "(max %.0f micros behind schedule)",
+                    thread->schedule->late());
+      thread->stats.AddMessage(msg);
+    }
 
     {
       MutexLock l(&shared->mu);
@@ -846,6 +1154,17 @@ class Benchmark {
       Validation_Read();
   }
 
+  // The start of the next operation of "thread", its intended start in the
+  // open loop once it is due.
+  static uint64_t StartOp(ThreadState* thread) {
+    if (thread->schedule == nullptr) {
+      return g_env->NowMicros();
+    }
+    const double start = thread->schedule->Wait();
+    thread->stats.StartOp(start);
+    return static_cast<uint64_t>(start);
+  }
+
   void Crc32c(ThreadState* thread) {
     // Checksum about 500MB of data total
     const int size = 4096;
@@ -919,14 +1238,32 @@ class Benchmark {
     options.create_if_missing = !FLAGS_use_existing_db;
     options.block_cache = cache_;
     options.write_buffer_size = FLAGS_write_buffer_size;
+    options.merge_immutables = FLAGS_merge_immutables;
+    options.offload_flush = FLAGS_offload_flush;
     options.max_file_size = FLAGS_max_file_size;
     options.block_size = FLAGS_block_size;
     options.bloom_bits = FLAGS_bloom_bits;
+    options.adaptive_bloom_bits = FLAGS_adaptive_bloom_bits;
+    options.read_compaction_sample = FLAGS_read_compaction_sample;
+    options.dynamic_level_bytes = FLAGS_dynamic_level_bytes;
+    options.memtable_rep = static_cast<MemTableRep>(FLAGS_memtable_rep);
+    options.memtable_numa_partitions = FLAGS_memtable_numa_partitions;
     options.block_restart_interval = FLAGS_block_restart_interval;
+    options.index_interval = FLAGS_index_interval;
+    options.index_key_separators = FLAGS_index_key_separators;
+    options.index_restart_interval = FLAGS_index_restart_interval;
+    options.min_blob_size = FLAGS_min_blob_size;
+#ifdef BYTEADDRESSABLE
+    if (FLAGS_compression_start_level >= 0) {
+      options.compression = kSnappyCompression;
+      options.compression_start_level = FLAGS_compression_start_level;
+    }
+#endif
     if (FLAGS_comparisons) {
       options.comparator = &count_comparator_;
     }
     options.max_open_files = FLAGS_open_files;
+    options.clock_cache = FLAGS_clock_cache;
     options.filter_policy = filter_policy_;
     options.reuse_logs = FLAGS_reuse_logs;
     //
@@ -987,6 +1324,14 @@ class Benchmark {
       std::fprintf(stderr, "open error: %s\n", s.ToString().c_str());
       std::exit(1);
     }
+    if (FLAGS_trace_output != nullptr) {
+      // Ended when the DB is deleted.
+      s = db_->StartTrace(FLAGS_trace_output);
+      if (!s.ok()) {
+        std::fprintf(stderr, "trace error: %s\n", s.ToString().c_str());
+        std::exit(1);
+      }
+    }
   }
 
   void OpenBench(ThreadState* thread) {
@@ -1068,6 +1413,7 @@ class Benchmark {
         //The key range should be adjustable.
 //        const int k = seq ? i + j : thread->rand.Uniform(FLAGS_num*FLAGS_threads);
         const int k = seq ? i + j : thread->rand.Next()%(FLAGS_num*FLAGS_threads);
+        StartOp(thread);
 
 //        key.Set(k);
         GenerateKeyFromInt(k, &key);
@@ -1107,6 +1453,7 @@ class Benchmark {
         //The key range should be adjustable.
         //        const int k = seq ? i + j : thread->rand.Uniform(FLAGS_num*FLAGS_threads);
         const int k = seq ? i + j : thread->rand.Next()%(number_of_key_per_compute);
+        StartOp(thread);
 
         //        key.Set(k);
         GenerateKeyFromInt(
@@ -1144,7 +1491,12 @@ class Benchmark {
   }
 
   void ReadReverse(ThreadState* thread) {
+#ifdef BYTEADDRESSABLE
+    Iterator* iter = db_->NewSEQIterator(ReadOptions());
+#endif
+#ifndef BYTEADDRESSABLE
     Iterator* iter = db_->NewIterator(ReadOptions());
+#endif
     int i = 0;
     int64_t bytes = 0;
     for (iter->SeekToLast(); i < reads_ && iter->Valid(); iter->Prev()) {
@@ -1156,8 +1508,20 @@ class Benchmark {
     thread->stats.AddBytes(bytes);
   }
 
+  // Print the PerfContext of the Get() of "key" if it was slow.
+  static void MaybeReportSlowGet(const Slice& key) {
+    const PerfContext* perf = GetPerfContext();
+    if (FLAGS_slow_get_micros > 0 &&
+        perf->get_nanos >=
+            static_cast<uint64_t>(FLAGS_slow_get_micros) * 1000) {
+      std::fprintf(stderr, "slow get of %s: %s\n", EscapeString(key).c_str(),
+                   perf->ToString().c_str());
+    }
+  }
+
   void ReadRandom(ThreadState* thread) {
     ReadOptions options;
+    options.perf_context = FLAGS_slow_get_micros > 0;
     //TODO(ruihong): specify the table_cache option.
     std::string value;
     int found = 0;
@@ -1170,12 +1534,14 @@ class Benchmark {
 //
 //            key.Set(k);
       GenerateKeyFromInt(k, &key);
+      StartOp(thread);
 //      if (db_->Get(options, key.slice(), &value).ok()) {
 //        found++;
 //      }
       if (db_->Get(options, key, &value).ok()) {
         found++;
       }
+      MaybeReportSlowGet(key);
       thread->stats.FinishedSingleOp();
     }
     char msg[100];
@@ -1184,6 +1550,7 @@ class Benchmark {
   }
   void ReadRandom_Sharded(ThreadState* thread) {
     ReadOptions options;
+    options.perf_context = FLAGS_slow_get_micros > 0;
     //TODO(ruihong): specify the cache option.
     std::string value;
     int found = 0;
@@ -1199,12 +1566,14 @@ class Benchmark {
       //            key.Set(k);
       GenerateKeyFromInt(k + shard_number_among_computes * number_of_key_per_compute,
                          &key);
+      StartOp(thread);
       //      if (db_->Get(options, key.slice(), &value).ok()) {
       //        found++;
       //      }
       if (db_->Get(options, key, &value).ok()) {
         found++;
       }
+      MaybeReportSlowGet(key);
       thread->stats.FinishedSingleOp();
     }
     char msg[100];
@@ -1232,6 +1601,7 @@ class Benchmark {
     while (!duration.Done(1)) {
 //      DB* db = SelectDB(thread);
 GenerateKeyFromInt(thread->rand.Next() % (FLAGS_num * FLAGS_threads), &key);
+      StartOp(thread);
       if (get_weight == 0 && put_weight == 0) {
         // one batch completed, reinitialize for next batch
         get_weight = FLAGS_readwritepercent;
@@ -1397,6 +1767,273 @@ GenerateKeyFromInt(thread->rand.Next() % (FLAGS_num * FLAGS_threads), &key);
     }
   }
 
+  // Set ycsb_ to the YCSB workload "workload", 'a' to 'f', with the mix and
+  // distribution flags applied. False if the flags are invalid.
+  bool SetYCSBWorkload(char workload) {
+    static const int kMixes[6][kNumOpTypes] = {
+        {50, 50, 0, 0, 0}, {95, 5, 0, 0, 0}, {100, 0, 0, 0, 0},
+        {95, 0, 5, 0, 0},  {0, 0, 5, 95, 0}, {50, 0, 0, 0, 50}};
+    const int index = workload - 'a';
+    std::copy(kMixes[index], kMixes[index] + kNumOpTypes, ycsb_.mix);
+    ycsb_.distribution = workload == 'd' ? YCSBWorkload::kLatest
+                                         : YCSBWorkload::kZipfian;
+    if (FLAGS_ycsb_mix != nullptr) {
+      int* m = ycsb_.mix;
+      char junk;
+      if (sscanf(FLAGS_ycsb_mix, "%d,%d,%d,%d,%d%c", &m[0], &m[1], &m[2],
+                 &m[3], &m[4], &junk) != 5 ||
+          m[0] + m[1] + m[2] + m[3] + m[4] != 100) {
+        std::fprintf(stderr, "invalid --ycsb_mix '%s'\n", FLAGS_ycsb_mix);
+        return false;
+      }
+    }
+    if (FLAGS_ycsb_distribution != nullptr) {
+      const Slice distribution(FLAGS_ycsb_distribution);
+      if (distribution == Slice("uniform")) {
+        ycsb_.distribution = YCSBWorkload::kUniform;
+      } else if (distribution == Slice("zipfian")) {
+        ycsb_.distribution = YCSBWorkload::kZipfian;
+      } else if (distribution == Slice("latest")) {
+        ycsb_.distribution = YCSBWorkload::kLatest;
+      } else {
+        std::fprintf(stderr, "invalid --ycsb_distribution '%s'\n",
+                     FLAGS_ycsb_distribution);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // The size of the next value a YCSB workload writes.
+  int YCSBValueSize(ThreadState* thread, ZipfianGenerator* sizes) {
+    const uint64_t range = FLAGS_value_size_max - FLAGS_value_size_min + 1;
+    const Slice distribution(FLAGS_value_size_distribution);
+    if (distribution == Slice("uniform")) {
+      return FLAGS_value_size_min + thread->rand.Uniform(range);
+    } else if (distribution == Slice("zipfian")) {
+      return FLAGS_value_size_min + sizes->Next(&thread->rand, range);
+    }
+    return value_size_;
+  }
+
+  // Each thread writes num_ records, so that the records are
+  // [0, FLAGS_num * FLAGS_threads).
+  void YCSBLoad(ThreadState* thread) {
+    RandomGenerator gen;
+    ZipfianGenerator sizes(
+        FLAGS_value_size_max - FLAGS_value_size_min + 1, FLAGS_ycsb_theta);
+    std::unique_ptr<const char[]> key_guard;
+    Slice key = AllocateKey(&key_guard);
+    int64_t bytes = 0;
+    if (thread->tid == 0) {
+      ycsb_records_.store(static_cast<uint64_t>(FLAGS_num) * FLAGS_threads);
+    }
+    for (int i = 0; i < num_; i++) {
+      GenerateKeyFromInt(static_cast<uint64_t>(thread->tid) * num_ + i, &key);
+      const int value_size = YCSBValueSize(thread, &sizes);
+      const uint64_t start = StartOp(thread);
+      Status s = db_->Put(write_options_, key, gen.Generate(value_size));
+      if (!s.ok()) {
+        std::fprintf(stderr, "put error: %s\n", s.ToString().c_str());
+        std::exit(1);
+      }
+      thread->stats.FinishedOp(kInsert, g_env->NowMicros() - start);
+      bytes += value_size + key.size();
+    }
+    thread->stats.AddBytes(bytes);
+  }
+
+  // Runs the operations of ycsb_ until reads_ of them are done, or for
+  // --duration seconds.
+  void YCSB(ThreadState* thread) {
+    ReadOptions options;
+    RandomGenerator gen;
+    std::string value;
+    const uint64_t loaded = ycsb_records_.load();
+    ZipfianGenerator keys(loaded, FLAGS_ycsb_theta);
+    ZipfianGenerator sizes(
+        FLAGS_value_size_max - FLAGS_value_size_min + 1, FLAGS_ycsb_theta);
+    std::unique_ptr<const char[]> key_guard;
+    Slice key = AllocateKey(&key_guard);
+    int64_t found = 0;
+    int64_t bytes = 0;
+    Duration duration(FLAGS_duration, reads_);
+    while (!duration.Done(1)) {
+      int pick = static_cast<int>(thread->rand.Uniform(100));
+      int type = 0;
+      while (pick >= ycsb_.mix[type]) {
+        pick -= ycsb_.mix[type];
+        type++;
+      }
+      uint64_t k;
+      if (type == kInsert) {
+        k = ycsb_records_.fetch_add(1);
+      } else {
+        const uint64_t records = ycsb_records_.load();
+        switch (ycsb_.distribution) {
+          case YCSBWorkload::kUniform:
+            k = thread->rand.Uniform(records);
+            break;
+          case YCSBWorkload::kLatest:
+            k = records - 1 - keys.Next(&thread->rand, records);
+            break;
+          default:
+            // Scramble the ranks so that the popular records are spread
+            // over the key space rather than clustered at its start.
+            k = FNVHash64(keys.Next(&thread->rand, records)) % records;
+            break;
+        }
+      }
+      GenerateKeyFromInt(k, &key);
+      const uint64_t start = StartOp(thread);
+      Status s;
+      switch (type) {
+        case kRead:
+          s = db_->Get(options, key, &value);
+          break;
+        case kReadModifyWrite:
+          s = db_->Get(options, key, &value);
+          if (!s.ok() && !s.IsNotFound()) break;
+          // Fall through to write the record back.
+          [[fallthrough]];
+        case kUpdate:
+        case kInsert: {
+          const int value_size = YCSBValueSize(thread, &sizes);
+          s = db_->Put(write_options_, key, gen.Generate(value_size));
+          bytes += value_size + key.size();
+          break;
+        }
+        case kScan: {
+          const int length =
+              1 + thread->rand.Uniform(FLAGS_ycsb_max_scan_length);
+          Iterator* iter = db_->NewIterator(options);
+          iter->Seek(key);
+          for (int i = 0; i < length && iter->Valid(); i++) {
+            bytes += iter->key().size() + iter->value().size();
+            iter->Next();
+          }
+          s = iter->status();
+          delete iter;
+          break;
+        }
+      }
+      if (!s.ok() && !s.IsNotFound()) {
+        std::fprintf(stderr, "%s error: %s\n", kOpTypeNames[type],
+                     s.ToString().c_str());
+        std::exit(1);
+      }
+      if (type == kRead && s.ok()) {
+        found++;
+      }
+      thread->stats.FinishedOp(static_cast<OpType>(type),
+                               g_env->NowMicros() - start);
+    }
+    char msg[100];
+    std::snprintf(msg, sizeof(msg), "(%" PRId64 " reads found)", found);
+    thread->stats.AddMessage(msg);
+    thread->stats.AddBytes(bytes);
+  }
+
+  bool LoadTrace() {
+    if (FLAGS_trace_file == nullptr) {
+      std::fprintf(stderr, "replay needs --trace_file\n");
+      return false;
+    }
+    Status s = ReadTrace(g_env, FLAGS_trace_file, &trace_);
+    if (!s.ok()) {
+      std::fprintf(stderr, "trace error: %s\n", s.ToString().c_str());
+      return false;
+    }
+    replay_start_.store(0);
+    return true;
+  }
+
+  // Replays the records of trace_ with the thread id modulo the threads as
+  // index. The writes put random values of the recorded sizes, the deletes
+  // count as updates.
+  void Replay(ThreadState* thread) {
+    ReadOptions options;
+    RandomGenerator gen;
+    std::string value;
+    uint64_t expected = 0;
+    replay_start_.compare_exchange_strong(expected, g_env->NowMicros());
+    const double replay_start = replay_start_.load();
+    int64_t found = 0;
+    int64_t bytes = 0;
+    for (size_t i = thread->tid; i < trace_.size(); i += thread->shared->total) {
+      const TraceRecord& record = trace_[i];
+      uint64_t start;
+      if (FLAGS_trace_replay_speed > 0) {
+        const double intended =
+            replay_start + record.micros / FLAGS_trace_replay_speed;
+        double now = g_env->NowMicros();
+        if (intended - now > 200) {
+          g_env->SleepForMicroseconds(static_cast<int>(intended - now - 100));
+        }
+        while (g_env->NowMicros() < intended) {
+        }
+        // The latency counts from the recorded time, as with the open loop.
+        thread->stats.StartOp(intended);
+        start = static_cast<uint64_t>(intended);
+      } else {
+        start = g_env->NowMicros();
+      }
+      OpType type;
+      Status s;
+      switch (record.type) {
+        case kTraceGet:
+          type = kRead;
+          s = db_->Get(options, record.key, &value);
+          if (s.ok()) {
+            found++;
+          }
+          break;
+        case kTracePut:
+          type = kUpdate;
+          s = db_->Put(write_options_, record.key,
+                       gen.Generate(record.value_size));
+          bytes += record.key.size() + record.value_size;
+          break;
+        case kTraceMerge:
+          type = kUpdate;
+          s = db_->Merge(write_options_, record.key,
+                         gen.Generate(record.value_size));
+          bytes += record.key.size() + record.value_size;
+          break;
+        case kTraceDelete:
+          type = kUpdate;
+          s = db_->Delete(write_options_, record.key);
+          break;
+        case kTraceSeek: {
+          type = kScan;
+          Iterator* iter = db_->NewIterator(options);
+          iter->Seek(record.key);
+          for (uint32_t n = 0; n < record.value_size && iter->Valid(); n++) {
+            bytes += iter->key().size() + iter->value().size();
+            iter->Next();
+          }
+          s = iter->status();
+          delete iter;
+          break;
+        }
+        default:
+          std::fprintf(stderr, "corrupt trace record of type %d\n",
+                       static_cast<int>(record.type));
+          std::exit(1);
+      }
+      if (!s.ok() && !s.IsNotFound()) {
+        std::fprintf(stderr, "%s error: %s\n", kOpTypeNames[type],
+                     s.ToString().c_str());
+        std::exit(1);
+      }
+      thread->stats.FinishedOp(type, g_env->NowMicros() - start);
+    }
+    char msg[100];
+    std::snprintf(msg, sizeof(msg), "(%" PRId64 " reads found)", found);
+    thread->stats.AddMessage(msg);
+    thread->stats.AddBytes(bytes);
+  }
+
   void Compact(ThreadState* thread) { db_->CompactRange(nullptr, nullptr); }
 
   void PrintStats(const char* key) {
@@ -1473,6 +2110,12 @@ int main(int argc, char** argv) {
       FLAGS_key_size = n;
     } else if (sscanf(argv[i], "--write_buffer_size=%d%c", &n, &junk) == 1) {
       FLAGS_write_buffer_size = n;
+    } else if (sscanf(argv[i], "--merge_immutables=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_merge_immutables = n;
+    } else if (sscanf(argv[i], "--offload_flush=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_offload_flush = n;
     } else if (sscanf(argv[i], "--max_file_size=%d%c", &n, &junk) == 1) {
       FLAGS_max_file_size = n;
     } else if (sscanf(argv[i], "--block_size=%d%c", &n, &junk) == 1) {
@@ -1483,16 +2126,79 @@ int main(int argc, char** argv) {
       FLAGS_cache_size = n;
     } else if (sscanf(argv[i], "--bloom_bits=%d%c", &n, &junk) == 1) {
       FLAGS_bloom_bits = n;
+    } else if (sscanf(argv[i], "--adaptive_bloom_bits=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_adaptive_bloom_bits = n;
+    } else if (sscanf(argv[i], "--read_compaction_sample=%d%c", &n, &junk) ==
+                   1 &&
+               n >= 0) {
+      FLAGS_read_compaction_sample = n;
+    } else if (sscanf(argv[i], "--dynamic_level_bytes=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_dynamic_level_bytes = n;
+    } else if (sscanf(argv[i], "--memtable_rep=%d%c", &n, &junk) == 1 &&
+               n >= 0 && n <= 2) {
+      FLAGS_memtable_rep = n;
+    } else if (sscanf(argv[i], "--memtable_numa_partitions=%d%c", &n,
+                      &junk) == 1 &&
+               n >= 1) {
+      FLAGS_memtable_numa_partitions = n;
+    } else if (sscanf(argv[i], "--clock_cache=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_clock_cache = n;
     } else if (sscanf(argv[i], "--open_files=%d%c", &n, &junk) == 1) {
       FLAGS_open_files = n;
     } else if (sscanf(argv[i], "--numa_awared=%d%c", &n, &junk) == 1) {
       FLAGS_enable_numa = n;
     } else if (sscanf(argv[i], "--block_restart_interval=%d%c", &n, &junk) == 1) {
       FLAGS_block_restart_interval = n;
+    } else if (sscanf(argv[i], "--index_interval=%d%c", &n, &junk) == 1) {
+      FLAGS_index_interval = n;
+    } else if (sscanf(argv[i], "--index_key_separators=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_index_key_separators = n;
+    } else if (sscanf(argv[i], "--index_restart_interval=%d%c", &n, &junk) == 1) {
+      FLAGS_index_restart_interval = n;
+    } else if (sscanf(argv[i], "--compression_start_level=%d%c", &n, &junk) == 1) {
+      FLAGS_compression_start_level = n;
+    } else if (sscanf(argv[i], "--min_blob_size=%d%c", &n, &junk) == 1) {
+      FLAGS_min_blob_size = n;
     } else if (sscanf(argv[i], "--readwritepercent=%d%c", &n, &junk) == 1) {
       FLAGS_readwritepercent = n;
     } else if (sscanf(argv[i], "--duration=%d%c", &n, &junk) == 1) {
       FLAGS_duration = n;
+    } else if (sscanf(argv[i], "--ycsb_theta=%lf%c", &d, &junk) == 1 &&
+               d > 0 && d < 1) {
+      FLAGS_ycsb_theta = d;
+    } else if (sscanf(argv[i], "--open_loop_rate=%lf%c", &d, &junk) == 1) {
+      FLAGS_open_loop_rate = d;
+    } else if (sscanf(argv[i], "--poisson=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_poisson = n;
+    } else if (strncmp(argv[i], "--ycsb_distribution=", 20) == 0) {
+      FLAGS_ycsb_distribution = argv[i] + 20;
+    } else if (strncmp(argv[i], "--ycsb_mix=", 11) == 0) {
+      FLAGS_ycsb_mix = argv[i] + 11;
+    } else if (sscanf(argv[i], "--ycsb_max_scan_length=%d%c", &n, &junk) == 1 &&
+               n > 0) {
+      FLAGS_ycsb_max_scan_length = n;
+    } else if (strncmp(argv[i], "--value_size_distribution=", 26) == 0) {
+      FLAGS_value_size_distribution = argv[i] + 26;
+    } else if (sscanf(argv[i], "--value_size_min=%d%c", &n, &junk) == 1) {
+      FLAGS_value_size_min = n;
+    } else if (sscanf(argv[i], "--value_size_max=%d%c", &n, &junk) == 1) {
+      FLAGS_value_size_max = n;
+    } else if (strncmp(argv[i], "--trace_output=", 15) == 0) {
+      FLAGS_trace_output = argv[i] + 15;
+    } else if (strncmp(argv[i], "--trace_file=", 13) == 0) {
+      FLAGS_trace_file = argv[i] + 13;
+    } else if (sscanf(argv[i], "--trace_replay_speed=%lf%c", &d, &junk) == 1 &&
+               d >= 0) {
+      FLAGS_trace_replay_speed = d;
+    } else if (sscanf(argv[i], "--slow_get_micros=%d%c", &n, &junk) == 1) {
+      FLAGS_slow_get_micros = n;
+    } else if (strncmp(argv[i], "--timeline_output=", 18) == 0) {
+      FLAGS_timeline_output = argv[i] + 18;
     } else if (strncmp(argv[i], "--db=", 5) == 0) {
       FLAGS_db = argv[i] + 5;
     } else {
@@ -1514,6 +2220,9 @@ int main(int argc, char** argv) {
     FLAGS_db = default_db_path.c_str();
   }
 
+  if (FLAGS_timeline_output != nullptr) {
+    dLSM::Timeline::Start(1 << 16);
+  }
   dLSM::Benchmark benchmark;
   benchmark.Run();
   return 0;
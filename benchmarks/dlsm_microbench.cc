@@ -0,0 +1,296 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+// Microbenchmarks of the components on the hot paths of the Gets and of the
+// compactions. None of them needs an RDMA device or a memory node.
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "db/inlineskiplist.h"
+#include "table/full_filter_block.h"
+#include "table/merger.h"
+#include "util/ThreadPool.h"
+#include "util/coding.h"
+#include "util/concurrent_arena.h"
+#include "util/crc32c.h"
+#include "util/random.h"
+#include "util/rdma.h"
+
+#include "dLSM/comparator.h"
+#include "dLSM/iterator.h"
+
+namespace dLSM {
+
+namespace {
+
+// Orders the 8 byte big-endian keys of the skiplist benchmarks.
+struct FixedKeyComparator {
+  typedef Slice DecodedType;
+
+  DecodedType decode_key(const char* key) const { return Slice(key, 8); }
+  uint64_t key_prefix(const DecodedType& key) const {
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < 8; i++) {
+      prefix = (prefix << 8) | static_cast<uint8_t>(key[i]);
+    }
+    return prefix;
+  }
+  int operator()(const char* a, const char* b) const {
+    return std::memcmp(a, b, 8);
+  }
+  int operator()(const char* a, const DecodedType& b) const {
+    return std::memcmp(a, b.data(), 8);
+  }
+};
+
+typedef InlineSkipList<FixedKeyComparator> TestSkipList;
+
+void EncodeKey(uint64_t v, char* dst) {
+  for (int i = 7; i >= 0; i--) {
+    dst[i] = static_cast<char>(v & 0xff);
+    v >>= 8;
+  }
+}
+
+void FillSkipList(TestSkipList* list, int n, Random64* rand) {
+  for (int i = 0; i < n; i++) {
+    char* key = list->AllocateKey(8);
+    EncodeKey(rand->Next(), key);
+    list->Insert(key);
+  }
+}
+
+// An iterator over sorted keys held in a vector.
+class VectorIterator : public Iterator {
+ public:
+  explicit VectorIterator(const std::vector<std::string>* keys)
+      : keys_(keys), pos_(keys->size()) {}
+
+  bool Valid() const override { return pos_ < keys_->size(); }
+  void SeekToFirst() override { pos_ = 0; }
+  void SeekToLast() override {
+    pos_ = keys_->empty() ? keys_->size() : keys_->size() - 1;
+  }
+  void Seek(const Slice& target) override {
+    pos_ = std::lower_bound(keys_->begin(), keys_->end(), target.ToString()) -
+           keys_->begin();
+  }
+  void Next() override { pos_++; }
+  void Prev() override { pos_ = pos_ == 0 ? keys_->size() : pos_ - 1; }
+  Slice key() const override { return (*keys_)[pos_]; }
+  Slice value() const override { return Slice(); }
+  Status status() const override { return Status::OK(); }
+
+ private:
+  const std::vector<std::string>* keys_;
+  size_t pos_;
+};
+
+}  // namespace
+
+static void BM_SkipListInsert(benchmark::State& state) {
+  Random64 rand(301);
+  for (auto _ : state) {
+    state.PauseTiming();
+    ConcurrentArena arena;
+    TestSkipList list(FixedKeyComparator(), &arena);
+    state.ResumeTiming();
+    FillSkipList(&list, static_cast<int>(state.range(0)), &rand);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SkipListInsert)->Arg(1 << 10)->Arg(1 << 16);
+
+static void BM_SkipListConcurrentInsert(benchmark::State& state) {
+  static ConcurrentArena* arena;
+  static TestSkipList* list;
+  if (state.thread_index == 0) {
+    arena = new ConcurrentArena();
+    list = new TestSkipList(FixedKeyComparator(), arena);
+  }
+  Random64 rand(301 + state.thread_index);
+  for (auto _ : state) {
+    char* key = list->AllocateKey(8);
+    EncodeKey(rand.Next(), key);
+    list->InsertConcurrently(key);
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index == 0) {
+    delete list;
+    delete arena;
+  }
+}
+BENCHMARK(BM_SkipListConcurrentInsert)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_SkipListLookup(benchmark::State& state) {
+  ConcurrentArena arena;
+  TestSkipList list(FixedKeyComparator(), &arena);
+  Random64 rand(301);
+  FillSkipList(&list, static_cast<int>(state.range(0)), &rand);
+  char key[8];
+  for (auto _ : state) {
+    EncodeKey(rand.Next(), key);
+    TestSkipList::Iterator iter(&list);
+    iter.Seek(key);
+    benchmark::DoNotOptimize(iter.Valid());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SkipListLookup)->Arg(1 << 10)->Arg(1 << 20);
+
+static void BM_ConcurrentArenaAllocate(benchmark::State& state) {
+  static ConcurrentArena* arena;
+  if (state.thread_index == 0) {
+    arena = new ConcurrentArena();
+  }
+  const size_t bytes = static_cast<size_t>(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(arena->AllocateAligned(bytes));
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index == 0) {
+    delete arena;
+  }
+}
+BENCHMARK(BM_ConcurrentArenaAllocate)
+    ->Arg(64)
+    ->Arg(512)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+static void BM_FilterKeyMayMatch(benchmark::State& state) {
+  const int num_keys = static_cast<int>(state.range(0));
+  std::vector<char> buffer(num_keys * 2 + 4096);
+  ibv_mr mr;
+  std::memset(&mr, 0, sizeof(mr));
+  mr.addr = buffer.data();
+  mr.length = buffer.size();
+  FullFilterBlockBuilder builder(&mr, 10);
+  char key[8];
+  for (int i = 0; i < num_keys; i++) {
+    EncodeKey(i, key);
+    builder.AddKey(Slice(key, 8));
+  }
+  builder.Finish();
+  FullFilterBlockReader reader(builder.result, nullptr, Memory);
+  Random64 rand(301);
+  int matches = 0;
+  for (auto _ : state) {
+    // Half of the keys are in the filter.
+    EncodeKey(rand.Uniform(2 * num_keys), key);
+    matches += reader.KeyMayMatch(Slice(key, 8));
+  }
+  benchmark::DoNotOptimize(matches);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FilterKeyMayMatch)->Arg(1 << 12)->Arg(1 << 20);
+
+static void BM_InUseArray(benchmark::State& state) {
+  static In_Use_Array* slots;
+  if (state.thread_index == 0) {
+    slots = new In_Use_Array(1 << 16, 4096, nullptr);
+  }
+  for (auto _ : state) {
+    int index = slots->allocate_memory_slot();
+    if (index >= 0) {
+      slots->deallocate_memory_slot(index);
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index == 0) {
+    delete slots;
+  }
+}
+BENCHMARK(BM_InUseArray)->ThreadRange(1, 16)->UseRealTime();
+
+static void BM_ThreadPoolSchedule(benchmark::State& state) {
+  ThreadPool pool;
+  pool.SetBackgroundThreads(static_cast<int>(state.range(0)));
+  pool.StartBGThreads();
+  std::atomic<int64_t> done(0);
+  int64_t scheduled = 0;
+  for (auto _ : state) {
+    pool.Schedule([&done](void*) { done.fetch_add(1); }, nullptr);
+    scheduled++;
+  }
+  while (done.load() < scheduled) {
+  }
+  pool.JoinThreads(true);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ThreadPoolSchedule)->Arg(1)->Arg(4)->UseRealTime();
+
+static void BM_Varint64(benchmark::State& state) {
+  std::vector<uint64_t> values(1024);
+  Random64 rand(301);
+  for (uint64_t& v : values) {
+    v = rand.Next() >> rand.Uniform(64);
+  }
+  std::string encoded;
+  for (auto _ : state) {
+    encoded.clear();
+    for (uint64_t v : values) {
+      PutVarint64(&encoded, v);
+    }
+    const char* p = encoded.data();
+    const char* limit = p + encoded.size();
+    uint64_t sum = 0;
+    while (p < limit) {
+      uint64_t v;
+      p = GetVarint64Ptr(p, limit, &v);
+      sum += v;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+}
+BENCHMARK(BM_Varint64);
+
+static void BM_Crc32c(benchmark::State& state) {
+  std::string data(static_cast<size_t>(state.range(0)), 'x');
+  uint32_t crc = 0;
+  for (auto _ : state) {
+    crc = crc32c::Extend(crc, data.data(), data.size());
+  }
+  benchmark::DoNotOptimize(crc);
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Crc32c)->Arg(64)->Arg(4096)->Arg(1 << 20);
+
+static void BM_MergingIterator(benchmark::State& state) {
+  const int n = static_cast<int>(state.range(0));
+  std::vector<std::vector<std::string>> runs(n);
+  Random64 rand(301);
+  char key[8];
+  for (auto& run : runs) {
+    for (int i = 0; i < 10000; i++) {
+      EncodeKey(rand.Next(), key);
+      run.emplace_back(key, 8);
+    }
+    std::sort(run.begin(), run.end());
+  }
+  int64_t keys = 0;
+  for (auto _ : state) {
+    std::vector<Iterator*> children;
+    for (auto& run : runs) {
+      children.push_back(new VectorIterator(&run));
+    }
+    Iterator* iter =
+        NewMergingIterator(BytewiseComparator(), children.data(), n);
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+      keys++;
+    }
+    delete iter;
+  }
+  state.SetItemsProcessed(keys);
+}
+BENCHMARK(BM_MergingIterator)->Arg(2)->Arg(8)->Arg(32);
+
+}  // namespace dLSM
+
+BENCHMARK_MAIN();
@@ -0,0 +1,29 @@
+# - Find mlx5
+# Find the mlx5 direct verbs library and includes
+#
+# MLX5_INCLUDE_DIRS - where to find infiniband/mlx5dv.h, etc.
+# MLX5_LIBRARIES - List of libraries when using mlx5.
+# MLX5_FOUND - True if mlx5 found.
+
+find_path(MLX5_INCLUDE_DIRS
+  NAMES infiniband/mlx5dv.h
+  HINTS ${MLX5_ROOT_DIR}/include)
+
+find_library(MLX5_LIBRARIES
+  NAMES mlx5
+  HINTS ${MLX5_ROOT_DIR}/lib)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(mlx5 DEFAULT_MSG MLX5_LIBRARIES MLX5_INCLUDE_DIRS)
+
+mark_as_advanced(
+  MLX5_LIBRARIES
+  MLX5_INCLUDE_DIRS)
+
+if(MLX5_FOUND AND NOT (TARGET mlx5::mlx5))
+  add_library (mlx5::mlx5 UNKNOWN IMPORTED)
+  set_target_properties(mlx5::mlx5
+    PROPERTIES
+      IMPORTED_LOCATION ${MLX5_LIBRARIES}
+      INTERFACE_INCLUDE_DIRECTORIES ${MLX5_INCLUDE_DIRS})
+endif()
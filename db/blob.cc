@@ -0,0 +1,278 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/blob.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#include "util/coding.h"
+
+namespace dLSM {
+
+namespace {
+
+// The pieces read with one chained read at most.
+const size_t kBlobReadBatch = 8;
+// The bytes of a table record besides its key and value, with some room.
+const size_t kRecordOverhead = 64;
+
+}  // namespace
+
+uint64_t BlobIndex::size() const {
+  uint64_t total = 0;
+  for (const Piece& piece : pieces) {
+    total += piece.size;
+  }
+  return total;
+}
+
+// A value in one chunk keeps the encoding it had before the values could
+// span chunks: the node, then the chunk, rkey, offset and size of every
+// piece.
+void BlobIndex::EncodeTo(std::string* dst) const {
+  dst->push_back(static_cast<char>(node_id));
+  for (const Piece& piece : pieces) {
+    PutFixed64(dst, piece.chunk);
+    PutFixed32(dst, piece.rkey);
+    PutVarint32(dst, piece.offset);
+    PutVarint32(dst, piece.size);
+  }
+}
+
+bool BlobIndex::DecodeFrom(const Slice& src) {
+  Slice input = src;
+  if (input.empty()) {
+    return false;
+  }
+  node_id = static_cast<uint8_t>(input[0]);
+  input.remove_prefix(1);
+  pieces.clear();
+  while (!input.empty()) {
+    if (input.size() < 12) {
+      return false;
+    }
+    Piece piece;
+    piece.chunk = DecodeFixed64(input.data());
+    piece.rkey = DecodeFixed32(input.data() + 8);
+    input.remove_prefix(12);
+    if (!GetVarint32(&input, &piece.offset) ||
+        !GetVarint32(&input, &piece.size)) {
+      return false;
+    }
+    pieces.push_back(piece);
+  }
+  return !pieces.empty();
+}
+
+void AddBlobChunks(const Slice& index, std::set<uint64_t>* chunks) {
+  BlobIndex blob;
+  if (blob.DecodeFrom(index)) {
+    for (const BlobIndex::Piece& piece : blob.pieces) {
+      chunks->insert(piece.chunk);
+    }
+  }
+}
+
+bool TooLargeForTable(RDMA_Manager* rdma_mg, const Slice& key,
+                      const Slice& value) {
+  return key.size() + value.size() + kRecordOverhead >
+         rdma_mg->name_to_chunksize.at(DataChunk);
+}
+
+Status ReadBlob(RDMA_Manager* rdma_mg, const Slice& index,
+                std::string* value) {
+  value->clear();
+  return ReadBlob(rdma_mg, index, [value](const Slice& piece) {
+    value->append(piece.data(), piece.size());
+  });
+}
+
+Status ReadBlob(RDMA_Manager* rdma_mg, const Slice& index,
+                const BlobCallback& callback) {
+  BlobIndex blob;
+  if (!blob.DecodeFrom(index)) {
+    return Status::Corruption("bad blob index");
+  }
+  if (rdma_mg->node_id == blob.node_id) {
+    for (const BlobIndex::Piece& piece : blob.pieces) {
+      callback(Slice(reinterpret_cast<const char*>(piece.chunk) + piece.offset,
+                     piece.size));
+    }
+    return Status::OK();
+  }
+  // Not the read buffer of the thread, the lookup may still need what it
+  // holds.
+  const size_t batch = std::min(blob.pieces.size(), kBlobReadBatch);
+  std::vector<ibv_mr> local_mrs(batch);
+  for (ibv_mr& mr : local_mrs) {
+    rdma_mg->Allocate_Iterator_Buffer(mr);
+  }
+  Status s;
+  for (size_t first = 0; s.ok() && first < blob.pieces.size();
+       first += batch) {
+    const size_t last = std::min(first + batch, blob.pieces.size());
+    std::vector<RDMA_Read_Request> requests;
+    for (size_t i = first; i < last; i++) {
+      const BlobIndex::Piece& piece = blob.pieces[i];
+      const ibv_mr& local_mr = local_mrs[i - first];
+      if (piece.size > local_mr.length) {
+        s = Status::Corruption("blob piece larger than a chunk");
+        break;
+      }
+      requests.push_back({reinterpret_cast<char*>(piece.chunk) + piece.offset,
+                          piece.rkey, local_mr.addr, local_mr.lkey,
+                          piece.size});
+    }
+    if (!s.ok()) {
+      break;
+    }
+    RDMA_Read_Future future;
+    if (rdma_mg->RDMA_Read_Batch_Async(requests, blob.node_id, &future) != 0 ||
+        future.Wait() != 0) {
+      s = Status::IOError("blob read failed");
+      break;
+    }
+    for (size_t i = first; i < last; i++) {
+      callback(Slice(static_cast<const char*>(local_mrs[i - first].addr),
+                     blob.pieces[i].size));
+    }
+  }
+  for (const ibv_mr& mr : local_mrs) {
+    rdma_mg->Release_Iterator_Buffer(mr);
+  }
+  return s;
+}
+
+BlobWriter::BlobWriter(std::shared_ptr<RDMA_Manager> rdma_mg,
+                       uint8_t target_node_id)
+    : rdma_mg_(std::move(rdma_mg)), target_node_id_(target_node_id) {}
+
+BlobWriter::~BlobWriter() {
+  if (has_local_) {
+    rdma_mg_->Deallocate_Local_RDMA_Slot(local_mr_.addr, FlushBuffer);
+  }
+  if (has_remote_) {
+    chunks_.push_back(reinterpret_cast<uint64_t>(remote_mr_.addr));
+  }
+  for (uint64_t chunk : chunks_) {
+    rdma_mg_->Deallocate_Remote_RDMA_Slot(reinterpret_cast<void*>(chunk),
+                                          target_node_id_);
+  }
+}
+
+void BlobWriter::Add(const Slice& value, std::string* index) {
+  if (!has_local_) {
+    rdma_mg_->Allocate_Local_RDMA_Slot(local_mr_, FlushBuffer);
+    has_local_ = true;
+  }
+  // A value which fits in a chunk is not split.
+  if (has_remote_ && value.size() <= Capacity() &&
+      filled_ + value.size() > Capacity()) {
+    WriteChunk();
+  }
+  BlobIndex blob;
+  blob.node_id = target_node_id_;
+  Slice rest = value;
+  do {
+    if (!has_remote_) {
+      rdma_mg_->Allocate_Remote_RDMA_Slot(remote_mr_, target_node_id_);
+      has_remote_ = true;
+      filled_ = 0;
+    }
+    const size_t n = std::min(rest.size(), Capacity() - filled_);
+    if (n > 0 || rest.empty()) {
+      memcpy(static_cast<char*>(local_mr_.addr) + filled_, rest.data(), n);
+      BlobIndex::Piece piece;
+      piece.chunk = reinterpret_cast<uint64_t>(remote_mr_.addr);
+      piece.rkey = remote_mr_.rkey;
+      piece.offset = static_cast<uint32_t>(filled_);
+      piece.size = static_cast<uint32_t>(n);
+      blob.pieces.push_back(piece);
+      filled_ += n;
+      rest.remove_prefix(n);
+    }
+    if (!rest.empty()) {
+      WriteChunk();
+    }
+  } while (!rest.empty());
+  index->clear();
+  blob.EncodeTo(index);
+}
+
+void BlobWriter::WriteChunk() {
+  if (filled_ > 0) {
+    rdma_mg_->RDMA_Write(&remote_mr_, &local_mr_, filled_,
+                         QP_WRITE_LOCAL_FLUSH, IBV_SEND_SIGNALED, 1,
+                         target_node_id_);
+  }
+  chunks_.push_back(reinterpret_cast<uint64_t>(remote_mr_.addr));
+  has_remote_ = false;
+  filled_ = 0;
+}
+
+Status BlobWriter::Finish(std::vector<uint64_t>* chunks) {
+  if (has_remote_) {
+    WriteChunk();
+  }
+  chunks->swap(chunks_);
+  chunks_.clear();
+  return Status::OK();
+}
+
+namespace {
+
+struct ChunkRefs {
+  std::mutex mu;
+  std::map<std::pair<uint8_t, uint64_t>, int> refs;
+};
+
+ChunkRefs* GetChunkRefs() {
+  static ChunkRefs* refs = new ChunkRefs();
+  return refs;
+}
+
+}  // namespace
+
+void BlobChunkRefs::Ref(uint8_t node_id, const std::vector<uint64_t>& chunks) {
+  if (chunks.empty()) {
+    return;
+  }
+  ChunkRefs* r = GetChunkRefs();
+  std::lock_guard<std::mutex> l(r->mu);
+  for (uint64_t chunk : chunks) {
+    r->refs[{node_id, chunk}]++;
+  }
+}
+
+void BlobChunkRefs::Unref(RDMA_Manager* rdma_mg, uint8_t node_id,
+                          const std::vector<uint64_t>& chunks, bool free) {
+  if (chunks.empty()) {
+    return;
+  }
+  std::vector<uint64_t> dead;
+  {
+    ChunkRefs* r = GetChunkRefs();
+    std::lock_guard<std::mutex> l(r->mu);
+    for (uint64_t chunk : chunks) {
+      auto iter = r->refs.find({node_id, chunk});
+      assert(iter != r->refs.end());
+      if (iter != r->refs.end() && --iter->second == 0) {
+        r->refs.erase(iter);
+        dead.push_back(chunk);
+      }
+    }
+  }
+  if (free) {
+    for (uint64_t chunk : dead) {
+      rdma_mg->Deallocate_Remote_RDMA_Slot(reinterpret_cast<void*>(chunk),
+                                           node_id);
+    }
+  }
+}
+
+}  // namespace dLSM
@@ -0,0 +1,118 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_BLOB_H_
+#define STORAGE_dLSM_DB_BLOB_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "dLSM/slice.h"
+#include "dLSM/status.h"
+#include "util/rdma.h"
+
+namespace dLSM {
+
+// The values of at least Options::min_blob_size bytes are moved out of the
+// tables at the flush, into chunks of remote memory holding the values one
+// after the other. The table keeps a kTypeBlobIndex entry whose value is the
+// BlobIndex of the value, so that the compactions move the small index
+// around rather than the value. A read takes one more RDMA read for it.
+//
+// A chunk is freed once no table refers to it: every table carries the
+// chunks its entries point to, see RemoteMemTableMetaData::blob_chunks, and
+// the output of a compaction carries the ones of the entries it keeps.
+//
+// A value larger than a chunk is scattered over several, it starts in the
+// chunk being filled and goes on in new ones.
+struct BlobIndex {
+  // The part of the value in one chunk.
+  struct Piece {
+    uint64_t chunk = 0;
+    uint32_t rkey = 0;
+    uint32_t offset = 0;
+    uint32_t size = 0;
+  };
+  // The memory node of the chunks.
+  uint8_t node_id = 0;
+  // The value is the pieces one after the other.
+  std::vector<Piece> pieces;
+
+  uint64_t size() const;
+  void EncodeTo(std::string* dst) const;
+  bool DecodeFrom(const Slice& src);
+};
+
+// Add the chunks the BlobIndex "index" points to to *chunks.
+void AddBlobChunks(const Slice& index, std::set<uint64_t>* chunks);
+
+// Whether the entry of "key" and "value" is too large for a data chunk of a
+// table, the value has to go to blob chunks.
+bool TooLargeForTable(RDMA_Manager* rdma_mg, const Slice& key,
+                      const Slice& value);
+
+// Read the value "index" refers to into *value. On the memory node of the
+// chunks the value is copied from the local memory.
+Status ReadBlob(RDMA_Manager* rdma_mg, const Slice& index, std::string* value);
+
+// Called with the pieces of a value in order.
+typedef std::function<void(const Slice& piece)> BlobCallback;
+
+// Same as above, but hand the value to "callback" a piece at a time rather
+// than holding all of it. The pieces of several chunks are read with one
+// chained RDMA read.
+Status ReadBlob(RDMA_Manager* rdma_mg, const Slice& index,
+                const BlobCallback& callback);
+
+// Writes the values of a flush to the remote chunks of "target_node_id",
+// a chunk at a time.
+class BlobWriter {
+ public:
+  BlobWriter(std::shared_ptr<RDMA_Manager> rdma_mg, uint8_t target_node_id);
+  ~BlobWriter();
+
+  BlobWriter(const BlobWriter&) = delete;
+  BlobWriter& operator=(const BlobWriter&) = delete;
+
+  // Add "value" and store its BlobIndex in *index.
+  void Add(const Slice& value, std::string* index);
+  // Write out the last chunk and hand the chunks over to *chunks.
+  Status Finish(std::vector<uint64_t>* chunks);
+
+ private:
+  void WriteChunk();
+  // The bytes a chunk holds.
+  size_t Capacity() const {
+    return std::min(local_mr_.length, remote_mr_.length);
+  }
+
+  std::shared_ptr<RDMA_Manager> rdma_mg_;
+  const uint8_t target_node_id_;
+  ibv_mr local_mr_;
+  bool has_local_ = false;
+  // The chunk being filled, its values are in local_mr_.
+  ibv_mr remote_mr_;
+  bool has_remote_ = false;
+  size_t filled_ = 0;
+  // Freed if not handed over.
+  std::vector<uint64_t> chunks_;
+};
+
+// The references the tables of this compute node hold on the blob chunks.
+class BlobChunkRefs {
+ public:
+  static void Ref(uint8_t node_id, const std::vector<uint64_t>& chunks);
+  // The chunks no table refers to anymore are freed through "rdma_mg",
+  // unless "free" is false: they belong to another compute node then.
+  static void Unref(RDMA_Manager* rdma_mg, uint8_t node_id,
+                    const std::vector<uint64_t>& chunks, bool free);
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_BLOB_H_
@@ -35,6 +35,7 @@ Status BuildTable(const std::string& dbname, Env* env, const Options& options,
     builder->get_datablocks_map(meta->remote_data_mrs);
     builder->get_dataindexblocks_map(meta->remote_dataindex_mrs);
     builder->get_filter_map(meta->remote_filter_mrs);
+    meta->prefix_extractor = FilterPrefixName(options);
 
 
     meta->file_size = 0;
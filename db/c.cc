@@ -6,8 +6,10 @@
 
 #include <string.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
+#include <vector>
 
 #include "dLSM/cache.h"
 #include "dLSM/comparator.h"
@@ -33,6 +35,7 @@ using dLSM::Logger;
 using dLSM::NewBloomFilterPolicy;
 using dLSM::NewLRUCache;
 using dLSM::Options;
+using dLSM::PinnableSlice;
 using dLSM::RandomAccessFile;
 using dLSM::Range;
 using dLSM::ReadOptions;
@@ -216,6 +219,78 @@ char* dLSM_get(dLSM_t* db, const dLSM_readoptions_t* options,
   return result;
 }
 
+void dLSM_write_async(dLSM_t* db, const dLSM_writeoptions_t* options,
+                      const dLSM_writebatch_t* batch, void* state,
+                      void (*callback)(void* state, const char* err)) {
+  db->rep->WriteAsync(options->rep, batch->rep,
+                      [state, callback](const Status& s) {
+                        if (s.ok()) {
+                          (*callback)(state, nullptr);
+                        } else {
+                          (*callback)(state, s.ToString().c_str());
+                        }
+                      });
+}
+
+uint8_t dLSM_get_into(dLSM_t* db, const dLSM_readoptions_t* options,
+                      const char* key, size_t keylen, char* buf, size_t buflen,
+                      size_t* vallen, char** errptr) {
+  // The value is copied straight out of the memtable or the block.
+  PinnableSlice value;
+  Status s = db->rep->Get(options->rep, Slice(key, keylen), &value);
+  if (!s.ok()) {
+    *vallen = 0;
+    if (!s.IsNotFound()) {
+      SaveError(errptr, s);
+    }
+    return 0;
+  }
+  *vallen = value.size();
+  std::memcpy(buf, value.data(), std::min(buflen, value.size()));
+  return 1;
+}
+
+void dLSM_multi_get(dLSM_t* db, const dLSM_readoptions_t* options,
+                    size_t num_keys, const char* const* keys_list,
+                    const size_t* keys_list_sizes, char** values_list,
+                    size_t* values_list_sizes, char** errs) {
+  std::vector<Slice> keys(num_keys);
+  for (size_t i = 0; i < num_keys; i++) {
+    keys[i] = Slice(keys_list[i], keys_list_sizes[i]);
+  }
+  std::vector<std::string> values(num_keys);
+  std::vector<Status> statuses = db->rep->MultiGet(options->rep, keys, &values);
+  for (size_t i = 0; i < num_keys; i++) {
+    if (statuses[i].ok()) {
+      values_list[i] = CopyString(values[i]);
+      values_list_sizes[i] = values[i].size();
+    } else {
+      values_list[i] = nullptr;
+      values_list_sizes[i] = 0;
+      if (!statuses[i].IsNotFound()) {
+        SaveError(&errs[i], statuses[i]);
+      }
+    }
+  }
+}
+
+void dLSM_prefetch(dLSM_t* db, const dLSM_readoptions_t* options,
+                   size_t num_keys, const char* const* keys_list,
+                   const size_t* keys_list_sizes) {
+  std::vector<Slice> keys(num_keys);
+  for (size_t i = 0; i < num_keys; i++) {
+    keys[i] = Slice(keys_list[i], keys_list_sizes[i]);
+  }
+  db->rep->Prefetch(options->rep, keys);
+}
+
+void dLSM_prefetch_range(dLSM_t* db, const dLSM_readoptions_t* options,
+                         const char* start_key, size_t start_len,
+                         const char* limit_key, size_t limit_len) {
+  db->rep->Prefetch(options->rep, Range(Slice(start_key, start_len),
+                                        Slice(limit_key, limit_len)));
+}
+
 dLSM_iterator_t* dLSM_create_iterator(
     dLSM_t* db, const dLSM_readoptions_t* options) {
   dLSM_iterator_t* result = new dLSM_iterator_t;
@@ -260,6 +335,21 @@ void dLSM_approximate_sizes(dLSM_t* db, int num_ranges,
   delete[] ranges;
 }
 
+void dLSM_approximate_counts(dLSM_t* db, int num_ranges,
+                             const char* const* range_start_key,
+                             const size_t* range_start_key_len,
+                             const char* const* range_limit_key,
+                             const size_t* range_limit_key_len,
+                             uint64_t* entries, uint64_t* raw_sizes) {
+  Range* ranges = new Range[num_ranges];
+  for (int i = 0; i < num_ranges; i++) {
+    ranges[i].start = Slice(range_start_key[i], range_start_key_len[i]);
+    ranges[i].limit = Slice(range_limit_key[i], range_limit_key_len[i]);
+  }
+  db->rep->GetApproximateCounts(ranges, num_ranges, entries, raw_sizes);
+  delete[] ranges;
+}
+
 void dLSM_compact_range(dLSM_t* db, const char* start_key,
                            size_t start_key_len, const char* limit_key,
                            size_t limit_key_len) {
@@ -339,6 +429,25 @@ void dLSM_writebatch_delete(dLSM_writebatch_t* b, const char* key,
   b->rep.Delete(Slice(key, klen));
 }
 
+void dLSM_writebatch_put_many(dLSM_writebatch_t* b, size_t num,
+                              const char* const* keys_list,
+                              const size_t* keys_list_sizes,
+                              const char* const* values_list,
+                              const size_t* values_list_sizes) {
+  for (size_t i = 0; i < num; i++) {
+    b->rep.Put(Slice(keys_list[i], keys_list_sizes[i]),
+               Slice(values_list[i], values_list_sizes[i]));
+  }
+}
+
+void dLSM_writebatch_delete_many(dLSM_writebatch_t* b, size_t num,
+                                 const char* const* keys_list,
+                                 const size_t* keys_list_sizes) {
+  for (size_t i = 0; i < num; i++) {
+    b->rep.Delete(Slice(keys_list[i], keys_list_sizes[i]));
+  }
+}
+
 void dLSM_writebatch_iterate(const dLSM_writebatch_t* b, void* state,
                                 void (*put)(void*, const char* k, size_t klen,
                                             const char* v, size_t vlen),
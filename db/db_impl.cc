@@ -4,60 +4,140 @@
 
 #include "db/db_impl.h"
 #include "db/db_impl_sharding.h"
+#include "db/blob.h"
 #include "db/builder.h"
 #include "db/db_iter.h"
 #include "db/dbformat.h"
+#include "db/edit_publisher.h"
 #include "db/filename.h"
 #include "db/log_reader.h"
 #include "db/log_writer.h"
 #include "db/memtable.h"
 #include "db/memtable_list.h"
+#include "db/merge_helper.h"
+#include "db/negative_lookup_cache.h"
+#include "db/parity_stripes.h"
+#include "db/remote_log.h"
+#include "db/scan_pushdown.h"
 #include "db/table_cache.h"
+#include "db/trace.h"
 #include "db/version_set.h"
 #include "db/write_batch_internal.h"
+#include "db/write_cut.h"
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
+#include <limits>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <utility>
 #include <vector>
 
+#include "dLSM/compaction_filter.h"
 #include "dLSM/db.h"
 #include "dLSM/env.h"
+#include "dLSM/merge_operator.h"
+#include "dLSM/rate_limiter.h"
+#include "dLSM/scan_filter.h"
+#include "dLSM/slice_transform.h"
 #include "dLSM/status.h"
 #include "dLSM/table.h"
 
 #include "port/port.h"
 #include "table/block.h"
+#include "table/format.h"
 #include "table/merger.h"
 #include "table/table_builder_computeside.h"
 #include "table/table_builder_bacs.h"
 #include "table/two_level_iterator.h"
 #include "util/coding.h"
+#include "util/core_local.h"
 #include "util/logging.h"
+#include "util/memory_budget.h"
 #include "util/mutexlock.h"
+#include "util/perf_context_imp.h"
+#include "util/statistics.h"
+#include "util/timeline.h"
 
 namespace dLSM {
 
 
-int SuperVersion::dummy = 0;
-void* const SuperVersion::kSVInUse = &SuperVersion::dummy;
-void* const SuperVersion::kSVObsolete = nullptr;
-void SuperVersionUnrefHandle(void* ptr) {
-  // UnrefHandle is called when a thread exists or a ThreadLocalPtr gets
-  // destroyed. When former happens, the thread shouldn't see kSVInUse.
-  // When latter happens, we are in ~ColumnFamilyData(), no get should happen as
-  // well.
-  SuperVersion* sv = static_cast<SuperVersion*>(ptr);
-  bool was_last_ref __attribute__((__unused__));
-  was_last_ref = sv->Unref();
-  // Thread-local SuperVersions can't outlive ColumnFamilyData::super_version_.
-  // This is important because we can't do SuperVersion cleanup here.
-  // That would require locking DB mutex, which would deadlock because
-  // SuperVersionUnrefHandle is called with locked ThreadLocalPtr mutex.
-  assert(!was_last_ref);
+// Counters per row of the read sketch, about the number of files of a shard,
+// and the reads after which its counts are halved. A file read by more than
+// about 1/300 of the reads has the maximum frequency.
+static const size_t kReadSketchWidth = 1024;
+static const uint64_t kReadSketchSampleSize = 4096;
+// Number of hot files tracked, and the read frequency below which a file is
+// not hot whatever the others are.
+static const size_t kMaxHotFiles = 16;
+static const uint32_t kMinHotFileFrequency = 4;
+// Read frequency from which a hot file of a cold level is loaded back into
+// the memory of its memory node, and the most files loaded per flush.
+static const uint32_t kMinPromoteFrequency = 16;
+static const size_t kMaxPromotionsPerFlush = 2;
+// Age after which the compaction load reported by the memory node is not
+// trusted any more.
+static const uint64_t kMemoryNodeLoadLifetimeMicros = 1000000;
+// A node whose processors are busy this much of the time runs no more
+// compactions than it has to, and the age after which the time of the
+// compactions run on the compute node is retaken.
+static const uint32_t kBusyCpuPercent = 90;
+static const uint64_t kLocalCompactionTimingLifetimeMicros = 10000000;
+// The delay of a writer at the memtable switch under full pressure, which is
+// 1ms just past kL0_SlowdownWritesTrigger. The status of the memory node is
+// refreshed every 10ms, and ignored once it is much older.
+static const uint64_t kMemoryNodeStatusLifetimeMicros = 100000;
+// The pressure of the memory node grows below this much free registered
+// memory, and from this many unpersisted edits up to twice as many.
+static const uint64_t kMemoryNodeLowFreeBytes = 4ull * 1024 * 1024 * 1024;
+static const uint32_t kPersistenceLagSlowdown = 64;
+// The compaction debt is sampled this often for the time to stall, a new
+// sample weighing this much in the moving averages.
+static const uint64_t kDebtSampleMicros = 1000000;
+static const double kDebtRateWeight = 0.25;
+// The bounds of the sequence range of a memtable with
+// adaptive_memtable_window, and the entries a memtable needs to be sampled.
+static const size_t kMinSeqWindow = MEMTABLE_SEQ_SIZE / 64;
+static const size_t kMaxSeqWindow = MEMTABLE_SEQ_SIZE * 16;
+static const size_t kMinSampledSequences = 1024;
+// The memtable bytes a key range of a flush holds at least, and the keys
+// sampled from every memtable for each range.
+static const size_t kMinFlushPartitionBytes = 16 * 1024 * 1024;
+static const size_t kFlushSamplesPerPartition = 16;
+
+static uint64_t HotFileKey(const RemoteMemTableMetaData& f) {
+  return (f.number << 8) | f.creator_node_id;
+}
+
+static uint64_t NowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void WriteLatencySlotUnrefHandle(void* ptr) {
+  // Called when a thread exits. The latencies recorded stay in the slot,
+  // which is left for another thread.
+  static_cast<WriteLatencySlot*>(ptr)->in_use = false;
+}
+
+void SequenceLeaseUnrefHandle(void* ptr) {
+  // Called when a thread exits. The sequences left in the lease go to the
+  // next thread taking the slot.
+  static_cast<SequenceLease*>(ptr)->in_use = false;
+}
+
+void SuperVersionEpochSlotUnrefHandle(void* ptr) {
+  // Called when a thread exits. The slot is left for another thread, it is
+  // freed with the DB.
+  auto* slot = static_cast<SuperVersionEpochSlot*>(ptr);
+  assert(slot->epoch.load() == 0);
+  slot->in_use = false;
 }
 // Information kept for every waiting writer
 struct DBImpl::Writer {
@@ -71,6 +151,52 @@ struct DBImpl::Writer {
   port::CondVar cv;
 };
 
+// A batch of WriteAsync() waiting for a thread of AsyncWriteLoop().
+struct AsyncWrite {
+  WriteOptions options;
+  WriteBatch batch;
+  DB::WriteCallback callback;
+};
+
+struct DBImpl::AsyncWrites {
+  struct alignas(64) Queue {
+    std::mutex mu;
+    std::deque<AsyncWrite> writes;
+  };
+  CoreLocalArray<Queue> queues;
+  // The batches queued and not yet taken by a thread, counted before they
+  // are queued.
+  std::atomic<int64_t> pending{0};
+  std::mutex mu;
+  std::condition_variable cv;
+  // Protected by mu.
+  bool exit = false;
+  std::once_flag started;
+  std::vector<std::thread> threads;
+};
+
+// The hints of Prefetch() waiting, past which the oldest are dropped, as
+// the reads they hint at are likely over.
+static const size_t kMaxQueuedPrefetches = 64;
+
+// A hint of Prefetch(), the keys or, if there are none, the range.
+struct DBImpl::PrefetchRequest {
+  ReadOptions options;
+  std::vector<std::string> keys;
+  std::string start;
+  std::string limit;
+};
+
+struct DBImpl::Prefetches {
+  std::mutex mu;
+  std::condition_variable cv;
+  // Protected by mu.
+  std::deque<PrefetchRequest> requests;
+  bool exit = false;
+  std::once_flag started;
+  std::thread thread;
+};
+
 
 
 
@@ -98,9 +224,43 @@ Options SanitizeOptions(const std::string& dbname,
 //  if (result.block_cache == nullptr) {
 //    result.block_cache = NewLRUCache(64 << 20);
 //  }
+  if (result.partitioned_table_meta && result.table_meta_cache == nullptr) {
+    result.table_meta_cache =
+        result.clock_cache
+            ? NewClockCache(64 << 20, result.table_meta_partition_size)
+            : NewLRUCache(64 << 20);
+  }
+  if (result.replica_owner_node_id != 0) {
+    // The misses would not see the writes of the owner.
+    result.negative_lookup_cache_size = 0;
+  }
   return result;
 }
 
+static void SetBackgroundPool(Env* env, const Options& options, int max,
+                              ThreadPoolType type) {
+  if (options.min_background_threads > 0) {
+    env->SetBackgroundThreads(std::min(options.min_background_threads, max),
+                              max, type);
+  } else {
+    env->SetBackgroundThreads(max, type);
+  }
+}
+
+static void ApplyPollPolicies(RDMA_Manager* rdma_mg, const Options& options) {
+  const std::pair<QP_Type, bool> classes[] = {
+      {QP_READ_LOCAL, options.adaptive_read_polling},
+      {QP_WRITE_LOCAL_FLUSH, options.adaptive_flush_polling},
+      {QP_WRITE_LOCAL_COMPACT, options.adaptive_compaction_polling}};
+  for (const auto& c : classes) {
+    if (!c.second) continue;
+    Poll_Policy policy;
+    policy.mode = POLL_ADAPTIVE;
+    policy.busy_poll_us = options.rdma_busy_poll_micros;
+    rdma_mg->Set_Poll_Policy(c.first, policy);
+  }
+}
+
 static int TableCacheSize(const Options& sanitized_options) {
   // Reserve ten files or so for other uses and give the rest to TableCache.
   return sanitized_options.max_open_files - kNumNonTableCacheFiles;
@@ -158,8 +318,19 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
                                &internal_filter_policy_, raw_options)),
       owns_info_log_(options_.info_log != raw_options.info_log),
       owns_cache_(options_.block_cache != raw_options.block_cache),
+      owns_meta_cache_(options_.table_meta_cache !=
+                       raw_options.table_meta_cache),
       dbname_(dbname),
       table_cache_(new TableCache(dbname_, options_, TableCacheSize(options_))),
+      negative_cache_(options_.negative_lookup_cache_size > 0
+                          ? new NegativeLookupCache(
+                                options_.negative_lookup_cache_size)
+                          : nullptr),
+      tracer_(new Tracer(env_)),
+      owns_tracer_(true),
+      remote_log_(nullptr),
+      remote_log_unflushed_(0),
+      write_controller_(env_, options_.delayed_write_rate),
       db_lock_(nullptr),
       shutting_down_(false),
 //      write_stall_cv(&write_stall_mutex_),
@@ -172,18 +343,41 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
       log_(nullptr),
       seed_(0),
       tmp_batch_(new WriteBatch),
+      async_writes_(new AsyncWrites),
+      prefetches_(new Prefetches),
       background_compaction_scheduled_(false),
+      queued_compactions_(0),
+      memory_node_compaction_load_(0),
+      memory_node_load_micros_(0),
       manual_compaction_(nullptr),
       versions_(new VersionSet(dbname_, &options_, table_cache_,
                                &internal_comparator_, &superversion_memlist_mtx)),
       super_version_number_(0),
-      super_version(nullptr), local_sv_(new ThreadLocalPtr(&SuperVersionUnrefHandle))
+      super_version(nullptr), super_version_epoch_(1),
+      local_epoch_slot_(new ThreadLocalPtr(&SuperVersionEpochSlotUnrefHandle)),
+      local_write_latency_slot_(
+          new ThreadLocalPtr(&WriteLatencySlotUnrefHandle)),
+      local_sequence_lease_(new ThreadLocalPtr(&SequenceLeaseUnrefHandle)),
+      read_sketch_(kReadSketchWidth, kReadSketchSampleSize)
 #ifdef PROCESSANALYSIS
       ,Total_time_elapse(0),
       flush_times(0)
 #endif
 {
   printf("DBImpl start\n");
+  InitQuota();
+  InitMemoryBudget();
+  // These are settings of the RDMA manager, which all the DBs share.
+  if (options_.track_rdma_slots) {
+    env_->rdma_mg->Set_Slot_Tracking(true);
+  }
+  if (options_.resize_rdma_pools) {
+    env_->rdma_mg->Set_Pool_Resizing(true);
+  }
+  if (options_.release_remote_regions) {
+    env_->rdma_mg->Set_Remote_Region_Release(true);
+  }
+  ApplyPollPolicies(env_->rdma_mg.get(), options_);
 
 //  for(auto iter : options_.ShardInfo){
 //    versions_pool.insert({iter.first,
@@ -199,8 +393,10 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
     byte_len = rdma_mg->byte_len_map.at(shard_target_node_id);
     cv_imme = rdma_mg->cv_imme_map.at(shard_target_node_id);
 
-    env_->SetBackgroundThreads(options_.max_background_flushes,ThreadPoolType::FlushThreadPool);
-    env_->SetBackgroundThreads(options_.max_background_compactions,ThreadPoolType::CompactionThreadPool);
+    SetBackgroundPool(env_, options_, options_.max_background_flushes,
+                      ThreadPoolType::FlushThreadPool);
+    SetBackgroundPool(env_, options_, options_.max_background_compactions,
+                      ThreadPoolType::CompactionThreadPool);
     //TODO: Make client handling thread only 1 per compute node-memory node connection.
 //    main_comm_threads.emplace_back(
 //        &DBImpl::client_message_polling_and_handling_thread, this, "main");
@@ -230,7 +426,11 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
 //        printf("Waked up\n");
 //      }
 //    }
-    Unpin_bg_pool_.SetBackgroundThreads(1);
+#ifdef WITHPERSISTENCE
+    // The memory node writes the epoch of the last persisted edit here.
+    rdma_mg->Allocate_Local_RDMA_Slot(persist_epoch_mr_, Message);
+    *static_cast<uint64_t*>(persist_epoch_mr_.addr) = 0;
+#endif
 //    if (options_.block_cache != nullptr){
 //      size_t size_in_gb = options_.block_cache->GetCapacity()/(1024*1024*1024) +1 +1;
 //      for (size_t i = 0; i < size_in_gb; ++i) {
@@ -277,8 +477,19 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname,
                                &internal_filter_policy_, raw_options)),
       owns_info_log_(options_.info_log != raw_options.info_log),
       owns_cache_(options_.block_cache != raw_options.block_cache),
+      owns_meta_cache_(options_.table_meta_cache !=
+                       raw_options.table_meta_cache),
       dbname_(dbname),
       table_cache_(new TableCache(dbname_, options_, TableCacheSize(options_))),
+      negative_cache_(options_.negative_lookup_cache_size > 0
+                          ? new NegativeLookupCache(
+                                options_.negative_lookup_cache_size)
+                          : nullptr),
+      tracer_(nullptr),
+      owns_tracer_(false),
+      remote_log_(nullptr),
+      remote_log_unflushed_(0),
+      write_controller_(env_, options_.delayed_write_rate),
       db_lock_(nullptr),
       shutting_down_(false),
       //      write_stall_cv(&write_stall_mutex_),
@@ -291,20 +502,47 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname,
       log_(nullptr),
       seed_(0),
       tmp_batch_(new WriteBatch),
+      async_writes_(new AsyncWrites),
+      prefetches_(new Prefetches),
       background_compaction_scheduled_(false),
+      queued_compactions_(0),
+      memory_node_compaction_load_(0),
+      memory_node_load_micros_(0),
       manual_compaction_(nullptr),
       versions_(new VersionSet(dbname_, &options_, table_cache_,
                                &internal_comparator_, &superversion_memlist_mtx)),
       super_version_number_(0),
-      super_version(nullptr), local_sv_(new ThreadLocalPtr(&SuperVersionUnrefHandle)),
+      super_version(nullptr), super_version_epoch_(1),
+      local_epoch_slot_(new ThreadLocalPtr(&SuperVersionEpochSlotUnrefHandle)),
+      local_write_latency_slot_(
+          new ThreadLocalPtr(&WriteLatencySlotUnrefHandle)),
+      local_sequence_lease_(new ThreadLocalPtr(&SequenceLeaseUnrefHandle)),
+      read_sketch_(kReadSketchWidth, kReadSketchSampleSize),
       shard_target_node_id(0)
 {
-
+  InitQuota();
+  InitMemoryBudget();
+  // These are settings of the RDMA manager, which all the DBs share.
+  if (options_.track_rdma_slots) {
+    env_->rdma_mg->Set_Slot_Tracking(true);
+  }
+  if (options_.resize_rdma_pools) {
+    env_->rdma_mg->Set_Pool_Resizing(true);
+  }
+  if (options_.release_remote_regions) {
+    env_->rdma_mg->Set_Remote_Region_Release(true);
+  }
+  ApplyPollPolicies(env_->rdma_mg.get(), options_);
 
   std::shared_ptr<RDMA_Manager> rdma_mg = env_->rdma_mg;
-  env_->SetBackgroundThreads(options_.max_background_flushes,ThreadPoolType::FlushThreadPool);
-  env_->SetBackgroundThreads(options_.max_background_compactions,ThreadPoolType::CompactionThreadPool);
-
+  SetBackgroundPool(env_, options_, options_.max_background_flushes,
+                    ThreadPoolType::FlushThreadPool);
+  SetBackgroundPool(env_, options_, options_.max_background_compactions,
+                    ThreadPoolType::CompactionThreadPool);
+#ifdef WITHPERSISTENCE
+  rdma_mg->Allocate_Local_RDMA_Slot(persist_epoch_mr_, Message);
+  *static_cast<uint64_t*>(persist_epoch_mr_.addr) = 0;
+#endif
 
 
 }
@@ -313,13 +551,52 @@ DBImpl::~DBImpl() {
   // Wait for background work to finish.
 //  undefine_mutex.Lock();
   printf("DBImpl deallocated\n");
+  if (budget_member_ != nullptr) {
+    UnregisterMemoryBudgetMember(options_.memory_budget, budget_member_);
+    delete budget_member_;
+  }
+  // The batches queued by WriteAsync() are applied before the threads exit.
+  {
+    std::unique_lock<std::mutex> lck(async_writes_->mu);
+    async_writes_->exit = true;
+  }
+  async_writes_->cv.notify_all();
+  for (std::thread& thread : async_writes_->threads) {
+    thread.join();
+  }
+  // The hints left are dropped.
+  {
+    std::unique_lock<std::mutex> lck(prefetches_->mu);
+    prefetches_->exit = true;
+  }
+  prefetches_->cv.notify_all();
+  if (prefetches_->thread.joinable()) {
+    prefetches_->thread.join();
+  }
   WaitforAllbgtasks(false);
   //TODO: recycle all the
 
 // No need to exit the background threads.
 //  env_->JoinAllThreads(true);
-//  Unpin_bg_pool_.JoinThreads(true);
   shutting_down_.store(true);
+  if (replica_refresher_.joinable()) {
+    {
+      // The refresher is waiting or refreshing, the notification is not
+      // lost.
+      std::unique_lock<std::mutex> lck(replica_mtx_);
+    }
+    replica_cv_.notify_all();
+    replica_refresher_.join();
+  }
+  if (edit_syncer_.joinable()) {
+    // It sends the edits left before it exits.
+    {
+      std::unique_lock<std::mutex> lck(edit_sync_mtx_);
+      edit_syncer_exit_ = true;
+    }
+    edit_sync_cv_.notify_all();
+    edit_syncer_.join();
+  }
   // wait for communicaiton thread to finish
   for(int i = 0; i < main_comm_threads.size(); i++){
     main_comm_threads[i].join();
@@ -355,15 +632,44 @@ DBImpl::~DBImpl() {
   if (db_lock_ != nullptr) {
     env_->UnlockFile(db_lock_);
   }
-  delete local_sv_;
-  if (super_version!= nullptr && super_version->Unref())
-    super_version->Cleanup();
+  delete local_epoch_slot_;
+  for (auto slot : epoch_slots_) {
+    delete slot;
+  }
+  delete local_write_latency_slot_;
+  for (auto slot : write_latency_slots_) {
+    delete slot;
+  }
+  delete local_sequence_lease_;
+  for (auto lease : sequence_leases_) {
+    delete lease;
+  }
+  if (!IsReplica()) {
+    // The memory node keeps the tables of the current version for the next
+    // open of the shard, see recover_version_from_remote().
+    Version* current = versions_->current();
+    for (int level = 0; level < config::kNumLevels; level++) {
+      for (const auto& f : current->files(level)) {
+        f->borrowed = true;
+      }
+    }
+  }
+  ReclaimSuperVersions(true);
+  SuperVersion* sv = super_version.load();
+  if (sv != nullptr && sv->Unref())
+    sv->Cleanup();
 //  if (local_sv_.get()->Get() != nullptr){
 //    CleanupSuperVersion(static_cast<SuperVersion*>(local_sv_.get()->Get()));
 //  }
 //  local_sv_->Reset(nullptr);
 
   delete versions_;
+  delete edit_publisher_;
+  delete replica_edits_;
+  delete replica_tail_;
+#ifdef WITHPERSISTENCE
+  env_->rdma_mg->Deallocate_Local_RDMA_Slot(persist_epoch_mr_.addr, Message);
+#endif
   if (mem_ != nullptr) mem_.load()->SimpleDelete();
 //  if (imm_ != nullptr) imm_.load()->SimpleDelete();
 //  if (imm_ != nullptr) delete imm_;
@@ -371,6 +677,12 @@ DBImpl::~DBImpl() {
   delete log_;
   delete logfile_;
   delete table_cache_;
+  delete negative_cache_;
+  if (owns_tracer_) {
+    delete tracer_;
+  }
+  delete remote_log_;
+  delete rdma_limiter_;
 
   if (owns_info_log_) {
     delete options_.info_log;
@@ -378,6 +690,9 @@ DBImpl::~DBImpl() {
   if (owns_cache_) {
     delete options_.block_cache;
   }
+  if (owns_meta_cache_) {
+    delete options_.table_meta_cache;
+  }
 #ifdef PROCESSANALYSIS
   if (flush_times.load() >0)
     printf("Memtable total flush time, number of flush, average flush time are %zu, %zu, %zu\n",
@@ -397,14 +712,15 @@ void DBImpl::WaitforAllbgtasks(bool clear_mem) {
     iter->SeekToFirst();
     if(iter->Valid()){
       mem->NotFullTableflush();
-      MemTable* temp_mem = new MemTable(internal_comparator_);
+      const size_t seq_window = NextSeqWindow(mem);
+      MemTable* temp_mem = NewMemTable(seq_window);
       DEBUG_arg("Not full flushed table first seq number is %lu", mem->GetFirstseq());
       // Get the real largest seq because it is not a full table flush
       uint64_t last_mem_seq = mem->Getlargest_seq();
       temp_mem->SetFirstSeq(last_mem_seq+1);
       // starting from this sequenctial number, the data should write to the new memtable
       // set the immutable as seq_num - 1
-      temp_mem->SetLargestSeq(last_mem_seq + MEMTABLE_SEQ_SIZE);
+      temp_mem->SetLargestSeq(last_mem_seq + seq_window);
       temp_mem->Ref();
       mem->SetFlushState(MemTable::FLUSH_REQUESTED);
       mem_.store(temp_mem);
@@ -570,7 +886,10 @@ Status DBImpl::Recover(VersionEdit* edit, bool* save_manifest) {
 //    return s;
 //  }
 
+  // A database reopened takes its tables back from the memory node.
+  bool reattach = true;
   if (!env_->FileExists(CurrentFileName(dbname_))) {
+    reattach = false;
     if (options_.create_if_missing) {
       Log(options_.info_log, "Creating DB %s since it was missing.",
           dbname_.c_str());
@@ -593,6 +912,32 @@ Status DBImpl::Recover(VersionEdit* edit, bool* save_manifest) {
   if (!s.ok()) {
     return s;
   }
+  s = recover_version_from_remote(shard_target_node_id, reattach);
+  if (!s.ok()) {
+    return s;
+  }
+  if (options_.remote_log_size > 0) {
+    remote_log_ = new RemoteLog(env_->rdma_mg.get(), shard_target_node_id,
+                                shard_id, options_.remote_log_size);
+    s = remote_log_->Open(&remote_log_batches_, &remote_log_unflushed_);
+    if (!s.ok()) {
+      return s;
+    }
+    // The sequences go on after the ones of the log, which
+    // ReplayRemoteLog() hands out again.
+    SequenceNumber next_sequence =
+        std::max(versions_->LastSequence(), remote_log_unflushed_);
+    for (const std::string& contents : remote_log_batches_) {
+      WriteBatch batch;
+      WriteBatchInternal::SetContents(&batch, contents);
+      next_sequence = std::max(next_sequence,
+                               WriteBatchInternal::Sequence(&batch) +
+                                   WriteBatchInternal::Count(&batch));
+    }
+    versions_->SetLastSequence(next_sequence);
+    Log(options_.info_log, "Recovered %zu batches from the remote log",
+        remote_log_batches_.size());
+  }
   SequenceNumber max_sequence(0);
 
   // Recover from all newer log files than the ones named in the
@@ -647,9 +992,130 @@ Status DBImpl::Recover(VersionEdit* edit, bool* save_manifest) {
     versions_->SetLastSequence(max_sequence);
   }
 
+  if (options_.replica_edit_log_size > 0) {
+    edit_publisher_ = new EditPublisher(
+        env_->rdma_mg.get(), shard_target_node_id, shard_id,
+        options_.replica_edit_log_size, options_.replica_retire_micros, env_,
+        options_.info_log);
+    s = edit_publisher_->Open(versions_->current(), versions_->LastSequence());
+    if (!s.ok()) {
+      return s;
+    }
+    versions_->SetEditPublisher(edit_publisher_);
+  }
+
   return Status::OK();
 }
 
+namespace {
+// Copies the entries of a batch from the "skip"th one on.
+class SkipEntries : public WriteBatch::Handler {
+ public:
+  SkipEntries(WriteBatch* batch, int skip) : batch_(batch), skip_(skip) {}
+  void Put(const Slice& key, const Slice& value) override {
+    if (skip_-- <= 0) batch_->Put(key, value);
+  }
+  void Delete(const Slice& key) override {
+    if (skip_-- <= 0) batch_->Delete(key);
+  }
+  void Merge(const Slice& key, const Slice& value) override {
+    if (skip_-- <= 0) batch_->Merge(key, value);
+  }
+
+ private:
+  WriteBatch* const batch_;
+  int skip_;
+};
+}  // namespace
+
+Status DBImpl::ReplayRemoteLog() {
+  if (remote_log_ == nullptr) {
+    return Status::OK();
+  }
+  // The entries after the flushed tables. They get new sequences in the
+  // order of their old ones, the log keeps them until those are flushed.
+  std::vector<std::pair<SequenceNumber, WriteBatch>> replayed;
+  for (const std::string& contents : remote_log_batches_) {
+    WriteBatch batch;
+    WriteBatchInternal::SetContents(&batch, contents);
+    const SequenceNumber first = WriteBatchInternal::Sequence(&batch);
+    const int count = WriteBatchInternal::Count(&batch);
+    if (first + count <= remote_log_unflushed_) {
+      continue;
+    }
+    if (first < remote_log_unflushed_) {
+      // Crossed the border of a flushed memtable.
+      WriteBatch rest;
+      SkipEntries handler(&rest, remote_log_unflushed_ - first);
+      Status s = batch.Iterate(&handler);
+      if (!s.ok()) {
+        return s;
+      }
+      batch = rest;
+    }
+    replayed.emplace_back(first, batch);
+  }
+  remote_log_batches_.clear();
+  std::sort(replayed.begin(), replayed.end(),
+            [](const std::pair<SequenceNumber, WriteBatch>& a,
+               const std::pair<SequenceNumber, WriteBatch>& b) {
+              return a.first < b.first;
+            });
+  Status s;
+  const size_t threads = std::min<size_t>(
+      std::max(options_.log_replay_threads, 1), replayed.size());
+  if (threads <= 1) {
+    for (auto& batch : replayed) {
+      s = InsertBatchIntoMemtables(&batch.second, false);
+      if (!s.ok()) {
+        return s;
+      }
+    }
+  } else {
+    // As concurrent writers do, the batches take their sequences one after
+    // the other and are inserted side by side.
+    std::mutex mu;
+    size_t next = 0;
+    auto replay = [&] {
+      while (true) {
+        PreparedWrite prepared;
+        Status prepare_status;
+        {
+          std::lock_guard<std::mutex> l(mu);
+          if (next == replayed.size() || !s.ok()) {
+            return;
+          }
+          prepare_status =
+              PrepareWrite(&replayed[next++].second, false, &prepared);
+        }
+        Status commit_status =
+            CommitWrite(&prepared, prepare_status.ok(), false);
+        if (!prepare_status.ok() || !commit_status.ok()) {
+          std::lock_guard<std::mutex> l(mu);
+          if (s.ok()) {
+            s = prepare_status.ok() ? commit_status : prepare_status;
+          }
+        }
+      }
+    };
+    std::vector<std::thread> replayers;
+    for (size_t i = 0; i < threads; i++) {
+      replayers.emplace_back(replay);
+    }
+    for (std::thread& replayer : replayers) {
+      replayer.join();
+    }
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  assert(versions_->LastSequence() > 0);
+  remote_log_->SetRecoveredSequence(versions_->LastSequence() - 1);
+  Log(options_.info_log, "Replayed %zu batches of the remote log",
+      replayed.size());
+  return s;
+}
+
 Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
                               bool* save_manifest, VersionEdit* edit,
                               SequenceNumber* max_sequence) {
@@ -706,7 +1172,7 @@ Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
     WriteBatchInternal::SetContents(&batch, record);
 
     if (mem == nullptr) {
-      mem = new MemTable(internal_comparator_);
+      mem = NewMemTable(MEMTABLE_SEQ_SIZE);
       mem->Ref();
     }
     status = WriteBatchInternal::InsertInto(&batch, mem);
@@ -752,7 +1218,7 @@ Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
         mem = nullptr;
       } else {
         // mem can be nullptr if lognum exists but was empty.
-        mem_.store(new MemTable(internal_comparator_));
+        mem_.store(NewMemTable(MEMTABLE_SEQ_SIZE));
         mem_.load()->Ref();
       }
     }
@@ -775,54 +1241,272 @@ Status DBImpl::WriteLevel0Table(FlushJob* job, VersionEdit* edit) {
   const uint64_t start_micros = env_->NowMicros();
   //Mark all memtable as FLUSHPROCESSING.
   job->SetAllMemStateProcessing();
-  std::shared_ptr<RemoteMemTableMetaData> meta = std::make_shared<RemoteMemTableMetaData>(0,versions_->table_cache_,
-                                               shard_target_node_id);
-  job->sst = meta;
-  meta->number = versions_->NewFileNumber();
-  DEBUG_arg("new file number for flushing is %lu\n", meta->number);
-//  pending_outputs_.insert(meta->number);
-  Iterator* iter = imm_.MakeInputIterator(job);
-  Log(options_.info_log, "Level-0 table #%llu: started",
-      (unsigned long long)meta->number);
-//  printf("now system start to serializae mem %p\n", mem);
-  Status s;
-  {
-//    undefine_mutex.Unlock();
-    s = job->BuildTable(dbname_, env_, options_, table_cache_, iter, meta, Flush,
-                    shard_target_node_id);
-//    undefine_mutex.Lock();
+  job->ssts.clear();
+  bool offloaded = false;
+  if (options_.offload_flush && options_.min_blob_size == 0) {
+    Status offload_status = OffloadFlush(job);
+    offloaded = offload_status.ok();
+    if (!offloaded && !offload_status.IsNotSupportedError()) {
+      Log(options_.info_log, "Flush offload failed, building here: %s",
+          offload_status.ToString().c_str());
+    }
+  }
+  // The user keys the key ranges of the flush are split at.
+  std::vector<std::string> bounds;
+  if (!offloaded) {
+    PickFlushPartitions(job, &bounds);
+  }
+  const size_t partitions = offloaded ? 1 : bounds.size() + 1;
+  for (size_t i = 0; !offloaded && i < partitions; i++) {
+    auto meta = std::make_shared<RemoteMemTableMetaData>(
+        0, versions_->table_cache_, NextTableNode());
+    meta->number = versions_->NewFileNumber();
+    DEBUG_arg("new file number for flushing is %lu\n", meta->number);
+    Log(options_.info_log, "Level-0 table #%llu: started",
+        (unsigned long long)meta->number);
+    job->ssts.push_back(meta);
+  }
+  std::vector<Status> statuses(partitions);
+  // Every range merges the memtables with its own iterator.
+  auto build = [&](size_t i) {
+    Slice smallest;
+    Slice limit;
+    if (i > 0) {
+      smallest = bounds[i - 1];
+    }
+    if (i + 1 < partitions) {
+      limit = bounds[i];
+    }
+    Iterator* iter = imm_.MakeInputIterator(job);
+    statuses[i] = job->BuildTable(dbname_, env_, options_, table_cache_, iter,
+                                  job->ssts[i], Flush,
+                                  job->ssts[i]->shard_target_node_id,
+                                  i > 0 ? &smallest : nullptr,
+                                  i + 1 < partitions ? &limit : nullptr);
+    delete iter;
+  };
+  // As the subcompactions do, the first range is built on this thread.
+  std::vector<port::Thread> threads;
+  if (!offloaded) {
+    threads.reserve(partitions - 1);
+    for (size_t i = 1; i < partitions; i++) {
+      threads.emplace_back(build, i);
+    }
+    build(0);
+  }
+  for (auto& thread : threads) {
+    thread.join();
   }
 //  printf("remote table use count after building %ld\n", meta.use_count());
 //  Log(options_.info_log, "Level-0 table #%llu: %lld bytes %s",
 //      (unsigned long long)meta.number, (unsigned long long)meta.file_size,
 //      s.ToString().c_str());
-  delete iter;
-//  pending_outputs_.erase(meta->number);
 
   // Note that if file_size is zero, the file has been deleted and
   // should not be added to the manifest.
   int level = 0;
-
-  if (s.ok() && meta->file_size > 0) {
-//    const Slice min_user_key = meta->smallest.user_key();
-//    const Slice max_user_key = meta->largest.user_key();
-//    if (base != nullptr) {
-//      level = base->PickLevelForMemTableOutput(min_user_key, max_user_key);
-//    }
-    meta->level = 0;
-    //No need to add file here, we will add to the version edit in Try install flush
-    // result
-//    edit->AddFile(0, meta);
-//    assert(edit->GetNewFilesNum()==1);
+  Status s;
+  CompactionStats stats;
+  for (size_t i = 0; i < partitions; i++) {
+    if (s.ok()) {
+      s = statuses[i];
+    }
+    const std::shared_ptr<RemoteMemTableMetaData>& meta = job->ssts[i];
+    if (statuses[i].ok() && meta->file_size > 0) {
+      meta->level = 0;
+      //No need to add file here, we will add to the version edit in Try install flush
+      // result
+    }
+    stats.bytes_written += meta->file_size;
   }
 
-  CompactionStats stats;
   stats.micros = env_->NowMicros() - start_micros;
-  stats.bytes_written = meta->file_size;
-  stats_[level].Add(stats);
+  stats.count = 1;
+  AddCompactionStats(level, stats);
+  if (s.ok()) {
+    write_controller_.RecordFlush(stats.bytes_written, stats.micros);
+  }
 //  write_stall_mutex_.AssertNotHeld();
   return s;
 }
+Status DBImpl::OffloadFlush(FlushJob* job) {
+  std::shared_ptr<RDMA_Manager> rdma_mg = env_->rdma_mg;
+  std::unique_ptr<Iterator> iter(imm_.MakeInputIterator(job));
+  iter->SeekToFirst();
+  FlushEntryFilter filter(internal_comparator_.user_comparator(),
+                          job->smallest_snapshot);
+  ibv_mr send_mr = {};
+  ibv_mr receive_mr = {};
+  ibv_mr ready_mr = {};
+  ibv_mr batch_mr = {};
+  ibv_mr edit_mr = {};
+  rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+  rdma_mg->Allocate_Local_RDMA_Slot(receive_mr, Message);
+  rdma_mg->Allocate_Local_RDMA_Slot(ready_mr, Message);
+  rdma_mg->Allocate_Local_RDMA_Slot(batch_mr, Version_edit);
+  rdma_mg->Allocate_Local_RDMA_Slot(edit_mr, Version_edit);
+  // The flag byte the memory node polls on follows the batch.
+  const size_t capacity = batch_mr.length - 1;
+  uint64_t bytes = 0;
+  // Fill the batch buffer with the next entries the flush keeps.
+  auto fill = [&](size_t* size) -> Status {
+    char* dst = static_cast<char*>(batch_mr.addr);
+    *size = 0;
+    for (; iter->Valid(); iter->Next()) {
+      const Slice key = iter->key();
+      const Slice value = iter->value();
+      const size_t entry_size = VarintLength(key.size()) + key.size() +
+                                VarintLength(value.size()) + value.size();
+      if (*size + entry_size > capacity) {
+        if (*size == 0) {
+          return Status::NotSupported("flush entry does not fit a batch");
+        }
+        break;
+      }
+      ParsedInternalKey ikey;
+      if (!ParseInternalKey(key, &ikey)) {
+        return Status::Corruption("Corrupt key value detected");
+      }
+      if (!filter.Keep(ikey)) {
+        continue;
+      }
+      if (ikey.type == kTypeValue &&
+          TooLargeForTable(rdma_mg.get(), key, value)) {
+        // The memory node keeps every value in the table, the flush is
+        // built here and the value goes to blob chunks.
+        return Status::NotSupported("flush entry too large for a table");
+      }
+      char* p = EncodeVarint32(dst + *size, key.size());
+      memcpy(p, key.data(), key.size());
+      p = EncodeVarint32(p + key.size(), value.size());
+      memcpy(p, value.data(), value.size());
+      *size += entry_size;
+    }
+    dst[*size] = 1;
+    bytes += *size;
+    return iter->status();
+  };
+  size_t size = 0;
+  Status s = fill(&size);
+  if (s.ok() && size == 0) {
+    // Built here, as the flush of nothing is.
+    s = Status::NotSupported("nothing to flush");
+  }
+  bool sent = false;
+  if (s.ok()) {
+    RDMA_Request* send_pointer = (RDMA_Request*)send_mr.addr;
+    send_pointer->command = flush_offload_;
+    send_pointer->content.fo = {};
+    send_pointer->content.fo.size = size;
+    send_pointer->content.fo.batch = batch_mr.addr;
+    send_pointer->content.fo.batch_rkey = batch_mr.rkey;
+    send_pointer->content.fo.capacity = edit_mr.length;
+    send_pointer->content.fo.last = !iter->Valid();
+    send_pointer->content.fo.bloom_bits = job->bloom_bits;
+    send_pointer->buffer = receive_mr.addr;
+    send_pointer->rkey = receive_mr.rkey;
+    send_pointer->buffer_large = edit_mr.addr;
+    send_pointer->rkey_large = edit_mr.rkey;
+    //Clear the reply buffer for the polling.
+    *(RDMA_Reply*)receive_mr.addr = {};
+    rdma_mg->post_send<RDMA_Request>(&send_mr, shard_target_node_id,
+                                     std::string("main"));
+    ibv_wc wc[2] = {};
+    if (rdma_mg->poll_completion(wc, 1, std::string("main"), true,
+                                 shard_target_node_id)) {
+      s = Status::IOError("failed to send the flush to the memory node");
+    } else {
+      sent = true;
+    }
+  }
+  RDMA_Reply* receive_pointer = (RDMA_Reply*)receive_mr.addr;
+  uint64_t batches = 1;
+  while (sent) {
+    rdma_mg->poll_reply_buffer(receive_pointer);
+    const flush_offload reply = receive_pointer->content.fo;
+    *receive_pointer = {};
+    if (!reply.ok) {
+      if (s.ok()) {
+        s = Status::IOError("flush failed on the memory node");
+      }
+      break;
+    }
+    if (reply.last) {
+      VersionEdit edit(0);
+      edit.DecodeFrom(Slice(static_cast<char*>(edit_mr.addr), reply.size), 0,
+                      table_cache_);
+      assert(edit.GetNewFilesNum() == 1);
+      for (auto& file : *edit.GetNewFiles()) {
+        std::shared_ptr<RemoteMemTableMetaData> meta = file.second;
+        meta->number = versions_->NewFileNumber();
+        meta->level = 0;
+        Log(options_.info_log, "Level-0 table #%llu: built by the memory node",
+            (unsigned long long)meta->number);
+        job->ssts.push_back(meta);
+      }
+      break;
+    }
+    // The memory node has read the batch, the buffer takes the next one.
+    Status fill_status = fill(&size);
+    flush_offload_batch* next = static_cast<flush_offload_batch*>(ready_mr.addr);
+    next->size = fill_status.ok() ? size : FLUSH_OFFLOAD_ABORT;
+    next->last = !iter->Valid();
+    next->seq = batches++;
+    rdma_mg->RDMA_Write(reply.ready, reply.ready_rkey, &ready_mr,
+                        sizeof(flush_offload_batch), std::string("main"),
+                        IBV_SEND_SIGNALED, 1, shard_target_node_id);
+    if (!fill_status.ok()) {
+      // The memory node drops the table and replies.
+      s = fill_status;
+    }
+  }
+  if (s.ok() && job->ssts.empty()) {
+    s = Status::IOError("no table from the memory node");
+  }
+  rdma_mg->Deallocate_Local_RDMA_Slot(edit_mr.addr, Version_edit);
+  rdma_mg->Deallocate_Local_RDMA_Slot(batch_mr.addr, Version_edit);
+  rdma_mg->Deallocate_Local_RDMA_Slot(ready_mr.addr, Message);
+  rdma_mg->Deallocate_Local_RDMA_Slot(receive_mr.addr, Message);
+  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
+  return s;
+}
+// The split keys are taken from a sample of every memtable of the job, as
+// the memtables may hold different parts of the key space. A range is not
+// split off under kMinFlushPartitionBytes of memtables.
+void DBImpl::PickFlushPartitions(FlushJob* job,
+                                 std::vector<std::string>* bounds) {
+  size_t bytes = 0;
+  for (MemTable* m : job->mem_vec) {
+    bytes += m->ApproximateMemoryUsage();
+  }
+  const size_t partitions = std::min<size_t>(
+      std::max(options_.max_flush_partitions, 1),
+      std::max<size_t>(bytes / kMinFlushPartitionBytes, 1));
+  if (partitions <= 1) {
+    return;
+  }
+  std::vector<std::string> samples;
+  for (MemTable* m : job->mem_vec) {
+    m->SampleUserKeys(partitions * kFlushSamplesPerPartition, &samples);
+  }
+  if (samples.empty()) {
+    return;
+  }
+  const Comparator* ucmp = internal_comparator_.user_comparator();
+  std::sort(samples.begin(), samples.end(),
+            [ucmp](const std::string& a, const std::string& b) {
+              return ucmp->Compare(a, b) < 0;
+            });
+  for (size_t i = 1; i < partitions; i++) {
+    const std::string& bound = samples[i * samples.size() / partitions];
+    // A bound equal to the one before would leave an empty range.
+    if (bound.empty() ||
+        (!bounds->empty() && ucmp->Compare(bounds->back(), bound) >= 0)) {
+      continue;
+    }
+    bounds->push_back(bound);
+  }
+}
 Status DBImpl::WriteLevel0Table(MemTable* job, VersionEdit* edit,
                                 Version* base) {
 //  undefine_mutex.AssertHeld();
@@ -865,7 +1549,8 @@ Status DBImpl::WriteLevel0Table(MemTable* job, VersionEdit* edit,
   CompactionStats stats;
   stats.micros = env_->NowMicros() - start_micros;
   stats.bytes_written = meta->file_size;
-  stats_[level].Add(stats);
+  stats.count = 1;
+  AddCompactionStats(level, stats);
 //  write_stall_mutex_.AssertNotHeld();
   return s;
 }
@@ -965,7 +1650,23 @@ Status DBImpl::WriteLevel0Table(MemTable* job, VersionEdit* edit,
 //    RecordBackgroundError(s);
 //  }
 //}
-void DBImpl::CompactMemTable() {
+// A flush is known on the timeline by its first table, and its bytes are the
+// ones of all its tables.
+static void SetTimelineJob(
+    TimelineScope* timeline,
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& ssts) {
+  uint64_t bytes = 0;
+  for (auto& sst : ssts) {
+    bytes += sst->file_size;
+  }
+  if (!ssts.empty()) {
+    timeline->set_job_id(
+        TimelineJobId(ssts[0]->number, ssts[0]->creator_node_id));
+  }
+  timeline->set_bytes(bytes);
+}
+
+bool DBImpl::CompactMemTable() {
 //  undefine_mutex.AssertHeld();
   //TOTHINK What will happen if we remove the mutex in the future?
 
@@ -978,13 +1679,19 @@ void DBImpl::CompactMemTable() {
   // the case that the thread this immutable is under the control of conditional
   // variable.
   FlushJob f_job(&write_stall_cv, &internal_comparator_);
+  f_job.smallest_snapshot = snapshots_.Oldest(VisibleSequence());
+  f_job.bloom_bits = versions_->BloomBitsForLevel(0);
   { //This code should synchronized outside the superversion mutex, since nothing
     // has been changed for superversion.
     std::unique_lock<std::mutex> l(FlushPickMTX);
     if (imm_.IsFlushPending())
-      imm_.PickMemtablesToFlush(&f_job.mem_vec);
+      imm_.PickMemtablesToFlush(&f_job.mem_vec,
+                                options_.max_memtables_per_flush);
     else
-      return;
+      return true;
+  }
+  if (f_job.mem_vec.empty()) {
+    return false;
   }
   DEBUG_arg("picked metable number is %lu", f_job.mem_vec.size());
   f_job.Waitforpendingwriter();
@@ -994,7 +1701,9 @@ void DBImpl::CompactMemTable() {
 #ifdef PROCESSANALYSIS
   auto start = std::chrono::high_resolution_clock::now();
 #endif
+  TimelineScope flush_timeline("flush", shard_id);
   Status s = WriteLevel0Table(&f_job, &edit);
+  SetTimelineJob(&flush_timeline, f_job.ssts);
 #ifdef PROCESSANALYSIS
   auto stop = std::chrono::high_resolution_clock::now();
   auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
@@ -1007,11 +1716,17 @@ void DBImpl::CompactMemTable() {
   //  base->Unref();
 //  assert(edit.GetNewFilesNum()==1);
 
-  TryInstallMemtableFlushResults(&f_job, versions_, f_job.sst, &edit);
+  {
+    TimelineScope install_timeline("install_flush", shard_id);
+    SetTimelineJob(&install_timeline, f_job.ssts);
+    TryInstallMemtableFlushResults(&f_job, versions_, f_job.ssts, &edit);
+  }
+  UpdateHotFiles();
 //  MaybeScheduleFlushOrCompaction();
   if (s.ok() && shutting_down_.load(std::memory_order_acquire)) {
     s = Status::IOError("Deleting DB during memtable compaction");
   }
+  return true;
 }
 void DBImpl::ForceCompactMemTable() {
   //  undefine_mutex.AssertHeld();
@@ -1026,16 +1741,22 @@ void DBImpl::ForceCompactMemTable() {
   // the case that the thread this immutable is under the control of conditional
   // variable.
   FlushJob f_job(&write_stall_cv, &internal_comparator_);
+  f_job.smallest_snapshot = snapshots_.Oldest(VisibleSequence());
+  f_job.bloom_bits = versions_->BloomBitsForLevel(0);
   { //This code should synchronized outside the superversion mutex, since nothing
     // has been changed for superversion.
     std::unique_lock<std::mutex> l(FlushPickMTX);
     if (imm_.IsFlushDoable()){
-      imm_.PickMemtablesToFlush(&f_job.mem_vec);
+      imm_.PickMemtablesToFlush(&f_job.mem_vec,
+                                options_.max_memtables_per_flush);
     }else{
       return ;
     }
 
   }
+  if (f_job.mem_vec.empty()) {
+    return;
+  }
   DEBUG_arg("picked metable number is %lu", f_job.mem_vec.size());
   f_job.Waitforpendingwriter();
 
@@ -1044,7 +1765,9 @@ void DBImpl::ForceCompactMemTable() {
 #ifdef PROCESSANALYSIS
   auto start = std::chrono::high_resolution_clock::now();
 #endif
+  TimelineScope flush_timeline("flush", shard_id);
   Status s = WriteLevel0Table(&f_job, &edit);
+  SetTimelineJob(&flush_timeline, f_job.ssts);
 #ifdef PROCESSANALYSIS
   auto stop = std::chrono::high_resolution_clock::now();
   auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
@@ -1057,7 +1780,12 @@ void DBImpl::ForceCompactMemTable() {
   //  base->Unref();
   //  assert(edit.GetNewFilesNum()==1);
 
-  TryInstallMemtableFlushResults(&f_job, versions_, f_job.sst, &edit);
+  {
+    TimelineScope install_timeline("install_flush", shard_id);
+    SetTimelineJob(&install_timeline, f_job.ssts);
+    TryInstallMemtableFlushResults(&f_job, versions_, f_job.ssts, &edit);
+  }
+  UpdateHotFiles();
   //  MaybeScheduleFlushOrCompaction();
   if (s.ok() && shutting_down_.load(std::memory_order_acquire)) {
     s = Status::IOError("Deleting DB during memtable compaction");
@@ -1065,6 +1793,10 @@ void DBImpl::ForceCompactMemTable() {
 }
 //NOte: deprecated function
 void DBImpl::CompactRange(const Slice* begin, const Slice* end) {
+  if (IsReplica()) {
+    // The owner compacts the tables.
+    return;
+  }
   int max_level_with_files = 1;
   {
     MutexLock l(&undefine_mutex);
@@ -1156,25 +1888,48 @@ void DBImpl::MaybeScheduleFlushOrCompaction() {
     return;
   }
   DEBUG("May be schedule a background task! \n");
-  if (imm_.IsFlushPending()) {
+  // With the flushes of the quota in flight, the first to finish schedules
+  // the next one.
+  if (imm_.IsFlushPending() && ReserveFlush()) {
 //    background_compaction_scheduled_ = true;
     void* function_args = nullptr;
     BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = function_args};
     ThreadPoolType type = ThreadPoolType::FlushThreadPool;
-    if (env_->Queue_Length_Quiry(type)>256){
+    // The shards share the pool, every one takes its turns.
+    if (env_->Queue_Length_Quiry(type, this)>256){
       //If there has already be enough compaction scheduled, then drop this one
+      delete thread_pool_args;
+      flushes_in_flight_.fetch_sub(1);
       return;
     }
-    env_->Schedule(BGWork_Flush, static_cast<void*>(thread_pool_args), type);
+    env_->Schedule(BGWork_Flush, static_cast<void*>(thread_pool_args), type,
+                   this, kFlushPriority);
     DEBUG("Schedule a flushing !\n");
   }
+  MaybeScheduleImmutableMerge();
+  MaybeScheduleReplication();
   if (versions_->NeedsCompaction()) {
 //    background_compaction_scheduled_ = true;
-    void* function_args = nullptr;
-    BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = function_args};
-    env_->Schedule(BGWork_Compaction, static_cast<void*>(thread_pool_args), ThreadPoolType::CompactionThreadPool);
-    DEBUG("Schedule a Compaction !\n");
+    ScheduleCompaction();
+  }
+}
+
+void DBImpl::ScheduleCompaction() {
+  // The waiting task picks from the latest version when it runs, a second
+  // one would pick nothing more.
+  int expected = 0;
+  if (!queued_compactions_.compare_exchange_strong(expected, 1)) {
+    return;
   }
+  void* function_args = nullptr;
+  BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = function_args};
+  // The compactions of level 0 go before the deeper ones of the other
+  // shards, the writes of the shard stall on them.
+  env_->Schedule(BGWork_Compaction, static_cast<void*>(thread_pool_args),
+                 ThreadPoolType::CompactionThreadPool, this,
+                 versions_->CompactionLevel() == 0 ? kL0CompactionPriority
+                                                   : kCompactionPriority);
+  DEBUG("Schedule a Compaction !\n");
 }
 
 void DBImpl::BGWork_Flush(void* thread_arg) {
@@ -1184,6 +1939,7 @@ void DBImpl::BGWork_Flush(void* thread_arg) {
 }
 void DBImpl::BGWork_Compaction(void* thread_arg) {
   BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_arg);
+  ((DBImpl*)p->db)->queued_compactions_.fetch_sub(1);
   ((DBImpl*)p->db)->BackgroundCompaction(p->func_args);
   delete static_cast<BGThreadMetadata*>(thread_arg);
 }
@@ -1211,58 +1967,277 @@ void DBImpl::BackgroundFlush(void* p) {
   //Tothink: why there is a Lock, which data structure is this mutex protecting
 //  undefine_mutex.Lock();
 //  assert(background_compaction_scheduled_);
+  bool picked = true;
   if (shutting_down_.load(std::memory_order_acquire)) {
     // No more background work when shutting down.
   } else if (!bg_error_.ok()) {
     // No more background work after a background error.
   } else if (imm_.IsFlushPending()) {
 
-    CompactMemTable();
+    picked = CompactMemTable();
 
     DEBUG_arg("First level's file number is %d", versions_->NumLevelFiles(0));
     DEBUG("Memtable flushed\n");
   }
+  flushes_in_flight_.fetch_sub(1);
 
 //  background_compaction_scheduled_ = false;
 
   // Previous compaction may have produced too many files in a level,
-  // so reschedule another compaction if needed.
-  MaybeScheduleFlushOrCompaction();
+  // so reschedule another compaction if needed. The merge the memtables
+  // waited for schedules the flush once it is installed.
+  if (picked) {
+    MaybeScheduleFlushOrCompaction();
+  }
 //  undefine_mutex.Unlock();
 }
-#ifndef NEARDATACOMPACTION
-void DBImpl::BackgroundCompaction(void* p) {
-  //  write_stall_mutex_.AssertNotHeld();
+void DBImpl::MaybeScheduleImmutableMerge() {
+  // Only the tables the next flush leaves waiting are merged.
+  if (!options_.merge_immutables ||
+      imm_.num_flush_not_started_.load() <
+          options_.max_memtables_per_flush + 2) {
+    return;
+  }
+  bool expected = false;
+  if (!immutable_merge_scheduled_.compare_exchange_strong(expected, true)) {
+    return;
+  }
+  BGThreadMetadata* thread_pool_args =
+      new BGThreadMetadata{.db = this, .func_args = nullptr};
+  env_->Schedule(BGWork_MergeImmutables, static_cast<void*>(thread_pool_args),
+                 ThreadPoolType::FlushThreadPool, this, kFlushPriority);
+}
 
-  if (shutting_down_.load(std::memory_order_acquire)) {
-    // No more background work when shutting down.
-  } else if (!bg_error_.ok()) {
-    // No more background work after a background error.
-  } else if (versions_->NeedsCompaction()) {
-    Compaction* c;
-    bool is_manual = (manual_compaction_ != nullptr);
-    InternalKey manual_end;
-    if (is_manual) {
-      ManualCompaction* m = manual_compaction_;
-      c = versions_->CompactRange(m->level, m->begin, m->end);
-      m->done = (c == nullptr);
-      if (c != nullptr) {
-        manual_end = c->input(0, c->num_input_files(0) - 1)->largest;
-      }
-      Log(options_.info_log,
-          "Manual compaction at level-%d from %s .. %s; will stop at %s\n",
-          m->level, (m->begin ? m->begin->DebugString().c_str() : "(begin)"),
-          (m->end ? m->end->DebugString().c_str() : "(end)"),
-          (m->done ? "(end)" : manual_end.DebugString().c_str()));
-    } else {
-      c = versions_->PickCompaction();
-      //if there is no task to pick up, just return.
-      if (c== nullptr){
-        DEBUG("compaction task executed but not found doable task.\n");
-        delete c;
-        return;
-      }
+void DBImpl::BGWork_MergeImmutables(void* thread_arg) {
+  BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_arg);
+  ((DBImpl*)p->db)->BackgroundMergeImmutables();
+  delete static_cast<BGThreadMetadata*>(thread_arg);
+}
 
+void DBImpl::BackgroundMergeImmutables() {
+  MemTable* newer = nullptr;
+  MemTable* older = nullptr;
+  SequenceNumber smallest_snapshot =
+      snapshots_.Oldest(VisibleSequence());
+  bool picked = false;
+  if (!shutting_down_.load(std::memory_order_acquire) && bg_error_.ok()) {
+    // The flushes pick under FlushPickMTX, the list changes under
+    // superversion_memlist_mtx.
+    std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+    std::unique_lock<std::mutex> l2(FlushPickMTX);
+    picked = imm_.PickMemtablesToMerge(
+        &newer, &older, options_.max_memtables_per_flush,
+        2 * options_.write_buffer_size);
+  }
+  if (picked) {
+    const size_t input_bytes =
+        newer->ApproximateMemoryUsage() + older->ApproximateMemoryUsage();
+    MemTable* merged = MemTable::Merge(newer, older, smallest_snapshot,
+                                       options_.memtable_bloom_bits_per_key);
+    const size_t output_bytes = merged->ApproximateMemoryUsage();
+    {
+      std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+      std::unique_lock<std::mutex> l2(FlushPickMTX);
+      imm_.InstallMergedMemtable(newer, older, merged);
+      InstallSuperVersion();
+    }
+    // One memtable less for the writers stalled on the immutables.
+    write_stall_cv.notify_all();
+    Log(options_.info_log, "Merged two immutables of %zu bytes into %zu bytes",
+        input_bytes, output_bytes);
+  }
+  immutable_merge_scheduled_.store(false);
+  MaybeScheduleFlushOrCompaction();
+}
+
+void DBImpl::MaybeScheduleReplication() {
+  const size_t memory_nodes = env_->rdma_mg->memory_nodes.size();
+  const bool replicate = options_.replicated_levels > 0 && memory_nodes >= 2;
+  const bool encode =
+      options_.erasure_coded_level > 0 && options_.erasure_code_width > 0 &&
+      memory_nodes > static_cast<size_t>(options_.erasure_code_width);
+  if (!replicate && !encode) {
+    return;
+  }
+  bool expected = false;
+  if (!replication_scheduled_.compare_exchange_strong(expected, true)) {
+    return;
+  }
+  BGThreadMetadata* thread_pool_args =
+      new BGThreadMetadata{.db = this, .func_args = nullptr};
+  env_->Schedule(BGWork_Replicate, static_cast<void*>(thread_pool_args),
+                 ThreadPoolType::CompactionThreadPool, this,
+                 kCompactionPriority);
+}
+
+void DBImpl::BGWork_Replicate(void* thread_arg) {
+  BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_arg);
+  ((DBImpl*)p->db)->BackgroundReplicate();
+  delete static_cast<BGThreadMetadata*>(thread_arg);
+}
+
+void DBImpl::BackgroundReplicate() {
+  // The memory nodes are 0, 2, 4 and so on, the copy goes to the next one.
+  const int memory_nodes = static_cast<int>(env_->rdma_mg->memory_nodes.size());
+  const int replicated_levels =
+      memory_nodes >= 2 ? options_.replicated_levels : 0;
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> tables;
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> striped;
+  {
+    std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+    Version* current = versions_->current();
+    for (int level = 0; level < config::kNumLevels; level++) {
+      for (const auto& f : current->files(level)) {
+        if (f->cold_file_id != 0 || f->borrowed ||
+            f->remote_data_mrs.empty()) {
+          continue;
+        }
+        if (level < replicated_levels && f->replica.load() == nullptr) {
+          tables.push_back(f);
+        } else if (options_.erasure_coded_level > 0 &&
+                   level >= options_.erasure_coded_level &&
+                   f->stripe.load() == nullptr) {
+          striped.push_back(f);
+        }
+      }
+    }
+  }
+  size_t copied = 0;
+  uint64_t bytes = 0;
+  for (const auto& f : tables) {
+    if (shutting_down_.load(std::memory_order_acquire)) {
+      break;
+    }
+    const uint8_t node_id = (DataChunkNode(*f) + 2) % (2 * memory_nodes);
+    Status s = ReplicateTable(f.get(), node_id);
+    if (!s.ok()) {
+      Log(options_.info_log, "Replication of table #%llu failed: %s",
+          (unsigned long long)f->number, s.ToString().c_str());
+      break;
+    }
+    copied++;
+    bytes += f->remote_data_mrs.rbegin()->first;
+  }
+  if (copied > 0) {
+    Log(options_.info_log, "Replicated %zu tables of %llu bytes", copied,
+        (unsigned long long)bytes);
+  }
+  if (options_.erasure_coded_level > 0 && options_.erasure_code_width > 0 &&
+      memory_nodes > options_.erasure_code_width) {
+    for (const auto& f : striped) {
+      ParityStripes::Add(f);
+    }
+    // The stripes take the tables of the other shards as well.
+    const int stripes =
+        ParityStripes::Encode(env_->rdma_mg.get(), options_.erasure_code_width);
+    if (stripes > 0) {
+      Log(options_.info_log, "Built the parity of %d stripes", stripes);
+    }
+  }
+  replication_scheduled_.store(false);
+}
+
+Status DBImpl::ReplicateTable(RemoteMemTableMetaData* table, uint8_t node_id) {
+  std::shared_ptr<RDMA_Manager> rdma_mg = env_->rdma_mg;
+  const uint8_t source = DataChunkNode(*table);
+  ibv_mr buffer = {};
+  rdma_mg->Allocate_Local_RDMA_Slot(buffer, FlushBuffer);
+  TableReplica* replica = new TableReplica();
+  replica->node_id = node_id;
+  Status s;
+  for (const auto& chunk : table->remote_data_mrs) {
+    ibv_mr* copy = new ibv_mr();
+    rdma_mg->Allocate_Remote_RDMA_Slot(*copy, node_id, chunk.second->length);
+    copy->length = chunk.second->length;
+    replica->data_mrs.insert({chunk.first, copy});
+    // A chunk larger than the buffer is copied in pieces.
+    for (size_t offset = 0; s.ok() && offset < chunk.second->length;
+         offset += buffer.length) {
+      const size_t size = std::min(buffer.length, chunk.second->length - offset);
+      ibv_mr from = *chunk.second;
+      from.addr = static_cast<char*>(from.addr) + offset;
+      ibv_mr to = *copy;
+      to.addr = static_cast<char*>(to.addr) + offset;
+      // Paced as the writes of the compactions are.
+      if (options_.rate_limiter != nullptr) {
+        options_.rate_limiter->Request(static_cast<int64_t>(size),
+                                       RateLimiter::kLow);
+      }
+      if (options_.rdma_limiter != nullptr) {
+        options_.rdma_limiter->Request(static_cast<int64_t>(size),
+                                       RateLimiter::kLow);
+      }
+      if (rdma_mg->RDMA_Read(&from, &buffer, size, QP_READ_LOCAL,
+                             IBV_SEND_SIGNALED, 1, source) != 0 ||
+          rdma_mg->RDMA_Write(&to, &buffer, size, QP_WRITE_LOCAL_COMPACT,
+                              IBV_SEND_SIGNALED, 1, node_id) != 0) {
+        s = Status::IOError("table copy to the second memory node failed");
+      }
+    }
+    if (!s.ok()) {
+      break;
+    }
+  }
+  rdma_mg->Deallocate_Local_RDMA_Slot(buffer.addr, FlushBuffer);
+  if (!s.ok()) {
+    for (auto& chunk : replica->data_mrs) {
+      rdma_mg->Deallocate_Remote_RDMA_Slot(chunk.second->addr, node_id,
+                                           chunk.second->length);
+      delete chunk.second;
+    }
+    delete replica;
+    return s;
+  }
+  table->replica.store(replica, std::memory_order_release);
+  return s;
+}
+
+#ifndef NEARDATACOMPACTION
+void DBImpl::BackgroundCompaction(void* p) {
+  //  write_stall_mutex_.AssertNotHeld();
+
+  if (shutting_down_.load(std::memory_order_acquire)) {
+    // No more background work when shutting down.
+  } else if (!bg_error_.ok()) {
+    // No more background work after a background error.
+  } else if (versions_->NeedsCompaction()) {
+    // The tables a range tombstone deletes, and with FIFO the expired
+    // ones, are dropped before they are picked for a compaction.
+    DropCoveredFiles();
+    DropExpiredFiles();
+    Compaction* c;
+    bool is_manual = (manual_compaction_ != nullptr);
+    InternalKey manual_end;
+    if (is_manual) {
+      ManualCompaction* m = manual_compaction_;
+      c = versions_->CompactRange(m->level, m->begin, m->end);
+      m->done = (c == nullptr);
+      if (c != nullptr) {
+        manual_end = c->input(0, c->num_input_files(0) - 1)->largest;
+      }
+      Log(options_.info_log,
+          "Manual compaction at level-%d from %s .. %s; will stop at %s\n",
+          m->level, (m->begin ? m->begin->DebugString().c_str() : "(begin)"),
+          (m->end ? m->end->DebugString().c_str() : "(end)"),
+          (m->done ? "(end)" : manual_end.DebugString().c_str()));
+    } else {
+      c = versions_->PickCompaction();
+      //if there is no task to pick up, just return.
+      if (c== nullptr){
+        DEBUG("compaction task executed but not found doable task.\n");
+        delete c;
+        return;
+      }
+      // The files of c are marked as under compaction, the next task can
+      // pick a compaction which does not overlap with it while this one
+      // runs.
+      if (versions_->NeedsCompaction()) {
+        ScheduleCompaction();
+      }
+
+    }
+    if (c != nullptr) {
+      versions_->KeepUntouchedFiles(c);
     }
     //    write_stall_mutex_.AssertNotHeld();
     Status status;
@@ -1344,6 +2319,15 @@ void DBImpl::BackgroundCompaction(void* p) {
 }
 #endif
 #ifdef NEARDATACOMPACTION
+static uint64_t CompactionInputBytes(Compaction* c) {
+  uint64_t bytes = 0;
+  for (int which = 0; which < 2; which++) {
+    for (int i = 0; i < c->num_input_files(which); i++) {
+      bytes += c->input(which, i)->file_size;
+    }
+  }
+  return bytes;
+}
 void DBImpl::BackgroundCompaction(void* p) {
 //  write_stall_mutex_.AssertNotHeld();
 //  assert(false);
@@ -1352,6 +2336,10 @@ void DBImpl::BackgroundCompaction(void* p) {
   } else if (!bg_error_.ok()) {
     // No more background work after a background error.
   } else if (versions_->NeedsCompaction()) {
+    // The tables a range tombstone deletes, and with FIFO the expired
+    // ones, are dropped before they are picked for a compaction.
+    DropCoveredFiles();
+    DropExpiredFiles();
     Compaction* c;
     bool is_manual = (manual_compaction_ != nullptr);
     InternalKey manual_end;
@@ -1375,8 +2363,17 @@ void DBImpl::BackgroundCompaction(void* p) {
         delete c;
         return;
       }
+      // The files of c are marked as under compaction, the next task can
+      // pick a compaction which does not overlap with it while this one
+      // runs.
+      if (versions_->NeedsCompaction()) {
+        ScheduleCompaction();
+      }
 
     }
+    if (c != nullptr) {
+      versions_->KeepUntouchedFiles(c);
+    }
 //    write_stall_mutex_.AssertNotHeld();
     Status status;
     if (c == nullptr) {
@@ -1399,7 +2396,7 @@ void DBImpl::BackgroundCompaction(void* p) {
         f->UnderCompaction = false;
         c->ReleaseInputs();
 #ifdef WITHPERSISTENCE
-        Edit_sync_to_remote(c->edit(),&l_vs);
+        Edit_sync_to_remote(c->edit());
 #endif
 //#ifndef WITHPERSISTENCE
 //        l_vs.unlock();
@@ -1417,13 +2414,15 @@ void DBImpl::BackgroundCompaction(void* p) {
           static_cast<unsigned long long>(f->file_size),
           status.ToString().c_str(), versions_->LevelSummary(&tmp));
       DEBUG("Trival compaction\n");
-    } else if (options_.near_data_compaction) {
-
-      NearDataCompaction(c);
+    } else if (InputsOnShardNode(c) && PlaceCompactionNearData() &&
+               NearDataCompaction(c)) {
+      // Done and timed on the memory node.
 //      MaybeScheduleFlushOrCompaction();
 //      return;
     }else{
       CompactionState* compact = new CompactionState(c);
+      const uint64_t bytes = CompactionInputBytes(c);
+      local_compactions_.fetch_add(1);
 
       auto start = std::chrono::high_resolution_clock::now();
 //      write_stall_mutex_.AssertNotHeld();
@@ -1436,6 +2435,10 @@ void DBImpl::BackgroundCompaction(void* p) {
 
       auto stop = std::chrono::high_resolution_clock::now();
       auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+      local_compactions_.fetch_sub(1);
+      if (status.ok()) {
+        RecordCompactionTime(false, bytes, duration.count());
+      }
       printf("Table compaction time elapse (%ld) us, compaction level is %d, first level file number %d, the second level file number %d \n",
              duration.count(), compact->compaction->level(), compact->compaction->num_input_files(0),compact->compaction->num_input_files(1) );
       DEBUG("Non-trivalcompaction!\n");
@@ -1502,6 +2505,8 @@ Status DBImpl::OpenCompactionOutputFile(SubcompactionState* compact) {
     out.number = file_number;
     out.smallest.Clear();
     out.largest.Clear();
+    out.largest_seq = 0;
+    out.node_id = NextTableNode();
     compact->outputs.push_back(out);
 //    undefine_mutex.Unlock();
   }
@@ -1511,12 +2516,15 @@ Status DBImpl::OpenCompactionOutputFile(SubcompactionState* compact) {
 //  Status s = env_->NewWritableFile(fname, &compact->outfile);
   Status s = Status::OK();
   if (s.ok()) {
+    const uint8_t node_id = compact->outputs.back().node_id;
 #ifndef BYTEADDRESSABLE
     compact->builder = new TableBuilder_ComputeSide(
-        options_, Compact, shard_target_node_id);
+        options_, Compact, node_id, compact->compaction->BloomBits());
 #endif
 #ifdef BYTEADDRESSABLE
-    compact->builder = new TableBuilder_BACS(options_, Compact, shard_target_node_id);
+    compact->builder = new TableBuilder_BACS(
+        options_, Compact, node_id, compact->compaction->level() + 1,
+        compact->compaction->BloomBits());
 #endif
   }
   return s;
@@ -1533,6 +2541,8 @@ Status DBImpl::OpenCompactionOutputFile(CompactionState* compact) {
     out.number = file_number;
     out.smallest.Clear();
     out.largest.Clear();
+    out.largest_seq = 0;
+    out.node_id = NextTableNode();
     compact->outputs.push_back(out);
 //    undefine_mutex.Unlock();
   }
@@ -1542,12 +2552,15 @@ Status DBImpl::OpenCompactionOutputFile(CompactionState* compact) {
 //  Status s = env_->NewWritableFile(fname, &compact->outfile);
   Status s = Status::OK();
   if (s.ok()) {
+    const uint8_t node_id = compact->outputs.back().node_id;
 #ifndef BYTEADDRESSABLE
     compact->builder = new TableBuilder_ComputeSide(
-        options_, Compact, shard_target_node_id);
+        options_, Compact, node_id, compact->compaction->BloomBits());
 #endif
 #ifdef BYTEADDRESSABLE
-    compact->builder = new TableBuilder_BACS(options_, Compact, shard_target_node_id);
+    compact->builder = new TableBuilder_BACS(
+        options_, Compact, node_id, compact->compaction->level() + 1,
+        compact->compaction->BloomBits());
 #endif
   }
   return s;
@@ -1583,6 +2596,10 @@ Status DBImpl::FinishCompactionOutputFile(SubcompactionState* compact,
 #endif
   const uint64_t current_bytes = compact->builder->FileSize();
   compact->current_output()->file_size = current_bytes;
+  compact->current_output()->num_entries = current_entries;
+  compact->current_output()->num_deletions =
+      compact->builder->NumDeletions();
+  compact->current_output()->key_stats = compact->builder->KeyStats();
   assert(file_size == current_bytes);
   compact->total_bytes += current_bytes;
   delete compact->builder;
@@ -1643,6 +2660,10 @@ Status DBImpl::FinishCompactionOutputFile(CompactionState* compact,
 #endif
   const uint64_t current_bytes = compact->builder->FileSize();
   compact->current_output()->file_size = current_bytes;
+  compact->current_output()->num_entries = current_entries;
+  compact->current_output()->num_deletions =
+      compact->builder->NumDeletions();
+  compact->current_output()->key_stats = compact->builder->KeyStats();
   assert(file_size == current_bytes);
   compact->total_bytes += current_bytes;
   delete compact->builder;
@@ -1689,16 +2710,23 @@ Status DBImpl::InstallCompactionResults(CompactionState* compact,
     for (size_t i = 0; i < compact->outputs.size(); i++) {
       const CompactionOutput& out = compact->outputs[i];
       std::shared_ptr<RemoteMemTableMetaData> meta = std::make_shared<RemoteMemTableMetaData>(0,table_cache_,
-                                                   shard_target_node_id);
+                                                   out.node_id);
       //TODO make all the metadata written into out
       meta->number = out.number;
       meta->level = level+1;
       meta->file_size = out.file_size;
+      meta->num_entries = out.num_entries;
+      meta->num_deletions = out.num_deletions;
+      meta->key_stats = out.key_stats;
       meta->smallest = out.smallest;
       meta->largest = out.largest;
+      meta->largest_seq = out.largest_seq;
       meta->remote_data_mrs = out.remote_data_mrs;
       meta->remote_dataindex_mrs = out.remote_dataindex_mrs;
       meta->remote_filter_mrs = out.remote_filter_mrs;
+      meta->prefix_extractor = FilterPrefixName(options_);
+      meta->SetBlobChunks(std::vector<uint64_t>(out.blob_chunks.begin(),
+                                                out.blob_chunks.end()));
       compact->compaction->edit()->AddFile(level + 1, meta);
       assert(!meta->UnderCompaction);
     }
@@ -1707,22 +2735,30 @@ Status DBImpl::InstallCompactionResults(CompactionState* compact,
       for (size_t i = 0; i < subcompact.outputs.size(); i++) {
         const CompactionOutput& out = subcompact.outputs[i];
         std::shared_ptr<RemoteMemTableMetaData> meta =
-            std::make_shared<RemoteMemTableMetaData>(0,table_cache_,shard_target_node_id);
+            std::make_shared<RemoteMemTableMetaData>(0,table_cache_,out.node_id);
         // TODO make all the metadata written into out
         meta->number = out.number;
         meta->file_size = out.file_size;
+        meta->num_entries = out.num_entries;
+        meta->num_deletions = out.num_deletions;
+        meta->key_stats = out.key_stats;
         meta->level = level+1;
         meta->smallest = out.smallest;
         meta->largest = out.largest;
+        meta->largest_seq = out.largest_seq;
         meta->remote_data_mrs = out.remote_data_mrs;
         meta->remote_dataindex_mrs = out.remote_dataindex_mrs;
         meta->remote_filter_mrs = out.remote_filter_mrs;
+        meta->prefix_extractor = FilterPrefixName(options_);
+        meta->SetBlobChunks(std::vector<uint64_t>(out.blob_chunks.begin(),
+                                                  out.blob_chunks.end()));
         compact->compaction->edit()->AddFile(level + 1, meta);
         assert(!meta->UnderCompaction);
       }
     }
   }
   assert(compact->compaction->edit()->GetNewFilesNum() > 0 );
+  OpenNewTables(compact->compaction->edit());
   lck_sv->lock();
 
 //  std::unique_lock<std::mutex> lck_vs(versionset_mtx, std::defer_lock);
@@ -1732,9 +2768,23 @@ Status DBImpl::InstallCompactionResults(CompactionState* compact,
   write_stall_cv.notify_all();
   return s;
 }
+void DBImpl::OpenNewTables(
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables) {
+  if (options_.open_new_tables && !tables.empty()) {
+    table_cache_->OpenTables(tables);
+  }
+}
+void DBImpl::OpenNewTables(VersionEdit* edit) {
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> tables;
+  for (const auto& file : *edit->GetNewFiles()) {
+    tables.push_back(file.second);
+  }
+  OpenNewTables(tables);
+}
 Status DBImpl::TryInstallMemtableFlushResults(
     FlushJob* job, VersionSet* vset,
-    std::shared_ptr<RemoteMemTableMetaData>& sstable, VersionEdit* edit) {
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& sstables,
+    VersionEdit* edit) {
   autovector<MemTable*> mems = job->mem_vec;
   assert(mems.size() >0);
 
@@ -1752,9 +2802,10 @@ Status DBImpl::TryInstallMemtableFlushResults(
       // First mark the flushing is finished in the immutables
       mems[i]->MarkFlushed();
       DEBUG_arg("Memtable %p marked as flushed\n", mems[i]);
-      mems[i]->sstable = sstable;
+      mems[i]->sstables = sstables;
     }
   }
+  OpenNewTables(sstables);
 
 
   // if some other thread is already committing, then return
@@ -1788,8 +2839,10 @@ Status DBImpl::TryInstallMemtableFlushResults(
     if (!m->CheckFlushFinished()) {
       break;
     }
-    assert(m->sstable != nullptr);
-    edit->AddFileIfNotExist(0,m->sstable);
+    assert(!m->sstables.empty());
+    for (const auto& sstable : m->sstables) {
+      edit->AddFileIfNotExist(0, sstable);
+    }
     batch_count++;
   }
   if (batch_count == 0){
@@ -1804,10 +2857,13 @@ Status DBImpl::TryInstallMemtableFlushResults(
   imm_.InstallNewVersion();
   size_t batch_count_for_fetch_sub = batch_count;
   MemTableListVersion* current = imm_.current_.load();
+  // The tables hold every sequence up to the last one of the newest memtable.
+  SequenceNumber flushed_sequence = 0;
   while (batch_count-- > 0) {
     MemTable* m = current->memlist_.back();
+    flushed_sequence = m->Getlargest_seq_supposed();
 
-    assert(m->sstable != nullptr);
+    assert(!m->sstables.empty());
     autovector<MemTable*> dummy_to_delete = autovector<MemTable*>();
     current->Remove(m);
     imm_.UpdateCachedValuesFromMemTableListVersion();
@@ -1826,7 +2882,7 @@ Status DBImpl::TryInstallMemtableFlushResults(
     // Install Superversion will also modify the version reference counter.
 
 #ifdef WITHPERSISTENCE
-    Edit_sync_to_remote(c->edit(),&lck);
+    Edit_sync_to_remote(edit);
 #endif
 //#ifndef WITHPERSISTENCE
 //    lck.unlock();
@@ -1846,6 +2902,13 @@ Status DBImpl::TryInstallMemtableFlushResults(
 
   lck2.unlock();
   job->write_stall_cv_->notify_all();
+  if (s.ok() && remote_log_ != nullptr) {
+    Status log_status = remote_log_->Truncate(flushed_sequence);
+    if (!log_status.ok()) {
+      Log(options_.info_log, "Remote log truncation failed: %s",
+          log_status.ToString().c_str());
+    }
+  }
 
 //  }
 
@@ -1855,7 +2918,7 @@ Status DBImpl::TryInstallMemtableFlushResults(
 //  SuperVersion* sv = GetThreadLocalSuperVersion(db);
 //  sv->Ref();
 //  if (!ReturnThreadLocalSuperVersion(sv)) {
-//    // This Unref() corresponds to the Ref() in GetThreadLocalSuperVersion()
+//    // This Unref() corresponds to the Ref() in PinSuperVersion()
 //    // when the thread-local pointer was populated. So, the Ref() earlier in
 //    // this function still prevents the returned SuperVersion* from being
 //    // deleted out from under the caller.
@@ -1872,111 +2935,763 @@ void DBImpl::CleanupSuperVersion(SuperVersion* sv) {
     }
   }
 }
-bool DBImpl::ReturnThreadLocalSuperVersion(SuperVersion* sv) {
-  assert(sv != nullptr);
-  // Put the SuperVersion back
-  void* expected = SuperVersion::kSVInUse;
-  if (local_sv_->CompareAndSwap(static_cast<void*>(sv), expected)) {
-    // When we see kSVInUse in the ThreadLocal, we are sure ThreadLocal
-    // storage has not been altered and no Scrape has happened. The
-    // SuperVersion is still current.
-    return true;
-  } else {
-    // ThreadLocal scrape happened in the process of this GetImpl call (after
-    // thread local Swap() at the beginning and before CompareAndSwap()).
-    // This means the SuperVersion it holds is obsolete.
-    assert(expected == SuperVersion::kSVObsolete);
+SuperVersionEpochSlot* DBImpl::GetEpochSlot() {
+  auto* slot = static_cast<SuperVersionEpochSlot*>(local_epoch_slot_->Get());
+  if (slot == nullptr) {
+    std::unique_lock<std::mutex> lck(epoch_slots_mtx_);
+    for (auto free_slot : epoch_slots_) {
+      if (!free_slot->in_use) {
+        slot = free_slot;
+        break;
+      }
+    }
+    if (slot == nullptr) {
+      slot = new SuperVersionEpochSlot();
+      epoch_slots_.push_back(slot);
+    }
+    slot->in_use = true;
+    local_epoch_slot_->Reset(slot);
   }
-  return false;
+  return slot;
 }
-
-void DBImpl::ReturnAndCleanupSuperVersion(SuperVersion* sv) {
-  if (!ReturnThreadLocalSuperVersion(sv)) {
-    CleanupSuperVersion(sv);
+WriteLatencySlot* DBImpl::GetWriteLatencySlot() {
+  auto* slot =
+      static_cast<WriteLatencySlot*>(local_write_latency_slot_->Get());
+  if (slot == nullptr) {
+    std::unique_lock<std::mutex> lck(write_latency_slots_mtx_);
+    for (auto free_slot : write_latency_slots_) {
+      if (!free_slot->in_use) {
+        slot = free_slot;
+        break;
+      }
+    }
+    if (slot == nullptr) {
+      slot = new WriteLatencySlot();
+      write_latency_slots_.push_back(slot);
+    }
+    slot->in_use = true;
+    local_write_latency_slot_->Reset(slot);
   }
+  return slot;
 }
-SuperVersion* DBImpl::GetThreadLocalSuperVersion() {
-  // The SuperVersion is cached in thread local storage to avoid acquiring
-  // mutex when SuperVersion does not change since the last use. When a new
-  // SuperVersion is installed, the compaction or flush thread cleans up
-  // cached SuperVersion in all existing thread local storage. To avoid
-  // acquiring mutex for this operation, we use atomic Swap() on the thread
-  // local pointer to guarantee exclusive access. If the thread local pointer
-  // is being used while a new SuperVersion is installed, the cached
-  // SuperVersion can become stale. In that case, the background thread would
-  // have swapped in kSVObsolete. We re-check the value at when returning
-  // SuperVersion back to thread local, with an atomic compare and swap.
-  // The superversion will need to be released if detected to be stale.
-  void* ptr = local_sv_->Swap(SuperVersion::kSVInUse);
-  // Invariant:
-  // (1) Scrape (always) installs kSVObsolete in ThreadLocal storage
-  // (2) the Swap above (always) installs kSVInUse, ThreadLocal storage
-  // should only keep kSVInUse before ReturnThreadLocalSuperVersion call
-  // (if no Scrape happens).
-  assert(ptr != SuperVersion::kSVInUse);
-  SuperVersion* sv = static_cast<SuperVersion*>(ptr);
-  if (sv == SuperVersion::kSVObsolete ||
-      sv->version_number != super_version_number_.load()) {
-    SuperVersion* sv_to_delete = nullptr;
-    // if there is an old superversion unrefer old one and replace it as a new one
-
-    if (sv && sv->Unref()) {
-
-      // NOTE: underlying resources held by superversion (sst files) might
-      // not be released until the next background job.
-      sv->Cleanup();
-      std::unique_lock<std::mutex> lck(superversion_memlist_mtx);
-      sv = super_version->Ref();
-
-    } else {
-      std::unique_lock<std::mutex> lck(superversion_memlist_mtx);
-      sv = super_version->Ref();
+SequenceLease* DBImpl::GetSequenceLease() {
+  auto* lease = static_cast<SequenceLease*>(local_sequence_lease_->Get());
+  if (lease == nullptr) {
+    std::unique_lock<std::mutex> lck(sequence_leases_mtx_);
+    for (auto free_lease : sequence_leases_) {
+      if (!free_lease->in_use) {
+        lease = free_lease;
+        break;
+      }
     }
-
-//    lck.unlock();
+    if (lease == nullptr) {
+      lease = new SequenceLease();
+      sequence_leases_.push_back(lease);
+    }
+    lease->in_use = true;
+    local_sequence_lease_->Reset(lease);
+  }
+  return lease;
+}
+SequenceNumber DBImpl::TakeSequences(size_t n) {
+  const size_t lease_size = options_.sequence_lease_size;
+  // The cut of a sharded DB waits for the sequences taken before it.
+  if (lease_size == 0 || n >= lease_size || write_cut_ != nullptr ||
+      sequencer_ != nullptr) {
+    if (lease_size > 0) {
+      // The next writes of this thread must not go below this one.
+      RetireSequenceLease();
+    }
+    return AssignSequences(n);
+  }
+  SequenceLease* lease = GetSequenceLease();
+  // Only this thread moves "end".
+  const uint64_t end = lease->end.load(std::memory_order_relaxed);
+  uint64_t next = lease->next.load(std::memory_order_relaxed);
+  while (next + n <= end) {
+    if (lease->next.compare_exchange_weak(next, next + n)) {
+      return next;
+    }
+  }
+  if (next < end) {
+    // Too few for the batch, the rest is skipped and the lease refilled.
+    RetireSequenceLease();
+  }
+  std::lock_guard<std::mutex> l(lease->mutex);
+  const uint64_t first = versions_->AssignSequnceNumbers(lease_size);
+  lease->end.store(first + lease_size);
+  lease->next.store(first + n);
+  return first;
+}
+SequenceNumber DBImpl::AssignSequences(size_t n) {
+  if (sequencer_ == nullptr) {
+    return versions_->AssignSequnceNumbers(n);
+  }
+  std::lock_guard<std::mutex> l(sequencer_mtx_);
+  // No other writer of this node takes sequences meanwhile.
+  const SequenceNumber next = versions_->LastSequence();
+  SequenceNumber first;
+  Status s = sequencer_->Reserve(n, &first);
+  if (s.ok() && first < next) {
+    // The counter is behind this node, which wrote before it opened the
+    // sequencer or before the memory node restarted. It is moved past the
+    // sequences of this node, the other nodes skip the ones it hands out.
+    SequenceNumber behind;
+    s = sequencer_->Reserve(next - first, &behind);
+    if (s.ok()) {
+      s = sequencer_->Reserve(n, &first);
+    }
+  }
+  if (!s.ok()) {
+    // Ordered by this node only, as without the sequencer.
+    Log(options_.info_log, "Shard %d sequencer: %s", shard_id,
+        s.ToString().c_str());
+    return versions_->AssignSequnceNumbers(n);
+  }
+  std::unique_lock<std::mutex> lck(superversion_memlist_mtx);
+  versions_->AssignSequnceNumbers(first + n - next);
+  if (first > next) {
+    // Taken by the other compute nodes writing the shard.
+    SkipSequences(next, first - 1);
+  }
+  return first;
+}
+void DBImpl::RetireSequenceLease() {
+  auto* lease = static_cast<SequenceLease*>(local_sequence_lease_->Get());
+  if (lease == nullptr) {
+    return;
+  }
+  const uint64_t end = lease->end.load(std::memory_order_relaxed);
+  if (lease->next.load(std::memory_order_relaxed) >= end) {
+    return;
+  }
+  // The same order as the memtable switch, which claims the leases.
+  std::unique_lock<std::mutex> lck(superversion_memlist_mtx);
+  std::lock_guard<std::mutex> l(lease->mutex);
+  const uint64_t next = lease->next.exchange(end);
+  if (next < end) {
+    SkipSequences(next, end - 1);
+  }
+}
+void DBImpl::ClaimSequenceLeases(
+    std::vector<std::pair<uint64_t, uint64_t>>* unused) {
+  std::unique_lock<std::mutex> lck(sequence_leases_mtx_);
+  for (auto lease : sequence_leases_) {
+    std::lock_guard<std::mutex> l(lease->mutex);
+    const uint64_t end = lease->end.load();
+    const uint64_t next = lease->next.exchange(end);
+    if (next < end) {
+      unused->emplace_back(next, end - 1);
+    }
+  }
+}
+void DBImpl::SkipSequences(uint64_t first, uint64_t last) {
+  MemTable* mem = mem_.load();
+  const uint64_t mem_last = mem->Getlargest_seq_supposed();
+  if (last > mem_last) {
+    skipped_sequences_.emplace_back(std::max(first, mem_last + 1), last);
+    if (first > mem_last) {
+      return;
+    }
+    last = mem_last;
+  }
+  while (first <= last) {
+    MemTable* owner = first >= mem->GetFirstseq()
+                          ? mem
+                          : imm_.PickMemtablesSeqBelong(first);
+    assert(owner != nullptr);
+    if (owner == nullptr) {
+      return;
+    }
+    const uint64_t owner_last =
+        std::min<uint64_t>(last, owner->Getlargest_seq_supposed());
+    owner->increase_seq_count(owner_last - first + 1);
+    first = owner_last + 1;
+  }
+}
+SequenceNumber DBImpl::VisibleSequence() {
+  SequenceNumber visible = versions_->LastSequence();
+  if (options_.sequence_lease_size == 0) {
+    return visible;
+  }
+  // A lease taken after the counter is read starts after it. A lease being
+  // refilled still shows its old "next", which is before the new one.
+  std::unique_lock<std::mutex> lck(sequence_leases_mtx_);
+  for (auto lease : sequence_leases_) {
+    const uint64_t next = lease->next.load();
+    if (next < lease->end.load()) {
+      visible = std::min<SequenceNumber>(visible, next - 1);
+    }
+  }
+  return visible;
+}
+void DBImpl::MergeWriteLatency(Histogram* histograms) {
+  std::unique_lock<std::mutex> lck(write_latency_slots_mtx_);
+  for (auto slot : write_latency_slots_) {
+    std::unique_lock<std::mutex> slot_lck(slot->mutex);
+    for (int i = 0; i < WriteLatencySlot::kNumPhases; i++) {
+      histograms[i].Merge(slot->histograms[i]);
+    }
+  }
+}
+std::string DBImpl::WriteLatencyString(const Histogram* histograms) {
+  static const char* const kPhaseNames[WriteLatencySlot::kNumPhases] = {
+      "sequence assignment", "memtable pickup", "stall", "memtable insert"};
+  std::string result;
+  for (int i = 0; i < WriteLatencySlot::kNumPhases; i++) {
+    result.append("Write ");
+    result.append(kPhaseNames[i]);
+    result.append(" (micros):\n");
+    result.append(histograms[i].ToString());
+  }
+  return result;
+}
+void DBImpl::AddCompactionStats(int level, const CompactionStats& stats) {
+  std::unique_lock<std::mutex> lck(stats_mtx_);
+  stats_[level].Add(stats);
+}
+void DBImpl::AddStats(std::map<std::string, uint64_t>* stats) {
+  CompactionStats levels[config::kNumLevels];
+  {
+    std::unique_lock<std::mutex> lck(stats_mtx_);
+    for (int level = 0; level < config::kNumLevels; level++) {
+      levels[level] = stats_[level];
+    }
+  }
+  // The flushes write into level 0 and read nothing.
+  (*stats)["flush.count"] += levels[0].count;
+  (*stats)["flush.bytes"] += levels[0].bytes_written;
+  (*stats)["flush.micros"] += levels[0].micros;
+  for (int level = 0; level < config::kNumLevels; level++) {
+    std::string prefix = "level" + std::to_string(level) + ".";
+    (*stats)[prefix + "files"] += versions_->NumLevelFiles(level);
+    (*stats)[prefix + "bytes"] += versions_->NumLevelBytes(level);
+    if (level == 0) {
+      continue;
+    }
+    (*stats)[prefix + "compactions"] += levels[level].count;
+    (*stats)[prefix + "remote_compactions"] += levels[level].remote_count;
+    (*stats)[prefix + "remote_compaction_queue_micros"] +=
+        levels[level].remote_queue_micros;
+    (*stats)[prefix + "compaction_micros"] += levels[level].micros;
+    (*stats)[prefix + "compaction_bytes_read"] += levels[level].bytes_read;
+    (*stats)[prefix + "compaction_bytes_written"] +=
+        levels[level].bytes_written;
+  }
+  WriteController::Stats stalls = write_controller_.GetStats();
+  (*stats)["stall.delayed_writes"] += stalls.delayed_writes;
+  (*stats)["stall.delay_micros"] += stalls.delay_micros;
+  (*stats)["stall.stops"] += stalls.stops;
+  (*stats)["stall.stop_micros"] += stalls.stop_micros;
+  (*stats)["stall.quota_micros"] += quota_stall_micros_.load();
+  (*stats)["write.user_bytes"] += user_bytes_written_.load();
+  (*stats)["compaction.pending_bytes"] += versions_->PendingCompactionBytes();
+}
+void DBImpl::AddCompactionDebt(const std::string& prefix,
+                               std::map<std::string, uint64_t>* stats) {
+  uint64_t flush_bytes;
+  uint64_t compaction_bytes = 0;
+  {
+    std::unique_lock<std::mutex> lck(stats_mtx_);
+    flush_bytes = stats_[0].bytes_written;
+    for (int level = 1; level < config::kNumLevels; level++) {
+      compaction_bytes += stats_[level].bytes_written;
+    }
+  }
+  SampleCompactionDebt();
+  (*stats)[prefix + "pending_compaction_bytes"] =
+      versions_->PendingCompactionBytes();
+  (*stats)[prefix + "level0_files"] = versions_->NumStallFiles();
+  (*stats)[prefix + "user_bytes"] = user_bytes_written_.load();
+  (*stats)[prefix + "flush_bytes"] = flush_bytes;
+  (*stats)[prefix + "compaction_bytes"] = compaction_bytes;
+  (*stats)[prefix + "time_to_stall_micros"] = TimeToStall();
+}
+void DBImpl::SampleCompactionDebt() {
+  std::unique_lock<std::mutex> lck(debt_mtx_, std::try_to_lock);
+  const uint64_t now = env_->NowMicros();
+  if (!lck.owns_lock() || now - debt_sample_micros_ < kDebtSampleMicros) {
+    return;
+  }
+  const int files = versions_->NumStallFiles();
+  const uint64_t bytes = versions_->PendingCompactionBytes();
+  if (debt_sample_micros_ > 0) {
+    const double seconds = (now - debt_sample_micros_) / 1e6;
+    const double file_rate = (files - debt_sample_files_) / seconds;
+    const double bytes_rate =
+        (static_cast<double>(bytes) - debt_sample_bytes_) / seconds;
+    level0_file_rate_ += kDebtRateWeight * (file_rate - level0_file_rate_);
+    pending_bytes_rate_ += kDebtRateWeight * (bytes_rate - pending_bytes_rate_);
+  }
+  debt_sample_micros_ = now;
+  debt_sample_files_ = files;
+  debt_sample_bytes_ = bytes;
+}
+uint64_t DBImpl::TimeToStall() {
+  // The shortest of the times, negative until one is found.
+  double seconds = -1;
+  auto until = [&](double left, double rate) {
+    if (left <= 0) {
+      seconds = 0;
+    } else if (rate > 0 && (seconds < 0 || left / rate < seconds)) {
+      seconds = left / rate;
+    }
+  };
+  std::unique_lock<std::mutex> lck(debt_mtx_);
+  if (options_.compaction_style != kCompactionStyleFIFO) {
+    until(config::kL0_StopWritesTrigger - versions_->NumStallFiles(),
+          level0_file_rate_);
+  }
+  const uint64_t hard_limit = options_.hard_pending_compaction_bytes_limit;
+  if (hard_limit > 0) {
+    until(static_cast<double>(hard_limit) - versions_->PendingCompactionBytes(),
+          pending_bytes_rate_);
+  }
+  if (seconds < 0) {
+    return UINT64_MAX;
+  }
+  return static_cast<uint64_t>(std::min(seconds * 1e6, 1e18));
+}
+void DBImpl::AddProcessStats(std::map<std::string, uint64_t>* stats) {
+  for (uint32_t i = 0; i < kNumTickers; i++) {
+    (*stats)[kTickerNames[i]] += GetTickerCount(static_cast<Ticker>(i));
+  }
+}
+std::string DBImpl::StatsString(const std::map<std::string, uint64_t>& stats) {
+  auto get = [&stats](const std::string& name) -> uint64_t {
+    auto iter = stats.find(name);
+    return iter == stats.end() ? 0 : iter->second;
+  };
+  std::string result;
+  char buf[200];
+  std::snprintf(buf, sizeof(buf),
+                "Flushes: %llu, %.1f MB in %.3f sec\n",
+                static_cast<unsigned long long>(get("flush.count")),
+                get("flush.bytes") / 1048576.0, get("flush.micros") / 1e6);
+  result.append(buf);
+  std::snprintf(buf, sizeof(buf),
+                "                                      Compactions\n"
+                "Level  Files Size(MB)  Count Remote Time(sec) Read(MB) "
+                "Write(MB)\n"
+                "--------------------------------------------------------"
+                "--------\n");
+  result.append(buf);
+  for (int level = 0; level < config::kNumLevels; level++) {
+    std::string prefix = "level" + std::to_string(level) + ".";
+    uint64_t files = get(prefix + "files");
+    uint64_t compactions = get(prefix + "compactions");
+    if (files == 0 && compactions == 0) {
+      continue;
+    }
+    std::snprintf(buf, sizeof(buf),
+                  "%3d %8llu %8.0f %6llu %6llu %9.0f %8.0f %9.0f\n", level,
+                  static_cast<unsigned long long>(files),
+                  get(prefix + "bytes") / 1048576.0,
+                  static_cast<unsigned long long>(compactions),
+                  static_cast<unsigned long long>(
+                      get(prefix + "remote_compactions")),
+                  get(prefix + "compaction_micros") / 1e6,
+                  get(prefix + "compaction_bytes_read") / 1048576.0,
+                  get(prefix + "compaction_bytes_written") / 1048576.0);
+    result.append(buf);
+  }
+  uint64_t written = get("flush.bytes");
+  for (int level = 1; level < config::kNumLevels; level++) {
+    written += get("level" + std::to_string(level) +
+                   ".compaction_bytes_written");
   }
+  const uint64_t user_bytes = get("write.user_bytes");
+  std::snprintf(buf, sizeof(buf),
+                "Write amplification: %.2f of %.1f MB written, pending "
+                "compactions: %.1f MB\n",
+                user_bytes == 0 ? 0.0
+                                : static_cast<double>(written) / user_bytes,
+                user_bytes / 1048576.0,
+                get("compaction.pending_bytes") / 1048576.0);
+  result.append(buf);
+  std::snprintf(buf, sizeof(buf),
+                "Write stalls: delayed %llu writes for %.3f sec, stopped "
+                "%llu writes for %.3f sec, waited %.3f sec for the quota\n",
+                static_cast<unsigned long long>(get("stall.delayed_writes")),
+                get("stall.delay_micros") / 1e6,
+                static_cast<unsigned long long>(get("stall.stops")),
+                get("stall.stop_micros") / 1e6,
+                get("stall.quota_micros") / 1e6);
+  result.append(buf);
+  std::snprintf(buf, sizeof(buf),
+                "Bloom filter: checked %llu, useful %llu, false positive "
+                "%llu\n",
+                static_cast<unsigned long long>(get("bloom.checked")),
+                static_cast<unsigned long long>(get("bloom.useful")),
+                static_cast<unsigned long long>(get("bloom.false_positive")));
+  result.append(buf);
+  std::snprintf(buf, sizeof(buf),
+                "Block cache: hit %llu, miss %llu; table cache: hit %llu, "
+                "miss %llu\n",
+                static_cast<unsigned long long>(get("block_cache.hit")),
+                static_cast<unsigned long long>(get("block_cache.miss")),
+                static_cast<unsigned long long>(get("table_cache.hit")),
+                static_cast<unsigned long long>(get("table_cache.miss")));
+  result.append(buf);
+  return result;
+}
+SuperVersion* DBImpl::PinSuperVersion() {
+  // The reader announces the epoch it starts in before it loads the pointer.
+  // A writer which swaps the pointer afterwards keeps the reference of the
+  // old SuperVersion until this slot is unpinned or has moved past the swap,
+  // so the SuperVersion stays alive without the reader touching its
+  // reference count or any mutex. The store and the load must not be
+  // reordered: the writer must not see the slot unpinned while the reader
+  // loads the old pointer.
+  SuperVersionEpochSlot* slot = GetEpochSlot();
+  assert(slot->epoch.load(std::memory_order_relaxed) == 0);
+  slot->epoch.store(super_version_epoch_.load(std::memory_order_acquire));
+  SuperVersion* sv = super_version.load();
   assert(sv != nullptr);
   return sv;
 }
-
-
-
+void DBImpl::UnpinSuperVersion(SuperVersion* sv) {
+  assert(sv != nullptr);
+  (void)sv;
+  auto* slot = static_cast<SuperVersionEpochSlot*>(local_epoch_slot_->Get());
+  assert(slot != nullptr && slot->epoch.load(std::memory_order_relaxed) != 0);
+  slot->epoch.store(0, std::memory_order_release);
+}
+void DBImpl::ReclaimSuperVersions(bool all) {
+  uint64_t min_pinned = std::numeric_limits<uint64_t>::max();
+  if (!all) {
+    std::unique_lock<std::mutex> lck(epoch_slots_mtx_);
+    for (auto slot : epoch_slots_) {
+      uint64_t epoch = slot->epoch.load();
+      if (epoch != 0 && epoch < min_pinned) {
+        min_pinned = epoch;
+      }
+    }
+  }
+  std::vector<SuperVersion*> to_release;
+  {
+    std::unique_lock<std::mutex> lck(retired_sv_mtx_);
+    size_t kept = 0;
+    for (auto& retired : retired_svs_) {
+      // A reader pinned at epoch e may hold the SuperVersions retired at an
+      // epoch above e only.
+      if (retired.first <= min_pinned) {
+        to_release.push_back(retired.second);
+      } else {
+        retired_svs_[kept++] = retired;
+      }
+    }
+    retired_svs_.resize(kept);
+  }
+  for (auto sv : to_release) {
+    CleanupSuperVersion(sv);
+  }
+}
 
 void DBImpl::InstallSuperVersion() {
-  SuperVersion* old_superversion = super_version;
   // need to be protected by a versionset mutex. or make the refs an atomic value.
-  super_version = new SuperVersion(mem_, imm_.current(), versions_->current());
-  super_version->Ref();
-  ++super_version_number_;
-  super_version->version_number = super_version_number_;
+  SuperVersion* new_superversion =
+      new SuperVersion(mem_, imm_.current(), versions_->current());
+  new_superversion->Ref();
+  new_superversion->version_number = ++super_version_number_;
+  SuperVersion* old_superversion = super_version.exchange(new_superversion);
   if (old_superversion != nullptr) {
-    // Reset SuperVersions cached in thread local storage.
-    // This should be done before old_superversion->Unref(). That's to ensure
-    // that local_sv_ never holds the last reference to SuperVersion, since
-    // it has no means to safely do SuperVersion cleanup.
-    ResetThreadLocalSuperVersions();
-
-    if (old_superversion->Unref()) {
-      old_superversion->Cleanup();
+    // The readers pinned from now on see the new SuperVersion, the ones
+    // pinned before may still use the old one.
+    uint64_t retire_epoch = super_version_epoch_.fetch_add(1) + 1;
+    {
+      std::unique_lock<std::mutex> lck(retired_sv_mtx_);
+      retired_svs_.emplace_back(retire_epoch, old_superversion);
+    }
+    ReclaimSuperVersions(false);
+  }
+}
+void DBImpl::UpdateHotFiles() {
+  std::vector<std::pair<uint32_t, std::shared_ptr<RemoteMemTableMetaData>>>
+      hot_files;
+  SuperVersion* sv = PinSuperVersion();
+  for (int level = 0; level < config::kNumLevels; level++) {
+    for (const auto& f : sv->current->files(level)) {
+      uint32_t frequency = read_sketch_.Estimate(HotFileKey(*f));
+      if (frequency >= kMinHotFileFrequency) {
+        hot_files.emplace_back(frequency, f);
+      }
+    }
+  }
+  UnpinSuperVersion(sv);
+  if (hot_files.size() > kMaxHotFiles) {
+    std::nth_element(
+        hot_files.begin(), hot_files.begin() + kMaxHotFiles, hot_files.end(),
+        [](const std::pair<uint32_t, std::shared_ptr<RemoteMemTableMetaData>>& a,
+           const std::pair<uint32_t, std::shared_ptr<RemoteMemTableMetaData>>& b) {
+          return a.first > b.first;
+        });
+    hot_files.resize(kMaxHotFiles);
+  }
+  // Pinned outside of any DB mutex, a table which is not cached yet is read
+  // here.
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> files;
+  std::vector<std::tuple<uint64_t, uint8_t, uint32_t>> reported;
+  for (const auto& hot_file : hot_files) {
+    files.push_back(hot_file.second);
+    reported.emplace_back(hot_file.second->number,
+                          hot_file.second->creator_node_id, hot_file.first);
+  }
+  table_cache_->PinTables(files);
+  {
+    std::unique_lock<std::mutex> lck(hot_files_mtx_);
+    hot_files_.swap(reported);
+  }
+  size_t promotions = 0;
+  for (const auto& hot_file : hot_files) {
+    if (promotions == kMaxPromotionsPerFlush) {
+      break;
+    }
+    if (hot_file.first >= kMinPromoteFrequency &&
+        hot_file.second->cold_file_id != 0 &&
+        PromoteColdFile(hot_file.second)) {
+      promotions++;
     }
   }
 }
-void DBImpl::NearDataCompaction(Compaction* c) {
+bool DBImpl::PromoteColdFile(const std::shared_ptr<RemoteMemTableMetaData>& f) {
+  auto in_current = [this, &f]() {
+    for (const auto& current : versions_->current()->files(f->level)) {
+      if (current == f) {
+        return true;
+      }
+    }
+    return false;
+  };
+  {
+    std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+    if (f->UnderCompaction || !in_current()) {
+      return false;
+    }
+    // Kept out of the compactions while it is loaded.
+    f->UnderCompaction = true;
+  }
   std::shared_ptr<RDMA_Manager> rdma_mg = env_->rdma_mg;
-  // register the memory block from the remote memory
-  RDMA_Request* send_pointer;
-  ibv_mr send_mr = {};
-  ibv_mr mr_c = {};
-//  ibv_mr recv_mr_c = {};
-  ibv_mr receive_mr = {};
-  rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
-  rdma_mg->Allocate_Local_RDMA_Slot(mr_c, Version_edit);
-//  rdma_mg->Allocate_Local_RDMA_Slot(recv_mr_c, Version_edit);
-  rdma_mg->Allocate_Local_RDMA_Slot(receive_mr, Message);
-  std::string serilized_c;
+  ibv_mr edit_mr = {};
+  rdma_mg->Allocate_Local_RDMA_Slot(edit_mr, Version_edit);
+  size_t edit_size = rdma_mg->Remote_Promote_SSTable(
+      f->cold_file_id, f->level, &edit_mr, f->shard_target_node_id);
+  std::shared_ptr<RemoteMemTableMetaData> promoted;
+  if (edit_size > 0) {
+    VersionEdit loaded(0);
+    loaded.DecodeFrom(Slice((char*)edit_mr.addr, edit_size), 0, table_cache_);
+    assert(loaded.GetNewFilesNum() == 1);
+    promoted = loaded.GetNewFiles()->begin()->second;
+  }
+  rdma_mg->Deallocate_Local_RDMA_Slot(edit_mr.addr, Version_edit);
+  std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+  if (promoted == nullptr || !in_current()) {
+    // A promoted table nobody installs frees its chunks when it is dropped.
+    f->UnderCompaction = false;
+    return false;
+  }
+  promoted->level = f->level;
+  promoted->file_size = f->file_size;
+  promoted->smallest = f->smallest;
+  promoted->largest = f->largest;
+  promoted->largest_seq = f->largest_seq;
+  promoted->num_entries = f->num_entries;
+  promoted->num_deletions = f->num_deletions;
+  promoted->key_stats = f->key_stats;
+  promoted->creation_time = f->creation_time;
+  promoted->prefix_extractor = f->prefix_extractor;
+  promoted->SetBlobChunks(f->blob_chunks);
+  // A new number, the builder would otherwise take the table for the
+  // removed one.
+  promoted->number = versions_->NewFileNumber();
+  VersionEdit edit(0);
+  edit.RemoveFile(f->level, f->number, f->creator_node_id);
+  edit.AddFile(f->level, promoted);
+  Status s = versions_->LogAndApply(&edit);
+#ifdef WITHPERSISTENCE
+  Edit_sync_to_remote(&edit);
+#endif
+  InstallSuperVersion();
+  if (!s.ok()) {
+    RecordBackgroundError(s);
+    return false;
+  }
+  return true;
+}
+double DBImpl::WritePressure() {
+  // Every signal maps to a pressure in [0, 1], 1 where the writes would
+  // stop.
+  double pressure = 0;
+  const int level0_filenum = versions_->NumStallFiles();
+  if (level0_filenum > config::kL0_SlowdownWritesTrigger) {
+    pressure = std::max(
+        pressure,
+        static_cast<double>(level0_filenum - config::kL0_SlowdownWritesTrigger) /
+            (config::kL0_StopWritesTrigger - config::kL0_SlowdownWritesTrigger));
+  }
+  SampleCompactionDebt();
+  const uint64_t soft_limit = options_.soft_pending_compaction_bytes_limit;
+  const uint64_t hard_limit = options_.hard_pending_compaction_bytes_limit;
+  const uint64_t pending_bytes = versions_->PendingCompactionBytes();
+  if (soft_limit > 0 && pending_bytes > soft_limit) {
+    pressure = std::max(
+        pressure,
+        hard_limit > soft_limit
+            ? static_cast<double>(pending_bytes - soft_limit) /
+                  (hard_limit - soft_limit)
+            : 1.0);
+  }
+  const int imm_slowdown = config::Immutable_StopWritesTrigger / 2;
+  const int imm_num = static_cast<int>(imm_.current_memtable_num());
+  if (imm_num > imm_slowdown) {
+    pressure = std::max(
+        pressure, static_cast<double>(imm_num - imm_slowdown) /
+                      (config::Immutable_StopWritesTrigger - imm_slowdown));
+  }
+  Memory_Node_Status status;
+  if (env_->rdma_mg->Get_Memory_Node_Status(
+          shard_target_node_id, kMemoryNodeStatusLifetimeMicros, &status)) {
+    if (status.free_bytes < kMemoryNodeLowFreeBytes) {
+      pressure = std::max(
+          pressure, 1.0 - static_cast<double>(status.free_bytes) /
+                              kMemoryNodeLowFreeBytes);
+    }
+    // The memory node runs max_background_compactions compactions at once,
+    // as this node does; more than four times as many queued is full
+    // pressure.
+    const uint32_t threads =
+        static_cast<uint32_t>(std::max(options_.max_background_compactions, 1));
+    if (status.compaction_queue > threads) {
+      pressure = std::max(pressure,
+                          static_cast<double>(status.compaction_queue - threads) /
+                              (3 * threads));
+    }
+    if (status.persistence_lag > kPersistenceLagSlowdown) {
+      pressure = std::max(
+          pressure,
+          static_cast<double>(status.persistence_lag - kPersistenceLagSlowdown) /
+              kPersistenceLagSlowdown);
+    }
+  }
+  return std::min(pressure, 1.0);
+}
+bool DBImpl::InputsOnShardNode(Compaction* c) {
+  for (int which = 0; which < 2; which++) {
+    for (const auto& f : c->inputs_[which]) {
+      if (f->shard_target_node_id != shard_target_node_id) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+uint8_t DBImpl::NextTableNode() {
+  const uint32_t memory_nodes =
+      static_cast<uint32_t>(env_->rdma_mg->memory_nodes.size());
+  if (!options_.stripe_tables || options_.min_blob_size > 0 ||
+      memory_nodes < 2) {
+    return shard_target_node_id;
+  }
+  // The memory nodes are 0, 2, 4 and so on, starting from the one of the
+  // shard.
+  const uint32_t turn = tables_placed_.fetch_add(1) % memory_nodes;
+  return static_cast<uint8_t>((shard_target_node_id + 2 * turn) %
+                              (2 * memory_nodes));
+}
+bool DBImpl::PlaceCompactionNearData() {
+  if (!options_.near_data_compaction) {
+    return false;
+  }
+  // The memory node runs its compactions on max_background_compactions
+  // threads, as this node does.
+  const uint32_t threads =
+      static_cast<uint32_t>(std::max(options_.max_background_compactions, 1));
+  // The status the memory node publishes is the freshest, the count it sends
+  // back with the compaction results the fallback.
+  uint32_t queue;
+  uint32_t memory_node_busy = 0;
+  Memory_Node_Status status;
+  if (env_->rdma_mg->Get_Memory_Node_Status(
+          shard_target_node_id, kMemoryNodeStatusLifetimeMicros, &status)) {
+    queue = status.compaction_queue;
+    memory_node_busy = status.cpu_busy_percent;
+  } else if (env_->NowMicros() - memory_node_load_micros_.load() <=
+             kMemoryNodeLoadLifetimeMicros) {
+    queue = memory_node_compaction_load_.load();
+  } else {
+    // Without newer reports the memory node may have drained since.
+    return true;
+  }
+  if (queue < threads && memory_node_busy < kBusyCpuPercent) {
+    return true;
+  }
+  if (local_compactions_.load() >= static_cast<int>(threads) ||
+      cpu_load_.BusyPercent() >= kBusyCpuPercent) {
+    return true;
+  }
+  // Both placements are timed end to end, so the RDMA traffic of running it
+  // here weighs against the queue of the memory node. Untimed, or timed long
+  // ago, it runs here to be timed.
+  const uint64_t near_data = near_data_micros_per_mb_.load();
+  const uint64_t local = local_micros_per_mb_.load();
+  if (near_data == 0 || local == 0 ||
+      env_->NowMicros() - local_timed_micros_.load() >
+          kLocalCompactionTimingLifetimeMicros) {
+    return false;
+  }
+  return near_data <= local;
+}
+
+void DBImpl::RecordCompactionTime(bool near_data, uint64_t bytes,
+                                  uint64_t micros) {
+  if (bytes == 0) {
+    return;
+  }
+  const uint64_t sample = std::max<uint64_t>(
+      static_cast<uint64_t>(static_cast<double>(micros) * (1 << 20) / bytes),
+      1);
+  std::atomic<uint64_t>& average =
+      near_data ? near_data_micros_per_mb_ : local_micros_per_mb_;
+  const uint64_t old = average.load();
+  average.store(old == 0 ? sample : (3 * old + sample) / 4);
+  if (!near_data) {
+    local_timed_micros_.store(env_->NowMicros());
+  }
+}
+
+bool DBImpl::NearDataCompaction(Compaction* c) {
+  std::shared_ptr<RDMA_Manager> rdma_mg = env_->rdma_mg;
+  const uint64_t start_micros = env_->NowMicros();
+  // Until the request is sent, the memory node goes on with the flow.
+  TimelineScope timeline("compaction_dispatch", shard_id, c->JobId(),
+                         Timeline::kFlowStart);
+  // register the memory block from the remote memory
+  RDMA_Request* send_pointer;
+  ibv_mr send_mr = {};
+  ibv_mr mr_c = {};
+//  ibv_mr recv_mr_c = {};
+  ibv_mr receive_mr = {};
+  rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+  rdma_mg->Allocate_Local_RDMA_Slot(mr_c, Version_edit);
+//  rdma_mg->Allocate_Local_RDMA_Slot(recv_mr_c, Version_edit);
+  rdma_mg->Allocate_Local_RDMA_Slot(receive_mr, Message);
+  std::string serilized_c;
   DEBUG_arg("Compaction decoded, the first input file number is %lu \n", c->inputs_[0][0]->number);
   DEBUG_arg("Compaction decoded, input file level is %d \n", c->level());
+  // The memory node drops the versions no snapshot of this node reads.
+  c->set_smallest_snapshot(snapshots_.Oldest(VisibleSequence()));
   c->EncodeTo(&serilized_c);
+  // The output comes back with the version edit, see
+  // install_version_edit_handler().
+  CompactionStats stats;
+  for (int which = 0; which < 2; which++) {
+    for (int i = 0; i < c->num_input_files(which); i++) {
+      stats.bytes_read += c->input(which, i)->file_size;
+    }
+  }
+  stats.count = 1;
+  stats.remote_count = 1;
+  timeline.set_bytes(stats.bytes_read);
   //TODO: remove the code in the bracket.
 //  {Compaction cn(&options_);
 //  cn.DecodeFrom(Slice(serilized_c), 0);
@@ -1992,6 +3707,13 @@ void DBImpl::NearDataCompaction(Compaction* c) {
   send_pointer = (RDMA_Request*)send_mr.addr;
   send_pointer->command = near_data_compaction;
   send_pointer->content.sstCompact.buffer_size = serilized_c.size() + 1;
+  send_pointer->content.sstCompact.level = c->level();
+  send_pointer->content.sstCompact.shard_id = shard_id;
+  send_pointer->content.sstCompact.weight =
+      static_cast<uint8_t>(std::min(std::max(options_.compaction_share, 1), 255));
+  send_pointer->content.sstCompact.stalled =
+      c->level() == 0 &&
+      versions_->NumStallFiles() > config::kL0_SlowdownWritesTrigger;
   send_pointer->buffer = receive_mr.addr;
   send_pointer->rkey = receive_mr.rkey;
   send_pointer->buffer_large = mr_c.addr;
@@ -2019,7 +3741,7 @@ void DBImpl::NearDataCompaction(Compaction* c) {
   if (rdma_mg->poll_completion(wc, 1, std::string("main"), true,
                                shard_target_node_id)){
     fprintf(stderr, "failed to poll send for remote memory register\n");
-    return;
+    return true;
   }
 #ifdef WITHPERSISTENCE
 
@@ -2117,6 +3839,21 @@ void DBImpl::NearDataCompaction(Compaction* c) {
   assert(*((unsigned char*)mr_c.addr + buffer_size - 1) == 1);
   assert(*imme_data == 0);
   lck.unlock();
+  // The edit is followed by the compaction load of the memory node, the
+  // time the compaction waited there for a thread, whether it was handed
+  // back and the flag byte.
+  assert(buffer_size > 3 * sizeof(uint32_t) + 1);
+  size_t edit_size = buffer_size - 1 - 3 * sizeof(uint32_t);
+  memory_node_compaction_load_.store(
+      DecodeFixed32((char*)mr_c.addr + edit_size));
+  memory_node_load_micros_.store(env_->NowMicros());
+  const bool handed_back =
+      DecodeFixed32((char*)mr_c.addr + edit_size + 2 * sizeof(uint32_t)) != 0;
+  if (!handed_back) {
+    stats.remote_queue_micros =
+        DecodeFixed32((char*)mr_c.addr + edit_size + sizeof(uint32_t));
+    AddCompactionStats(c->level() + 1, stats);
+  }
 
 //  _mm_clflush(polling_size_2);
   asm volatile ("sfence\n" : : );
@@ -2124,7 +3861,7 @@ void DBImpl::NearDataCompaction(Compaction* c) {
   asm volatile ("mfence\n" : : );
 //  assert(*(unsigned char*)recv_mr_c.addr == 6);
   VersionEdit edit(0);
-  edit.DecodeFrom(Slice((char*)mr_c.addr, buffer_size), 0, table_cache_);
+  edit.DecodeFrom(Slice((char*)mr_c.addr, edit_size), 0, table_cache_);
 #ifndef NDEBUG
   for(auto iter : *edit.GetNewFiles()){
     assert(iter.second->shard_target_node_id == shard_target_node_id);
@@ -2140,12 +3877,15 @@ void DBImpl::NearDataCompaction(Compaction* c) {
 //    assert(iter.second->creator_node_id == 1);
 //  }
   size_t new_file_size = edit.GetNewFilesNum();
-  assert(new_file_size > 0);
+  // The edit is empty if the memory node could not read a cold input, the
+  // inputs are then only released.
   uint64_t file_number_end = versions_->NewFileNumberBatch(new_file_size);
   DEBUG_arg("new file number for end is %lu \n", file_number_end);
   DEBUG_arg("Edit new file number is %lu\n", new_file_size);
   edit.SetFileNumbers(file_number_end);
-  {
+  // A compaction handed back keeps its inputs, the caller runs it.
+  if (!handed_back) {
+    OpenNewTables(&edit);
     std::unique_lock<std::mutex> lck(superversion_memlist_mtx);
     // TODO: remove the version id argument because we no longer need it.
 //    std::unique_lock<std::mutex> lck_vs(versionset_mtx, std::defer_lock);
@@ -2158,20 +3898,30 @@ void DBImpl::NearDataCompaction(Compaction* c) {
     write_stall_cv.notify_all();
   }
 #ifdef WITHPERSISTENCE
-  uint64_t* file_number_end_send_ptr = static_cast<uint64_t*>(send_mr.addr);
-  *file_number_end_send_ptr = file_number_end;
-  memset((char*)send_mr.addr + sizeof(uint64_t), 1, 1);
+  versions_->Persistency_unpin(
+      *static_cast<volatile uint64_t*>(persist_epoch_mr_.addr));
+  compaction_file_numbers* file_numbers =
+      static_cast<compaction_file_numbers*>(send_mr.addr);
+  file_numbers->file_number_end = file_number_end;
+  file_numbers->persist_epoch = versions_->Persistency_pin(&edit);
+  file_numbers->epoch_buffer = persist_epoch_mr_.addr;
+  file_numbers->epoch_rkey = persist_epoch_mr_.rkey;
+  memset((char*)send_mr.addr + sizeof(compaction_file_numbers), 1, 1);
   rdma_mg->RDMA_Write(remote_prt, remote_rkey,
-                           &send_mr, sizeof(uint64_t) + 1, "main",
-                           IBV_SEND_SIGNALED, 1);
+                           &send_mr, sizeof(compaction_file_numbers) + 1, "main",
+                           IBV_SEND_SIGNALED, 1, shard_target_node_id);
 
 #endif
   rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr,Message);
   rdma_mg->Deallocate_Local_RDMA_Slot(mr_c.addr,Version_edit);
 //  rdma_mg->Deallocate_Local_RDMA_Slot(recv_mr_c.addr,Version_edit);
   rdma_mg->Deallocate_Local_RDMA_Slot(receive_mr.addr,Message);
-
-
+  if (handed_back) {
+    return false;
+  }
+  RecordCompactionTime(true, stats.bytes_read,
+                       env_->NowMicros() - start_micros);
+  return true;
 }
 //void DBImpl::Communication_To_Home_Node() {
 //  ibv_wc wc[3] = {};
@@ -2188,10 +3938,34 @@ void DBImpl::sync_option_to_remote(uint8_t target_node_id) {
   rdma_mg->Allocate_Local_RDMA_Slot(send_mr_ve, Version_edit);
   rdma_mg->Allocate_Local_RDMA_Slot(receive_mr, Message);
   *(Options*)send_mr_ve.addr = options_;
-  memset((char*)send_mr_ve.addr + sizeof(options_), 1, 1);
+  // The pointers of the options mean nothing on the memory node, the
+  // compaction filter, the prefix extractor and the merge operator are
+  // selected by their names, which follow the options.
+  Slice filter_name = options_.compaction_filter != nullptr
+                          ? options_.compaction_filter->Name()
+                          : Slice();
+  Slice extractor_name = options_.prefix_extractor != nullptr
+                             ? Slice(options_.prefix_extractor->Name())
+                             : Slice();
+  Slice merge_operator_name = options_.merge_operator != nullptr
+                                  ? Slice(options_.merge_operator->Name())
+                                  : Slice();
+  char* name_buf = (char*)send_mr_ve.addr + sizeof(options_);
+  EncodeFixed32(name_buf, filter_name.size());
+  memcpy(name_buf + 4, filter_name.data(), filter_name.size());
+  name_buf += 4 + filter_name.size();
+  EncodeFixed32(name_buf, extractor_name.size());
+  memcpy(name_buf + 4, extractor_name.data(), extractor_name.size());
+  name_buf += 4 + extractor_name.size();
+  EncodeFixed32(name_buf, merge_operator_name.size());
+  memcpy(name_buf + 4, merge_operator_name.data(), merge_operator_name.size());
+  const size_t options_size = sizeof(options_) + 12 + filter_name.size() +
+                              extractor_name.size() +
+                              merge_operator_name.size();
+  memset((char*)send_mr_ve.addr + options_size, 1, 1);
   send_pointer = (RDMA_Request*)send_mr.addr;
   send_pointer->command = sync_option;
-  send_pointer->content.ive.buffer_size = sizeof(options_) + 1;
+  send_pointer->content.ive.buffer_size = options_size + 1;
   send_pointer->buffer = receive_mr.addr;
   send_pointer->rkey = receive_mr.rkey;
 
@@ -2227,12 +4001,91 @@ void DBImpl::sync_option_to_remote(uint8_t target_node_id) {
   asm volatile ("lfence\n" : : );
   asm volatile ("mfence\n" : : );
   rdma_mg->RDMA_Write(receive_pointer->buffer, receive_pointer->rkey,
-                      &send_mr_ve, sizeof(options_) + 1, "main",
+                      &send_mr_ve, options_size + 1, "main",
                       IBV_SEND_SIGNALED, 1, target_node_id);
   rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr,Message);
   rdma_mg->Deallocate_Local_RDMA_Slot(send_mr_ve.addr,Version_edit);
   rdma_mg->Deallocate_Local_RDMA_Slot(receive_mr.addr,Message);
 }
+Status DBImpl::recover_version_from_remote(uint8_t target_node_id,
+                                           bool reattach) {
+  std::shared_ptr<RDMA_Manager> rdma_mg = env_->rdma_mg;
+  ibv_mr send_mr = {};
+  ibv_mr edit_mr = {};
+  ibv_mr receive_mr = {};
+  rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+  rdma_mg->Allocate_Local_RDMA_Slot(edit_mr, Version_edit);
+  rdma_mg->Allocate_Local_RDMA_Slot(receive_mr, Message);
+  Status s;
+  bool timed_out = false;
+  size_t start = 0;
+  size_t recovered_files = 0;
+  do {
+    RDMA_Request* send_pointer = (RDMA_Request*)send_mr.addr;
+    send_pointer->command = retrieve_recovered_version_;
+    send_pointer->content.rv.start = start;
+    send_pointer->content.rv.buffer_size = edit_mr.length;
+    send_pointer->content.rv.reattach = reattach;
+    send_pointer->content.rv.shard_id = shard_id;
+    send_pointer->buffer = receive_mr.addr;
+    send_pointer->rkey = receive_mr.rkey;
+    send_pointer->buffer_large = edit_mr.addr;
+    send_pointer->rkey_large = edit_mr.rkey;
+    RDMA_Reply* receive_pointer = (RDMA_Reply*)receive_mr.addr;
+    //Clear the reply buffer for the sending the request.
+    *receive_pointer = {};
+    asm volatile ("sfence\n" : : );
+    asm volatile ("lfence\n" : : );
+    asm volatile ("mfence\n" : : );
+    rdma_mg->post_send<RDMA_Request>(&send_mr, target_node_id,
+                                     std::string("main"));
+    ibv_wc wc[2] = {};
+    if (rdma_mg->poll_completion(wc, 1, std::string("main"), true,
+                                 target_node_id)) {
+      s = Status::IOError("failed to request the recovered version");
+      break;
+    }
+    if (!rdma_mg->poll_reply_buffer(receive_pointer,
+                                    RPC_REPLY_TIMEOUT_MICROS)) {
+      s = Status::IOError("no reply for the recovered version");
+      timed_out = true;
+      break;
+    }
+    VersionEdit edit(0);
+    s = edit.DecodeFrom(
+        Slice((char*)edit_mr.addr, receive_pointer->content.rv.buffer_size), 0,
+        table_cache_);
+    if (!s.ok()) {
+      break;
+    }
+    // LogAndApply overwrites the last sequence of the edit.
+    SequenceNumber last_sequence = edit.GetLastSequence();
+    size_t file_num = edit.GetNewFilesNum();
+    if (file_num > 0 || !edit.GetRangeTombstones().empty()) {
+      for (auto iter : *edit.GetNewFiles()) {
+        versions_->MarkFileNumberUsed(iter.second->number);
+      }
+      // The memory node has the files already, so they are not pinned.
+      versions_->LogAndApply(&edit);
+      recovered_files += file_num;
+    }
+    if (versions_->LastSequence() < last_sequence) {
+      versions_->SetLastSequence(last_sequence);
+    }
+    start = receive_pointer->content.rv.next;
+  } while (start != 0);
+  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
+  if (!timed_out) {
+    // Otherwise the late reply may still land in the slots, they are leaked.
+    rdma_mg->Deallocate_Local_RDMA_Slot(edit_mr.addr, Version_edit);
+    rdma_mg->Deallocate_Local_RDMA_Slot(receive_mr.addr, Message);
+  }
+  if (s.ok() && recovered_files > 0) {
+    Log(options_.info_log, "Recovered %zu files from memory node %u",
+        recovered_files, target_node_id);
+  }
+  return s;
+}
 void DBImpl::remote_qp_reset(std::string& qp_type, uint8_t target_node_id) {
   std::shared_ptr<RDMA_Manager> rdma_mg = env_->rdma_mg;
   RDMA_Request* send_pointer;
@@ -2359,10 +4212,11 @@ void DBImpl::client_message_polling_and_handling_thread(std::string q_id) {
       write_stall_cv.notify_one();
     }
     printf("client handling thread\n");
+    QP_Type qp_type = QP_Type_From_String(q_id);
     while (!shutting_down_.load()) {
       // we can only use try_poll... rather than poll_com.. because we need to
       // make sure the shutting down signal can work.
-      if(rdma_mg->try_poll_completions(wc, 1, q_id, false,
+      if(rdma_mg->try_poll_completions(wc, 1, qp_type, false,
                                         shard_target_node_id) >0){
         if(wc[0].wc_flags & IBV_WC_WITH_IMM){
           wc[0].imm_data;// use this to find the correct condition variable.
@@ -2400,20 +4254,6 @@ void DBImpl::client_message_polling_and_handling_thread(std::string q_id) {
                                               shard_target_node_id,
                                               "main");
           install_version_edit_handler(receive_msg_buf, q_id);
-#ifdef WITHPERSISTENCE
-        } else if(receive_msg_buf->command == persist_unpin_) {
-          //TODO: implement the persistent unpin dispatch machenism
-          rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_counter], "main");
-          auto start = std::chrono::high_resolution_clock::now();
-          Arg_for_handler* argforhandler = new Arg_for_handler{.request=receive_msg_buf,.client_ip = "main"};
-          BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = argforhandler};
-          Unpin_bg_pool_.Schedule(&DBImpl::SSTable_Unpin_Dispatch, thread_pool_args);
-          auto stop = std::chrono::high_resolution_clock::now();
-          auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-          printf("unpin for %lu files time elapse is %ld",
-                 (receive_msg_buf->content.psu.buffer_size-1)/sizeof(uint64_t),
-                 duration.count());
-#endif
         } else {
           printf("corrupt message from client.");
           break;
@@ -2461,7 +4301,6 @@ void DBImpl::WaitForComputeMessageHandlingThread(uint8_t target_memory_id,
   }
 //  main_comm_threads.emplace_back(
 //      &DBImpl::client_message_polling_and_handling_thread, this, "main");
-  Unpin_bg_pool_.SetBackgroundThreads(1);
 }
 //void DBImpl::Wait_for_client_message_hanlding_setup() {
 //  {
@@ -2475,41 +4314,104 @@ void DBImpl::WaitForComputeMessageHandlingThread(uint8_t target_memory_id,
 //  Unpin_bg_pool_.SetBackgroundThreads(1);
 //
 //}
-void DBImpl::Edit_sync_to_remote(VersionEdit* edit,
-                                 std::unique_lock<std::mutex>* version_mtx) {
-  //  std::unique_lock<std::shared_mutex> l(main_qp_mutex);
-//  auto start = std::chrono::high_resolution_clock::now();
+void DBImpl::Edit_sync_to_remote(VersionEdit* edit, bool wait) {
+  {
+    std::unique_lock<std::mutex> lck(hot_files_mtx_);
+    for (const auto& hot_file : hot_files_) {
+      edit->AddHotFile(std::get<0>(hot_file), std::get<1>(hot_file),
+                       std::get<2>(hot_file));
+    }
+  }
+  std::string serilized_ve;
+  edit->EncodeTo(&serilized_ve);
+  std::unique_lock<std::mutex> lck(edit_sync_mtx_);
+  uint64_t version_id = 0;
+#ifdef WITHPERSISTENCE
+  // Under edit_sync_mtx_, the epochs grow in the order of the queue.
+  version_id = versions_->Persistency_pin(edit);
+#endif
+  pending_edits_.emplace_back(std::move(serilized_ve), version_id);
+  const uint64_t ticket = ++edits_queued_;
+  if (!edit_syncer_.joinable()) {
+    edit_syncer_ = std::thread(&DBImpl::Edit_sync_loop, this);
+  }
+  edit_sync_cv_.notify_all();
+  while (wait && edits_synced_ < ticket) {
+    edit_sync_cv_.wait(lck);
+  }
+}
+void DBImpl::Edit_sync_loop() {
   std::shared_ptr<RDMA_Manager> rdma_mg = env_->rdma_mg;
-  // register the memory block from the remote memory
-  RDMA_Request* send_pointer;
   ibv_mr send_mr = {};
   ibv_mr send_mr_ve = {};
-
   ibv_mr receive_mr = {};
   rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
   rdma_mg->Allocate_Local_RDMA_Slot(send_mr_ve, Version_edit);
-
   rdma_mg->Allocate_Local_RDMA_Slot(receive_mr, Message);
-//  auto end = std::chrono::high_resolution_clock::now();
-//  auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-//  printf("Sync version edit time elapse part 1 allocation: %ld us \n", duration.count());
-//  start = std::chrono::high_resolution_clock::now();
-  std::string serilized_ve;
-  // Check this buffer reservation.
-//  serilized_ve.reserve(10000);
-  edit->EncodeTo(&serilized_ve);
-  assert(serilized_ve.size() <= send_mr_ve.length);
-//  end = std::chrono::high_resolution_clock::now();
-//  duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-//  printf("Sync version edit time elapse: %ld us part 2 serialization\n", duration.count());
-//  start = std::chrono::high_resolution_clock::now();
-  memcpy(send_mr_ve.addr, serilized_ve.c_str(), serilized_ve.size());
+  std::string batch;
+  std::unique_lock<std::mutex> lck(edit_sync_mtx_);
+  while (true) {
+    while (pending_edits_.empty() && !edit_syncer_exit_) {
+      edit_sync_cv_.wait(lck);
+    }
+    if (pending_edits_.empty()) {
+      break;
+    }
+    // The edits queued while the last message was out go in one message,
+    // as many as the buffer holds with the byte polled for at the end.
+    batch.clear();
+    uint32_t num_edits = 0;
+    uint64_t version_id = 0;
+    while (!pending_edits_.empty()) {
+      const std::string& serilized_ve = pending_edits_.front().first;
+      if (num_edits > 0 && batch.size() + VarintLength(serilized_ve.size()) +
+                                   serilized_ve.size() + 1 >
+                               send_mr_ve.length) {
+        break;
+      }
+      PutVarint32(&batch, static_cast<uint32_t>(serilized_ve.size()));
+      batch.append(serilized_ve);
+      version_id = pending_edits_.front().second;
+      pending_edits_.pop_front();
+      num_edits++;
+    }
+    lck.unlock();
+    Send_edits_to_remote(batch, num_edits, version_id, send_mr, send_mr_ve,
+                         receive_mr);
+    lck.lock();
+    edits_synced_ += num_edits;
+    edit_sync_cv_.notify_all();
+  }
+  lck.unlock();
+  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr,Message);
+  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr_ve.addr,Version_edit);
+  rdma_mg->Deallocate_Local_RDMA_Slot(receive_mr.addr,Message);
+}
+void DBImpl::Send_edits_to_remote(const std::string& batch,
+                                  uint32_t num_edits, uint64_t version_id,
+                                  ibv_mr& send_mr, ibv_mr& send_mr_ve,
+                                  ibv_mr& receive_mr) {
+  std::shared_ptr<RDMA_Manager> rdma_mg = env_->rdma_mg;
+  RDMA_Request* send_pointer;
+  assert(batch.size() < send_mr_ve.length);
+  memcpy(send_mr_ve.addr, batch.data(), batch.size());
 
-  memset((char*)send_mr_ve.addr + serilized_ve.size(), 1, 1);
+  memset((char*)send_mr_ve.addr + batch.size(), 1, 1);
 
   send_pointer = (RDMA_Request*)send_mr.addr;
   send_pointer->command = install_version_edit;
-  send_pointer->content.ive.buffer_size = serilized_ve.size() + 1;
+  send_pointer->content.ive.buffer_size = batch.size() + 1;
+  send_pointer->content.ive.num_edits = num_edits;
+  send_pointer->content.ive.shard_id = shard_id;
+#ifdef WITHPERSISTENCE
+  // Drop the pins of the edits persisted so far. The edits of the batch
+  // stay pinned until the memory node writes back an epoch beyond the last.
+  versions_->Persistency_unpin(
+      *static_cast<volatile uint64_t*>(persist_epoch_mr_.addr));
+  send_pointer->content.ive.version_id = version_id;
+  send_pointer->buffer_large = persist_epoch_mr_.addr;
+  send_pointer->rkey_large = persist_epoch_mr_.rkey;
+#endif
   send_pointer->buffer = receive_mr.addr;
   send_pointer->rkey = receive_mr.rkey;
   send_pointer->imm_num = 0;
@@ -2521,29 +4423,14 @@ void DBImpl::Edit_sync_to_remote(VersionEdit* edit,
   asm volatile ("lfence\n" : : );
   asm volatile ("mfence\n" : : );
   rdma_mg->post_send<RDMA_Request>(&send_mr, 0, std::string("main"));
-//  end = std::chrono::high_resolution_clock::now();
-//  duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-//  printf("Sync version edit time elapse: %ld us part 3 memcopy and WR post\n", duration.count());
-//  start = std::chrono::high_resolution_clock::now();
-
-  //TODO: we need to lock the whole version edit process. The memory server need to have
-  // a reply to let the compute node release the lock to make sure that the compute and
-  // memory node has the same sequence of version edit.
-  // The difference sequence of version edit may trigger big problem (system crash), if
-  // the new version edit delete a file which has not been installed by the old edit yet,
-  // because the old version edit is lagged because of RDMA or cpu schedule.
-  // For now it is ok.
-//  version_mtx->unlock();
 
+  // The edits go out from edit_syncer_ only, so the memory node gets them
+  // in the order they were applied.
   ibv_wc wc[2] = {};
-  if (rdma_mg->poll_completion(wc, 1, std::string("main"), true, edit->GetNodeID())){
+  if (rdma_mg->poll_completion(wc, 1, std::string("main"), true, 0)){
     fprintf(stderr, "failed to poll send for edit version edit sync\n");
     return;
   }
-//  end = std::chrono::high_resolution_clock::now();
-//  duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-//  printf("Sync version edit time elapse: %ld us part 4 mutex unlock\n", duration.count());
-//  start = std::chrono::high_resolution_clock::now();
   asm volatile ("sfence\n" : : );
   asm volatile ("lfence\n" : : );
   asm volatile ("mfence\n" : : );
@@ -2554,9 +4441,6 @@ void DBImpl::Edit_sync_to_remote(VersionEdit* edit,
     printf("receive structure size is %lu", sizeof(RDMA_Reply));
     exit(0);
   }
-//  end = std::chrono::high_resolution_clock::now();
-//  duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-//  printf("Sync version edit time elapse: %ld us part 5 receive the reply\n", duration.count());
 
   //Note: here multiple threads will RDMA_Write the "main" qp at the same time,
   // which means the polling result may not belongs to this thread, but it does not
@@ -2565,21 +4449,8 @@ void DBImpl::Edit_sync_to_remote(VersionEdit* edit,
   asm volatile ("lfence\n" : : );
   asm volatile ("mfence\n" : : );
   rdma_mg->RDMA_Write(receive_pointer->buffer, receive_pointer->rkey,
-                      &send_mr_ve, serilized_ve.size() + 1, "main",
+                      &send_mr_ve, batch.size() + 1, "main",
                       IBV_SEND_SIGNALED, 1, shard_target_node_id);
-  //TODO: implement a wait function for the received bit. THe problem is when to
-  // reset the buffer to zero (we may need different buffer for the compaction reply)
-  // and how to make sure that the reply will wake up this waiting thread. The
-  // signal may comes befoer the thread go to sleep.
-  //
-//  start = std::chrono::high_resolution_clock::now();
-  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr,Message);
-  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr_ve.addr,Version_edit);
-  rdma_mg->Deallocate_Local_RDMA_Slot(receive_mr.addr,Message);
-//  end = std::chrono::high_resolution_clock::now();
-//  duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-//  printf("Sync version edit time elapse: %ld us part 6 Deallocation \n", duration.count());
-
 }
 void DBImpl::install_version_edit_handler(RDMA_Request* request,
                                           std::string client_ip) {
@@ -2657,10 +4528,24 @@ void DBImpl::install_version_edit_handler(RDMA_Request* request,
 #ifndef NDEBUG
     printf("Get the printed result after %zu iteration, received %d, checkbyte is %d\n", counter, send_pointer->received, check_byte);
 #endif
+    TimelineScope timeline("install_compaction", shard_id, 0,
+                           Timeline::kFlowEnd);
     VersionEdit version_edit(0);
     version_edit.DecodeFrom(
         Slice((char*)edit_recv_mr.addr, request->content.ive.buffer_size), 0,
         table_cache_);
+    CompactionStats stats;
+    for (auto& file : *version_edit.GetNewFiles()) {
+      stats.bytes_written += file.second->file_size;
+    }
+    AddCompactionStats(version_edit.compactlevel() + 1, stats);
+    if (!version_edit.GetDeletedFiles()->empty()) {
+      auto& first = *version_edit.GetDeletedFiles()->begin();
+      timeline.set_job_id(
+          TimelineJobId(std::get<1>(first), std::get<2>(first)));
+    }
+    timeline.set_bytes(stats.bytes_written);
+    OpenNewTables(&version_edit);
 //    printf("Marker 1\n");
     std::unique_lock<std::mutex> lck(superversion_memlist_mtx);
 //    printf("Marker 2\n");
@@ -2679,80 +4564,6 @@ void DBImpl::install_version_edit_handler(RDMA_Request* request,
   }
   delete request;
 }
-#ifdef WITHPERSISTENCE
-void DBImpl::SSTable_Unpin_Dispatch(void* thread_args) {
-  BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_args);
-  ((DBImpl*)p->db)->persistence_unpin_handler(p->func_args);
-  delete static_cast<BGThreadMetadata*>(thread_args);
-}
-void DBImpl::persistence_unpin_handler(void* arg) {
-  RDMA_Request* request = ((Arg_for_handler*)arg)->request;
-  std::string client_ip = ((Arg_for_handler*)arg)->client_ip;
-  auto rdma_mg = env_->rdma_mg;
-  ibv_mr send_mr;
-  rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
-  RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
-//  send_pointer->content.ive = {};
-  ibv_mr file_number_recv_mr;
-  rdma_mg->Allocate_Local_RDMA_Slot(file_number_recv_mr, Version_edit);
-  send_pointer->buffer_large = file_number_recv_mr.addr;
-  send_pointer->rkey_large = file_number_recv_mr.rkey;
-  send_pointer->received = true;
-  //TODO: how to check whether the version edit message is ready, we need to know the size of the
-  // version edit in the first REQUEST from compute node.
-  volatile char* polling_byte = (char*)file_number_recv_mr.addr + request->content.psu.buffer_size - 1;
-  memset((void*)polling_byte, 0, 1);
-  for (int i = 0; i < 100; ++i) {
-    if(*polling_byte != 0){
-      printf("polling byte error");
-      assert(false);
-    }
-  }
-  asm volatile ("sfence\n" : : );
-  asm volatile ("lfence\n" : : );
-  asm volatile ("mfence\n" : : );
-  rdma_mg->RDMA_Write(request->buffer, request->rkey,
-                      &send_mr, sizeof(RDMA_Reply),std::move(client_ip), IBV_SEND_SIGNALED,1);
-  size_t counter = 0;
-  while (*(unsigned char*)polling_byte != 1){
-    _mm_clflush(polling_byte);
-    asm volatile ("sfence\n" : : );
-    asm volatile ("lfence\n" : : );
-    asm volatile ("mfence\n" : : );
-    std::fprintf(stderr, "Polling install version handler\r");
-    std::fflush(stderr);
-    counter++;
-  }
-  asm volatile ("sfence\n" : : );
-  asm volatile ("lfence\n" : : );
-  asm volatile ("mfence\n" : : );
-  uint64_t* arr_ptr = (uint64_t*)file_number_recv_mr.addr;
-  uint32_t size = (request->content.psu.buffer_size - 1)/sizeof(uint64_t);
-  assert((request->content.psu.buffer_size - 1)%sizeof(uint64_t) == 0);
-  DEBUG_arg("Persistent unpin id is %d", request->content.psu.id);
-  versions_->Persistency_unpin(arr_ptr, size);
-  delete request;
-}
-#endif
-void DBImpl::ResetThreadLocalSuperVersions() {
-  autovector<void*> sv_ptrs;
-  // If there the default pointer for local_sv_ s are nullptr
-  local_sv_->Scrape(&sv_ptrs, SuperVersion::kSVObsolete);
-  for (auto ptr : sv_ptrs) {
-    assert(ptr);
-    if (ptr == SuperVersion::kSVInUse || ptr == nullptr) {
-      continue;
-    }
-    auto sv = static_cast<SuperVersion*>(ptr);
-    bool was_last_ref __attribute__((__unused__));
-    was_last_ref = sv->Unref();
-    // sv couldn't have been the last reference because
-    // ResetThreadLocalSuperVersions() is called before
-    // unref'ing super_version_.
-    assert(!was_last_ref);
-  }
-}
-
 //void DBImpl::InstallSuperVersion() {
 //    SuperVersion* old = super_version;
 //  super_version.store(new SuperVersion(mem_,imm_.current(), versions_->current()));
@@ -2770,7 +4581,8 @@ void DBImpl::ResetThreadLocalSuperVersions() {
 //}
 Status DBImpl::DoCompactionWorkWithSubcompaction(CompactionState* compact) {
   Compaction* c = compact->compaction;
-  c->GenSubcompactionBoundaries();
+  versions_->GenSubcompactionBoundaries(
+      c, static_cast<size_t>(std::max(options_.MaxSubcompaction, 1)), false);
   auto boundaries = c->GetBoundaries();
   auto sizes = c->GetSizes();
   assert(boundaries->size() == sizes->size() - 1);
@@ -2849,6 +4661,8 @@ Status DBImpl::DoCompactionWorkWithSubcompaction(CompactionState* compact) {
       stats.bytes_written += iter.outputs[i].file_size;
     }
   }
+  stats.count = 1;
+  AddCompactionStats(compact->compaction->level() + 1, stats);
 
 // TODO: we can remove this lock.
 
@@ -2876,13 +4690,19 @@ void DBImpl::ProcessKeyValueCompaction(SubcompactionState* sub_compact){
   //Start and End are userkeys.
   Slice* start = sub_compact->start;
   Slice* end = sub_compact->end;
-  if (snapshots_.empty()) {
-    sub_compact->smallest_snapshot = versions_->LastSequence();
-  } else {
-    sub_compact->smallest_snapshot = snapshots_.oldest()->sequence_number();
-  }
+  sub_compact->smallest_snapshot =
+      snapshots_.Oldest(VisibleSequence());
 
   Iterator* input = versions_->MakeInputIterator(sub_compact->compaction);
+  if (options_.merge_operator != nullptr) {
+    // The merge operands no snapshot reads are applied to the value below
+    // them before the loop, which drops that value like any hidden one.
+    input = NewCompactionMergeIterator(
+        input, user_comparator(), options_.merge_operator,
+        sub_compact->smallest_snapshot, &sub_compact->compaction->range_tombstones(),
+        sub_compact->compaction->level() + 1 == config::kNumLevels - 1,
+        env_->rdma_mg.get());
+  }
 
   // Release mutex while we're actually doing the compaction work
 //  undefine_mutex.Unlock();
@@ -2907,12 +4727,15 @@ void DBImpl::ProcessKeyValueCompaction(SubcompactionState* sub_compact){
   bool has_current_user_key = false;
   SequenceNumber last_sequence_for_key = kMaxSequenceNumber;
   Slice key;
+  Slice value;
+  std::string filtered_key;
   assert(input->Valid());
 #ifndef NDEBUG
   printf("first key is %s", input->key().ToString().c_str());
 #endif
   while (input->Valid() && !shutting_down_.load(std::memory_order_acquire)) {
     key = input->key();
+    value = input->value();
 
 //    assert(key.data()[0] == '0');
     //We do not need to check whether the output file have too much overlap with level n + 2.
@@ -2955,30 +4778,45 @@ void DBImpl::ProcessKeyValueCompaction(SubcompactionState* sub_compact){
         // Hidden by an newer entry for same user key
 
         drop = true;  // (A)
+      } else if ((ikey.type == kTypeValue || ikey.type == kTypeMerge ||
+                  ikey.type == kTypeBlobIndex) &&
+                 sub_compact->compaction->range_tombstones().ShouldDelete(
+                     user_comparator(), ikey.user_key, ikey.sequence,
+                     sub_compact->smallest_snapshot)) {
+        // Deleted by a range tombstone which every snapshot sees.
+        drop = true;
+      } else if (ikey.type == kTypeDeletion &&
+                 ikey.sequence <= sub_compact->smallest_snapshot &&
+                 sub_compact->compaction->bottommost()) {
+        // No file below the output level has the key, and the older
+        // entries of the key in this compaction are dropped by rule (A).
+        drop = true;
+      } else if (ikey.sequence <= sub_compact->smallest_snapshot) {
+        // Only the entries no snapshot reads may be filtered.
+        FilterCompactionEntry(options_.compaction_filter,
+                              sub_compact->compaction->level(), ikey,
+                              &filtered_key, &key, &value);
       }
-//      else if (ikey.type == kTypeDeletion &&
-//                 ikey.sequence <= sub_compact->smallest_snapshot &&
-//                 sub_compact->compaction->IsBaseLevelForKey(ikey.user_key)) {
-//        // TOTHINK(0ruihong) :what is this for?
-//        //  Generally delete can only be deleted when there is definitely no file contain the
-//        //  same key in the upper level.
-//        // For this user key:
-//        // (1) there is no data in higher levels
-//        // (2) data in lower levels will have larger sequence numbers
-//        // (3) data in layers that are being compacted here and have
-//        //     smaller sequence numbers will be dropped in the next
-//        //     few iterations of this loop (by rule (A) above).
-//        // Therefore this deletion marker is obsolete and can be dropped.
-//        drop = true;
-//      }
 
-      last_sequence_for_key = ikey.sequence;
+      if (ikey.type != kTypeMerge) {
+        // A merge operand which is kept needs the entries below it.
+        last_sequence_for_key = ikey.sequence;
+      }
 
     }
 #ifndef NDEBUG
     number_of_key++;
 #endif
     if (!drop) {
+      // Cut the output before it overlaps too many grandparent files, so
+      // that the compaction of the next level reads less.
+      if (sub_compact->ShouldStopBefore(key) && sub_compact->builder != nullptr) {
+        sub_compact->current_output()->largest.DecodeFrom(sub_compact->builder->LastKey());
+        status = FinishCompactionOutputFile(sub_compact, input);
+        if (!status.ok()) {
+          break;
+        }
+      }
       // Open output file if necessary
       if (sub_compact->builder == nullptr) {
         status = OpenCompactionOutputFile(sub_compact);
@@ -2992,7 +4830,12 @@ void DBImpl::ProcessKeyValueCompaction(SubcompactionState* sub_compact){
 #ifndef NDEBUG
       Not_drop_counter++;
 #endif
-      sub_compact->builder->Add(key, input->value());
+      sub_compact->builder->Add(key, value);
+      if (ExtractValueType(key) == kTypeBlobIndex) {
+        AddBlobChunks(value, &sub_compact->current_output()->blob_chunks);
+      }
+      sub_compact->current_output()->largest_seq =
+          std::max(sub_compact->current_output()->largest_seq, ikey.sequence);
 //      assert(key.data()[0] == '0');
       // Close output file if it is big enough
       if (sub_compact->builder->FileSize() >=
@@ -3052,13 +4895,18 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
   assert(versions_->NumLevelFiles(compact->compaction->level()) > 0);
   assert(compact->builder == nullptr);
 //  assert(compact->outfile == nullptr);
-  if (snapshots_.empty()) {
-    compact->smallest_snapshot = versions_->LastSequence();
-  } else {
-    compact->smallest_snapshot = snapshots_.oldest()->sequence_number();
-  }
+  compact->smallest_snapshot = snapshots_.Oldest(VisibleSequence());
 
   Iterator* input = versions_->MakeInputIterator(compact->compaction);
+  if (options_.merge_operator != nullptr) {
+    // The merge operands no snapshot reads are applied to the value below
+    // them before the loop, which drops that value like any hidden one.
+    input = NewCompactionMergeIterator(
+        input, user_comparator(), options_.merge_operator,
+        compact->smallest_snapshot, &compact->compaction->range_tombstones(),
+        compact->compaction->level() + 1 == config::kNumLevels - 1,
+        env_->rdma_mg.get());
+  }
 
   // Release mutex while we're actually doing the compaction work
 //  undefine_mutex.Unlock();
@@ -3076,12 +4924,15 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
   bool has_current_user_key = false;
   SequenceNumber last_sequence_for_key = kMaxSequenceNumber;
   Slice key;
+  Slice value;
+  std::string filtered_key;
   assert(input->Valid());
 #ifndef NDEBUG
   printf("first key is %s", input->key().ToString().c_str());
 #endif
   while (input->Valid() && !shutting_down_.load(std::memory_order_acquire)) {
     key = input->key();
+    value = input->value();
 //    assert(key.data()[0] == '0');
     //We do not need to check whether the output file have too much overlap with level n + 2.
     // If there is a lot of overlap subcompaction can be triggered.
@@ -3116,29 +4967,44 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
         // Hidden by an newer entry for same user key
 
         drop = true;  // (A)
+      } else if ((ikey.type == kTypeValue || ikey.type == kTypeMerge ||
+                  ikey.type == kTypeBlobIndex) &&
+                 compact->compaction->range_tombstones().ShouldDelete(
+                     user_comparator(), ikey.user_key, ikey.sequence,
+                     compact->smallest_snapshot)) {
+        // Deleted by a range tombstone which every snapshot sees.
+        drop = true;
+      } else if (ikey.type == kTypeDeletion &&
+                 ikey.sequence <= compact->smallest_snapshot &&
+                 compact->compaction->bottommost()) {
+        // No file below the output level has the key, and the older
+        // entries of the key in this compaction are dropped by rule (A).
+        drop = true;
+      } else if (ikey.sequence <= compact->smallest_snapshot) {
+        // Only the entries no snapshot reads may be filtered.
+        FilterCompactionEntry(options_.compaction_filter,
+                              compact->compaction->level(), ikey,
+                              &filtered_key, &key, &value);
       }
-//      else if (ikey.type == kTypeDeletion &&
-//                 ikey.sequence <= compact->smallest_snapshot &&
-//                 compact->compaction->IsBaseLevelForKey(ikey.user_key)) {
-//        // TOTHINK(0ruihong) :what is this for?
-//        //  Generally delete can only be deleted when there is definitely no file contain the
-//        //  same key in the upper level.
-//        // For this user key:
-//        // (1) there is no data in higher levels
-//        // (2) data in lower levels will have larger sequence numbers
-//        // (3) data in layers that are being compacted here and have
-//        //     smaller sequence numbers will be dropped in the next
-//        //     few iterations of this loop (by rule (A) above).
-//        // Therefore this deletion marker is obsolete and can be dropped.
-//        drop = true;
-//      }
 
-      last_sequence_for_key = ikey.sequence;
+      if (ikey.type != kTypeMerge) {
+        // A merge operand which is kept needs the entries below it.
+        last_sequence_for_key = ikey.sequence;
+      }
     }
 #ifndef NDEBUG
     number_of_key++;
 #endif
     if (!drop) {
+      // Cut the output before it overlaps too many grandparent files, so
+      // that the compaction of the next level reads less.
+      if (compact->compaction->ShouldStopBefore(key) && compact->builder != nullptr) {
+        compact->current_output()->largest.DecodeFrom(compact->builder->LastKey());
+        status = FinishCompactionOutputFile(compact, input);
+        if (!status.ok()) {
+          break;
+        }
+      }
       // Open output file if necessary
       if (compact->builder == nullptr) {
         status = OpenCompactionOutputFile(compact);
@@ -3152,7 +5018,12 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
 #ifndef NDEBUG
       Not_drop_counter++;
 #endif
-      compact->builder->Add(key, input->value());
+      compact->builder->Add(key, value);
+      if (ExtractValueType(key) == kTypeBlobIndex) {
+        AddBlobChunks(value, &compact->current_output()->blob_chunks);
+      }
+      compact->current_output()->largest_seq =
+          std::max(compact->current_output()->largest_seq, ikey.sequence);
 //      assert(key.data()[0] == '0');
       // Close output file if it is big enough
       if (compact->builder->FileSize() >=
@@ -3206,7 +5077,8 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
   }
   // TODO: we can remove this lock.
   undefine_mutex.Lock();
-  stats_[compact->compaction->level() + 1].Add(stats);
+  stats.count = 1;
+  AddCompactionStats(compact->compaction->level() + 1, stats);
 
   if (status.ok()) {
     std::unique_lock<std::mutex> l(superversion_memlist_mtx, std::defer_lock);
@@ -3246,24 +5118,72 @@ static void CleanupIteratorState(void* arg1, void* arg2) {
   delete state;
 }
 
+// The range of ReadOptions::iterate_prefix, held by the iterator.
+struct PrefixBounds {
+  std::string lower;
+  std::string upper;
+  Slice lower_slice;
+  Slice upper_slice;
+};
+
+static void DeletePrefixBounds(void* arg1, void* arg2) {
+  delete reinterpret_cast<PrefixBounds*>(arg1);
+}
+
+// "options" bounded to the keys starting with options.iterate_prefix, which
+// under the bytewise comparator are [prefix, successor of the prefix). The
+// bounds the caller set are kept. *bounds is set to the bounds to release
+// with the iterator, or to nullptr.
+static ReadOptions BoundToPrefix(const ReadOptions& options,
+                                 const Comparator* ucmp,
+                                 PrefixBounds** bounds) {
+  *bounds = nullptr;
+  ReadOptions result = options;
+  if (options.iterate_prefix == nullptr || ucmp != BytewiseComparator() ||
+      options.iterate_lower_bound != nullptr ||
+      options.iterate_upper_bound != nullptr) {
+    return result;
+  }
+  PrefixBounds* b = new PrefixBounds;
+  b->lower = options.iterate_prefix->ToString();
+  b->upper = b->lower;
+  // Drop the trailing 0xff bytes and increment the last byte left. A prefix
+  // of 0xff bytes only has no upper bound.
+  while (!b->upper.empty() &&
+         static_cast<unsigned char>(b->upper.back()) == 0xff) {
+    b->upper.pop_back();
+  }
+  b->lower_slice = b->lower;
+  result.iterate_lower_bound = &b->lower_slice;
+  if (!b->upper.empty()) {
+    b->upper.back()++;
+    b->upper_slice = b->upper;
+    result.iterate_upper_bound = &b->upper_slice;
+  }
+  *bounds = b;
+  return result;
+}
+
 }  // anonymous namespace
 
-Iterator* DBImpl::NewInternalIterator(const ReadOptions& options,
-                                      SequenceNumber* latest_snapshot,
-                                      uint32_t* seed) {
+Iterator* DBImpl::NewInternalIterator(
+    const ReadOptions& options, SequenceNumber* latest_snapshot,
+    uint32_t* seed, const RangeTombstones** range_tombstones) {
   SequenceNumber snapshot;
   // TODO: make the user defined snapshot work. THe superversion should be confirmed when
   // creating the snapshot.
-  SuperVersion* sv;
+  // The entries of a snapshot are read from the current SuperVersion too,
+  // the newer ones are skipped by the DB iterator.
+  SuperVersion* sv = PinSuperVersion();
   if (options.snapshot != nullptr) {
     snapshot =
         static_cast<const SnapshotImpl*>(options.snapshot)->sequence_number();
 
   } else {
-    snapshot = versions_->LastSequence();
-    sv = GetThreadLocalSuperVersion();
+    snapshot = VisibleSequence();
 
   }
+  *latest_snapshot = snapshot;
 
   MemTable* mem = sv->mem;
   MemTableListVersion* imm = sv->imm;
@@ -3298,17 +5218,25 @@ Iterator* DBImpl::NewInternalIterator(const ReadOptions& options,
 //  mem->Ref();
 //  imm
   imm->AddIteratorsToList(&list);
-  current->AddIterators(options, &list);
+  // The memtables are positioned by every seek, the tables only once they
+  // can have the next key.
+  std::vector<Slice> smallest(list.size());
+  std::vector<Slice> largest(list.size());
+  current->AddIterators(options, &list, &smallest, &largest);
   Iterator* internal_iter =
-      NewMergingIterator(&internal_comparator_, &list[0], list.size());
+      NewMergingIterator(&internal_comparator_, &list[0], list.size(),
+                         &smallest[0], &largest[0]);
 //  versions_->current()->Ref(0);
 
   IterState* cleanup = new IterState(&undefine_mutex, mem, imm, current);
   internal_iter->RegisterCleanup(CleanupIteratorState, cleanup, nullptr);
 
   *seed = ++seed_;
+  if (range_tombstones != nullptr) {
+    *range_tombstones = &current->range_tombstones();
+  }
 //  undefine_mutex.Unlock();
-  ReturnAndCleanupSuperVersion(sv);
+  UnpinSuperVersion(sv);
   return internal_iter;
 }
 #ifdef BYTEADDRESSABLE
@@ -3318,16 +5246,18 @@ Iterator* DBImpl::NewInternalSEQIterator(const ReadOptions& options,
   SequenceNumber snapshot;
   // TODO: make the user defined snapshot work. THe superversion should be confirmed when
   // creating the snapshot.
-  SuperVersion* sv;
+  // The entries of a snapshot are read from the current SuperVersion too,
+  // the newer ones are skipped by the DB iterator.
+  SuperVersion* sv = PinSuperVersion();
   if (options.snapshot != nullptr) {
     snapshot =
         static_cast<const SnapshotImpl*>(options.snapshot)->sequence_number();
 
   } else {
-    snapshot = versions_->LastSequence();
-    sv = GetThreadLocalSuperVersion();
+    snapshot = VisibleSequence();
 
   }
+  *latest_snapshot = snapshot;
 
   MemTable* mem = sv->mem;
   MemTableListVersion* imm = sv->imm;
@@ -3363,9 +5293,12 @@ Iterator* DBImpl::NewInternalSEQIterator(const ReadOptions& options,
 //  mem->Ref();
   //  imm
   imm->AddIteratorsToList(&list);
-  current->AddSEQIterators(options, &list);
+  std::vector<Slice> smallest(list.size());
+  std::vector<Slice> largest(list.size());
+  current->AddSEQIterators(options, &list, &smallest, &largest);
   Iterator* internal_iter =
-      NewMergingIterator(&internal_comparator_, &list[0], list.size());
+      NewMergingIterator(&internal_comparator_, &list[0], list.size(),
+                         &smallest[0], &largest[0]);
 //  versions_->current()->Ref(0);
 
   IterState* cleanup = new IterState(&undefine_mutex, mem, imm, current);
@@ -3373,9 +5306,7 @@ Iterator* DBImpl::NewInternalSEQIterator(const ReadOptions& options,
 
   *seed = ++seed_;
   //  undefine_mutex.Unlock();
-  if (options.snapshot == nullptr){
-    ReturnAndCleanupSuperVersion(sv);
-  }
+  UnpinSuperVersion(sv);
 
   return internal_iter;
 }
@@ -3394,16 +5325,82 @@ int64_t DBImpl::TEST_MaxNextLevelOverlappingBytes() {
 
 Status DBImpl::Get(const ReadOptions& options, const Slice& key,
                    std::string* value) {
-  Status s;
+  tracer_->RecordGet(key);
+  return GetImpl(options, key, value);
+}
+
+Status DBImpl::Get(const ReadOptions& options, const Slice& key,
+                   PinnableSlice* value) {
+  tracer_->RecordGet(key);
+  value->Reset();
+  return GetImpl(options, key, value);
+}
+
+Status DBImpl::GetLarge(const ReadOptions& options, const Slice& key,
+                        const ValueCallback& callback) {
+  tracer_->RecordGet(key);
+  std::string value;
+  std::string blob_index;
+  Status s = GetImpl(options, key, &value, &blob_index);
+  if (!s.ok()) {
+    return s;
+  }
+  if (blob_index.empty()) {
+    callback(value);
+    return s;
+  }
+  return ReadBlob(env_->rdma_mg.get(), blob_index, callback);
+}
+
+static void ClearValue(std::string* value) { value->clear(); }
+static void ClearValue(PinnableSlice* value) { value->Reset(); }
+
+// Apply the merge operands the lookup met to its result.
+static Status FinishMerge(const MergeContext& merge_context, const Slice& key,
+                          const Status& s, std::string* value) {
+  return merge_context.Finish(key, s, value);
+}
+static Status FinishMerge(const MergeContext& merge_context, const Slice& key,
+                          const Status& s, PinnableSlice* value) {
+  std::string merged;
+  if (s.ok()) {
+    merged.assign(value->data(), value->size());
+  }
+  Status result = merge_context.Finish(key, s, &merged);
+  if (result.ok()) {
+    value->Reset();
+    value->PinSelf(merged);
+  }
+  return result;
+}
+
+template <typename Value>
+Status DBImpl::GetImpl(const ReadOptions& options, const Slice& key,
+                       Value* value, std::string* blob_index) {
+  PerfContextGuard perf_guard(options.perf_context);
+  Status s = CheckReplica();
+  if (!s.ok()) {
+    return s;
+  }
   SequenceNumber snapshot;
+  // The negative lookup cache only knows about the latest state, and the
+  // stamp has to be taken before the snapshot.
+  bool cacheable_miss = false;
+  uint64_t miss_stamp = 0;
+  if (negative_cache_ != nullptr && options.snapshot == nullptr) {
+    if (negative_cache_->KnownMissing(key)) {
+      return Status::NotFound(Slice());
+    }
+    cacheable_miss = negative_cache_->Stamp(key, &miss_stamp);
+  }
   if (options.snapshot != nullptr) {
     snapshot =
         static_cast<const SnapshotImpl*>(options.snapshot)->sequence_number();
   } else {
-    snapshot = versions_->LastSequence();
+    snapshot = VisibleSequence();
   }
   //TODO: we should move the get version before the fetching of snapshot.
-  auto sv = GetThreadLocalSuperVersion();
+  auto sv = PinSuperVersion();
 
   MemTable* mem = sv->mem;
   MemTableListVersion* imm = sv->imm;
@@ -3411,82 +5408,1314 @@ Status DBImpl::Get(const ReadOptions& options, const Slice& key,
 
 
   Version::GetStats stats;
+  // The tables a sampled read found nothing in after reading a block.
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> missed_files;
 
   // Unlock while reading from files and memtables
   {
 //    undefine_mutex.Unlock();
     // First look in the memtable, then in the immutable memtable (if any).
     LookupKey lkey(key, snapshot);
-
-    if (mem->Get(lkey, value, &s)) {
-      // Done
-    } else if (imm != nullptr && imm->Get(lkey, value, &s)) {
-      // Done
-    } else {
-      s = current->Get(options, lkey, value, &stats);
-//      have_stat_update = true;
+    // The version drops the values of the tables the range tombstones
+    // delete, those of the memtables are checked here.
+    SequenceNumber entry_seq;
+    bool in_memtable = true;
+    MergeContext merge_context(options_.merge_operator, user_comparator(),
+                               &current->range_tombstones(), snapshot);
+    bool found;
+    {
+      PERF_TIMER_GUARD(memtable_nanos);
+      found = mem->Get(lkey, value, &s, &merge_context, &entry_seq);
+    }
+    if (!found && imm != nullptr) {
+      PERF_TIMER_GUARD(imm_nanos);
+      found = imm->Get(lkey, value, &s, &merge_context, &entry_seq);
+    }
+    if (!found) {
+      in_memtable = false;
+      // The table reads go over RDMA, the rate limiter throttles the
+      // background writes while they are slow.
+      RateLimiter* limiter = options_.rate_limiter;
+      const uint64_t start_micros =
+          limiter != nullptr ? env_->NowMicros() : 0;
+      // Every read_compaction_sample-th read of a thread is sampled.
+      static thread_local uint32_t reads_until_sample = 0;
+      const int sample = options_.read_compaction_sample;
+      if (sample > 0 && reads_until_sample-- == 0) {
+        reads_until_sample = sample - 1;
+        stats.missed_files = &missed_files;
+      }
+      stats.blob_index = blob_index;
+      s = current->Get(options, lkey, value, &stats, &merge_context);
+      if (limiter != nullptr) {
+        limiter->ReportForegroundLatency(env_->NowMicros() - start_micros);
+      }
+      if (stats.read_file != nullptr) {
+        read_sketch_.Increment(HotFileKey(*stats.read_file));
+      }
+    }
+    if (in_memtable && s.ok() &&
+        current->range_tombstones().ShouldDelete(user_comparator(), key,
+                                                 entry_seq, snapshot)) {
+      ClearValue(value);
+      s = Status::NotFound(Slice());
+    }
+    if (!merge_context.empty()) {
+      s = FinishMerge(merge_context, key, s, value);
     }
 //    undefine_mutex.Lock();
   }
-  // TODO keep the file compaction. we remove it as we want.
-//  if (have_stat_update && current->UpdateStats(stats)) {
-//    MaybeScheduleFlushOrCompaction();
-//  }
+  bool marked = false;
+  for (const auto& f : missed_files) {
+    marked |= current->ChargeSeeks(f, options_.read_compaction_sample);
+  }
+  if (marked) {
+    MaybeScheduleFlushOrCompaction();
+  }
   //TOthink: whether we need a lock for the dereference
-  ReturnAndCleanupSuperVersion(sv);
+  UnpinSuperVersion(sv);
+  if (cacheable_miss && s.IsNotFound()) {
+    negative_cache_->Insert(key, miss_stamp);
+  }
   return s;
 }
-
-Iterator* DBImpl::NewIterator(const ReadOptions& options) {
-  SequenceNumber latest_snapshot;
-  uint32_t seed;
-  Iterator* iter = NewInternalIterator(options, &latest_snapshot, &seed);
-  return NewDBIterator(this, user_comparator(), iter,
-                       (options.snapshot != nullptr
-                            ? static_cast<const SnapshotImpl*>(options.snapshot)
-                                  ->sequence_number()
-                            : latest_snapshot),
-                       seed);
-}
-#ifdef BYTEADDRESSABLE
-Iterator* DBImpl::NewSEQIterator(const ReadOptions& options) {
-  SequenceNumber latest_snapshot;
-  uint32_t seed;
-  Iterator* iter = NewInternalSEQIterator(options, &latest_snapshot, &seed);
-  return NewDBIterator(this, user_comparator(), iter,
-                       (options.snapshot != nullptr
-                            ? static_cast<const SnapshotImpl*>(options.snapshot)
-                                  ->sequence_number()
-                            : latest_snapshot),
-                       seed);
-}
-#endif
-void DBImpl::RecordReadSample(Slice key) {
-  MutexLock l(&undefine_mutex);
-  if (versions_->current()->RecordReadSample(key)) {
-    MaybeScheduleFlushOrCompaction();
+std::vector<Status> DBImpl::MultiGet(const ReadOptions& options,
+                                     const std::vector<Slice>& keys,
+                                     std::vector<std::string>* values) {
+  for (const Slice& key : keys) {
+    tracer_->RecordGet(key);
   }
+  return MultiGetImpl(options, keys, values);
 }
 
-const Snapshot* DBImpl::GetSnapshot() {
-  //TODO: get snapshot need to get the superversion before the sequential number
-  MutexLock l(&undefine_mutex);
-  return snapshots_.New(versions_->LastSequence());
-}
-
-void DBImpl::ReleaseSnapshot(const Snapshot* snapshot) {
+std::vector<Status> DBImpl::MultiGetImpl(const ReadOptions& options,
+                                         const std::vector<Slice>& keys,
+                                         std::vector<std::string>* values) {
+  Status replica = CheckReplica();
+  if (!replica.ok()) {
+    values->resize(keys.size());
+    return std::vector<Status>(keys.size(), replica);
+  }
+  SequenceNumber snapshot;
+  if (options.snapshot != nullptr) {
+    snapshot =
+        static_cast<const SnapshotImpl*>(options.snapshot)->sequence_number();
+  } else {
+    snapshot = VisibleSequence();
+  }
+  std::vector<Status> statuses(keys.size());
+  values->resize(keys.size());
+  // All the keys are served by the same super version, so that they see the
+  // same memtables and the same set of files.
+  auto sv = PinSuperVersion();
+
+  MemTable* mem = sv->mem;
+  MemTableListVersion* imm = sv->imm;
+  Version* current = sv->current;
+
+  std::vector<LookupKey*> lkeys;
+  lkeys.reserve(keys.size());
+  // Keys missed by the memtables, they are looked up in the SSTables together.
+  std::vector<const LookupKey*> remain_keys;
+  std::vector<std::string*> remain_values;
+  std::vector<Status*> remain_status;
+  const RangeTombstones& tombstones = current->range_tombstones();
+  for (size_t i = 0; i < keys.size(); i++) {
+    lkeys.push_back(new LookupKey(keys[i], snapshot));
+    SequenceNumber entry_seq;
+    MergeContext merge_context(options_.merge_operator, user_comparator(),
+                               &tombstones, snapshot);
+    if (mem->Get(*lkeys[i], &(*values)[i], &statuses[i], &merge_context,
+                 &entry_seq) ||
+        (imm != nullptr && imm->Get(*lkeys[i], &(*values)[i], &statuses[i],
+                                    &merge_context, &entry_seq))) {
+      if (statuses[i].ok() &&
+          tombstones.ShouldDelete(user_comparator(), keys[i], entry_seq,
+                                  snapshot)) {
+        (*values)[i].clear();
+        statuses[i] = Status::NotFound(Slice());
+      }
+      statuses[i] = merge_context.Finish(keys[i], statuses[i], &(*values)[i]);
+    } else if (!merge_context.empty()) {
+      // The value below the operands of the memtables is looked up on its
+      // own, the batch only takes the keys the memtables know nothing of.
+      Version::GetStats stats;
+      statuses[i] = current->Get(options, *lkeys[i], &(*values)[i], &stats,
+                                 &merge_context);
+      statuses[i] = merge_context.Finish(keys[i], statuses[i], &(*values)[i]);
+    } else {
+      remain_keys.push_back(lkeys[i]);
+      remain_values.push_back(&(*values)[i]);
+      remain_status.push_back(&statuses[i]);
+    }
+  }
+  if (!remain_keys.empty()) {
+    current->MultiGet(options, remain_keys, remain_values, remain_status);
+  }
+  UnpinSuperVersion(sv);
+  for (auto lkey : lkeys) {
+    delete lkey;
+  }
+  return statuses;
+}
+
+void DBImpl::Prefetch(const ReadOptions& options,
+                      const std::vector<Slice>& keys) {
+  if (options_.block_cache == nullptr || keys.empty()) {
+    return;
+  }
+  PrefetchRequest request;
+  request.options = options;
+  request.keys.reserve(keys.size());
+  for (const Slice& key : keys) {
+    request.keys.push_back(key.ToString());
+  }
+  SchedulePrefetch(std::move(request));
+}
+
+void DBImpl::Prefetch(const ReadOptions& options, const Range& range) {
+  if (options_.block_cache == nullptr) {
+    return;
+  }
+  PrefetchRequest request;
+  request.options = options;
+  request.start = range.start.ToString();
+  request.limit = range.limit.ToString();
+  SchedulePrefetch(std::move(request));
+}
+
+void DBImpl::SchedulePrefetch(PrefetchRequest request) {
+  // The caller's snapshot and bounds may be gone by the time the hint is
+  // read, and its deadline past.
+  request.options.snapshot = nullptr;
+  request.options.iterate_lower_bound = nullptr;
+  request.options.iterate_upper_bound = nullptr;
+  request.options.iterate_prefix = nullptr;
+  request.options.deadline = 0;
+  request.options.keys_only = false;
+  request.options.fill_cache = true;
+  Prefetches* prefetches = prefetches_.get();
+  std::call_once(prefetches->started, [this, prefetches] {
+    prefetches->thread = std::thread(&DBImpl::PrefetchLoop, this);
+  });
+  {
+    std::lock_guard<std::mutex> l(prefetches->mu);
+    if (prefetches->requests.size() >= kMaxQueuedPrefetches) {
+      prefetches->requests.pop_front();
+    }
+    prefetches->requests.push_back(std::move(request));
+  }
+  prefetches->cv.notify_one();
+}
+
+void DBImpl::PrefetchLoop() {
+  Prefetches* prefetches = prefetches_.get();
+  const Comparator* ucmp = user_comparator();
+  while (true) {
+    PrefetchRequest request;
+    {
+      std::unique_lock<std::mutex> lck(prefetches->mu);
+      prefetches->cv.wait(lck, [prefetches] {
+        return !prefetches->requests.empty() || prefetches->exit;
+      });
+      if (prefetches->exit) {
+        break;
+      }
+      request = std::move(prefetches->requests.front());
+      prefetches->requests.pop_front();
+    }
+    if (!request.keys.empty()) {
+      std::vector<Slice> keys(request.keys.begin(), request.keys.end());
+      std::vector<std::string> values;
+      MultiGetImpl(request.options, keys, &values);
+      continue;
+    }
+    // The iterator which reads the entries one at a time rather than the
+    // SEQ one, as only the former fills the block_cache. The files out of
+    // the range are skipped.
+    Slice start(request.start);
+    Slice limit(request.limit);
+    request.options.iterate_lower_bound = &start;
+    if (!limit.empty()) {
+      request.options.iterate_upper_bound = &limit;
+    }
+    SequenceNumber ignored;
+    uint32_t ignored_seed;
+    std::unique_ptr<Iterator> iter(
+        NewInternalIterator(request.options, &ignored, &ignored_seed));
+    const size_t capacity = options_.block_cache->GetCapacity();
+    size_t bytes = 0;
+    InternalKey seek_key(start, kMaxSequenceNumber, kValueTypeForSeek);
+    for (iter->Seek(seek_key.Encode()); iter->Valid() && bytes < capacity;
+         iter->Next()) {
+      if (!limit.empty() &&
+          ucmp->Compare(ExtractUserKey(iter->key()), limit) >= 0) {
+        break;
+      }
+      bytes += iter->key().size() + iter->value().size();
+    }
+  }
+}
+
+Iterator* DBImpl::NewIterator(const ReadOptions& user_options) {
+  Status replica = CheckReplica();
+  if (!replica.ok()) {
+    return NewErrorIterator(replica);
+  }
+  PrefixBounds* bounds;
+  const ReadOptions options =
+      BoundToPrefix(user_options, user_comparator(), &bounds);
+  SequenceNumber latest_snapshot;
+  uint32_t seed;
+  const RangeTombstones* range_tombstones;
+  Iterator* iter = NewInternalIterator(options, &latest_snapshot, &seed,
+                                       &range_tombstones);
+  Iterator* result = NewDBIterator(
+      this, user_comparator(), options_.merge_operator, iter,
+      (options.snapshot != nullptr
+           ? static_cast<const SnapshotImpl*>(options.snapshot)
+                 ->sequence_number()
+           : latest_snapshot),
+      seed, range_tombstones, options);
+  if (bounds != nullptr) {
+    result->RegisterCleanup(&DeletePrefixBounds, bounds, nullptr);
+  }
+  if (owns_tracer_ && tracer_->active()) {
+    result = NewTracingIterator(result, tracer_);
+  }
+  return result;
+}
+Iterator* DBImpl::NewRefreshedInternalIterator(
+    const ReadOptions& options, bool seq, SequenceNumber* latest_snapshot,
+    const RangeTombstones** range_tombstones) {
+  uint32_t seed;
+#ifdef BYTEADDRESSABLE
+  if (seq) {
+    *range_tombstones = nullptr;
+    return NewInternalSEQIterator(options, latest_snapshot, &seed);
+  }
+#endif
+  return NewInternalIterator(options, latest_snapshot, &seed, range_tombstones);
+}
+#ifdef BYTEADDRESSABLE
+Iterator* DBImpl::NewSEQIterator(const ReadOptions& user_options) {
+  Status replica = CheckReplica();
+  if (!replica.ok()) {
+    return NewErrorIterator(replica);
+  }
+  PrefixBounds* bounds;
+  const ReadOptions options =
+      BoundToPrefix(user_options, user_comparator(), &bounds);
+  SequenceNumber latest_snapshot;
+  uint32_t seed;
+  Iterator* iter = NewInternalSEQIterator(options, &latest_snapshot, &seed);
+  Iterator* result = NewDBIterator(
+      this, user_comparator(), options_.merge_operator, iter,
+      (options.snapshot != nullptr
+           ? static_cast<const SnapshotImpl*>(options.snapshot)
+                 ->sequence_number()
+           : latest_snapshot),
+      seed, nullptr, options, true);
+  if (bounds != nullptr) {
+    result->RegisterCleanup(&DeletePrefixBounds, bounds, nullptr);
+  }
+  return result;
+}
+#endif
+Status DBImpl::ParallelScan(const ReadOptions& options, const Range& range,
+                            int num_partitions, bool ordered,
+                            const ScanCallback& callback) {
+  ReadOptions scan_options = options;
+  const Snapshot* snapshot = nullptr;
+  if (scan_options.snapshot == nullptr) {
+    // The partitions read the same state of the database.
+    snapshot = GetSnapshot();
+    scan_options.snapshot = snapshot;
+  }
+  std::vector<ScanPartition> partitions;
+  AddScanPartitions(scan_options, range, num_partitions, &partitions);
+  Status s = RunParallelScan(partitions, ordered, callback);
+  if (snapshot != nullptr) {
+    ReleaseSnapshot(snapshot);
+  }
+  return s;
+}
+Status DBImpl::FilteredScan(const ReadOptions& options, const Range& range,
+                            const std::string& filter_name,
+                            const ScanCallback& callback) {
+  if (options_.merge_operator != nullptr) {
+    // The memory nodes resolve the keys of the tables one entry at a time.
+    return Status::NotSupported("FilteredScan with a merge operator");
+  }
+  const ScanFilter* filter = FindScanFilter(filter_name);
+  if (filter == nullptr) {
+    return Status::InvalidArgument("scan filter is not registered",
+                                   filter_name);
+  }
+  const Comparator* ucmp = user_comparator();
+  ScanPushdownRequest scan;
+  scan.snapshot =
+      options.snapshot != nullptr
+          ? static_cast<const SnapshotImpl*>(options.snapshot)->sequence_number()
+          : VisibleSequence();
+  scan.start = range.start.ToString();
+  scan.limit = range.limit.ToString();
+  scan.filter_name = filter_name;
+  // The files overlapping the range and an iterator over the memtables, of
+  // the same SuperVersion.
+  SuperVersion* sv = PinSuperVersion();
+  MemTable* mem = sv->mem;
+  MemTableListVersion* imm = sv->imm;
+  Version* current = sv->current;
+  for (int level = 0; level < config::kNumLevels; level++) {
+    for (const auto& f : current->files(level)) {
+      if ((!range.limit.empty() &&
+           ucmp->Compare(f->smallest.user_key(), range.limit) >= 0) ||
+          ucmp->Compare(f->largest.user_key(), range.start) < 0) {
+        continue;
+      }
+      scan.files[level].push_back(f);
+    }
+  }
+  scan.tombstones = current->range_tombstones();
+  mem->Ref();
+  imm->Ref();
+  current->Ref(7);
+  std::vector<Iterator*> list;
+  list.push_back(mem->NewIterator());
+  imm->AddIteratorsToList(&list);
+  Iterator* mem_iter =
+      NewMergingIterator(&internal_comparator_, &list[0], list.size());
+  mem_iter->RegisterCleanup(CleanupIteratorState,
+                            new IterState(&undefine_mutex, mem, imm, current),
+                            nullptr);
+  UnpinSuperVersion(sv);
+  std::unique_ptr<Iterator> mem_iter_guard(mem_iter);
+  ScanResolver mem_resolver(mem_iter, ucmp, scan.snapshot, range.limit,
+                            &scan.tombstones, filter, env_->rdma_mg.get());
+  mem_resolver.Seek(range.start);
+
+  std::string payload;
+  scan.EncodeTo(&payload);
+  std::shared_ptr<RDMA_Manager> rdma_mg = env_->rdma_mg;
+  ibv_mr scan_mr = {};
+  rdma_mg->Allocate_Local_RDMA_Slot(scan_mr, Version_edit);
+  if (payload.size() + 1 > scan_mr.length) {
+    // The file list does not fit a request, scan here.
+    rdma_mg->Deallocate_Local_RDMA_Slot(scan_mr.addr, Version_edit);
+    SequenceNumber ignored;
+    uint32_t ignored_seed;
+    Iterator* iter = NewInternalIterator(options, &ignored, &ignored_seed);
+    std::unique_ptr<Iterator> iter_guard(iter);
+    ScanResolver resolver(iter, ucmp, scan.snapshot, range.limit,
+                          &scan.tombstones, filter, rdma_mg.get());
+    for (resolver.Seek(range.start); resolver.Valid(); resolver.Next()) {
+      if (resolver.kept() && !callback(resolver.key(), resolver.value())) {
+        break;
+      }
+    }
+    return resolver.status();
+  }
+  memcpy(scan_mr.addr, payload.data(), payload.size());
+  // The memory node polls on the byte after the payload.
+  static_cast<char*>(scan_mr.addr)[payload.size()] = 1;
+
+  ibv_mr send_mr = {};
+  ibv_mr receive_mr = {};
+  ibv_mr batch_mr = {};
+  ibv_mr credit_mr = {};
+  rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+  rdma_mg->Allocate_Local_RDMA_Slot(receive_mr, Message);
+  rdma_mg->Allocate_Local_RDMA_Slot(batch_mr, Version_edit);
+  rdma_mg->Allocate_Local_RDMA_Slot(credit_mr, Message);
+  RDMA_Request* send_pointer = (RDMA_Request*)send_mr.addr;
+  send_pointer->command = scan_pushdown_;
+  send_pointer->content.sp = {};
+  send_pointer->content.sp.size = payload.size();
+  send_pointer->content.sp.batch = batch_mr.addr;
+  send_pointer->content.sp.batch_rkey = batch_mr.rkey;
+  send_pointer->content.sp.capacity = batch_mr.length;
+  send_pointer->buffer = receive_mr.addr;
+  send_pointer->rkey = receive_mr.rkey;
+  send_pointer->buffer_large = scan_mr.addr;
+  send_pointer->rkey_large = scan_mr.rkey;
+  RDMA_Reply* receive_pointer = (RDMA_Reply*)receive_mr.addr;
+  //Clear the reply buffer for the polling.
+  *receive_pointer = {};
+  rdma_mg->post_send<RDMA_Request>(&send_mr, shard_target_node_id,
+                                   std::string("main"));
+  ibv_wc wc[2] = {};
+  Status s;
+  if (rdma_mg->poll_completion(wc, 1, std::string("main"), true,
+                               shard_target_node_id)) {
+    s = Status::IOError("failed to send the pushed down scan");
+  }
+  bool stopped = false;
+  uint64_t batches = 0;
+  bool last = !s.ok();
+  while (!last) {
+    rdma_mg->poll_reply_buffer(receive_pointer);
+    const scan_pushdown reply = receive_pointer->content.sp;
+    *receive_pointer = {};
+    last = reply.last;
+    if (!reply.ok) {
+      s = Status::IOError("pushed down scan failed on the memory node");
+      break;
+    }
+    // Merge the kept entries of the batch with the memtables, which are
+    // newer. A memtable key which is not kept hides the one of the batch.
+    Slice input(static_cast<char*>(batch_mr.addr), reply.size);
+    while (!stopped && !input.empty()) {
+      Slice key, value;
+      if (!GetLengthPrefixedSlice(&input, &key) ||
+          !GetLengthPrefixedSlice(&input, &value)) {
+        s = Status::Corruption("bad pushed down scan batch");
+        stopped = true;
+        break;
+      }
+      bool hidden = false;
+      for (; !stopped && mem_resolver.Valid(); mem_resolver.Next()) {
+        const int r = ucmp->Compare(mem_resolver.key(), key);
+        if (r > 0) {
+          break;
+        }
+        hidden = r == 0;
+        if (mem_resolver.kept() &&
+            !callback(mem_resolver.key(), mem_resolver.value())) {
+          stopped = true;
+        }
+      }
+      if (!stopped && !hidden && !callback(key, value)) {
+        stopped = true;
+      }
+    }
+    batches++;
+    if (last) {
+      break;
+    }
+    // Hand the batch buffer back to the memory node.
+    *static_cast<uint64_t*>(credit_mr.addr) =
+        stopped ? SCAN_PUSHDOWN_ABORT : batches;
+    rdma_mg->RDMA_Write(reply.credit, reply.credit_rkey, &credit_mr,
+                        sizeof(uint64_t), std::string("main"),
+                        IBV_SEND_SIGNALED, 1, shard_target_node_id);
+    if (stopped) {
+      break;
+    }
+  }
+  if (s.ok() && !stopped) {
+    for (; mem_resolver.Valid(); mem_resolver.Next()) {
+      if (mem_resolver.kept() &&
+          !callback(mem_resolver.key(), mem_resolver.value())) {
+        break;
+      }
+    }
+  }
+  if (s.ok()) {
+    s = mem_resolver.status();
+  }
+  rdma_mg->Deallocate_Local_RDMA_Slot(credit_mr.addr, Message);
+  rdma_mg->Deallocate_Local_RDMA_Slot(batch_mr.addr, Version_edit);
+  rdma_mg->Deallocate_Local_RDMA_Slot(receive_mr.addr, Message);
+  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
+  rdma_mg->Deallocate_Local_RDMA_Slot(scan_mr.addr, Version_edit);
+  return s;
+}
+void DBImpl::AddScanPartitions(const ReadOptions& options, const Range& range,
+                               int num_partitions,
+                               std::vector<ScanPartition>* partitions) {
+  const Comparator* ucmp = user_comparator();
+  // The smallest key and the size of every file which starts within the
+  // range, and the bytes of all the files overlapping it.
+  std::vector<std::pair<std::string, uint64_t>> starts;
+  uint64_t total_bytes = 0;
+  SuperVersion* sv = PinSuperVersion();
+  for (int level = 0; level < config::kNumLevels; level++) {
+    for (const auto& f : sv->current->files(level)) {
+      Slice smallest = f->smallest.user_key();
+      if ((!range.limit.empty() && ucmp->Compare(smallest, range.limit) >= 0) ||
+          ucmp->Compare(f->largest.user_key(), range.start) < 0) {
+        continue;
+      }
+      total_bytes += f->file_size;
+      if (ucmp->Compare(smallest, range.start) > 0) {
+        starts.emplace_back(smallest.ToString(), f->file_size);
+      }
+    }
+  }
+  UnpinSuperVersion(sv);
+  std::sort(starts.begin(), starts.end(),
+            [ucmp](const std::pair<std::string, uint64_t>& a,
+                   const std::pair<std::string, uint64_t>& b) {
+              return ucmp->Compare(a.first, b.first) < 0;
+            });
+  // The files which start before a split are read before it, roughly.
+  uint64_t bytes_before = total_bytes;
+  for (const auto& start : starts) {
+    bytes_before -= start.second;
+  }
+  std::vector<std::string> splits;
+  const uint64_t parts = std::max(num_partitions, 1);
+  for (const auto& start : starts) {
+    if (splits.size() + 1 == parts) {
+      break;
+    }
+    if (bytes_before * parts >= total_bytes * (splits.size() + 1) &&
+        (splits.empty() || ucmp->Compare(start.first, splits.back()) > 0)) {
+      splits.push_back(start.first);
+    }
+    bytes_before += start.second;
+  }
+  std::string start = range.start.ToString();
+  for (std::string& split : splits) {
+    partitions->push_back({this, ucmp, options, start, split});
+    start = std::move(split);
+  }
+  partitions->push_back({this, ucmp, options, start, range.limit.ToString()});
+}
+void DBImpl::RecordReadSample(Slice key) {
+  if (options_.read_compaction_sample <= 0) {
+    return;
+  }
   MutexLock l(&undefine_mutex);
+  if (versions_->current()->RecordReadSample(key)) {
+    MaybeScheduleFlushOrCompaction();
+  }
+}
+
+const Snapshot* DBImpl::GetSnapshot() {
+  //TODO: get snapshot need to get the superversion before the sequential number
+  // Counted before its sequence is read, see InsertBatchIntoMemtables.
+  num_snapshots_.fetch_add(1);
+  return snapshots_.New([this]() { return VisibleSequence(); });
+}
+
+void DBImpl::ReleaseSnapshot(const Snapshot* snapshot) {
   snapshots_.Delete(static_cast<const SnapshotImpl*>(snapshot));
+  num_snapshots_.fetch_sub(1);
 }
 
 // Convenience methods
 Status DBImpl::Put(const WriteOptions& o, const Slice& key, const Slice& val) {
+  Status s;
+  if (WriteSingle(o, kTypeValue, key, val, &s)) {
+    return s;
+  }
   return DB::Put(o, key, val);
 }
 
 Status DBImpl::Delete(const WriteOptions& options, const Slice& key) {
+  Status s;
+  if (WriteSingle(options, kTypeDeletion, key, Slice(), &s)) {
+    return s;
+  }
   return DB::Delete(options, key);
 }
+
+Status DBImpl::Merge(const WriteOptions& options, const Slice& key,
+                     const Slice& value) {
+  if (options_.merge_operator == nullptr) {
+    return Status::InvalidArgument("Merge", "no merge operator");
+  }
+  Status s;
+  if (WriteSingle(options, kTypeMerge, key, value, &s)) {
+    return s;
+  }
+  return DB::Merge(options, key, value);
+}
+
+Status DBImpl::DeleteRange(const WriteOptions& options, const Slice& begin,
+                           const Slice& end) {
+  if (IsReplica()) {
+    return Status::NotSupported("DeleteRange on a read replica");
+  }
+  if (user_comparator()->Compare(begin, end) >= 0) {
+    return Status::OK();
+  }
+  RangeTombstone tombstone;
+  tombstone.begin = begin.ToString();
+  tombstone.end = end.ToString();
+  // The tombstone takes a sequence number of the write path, the memtable it
+  // falls in counts it so that the memtable still fills up.
+  tombstone.sequence = AssignSequences(1);
+  MemTable* mem;
+  Status s = PickupTableToWrite(false, tombstone.sequence, mem);
+  if (!s.ok()) {
+    return s;
+  }
+  VersionEdit edit(0);
+  edit.AddRangeTombstone(tombstone);
+  {
+    std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+    s = versions_->LogAndApply(&edit);
+    InstallSuperVersion();
+  }
+  mem->increase_seq_count(1);
+  if (s.ok()) {
+    DropCoveredFiles();
+  }
+  return s;
+}
+
+Status DBImpl::IngestSorted(Iterator* input) {
+  if (IsReplica()) {
+    return Status::NotSupported("IngestSorted on a read replica");
+  }
+  input->SeekToFirst();
+  if (!input->Valid()) {
+    return input->status();
+  }
+  // The entries take a sequence number of the write path as a range
+  // tombstone does, the memtable it falls in counts it.
+  const SequenceNumber sequence = AssignSequences(1);
+  MemTable* mem;
+  Status s = PickupTableToWrite(false, sequence, mem);
+  if (!s.ok()) {
+    return s;
+  }
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> tables;
+  s = BuildIngestedTables(input, sequence, &tables);
+  if (s.ok() && !tables.empty()) {
+    const Slice smallest = tables.front()->smallest.user_key();
+    const Slice largest = tables.back()->largest.user_key();
+    std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+    std::vector<MemTable*> mems(imm_.current()->memlist_.begin(),
+                                imm_.current()->memlist_.end());
+    mems.push_back(mem_.load());
+    if (MemTablesOverlap(mems, smallest, largest)) {
+      // Their older entries would be read before the tables.
+      s = Status::InvalidArgument("the ingested keys overlap the memtables");
+    } else {
+      // The compactions pick their files under the same mutex, the level
+      // does not change before the edit is applied.
+      const int level = PickLevelForIngestion(smallest, largest);
+      VersionEdit edit(0);
+      for (const auto& table : tables) {
+        table->level = level;
+        edit.AddFile(level, table);
+      }
+      if (negative_cache_ != nullptr) {
+        negative_cache_->BeginWriteAll();
+      }
+      s = versions_->LogAndApply(&edit);
+#ifdef WITHPERSISTENCE
+      // The ingested tables reach the memory node before the call returns.
+      Edit_sync_to_remote(&edit, true);
+#endif
+      InstallSuperVersion();
+      if (negative_cache_ != nullptr) {
+        negative_cache_->EndWriteAll();
+      }
+      Log(options_.info_log, "Ingested %zu tables at level-%d",
+          tables.size(), level);
+    }
+  }
+  mem->increase_seq_count(1);
+  // The tables not installed free their chunks when they are dropped.
+  if (s.ok()) {
+    MaybeScheduleFlushOrCompaction();
+  }
+  return s;
+}
+
+// The tables are cut at max_file_size as the outputs of a compaction are.
+Status DBImpl::BuildIngestedTables(
+    Iterator* input, SequenceNumber sequence,
+    std::vector<std::shared_ptr<RemoteMemTableMetaData>>* tables) {
+  const Comparator* ucmp = user_comparator();
+  Status s;
+  TableBuilder* builder = nullptr;
+  // Frees the chunks it has not handed over when it goes.
+  std::unique_ptr<BlobWriter> blob_writer;
+  std::shared_ptr<RemoteMemTableMetaData> meta;
+  std::string last_key;
+  std::string blob_index;
+  for (; input->Valid(); input->Next()) {
+    const Slice key = input->key();
+    if (meta != nullptr && ucmp->Compare(key, last_key) <= 0) {
+      s = Status::InvalidArgument(
+          "the ingested keys are not in strictly ascending order");
+      break;
+    }
+    InternalKey ikey(key, sequence, kTypeValue);
+    Slice value = input->value();
+    if ((options_.min_blob_size > 0 &&
+         value.size() >= options_.min_blob_size) ||
+        TooLargeForTable(env_->rdma_mg.get(), ikey.Encode(), value)) {
+      if (blob_writer == nullptr) {
+        blob_writer.reset(new BlobWriter(env_->rdma_mg, shard_target_node_id));
+      }
+      blob_writer->Add(value, &blob_index);
+      ikey = InternalKey(key, sequence, kTypeBlobIndex);
+      value = blob_index;
+    }
+    if (builder == nullptr) {
+      meta = std::make_shared<RemoteMemTableMetaData>(
+          0, versions_->table_cache_, shard_target_node_id);
+      meta->number = versions_->NewFileNumber();
+      meta->smallest = ikey;
+      meta->largest_seq = sequence;
+#ifndef BYTEADDRESSABLE
+      builder = new TableBuilder_ComputeSide(options_, Compact,
+                                             shard_target_node_id);
+#endif
+#ifdef BYTEADDRESSABLE
+      builder = new TableBuilder_BACS(options_, Compact, shard_target_node_id);
+#endif
+    }
+    builder->Add(ikey.Encode(), value);
+    meta->largest = ikey;
+    last_key.assign(key.data(), key.size());
+    if (builder->FileSize() >= options_.max_file_size) {
+      s = FinishIngestedTable(builder, blob_writer.get(), meta);
+      builder = nullptr;
+      blob_writer.reset();
+      if (!s.ok()) {
+        break;
+      }
+      tables->push_back(meta);
+    }
+  }
+  if (s.ok()) {
+    s = input->status();
+  }
+  if (builder != nullptr) {
+    if (s.ok()) {
+      s = FinishIngestedTable(builder, blob_writer.get(), meta);
+      if (s.ok()) {
+        tables->push_back(meta);
+      }
+    } else {
+      builder->Abandon();
+      builder->get_datablocks_map(meta->remote_data_mrs);
+      builder->get_dataindexblocks_map(meta->remote_dataindex_mrs);
+      builder->get_filter_map(meta->remote_filter_mrs);
+      delete builder;
+    }
+  }
+  return s;
+}
+
+Status DBImpl::FinishIngestedTable(
+    TableBuilder* builder, BlobWriter* blob_writer,
+    const std::shared_ptr<RemoteMemTableMetaData>& meta) {
+  Status s = builder->Finish();
+  // The chunks go to meta either way so that it frees them when dropped.
+  if (blob_writer != nullptr) {
+    std::vector<uint64_t> chunks;
+    Status blob_status = blob_writer->Finish(&chunks);
+    if (s.ok()) {
+      s = blob_status;
+    }
+    meta->SetBlobChunks(std::move(chunks));
+  }
+  builder->get_datablocks_map(meta->remote_data_mrs);
+  builder->get_dataindexblocks_map(meta->remote_dataindex_mrs);
+  builder->get_filter_map(meta->remote_filter_mrs);
+  meta->prefix_extractor = FilterPrefixName(options_);
+  meta->file_size = builder->FileSize();
+  meta->num_entries = builder->NumEntries();
+  meta->num_deletions = builder->NumDeletions();
+  meta->key_stats = builder->KeyStats();
+  meta->creation_time = env_->NowMicros() / 1000000;
+  delete builder;
+  if (s.ok()) {
+    Log(options_.info_log, "Ingested table #%llu: %lld keys, %lld bytes",
+        (unsigned long long)meta->number,
+        (unsigned long long)meta->num_entries,
+        (unsigned long long)meta->file_size);
+  }
+  return s;
+}
+
+bool DBImpl::MemTablesOverlap(const std::vector<MemTable*>& mems,
+                              const Slice& smallest, const Slice& largest) {
+  const Comparator* ucmp = user_comparator();
+  InternalKey start(smallest, kMaxSequenceNumber, kValueTypeForSeek);
+  for (MemTable* m : mems) {
+    std::unique_ptr<Iterator> iter(m->NewIterator());
+    iter->Seek(start.Encode());
+    if (iter->Valid() &&
+        ucmp->Compare(ExtractUserKey(iter->key()), largest) <= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The tables are newer than everything in the levels. They go below level 0
+// past the levels they do not overlap, and not into a level a compaction is
+// writing into, whose outputs could overlap them.
+int DBImpl::PickLevelForIngestion(const Slice& smallest,
+                                  const Slice& largest) {
+  Version* current = versions_->current();
+  if (current->OverlapInLevel(0, &smallest, &largest)) {
+    return 0;
+  }
+  int level = 0;
+  while (level + 1 < config::kNumLevels &&
+         !current->OverlapInLevel(level + 1, &smallest, &largest)) {
+    bool compacting = false;
+    for (const auto& f : current->files(level)) {
+      if (f->UnderCompaction) {
+        compacting = true;
+        break;
+      }
+    }
+    if (compacting) {
+      break;
+    }
+    level++;
+  }
+  return level;
+}
+
+void DBImpl::AdvanceSequence(SequenceNumber sequence) {
+  std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+  if (versions_->LastSequence() >= sequence) {
+    return;
+  }
+  versions_->SetLastSequence(sequence);
+  // The sequences leased before it are not taken anymore.
+  std::vector<std::pair<uint64_t, uint64_t>> unused;
+  ClaimSequenceLeases(&unused);
+  skipped_sequences_.clear();
+  // The window of the memtable is behind the sequence now, it is replaced
+  // by an empty one whose window starts there.
+  MemTable* old_mem = mem_.load();
+  const size_t seq_window = old_mem->SeqWindow();
+  MemTable* mem = NewMemTable(seq_window);
+  mem->SetFirstSeq(sequence);
+  mem->SetLargestSeq(sequence + seq_window - 1);
+  mem->Ref();
+  mem_.store(mem);
+  InstallSuperVersion();
+  old_mem->NotFullTableflush();
+  old_mem->Unref();
+}
+
+Status DBImpl::MoveTablesFrom(const Slice& key, DBImpl* target) {
+  const Comparator* ucmp = user_comparator();
+  target->versions_->MarkFileNumberUsed(versions_->NewFileNumber());
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>>
+      files[config::kNumLevels];
+  RangeTombstones tombstones;
+  {
+    std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+    Version* current = versions_->current();
+    for (int level = 0; level < config::kNumLevels; level++) {
+      files[level] = current->files(level);
+    }
+    tombstones = current->range_tombstones();
+  }
+  // The tables of this shard rewritten under the numbers of the removed
+  // ones, which the edit removing them would cancel, go in a second edit.
+  VersionEdit remove_edit(0);
+  VersionEdit low_edit(0);
+  VersionEdit high_edit(0);
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> moved;
+  Status s;
+  for (int level = 0; s.ok() && level < config::kNumLevels; level++) {
+    for (const auto& f : files[level]) {
+      if (ucmp->Compare(f->largest.user_key(), key) < 0) {
+        continue;
+      }
+      remove_edit.RemoveFile(level, f->number, f->creator_node_id);
+      if (ucmp->Compare(f->smallest.user_key(), key) >= 0) {
+        moved.push_back(f);
+        high_edit.AddFile(level, f);
+        continue;
+      }
+      std::shared_ptr<RemoteMemTableMetaData> low;
+      std::shared_ptr<RemoteMemTableMetaData> high;
+      s = SplitTable(f, key, target, &low, &high);
+      if (!s.ok()) {
+        break;
+      }
+      low_edit.AddFile(level, low);
+      high_edit.AddFile(level, high);
+    }
+  }
+  if (!s.ok()) {
+    // The tables rewritten so far free their chunks when they are dropped.
+    return s;
+  }
+  for (const RangeTombstone& tombstone : tombstones.tombstones()) {
+    if (ucmp->Compare(tombstone.end, key) > 0) {
+      RangeTombstone clipped = tombstone;
+      if (ucmp->Compare(clipped.begin, key) < 0) {
+        clipped.begin = key.ToString();
+      }
+      high_edit.AddRangeTombstone(clipped);
+    }
+  }
+  {
+    std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+    s = versions_->LogAndApply(&remove_edit);
+    if (s.ok() && low_edit.GetNewFilesNum() != 0) {
+      s = versions_->LogAndApply(&low_edit);
+    }
+    InstallSuperVersion();
+  }
+  if (!s.ok()) {
+    return s;
+  }
+  for (const auto& f : moved) {
+    table_cache_->Evict(f->number, f->creator_node_id);
+    f->table_cache = target->table_cache_;
+  }
+  if (target->negative_cache_ != nullptr) {
+    target->negative_cache_->BeginWriteAll();
+  }
+  {
+    std::unique_lock<std::mutex> l(target->superversion_memlist_mtx);
+    s = target->versions_->LogAndApply(&high_edit);
+    target->InstallSuperVersion();
+  }
+  if (target->negative_cache_ != nullptr) {
+    target->negative_cache_->EndWriteAll();
+  }
+  Log(options_.info_log, "Moved %zu tables from '%s' on to shard %d, %zu split",
+      moved.size(), key.ToString().c_str(), target->shard_id,
+      low_edit.GetNewFilesNum());
+  return s;
+}
+
+Status DBImpl::SplitTable(
+    const std::shared_ptr<RemoteMemTableMetaData>& table, const Slice& key,
+    DBImpl* target, std::shared_ptr<RemoteMemTableMetaData>* low,
+    std::shared_ptr<RemoteMemTableMetaData>* high) {
+  ReadOptions read_options;
+  read_options.fill_cache = false;
+  std::unique_ptr<Iterator> iter(
+      table_cache_->NewIterator(read_options, table));
+  iter->SeekToFirst();
+  Status s = CopyTableEntries(*table, iter.get(), key, this, low);
+  if (s.ok()) {
+    s = CopyTableEntries(*table, iter.get(), Slice(), target, high);
+  }
+  if (s.ok() && (*low == nullptr || *high == nullptr)) {
+    s = Status::Corruption("the table has no keys on one side of the split");
+  }
+  return s;
+}
+
+Status DBImpl::CopyTableEntries(const RemoteMemTableMetaData& table,
+                                Iterator* input, const Slice& limit,
+                                DBImpl* owner,
+                                std::shared_ptr<RemoteMemTableMetaData>* copy) {
+  const Comparator* ucmp = user_comparator();
+  TableBuilder* builder = nullptr;
+  std::shared_ptr<RemoteMemTableMetaData> meta;
+  for (; input->Valid(); input->Next()) {
+    const Slice ikey = input->key();
+    if (!limit.empty() && ucmp->Compare(ExtractUserKey(ikey), limit) >= 0) {
+      break;
+    }
+    if (builder == nullptr) {
+      meta = std::make_shared<RemoteMemTableMetaData>(
+          0, owner->versions_->table_cache_, owner->shard_target_node_id);
+      meta->number = table.number;
+      meta->level = table.level;
+      meta->smallest.DecodeFrom(ikey);
+      meta->largest_seq = table.largest_seq;
+#ifndef BYTEADDRESSABLE
+      builder = new TableBuilder_ComputeSide(
+          owner->options_, Compact, owner->shard_target_node_id,
+          owner->versions_->BloomBitsForLevel(table.level));
+#endif
+#ifdef BYTEADDRESSABLE
+      builder = new TableBuilder_BACS(
+          owner->options_, Compact, owner->shard_target_node_id, table.level,
+          owner->versions_->BloomBitsForLevel(table.level));
+#endif
+    }
+    builder->Add(ikey, input->value());
+    meta->largest.DecodeFrom(ikey);
+  }
+  Status s = input->status();
+  if (builder != nullptr) {
+    if (s.ok()) {
+      s = owner->FinishIngestedTable(builder, nullptr, meta);
+      if (s.ok()) {
+        *copy = meta;
+      }
+    } else {
+      builder->Abandon();
+      builder->get_datablocks_map(meta->remote_data_mrs);
+      builder->get_dataindexblocks_map(meta->remote_dataindex_mrs);
+      builder->get_filter_map(meta->remote_filter_mrs);
+      delete builder;
+    }
+  }
+  return s;
+}
+
+Status DBImpl::CopyTablesTo(
+    DBImpl* target, bool install,
+    std::map<std::shared_ptr<RemoteMemTableMetaData>,
+             std::shared_ptr<RemoteMemTableMetaData>>* copies) {
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> files;
+  RangeTombstones tombstones;
+  {
+    std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+    Version* current = versions_->current();
+    for (int level = 0; level < config::kNumLevels; level++) {
+      const auto& level_files = current->files(level);
+      files.insert(files.end(), level_files.begin(), level_files.end());
+    }
+    tombstones = current->range_tombstones();
+  }
+  // The copies of the tables compacted away since the last call.
+  std::set<std::shared_ptr<RemoteMemTableMetaData>> live(files.begin(),
+                                                         files.end());
+  for (auto iter = copies->begin(); iter != copies->end();) {
+    if (live.count(iter->first) == 0) {
+      iter = copies->erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+  ReadOptions read_options;
+  read_options.fill_cache = false;
+  Status s;
+  size_t copied = 0;
+  for (const auto& f : files) {
+    if (copies->count(f) != 0) {
+      continue;
+    }
+    std::unique_ptr<Iterator> iter(table_cache_->NewIterator(read_options, f));
+    iter->SeekToFirst();
+    std::shared_ptr<RemoteMemTableMetaData> copy;
+    s = CopyTableEntries(*f, iter.get(), Slice(), target, &copy);
+    if (!s.ok()) {
+      return s;
+    }
+    if (copy == nullptr) {
+      return Status::Corruption("a table to copy has no entries");
+    }
+    (*copies)[f] = copy;
+    copied++;
+  }
+  Log(options_.info_log, "Copied %zu tables over to shard %d", copied,
+      target->shard_id);
+  if (!install) {
+    return s;
+  }
+  // The copies keep the numbers of the tables, the ones of "target" go on
+  // after them.
+  target->versions_->MarkFileNumberUsed(versions_->NewFileNumber());
+  VersionEdit edit(0);
+  for (const auto& f : files) {
+    const std::shared_ptr<RemoteMemTableMetaData>& copy = (*copies)[f];
+    // A trivial move may have changed the level since it was copied.
+    copy->level = f->level;
+    edit.AddFile(copy->level, copy);
+  }
+  for (const RangeTombstone& tombstone : tombstones.tombstones()) {
+    edit.AddRangeTombstone(tombstone);
+  }
+  if (target->negative_cache_ != nullptr) {
+    target->negative_cache_->BeginWriteAll();
+  }
+  {
+    std::unique_lock<std::mutex> l(target->superversion_memlist_mtx);
+    s = target->versions_->LogAndApply(&edit);
+    target->InstallSuperVersion();
+  }
+  if (target->negative_cache_ != nullptr) {
+    target->negative_cache_->EndWriteAll();
+  }
+  return s;
+}
+
+Status DBImpl::TakeOverTables(DBImpl* other) {
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> files;
+  RangeTombstones tombstones;
+  VersionEdit remove_edit(0);
+  {
+    std::unique_lock<std::mutex> l(other->superversion_memlist_mtx);
+    Version* current = other->versions_->current();
+    for (int level = 0; level < config::kNumLevels; level++) {
+      for (const auto& f : current->files(level)) {
+        remove_edit.RemoveFile(level, f->number, f->creator_node_id);
+        files.push_back(f);
+      }
+    }
+    tombstones = current->range_tombstones();
+  }
+  {
+    // A range tombstone is removed by its sequence number, which the
+    // shards hand out apart.
+    std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+    for (const RangeTombstone& own :
+         versions_->current()->range_tombstones().tombstones()) {
+      for (const RangeTombstone& tombstone : tombstones.tombstones()) {
+        if (own.sequence == tombstone.sequence) {
+          return Status::NotSupported(
+              "the range tombstones of the shards share a sequence number");
+        }
+      }
+    }
+  }
+  VersionEdit add_edit(0);
+  for (const RangeTombstone& tombstone : tombstones.tombstones()) {
+    remove_edit.RemoveRangeTombstone(tombstone.sequence);
+    add_edit.AddRangeTombstone(tombstone);
+  }
+  Status s;
+  {
+    std::unique_lock<std::mutex> l(other->superversion_memlist_mtx);
+    s = other->versions_->LogAndApply(&remove_edit);
+    other->InstallSuperVersion();
+  }
+  if (!s.ok()) {
+    return s;
+  }
+  // Renumbered in the order of their numbers, which keeps the one of the
+  // level 0 tables.
+  std::sort(files.begin(), files.end(),
+            [](const std::shared_ptr<RemoteMemTableMetaData>& a,
+               const std::shared_ptr<RemoteMemTableMetaData>& b) {
+              return a->number < b->number;
+            });
+  for (const auto& f : files) {
+    other->table_cache_->Evict(f->number, f->creator_node_id);
+    f->number = versions_->NewFileNumber();
+    f->table_cache = table_cache_;
+    add_edit.AddFile(f->level, f);
+  }
+  // The tables bring the keys the other shard was written since the split.
+  if (negative_cache_ != nullptr) {
+    negative_cache_->BeginWriteAll();
+  }
+  {
+    std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+    s = versions_->LogAndApply(&add_edit);
+    InstallSuperVersion();
+  }
+  if (negative_cache_ != nullptr) {
+    negative_cache_->EndWriteAll();
+  }
+  Log(options_.info_log, "Took over %zu tables of shard %d", files.size(),
+      other->shard_id);
+  if (s.ok()) {
+    MaybeScheduleFlushOrCompaction();
+  }
+  return s;
+}
+
+void DBImpl::DropCoveredFiles() {
+  SequenceNumber smallest_snapshot =
+      snapshots_.Oldest(VisibleSequence());
+  std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+  Version* current = versions_->current();
+  const RangeTombstones& tombstones = current->range_tombstones();
+  if (tombstones.empty()) {
+    return;
+  }
+  const Comparator* ucmp = user_comparator();
+  VersionEdit edit(0);
+  int dropped_files = 0;
+  // The tables which stay, the ones under compaction are never dropped here.
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> kept;
+  for (int level = 0; level < config::kNumLevels; level++) {
+    for (const auto& f : current->files(level)) {
+      if (!f->UnderCompaction &&
+          tombstones.CoversRange(ucmp, f->smallest.user_key(),
+                                 f->largest.user_key(), f->largest_seq,
+                                 smallest_snapshot)) {
+        edit.RemoveFile(level, f->number, f->creator_node_id);
+        dropped_files++;
+      } else {
+        kept.push_back(f);
+      }
+    }
+  }
+  // A tombstone deletes nothing any more once no table overlaps it and the
+  // memtables only hold newer entries.
+  const SequenceNumber first_memtable_seq = std::min<SequenceNumber>(
+      mem_.load()->GetFirstseq(), imm_.current()->GetFirstSequence());
+  int dropped_tombstones = 0;
+  for (const RangeTombstone& t : tombstones.tombstones()) {
+    if (t.sequence >= first_memtable_seq) {
+      continue;
+    }
+    bool overlapped = false;
+    for (const auto& f : kept) {
+      if (ucmp->Compare(f->largest.user_key(), t.begin) >= 0 &&
+          ucmp->Compare(f->smallest.user_key(), t.end) < 0) {
+        overlapped = true;
+        break;
+      }
+    }
+    if (!overlapped) {
+      edit.RemoveRangeTombstone(t.sequence);
+      dropped_tombstones++;
+    }
+  }
+  if (dropped_files == 0 && dropped_tombstones == 0) {
+    return;
+  }
+  Status s = versions_->LogAndApply(&edit);
+  InstallSuperVersion();
+  if (!s.ok()) {
+    RecordBackgroundError(s);
+  }
+  Log(options_.info_log, "Dropped %d tables and %d range tombstones: %s\n",
+      dropped_files, dropped_tombstones, s.ToString().c_str());
+}
+
+void DBImpl::DropExpiredFiles() {
+  if (options_.compaction_style != kCompactionStyleFIFO) {
+    return;
+  }
+  std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+  Version* current = versions_->current();
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> tables;
+  uint64_t total_bytes = 0;
+  for (int level = 0; level < config::kNumLevels; level++) {
+    for (const auto& f : current->files(level)) {
+      if (!f->UnderCompaction) {
+        tables.push_back(f);
+        total_bytes += f->file_size;
+      }
+    }
+  }
+  // The oldest entries first.
+  std::sort(tables.begin(), tables.end(),
+            [](const std::shared_ptr<RemoteMemTableMetaData>& a,
+               const std::shared_ptr<RemoteMemTableMetaData>& b) {
+              return a->largest_seq < b->largest_seq;
+            });
+  const uint64_t now = env_->NowMicros() / 1000000;
+  VersionEdit edit(0);
+  int dropped_files = 0;
+  for (const auto& f : tables) {
+    const bool expired = options_.ttl > 0 && f->creation_time > 0 &&
+                         f->creation_time + options_.ttl < now;
+    if (!expired && total_bytes <= options_.fifo_max_table_files_size) {
+      break;
+    }
+    edit.RemoveFile(f->level, f->number, f->creator_node_id);
+    total_bytes -= f->file_size;
+    dropped_files++;
+  }
+  if (dropped_files == 0) {
+    return;
+  }
+  Status s = versions_->LogAndApply(&edit);
+#ifdef WITHPERSISTENCE
+  Edit_sync_to_remote(&edit);
+#endif
+  InstallSuperVersion();
+  if (!s.ok()) {
+    RecordBackgroundError(s);
+  }
+  Log(options_.info_log, "Dropped %d expired tables, %llu bytes left: %s\n",
+      dropped_files, static_cast<unsigned long long>(total_bytes),
+      s.ToString().c_str());
+}
 //
 //Status DBImpl::Write(const WriteOptions& options, WriteBatch* updates) {
 //  Writer w(&undefine_mutex);
@@ -3564,109 +6793,372 @@ Status DBImpl::Delete(const WriteOptions& options, const Slice& key) {
 //  return status;
 //}
 Status DBImpl::Write(const WriteOptions& options, WriteBatch* updates) {
-//  Writer w(&undefine_mutex);
-//  w.batch = updates;
-//  w.sync = options.sync;
-//  w.done = false;
+  assert(updates != nullptr);
+  if (IsReplica()) {
+    return Status::NotSupported("Write on a read replica");
+  }
+  if (options_.enable_group_commit) {
+    return GroupCommitWrite(options, updates);
+  }
+  return InsertBatchIntoMemtables(updates, true, options.memtable_insert_hint);
+}
 
+void DBImpl::WriteAsync(const WriteOptions& options, const WriteBatch& updates,
+                        const WriteCallback& callback) {
+  AsyncWrites* async = async_writes_.get();
+  std::call_once(async->started, [this, async] {
+    for (int i = 0; i < std::max(options_.async_write_threads, 1); i++) {
+      async->threads.emplace_back(&DBImpl::AsyncWriteLoop, this);
+    }
+  });
+  // Only a thread which found nothing to take may be waiting.
+  const bool idle = async->pending.fetch_add(1) == 0;
+  AsyncWrites::Queue* queue = async->queues.Access();
+  {
+    std::lock_guard<std::mutex> l(queue->mu);
+    queue->writes.push_back({options, updates, callback});
+  }
+  if (idle) {
+    {
+      std::lock_guard<std::mutex> l(async->mu);
+    }
+    async->cv.notify_one();
+  }
+}
 
+void DBImpl::AsyncWriteLoop() {
+  AsyncWrites* async = async_writes_.get();
+  // The bytes of a group, as BuildBatchGroup() allows.
+  const size_t kMaxGroupBytes = 1 << 20;
+  std::vector<AsyncWrite> group;
+  WriteBatch merged;
+  while (true) {
+    group.clear();
+    size_t bytes = 0;
+    for (size_t i = 0; i < async->queues.Size() && bytes < kMaxGroupBytes;
+         i++) {
+      AsyncWrites::Queue* queue = async->queues.AccessAtCore(i);
+      std::lock_guard<std::mutex> l(queue->mu);
+      while (!queue->writes.empty() && bytes < kMaxGroupBytes) {
+        bytes += WriteBatchInternal::ByteSize(&queue->writes.front().batch);
+        group.push_back(std::move(queue->writes.front()));
+        queue->writes.pop_front();
+      }
+    }
+    if (group.empty()) {
+      std::unique_lock<std::mutex> lck(async->mu);
+      if (async->exit && async->pending.load() == 0) {
+        break;
+      }
+      // A batch counted and not queued yet is picked up at the next round.
+      async->cv.wait(lck, [async] {
+        return async->pending.load() > 0 || async->exit;
+      });
+      continue;
+    }
+    async->pending.fetch_sub(static_cast<int64_t>(group.size()));
+    if (async->pending.load() > 0) {
+      // Another thread collects the next group while this one is applied.
+      async->cv.notify_one();
+    }
+    WriteOptions options = group[0].options;
+    WriteBatch* updates = &group[0].batch;
+    if (group.size() > 1) {
+      merged.Clear();
+      for (const AsyncWrite& write : group) {
+        WriteBatchInternal::Append(&merged, &write.batch);
+        options.sync |= write.options.sync;
+      }
+      updates = &merged;
+    }
+    Status s = Write(options, updates);
+    for (const AsyncWrite& write : group) {
+      write.callback(s);
+    }
+  }
+}
 
-  // May temporarily Unlock and wait.
-//  Status status = Status::OK();
-#ifdef TIMEPRINT
-  auto start = std::chrono::high_resolution_clock::now();
-  auto total_start = std::chrono::high_resolution_clock::now();
-#endif
+// Leader/follower group commit. The writer at the front of writers_ merges
+// the queued batches through BuildBatchGroup and applies them with a single
+// sequence reservation, the followers only wait for their status.
+Status DBImpl::GroupCommitWrite(const WriteOptions& options,
+                                WriteBatch* updates) {
+  Writer w(&undefine_mutex);
+  w.batch = updates;
+  w.sync = options.sync;
+  w.done = false;
+
+  MutexLock l(&undefine_mutex);
+  writers_.push_back(&w);
+  while (!w.done && &w != writers_.front()) {
+    w.cv.Wait();
+  }
+  if (w.done) {
+    return w.status;
+  }
+
+  Writer* last_writer = &w;
+  WriteBatch* write_batch = BuildBatchGroup(&last_writer);
+  Status status;
+  {
+    // &w is at the front of the queue, so no other leader can touch
+    // tmp_batch_ while the mutex is released.
+    undefine_mutex.Unlock();
+    // The leader inserts the whole group, with its own insert hint.
+    status = InsertBatchIntoMemtables(write_batch, true,
+                                      options.memtable_insert_hint);
+    undefine_mutex.Lock();
+  }
+  if (write_batch == tmp_batch_) tmp_batch_->Clear();
+
+  while (true) {
+    Writer* ready = writers_.front();
+    writers_.pop_front();
+    if (ready != &w) {
+      ready->status = status;
+      ready->done = true;
+      ready->cv.Signal();
+    }
+    if (ready == last_writer) break;
+  }
+
+  // Notify new head of write queue
+  if (!writers_.empty()) {
+    writers_.front()->cv.Signal();
+  }
+  return status;
+}
+
+// Reserve the sequence numbers of the whole batch with one atomic operation,
+// then insert every part of the range into the memtable owning it. A batch
+// normally lands in a single memtable; only the batch crossing the sequence
+// border of the active memtable is split.
+Status DBImpl::InsertBatchIntoMemtables(WriteBatch* updates, bool write_log,
+                                        bool insert_hint) {
+  PreparedWrite prepared;
+  Status status = PrepareWrite(updates, write_log, &prepared);
+  Status commit_status = CommitWrite(&prepared, status.ok(), insert_hint);
+  return status.ok() ? commit_status : status;
+}
+
+Status DBImpl::PrepareWrite(WriteBatch* updates, bool write_log,
+                            PreparedWrite* prepared) {
+  prepared->batch = updates;
   size_t kv_num = WriteBatchInternal::Count(updates);
-  assert(kv_num == 1);
-  uint64_t sequence = versions_->AssignSequnceNumbers(kv_num);
-  //todo: remove
-//  kv_counter0.fetch_add(1);
-  MemTable* mem;
-  Status status = PickupTableToWrite(updates == nullptr, sequence, mem);
-#ifdef TIMEPRINT
-  auto stop = std::chrono::high_resolution_clock::now();
-  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-  std::printf("preprocessing, time elapse is %zu\n",  duration.count());
-#endif
-//    size_t seq_count = 1;
-//  spin_mutex.Lock();
-//  uint64_t sequence = versions_->LastSequence_nonatomic();
-//  versions_->SetLastSequence_nonatomic(sequence+seq_count);
-//  spin_mutex.Unlock();
-//  uint64_t sequence = 10;
+  if (kv_num == 0) {
+    return Status::OK();
+  }
+  const uint64_t batch_bytes = WriteBatchInternal::ByteSize(updates);
+  if (write_log) {
+    // Not the batches replayed by the recovery.
+    tracer_->RecordWrite(updates);
+    user_bytes_written_.fetch_add(batch_bytes, std::memory_order_relaxed);
+  }
+  // The phases are timed in nanoseconds and recorded once per batch.
+  uint64_t* phase_nanos = prepared->phase_nanos;
+  // Paced before the sequences are taken, a sleeping writer would hold up
+  // the flush of the memtable they belong to.
+  if (write_controller_.NeedsPressure()) {
+    write_controller_.SetPressure(WritePressure());
+  }
+  const uint64_t write_delay = write_controller_.GetDelay(batch_bytes);
+  if (write_delay > 0) {
+    const uint64_t delay_start = NowNanos();
+    env_->SleepForMicroseconds(static_cast<int>(write_delay));
+    phase_nanos[WriteLatencySlot::kStall] += NowNanos() - delay_start;
+  }
+  if (negative_cache_ != nullptr) {
+    negative_cache_->BeginWrite(updates);
+  }
+  uint64_t phase_start = NowNanos();
+  if (write_cut_ != nullptr && !prepared->in_cut) {
+    prepared->cut = write_cut_;
+    prepared->cut_epoch = write_cut_->Enter();
+  }
+  uint64_t sequence = TakeSequences(kv_num);
+  if (prepared->cut != nullptr) {
+    prepared->cut->Reserved();
+  }
+  phase_nanos[WriteLatencySlot::kSequence] = NowNanos() - phase_start;
+  const uint64_t last_sequence = sequence + kv_num - 1;
+  WriteBatchInternal::SetSequence(updates, sequence);
+  Status status;
+  if (write_log && remote_log_ != nullptr) {
+    status = remote_log_->AddRecord(WriteBatchInternal::Contents(updates),
+                                    last_sequence);
+  }
+  return status;
+}
+
+Status DBImpl::CommitWrite(PreparedWrite* prepared, bool insert,
+                           bool insert_hint) {
+  WriteBatch* updates = prepared->batch;
+  size_t kv_num = WriteBatchInternal::Count(updates);
+  if (kv_num == 0) {
+    return Status::OK();
+  }
+  uint64_t* phase_nanos = prepared->phase_nanos;
+  uint64_t phase_start;
+  uint64_t sequence = WriteBatchInternal::Sequence(updates);
+  const uint64_t last_sequence = sequence + kv_num - 1;
+  // Checked after the sequences are taken: a snapshot counted later reads
+  // the last sequence after them, and sees the new values anyway.
+  const bool update_in_place =
+      options_.inplace_update_support && num_snapshots_.load() == 0;
   //TOTHINK: what if a write with a higher seq first go outside MakeRoomForwrite,
   // and it is supposed to write to the new memtable which has not been created yet.
   // hint how about set the metable barrier as seq_num rather than memory size?
-#ifdef TIMEPRINT
-  start = std::chrono::high_resolution_clock::now();
-#endif
-  if (status.ok()) {  // nullptr batch is for compactions
-    assert(updates != nullptr);
-    WriteBatchInternal::SetSequence(updates, sequence);
-
-//    if (sequence >= mem_.load()->GetFirstseq()) {
-//      status = WriteBatchInternal::InsertInto(updates, mem_);
-//    }else{
-//      // TODO: some write may have write to immtable, the immutable need to be notified
-//      // when all the outgoing write on this table have finished and flush to storage
-//      status = WriteBatchInternal::InsertInto(updates, imm_);
-//    }
-    assert(sequence <= mem->Getlargest_seq_supposed() && sequence >= mem->GetFirstseq());
-    status = WriteBatchInternal::InsertInto(updates, mem);
-    mem->increase_seq_count(kv_num);
-  }else{
-    printf("Weird status not OK");
-    assert(0==1);
-  }
-//  kv_counter1.fetch_add(1);
-//  if (mem_switching){}
-//  thread_ready_num++;
-//  printf("thread ready %d\n", thread_ready_num);
-//  if (thread_ready_num >= thread_num) {
-//    cv.notify_all();
-//  }
-#ifdef TIMEPRINT
-  stop = std::chrono::high_resolution_clock::now();
-  duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-  auto total_duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - total_start);
-  std::printf("Real insert to memtable, time elapse is %zu\n",  duration.count());
-  std::printf("total time, time elapse is %zu\n",  total_duration.count());
-#endif
-//  printf("A value has been inserted\n");
+  Status status;
+  while (sequence <= last_sequence) {
+    MemTable* mem;
+    uint64_t stall_micros = 0;
+    phase_start = NowNanos();
+    status = PickupTableToWrite(false, sequence, mem, &stall_micros);
+    const uint64_t pickup_nanos = NowNanos() - phase_start;
+    phase_nanos[WriteLatencySlot::kStall] += stall_micros * 1000;
+    phase_nanos[WriteLatencySlot::kPickup] +=
+        pickup_nanos - std::min(pickup_nanos, stall_micros * 1000);
+    if (!status.ok()) {
+      break;
+    }
+    assert(sequence <= mem->Getlargest_seq_supposed() &&
+           sequence >= mem->GetFirstseq());
+    uint64_t chunk_last =
+        std::min(last_sequence, mem->Getlargest_seq_supposed());
+    phase_start = NowNanos();
+    if (!insert) {
+      // The sequences of an aborted batch hold nothing.
+    } else if (sequence == WriteBatchInternal::Sequence(updates) &&
+               chunk_last == last_sequence) {
+      status = WriteBatchInternal::InsertInto(updates, mem, insert_hint,
+                                              update_in_place);
+    } else {
+      status = WriteBatchInternal::InsertInto(updates, mem, sequence,
+                                              chunk_last, insert_hint,
+                                              update_in_place);
+    }
+    phase_nanos[WriteLatencySlot::kInsert] += NowNanos() - phase_start;
+    mem->increase_seq_count(chunk_last - sequence + 1);
+    if (!status.ok()) {
+      break;
+    }
+    sequence = chunk_last + 1;
+  }
+  if (negative_cache_ != nullptr) {
+    negative_cache_->EndWrite(updates);
+  }
+  if (prepared->cut != nullptr) {
+    prepared->cut->Exit(prepared->cut_epoch);
+  }
+  RecordWriteLatency(phase_nanos);
   return status;
 }
 
+// The same steps as PrepareWrite() and CommitWrite() for one key, without
+// encoding it into a batch and decoding it again. A single key always lands
+// in one memtable.
+bool DBImpl::WriteSingle(const WriteOptions& options, ValueType type,
+                         const Slice& key, const Slice& value, Status* s) {
+  if (IsReplica() || options_.enable_group_commit ||
+      remote_log_ != nullptr || tracer_->active()) {
+    return false;
+  }
+  uint64_t phase_nanos[WriteLatencySlot::kNumPhases] = {};
+  if (write_controller_.NeedsPressure()) {
+    write_controller_.SetPressure(WritePressure());
+  }
+  const uint64_t batch_bytes = WriteBatchInternal::ByteSize(type, key, value);
+  user_bytes_written_.fetch_add(batch_bytes, std::memory_order_relaxed);
+  const uint64_t write_delay = write_controller_.GetDelay(batch_bytes);
+  if (write_delay > 0) {
+    const uint64_t delay_start = NowNanos();
+    env_->SleepForMicroseconds(static_cast<int>(write_delay));
+    phase_nanos[WriteLatencySlot::kStall] += NowNanos() - delay_start;
+  }
+  if (negative_cache_ != nullptr) {
+    negative_cache_->BeginWrite(key);
+  }
+  uint64_t phase_start = NowNanos();
+  WriteCut* cut = write_cut_;
+  uint64_t cut_epoch = 0;
+  if (cut != nullptr) {
+    cut_epoch = cut->Enter();
+  }
+  const uint64_t sequence = TakeSequences(1);
+  if (cut != nullptr) {
+    cut->Reserved();
+  }
+  phase_nanos[WriteLatencySlot::kSequence] = NowNanos() - phase_start;
+  const bool update_in_place = type == kTypeValue &&
+                               options_.inplace_update_support &&
+                               num_snapshots_.load() == 0;
+  MemTable* mem;
+  uint64_t stall_micros = 0;
+  phase_start = NowNanos();
+  *s = PickupTableToWrite(false, sequence, mem, &stall_micros);
+  const uint64_t pickup_nanos = NowNanos() - phase_start;
+  phase_nanos[WriteLatencySlot::kStall] += stall_micros * 1000;
+  phase_nanos[WriteLatencySlot::kPickup] +=
+      pickup_nanos - std::min(pickup_nanos, stall_micros * 1000);
+  if (s->ok()) {
+    assert(sequence <= mem->Getlargest_seq_supposed() &&
+           sequence >= mem->GetFirstseq());
+    phase_start = NowNanos();
+    mem->Add(sequence, type, key, value, options.memtable_insert_hint,
+             update_in_place);
+    phase_nanos[WriteLatencySlot::kInsert] += NowNanos() - phase_start;
+    mem->increase_seq_count(1);
+  }
+  if (negative_cache_ != nullptr) {
+    negative_cache_->EndWrite(key);
+  }
+  if (cut != nullptr) {
+    cut->Exit(cut_epoch);
+  }
+  RecordWriteLatency(phase_nanos);
+  return true;
+}
+
+void DBImpl::RecordWriteLatency(const uint64_t* phase_nanos) {
+  WriteLatencySlot* latency = GetWriteLatencySlot();
+  std::unique_lock<std::mutex> lck(latency->mutex);
+  for (int i = 0; i < WriteLatencySlot::kNumPhases; i++) {
+    latency->histograms[i].Add(phase_nanos[i] / 1000.0);
+  }
+}
+
 // seldom Lock
 //// TOTHINK The write batch should not too large. other wise the wait function may
 //// memtable could overflow even before the actual write.
-Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r) {
+Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r,
+                                  uint64_t* stall_micros) {
   Status s = Status::OK();
   //Get a snapshot it is vital for the CAS but not vital for the wait logic.
   mem_r = mem_.load();
   // First check whether we need to switch the table, we do not Lock here, because
   // most of the time the memtable will not be switched. we will Lock inside and
   // get the table
-  bool delayed = false;
   //TODO(RUIHONG): Avoid lock twice when swithing the memtable.
   while(seq_num > mem_r->Getlargest_seq_supposed()){
     //before switch the table we need to check whether there is enough room
     // for a new table.
 
-    size_t level0_filenum = versions_->NumLevelFiles(0);
+    size_t level0_filenum = versions_->NumStallFiles();
+    const bool over_quota = MemtableQuotaExceeded(mem_r);
     if (imm_.current_memtable_num() >= config::Immutable_StopWritesTrigger
-        || level0_filenum >= config::kL0_StopWritesTrigger) {
+        || level0_filenum >= config::kL0_StopWritesTrigger || over_quota) {
       // We have filled up the current memtable, but the previous
       // one is still being compacted, so we wait.
       // the wait will never get signalled.
 
       // We check the imm again in the while loop, because the state may have already been changed before you acquire the Lock.
+      const uint64_t stop_start = env_->NowMicros();
       std::unique_lock<std::mutex> lck(superversion_memlist_mtx);
 //      imm_mtx.lock();
       Log(options_.info_log, "Current memtable full; waiting...\n");
       mem_r = mem_.load();
-      while ((imm_.current_memtable_num() >= config::Immutable_StopWritesTrigger || versions_->NumLevelFiles(0) >=
-             config::kL0_StopWritesTrigger) && seq_num > mem_r->Getlargest_seq_supposed()) {
+      while ((imm_.current_memtable_num() >= config::Immutable_StopWritesTrigger || versions_->NumStallFiles() >=
+             config::kL0_StopWritesTrigger || MemtableQuotaExceeded(mem_r)) && seq_num > mem_r->Getlargest_seq_supposed()) {
         assert(seq_num > mem_r->GetFirstseq());
 //        std::cout << "Writer is going to wait current immutable number " << (imm_.current_memtable_num()) << " Level 0 file number "
 //                  << (versions_->NumLevelFiles(0)) <<std::endl;
@@ -3675,9 +7167,15 @@ Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r
         mem_r = mem_.load();
       }
 //      imm_mtx.unlock();
-    } else if(level0_filenum > config::kL0_SlowdownWritesTrigger && !delayed){
-      env_->SleepForMicroseconds(1000);
-      delayed = true;
+      lck.unlock();
+      const uint64_t stop_micros = env_->NowMicros() - stop_start;
+      write_controller_.RecordStop(stop_micros);
+      if (over_quota) {
+        quota_stall_micros_.fetch_add(stop_micros);
+      }
+      if (stall_micros != nullptr) {
+        *stall_micros += stop_micros;
+      }
     }else{
       std::unique_lock<std::mutex> l(superversion_memlist_mtx);
 //      assert(locked == false);
@@ -3692,16 +7190,18 @@ Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r
       mem_r = mem_.load();
       //After aquire the lock check the status again
       if (imm_.current_memtable_num() <= config::Immutable_StopWritesTrigger&&
-          versions_->NumLevelFiles(0) <= config::kL0_StopWritesTrigger &&
+          versions_->NumStallFiles() <= config::kL0_StopWritesTrigger &&
+          !MemtableQuotaExceeded(mem_r) &&
           seq_num > mem_r->Getlargest_seq_supposed()){
         assert(versions_->PrevLogNumber() == 0);
-        MemTable* temp_mem = new MemTable(internal_comparator_);
+        const size_t seq_window = NextSeqWindow(mem_r);
+        MemTable* temp_mem = NewMemTable(seq_window);
         uint64_t last_mem_seq = mem_r->Getlargest_seq_supposed();
         //The memtable seq barrier is (  ];
         temp_mem->SetFirstSeq(last_mem_seq+1);
         // starting from this sequenctial number, the data should write the the new memtable
         // set the immutable as seq_num - 1
-        temp_mem->SetLargestSeq(last_mem_seq + MEMTABLE_SEQ_SIZE);
+        temp_mem->SetLargestSeq(last_mem_seq + seq_window);
         temp_mem->Ref();
         mem_r->SetFlushState(MemTable::FLUSH_REQUESTED);
         mem_.store(temp_mem);
@@ -3709,6 +7209,17 @@ Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r
         assert(imm_.current_memtable_num() <= config::Immutable_StopWritesTrigger);
         imm_.Add(mem_r);
         has_imm_.store(true, std::memory_order_release);
+        if (options_.sequence_lease_size > 0 || sequencer_ != nullptr) {
+          // The sequences the writers leased and have not taken would keep
+          // mem_r from filling up, and the ones skipped before may fall in
+          // temp_mem.
+          std::vector<std::pair<uint64_t, uint64_t>> unused;
+          unused.swap(skipped_sequences_);
+          ClaimSequenceLeases(&unused);
+          for (const auto& range : unused) {
+            SkipSequences(range.first, range.second);
+          }
+        }
         InstallSuperVersion();
         // if we have create a new table then the new table will definite be
         // the table we will write.
@@ -3718,6 +7229,9 @@ Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r
 #ifndef NDEBUG
         locked = false;
 #endif
+        l.unlock();
+        // The new memtable may take the node over its memory budget.
+        MaybeCheckMemoryBudget(options_.memory_budget);
         return s;
       }
 #ifndef NDEBUG
@@ -3746,6 +7260,127 @@ Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r
     }
   }
 }
+void DBImpl::InitQuota() {
+  const ShardQuota& quota = options_.shard_quota;
+  quota_memtable_bytes_.store(quota.memtable_bytes);
+  quota_max_flushes_.store(quota.max_flushes);
+  if (quota.rdma_bytes_per_second > 0) {
+    // Before the table cache opens any table, the tables take the options
+    // as they are then.
+    rdma_limiter_ = NewRateLimiter(quota.rdma_bytes_per_second);
+    options_.rdma_limiter = rdma_limiter_;
+  }
+}
+
+Status DBImpl::SetQuota(const ShardQuota& quota) {
+  if ((quota.rdma_bytes_per_second > 0) != (rdma_limiter_ != nullptr)) {
+    return Status::InvalidArgument(
+        "the RDMA budget of a shard is set when it is opened");
+  }
+  quota_memtable_bytes_.store(quota.memtable_bytes);
+  quota_max_flushes_.store(quota.max_flushes);
+  if (rdma_limiter_ != nullptr) {
+    rdma_limiter_->SetBytesPerSecond(quota.rdma_bytes_per_second);
+  }
+  // The writers stopped by the old quota check it again, and the flushes
+  // it held back are scheduled.
+  std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+  write_stall_cv.notify_all();
+  MaybeScheduleFlushOrCompaction();
+  return Status::OK();
+}
+
+class DBImpl::BudgetMember : public MemoryBudgetMember {
+ public:
+  explicit BudgetMember(DBImpl* db) : db_(db) {}
+
+  size_t MemtableMemoryUsage() override {
+    // The lock keeps mem_ from being flushed and freed meanwhile.
+    std::unique_lock<std::mutex> l(db_->superversion_memlist_mtx);
+    MemTable* mem = db_->mem_.load();
+    // Null until the constructor recovers the DB.
+    return (mem != nullptr ? mem->ApproximateMemoryUsage() : 0) +
+           db_->imm_.ApproximateMemoryUsage();
+  }
+  size_t TableReaderMemoryUsage() override {
+    return db_->table_cache_->ApproximateMemoryUsage();
+  }
+  Cache* BlockCache() override { return db_->options_.block_cache; }
+  Cache* TableMetaCache() override { return db_->options_.table_meta_cache; }
+  RDMA_Manager* RdmaManager() override { return db_->env_->rdma_mg.get(); }
+  void EvictTableReaders() override { db_->table_cache_->Prune(); }
+  void ShrinkMemtables() override { db_->shrink_memtables_.store(true); }
+
+ private:
+  DBImpl* const db_;
+};
+
+void DBImpl::InitMemoryBudget() {
+  if (options_.memory_budget != nullptr) {
+    budget_member_ = new BudgetMember(this);
+    RegisterMemoryBudgetMember(options_.memory_budget, budget_member_);
+  }
+}
+
+bool DBImpl::MemtableQuotaExceeded(MemTable* full) {
+  const size_t limit = quota_memtable_bytes_.load(std::memory_order_relaxed);
+  // A shard without immutables has nothing to wait for.
+  return limit != 0 && imm_.current_memtable_num() > 0 &&
+         imm_.ApproximateMemoryUsage() + full->ApproximateMemoryUsage() >
+             limit;
+}
+
+bool DBImpl::ReserveFlush() {
+  const int max_flushes = quota_max_flushes_.load(std::memory_order_relaxed);
+  int in_flight = flushes_in_flight_.load();
+  while (max_flushes <= 0 || in_flight < max_flushes) {
+    if (flushes_in_flight_.compare_exchange_weak(in_flight, in_flight + 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+MemTable* DBImpl::NewMemTable(size_t seq_window) const {
+  return new MemTable(internal_comparator_,
+                      options_.memtable_bloom_bits_per_key, seq_window,
+                      options_.memtable_huge_page_size,
+                      options_.inplace_update_support &&
+                              options_.memtable_rep == kSkipListMemTable
+                          ? options_.inplace_update_num_locks
+                          : 0,
+                      options_.memtable_rep,
+                      options_.memtable_rep == kSkipListMemTable &&
+                              !options_.inplace_update_support
+                          ? std::max(options_.memtable_numa_partitions, 1)
+                          : 1);
+}
+
+// The entries inserted so far tell the bytes per sequence of "full". Its
+// writers may still be inserting, which the sample does not need. The range
+// at most doubles or halves from a memtable to the next one, so that a burst
+// of large or small values does not throw it off.
+size_t DBImpl::NextSeqWindow(MemTable* full) {
+  const size_t window = full->SeqWindow();
+  if (shrink_memtables_.exchange(false)) {
+    // Over the memory budget, the memtable goes to the flush sooner. The
+    // adaptive window grows back from there.
+    return std::max(window / 2, kMinSeqWindow);
+  }
+  if (!options_.adaptive_memtable_window) {
+    return MEMTABLE_SEQ_SIZE;
+  }
+  const size_t sampled = full->Get_seq_count();
+  if (sampled < kMinSampledSequences) {
+    return window;
+  }
+  const double bytes_per_seq =
+      static_cast<double>(full->ApproximateMemoryUsage()) / sampled;
+  size_t target = static_cast<size_t>(options_.write_buffer_size /
+                                      std::max(bytes_per_seq, 1.0));
+  target = std::min(std::max(target, window / 2), window * 2);
+  return std::min(std::max(target, kMinSeqWindow), kMaxSeqWindow);
+}
 // TOTHINK The write batch should not too large. other wise the wait function may
 // memtable could overflow even before the actual write.
 // ---------------Lock free----------------
@@ -4021,23 +7656,10 @@ bool DBImpl::GetProperty(const Slice& property, std::string* value) {
       return true;
     }
   } else if (in == "stats") {
-    char buf[200];
-    std::snprintf(buf, sizeof(buf),
-                  "                               Compactions\n"
-                  "Level  Files Size(MB) Time(sec) Read(MB) Write(MB)\n"
-                  "--------------------------------------------------\n");
-    value->append(buf);
-    for (int level = 0; level < config::kNumLevels; level++) {
-      int files = versions_->NumLevelFiles(level);
-      if (stats_[level].micros > 0 || files > 0) {
-        std::snprintf(buf, sizeof(buf), "%3d %8d %8.0f %9.0f %8.0f %9.0f\n",
-                      level, files, versions_->NumLevelBytes(level) / 1048576.0,
-                      stats_[level].micros / 1e6,
-                      stats_[level].bytes_read / 1048576.0,
-                      stats_[level].bytes_written / 1048576.0);
-        value->append(buf);
-      }
-    }
+    std::map<std::string, uint64_t> stats;
+    AddStats(&stats);
+    AddProcessStats(&stats);
+    *value = StatsString(stats);
     return true;
   } else if (in == "sstables") {
     *value = versions_->current()->DebugString();
@@ -4055,11 +7677,133 @@ bool DBImpl::GetProperty(const Slice& property, std::string* value) {
                   static_cast<unsigned long long>(total_usage));
     value->append(buf);
     return true;
+  } else if (in == "rate-limiter") {
+    RateLimiter* limiter = options_.rate_limiter;
+    if (limiter == nullptr) {
+      return false;
+    }
+    char buf[200];
+    std::snprintf(
+        buf, sizeof(buf),
+        "rate: %lld bytes/s, flush: %lld bytes, compaction: %lld bytes, "
+        "foreground latency: %llu us\n",
+        static_cast<long long>(limiter->GetBytesPerSecond()),
+        static_cast<long long>(
+            limiter->GetTotalBytesThrough(RateLimiter::kHigh)),
+        static_cast<long long>(
+            limiter->GetTotalBytesThrough(RateLimiter::kLow)),
+        static_cast<unsigned long long>(limiter->GetForegroundLatency()));
+    value->append(buf);
+    return true;
+  } else if (in == "memory-budget") {
+    if (options_.memory_budget == nullptr) {
+      return false;
+    }
+    options_.memory_budget->Check();
+    value->append(options_.memory_budget->ToString());
+    return true;
+  } else if (in == "shard-quota") {
+    int64_t rdma_rate = 0;
+    int64_t rdma_bytes = 0;
+    if (rdma_limiter_ != nullptr) {
+      rdma_rate = rdma_limiter_->GetBytesPerSecond();
+      rdma_bytes = rdma_limiter_->GetTotalBytesThrough(RateLimiter::kHigh) +
+                   rdma_limiter_->GetTotalBytesThrough(RateLimiter::kLow);
+    }
+    const size_t memtable_bytes =
+        (mem != nullptr ? mem->ApproximateMemoryUsage() : 0) +
+        imm_.ApproximateMemoryUsage();
+    char buf[300];
+    std::snprintf(
+        buf, sizeof(buf),
+        "memtables: %llu of %llu bytes, flushes: %d of %d, quota stalls: "
+        "%llu us, rdma: %lld bytes/s, %lld bytes\n",
+        static_cast<unsigned long long>(memtable_bytes),
+        static_cast<unsigned long long>(quota_memtable_bytes_.load()),
+        flushes_in_flight_.load(), quota_max_flushes_.load(),
+        static_cast<unsigned long long>(quota_stall_micros_.load()),
+        static_cast<long long>(rdma_rate), static_cast<long long>(rdma_bytes));
+    value->append(buf);
+    return true;
+  } else if (in == "compaction-debt") {
+    std::map<std::string, uint64_t> debt;
+    AddCompactionDebt("", &debt);
+    const uint64_t written = debt["flush_bytes"] + debt["compaction_bytes"];
+    const uint64_t stall_micros = debt["time_to_stall_micros"];
+    char stall[32] = "none";
+    if (stall_micros != UINT64_MAX) {
+      std::snprintf(stall, sizeof(stall), "%.1f sec", stall_micros / 1e6);
+    }
+    char buf[300];
+    std::snprintf(
+        buf, sizeof(buf),
+        "pending compactions: %llu bytes, level 0 files: %llu, write "
+        "amplification: %.2f of %llu bytes, time to stall: %s\n",
+        static_cast<unsigned long long>(debt["pending_compaction_bytes"]),
+        static_cast<unsigned long long>(debt["level0_files"]),
+        debt["user_bytes"] == 0
+            ? 0.0
+            : static_cast<double>(written) / debt["user_bytes"],
+        static_cast<unsigned long long>(debt["user_bytes"]), stall);
+    value->append(buf);
+    return true;
+  } else if (in == "write-latency") {
+    Histogram histograms[WriteLatencySlot::kNumPhases];
+    for (Histogram& histogram : histograms) {
+      histogram.Clear();
+    }
+    MergeWriteLatency(histograms);
+    *value = WriteLatencyString(histograms);
+    return true;
+  } else if (in == "remote-memory") {
+    // The remote memory this node allocated, and how much of it the
+    // rounding of the sizes wastes.
+    std::shared_ptr<RDMA_Manager> rdma_mg = options_.env->rdma_mg;
+    char buf[300];
+    for (auto& node : rdma_mg->memory_nodes) {
+      Remote_Memory_Stats stats = rdma_mg->Get_Remote_Memory_Stats(node.first);
+      double fragmentation =
+          stats.allocated == 0
+              ? 0.0
+              : 100.0 * (stats.allocated - stats.requested) / stats.allocated;
+      std::snprintf(
+          buf, sizeof(buf),
+          "node %d: registered %.1f MB, allocated %.1f MB, requested %.1f MB, "
+          "free in split slots %.1f MB, internal fragmentation %.1f%%, "
+          "released regions %llu\n",
+          node.first, stats.registered / 1048576.0,
+          stats.allocated / 1048576.0, stats.requested / 1048576.0,
+          stats.slab_free / 1048576.0, fragmentation,
+          static_cast<unsigned long long>(stats.released_regions));
+      value->append(buf);
+    }
+    return true;
+  } else if (in == "rdma") {
+    *value = options_.env->rdma_mg->Stats_String();
+    return true;
+  } else if (in == "rdma-pools") {
+    *value = options_.env->rdma_mg->Local_Pools_String();
+    return true;
   }
 
   return false;
 }
 
+bool DBImpl::GetMapProperty(const Slice& property,
+                            std::map<std::string, uint64_t>* value) {
+  value->clear();
+  if (property == Slice("dLSM.stats")) {
+    AddStats(value);
+    AddProcessStats(value);
+    return true;
+  }
+  if (property == Slice("dLSM.compaction-debt")) {
+    AddCompactionDebt("", value);
+    return true;
+  }
+  return false;
+}
+
 void DBImpl::GetApproximateSizes(const Range* range, int n, uint64_t* sizes) {
   // TODO(opt): better implementation
   MutexLock l(&undefine_mutex);
@@ -4078,29 +7822,449 @@ void DBImpl::GetApproximateSizes(const Range* range, int n, uint64_t* sizes) {
   v->Unref(0);
 }
 
+void DBImpl::GetApproximateCounts(const Range* range, int n,
+                                  uint64_t* entries, uint64_t* raw_sizes) {
+  MutexLock l(&undefine_mutex);
+  Version* v = versions_->current();
+  v->Ref(0);
+  for (int i = 0; i < n; i++) {
+    InternalKey k1(range[i].start, kMaxSequenceNumber, kValueTypeForSeek);
+    InternalKey k2(range[i].limit, kMaxSequenceNumber, kValueTypeForSeek);
+    uint64_t start_bytes, start_entries, start_raw;
+    uint64_t limit_bytes, limit_entries, limit_raw;
+    versions_->ApproximateOffsetOf(v, k1, &start_bytes, &start_entries,
+                                   &start_raw);
+    versions_->ApproximateOffsetOf(v, k2, &limit_bytes, &limit_entries,
+                                   &limit_raw);
+    entries[i] = limit_entries >= start_entries ? limit_entries - start_entries
+                                                : 0;
+    if (raw_sizes != nullptr) {
+      raw_sizes[i] = limit_raw >= start_raw ? limit_raw - start_raw : 0;
+    }
+  }
+  v->Unref(0);
+}
+
 
 // Default implementations of convenience methods that subclasses of DB
 // can call if they wish
+bool DB::GetMapProperty(const Slice& /*property*/,
+                        std::map<std::string, uint64_t>* /*value*/) {
+  return false;
+}
+
 Status DB::Put(const WriteOptions& opt, const Slice& key, const Slice& value) {
   WriteBatch batch;
   batch.Put(key, value);
   return Write(opt, &batch);
 }
 
+void DB::WriteAsync(const WriteOptions& options, const WriteBatch& updates,
+                    const WriteCallback& callback) {
+  WriteBatch batch = updates;
+  callback(Write(options, &batch));
+}
+
 Status DB::Delete(const WriteOptions& opt, const Slice& key) {
   WriteBatch batch;
   batch.Delete(key);
   return Write(opt, &batch);
 }
 
+Status DB::Merge(const WriteOptions& opt, const Slice& key,
+                 const Slice& value) {
+  WriteBatch batch;
+  batch.Merge(key, value);
+  return Write(opt, &batch);
+}
+
+Status DB::DeleteRange(const WriteOptions& /*options*/,
+                       const Slice& /*begin*/, const Slice& /*end*/) {
+  return Status::NotSupported("DeleteRange");
+}
+
+Status DB::IngestSorted(Iterator* /*input*/) {
+  return Status::NotSupported("IngestSorted");
+}
+
+Status DB::ParallelScan(const ReadOptions& /*options*/,
+                        const Range& /*range*/, int /*num_partitions*/,
+                        bool /*ordered*/, const ScanCallback& /*callback*/) {
+  return Status::NotSupported("ParallelScan");
+}
+
+Status DB::FilteredScan(const ReadOptions& /*options*/,
+                        const Range& /*range*/,
+                        const std::string& /*filter_name*/,
+                        const ScanCallback& /*callback*/) {
+  return Status::NotSupported("FilteredScan");
+}
+
+Status DBImpl::StartTrace(const std::string& path) {
+  return tracer_->Start(path);
+}
+
+Status DBImpl::EndTrace() { return tracer_->End(); }
+
+Status DB::StartTrace(const std::string& /*path*/) {
+  return Status::NotSupported("StartTrace");
+}
+
+Status DB::EndTrace() { return Status::NotSupported("EndTrace"); }
+
+Status DB::Get(const ReadOptions& options, const Slice& key,
+               PinnableSlice* value) {
+  value->Reset();
+  Status s = Get(options, key, value->GetSelf());
+  if (s.ok()) {
+    value->PinSelf();
+  }
+  return s;
+}
+
+Status DB::GetLarge(const ReadOptions& options, const Slice& key,
+                    const ValueCallback& callback) {
+  std::string value;
+  Status s = Get(options, key, &value);
+  if (s.ok()) {
+    callback(value);
+  }
+  return s;
+}
+
+std::vector<Status> DB::MultiGet(const ReadOptions& options,
+                                 const std::vector<Slice>& keys,
+                                 std::vector<std::string>* values) {
+  std::vector<Status> statuses(keys.size());
+  values->resize(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    statuses[i] = Get(options, keys[i], &(*values)[i]);
+  }
+  return statuses;
+}
+
+void DB::Prefetch(const ReadOptions& /*options*/,
+                  const std::vector<Slice>& /*keys*/) {}
+
+void DB::Prefetch(const ReadOptions& /*options*/, const Range& /*range*/) {}
+
+void DB::GetApproximateCounts(const Range* /*range*/, int n, uint64_t* entries,
+                              uint64_t* raw_sizes) {
+  for (int i = 0; i < n; i++) {
+    entries[i] = 0;
+    if (raw_sizes != nullptr) {
+      raw_sizes[i] = 0;
+    }
+  }
+}
+
+Status DBImpl::OpenShard() {
+  if (IsReplica()) {
+    return OpenReplica();
+  }
+  undefine_mutex.Lock();
+  VersionEdit edit(0);
+  // Recover handles create_if_missing, error_if_exists
+  bool save_manifest = false;
+  Status s = Recover(&edit, &save_manifest);
+  if (s.ok() && mem_ == nullptr) {
+    // Create new log and a corresponding memtable.
+    uint64_t new_log_number = versions_->NewFileNumber();
+    WritableFile* lfile;
+    s = env_->NewWritableFile(LogFileName(dbname_, new_log_number), &lfile);
+    if (s.ok()) {
+      edit.SetLogNumber(new_log_number);
+      logfile_ = lfile;
+      logfile_number_ = new_log_number;
+      log_ = new log::Writer(lfile);
+      mem_ = NewMemTable(MEMTABLE_SEQ_SIZE);
+      // The sequence may go on from the files recovered by the memory node.
+      mem_.load()->SetFirstSeq(versions_->LastSequence());
+      mem_.load()->SetLargestSeq(versions_->LastSequence() +
+                                 MEMTABLE_SEQ_SIZE - 1);
+      mem_.load()->Ref();
+    }
+  }
+  if (s.ok() && save_manifest) {
+    edit.SetPrevLogNumber(0);  // No older logs needed after recovery.
+    edit.SetLogNumber(logfile_number_);
+    s = versions_->LogAndApply(&edit);
+  }
+  if (s.ok()) {
+    MaybeScheduleFlushOrCompaction();
+  }
+  InstallSuperVersion();
+  undefine_mutex.Unlock();
+  if (s.ok()) {
+    s = ReplayRemoteLog();
+  }
+  if (s.ok() && options_.shard_sequencer) {
+    sequencer_.reset(new ShardSequencer(env_->rdma_mg.get(),
+                                        shard_target_node_id, shard_id));
+    s = sequencer_->Open();
+    if (!s.ok()) {
+      sequencer_.reset();
+    }
+  }
+  if (s.ok()) {
+    assert(mem_ != nullptr);
+  }
+  return s;
+}
+
+namespace {
+// The edit which turns "current" into the version "snapshot" holds. The
+// files both have stay as they are in "current".
+void DiffSnapshot(Version* current, VersionEdit* snapshot, VersionEdit* diff) {
+  typedef std::tuple<int, uint64_t, uint8_t> FileKey;
+  std::set<FileKey> kept;
+  for (const auto& f : *snapshot->GetNewFiles()) {
+    kept.emplace(f.first, f.second->number, f.second->creator_node_id);
+  }
+  std::set<FileKey> present;
+  for (int level = 0; level < config::kNumLevels; level++) {
+    for (const auto& f : current->files(level)) {
+      present.emplace(level, f->number, f->creator_node_id);
+      if (kept.count(FileKey(level, f->number, f->creator_node_id)) == 0) {
+        diff->RemoveFile(level, f->number, f->creator_node_id);
+      }
+    }
+  }
+  for (const auto& f : *snapshot->GetNewFiles()) {
+    if (present.count(FileKey(f.first, f.second->number,
+                              f.second->creator_node_id)) == 0) {
+      diff->AddFile(f.first, f.second);
+    }
+  }
+  std::set<SequenceNumber> live;
+  for (const RangeTombstone& t : snapshot->GetRangeTombstones()) {
+    live.insert(t.sequence);
+  }
+  std::set<SequenceNumber> had;
+  for (const RangeTombstone& t : current->range_tombstones().tombstones()) {
+    had.insert(t.sequence);
+    if (live.count(t.sequence) == 0) {
+      diff->RemoveRangeTombstone(t.sequence);
+    }
+  }
+  for (const RangeTombstone& t : snapshot->GetRangeTombstones()) {
+    if (had.count(t.sequence) == 0) {
+      diff->AddRangeTombstone(t);
+    }
+  }
+}
+}  // namespace
+
+Status DBImpl::OpenReplica() {
+  RDMA_Manager* rdma_mg = env_->rdma_mg.get();
+  const uint8_t owner = options_.replica_owner_node_id;
+  mem_ = NewMemTable(MEMTABLE_SEQ_SIZE);
+  mem_.load()->Ref();
+  replica_edits_ =
+      new RemoteLogReader(rdma_mg, shard_target_node_id, owner, shard_id, true);
+  Status s = replica_edits_->Open();
+  if (s.ok() && options_.replica_read_tail) {
+    replica_tail_ = new RemoteLogReader(rdma_mg, shard_target_node_id, owner,
+                                        shard_id, false);
+    s = replica_tail_->Open();
+  }
+  if (s.ok()) {
+    s = RefreshReplica();
+  }
+  if (!s.ok()) {
+    return s;
+  }
+  Log(options_.info_log, "Shard %u replicates node %u", shard_id, owner);
+  replica_refresher_ = std::thread(&DBImpl::ReplicaRefreshLoop, this);
+  return s;
+}
+
+Status DBImpl::RefreshReplica() {
+  // The log is read first: the batches it has truncated by then are in the
+  // tables of the edits read after it.
+  std::vector<std::pair<uint64_t, std::string>> batches;
+  uint64_t tail = 0;
+  SequenceNumber unflushed = 0;
+  Status s;
+  if (replica_tail_ != nullptr) {
+    s = replica_tail_->Read(&replica_tail_offset_, &batches, &tail,
+                            &unflushed);
+  }
+  std::vector<std::pair<uint64_t, std::string>> records;
+  if (s.ok()) {
+    uint64_t edits_tail;
+    SequenceNumber unused;
+    s = replica_edits_->Read(&replica_edits_offset_, &records, &edits_tail,
+                             &unused);
+  }
+  if (!s.ok()) {
+    return s;
+  }
+
+  SequenceNumber last_sequence = versions_->LastSequence();
+  MemTable* fresh = nullptr;
+  if (replica_tail_ != nullptr) {
+    MemTable* target = mem_.load();
+    if (!replica_batches_.empty() && replica_batches_.front().first < tail) {
+      // The owner flushed some, the rest goes into a new memtable.
+      while (!replica_batches_.empty() &&
+             replica_batches_.front().first < tail) {
+        replica_batches_.pop_front();
+      }
+      fresh = NewMemTable(MEMTABLE_SEQ_SIZE);
+      fresh->Ref();
+      target = fresh;
+      for (const auto& kept : replica_batches_) {
+        WriteBatch batch;
+        WriteBatchInternal::SetContents(&batch, kept.second);
+        if (negative_cache_ != nullptr) {
+          negative_cache_->BeginWrite(&batch);
+        }
+        s = WriteBatchInternal::InsertInto(&batch, target);
+        if (negative_cache_ != nullptr) {
+          negative_cache_->EndWrite(&batch);
+        }
+        if (!s.ok()) {
+          break;
+        }
+      }
+    }
+    for (size_t i = 0; s.ok() && i < batches.size(); i++) {
+      WriteBatch batch;
+      WriteBatchInternal::SetContents(&batch, batches[i].second);
+      const SequenceNumber first = WriteBatchInternal::Sequence(&batch);
+      const int count = WriteBatchInternal::Count(&batch);
+      if (count == 0 || first + count <= unflushed) {
+        continue;
+      }
+      if (negative_cache_ != nullptr) {
+        negative_cache_->BeginWrite(&batch);
+      }
+      s = WriteBatchInternal::InsertInto(&batch, target);
+      if (negative_cache_ != nullptr) {
+        negative_cache_->EndWrite(&batch);
+      }
+      last_sequence = std::max(last_sequence, first + count - 1);
+      replica_batches_.push_back(std::move(batches[i]));
+    }
+  }
+
+  MemTable* old = nullptr;
+  // The tables of the edits, and a snapshot most of all, may bring any key.
+  const bool new_tables = negative_cache_ != nullptr && !records.empty();
+  if (new_tables) {
+    negative_cache_->BeginWriteAll();
+  }
+  {
+    std::unique_lock<std::mutex> l(superversion_memlist_mtx);
+    for (size_t i = 0; s.ok() && i < records.size(); i++) {
+      EditPublisher::Kind kind;
+      Slice contents;
+      if (!EditPublisher::DecodeRecord(records[i].second, &kind, &contents)) {
+        s = Status::Corruption("bad record in the replica edit log");
+        break;
+      }
+      if (kind == EditPublisher::kBroken) {
+        replica_broken_.store(true);
+        s = Status::IOError("the owner stopped publishing its edits");
+        break;
+      }
+      VersionEdit edit(0);
+      s = edit.DecodeFrom(contents, 0, table_cache_);
+      if (!s.ok()) {
+        break;
+      }
+      for (const auto& f : *edit.GetNewFiles()) {
+        f.second->borrowed = true;
+      }
+      // LogAndApply overwrites the last sequence of the edit.
+      if (edit.HasLastSequence()) {
+        last_sequence = std::max(last_sequence, edit.GetLastSequence());
+      }
+      if (kind == EditPublisher::kSnapshot) {
+        VersionEdit diff(0);
+        DiffSnapshot(versions_->current(), &edit, &diff);
+        s = versions_->LogAndApply(&diff);
+        if (s.ok()) {
+          // The owner opened the shard again.
+          replica_broken_.store(false);
+        }
+      } else {
+        s = versions_->LogAndApply(&edit);
+      }
+    }
+    if (fresh != nullptr) {
+      old = mem_.exchange(fresh);
+    }
+    if (versions_->LastSequence() < last_sequence) {
+      versions_->SetLastSequence(last_sequence);
+    }
+    InstallSuperVersion();
+  }
+  if (new_tables) {
+    negative_cache_->EndWriteAll();
+  }
+  if (old != nullptr) {
+    old->NotFullTableflush();
+    old->Unref();
+  }
+  if (s.ok()) {
+    replica_refreshed_micros_.store(env_->NowMicros());
+  } else if (!replica_broken_.load()) {
+    // Start over from the snapshot at the tail of the edits at the next
+    // refresh.
+    replica_edits_offset_ = 0;
+  }
+  return s;
+}
+
+void DBImpl::ReplicaRefreshLoop() {
+  std::unique_lock<std::mutex> lck(replica_mtx_);
+  while (!shutting_down_.load()) {
+    replica_cv_.wait_for(
+        lck, std::chrono::microseconds(options_.replica_refresh_micros));
+    if (shutting_down_.load()) {
+      break;
+    }
+    Status s = RefreshReplica();
+    if (!s.ok()) {
+      Log(options_.info_log, "Replica refresh failed: %s",
+          s.ToString().c_str());
+    }
+  }
+}
+
+Status DBImpl::CheckReplica() {
+  if (!IsReplica()) {
+    return Status::OK();
+  }
+  if (replica_broken_.load()) {
+    return Status::IOError("the owner of the replica stopped publishing");
+  }
+  if (env_->NowMicros() - replica_refreshed_micros_.load() >
+      options_.replica_retire_micros) {
+    return Status::IOError("the replica fell behind its owner");
+  }
+  return Status::OK();
+}
+
 DB::~DB() = default;
 
 Status DB::Open(const Options& options, const std::string& dbname, DB** dbptr) {
   *dbptr = nullptr;
 
-  if (options.ShardInfo == nullptr){
+  if (options.ShardInfo == nullptr && options.hash_shards <= 0){
     //If it is not sharded
     DBImpl* impl = new DBImpl(options, dbname);
+    if (impl->IsReplica()) {
+      Status s = impl->OpenReplica();
+      if (s.ok()) {
+        *dbptr = impl;
+      } else {
+        delete impl;
+      }
+      return s;
+    }
     impl->undefine_mutex.Lock();
     VersionEdit edit(0);
     // Recover handles create_if_missing, error_if_exists
@@ -4117,9 +8281,11 @@ Status DB::Open(const Options& options, const std::string& dbname, DB** dbptr) {
         impl->logfile_ = lfile;
         impl->logfile_number_ = new_log_number;
         impl->log_ = new log::Writer(lfile);
-        impl->mem_ = new MemTable(impl->internal_comparator_);
-        impl->mem_.load()->SetFirstSeq(0);
-        impl->mem_.load()->SetLargestSeq(MEMTABLE_SEQ_SIZE-1);
+        impl->mem_ = impl->NewMemTable(MEMTABLE_SEQ_SIZE);
+        // The sequence may go on from the files recovered by the memory node.
+        impl->mem_.load()->SetFirstSeq(impl->versions_->LastSequence());
+        impl->mem_.load()->SetLargestSeq(impl->versions_->LastSequence() +
+                                          MEMTABLE_SEQ_SIZE - 1);
         impl->mem_.load()->Ref();
       }
     }
@@ -4135,6 +8301,9 @@ Status DB::Open(const Options& options, const std::string& dbname, DB** dbptr) {
     }
     impl->InstallSuperVersion();
     impl->undefine_mutex.Unlock();
+    if (s.ok()) {
+      s = impl->ReplayRemoteLog();
+    }
     if (s.ok()) {
       assert(impl->mem_ != nullptr);
       *dbptr = impl;
@@ -4150,9 +8319,8 @@ Status DB::Open(const Options& options, const std::string& dbname, DB** dbptr) {
     *dbptr = impl_with_shards;
 //    int i = 0;
 //    uint8_t shard_target_node_id = 2*i;
+    std::vector<DBImpl*> shards;
     for(auto iter : *impl_with_shards->GetShards_pool()){
-
-      DBImpl* impl = iter.second;
       //The node id space are shared by both compute nodes and memory nodes.
       // we need to twice the id.
 //      shard_target_node_id = 2*i;
@@ -4160,44 +8328,31 @@ Status DB::Open(const Options& options, const std::string& dbname, DB** dbptr) {
 //      impl->SetTargetnodeid(shard_target_node_id);
 //      i++;
 //      impl->SetTargetnodeid()
-      impl->undefine_mutex.Lock();
-      VersionEdit edit(0);
-      // Recover handles create_if_missing, error_if_exists
-      bool save_manifest = false;
-      s = impl->Recover(&edit, &save_manifest);
-      if (s.ok() && impl->mem_ == nullptr) {
-        // Create new log and a corresponding memtable.
-        uint64_t new_log_number = impl->versions_->NewFileNumber();
-        WritableFile* lfile;
-        s = options.env->NewWritableFile(LogFileName(dbname, new_log_number),
-                                         &lfile);
-        if (s.ok()) {
-          edit.SetLogNumber(new_log_number);
-          impl->logfile_ = lfile;
-          impl->logfile_number_ = new_log_number;
-          impl->log_ = new log::Writer(lfile);
-          impl->mem_ = new MemTable(impl->internal_comparator_);
-          impl->mem_.load()->SetFirstSeq(0);
-          impl->mem_.load()->SetLargestSeq(MEMTABLE_SEQ_SIZE-1);
-          impl->mem_.load()->Ref();
-        }
+      shards.push_back(iter.second);
+    }
+    if (options.log_replay_threads > 1) {
+      // The shards recover from their own memory nodes, side by side.
+      std::vector<Status> statuses(shards.size());
+      std::vector<std::thread> openers;
+      for (size_t i = 0; i < shards.size(); i++) {
+        openers.emplace_back(
+            [&, i] { statuses[i] = shards[i]->OpenShard(); });
       }
-      if (s.ok() && save_manifest) {
-        edit.SetPrevLogNumber(0);  // No older logs needed after recovery.
-        edit.SetLogNumber(impl->logfile_number_);
-        //    std::unique_lock<std::mutex> lck(impl->versionset_mtx,std::defer_lock);
-        s = impl->versions_->LogAndApply(&edit);
+      for (std::thread& opener : openers) {
+        opener.join();
       }
-      if (s.ok()) {
-        //    impl->RemoveObsoleteFiles();
-        impl->MaybeScheduleFlushOrCompaction();
+      for (const Status& status : statuses) {
+        if (s.ok() && !status.ok()) {
+          s = status;
+        }
       }
-      impl->InstallSuperVersion();
-      impl->undefine_mutex.Unlock();
-      if (s.ok()) {
-          assert(impl->mem_ != nullptr);
-      }else{
-        delete impl;
+    } else {
+      for (DBImpl* impl : shards) {
+        s = impl->OpenShard();
+        if (!s.ok()) {
+          // The shards are deleted with impl_with_shards.
+          break;
+        }
       }
     }
     if (s.ok()) {
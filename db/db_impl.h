@@ -7,21 +7,31 @@
 
 #include "db/dbformat.h"
 #include "db/log_writer.h"
+#include "db/shard_sequencer.h"
 #include "db/snapshot.h"
+#include "db/write_controller.h"
 #include <atomic>
 #include <condition_variable>
 #include <deque>
+#include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "dLSM/db.h"
 #include "dLSM/env.h"
 
 #include "port/port.h"
 #include "port/thread_annotations.h"
+#include "util/frequency_sketch.h"
+#include "util/histogram.h"
 #include "util/mutexlock.h"
 
 #include "memtable_list.h"
+#include "parallel_scan.h"
 #include "version_set.h"
 
 namespace dLSM {
@@ -32,6 +42,13 @@ class Version;
 class VersionEdit;
 class VersionSet;
 class MemTableList;
+class EditPublisher;
+class MemoryBudgetMember;
+class NegativeLookupCache;
+class RemoteLog;
+class RemoteLogReader;
+class Tracer;
+class WriteCut;
 //TODO: make memtableversionlist and LSM versionset 's function integrated into
 // Superversion.
 struct SuperVersion {
@@ -60,15 +77,6 @@ struct SuperVersion {
   void Cleanup();
   void Init();
 
-  // The value of dummy is not actually used. kSVInUse takes its address as a
-  // mark in the thread local storage to indicate the SuperVersion is in use
-  // by thread. This way, the value of kSVInUse is guaranteed to have no
-  // conflict with SuperVersion object address and portable on different
-  // platform.
-  static int dummy;
-  static void* const kSVInUse;
-  static void* const kSVObsolete;
-
  private:
   std::atomic<uint32_t> refs;
   // We need to_delete because during Cleanup(), imm->Unref() returns
@@ -76,6 +84,45 @@ struct SuperVersion {
   // delete all those memtables outside of mutex, during destruction
   autovector<MemTable*> to_delete;
 };
+// The epoch a reader thread has pinned, 0 when it is not reading. Every slot
+// is on a cache line of its own, it is written by one thread only.
+struct alignas(64) SuperVersionEpochSlot {
+  std::atomic<uint64_t> epoch{0};
+  // Whether a live thread owns the slot.
+  std::atomic<bool> in_use{true};
+};
+// The latencies of the phases of the writes of one thread, in microseconds.
+// The owner thread adds to them under mutex, which only the readers of the
+// "dLSM.write-latency" property contend for.
+struct alignas(64) WriteLatencySlot {
+  enum Phase {
+    kSequence,  // Taking the sequence numbers of the batch.
+    kPickup,    // PickupTableToWrite() outside of the stops.
+    kStall,     // The write delay and the stops on a full memtable list.
+    kInsert,    // The memtable inserts.
+    kNumPhases
+  };
+  WriteLatencySlot() {
+    for (Histogram& histogram : histograms) {
+      histogram.Clear();
+    }
+  }
+  std::mutex mutex;
+  Histogram histograms[kNumPhases];
+  // Whether a live thread owns the slot.
+  std::atomic<bool> in_use{true};
+};
+// The sequences a writer thread reserved for its next writes, see
+// Options::sequence_lease_size. The thread takes them from "next" on, the
+// memtable switch claims the ones left, both by moving "next".
+struct alignas(64) SequenceLease {
+  std::atomic<uint64_t> next{0};
+  // Changed under "mutex" only.
+  std::atomic<uint64_t> end{0};
+  std::mutex mutex;
+  // Whether a live thread owns the slot.
+  std::atomic<bool> in_use{true};
+};
 // The structure for storing argument for thread pool.
 
 class DBImpl : public DB {
@@ -93,17 +140,58 @@ class DBImpl : public DB {
   Status Put(const WriteOptions&, const Slice& key,
              const Slice& value) override;
   Status Delete(const WriteOptions&, const Slice& key) override;
+  Status Merge(const WriteOptions&, const Slice& key,
+               const Slice& value) override;
+  Status DeleteRange(const WriteOptions&, const Slice& begin,
+                     const Slice& end) override;
+  Status IngestSorted(Iterator* input) override;
   Status Write(const WriteOptions& options, WriteBatch* updates) override;
+  void WriteAsync(const WriteOptions& options, const WriteBatch& updates,
+                  const WriteCallback& callback) override;
   Status Get(const ReadOptions& options, const Slice& key,
              std::string* value) override;
+  Status Get(const ReadOptions& options, const Slice& key,
+             PinnableSlice* value) override;
+  Status GetLarge(const ReadOptions& options, const Slice& key,
+                  const ValueCallback& callback) override;
+  std::vector<Status> MultiGet(const ReadOptions& options,
+                               const std::vector<Slice>& keys,
+                               std::vector<std::string>* values) override;
+  void Prefetch(const ReadOptions& options,
+                const std::vector<Slice>& keys) override;
+  void Prefetch(const ReadOptions& options, const Range& range) override;
   Iterator* NewIterator(const ReadOptions&) override;
 #ifdef BYTEADDRESSABLE
   Iterator* NewSEQIterator(const ReadOptions&) override;
 #endif
+  Status ParallelScan(const ReadOptions& options, const Range& range,
+                      int num_partitions, bool ordered,
+                      const ScanCallback& callback) override;
+  Status FilteredScan(const ReadOptions& options, const Range& range,
+                      const std::string& filter_name,
+                      const ScanCallback& callback) override;
+  Status StartTrace(const std::string& path) override;
+  Status EndTrace() override;
+  // Split "range" of this shard into at most "num_partitions" partitions at
+  // the smallest keys of the files of the current version, each with about
+  // the same bytes of files, and append them to *partitions.
+  void AddScanPartitions(const ReadOptions& options, const Range& range,
+                         int num_partitions,
+                         std::vector<ScanPartition>* partitions);
+  // The internal iterator of a DB iterator being refreshed, the one of
+  // NewInternalSEQIterator() if "seq". *range_tombstones is set as by
+  // NewInternalIterator(), to nullptr for the seq one.
+  Iterator* NewRefreshedInternalIterator(
+      const ReadOptions& options, bool seq, SequenceNumber* latest_snapshot,
+      const RangeTombstones** range_tombstones);
   const Snapshot* GetSnapshot() override;
   void ReleaseSnapshot(const Snapshot* snapshot) override;
   bool GetProperty(const Slice& property, std::string* value) override;
+  bool GetMapProperty(const Slice& property,
+                      std::map<std::string, uint64_t>* value) override;
   void GetApproximateSizes(const Range* range, int n, uint64_t* sizes) override;
+  void GetApproximateCounts(const Range* range, int n, uint64_t* entries,
+                            uint64_t* raw_sizes) override;
   void CompactRange(const Slice* begin, const Slice* end) override;
 
   // Extra methods (for testing) that are not in the public DB interface
@@ -128,10 +216,11 @@ class DBImpl : public DB {
   // bytes.
   void RecordReadSample(Slice key);
   void CleanupSuperVersion(SuperVersion* sv);
-  void ReturnAndCleanupSuperVersion(SuperVersion* sv);
-  SuperVersion* GetThreadLocalSuperVersion();
-  bool ReturnThreadLocalSuperVersion(SuperVersion* sv);
-  void ResetThreadLocalSuperVersions();
+  // Pin the current SuperVersion for a read of this thread, without taking a
+  // reference. It stays valid until UnpinSuperVersion(). The pins of a thread
+  // do not nest.
+  SuperVersion* PinSuperVersion();
+  void UnpinSuperVersion(SuperVersion* sv);
   void InstallSuperVersion();
   void WaitforAllbgtasks(bool clear_mem) override;
   void SetTargetnodeid(uint8_t id){
@@ -148,9 +237,11 @@ class DBImpl : public DB {
 //  void Wait_for_client_message_hanlding_setup();
  private:
   friend class DB;
+  friend class DBImpl_Sharding;
 //  struct CompactionState;
 //  struct SubcompactionState;
   struct Writer;
+  struct AsyncWrites;
 
   // Information for a manual compaction
   struct ManualCompaction {
@@ -163,9 +254,18 @@ class DBImpl : public DB {
 
 
 
-  Iterator* NewInternalIterator(const ReadOptions&,
-                                SequenceNumber* latest_snapshot,
-                                uint32_t* seed);
+  // Get() with the value copied to a std::string or pinned in a
+  // PinnableSlice. If blob_index is not null, a value of the tables kept in
+  // blob chunks is left unread, see Version::GetStats::blob_index.
+  template <typename Value>
+  Status GetImpl(const ReadOptions& options, const Slice& key, Value* value,
+                 std::string* blob_index = nullptr);
+
+  // If range_tombstones is not null, *range_tombstones is set to the range
+  // tombstones of the version the iterator reads, which lives as long as it.
+  Iterator* NewInternalIterator(
+      const ReadOptions&, SequenceNumber* latest_snapshot, uint32_t* seed,
+      const RangeTombstones** range_tombstones = nullptr);
 #ifdef BYTEADDRESSABLE
   Iterator* NewInternalSEQIterator(const ReadOptions&,
                                 SequenceNumber* latest_snapshot,
@@ -187,28 +287,202 @@ class DBImpl : public DB {
   // Compact the in-memory write buffer to disk.  Switches to a new
   // log-file/memtable and writes a new descriptor iff successful.
   // Errors are recorded in bg_error_.
-  void CompactMemTable();
+  // Returns false if the memtables waiting for a flush wait for their merge
+  // first, see MaybeScheduleImmutableMerge().
+  bool CompactMemTable();
   void ForceCompactMemTable();
   Status RecoverLogFile(uint64_t log_number, bool last_log, bool* save_manifest,
                         VersionEdit* edit, SequenceNumber* max_sequence)
       EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
+  // Insert the batches of the remote log which Recover() read into the
+  // memtables, once DB::Open() set them up.
+  Status ReplayRemoteLog();
 
+  // Build the level 0 tables of the job, one for every key range the job
+  // is split into by PickFlushPartitions(), on threads of their own.
   Status WriteLevel0Table(FlushJob* job, VersionEdit* edit)
       EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
+  // Send the entries "job" keeps to the memory node, which builds its table,
+  // see Options::offload_flush. job->ssts gets the table. NotSupported if
+  // there is nothing to write, an error if the memory node could not build
+  // the table.
+  Status OffloadFlush(FlushJob* job);
+  // Build the tables of IngestSorted() out of "input", every entry at
+  // "sequence". The large values go to blob chunks as at the flush.
+  Status BuildIngestedTables(
+      Iterator* input, SequenceNumber sequence,
+      std::vector<std::shared_ptr<RemoteMemTableMetaData>>* tables);
+  Status FinishIngestedTable(
+      TableBuilder* builder, BlobWriter* blob_writer,
+      const std::shared_ptr<RemoteMemTableMetaData>& meta);
+  // Recover a shard of DBImpl_Sharding and set up its memtable, once its
+  // memory node and shard id are set.
+  Status OpenShard();
+  bool IsReplica() const { return options_.replica_owner_node_id != 0; }
+  // Replace the quota of the shard, see ShardQuota. A shard opened without
+  // an RDMA budget can not get one, nor lose the one it has.
+  Status SetQuota(const ShardQuota& quota);
+  // Open the DB, or the shard, as a read replica of the one of
+  // options_.replica_owner_node_id, once its memory node and shard id are
+  // set, and start following it.
+  Status OpenReplica();
+  // Apply the edits, and insert the unflushed batches, the owner published
+  // since the last refresh. Called by the refresh thread only, after
+  // OpenReplica().
+  Status RefreshReplica();
+  void ReplicaRefreshLoop();
+  // OK unless the DB is a read replica whose owner stopped publishing, or
+  // whose last refresh is older than options_.replica_retire_micros, after
+  // which the owner may have freed the tables of its versions.
+  Status CheckReplica();
+  // Let the sequence of this shard go on after "sequence", for the shard
+  // which takes over the tables of another one. The memtable must have no
+  // entries.
+  void AdvanceSequence(SequenceNumber sequence);
+  // Hand the tables and range tombstones of the user keys from "key" on
+  // over to "target", a new shard on the same memory node. The tables keep
+  // their numbers, those of "target" go on after the ones of this shard. A
+  // table with keys on both sides of "key" is rewritten into one table of
+  // each side under its number, so that the level 0 tables keep their
+  // order. No flush or compaction may run on either shard.
+  Status MoveTablesFrom(const Slice& key, DBImpl* target);
+  // The part of "table" before "key" into *low, built for this shard, and
+  // the rest into *high, built for "target".
+  Status SplitTable(const std::shared_ptr<RemoteMemTableMetaData>& table,
+                    const Slice& key, DBImpl* target,
+                    std::shared_ptr<RemoteMemTableMetaData>* low,
+                    std::shared_ptr<RemoteMemTableMetaData>* high);
+  // Copy the entries of "input", a table iterator of "table", up to the
+  // user key "limit", or to the end if it is empty, into a table built for
+  // "owner" on its memory node, under the number and at the level of
+  // "table". *copy is left alone if there are none.
+  Status CopyTableEntries(const RemoteMemTableMetaData& table, Iterator* input,
+                          const Slice& limit, DBImpl* owner,
+                          std::shared_ptr<RemoteMemTableMetaData>* copy);
+  // Copy the tables of the current version missing from *copies over to
+  // "target", a new shard on another memory node, and drop the copies of
+  // the tables which are gone from *copies. With "install" the copies and
+  // the range tombstones are installed into "target" as well, no flush or
+  // compaction may run on this shard then.
+  Status CopyTablesTo(
+      DBImpl* target, bool install,
+      std::map<std::shared_ptr<RemoteMemTableMetaData>,
+               std::shared_ptr<RemoteMemTableMetaData>>* copies);
+  // Take over all the tables and range tombstones of "other", a shard on
+  // the same memory node whose keys are after the ones of this shard,
+  // renumbered in the order of their numbers. "other" is left empty. No
+  // flush or compaction may run on either shard.
+  Status TakeOverTables(DBImpl* other);
+  // Whether one of "mems" holds a user key in [smallest, largest].
+  bool MemTablesOverlap(const std::vector<MemTable*>& mems,
+                        const Slice& smallest, const Slice& largest);
+  // The level the ingested tables of [smallest, largest] go to,
+  // superversion_memlist_mtx held.
+  int PickLevelForIngestion(const Slice& smallest, const Slice& largest);
+  // The user keys the flush of "job" is split at, none for one range.
+  void PickFlushPartitions(FlushJob* job, std::vector<std::string>* bounds);
   Status WriteLevel0Table(MemTable* job, VersionEdit* edit, Version* base)
   EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
-  Status PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r)
+  // The number of sequences the memtable after "full" takes.
+  size_t NextSeqWindow(MemTable* full);
+  // A memtable for "seq_window" sequences, as options_ configure it.
+  MemTable* NewMemTable(size_t seq_window) const;
+  // Take the quota of options_.shard_quota, for the constructors.
+  void InitQuota();
+  // Join options_.memory_budget, for the constructors.
+  void InitMemoryBudget();
+  class BudgetMember;
+  // Whether switching from the memtable "full" would hold more memtable
+  // bytes than the quota allows while a flush can still free some.
+  bool MemtableQuotaExceeded(MemTable* full);
+  // Count a flush to schedule, false if the quota has enough in flight.
+  bool ReserveFlush();
+  // The time the writer was stopped is added to *stall_micros if it is not
+  // null.
+  Status PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r,
+                            uint64_t* stall_micros = nullptr)
       EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
+  // The batch goes to the remote log first, unless !write_log. See
+  // WriteOptions::memtable_insert_hint for "insert_hint".
+  Status InsertBatchIntoMemtables(WriteBatch* updates, bool write_log = true,
+                                  bool insert_hint = false);
+  // A batch whose sequences are taken, between PrepareWrite() and
+  // CommitWrite().
+  struct PreparedWrite {
+    WriteBatch* batch = nullptr;
+    uint64_t phase_nanos[WriteLatencySlot::kNumPhases] = {};
+    // Set by a caller which took the sequences of several shards within
+    // write_cut_ itself.
+    bool in_cut = false;
+    // The cut the write entered for its sequences and left at CommitWrite().
+    WriteCut* cut = nullptr;
+    uint64_t cut_epoch = 0;
+  };
+  // The first half of InsertBatchIntoMemtables(): the write delay, the
+  // sequences of the batch and its remote log record. The sequences are
+  // taken within write_cut_ unless prepared->in_cut. They are taken even if
+  // it fails, CommitWrite() must follow in any case.
+  Status PrepareWrite(WriteBatch* updates, bool write_log,
+                      PreparedWrite* prepared);
+  // Insert the prepared batch into the memtables owning its sequences, or
+  // only count the sequences if !insert, so that the memtables still fill
+  // up.
+  Status CommitWrite(PreparedWrite* prepared, bool insert, bool insert_hint);
+  // Put(), Delete() and Merge() without a WriteBatch: the sequence of the
+  // key is taken and the entry goes straight into the memtable arena.
+  // Returns false, leaving *s alone, if the write has to go through a
+  // batch, which the group commit, the remote log and the trace take.
+  bool WriteSingle(const WriteOptions& options, ValueType type,
+                   const Slice& key, const Slice& value, Status* s);
+  void RecordWriteLatency(const uint64_t* phase_nanos);
+  Status GroupCommitWrite(const WriteOptions& options, WriteBatch* updates);
   WriteBatch* BuildBatchGroup(Writer** last_writer)
       EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
+  // Run by the threads of async_writes_: apply the queued batches of
+  // WriteAsync() a group at a time until the DB is deleted.
+  void AsyncWriteLoop();
+  // MultiGet() without the trace.
+  std::vector<Status> MultiGetImpl(const ReadOptions& options,
+                                   const std::vector<Slice>& keys,
+                                   std::vector<std::string>* values);
+  struct PrefetchRequest;
+  // Queue a hint of Prefetch() for PrefetchLoop().
+  void SchedulePrefetch(PrefetchRequest request);
+  // Run by the thread of prefetches_: read the hints of Prefetch() until
+  // the DB is deleted.
+  void PrefetchLoop();
 
   void RecordBackgroundError(const Status& s);
+  // Remove the tables whose entries are all deleted by a range tombstone
+  // which every snapshot sees, without reading them, and the tombstones
+  // which can not delete anything any more.
+  void DropCoveredFiles();
+  // With kCompactionStyleFIFO, drop the oldest tables while they hold more
+  // than Options::fifo_max_table_files_size bytes or are past
+  // Options::ttl, by a version edit.
+  void DropExpiredFiles();
 
   void MaybeScheduleFlushOrCompaction() EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
   static void BGWork_Flush(void* thread_args);
   static void BGWork_Compaction(void* thread_args);
+  // Queue a compaction task unless one is already waiting to pick.
+  void ScheduleCompaction();
   void BackgroundCall();
   void BackgroundFlush(void* p);
+  // Queue a merge of immutables, see Options::merge_immutables, unless one
+  // is queued already or there is nothing to merge.
+  void MaybeScheduleImmutableMerge();
+  static void BGWork_MergeImmutables(void* thread_args);
+  void BackgroundMergeImmutables();
+  // Queue the copy of the tables of the replicated levels which have none,
+  // see Options::replicated_levels, and the parity of the erasure coded
+  // ones, see Options::erasure_coded_level, unless it is queued already.
+  void MaybeScheduleReplication();
+  static void BGWork_Replicate(void* thread_args);
+  void BackgroundReplicate();
+  // Copy the data chunks of "table" to the memory node "node_id" through
+  // the compute node and publish them as its replica.
+  Status ReplicateTable(RemoteMemTableMetaData* table, uint8_t node_id);
   void BackgroundCompaction(void* p) EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
   void CleanupCompaction(CompactionState* compact)
       EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
@@ -224,25 +498,70 @@ class DBImpl : public DB {
   Status InstallCompactionResults(CompactionState* compact,
                                   std::unique_lock<std::mutex>* lck_sv)
       EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
+  // Open "tables", or the new tables of *edit, in the table cache before
+  // they are installed, see Options::open_new_tables.
+  void OpenNewTables(
+      const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables);
+  void OpenNewTables(VersionEdit* edit);
   Status TryInstallMemtableFlushResults(
       FlushJob* job, VersionSet* vset,
-      std::shared_ptr<RemoteMemTableMetaData>& sstable, VersionEdit* edit);
+      const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& sstables,
+      VersionEdit* edit);
 //  SuperVersion* GetReferencedSuperVersion(DBImpl* db);
 
-  void NearDataCompaction(Compaction* c);
+  // Run c on the memory node of the shard and install its result. Returns
+  // false if the memory node handed it back undone, see
+  // Memory_Node_Keeper::SetCompactionHandBack(), c then runs here.
+  bool NearDataCompaction(Compaction* c);
+  // Whether c goes to the memory node of the shard rather than running on
+  // this node, which reads the inputs from the memory node and writes the
+  // outputs back. It stays here only while the memory node is saturated,
+  // this node has a core to spare, and the compactions run here lately were
+  // not slower than those sent there.
+  bool PlaceCompactionNearData();
+  // Whether all the inputs of c are on the memory node of the shard, which
+  // reads them from its memory if the compaction goes there.
+  bool InputsOnShardNode(Compaction* c);
+  // The memory node the next SSTable of the shard built on this node goes
+  // to, the one of the shard unless Options::stripe_tables.
+  uint8_t NextTableNode();
+  // Fold the time a compaction of "bytes" input bytes took, placed as
+  // PlaceCompactionNearData() chose, into the timings it compares.
+  void RecordCompactionTime(bool near_data, uint64_t bytes, uint64_t micros);
+  // The pressure write_controller_ paces the writes at. It grows with the
+  // level 0 files and immutable memtables of this shard and with the
+  // pressure its memory node publishes, so that the writes slow down
+  // smoothly well before they have to stop.
+  double WritePressure();
+  // Pick the files read most often since the last flush, pin their tables in
+  // the table cache and keep them for the next edit sent to the memory node.
+  void UpdateHotFiles();
+  // Load the cold table f back into the memory of its memory node under a
+  // new file number. Returns false if f is compacted meanwhile or the memory
+  // node fails to load it.
+  bool PromoteColdFile(const std::shared_ptr<RemoteMemTableMetaData>& f);
 //  void Communication_To_Home_Node();
-  void Edit_sync_to_remote(VersionEdit* edit,
-                           std::unique_lock<std::mutex>* version_mtx);
+  // Queue the edit, just applied, for the memory node and return. The edits
+  // go out in the order they are queued, several in one message, from
+  // edit_syncer_. If "wait" is set, return once the memory node has it.
+  void Edit_sync_to_remote(VersionEdit* edit, bool wait = false);
+  void Edit_sync_loop();
+  // Send the "num_edits" edits of "batch", each prefixed with its varint32
+  // length, in one install_version_edit message.
+  void Send_edits_to_remote(const std::string& batch, uint32_t num_edits,
+                            uint64_t version_id, ibv_mr& send_mr,
+                            ibv_mr& send_mr_ve, ibv_mr& receive_mr);
   const Comparator* user_comparator() const {
     return internal_comparator_.user_comparator();
   }
   void sync_option_to_remote(uint8_t target_node_id);
+  // Install the files the memory node recovered from its disk after a
+  // restart, if this is the first compute node to ask for them. With
+  // "reattach", also the files this compute node had before it restarted,
+  // which are still in the memory of the memory node.
+  Status recover_version_from_remote(uint8_t target_node_id, bool reattach);
   void remote_qp_reset(std::string& qp_type, uint8_t target_node_id);
   void install_version_edit_handler(RDMA_Request* request, std::string client_ip);
-#ifdef WITHPERSISTENCE
-  static void SSTable_Unpin_Dispatch(void* thread_args);
-  void persistence_unpin_handler(void* arg);
-#endif
   // Constant after construction
   Env* const env_;
   std::unordered_map<unsigned int, std::pair<std::mutex, std::condition_variable>> imm_notifier_pool;
@@ -260,10 +579,59 @@ class DBImpl : public DB {
   Options options_;  // options_.comparator == &internal_comparator_
   const bool owns_info_log_;
   const bool owns_cache_;
+  const bool owns_meta_cache_;
   const std::string dbname_;
 
   // table_cache_ provides its own synchronization
   TableCache* const table_cache_;
+  // Null unless options_.negative_lookup_cache_size is set. Provides its own
+  // synchronization.
+  NegativeLookupCache* const negative_cache_;
+  // The trace of StartTrace(), the one of the DBImpl_Sharding for a shard,
+  // which records the iterators itself. Provides its own synchronization.
+  Tracer* tracer_;
+  bool owns_tracer_;
+  // Null unless options_.remote_log_size is set, opened by Recover().
+  // Provides its own synchronization.
+  RemoteLog* remote_log_;
+  // Null unless options_.replica_edit_log_size is set, opened by Recover().
+  // Called by versions_ only.
+  EditPublisher* edit_publisher_ = nullptr;
+  // The rings of the owner a read replica follows and the offsets it read
+  // them up to. The tail is null unless options_.replica_read_tail is set.
+  // Used by the refresh thread only.
+  RemoteLogReader* replica_edits_ = nullptr;
+  RemoteLogReader* replica_tail_ = nullptr;
+  uint64_t replica_edits_offset_ = 0;
+  uint64_t replica_tail_offset_ = 0;
+  // The batches of the owner inserted into mem_, with their offsets in its
+  // log. mem_ is rebuilt from the ones left once the owner truncates.
+  std::deque<std::pair<uint64_t, std::string>> replica_batches_;
+  std::thread replica_refresher_;
+  // When the last refresh succeeded, and whether the owner published that
+  // it stopped publishing.
+  std::atomic<uint64_t> replica_refreshed_micros_{0};
+  std::atomic<bool> replica_broken_{false};
+  std::mutex replica_mtx_;
+  std::condition_variable replica_cv_;
+  // The encoded edits waiting for edit_syncer_, with their persistence
+  // epochs, and the count of the edits queued and sent since the start.
+  std::deque<std::pair<std::string, uint64_t>> pending_edits_;
+  uint64_t edits_queued_ = 0;
+  uint64_t edits_synced_ = 0;
+  bool edit_syncer_exit_ = false;
+  std::thread edit_syncer_;
+  std::mutex edit_sync_mtx_;
+  std::condition_variable edit_sync_cv_;
+  // The cut of the sharded DB of the shard, which its writes take their
+  // sequences in, or null. Set before the shard is opened.
+  WriteCut* write_cut_ = nullptr;
+  // The batches Recover() read from the remote log until they are replayed,
+  // and the first sequence the tables flushed before do not hold.
+  std::vector<std::string> remote_log_batches_;
+  SequenceNumber remote_log_unflushed_;
+  // Provides its own synchronization.
+  WriteController write_controller_;
 
   // Lock over the persistent DB state.  Non-null iff successfully acquired.
   FileLock* db_lock_;
@@ -298,15 +666,81 @@ class DBImpl : public DB {
   // Queue of writers.
   std::deque<Writer*> writers_;
   WriteBatch* tmp_batch_;
-
+  // The queues of WriteAsync() and their threads.
+  std::unique_ptr<AsyncWrites> async_writes_;
+  // The hints of Prefetch() and their thread.
+  struct Prefetches;
+  std::unique_ptr<Prefetches> prefetches_;
+
+  // Taken and released without undefine_mutex. The reads without a snapshot
+  // read at LastSequence() instead of taking one.
   SnapshotList snapshots_;
-  ThreadPool Unpin_bg_pool_;
+  // The size of snapshots_, read by the writers without a lock to update
+  // the values in place while it is 0.
+  std::atomic<size_t> num_snapshots_{0};
+#ifdef WITHPERSISTENCE
+  // The persistence epoch the memory node has reached for this shard, which
+  // it writes by RDMA. The edits up to it are durable.
+  ibv_mr persist_epoch_mr_;
+#endif
   // Set of table files to protect from deletion because they are
   // part of ongoing compactions.
 //  std::set<uint64_t> pending_outputs_;
 
   // Has a background compaction been scheduled or is running?
   bool background_compaction_scheduled_;
+  // Compaction tasks scheduled which have not picked their compaction yet.
+  // A task which has picked one queues the next, so that non-overlapping
+  // compactions are dispatched in parallel up to the compaction threads.
+  std::atomic<int> queued_compactions_;
+  // The quota of the shard, read without a lock. A change applies from the
+  // next memtable switch, or flush scheduled, on.
+  std::atomic<size_t> quota_memtable_bytes_{0};
+  std::atomic<int> quota_max_flushes_{0};
+  // Owned, options_.rdma_limiter if the shard was opened with an RDMA
+  // budget.
+  RateLimiter* rdma_limiter_ = nullptr;
+  // The flushes of the shard scheduled and not finished.
+  std::atomic<int> flushes_in_flight_{0};
+  // A merge of immutables is queued or running.
+  std::atomic<bool> immutable_merge_scheduled_{false};
+  // A copy of tables to their second memory node, or the parity of tables,
+  // is queued or running.
+  std::atomic<bool> replication_scheduled_{false};
+  // The time the writers of the shard waited for the memtable quota.
+  std::atomic<uint64_t> quota_stall_micros_{0};
+  // The bytes of the batches the users wrote, against which the bytes the
+  // flushes and the compactions write make the write amplification.
+  std::atomic<uint64_t> user_bytes_written_{0};
+  // The last sample of SampleCompactionDebt() and the moving averages of the
+  // growth of the level 0 files and the pending compaction bytes, per
+  // second, under debt_mtx_.
+  std::mutex debt_mtx_;
+  uint64_t debt_sample_micros_ = 0;
+  int debt_sample_files_ = 0;
+  uint64_t debt_sample_bytes_ = 0;
+  double level0_file_rate_ = 0;
+  double pending_bytes_rate_ = 0;
+  // Owned, the shard in options_.memory_budget, null without one.
+  MemoryBudgetMember* budget_member_ = nullptr;
+  // The budget asked for a smaller memtable, the next switch halves the
+  // sequence window.
+  std::atomic<bool> shrink_memtables_{false};
+  // Compactions queued or running on the memory node of the shard, as the
+  // memory node reported with its last compaction result, and when. The
+  // count covers the compactions of all the compute nodes.
+  std::atomic<uint32_t> memory_node_compaction_load_;
+  std::atomic<uint64_t> memory_node_load_micros_;
+  // The compactions running on this node, and how busy its processors are.
+  std::atomic<int> local_compactions_{0};
+  port::CpuLoad cpu_load_;
+  // The moving averages of the time the compactions took per MB of input
+  // sent to the memory node, waiting in its queue included, and run here,
+  // the RDMA traffic of the inputs and outputs included. 0 until timed;
+  // the time here is retaken once it is old.
+  std::atomic<uint64_t> near_data_micros_per_mb_{0};
+  std::atomic<uint64_t> local_micros_per_mb_{0};
+  std::atomic<uint64_t> local_timed_micros_{0};
 
   ManualCompaction* manual_compaction_;
 
@@ -315,17 +749,99 @@ class DBImpl : public DB {
   // Have we encountered a background error in paranoid mode?
   Status bg_error_;
 
+  // Added from the flushes, the compactions and the version edits of the
+  // compactions of the memory node, under stats_mtx_.
+  void AddCompactionStats(int level, const CompactionStats& stats);
+  std::mutex stats_mtx_;
   CompactionStats stats_[config::kNumLevels];
 //  std::atomic<size_t> memtable_counter = 0;
 //  std::atomic<size_t> kv_counter0 = 0;
 //  std::atomic<size_t> kv_counter1 = 0;
   std::atomic<uint64_t> super_version_number_;
-  SuperVersion* super_version;
-//  std::unique_ptr<ThreadLocalPtr> local_sv_;
-  ThreadLocalPtr* local_sv_;
+  // Published with a pointer swap, so that readers need no lock. A replaced
+  // SuperVersion is retired with the epoch of the swap and its reference is
+  // dropped once no reader pins an older epoch.
+  std::atomic<SuperVersion*> super_version;
+  std::atomic<uint64_t> super_version_epoch_;
+  SuperVersionEpochSlot* GetEpochSlot();
+  void ReclaimSuperVersions(bool all);
+  // Slot of this thread in epoch_slots_.
+  ThreadLocalPtr* local_epoch_slot_;
+  std::mutex epoch_slots_mtx_;
+  std::vector<SuperVersionEpochSlot*> epoch_slots_;
+  // The write latencies of every thread that wrote, kept after it exits.
+  WriteLatencySlot* GetWriteLatencySlot();
+  // Add the write latencies of all the threads to "histograms", one per
+  // WriteLatencySlot::Phase.
+  void MergeWriteLatency(Histogram* histograms);
+  // The "dLSM.write-latency" property of "histograms".
+  static std::string WriteLatencyString(const Histogram* histograms);
+  // Add the "dLSM.stats" counters of this shard to *stats.
+  void AddStats(std::map<std::string, uint64_t>* stats);
+  // Add the "dLSM.stats" counters the shards of the process share to *stats.
+  static void AddProcessStats(std::map<std::string, uint64_t>* stats);
+  // The "dLSM.stats" property of the counters "stats".
+  static std::string StatsString(const std::map<std::string, uint64_t>& stats);
+  // Add the "dLSM.compaction-debt" counters of this shard to *stats, their
+  // names prefixed with "prefix".
+  void AddCompactionDebt(const std::string& prefix,
+                         std::map<std::string, uint64_t>* stats);
+  // Fold how fast the level 0 files and the pending compaction bytes of the
+  // shard grew since the last sample into their moving averages, once per
+  // kDebtSampleMicros at most.
+  void SampleCompactionDebt();
+  // The microseconds until the level 0 files reach kL0_StopWritesTrigger, or
+  // the pending compaction bytes the hard limit of the options, at the rate
+  // they grew lately. UINT64_MAX while neither grows.
+  uint64_t TimeToStall();
+  ThreadLocalPtr* local_write_latency_slot_;
+  std::mutex write_latency_slots_mtx_;
+  std::vector<WriteLatencySlot*> write_latency_slots_;
+  // Reserve "n" consecutive sequences and return the first one, from the
+  // lease of the thread if it has enough left.
+  SequenceNumber TakeSequences(size_t n);
+  // Reserve "n" consecutive sequences from versions_, or from sequencer_ if
+  // the shard has one, in which case the sequences the other compute nodes
+  // took since the last reservation are skipped.
+  SequenceNumber AssignSequences(size_t n);
+  SequenceLease* GetSequenceLease();
+  // Skip the sequences left in the lease of this thread, before it takes
+  // sequences from the shared counter, so that its later writes stay
+  // above its earlier ones.
+  void RetireSequenceLease();
+  // Take back the sequences the writers have not taken from their leases,
+  // as ranges of first and last sequence.
+  void ClaimSequenceLeases(std::vector<std::pair<uint64_t, uint64_t>>* unused);
+  // Count the sequences [first, last], which no write takes, into the
+  // memtables they belong to, so that those still fill up. The ones after
+  // mem_ wait in skipped_sequences_ for the memtables to come.
+  // REQUIRES: superversion_memlist_mtx held.
+  void SkipSequences(uint64_t first, uint64_t last);
+  // The last sequence before all the ones the writers hold in their leases,
+  // which the reads without a snapshot, and the flushes and compactions,
+  // take as the latest one.
+  SequenceNumber VisibleSequence();
+  ThreadLocalPtr* local_sequence_lease_;
+  std::mutex sequence_leases_mtx_;
+  std::vector<SequenceLease*> sequence_leases_;
+  std::vector<std::pair<uint64_t, uint64_t>> skipped_sequences_;
+  // The counter of the shard on its memory node with
+  // Options::shard_sequencer, null otherwise. The reservations of this node
+  // are serialized by sequencer_mtx_.
+  std::unique_ptr<ShardSequencer> sequencer_;
+  std::mutex sequencer_mtx_;
+  std::mutex retired_sv_mtx_;
+  std::vector<std::pair<uint64_t, SuperVersion*>> retired_svs_;
+  // Reads served by every SSTable, keyed by file number and creator node.
+  FrequencySketch read_sketch_;
+  std::mutex hot_files_mtx_;
+  // file number, creator node id, frequency
+  std::vector<std::tuple<uint64_t, uint8_t, uint32_t>> hot_files_;
   std::vector<std::thread> main_comm_threads;
   uint8_t shard_target_node_id = 0;
   uint8_t shard_id = 0;
+  // The SSTables NextTableNode() placed, for the turns of the memory nodes.
+  std::atomic<uint32_t> tables_placed_{0};
 #ifdef PROCESSANALYSIS
   std::atomic<size_t> Total_time_elapse;
   std::atomic<size_t> flush_times;
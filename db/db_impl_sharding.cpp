@@ -4,25 +4,76 @@
 
 #include "db_impl_sharding.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <thread>
+
+#include "dLSM/write_batch.h"
+#include "table/merger.h"
+
 namespace dLSM {
 
-DBImpl_Sharding::DBImpl_Sharding(const Options& options, const std::string& dbname) {
-    assert(options.ShardInfo->size() != 0);
-    for (auto iter : *options.ShardInfo) {
-      Shard_Info.emplace_back(iter.first.ToString(), iter.second.ToString());
-    }
-    for(const auto& iter : Shard_Info) {
-      //We can not set the target node id in DBImpl because we don't know what should be
-      // the node id corresponding with this shard. (Is that true?) Probably not.
+namespace {
+// Holds a write which takes sequences in several places within one epoch of
+// the cut until it is done.
+class CutScope {
+ public:
+  explicit CutScope(WriteCut* cut) : cut_(cut), epoch_(cut->Enter()) {}
+  ~CutScope() {
+    cut_->Reserved();
+    cut_->Exit(epoch_);
+  }
+
+  CutScope(const CutScope&) = delete;
+  CutScope& operator=(const CutScope&) = delete;
+
+ private:
+  WriteCut* const cut_;
+  const uint64_t epoch_;
+};
+
+// The gap in the load shares of the memory nodes BalanceShards() leaves.
+const double kBalanceThreshold = 0.1;
+
+// The snapshots of all the shards, see DBImpl_Sharding::GetSnapshot().
+class ShardedSnapshot : public Snapshot {
+ public:
+  std::map<DBImpl*, const Snapshot*> snapshots;
+};
+}  // namespace
 
-      // Now the shards are assigned to target memory nodes in a strictly round robin manner
-      // according to the upper bound of shard. the third argument we set as 0,
-      // to overload the function. The overloaded initial function will not create message
-      // handling thread.
-      auto sharded_db =
-          new DBImpl(options, dbname, iter.second, iter.first);
-      shards_pool.insert({iter.second, sharded_db});
+DBImpl_Sharding::DBImpl_Sharding(const Options& options, const std::string& dbname)
+    : router_(options.ShardInfo == nullptr),
+      options_(options),
+      dbname_(dbname),
+      tracer_(options.env) {
+    if (router_.hashed()) {
+      // The shards split the hash values evenly.
+      assert(options.hash_shards > 0);
+      for (int i = 0; i < options.hash_shards; i++) {
+        auto sharded_db =
+            NewShard(ShardRouter::HashBound(i + 1, options.hash_shards),
+                     ShardRouter::HashBound(i, options.hash_shards));
+        shards_pool.insert({Slice(sharded_db->upper_bound), sharded_db});
+      }
+    } else {
+      assert(options.ShardInfo->size() != 0);
+      for(const auto& iter : *options.ShardInfo) {
+        //We can not set the target node id in DBImpl because we don't know what should be
+        // the node id corresponding with this shard. (Is that true?) Probably not.
+
+        // Now the shards are assigned to target memory nodes in a strictly round robin manner
+        // according to the upper bound of shard. the third argument we set as 0,
+        // to overload the function. The overloaded initial function will not create message
+        // handling thread.
+        auto sharded_db =
+            NewShard(iter.second.ToString(), iter.first.ToString());
+        shards_pool.insert({Slice(sharded_db->upper_bound), sharded_db});
+      }
     }
+    router_.Build(shards_pool);
     int i = 0;
     int memory_node_num = Env::Default()->rdma_mg->memory_nodes.size();
     int target_mem_node_id = 0;
@@ -30,6 +81,7 @@ DBImpl_Sharding::DBImpl_Sharding(const Options& options, const std::string& dbna
       target_mem_node_id = 2*(i%memory_node_num);
       assert(i < 256);
       iter.second->WaitForComputeMessageHandlingThread(target_mem_node_id, i);
+      shard_ids_.insert(i);
       i++;
     }
     // you should not combine this two loops together because there is a wait function.
@@ -37,6 +89,13 @@ DBImpl_Sharding::DBImpl_Sharding(const Options& options, const std::string& dbna
 //      iter.second->Wait_for_client_message_hanlding_setup();
 //    }
 }
+DBImpl* DBImpl_Sharding::NewShard(const std::string& upper_bound,
+                                  const std::string& lower_bound) {
+  auto* db = new DBImpl(options_, dbname_, upper_bound, lower_bound);
+  db->write_cut_ = &cut_;
+  db->tracer_ = &tracer_;
+  return db;
+}
 DBImpl_Sharding::~DBImpl_Sharding() {
   for(auto iter : shards_pool){
 //    delete[] iter.first.data();
@@ -45,13 +104,12 @@ DBImpl_Sharding::~DBImpl_Sharding() {
 }
 Status DBImpl_Sharding::Put(const WriteOptions& options, const Slice& key,
                             const Slice& value) {
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
   DBImpl* db;
   if(Get_Target_Shard(db, key)){
-    WriteBatch batch;
-    batch.Put(key, value);
-    assert(key.compare(db->lower_bound) >= 0);
-    assert(key.compare(db->upper_bound) < 0);
-    return db->Write(options, &batch);
+    assert(router_.hashed() || key.compare(db->lower_bound) >= 0);
+    assert(router_.hashed() || key.compare(db->upper_bound) < 0);
+    return db->Put(options, key, value);
   }else{
     // forward to other shards
     assert(false);
@@ -60,11 +118,10 @@ Status DBImpl_Sharding::Put(const WriteOptions& options, const Slice& key,
 
 }
 Status DBImpl_Sharding::Delete(const WriteOptions& options, const Slice& key) {
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
   DBImpl* db;
   if(Get_Target_Shard(db, key)){
-    WriteBatch batch;
-    batch.Delete(key);
-    return db->Write(options, &batch);
+    return db->Delete(options, key);
   }else{
     // forward to other shards
     assert(false);
@@ -72,63 +129,1123 @@ Status DBImpl_Sharding::Delete(const WriteOptions& options, const Slice& key) {
   }
 
 }
+Status DBImpl_Sharding::Merge(const WriteOptions& options, const Slice& key,
+                              const Slice& value) {
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+  DBImpl* db;
+  if (Get_Target_Shard(db, key)) {
+    return db->Merge(options, key, value);
+  }
+  assert(false);
+  return Status::Corruption("Shard not found\n");
+}
+Status DBImpl_Sharding::DeleteRange(const WriteOptions& options,
+                                    const Slice& begin, const Slice& end) {
+  // Every shard deletes its part of the range, all within one epoch of the
+  // cut.
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+  CutScope cut(&cut_);
+  for (auto& iter : shards_pool) {
+    DBImpl* db = iter.second;
+    Slice lower = begin;
+    Slice upper = end;
+    if (!router_.hashed()) {
+      // The keys of the hashed shards are anywhere in the range.
+      lower = begin.compare(db->lower_bound) > 0 ? begin : db->lower_bound;
+      upper = end.compare(db->upper_bound) < 0 ? end : db->upper_bound;
+    }
+    if (lower.compare(upper) < 0) {
+      Status s = db->DeleteRange(options, lower, upper);
+      if (!s.ok()) {
+        return s;
+      }
+    }
+  }
+  return Status::OK();
+}
+namespace {
+// The entries of an input of IngestSorted() in the range of a shard. The
+// input is positioned with Seek() on the lower bound of the shard.
+class ShardRangeIterator : public Iterator {
+ public:
+  ShardRangeIterator(Iterator* input, const Slice& lower, const Slice& upper)
+      : input_(input), lower_(lower), upper_(upper) {}
+
+  bool Valid() const override {
+    return input_->Valid() &&
+           (upper_.empty() || input_->key().compare(upper_) < 0);
+  }
+  void SeekToFirst() override {
+    if (lower_.empty()) {
+      input_->SeekToFirst();
+    } else {
+      input_->Seek(lower_);
+    }
+  }
+  void SeekToLast() override { assert(false); }
+  void Seek(const Slice& target) override { input_->Seek(target); }
+  void Next() override { input_->Next(); }
+  void Prev() override { input_->Prev(); }
+  Slice key() const override { return input_->key(); }
+  Slice value() const override { return input_->value(); }
+  Status status() const override { return input_->status(); }
+
+ private:
+  Iterator* const input_;
+  const Slice lower_;
+  const Slice upper_;
+};
+
+// The entries of an input of IngestSorted() which "router" sends to "db".
+class ShardHashIterator : public Iterator {
+ public:
+  ShardHashIterator(Iterator* input, const ShardRouter* router, DBImpl* db)
+      : input_(input), router_(router), db_(db) {}
+
+  bool Valid() const override { return input_->Valid(); }
+  void SeekToFirst() override {
+    input_->SeekToFirst();
+    SkipOthers();
+  }
+  void SeekToLast() override { assert(false); }
+  void Seek(const Slice& target) override {
+    input_->Seek(target);
+    SkipOthers();
+  }
+  void Next() override {
+    input_->Next();
+    SkipOthers();
+  }
+  void Prev() override { assert(false); }
+  Slice key() const override { return input_->key(); }
+  Slice value() const override { return input_->value(); }
+  Status status() const override { return input_->status(); }
+
+ private:
+  void SkipOthers() {
+    while (input_->Valid() && router_->Find(input_->key()) != db_) {
+      input_->Next();
+    }
+  }
+
+  Iterator* const input_;
+  const ShardRouter* const router_;
+  DBImpl* const db_;
+};
+}  // namespace
+
+Status DBImpl_Sharding::IngestSorted(Iterator* input) {
+  // Every shard ingests its part of the input, as DeleteRange() does.
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+  CutScope cut(&cut_);
+  for (auto& iter : shards_pool) {
+    DBImpl* db = iter.second;
+    Status s;
+    if (router_.hashed()) {
+      // One pass over the input for every shard.
+      ShardHashIterator part(input, &router_, db);
+      part.SeekToFirst();
+      if (!part.Valid()) {
+        continue;
+      }
+      s = db->IngestSorted(&part);
+    } else {
+      ShardRangeIterator range(input, db->lower_bound, db->upper_bound);
+      range.SeekToFirst();
+      if (!range.Valid()) {
+        continue;
+      }
+      s = db->IngestSorted(&range);
+    }
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  return input->status();
+}
+namespace {
+// Split a batch into one sub-batch per target shard.
+class ShardBatchSplitter : public WriteBatch::Handler {
+ public:
+  explicit ShardBatchSplitter(const ShardRouter* router) : router_(router) {}
+  void Put(const Slice& key, const Slice& value) override {
+    WriteBatch* b = Target(key);
+    if (b != nullptr) b->Put(key, value);
+  }
+  void Delete(const Slice& key) override {
+    WriteBatch* b = Target(key);
+    if (b != nullptr) b->Delete(key);
+  }
+  void Merge(const Slice& key, const Slice& value) override {
+    WriteBatch* b = Target(key);
+    if (b != nullptr) b->Merge(key, value);
+  }
+  std::map<DBImpl*, WriteBatch> batches;
+  bool missing_shard = false;
+
+ private:
+  WriteBatch* Target(const Slice& key) {
+    DBImpl* db = router_->Find(key);
+    if (db == nullptr) {
+      missing_shard = true;
+      return nullptr;
+    }
+    return &batches[db];
+  }
+  const ShardRouter* const router_;
+};
+}  // namespace
+
 Status DBImpl_Sharding::Write(const WriteOptions& options,
                               WriteBatch* updates) {
-  DBImpl* db = nullptr;
-//  assert(false);
-  //TODO: cross shard batch should be atomic.
-  Slice first_key = updates->ParseFirst();
-  assert(first_key.size() >0);
-  if(Get_Target_Shard(db, first_key)){
-    return db->Write(options, updates);
-  }else{
+  if (options_.replica_owner_node_id != 0) {
+    return Status::NotSupported("Write on a read replica");
+  }
+  // A snapshot sees all of the batch or none, see GetSnapshot().
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+  ShardBatchSplitter splitter(&router_);
+  Status s = updates->Iterate(&splitter);
+  if (!s.ok()) {
+    return s;
+  }
+  if (splitter.missing_shard) {
     assert(false);
     return Status::Corruption("Shard not found\n");
   }
-
+  if (splitter.batches.size() == 1) {
+    // The common case, hand the caller's batch over untouched.
+    return splitter.batches.begin()->first->Write(options, updates);
+  }
+  // Two phases: every shard takes the sequences of its part and logs it,
+  // then the parts go into the memtables if all were prepared, or are
+  // dropped from all of them. The parts bypass the group commit of the
+  // shards, the other writes of a shard do not wait for them.
+  // The sequences of all the parts are taken within one epoch of the cut.
+  std::vector<std::pair<DBImpl*, DBImpl::PreparedWrite>> prepared;
+  prepared.reserve(splitter.batches.size());
+  const uint64_t epoch = cut_.Enter();
+  for (auto& iter : splitter.batches) {
+    prepared.emplace_back(iter.first, DBImpl::PreparedWrite());
+    prepared.back().second.in_cut = true;
+    s = iter.first->PrepareWrite(&iter.second, true, &prepared.back().second);
+    if (!s.ok()) {
+      break;
+    }
+  }
+  cut_.Reserved();
+  const bool commit = s.ok();
+  for (auto& iter : prepared) {
+    Status commit_status = iter.first->CommitWrite(
+        &iter.second, commit, options.memtable_insert_hint);
+    if (s.ok()) {
+      s = commit_status;
+    }
+  }
+  cut_.Exit(epoch);
+  return s;
 }
 Status DBImpl_Sharding::Get(const ReadOptions& options, const Slice& key,
                             std::string* value) {
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
   DBImpl* db;
   if(Get_Target_Shard(db, key)){
-    return db->Get(options, key, value);
+    return db->Get(ShardReadOptions(options, db), key, value);
   }else{
     assert(false);
     return Status::Corruption("Shard not found\n");
   }
 
 }
-Iterator* DBImpl_Sharding::NewIterator(const ReadOptions& options) {
-  //TODO: support cross shard iterator.
-  DBImpl* db = shards_pool.begin()->second;
+Status DBImpl_Sharding::GetLarge(const ReadOptions& options, const Slice& key,
+                                 const ValueCallback& callback) {
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+  DBImpl* db;
+  if (Get_Target_Shard(db, key)) {
+    return db->GetLarge(ShardReadOptions(options, db), key, callback);
+  }
+  assert(false);
+  return Status::Corruption("Shard not found\n");
+}
+std::vector<Status> DBImpl_Sharding::MultiGet(
+    const ReadOptions& options, const std::vector<Slice>& keys,
+    std::vector<std::string>* values) {
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+  std::vector<Status> statuses(keys.size());
+  values->resize(keys.size());
+  // Group the keys by shard so that every shard batches its own reads.
+  std::map<DBImpl*, std::vector<size_t>> shard_keys;
+  for (size_t i = 0; i < keys.size(); i++) {
+    DBImpl* db;
+    if (Get_Target_Shard(db, keys[i])) {
+      shard_keys[db].push_back(i);
+    } else {
+      assert(false);
+      statuses[i] = Status::Corruption("Shard not found\n");
+    }
+  }
+  for (auto& iter : shard_keys) {
+    std::vector<Slice> sub_keys;
+    sub_keys.reserve(iter.second.size());
+    for (size_t i : iter.second) {
+      sub_keys.push_back(keys[i]);
+    }
+    std::vector<std::string> sub_values;
+    std::vector<Status> sub_statuses =
+        iter.first->MultiGet(ShardReadOptions(options, iter.first), sub_keys,
+                             &sub_values);
+    for (size_t j = 0; j < iter.second.size(); j++) {
+      statuses[iter.second[j]] = sub_statuses[j];
+      (*values)[iter.second[j]].swap(sub_values[j]);
+    }
+  }
+  return statuses;
+}
+void DBImpl_Sharding::Prefetch(const ReadOptions& options,
+                               const std::vector<Slice>& keys) {
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+  std::map<DBImpl*, std::vector<Slice>> shard_keys;
+  for (const Slice& key : keys) {
+    DBImpl* db;
+    if (Get_Target_Shard(db, key)) {
+      shard_keys[db].push_back(key);
+    }
+  }
+  // The shards read the hints at their latest state, the snapshot is not
+  // translated.
+  for (auto& iter : shard_keys) {
+    iter.first->Prefetch(options, iter.second);
+  }
+}
+void DBImpl_Sharding::Prefetch(const ReadOptions& options,
+                               const Range& range) {
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+  if (router_.hashed()) {
+    for (auto& iter : shards_pool) {
+      iter.second->Prefetch(options, range);
+    }
+    return;
+  }
+  const Comparator* ucmp = shards_pool.begin()->second->user_comparator();
+  for (auto iter = shards_pool.upper_bound(range.start);
+       iter != shards_pool.end(); ++iter) {
+    DBImpl* db = iter->second;
+    if (!range.limit.empty() && !db->lower_bound.empty() &&
+        ucmp->Compare(db->lower_bound, range.limit) >= 0) {
+      break;
+    }
+    Slice start = range.start;
+    if (ucmp->Compare(db->lower_bound, start) > 0) {
+      start = db->lower_bound;
+    }
+    Slice limit = range.limit;
+    if (limit.empty() || ucmp->Compare(db->upper_bound, limit) < 0) {
+      limit = db->upper_bound;
+    }
+    db->Prefetch(options, Range(start, limit));
+  }
+}
+namespace {
+// The iterators of the shards one after another. Once the iterator of a
+// shard has been stepped kPrefetchSteps times the one of the next shard is
+// opened and positioned on a thread of its own, so that a long scan does not
+// wait at the border of the shards. The SEQ iterators are not opened ahead,
+// their reads in flight are bound to the queue pair of the thread issuing
+// them.
+class ShardedIterator : public Iterator {
+ public:
+  struct Shard {
+    DBImpl* db;
+    ReadOptions options;
+  };
 
-  return db->NewIterator(options);
+  // "shards" in key order. "snapshot", if not nullptr, was taken for the
+  // iterator and is released to "owner" once the iterator is deleted.
+  ShardedIterator(DB* owner, const Snapshot* snapshot,
+                  std::vector<Shard> shards, const Comparator* ucmp, bool seq)
+      : owner_(owner),
+        snapshot_(snapshot),
+        shards_(std::move(shards)),
+        ucmp_(ucmp),
+        seq_(seq),
+        current_(0),
+        steps_(0),
+        prefetched_(nullptr) {}
+
+  ShardedIterator(const ShardedIterator&) = delete;
+  ShardedIterator& operator=(const ShardedIterator&) = delete;
+
+  ~ShardedIterator() override {
+    DropPrefetch();
+    iter_.reset();
+    if (snapshot_ != nullptr) {
+      owner_->ReleaseSnapshot(snapshot_);
+    }
+  }
+
+  bool Valid() const override { return iter_ != nullptr && iter_->Valid(); }
+  void SeekToFirst() override {
+    if (shards_.empty()) {
+      return;
+    }
+    Open(0);
+    iter_->SeekToFirst();
+    ForwardToValid();
+  }
+  void SeekToLast() override {
+    if (shards_.empty()) {
+      return;
+    }
+    Open(shards_.size() - 1);
+    iter_->SeekToLast();
+    BackwardToValid();
+  }
+  void Seek(const Slice& target) override {
+    // The first shard whose upper bound is past "target".
+    size_t i = 0;
+    while (i < shards_.size() &&
+           ucmp_->Compare(shards_[i].db->upper_bound, target) <= 0) {
+      i++;
+    }
+    if (i == shards_.size()) {
+      DropPrefetch();
+      iter_.reset();
+      return;
+    }
+    Open(i);
+    iter_->Seek(target);
+    ForwardToValid();
+  }
+  void Next() override {
+    assert(Valid());
+    iter_->Next();
+    if (++steps_ == kPrefetchSteps) {
+      StartPrefetch();
+    }
+    ForwardToValid();
+  }
+  void Prev() override {
+    assert(Valid());
+    iter_->Prev();
+    BackwardToValid();
+  }
+  Slice key() const override { return iter_->key(); }
+  Slice value() const override { return iter_->value(); }
+  Status status() const override {
+    return iter_ != nullptr ? iter_->status() : Status::OK();
+  }
+
+ private:
+  static const size_t kPrefetchSteps = 256;
+
+  Iterator* NewShardIterator(size_t i) const {
+#ifdef BYTEADDRESSABLE
+    if (seq_) {
+      return shards_[i].db->NewSEQIterator(shards_[i].options);
+    }
+#endif
+    return shards_[i].db->NewIterator(shards_[i].options);
+  }
+  // Make the iterator of shard "i" the current one, it is left unpositioned
+  // unless it was the current one already.
+  void Open(size_t i) {
+    if (iter_ == nullptr || current_ != i) {
+      DropPrefetch();
+      iter_.reset(NewShardIterator(i));
+      current_ = i;
+    }
+    steps_ = 0;
+  }
+  // Move on to the first entry of the following shards while the current
+  // one is exhausted.
+  void ForwardToValid() {
+    while (!iter_->Valid() && iter_->status().ok() &&
+           current_ + 1 < shards_.size()) {
+      if (prefetch_.joinable()) {
+        // Opened ahead for current_ + 1 and positioned on its first entry.
+        prefetch_.join();
+        iter_.reset(prefetched_);
+        prefetched_ = nullptr;
+        current_++;
+        steps_ = 0;
+      } else {
+        Open(current_ + 1);
+        iter_->SeekToFirst();
+      }
+    }
+  }
+  void BackwardToValid() {
+    while (!iter_->Valid() && iter_->status().ok() && current_ > 0) {
+      Open(current_ - 1);
+      iter_->SeekToLast();
+    }
+  }
+  void StartPrefetch() {
+    if (seq_ || prefetch_.joinable() || current_ + 1 >= shards_.size()) {
+      return;
+    }
+    const size_t next = current_ + 1;
+    prefetch_ = std::thread([this, next]() {
+      Iterator* iter = NewShardIterator(next);
+      iter->SeekToFirst();
+      prefetched_ = iter;
+    });
+  }
+  void DropPrefetch() {
+    if (prefetch_.joinable()) {
+      prefetch_.join();
+      delete prefetched_;
+      prefetched_ = nullptr;
+    }
+  }
+
+  DB* const owner_;
+  const Snapshot* const snapshot_;
+  const std::vector<Shard> shards_;
+  const Comparator* const ucmp_;
+  const bool seq_;
+  size_t current_;
+  // Steps of Next() through the current shard.
+  size_t steps_;
+  std::unique_ptr<Iterator> iter_;
+  // Opens the iterator of shard current_ + 1 into prefetched_.
+  std::thread prefetch_;
+  Iterator* prefetched_;
+};
+
+// The cleanup of the merged iterators of the hashed shards.
+void ReleaseIteratorSnapshot(void* db, void* snapshot) {
+  static_cast<DB*>(db)->ReleaseSnapshot(static_cast<const Snapshot*>(snapshot));
+}
+}  // namespace
+
+Iterator* DBImpl_Sharding::NewIterator(const ReadOptions& options) {
+  Iterator* iter = NewShardedIterator(options, false);
+  if (tracer_.active()) {
+    iter = NewTracingIterator(iter, &tracer_);
+  }
+  return iter;
+}
+Iterator* DBImpl_Sharding::NewShardedIterator(const ReadOptions& options,
+                                              bool seq) {
+  const Comparator* ucmp = shards_pool.begin()->second->user_comparator();
+  ReadOptions read_options = options;
+  const Snapshot* snapshot = nullptr;
+  if (read_options.snapshot == nullptr) {
+    snapshot = GetSnapshot();
+    read_options.snapshot = snapshot;
+  }
+  // The shards do not change while the snapshot is alive.
+  if (router_.hashed()) {
+    // Every key is in one shard only, the merge finds no duplicates.
+    std::vector<Iterator*> children;
+    for (auto& iter : shards_pool) {
+      DBImpl* db = iter.second;
+      const ReadOptions shard_options = ShardReadOptions(read_options, db);
+#ifdef BYTEADDRESSABLE
+      if (seq) {
+        children.push_back(db->NewSEQIterator(shard_options));
+        continue;
+      }
+#endif
+      children.push_back(db->NewIterator(shard_options));
+    }
+    Iterator* merged = NewMergingIterator(ucmp, children.data(),
+                                          static_cast<int>(children.size()));
+    if (snapshot != nullptr) {
+      merged->RegisterCleanup(&ReleaseIteratorSnapshot, this,
+                              const_cast<Snapshot*>(snapshot));
+    }
+    return merged;
+  }
+  std::vector<ShardedIterator::Shard> shards;
+  // The shards are sorted by their upper bound, only the ones overlapping
+  // [iterate_lower_bound, iterate_upper_bound) are read.
+  for (auto& iter : shards_pool) {
+    DBImpl* db = iter.second;
+    if (options.iterate_lower_bound != nullptr &&
+        ucmp->Compare(db->upper_bound, *options.iterate_lower_bound) <= 0) {
+      continue;
+    }
+    if (options.iterate_upper_bound != nullptr &&
+        ucmp->Compare(db->lower_bound, *options.iterate_upper_bound) >= 0) {
+      break;
+    }
+    shards.push_back({db, ShardReadOptions(read_options, db)});
+  }
+  return new ShardedIterator(this, snapshot, std::move(shards), ucmp, seq);
+}
+Status DBImpl_Sharding::ParallelScan(const ReadOptions& options,
+                                     const Range& range, int num_partitions,
+                                     bool ordered,
+                                     const ScanCallback& callback) {
+  if (router_.hashed() && ordered) {
+    return Status::NotSupported("ordered scan of hashed shards");
+  }
+  ReadOptions scan_options = options;
+  const Snapshot* snapshot = nullptr;
+  if (scan_options.snapshot == nullptr) {
+    snapshot = GetSnapshot();
+    scan_options.snapshot = snapshot;
+  }
+  // The shards do not change while the snapshot is alive.
+  const Comparator* ucmp = shards_pool.begin()->second->user_comparator();
+  std::vector<DBImpl*> shards;
+  // The shards are sorted by their upper bound, all the hashed ones hold
+  // keys of the range.
+  for (auto iter = router_.hashed() ? shards_pool.begin()
+                                    : shards_pool.upper_bound(range.start);
+       iter != shards_pool.end(); ++iter) {
+    DBImpl* db = iter->second;
+    if (!router_.hashed() && !range.limit.empty() &&
+        !db->lower_bound.empty() &&
+        ucmp->Compare(db->lower_bound, range.limit) >= 0) {
+      break;
+    }
+    shards.push_back(db);
+  }
+  if (shards.empty()) {
+    ReleaseSnapshot(snapshot);
+    return Status::OK();
+  }
+  const int per_shard =
+      std::max(1, (num_partitions + static_cast<int>(shards.size()) - 1) /
+                      static_cast<int>(shards.size()));
+  std::vector<ScanPartition> partitions;
+  for (DBImpl* db : shards) {
+    const ReadOptions shard_options = ShardReadOptions(scan_options, db);
+    // The part of the range within [lower bound, upper bound) of the shard.
+    Slice start = range.start;
+    Slice limit = range.limit;
+    if (!router_.hashed()) {
+      if (ucmp->Compare(db->lower_bound, start) > 0) {
+        start = db->lower_bound;
+      }
+      if (limit.empty() || ucmp->Compare(db->upper_bound, limit) < 0) {
+        limit = db->upper_bound;
+      }
+    }
+    db->AddScanPartitions(shard_options, Range(start, limit), per_shard,
+                          &partitions);
+  }
+  Status s = RunParallelScan(partitions, ordered, callback);
+  ReleaseSnapshot(snapshot);
+  return s;
+}
+Status DBImpl_Sharding::FilteredScan(const ReadOptions& options,
+                                     const Range& range,
+                                     const std::string& filter_name,
+                                     const ScanCallback& callback) {
+  if (router_.hashed()) {
+    // The entries of the shards would have to be merged into key order.
+    return Status::NotSupported("filtered scan of hashed shards");
+  }
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+  const Comparator* ucmp = shards_pool.begin()->second->user_comparator();
+  bool stopped = false;
+  auto shard_callback = [&](const Slice& key, const Slice& value) {
+    stopped = !callback(key, value);
+    return !stopped;
+  };
+  Status s;
+  for (auto iter = shards_pool.upper_bound(range.start);
+       s.ok() && !stopped && iter != shards_pool.end(); ++iter) {
+    DBImpl* db = iter->second;
+    if (!range.limit.empty() && !db->lower_bound.empty() &&
+        ucmp->Compare(db->lower_bound, range.limit) >= 0) {
+      break;
+    }
+    Slice start = range.start;
+    if (ucmp->Compare(db->lower_bound, start) > 0) {
+      start = db->lower_bound;
+    }
+    Slice limit = range.limit;
+    if (limit.empty() || ucmp->Compare(db->upper_bound, limit) < 0) {
+      limit = db->upper_bound;
+    }
+    s = db->FilteredScan(ShardReadOptions(options, db), Range(start, limit),
+                         filter_name, shard_callback);
+  }
+  return s;
 }
 #ifdef BYTEADDRESSABLE
 Iterator* DBImpl_Sharding::NewSEQIterator(const ReadOptions& options) {
-  DBImpl* db = shards_pool.begin()->second;
-
-  return db->NewSEQIterator(options);
+  return NewShardedIterator(options, true);
 }
 #endif
 const Snapshot* DBImpl_Sharding::GetSnapshot() {
-  //TODO: This is vital for the cross shard transaction.
-  return nullptr;
+  // The shards do not change meanwhile. The snapshots are taken while no
+  // write is taking its sequences, and are returned once the writes whose
+  // sequences are before them are done.
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+  auto* snapshot = new ShardedSnapshot;
+  cut_.Cut([&]() {
+    for (auto& iter : shards_pool) {
+      snapshot->snapshots[iter.second] = iter.second->GetSnapshot();
+    }
+  });
+  live_snapshots_.fetch_add(1);
+  return snapshot;
+}
+void DBImpl_Sharding::ReleaseSnapshot(const Snapshot* snapshot) {
+  if (snapshot == nullptr) {
+    return;
+  }
+  auto* sharded = static_cast<const ShardedSnapshot*>(snapshot);
+  for (auto& iter : sharded->snapshots) {
+    iter.first->ReleaseSnapshot(iter.second);
+  }
+  delete sharded;
+  live_snapshots_.fetch_sub(1);
+}
+ReadOptions DBImpl_Sharding::ShardReadOptions(const ReadOptions& options,
+                                              DBImpl* db) const {
+  ReadOptions result = options;
+  if (options.snapshot != nullptr) {
+    auto* sharded = static_cast<const ShardedSnapshot*>(options.snapshot);
+    auto iter = sharded->snapshots.find(db);
+    assert(iter != sharded->snapshots.end());
+    result.snapshot = iter->second;
+  }
+  return result;
 }
-void DBImpl_Sharding::ReleaseSnapshot(const Snapshot* snapshot) {}
 bool DBImpl_Sharding::GetProperty(const Slice& property, std::string* value) {
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+  // The shards share the RDMA manager, and so the remote memory and the
+  // transport statistics, and the memory budget.
+  if ((property == Slice("dLSM.remote-memory") ||
+       property == Slice("dLSM.rdma") ||
+       property == Slice("dLSM.memory-budget")) &&
+      !shards_pool.empty()) {
+    return shards_pool.begin()->second->GetProperty(property, value);
+  }
+  if (property == Slice("dLSM.write-latency")) {
+    // The latencies of all the shards together.
+    Histogram histograms[WriteLatencySlot::kNumPhases];
+    for (Histogram& histogram : histograms) {
+      histogram.Clear();
+    }
+    for (auto& shard : shards_pool) {
+      shard.second->MergeWriteLatency(histograms);
+    }
+    *value = DBImpl::WriteLatencyString(histograms);
+    return true;
+  }
+  if (property == Slice("dLSM.stats")) {
+    std::map<std::string, uint64_t> stats;
+    for (auto& shard : shards_pool) {
+      shard.second->AddStats(&stats);
+    }
+    DBImpl::AddProcessStats(&stats);
+    *value = DBImpl::StatsString(stats);
+    return true;
+  }
+  if (property == Slice("dLSM.shard-quota") ||
+      property == Slice("dLSM.compaction-debt")) {
+    for (auto& shard : shards_pool) {
+      char buf[32];
+      std::snprintf(buf, sizeof(buf), "shard %u: ",
+                    static_cast<unsigned>(shard.second->shard_id));
+      value->append(buf);
+      // The shard clears the value it is given.
+      std::string shard_value;
+      shard.second->GetProperty(property, &shard_value);
+      value->append(shard_value);
+    }
+    return true;
+  }
   //Not implemented.
   return false;
 }
+bool DBImpl_Sharding::GetMapProperty(const Slice& property,
+                                     std::map<std::string, uint64_t>* value) {
+  value->clear();
+  if (property == Slice("dLSM.stats")) {
+    // The shards share the caches and the tables, which count once.
+    std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+    for (auto& shard : shards_pool) {
+      shard.second->AddStats(value);
+    }
+    DBImpl::AddProcessStats(value);
+    return true;
+  }
+  if (property == Slice("dLSM.compaction-debt")) {
+    std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+    for (auto& shard : shards_pool) {
+      shard.second->AddCompactionDebt(
+          "shard" + std::to_string(shard.second->shard_id) + ".", value);
+    }
+    return true;
+  }
+  return false;
+}
+Status DBImpl_Sharding::StartTrace(const std::string& path) {
+  return tracer_.Start(path);
+}
+Status DBImpl_Sharding::EndTrace() { return tracer_.End(); }
+// A shard holds none of the keys of the others, the estimates of the
+// shards add up.
 void DBImpl_Sharding::GetApproximateSizes(const Range* range, int n,
                                           uint64_t* sizes) {
-  //Not implemented
+  std::vector<uint64_t> shard_sizes(n);
+  std::fill(sizes, sizes + n, 0);
+  for (auto& iter : shards_pool) {
+    iter.second->GetApproximateSizes(range, n, shard_sizes.data());
+    for (int i = 0; i < n; i++) {
+      sizes[i] += shard_sizes[i];
+    }
+  }
+}
+void DBImpl_Sharding::GetApproximateCounts(const Range* range, int n,
+                                           uint64_t* entries,
+                                           uint64_t* raw_sizes) {
+  std::vector<uint64_t> shard_entries(n);
+  std::vector<uint64_t> shard_raw_sizes(n);
+  std::fill(entries, entries + n, 0);
+  if (raw_sizes != nullptr) {
+    std::fill(raw_sizes, raw_sizes + n, 0);
+  }
+  for (auto& iter : shards_pool) {
+    iter.second->GetApproximateCounts(range, n, shard_entries.data(),
+                                      shard_raw_sizes.data());
+    for (int i = 0; i < n; i++) {
+      entries[i] += shard_entries[i];
+      if (raw_sizes != nullptr) {
+        raw_sizes[i] += shard_raw_sizes[i];
+      }
+    }
+  }
 }
 void DBImpl_Sharding::CompactRange(const Slice* begin, const Slice* end) {
   //Not implemented
   assert(false);
 }
+bool DBImpl_Sharding::NewShardId(uint8_t target_memory_id, uint8_t* shard_id) {
+  // The memory node of a shard follows from its id, see
+  // DBImpl::WaitForComputeMessageHandlingThread().
+  const int memory_node_num = Env::Default()->rdma_mg->memory_nodes.size();
+  for (int id = target_memory_id / 2; id < 256; id += memory_node_num) {
+    if (shard_ids_.count(id) == 0) {
+      shard_ids_.insert(id);
+      *shard_id = id;
+      return true;
+    }
+  }
+  return false;
+}
+Status DBImpl_Sharding::CheckNoSnapshots() const {
+  if (live_snapshots_.load() != 0) {
+    return Status::InvalidArgument(
+        "the shards can not change while snapshots or iterators are alive");
+  }
+  return Status::OK();
+}
+Status DBImpl_Sharding::SplitShard(const Slice& key) {
+#ifdef WITHPERSISTENCE
+  // The memory nodes persist the tables of every shard apart.
+  return Status::NotSupported("shard split with WITHPERSISTENCE");
+#else
+  if (options_.replica_owner_node_id != 0) {
+    return Status::NotSupported("shard split on a read replica");
+  }
+  if (router_.hashed()) {
+    // The tables are split by their keys, not by their hashes.
+    return Status::NotSupported("split of hashed shards");
+  }
+  std::unique_lock<std::mutex> reshard_lck(reshard_mtx_);
+  DBImpl* db;
+  {
+    std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+    if (!Get_Target_Shard(db, key)) {
+      return Status::InvalidArgument("no shard holds the split key");
+    }
+    if (key.compare(db->lower_bound) <= 0) {
+      return Status::InvalidArgument("the split key is the lower bound of "
+                                     "its shard");
+    }
+    Status s = CheckNoSnapshots();
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  uint8_t shard_id;
+  if (!NewShardId(db->shard_target_node_id, &shard_id)) {
+    return Status::NotSupported("no shard id left for the memory node");
+  }
+  // The new shard is set up, and most of the memtables of the shard are
+  // flushed, while the reads and writes go on.
+  auto* new_db = NewShard(db->upper_bound, key.ToString());
+  new_db->WaitForComputeMessageHandlingThread(db->shard_target_node_id,
+                                              shard_id);
+  Status s = new_db->OpenShard();
+  if (!s.ok()) {
+    delete new_db;
+    return s;
+  }
+  db->WaitforAllbgtasks(true);
+  std::unique_lock<std::shared_mutex> lck(snapshot_mtx_);
+  s = CheckNoSnapshots();
+  if (s.ok()) {
+    db->WaitforAllbgtasks(true);
+    s = db->MoveTablesFrom(key, new_db);
+  }
+  if (s.ok()) {
+    // The entries moved are older than the writes to come.
+    new_db->AdvanceSequence(db->versions_->LastSequence());
+    shards_pool.erase(Slice(db->upper_bound));
+    db->upper_bound = key.ToString();
+    shards_pool.insert({Slice(db->upper_bound), db});
+    shards_pool.insert({Slice(new_db->upper_bound), new_db});
+    router_.Build(shards_pool);
+  }
+  lck.unlock();
+  if (!s.ok()) {
+    delete new_db;
+  }
+  return s;
+#endif
+}
+Status DBImpl_Sharding::MergeShards(const Slice& key) {
+#ifdef WITHPERSISTENCE
+  return Status::NotSupported("shard merge with WITHPERSISTENCE");
+#else
+  if (options_.replica_owner_node_id != 0) {
+    return Status::NotSupported("shard merge on a read replica");
+  }
+  if (router_.hashed()) {
+    return Status::NotSupported("merge of hashed shards");
+  }
+  std::unique_lock<std::mutex> reshard_lck(reshard_mtx_);
+  DBImpl* db;
+  DBImpl* next;
+  {
+    std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+    auto iter = shards_pool.upper_bound(key);
+    if (iter == shards_pool.end()) {
+      return Status::InvalidArgument("no shard holds the key");
+    }
+    db = iter->second;
+    if (++iter == shards_pool.end()) {
+      return Status::InvalidArgument("the shard is the last one");
+    }
+    next = iter->second;
+    // The compactions read the tables from the memory node of the shard.
+    if (db->shard_target_node_id != next->shard_target_node_id) {
+      return Status::NotSupported("the shards are on different memory nodes");
+    }
+    Status s = CheckNoSnapshots();
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  db->WaitforAllbgtasks(true);
+  next->WaitforAllbgtasks(true);
+  std::unique_lock<std::shared_mutex> lck(snapshot_mtx_);
+  Status s = CheckNoSnapshots();
+  if (s.ok()) {
+    db->WaitforAllbgtasks(true);
+    next->WaitforAllbgtasks(true);
+    s = db->TakeOverTables(next);
+  }
+  if (s.ok()) {
+    // The sequences of the shards are apart, the writes to come are newer
+    // than the entries of both.
+    db->AdvanceSequence(next->versions_->LastSequence());
+    shards_pool.erase(Slice(db->upper_bound));
+    shards_pool.erase(Slice(next->upper_bound));
+    db->upper_bound = next->upper_bound;
+    shards_pool.insert({Slice(db->upper_bound), db});
+    router_.Build(shards_pool);
+  }
+  lck.unlock();
+  if (s.ok()) {
+    // Nothing reads it any more, its shard id is not given out again.
+    delete next;
+  }
+  return s;
+#endif
+}
+Status DBImpl_Sharding::MigrateShard(const Slice& key,
+                                     uint8_t target_memory_id) {
+  std::unique_lock<std::mutex> reshard_lck(reshard_mtx_);
+  DBImpl* db;
+  {
+    std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+    if (!Get_Target_Shard(db, key)) {
+      return Status::InvalidArgument("no shard holds the key");
+    }
+  }
+  return MigrateShardLocked(db, target_memory_id);
+}
+Status DBImpl_Sharding::MigrateShardLocked(DBImpl* db,
+                                           uint8_t target_memory_id) {
+#ifdef WITHPERSISTENCE
+  return Status::NotSupported("shard migration with WITHPERSISTENCE");
+#else
+  if (options_.replica_owner_node_id != 0) {
+    return Status::NotSupported("shard migration on a read replica");
+  }
+  if (Env::Default()->rdma_mg->memory_nodes.count(target_memory_id) == 0) {
+    return Status::InvalidArgument("no such memory node");
+  }
+  if (db->shard_target_node_id == target_memory_id) {
+    return Status::OK();
+  }
+  {
+    std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+    Status s = CheckNoSnapshots();
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  uint8_t shard_id;
+  if (!NewShardId(target_memory_id, &shard_id)) {
+    return Status::NotSupported("no shard id left for the memory node");
+  }
+  auto* new_db = NewShard(db->upper_bound, db->lower_bound);
+  new_db->WaitForComputeMessageHandlingThread(target_memory_id, shard_id);
+  Status s = new_db->OpenShard();
+  std::map<std::shared_ptr<RemoteMemTableMetaData>,
+           std::shared_ptr<RemoteMemTableMetaData>>
+      copies;
+  if (s.ok()) {
+    db->WaitforAllbgtasks(true);
+    s = db->CopyTablesTo(new_db, false, &copies);
+  }
+  if (!s.ok()) {
+    delete new_db;
+    return s;
+  }
+  std::unique_lock<std::shared_mutex> lck(snapshot_mtx_);
+  s = CheckNoSnapshots();
+  if (s.ok()) {
+    db->WaitforAllbgtasks(true);
+    s = db->CopyTablesTo(new_db, true, &copies);
+  }
+  if (s.ok()) {
+    new_db->AdvanceSequence(db->versions_->LastSequence());
+    shards_pool.erase(Slice(db->upper_bound));
+    shards_pool.insert({Slice(new_db->upper_bound), new_db});
+    router_.Build(shards_pool);
+  }
+  lck.unlock();
+  copies.clear();
+  if (s.ok()) {
+    // Its tables are freed on the memory node it leaves.
+    balanced_sequences_.erase(db);
+    delete db;
+  } else {
+    delete new_db;
+  }
+  return s;
+#endif
+}
+Status DBImpl_Sharding::SetShardQuota(const Slice& key,
+                                       const ShardQuota& quota) {
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+  DBImpl* db;
+  if (!Get_Target_Shard(db, key)) {
+    return Status::InvalidArgument("no shard holds the key");
+  }
+  return db->SetQuota(quota);
+}
+Status DBImpl_Sharding::BalanceShards() {
+  if (options_.replica_owner_node_id != 0) {
+    return Status::NotSupported("shard balancing on a read replica");
+  }
+  std::unique_lock<std::mutex> reshard_lck(reshard_mtx_);
+  struct ShardLoad {
+    DBImpl* db;
+    double writes;
+    double bytes;
+  };
+  std::vector<ShardLoad> shard_loads;
+  std::map<uint8_t, double> compactions;
+  double total_writes = 0;
+  double total_bytes = 0;
+  double total_compactions = 0;
+  for (auto& node : Env::Default()->rdma_mg->memory_nodes) {
+    compactions[node.first] = 0;
+  }
+  {
+    std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
+    for (auto& iter : shards_pool) {
+      DBImpl* db = iter.second;
+      const SequenceNumber last = db->versions_->LastSequence();
+      SequenceNumber& balanced = balanced_sequences_[db];
+      ShardLoad load = {db, static_cast<double>(last - balanced), 0};
+      balanced = last;
+      for (int level = 0; level < config::kNumLevels; level++) {
+        load.bytes += db->versions_->NumLevelBytes(level);
+      }
+      total_writes += load.writes;
+      total_bytes += load.bytes;
+      shard_loads.push_back(load);
+      // Every shard on a memory node hears of the same compactions.
+      double& reported = compactions[db->shard_target_node_id];
+      reported = std::max<double>(reported,
+                                  db->memory_node_compaction_load_.load());
+    }
+  }
+  for (auto& node : compactions) {
+    total_compactions += node.second;
+  }
+  // The shares of a shard, its memory node's compactions split by writes.
+  std::map<uint8_t, double> node_loads;
+  std::map<uint8_t, double> node_writes;
+  for (auto& node : compactions) {
+    node_loads[node.first] =
+        total_compactions == 0 ? 0 : node.second / total_compactions;
+  }
+  for (const ShardLoad& load : shard_loads) {
+    node_writes[load.db->shard_target_node_id] += load.writes;
+  }
+  std::map<DBImpl*, double> shard_shares;
+  for (const ShardLoad& load : shard_loads) {
+    const uint8_t node = load.db->shard_target_node_id;
+    double share = (total_writes == 0 ? 0 : load.writes / total_writes) +
+                   (total_bytes == 0 ? 0 : load.bytes / total_bytes);
+    if (node_writes[node] != 0) {
+      share += node_loads[node] * load.writes / node_writes[node];
+    }
+    shard_shares[load.db] = share / 3;
+  }
+  for (auto& node : node_loads) {
+    node.second /= 3;
+  }
+  for (const ShardLoad& load : shard_loads) {
+    node_loads[load.db->shard_target_node_id] += shard_shares[load.db];
+  }
+  auto most = node_loads.begin();
+  auto least = node_loads.begin();
+  for (auto iter = node_loads.begin(); iter != node_loads.end(); ++iter) {
+    if (iter->second > most->second) most = iter;
+    if (iter->second < least->second) least = iter;
+  }
+  const double gap = most->second - least->second;
+  if (gap < kBalanceThreshold) {
+    return Status::OK();
+  }
+  // Moving a shard of load m leaves a gap of |gap - 2m|, the smallest one
+  // is picked if it is smaller than the gap.
+  DBImpl* best = nullptr;
+  double best_gap = gap;
+  for (const ShardLoad& load : shard_loads) {
+    if (load.db->shard_target_node_id != most->first) {
+      continue;
+    }
+    const double new_gap = std::abs(gap - 2 * shard_shares[load.db]);
+    if (new_gap < best_gap) {
+      best = load.db;
+      best_gap = new_gap;
+    }
+  }
+  if (best == nullptr) {
+    return Status::OK();
+  }
+  return MigrateShardLocked(best, least->first);
+}
 void DBImpl_Sharding::WaitforAllbgtasks(bool clear_mem) {
+  std::shared_lock<std::shared_mutex> lck(snapshot_mtx_);
   for(auto iter : shards_pool){
     iter.second->WaitforAllbgtasks(clear_mem);
   }
@@ -4,7 +4,15 @@
 
 #ifndef dLSM_DB_IMPL_SHARDING_H
 #define dLSM_DB_IMPL_SHARDING_H
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+
 #include "db_impl.h"
+#include "db/shard_router.h"
+#include "db/trace.h"
+#include "db/write_cut.h"
 namespace dLSM {
 //shard info: [lower bound, upper bound)
 class DBImpl_Sharding : public DB {
@@ -21,42 +29,143 @@ class DBImpl_Sharding : public DB {
   Status Put(const WriteOptions& options, const Slice& key,
              const Slice& value) override;
   Status Delete(const WriteOptions& options, const Slice& key) override;
+  Status Merge(const WriteOptions& options, const Slice& key,
+               const Slice& value) override;
+  Status DeleteRange(const WriteOptions& options, const Slice& begin,
+                     const Slice& end) override;
+  // The input is split over the shards with Seek().
+  Status IngestSorted(Iterator* input) override;
+  // A batch of several shards is in all of them or, if any of them fails to
+  // log its part, in none. A crash may still leave the parts logged before
+  // the failure to be recovered.
   Status Write(const WriteOptions& options, WriteBatch* updates) override;
+  using DB::Get;
   Status Get(const ReadOptions& options, const Slice& key,
              std::string* value) override;
+  Status GetLarge(const ReadOptions& options, const Slice& key,
+                  const ValueCallback& callback) override;
+  std::vector<Status> MultiGet(const ReadOptions& options,
+                               const std::vector<Slice>& keys,
+                               std::vector<std::string>* values) override;
+  // The keys go to their shards, the range to the shards it overlaps, or to
+  // all of them if they are hashed.
+  void Prefetch(const ReadOptions& options,
+                const std::vector<Slice>& keys) override;
+  void Prefetch(const ReadOptions& options, const Range& range) override;
+  // The shards one after another in key order, or merged if they are hashed,
+  // every one read at its snapshot of options.snapshot, or of a snapshot
+  // taken for the iterator.
   Iterator* NewIterator(const ReadOptions& options) override;
+  // The range is split over the shards it overlaps first, all the shards
+  // read at one snapshot.
+  Status ParallelScan(const ReadOptions& options, const Range& range,
+                      int num_partitions, bool ordered,
+                      const ScanCallback& callback) override;
+  // The shards the range overlaps are scanned one after another.
+  Status FilteredScan(const ReadOptions& options, const Range& range,
+                      const std::string& filter_name,
+                      const ScanCallback& callback) override;
 #ifdef BYTEADDRESSABLE
   Iterator* NewSEQIterator(const ReadOptions& options) override;
 #endif
   void WaitforAllbgtasks(bool clear_mem) override;
+  // The snapshots of all the shards at one cut of the sequences, so that a
+  // write of several shards is in all of them or in none. The writes wait
+  // only while the sequences are read, see WriteCut.
   const Snapshot* GetSnapshot() override;
   void ReleaseSnapshot(const Snapshot* snapshot) override;
   bool GetProperty(const Slice& property, std::string* value) override;
+  bool GetMapProperty(const Slice& property,
+                      std::map<std::string, uint64_t>* value) override;
   void GetApproximateSizes(const Range* range, int n, uint64_t* sizes) override;
+  void GetApproximateCounts(const Range* range, int n, uint64_t* entries,
+                            uint64_t* raw_sizes) override;
   void CompactRange(const Slice* begin, const Slice* end) override;
   std::map<Slice, DBImpl*, cmpBySlice>* GetShards_pool(){
     return &shards_pool;
   }
+  // Split the shard whose range holds "key" into [lower bound, key) and
+  // [key, upper bound), the new shard on the same memory node. The tables
+  // go over at their boundaries, the few with keys on both sides of "key"
+  // are rewritten. The reads and writes wait while the last writes of the
+  // shard are flushed and the tables move, most of the flushing is done
+  // before. Fails while a snapshot or an iterator of the DB is alive, they
+  // hold on to the shards.
+  Status SplitShard(const Slice& key);
+  // Merge the shard whose range holds "key" with the one after it, which
+  // must be on the same memory node, as SplitShard() does.
+  Status MergeShards(const Slice& key);
+  // Move the shard whose range holds "key" over to the memory node
+  // "target_memory_id". Its tables are copied while the reads and writes go
+  // on, then the ones written meanwhile while they wait, as SplitShard()
+  // does.
+  Status MigrateShard(const Slice& key, uint8_t target_memory_id);
+  // Move at most one shard from the most loaded memory node to the least
+  // loaded one, if that evens them out. The load of a memory node is its
+  // share of the writes since the last call, of the bytes of the tables and
+  // of the compactions the memory nodes last reported running.
+  Status BalanceShards();
+  // Replace the quota of the shard whose range holds "key", see
+  // DBImpl::SetQuota(). The shards a split or a merge makes, and a migrated
+  // shard, start from options.shard_quota again.
+  Status SetShardQuota(const Slice& key, const ShardQuota& quota);
+  // One trace of all the shards, the shards record the writes and the Gets.
+  Status StartTrace(const std::string& path) override;
+  Status EndTrace() override;
  private:
+  // "options" with the snapshot of "db" out of the one of GetSnapshot().
+  ReadOptions ShardReadOptions(const ReadOptions& options, DBImpl* db) const;
+  // The iterator of NewIterator(), or of NewSEQIterator() with "seq".
+  Iterator* NewShardedIterator(const ReadOptions& options, bool seq);
   bool Get_Target_Shard(DBImpl*& db_ptr, Slice key){
-    auto iter = shards_pool.upper_bound(key);
-    if(iter != shards_pool.end()){
-      db_ptr = iter->second;
-//#ifndef NDEBUG
-//      Shard_Info.f
-//      assert(key.compare());
-//#endif
-//      db_ptr->
+    DBImpl* db = router_.Find(key);
+    if(db != nullptr){
+      db_ptr = db;
       return true;
       // TODO: Also remember to check the lower bound if not return false.
     }else{
       return false;
     }
   }
-    std::map<Slice, DBImpl*, cmpBySlice> shards_pool;// <upper bound, dbptr>
-    // In case that the shard key buffer get deleted outside the DB.
-    // THe range of every shard is [lower bound, upper bound).
-    std::vector<std::pair<std::string, std::string>> Shard_Info;
+  // A shard id for the memory node "target_memory_id" not given out yet into
+  // *shard_id, false if there is none left. reshard_mtx_ held.
+  bool NewShardId(uint8_t target_memory_id, uint8_t* shard_id);
+  // Whether there is no snapshot of the DB, snapshot_mtx_ held.
+  Status CheckNoSnapshots() const;
+  // A shard of the DB, not opened yet.
+  DBImpl* NewShard(const std::string& upper_bound,
+                   const std::string& lower_bound);
+  // MigrateShard() of "db", reshard_mtx_ held.
+  Status MigrateShardLocked(DBImpl* db, uint8_t target_memory_id);
+
+    // <upper bound, dbptr>, the keys point to the upper bounds of the shards.
+    // THe range of every shard is [lower bound, upper bound), of the hashes of
+    // its keys if router_ is hashed.
+    std::map<Slice, DBImpl*, cmpBySlice> shards_pool;
+    // The lookups of the shard of a key, rebuilt with shards_pool while
+    // snapshot_mtx_ is held exclusively, so that the reads and writes
+    // holding it shared see it whole.
+    ShardRouter router_;
+    // Held shared by the reads, the writes and GetSnapshot(), and
+    // exclusively while the shards are split, merged or migrated.
+    std::shared_mutex snapshot_mtx_;
+    // The writes of the shards take their sequences within it.
+    WriteCut cut_;
+    // The snapshots of GetSnapshot() not released yet. The shards do not
+    // change while there is one.
+    std::atomic<int> live_snapshots_{0};
+    // What the shards are opened with.
+    const Options options_;
+    const std::string dbname_;
+    // Shared by the shards, see DBImpl::tracer_.
+    Tracer tracer_;
+    // One split or merge at a time.
+    std::mutex reshard_mtx_;
+    // The shard ids given out, which are not given out again.
+    std::set<uint8_t> shard_ids_;
+    // The last sequence of every shard at the last BalanceShards(), under
+    // reshard_mtx_.
+    std::map<DBImpl*, SequenceNumber> balanced_sequences_;
 //    std::vector<std::thread> Sharded_main_comm_threads;
 //    int main_comm_thread_ready_num = 0;
 //    std::condition_variable handler_threads_cv;
@@ -4,11 +4,14 @@
 
 #include "db/db_iter.h"
 
+#include "db/blob.h"
 #include "db/db_impl.h"
 #include "db/dbformat.h"
 #include "db/filename.h"
+#include "db/range_tombstone.h"
 #include "dLSM/env.h"
 #include "dLSM/iterator.h"
+#include "dLSM/merge_operator.h"
 #include "port/port.h"
 #include "util/logging.h"
 #include "util/mutexlock.h"
@@ -45,16 +48,28 @@ class DBIter : public Iterator {
   //     just before all entries whose user key == this->key().
   enum Direction { kForward, kReverse };
 
-  DBIter(DBImpl* db, const Comparator* cmp, Iterator* iter, SequenceNumber s,
-         uint32_t seed)
+  DBIter(DBImpl* db, const Comparator* cmp, const MergeOperator* merge_operator,
+         Iterator* iter, SequenceNumber s, uint32_t seed,
+         const RangeTombstones* range_tombstones, const ReadOptions& options,
+         bool seq)
       : db_(db),
         user_comparator_(cmp),
+        merge_operator_(merge_operator),
         iter_(iter),
         sequence_(s),
+        range_tombstones_(NonEmpty(range_tombstones)),
+        options_(options),
+        seq_(seq),
+        lower_bound_(options.iterate_lower_bound),
+        upper_bound_(options.iterate_upper_bound),
         direction_(kForward),
         valid_(false),
+        current_merged_(false),
         rnd_(seed),
-        bytes_until_read_sampling_(RandomCompactionPeriod()) {}
+        bytes_until_read_sampling_(RandomCompactionPeriod()),
+        last_refresh_micros_(options.auto_refresh_micros > 0
+                                 ? Env::Default()->NowMicros()
+                                 : 0) {}
 
   DBIter(const DBIter&) = delete;
   DBIter& operator=(const DBIter&) = delete;
@@ -63,11 +78,18 @@ class DBIter : public Iterator {
   bool Valid() const override { return valid_; }
   Slice key() const override {
     assert(valid_);
-    return (direction_ == kForward) ? ExtractUserKey(iter_->key()) : saved_key_;
+    return (direction_ == kForward && !current_merged_)
+               ? ExtractUserKey(iter_->key())
+               : saved_key_;
   }
   Slice value() const override {
     assert(valid_);
-    return (direction_ == kForward) ? iter_->value() : saved_value_;
+    if (options_.keys_only) {
+      return Slice();
+    }
+    return (direction_ == kForward && !current_merged_ && !current_blob_)
+               ? iter_->value()
+               : saved_value_;
   }
   Status status() const override {
     if (status_.ok()) {
@@ -82,11 +104,48 @@ class DBIter : public Iterator {
   void Seek(const Slice& target) override;
   void SeekToFirst() override;
   void SeekToLast() override;
+  Status Refresh() override;
 
  private:
+  static const RangeTombstones* NonEmpty(const RangeTombstones* t) {
+    return t != nullptr && !t->empty() ? t : nullptr;
+  }
   void FindNextUserEntry(bool skipping, std::string* skip);
   void FindPrevUserEntry();
+  // iter_ is at a visible merge operand, collect it and the operands after
+  // it down to the value or the deletion below them, and yield the merged
+  // entry.
+  void MergeValuesNewToOld();
+  // Store in saved_value_ the result of "operands", the oldest first,
+  // applied to "base". Returns false and sets status_ if that fails.
+  bool MergeOperands(const Slice* base, const std::vector<Slice>& operands);
+  // Read the value of the blob index "index" into *value. Returns false and
+  // sets status_ if that fails.
+  bool ReadBlobValue(const Slice& index, std::string* value);
   bool ParseKey(ParsedInternalKey* key);
+  // Refresh and seek back to the current key if ReadOptions::
+  // auto_refresh_keys or auto_refresh_micros says it is time.
+  void MaybeAutoRefresh();
+  // The type of the entry, a value or a merge operand deleted by a range
+  // tombstone counts as a deletion.
+  ValueType EntryType(const ParsedInternalKey& ikey) const {
+    if ((ikey.type == kTypeValue || ikey.type == kTypeMerge ||
+         ikey.type == kTypeBlobIndex) &&
+        range_tombstones_ != nullptr &&
+        range_tombstones_->ShouldDelete(user_comparator_, ikey.user_key,
+                                        ikey.sequence, sequence_)) {
+      return kTypeDeletion;
+    }
+    return ikey.type;
+  }
+  bool BeforeLowerBound(const Slice& user_key) const {
+    return lower_bound_ != nullptr &&
+           user_comparator_->Compare(user_key, *lower_bound_) < 0;
+  }
+  bool AfterUpperBound(const Slice& user_key) const {
+    return upper_bound_ != nullptr &&
+           user_comparator_->Compare(user_key, *upper_bound_) >= 0;
+  }
 
   inline void SaveKey(const Slice& k, std::string* dst) {
     dst->assign(k.data(), k.size());
@@ -108,15 +167,31 @@ class DBIter : public Iterator {
 
   DBImpl* db_;
   const Comparator* const user_comparator_;
-  Iterator* const iter_;
-  SequenceNumber const sequence_;
+  const MergeOperator* const merge_operator_;
+  Iterator* iter_;
+  SequenceNumber sequence_;
+  const RangeTombstones* range_tombstones_;
+  // What Refresh() builds the internal iterator with.
+  const ReadOptions options_;
+  const bool seq_;
+  const Slice* const lower_bound_;
+  const Slice* const upper_bound_;
   Status status_;
   std::string saved_key_;    // == current key when direction_==kReverse
   std::string saved_value_;  // == current raw value when direction_==kReverse
   Direction direction_;
   bool valid_;
+  // Moving forward, the current entry is the merge of the operands before
+  // iter_, in saved_key_ and saved_value_.
+  bool current_merged_;
+  // Moving forward, the current entry is a blob index at iter_, whose value
+  // is in saved_value_.
+  bool current_blob_ = false;
   Random rnd_;
   size_t bytes_until_read_sampling_;
+  // The keys returned by Next() and the time since the last refresh.
+  uint64_t keys_since_refresh_ = 0;
+  uint64_t last_refresh_micros_;
 };
 
 inline bool DBIter::ParseKey(ParsedInternalKey* ikey) {
@@ -157,6 +232,14 @@ void DBIter::Next() {
       return;
     }
     // saved_key_ already contains the key to skip past.
+  } else if (current_merged_) {
+    // iter_ is past the operands already, and saved_key_ holds their key.
+    current_merged_ = false;
+    if (!iter_->Valid()) {
+      valid_ = false;
+      saved_key_.clear();
+      return;
+    }
   } else {
     // Store in saved_key_ the current key so we skip it below.
     SaveKey(ExtractUserKey(iter_->key()), &saved_key_);
@@ -172,6 +255,31 @@ void DBIter::Next() {
   }
 
   FindNextUserEntry(true, &saved_key_);
+  if (valid_ && (options_.auto_refresh_keys > 0 ||
+                 options_.auto_refresh_micros > 0)) {
+    MaybeAutoRefresh();
+  }
+}
+
+void DBIter::MaybeAutoRefresh() {
+  keys_since_refresh_++;
+  bool due = options_.auto_refresh_keys > 0 &&
+             keys_since_refresh_ >= options_.auto_refresh_keys;
+  // The clock is read every 64 keys.
+  if (!due && options_.auto_refresh_micros > 0 &&
+      keys_since_refresh_ % 64 == 0) {
+    due = Env::Default()->NowMicros() - last_refresh_micros_ >=
+          options_.auto_refresh_micros;
+  }
+  if (!due || db_ == nullptr) {
+    return;
+  }
+  // A key deleted meanwhile is skipped by the seek, as it would have been
+  // by the next Next().
+  std::string current = key().ToString();
+  if (Refresh().ok()) {
+    Seek(current);
+  }
 }
 
 void DBIter::FindNextUserEntry(bool skipping, std::string* skip) {
@@ -180,8 +288,13 @@ void DBIter::FindNextUserEntry(bool skipping, std::string* skip) {
   assert(direction_ == kForward);
   do {
     ParsedInternalKey ikey;
-    if (ParseKey(&ikey) && ikey.sequence <= sequence_) {
-      switch (ikey.type) {
+    const bool parsed = ParseKey(&ikey);
+    if (parsed && AfterUpperBound(ikey.user_key)) {
+      // The rest is out of the range too.
+      break;
+    }
+    if (parsed && ikey.sequence <= sequence_) {
+      switch (EntryType(ikey)) {
         case kTypeDeletion:
           // Arrange to skip all upcoming entries for this key since
           // they are hidden by this deletion.
@@ -189,12 +302,24 @@ void DBIter::FindNextUserEntry(bool skipping, std::string* skip) {
           skipping = true;
           break;
         case kTypeValue:
+        case kTypeBlobIndex:
           if (skipping &&
               user_comparator_->Compare(ikey.user_key, *skip) <= 0) {
             // Entry hidden
           } else {
-            valid_ = true;
             saved_key_.clear();
+            current_blob_ = ikey.type == kTypeBlobIndex && !options_.keys_only;
+            valid_ = !current_blob_ ||
+                     ReadBlobValue(iter_->value(), &saved_value_);
+            return;
+          }
+          break;
+        case kTypeMerge:
+          if (skipping &&
+              user_comparator_->Compare(ikey.user_key, *skip) <= 0) {
+            // Entry hidden
+          } else {
+            MergeValuesNewToOld();
             return;
           }
           break;
@@ -206,14 +331,84 @@ void DBIter::FindNextUserEntry(bool skipping, std::string* skip) {
   valid_ = false;
 }
 
+void DBIter::MergeValuesNewToOld() {
+  SaveKey(ExtractUserKey(iter_->key()), &saved_key_);
+  // The newest first.
+  std::vector<std::string> operands;
+  operands.push_back(iter_->value().ToString());
+  std::string base;
+  bool has_base = false;
+  for (iter_->Next(); iter_->Valid(); iter_->Next()) {
+    ParsedInternalKey ikey;
+    if (!ParseKey(&ikey) ||
+        user_comparator_->Compare(ikey.user_key, saved_key_) != 0) {
+      break;
+    }
+    const ValueType type = EntryType(ikey);
+    if (type == kTypeMerge) {
+      operands.push_back(iter_->value().ToString());
+      continue;
+    }
+    if (type == kTypeValue) {
+      base = iter_->value().ToString();
+      has_base = true;
+    } else if (type == kTypeBlobIndex) {
+      if (!ReadBlobValue(iter_->value(), &base)) {
+        current_merged_ = false;
+        valid_ = false;
+        return;
+      }
+      has_base = true;
+    }
+    // The entries of the key from here on are skipped by Next().
+    break;
+  }
+  std::vector<Slice> list(operands.rbegin(), operands.rend());
+  const Slice base_slice(base);
+  current_merged_ = MergeOperands(has_base ? &base_slice : nullptr, list);
+  valid_ = current_merged_;
+}
+
+bool DBIter::MergeOperands(const Slice* base,
+                           const std::vector<Slice>& operands) {
+  if (merge_operator_ == nullptr) {
+    status_ = Status::InvalidArgument("no merge operator for ", saved_key_);
+    return false;
+  }
+  std::string merged;
+  if (!merge_operator_->FullMerge(saved_key_, base, operands, &merged)) {
+    status_ = Status::Corruption("merge failed for ", saved_key_);
+    return false;
+  }
+  saved_value_.swap(merged);
+  return true;
+}
+
+bool DBIter::ReadBlobValue(const Slice& index, std::string* value) {
+  Status s = ReadBlob(Env::Default()->rdma_mg.get(), index, value);
+  if (!s.ok()) {
+    status_ = s;
+    return false;
+  }
+  return true;
+}
+
 void DBIter::Prev() {
   assert(valid_);
 
   if (direction_ == kForward) {  // Switch directions?
     // iter_ is pointing at the current entry.  Scan backwards until
     // the key changes so we can use the normal reverse scanning code.
-    assert(iter_->Valid());  // Otherwise valid_ would have been false
-    SaveKey(ExtractUserKey(iter_->key()), &saved_key_);
+    if (current_merged_) {
+      // iter_ is past the operands, and saved_key_ holds their key.
+      current_merged_ = false;
+      if (!iter_->Valid()) {
+        iter_->SeekToLast();
+      }
+    } else {
+      assert(iter_->Valid());  // Otherwise valid_ would have been false
+      SaveKey(ExtractUserKey(iter_->key()), &saved_key_);
+    }
     while (true) {
       iter_->Prev();
       if (!iter_->Valid()) {
@@ -237,20 +432,34 @@ void DBIter::FindPrevUserEntry() {
   assert(direction_ == kReverse);
 
   ValueType value_type = kTypeDeletion;
+  // The merge operands of saved_key_ after its value, the oldest first.
+  std::vector<std::string> operands;
+  bool has_base = false;
   if (iter_->Valid()) {
     do {
       ParsedInternalKey ikey;
-      if (ParseKey(&ikey) && ikey.sequence <= sequence_) {
+      const bool parsed = ParseKey(&ikey);
+      if (parsed && BeforeLowerBound(ikey.user_key)) {
+        break;
+      }
+      if (parsed && ikey.sequence <= sequence_) {
         if ((value_type != kTypeDeletion) &&
             user_comparator_->Compare(ikey.user_key, saved_key_) < 0) {
           // We encountered a non-deleted value in entries for previous keys,
           break;
         }
-        value_type = ikey.type;
+        value_type = EntryType(ikey);
         if (value_type == kTypeDeletion) {
           saved_key_.clear();
           ClearSavedValue();
+          operands.clear();
+          has_base = false;
+        } else if (value_type == kTypeMerge) {
+          SaveKey(ExtractUserKey(iter_->key()), &saved_key_);
+          operands.push_back(iter_->value().ToString());
         } else {
+          operands.clear();
+          has_base = true;
           Slice raw_value = iter_->value();
           if (saved_value_.capacity() > raw_value.size() + 1048576) {
             std::string empty;
@@ -258,12 +467,24 @@ void DBIter::FindPrevUserEntry() {
           }
           SaveKey(ExtractUserKey(iter_->key()), &saved_key_);
           saved_value_.assign(raw_value.data(), raw_value.size());
+          if (value_type == kTypeBlobIndex && !options_.keys_only &&
+              !ReadBlobValue(raw_value, &saved_value_)) {
+            value_type = kTypeDeletion;
+            break;
+          }
         }
       }
       iter_->Prev();
     } while (iter_->Valid());
   }
 
+  if (value_type == kTypeMerge) {
+    std::vector<Slice> list(operands.begin(), operands.end());
+    const Slice base(saved_value_);
+    if (!MergeOperands(has_base ? &base : nullptr, list)) {
+      value_type = kTypeDeletion;
+    }
+  }
   if (value_type == kTypeDeletion) {
     // End
     valid_ = false;
@@ -277,10 +498,13 @@ void DBIter::FindPrevUserEntry() {
 
 void DBIter::Seek(const Slice& target) {
   direction_ = kForward;
+  current_merged_ = false;
   ClearSavedValue();
   saved_key_.clear();
   AppendInternalKey(&saved_key_,
-                    ParsedInternalKey(target, sequence_, kValueTypeForSeek));
+                    ParsedInternalKey(BeforeLowerBound(target) ? *lower_bound_
+                                                               : target,
+                                      sequence_, kValueTypeForSeek));
   iter_->Seek(saved_key_);
   if (iter_->Valid()) {
     FindNextUserEntry(false, &saved_key_ /* temporary storage */);
@@ -290,7 +514,12 @@ void DBIter::Seek(const Slice& target) {
 }
 
 void DBIter::SeekToFirst() {
+  if (lower_bound_ != nullptr) {
+    Seek(*lower_bound_);
+    return;
+  }
   direction_ = kForward;
+  current_merged_ = false;
   ClearSavedValue();
   iter_->SeekToFirst();
   if (iter_->Valid()) {
@@ -302,17 +531,61 @@ void DBIter::SeekToFirst() {
 
 void DBIter::SeekToLast() {
   direction_ = kReverse;
+  current_merged_ = false;
   ClearSavedValue();
-  iter_->SeekToLast();
+  if (upper_bound_ != nullptr) {
+    // The entries from the bound on are out of the range.
+    InternalKey bound(*upper_bound_, kMaxSequenceNumber, kValueTypeForSeek);
+    iter_->Seek(bound.Encode());
+    if (iter_->Valid()) {
+      iter_->Prev();
+    } else {
+      iter_->SeekToLast();
+    }
+  } else {
+    iter_->SeekToLast();
+  }
   FindPrevUserEntry();
 }
 
+Status DBIter::Refresh() {
+  if (db_ == nullptr) {
+    return Status::NotSupported("Refresh");
+  }
+  // The old children go first, the new ones take over their prefetch
+  // buffers.
+  delete iter_;
+  SequenceNumber latest_snapshot;
+  const RangeTombstones* range_tombstones;
+  iter_ = db_->NewRefreshedInternalIterator(options_, seq_, &latest_snapshot,
+                                            &range_tombstones);
+  if (options_.snapshot == nullptr) {
+    sequence_ = latest_snapshot;
+  }
+  range_tombstones_ = NonEmpty(range_tombstones);
+  direction_ = kForward;
+  valid_ = false;
+  current_merged_ = false;
+  status_ = Status::OK();
+  saved_key_.clear();
+  ClearSavedValue();
+  keys_since_refresh_ = 0;
+  if (options_.auto_refresh_micros > 0) {
+    last_refresh_micros_ = Env::Default()->NowMicros();
+  }
+  return iter_->status();
+}
+
 }  // anonymous namespace
 
 Iterator* NewDBIterator(DBImpl* db, const Comparator* user_key_comparator,
+                        const MergeOperator* merge_operator,
                         Iterator* internal_iter, SequenceNumber sequence,
-                        uint32_t seed) {
-  return new DBIter(db, user_key_comparator, internal_iter, sequence, seed);
+                        uint32_t seed,
+                        const RangeTombstones* range_tombstones,
+                        const ReadOptions& options, bool seq) {
+  return new DBIter(db, user_key_comparator, merge_operator, internal_iter,
+                    sequence, seed, range_tombstones, options, seq);
 }
 
 }  // namespace dLSM
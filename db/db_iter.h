@@ -13,13 +13,24 @@
 namespace dLSM {
 
 class DBImpl;
+class MergeOperator;
+class RangeTombstones;
 
 // Return a new iterator that converts internal keys (yielded by
 // "*internal_iter") that were live at the specified "sequence" number
-// into appropriate user keys.
+// into appropriate user keys. The values deleted by "*range_tombstones", if
+// not null, are skipped; it must outlive the iterator. The user keys out of
+// the bounds of ReadOptions::iterate_lower_bound and iterate_upper_bound in
+// "options" are not returned either. Refresh() replaces "internal_iter" by
+// a new one of "db" for "options", a seq iterator if "seq". The merge
+// operands are applied with "merge_operator".
 Iterator* NewDBIterator(DBImpl* db, const Comparator* user_key_comparator,
+                        const MergeOperator* merge_operator,
                         Iterator* internal_iter, SequenceNumber sequence,
-                        uint32_t seed);
+                        uint32_t seed,
+                        const RangeTombstones* range_tombstones = nullptr,
+                        const ReadOptions& options = ReadOptions(),
+                        bool seq = false);
 
 }  // namespace dLSM
 
@@ -7,6 +7,7 @@
 #include <cstdio>
 #include <sstream>
 
+#include "dLSM/compaction_filter.h"
 #include "port/port.h"
 #include "util/coding.h"
 
@@ -17,6 +18,21 @@ void AppendInternalKey(std::string* result, const ParsedInternalKey& key) {
   PutFixed64(result, PackSequenceAndType(key.sequence, key.type));
 }
 
+bool FilterCompactionEntry(const CompactionFilter* filter, int level,
+                           const ParsedInternalKey& ikey, std::string* buf,
+                           Slice* key, Slice* value) {
+  if (filter == nullptr || ikey.type != kTypeValue ||
+      !filter->Filter(level, ikey.user_key, *value)) {
+    return false;
+  }
+  buf->clear();
+  AppendInternalKey(buf, ParsedInternalKey(ikey.user_key, ikey.sequence,
+                                           kTypeDeletion));
+  *key = *buf;
+  *value = Slice();
+  return true;
+}
+
 std::string ParsedInternalKey::DebugString() const {
   std::ostringstream ss;
   ss << '\'' << EscapeString(user_key.ToString()) << "' @ " << sequence << " : "
@@ -34,26 +50,20 @@ std::string InternalKey::DebugString() const {
   return ss.str();
 }
 
+static const char kInternalKeyComparatorName[] = "dLSM.InternalKeyComparator";
+
 const char* InternalKeyComparator::Name() const {
-  return "dLSM.InternalKeyComparator";
+  return kInternalKeyComparatorName;
 }
 
-int InternalKeyComparator::Compare(const Slice& akey, const Slice& bkey) const {
-  // Order by:
-  //    increasing user key (according to user-supplied comparator)
-  //    decreasing sequence number
-  //    decreasing type (though sequence# should be enough to disambiguate)
-  int r = user_comparator_->Compare(ExtractUserKey(akey), ExtractUserKey(bkey));
-  if (r == 0) {
-    const uint64_t anum = DecodeFixed64(akey.data() + akey.size() - 8);
-    const uint64_t bnum = DecodeFixed64(bkey.data() + bkey.size() - 8);
-    if (anum > bnum) {
-      r = -1;
-    } else if (anum < bnum) {
-      r = +1;
-    }
+const InternalKeyComparator* InternalKeyComparator::BytewiseOf(
+    const Comparator* c) {
+  if (c == nullptr || c->Name() != kInternalKeyComparatorName) {
+    return nullptr;
   }
-  return r;
+  const InternalKeyComparator* icmp =
+      static_cast<const InternalKeyComparator*>(c);
+  return icmp->bytewise_ ? icmp : nullptr;
 }
 
 void InternalKeyComparator::FindShortestSeparator(std::string* start,
@@ -7,6 +7,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <string>
 
 #include "dLSM/comparator.h"
@@ -15,6 +16,7 @@
 #include "dLSM/slice.h"
 //#include "dLSM/table_builder_computeside.h"
 
+#include "port/port.h"
 #include "util/coding.h"
 #include "util/logging.h"
 
@@ -24,7 +26,6 @@ namespace dLSM {
 // parameters set via options.
 namespace config {
 static const int kNumLevels = 6;
-static const int MaxImmuNumPerFlush = 1;
 // Immutable flushing will be triggered when hit this number
 static const int Immutable_FlushTrigger = 1;
 // Maximum number of unflushed immutable files 10 in 1-1,
@@ -67,18 +68,27 @@ static const int kReadBytesPeriod = 1048576;
 }  // namespace config
 
 class InternalKey;
+class CompactionFilter;
 
 // Value types encoded as the last component of internal keys.
 // DO NOT CHANGE THESE ENUM VALUES: they are embedded in the on-disk
 // data structures.
-enum ValueType { kTypeDeletion = 0x0, kTypeValue = 0x1 };
+// A kTypeMerge entry holds an operand of Options::merge_operator, applied to
+// the entries of its key below it. A kTypeBlobIndex entry holds the
+// BlobIndex of a value kept out of the table, see db/blob.h.
+enum ValueType {
+  kTypeDeletion = 0x0,
+  kTypeValue = 0x1,
+  kTypeMerge = 0x2,
+  kTypeBlobIndex = 0x3
+};
 // kValueTypeForSeek defines the ValueType that should be passed when
 // constructing a ParsedInternalKey object for seeking to a particular
 // sequence number (since we sort sequence numbers in decreasing order
 // and the value type is embedded as the low 8 bits in the sequence
 // number in internal keys, we need to use the highest-numbered
 // ValueType, not the lowest).
-static const ValueType kValueTypeForSeek = kTypeValue;
+static const ValueType kValueTypeForSeek = kTypeBlobIndex;
 
 typedef uint64_t SequenceNumber;
 
@@ -111,6 +121,15 @@ void AppendInternalKey(std::string* result, const ParsedInternalKey& key);
 // On error, returns false, leaves "*result" in an undefined state.
 bool ParseInternalKey(const Slice& internal_key, ParsedInternalKey* result);
 
+// Ask "filter" whether the value entry "ikey" of a compaction of "level"
+// should be removed. A removed entry becomes a deletion at the same sequence,
+// so that the older values of the key in the lower levels stay hidden: "*key"
+// then points into "*buf" and "*value" is empty. Returns whether it was
+// removed.
+bool FilterCompactionEntry(const CompactionFilter* filter, int level,
+                           const ParsedInternalKey& ikey, std::string* buf,
+                           Slice* key, Slice* value);
+
 // Pack a sequence number and a ValueType into a uint64_t
 inline uint64_t PackSequenceAndType(uint64_t seq, ValueType t) {
   assert(seq <= kMaxSequenceNumber);
@@ -376,23 +395,82 @@ inline Slice ExtractUserKey(const Slice& internal_key) {
   return Slice(internal_key.data(), internal_key.size() - 8);
 }
 
+// Returns the value type of an internal key.
+inline ValueType ExtractValueType(const Slice& internal_key) {
+  assert(internal_key.size() >= 8);
+  return static_cast<ValueType>(
+      static_cast<unsigned char>(internal_key[internal_key.size() - 8]));
+}
+
+// Slice::compare(), the order of BytewiseComparator(), with the first 8
+// bytes compared as one big endian word. That settles most unequal keys
+// without the memcmp() call.
+inline int BytewiseCompare(const Slice& a, const Slice& b) {
+  if (a.size() >= sizeof(uint64_t) && b.size() >= sizeof(uint64_t)) {
+    uint64_t x, y;
+    std::memcpy(&x, a.data(), sizeof(x));
+    std::memcpy(&y, b.data(), sizeof(y));
+    if (x != y) {
+      if (port::kLittleEndian) {
+        x = __builtin_bswap64(x);
+        y = __builtin_bswap64(y);
+      }
+      return x < y ? -1 : +1;
+    }
+  }
+  return a.compare(b);
+}
+
 // A comparator for internal keys that uses a specified comparator for
 // the user key portion and breaks ties by decreasing sequence number.
-class InternalKeyComparator : public Comparator {
+//
+// The class is final, so the callers holding an InternalKeyComparator, as
+// the memtable and the file search of a version do, call Compare() without
+// the virtual dispatch, and with BytewiseComparator() the user keys are
+// compared inline too.
+class InternalKeyComparator final : public Comparator {
  private:
   const Comparator* user_comparator_;
+  bool bytewise_;
 
  public:
-  explicit InternalKeyComparator(const Comparator* c) : user_comparator_(c) {}
+  explicit InternalKeyComparator(const Comparator* c)
+      : user_comparator_(c), bytewise_(c == BytewiseComparator()) {}
   const char* Name() const override;
-  int Compare(const Slice& a, const Slice& b) const override;
+  int Compare(const Slice& akey, const Slice& bkey) const override {
+    // Order by:
+    //    increasing user key (according to user-supplied comparator)
+    //    decreasing sequence number
+    //    decreasing type (though sequence# should be enough to disambiguate)
+    const Slice auser = ExtractUserKey(akey);
+    const Slice buser = ExtractUserKey(bkey);
+    int r = bytewise_ ? BytewiseCompare(auser, buser)
+                      : user_comparator_->Compare(auser, buser);
+    if (r == 0) {
+      const uint64_t anum = DecodeFixed64(akey.data() + akey.size() - 8);
+      const uint64_t bnum = DecodeFixed64(bkey.data() + bkey.size() - 8);
+      if (anum > bnum) {
+        r = -1;
+      } else if (anum < bnum) {
+        r = +1;
+      }
+    }
+    return r;
+  }
   void FindShortestSeparator(std::string* start,
                              const Slice& limit) const override;
   void FindShortSuccessor(std::string* key) const override;
 
   const Comparator* user_comparator() const { return user_comparator_; }
+  bool bytewise() const { return bytewise_; }
 
   int Compare(const InternalKey& a, const InternalKey& b) const;
+
+  // Returns "c" if it is an InternalKeyComparator of BytewiseComparator(),
+  // else nullptr. The iterators of the tables, which only have a Comparator,
+  // check once and then take the inline path. Compares the Name() pointer
+  // rather than the string.
+  static const InternalKeyComparator* BytewiseOf(const Comparator* c);
 };
 
 // Filter policy wrapper that converts from internal keys to user keys
@@ -457,7 +535,7 @@ inline bool ParseInternalKey(const Slice& internal_key,
   result->sequence = num >> 8;
   result->type = static_cast<ValueType>(c);
   result->user_key = Slice(internal_key.data(), n - 8);
-  return (c <= static_cast<uint8_t>(kTypeValue));
+  return (c <= static_cast<uint8_t>(kTypeBlobIndex));
 }
 
 // A helper class useful for DBImpl::Get()
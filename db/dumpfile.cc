@@ -88,6 +88,14 @@ class WriteBatchItemPrinter : public WriteBatch::Handler {
     r += "'\n";
     dst_->Append(r);
   }
+  void Merge(const Slice& key, const Slice& value) override {
+    std::string r = "  merge '";
+    AppendEscapedStringTo(&r, key);
+    r += "' '";
+    AppendEscapedStringTo(&r, value);
+    r += "'\n";
+    dst_->Append(r);
+  }
 
   WritableFile* dst_;
 };
@@ -189,6 +197,10 @@ Status DumpTable(Env* env, const std::string& fname, WritableFile* dst) {
         r += "del";
       } else if (key.type == kTypeValue) {
         r += "val";
+      } else if (key.type == kTypeMerge) {
+        r += "merge";
+      } else if (key.type == kTypeBlobIndex) {
+        r += "blob";
       } else {
         AppendNumberTo(&r, key.type);
       }
@@ -0,0 +1,157 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/edit_publisher.h"
+
+#include <vector>
+
+#include "db/version_edit.h"
+#include "db/version_set.h"
+#include "dLSM/env.h"
+#include "util/coding.h"
+
+namespace dLSM {
+
+namespace {
+
+// number and kind.
+const size_t kRecordPrefixSize = 12;
+
+}  // namespace
+
+EditPublisher::EditPublisher(RDMA_Manager* rdma_mg, uint8_t target_node_id,
+                             uint8_t shard_id, size_t size,
+                             uint64_t retire_micros, Env* env,
+                             Logger* info_log)
+    : log_(rdma_mg, target_node_id, shard_id, size, true),
+      env_(env),
+      info_log_(info_log),
+      retire_micros_(retire_micros),
+      next_number_(1),
+      used_(0) {}
+
+Status EditPublisher::Open(Version* current, SequenceNumber last_sequence) {
+  std::vector<std::string> previous;
+  SequenceNumber unused;
+  Status s = log_.Open(&previous, &unused);
+  if (s.ok()) {
+    // The numbers start over, the records of the previous run go first.
+    log_.SetRecoveredSequence(0);
+    s = log_.Truncate(0);
+  }
+  if (s.ok()) {
+    std::string snapshot;
+    EncodeSnapshot(current, last_sequence, &snapshot);
+    s = AppendSnapshot(snapshot);
+  }
+  error_ = s;
+  return s;
+}
+
+void EditPublisher::Publish(VersionEdit* edit, Version* before,
+                            Version* after) {
+  if (!error_.ok()) {
+    return;
+  }
+  const uint64_t now = env_->NowMicros();
+  while (!retired_.empty() && retired_.front().first <= now) {
+    retired_.pop_front();
+  }
+  for (const auto& deleted : *edit->GetDeletedFiles()) {
+    const int level = std::get<0>(deleted);
+    for (const auto& f : before->files(level)) {
+      if (f->number == std::get<1>(deleted) &&
+          f->creator_node_id == std::get<2>(deleted)) {
+        retired_.emplace_back(now + retire_micros_, f);
+        break;
+      }
+    }
+  }
+  std::string record;
+  edit->EncodeTo(&record);
+  Status s;
+  if (used_ + RemoteLog::RecordSize(kRecordPrefixSize + record.size()) <=
+      log_.capacity() / 2) {
+    s = Append(kEdit, record);
+  } else {
+    record.clear();
+    EncodeSnapshot(after, edit->GetLastSequence(), &record);
+    s = AppendSnapshot(record);
+  }
+  if (!s.ok()) {
+    Log(info_log_, "Stopped publishing the edits to the replicas: %s",
+        s.ToString().c_str());
+    error_ = s;
+    // Otherwise the replicas only notice by the time of their last refresh.
+    s = Append(kBroken, Slice());
+    if (!s.ok()) {
+      Log(info_log_, "Failed to tell the replicas: %s", s.ToString().c_str());
+    }
+  }
+}
+
+bool EditPublisher::DecodeRecord(const Slice& record, Kind* kind,
+                                 Slice* edit) {
+  if (record.size() < kRecordPrefixSize) {
+    return false;
+  }
+  const uint32_t k = DecodeFixed32(record.data() + 8);
+  if (k != kEdit && k != kSnapshot && k != kBroken) {
+    return false;
+  }
+  *kind = static_cast<Kind>(k);
+  *edit = Slice(record.data() + kRecordPrefixSize,
+                record.size() - kRecordPrefixSize);
+  return true;
+}
+
+Status EditPublisher::Append(Kind kind, const Slice& edit) {
+  std::string record;
+  record.reserve(kRecordPrefixSize + edit.size());
+  const uint64_t number = next_number_++;
+  PutFixed64(&record, number);
+  PutFixed32(&record, kind);
+  record.append(edit.data(), edit.size());
+  Status s = log_.AddRecord(record, number);
+  if (s.ok()) {
+    used_ += RemoteLog::RecordSize(record.size());
+  }
+  return s;
+}
+
+Status EditPublisher::AppendSnapshot(const Slice& edit) {
+  // The records before it take at most the other half, so the ring never
+  // waits for a truncation nobody would make.
+  if (RemoteLog::RecordSize(kRecordPrefixSize + edit.size()) >
+      log_.capacity() / 2) {
+    return Status::InvalidArgument(
+        "snapshot larger than half of the replica edit log");
+  }
+  const uint64_t number = next_number_;
+  Status s = Append(kSnapshot, edit);
+  if (s.ok()) {
+    s = log_.Truncate(number - 1);
+  }
+  if (s.ok()) {
+    used_ = RemoteLog::RecordSize(kRecordPrefixSize + edit.size());
+  }
+  return s;
+}
+
+void EditPublisher::EncodeSnapshot(Version* v, SequenceNumber last_sequence,
+                                   std::string* dst) {
+  VersionEdit snapshot(0);
+  for (int level = 0; level < config::kNumLevels; level++) {
+    for (const auto& f : v->files(level)) {
+      snapshot.AddFile(level, f);
+    }
+  }
+  for (const RangeTombstone& t : v->range_tombstones().tombstones()) {
+    snapshot.AddRangeTombstone(t);
+  }
+  snapshot.SetLastSequence(last_sequence);
+  snapshot.EncodeTo(dst);
+}
+
+}  // namespace dLSM
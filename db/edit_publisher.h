@@ -0,0 +1,95 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_EDIT_PUBLISHER_H_
+#define STORAGE_dLSM_DB_EDIT_PUBLISHER_H_
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "db/dbformat.h"
+#include "db/remote_log.h"
+#include "dLSM/status.h"
+
+namespace dLSM {
+
+class Env;
+class Logger;
+class RDMA_Manager;
+struct RemoteMemTableMetaData;
+class Version;
+class VersionEdit;
+
+// The version edits of a shard, published in a RemoteLog ring on its memory
+// node for the read replicas of the shard on the other compute nodes, which
+// read the ring and apply the edits to versions of their own. A record is
+//
+//    number: fixed64, of the record, from 1 on
+//    kind: fixed32, kEdit or kSnapshot
+//    the encoded VersionEdit
+//
+// A snapshot holds all the files and range tombstones of the version the
+// records before it lead to, the ring is truncated just before a snapshot
+// only. A replica that falls behind the truncation so starts over from the
+// snapshot at the tail. Once the ring is half full the next edit goes out as
+// a snapshot of the version it leads to.
+//
+// The tables the edits remove are kept for "retire_micros", so that the
+// replicas finish the reads of the versions they still have before the
+// chunks of the tables are freed.
+//
+// Once publishing fails the owner appends a kBroken record, with no edit,
+// if it still can, and publishes nothing more.
+class EditPublisher {
+ public:
+  enum Kind : uint32_t { kEdit = 0, kSnapshot = 1, kBroken = 2 };
+
+  EditPublisher(RDMA_Manager* rdma_mg, uint8_t target_node_id,
+                uint8_t shard_id, size_t size, uint64_t retire_micros,
+                Env* env, Logger* info_log);
+
+  EditPublisher(const EditPublisher&) = delete;
+  EditPublisher& operator=(const EditPublisher&) = delete;
+
+  // Set up the ring and publish a snapshot of "current", which replaces the
+  // records a previous run left in it.
+  Status Open(Version* current, SequenceNumber last_sequence);
+
+  // Publish "edit", which turns "before" into "after". The calls come in the
+  // order of the edits, VersionSet::LogAndApply() serializes them. After a
+  // failure only a kBroken record is published, the replicas stop serving
+  // reads once they read it.
+  void Publish(VersionEdit* edit, Version* before, Version* after);
+
+  // Split "record" into its kind and its edit. Returns false if it is not a
+  // record of an EditPublisher.
+  static bool DecodeRecord(const Slice& record, Kind* kind, Slice* edit);
+
+ private:
+  // Append a record of "kind" whose edit is "edit".
+  Status Append(Kind kind, const Slice& edit);
+  // Append the snapshot "edit" and truncate the ring before it.
+  Status AppendSnapshot(const Slice& edit);
+  static void EncodeSnapshot(Version* v, SequenceNumber last_sequence,
+                             std::string* dst);
+
+  RemoteLog log_;
+  Env* const env_;
+  Logger* const info_log_;
+  const uint64_t retire_micros_;
+  uint64_t next_number_;
+  // The bytes of the records since the last snapshot, the snapshot included.
+  uint64_t used_;
+  Status error_;
+  // The removed tables and when they may be freed, the oldest first.
+  std::deque<std::pair<uint64_t, std::shared_ptr<RemoteMemTableMetaData>>>
+      retired_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_EDIT_PUBLISHER_H_
@@ -46,6 +46,7 @@
 #include <atomic>
 #include <stdlib.h>
 #include <type_traits>
+#include <vector>
 
 #include "dLSM/slice.h"
 
@@ -150,6 +151,11 @@ class InlineSkipList {
   // Return estimated number of entries smaller than `key`.
   uint64_t EstimateCount(const char* key) const;
 
+  // Append to "keys", in order, the keys of the highest level which links at
+  // least n nodes, or of level 0 if none does. The nodes of a level are an
+  // even sample of the list, so this walks O(n) nodes.
+  void SampleKeys(size_t n, std::vector<const char*>* keys) const;
+
   // Validate correctness of the skip-list.
   void TEST_Validate() const;
 
@@ -244,6 +250,11 @@ class InlineSkipList {
   // Return nullptr if there is no such node.
   Node* FindGreaterOrEqual(const char* key) const;
 
+  // Compare the key of node n with key, whose prefix is key_prefix. The
+  // inline prefixes decide it when they differ.
+  int CompareNodeKey(Node* n, const DecodedKey& key,
+                     uint64_t key_prefix) const;
+
   // Return the latest node with a key < key.
   // Return head_ if there is no such node.
   // Fills prev[level] with pointer to previous node at "level" for every
@@ -314,7 +325,15 @@ struct InlineSkipList<Comparator>::Node {
     return rv;
   }
 
+#ifdef INLINEKEYPREFIX
+  const char* Key() const { return reinterpret_cast<const char*>(this + 1); }
+  // Fixed-width key prefix from Comparator::key_prefix, stored with the link
+  // so that most comparisons of a search never touch the key itself.
+  uint64_t KeyPrefix() const { return key_prefix_; }
+  void SetKeyPrefix(uint64_t prefix) { key_prefix_ = prefix; }
+#else
   const char* Key() const { return reinterpret_cast<const char*>(&next_[1]); }
+#endif
 
   // Accessors/mutators for links.  Wrapped in methods so we can add
   // the appropriate barriers as necessary, and perform the necessary
@@ -361,6 +380,9 @@ struct InlineSkipList<Comparator>::Node {
   // next_[0] is the lowest level link (level 0).  Higher levels are
   // stored _earlier_, so level 1 is at next_[-1].
     std::atomic<Node*> next_[1];
+#ifdef INLINEKEYPREFIX
+  uint64_t key_prefix_;
+#endif
 };
 
 template <class Comparator>
@@ -466,6 +488,20 @@ bool InlineSkipList<Comparator>::KeyIsAfterNode(const DecodedKey& key,
   return (n != nullptr) && (compare_(n->Key(), key) < 0);
 }
 
+template <class Comparator>
+int InlineSkipList<Comparator>::CompareNodeKey(Node* n, const DecodedKey& key,
+                                               uint64_t key_prefix) const {
+#ifdef INLINEKEYPREFIX
+  uint64_t node_prefix = n->KeyPrefix();
+  if (node_prefix != key_prefix) {
+    return node_prefix < key_prefix ? -1 : 1;
+  }
+#else
+  (void)key_prefix;
+#endif
+  return compare_(n->Key(), key);
+}
+
 template <class Comparator>
 typename InlineSkipList<Comparator>::Node*
 InlineSkipList<Comparator>::FindGreaterOrEqual(const char* key) const {
@@ -478,6 +514,11 @@ InlineSkipList<Comparator>::FindGreaterOrEqual(const char* key) const {
   int level = GetMaxHeight() - 1;
   Node* last_bigger = nullptr;
   const DecodedKey key_decoded = compare_.decode_key(key);
+#ifdef INLINEKEYPREFIX
+  const uint64_t key_prefix = compare_.key_prefix(key_decoded);
+#else
+  const uint64_t key_prefix = 0;
+#endif
   while (true) {
     Node* next = x->Next(level);
     if (next != nullptr) {
@@ -489,7 +530,7 @@ InlineSkipList<Comparator>::FindGreaterOrEqual(const char* key) const {
     assert(x == head_ || KeyIsAfterNode(key_decoded, x));
     int cmp = (next == nullptr || next == last_bigger)
                   ? 1
-                  : compare_(next->Key(), key_decoded);
+                  : CompareNodeKey(next, key_decoded, key_prefix);
     if (cmp == 0 || (cmp > 0 && level == 0)) {
       return next;
     } else if (cmp < 0) {
@@ -595,6 +636,24 @@ uint64_t InlineSkipList<Comparator>::EstimateCount(const char* key) const {
   }
 }
 
+template <class Comparator>
+void InlineSkipList<Comparator>::SampleKeys(size_t n,
+                                            std::vector<const char*>* keys) const {
+  for (int level = GetMaxHeight() - 1; level >= 0; level--) {
+    size_t count = 0;
+    for (Node* x = head_->Next(level); x != nullptr && count < n;
+         x = x->Next(level)) {
+      count++;
+    }
+    if (count >= n || level == 0) {
+      for (Node* x = head_->Next(level); x != nullptr; x = x->Next(level)) {
+        keys->push_back(x->Key());
+      }
+      return;
+    }
+  }
+}
+
 template <class Comparator>
 InlineSkipList<Comparator>::InlineSkipList(const Comparator cmp,
                                            ConcurrentArena* arena,
@@ -759,6 +818,10 @@ bool InlineSkipList<Comparator>::Insert(const char* key, Splice* splice,
   //TOTHINK Does key contain both key and value?
   Node* x = reinterpret_cast<Node*>(const_cast<char*>(key)) - 1;
   const DecodedKey key_decoded = compare_.decode_key(key);
+#ifdef INLINEKEYPREFIX
+  // Set before x is linked, the release store of the link publishes it.
+  x->SetKeyPrefix(compare_.key_prefix(key_decoded));
+#endif
   std::string key_snapshot = key_decoded.ToString();
   int height = x->UnstashHeight();
   assert(height >= 1 && height <= kMaxHeight_);
@@ -3,12 +3,25 @@
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
 #include "db/memtable.h"
+
+#include <algorithm>
+#include <optional>
+#include <thread>
+#ifdef NUMA
+#include <numa.h>
+#include <sched.h>
+#endif
+
 #include "db/dbformat.h"
+#include "db/merge_helper.h"
 #include "dLSM/comparator.h"
 #include "dLSM/env.h"
 #include "dLSM/iterator.h"
 #include "db/version_edit.h"
+#include "port/port.h"
+#include "table/merger.h"
 #include "util/coding.h"
+#include "util/hash.h"
 
 namespace dLSM {
 #ifdef PROCESSANALYSIS
@@ -24,15 +37,118 @@ std::atomic<uint64_t> MemTable::foundNum = 0;
 //  return Slice(p, len);
 //}
 
-MemTable::MemTable(const InternalKeyComparator& cmp)
-    : comparator(cmp), refs_(0), table_(comparator, &arena_) {}
+namespace {
+
+std::atomic<uint64_t> next_memtable_id(1);
+
+// The splice the last hinted insert of this thread ended at, for the
+// partition "partition" of the memtable memtable_id.
+struct InsertHint {
+  uint64_t memtable_id = 0;
+  size_t partition = 0;
+  void* splice = nullptr;
+
+  ~InsertHint() { delete[] static_cast<char*>(splice); }
+};
+
+thread_local InsertHint insert_hint_of_thread;
+
+// The entries a thread sorts at least when the entries of a vector table
+// are sorted by several.
+const size_t kMinEntriesPerSortThread = 1 << 16;
+
+// Sort "entries" in the order of "cmp", a part on each of up to
+// hardware_concurrency() threads, and merge the parts.
+void SortEntries(std::vector<const char*>* entries,
+                 const MemTable::KeyComparator& cmp) {
+  auto less = [&cmp](const char* a, const char* b) { return cmp(a, b) < 0; };
+  const size_t threads = std::min<size_t>(
+      std::max(std::thread::hardware_concurrency(), 1u),
+      entries->size() / kMinEntriesPerSortThread);
+  if (threads <= 1) {
+    std::sort(entries->begin(), entries->end(), less);
+    return;
+  }
+  std::vector<size_t> bounds;
+  for (size_t i = 0; i <= threads; i++) {
+    bounds.push_back(entries->size() * i / threads);
+  }
+  std::vector<std::thread> sorters;
+  for (size_t i = 0; i < threads; i++) {
+    sorters.emplace_back([&, i] {
+      std::sort(entries->begin() + bounds[i], entries->begin() + bounds[i + 1],
+                less);
+    });
+  }
+  for (std::thread& sorter : sorters) {
+    sorter.join();
+  }
+  for (size_t width = 1; width < threads; width *= 2) {
+    for (size_t i = 0; i + width < threads; i += 2 * width) {
+      std::inplace_merge(entries->begin() + bounds[i],
+                         entries->begin() + bounds[i + width],
+                         entries->begin() + bounds[std::min(i + 2 * width,
+                                                            threads)],
+                         less);
+    }
+  }
+}
+
+}  // namespace
+
+MemTable::MemTable(const InternalKeyComparator& cmp, int bloom_bits_per_key,
+                   size_t seq_window, size_t huge_page_size,
+                   size_t inplace_update_locks, MemTableRep rep,
+                   size_t partitions)
+    : comparator(cmp),
+      refs_(0),
+      id_(next_memtable_id.fetch_add(1, std::memory_order_relaxed)),
+      arena_(Arena::kMinBlockSize, nullptr, huge_page_size),
+      rep_(rep),
+      table_(comparator, &arena_),
+      bloom_(bloom_bits_per_key > 0
+                 ? new DynamicBloom(seq_window, bloom_bits_per_key)
+                 : nullptr),
+      locks_(inplace_update_locks > 0
+                 ? new Striped<port::RWMutex, Slice>(
+                       inplace_update_locks,
+                       [](const Slice& user_key) {
+                         return Hash(user_key.data(), user_key.size(), 0);
+                       })
+                 : nullptr) {
+  assert(locks_ == nullptr || rep_ == kSkipListMemTable);
+  assert(partitions <= 1 || (rep_ == kSkipListMemTable && locks_ == nullptr));
+  for (size_t i = 1; i < partitions; i++) {
+    partitions_.emplace_back(new Table(comparator, &arena_));
+  }
+  if (rep_ == kHashMemTable) {
+    // About two entries per bucket.
+    num_buckets_ = std::max<size_t>(seq_window / 2, 64);
+    buckets_.reset(new std::atomic<HashNode*>[num_buckets_]);
+    for (size_t i = 0; i < num_buckets_; i++) {
+      buckets_[i].store(nullptr, std::memory_order_relaxed);
+    }
+  } else if (rep_ == kVectorMemTable) {
+    // A write takes one sequence per entry.
+    num_slots_ = seq_window;
+    slots_.reset(new std::atomic<const char*>[num_slots_]);
+    for (size_t i = 0; i < num_slots_; i++) {
+      slots_[i].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+}
 
 MemTable::~MemTable() {
   DEBUG_arg("Memtable %p deallocated\n", this);
   assert(refs_ == 0);
 }
 
-size_t MemTable::ApproximateMemoryUsage() { return arena_.ApproximateMemoryUsage(); }
+size_t MemTable::ApproximateMemoryUsage() {
+  return arena_.ApproximateMemoryUsage() +
+         entries_.capacity() * sizeof(const char*) +
+         num_buckets_ * sizeof(std::atomic<HashNode*>) +
+         num_slots_ * sizeof(std::atomic<const char*>);
+}
 
 int MemTable::KeyComparator::operator()(const char* aptr,
                                         const char* bptr) const {
@@ -50,6 +166,22 @@ const {
   return comparator.Compare(a, key);
 }
 
+#ifdef INLINEKEYPREFIX
+uint64_t MemTable::KeyComparator::key_prefix(
+    const KeyComparator::DecodedType& key) const {
+  if (!bytewise) {
+    return 0;
+  }
+  Slice user_key = ExtractUserKey(key);
+  size_t n = std::min(user_key.size(), sizeof(uint64_t));
+  uint64_t prefix = 0;
+  for (size_t i = 0; i < n; i++) {
+    prefix |= static_cast<uint64_t>(static_cast<uint8_t>(user_key[i]))
+              << (56 - 8 * i);
+  }
+  return prefix;
+}
+#endif
 
 // Encode a suitable internal key target for "target" and return it.
 // Uses *scratch as scratch space, and the returned pointer will point
@@ -61,9 +193,56 @@ static const char* EncodeKey(std::string* scratch, const Slice& target) {
   return scratch->data();
 }
 
+// The entries of a merged memtable, with the interface of the skiplist
+// iterator.
+class EntryArrayIterator {
+ public:
+  EntryArrayIterator(const std::vector<const char*>* entries,
+                     const MemTable::KeyComparator* cmp)
+      : entries_(entries), cmp_(cmp), pos_(entries->size()) {}
+
+  bool Valid() const { return pos_ < entries_->size(); }
+  const char* key() const { return (*entries_)[pos_]; }
+  void Next() { ++pos_; }
+  void Prev() { pos_ = pos_ == 0 ? entries_->size() : pos_ - 1; }
+  void Seek(const char* target) {
+    pos_ = std::lower_bound(entries_->begin(), entries_->end(), target,
+                            [this](const char* entry, const char* t) {
+                              return (*cmp_)(entry, t) < 0;
+                            }) -
+           entries_->begin();
+  }
+  void SeekToFirst() { pos_ = 0; }
+  void SeekToLast() {
+    pos_ = entries_->empty() ? entries_->size() : entries_->size() - 1;
+  }
+
+ private:
+  const std::vector<const char*>* entries_;
+  const MemTable::KeyComparator* cmp_;
+  size_t pos_;
+};
+
+// A sorted copy of the entries of a hash or vector memtable, which the
+// iterator keeps alive.
+class SortedEntryIterator : public EntryArrayIterator {
+ public:
+  SortedEntryIterator(std::shared_ptr<const std::vector<const char*>> entries,
+                      const MemTable::KeyComparator* cmp)
+      : EntryArrayIterator(entries.get(), cmp), entries_(std::move(entries)) {}
+
+ private:
+  std::shared_ptr<const std::vector<const char*>> entries_;
+};
+
+// With "locks", the values of the table may be updated in place, and the
+// entry under the cursor is copied under the read lock of its key.
+template <typename EntryIter>
 class MemTableIterator : public Iterator {
  public:
-  explicit MemTableIterator(MemTable::Table* table) : iter_(table) {}
+  explicit MemTableIterator(EntryIter iter,
+                            Striped<port::RWMutex, Slice>* locks = nullptr)
+      : iter_(std::move(iter)), locks_(locks) {}
 
   MemTableIterator(const MemTableIterator&) = delete;
   MemTableIterator& operator=(const MemTableIterator&) = delete;
@@ -71,13 +250,36 @@ class MemTableIterator : public Iterator {
   ~MemTableIterator() override = default;
 
   bool Valid() const override { return iter_.Valid(); }
-  void Seek(const Slice& k) override { iter_.Seek(EncodeKey(&tmp_, k)); }
-  void SeekToFirst() override { iter_.SeekToFirst(); }
-  void SeekToLast() override { iter_.SeekToLast(); }
-  void Next() override { iter_.Next(); }
-  void Prev() override { iter_.Prev(); }
-  Slice key() const override { return GetLengthPrefixedSlice(iter_.key()); }
+  void Seek(const Slice& k) override {
+    iter_.Seek(EncodeKey(&tmp_, k));
+    Pin();
+  }
+  void SeekToFirst() override {
+    iter_.SeekToFirst();
+    Pin();
+  }
+  void SeekToLast() override {
+    iter_.SeekToLast();
+    Pin();
+  }
+  void Next() override {
+    iter_.Next();
+    Pin();
+  }
+  void Prev() override {
+    iter_.Prev();
+    Pin();
+  }
+  Slice key() const override {
+    if (locks_ != nullptr) {
+      return key_;
+    }
+    return GetLengthPrefixedSlice(iter_.key());
+  }
   Slice value() const override {
+    if (locks_ != nullptr) {
+      return value_;
+    }
     Slice key_slice = GetLengthPrefixedSlice(iter_.key());
     return GetLengthPrefixedSlice(key_slice.data() + key_slice.size());
   }
@@ -85,14 +287,207 @@ class MemTableIterator : public Iterator {
   Status status() const override { return Status::OK(); }
 
  private:
-  MemTable::Table::Iterator iter_;
+  // Copy the entry under the cursor, whose sequence and value a writer may
+  // be overwriting, see MemTable::UpdateInPlace().
+  void Pin() {
+    if (locks_ == nullptr || !iter_.Valid()) {
+      return;
+    }
+    Slice key_slice = GetLengthPrefixedSlice(iter_.key());
+    ReadLock l(locks_->get(ExtractUserKey(key_slice)));
+    key_.assign(key_slice.data(), key_slice.size());
+    Slice value_slice =
+        GetLengthPrefixedSlice(key_slice.data() + key_slice.size());
+    value_.assign(value_slice.data(), value_slice.size());
+  }
+
+  EntryIter iter_;
+  Striped<port::RWMutex, Slice>* const locks_;
   std::string tmp_;  // For passing to EncodeKey
+  // The entry under the cursor with locks_.
+  std::string key_;
+  std::string value_;
 };
 
-Iterator* MemTable::NewIterator() { return new MemTableIterator(&table_); }
+Iterator* MemTable::NewIterator() {
+  if (merged_) {
+    return new MemTableIterator<EntryArrayIterator>(
+        EntryArrayIterator(&entries_, &comparator));
+  }
+  if (rep_ != kSkipListMemTable) {
+    return new MemTableIterator<SortedEntryIterator>(
+        SortedEntryIterator(SortedEntries(), &comparator));
+  }
+  if (partitions_.empty()) {
+    return new MemTableIterator<Table::Iterator>(Table::Iterator(&table_),
+                                                 locks_.get());
+  }
+  // One sorted stream of the partitions, for the flush to write one table.
+  std::vector<Iterator*> list;
+  for (size_t i = 0; i <= partitions_.size(); i++) {
+    list.push_back(
+        new MemTableIterator<Table::Iterator>(Table::Iterator(Partition(i))));
+  }
+  return NewMergingIterator(&comparator.comparator, list.data(),
+                            static_cast<int>(list.size()));
+}
+
+size_t MemTable::PartitionOfThread() const {
+  const size_t partitions = partitions_.size() + 1;
+#ifdef NUMA
+  const int cpu = sched_getcpu();
+  const int node = cpu < 0 ? -1 : numa_node_of_cpu(cpu);
+  if (node >= 0) {
+    return static_cast<size_t>(node) % partitions;
+  }
+#endif
+  // Without the NUMA library the cores are spread over the partitions.
+  const int core = port::PhysicalCoreID();
+  return core < 0 ? 0 : static_cast<size_t>(core) % partitions;
+}
+
+void MemTable::CollectEntries(const LookupKey* key,
+                              std::vector<const char*>* entries) {
+  const Comparator* ucmp = comparator.comparator.user_comparator();
+  auto matches = [&](const char* entry) {
+    return key == nullptr ||
+           ucmp->Compare(ExtractUserKey(GetLengthPrefixedSlice(entry)),
+                         key->user_key()) == 0;
+  };
+  if (rep_ == kHashMemTable) {
+    size_t first = 0;
+    size_t last = num_buckets_;
+    if (key != nullptr) {
+      Slice user_key = key->user_key();
+      first = Hash(user_key.data(), user_key.size(), 0) % num_buckets_;
+      last = first + 1;
+    }
+    for (size_t i = first; i < last; i++) {
+      for (HashNode* node = buckets_[i].load(std::memory_order_acquire);
+           node != nullptr; node = node->next) {
+        if (matches(node->entry)) {
+          entries->push_back(node->entry);
+        }
+      }
+    }
+    return;
+  }
+  assert(rep_ == kVectorMemTable);
+  const size_t taken =
+      std::min(next_slot_.load(std::memory_order_acquire), num_slots_);
+  for (size_t i = 0; i < taken; i++) {
+    const char* entry = slots_[i].load(std::memory_order_acquire);
+    if (entry != nullptr && matches(entry)) {
+      entries->push_back(entry);
+    }
+  }
+  std::lock_guard<std::mutex> l(overflow_mu_);
+  for (const char* entry : overflow_) {
+    if (matches(entry)) {
+      entries->push_back(entry);
+    }
+  }
+}
+
+std::shared_ptr<const std::vector<const char*>> MemTable::SortedEntries() {
+  auto sort = [this] {
+    auto entries = std::make_shared<std::vector<const char*>>();
+    CollectEntries(nullptr, entries.get());
+    SortEntries(entries.get(), comparator);
+    return std::shared_ptr<const std::vector<const char*>>(std::move(entries));
+  };
+  if (!able_to_flush.load()) {
+    return sort();
+  }
+  // The writers are done with the table, which is sorted once for all its
+  // iterators and its flush.
+  std::call_once(sorted_once_, [&] { sorted_ = sort(); });
+  return sorted_;
+}
+
+void MemTable::SampleUserKeys(size_t n, std::vector<std::string>* user_keys) {
+  std::vector<const char*> keys;
+  if (merged_) {
+    const size_t step = std::max<size_t>(entries_.size() / std::max<size_t>(n, 1), 1);
+    for (size_t i = 0; i < entries_.size(); i += step) {
+      keys.push_back(entries_[i]);
+    }
+  } else if (rep_ != kSkipListMemTable) {
+    auto entries = SortedEntries();
+    const size_t step =
+        std::max<size_t>(entries->size() / std::max<size_t>(n, 1), 1);
+    for (size_t i = 0; i < entries->size(); i += step) {
+      keys.push_back((*entries)[i]);
+    }
+  } else if (partitions_.empty()) {
+    table_.SampleKeys(n, &keys);
+  } else {
+    const size_t per_partition = n / (partitions_.size() + 1) + 1;
+    for (size_t i = 0; i <= partitions_.size(); i++) {
+      Partition(i)->SampleKeys(per_partition, &keys);
+    }
+    std::sort(keys.begin(), keys.end(), [this](const char* a, const char* b) {
+      return comparator(a, b) < 0;
+    });
+  }
+  for (const char* key : keys) {
+    user_keys->push_back(ExtractUserKey(GetLengthPrefixedSlice(key)).ToString());
+  }
+}
 
-  void MemTable::Add(SequenceNumber s, ValueType type, const Slice& key,
-                   const Slice& value) {
+bool MemTable::UpdateInPlace(SequenceNumber s, const Slice& key,
+                             const Slice& value) {
+  LookupKey lkey(key, s);
+  Table::Iterator iter(&table_);
+  iter.Seek(lkey.memtable_key().data());
+  if (!iter.Valid()) {
+    return false;
+  }
+  const char* entry = iter.key();
+  uint32_t key_length;
+  char* key_ptr =
+      const_cast<char*>(GetVarint32Ptr(entry, entry + 5, &key_length));
+  if (comparator.comparator.user_comparator()->Compare(
+          Slice(key_ptr, key_length - 8), key) != 0) {
+    return false;
+  }
+  const uint64_t tag = DecodeFixed64(key_ptr + key_length - 8);
+  if (static_cast<ValueType>(tag & 0xff) != kTypeValue) {
+    return false;
+  }
+  // The seek skipped the entries after s, the one found may only be older.
+  assert((tag >> 8) < s);
+  char* value_ptr = key_ptr + key_length;
+  uint32_t value_length;
+  GetVarint32Ptr(value_ptr, value_ptr + 5, &value_length);
+  // Only a value of the same size, the length is never rewritten. The
+  // readers of the entry, the Gets and the iterators, copy it under the
+  // read lock of the key, held here for writing.
+  if (value.size() != value_length) {
+    return false;
+  }
+  std::memcpy(value_ptr + VarintLength(value_length), value.data(),
+              value.size());
+  // The entry stays the first of its key under the new sequence.
+  EncodeFixed64(key_ptr + key_length - 8, (s << 8) | kTypeValue);
+  return true;
+}
+
+void MemTable::Add(SequenceNumber s, ValueType type, const Slice& key,
+                   const Slice& value, bool insert_hint,
+                   bool update_in_place) {
+  // A new entry of the key is ordered against the one updated in place by
+  // their sequences, both wait for each other.
+  std::optional<WriteLock> lock;
+  if (locks_ != nullptr) {
+    lock.emplace(locks_->get(key));
+    if (update_in_place && type == kTypeValue &&
+        UpdateInPlace(s, key, value)) {
+      return;
+    }
+  } else {
+    assert(!update_in_place);
+  }
   // Format of an entry is concatenation of:
   //  key_size     : varint32 of internal_key.size()
   //  key bytes    : char[internal_key.size()]
@@ -104,10 +499,13 @@ Iterator* MemTable::NewIterator() { return new MemTableIterator(&table_); }
   const size_t encoded_len = VarintLength(internal_key_size) +
                              internal_key_size + VarintLength(val_size) +
                              val_size;
+  const size_t partition = partitions_.empty() ? 0 : PartitionOfThread();
+  Table* table = Partition(partition);
   char* buf = nullptr;
   // TODO this is not correct since, the key and value should write to 1
   //  sizeof(Node) larger than the buf now!
-  buf = table_.AllocateKey(encoded_len);
+  buf = rep_ == kSkipListMemTable ? table->AllocateKey(encoded_len)
+                                  : arena_.Allocate(encoded_len);
   char* p = EncodeVarint32(buf, internal_key_size);
   std::memcpy(p, key.data(), key_size);
   p += key_size;
@@ -116,17 +514,55 @@ Iterator* MemTable::NewIterator() { return new MemTableIterator(&table_); }
   p = EncodeVarint32(p, val_size);
   std::memcpy(p, value.data(), val_size);
   assert(p + val_size == buf + encoded_len);
-  table_.InsertConcurrently(buf);
+  if (bloom_ != nullptr) {
+    // Before the insert, so a reader that finds the key also sees its bits.
+    bloom_->AddConcurrently(key);
+  }
+  if (rep_ == kHashMemTable) {
+    auto* node = reinterpret_cast<HashNode*>(
+        arena_.AllocateAligned(sizeof(HashNode)));
+    node->entry = buf;
+    std::atomic<HashNode*>& bucket =
+        buckets_[Hash(key.data(), key.size(), 0) % num_buckets_];
+    node->next = bucket.load(std::memory_order_relaxed);
+    while (!bucket.compare_exchange_weak(node->next, node,
+                                         std::memory_order_release)) {
+    }
+  } else if (rep_ == kVectorMemTable) {
+    const size_t slot = next_slot_.fetch_add(1, std::memory_order_relaxed);
+    if (slot < num_slots_) {
+      slots_[slot].store(buf, std::memory_order_release);
+    } else {
+      std::lock_guard<std::mutex> l(overflow_mu_);
+      overflow_.push_back(buf);
+    }
+  } else if (insert_hint) {
+    InsertHint* hint = &insert_hint_of_thread;
+    if (hint->memtable_id != id_ || hint->partition != partition) {
+      // The splice of another skiplist points into its nodes.
+      delete[] static_cast<char*>(hint->splice);
+      hint->splice = nullptr;
+      hint->memtable_id = id_;
+      hint->partition = partition;
+    }
+    table->InsertWithHintConcurrently(buf, &hint->splice);
+  } else {
+    table->InsertConcurrently(buf);
+  }
 }
 
-bool MemTable::Get(const LookupKey& key, std::string* value, Status* s) {
-#ifdef PROCESSANALYSIS
-  auto start = std::chrono::high_resolution_clock::now();
-#endif
+namespace {
+
+// Walk the entries of the user key of "key" from the seek target on, see
+// MemTable::GetEntry(). The value is copied to *scratch if "copy_value".
+template <typename EntryIter>
+bool FindEntry(EntryIter* iter, const Comparator* ucmp, const LookupKey& key,
+               bool copy_value, ValueType* type, Slice* value,
+               SequenceNumber* seq, std::string* scratch,
+               MergeContext* merge_context) {
   Slice memkey = key.memtable_key();
-  Table::Iterator iter(&table_);
-  iter.Seek(memkey.data());
-  if (iter.Valid()) {
+  // The merge operands are followed to the older entries of the key.
+  for (iter->Seek(memkey.data()); iter->Valid(); iter->Next()) {
     // entry format is:
     //    klength  varint32
     //    userkey  char[klength]
@@ -136,27 +572,112 @@ bool MemTable::Get(const LookupKey& key, std::string* value, Status* s) {
     // Check that it belongs to same user key.  We do not check the
     // sequence number since the Seek() call above should have skipped
     // all entries with overly large sequence numbers.
-    const char* entry = iter.key();
+    const char* entry = iter->key();
     uint32_t key_length;
     const char* key_ptr = GetVarint32Ptr(entry, entry + 5, &key_length);
-    if (comparator.comparator.user_comparator()->Compare(
-            Slice(key_ptr, key_length - 8), key.user_key()) == 0) {
-      // Correct user key
-      const uint64_t tag = DecodeFixed64(key_ptr + key_length - 8);
-      switch (static_cast<ValueType>(tag & 0xff)) {
-        case kTypeValue: {
-          Slice v = GetLengthPrefixedSlice(key_ptr + key_length);
-          value->assign(v.data(), v.size());
+    if (ucmp->Compare(Slice(key_ptr, key_length - 8), key.user_key()) != 0) {
+      break;
+    }
+    // Correct user key
+    const uint64_t tag = DecodeFixed64(key_ptr + key_length - 8);
+    *type = static_cast<ValueType>(tag & 0xff);
+    if (seq != nullptr) {
+      *seq = tag >> 8;
+    }
+    switch (*type) {
+      case kTypeValue: {
+        *value = GetLengthPrefixedSlice(key_ptr + key_length);
+        if (copy_value) {
+          // The value may be overwritten once the lock is released.
+          scratch->assign(value->data(), value->size());
+          *value = Slice(*scratch);
+        }
 #ifdef PROCESSANALYSIS
-          foundNum.fetch_add(1);
+        MemTable::foundNum.fetch_add(1);
 #endif
+        return true;
+      }
+      case kTypeDeletion:
+        return true;
+      case kTypeMerge:
+        if (!merge_context->AddOperand(
+                key.user_key(), tag >> 8,
+                GetLengthPrefixedSlice(key_ptr + key_length))) {
+          // Deleted by a range tombstone, as are the older entries.
+          *type = kTypeDeletion;
           return true;
         }
-        case kTypeDeletion:
-          *s = Status::NotFound(Slice());
-          return true;
+        continue;
+      case kTypeBlobIndex:
+        // Only the tables hold blob indexes.
+        break;
+    }
+    break;
+  }
+  return false;
+}
+
+}  // namespace
+
+bool MemTable::GetEntry(const LookupKey& key, ValueType* type, Slice* value,
+                        SequenceNumber* seq, std::string* scratch,
+                        MergeContext* merge_context) {
+  if (bloom_ != nullptr && !bloom_->MayContain(key.user_key())) {
+    return false;
+  }
+  std::optional<ReadLock> lock;
+  if (locks_ != nullptr) {
+    lock.emplace(locks_->get(key.user_key()));
+  }
+#ifdef PROCESSANALYSIS
+  auto start = std::chrono::high_resolution_clock::now();
+#endif
+  const Comparator* ucmp = comparator.comparator.user_comparator();
+  bool found;
+  if (merged_) {
+    EntryArrayIterator iter(&entries_, &comparator);
+    found = FindEntry(&iter, ucmp, key, false, type, value, seq, scratch,
+                      merge_context);
+  } else if (rep_ != kSkipListMemTable) {
+    // The entries of the key, sorted to walk them as in the skiplist.
+    std::vector<const char*> entries;
+    CollectEntries(&key, &entries);
+    std::sort(entries.begin(), entries.end(),
+              [this](const char* a, const char* b) {
+                return comparator(a, b) < 0;
+              });
+    EntryArrayIterator iter(&entries, &comparator);
+    found = FindEntry(&iter, ucmp, key, false, type, value, seq, scratch,
+                      merge_context);
+  } else if (!partitions_.empty()) {
+    // The entries of the key from every partition, sorted as they would be
+    // in one skiplist.
+    std::vector<const char*> entries;
+    const char* target = key.memtable_key().data();
+    for (size_t i = 0; i <= partitions_.size(); i++) {
+      Table::Iterator iter(Partition(i));
+      for (iter.Seek(target); iter.Valid(); iter.Next()) {
+        if (ucmp->Compare(ExtractUserKey(GetLengthPrefixedSlice(iter.key())),
+                          key.user_key()) != 0) {
+          break;
+        }
+        entries.push_back(iter.key());
       }
     }
+    std::sort(entries.begin(), entries.end(),
+              [this](const char* a, const char* b) {
+                return comparator(a, b) < 0;
+              });
+    EntryArrayIterator iter(&entries, &comparator);
+    found = FindEntry(&iter, ucmp, key, false, type, value, seq, scratch,
+                      merge_context);
+  } else {
+    Table::Iterator iter(&table_);
+    found = FindEntry(&iter, ucmp, key, locks_ != nullptr, type, value, seq,
+                      scratch, merge_context);
+  }
+  if (found) {
+    return true;
   }
 #ifdef PROCESSANALYSIS
   auto stop = std::chrono::high_resolution_clock::now();
@@ -168,4 +689,93 @@ bool MemTable::Get(const LookupKey& key, std::string* value, Status* s) {
   return false;
 }
 
+MemTable* MemTable::Merge(MemTable* newer, MemTable* older,
+                          SequenceNumber smallest_snapshot,
+                          int bloom_bits_per_key) {
+  assert(newer->able_to_flush.load() && older->able_to_flush.load());
+  assert(newer->GetFirstseq() == older->Getlargest_seq_supposed() + 1);
+  const size_t seq_count = older->Get_seq_count() + newer->Get_seq_count();
+  auto* merged = new MemTable(older->comparator.comparator, bloom_bits_per_key,
+                              seq_count);
+  merged->merged_ = true;
+  merged->SetFirstSeq(older->GetFirstseq());
+  merged->SetLargestSeq(newer->Getlargest_seq_supposed());
+  merged->full_table_flush = newer->full_table_flush && older->full_table_flush;
+
+  Iterator* list[2] = {newer->NewIterator(), older->NewIterator()};
+  std::unique_ptr<Iterator> iter(
+      NewMergingIterator(&merged->comparator.comparator, list, 2));
+  FlushEntryFilter filter(merged->comparator.comparator.user_comparator(),
+                          smallest_snapshot);
+  ParsedInternalKey ikey;
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    Slice key = iter->key();
+    const bool parsed = ParseInternalKey(key, &ikey);
+    if (!parsed) {
+      // Kept as it is, the flush reports it.
+      filter.Reset();
+    } else if (!filter.Keep(ikey)) {
+      continue;
+    }
+    Slice value = iter->value();
+    const size_t encoded_len = VarintLength(key.size()) + key.size() +
+                               VarintLength(value.size()) + value.size();
+    char* buf = merged->arena_.Allocate(encoded_len);
+    char* p = EncodeVarint32(buf, key.size());
+    std::memcpy(p, key.data(), key.size());
+    p = EncodeVarint32(p + key.size(), value.size());
+    std::memcpy(p, value.data(), value.size());
+    merged->entries_.push_back(buf);
+    if (merged->bloom_ != nullptr && parsed) {
+      merged->bloom_->AddConcurrently(ikey.user_key);
+    }
+  }
+  merged->entries_.shrink_to_fit();
+  merged->seq_count.store(seq_count);
+  merged->able_to_flush.store(true);
+  return merged;
+}
+
+bool MemTable::Get(const LookupKey& key, std::string* value, Status* s,
+                   MergeContext* merge_context, SequenceNumber* seq) {
+  ValueType type;
+  Slice v;
+  std::string scratch;
+  if (!GetEntry(key, &type, &v, seq, &scratch, merge_context)) {
+    return false;
+  }
+  if (type == kTypeValue) {
+    value->assign(v.data(), v.size());
+  } else {
+    *s = Status::NotFound(Slice());
+  }
+  return true;
+}
+
+static void UnrefMemTable(void* arg1, void* arg2) {
+  reinterpret_cast<MemTable*>(arg1)->Unref();
+}
+
+bool MemTable::Get(const LookupKey& key, PinnableSlice* value, Status* s,
+                   MergeContext* merge_context, SequenceNumber* seq) {
+  ValueType type;
+  Slice v;
+  if (!GetEntry(key, &type, &v, seq, value->GetSelf(), merge_context)) {
+    return false;
+  }
+  if (type == kTypeValue) {
+    if (locks_ != nullptr) {
+      // Copied into the buffer of value, an arena value may be overwritten.
+      value->PinSelf();
+    } else {
+      // The value stays in the arena for as long as the table is referenced.
+      Ref();
+      value->PinSlice(v, &UnrefMemTable, this, nullptr);
+    }
+  } else {
+    *s = Status::NotFound(Slice());
+  }
+  return true;
+}
+
 }  // namespace dLSM
@@ -12,18 +12,60 @@
 // #define MEMTABLE_SEQ_SIZE 610081
 #include "db/dbformat.h"
 #include "db/inlineskiplist.h"
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include "dLSM/db.h"
+#include "dLSM/options.h"
+#include "util/dynamic_bloom.h"
+#include "util/mutexlock.h"
 
 //#include "util/arena_old.h"
 
 namespace dLSM {
 
 class InternalKeyComparator;
-class MemTableIterator;
+class MergeContext;
 class RemoteMemTableMetaData;
 
+// Tells which of the entries of memtables merged in order a flush keeps:
+// an entry is dropped once a newer entry of its user key is visible to
+// every snapshot. The merge operands keep the entries below them.
+class FlushEntryFilter {
+ public:
+  FlushEntryFilter(const Comparator* ucmp, SequenceNumber smallest_snapshot)
+      : ucmp_(ucmp), smallest_snapshot_(smallest_snapshot) {}
+
+  bool Keep(const ParsedInternalKey& ikey) {
+    bool keep = true;
+    if (!has_current_user_key_ ||
+        ucmp_->Compare(ikey.user_key, Slice(current_user_key_)) != 0) {
+      // First occurrence of this user key
+      current_user_key_.assign(ikey.user_key.data(), ikey.user_key.size());
+      has_current_user_key_ = true;
+      last_sequence_for_key_ = kMaxSequenceNumber;
+    } else if (last_sequence_for_key_ <= smallest_snapshot_) {
+      keep = false;
+    }
+    if (ikey.type != kTypeMerge) {
+      last_sequence_for_key_ = ikey.sequence;
+    }
+    return keep;
+  }
+
+  // Forget the current user key, for an entry which could not be parsed.
+  void Reset() { has_current_user_key_ = false; }
+
+ private:
+  const Comparator* const ucmp_;
+  const SequenceNumber smallest_snapshot_;
+  std::string current_user_key_;
+  bool has_current_user_key_ = false;
+  SequenceNumber last_sequence_for_key_ = kMaxSequenceNumber;
+};
+
 class MemTable {
  public:
   struct KeyComparator {
@@ -35,30 +77,71 @@ class MemTable {
       return GetLengthPrefixedSlice(key);
     }
     const InternalKeyComparator comparator;
+#ifdef INLINEKEYPREFIX
+    // Inline prefixes only follow the key order of the bytewise comparator.
+    const bool bytewise;
+    explicit KeyComparator(const InternalKeyComparator& c)
+        : comparator(c), bytewise(c.bytewise()) {}
+    // The first 8 bytes of the user key in big endian, zero padded, so that
+    // unequal prefixes order the same as the keys. Always 0 if the user
+    // comparator is not bytewise, which makes every comparison fall back to
+    // the full key.
+    uint64_t key_prefix(const DecodedType& key) const;
+#else
     explicit KeyComparator(const InternalKeyComparator& c) : comparator(c) {}
+#endif
     int operator()(const char* a, const char* b) const;
     int operator()(const char* prefix_len_key,
                    const DecodedType& key) const;
   };
   //Requested means in the queue but not handled by thread, scheduled means put into the
+  // Merging means it is being merged with its neighbour, see Merge().
   enum FlushStateEnum { FLUSH_NOT_REQUESTED, FLUSH_REQUESTED,
-    FLUSH_PROCESSING, FLUSH_FINISHED};
+    FLUSH_PROCESSING, FLUSH_FINISHED, MERGE_PROCESSING};
   // MemTables are reference counted.  The initial reference count
   // is zero and the caller must call Ref() at least once.
   std::atomic<bool> able_to_flush = false;
   bool full_table_flush=true;
-  std::shared_ptr<RemoteMemTableMetaData> sstable;
+  // The tables its flush wrote, one for every key range of the flush.
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> sstables;
   const KeyComparator comparator;
 #ifdef PROCESSANALYSIS
   static std::atomic<uint64_t> GetTimeElapseSum;
   static std::atomic<uint64_t> GetNum;
   static std::atomic<uint64_t> foundNum;
 #endif
-  explicit MemTable(const InternalKeyComparator& cmp);
+  // A bloom filter of the user keys is kept if bloom_bits_per_key > 0, sized
+  // for the "seq_window" sequences the table is going to take. The arena
+  // takes its blocks from huge pages of "huge_page_size" if it is not 0.
+  // With "inplace_update_locks" above 0 the values may be updated in place,
+  // see Add(), and the entries of a key are guarded by one of that many
+  // locks, only for kSkipListMemTable. "rep" is how the entries are kept.
+  // A kSkipListMemTable without inplace update locks may be split into
+  // "partitions" skiplists, each written by the threads of one NUMA node,
+  // see Add().
+  explicit MemTable(const InternalKeyComparator& cmp,
+                    int bloom_bits_per_key = 0,
+                    size_t seq_window = MEMTABLE_SEQ_SIZE,
+                    size_t huge_page_size = 0,
+                    size_t inplace_update_locks = 0,
+                    MemTableRep rep = kSkipListMemTable,
+                    size_t partitions = 1);
   MemTable(const MemTable&) = delete;
   MemTable& operator=(const MemTable&) = delete;
   ~MemTable();
 
+  // Merge the entries of "newer" and "older", two immutables the writers
+  // are done with whose sequences follow each other, into a new table of
+  // both their sequences. An entry is dropped if a newer entry of its key
+  // is visible to "smallest_snapshot", the merge operands keep the entries
+  // below them. The new table keeps its entries in a sorted array rather
+  // than a skiplist and takes no more writes. The caller must Ref() it.
+  static MemTable* Merge(MemTable* newer, MemTable* older,
+                         SequenceNumber smallest_snapshot,
+                         int bloom_bits_per_key);
+  // True for the tables made by Merge().
+  bool IsMerged() const { return merged_; }
+
   typedef InlineSkipList<KeyComparator> Table;
   Table* GetTable(){
     return &table_;
@@ -68,14 +151,16 @@ class MemTable {
   void NotFullTableflush(){full_table_flush = false;}
   // Drop reference count.  Delete if no more references exist.
   void Unref() {
-    refs_.fetch_sub(1);
-    assert(refs_ >= 0);
+    // The Unref() which takes the count to zero deletes, concurrent ones
+    // must not both see it at zero.
+    int remaining = refs_.fetch_sub(1) - 1;
+    assert(remaining >= 0);
 
-    if (refs_ <= 0) {
+    if (remaining <= 0) {
       // TODO: THis assertion may changed in the future
 #ifndef NDEBUG
       if (full_table_flush){
-        assert(seq_count.load() == MEMTABLE_SEQ_SIZE);
+        assert(seq_count.load() == SeqWindow());
       }
 
 #endif
@@ -101,17 +186,41 @@ class MemTable {
   // db/format.{h,cc} module.
   Iterator* NewIterator();
 
+  // Append to "user_keys" about n or more user keys spread evenly over the
+  // memtable, in order, fewer if it has not as many entries.
+  void SampleUserKeys(size_t n, std::vector<std::string>* user_keys);
+
   // Add an entry into memtable that maps key to value at the
   // specified sequence number and with the specified type.
   // Typically value will be empty if type==kTypeDeletion.
+  // A partitioned table takes it into the partition of the NUMA node the
+  // thread runs on, so that the skiplist nodes a writer touches stay on its
+  // socket. The Gets and the iterators look at every partition.
+  // With "insert_hint" the search starts from where the last insert of this
+  // thread into the memtable ended, which saves the search from the head for
+  // the keys a thread writes in order.
+  // With "update_in_place", a value whose key has a value of the same size
+  // as its newest entry here, at a smaller sequence, overwrites it
+  // instead. The caller makes sure no snapshot needs the old value. Only
+  // for the tables built with inplace update locks.
   void Add(SequenceNumber seq, ValueType type, const Slice& key,
-           const Slice& value);
+           const Slice& value, bool insert_hint = false,
+           bool update_in_place = false);
 
   // If memtable contains a value for key, store it in *value and return true.
   // If memtable contains a deletion for key, store a NotFound() error
   // in *status and return true.
   // Else, return false.
-  bool Get(const LookupKey& key, std::string* value, Status* s);
+  // The merge operands before the value or the deletion are added to
+  // *merge_context, which the caller applies.
+  // If seq is not null, the sequence number of the entry found is stored
+  // in *seq.
+  bool Get(const LookupKey& key, std::string* value, Status* s,
+           MergeContext* merge_context, SequenceNumber* seq = nullptr);
+  // Same as above, but *value refers to the entry in the arena and keeps
+  // this memtable referenced until it is reset.
+  bool Get(const LookupKey& key, PinnableSlice* value, Status* s,
+           MergeContext* merge_context, SequenceNumber* seq = nullptr);
   void SetLargestSeq(uint64_t seq){
     largest_seq_supposed = seq;
   }
@@ -127,6 +236,9 @@ class MemTable {
   bool CheckFlush_Requested(){
     return flush_state_ == FLUSH_REQUESTED;
   }
+  bool CheckMergeInProcess(){
+    return flush_state_ == MERGE_PROCESSING;
+  }
   bool CheckFlushFinished(){
     return flush_state_.load() == FLUSH_FINISHED;
   }
@@ -145,18 +257,22 @@ class MemTable {
   uint64_t Getlargest_seq() const{
     // in case that there is a unfull table flush, the largest seq will be different
     // from the one supposed
-    return largest_seq_supposed - MEMTABLE_SEQ_SIZE + seq_count;
+    return first_seq - 1 + seq_count;
   }
   uint64_t GetFirstseq() const{
     return first_seq;
   }
+  // The number of sequences the table takes, from GetFirstseq() up to
+  // Getlargest_seq_supposed().
+  size_t SeqWindow() const {
+    return largest_seq_supposed - first_seq + 1;
+  }
   void increase_seq_count(size_t num){
-    seq_count.fetch_add(num);
-    assert(num == 1);
-    assert(seq_count <= MEMTABLE_SEQ_SIZE);
-    //TODO; For a write batch you the write may cross the boder, we need to modify
-    // the boder of the next table
-    if (seq_count >= MEMTABLE_SEQ_SIZE){
+    // A write batch crossing the border of this table only accounts the
+    // part of its sequence range that belongs here, see DBImpl::Write.
+    size_t after = seq_count.fetch_add(num) + num;
+    assert(after <= SeqWindow());
+    if (after >= SeqWindow()){
       able_to_flush.store(true);
     }
   }
@@ -164,7 +280,31 @@ class MemTable {
     return seq_count;
   }
  private:
-  friend class MemTableIterator;
+  // Find the newest entry for key which is not a merge operand, the operands
+  // before it are added to *merge_context. If it is a value, *value refers
+  // to it in the arena, or to its copy in *scratch if the values may be
+  // updated in place, and if seq is not null, *seq is its sequence number.
+  // Returns false if there is no such entry for key.
+  bool GetEntry(const LookupKey& key, ValueType* type, Slice* value,
+                SequenceNumber* seq, std::string* scratch,
+                MergeContext* merge_context);
+  // Overwrite the newest entry for "key" if it is a value of the size of
+  // "value", lock held. Returns false if a new entry is needed.
+  bool UpdateInPlace(SequenceNumber s, const Slice& key, const Slice& value);
+  // The entries of a hash or vector table in key order. Sorted once for an
+  // immutable table, every time for one which may still take writes.
+  std::shared_ptr<const std::vector<const char*>> SortedEntries();
+  // The entries of a hash or vector table in no order. Those of the user
+  // key of "key" only, if it is not null, which a vector table still finds
+  // by looking at all of them.
+  void CollectEntries(const LookupKey* key, std::vector<const char*>* entries);
+  // Skiplist "i" of a partitioned table, table_ is the first one.
+  Table* Partition(size_t i) {
+    return i == 0 ? &table_ : partitions_[i - 1].get();
+  }
+  // The partition the calling thread writes to.
+  size_t PartitionOfThread() const;
+
   friend class MemTableBackwardIterator;
 
 
@@ -174,9 +314,41 @@ class MemTable {
 
   std::atomic<int> refs_;
   std::atomic<size_t> seq_count = 0;
+  // Unique over the memtables of the process, the insert hints of a thread
+  // are only used for the memtable they were taken in.
+  const uint64_t id_;
 
   ConcurrentArena arena_;
+  const MemTableRep rep_;
   Table table_;
+  // The skiplists after table_ of a partitioned table, sharing its arena.
+  std::vector<std::unique_ptr<Table>> partitions_;
+  // The buckets of a hash table, the chains of the entries whose user keys
+  // hash to them, newest inserted first.
+  struct HashNode {
+    const char* entry;
+    HashNode* next;
+  };
+  size_t num_buckets_ = 0;
+  std::unique_ptr<std::atomic<HashNode*>[]> buckets_;
+  // The entries of a vector table, in the order they took their slots, a
+  // null slot is being written. The entries past the seq_window slots go to
+  // overflow_.
+  size_t num_slots_ = 0;
+  std::unique_ptr<std::atomic<const char*>[]> slots_;
+  std::atomic<size_t> next_slot_{0};
+  std::mutex overflow_mu_;
+  std::vector<const char*> overflow_;
+  // SortedEntries() of an immutable hash or vector table.
+  std::once_flag sorted_once_;
+  std::shared_ptr<const std::vector<const char*>> sorted_;
+  // The entries of a merged table in key order, in the arena, the skiplist
+  // is empty.
+  bool merged_ = false;
+  std::vector<const char*> entries_;
+  std::unique_ptr<DynamicBloom> bloom_;
+  // Null unless the values may be updated in place, striped by user key.
+  std::unique_ptr<Striped<port::RWMutex, Slice>> locks_;
   std::atomic<FlushStateEnum> flush_state_ = FLUSH_NOT_REQUESTED;
   int64_t first_seq;
   std::atomic<int64_t> largest_seq_till_now = 0;
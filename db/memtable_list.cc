@@ -9,6 +9,7 @@
 #include <limits>
 #include <queue>
 #include <string>
+#include "db/blob.h"
 #include "db/db_impl.h"
 #include "db/memtable.h"
 #include "db/version_set.h"
@@ -16,6 +17,7 @@
 #include "dLSM/env.h"
 #include "dLSM/iterator.h"
 #include "util/coding.h"
+#include "util/perf_context_imp.h"
 #include "table/merger.h"
 #include "db/table_cache.h"
 #include "table/table_builder_computeside.h"
@@ -115,8 +117,15 @@ int MemTableList::NumFlushed() const {
 // Return the most recent value found, if any.
 // Operands stores the list of merge operations to apply, so far.
 bool MemTableListVersion::Get(const LookupKey& key, std::string* value,
-                              Status* s) {
-  return GetFromList(&memlist_, key, value, s);
+                              Status* s, MergeContext* merge_context,
+                              SequenceNumber* seq) {
+  return GetFromList(&memlist_, key, value, s, merge_context, seq);
+}
+
+bool MemTableListVersion::Get(const LookupKey& key, PinnableSlice* value,
+                              Status* s, MergeContext* merge_context,
+                              SequenceNumber* seq) {
+  return GetFromList(&memlist_, key, value, s, merge_context, seq);
 }
 
 //void MemTableListVersion::MultiGet(const ReadOptions& read_options,
@@ -153,16 +162,17 @@ bool MemTableListVersion::Get(const LookupKey& key, std::string* value,
 //                     nullptr /*read_callback*/, is_blob_index);
 //}
 
+template <typename Value>
 bool MemTableListVersion::GetFromList(std::list<MemTable*>* list,
-                                      const LookupKey& key, std::string* value,
-                                      Status* s) {
+                                      const LookupKey& key, Value* value,
+                                      Status* s, MergeContext* merge_context,
+                                      SequenceNumber* seq) {
 //#ifdef GETANALYSIS
 //  auto start = std::chrono::high_resolution_clock::now();
 //#endif
   for (auto& memtable : *list) {
-    SequenceNumber current_seq = kMaxSequenceNumber;
-
-    bool done = memtable->Get(key, value, s);
+    PERF_COUNTER_ADD(imm_searched, 1);
+    bool done = memtable->Get(key, value, s, merge_context, seq);
 
     if (done) {
       return true;
@@ -206,6 +216,13 @@ MemTable* MemTableListVersion::PickMemtablesSeqBelong(size_t seq) {
   }
   return nullptr;
 }
+SequenceNumber MemTableListVersion::GetFirstSequence() const {
+  SequenceNumber first = kMaxSequenceNumber;
+  for (auto iter : memlist_) {
+    first = std::min<SequenceNumber>(first, iter->GetFirstseq());
+  }
+  return first;
+}
 //void MemTableListVersion::AddIterators(
 //    const ReadOptions& options, MergeIteratorBuilder* merge_iter_builder) {
 //  for (auto& m : memlist_) {
@@ -355,7 +372,8 @@ bool MemTableList::AllFlushNotFinished() const {
 }
 // Returns the memtables that need to be flushed.
 //Pick up a configurable number of memtable, not too much and not too less.2~4 could be better
-void MemTableList::PickMemtablesToFlush(autovector<MemTable*>* mems) {
+void MemTableList::PickMemtablesToFlush(autovector<MemTable*>* mems,
+                                        size_t max_memtables) {
 //  AutoThreadOperationStageUpdater stage_updater(
 //      ThreadStatus::STAGE_PICK_MEMTABLES_TO_FLUSH);
   auto current = current_.load();// get a snapshot
@@ -364,6 +382,11 @@ void MemTableList::PickMemtablesToFlush(autovector<MemTable*>* mems) {
   int table_counter = 0;
   for (auto it = memlist.rbegin(); it != memlist.rend(); ++it) {
     MemTable* m = *it;
+    if (m->CheckMergeInProcess()) {
+      // The tables newer than the ones being merged wait for their merge,
+      // so that no flush holds newer entries than a later one.
+      break;
+    }
 
     if (m->CheckFlush_Requested()) {
       //The pickmemtable should never see the flush finished table.
@@ -375,8 +398,8 @@ void MemTableList::PickMemtablesToFlush(autovector<MemTable*>* mems) {
 //      }
 //      m->flush_in_progress_ = true;  // flushing will start very soon
       mems->push_back(m);
-      // at most pick 2 table and do the merge
-      if(++table_counter >= dLSM::config::MaxImmuNumPerFlush)
+      // The picked tables are merged into the same output.
+      if (++table_counter >= static_cast<int>(std::max<size_t>(max_memtables, 1)))
         break;
     }
   }
@@ -386,6 +409,64 @@ void MemTableList::PickMemtablesToFlush(autovector<MemTable*>* mems) {
   }
 }
 
+bool MemTableList::PickMemtablesToMerge(MemTable** newer, MemTable** older,
+                                        int keep_for_flush, size_t max_bytes) {
+  const auto& memlist = current_.load()->memlist_;
+  // The tables waiting for a flush older than the one at hand.
+  int waiting_older = num_flush_not_started_.load();
+  MemTable* candidate = nullptr;
+  for (MemTable* m : memlist) {
+    if (!m->CheckFlush_Requested()) {
+      candidate = nullptr;
+      continue;
+    }
+    if (--waiting_older < keep_for_flush) {
+      return false;
+    }
+    if (!m->able_to_flush.load() || !m->full_table_flush) {
+      candidate = nullptr;
+      continue;
+    }
+    if (candidate != nullptr &&
+        candidate->GetFirstseq() == m->Getlargest_seq_supposed() + 1 &&
+        candidate->ApproximateMemoryUsage() + m->ApproximateMemoryUsage() <=
+            max_bytes) {
+      candidate->SetFlushState(MemTable::MERGE_PROCESSING);
+      m->SetFlushState(MemTable::MERGE_PROCESSING);
+      num_flush_not_started_.fetch_sub(2);
+      *newer = candidate;
+      *older = m;
+      return true;
+    }
+    candidate = m;
+  }
+  return false;
+}
+
+void MemTableList::InstallMergedMemtable(MemTable* newer, MemTable* older,
+                                         MemTable* merged) {
+  assert(newer->CheckMergeInProcess() && older->CheckMergeInProcess());
+  InstallNewVersion();
+  std::list<MemTable*>* memlist = &current_.load()->memlist_;
+  auto it = std::find(memlist->begin(), memlist->end(), newer);
+  assert(it != memlist->end() && std::next(it) != memlist->end() &&
+         *std::next(it) == older);
+  merged->Ref();
+  *it = merged;
+  memlist->erase(std::next(it));
+  current_memory_usage_ += merged->ApproximateMemoryUsage();
+  current_memory_usage_ -=
+      newer->ApproximateMemoryUsage() + older->ApproximateMemoryUsage();
+  // The versions the readers hold keep their own references.
+  newer->Unref();
+  older->Unref();
+  current_memtable_num_.fetch_sub(1);
+  merged->SetFlushState(MemTable::FLUSH_REQUESTED);
+  num_flush_not_started_.fetch_add(1);
+  imm_flush_needed.store(true, std::memory_order_release);
+  UpdateCachedValuesFromMemTableListVersion();
+}
+
 MemTable* MemTableList::PickMemtablesSeqBelong(size_t seq) {
     return current_.load()->PickMemtablesSeqBelong(seq);
 }
@@ -822,47 +903,62 @@ Status FlushJob::BuildTable(const std::string& dbname, Env* env,
                             const Options& options, TableCache* table_cache,
                             Iterator* iter,
                             const std::shared_ptr<RemoteMemTableMetaData>& meta,
-                            IO_type type, uint8_t target_node_id) {
+                            IO_type type, uint8_t target_node_id,
+                            const Slice* smallest_user_key,
+                            const Slice* limit_user_key) {
   Status s;
 //  meta->file_size = 0;
-  iter->SeekToFirst();
+  if (smallest_user_key != nullptr) {
+    InternalKey start(*smallest_user_key, kMaxSequenceNumber,
+                      kValueTypeForSeek);
+    iter->Seek(start.Encode());
+  } else {
+    iter->SeekToFirst();
+  }
+  const Comparator* ucmp = user_cmp->user_comparator();
+  auto in_range = [&]() {
+    return iter->Valid() &&
+           (limit_user_key == nullptr ||
+            ucmp->Compare(ExtractUserKey(iter->key()), *limit_user_key) < 0);
+  };
 #ifndef NDEBUG
   int Not_drop_counter = 0;
   int number_of_key = 0;
 #endif
   ParsedInternalKey ikey;
-  std::string current_user_key;
-  bool has_current_user_key = false;
-  if (iter->Valid()) {
+  // The entries of the memtables of the job come merged, the newest entry
+  // of a user key first.
+  FlushEntryFilter filter(ucmp, smallest_snapshot);
+  if (in_range()) {
 #ifndef BYTEADDRESSABLE
-    auto* builder = new TableBuilder_ComputeSide(options, type, target_node_id);
+    auto* builder = new TableBuilder_ComputeSide(options, type, target_node_id,
+                                                 bloom_bits);
 #endif
 #ifdef BYTEADDRESSABLE
-    auto* builder = new TableBuilder_BACS(options, type, target_node_id);
+    auto* builder =
+        new TableBuilder_BACS(options, type, target_node_id, 0, bloom_bits);
 #endif
-    meta->smallest.DecodeFrom(iter->key());
+    meta->largest_seq = 0;
+    // The large values go to blob chunks, their entries become blob
+    // indexes. The values too large for a data chunk always do.
+    std::unique_ptr<BlobWriter> blob_writer(
+        new BlobWriter(options.env->rdma_mg, meta->shard_target_node_id));
+    std::string blob_key;
+    std::string blob_index;
+    bool first = true;
     Slice key;
-    for (; iter->Valid(); iter->Next()) {
+    for (; in_range(); iter->Next()) {
       key = iter->key();
 //      assert(key.data()[0] == '0');
       bool drop = false;
       if (!ParseInternalKey(key, &ikey)) {
         // Do not hide error keys
-        current_user_key.clear();
-        has_current_user_key = false;
+        filter.Reset();
         printf("Corrupt key value detected\n");
         s = Status::IOError("Corrupt key value detected\n");
         break;
       } else {
-        if (!has_current_user_key ||
-            user_cmp->Compare(ikey.user_key, Slice(current_user_key)) != 0) {
-          // First occurrence of this user key
-          current_user_key.assign(ikey.user_key.data(), ikey.user_key.size());
-          has_current_user_key = true;
-          // this will result in the key not drop, next if will always be false because of the last_sequence_for_key.
-        }else{
-          drop = true;
-        }
+        drop = !filter.Keep(ikey);
       }
 #ifndef NDEBUG
       number_of_key++;
@@ -871,7 +967,24 @@ Status FlushJob::BuildTable(const std::string& dbname, Env* env,
 #ifndef NDEBUG
         Not_drop_counter++;
 #endif
-        builder->Add(key, iter->value());
+        Slice value = iter->value();
+        if (ikey.type == kTypeValue &&
+            ((options.min_blob_size > 0 &&
+              value.size() >= options.min_blob_size) ||
+             TooLargeForTable(options.env->rdma_mg.get(), key, value))) {
+          blob_writer->Add(value, &blob_index);
+          blob_key.assign(key.data(), key.size() - 8);
+          PutFixed64(&blob_key,
+                     PackSequenceAndType(ikey.sequence, kTypeBlobIndex));
+          key = blob_key;
+          value = blob_index;
+        }
+        if (first) {
+          meta->smallest.DecodeFrom(key);
+          first = false;
+        }
+        builder->Add(key, value);
+        meta->largest_seq = std::max(meta->largest_seq, ikey.sequence);
       }
 
     }
@@ -890,9 +1003,18 @@ Status FlushJob::BuildTable(const std::string& dbname, Env* env,
     // Finish and check for builder errors
 
     s = builder->Finish();
+    {
+      std::vector<uint64_t> chunks;
+      Status blob_status = blob_writer->Finish(&chunks);
+      if (s.ok()) {
+        s = blob_status;
+      }
+      meta->SetBlobChunks(std::move(chunks));
+    }
     builder->get_datablocks_map(meta->remote_data_mrs);
     builder->get_dataindexblocks_map(meta->remote_dataindex_mrs);
     builder->get_filter_map(meta->remote_filter_mrs);
+    meta->prefix_extractor = FilterPrefixName(options);
 
 
     meta->file_size = 0;
@@ -901,6 +1023,9 @@ Status FlushJob::BuildTable(const std::string& dbname, Env* env,
       meta->file_size += iter.second->length;
     }
     meta->num_entries = builder->get_numentries();
+    meta->num_deletions = builder->NumDeletions();
+    meta->key_stats = builder->KeyStats();
+    meta->creation_time = options.env->NowMicros() / 1000000;
     DEBUG_arg("SSTable size is %lu \n", meta->file_size);
     assert(builder->FileSize() == meta->file_size);
     delete builder;
@@ -60,7 +60,13 @@ class MemTableListVersion {
   // If any operation was found for this key, its most recent sequence number
   // will be stored in *seq on success (regardless of whether true/false is
   // returned).  Otherwise, *seq will be set to kMaxSequenceNumber.
-  bool Get(const LookupKey& key, std::string* value,Status* s);
+  // The merge operands met before are added to *merge_context, see
+  // MemTable::Get().
+  bool Get(const LookupKey& key, std::string* value, Status* s,
+           MergeContext* merge_context, SequenceNumber* seq = nullptr);
+  // Same as above, but *value pins the memtable which holds the value.
+  bool Get(const LookupKey& key, PinnableSlice* value, Status* s,
+           MergeContext* merge_context, SequenceNumber* seq = nullptr);
 
 //  bool Get(const LookupKey& key, std::string* value, std::string* timestamp,
 //           Status* s, MergeContext* merge_context,
@@ -112,6 +118,9 @@ class MemTableListVersion {
                     std::vector<Iterator*>* iterator_list,
                     Arena* arena);
   MemTable* PickMemtablesSeqBelong(size_t seq);
+  // The smallest first sequence number of the memtables in the list, or
+  // kMaxSequenceNumber if the list is empty.
+  SequenceNumber GetFirstSequence() const;
 //  void AddIterators(const ReadOptions& options,
 //                    MergeIteratorBuilder* merge_iter_builder);
 
@@ -150,8 +159,10 @@ class MemTableListVersion {
   // Return true if memtable is trimmed
   bool TrimHistory(size_t usage);
 
+  template <typename Value>
   bool GetFromList(std::list<MemTable*>* list, const LookupKey& key,
-                   std::string* value, Status* s);
+                   Value* value, Status* s, MergeContext* merge_context,
+                   SequenceNumber* seq);
 
   void AddMemTable(MemTable* m);
 
@@ -246,9 +257,21 @@ class MemTableList {
   bool IsFlushPending() const;
   bool IsFlushDoable() const;
   bool AllFlushNotFinished() const;
-  // Returns the earliest memtables that needs to be flushed. The returned
-  // memtables are guaranteed to be in the ascending order of created time.
-  void PickMemtablesToFlush(autovector<MemTable*>* mems);
+  // Returns the earliest memtables that needs to be flushed, at most
+  // max_memtables of them. The returned memtables are guaranteed to be in
+  // the ascending order of created time.
+  void PickMemtablesToFlush(autovector<MemTable*>* mems, size_t max_memtables);
+  // Pick two neighbouring immutables waiting for a flush which the writers
+  // are done with and which take up to "max_bytes" together, *newer and
+  // *older, to be merged by MemTable::Merge(). At least "keep_for_flush"
+  // tables waiting for a flush are left older than them, the next flush
+  // takes those. Returns false if there are no such tables.
+  bool PickMemtablesToMerge(MemTable** newer, MemTable** older,
+                            int keep_for_flush, size_t max_bytes);
+  // Replace the tables PickMemtablesToMerge() picked with "merged" in a
+  // new version, which waits for a flush in their place.
+  void InstallMergedMemtable(MemTable* newer, MemTable* older,
+                             MemTable* merged);
   MemTable* PickMemtablesSeqBelong(size_t seq);
   // Reset status of the given memtable list back to pending state so that
   // they can get picked up again on the next round of flush.
@@ -425,14 +448,25 @@ class FlushJob {
 
 //  std::mutex* imm_mtx_;
   std::condition_variable* write_stall_cv_;
-  std::shared_ptr<RemoteMemTableMetaData> sst;
+  // The tables of the flush, one for every key range it is split into.
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> ssts;
   const InternalKeyComparator* user_cmp;
+  // The oldest snapshot, the entries it reads are kept by BuildTable().
+  SequenceNumber smallest_snapshot = kMaxSequenceNumber;
+  // The bits per key of the filters of the tables, see
+  // VersionSet::BloomBitsForLevel(). Options::bloom_bits if negative.
+  int bloom_bits = -1;
   void Waitforpendingwriter();
   void SetAllMemStateProcessing();
+  // Build "meta" out of the entries of "iter" whose user keys are at or after
+  // smallest_user_key and before limit_user_key, either bound is open if it
+  // is nullptr.
   Status BuildTable(const std::string& dbname, Env* env, const Options& options,
                     TableCache* table_cache, Iterator* iter,
                     const std::shared_ptr<RemoteMemTableMetaData>& meta,
-                    IO_type type, uint8_t target_node_id);
+                    IO_type type, uint8_t target_node_id,
+                    const Slice* smallest_user_key = nullptr,
+                    const Slice* limit_user_key = nullptr);
 
 };
 // Installs memtable atomic flush results.
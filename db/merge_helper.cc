@@ -0,0 +1,261 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/merge_helper.h"
+
+#include "db/blob.h"
+#include <utility>
+
+#include "db/range_tombstone.h"
+#include "dLSM/comparator.h"
+#include "dLSM/iterator.h"
+#include "dLSM/merge_operator.h"
+
+namespace dLSM {
+
+MergeContext::MergeContext(const MergeOperator* merge_operator,
+                           const Comparator* ucmp,
+                           const RangeTombstones* range_tombstones,
+                           SequenceNumber snapshot)
+    : merge_operator_(merge_operator),
+      ucmp_(ucmp),
+      range_tombstones_(range_tombstones),
+      snapshot_(snapshot) {}
+
+bool MergeContext::AddOperand(const Slice& user_key, SequenceNumber sequence,
+                              const Slice& operand) {
+  if (range_tombstones_ != nullptr &&
+      range_tombstones_->ShouldDelete(ucmp_, user_key, sequence, snapshot_)) {
+    return false;
+  }
+  operands_.emplace_back(operand.data(), operand.size());
+  return true;
+}
+
+Status MergeContext::Finish(const Slice& user_key, const Status& s,
+                            std::string* value) const {
+  if (operands_.empty() || !(s.ok() || s.IsNotFound())) {
+    return s;
+  }
+  if (merge_operator_ == nullptr) {
+    return Status::InvalidArgument("no merge operator for ", user_key);
+  }
+  std::vector<Slice> operands(operands_.rbegin(), operands_.rend());
+  const Slice base(*value);
+  std::string merged;
+  if (!merge_operator_->FullMerge(user_key, s.ok() ? &base : nullptr,
+                                  operands, &merged)) {
+    return Status::Corruption("merge failed for ", user_key);
+  }
+  value->swap(merged);
+  return Status::OK();
+}
+
+namespace {
+
+class CompactionMergeIterator : public Iterator {
+ public:
+  CompactionMergeIterator(Iterator* input, const Comparator* ucmp,
+                          const MergeOperator* merge_operator,
+                          SequenceNumber smallest_snapshot,
+                          const RangeTombstones* range_tombstones,
+                          bool bottommost, RDMA_Manager* rdma_mg)
+      : input_(input),
+        ucmp_(ucmp),
+        merge_operator_(merge_operator),
+        smallest_snapshot_(smallest_snapshot),
+        range_tombstones_(range_tombstones),
+        bottommost_(bottommost),
+        rdma_mg_(rdma_mg),
+        in_merged_(false),
+        merged_index_(0),
+        has_done_key_(false) {}
+
+  CompactionMergeIterator(const CompactionMergeIterator&) = delete;
+  CompactionMergeIterator& operator=(const CompactionMergeIterator&) = delete;
+
+  ~CompactionMergeIterator() override { delete input_; }
+
+  bool Valid() const override {
+    return status_.ok() && (in_merged_ || input_->Valid());
+  }
+  void SeekToFirst() override {
+    has_done_key_ = false;
+    input_->SeekToFirst();
+    Prepare();
+  }
+  void SeekToLast() override {
+    status_ = Status::NotSupported("SeekToLast of a compaction input");
+  }
+  void Seek(const Slice& target) override {
+    has_done_key_ = false;
+    input_->Seek(target);
+    Prepare();
+  }
+  void Next() override {
+    assert(Valid());
+    if (in_merged_) {
+      if (++merged_index_ < merged_.size()) {
+        return;
+      }
+      // The input is past the operands already.
+      in_merged_ = false;
+    } else {
+      input_->Next();
+    }
+    Prepare();
+  }
+  void Prev() override {
+    status_ = Status::NotSupported("Prev of a compaction input");
+  }
+  Slice key() const override {
+    return in_merged_ ? Slice(merged_[merged_index_].first) : input_->key();
+  }
+  Slice value() const override {
+    return in_merged_ ? Slice(merged_[merged_index_].second)
+                      : input_->value();
+  }
+  Status status() const override {
+    return status_.ok() ? input_->status() : status_;
+  }
+
+ private:
+  bool Deleted(const ParsedInternalKey& ikey) const {
+    return range_tombstones_ != nullptr &&
+           range_tombstones_->ShouldDelete(ucmp_, ikey.user_key, ikey.sequence,
+                                           smallest_snapshot_);
+  }
+
+  // The input is at the next entry, merge the operands starting there.
+  void Prepare() {
+    if (!input_->Valid()) {
+      return;
+    }
+    ParsedInternalKey ikey;
+    if (!ParseInternalKey(input_->key(), &ikey) ||
+        ikey.sequence > smallest_snapshot_) {
+      return;
+    }
+    if (ikey.type != kTypeMerge) {
+      // The operands below it are hidden from every snapshot.
+      done_key_.assign(ikey.user_key.data(), ikey.user_key.size());
+      has_done_key_ = true;
+      return;
+    }
+    if ((has_done_key_ && ucmp_->Compare(ikey.user_key, done_key_) == 0) ||
+        Deleted(ikey)) {
+      return;
+    }
+    MergeOperands(ikey);
+  }
+
+  void MergeOperands(const ParsedInternalKey& first) {
+    std::string user_key = first.user_key.ToString();
+    // The newest first, the keys are the ones of the input.
+    std::vector<std::pair<std::string, std::string>> operands;
+    operands.emplace_back(input_->key().ToString(), input_->value().ToString());
+    bool has_base = false;
+    bool has_value = false;
+    std::string base;
+    for (input_->Next(); input_->Valid(); input_->Next()) {
+      ParsedInternalKey ikey;
+      if (!ParseInternalKey(input_->key(), &ikey) ||
+          ucmp_->Compare(ikey.user_key, user_key) != 0) {
+        break;
+      }
+      if (ikey.type == kTypeMerge && !Deleted(ikey)) {
+        operands.emplace_back(input_->key().ToString(),
+                              input_->value().ToString());
+        continue;
+      }
+      // A value or a deletion, which stays in the input for the compaction
+      // to drop.
+      has_base = true;
+      if (ikey.type == kTypeValue && !Deleted(ikey)) {
+        has_value = true;
+        base = input_->value().ToString();
+      } else if (ikey.type == kTypeBlobIndex && !Deleted(ikey)) {
+        has_value = true;
+        status_ = ReadBlob(rdma_mg_, input_->value(), &base);
+        if (!status_.ok()) {
+          return;
+        }
+      }
+      break;
+    }
+    merged_.clear();
+    merged_index_ = 0;
+    if (has_base || bottommost_) {
+      std::vector<Slice> list;
+      for (auto iter = operands.rbegin(); iter != operands.rend(); ++iter) {
+        list.push_back(iter->second);
+      }
+      const Slice base_slice(base);
+      std::string value;
+      if (!merge_operator_->FullMerge(user_key,
+                                      has_value ? &base_slice : nullptr, list,
+                                      &value)) {
+        status_ = Status::Corruption("merge failed for ", user_key);
+        return;
+      }
+      std::string key;
+      AppendInternalKey(&key, ParsedInternalKey(user_key, first.sequence,
+                                                kTypeValue));
+      merged_.emplace_back(std::move(key), std::move(value));
+      done_key_.swap(user_key);
+      has_done_key_ = true;
+    } else {
+      // Combined from the oldest on, the result takes the newest key.
+      std::string combined = operands.back().second;
+      bool all_combined = true;
+      for (size_t i = operands.size() - 1; i-- > 0;) {
+        std::string result;
+        if (!merge_operator_->PartialMerge(user_key, combined,
+                                           operands[i].second, &result)) {
+          all_combined = false;
+          break;
+        }
+        combined.swap(result);
+      }
+      if (all_combined) {
+        merged_.emplace_back(std::move(operands.front().first),
+                             std::move(combined));
+      } else {
+        merged_.swap(operands);
+      }
+    }
+    in_merged_ = true;
+  }
+
+  Iterator* const input_;
+  const Comparator* const ucmp_;
+  const MergeOperator* const merge_operator_;
+  const SequenceNumber smallest_snapshot_;
+  const RangeTombstones* const range_tombstones_;
+  const bool bottommost_;
+  RDMA_Manager* const rdma_mg_;
+  Status status_;
+  // The entries which replace the operands while in_merged_, kept until the
+  // next operands are merged.
+  bool in_merged_;
+  std::vector<std::pair<std::string, std::string>> merged_;
+  size_t merged_index_;
+  // A key whose entries after the input are hidden from every snapshot.
+  bool has_done_key_;
+  std::string done_key_;
+};
+
+}  // namespace
+
+Iterator* NewCompactionMergeIterator(Iterator* input, const Comparator* ucmp,
+                                     const MergeOperator* merge_operator,
+                                     SequenceNumber smallest_snapshot,
+                                     const RangeTombstones* range_tombstones,
+                                     bool bottommost, RDMA_Manager* rdma_mg) {
+  return new CompactionMergeIterator(input, ucmp, merge_operator,
+                                     smallest_snapshot, range_tombstones,
+                                     bottommost, rdma_mg);
+}
+
+}  // namespace dLSM
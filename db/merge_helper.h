@@ -0,0 +1,78 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_MERGE_HELPER_H_
+#define STORAGE_dLSM_DB_MERGE_HELPER_H_
+
+#include <string>
+#include <vector>
+
+#include "db/dbformat.h"
+#include "dLSM/status.h"
+
+namespace dLSM {
+
+class Comparator;
+class Iterator;
+class MergeOperator;
+class RDMA_Manager;
+class RangeTombstones;
+
+// The merge operands a point lookup meets for its key, from the newest on,
+// until it finds the value or the deletion they apply to.
+class MergeContext {
+ public:
+  // The operands deleted by "range_tombstones" at "snapshot" end the lookup
+  // as a deletion would. "range_tombstones" may be null.
+  MergeContext(const MergeOperator* merge_operator, const Comparator* ucmp,
+               const RangeTombstones* range_tombstones,
+               SequenceNumber snapshot);
+
+  MergeContext(const MergeContext&) = delete;
+  MergeContext& operator=(const MergeContext&) = delete;
+
+  bool empty() const { return operands_.empty(); }
+
+  // Record the operand of "user_key" at "sequence", older than those added
+  // before. Returns false if a range tombstone deletes it.
+  bool AddOperand(const Slice& user_key, SequenceNumber sequence,
+                  const Slice& operand);
+
+  // Finish the lookup of "user_key" which ended with "s": OK if *value
+  // holds the value below the operands, NotFound if there is none. The
+  // operands are applied to it into *value. Other statuses are returned as
+  // they are, as is "s" if there are no operands.
+  Status Finish(const Slice& user_key, const Status& s,
+                std::string* value) const;
+
+ private:
+  const MergeOperator* const merge_operator_;
+  const Comparator* const ucmp_;
+  const RangeTombstones* const range_tombstones_;
+  const SequenceNumber snapshot_;
+  // The newest first.
+  std::vector<std::string> operands_;
+};
+
+// Return an iterator over the entries of the compaction input "input" in
+// which the merge operands of a key that no snapshot after
+// "smallest_snapshot" reads are applied to the value below them, which
+// replaces them by one value at the sequence of the newest one. The
+// operands without a value below them in the input are combined by
+// MergeOperator::PartialMerge() or kept as they are, unless "bottommost" says
+// there is nothing older in the database, then they are applied to no
+// value. The entries which "range_tombstones", if not null, deletes at
+// "smallest_snapshot" count as deletions. The other entries come as they
+// are, the compaction drops the ones the new values hide. A blob value
+// below the operands is read through "rdma_mg". Only moves forward. Takes
+// the ownership of "input".
+Iterator* NewCompactionMergeIterator(Iterator* input, const Comparator* ucmp,
+                                     const MergeOperator* merge_operator,
+                                     SequenceNumber smallest_snapshot,
+                                     const RangeTombstones* range_tombstones,
+                                     bool bottommost, RDMA_Manager* rdma_mg);
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_MERGE_HELPER_H_
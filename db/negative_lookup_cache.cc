@@ -0,0 +1,125 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/negative_lookup_cache.h"
+
+#include "dLSM/write_batch.h"
+
+#include "util/hash.h"
+
+namespace dLSM {
+
+namespace {
+
+// Writes to different keys of a stripe invalidate each other's entries.
+constexpr size_t kNumStripes = 4096;
+
+void DeleteNothing(const Slice& /*key*/, void* /*value*/) {}
+
+}  // namespace
+
+class NegativeLookupCache::StripeUpdater : public WriteBatch::Handler {
+ public:
+  StripeUpdater(const NegativeLookupCache* cache, bool begin)
+      : cache_(cache), begin_(begin) {}
+
+  void Put(const Slice& key, const Slice& /*value*/) override { Update(key); }
+  void Delete(const Slice& key) override { Update(key); }
+  void Merge(const Slice& key, const Slice& /*value*/) override {
+    Update(key);
+  }
+
+ private:
+  void Update(const Slice& key) {
+    Stripe* stripe = cache_->StripeOf(key);
+    if (begin_) {
+      stripe->started.fetch_add(1);
+    } else {
+      stripe->finished.fetch_add(1, std::memory_order_release);
+    }
+  }
+
+  const NegativeLookupCache* cache_;
+  const bool begin_;
+};
+
+NegativeLookupCache::NegativeLookupCache(size_t capacity)
+    : cache_(NewLRUCache(capacity)), stripes_(new Stripe[kNumStripes]) {}
+
+NegativeLookupCache::~NegativeLookupCache() { delete cache_; }
+
+NegativeLookupCache::Stripe* NegativeLookupCache::StripeOf(
+    const Slice& user_key) const {
+  return &stripes_[Hash(user_key.data(), user_key.size(), 0x4e4c4300) %
+                   kNumStripes];
+}
+
+void NegativeLookupCache::BeginWrite(const WriteBatch* batch) {
+  // The start is counted before the key becomes visible, so that a reader
+  // which finds the key missing in the memtable after that sees the entry
+  // stale.
+  StripeUpdater updater(this, true);
+  batch->Iterate(&updater);
+}
+
+void NegativeLookupCache::EndWrite(const WriteBatch* batch) {
+  StripeUpdater updater(this, false);
+  batch->Iterate(&updater);
+}
+
+void NegativeLookupCache::BeginWrite(const Slice& user_key) {
+  StripeOf(user_key)->started.fetch_add(1);
+}
+
+void NegativeLookupCache::EndWrite(const Slice& user_key) {
+  StripeOf(user_key)->finished.fetch_add(1, std::memory_order_release);
+}
+
+void NegativeLookupCache::BeginWriteAll() {
+  for (size_t i = 0; i < kNumStripes; i++) {
+    stripes_[i].started.fetch_add(1);
+  }
+}
+
+void NegativeLookupCache::EndWriteAll() {
+  for (size_t i = 0; i < kNumStripes; i++) {
+    stripes_[i].finished.fetch_add(1, std::memory_order_release);
+  }
+}
+
+bool NegativeLookupCache::KnownMissing(const Slice& user_key) {
+  Cache::Handle* handle = cache_->Lookup(user_key);
+  if (handle == nullptr) {
+    return false;
+  }
+  uint64_t stamp = reinterpret_cast<uintptr_t>(cache_->Value(handle));
+  cache_->Release(handle);
+  if (StripeOf(user_key)->started.load() == stamp) {
+    return true;
+  }
+  cache_->Erase(user_key);
+  return false;
+}
+
+bool NegativeLookupCache::Stamp(const Slice& user_key, uint64_t* stamp) const {
+  // No write may be in flight. If the finished count read first equals the
+  // started count read next, every write begun so far was in the memtable
+  // when the finished count was read, and the lookup which follows sees it.
+  Stripe* stripe = StripeOf(user_key);
+  uint64_t finished = stripe->finished.load(std::memory_order_acquire);
+  uint64_t started = stripe->started.load();
+  if (started != finished) {
+    return false;
+  }
+  *stamp = started;
+  return true;
+}
+
+void NegativeLookupCache::Insert(const Slice& user_key, uint64_t stamp) {
+  cache_->Release(cache_->Insert(
+      user_key, reinterpret_cast<void*>(static_cast<uintptr_t>(stamp)), 1,
+      &DeleteNothing));
+}
+
+}  // namespace dLSM
@@ -0,0 +1,73 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_NEGATIVE_LOOKUP_CACHE_H_
+#define STORAGE_dLSM_DB_NEGATIVE_LOOKUP_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "dLSM/cache.h"
+#include "dLSM/slice.h"
+
+namespace dLSM {
+
+class WriteBatch;
+
+// A bounded cache of the user keys which a Get() without snapshot has found
+// missing, so that a repeated lookup of one of them is answered without
+// touching the memtables, the filters or the memory nodes.
+//
+// The keys are hashed to stripes which count the writes that started and
+// finished inserting their keys into a memtable. An entry remembers the
+// count of its stripe when the lookup began, and is stale as soon as another
+// write to the stripe starts.
+class NegativeLookupCache {
+ public:
+  // capacity is the number of keys kept.
+  explicit NegativeLookupCache(size_t capacity);
+  ~NegativeLookupCache();
+
+  NegativeLookupCache(const NegativeLookupCache&) = delete;
+  NegativeLookupCache& operator=(const NegativeLookupCache&) = delete;
+
+  // Call around the memtable insert of "batch".
+  void BeginWrite(const WriteBatch* batch);
+  void EndWrite(const WriteBatch* batch);
+  // The same for a write of the single key user_key.
+  void BeginWrite(const Slice& user_key);
+  void EndWrite(const Slice& user_key);
+  // The same for a change which may add any key, such as tables installed
+  // without a write. The entries cached before it are stale after it.
+  void BeginWriteAll();
+  void EndWriteAll();
+
+  // Returns true if user_key is known to be missing.
+  bool KnownMissing(const Slice& user_key);
+
+  // Call before the lookup of user_key. Returns false if a write to the
+  // stripe of the key is in flight, the result of the lookup must not be
+  // cached then. Otherwise sets *stamp for Insert().
+  bool Stamp(const Slice& user_key, uint64_t* stamp) const;
+  // Record that the lookup stamped with "stamp" found user_key missing.
+  void Insert(const Slice& user_key, uint64_t stamp);
+
+ private:
+  struct Stripe {
+    std::atomic<uint64_t> started{0};
+    std::atomic<uint64_t> finished{0};
+  };
+  class StripeUpdater;
+
+  Stripe* StripeOf(const Slice& user_key) const;
+
+  Cache* const cache_;
+  std::unique_ptr<Stripe[]> stripes_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_NEGATIVE_LOOKUP_CACHE_H_
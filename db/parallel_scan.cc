@@ -0,0 +1,143 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/parallel_scan.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "db/db_impl.h"
+#include "util/bounded_queue.h"
+#include "util/coding.h"
+
+namespace dLSM {
+
+namespace {
+
+// The entries a partition hands to the calling thread at once, and the
+// batches it reads ahead of it.
+const size_t kScanBatchBytes = 1 << 20;
+const size_t kScanBatchesAhead = 4;
+
+Iterator* NewPartitionIterator(const ReadOptions& options,
+                               const ScanPartition& partition) {
+#ifdef BYTEADDRESSABLE
+  // Every partition gets prefetch buffers of its own.
+  return partition.db->NewSEQIterator(options);
+#else
+  return partition.db->NewIterator(options);
+#endif
+}
+
+// Pass the entries of "partition" to "emit" until it returns false.
+Status ScanRange(const ScanPartition& partition,
+                 const DB::ScanCallback& emit) {
+  // The files past the partition are not read.
+  ReadOptions options = partition.options;
+  Slice limit(partition.limit);
+  if (!partition.limit.empty()) {
+    options.iterate_upper_bound = &limit;
+  }
+  Iterator* iter = NewPartitionIterator(options, partition);
+  if (partition.start.empty()) {
+    iter->SeekToFirst();
+  } else {
+    iter->Seek(partition.start);
+  }
+  for (; iter->Valid(); iter->Next()) {
+    if (!partition.limit.empty() &&
+        partition.comparator->Compare(iter->key(), partition.limit) >= 0) {
+      break;
+    }
+    if (!emit(iter->key(), iter->value())) {
+      break;
+    }
+  }
+  Status s = iter->status();
+  delete iter;
+  return s;
+}
+
+}  // namespace
+
+Status RunParallelScan(const std::vector<ScanPartition>& partitions,
+                       bool ordered, const DB::ScanCallback& callback) {
+  std::atomic<bool> stop(false);
+  std::vector<Status> statuses(partitions.size());
+  std::vector<std::thread> threads;
+  threads.reserve(partitions.size());
+  if (!ordered) {
+    for (size_t i = 0; i < partitions.size(); i++) {
+      threads.emplace_back([&, i]() {
+        statuses[i] = ScanRange(partitions[i], [&](const Slice& key,
+                                                   const Slice& value) {
+          if (stop.load(std::memory_order_relaxed)) {
+            return false;
+          }
+          if (!callback(key, value)) {
+            stop.store(true, std::memory_order_relaxed);
+            return false;
+          }
+          return true;
+        });
+      });
+    }
+  } else {
+    // The batches hold the entries as length prefixed keys and values.
+    std::vector<std::unique_ptr<BoundedQueue<std::string>>> queues;
+    for (size_t i = 0; i < partitions.size(); i++) {
+      queues.emplace_back(new BoundedQueue<std::string>(kScanBatchesAhead));
+    }
+    for (size_t i = 0; i < partitions.size(); i++) {
+      threads.emplace_back([&, i]() {
+        std::string batch;
+        statuses[i] = ScanRange(partitions[i], [&](const Slice& key,
+                                                   const Slice& value) {
+          if (stop.load(std::memory_order_relaxed)) {
+            return false;
+          }
+          PutLengthPrefixedSlice(&batch, key);
+          PutLengthPrefixedSlice(&batch, value);
+          if (batch.size() >= kScanBatchBytes) {
+            queues[i]->Push(std::move(batch));
+            batch.clear();
+          }
+          return true;
+        });
+        if (!batch.empty()) {
+          queues[i]->Push(std::move(batch));
+        }
+        queues[i]->Close();
+      });
+    }
+    std::string batch;
+    for (size_t i = 0; i < partitions.size(); i++) {
+      // Once stopped the batches are only drained, so that no partition
+      // waits for room.
+      while (queues[i]->Pop(&batch)) {
+        Slice input(batch);
+        Slice key, value;
+        while (!stop.load(std::memory_order_relaxed) &&
+               GetLengthPrefixedSlice(&input, &key) &&
+               GetLengthPrefixedSlice(&input, &value)) {
+          if (!callback(key, value)) {
+            stop.store(true, std::memory_order_relaxed);
+          }
+        }
+      }
+    }
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (const Status& s : statuses) {
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  return Status::OK();
+}
+
+}  // namespace dLSM
@@ -0,0 +1,39 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_PARALLEL_SCAN_H_
+#define STORAGE_dLSM_DB_PARALLEL_SCAN_H_
+
+#include <string>
+#include <vector>
+
+#include "dLSM/comparator.h"
+#include "dLSM/db.h"
+
+namespace dLSM {
+
+class DBImpl;
+
+// One part of a DB::ParallelScan(): the user keys of "db" in [start, limit),
+// ordered by "comparator" and read at options.snapshot. An empty start or
+// limit has no bound.
+struct ScanPartition {
+  DBImpl* db;
+  const Comparator* comparator;
+  ReadOptions options;
+  std::string start;
+  std::string limit;
+};
+
+// Scan every partition with an iterator of its own on a thread of its own,
+// see DB::ParallelScan(). With "ordered" the partitions are passed to the
+// callback one after the other, in their order in "partitions", while the
+// later ones are read ahead into a few buffered batches each. Returns the
+// first error of a partition.
+Status RunParallelScan(const std::vector<ScanPartition>& partitions,
+                       bool ordered, const DB::ScanCallback& callback);
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_PARALLEL_SCAN_H_
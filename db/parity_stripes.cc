@@ -0,0 +1,297 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/parity_stripes.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+
+#include "db/version_edit.h"
+#include "table/format.h"
+
+namespace dLSM {
+
+namespace {
+
+std::mutex stripes_mutex;
+// The tables waiting for a stripe, by the memory node of their data chunks.
+std::map<uint8_t, std::deque<std::weak_ptr<RemoteMemTableMetaData>>> queued;
+std::atomic<bool> nodes_down[256];
+// The parity of the next stripe goes to the first memory node after this
+// one which holds no table of the stripe.
+uint8_t last_parity_node = 0;
+
+// XOR "n" bytes of "src" into "dst" a word at a time, which the compiler
+// vectorizes.
+void XorInto(char* dst, const char* src, size_t n) {
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+    uint64_t a, b;
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    memcpy(dst + i, &a, sizeof(a));
+  }
+  for (; i < n; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+// The "size" bytes at "offset" of the remote chunk "chunk".
+ibv_mr ChunkPiece(const ibv_mr& chunk, size_t offset) {
+  ibv_mr piece = chunk;
+  piece.addr = static_cast<char*>(chunk.addr) + offset;
+  return piece;
+}
+
+void FreeParity(RDMA_Manager* rdma_mg, const ParityStripe& stripe) {
+  for (const ibv_mr& chunk : stripe.parity) {
+    rdma_mg->Deallocate_Remote_RDMA_Slot(chunk.addr, stripe.parity_node,
+                                         chunk.length);
+  }
+}
+
+// Write the parity of the data chunks of "stripe", whose members are set,
+// to its parity node.
+Status BuildParity(RDMA_Manager* rdma_mg, ParityStripe* stripe) {
+  size_t chunks = 0;
+  for (const auto& member : stripe->members) {
+    chunks = std::max(chunks, member.chunks.size());
+  }
+  ibv_mr sum = {};
+  ibv_mr buffer = {};
+  rdma_mg->Allocate_Local_RDMA_Slot(sum, FlushBuffer);
+  rdma_mg->Allocate_Local_RDMA_Slot(buffer, FlushBuffer);
+  Status s;
+  for (size_t i = 0; s.ok() && i < chunks; i++) {
+    size_t length = 0;
+    for (const auto& member : stripe->members) {
+      if (i < member.chunks.size()) {
+        length = std::max(length, member.chunks[i].length);
+      }
+    }
+    ibv_mr parity = {};
+    rdma_mg->Allocate_Remote_RDMA_Slot(parity, stripe->parity_node, length);
+    parity.length = length;
+    stripe->parity.push_back(parity);
+    for (size_t offset = 0; s.ok() && offset < length;
+         offset += sum.length) {
+      const size_t size = std::min(sum.length, length - offset);
+      memset(sum.addr, 0, size);
+      for (const auto& member : stripe->members) {
+        if (i >= member.chunks.size() ||
+            member.chunks[i].length <= offset) {
+          continue;
+        }
+        const size_t part = std::min(size, member.chunks[i].length - offset);
+        ibv_mr from = ChunkPiece(member.chunks[i], offset);
+        if (rdma_mg->RDMA_Read(&from, &buffer, part, QP_READ_LOCAL,
+                               IBV_SEND_SIGNALED, 1, member.node_id) != 0) {
+          s = Status::IOError("read for the parity failed");
+          break;
+        }
+        XorInto(static_cast<char*>(sum.addr),
+                static_cast<const char*>(buffer.addr), part);
+      }
+      ibv_mr to = ChunkPiece(parity, offset);
+      if (s.ok() &&
+          rdma_mg->RDMA_Write(&to, &sum, size, QP_WRITE_LOCAL_COMPACT,
+                              IBV_SEND_SIGNALED, 1,
+                              stripe->parity_node) != 0) {
+        s = Status::IOError("parity write failed");
+      }
+    }
+  }
+  rdma_mg->Deallocate_Local_RDMA_Slot(buffer.addr, FlushBuffer);
+  rdma_mg->Deallocate_Local_RDMA_Slot(sum.addr, FlushBuffer);
+  return s;
+}
+
+}  // namespace
+
+void ParityStripes::Add(const std::shared_ptr<RemoteMemTableMetaData>& table) {
+  std::lock_guard<std::mutex> l(stripes_mutex);
+  if (table->stripe_queued) {
+    return;
+  }
+  table->stripe_queued = true;
+  auto& tables = queued[DataChunkNode(*table)];
+  // Drop the tables compacted away while they waited.
+  while (!tables.empty() && tables.front().expired()) {
+    tables.pop_front();
+  }
+  tables.push_back(table);
+}
+
+int ParityStripes::Encode(RDMA_Manager* rdma_mg, int width) {
+  int built = 0;
+  while (true) {
+    std::vector<std::shared_ptr<RemoteMemTableMetaData>> tables;
+    auto stripe = std::make_unique<ParityStripe>();
+    {
+      std::lock_guard<std::mutex> l(stripes_mutex);
+      std::vector<uint8_t> nodes;
+      for (auto& entry : queued) {
+        while (!entry.second.empty() && entry.second.front().expired()) {
+          entry.second.pop_front();
+        }
+        if (!entry.second.empty() && !IsDown(entry.first)) {
+          nodes.push_back(entry.first);
+        }
+      }
+      if (nodes.size() < static_cast<size_t>(width)) {
+        return built;
+      }
+      nodes.resize(width);
+      // The parity goes to a node holding none of the tables.
+      bool found = false;
+      const size_t num_nodes = rdma_mg->memory_nodes.size();
+      for (size_t i = 1; i <= num_nodes && !found; i++) {
+        const uint8_t node =
+            static_cast<uint8_t>((last_parity_node + 2 * i) % (2 * num_nodes));
+        if (!IsDown(node) &&
+            std::find(nodes.begin(), nodes.end(), node) == nodes.end()) {
+          stripe->parity_node = node;
+          last_parity_node = node;
+          found = true;
+        }
+      }
+      if (!found) {
+        return built;
+      }
+      for (uint8_t node : nodes) {
+        tables.push_back(queued[node].front().lock());
+        queued[node].pop_front();
+      }
+    }
+    if (std::find(tables.begin(), tables.end(), nullptr) != tables.end()) {
+      // One was compacted away as it was picked, the others wait for the
+      // next stripe.
+      std::lock_guard<std::mutex> l(stripes_mutex);
+      for (const auto& table : tables) {
+        if (table != nullptr) {
+          queued[DataChunkNode(*table)].push_front(table);
+        }
+      }
+      continue;
+    }
+    for (const auto& table : tables) {
+      ParityStripe::Member member;
+      member.node_id = DataChunkNode(*table);
+      member.collected = table->creator_node_id != rdma_mg->node_id;
+      for (const auto& chunk : table->remote_data_mrs) {
+        member.chunks.push_back(*chunk.second);
+      }
+      stripe->members.push_back(std::move(member));
+    }
+    Status s = BuildParity(rdma_mg, stripe.get());
+    if (!s.ok()) {
+      // The tables are left without parity.
+      FreeParity(rdma_mg, *stripe);
+      return built;
+    }
+    ParityStripe* published = stripe.release();
+    for (size_t i = 0; i < tables.size(); i++) {
+      tables[i]->stripe_index = static_cast<int>(i);
+      tables[i]->stripe.store(published, std::memory_order_release);
+    }
+    built++;
+  }
+}
+
+void ParityStripes::Leave(RDMA_Manager* rdma_mg, ParityStripe* stripe,
+                          int index, bool free) {
+  {
+    std::lock_guard<std::mutex> l(stripes_mutex);
+    stripe->members[index].left = true;
+    stripe->members[index].free = free;
+    for (const auto& member : stripe->members) {
+      if (!member.left) {
+        return;
+      }
+    }
+  }
+  for (const auto& member : stripe->members) {
+    if (!member.free) {
+      continue;
+    }
+    if (member.collected) {
+      std::vector<uint64_t> addrs;
+      addrs.reserve(member.chunks.size());
+      for (const ibv_mr& chunk : member.chunks) {
+        addrs.push_back((uint64_t)chunk.addr);
+      }
+      rdma_mg->Remote_Memory_Deallocate(addrs.data(), addrs.size(),
+                                        member.node_id);
+    } else {
+      for (const ibv_mr& chunk : member.chunks) {
+        rdma_mg->Deallocate_Remote_RDMA_Slot(chunk.addr, member.node_id,
+                                             chunk.length);
+      }
+    }
+  }
+  FreeParity(rdma_mg, *stripe);
+  delete stripe;
+}
+
+bool ParityStripes::IsDown(uint8_t node_id) {
+  return nodes_down[node_id].load(std::memory_order_relaxed);
+}
+
+void ParityStripes::MarkDown(uint8_t node_id) {
+  nodes_down[node_id].store(true, std::memory_order_relaxed);
+}
+
+Status ParityStripes::Rebuild(RDMA_Manager* rdma_mg,
+                              const RemoteMemTableMetaData& table,
+                              uint64_t offset, size_t n, ibv_mr* contents) {
+  ParityStripe* stripe = table.stripe.load(std::memory_order_acquire);
+  auto iter = table.remote_data_mrs.upper_bound(offset);
+  if (stripe == nullptr || iter == table.remote_data_mrs.end()) {
+    return Status::IOError("no parity to rebuild the read from");
+  }
+  const size_t i = iter - table.remote_data_mrs.begin();
+  const size_t position = offset - (iter->first - iter->second->length);
+  if (IsDown(stripe->parity_node)) {
+    return Status::IOError("the parity of the table is down too");
+  }
+  ibv_mr from = ChunkPiece(stripe->parity[i], position);
+  if (rdma_mg->RDMA_Read(&from, contents, n, QP_READ_LOCAL, IBV_SEND_SIGNALED,
+                         1, stripe->parity_node) != 0) {
+    MarkDown(stripe->parity_node);
+    return Status::IOError("parity read failed");
+  }
+  ibv_mr buffer = {};
+  rdma_mg->Allocate_Local_RDMA_Slot(buffer, DataChunk);
+  Status s;
+  for (size_t j = 0; j < stripe->members.size(); j++) {
+    const ParityStripe::Member& member = stripe->members[j];
+    if (static_cast<int>(j) == table.stripe_index ||
+        i >= member.chunks.size() || member.chunks[i].length <= position) {
+      continue;
+    }
+    if (IsDown(member.node_id)) {
+      s = Status::IOError("two memory nodes of the stripe are down");
+      break;
+    }
+    const size_t part = std::min(n, member.chunks[i].length - position);
+    from = ChunkPiece(member.chunks[i], position);
+    if (rdma_mg->RDMA_Read(&from, &buffer, part, QP_READ_LOCAL,
+                           IBV_SEND_SIGNALED, 1, member.node_id) != 0) {
+      MarkDown(member.node_id);
+      s = Status::IOError("read for the rebuild failed");
+      break;
+    }
+    XorInto(static_cast<char*>(contents->addr),
+            static_cast<const char*>(buffer.addr), part);
+  }
+  rdma_mg->Deallocate_Local_RDMA_Slot(buffer.addr, DataChunk);
+  return s;
+}
+
+}  // namespace dLSM
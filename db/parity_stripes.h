@@ -0,0 +1,76 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_PARITY_STRIPES_H_
+#define STORAGE_dLSM_DB_PARITY_STRIPES_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "dLSM/status.h"
+#include "util/rdma.h"
+
+namespace dLSM {
+
+struct RemoteMemTableMetaData;
+
+// The tables of Options::erasure_coded_level and deeper are protected by
+// parity rather than copies. The data chunks of Options::erasure_code_width
+// tables on as many memory nodes form a stripe: chunk i of the parity, on
+// one more memory node, is the XOR of chunk i of every table, the shorter
+// ones padded with zeros. The tables stay where they are and a read of one
+// is still a single RDMA read; only a read from a memory node which failed
+// is rebuilt from the parity and the other tables of the stripe.
+//
+// The tables of a stripe may come from all the shards of the compute node.
+// The data chunks of a table are freed with the last table of its stripe,
+// which keeps the parity valid for the others.
+struct ParityStripe {
+  struct Member {
+    uint8_t node_id;
+    // Copies of the ibv_mr of the data chunks, which outlive the table.
+    std::vector<ibv_mr> chunks;
+    // The memory node frees the chunks through its garbage collection,
+    // rather than the compute node which allocated them.
+    bool collected = false;
+    // The table is gone and its chunks may be freed.
+    bool left = false;
+    bool free = false;
+  };
+  std::vector<Member> members;
+  uint8_t parity_node;
+  std::vector<ibv_mr> parity;
+};
+
+class ParityStripes {
+ public:
+  // Queue "table" for a stripe, unless it is queued or in one already.
+  static void Add(const std::shared_ptr<RemoteMemTableMetaData>& table);
+
+  // Build the stripes of "width" queued tables on different memory nodes,
+  // as long as there are enough of them, and return how many were built.
+  static int Encode(RDMA_Manager* rdma_mg, int width);
+
+  // Called when the table "index" of "stripe" is destroyed. Its data chunks
+  // are freed once the last table of the stripe is gone, if "free", that is
+  // if the table is not borrowed. The parity is freed with them.
+  static void Leave(RDMA_Manager* rdma_mg, ParityStripe* stripe, int index,
+                    bool free);
+
+  // Whether a read from "node_id" failed, the reads of the striped tables
+  // there are rebuilt from then on.
+  static bool IsDown(uint8_t node_id);
+  static void MarkDown(uint8_t node_id);
+
+  // Rebuild the "n" bytes of the data chunks of "table" at "offset", which
+  // lie in one chunk, into the local buffer "contents".
+  static Status Rebuild(RDMA_Manager* rdma_mg,
+                        const RemoteMemTableMetaData& table, uint64_t offset,
+                        size_t n, ibv_mr* contents);
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_PARITY_STRIPES_H_
@@ -0,0 +1,81 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/range_tombstone.h"
+
+#include <algorithm>
+
+#include "dLSM/comparator.h"
+#include "util/coding.h"
+
+namespace dLSM {
+
+void RangeTombstones::Remove(SequenceNumber sequence) {
+  tombstones_.erase(
+      std::remove_if(tombstones_.begin(), tombstones_.end(),
+                     [sequence](const RangeTombstone& t) {
+                       return t.sequence == sequence;
+                     }),
+      tombstones_.end());
+}
+
+bool RangeTombstones::ShouldDelete(const Comparator* ucmp,
+                                   const Slice& user_key,
+                                   SequenceNumber sequence,
+                                   SequenceNumber snapshot) const {
+  for (const RangeTombstone& t : tombstones_) {
+    if (sequence < t.sequence && t.sequence <= snapshot &&
+        ucmp->Compare(user_key, t.begin) >= 0 &&
+        ucmp->Compare(user_key, t.end) < 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool RangeTombstones::CoversRange(const Comparator* ucmp, const Slice& smallest,
+                                  const Slice& largest,
+                                  SequenceNumber largest_sequence,
+                                  SequenceNumber snapshot) const {
+  for (const RangeTombstone& t : tombstones_) {
+    if (largest_sequence < t.sequence && t.sequence <= snapshot &&
+        ucmp->Compare(smallest, t.begin) >= 0 &&
+        ucmp->Compare(largest, t.end) < 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void RangeTombstones::EncodeTo(std::string* dst) const {
+  PutVarint32(dst, static_cast<uint32_t>(tombstones_.size()));
+  for (const RangeTombstone& t : tombstones_) {
+    PutLengthPrefixedSlice(dst, t.begin);
+    PutLengthPrefixedSlice(dst, t.end);
+    PutVarint64(dst, t.sequence);
+  }
+}
+
+bool RangeTombstones::DecodeFrom(Slice* input) {
+  tombstones_.clear();
+  uint32_t n;
+  if (!GetVarint32(input, &n)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    Slice begin, end;
+    RangeTombstone t;
+    if (!GetLengthPrefixedSlice(input, &begin) ||
+        !GetLengthPrefixedSlice(input, &end) ||
+        !GetVarint64(input, &t.sequence)) {
+      return false;
+    }
+    t.begin = begin.ToString();
+    t.end = end.ToString();
+    tombstones_.push_back(std::move(t));
+  }
+  return true;
+}
+
+}  // namespace dLSM
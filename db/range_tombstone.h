@@ -0,0 +1,56 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_RANGE_TOMBSTONE_H_
+#define STORAGE_dLSM_DB_RANGE_TOMBSTONE_H_
+
+#include <string>
+#include <vector>
+
+#include "db/dbformat.h"
+#include "dLSM/slice.h"
+
+namespace dLSM {
+
+class Comparator;
+
+// The deletion of the user keys in [begin, end) written before "sequence",
+// issued by DB::DeleteRange(). The sequence number also identifies it.
+struct RangeTombstone {
+  std::string begin;
+  std::string end;
+  SequenceNumber sequence;
+};
+
+// The range tombstones which are live in a version. There are few of them,
+// so the lookups scan them all.
+class RangeTombstones {
+ public:
+  bool empty() const { return tombstones_.empty(); }
+  const std::vector<RangeTombstone>& tombstones() const { return tombstones_; }
+
+  void Add(const RangeTombstone& tombstone) { tombstones_.push_back(tombstone); }
+  void Remove(SequenceNumber sequence);
+
+  // Whether the entry for "user_key" at "sequence" is deleted by a tombstone
+  // which is visible at "snapshot".
+  bool ShouldDelete(const Comparator* ucmp, const Slice& user_key,
+                    SequenceNumber sequence, SequenceNumber snapshot) const;
+
+  // Whether a tombstone which is visible at "snapshot" covers all of
+  // [smallest, largest] and is newer than "largest_sequence".
+  bool CoversRange(const Comparator* ucmp, const Slice& smallest,
+                   const Slice& largest, SequenceNumber largest_sequence,
+                   SequenceNumber snapshot) const;
+
+  void EncodeTo(std::string* dst) const;
+  bool DecodeFrom(Slice* input);
+
+ private:
+  std::vector<RangeTombstone> tombstones_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_RANGE_TOMBSTONE_H_
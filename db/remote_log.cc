@@ -0,0 +1,462 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/remote_log.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "util/coding.h"
+#include "util/crc32c.h"
+#include "util/rdma.h"
+#include "util/rdma_rpc.h"
+
+namespace dLSM {
+
+namespace {
+
+// checksum, length and offset.
+const size_t kRecordHeaderSize = 16;
+// The header of a write batch, sequence and count.
+const size_t kBatchHeaderSize = 12;
+// The records one RDMA write takes at most, so that a large group does not
+// hold up the writers queued behind it for long.
+const uint64_t kMaxGroupBytes = 1 << 20;
+
+}  // namespace
+
+struct RemoteLog::Writer {
+  Slice batch;
+  SequenceNumber last_sequence;
+  Status status;
+  bool done = false;
+  std::condition_variable cv;
+};
+
+RemoteLog::RemoteLog(RDMA_Manager* rdma_mg, uint8_t target_node_id,
+                     uint8_t shard_id, size_t size, bool edits)
+    : rdma_mg_(rdma_mg),
+      target_node_id_(target_node_id),
+      shard_id_(shard_id),
+      size_(size),
+      edits_(edits),
+      ring_(),
+      capacity_(0),
+      staging_mr_(),
+      tail_(0),
+      head_(0),
+      unflushed_(0),
+      header_mr_() {
+  rdma_mg_->Allocate_Local_RDMA_Slot(staging_mr_, FlushBuffer);
+  rdma_mg_->Allocate_Local_RDMA_Slot(header_mr_, Message);
+}
+
+RemoteLog::~RemoteLog() {
+  assert(writers_.empty());
+  rdma_mg_->Deallocate_Local_RDMA_Slot(staging_mr_.addr, FlushBuffer);
+  rdma_mg_->Deallocate_Local_RDMA_Slot(header_mr_.addr, Message);
+}
+
+size_t RemoteLog::RecordSize(size_t batch_size) {
+  return (kRecordHeaderSize + batch_size + 7) & ~static_cast<size_t>(7);
+}
+
+Status RemoteLog::Open(std::vector<std::string>* batches,
+                       SequenceNumber* unflushed) {
+  ibv_mr send_mr = {};
+  ibv_mr receive_mr = {};
+  rdma_mg_->Allocate_Local_RDMA_Slot(send_mr, Message);
+  rdma_mg_->Allocate_Local_RDMA_Slot(receive_mr, Message);
+  RDMA_Request* send_pointer = (RDMA_Request*)send_mr.addr;
+  send_pointer->command = remote_log_;
+  send_pointer->content.rl = {};
+  send_pointer->content.rl.size = size_;
+  send_pointer->content.rl.shard_id = shard_id_;
+  send_pointer->content.rl.edits = edits_;
+  send_pointer->buffer = receive_mr.addr;
+  send_pointer->rkey = receive_mr.rkey;
+  send_pointer->imm_num = 0;
+  RDMA_Reply* receive_pointer = (RDMA_Reply*)receive_mr.addr;
+  //Clear the reply buffer for the polling.
+  *receive_pointer = {};
+  rdma_mg_->post_send<RDMA_Request>(&send_mr, target_node_id_,
+                                    std::string("main"));
+  ibv_wc wc[2] = {};
+  Status s;
+  if (rdma_mg_->poll_completion(wc, 1, std::string("main"), true,
+                                target_node_id_)) {
+    s = Status::IOError("failed to send the remote log setup");
+  } else {
+    rdma_mg_->poll_reply_buffer(receive_pointer);
+    ring_ = receive_pointer->content.mr;
+  }
+  rdma_mg_->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
+  rdma_mg_->Deallocate_Local_RDMA_Slot(receive_mr.addr, Message);
+  if (!s.ok()) {
+    return s;
+  }
+  if (ring_.addr == nullptr || ring_.length <= kHeaderSize) {
+    return Status::IOError("the memory node has no remote log");
+  }
+  capacity_ = ring_.length - kHeaderSize;
+
+  char header[16];
+  s = ReadRing(0, sizeof(header), header);
+  std::string area;
+  if (s.ok()) {
+    area.resize(capacity_);
+    s = ReadRing(kHeaderSize, capacity_, &area[0]);
+  }
+  if (!s.ok()) {
+    return s;
+  }
+  auto copy = [&](uint64_t offset, size_t n, char* dst) {
+    const size_t pos = offset % capacity_;
+    const size_t first = std::min<size_t>(n, capacity_ - pos);
+    memcpy(dst, area.data() + pos, first);
+    memcpy(dst + first, area.data(), n - first);
+  };
+  const SequenceNumber first_unflushed = DecodeFixed64(header);
+  const uint64_t tail = DecodeFixed64(header + 8);
+  uint64_t offset = tail;
+  while (offset - tail + kRecordHeaderSize <= capacity_) {
+    char record_header[kRecordHeaderSize];
+    copy(offset, kRecordHeaderSize, record_header);
+    const uint32_t length = DecodeFixed32(record_header + 4);
+    if (DecodeFixed64(record_header + 8) != offset ||
+        length < kBatchHeaderSize ||
+        offset - tail + RecordSize(length) > capacity_) {
+      break;
+    }
+    std::string batch(length, '\0');
+    copy(offset + kRecordHeaderSize, length, &batch[0]);
+    uint32_t crc = crc32c::Value(record_header + 4, kRecordHeaderSize - 4);
+    crc = crc32c::Extend(crc, batch.data(), length);
+    if (crc32c::Unmask(DecodeFixed32(record_header)) != crc) {
+      break;
+    }
+    batches->push_back(std::move(batch));
+    offset += RecordSize(length);
+  }
+
+  std::unique_lock<std::mutex> lck(mutex_);
+  tail_ = tail;
+  head_ = offset;
+  unflushed_ = first_unflushed;
+  if (head_ != tail_) {
+    records_.push_back({head_, kMaxSequenceNumber});
+  }
+  *unflushed = first_unflushed;
+  return s;
+}
+
+void RemoteLog::SetRecoveredSequence(SequenceNumber sequence) {
+  std::unique_lock<std::mutex> lck(mutex_);
+  if (!records_.empty() &&
+      records_.front().last_sequence == kMaxSequenceNumber) {
+    records_.front().last_sequence = sequence;
+  }
+}
+
+Status RemoteLog::AddRecord(const Slice& batch, SequenceNumber last_sequence) {
+  Writer w;
+  w.batch = batch;
+  w.last_sequence = last_sequence;
+
+  std::unique_lock<std::mutex> lck(mutex_);
+  writers_.push_back(&w);
+  while (!w.done && &w != writers_.front()) {
+    w.cv.wait(lck);
+  }
+  if (w.done) {
+    return w.status;
+  }
+
+  // &w leads the writers queued so far, up to kMaxGroupBytes of them.
+  Status s = error_;
+  std::vector<Writer*> group;
+  uint64_t bytes = 0;
+  if (s.ok() && RecordSize(batch.size()) > capacity_) {
+    s = Status::InvalidArgument("batch larger than the remote log");
+    group.push_back(&w);
+  } else {
+    const uint64_t max_bytes = std::min(capacity_, kMaxGroupBytes);
+    for (Writer* writer : writers_) {
+      const uint64_t n = RecordSize(writer->batch.size());
+      if (!group.empty() && bytes + n > max_bytes) {
+        break;
+      }
+      group.push_back(writer);
+      bytes += n;
+    }
+  }
+  while (s.ok() && head_ + bytes - tail_ > capacity_) {
+    // Full until a flush truncates the log.
+    room_cv_.wait(lck);
+    s = error_;
+  }
+  if (s.ok()) {
+    const uint64_t offset = head_;
+    head_ += bytes;
+    {
+      // The front of writers_ stays &w, no other writer runs meanwhile.
+      lck.unlock();
+      s = WriteGroup(group, offset);
+      lck.lock();
+    }
+    if (s.ok()) {
+      uint64_t end = offset;
+      for (Writer* writer : group) {
+        end += RecordSize(writer->batch.size());
+        records_.push_back({end, writer->last_sequence});
+      }
+    } else {
+      error_ = s;
+    }
+  }
+
+  for (size_t i = 0; i < group.size(); i++) {
+    Writer* ready = writers_.front();
+    writers_.pop_front();
+    if (ready != &w) {
+      ready->status = s;
+      ready->done = true;
+      ready->cv.notify_one();
+    }
+  }
+  // Notify new head of write queue
+  if (!writers_.empty()) {
+    writers_.front()->cv.notify_one();
+  }
+  return s;
+}
+
+Status RemoteLog::Truncate(SequenceNumber sequence) {
+  std::unique_lock<std::mutex> header_lck(header_mtx_);
+  uint64_t tail;
+  SequenceNumber first_unflushed;
+  {
+    std::unique_lock<std::mutex> lck(mutex_);
+    tail = tail_;
+    while (!records_.empty() && records_.front().last_sequence <= sequence) {
+      tail = records_.front().end;
+      records_.pop_front();
+    }
+    if (tail == tail_) {
+      return Status::OK();
+    }
+    unflushed_ = std::max(unflushed_, sequence + 1);
+    first_unflushed = unflushed_;
+  }
+  // The room is handed out only once the tail is in the ring. The sequence
+  // goes first, so that a torn header never has the new tail with the old
+  // sequence.
+  char* header = static_cast<char*>(header_mr_.addr);
+  EncodeFixed64(header, first_unflushed);
+  EncodeFixed64(header + 8, tail);
+  if (rdma_mg_->RDMA_Write(ring_.addr, ring_.rkey, &header_mr_, 16,
+                           QP_WRITE_LOCAL_FLUSH, IBV_SEND_SIGNALED, 1,
+                           target_node_id_) != 0) {
+    return Status::IOError("failed to truncate the remote log");
+  }
+  {
+    std::unique_lock<std::mutex> lck(mutex_);
+    tail_ = tail;
+  }
+  room_cv_.notify_all();
+  return Status::OK();
+}
+
+Status RemoteLog::WriteGroup(const std::vector<Writer*>& group,
+                             uint64_t offset) {
+  static const char kPadding[8] = {};
+  Status s;
+  size_t staged = 0;
+  for (Writer* writer : group) {
+    const Slice& batch = writer->batch;
+    char record_header[kRecordHeaderSize];
+    EncodeFixed32(record_header + 4, static_cast<uint32_t>(batch.size()));
+    EncodeFixed64(record_header + 8, offset + staged);
+    uint32_t crc = crc32c::Value(record_header + 4, kRecordHeaderSize - 4);
+    crc = crc32c::Extend(crc, batch.data(), batch.size());
+    EncodeFixed32(record_header, crc32c::Mask(crc));
+    s = Stage(record_header, kRecordHeaderSize, &offset, &staged);
+    if (s.ok()) {
+      s = Stage(batch.data(), batch.size(), &offset, &staged);
+    }
+    if (s.ok()) {
+      s = Stage(kPadding,
+                RecordSize(batch.size()) - kRecordHeaderSize - batch.size(),
+                &offset, &staged);
+    }
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  if (staged > 0) {
+    s = WriteStaged(offset, staged);
+  }
+  return s;
+}
+
+Status RemoteLog::Stage(const char* data, size_t n, uint64_t* offset,
+                        size_t* staged) {
+  char* buffer = static_cast<char*>(staging_mr_.addr);
+  while (n > 0) {
+    const size_t chunk = std::min(n, staging_mr_.length - *staged);
+    memcpy(buffer + *staged, data, chunk);
+    *staged += chunk;
+    data += chunk;
+    n -= chunk;
+    if (*staged == staging_mr_.length) {
+      Status s = WriteStaged(*offset, *staged);
+      if (!s.ok()) {
+        return s;
+      }
+      *offset += *staged;
+      *staged = 0;
+    }
+  }
+  return Status::OK();
+}
+
+Status RemoteLog::WriteStaged(uint64_t offset, size_t n) {
+  char* area = static_cast<char*>(ring_.addr) + kHeaderSize;
+  const size_t pos = offset % capacity_;
+  const size_t first = std::min<size_t>(n, capacity_ - pos);
+  ibv_mr local = staging_mr_;
+  if (rdma_mg_->RDMA_Write(area + pos, ring_.rkey, &local, first,
+                           QP_WRITE_LOCAL_FLUSH, IBV_SEND_SIGNALED, 1,
+                           target_node_id_) != 0) {
+    return Status::IOError("failed to write the remote log");
+  }
+  if (first < n) {
+    // Wrapped around the end of the ring.
+    local.addr = static_cast<char*>(staging_mr_.addr) + first;
+    if (rdma_mg_->RDMA_Write(area, ring_.rkey, &local, n - first,
+                             QP_WRITE_LOCAL_FLUSH, IBV_SEND_SIGNALED, 1,
+                             target_node_id_) != 0) {
+      return Status::IOError("failed to write the remote log");
+    }
+  }
+  return Status::OK();
+}
+
+Status RemoteLog::ReadRing(uint64_t offset, size_t n, char* dst) {
+  while (n > 0) {
+    const size_t chunk = std::min(n, staging_mr_.length);
+    ibv_mr remote = ring_;
+    remote.addr = static_cast<char*>(ring_.addr) + offset;
+    if (rdma_mg_->RDMA_Read(&remote, &staging_mr_, chunk, QP_READ_LOCAL,
+                            IBV_SEND_SIGNALED, 1, target_node_id_) != 0) {
+      return Status::IOError("failed to read the remote log");
+    }
+    memcpy(dst, staging_mr_.addr, chunk);
+    dst += chunk;
+    offset += chunk;
+    n -= chunk;
+  }
+  return Status::OK();
+}
+
+RemoteLogReader::RemoteLogReader(RDMA_Manager* rdma_mg, uint8_t target_node_id,
+                                 uint8_t owner_node_id, uint8_t shard_id,
+                                 bool edits)
+    : rdma_mg_(rdma_mg),
+      target_node_id_(target_node_id),
+      owner_node_id_(owner_node_id),
+      shard_id_(shard_id),
+      edits_(edits),
+      ring_(),
+      capacity_(0),
+      staging_mr_() {
+  rdma_mg_->Allocate_Local_RDMA_Slot(staging_mr_, FlushBuffer);
+}
+
+RemoteLogReader::~RemoteLogReader() {
+  rdma_mg_->Deallocate_Local_RDMA_Slot(staging_mr_.addr, FlushBuffer);
+}
+
+Status RemoteLogReader::Open() {
+  RPC_Call call(rdma_mg_, target_node_id_, remote_log_);
+  call.request()->content.rl = {};
+  call.request()->content.rl.shard_id = shard_id_;
+  call.request()->content.rl.owner_node_id = owner_node_id_;
+  call.request()->content.rl.edits = edits_;
+  if (!call.Send() || !call.Wait(RPC_REPLY_TIMEOUT_MICROS)) {
+    return Status::IOError("failed to look up the remote log of the owner");
+  }
+  ring_ = call.reply().content.mr;
+  if (ring_.addr == nullptr || ring_.length <= RemoteLog::kHeaderSize) {
+    return Status::IOError("the owner has no remote log on the memory node");
+  }
+  capacity_ = ring_.length - RemoteLog::kHeaderSize;
+  return Status::OK();
+}
+
+Status RemoteLogReader::Read(
+    uint64_t* offset, std::vector<std::pair<uint64_t, std::string>>* records,
+    uint64_t* tail, SequenceNumber* unflushed) {
+  char header[16];
+  ibv_mr remote = ring_;
+  if (rdma_mg_->RDMA_Read(&remote, &staging_mr_, sizeof(header),
+                          QP_READ_LOCAL, IBV_SEND_SIGNALED, 1,
+                          target_node_id_) != 0) {
+    return Status::IOError("failed to read the remote log");
+  }
+  memcpy(header, staging_mr_.addr, sizeof(header));
+  *unflushed = DecodeFixed64(header);
+  *tail = DecodeFixed64(header + 8);
+  uint64_t pos = std::max(*offset, *tail);
+  while (pos - *tail + kRecordHeaderSize <= capacity_) {
+    char record_header[kRecordHeaderSize];
+    Status s = ReadArea(pos, kRecordHeaderSize, record_header);
+    if (!s.ok()) {
+      return s;
+    }
+    const uint32_t length = DecodeFixed32(record_header + 4);
+    if (DecodeFixed64(record_header + 8) != pos ||
+        length < kBatchHeaderSize ||
+        pos - *tail + RemoteLog::RecordSize(length) > capacity_) {
+      break;
+    }
+    std::string record(length, '\0');
+    s = ReadArea(pos + kRecordHeaderSize, length, &record[0]);
+    if (!s.ok()) {
+      return s;
+    }
+    uint32_t crc = crc32c::Value(record_header + 4, kRecordHeaderSize - 4);
+    crc = crc32c::Extend(crc, record.data(), length);
+    if (crc32c::Unmask(DecodeFixed32(record_header)) != crc) {
+      break;
+    }
+    records->emplace_back(pos, std::move(record));
+    pos += RemoteLog::RecordSize(length);
+  }
+  *offset = pos;
+  return Status::OK();
+}
+
+Status RemoteLogReader::ReadArea(uint64_t offset, size_t n, char* dst) {
+  char* area = static_cast<char*>(ring_.addr) + RemoteLog::kHeaderSize;
+  while (n > 0) {
+    const size_t pos = offset % capacity_;
+    // Up to the end of the ring or of the staging slot.
+    const size_t chunk =
+        std::min<size_t>({n, capacity_ - pos, staging_mr_.length});
+    ibv_mr remote = ring_;
+    remote.addr = area + pos;
+    if (rdma_mg_->RDMA_Read(&remote, &staging_mr_, chunk, QP_READ_LOCAL,
+                            IBV_SEND_SIGNALED, 1, target_node_id_) != 0) {
+      return Status::IOError("failed to read the remote log");
+    }
+    memcpy(dst, staging_mr_.addr, chunk);
+    dst += chunk;
+    offset += chunk;
+    n -= chunk;
+  }
+  return Status::OK();
+}
+
+}  // namespace dLSM
@@ -0,0 +1,170 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_REMOTE_LOG_H_
+#define STORAGE_dLSM_DB_REMOTE_LOG_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <infiniband/verbs.h>
+
+#include "db/dbformat.h"
+#include "dLSM/status.h"
+
+namespace dLSM {
+
+class RDMA_Manager;
+
+// The write-ahead log of a shard, in a ring of registered memory on its
+// memory node which outlives the compute node. The records are written with
+// one-sided RDMA writes, the writers queued meanwhile are grouped into the
+// next write. The log is truncated once the memtables holding its batches
+// are flushed, see Options::remote_log_size.
+//
+// The ring is a header of kHeaderSize bytes, the first sequence the flushed
+// tables do not hold and then the tail, followed by the record area. The
+// offsets of the records grow forever, the record at offset p lies at p
+// modulo the size of the area and may wrap around its end. A record is
+//
+//    checksum: fixed32, the masked crc32c of the rest of the record
+//    length: fixed32, of the batch
+//    offset: fixed64, p
+//    contents of the batch
+//
+// padded to a multiple of 8 bytes. The records of the earlier rounds of the
+// ring do not have their own offset, so the log ends at the first record
+// which is not complete.
+//
+// The same ring carries the version edits of the shard for its read
+// replicas if "edits" is set, see EditPublisher.
+class RemoteLog {
+ public:
+  static const size_t kHeaderSize = 64;
+
+  RemoteLog(RDMA_Manager* rdma_mg, uint8_t target_node_id, uint8_t shard_id,
+            size_t size, bool edits = false);
+
+  RemoteLog(const RemoteLog&) = delete;
+  RemoteLog& operator=(const RemoteLog&) = delete;
+
+  ~RemoteLog();
+
+  // Set up the ring of the shard, or find the one a previous run left on the
+  // memory node, and return the batches it holds after its tail together
+  // with the first sequence the tables flushed before do not hold. The ring
+  // of a previous run keeps its size. The recovered records are not
+  // truncated before SetRecoveredSequence().
+  Status Open(std::vector<std::string>* batches, SequenceNumber* unflushed);
+
+  // The recovered records are dropped once "sequence" is flushed.
+  void SetRecoveredSequence(SequenceNumber sequence);
+
+  // Append the contents of a batch whose last sequence is "last_sequence",
+  // and return once it is in the ring. A writer waits for the truncation
+  // while the ring is full. After a failed write all the appends fail.
+  Status AddRecord(const Slice& batch, SequenceNumber last_sequence);
+
+  // Drop the records whose batches are all at or before "sequence", which
+  // the flushed tables hold.
+  Status Truncate(SequenceNumber sequence);
+
+  // The bytes the record of a batch of "batch_size" bytes takes in the ring.
+  static size_t RecordSize(size_t batch_size);
+  // The size of the record area, known once opened.
+  uint64_t capacity() const { return capacity_; }
+
+ private:
+  struct Writer;
+  // The end of an appended record and the last sequence of its batch.
+  struct Record {
+    uint64_t end;
+    SequenceNumber last_sequence;
+  };
+
+  // Write the records of "group" at "offset" through staging_mr_.
+  Status WriteGroup(const std::vector<Writer*>& group, uint64_t offset);
+  // Copy "data" into staging_mr_, writing it out while it is full.
+  Status Stage(const char* data, size_t n, uint64_t* offset, size_t* staged);
+  // Write the first "n" bytes of staging_mr_ at "offset" of the record area.
+  Status WriteStaged(uint64_t offset, size_t n);
+  // Read "n" bytes at "offset" of the ring, not of the record area.
+  Status ReadRing(uint64_t offset, size_t n, char* dst);
+
+  RDMA_Manager* const rdma_mg_;
+  const uint8_t target_node_id_;
+  const uint8_t shard_id_;
+  const size_t size_;
+  const bool edits_;
+  ibv_mr ring_;
+  // The size of the record area.
+  uint64_t capacity_;
+  // Only the writer at the front of writers_ uses it.
+  ibv_mr staging_mr_;
+
+  std::mutex mutex_;
+  // Signalled when a truncation makes room.
+  std::condition_variable room_cv_;
+  // The fields below are protected by mutex_.
+  std::deque<Writer*> writers_;
+  // The offsets of the tail and of the end of the log.
+  uint64_t tail_;
+  uint64_t head_;
+  SequenceNumber unflushed_;
+  // The appended records not truncated yet, in the order of the log.
+  std::deque<Record> records_;
+  Status error_;
+
+  // Serializes the writes of the header.
+  std::mutex header_mtx_;
+  ibv_mr header_mr_;
+};
+
+// Reads the ring of the RemoteLog of shard "shard_id" of the compute node
+// "owner_node_id", without writing to it, for the read replicas of the
+// shard. The owner goes on writing meanwhile, a record which is torn or
+// already overwritten fails its checksum or its offset and ends the read.
+class RemoteLogReader {
+ public:
+  RemoteLogReader(RDMA_Manager* rdma_mg, uint8_t target_node_id,
+                  uint8_t owner_node_id, uint8_t shard_id, bool edits);
+
+  RemoteLogReader(const RemoteLogReader&) = delete;
+  RemoteLogReader& operator=(const RemoteLogReader&) = delete;
+
+  ~RemoteLogReader();
+
+  // Find the ring of the owner, which has to be set up already.
+  Status Open();
+
+  // Append the records from offset *offset on to *records together with
+  // their offsets, and advance *offset past the last one. The records the
+  // owner truncated are skipped, the read starts at the tail then. *tail and
+  // *unflushed are set to the tail and the sequence of the header.
+  Status Read(uint64_t* offset,
+              std::vector<std::pair<uint64_t, std::string>>* records,
+              uint64_t* tail, SequenceNumber* unflushed);
+
+ private:
+  // Read "n" bytes at "offset" of the record area into "dst".
+  Status ReadArea(uint64_t offset, size_t n, char* dst);
+
+  RDMA_Manager* const rdma_mg_;
+  const uint8_t target_node_id_;
+  const uint8_t owner_node_id_;
+  const uint8_t shard_id_;
+  const bool edits_;
+  ibv_mr ring_;
+  uint64_t capacity_;
+  ibv_mr staging_mr_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_REMOTE_LOG_H_
@@ -0,0 +1,130 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/scan_pushdown.h"
+
+#include "db/blob.h"
+#include "db/version_edit.h"
+#include "dLSM/comparator.h"
+#include "util/coding.h"
+
+namespace dLSM {
+
+void ScanPushdownRequest::EncodeTo(std::string* dst) const {
+  PutFixed64(dst, snapshot);
+  PutLengthPrefixedSlice(dst, start);
+  PutLengthPrefixedSlice(dst, limit);
+  PutLengthPrefixedSlice(dst, filter_name);
+  tombstones.EncodeTo(dst);
+  for (int level = 0; level < config::kNumLevels; level++) {
+    PutFixed32(dst, files[level].size());
+    for (const auto& f : files[level]) {
+      f->EncodeTo(dst);
+    }
+  }
+}
+
+bool ScanPushdownRequest::DecodeFrom(const Slice& src, int side) {
+  Slice input = src;
+  Slice start_slice, limit_slice, filter_slice;
+  if (!GetFixed64(&input, &snapshot) ||
+      !GetLengthPrefixedSlice(&input, &start_slice) ||
+      !GetLengthPrefixedSlice(&input, &limit_slice) ||
+      !GetLengthPrefixedSlice(&input, &filter_slice) ||
+      !tombstones.DecodeFrom(&input)) {
+    return false;
+  }
+  start = start_slice.ToString();
+  limit = limit_slice.ToString();
+  filter_name = filter_slice.ToString();
+  for (int level = 0; level < config::kNumLevels; level++) {
+    uint32_t num = 0;
+    if (!GetFixed32(&input, &num)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < num; i++) {
+      auto f = std::make_shared<RemoteMemTableMetaData>(side);
+      if (!f->DecodeFrom(input).ok()) {
+        return false;
+      }
+      files[level].push_back(f);
+    }
+  }
+  return true;
+}
+
+ScanResolver::ScanResolver(Iterator* iter, const Comparator* ucmp,
+                           SequenceNumber snapshot, const Slice& limit,
+                           const RangeTombstones* tombstones,
+                           const ScanFilter* filter, RDMA_Manager* rdma_mg)
+    : iter_(iter),
+      ucmp_(ucmp),
+      snapshot_(snapshot),
+      limit_(limit.ToString()),
+      tombstones_(tombstones != nullptr && !tombstones->empty() ? tombstones
+                                                                : nullptr),
+      filter_(filter),
+      rdma_mg_(rdma_mg) {}
+
+void ScanResolver::Seek(const Slice& start) {
+  has_key_ = false;
+  if (start.empty()) {
+    iter_->SeekToFirst();
+  } else {
+    InternalKey target(start, snapshot_, kValueTypeForSeek);
+    iter_->Seek(target.Encode());
+  }
+  Resolve();
+}
+
+void ScanResolver::Next() {
+  assert(valid_);
+  iter_->Next();
+  Resolve();
+}
+
+void ScanResolver::Resolve() {
+  valid_ = false;
+  for (; iter_->Valid(); iter_->Next()) {
+    ParsedInternalKey ikey;
+    if (!ParseInternalKey(iter_->key(), &ikey)) {
+      status_ = Status::Corruption("corrupted internal key in scan");
+      return;
+    }
+    // The newer entries are not visible, the older ones are overwritten.
+    if (ikey.sequence > snapshot_ ||
+        (has_key_ && ucmp_->Compare(ikey.user_key, key_) == 0)) {
+      continue;
+    }
+    if (!limit_.empty() && ucmp_->Compare(ikey.user_key, limit_) >= 0) {
+      return;
+    }
+    key_.assign(ikey.user_key.data(), ikey.user_key.size());
+    has_key_ = true;
+    value_ = iter_->value();
+    changed_ = false;
+    kept_ = (ikey.type == kTypeValue || ikey.type == kTypeBlobIndex) &&
+            (tombstones_ == nullptr ||
+             !tombstones_->ShouldDelete(ucmp_, ikey.user_key, ikey.sequence,
+                                        snapshot_));
+    if (kept_ && ikey.type == kTypeBlobIndex) {
+      status_ = ReadBlob(rdma_mg_, value_, &blob_value_);
+      if (!status_.ok()) {
+        return;
+      }
+      value_ = blob_value_;
+    }
+    if (kept_ && filter_ != nullptr) {
+      new_value_.clear();
+      kept_ = filter_->Filter(ikey.user_key, value_, &new_value_, &changed_);
+    }
+    valid_ = true;
+    return;
+  }
+  if (status_.ok()) {
+    status_ = iter_->status();
+  }
+}
+
+}  // namespace dLSM
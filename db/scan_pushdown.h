@@ -0,0 +1,94 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_SCAN_PUSHDOWN_H_
+#define STORAGE_dLSM_DB_SCAN_PUSHDOWN_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "db/dbformat.h"
+#include "db/range_tombstone.h"
+#include "dLSM/iterator.h"
+#include "dLSM/scan_filter.h"
+
+namespace dLSM {
+
+class RDMA_Manager;
+struct RemoteMemTableMetaData;
+
+// The part of a DB::FilteredScan() which the memory node runs over the
+// SSTables of a version, sent along with the scan_pushdown_ command.
+struct ScanPushdownRequest {
+  SequenceNumber snapshot = 0;
+  // An empty start or limit has no bound.
+  std::string start;
+  std::string limit;
+  std::string filter_name;
+  RangeTombstones tombstones;
+  // The files overlapping the range, every level in the order of the
+  // version.
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> files[config::kNumLevels];
+
+  void EncodeTo(std::string* dst) const;
+  // "side" is the machine type of the decoded files, see
+  // RemoteMemTableMetaData.
+  bool DecodeFrom(const Slice& src, int side);
+};
+
+// The latest entry of every user key of an iterator over internal keys as of
+// "snapshot", from a Seek() on up to "limit". An entry is not kept if it is
+// a deletion, is deleted by one of "tombstones" or is dropped by "filter",
+// which may be nullptr. The iterator is not owned.
+class ScanResolver {
+ public:
+  // The blob values are read through "rdma_mg".
+  ScanResolver(Iterator* iter, const Comparator* ucmp, SequenceNumber snapshot,
+               const Slice& limit, const RangeTombstones* tombstones,
+               const ScanFilter* filter, RDMA_Manager* rdma_mg);
+
+  ScanResolver(const ScanResolver&) = delete;
+  ScanResolver& operator=(const ScanResolver&) = delete;
+
+  // Position at the first user key at or after "start", the first one if it
+  // is empty.
+  void Seek(const Slice& start);
+  void Next();
+
+  bool Valid() const { return valid_; }
+  Slice key() const { return key_; }
+  bool kept() const { return kept_; }
+  // The value to return for a kept key, valid until Next().
+  Slice value() const { return changed_ ? Slice(new_value_) : value_; }
+  Status status() const { return status_; }
+
+ private:
+  // Find the latest entry of the next user key from the position of iter_.
+  void Resolve();
+
+  Iterator* const iter_;
+  const Comparator* const ucmp_;
+  const SequenceNumber snapshot_;
+  const std::string limit_;
+  const RangeTombstones* const tombstones_;
+  const ScanFilter* const filter_;
+  RDMA_Manager* const rdma_mg_;
+
+  bool valid_ = false;
+  Status status_;
+  // key_ is the last user key resolved since the Seek() if has_key_.
+  bool has_key_ = false;
+  std::string key_;
+  bool kept_ = false;
+  Slice value_;
+  // The value of a blob index, value_ refers to it then.
+  std::string blob_value_;
+  bool changed_ = false;
+  std::string new_value_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_SCAN_PUSHDOWN_H_
@@ -0,0 +1,96 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/shard_router.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "util/hash.h"
+
+namespace dLSM {
+
+namespace {
+// Apart from the seeds of the filters, whose bits would follow the shards.
+const uint32_t kShardHashSeed = 0x9e3779b9;
+
+// Big endian, the bounds are ordered as the hashes.
+void EncodeHash(uint32_t hash, char* buf) {
+  for (size_t j = 0; j < sizeof(hash); j++) {
+    buf[j] = static_cast<char>(hash >> (8 * (sizeof(hash) - 1 - j)));
+  }
+}
+}  // namespace
+
+std::string ShardRouter::HashBound(int i, int n) {
+  assert(0 <= i && i <= n);
+  if (i == 0) {
+    return std::string();
+  }
+  if (i == n) {
+    return std::string(sizeof(uint32_t) + 1, '\xff');
+  }
+  const uint32_t hash =
+      static_cast<uint32_t>((static_cast<uint64_t>(i) << 32) / n);
+  char buf[sizeof(hash)];
+  EncodeHash(hash, buf);
+  return std::string(buf, sizeof(buf));
+}
+
+uint64_t ShardRouter::Prefix(const Slice& s) {
+  uint64_t prefix = 0;
+  const size_t n = std::min<size_t>(s.size(), sizeof(prefix));
+  for (size_t i = 0; i < sizeof(prefix); i++) {
+    prefix <<= 8;
+    if (i < n) {
+      prefix |= static_cast<uint8_t>(s[i]);
+    }
+  }
+  return prefix;
+}
+
+void ShardRouter::Build(const std::map<Slice, DBImpl*, cmpBySlice>& shards) {
+  prefixes_.clear();
+  bounds_.clear();
+  shards_.clear();
+  prefixes_.reserve(shards.size());
+  bounds_.reserve(shards.size());
+  shards_.reserve(shards.size());
+  for (const auto& iter : shards) {
+    prefixes_.push_back(Prefix(iter.first));
+    bounds_.push_back(iter.first);
+    shards_.push_back(iter.second);
+  }
+}
+
+DBImpl* ShardRouter::Find(const Slice& key) const {
+  char buf[sizeof(uint32_t)];
+  Slice target = key;
+  if (hashed_) {
+    EncodeHash(Hash(key.data(), key.size(), kShardHashSeed), buf);
+    target = Slice(buf, sizeof(buf));
+  }
+  const uint64_t prefix = Prefix(target);
+  // The first prefix not below the one of the key, without branching on the
+  // comparisons.
+  if (prefixes_.empty()) {
+    return nullptr;
+  }
+  const uint64_t* base = prefixes_.data();
+  size_t n = prefixes_.size();
+  while (n > 1) {
+    const size_t half = n / 2;
+    base = base[half] < prefix ? base + half : base;
+    n -= half;
+  }
+  size_t i = (base - prefixes_.data()) + (*base < prefix);
+  // A bound with the prefix of the key may still not be above it.
+  while (i < prefixes_.size() && prefixes_[i] == prefix &&
+         bounds_[i].compare(target) <= 0) {
+    i++;
+  }
+  return i < shards_.size() ? shards_[i] : nullptr;
+}
+
+}  // namespace dLSM
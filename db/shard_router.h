@@ -0,0 +1,63 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_SHARD_ROUTER_H_
+#define STORAGE_dLSM_DB_SHARD_ROUTER_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "dLSM/options.h"
+#include "dLSM/slice.h"
+
+namespace dLSM {
+
+class DBImpl;
+
+// The shard of a key out of the upper bounds of the shards, as
+// std::map::upper_bound() on the shards of DBImpl_Sharding finds it, but
+// over one sorted array of the first 8 bytes of the bounds. Most lookups
+// compare integers only, the bounds sharing their 8 bytes with the key are
+// compared in full. Rebuilt whenever the shards change.
+//
+// A hashed router routes the hash of the key, as a big endian fixed32,
+// instead. The bounds of the shards are then ranges of the hash values, see
+// HashBound().
+class ShardRouter {
+ public:
+  explicit ShardRouter(bool hashed = false) : hashed_(hashed) {}
+
+  ShardRouter(const ShardRouter&) = delete;
+  ShardRouter& operator=(const ShardRouter&) = delete;
+
+  // Route to "shards", <upper bound, shard> as in DBImpl_Sharding. The bounds
+  // must outlive the next Build().
+  void Build(const std::map<Slice, DBImpl*, cmpBySlice>& shards);
+
+  // The shard with the smallest upper bound above "key", or above its hash,
+  // null if there is none.
+  DBImpl* Find(const Slice& key) const;
+
+  bool hashed() const { return hashed_; }
+
+  // Bound "i" of "n" shards splitting the hash values evenly, empty for the
+  // first and above every hash for the last.
+  static std::string HashBound(int i, int n);
+
+ private:
+  // The first 8 bytes of "s" as a big endian integer, zero padded, ordered as
+  // the slices are.
+  static uint64_t Prefix(const Slice& s);
+
+  const bool hashed_;
+  std::vector<uint64_t> prefixes_;
+  std::vector<Slice> bounds_;
+  std::vector<DBImpl*> shards_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_SHARD_ROUTER_H_
@@ -0,0 +1,48 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/shard_sequencer.h"
+
+#include "util/rdma.h"
+#include "util/rdma_rpc.h"
+
+namespace dLSM {
+
+ShardSequencer::ShardSequencer(RDMA_Manager* rdma_mg, uint8_t target_node_id,
+                               uint8_t shard_id)
+    : rdma_mg_(rdma_mg),
+      target_node_id_(target_node_id),
+      shard_id_(shard_id),
+      counter_() {}
+
+Status ShardSequencer::Open() {
+  RPC_Call call(rdma_mg_, target_node_id_, shard_sequencer_);
+  call.request()->content.ss = {};
+  call.request()->content.ss.shard_id = shard_id_;
+  if (!call.Send() || !call.Wait()) {
+    return Status::IOError("failed to send the shard sequencer setup");
+  }
+  counter_ = call.reply().content.mr;
+  if (counter_.addr == nullptr || counter_.length < sizeof(uint64_t)) {
+    return Status::IOError("the memory node has no shard sequencer");
+  }
+  return Status::OK();
+}
+
+Status ShardSequencer::Reserve(uint64_t n, SequenceNumber* first) {
+  assert(counter_.addr != nullptr && n > 0);
+  ibv_mr local = {};
+  rdma_mg_->Allocate_Local_RDMA_Slot(local, Message);
+  int rc = rdma_mg_->RDMA_FAA(&counter_, &local, n, QP_WRITE_LOCAL_FLUSH,
+                              target_node_id_);
+  // The value of the counter before the addition.
+  *first = *static_cast<uint64_t*>(local.addr);
+  rdma_mg_->Deallocate_Local_RDMA_Slot(local.addr, Message);
+  if (rc != 0) {
+    return Status::IOError("failed to reserve the shard sequences");
+  }
+  return Status::OK();
+}
+
+}  // namespace dLSM
@@ -0,0 +1,48 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_SHARD_SEQUENCER_H_
+#define STORAGE_dLSM_DB_SHARD_SEQUENCER_H_
+
+#include <cstdint>
+
+#include <infiniband/verbs.h>
+
+#include "db/dbformat.h"
+#include "dLSM/status.h"
+
+namespace dLSM {
+
+class RDMA_Manager;
+
+// The sequence counter of a shard on its memory node, shared by all the
+// compute nodes writing the shard. A writer reserves the sequences of its
+// batch with one RDMA fetch-and-add, so the batches of the different compute
+// nodes are ordered by the memory node without a round trip to its CPU. The
+// counter starts at 1 and lives as long as the memory node does.
+class ShardSequencer {
+ public:
+  ShardSequencer(RDMA_Manager* rdma_mg, uint8_t target_node_id,
+                 uint8_t shard_id);
+
+  ShardSequencer(const ShardSequencer&) = delete;
+  ShardSequencer& operator=(const ShardSequencer&) = delete;
+
+  // Find the counter of the shard on the memory node.
+  Status Open();
+
+  // Reserve "n" consecutive sequences, the first of which is stored in
+  // *first. Safe to call from several threads.
+  Status Reserve(uint64_t n, SequenceNumber* first);
+
+ private:
+  RDMA_Manager* const rdma_mg_;
+  const uint8_t target_node_id_;
+  const uint8_t shard_id_;
+  ibv_mr counter_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_SHARD_SEQUENCER_H_
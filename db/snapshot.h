@@ -5,15 +5,21 @@
 #ifndef STORAGE_dLSM_DB_SNAPSHOT_H_
 #define STORAGE_dLSM_DB_SNAPSHOT_H_
 
+#include <algorithm>
+#include <atomic>
+
 #include "db/dbformat.h"
 #include "dLSM/db.h"
+#include "port/port.h"
+#include "util/mutexlock.h"
 
 namespace dLSM {
 
 class SnapshotList;
 class SuperVersion;
-// Snapshots are kept in a doubly-linked list in the DB.
-// Each SnapshotImpl corresponds to a particular sequence number.
+// Snapshots are kept in the doubly-linked lists of the shards of a
+// SnapshotList. Each SnapshotImpl corresponds to a particular sequence
+// number.
 class SnapshotImpl : public Snapshot {
  public:
   SnapshotImpl(SequenceNumber sequence_number)
@@ -29,6 +35,8 @@ class SnapshotImpl : public Snapshot {
   // implementation operates on the next/previous fields direcly.
   SnapshotImpl* prev_;
   SnapshotImpl* next_;
+  // The shard of the list it is in.
+  uint32_t shard_ = 0;
 
   const SequenceNumber sequence_number_;
 
@@ -37,36 +45,57 @@ class SnapshotImpl : public Snapshot {
 #endif  // !defined(NDEBUG)
 };
 
+// The snapshots of a DB, spread over shards by the thread which takes them
+// so that the threads taking and releasing snapshots at a high rate do not
+// serialize on one lock. Each shard keeps its snapshots in the order of
+// their sequence numbers and publishes the oldest one, which Oldest() reads
+// without a lock.
 class SnapshotList {
  public:
-  SnapshotList() : head_(0) {
-    head_.prev_ = &head_;
-    head_.next_ = &head_;
+  SnapshotList() {
+    for (Shard& shard : shards_) {
+      shard.head.prev_ = &shard.head;
+      shard.head.next_ = &shard.head;
+    }
   }
 
-  bool empty() const { return head_.next_ == &head_; }
-  SnapshotImpl* oldest() const {
-    assert(!empty());
-    return head_.next_;
+  bool empty() const {
+    return Oldest(kMaxSequenceNumber) == kMaxSequenceNumber;
   }
-  SnapshotImpl* newest() const {
-    assert(!empty());
-    return head_.prev_;
+  // The sequence number of the oldest snapshot, or "if_empty" if there is
+  // none. A snapshot taken meanwhile may be missed, as if it was taken
+  // after the call.
+  SequenceNumber Oldest(SequenceNumber if_empty) const {
+    SequenceNumber oldest = kMaxSequenceNumber;
+    for (const Shard& shard : shards_) {
+      oldest = std::min(oldest, shard.oldest.load(std::memory_order_acquire));
+    }
+    return oldest == kMaxSequenceNumber ? if_empty : oldest;
   }
 
-  // Creates a SnapshotImpl and appends it to the end of the list.
-  SnapshotImpl* New(SequenceNumber sequence_number) {
-    assert(empty() || newest()->sequence_number_ <= sequence_number);
-
-    SnapshotImpl* snapshot = new SnapshotImpl(sequence_number);
+  // Creates a SnapshotImpl at the sequence number "sequence()" returns and
+  // appends it to the list of the shard of this thread. The sequence number
+  // is read under the lock of the shard, which keeps the list in order.
+  template <typename SequenceFunc>
+  SnapshotImpl* New(SequenceFunc sequence) {
+    const uint32_t i = ShardOfThisThread();
+    Shard& shard = shards_[i];
+    SpinLock l(&shard.mutex);
+    SnapshotImpl* snapshot = new SnapshotImpl(sequence());
+    assert(shard.head.prev_ == &shard.head ||
+           shard.head.prev_->sequence_number_ <= snapshot->sequence_number_);
 
 #if !defined(NDEBUG)
     snapshot->list_ = this;
 #endif  // !defined(NDEBUG)
-    snapshot->next_ = &head_;
-    snapshot->prev_ = head_.prev_;
+    snapshot->shard_ = i;
+    snapshot->next_ = &shard.head;
+    snapshot->prev_ = shard.head.prev_;
     snapshot->prev_->next_ = snapshot;
     snapshot->next_->prev_ = snapshot;
+    if (snapshot->prev_ == &shard.head) {
+      shard.oldest.store(snapshot->sequence_number_, std::memory_order_release);
+    }
     return snapshot;
   }
 
@@ -81,15 +110,40 @@ class SnapshotList {
 #if !defined(NDEBUG)
     assert(snapshot->list_ == this);
 #endif  // !defined(NDEBUG)
-    snapshot->prev_->next_ = snapshot->next_;
-    snapshot->next_->prev_ = snapshot->prev_;
+    Shard& shard = shards_[snapshot->shard_];
+    {
+      SpinLock l(&shard.mutex);
+      snapshot->prev_->next_ = snapshot->next_;
+      snapshot->next_->prev_ = snapshot->prev_;
+      if (snapshot->prev_ == &shard.head) {
+        shard.oldest.store(snapshot->next_ == &shard.head
+                               ? kMaxSequenceNumber
+                               : snapshot->next_->sequence_number_,
+                           std::memory_order_release);
+      }
+    }
     delete snapshot;
   }
 
  private:
-  // Dummy head of doubly-linked list of snapshots
-  SnapshotImpl head_;
+  static const uint32_t kNumShards = 16;
+  struct alignas(CACHE_LINE_SIZE) Shard {
+    SpinMutex mutex;
+    // Dummy head of doubly-linked list of snapshots
+    SnapshotImpl head{0};
+    // The sequence number of head.next_, kMaxSequenceNumber if the list is
+    // empty.
+    std::atomic<SequenceNumber> oldest{kMaxSequenceNumber};
+  };
+
+  static uint32_t ShardOfThisThread() {
+    static std::atomic<uint32_t> next_shard{0};
+    thread_local uint32_t shard =
+        next_shard.fetch_add(1, std::memory_order_relaxed) % kNumShards;
+    return shard;
+  }
 
+  Shard shards_[kNumShards];
 };
 
 }  // namespace dLSM
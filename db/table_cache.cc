@@ -4,14 +4,23 @@
 
 #include "db/table_cache.h"
 
+#include "db/dbformat.h"
 #include "db/filename.h"
 #include "table/table_memoryside.h"
+#include <map>
+#include <memory>
 #include <utility>
 
 #include "dLSM/env.h"
+#include "dLSM/rate_limiter.h"
+#include "dLSM/slice_transform.h"
 #include "dLSM/table.h"
 
+#include "table/format.h"
+
 #include "util/coding.h"
+#include "util/memory_budget.h"
+#include "util/statistics.h"
 
 namespace dLSM {
 #ifdef PROCESSANALYSIS
@@ -29,15 +38,23 @@ std::atomic<uint64_t> TableCache::cache_miss_block_fetch_time = 0;
 std::atomic<uint64_t> TableCache::cache_hit = 0;
 std::atomic<uint64_t> TableCache::cache_miss = 0;
 #endif
-union SSTable {
+struct SSTable {
+  union {
 //  RandomAccessFile* file;
 //  std::weak_ptr<RemoteMemTableMetaData> remote_table;
-  Table* table_compute;
-  Table_Memory_Side* table_memory;
+    Table* table_compute;
+    Table_Memory_Side* table_memory;
+  };
+  // The memory of table_compute, counted in *table_bytes while it is open.
+  size_t bytes = 0;
+  std::atomic<size_t>* table_bytes = nullptr;
 };
 
 static void DeleteEntry_Compute(const Slice& key, void* value) {
   SSTable* tf = reinterpret_cast<SSTable*>(value);
+  if (tf->table_bytes != nullptr) {
+    tf->table_bytes->fetch_sub(tf->bytes, std::memory_order_relaxed);
+  }
   delete tf->table_compute;
 //  delete tf->file;
   delete tf;
@@ -60,7 +77,8 @@ TableCache::TableCache(const std::string& dbname, const Options& options,
     : env_(options.env),
       dbname_(dbname),
       options_(options),
-      cache_(NewLRUCache(entries)) {}
+      cache_(options.clock_cache ? NewClockCache(entries)
+                                 : NewLRUCache(entries)) {}
 
 TableCache::~TableCache() {
 #ifdef PROCESSANALYSIS
@@ -86,6 +104,9 @@ TableCache::~TableCache() {
   }
 #endif
   printf("Total number of entries within the cahce is %zu", cache_->TotalCharge());
+  for (auto& pinned : pinned_) {
+    cache_->Release(pinned.second);
+  }
   delete cache_;
 }
 
@@ -106,6 +127,7 @@ Status TableCache::FindTable(
 
 
   *handle = cache_->Lookup(key);
+  RecordTick(*handle != nullptr ? kTableCacheHit : kTableCacheMiss);
   if (*handle == nullptr) {
     // TODO: implement a hash lock to reduce the contention here, otherwise multiple
     // readers may get the same table and RDMA read the index block several times.
@@ -126,19 +148,62 @@ Status TableCache::FindTable(
         // or somebody repairs the file, we recover automatically.
       } else {
         assert(table!= nullptr);
-        SSTable* tf = new SSTable;
-        //      tf->file = file;
-        //      tf->remote_table = Remote_memtable_meta;
-        tf->table_compute = table;
-        assert(table->rep != nullptr);
-        *handle = cache_->Insert(key, tf, 1, &DeleteEntry_Compute);
+        *handle = InsertTable(key, table);
       }
     }
     hash_mtx[hash_value].unlock();
+    MaybeCheckMemoryBudget(options_.memory_budget);
   }
 
   return s;
 }
+Cache::Handle* TableCache::InsertTable(const Slice& key, Table* table) {
+  SSTable* tf = new SSTable;
+  tf->table_compute = table;
+  assert(table->rep != nullptr);
+  tf->bytes = table->ApproximateMemoryUsage();
+  tf->table_bytes = &table_bytes_;
+  table_bytes_.fetch_add(tf->bytes, std::memory_order_relaxed);
+  return cache_->Insert(key, tf, 1, &DeleteEntry_Compute);
+}
+void TableCache::OpenTables(
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& files) {
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> missing;
+  for (const auto& file : files) {
+    Slice key((char*)&file->number, sizeof(uint64_t));
+    Cache::Handle* handle = cache_->Lookup(key);
+    if (handle != nullptr) {
+      cache_->Release(handle);
+    } else {
+      missing.push_back(file);
+    }
+  }
+  if (missing.empty()) {
+    return;
+  }
+  std::vector<Table*> tables;
+  std::vector<Status> statuses;
+  Table::OpenBatch(options_, missing, &tables, &statuses);
+  for (size_t i = 0; i < missing.size(); i++) {
+    if (tables[i] == nullptr) {
+      // FindTable() tries again when the table is read.
+      continue;
+    }
+    Slice key((char*)&missing[i]->number, sizeof(uint64_t));
+    uint64_t hash_value = missing[i]->number % 32;
+    hash_mtx[hash_value].lock();
+    Cache::Handle* handle = cache_->Lookup(key);
+    if (handle == nullptr) {
+      handle = InsertTable(key, tables[i]);
+    } else {
+      // A reader opened it meanwhile.
+      delete tables[i];
+    }
+    hash_mtx[hash_value].unlock();
+    cache_->Release(handle);
+  }
+  MaybeCheckMemoryBudget(options_.memory_budget);
+}
 Status TableCache::FindTable_MemorySide(
     const std::shared_ptr<RemoteMemTableMetaData>& Remote_memtable_meta,
     Table_Memory_Side*& table) {
@@ -188,6 +253,22 @@ Status TableCache::FindTable_MemorySide(
 
 
 }
+bool TableCache::PrefixFiltered(const ReadOptions& options,
+                                const RemoteMemTableMetaData& remote_table,
+                                const Table* table) const {
+  const SliceTransform* extractor = options_.prefix_extractor;
+  if (options.iterate_prefix == nullptr || extractor == nullptr ||
+      remote_table.prefix_extractor != extractor->Name()) {
+    return false;
+  }
+  // A prefix the extractor does not produce is not in any filter.
+  const Slice& prefix = *options.iterate_prefix;
+  if (!extractor->InDomain(prefix) || extractor->Transform(prefix) != prefix) {
+    return false;
+  }
+  return !table->FilterMayMatch(prefix);
+}
+
 Iterator* TableCache::NewIterator(
     const ReadOptions& options,
     std::shared_ptr<RemoteMemTableMetaData> remote_table, Table** tableptr) {
@@ -196,12 +277,16 @@ Iterator* TableCache::NewIterator(
   }
 
   Cache::Handle* handle = nullptr;
-  Status s = FindTable(std::move(remote_table), &handle);
+  Status s = FindTable(remote_table, &handle);
   if (!s.ok()) {
     return NewErrorIterator(s);
   }
 
   Table* table = reinterpret_cast<SSTable*>(cache_->Value(handle))->table_compute;
+  if (PrefixFiltered(options, *remote_table, table)) {
+    cache_->Release(handle);
+    return NewEmptyIterator();
+  }
 #ifndef BYTEADDRESSABLE
   Iterator* result = table->NewIterator(options);
 #endif
@@ -223,12 +308,16 @@ Iterator* TableCache::NewSEQIterator(
   }
 
   Cache::Handle* handle = nullptr;
-  Status s = FindTable(std::move(remote_table), &handle);
+  Status s = FindTable(remote_table, &handle);
   if (!s.ok()) {
     return NewErrorIterator(s);
   }
 
   Table* table = reinterpret_cast<SSTable*>(cache_->Value(handle))->table_compute;
+  if (PrefixFiltered(options, *remote_table, table)) {
+    cache_->Release(handle);
+    return NewEmptyIterator();
+  }
   Iterator* result = table->NewSEQIterator(options);
   result->RegisterCleanup(&UnrefEntry, cache_, handle);
   if (tableptr != nullptr) {
@@ -272,11 +361,57 @@ Iterator* TableCache::NewIterator_MemorySide(
   }
   return result;
 }
+void TableCache::SampleIndexKeys(
+    const std::shared_ptr<RemoteMemTableMetaData>& remote_table,
+    bool memory_side, size_t max_keys, std::vector<std::string>* keys) {
+  Iterator* iter;
+  Cache::Handle* handle = nullptr;
+  Table_Memory_Side* memory_table = nullptr;
+  if (memory_side) {
+    if (!FindTable_MemorySide(remote_table, memory_table).ok()) {
+      return;
+    }
+    iter = memory_table->NewIndexIterator();
+  } else {
+    if (!FindTable(remote_table, &handle).ok()) {
+      return;
+    }
+    ReadOptions options;
+    options.fill_cache = false;
+    iter = reinterpret_cast<SSTable*>(cache_->Value(handle))
+               ->table_compute->NewIndexIterator(options);
+  }
+  // Every stride-th key is kept, and once twice too many are kept every
+  // other one is dropped and the stride doubles.
+  const size_t first = keys->size();
+  size_t stride = 1;
+  size_t i = 0;
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next(), i++) {
+    if (i % stride != 0) {
+      continue;
+    }
+    keys->push_back(iter->key().ToString());
+    if (keys->size() - first >= 2 * max_keys) {
+      size_t kept = first;
+      for (size_t j = first; j < keys->size(); j += 2) {
+        (*keys)[kept++] = std::move((*keys)[j]);
+      }
+      keys->resize(kept);
+      stride *= 2;
+    }
+  }
+  delete iter;
+  if (handle != nullptr) {
+    cache_->Release(handle);
+  }
+  delete memory_table;
+}
 Status TableCache::Get(const ReadOptions& options,
                        std::shared_ptr<RemoteMemTableMetaData> f,
                        const Slice& k, void* arg,
                        void (*handle_result)(void*, const Slice&,
-                                             const Slice&)) {
+                                             const Slice&),
+                       Cleanable* pinned) {
 #ifdef PROCESSANALYSIS
   auto start = std::chrono::high_resolution_clock::now();
 #endif
@@ -286,7 +421,7 @@ Status TableCache::Get(const ReadOptions& options,
   Status s = FindTable(f, &handle);
   if (s.ok()) {
     Table* t = reinterpret_cast<SSTable*>(cache_->Value(handle))->table_compute;
-    s = t->InternalGet(options, k, arg, handle_result);
+    s = t->InternalGet(options, k, arg, handle_result, pinned);
     //if you want to bypass the lock in cache then commet the code below
     cache_->Release(handle);
   }
@@ -307,6 +442,242 @@ char buf[sizeof(file_number)];
 //  memcpy(buf + sizeof(uint64_t), &creator_node_id,
 //         sizeof(uint8_t));
   cache_->Erase(Slice(buf, sizeof(buf)));
+  Cache::Handle* pinned = nullptr;
+  {
+    std::unique_lock<std::mutex> lck(pinned_mtx_);
+    auto iter = pinned_.find(file_number);
+    if (iter != pinned_.end()) {
+      pinned = iter->second;
+      pinned_.erase(iter);
+    }
+  }
+  if (pinned != nullptr) {
+    cache_->Release(pinned);
+  }
+}
+
+void TableCache::PinTables(
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& files) {
+  std::map<uint64_t, Cache::Handle*> pinned;
+  for (const auto& f : files) {
+    Cache::Handle* handle = nullptr;
+    if (FindTable(f, &handle).ok()) {
+      pinned.emplace(f->number, handle);
+    }
+  }
+  {
+    std::unique_lock<std::mutex> lck(pinned_mtx_);
+    pinned_.swap(pinned);
+  }
+  // The handles of the previous call. Released out of the lock, as the last
+  // release deletes the table.
+  for (auto& unpinned : pinned) {
+    cache_->Release(unpinned.second);
+  }
+}
+
+void TableCache::MultiGet(const ReadOptions& options,
+                          std::vector<BatchedGet>* batch,
+                          void (*handle_result)(void*, const Slice&,
+                                                const Slice&),
+                          bool (*resolved)(void*)) {
+  struct PendingRead {
+    size_t index;
+    Cache::Handle* handle;
+    Table* table;
+    BlockHandle block;
+    ibv_mr local_mr;
+    uint8_t target_node_id;
+    // Read through the memory node, see Options::cold_level.
+    bool cold;
+    bool cold_ok;
+  };
+  std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+  std::vector<PendingRead> pending;
+  std::map<uint8_t, std::vector<RDMA_Read_Request>> requests;
+  size_t read_bytes = 0;
+  // The filter of a table is probed for all its keys at once, so that the
+  // probes overlap their cache misses.
+  std::vector<Cache::Handle*> handles(batch->size(), nullptr);
+  std::unique_ptr<bool[]> may_match(new bool[batch->size()]);
+  std::map<Table*, std::vector<size_t>> by_table;
+  for (size_t i = 0; i < batch->size(); i++) {
+    BatchedGet& get = (*batch)[i];
+    get.s = FindTable(get.file, &handles[i]);
+    if (get.s.ok()) {
+      by_table[reinterpret_cast<SSTable*>(cache_->Value(handles[i]))
+                   ->table_compute]
+          .push_back(i);
+    }
+  }
+  std::vector<Slice> user_keys;
+  std::unique_ptr<bool[]> results(new bool[batch->size()]);
+  for (const auto& iter : by_table) {
+    user_keys.clear();
+    for (size_t i : iter.second) {
+      user_keys.push_back(ExtractUserKey((*batch)[i].k));
+    }
+    iter.first->FiltersMayMatch(user_keys.data(), user_keys.size(),
+                                results.get());
+    for (size_t k = 0; k < iter.second.size(); k++) {
+      may_match[iter.second[k]] = results[k];
+    }
+  }
+  for (size_t i = 0; i < batch->size(); i++) {
+    BatchedGet& get = (*batch)[i];
+    PendingRead read;
+    read.index = i;
+    read.handle = handles[i];
+    if (!get.s.ok()) {
+      continue;
+    }
+    read.table =
+        reinterpret_cast<SSTable*>(cache_->Value(read.handle))->table_compute;
+    if (!may_match[i] ||
+        !read.table->PrepareGet(options, get.k, get.arg, handle_result,
+                                &read.block, &get.s, true)) {
+      cache_->Release(read.handle);
+      continue;
+    }
+    size_t n = Table::RemoteReadSize(read.block);
+    assert(n <= rdma_mg->name_to_chunksize.at(DataChunk));
+    // The thread local read buffer can not be shared by the reads in flight,
+    // every read gets its own slot.
+    rdma_mg->Allocate_Local_RDMA_Slot(read.local_mr, DataChunk);
+    read.target_node_id = get.file->shard_target_node_id;
+    read.cold = get.file->cold_file_id != 0;
+    read.cold_ok = false;
+    if (!read.cold) {
+      ibv_mr remote_mr = {};
+      Find_Remote_MR(&get.file->remote_data_mrs, read.block, &remote_mr);
+      requests[read.target_node_id].push_back(
+          {remote_mr.addr, remote_mr.rkey, read.local_mr.addr,
+           read.local_mr.lkey, n});
+      read_bytes += n;
+    }
+    pending.push_back(read);
+  }
+  if (options_.rdma_limiter != nullptr && read_bytes != 0) {
+    options_.rdma_limiter->Request(static_cast<int64_t>(read_bytes),
+                                   RateLimiter::kHigh);
+  }
+  // Post the reads of all the memory nodes before waiting for any of them.
+  std::vector<RDMA_Read_Future> futures(requests.size());
+  std::map<uint8_t, int> read_rc;
+  size_t j = 0;
+  for (auto& iter : requests) {
+    read_rc[iter.first] =
+        rdma_mg->RDMA_Read_Batch_Async(iter.second, iter.first, &futures[j++]);
+  }
+  // The cold reads go one by one while the others are in flight.
+  for (PendingRead& read : pending) {
+    if (read.cold) {
+      const BatchedGet& get = (*batch)[read.index];
+      read.cold_ok = rdma_mg->Remote_Cold_Read(
+          get.file->cold_file_id, read.block.offset(),
+          Table::RemoteReadSize(read.block), &read.local_mr,
+          read.target_node_id);
+    }
+  }
+  j = 0;
+  for (auto& iter : requests) {
+    int rc = futures[j++].Wait();
+    if (read_rc[iter.first] == 0) {
+      read_rc[iter.first] = rc;
+    }
+  }
+  // Entries without a pending read were already handled in PrepareGet.
+  bool stop = false;
+  size_t p = 0;
+  for (size_t i = 0; i < batch->size(); i++) {
+    BatchedGet& get = (*batch)[i];
+    if (p < pending.size() && pending[p].index == i) {
+      PendingRead& read = pending[p++];
+      if (!stop) {
+        if (read.cold ? !read.cold_ok : read_rc[read.target_node_id] != 0) {
+          get.s = Status::IOError("RDMA read failed");
+        } else {
+          get.s = read.table->FinishGet(options, get.k, read.block,
+                                        static_cast<char*>(read.local_mr.addr),
+                                        get.arg, handle_result);
+        }
+      }
+      rdma_mg->Deallocate_Local_RDMA_Slot(read.local_mr.addr, DataChunk);
+      cache_->Release(read.handle);
+    }
+    if (!stop && resolved != nullptr && (!get.s.ok() || (*resolved)(get.arg))) {
+      stop = true;
+    }
+  }
+}
+
+bool TableCache::StartGet(const ReadOptions& options, BatchedGet* get,
+                          void (*handle_result)(void*, const Slice&,
+                                                const Slice&),
+                          AsyncGet* pending) {
+  pending->handle = nullptr;
+  get->s = FindTable(get->file, &pending->handle);
+  if (!get->s.ok()) {
+    return false;
+  }
+  pending->table =
+      reinterpret_cast<SSTable*>(cache_->Value(pending->handle))->table_compute;
+  if (!pending->table->PrepareGet(options, get->k, get->arg, handle_result,
+                                  &pending->block, &get->s)) {
+    cache_->Release(pending->handle);
+    pending->handle = nullptr;
+    return false;
+  }
+  std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+  size_t n = Table::RemoteReadSize(pending->block);
+  assert(n <= rdma_mg->name_to_chunksize.at(DataChunk));
+  // Every read in flight gets its own slot, as in MultiGet().
+  rdma_mg->Allocate_Local_RDMA_Slot(pending->local_mr, DataChunk);
+  const uint8_t target_node_id = get->file->shard_target_node_id;
+  pending->cold = get->file->cold_file_id != 0;
+  pending->cold_ok = false;
+  if (pending->cold) {
+    // The future stays done, the cold read goes through the memory node.
+    pending->cold_ok = rdma_mg->Remote_Cold_Read(
+        get->file->cold_file_id, pending->block.offset(), n,
+        &pending->local_mr, target_node_id);
+    return true;
+  }
+  if (options_.rdma_limiter != nullptr) {
+    options_.rdma_limiter->Request(static_cast<int64_t>(n),
+                                   RateLimiter::kHigh);
+  }
+  ibv_mr remote_mr = {};
+  Find_Remote_MR(&get->file->remote_data_mrs, pending->block, &remote_mr);
+  std::vector<RDMA_Read_Request> request = {
+      {remote_mr.addr, remote_mr.rkey, pending->local_mr.addr,
+       pending->local_mr.lkey, n}};
+  if (rdma_mg->RDMA_Read_Batch_Async(request, target_node_id,
+                                     &pending->future) != 0) {
+    // Drain what was posted, FinishGet() reports the failure.
+    pending->future.Wait();
+    pending->cold = true;
+  }
+  return true;
+}
+
+void TableCache::FinishGet(const ReadOptions& options, BatchedGet* get,
+                           void (*handle_result)(void*, const Slice&,
+                                                 const Slice&),
+                           AsyncGet* pending) {
+  std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+  const bool failed =
+      pending->cold ? !pending->cold_ok : pending->future.Wait() != 0;
+  if (failed) {
+    get->s = Status::IOError("RDMA read failed");
+  } else {
+    get->s = pending->table->FinishGet(
+        options, get->k, pending->block,
+        static_cast<char*>(pending->local_mr.addr), get->arg, handle_result);
+  }
+  rdma_mg->Deallocate_Local_RDMA_Slot(pending->local_mr.addr, DataChunk);
+  cache_->Release(pending->handle);
+  pending->handle = nullptr;
 }
 
 }  // namespace dLSM
@@ -9,8 +9,11 @@
 
 #include "db/dbformat.h"
 #include "db/version_edit.h"
+#include <atomic>
 #include <cstdint>
+#include <map>
 #include <string>
+#include <vector>
 //#include <table/table_memoryside.h>
 
 #include "dLSM/cache.h"
@@ -48,7 +51,8 @@ class TableCache {
   // underlying the returned iterator, or to nullptr if no Table object
   // underlies the returned iterator.  The returned "*tableptr" object is owned
   // by the table_cache and should not be deleted, and is valid for as long as the
-  // returned iterator is live.
+  // returned iterator is live. With options.iterate_prefix the iterator is
+  // empty if the filter of the table has no key of the prefix.
   Iterator* NewIterator(const ReadOptions& options,
                         std::shared_ptr<RemoteMemTableMetaData> remote_table,
                         Table** tableptr = nullptr);
@@ -60,6 +64,13 @@ class TableCache {
   Iterator* NewIterator_MemorySide(const ReadOptions& options,
                         const std::shared_ptr<RemoteMemTableMetaData>& remote_table,
       Table_Memory_Side** tableptr = nullptr);
+  // Append to "keys" at most "max_keys" of the keys of the index of the
+  // table, spread evenly over it, so that each stands for about as many
+  // bytes of the table. With "memory_side" the table is opened as on the
+  // memory node, where its index is local.
+  void SampleIndexKeys(
+      const std::shared_ptr<RemoteMemTableMetaData>& remote_table,
+      bool memory_side, size_t max_keys, std::vector<std::string>* keys);
 #ifdef PROCESSANALYSIS
   static void CleanAll(){
     GetTimeElapseSum = 0;
@@ -80,18 +91,91 @@ class TableCache {
   }
 #endif
   // If a seek to internal key "k" in specified file finds an entry,
-  // call (*handle_result)(arg, found_key, found_value).
+  // call (*handle_result)(arg, found_key, found_value). If pinned is not
+  // null, the entry stays valid until pinned runs its cleanups.
   Status Get(const ReadOptions& options,
              std::shared_ptr<RemoteMemTableMetaData> f, const Slice& k,
              void* arg,
-             void (*handle_result)(void*, const Slice&, const Slice&));
+             void (*handle_result)(void*, const Slice&, const Slice&),
+             Cleanable* pinned = nullptr);
+
+  // One lookup of a MultiGet() batch, "s" is set by MultiGet().
+  struct BatchedGet {
+    std::shared_ptr<RemoteMemTableMetaData> file;
+    Slice k;
+    void* arg;
+    Status s;
+  };
+  // Same as calling Get() for every entry of *batch, except that the remote
+  // reads of all the entries are posted as one chained RDMA submission per
+  // memory node and waited for together.
+  // If "resolved" is given, the results are handled in batch order and the
+  // entries after the first one for which resolved(arg) returns true (or
+  // which fails) are left unhandled.
+  void MultiGet(const ReadOptions& options, std::vector<BatchedGet>* batch,
+                void (*handle_result)(void*, const Slice&, const Slice&),
+                bool (*resolved)(void*) = nullptr);
+
+  // A Get() whose remote read is in flight, see StartGet(). handle is null
+  // while there is none.
+  struct AsyncGet {
+    Cache::Handle* handle = nullptr;
+    Table* table = nullptr;
+    BlockHandle block;
+    ibv_mr local_mr;
+    RDMA_Read_Future future;
+    // Read through the memory node, see Options::cold_level.
+    bool cold = false;
+    bool cold_ok = false;
+  };
+  // Start the lookup of *get and post its remote read without waiting for
+  // it. Returns true if the read is in flight: once pending->future.IsReady()
+  // FinishGet() completes the lookup. Returns false if the lookup ended
+  // without a read, get->s is set then.
+  bool StartGet(const ReadOptions& options, BatchedGet* get,
+                void (*handle_result)(void*, const Slice&, const Slice&),
+                AsyncGet* pending);
+  // Complete the lookup StartGet() started, whose read has finished, and set
+  // get->s.
+  void FinishGet(const ReadOptions& options, BatchedGet* get,
+                 void (*handle_result)(void*, const Slice&, const Slice&),
+                 AsyncGet* pending);
 
   // Evict any entry for the specified file number
   void Evict(uint64_t file_number, uint8_t creator_node_id);
 
+  // Close the tables no reader holds, and drop their index and filter.
+  void Prune() { cache_->Prune(); }
+
+  // The bytes of the index blocks and filters of the open tables.
+  size_t ApproximateMemoryUsage() const {
+    return table_bytes_.load(std::memory_order_relaxed);
+  }
+
+  // Open the tables of "files" the cache does not hold yet, with the index
+  // blocks and filters of all of them read in one batch, and leave them in
+  // the cache. Called before a flush or a compaction installs its tables,
+  // see Options::open_new_tables.
+  void OpenTables(
+      const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& files);
+
+  // Keep the tables of "files", with their index and filter, in the cache
+  // until the next call, and release the ones pinned by the previous call
+  // which are not in "files".
+  void PinTables(
+      const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& files);
+
  private:
+  // Whether the filter of "table" rules out options.iterate_prefix. Only a
+  // table built with the prefix extractor of options_ has the prefixes in
+  // its filter.
+  bool PrefixFiltered(const ReadOptions& options,
+                      const RemoteMemTableMetaData& remote_table,
+                      const Table* table) const;
   Status FindTable(const std::shared_ptr<RemoteMemTableMetaData>& Remote_memtable_meta,
                    Cache::Handle** handle);
+  // Add the open "table" under "key", and return its handle.
+  Cache::Handle* InsertTable(const Slice& key, Table* table);
   Status FindTable_MemorySide(
       const std::shared_ptr<RemoteMemTableMetaData>& Remote_memtable_meta,
       Table_Memory_Side*& table);
@@ -99,7 +183,11 @@ class TableCache {
   const std::string dbname_;
   const Options& options_;
   Cache* cache_;
+  std::atomic<size_t> table_bytes_{0};
   std::mutex hash_mtx[32];
+  std::mutex pinned_mtx_;
+  // file number -> handle, see PinTables().
+  std::map<uint64_t, Cache::Handle*> pinned_;
 };
 
 }  // namespace dLSM
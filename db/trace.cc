@@ -0,0 +1,246 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/trace.h"
+
+#include <algorithm>
+
+#include "dLSM/write_batch.h"
+#include "util/coding.h"
+
+namespace dLSM {
+
+namespace {
+
+const uint32_t kTraceMagic = 0x7472634c;  // "Lcrt"
+const uint32_t kTraceVersion = 1;
+const size_t kTraceHeaderSize = 16;
+// A buffer is written out once it holds that much.
+const size_t kBufferSize = 64 * 1024;
+
+// Records the Seek() and the Next() calls after it. A SeekToFirst() is a
+// Seek() to the empty key, the other moves are not recorded.
+class TracingIterator : public Iterator {
+ public:
+  TracingIterator(Iterator* iter, Tracer* tracer)
+      : iter_(iter), tracer_(tracer) {}
+  ~TracingIterator() override {
+    FinishSeek();
+    delete iter_;
+  }
+
+  bool Valid() const override { return iter_->Valid(); }
+  void SeekToFirst() override {
+    StartSeek(Slice());
+    iter_->SeekToFirst();
+  }
+  void SeekToLast() override {
+    FinishSeek();
+    iter_->SeekToLast();
+  }
+  void Seek(const Slice& target) override {
+    StartSeek(target);
+    iter_->Seek(target);
+  }
+  void Next() override {
+    nexts_++;
+    iter_->Next();
+  }
+  void Prev() override { iter_->Prev(); }
+  Slice key() const override { return iter_->key(); }
+  Slice value() const override { return iter_->value(); }
+  Status status() const override { return iter_->status(); }
+  Status Refresh() override { return iter_->Refresh(); }
+
+ private:
+  void StartSeek(const Slice& target) {
+    FinishSeek();
+    seeking_ = true;
+    seek_micros_ = tracer_->NowMicros();
+    seek_key_.assign(target.data(), target.size());
+    nexts_ = 0;
+  }
+  // The length of the scan is known once the next seek starts.
+  void FinishSeek() {
+    if (seeking_) {
+      tracer_->RecordSeek(seek_micros_, seek_key_, nexts_);
+      seeking_ = false;
+    }
+  }
+
+  Iterator* const iter_;
+  Tracer* const tracer_;
+  bool seeking_ = false;
+  uint64_t seek_micros_ = 0;
+  std::string seek_key_;
+  uint32_t nexts_ = 0;
+};
+
+}  // namespace
+
+class Tracer::BatchRecorder : public WriteBatch::Handler {
+ public:
+  BatchRecorder(Tracer* tracer, uint64_t micros)
+      : tracer_(tracer), micros_(micros) {}
+
+  void Put(const Slice& key, const Slice& value) override {
+    tracer_->RecordAt(micros_, kTracePut, key,
+                      static_cast<uint32_t>(value.size()));
+  }
+  void Delete(const Slice& key) override {
+    tracer_->RecordAt(micros_, kTraceDelete, key, 0);
+  }
+  void Merge(const Slice& key, const Slice& value) override {
+    tracer_->RecordAt(micros_, kTraceMerge, key,
+                      static_cast<uint32_t>(value.size()));
+  }
+
+ private:
+  Tracer* const tracer_;
+  const uint64_t micros_;
+};
+
+Tracer::Tracer(Env* env) : env_(env) {}
+
+Tracer::~Tracer() { End(); }
+
+Status Tracer::Start(const std::string& path) {
+  std::lock_guard<std::mutex> l(file_mu_);
+  if (file_ != nullptr) {
+    return Status::InvalidArgument("a trace is being recorded", path);
+  }
+  WritableFile* file;
+  Status s = env_->NewWritableFile(path, &file);
+  if (!s.ok()) {
+    return s;
+  }
+  start_micros_ = env_->NowMicros();
+  std::string header;
+  PutFixed32(&header, kTraceMagic);
+  PutFixed32(&header, kTraceVersion);
+  PutFixed64(&header, start_micros_);
+  s = file->Append(header);
+  if (!s.ok()) {
+    delete file;
+    return s;
+  }
+  file_ = file;
+  status_ = Status::OK();
+  active_.store(true, std::memory_order_release);
+  return s;
+}
+
+Status Tracer::End() {
+  if (!active_.exchange(false)) {
+    return Status::OK();
+  }
+  // The records which started before are in the buffers once their mutex is
+  // released.
+  for (size_t i = 0; i < buffers_.Size(); i++) {
+    Buffer* buffer = buffers_.AccessAtCore(i);
+    std::lock_guard<std::mutex> l(buffer->mu);
+    WriteOut(&buffer->data);
+  }
+  std::lock_guard<std::mutex> l(file_mu_);
+  Status s = status_;
+  Status close_status = file_->Close();
+  if (s.ok()) {
+    s = close_status;
+  }
+  delete file_;
+  file_ = nullptr;
+  return s;
+}
+
+void Tracer::RecordWrite(const WriteBatch* batch) {
+  if (active()) {
+    BatchRecorder recorder(this, env_->NowMicros());
+    batch->Iterate(&recorder);
+  }
+}
+
+void Tracer::RecordSeek(uint64_t micros, const Slice& key, uint32_t nexts) {
+  if (active()) {
+    RecordAt(micros, kTraceSeek, key, nexts);
+  }
+}
+
+void Tracer::RecordAt(uint64_t micros, TraceType type, const Slice& key,
+                      uint32_t value_size) {
+  Buffer* buffer = buffers_.Access();
+  std::lock_guard<std::mutex> l(buffer->mu);
+  if (!active()) {
+    // End() may have written the buffer out already.
+    return;
+  }
+  std::string* data = &buffer->data;
+  PutFixed64(data, micros > start_micros_ ? micros - start_micros_ : 0);
+  data->push_back(static_cast<char>(type));
+  PutLengthPrefixedSlice(data, key);
+  PutVarint32(data, value_size);
+  if (data->size() >= kBufferSize) {
+    WriteOut(data);
+  }
+}
+
+void Tracer::WriteOut(std::string* data) {
+  if (data->empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> l(file_mu_);
+  if (file_ != nullptr && status_.ok()) {
+    status_ = file_->Append(*data);
+  }
+  data->clear();
+}
+
+Iterator* NewTracingIterator(Iterator* iter, Tracer* tracer) {
+  return new TracingIterator(iter, tracer);
+}
+
+Status ReadTrace(Env* env, const std::string& path,
+                 std::vector<TraceRecord>* records) {
+  std::string contents;
+  Status s = ReadFileToString(env, path, &contents);
+  if (!s.ok()) {
+    return s;
+  }
+  if (contents.size() < kTraceHeaderSize ||
+      DecodeFixed32(contents.data()) != kTraceMagic) {
+    return Status::Corruption("not a trace", path);
+  }
+  if (DecodeFixed32(contents.data() + 4) != kTraceVersion) {
+    return Status::NotSupported("trace version", path);
+  }
+  Slice input(contents.data() + kTraceHeaderSize,
+              contents.size() - kTraceHeaderSize);
+  records->clear();
+  while (!input.empty()) {
+    TraceRecord record;
+    Slice key;
+    if (input.size() < 9) {
+      return Status::Corruption("truncated trace record", path);
+    }
+    record.micros = DecodeFixed64(input.data());
+    record.type = static_cast<TraceType>(input[8]);
+    input.remove_prefix(9);
+    if (!GetLengthPrefixedSlice(&input, &key) ||
+        !GetVarint32(&input, &record.value_size)) {
+      return Status::Corruption("truncated trace record", path);
+    }
+    if (record.type < kTracePut || record.type > kTraceSeek) {
+      return Status::Corruption("unknown trace record", path);
+    }
+    record.key = key.ToString();
+    records->push_back(std::move(record));
+  }
+  // The buffers of the cores were written out in any order.
+  std::stable_sort(records->begin(), records->end(),
+                   [](const TraceRecord& a, const TraceRecord& b) {
+                     return a.micros < b.micros;
+                   });
+  return Status::OK();
+}
+
+}  // namespace dLSM
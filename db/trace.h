@@ -0,0 +1,107 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_TRACE_H_
+#define STORAGE_dLSM_DB_TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "dLSM/env.h"
+#include "dLSM/iterator.h"
+#include "dLSM/slice.h"
+#include "dLSM/status.h"
+#include "util/core_local.h"
+
+namespace dLSM {
+
+class WriteBatch;
+
+// The operations of a trace.
+enum TraceType : uint8_t {
+  kTracePut = 1,
+  kTraceDelete = 2,
+  kTraceMerge = 3,
+  kTraceGet = 4,
+  // A Seek() of an iterator, the value size is the number of Next() calls
+  // which followed it.
+  kTraceSeek = 5,
+};
+
+struct TraceRecord {
+  // Since the start of the trace.
+  uint64_t micros;
+  TraceType type;
+  std::string key;
+  uint32_t value_size;
+};
+
+// Records the operations of a DB into a file, see DB::StartTrace(). The
+// records are encoded into per-core buffers, so that the threads of the
+// operations only contend with the ones on the same core and do not write
+// the file themselves but when a buffer is full. The records of different
+// buffers are interleaved in the file, ReadTrace() sorts them by time.
+//
+// A Tracer lives as long as the DB, Start() and End() may be called again.
+class Tracer {
+ public:
+  explicit Tracer(Env* env);
+  ~Tracer();
+
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  // Fails if a trace is already being recorded.
+  Status Start(const std::string& path);
+  // Writes out the buffers and closes the file.
+  Status End();
+  bool active() const { return active_.load(std::memory_order_acquire); }
+
+  void RecordGet(const Slice& key) { Record(kTraceGet, key, 0); }
+  void RecordWrite(const WriteBatch* batch);
+  // The Seek() at "micros" followed by "nexts" Next() calls.
+  void RecordSeek(uint64_t micros, const Slice& key, uint32_t nexts);
+  uint64_t NowMicros() const { return env_->NowMicros(); }
+
+ private:
+  class BatchRecorder;
+
+  struct alignas(64) Buffer {
+    std::mutex mu;
+    std::string data;
+  };
+
+  void Record(TraceType type, const Slice& key, uint32_t value_size) {
+    if (active()) {
+      RecordAt(env_->NowMicros(), type, key, value_size);
+    }
+  }
+  void RecordAt(uint64_t micros, TraceType type, const Slice& key,
+                uint32_t value_size);
+  // Append "data" to the file and clear it.
+  void WriteOut(std::string* data);
+
+  Env* const env_;
+  std::atomic<bool> active_{false};
+  uint64_t start_micros_ = 0;
+  CoreLocalArray<Buffer> buffers_;
+  // Guards file_ and status_, acquired after the mutex of a buffer.
+  std::mutex file_mu_;
+  WritableFile* file_ = nullptr;
+  Status status_;
+};
+
+// Wraps the iterator of DB::NewIterator() to record its seeks into "tracer".
+Iterator* NewTracingIterator(Iterator* iter, Tracer* tracer);
+
+// Reads the trace at "path" into *records, sorted by time.
+Status ReadTrace(Env* env, const std::string& path,
+                 std::vector<TraceRecord>* records);
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_TRACE_H_
@@ -4,10 +4,15 @@
 
 #include "db/version_edit.h"
 
+#include <algorithm>
+
+#include "db/blob.h"
+#include "db/parity_stripes.h"
 #include "db/version_set.h"
 #include "util/coding.h"
 #include "memory_node/memory_node_keeper.h"
 #include "dLSM/env.h"
+#include "dLSM/slice_transform.h"
 #include "table_cache.h"
 namespace dLSM {
 //std::shared_ptr<RDMA_Manager> RemoteMemTableMetaData::rdma_mg = Env::Default()->rdma_mg;
@@ -51,7 +56,11 @@ RemoteMemTableMetaData::RemoteMemTableMetaData(int side)
 RemoteMemTableMetaData::~RemoteMemTableMetaData() {
   //TODO and Tothink: when destroy this metadata check whether this is compute node, if yes, send a message to
   // home node to deference. Or the remote dereference is conducted in the granularity of version.
-  assert(remote_dataindex_mrs.size() == 1);
+  // A table decoded from the MANIFEST of the memory node has no chunks until
+  // its file is loaded.
+  assert(remote_dataindex_mrs.size() == 1 ||
+         (this_machine_type == 1 && remote_data_mrs.empty() &&
+          remote_dataindex_mrs.empty() && remote_filter_mrs.empty()));
   assert(this_machine_type ==0 || this_machine_type == 1);
 //  assert(creator_node_id == 0 || creator_node_id == 1);
 
@@ -60,7 +69,37 @@ RemoteMemTableMetaData::~RemoteMemTableMetaData() {
     if (table_cache != nullptr){
       table_cache->Evict(number, creator_node_id);
     }
-    if (creator_node_id == rdma_mg->node_id){
+    BlobChunkRefs::Unref(rdma_mg.get(), shard_target_node_id, blob_chunks,
+                         !borrowed);
+    ParityStripe* parity_stripe = stripe.load();
+    if (parity_stripe != nullptr) {
+      // The data chunks go with the last table of the stripe.
+      for (auto& chunk : remote_data_mrs) {
+        delete chunk.second;
+      }
+      remote_data_mrs.clear();
+      ParityStripes::Leave(rdma_mg.get(), parity_stripe, stripe_index,
+                           !borrowed);
+    }
+    // The compute node allocated the copy, it frees it as its own chunks.
+    TableReplica* copy = replica.load();
+    if (copy != nullptr) {
+      for (auto& chunk : copy->data_mrs) {
+        rdma_mg->Deallocate_Remote_RDMA_Slot(chunk.second->addr, copy->node_id,
+                                             chunk.second->length);
+        delete chunk.second;
+      }
+      delete copy;
+    }
+    if (borrowed) {
+      // The owner of the shard frees the chunks.
+      for (auto* chunks : {&remote_data_mrs, &remote_dataindex_mrs,
+                           &remote_filter_mrs}) {
+        for (auto& chunk : *chunks) {
+          delete chunk.second;
+        }
+      }
+    } else if (creator_node_id == rdma_mg->node_id){
       //#ifndef NDEBUG
       //        printf("Destroying RemoteMemtableMetaData locally on compute node, Table number is %lu, creator node id is %d \n", number, creator_node_id);
       //#endif
@@ -106,6 +145,12 @@ RemoteMemTableMetaData::~RemoteMemTableMetaData() {
   //    }
 
 
+}
+std::string FilterPrefixName(const Options& options) {
+  if (options.filter_policy == nullptr || options.prefix_extractor == nullptr) {
+    return std::string();
+  }
+  return options.prefix_extractor->Name();
 }
 void RemoteMemTableMetaData::EncodeTo(std::string* dst) const {
   PutFixed64(dst, level);
@@ -117,6 +162,9 @@ void RemoteMemTableMetaData::EncodeTo(std::string* dst) const {
   PutFixed64(dst, file_size);
   PutLengthPrefixedSlice(dst, smallest.Encode());
   PutLengthPrefixedSlice(dst, largest.Encode());
+  PutFixed64(dst, largest_seq);
+  PutFixed64(dst, cold_file_id);
+  PutLengthPrefixedSlice(dst, prefix_extractor);
   uint64_t remote_data_chunk_num = remote_data_mrs.size();
   uint64_t remote_dataindex_chunk_num = remote_dataindex_mrs.size();
   uint64_t remote_filter_chunk_num = remote_filter_mrs.size();
@@ -133,9 +181,13 @@ void RemoteMemTableMetaData::EncodeTo(std::string* dst) const {
 ////    rkey =
 //  }
 //#endif
-  PutFixed64(dst, (uint64_t)remote_data_mrs.begin()->second->context);
-  PutFixed64(dst, (uint64_t)remote_data_mrs.begin()->second->pd);
-  PutFixed32(dst, (uint32_t)remote_data_mrs.begin()->second->handle);
+  // A cold table has no data chunks, but always an index chunk.
+  const ibv_mr* first_mr = remote_data_mrs.empty()
+                               ? remote_dataindex_mrs.begin()->second
+                               : remote_data_mrs.begin()->second;
+  PutFixed64(dst, (uint64_t)first_mr->context);
+  PutFixed64(dst, (uint64_t)first_mr->pd);
+  PutFixed32(dst, (uint32_t)first_mr->handle);
 //  PutFixed32(dst, (uint32_t)remote_data_mrs.begin()->second->lkey);
 //  PutFixed32(dst, (uint32_t)remote_data_mrs.begin()->second->rkey);
   for(auto iter : remote_data_mrs){
@@ -150,6 +202,14 @@ void RemoteMemTableMetaData::EncodeTo(std::string* dst) const {
     PutFixed32(dst, iter.first);
     mr_serialization(dst,iter.second);
   }
+  PutVarint32(dst, blob_chunks.size());
+  for (uint64_t chunk : blob_chunks) {
+    PutFixed64(dst, chunk);
+  }
+  PutVarint64(dst, num_entries);
+  PutVarint64(dst, num_deletions);
+  PutVarint64(dst, creation_time);
+  key_stats.EncodeTo(dst);
 //  size_t
 }
 Status RemoteMemTableMetaData::DecodeFrom(Slice& src) {
@@ -180,6 +240,10 @@ Status RemoteMemTableMetaData::DecodeFrom(Slice& src) {
   smallest.DecodeFrom(temp);
   GetLengthPrefixedSlice(&src, &temp);
   largest.DecodeFrom(temp);
+  GetFixed64(&src, &largest_seq);
+  GetFixed64(&src, &cold_file_id);
+  GetLengthPrefixedSlice(&src, &temp);
+  prefix_extractor = temp.ToString();
   uint64_t remote_data_chunk_num;
   uint64_t remote_dataindex_chunk_num;
   uint64_t remote_filter_chunk_num;
@@ -196,7 +260,8 @@ Status RemoteMemTableMetaData::DecodeFrom(Slice& src) {
   GetFixed32(&src, &handle_temp);
 //  GetFixed32(&src, &lkey_temp);
 //  GetFixed32(&src, &rkey_temp);
-  assert(remote_data_chunk_num < 1000 && remote_data_chunk_num>0);
+  assert(remote_data_chunk_num < 1000 &&
+         (remote_data_chunk_num > 0 || cold_file_id != 0));
   for(auto i = 0; i< remote_data_chunk_num; i++){
     //Todo: check whether the reinterpret_cast here make the correct value.
     ibv_mr* mr = new ibv_mr{.context =  reinterpret_cast<ibv_context*>(context_temp),
@@ -244,8 +309,230 @@ Status RemoteMemTableMetaData::DecodeFrom(Slice& src) {
     remote_filter_mrs.insert({offset, mr});
   }
   assert(!remote_filter_mrs.empty());
+  uint32_t blob_chunk_num = 0;
+  GetVarint32(&src, &blob_chunk_num);
+  std::vector<uint64_t> chunks(blob_chunk_num);
+  for (auto& chunk : chunks) {
+    GetFixed64(&src, &chunk);
+  }
+  SetBlobChunks(std::move(chunks));
+  uint64_t entries = 0;
+  uint64_t deletions = 0;
+  GetVarint64(&src, &entries);
+  GetVarint64(&src, &deletions);
+  GetVarint64(&src, &creation_time);
+  num_entries = entries;
+  num_deletions = deletions;
+  key_stats.DecodeFrom(&src);
   return s;
 }
+// "key" as the length it shares with "base" and the rest of it.
+static void PutKeyDelta(std::string* dst, const Slice& base, const Slice& key) {
+  const size_t limit = std::min(base.size(), key.size());
+  size_t shared = 0;
+  while (shared < limit && base[shared] == key[shared]) {
+    shared++;
+  }
+  PutVarint32(dst, shared);
+  PutLengthPrefixedSlice(dst, Slice(key.data() + shared, key.size() - shared));
+}
+
+static bool GetKeyDelta(Slice* input, const Slice& base, InternalKey* dst) {
+  uint32_t shared;
+  Slice rest;
+  if (!GetVarint32(input, &shared) || shared > base.size() ||
+      !GetLengthPrefixedSlice(input, &rest)) {
+    return false;
+  }
+  std::string key;
+  key.reserve(shared + rest.size());
+  key.append(base.data(), shared);
+  key.append(rest.data(), rest.size());
+  return dst->DecodeFrom(key);
+}
+
+// Whether "next" continues the run of chunks from "prev" with the same steps
+// of offset and address and the same length and keys.
+static bool ContinuesRun(const ChunkTable::value_type& prev,
+                         const ChunkTable::value_type& next,
+                         uint32_t offset_step, uint64_t addr_step) {
+  return next.first - prev.first == offset_step &&
+         (uint64_t)next.second->addr - (uint64_t)prev.second->addr ==
+             addr_step &&
+         next.second->length == prev.second->length &&
+         next.second->lkey == prev.second->lkey &&
+         next.second->rkey == prev.second->rkey;
+}
+
+// The chunks as runs: the count of the run, the offset and address of its
+// first chunk, the steps of both to the next chunk, and the length and keys
+// all of them share. The chunks of a table are mostly cut from one remote
+// region one after another, so a table is a run or a few.
+static void PutChunkRuns(std::string* dst, const ChunkTable& chunks) {
+  PutVarint32(dst, chunks.size());
+  auto iter = chunks.begin();
+  while (iter != chunks.end()) {
+    uint32_t offset_step = 0;
+    uint64_t addr_step = 0;
+    size_t n = 1;
+    if (iter + 1 != chunks.end()) {
+      offset_step = (iter + 1)->first - iter->first;
+      addr_step = (uint64_t)(iter + 1)->second->addr - (uint64_t)iter->second->addr;
+      while (iter + n != chunks.end() &&
+             ContinuesRun(*(iter + n - 1), *(iter + n), offset_step,
+                          addr_step)) {
+        n++;
+      }
+      if (n == 1) {
+        offset_step = 0;
+        addr_step = 0;
+      }
+    }
+    PutVarint32(dst, n);
+    PutVarint32(dst, iter->first);
+    PutVarint32(dst, offset_step);
+    PutFixed64(dst, (uint64_t)iter->second->addr);
+    PutVarint64(dst, addr_step);
+    PutVarint64(dst, iter->second->length);
+    PutFixed32(dst, iter->second->lkey);
+    PutFixed32(dst, iter->second->rkey);
+    iter += n;
+  }
+}
+
+static bool GetChunkRuns(Slice* input, const ibv_mr& shared,
+                         ChunkTable* chunks) {
+  uint32_t count;
+  if (!GetVarint32(input, &count)) {
+    return false;
+  }
+  while (chunks->size() < count) {
+    uint32_t n, offset, offset_step;
+    uint64_t addr, addr_step, length;
+    uint32_t lkey, rkey;
+    if (!GetVarint32(input, &n) || n == 0 || n > count - chunks->size() ||
+        !GetVarint32(input, &offset) || !GetVarint32(input, &offset_step) ||
+        !GetFixed64(input, &addr) || !GetVarint64(input, &addr_step) ||
+        !GetVarint64(input, &length) || !GetFixed32(input, &lkey) ||
+        !GetFixed32(input, &rkey)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      ibv_mr* mr = new ibv_mr(shared);
+      mr->addr = reinterpret_cast<void*>(addr + i * addr_step);
+      mr->length = length;
+      mr->lkey = lkey;
+      mr->rkey = rkey;
+      chunks->insert({offset + i * offset_step, mr});
+    }
+  }
+  return true;
+}
+
+void RemoteMemTableMetaData::EncodeCompactTo(std::string* dst,
+                                             const Slice& previous_key) const {
+  PutVarint64(dst, level);
+  PutVarint64(dst, number);
+  dst->append(reinterpret_cast<const char*>(&creator_node_id), sizeof(creator_node_id));
+  dst->append(reinterpret_cast<const char*>(&shard_target_node_id), sizeof(shard_target_node_id));
+  PutVarint64(dst, file_size);
+  PutKeyDelta(dst, previous_key, smallest.Encode());
+  PutKeyDelta(dst, smallest.Encode(), largest.Encode());
+  PutVarint64(dst, largest_seq);
+  PutVarint64(dst, cold_file_id);
+  PutLengthPrefixedSlice(dst, prefix_extractor);
+  const ibv_mr* first_mr = remote_data_mrs.empty()
+                               ? remote_dataindex_mrs.begin()->second
+                               : remote_data_mrs.begin()->second;
+  PutFixed64(dst, (uint64_t)first_mr->context);
+  PutFixed64(dst, (uint64_t)first_mr->pd);
+  PutFixed32(dst, (uint32_t)first_mr->handle);
+  PutChunkRuns(dst, remote_data_mrs);
+  PutChunkRuns(dst, remote_dataindex_mrs);
+  PutChunkRuns(dst, remote_filter_mrs);
+  PutVarint32(dst, blob_chunks.size());
+  for (uint64_t chunk : blob_chunks) {
+    PutFixed64(dst, chunk);
+  }
+  PutVarint64(dst, num_entries);
+  PutVarint64(dst, num_deletions);
+  PutVarint64(dst, creation_time);
+  key_stats.EncodeTo(dst);
+}
+
+Status RemoteMemTableMetaData::DecodeCompactFrom(Slice& src,
+                                                 const Slice& previous_key) {
+  if (this_machine_type == 0)
+    rdma_mg = Env::Default()->rdma_mg;
+  else
+    rdma_mg = Memory_Node_Keeper::rdma_mg;
+
+  uint64_t context_temp;
+  uint64_t pd_temp;
+  uint32_t handle_temp;
+  Slice temp;
+  if (!GetVarint64(&src, &level) || level >= config::kNumLevels ||
+      !GetVarint64(&src, &number) ||
+      src.size() < sizeof(creator_node_id) + sizeof(shard_target_node_id)) {
+    return Status::Corruption("compact file metadata", "file number");
+  }
+  memcpy(&creator_node_id, src.data(), sizeof(creator_node_id));
+  src.remove_prefix(sizeof(creator_node_id));
+  memcpy(&shard_target_node_id, src.data(), sizeof(shard_target_node_id));
+  src.remove_prefix(sizeof(shard_target_node_id));
+  if (!GetVarint64(&src, &file_size) ||
+      !GetKeyDelta(&src, previous_key, &smallest) ||
+      !GetKeyDelta(&src, smallest.Encode(), &largest) ||
+      !GetVarint64(&src, &largest_seq) || !GetVarint64(&src, &cold_file_id) ||
+      !GetLengthPrefixedSlice(&src, &temp)) {
+    return Status::Corruption("compact file metadata", "key range");
+  }
+  prefix_extractor = temp.ToString();
+  if (!GetFixed64(&src, &context_temp) || !GetFixed64(&src, &pd_temp) ||
+      !GetFixed32(&src, &handle_temp)) {
+    return Status::Corruption("compact file metadata", "memory region");
+  }
+  ibv_mr shared = {};
+  shared.context = reinterpret_cast<ibv_context*>(context_temp);
+  shared.pd = reinterpret_cast<ibv_pd*>(pd_temp);
+  shared.handle = handle_temp;
+  if (!GetChunkRuns(&src, shared, &remote_data_mrs) ||
+      !GetChunkRuns(&src, shared, &remote_dataindex_mrs) ||
+      !GetChunkRuns(&src, shared, &remote_filter_mrs) ||
+      remote_dataindex_mrs.size() != 1) {
+    return Status::Corruption("compact file metadata", "chunks");
+  }
+  uint32_t blob_chunk_num = 0;
+  if (!GetVarint32(&src, &blob_chunk_num) ||
+      src.size() < blob_chunk_num * sizeof(uint64_t)) {
+    return Status::Corruption("compact file metadata", "blob chunks");
+  }
+  std::vector<uint64_t> chunks(blob_chunk_num);
+  for (auto& chunk : chunks) {
+    GetFixed64(&src, &chunk);
+  }
+  SetBlobChunks(std::move(chunks));
+  uint64_t entries = 0;
+  uint64_t deletions = 0;
+  if (!GetVarint64(&src, &entries) || !GetVarint64(&src, &deletions) ||
+      !GetVarint64(&src, &creation_time)) {
+    return Status::Corruption("compact file metadata", "entry counts");
+  }
+  num_entries = entries;
+  num_deletions = deletions;
+  if (!key_stats.DecodeFrom(&src)) {
+    return Status::Corruption("compact file metadata", "key stats");
+  }
+  return Status::OK();
+}
+
+void RemoteMemTableMetaData::SetBlobChunks(std::vector<uint64_t> chunks) {
+  assert(blob_chunks.empty());
+  blob_chunks = std::move(chunks);
+  if (this_machine_type == 0) {
+    BlobChunkRefs::Ref(shard_target_node_id, blob_chunks);
+  }
+}
 void RemoteMemTableMetaData::mr_serialization(std::string* dst, ibv_mr* mr) const {
 //  PutFixed64(dst, (uint64_t)mr->context);
 //  PutFixed64(dst, (uint64_t)mr->pd);
@@ -268,9 +555,52 @@ enum Tag {
   kDeletedFile = 6,
   kNewFile = 7,
   // 8 was used for large value refs
-  kPrevLogNumber = 9
+  kPrevLogNumber = 9,
+  // Read frequency of a file, sent to the memory node only.
+  kHotFile = 10,
+  kRangeTombstone = 11,
+  kDeletedRangeTombstone = 12,
+  // The cold file of the new file before it, see Options::cold_level.
+  kColdFile = 13,
+  // The prefix extractor of the filter of the new file before it.
+  kFilterPrefix = 14,
+  // A new file in the form of RemoteMemTableMetaData::EncodeCompactTo().
+  kNewFileCompact = 15,
+  // The blob chunks of the new file before it.
+  kBlobChunks = 16
 };
 
+static void PutColdFile(std::string* dst, const RemoteMemTableMetaData& f) {
+  if (f.cold_file_id != 0) {
+    PutVarint32(dst, kColdFile);
+    PutVarint64(dst, f.cold_file_id);
+  }
+}
+
+static void PutFilterPrefix(std::string* dst, const RemoteMemTableMetaData& f) {
+  if (!f.prefix_extractor.empty()) {
+    PutVarint32(dst, kFilterPrefix);
+    PutLengthPrefixedSlice(dst, f.prefix_extractor);
+  }
+}
+
+static void PutBlobChunks(std::string* dst, const RemoteMemTableMetaData& f) {
+  if (!f.blob_chunks.empty()) {
+    PutVarint32(dst, kBlobChunks);
+    PutVarint32(dst, f.blob_chunks.size());
+    for (uint64_t chunk : f.blob_chunks) {
+      PutFixed64(dst, chunk);
+    }
+  }
+}
+
+static void PutRangeTombstone(std::string* dst, const RangeTombstone& t) {
+  PutVarint32(dst, kRangeTombstone);
+  PutLengthPrefixedSlice(dst, t.begin);
+  PutLengthPrefixedSlice(dst, t.end);
+  PutVarint64(dst, t.sequence);
+}
+
 void VersionEdit::Clear() {
   comparator_.clear();
   log_number_ = 0;
@@ -284,6 +614,9 @@ void VersionEdit::Clear() {
   has_last_sequence_ = false;
   deleted_files_.clear();
   new_files_.clear();
+  hot_files_.clear();
+  new_range_tombstones_.clear();
+  deleted_range_tombstones_.clear();
 }
 
 void VersionEdit::EncodeTo(std::string* dst) const {
@@ -324,12 +657,31 @@ void VersionEdit::EncodeTo(std::string* dst) const {
 
   }
 
+  // The new files of a compaction are sorted, so the smallest key of each
+  // shares much of the largest key of the one before it.
+  Slice previous_key;
   for (size_t i = 0; i < new_files_.size(); i++) {
-    const std::shared_ptr<RemoteMemTableMetaData> f = new_files_[i].second;
-    PutVarint32(dst, kNewFile);
+    const std::shared_ptr<RemoteMemTableMetaData>& f = new_files_[i].second;
+    PutVarint32(dst, kNewFileCompact);
     PutVarint32(dst, new_files_[i].first);  // level
-    f->EncodeTo(dst);
+    f->EncodeCompactTo(dst, previous_key);
+    previous_key = f->largest.Encode();
+  }
+
+  for (const auto& hot_file : hot_files_) {
+    PutVarint32(dst, kHotFile);
+    PutVarint64(dst, std::get<0>(hot_file));  // file number
+    dst->append(reinterpret_cast<const char*>(&std::get<1>(hot_file)),
+                sizeof(uint8_t));
+    PutVarint32(dst, std::get<2>(hot_file));  // frequency
+  }
 
+  for (const RangeTombstone& t : new_range_tombstones_) {
+    PutRangeTombstone(dst, t);
+  }
+  for (SequenceNumber sequence : deleted_range_tombstones_) {
+    PutVarint32(dst, kDeletedRangeTombstone);
+    PutVarint64(dst, sequence);
   }
 //  assert(dst->size() < new_files_[0].second->rdma_mg->name_to_size["version_edit"]);
 }
@@ -378,6 +730,18 @@ void VersionEdit::EncodeToDiskFormat(std::string* dst) const {
     PutVarint64(dst, f->file_size);
     PutLengthPrefixedSlice(dst, f->smallest.Encode());
     PutLengthPrefixedSlice(dst, f->largest.Encode());
+    PutVarint64(dst, f->largest_seq);
+    PutColdFile(dst, *f);
+    PutFilterPrefix(dst, *f);
+    PutBlobChunks(dst, *f);
+  }
+
+  for (const RangeTombstone& t : new_range_tombstones_) {
+    PutRangeTombstone(dst, t);
+  }
+  for (SequenceNumber sequence : deleted_range_tombstones_) {
+    PutVarint32(dst, kDeletedRangeTombstone);
+    PutVarint64(dst, sequence);
   }
 }
 
@@ -413,6 +777,7 @@ Status VersionEdit::DecodeFrom(const Slice src, int this_machine_type,
   uint8_t node_id;
   Slice str;
   InternalKey key;
+  Slice previous_key;
   size_t counter = 0;
   while (msg == nullptr && GetVarint32(&input, &tag)) {
     switch (tag) {
@@ -489,6 +854,59 @@ Status VersionEdit::DecodeFrom(const Slice src, int this_machine_type,
         }
         break;
 
+      case kNewFileCompact:
+        if (GetLevel(&input, &level)) {
+          std::shared_ptr<RemoteMemTableMetaData> f = std::make_shared<RemoteMemTableMetaData>(this_machine_type,cache, 999);
+          if (f->DecodeCompactFrom(input, previous_key).ok()) {
+            previous_key = f->largest.Encode();
+            new_files_.push_back(std::make_pair(level, f));
+            break;
+          }
+          // Free none of the chunks it half decoded.
+          f->borrowed = true;
+        }
+        msg = "compact new-file entry";
+        break;
+
+      case kHotFile: {
+        uint32_t frequency;
+        if (GetVarint64(&input, &number) && !input.empty()) {
+          memcpy(&node_id, input.data(), sizeof(node_id));
+          input.remove_prefix(sizeof(node_id));
+          if (GetVarint32(&input, &frequency)) {
+            hot_files_.emplace_back(number, node_id, frequency);
+            break;
+          }
+        }
+        msg = "hot-file entry";
+        break;
+      }
+
+      case kRangeTombstone: {
+        Slice begin, end;
+        RangeTombstone t;
+        if (GetLengthPrefixedSlice(&input, &begin) &&
+            GetLengthPrefixedSlice(&input, &end) &&
+            GetVarint64(&input, &t.sequence)) {
+          t.begin = begin.ToString();
+          t.end = end.ToString();
+          new_range_tombstones_.push_back(std::move(t));
+        } else {
+          msg = "range tombstone";
+        }
+        break;
+      }
+
+      case kDeletedRangeTombstone: {
+        SequenceNumber sequence;
+        if (GetVarint64(&input, &sequence)) {
+          deleted_range_tombstones_.push_back(sequence);
+        } else {
+          msg = "deleted range tombstone";
+        }
+        break;
+      }
+
       default:
         msg = "unknown tag";
         break;
@@ -511,6 +929,174 @@ Status VersionEdit::DecodeFrom(const Slice src, int this_machine_type,
   return result;
 }
 
+Status VersionEdit::DecodeFromDiskFormat(const Slice& src,
+                                         int this_machine_type) {
+  Clear();
+  Slice input = src;
+  const char* msg = nullptr;
+  uint32_t tag;
+
+  // Temporary storage for parsing
+  int level;
+  uint64_t number;
+  uint64_t node_id;
+  Slice str;
+  InternalKey key;
+  while (msg == nullptr && GetVarint32(&input, &tag)) {
+    switch (tag) {
+      case kComparator:
+        if (GetLengthPrefixedSlice(&input, &str)) {
+          comparator_ = str.ToString();
+          has_comparator_ = true;
+        } else {
+          msg = "comparator name";
+        }
+        break;
+
+      case kLogNumber:
+        if (GetVarint64(&input, &log_number_)) {
+          has_log_number_ = true;
+        } else {
+          msg = "log number";
+        }
+        break;
+
+      case kPrevLogNumber:
+        if (GetVarint64(&input, &prev_log_number_)) {
+          has_prev_log_number_ = true;
+        } else {
+          msg = "previous log number";
+        }
+        break;
+
+      case kNextFileNumber:
+        if (GetVarint64(&input, &next_file_number_)) {
+          has_next_file_number_ = true;
+        } else {
+          msg = "next file number";
+        }
+        break;
+
+      case kLastSequence:
+        if (GetVarint64(&input, &last_sequence_)) {
+          has_last_sequence_ = true;
+        } else {
+          msg = "last sequence number";
+        }
+        break;
+
+      case kCompactPointer:
+        if (GetLevel(&input, &level) && GetInternalKey(&input, &key)) {
+          compact_pointers_.push_back(std::make_pair(level, key));
+        } else {
+          msg = "compaction pointer";
+        }
+        break;
+
+      case kDeletedFile:
+        if (GetLevel(&input, &level) && GetVarint64(&input, &number) &&
+            GetVarint64(&input, &node_id)) {
+          deleted_files_.insert(
+              std::make_tuple(level, number, static_cast<uint8_t>(node_id)));
+        } else {
+          msg = "deleted file";
+        }
+        break;
+
+      case kNewFile: {
+        auto f = std::make_shared<RemoteMemTableMetaData>(this_machine_type);
+        if (GetLevel(&input, &level) && GetVarint64(&input, &f->number) &&
+            !input.empty()) {
+          f->level = level;
+          f->creator_node_id = static_cast<uint8_t>(input[0]);
+          input.remove_prefix(sizeof(f->creator_node_id));
+          if (GetVarint64(&input, &f->file_size) &&
+              GetInternalKey(&input, &f->smallest) &&
+              GetInternalKey(&input, &f->largest) &&
+              GetVarint64(&input, &f->largest_seq)) {
+            new_files_.emplace_back(level, f);
+            break;
+          }
+        }
+        msg = "new-file entry";
+        break;
+      }
+
+      case kRangeTombstone: {
+        Slice begin, end;
+        RangeTombstone t;
+        if (GetLengthPrefixedSlice(&input, &begin) &&
+            GetLengthPrefixedSlice(&input, &end) &&
+            GetVarint64(&input, &t.sequence)) {
+          t.begin = begin.ToString();
+          t.end = end.ToString();
+          new_range_tombstones_.push_back(std::move(t));
+        } else {
+          msg = "range tombstone";
+        }
+        break;
+      }
+
+      case kDeletedRangeTombstone: {
+        SequenceNumber sequence;
+        if (GetVarint64(&input, &sequence)) {
+          deleted_range_tombstones_.push_back(sequence);
+        } else {
+          msg = "deleted range tombstone";
+        }
+        break;
+      }
+
+      case kColdFile:
+        if (new_files_.empty() ||
+            !GetVarint64(&input, &new_files_.back().second->cold_file_id)) {
+          msg = "cold file";
+        }
+        break;
+
+      case kFilterPrefix: {
+        Slice name;
+        if (!new_files_.empty() && GetLengthPrefixedSlice(&input, &name)) {
+          new_files_.back().second->prefix_extractor = name.ToString();
+        } else {
+          msg = "filter prefix";
+        }
+        break;
+      }
+
+      case kBlobChunks: {
+        uint32_t count;
+        if (new_files_.empty() || !GetVarint32(&input, &count) ||
+            input.size() < count * sizeof(uint64_t)) {
+          msg = "blob chunks";
+          break;
+        }
+        std::vector<uint64_t> chunks(count);
+        for (uint32_t i = 0; i < count; i++) {
+          chunks[i] = DecodeFixed64(input.data());
+          input.remove_prefix(sizeof(uint64_t));
+        }
+        new_files_.back().second->SetBlobChunks(std::move(chunks));
+        break;
+      }
+
+      default:
+        msg = "unknown tag";
+        break;
+    }
+  }
+
+  if (msg == nullptr && !input.empty()) {
+    msg = "invalid tag";
+  }
+
+  Status result;
+  if (msg != nullptr) {
+    result = Status::Corruption("VersionEdit", msg);
+  }
+  return result;
+}
+
 std::string VersionEdit::DebugString() const {
   std::string r;
   r.append("VersionEdit {");
@@ -559,11 +1145,26 @@ std::string VersionEdit::DebugString() const {
     r.append(" .. ");
     r.append(f->largest.DebugString());
   }
+  for (const RangeTombstone& t : new_range_tombstones_) {
+    r.append("\n  AddRangeTombstone: ");
+    AppendNumberTo(&r, t.sequence);
+    r.append(" ");
+    AppendEscapedStringTo(&r, t.begin);
+    r.append(" .. ");
+    AppendEscapedStringTo(&r, t.end);
+  }
+  for (SequenceNumber sequence : deleted_range_tombstones_) {
+    r.append("\n  RemoveRangeTombstone: ");
+    AppendNumberTo(&r, sequence);
+  }
   r.append("\n}\n");
   return r;
 }
 
 void VersionEdit_Merger::merge_one_edit(VersionEdit* edit) {
+  if (edit->HasLastSequence()) {
+    last_sequence_ = std::max(last_sequence_, edit->GetLastSequence());
+  }
 
   for (auto iter : *edit->GetDeletedFiles()){
     if (std::get<1>(iter)==5){
@@ -592,12 +1193,9 @@ void VersionEdit_Merger::merge_one_edit(VersionEdit* edit) {
           // That may cause system crash.
           only_trival_change.erase(std::get<1>(iter));
         }else{
-          assert(debug_map.find(std::get<1>(iter)) == debug_map.end());
+          // The file is never persisted, its pin on the compute node goes
+          // with the epoch of this merger.
           DEBUG_arg("The merged file is %lu\n", std::get<1>(iter));
-          merged_file_numbers.push_back(std::get<1>(iter));
-          if (merged_file_numbers.size() >= UNPIN_GRANULARITY){
-            ready_to_upin_merged_file = true;
-          }
         }
 
 
@@ -611,6 +1209,19 @@ void VersionEdit_Merger::merge_one_edit(VersionEdit* edit) {
     DEBUG_arg("insert a file %lu to", iter.second->number);
     new_files_.insert({iter.second->number, iter.second});
   }
+  for (const RangeTombstone& t : edit->GetRangeTombstones()) {
+    new_range_tombstones_.push_back(t);
+  }
+  for (SequenceNumber sequence : edit->GetDeletedRangeTombstones()) {
+    auto iter = std::find_if(
+        new_range_tombstones_.begin(), new_range_tombstones_.end(),
+        [sequence](const RangeTombstone& t) { return t.sequence == sequence; });
+    if (iter != new_range_tombstones_.end()) {
+      new_range_tombstones_.erase(iter);
+    } else {
+      deleted_range_tombstones_.push_back(sequence);
+    }
+  }
 //  ve_counter++;
 //  if (ve_counter >= EDIT_MERGER_COUNT){
 //    ve_counter = 0;
@@ -621,6 +1232,10 @@ void VersionEdit_Merger::merge_one_edit(VersionEdit* edit) {
 //  return true;
 }
 void VersionEdit_Merger::EncodeToDiskFormat(std::string* dst) const {
+  if (last_sequence_ > 0) {
+    PutVarint32(dst, kLastSequence);
+    PutVarint64(dst, last_sequence_);
+  }
   for (const auto& deleted_file_kvp : deleted_files_) {
     PutVarint32(dst, kDeletedFile);
     PutVarint32(dst, std::get<0>(deleted_file_kvp));   // level
@@ -638,6 +1253,17 @@ void VersionEdit_Merger::EncodeToDiskFormat(std::string* dst) const {
     PutVarint64(dst, f->file_size);
     PutLengthPrefixedSlice(dst, f->smallest.Encode());
     PutLengthPrefixedSlice(dst, f->largest.Encode());
+    PutVarint64(dst, f->largest_seq);
+    PutColdFile(dst, *f);
+    PutFilterPrefix(dst, *f);
+    PutBlobChunks(dst, *f);
+  }
+  for (const RangeTombstone& t : new_range_tombstones_) {
+    PutRangeTombstone(dst, t);
+  }
+  for (SequenceNumber sequence : deleted_range_tombstones_) {
+    PutVarint32(dst, kDeletedRangeTombstone);
+    PutVarint64(dst, sequence);
   }
 }
 
@@ -5,19 +5,30 @@
 #ifndef STORAGE_dLSM_DB_VERSION_EDIT_H_
 #define STORAGE_dLSM_DB_VERSION_EDIT_H_
 #define EDIT_MERGER_COUNT 64
-#define UNPIN_GRANULARITY 10
+#include <atomic>
 #include <set>
 #include <utility>
 #include <vector>
 
 #include "db/dbformat.h"
+#include "db/range_tombstone.h"
+#include "table/key_stats.h"
+#include "util/chunk_table.h"
 #include "util/rdma.h"
 
 namespace dLSM {
 
+struct Options;
+struct ParityStripe;
 class VersionSet;
 class RDMA_Manager;
 class TableCache;
+// The copy of the data chunks of a table on a second memory node, under
+// the same offsets, see Options::replicated_levels.
+struct TableReplica {
+  uint8_t node_id;
+  ChunkTable data_mrs;
+};
 struct RemoteMemTableMetaData {
 //  RemoteMemTableMetaData();
 // this_machine_type 0 means compute node, 1 means memory node
@@ -26,55 +37,42 @@ struct RemoteMemTableMetaData {
   RemoteMemTableMetaData(int side);
   //TOTHINK: the garbage collection of the Remote table is not triggered!
   ~RemoteMemTableMetaData();
-  bool Remote_blocks_deallocate(std::map<uint32_t , ibv_mr*> map){
-    std::map<uint32_t , ibv_mr*>::iterator it;
+  bool Remote_blocks_deallocate(ChunkTable map){
+    ChunkTable::iterator it;
 //    assert(creator_node_id%2 == 0);
     for (it = map.begin(); it != map.end(); it++){
       if(!rdma_mg->Deallocate_Remote_RDMA_Slot(it->second->addr,
-                                                shard_target_node_id)){
+                                                shard_target_node_id,
+                                                it->second->length)){
         return false;
       }
       delete it->second;
     }
     return true;
   }
-  // TODO: sperate the deallocation buffer.
+  // Hand the chunks, and the file of a cold table, over to the garbage
+  // collection of the memory node that created them. It does not wait for
+  // the memory node.
   bool Prepare_Batch_Deallocate(){
-    std::map<uint32_t , ibv_mr*>::iterator it;
-    uint64_t* ptr;
-//    assert(remote_dataindex_mrs.size() == 1);
-    size_t chunk_num = remote_data_mrs.size() + remote_dataindex_mrs.size()
-                       + remote_filter_mrs.size();
-    bool RPC =
-        rdma_mg->Remote_Memory_Deallocation_Fetch_Buff(&ptr, chunk_num, shard_target_node_id);
-    size_t index = 0;
-    for (it = remote_data_mrs.begin(); it != remote_data_mrs.end(); it++) {
-      ptr[index] = (uint64_t)it->second->addr;
-//      DEBUG_arg("deallocated data address is %p", ptr[index]);
-      index++;
-      delete it->second;
-    }
-    for (it = remote_dataindex_mrs.begin(); it != remote_dataindex_mrs.end(); it++) {
-      ptr[index] = (uint64_t)it->second->addr;
-//      DEBUG_arg("deallocated data address is %p", ptr[index]);
-      index++;
-      delete it->second;
+    std::vector<uint64_t> addrs;
+    addrs.reserve(remote_data_mrs.size() + remote_dataindex_mrs.size()
+                  + remote_filter_mrs.size() + 1);
+    if (cold_file_id != 0) {
+      addrs.push_back(cold_file_id | GC_COLD_FILE_BIT);
     }
-    for (it = remote_filter_mrs.begin(); it != remote_filter_mrs.end(); it++) {
-      ptr[index] = (uint64_t)it->second->addr;
-//      DEBUG_arg("deallocated data address is %p", ptr[index]);
-      index++;
-      delete it->second;
-    }
-    assert(index == chunk_num);
-    if (RPC){
-      rdma_mg->Memory_Deallocation_RPC(shard_target_node_id);
+    for (auto* chunks : {&remote_data_mrs, &remote_dataindex_mrs,
+                         &remote_filter_mrs}) {
+      for (auto& chunk : *chunks) {
+        addrs.push_back((uint64_t)chunk.second->addr);
+        delete chunk.second;
+      }
     }
-
+    rdma_mg->Remote_Memory_Deallocate(addrs.data(), addrs.size(),
+                                      shard_target_node_id);
     return true;
   }
-  bool Local_blocks_deallocate(std::map<uint32_t , ibv_mr*> map){
-    std::map<uint32_t , ibv_mr*>::iterator it;
+  bool Local_blocks_deallocate(ChunkTable map){
+    ChunkTable::iterator it;
 
     for (it = map.begin(); it != map.end(); it++){
 //      if(!rdma_mg->Deallocate_Local_RDMA_Slot(it->second->addr, "FlushBuffer")){
@@ -86,6 +84,15 @@ struct RemoteMemTableMetaData {
   }
   void EncodeTo(std::string* dst) const;
   Status DecodeFrom(Slice& src);
+  // The denser form the version edits carry, see VersionEdit::EncodeTo. The
+  // smallest key is stored as a delta against "previous_key", the largest
+  // key of the new file before it in the edit, and the chunks as runs of
+  // evenly spaced ones.
+  void EncodeCompactTo(std::string* dst, const Slice& previous_key) const;
+  Status DecodeCompactFrom(Slice& src, const Slice& previous_key);
+  // Record the blob chunks the entries of the table may point to. On the
+  // compute node the table holds a reference on them until it is destroyed.
+  void SetBlobChunks(std::vector<uint64_t> chunks);
   void mr_serialization(std::string* dst, ibv_mr* mr) const;
   std::shared_ptr<RDMA_Manager> rdma_mg;
   int this_machine_type;
@@ -95,22 +102,61 @@ struct RemoteMemTableMetaData {
   uint8_t shard_target_node_id;
   //  uint64_t refs;
   uint64_t level;
-  uint64_t allowed_seeks;  // Seeks allowed until compaction
+  // Seeks allowed until compaction, charged by the reads sampled
+  // concurrently, see Version::ChargeSeeks().
+  std::atomic<int64_t> allowed_seeks;
   uint64_t number;
 
+  // Not 0 if the data chunks were moved to the file of this number on the
+  // disk of the memory node, see Options::cold_level. The table has no data
+  // chunks then, only its index and filter ones.
+  uint64_t cold_file_id = 0;
+  // The name of the Options::prefix_extractor whose prefixes are in the
+  // filter of the table, empty if none.
+  std::string prefix_extractor;
   // The uint32_t is the offset within the file.
-  std::map<uint32_t, ibv_mr*> remote_data_mrs;
-  std::map<uint32_t, ibv_mr*> remote_dataindex_mrs;
-  std::map<uint32_t, ibv_mr*> remote_filter_mrs;
+  ChunkTable remote_data_mrs;
+  ChunkTable remote_dataindex_mrs;
+  ChunkTable remote_filter_mrs;
+  // The chunks of the memory node of the shard holding the values of the
+  // kTypeBlobIndex entries of the table, see db/blob.h.
+  std::vector<uint64_t> blob_chunks;
   //std::vector<ibv_mr*> remote_data_mrs
   uint64_t file_size;    // File size in bytes
-  size_t num_entries;
+  size_t num_entries = 0;
+  // The entries which are deletions, see Options::tombstone_compaction_ratio.
+  size_t num_deletions = 0;
+  // The raw sizes and a sample of the keys of the table, empty for the
+  // tables built before they were kept.
+  TableKeyStats key_stats;
+  // When the entries of the table were flushed, in seconds since the
+  // epoch, see Options::ttl. 0 for the tables of compactions.
+  uint64_t creation_time = 0;
   InternalKey smallest;  // Smallest internal key served by table
   InternalKey largest;   // Largest internal key served by table
+  // No entry of the table is newer than this, see RangeTombstones.
+  SequenceNumber largest_seq = kMaxSequenceNumber;
   TableCache* table_cache = nullptr;
   bool UnderCompaction = false;
+  // The table is read from the version of another compute node, a read
+  // replica of the shard does not free its chunks. Also set on the tables
+  // left to the next open of the shard when it is closed.
+  bool borrowed = false;
+  // Set once the data chunks are copied by the compute node owning the
+  // table, never encoded. Freed along with the table.
+  std::atomic<TableReplica*> replica{nullptr};
+  // The parity stripe of the table and its place in it, see
+  // db/parity_stripes.h. Set once, like the replica.
+  std::atomic<ParityStripe*> stripe{nullptr};
+  int stripe_index = 0;
+  // Queued for a stripe, under the lock of the stripes.
+  bool stripe_queued = false;
 };
 
+// The RemoteMemTableMetaData::prefix_extractor of the tables built with
+// "options".
+std::string FilterPrefixName(const Options& options);
+
 class VersionEdit {
  public:
   typedef std::set<std::tuple<int, uint64_t, uint8_t>> DeletedFileSet;
@@ -139,6 +185,8 @@ class VersionEdit {
     has_last_sequence_ = true;
     last_sequence_ = seq;
   }
+  bool HasLastSequence() const { return has_last_sequence_; }
+  SequenceNumber GetLastSequence() const { return last_sequence_; }
   void SetFileNumbers(uint64_t file_number_end){
     for (auto pair : new_files_) {
       pair.second->number = file_number_end++;
@@ -194,10 +242,34 @@ class VersionEdit {
   size_t GetNewFilesNum(){
     return new_files_.size();
   }
+  // Report the estimated read frequency of a file to the memory node. Hot
+  // files are not part of the version and not persisted.
+  void AddHotFile(uint64_t file, uint8_t node_id, uint32_t frequency) {
+    hot_files_.emplace_back(file, node_id, frequency);
+  }
+  const std::vector<std::tuple<uint64_t, uint8_t, uint32_t>>& GetHotFiles()
+      const {
+    return hot_files_;
+  }
+  void AddRangeTombstone(const RangeTombstone& tombstone) {
+    new_range_tombstones_.push_back(tombstone);
+  }
+  const std::vector<RangeTombstone>& GetRangeTombstones() const {
+    return new_range_tombstones_;
+  }
+  // Drop the tombstone of "sequence" once no data it deletes is left.
+  void RemoveRangeTombstone(SequenceNumber sequence) {
+    deleted_range_tombstones_.push_back(sequence);
+  }
+  const std::vector<SequenceNumber>& GetDeletedRangeTombstones() const {
+    return deleted_range_tombstones_;
+  }
   void EncodeTo(std::string* dst) const;
   Status DecodeFrom(const Slice src, int this_machine_type, TableCache* cache);
+  // The MANIFEST records of the memory node, which keep the files without
+  // their chunks.
   void EncodeToDiskFormat(std::string* dst) const;
-  Status DecodeFromDiskFormat(const Slice& src, int sstable_type);
+  Status DecodeFromDiskFormat(const Slice& src, int this_machine_type);
   std::string DebugString() const;
   int compactlevel(){
     return std::get<0>(*deleted_files_.begin());
@@ -222,6 +294,19 @@ class VersionEdit {
   std::vector<std::pair<int, InternalKey>> compact_pointers_;
   DeletedFileSet deleted_files_;
   std::vector<std::pair<int, std::shared_ptr<RemoteMemTableMetaData>>> new_files_;
+  // file number, node_id, frequency
+  std::vector<std::tuple<uint64_t, uint8_t, uint32_t>> hot_files_;
+  std::vector<RangeTombstone> new_range_tombstones_;
+  std::vector<SequenceNumber> deleted_range_tombstones_;
+};
+// The persistence epoch of an edit merged on the memory node, and the word of
+// the compute node that sent it, which the memory node advances to the
+// epochs that are durable.
+struct PersistEpoch {
+  uint8_t node_id;
+  void* epoch_buffer;
+  uint32_t epoch_rkey;
+  uint64_t epoch;
 };
 class VersionEdit_Merger {
  public:
@@ -230,6 +315,10 @@ class VersionEdit_Merger {
     deleted_files_.clear();
     new_files_.clear();
     only_trival_change.clear();
+    persist_epochs.clear();
+    new_range_tombstones_.clear();
+    deleted_range_tombstones_.clear();
+    last_sequence_ = 0;
 #ifndef NDEBUG
 //    debug_map.clear();
 #endif
@@ -238,6 +327,10 @@ class VersionEdit_Merger {
     deleted_files_.swap(ve_m->deleted_files_);
     new_files_.swap(ve_m->new_files_);
     only_trival_change.swap(ve_m->only_trival_change);
+    persist_epochs.swap(ve_m->persist_epochs);
+    new_range_tombstones_.swap(ve_m->new_range_tombstones_);
+    deleted_range_tombstones_.swap(ve_m->deleted_range_tombstones_);
+    std::swap(last_sequence_, ve_m->last_sequence_);
 #ifndef NDEBUG
     debug_map.swap(ve_m->debug_map);
 #endif
@@ -257,14 +350,19 @@ class VersionEdit_Merger {
     return new_files_.size();
   }
   void EncodeToDiskFormat(std::string* dst) const;
-  std::list<uint64_t> merged_file_numbers;
-  bool ready_to_upin_merged_file;
   std::set<uint64_t> only_trival_change;
+  // The epochs of the merged edits, durable once this merger is persisted.
+  std::vector<PersistEpoch> persist_epochs;
 #ifndef NDEBUG
   std::set<uint64_t> debug_map;
 #endif
  private:
   DeletedFileSet deleted_files_;
+  // A tombstone added and removed within the merged edits is in neither.
+  std::vector<RangeTombstone> new_range_tombstones_;
+  std::vector<SequenceNumber> deleted_range_tombstones_;
+  // The largest last sequence of the merged edits.
+  SequenceNumber last_sequence_ = 0;
 
   int ve_counter = 0;
   std::unordered_map<uint64_t , std::shared_ptr<RemoteMemTableMetaData>> new_files_;
@@ -4,14 +4,18 @@
 
 #include "db/version_set.h"
 
+#include "db/edit_publisher.h"
 #include "db/filename.h"
 #include "db/log_reader.h"
 #include "db/log_writer.h"
 #include "db/memtable.h"
+#include "db/merge_helper.h"
 #include "db/table_cache.h"
 //#include "db/dbformat.h"
 #include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <deque>
 
 #include "dLSM/env.h"
 
@@ -20,6 +24,8 @@
 #include "table/two_level_iterator.h"
 #include "util/coding.h"
 #include "util/logging.h"
+#include "util/perf_context_imp.h"
+#include "util/timeline.h"
 
 namespace dLSM {
 #ifdef PROCESSANALYSIS
@@ -32,10 +38,12 @@ static size_t TargetFileSize(const Options* options) {
   return options->max_file_size;
 }
 
+static uint64_t MaxFileSizeForLevel(const Options* options, int level);
+
 // Maximum bytes of overlaps in grandparent (i.e., level+2) before we
 // stop building a single file in a level->level+1 compaction.
-static int64_t MaxGrandParentOverlapBytes(const Options* options) {
-  return 10 * TargetFileSize(options);
+static int64_t MaxGrandParentOverlapBytes(const Options* options, int level) {
+  return 10 * MaxFileSizeForLevel(options, level);
 }
 
 // Maximum number of bytes in all compacted files.  We avoid expanding
@@ -58,9 +66,27 @@ static double MaxBytesForLevel(const Options* options, int level) {
   return result;
 }
 
+// The size of the tables a compaction from "level" writes to level + 1.
 static uint64_t MaxFileSizeForLevel(const Options* options, int level) {
-  // We could vary per level to reduce number of files?
-  return TargetFileSize(options);
+  uint64_t result = TargetFileSize(options);
+  for (int i = 0; i < level; i++) {
+    result *= options->max_file_size_multiplier;
+  }
+  return result;
+}
+
+// The share of the entries of "f" which are deletions.
+static double DeletionRatio(const RemoteMemTableMetaData& f) {
+  return f.num_entries == 0
+             ? 0
+             : static_cast<double>(f.num_deletions) / f.num_entries;
+}
+
+// The size of "f" with every deletion counted twice, a deletion takes
+// little room but costs the reads of the level as much as an entry, and
+// its compaction frees the entries it deletes below.
+static uint64_t CompensatedFileSize(const RemoteMemTableMetaData& f) {
+  return f.file_size + static_cast<uint64_t>(f.file_size * DeletionRatio(f));
 }
 
 static int64_t TotalFileSize(const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& files) {
@@ -112,6 +138,111 @@ int FindFile(const InternalKeyComparator& icmp,
   return right;
 }
 
+// Projection of user_key for the fences of a level whose keys share prefix,
+// see Version::LevelFence. Keeps the order of the keys, but not strictly.
+static uint64_t FenceKey(const std::string& prefix, const Slice& user_key) {
+  uint64_t x = 0;
+  for (size_t i = 0; i < 8; i++) {
+    size_t pos = prefix.size() + i;
+    uint8_t byte =
+        pos < user_key.size() ? static_cast<uint8_t>(user_key[pos]) : 0;
+    x = (x << 8) | byte;
+  }
+  return x;
+}
+
+// Index of the first of keys[0, n) which is >= x, or n. The loop has a
+// fixed trip count for n and the comparison compiles to a conditional move.
+static size_t FenceLowerBound(const uint64_t* keys, size_t n, uint64_t x) {
+  if (n == 0) {
+    return 0;
+  }
+  const uint64_t* base = keys;
+  while (n > 1) {
+    size_t half = n / 2;
+    base = base[half - 1] < x ? base + half : base;
+    n -= half;
+  }
+  return (base - keys) + (*base < x);
+}
+
+void Version::BuildFences() {
+  if (has_fences_ ||
+      vset_->icmp_.user_comparator() != BytewiseComparator()) {
+    return;
+  }
+  for (int level = 1; level < config::kNumLevels; level++) {
+    const auto& files = levels_[level];
+    if (files.empty() || fences_[level] != nullptr) {
+      continue;
+    }
+    auto built = std::make_shared<LevelFence>();
+    LevelFence& fence = *built;
+    Slice first = files.front()->smallest.user_key();
+    Slice last = files.back()->largest.user_key();
+    size_t prefix_length = 0;
+    while (prefix_length < first.size() && prefix_length < last.size() &&
+           first[prefix_length] == last[prefix_length]) {
+      prefix_length++;
+    }
+    fence.prefix.assign(first.data(), prefix_length);
+    fence.keys.reserve(files.size());
+    for (const auto& f : files) {
+      fence.keys.push_back(FenceKey(fence.prefix, f->largest.user_key()));
+    }
+    for (size_t i = kFenceFanout; i < files.size() + kFenceFanout;
+         i += kFenceFanout) {
+      fence.top.push_back(fence.keys[std::min(i, files.size()) - 1]);
+    }
+    fences_[level] = std::move(built);
+  }
+  has_fences_ = true;
+}
+
+uint32_t Version::FindFileInLevel(int level,
+                                  const Slice& internal_key) const {
+  const auto& files = levels_[level];
+  if (!has_fences_ || level == 0 || fences_[level] == nullptr) {
+    return FindFile(vset_->icmp_, files, internal_key);
+  }
+  const LevelFence& fence = *fences_[level];
+  const size_t n = fence.keys.size();
+  Slice user_key = ExtractUserKey(internal_key);
+  // Keys out of the prefix are before or after all the files.
+  int r = Slice(user_key.data(),
+                std::min(user_key.size(), fence.prefix.size()))
+              .compare(fence.prefix);
+  if (r < 0) {
+    return 0;
+  } else if (r > 0) {
+    return n;
+  }
+  uint64_t x = FenceKey(fence.prefix, user_key);
+  size_t group = FenceLowerBound(fence.top.data(), fence.top.size(), x);
+  size_t left = group * kFenceFanout;
+  if (left >= n) {
+    return n;
+  }
+  left += FenceLowerBound(fence.keys.data() + left,
+                          std::min(kFenceFanout, n - left), x);
+  // The files before left end before the target and the ones with a larger
+  // projection after it; compare the keys of the ones in between, usually
+  // none or one.
+  size_t right = left;
+  while (right < n && fence.keys[right] == x) {
+    right++;
+  }
+  while (left < right) {
+    size_t mid = (left + right) / 2;
+    if (vset_->icmp_.Compare(files[mid]->largest.Encode(), internal_key) < 0) {
+      left = mid + 1;
+    } else {
+      right = mid;
+    }
+  }
+  return left;
+}
+
 static bool AfterFile(const Comparator* ucmp, const Slice* user_key,
                       const std::shared_ptr<RemoteMemTableMetaData> f) {
   // null user_key occurs before all keys and is therefore never after *f
@@ -165,6 +296,40 @@ bool SomeFileOverlapsRange(const InternalKeyComparator& icmp,
 
 
 
+// Whether "f" may hold user keys within the bounds of "options".
+static bool FileInBounds(const Comparator* ucmp, const ReadOptions& options,
+                         const RemoteMemTableMetaData& f) {
+  return (options.iterate_lower_bound == nullptr ||
+          ucmp->Compare(f.largest.user_key(), *options.iterate_lower_bound) >=
+              0) &&
+         (options.iterate_upper_bound == nullptr ||
+          ucmp->Compare(f.smallest.user_key(), *options.iterate_upper_bound) <
+              0);
+}
+
+Version::LevelFileNumIterator::LevelFileNumIterator(
+    const InternalKeyComparator& icmp,
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>* flist,
+    const ReadOptions& options)
+    : LevelFileNumIterator(icmp, flist) {
+  const Comparator* ucmp = icmp.user_comparator();
+  if (options.iterate_lower_bound != nullptr) {
+    InternalKey bound(*options.iterate_lower_bound, kMaxSequenceNumber,
+                      kValueTypeForSeek);
+    begin_ = FindFile(icmp, *flist, bound.Encode());
+  }
+  if (options.iterate_upper_bound != nullptr) {
+    end_ = std::partition_point(
+               flist->begin() + begin_, flist->end(),
+               [&](const std::shared_ptr<RemoteMemTableMetaData>& f) {
+                 return ucmp->Compare(f->smallest.user_key(),
+                                      *options.iterate_upper_bound) < 0;
+               }) -
+           flist->begin();
+  }
+  end_ = std::max(begin_, end_);
+}
+
 static Iterator* GetFileIterator(
     void* arg, const ReadOptions& options,
     std::shared_ptr<RemoteMemTableMetaData> remote_table) {
@@ -191,15 +356,15 @@ static Iterator* GetFileIterator_Memoryside(
 Iterator* Version::NewConcatenatingIterator(const ReadOptions& options,
                                             int level) const {
   return NewTwoLevelFileIterator(
-      new LevelFileNumIterator(vset_->icmp_, &levels_[level]), &GetFileIterator,
-      vset_->table_cache_, options);
+      new LevelFileNumIterator(vset_->icmp_, &levels_[level].files(), options),
+      &GetFileIterator, vset_->table_cache_, options);
 }
 #ifdef BYTEADDRESSABLE
 Iterator* Version::NewConcatenatingSEQIterator(const ReadOptions& options,
                                             int level) const {
   return NewTwoLevelFileIterator(
-      new LevelFileNumIterator(vset_->icmp_, &levels_[level]), &GetFileSEQIterator,
-      vset_->table_cache_, options);
+      new LevelFileNumIterator(vset_->icmp_, &levels_[level].files(), options),
+      &GetFileSEQIterator, vset_->table_cache_, options);
 }
 #endif
 //Subversion::Subversion(size_t version_id,
@@ -223,38 +388,71 @@ Iterator* Version::NewConcatenatingSEQIterator(const ReadOptions& options,
 //}
 //Version::Version(const std::shared_ptr<Subversion>& sub_version)
 //    : subversion(sub_version) {}
+// Append the range from the smallest key of "first" to the largest one of
+// "last" to *smallest and *largest, if they are not nullptr.
+static void AddRange(const RemoteMemTableMetaData& first,
+                     const RemoteMemTableMetaData& last,
+                     std::vector<Slice>* smallest, std::vector<Slice>* largest) {
+  if (smallest != nullptr) {
+    smallest->push_back(first.smallest.Encode());
+    largest->push_back(last.largest.Encode());
+  }
+}
+
 void Version::AddIterators(const ReadOptions& options,
-                           std::vector<Iterator*>* iters) {
+                           std::vector<Iterator*>* iters,
+                           std::vector<Slice>* smallest,
+                           std::vector<Slice>* largest) {
+  const Comparator* ucmp = vset_->icmp_.user_comparator();
   // Merge all level zero files together since they may overlap
   for (size_t i = 0; i < levels_[0].size(); i++) {
-    iters->push_back(vset_->table_cache_->NewIterator(
-        options, levels_[0][i]));
+    if (FileInBounds(ucmp, options, *levels_[0][i])) {
+      iters->push_back(vset_->table_cache_->NewIterator(
+          options, levels_[0][i]));
+      AddRange(*levels_[0][i], *levels_[0][i], smallest, largest);
+    }
   }
 
   // For levels > 0, we can use a concatenating iterator that sequentially
   // walks through the non-overlapping files in the level, opening them
   // lazily.
   for (int level = 1; level < config::kNumLevels; level++) {
-    if (!levels_[level].empty()) {
+    if (!levels_[level].empty() &&
+        SomeFileOverlapsRange(vset_->icmp_, true, levels_[level],
+                              options.iterate_lower_bound,
+                              options.iterate_upper_bound)) {
       iters->push_back(NewConcatenatingIterator(options, level));
+      AddRange(*levels_[level].front(), *levels_[level].back(), smallest,
+               largest);
     }
   }
 }
 #ifdef BYTEADDRESSABLE
 void Version::AddSEQIterators(const ReadOptions& options,
-                           std::vector<Iterator*>* iters) {
+                              std::vector<Iterator*>* iters,
+                              std::vector<Slice>* smallest,
+                              std::vector<Slice>* largest) {
+  const Comparator* ucmp = vset_->icmp_.user_comparator();
   // Merge all level zero files together since they may overlap
   for (size_t i = 0; i < levels_[0].size(); i++) {
-    iters->push_back(vset_->table_cache_->NewSEQIterator(
-        options, levels_[0][i]));
+    if (FileInBounds(ucmp, options, *levels_[0][i])) {
+      iters->push_back(vset_->table_cache_->NewSEQIterator(
+          options, levels_[0][i]));
+      AddRange(*levels_[0][i], *levels_[0][i], smallest, largest);
+    }
   }
 
   // For levels > 0, we can use a concatenating iterator that sequentially
   // walks through the non-overlapping files in the level, opening them
   // lazily.
   for (int level = 1; level < config::kNumLevels; level++) {
-    if (!levels_[level].empty()) {
+    if (!levels_[level].empty() &&
+        SomeFileOverlapsRange(vset_->icmp_, true, levels_[level],
+                              options.iterate_lower_bound,
+                              options.iterate_upper_bound)) {
       iters->push_back(NewConcatenatingSEQIterator(options, level));
+      AddRange(*levels_[level].front(), *levels_[level].back(), smallest,
+               largest);
     }
   }
 }
@@ -294,7 +492,7 @@ void Version::ForEachOverlapping(Slice user_key, Slice internal_key, void* arg,
     if (num_files == 0) continue;
 
     // Binary search to find earliest index whose largest key >= internal_key.
-    uint32_t index = FindFile(vset_->icmp_, levels_[level], internal_key);
+    uint32_t index = FindFileInLevel(level, internal_key);
     if (index < num_files) {
       std::shared_ptr<RemoteMemTableMetaData> f = levels_[level][index];
       if (ucmp->Compare(user_key, f->smallest.user_key()) < 0) {
@@ -308,13 +506,83 @@ void Version::ForEachOverlapping(Slice user_key, Slice internal_key, void* arg,
   }
 }
 
+// Have the saver of a lookup at "k" drop the values the range tombstones
+// delete at its snapshot.
+static void SetRangeTombstones(const RangeTombstones& tombstones,
+                               const LookupKey& k, Saver* saver) {
+  if (tombstones.empty()) {
+    return;
+  }
+  Slice ikey = k.internal_key();
+  saver->range_tombstones = &tombstones;
+  saver->snapshot = DecodeFixed64(ikey.data() + ikey.size() - 8) >> 8;
+}
+
+// The table of "iter" holds a merge operand of the key of "saver" as its
+// first entry for "ikey". Add it and the operands after it to
+// *merge_context, and leave in "saver" the state of the entry below them,
+// with the value in saver->pinned_value, which refers to the block of
+// "iter", if there is one for a pinnable.
+static void CollectOperands(Iterator* iter, const Slice& ikey, Saver* saver,
+                            MergeContext* merge_context) {
+  saver->state = kNotFound;
+  for (iter->Seek(ikey); iter->Valid(); iter->Next()) {
+    ParsedInternalKey parsed_key;
+    if (!ParseInternalKey(iter->key(), &parsed_key)) {
+      saver->state = kCorrupt;
+      return;
+    }
+    if (saver->ucmp->Compare(parsed_key.user_key, saver->user_key) != 0) {
+      return;
+    }
+    if (parsed_key.type != kTypeMerge) {
+      SaveValue(saver, iter->key(), iter->value());
+      return;
+    }
+    if (!merge_context->AddOperand(parsed_key.user_key, parsed_key.sequence,
+                                   iter->value())) {
+      saver->state = kDeleted;
+      return;
+    }
+  }
+}
+
+Status Version::Get(const ReadOptions& options, const LookupKey& k,
+                    std::string* value, GetStats* stats,
+                    MergeContext* merge_context) {
+  return GetImpl(options, k, value, nullptr, stats, merge_context);
+}
+
 Status Version::Get(const ReadOptions& options, const LookupKey& k,
-                    std::string* value, GetStats* stats) {
+                    PinnableSlice* value, GetStats* stats,
+                    MergeContext* merge_context) {
+  return GetImpl(options, k, nullptr, value, stats, merge_context);
+}
+
+Status Version::GetImpl(const ReadOptions& options, const LookupKey& k,
+                        std::string* value, PinnableSlice* pinnable,
+                        GetStats* stats, MergeContext* merge_context) {
 #ifdef PROCESSANALYSIS
   auto start = std::chrono::high_resolution_clock::now();
 #endif
   stats->seek_file = nullptr;
   stats->seek_file_level = -1;
+  stats->read_file = nullptr;
+  if (stats->blob_index != nullptr) {
+    stats->blob_index->clear();
+  }
+  if (options.parallel_probe) {
+    if (pinnable == nullptr) {
+      return ParallelGet(options, k, value, stats, merge_context);
+    }
+    // The batched reads do not keep the blocks, the value is copied.
+    Status s = ParallelGet(options, k, pinnable->GetSelf(), stats,
+                           merge_context);
+    if (s.ok()) {
+      pinnable->PinSelf();
+    }
+    return s;
+  }
 
   struct State {
     Saver saver;
@@ -325,6 +593,7 @@ Status Version::Get(const ReadOptions& options, const LookupKey& k,
     int last_file_read_level;
 
     VersionSet* vset;
+    MergeContext* merge_context;
     Status s;
     bool found;
 
@@ -340,26 +609,66 @@ Status Version::Get(const ReadOptions& options, const LookupKey& k,
 
       state->last_file_read = f;
       state->last_file_read_level = level;
+      PERF_COUNTER_ADD(files_probed, 1);
+      PERF_TIMER_GUARD(files_nanos);
 
+      // Releases the block read from this file unless the value is pinned.
+      Cleanable pin;
+      state->saver.read_block = false;
       state->s = state->vset->table_cache_->Get(*state->options, f,
-          state->ikey, &state->saver, SaveValue);
+          state->ikey, &state->saver, SaveValue,
+          state->saver.pinnable != nullptr ? &pin : nullptr);
       if (!state->s.ok()) {
         state->found = true;
         return false;
       }
+      // Whether the value is in the pinnable already.
+      bool copied = false;
+      if (state->saver.state == kMerge) {
+        // The operands may go on past the entry the table returned, they
+        // are read with an iterator over the rest of the file. The merge
+        // needs the value below them.
+        state->saver.blob_index = nullptr;
+        Iterator* iter =
+            state->vset->table_cache_->NewIterator(*state->options, f);
+        CollectOperands(iter, state->ikey, &state->saver,
+                        state->merge_context);
+        if (state->saver.state == kFound && state->saver.pinnable != nullptr) {
+          state->saver.pinnable->PinSelf(state->saver.pinned_value);
+          copied = true;
+        }
+        state->s = iter->status();
+        delete iter;
+        if (!state->s.ok()) {
+          state->found = true;
+          return false;
+        }
+      }
       switch (state->saver.state) {
         case kNotFound:
+          if (state->saver.read_block && state->stats->missed_files != nullptr) {
+            state->stats->missed_files->push_back(f);
+          }
           return true;  // Keep searching in other files
         case kFound:
+          if (state->saver.pinnable != nullptr && state->saver.blob) {
+            state->saver.pinnable->PinSelf();
+          } else if (state->saver.pinnable != nullptr && !copied) {
+            state->saver.pinnable->PinSlice(state->saver.pinned_value, &pin);
+          }
+          state->stats->read_file = f;
           state->found = true;
           return false;
         case kDeleted:
+          state->stats->read_file = f;
           return false;
         case kCorrupt:
           state->s =
               Status::Corruption("corrupted key for ", state->saver.user_key);
           state->found = true;
           return false;
+        case kMerge:
+          break;
       }
 
       // Not reached. Added to avoid false compilation warnings of
@@ -377,11 +686,18 @@ Status Version::Get(const ReadOptions& options, const LookupKey& k,
   state.options = &options;
   state.ikey = k.internal_key();
   state.vset = vset_;
+  state.merge_context = merge_context;
 
   state.saver.state = kNotFound;
   state.saver.ucmp = vset_->icmp_.user_comparator();
   state.saver.user_key = k.user_key();
   state.saver.value = value;
+  state.saver.pinnable = pinnable;
+  if (stats->blob_index != nullptr && pinnable == nullptr &&
+      merge_context->empty()) {
+    state.saver.blob_index = stats->blob_index;
+  }
+  SetRangeTombstones(range_tombstones_, k, &state.saver);
 
   ForEachOverlapping(state.saver.user_key, state.ikey, &state, &State::Match);
 #ifdef PROCESSANALYSIS
@@ -397,19 +713,265 @@ Status Version::Get(const ReadOptions& options, const LookupKey& k,
   return state.found ? state.s : Status::NotFound(Slice());
 }
 
+Status Version::ParallelGet(const ReadOptions& options, const LookupKey& k,
+                            std::string* value, GetStats* stats,
+                            MergeContext* merge_context) {
+  struct Candidate {
+    int level;
+    Saver saver;
+    std::string value;
+    std::string blob_index;
+  };
+  struct State {
+    // The files overlapping the key from newest to oldest, as Get() visits
+    // them.
+    std::vector<Candidate> candidates;
+    std::vector<TableCache::BatchedGet> batch;
+
+    static bool Collect(void* arg, int level,
+                        std::shared_ptr<RemoteMemTableMetaData> f) {
+      State* state = reinterpret_cast<State*>(arg);
+      PERF_COUNTER_ADD(files_probed, 1);
+      state->candidates.emplace_back();
+      state->candidates.back().level = level;
+      state->batch.push_back({f, Slice(), nullptr, Status::OK()});
+      return true;
+    }
+    static bool Resolved(void* arg) {
+      return reinterpret_cast<Saver*>(arg)->state != kNotFound;
+    }
+  };
+  State state;
+  ForEachOverlapping(k.user_key(), k.internal_key(), &state, &State::Collect);
+  for (size_t i = 0; i < state.batch.size(); i++) {
+    Candidate& c = state.candidates[i];
+    c.saver.ucmp = vset_->icmp_.user_comparator();
+    c.saver.user_key = k.user_key();
+    c.saver.value = &c.value;
+    if (stats->blob_index != nullptr && merge_context->empty()) {
+      c.saver.blob_index = &c.blob_index;
+    }
+    SetRangeTombstones(range_tombstones_, k, &c.saver);
+    state.batch[i].k = k.internal_key();
+    state.batch[i].arg = &c.saver;
+  }
+  // All the reads are in flight together, the newest file that knows the key
+  // wins and the results of the older ones are not looked at.
+  vset_->table_cache_->MultiGet(options, &state.batch, SaveValue,
+                                &State::Resolved);
+  size_t i = 0;
+  while (i < state.batch.size() && state.batch[i].s.ok() &&
+         state.candidates[i].saver.state == kNotFound) {
+    i++;
+  }
+  if (stats->missed_files != nullptr) {
+    for (size_t j = 0; j < i; j++) {
+      if (state.candidates[j].saver.read_block) {
+        stats->missed_files->push_back(state.batch[j].file);
+      }
+    }
+  }
+  // Charge the first file if more than one was read, as Get() does.
+  if ((i < state.batch.size() && i > 0) ||
+      (i == state.batch.size() && i > 1)) {
+    stats->seek_file = state.batch[0].file;
+    stats->seek_file_level = state.candidates[0].level;
+  }
+  if (i == state.batch.size()) {
+    return Status::NotFound(Slice());
+  }
+  if (!state.batch[i].s.ok()) {
+    return state.batch[i].s;
+  }
+  if (state.candidates[i].saver.state == kMerge) {
+    // The entries below the operand are read file by file.
+    ReadOptions serial = options;
+    serial.parallel_probe = false;
+    return GetImpl(serial, k, value, nullptr, stats, merge_context);
+  }
+  stats->read_file = state.batch[i].file;
+  switch (state.candidates[i].saver.state) {
+    case kFound:
+      value->swap(state.candidates[i].value);
+      if (stats->blob_index != nullptr) {
+        stats->blob_index->swap(state.candidates[i].blob_index);
+      }
+      return Status::OK();
+    case kCorrupt:
+      return Status::Corruption("corrupted key for ", k.user_key());
+    default:
+      return Status::NotFound(Slice());
+  }
+}
+
+void Version::MultiGet(const ReadOptions& options,
+                       const std::vector<const LookupKey*>& keys,
+                       const std::vector<std::string*>& values,
+                       const std::vector<Status*>& statuses) {
+  struct KeyState {
+    Saver saver;
+    Slice ikey;
+    // Files overlapping the key, from newest to oldest.
+    std::vector<std::shared_ptr<RemoteMemTableMetaData>> files;
+    size_t next_file = 0;
+    bool done = false;
+    // Met a merge operand, looked up again on its own.
+    bool merge = false;
+
+    static bool Collect(void* arg, int level,
+                        std::shared_ptr<RemoteMemTableMetaData> f) {
+      reinterpret_cast<KeyState*>(arg)->files.push_back(f);
+      return true;
+    }
+  };
+  std::vector<KeyState> states(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    KeyState& state = states[i];
+    state.ikey = keys[i]->internal_key();
+    state.saver.state = kNotFound;
+    state.saver.ucmp = vset_->icmp_.user_comparator();
+    state.saver.user_key = keys[i]->user_key();
+    state.saver.value = values[i];
+    SetRangeTombstones(range_tombstones_, *keys[i], &state.saver);
+    ForEachOverlapping(state.saver.user_key, state.ikey, &state,
+                       &KeyState::Collect);
+    *statuses[i] = Status::NotFound(Slice());
+    state.done = state.files.empty();
+  }
+  // Take the result of the probe of the next file of key i.
+  auto settle = [&](size_t i, const Status& s) {
+    KeyState& state = states[i];
+    if (!s.ok()) {
+      *statuses[i] = s;
+      state.done = true;
+      return;
+    }
+    switch (state.saver.state) {
+      case kNotFound:
+        state.done = state.next_file == state.files.size();
+        break;
+      case kFound:
+        *statuses[i] = Status::OK();
+        state.done = true;
+        break;
+      case kDeleted:
+        state.done = true;
+        break;
+      case kCorrupt:
+        *statuses[i] =
+            Status::Corruption("corrupted key for ", state.saver.user_key);
+        state.done = true;
+        break;
+      case kMerge:
+        state.merge = true;
+        state.done = true;
+        break;
+    }
+  };
+  if (options.pipeline_depth > 0) {
+    // Every lookup moves on as soon as its own read completes.
+    std::vector<TableCache::AsyncGet> slots(options.pipeline_depth);
+    std::vector<TableCache::BatchedGet> gets(options.pipeline_depth);
+    std::vector<size_t> slot_keys(options.pipeline_depth);
+    std::vector<size_t> free_slots;
+    for (size_t j = slots.size(); j > 0; j--) {
+      free_slots.push_back(j - 1);
+    }
+    std::deque<size_t> ready;
+    for (size_t i = 0; i < states.size(); i++) {
+      if (!states[i].done) ready.push_back(i);
+    }
+    while (!ready.empty() || free_slots.size() < slots.size()) {
+      while (!ready.empty() && !free_slots.empty()) {
+        size_t i = ready.front();
+        ready.pop_front();
+        KeyState& state = states[i];
+        size_t j = free_slots.back();
+        gets[j] = {state.files[state.next_file++], state.ikey, &state.saver,
+                   Status::OK()};
+        if (vset_->table_cache_->StartGet(options, &gets[j], SaveValue,
+                                          &slots[j])) {
+          free_slots.pop_back();
+          slot_keys[j] = i;
+          continue;
+        }
+        settle(i, gets[j].s);
+        if (!state.done) ready.push_back(i);
+      }
+      for (size_t j = 0; j < slots.size(); j++) {
+        if (slots[j].handle == nullptr || !slots[j].future.IsReady()) {
+          continue;
+        }
+        size_t i = slot_keys[j];
+        vset_->table_cache_->FinishGet(options, &gets[j], SaveValue,
+                                       &slots[j]);
+        free_slots.push_back(j);
+        settle(i, gets[j].s);
+        if (!states[i].done) ready.push_back(i);
+      }
+    }
+  }
+  // Every round probes the next candidate file of all the unresolved keys.
+  std::vector<TableCache::BatchedGet> batch;
+  std::vector<size_t> batch_keys;
+  while (true) {
+    batch.clear();
+    batch_keys.clear();
+    for (size_t i = 0; i < states.size(); i++) {
+      KeyState& state = states[i];
+      if (state.done) continue;
+      batch.push_back({state.files[state.next_file++], state.ikey,
+                       &state.saver, Status::OK()});
+      batch_keys.push_back(i);
+    }
+    if (batch.empty()) {
+      break;
+    }
+    vset_->table_cache_->MultiGet(options, &batch, SaveValue);
+    for (size_t j = 0; j < batch.size(); j++) {
+      settle(batch_keys[j], batch[j].s);
+    }
+  }
+  ReadOptions serial = options;
+  serial.parallel_probe = false;
+  for (size_t i = 0; i < states.size(); i++) {
+    if (!states[i].merge) continue;
+    Slice ikey = keys[i]->internal_key();
+    MergeContext merge_context(
+        vset_->options_->merge_operator, vset_->icmp_.user_comparator(),
+        &range_tombstones_, DecodeFixed64(ikey.data() + ikey.size() - 8) >> 8);
+    GetStats stats;
+    Status s =
+        GetImpl(serial, *keys[i], values[i], nullptr, &stats, &merge_context);
+    *statuses[i] = merge_context.Finish(keys[i]->user_key(), s, values[i]);
+  }
+}
+
 bool Version::UpdateStats(const GetStats& stats) {
   std::shared_ptr<RemoteMemTableMetaData> f = stats.seek_file;
   if (f != nullptr) {
-    f->allowed_seeks--;
-    if (f->allowed_seeks <= 0 && file_to_compact_ == nullptr) {
-      file_to_compact_ = f;
-      file_to_compact_level_ = stats.seek_file_level;
-      return true;
-    }
+    return ChargeSeeks(f, 1);
   }
   return false;
 }
 
+bool Version::ChargeSeeks(const std::shared_ptr<RemoteMemTableMetaData>& f,
+                          int64_t seeks) {
+  if (f->allowed_seeks.fetch_sub(seeks, std::memory_order_relaxed) > seeks) {
+    return false;
+  }
+  // The first reader to run a file of this version out marks it, the
+  // versions after it are marked again by the next read charged.
+  bool expected = false;
+  if (!file_to_compact_marked_.compare_exchange_strong(expected, true)) {
+    return false;
+  }
+  file_to_compact_ = f;
+  file_to_compact_level_.store(static_cast<int>(f->level),
+                               std::memory_order_release);
+  return true;
+}
+
 bool Version::RecordReadSample(Slice internal_key) {
   ParsedInternalKey ikey;
   if (!ParseInternalKey(internal_key, &ikey)) {
@@ -503,7 +1065,7 @@ int Version::PickLevelForMemTableOutput(const Slice& smallest_user_key,
         // Check that file does not overlap too many grandparent bytes.
         GetOverlappingInputs(level + 2, &start, &limit, &overlaps);
         const int64_t sum = TotalFileSize(overlaps);
-        if (sum > MaxGrandParentOverlapBytes(vset_->options_)) {
+        if (sum > MaxGrandParentOverlapBytes(vset_->options_, level)) {
           break;
         }
       }
@@ -608,8 +1170,8 @@ class VersionSet::Builder {
   struct BySmallestKey {
     const InternalKeyComparator* internal_comparator;
 
-    bool operator()(std::shared_ptr<RemoteMemTableMetaData> f1,
-                    std::shared_ptr<RemoteMemTableMetaData> f2) const {
+    bool operator()(const std::shared_ptr<RemoteMemTableMetaData>& f1,
+                    const std::shared_ptr<RemoteMemTableMetaData>& f2) const {
       int r = internal_comparator->Compare(f1->smallest, f2->smallest);
       if (r != 0) {
         return (r < 0);
@@ -629,6 +1191,7 @@ class VersionSet::Builder {
   VersionSet* vset_;
   Version* base_;
   LevelState levels_[config::kNumLevels];
+  RangeTombstones range_tombstones_;
 #ifndef NDEBUG
   int number_deleted = 0;
 #endif
@@ -636,7 +1199,8 @@ class VersionSet::Builder {
 
  public:
   // Initialize a builder with the files from *base and other info from *vset
-  Builder(VersionSet* vset, Version* base) : vset_(vset), base_(base) {
+  Builder(VersionSet* vset, Version* base)
+      : vset_(vset), base_(base), range_tombstones_(base->range_tombstones_) {
     base_->Ref(3);
     BySmallestKey cmp;
     cmp.internal_comparator = &vset_->icmp_;
@@ -677,6 +1241,13 @@ class VersionSet::Builder {
           edit->compact_pointers_[i].second.Encode().ToString();
     }
 
+    for (const RangeTombstone& t : edit->new_range_tombstones_) {
+      range_tombstones_.Add(t);
+    }
+    for (SequenceNumber sequence : edit->deleted_range_tombstones_) {
+      range_tombstones_.Remove(sequence);
+    }
+
     // Delete files
     for (const auto& deleted_file_set_kvp : edit->deleted_files_) {
       const int level = std::get<0>(deleted_file_set_kvp);
@@ -730,18 +1301,31 @@ class VersionSet::Builder {
 
   // Save the current state in *v.
   void SaveTo(Version* v) {
+    v->range_tombstones_ = range_tombstones_;
 //    printf("SaveTo: level 1 deleted file size %lu\n", levels_[1].deleted_files.size());
     BySmallestKey cmp;
     cmp.internal_comparator = &vset_->icmp_;
     for (int level = 0; level < config::kNumLevels; level++) {
+      const FileSet* added_files = levels_[level].added_files;
+      if (added_files->empty() && levels_[level].deleted_files.empty()) {
+        // The edit leaves the level as it is, share its files and fences.
+        v->levels_[level] = base_->levels_[level];
+        v->fences_[level] = base_->fences_[level];
+        for (const auto& f : base_->levels_[level]) {
+          if (f->UnderCompaction) {
+            v->in_progress[level].push_back(f);
+          }
+        }
+        continue;
+      }
       // Merge the set of added files with the set of pre-existing files.
       // Drop any deleted files.  Store the result in *v.
       const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& base_files = base_->levels_[level];
 //      const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& base_in_progress = base_->levels_[level];
       std::vector<std::shared_ptr<RemoteMemTableMetaData>>::const_iterator base_iter = base_files.begin();
       std::vector<std::shared_ptr<RemoteMemTableMetaData>>::const_iterator base_end = base_files.end();
-      const FileSet* added_files = levels_[level].added_files;
-      v->levels_[level].reserve(base_files.size() + added_files->size());
+      LevelFiles::Files files;
+      files.reserve(base_files.size() + added_files->size());
       //TOTHINK: how could this make sure the order in level 0.
       // Answer: they are not organized by order, instead the organized by key,
       // but whensearcg level 0 the reader will order the table be filenumber and then
@@ -760,16 +1344,17 @@ class VersionSet::Builder {
              base_iter != bpos; ++base_iter) {
           //Ruihong: why the builder will push back the base_iter to the level?
           //Because the code tries to build the version from the scratch
-          MaybeAddFile(v, level, *base_iter);
+          MaybeAddFile(v, &files, level, *base_iter);
         }
 
-        MaybeAddFile(v, level, added_file);
+        MaybeAddFile(v, &files, level, added_file);
       }
 
       // Add remaining base files
       for (; base_iter != base_end; ++base_iter) {
-        MaybeAddFile(v, level, *base_iter);
+        MaybeAddFile(v, &files, level, *base_iter);
       }
+      v->levels_[level].Reset(std::move(files));
 
 #ifndef NDEBUG
 
@@ -797,7 +1382,9 @@ class VersionSet::Builder {
 #endif
   }
 
-  void MaybeAddFile(Version* v, int level, std::shared_ptr<RemoteMemTableMetaData> f) {
+  void MaybeAddFile(Version* v,
+                    std::vector<std::shared_ptr<RemoteMemTableMetaData>>* files,
+                    int level, const std::shared_ptr<RemoteMemTableMetaData>& f) {
 
     std::pair <std::multimap<uint64_t, uint8_t>::iterator, std::multimap<uint64_t ,uint8_t>::iterator>
         ret = levels_[level].deleted_files.equal_range(f->number);
@@ -819,7 +1406,6 @@ class VersionSet::Builder {
 //      printf("file NUM %lu get deleted.\n", f->number);
 //#endif
     } else {
-      std::vector<std::shared_ptr<RemoteMemTableMetaData>>* files = &v->levels_[level];
       std::vector<std::shared_ptr<RemoteMemTableMetaData>>* in_progresses = &v->in_progress[level];
 
 
@@ -934,22 +1520,33 @@ void VersionSet::AppendVersion(Version* v) {
   version_set_list.unlock();
 }
 #ifdef WITHPERSISTENCE
-void VersionSet::Persistency_pin(VersionEdit* edit) {
+uint64_t VersionSet::Persistency_pin(VersionEdit* edit) {
   std::unique_lock<std::mutex> lck(pinner_mtx);
+  uint64_t epoch = ++persist_epoch_;
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>>& pinned =
+      persistent_pinner_[epoch];
   for(auto iter : *edit->GetNewFiles()){
-    persistent_pinner_.insert({iter.second->number, iter.second});
+    pinned.push_back(iter.second);
 //    printf("pin sstable %lu", iter.second->number);
   }
-
-  assert(persistent_pinner_.size() <= 256);
+  pinned_file_num_ += pinned.size();
+  assert(pinned_file_num_ <= 256);
+  return epoch;
 }
-void VersionSet::Persistency_unpin(uint64_t* array, size_t size){
-  std::unique_lock<std::mutex> lck(pinner_mtx);
-  for (int i = 0; i < size; ++i) {
-    assert(persistent_pinner_.find(array[i]) != persistent_pinner_.end());
-//    printf("Unpin sstable %lu", array[i]);
-    persistent_pinner_.erase(array[i]);
+void VersionSet::Persistency_unpin(uint64_t persisted_epoch){
+  std::map<uint64_t, std::vector<std::shared_ptr<RemoteMemTableMetaData>>>
+      unpinned;
+  {
+    std::unique_lock<std::mutex> lck(pinner_mtx);
+    auto end = persistent_pinner_.upper_bound(persisted_epoch);
+    for (auto iter = persistent_pinner_.begin(); iter != end; ++iter) {
+      pinned_file_num_ -= iter->second.size();
+    }
+    unpinned.insert(persistent_pinner_.begin(), end);
+    persistent_pinner_.erase(persistent_pinner_.begin(), end);
   }
+  // The last references of the files may go here, which deallocates their
+  // chunks, so do it outside of the mutex.
 }
 #endif
 Status VersionSet::LogAndApply(VersionEdit* edit) {
@@ -980,9 +1577,6 @@ Status VersionSet::LogAndApply(VersionEdit* edit) {
   edit->SetLastSequence(last_sequence_);
   Version* v;
   v = new Version(this);
-#ifdef WITHPERSISTENCE
-  Persistency_pin(edit);
-#endif
   //Build an empty version.
 //  if (remote_subversion_id == 0){
 //    v = new Version(this);
@@ -1067,7 +1661,9 @@ Status VersionSet::LogAndApply(VersionEdit* edit) {
   // Install the new version
   if (s.ok()) {
 //    std::unique_lock<std::mutex> lck(*version_set_mtx);
-
+    if (edit_publisher_ != nullptr) {
+      edit_publisher_->Publish(edit, current_, v);
+    }
     AppendVersion(v);
   } else {
     delete v;
@@ -1256,14 +1852,125 @@ void VersionSet::MarkFileNumberUsed(uint64_t number) {
   }
 }
 
+void VersionSet::LevelMaxBytes(Version* v, double* max_bytes) const {
+  for (int level = 1; level < config::kNumLevels; level++) {
+    max_bytes[level] = MaxBytesForLevel(options_, level);
+  }
+  if (!options_->dynamic_level_bytes) {
+    return;
+  }
+  // As RocksDB's level_compaction_dynamic_level_bytes: from the size of the
+  // last level up, every level a tenth of the next, up to the first one no
+  // larger than the fixed level 1 size. The levels above it are empty, the
+  // tables of level 0 go down to the last level while it is small.
+  const int last = config::kNumLevels - 1;
+  const double base = MaxBytesForLevel(options_, 1);
+  double size = static_cast<double>(TotalFileSize(v->levels_[last]));
+  int base_level = last;
+  while (base_level > 1 && size > base) {
+    size /= 10;
+    base_level--;
+  }
+  // Not so small that every flush overflows it.
+  size = std::max(size, base / 10);
+  for (int level = 1; level < base_level; level++) {
+    max_bytes[level] = 0;
+  }
+  for (int level = base_level; level < last; level++) {
+    max_bytes[level] = size;
+    size *= 10;
+  }
+}
+
+double VersionSet::FIFOScore(Version* v) const {
+  uint64_t total_bytes = 0;
+  bool expired = false;
+  const uint64_t now = options_->env->NowMicros() / 1000000;
+  for (int level = 0; level < config::kNumLevels; level++) {
+    for (const auto& f : v->levels_[level]) {
+      if (f->UnderCompaction) {
+        continue;
+      }
+      total_bytes += f->file_size;
+      expired |= options_->ttl > 0 && f->creation_time > 0 &&
+                 f->creation_time + options_->ttl < now;
+    }
+  }
+  const double score = static_cast<double>(total_bytes) /
+                       std::max<uint64_t>(options_->fifo_max_table_files_size, 1);
+  return expired ? std::max(score, 1.0) : score;
+}
+
+uint64_t VersionSet::EstimatePendingBytes(Version* v,
+                                          const double* max_bytes) const {
+  const int last = config::kNumLevels - 1;
+  uint64_t pending = 0;
+  if (options_->compaction_style == kCompactionStyleFIFO) {
+    return 0;
+  }
+  if (options_->compaction_style == kCompactionStyleTiered) {
+    // A level due is merged into the next one as a whole.
+    for (int level = 0; level < last; level++) {
+      if (v->compaction_score_[level] >= 1) {
+        pending += TotalFileSize(v->levels_[level]) +
+                   TotalFileSize(v->levels_[level + 1]);
+      }
+    }
+    return pending;
+  }
+  // As RocksDB's estimated_compaction_needed_bytes: the bytes a level holds
+  // over its target, those pushed down from the level above included, are
+  // merged into the next level, which is rewritten in proportion.
+  uint64_t incoming = 0;
+  if (v->levels_[0].size() >= config::kL0_CompactionTrigger) {
+    incoming = TotalFileSize(v->levels_[0]);
+    pending += incoming + TotalFileSize(v->levels_[1]);
+  }
+  for (int level = 1; level < last; level++) {
+    const uint64_t level_bytes = TotalFileSize(v->levels_[level]) + incoming;
+    incoming = 0;
+    if (level_bytes > max_bytes[level]) {
+      incoming = level_bytes - static_cast<uint64_t>(max_bytes[level]);
+      const double next_ratio =
+          static_cast<double>(TotalFileSize(v->levels_[level + 1])) /
+          level_bytes;
+      pending += static_cast<uint64_t>(incoming * (next_ratio + 1));
+    }
+  }
+  return pending;
+}
+
 void VersionSet::Finalize(Version* v) {
+  // The files of a version do not change, the fences are built the first
+  // time only, before the version is installed.
+  v->BuildFences();
+  double max_bytes[config::kNumLevels];
+  LevelMaxBytes(v, max_bytes);
+  // The levels without a target size are emptied into the next one before
+  // any other level but level 0 is compacted.
+  auto level_score = [&](int level, uint64_t level_bytes) {
+    if (max_bytes[level] > 0) {
+      return static_cast<double>(level_bytes) / max_bytes[level];
+    }
+    return level_bytes == 0 ? 0.0
+                            : 1.0 + level_bytes / MaxBytesForLevel(options_, 1);
+  };
   // Precomputed best level for next compaction
 //  int best_level = -1;
 //  double best_score = -1;
 
   for (int level = 0; level < config::kNumLevels - 1; level++) {
     double score;
-    if (level == 0) {
+    if (options_->compaction_style == kCompactionStyleFIFO) {
+      // Nothing is merged, the score of level 0 only tells that some
+      // tables are due to be dropped, see DBImpl::DropExpiredFiles().
+      score = 0;
+      if (level == 0) {
+        score = FIFOScore(v);
+      }
+      v->compaction_level_[level] = level;
+      v->compaction_score_[level] = score;
+    } else if (level == 0) {
       // We treat level-0 specially by bounding the number of files
       // instead of number of bytes for two reasons:
       //
@@ -1283,11 +1990,45 @@ void VersionSet::Finalize(Version* v) {
       v->compaction_level_[level] = level;
       v->compaction_score_[level] = score;
 
+    } else if (options_->compaction_style == kCompactionStyleTiered) {
+      // A level is merged into the next one as a whole, once the next one
+      // is not much larger than it. Either can only take part in one
+      // compaction at a time.
+      const uint64_t level_bytes = TotalFileSize(v->levels_[level]);
+      const uint64_t next_level_bytes = TotalFileSize(v->levels_[level + 1]);
+      if (level_bytes == 0 || !v->in_progress[level].empty() ||
+          !v->in_progress[level + 1].empty()) {
+        score = 0;
+      } else {
+        score = static_cast<double>(level_bytes) *
+                (100 + options_->tiered_size_ratio) /
+                (100.0 * std::max<uint64_t>(next_level_bytes, 1));
+      }
+      v->compaction_level_[level] = level;
+      v->compaction_score_[level] = score;
+    } else if (options_->tombstone_compaction_ratio > 0) {
+      // The deletions weigh more, and a table mostly of deletions makes
+      // the level due.
+      uint64_t level_bytes = 0;
+      bool tombstones_due = false;
+      for (const auto& f : v->levels_[level]) {
+        if (f->UnderCompaction) {
+          continue;
+        }
+        level_bytes += CompensatedFileSize(*f);
+        tombstones_due |=
+            DeletionRatio(*f) >= options_->tombstone_compaction_ratio;
+      }
+      score = level_score(level, level_bytes);
+      if (tombstones_due) {
+        score = std::max(score, 1.0);
+      }
+      v->compaction_level_[level] = level;
+      v->compaction_score_[level] = score;
     } else {
       // Compute the ratio of current size to size limit.
       const uint64_t level_bytes = TotalFileSize(v->levels_[level]) - TotalFileSize(v->in_progress[level]);
-      score =
-          static_cast<double>(level_bytes) / MaxBytesForLevel(options_, level);
+      score = level_score(level, level_bytes);
       assert(score>=0);
       v->compaction_level_[level] = level;
       v->compaction_score_[level] = score;
@@ -1298,6 +2039,7 @@ void VersionSet::Finalize(Version* v) {
 //      best_score = score;
 //    }
   }
+  v->pending_compaction_bytes_ = EstimatePendingBytes(v, max_bytes);
   //sort the compaction level and compaction score.
   for (int i = 0; i < config::kNumLevels - 2; i++) {
     for (int j = i + 1; j < config::kNumLevels - 1; j++) {
@@ -1354,6 +2096,13 @@ int VersionSet::NumLevelFiles(int level) const {
   return current_->levels_[level].size();
 }
 
+int VersionSet::NumStallFiles() const {
+  if (options_->compaction_style == kCompactionStyleFIFO) {
+    return 0;
+  }
+  return NumLevelFiles(0);
+}
+
 const char* VersionSet::LevelSummary(LevelSummaryStorage* scratch) const {
   // Update code if kNumLevels changes
   static_assert(config::kNumLevels == 6, "");
@@ -1380,13 +2129,27 @@ const char* VersionSet::LevelSummary(LevelSummaryStorage* scratch) const {
 //  return true;
 //}
 uint64_t VersionSet::ApproximateOffsetOf(Version* v, const InternalKey& ikey) {
+  uint64_t bytes, entries, raw_bytes;
+  ApproximateOffsetOf(v, ikey, &bytes, &entries, &raw_bytes);
+  return bytes;
+}
+void VersionSet::ApproximateOffsetOf(Version* v, const InternalKey& ikey,
+                                     uint64_t* bytes, uint64_t* entries,
+                                     uint64_t* raw_bytes) {
   uint64_t result = 0;
+  double entries_before = 0;
+  double raw_before = 0;
   for (int level = 0; level < config::kNumLevels; level++) {
     const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& files = v->levels_[level];
     for (size_t i = 0; i < files.size(); i++) {
+      const TableKeyStats& stats = files[i]->key_stats;
+      const double raw_size = static_cast<double>(stats.raw_key_size) +
+                              static_cast<double>(stats.raw_value_size);
       if (icmp_.Compare(files[i]->largest, ikey) <= 0) {
         // Entire file is before "ikey", so just add the file size
         result += files[i]->file_size;
+        entries_before += files[i]->num_entries;
+        raw_before += raw_size;
       } else if (icmp_.Compare(files[i]->smallest, ikey) > 0) {
         // Entire file is after "ikey", so ignore
         if (level > 0) {
@@ -1395,6 +2158,14 @@ uint64_t VersionSet::ApproximateOffsetOf(Version* v, const InternalKey& ikey) {
           // "ikey".
           break;
         }
+      } else if (!stats.empty()) {
+        // "ikey" falls in the range for this table, placed by the keys
+        // sampled as the table was built.
+        const double fraction = stats.FractionBefore(
+            &icmp_, ikey.Encode(), files[i]->num_entries);
+        result += static_cast<uint64_t>(fraction * files[i]->file_size);
+        entries_before += fraction * files[i]->num_entries;
+        raw_before += fraction * raw_size;
       } else {
         // "ikey" falls in the range for this table.  Add the
         // approximate offset of "ikey" within the table.
@@ -1402,13 +2173,20 @@ uint64_t VersionSet::ApproximateOffsetOf(Version* v, const InternalKey& ikey) {
         Iterator* iter = table_cache_->NewIterator(
             ReadOptions(), files[i], &tableptr);
         if (tableptr != nullptr) {
-          result += tableptr->ApproximateOffsetOf(ikey.Encode());
+          const uint64_t offset = tableptr->ApproximateOffsetOf(ikey.Encode());
+          result += offset;
+          if (files[i]->file_size > 0) {
+            entries_before += static_cast<double>(offset) /
+                              files[i]->file_size * files[i]->num_entries;
+          }
         }
         delete iter;
       }
     }
   }
-  return result;
+  *bytes = result;
+  *entries = static_cast<uint64_t>(entries_before);
+  *raw_bytes = static_cast<uint64_t>(raw_before);
 }
 
 void VersionSet::AddLiveFiles(std::set<uint64_t>* live) {
@@ -1429,6 +2207,85 @@ int64_t VersionSet::NumLevelBytes(int level) const {
   return TotalFileSize(current_->levels_[level]);
 }
 
+uint64_t VersionSet::PendingCompactionBytes() const {
+  return current_->pending_compaction_bytes_;
+}
+
+int VersionSet::BloomBitsForLevel(int level) const {
+  const std::vector<int>& per_level = options_->bloom_bits_per_level;
+  if (!per_level.empty()) {
+    return per_level[std::min<size_t>(level, per_level.size() - 1)];
+  }
+  if (!options_->adaptive_bloom_bits || options_->bloom_bits <= 0) {
+    return options_->bloom_bits;
+  }
+  // Read without the lock like NeedsCompaction(), a level emptied or filled
+  // meanwhile only moves the bits of this table a little.
+  Version* v = current_;
+  int deepest = level;
+  for (int l = config::kNumLevels - 1; l > level; l--) {
+    if (!v->levels_[l].empty()) {
+      deepest = l;
+      break;
+    }
+  }
+  return AdaptiveBloomBits(*options_, level, deepest);
+}
+
+int VersionSet::AdaptiveBloomBits(const Options& options, int level,
+                                  int deepest) {
+  // A filter of b bits per key lets through about exp(-b ln(2)^2) of the
+  // missing keys. The sum of those over the levels, for filters of n_i keys
+  // taking M bits, is the least when every false positive rate is
+  // proportional to n_i, which gives ln(c) below for p_i = c n_i. The
+  // levels this would give less than 1 bit get 1, and the rest is shared
+  // again among the others.
+  const double ln2_squared = std::log(2.0) * std::log(2.0);
+  double keys[config::kNumLevels];
+  bool fixed[config::kNumLevels] = {};
+  double memory = 0;
+  for (int l = 0; l <= deepest; l++) {
+    keys[l] = l == 0 ? static_cast<double>(options.write_buffer_size) *
+                           config::kL0_CompactionTrigger
+                     : MaxBytesForLevel(&options, l);
+    memory += options.bloom_bits * keys[l];
+  }
+  double bits = options.bloom_bits;
+  for (int round = 0; round <= deepest; round++) {
+    double free_memory = memory;
+    double free_keys = 0;
+    double keys_log_keys = 0;
+    for (int l = 0; l <= deepest; l++) {
+      if (fixed[l]) {
+        free_memory -= keys[l];
+      } else {
+        free_keys += keys[l];
+        keys_log_keys += keys[l] * std::log(keys[l]);
+      }
+    }
+    const double log_c = -(free_memory * ln2_squared + keys_log_keys) /
+                         free_keys;
+    bool changed = false;
+    for (int l = 0; l <= deepest; l++) {
+      if (!fixed[l] && -(log_c + std::log(keys[l])) / ln2_squared < 1) {
+        fixed[l] = true;
+        changed = true;
+      }
+    }
+    if (fixed[level]) {
+      bits = 1;
+      break;
+    }
+    bits = -(log_c + std::log(keys[level])) / ln2_squared;
+    if (!changed) {
+      break;
+    }
+  }
+  // The filter of a table has to fit its filter chunk.
+  const int rounded = static_cast<int>(std::lround(bits));
+  return std::max(1, std::min(rounded, 2 * options.bloom_bits));
+}
+
 int64_t VersionSet::MaxNextLevelOverlappingBytes() {
   int64_t result = 0;
   std::vector<std::shared_ptr<RemoteMemTableMetaData>> overlaps;
@@ -1513,9 +2370,78 @@ Iterator* VersionSet::MakeInputIterator(Compaction* c) {
   delete[] list;
   return result;
 }
+void VersionSet::GenSubcompactionBoundaries(Compaction* c, size_t ranges,
+                                            bool memory_side) {
+  // Enough keys per range that a range is cut within a sixteenth of its
+  // bytes, with all the keys in one file.
+  static const size_t kSampledKeysPerRange = 16;
+  assert(c->boundaries_.empty() && c->sizes_.empty());
+  std::vector<std::pair<Slice, uint64_t>> samples;
+  std::vector<std::string> keys;
+  std::vector<std::string> all_keys;
+  std::vector<uint64_t> weights;
+  for (int which = 0; which < 2; which++) {
+    for (const auto& f : c->inputs_[which]) {
+      keys.clear();
+      table_cache_->SampleIndexKeys(f, memory_side,
+                                    kSampledKeysPerRange * ranges, &keys);
+      for (std::string& key : keys) {
+        if (key.size() >= 8) {
+          all_keys.push_back(std::move(key));
+          weights.push_back(std::max<uint64_t>(f->file_size / keys.size(), 1));
+        }
+      }
+    }
+  }
+  if (ranges < 2 || all_keys.empty()) {
+    c->GenSubcompactionBoundaries();
+    return;
+  }
+  uint64_t total = 0;
+  for (size_t i = 0; i < all_keys.size(); i++) {
+    samples.emplace_back(ExtractUserKey(all_keys[i]), weights[i]);
+    total += weights[i];
+  }
+  const Comparator* ucmp = icmp_.user_comparator();
+  std::sort(samples.begin(), samples.end(),
+            [ucmp](const std::pair<Slice, uint64_t>& a,
+                   const std::pair<Slice, uint64_t>& b) {
+              return ucmp->Compare(a.first, b.first) < 0;
+            });
+  // A range ends before the key at which the bytes before it reach the
+  // next multiple of total / ranges. No two ranges start at the same user
+  // key.
+  c->boundary_keys_.reserve(ranges - 1);
+  uint64_t bytes = 0;
+  uint64_t range_start = 0;
+  size_t cut = 1;
+  for (const auto& sample : samples) {
+    if (cut < ranges && bytes > range_start &&
+        bytes >= total / ranges * cut &&
+        (c->boundary_keys_.empty() ||
+         ucmp->Compare(sample.first, c->boundary_keys_.back()) > 0)) {
+      c->boundary_keys_.push_back(sample.first.ToString());
+      c->sizes_.push_back(bytes - range_start);
+      range_start = bytes;
+      while (cut < ranges && bytes >= total / ranges * cut) {
+        cut++;
+      }
+    }
+    bytes += sample.second;
+  }
+  c->sizes_.push_back(total - range_start);
+  for (const std::string& key : c->boundary_keys_) {
+    c->boundaries_.emplace_back(key);
+  }
+}
 Iterator* VersionSet::MakeInputIteratorMemoryServer(Compaction* c) {
   ReadOptions options;
+#ifdef BYTEADDRESSABLE
+  // A record corrupted in the memory node is not carried into the outputs.
+  options.verify_checksums = true;
+#else
   options.verify_checksums = options_->paranoid_checks;
+#endif
   options.fill_cache = false;
 
   // Level-0 files have to be merged together.  For other levels,
@@ -1545,6 +2471,24 @@ Iterator* VersionSet::MakeInputIteratorMemoryServer(Compaction* c) {
   delete[] list;
   return result;
 }
+Iterator* VersionSet::MakeScanIteratorMemoryServer(
+    std::vector<std::shared_ptr<RemoteMemTableMetaData>>* files) {
+  ReadOptions options;
+  options.verify_checksums = options_->paranoid_checks;
+  options.fill_cache = false;
+  std::vector<Iterator*> list;
+  for (const auto& f : files[0]) {
+    list.push_back(table_cache_->NewIterator_MemorySide(options, f));
+  }
+  for (int level = 1; level < config::kNumLevels; level++) {
+    if (!files[level].empty()) {
+      list.push_back(NewTwoLevelFileIterator(
+          new Version::LevelFileNumIterator(icmp_, &files[level]),
+          &GetFileIterator_Memoryside, table_cache_, options));
+    }
+  }
+  return NewMergingIterator(&icmp_, list.data(), list.size());
+}
 //Iterator* VersionSet::NewIterator(std::shared_ptr<RemoteMemTableMetaData> f) {
 //  Cache::Handle* handle = nullptr;
 //  Status s = FindTable(std::move(remote_table), &handle);
@@ -1657,6 +2601,17 @@ bool VersionSet::PickFileToCompact(int level, Compaction* c){
   }else {
     size_t current_level_size = current_->levels_[level].size();
     size_t random_index = std::rand() % current_level_size;
+    if (options_->tombstone_compaction_ratio > 0) {
+      // The table with the most deletions goes first, if it has enough.
+      double most = options_->tombstone_compaction_ratio;
+      for (size_t i = 0; i < current_level_size; i++) {
+        const auto& f = current_->levels_[level][i];
+        if (!f->UnderCompaction && DeletionRatio(*f) >= most) {
+          most = DeletionRatio(*f);
+          random_index = i;
+        }
+      }
+    }
     InternalKey smallest, largest;
     auto user_cmp = icmp_.user_comparator();
     int counter = 0;
@@ -1731,6 +2686,37 @@ bool VersionSet::PickFileToCompact(int level, Compaction* c){
   return !c->inputs_[0].empty();
 
 }
+bool VersionSet::PickLevelToCompact(int level, Compaction* c) {
+  assert(c->inputs_[0].empty());
+  assert(c->inputs_[1].empty());
+  assert(level > 0);
+  if (!current_->in_progress[level].empty() ||
+      current_->levels_[level].empty()) {
+    return false;
+  }
+  c->inputs_[0] = current_->levels_[level];
+  InternalKey smallest, largest;
+  GetRange(c->inputs_[0], &smallest, &largest);
+  if (!current_->GetOverlappingInputs(level + 1, &smallest, &largest,
+                                      &c->inputs_[1])) {
+    c->inputs_[0].clear();
+    c->inputs_[1].clear();
+    return false;
+  }
+  for (auto iter : c->inputs_[0]) {
+    iter->UnderCompaction = true;
+  }
+  current_->in_progress[level].insert(current_->in_progress[level].end(),
+                                      c->inputs_[0].begin(),
+                                      c->inputs_[0].end());
+  for (auto iter : c->inputs_[1]) {
+    iter->UnderCompaction = true;
+  }
+  current_->in_progress[level + 1].insert(
+      current_->in_progress[level + 1].end(), c->inputs_[1].begin(),
+      c->inputs_[1].end());
+  return true;
+}
 Compaction* VersionSet::PickCompaction() {
 
   Compaction* c;
@@ -1744,6 +2730,13 @@ Compaction* VersionSet::PickCompaction() {
   //TODO: may be we can create a verion for current_, and only use a read lock
   // when fetch the current from the list.
   std::unique_lock<std::mutex> lck(*sv_mtx);
+  if (options_->compaction_style == kCompactionStyleFIFO) {
+    // The due tables are dropped rather than compacted, and the reads in
+    // vain pay nothing.
+    current_->file_to_compact_level_.store(-1, std::memory_order_release);
+    delete c;
+    return nullptr;
+  }
 
   for (int i = 0; i < config::kNumLevels - 1; i++) {
     level = current_->CompactionLevel(i);
@@ -1757,7 +2750,13 @@ Compaction* VersionSet::PickCompaction() {
         // may starve.
         continue;
       }
-      if (PickFileToCompact(level,c)) {
+      bool picked;
+      if (level > 0 && options_->compaction_style == kCompactionStyleTiered) {
+        picked = PickLevelToCompact(level, c);
+      } else {
+        picked = PickFileToCompact(level, c);
+      }
+      if (picked) {
         assert(c->level() == level && level < 10);
 #ifndef NDEBUG
         for (auto iter : c->inputs_[0]) {
@@ -1778,9 +2777,17 @@ Compaction* VersionSet::PickCompaction() {
       break;
     }
   }
+  if (c->inputs_[0].empty() &&
+      current_->file_to_compact_level_.load(std::memory_order_acquire) >= 0) {
+    // No level is too large, the reads in vain may still pay a compaction.
+    PickSeekFileToCompact(c);
+  }
   if (!c->inputs_[0].empty()) {
+    SetupGrandparents(c);
+    SetupOutputs(c);
     c->input_version_ = current_;
     c->input_version_->Ref(2);
+    c->range_tombstones_ = current_->range_tombstones_;
     //Recalculate the scores so that next time pick from a different level.
     Finalize(current_);
 //    if (c->inputs_[1].size() == 1){
@@ -1897,6 +2904,104 @@ void AddBoundaryInputs(const InternalKeyComparator& icmp,
   }
 }
 
+// Compute the set of grandparent files that overlap this compaction
+// (parent == level+1; grandparent == level+2). The ones under compaction
+// count as well, they only bound the outputs.
+void VersionSet::SetupGrandparents(Compaction* c) {
+  c->grandparents_.clear();
+  c->grandparent_bounds_.clear();
+  const int level = c->level();
+  if (level + 2 >= config::kNumLevels) {
+    return;
+  }
+  InternalKey all_start, all_limit;
+  GetRange2(c->inputs_[0], c->inputs_[1], &all_start, &all_limit);
+  const Comparator* user_cmp = icmp_.user_comparator();
+  for (const auto& f : current_->levels_[level + 2]) {
+    if (user_cmp->Compare(f->largest.user_key(), all_start.user_key()) < 0 ||
+        user_cmp->Compare(f->smallest.user_key(), all_limit.user_key()) > 0) {
+      continue;
+    }
+    c->grandparents_.push_back(f);
+    c->grandparent_bounds_.emplace_back(f->largest, f->file_size);
+  }
+}
+
+void VersionSet::KeepUntouchedFiles(Compaction* c) {
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>>& files = c->inputs_[1];
+  if (c->inputs_[0].empty() || files.empty()) {
+    return;
+  }
+  ReadOptions options;
+  options.verify_checksums = options_->paranoid_checks;
+  options.fill_cache = false;
+  std::vector<Iterator*> list;
+  for (const auto& f : c->inputs_[0]) {
+    list.push_back(table_cache_->NewIterator(options, f));
+  }
+  Iterator* first_level =
+      NewMergingIterator(&icmp_, list.data(), static_cast<int>(list.size()));
+  const Comparator* user_cmp = icmp_.user_comparator();
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> merged;
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> kept;
+  for (size_t i = 0; i < files.size(); i++) {
+    const auto& f = files[i];
+    // A user key split across two files is merged as a whole.
+    bool untouched =
+        (i == 0 || user_cmp->Compare(files[i - 1]->largest.user_key(),
+                                     f->smallest.user_key()) != 0) &&
+        (i + 1 == files.size() ||
+         user_cmp->Compare(f->largest.user_key(),
+                           files[i + 1]->smallest.user_key()) != 0);
+    if (untouched) {
+      InternalKey target(f->smallest.user_key(), kMaxSequenceNumber,
+                         kValueTypeForSeek);
+      first_level->Seek(target.Encode());
+      untouched = first_level->status().ok() &&
+                  (!first_level->Valid() ||
+                   user_cmp->Compare(ExtractUserKey(first_level->key()),
+                                     f->largest.user_key()) > 0);
+    }
+    (untouched ? kept : merged).push_back(f);
+  }
+  delete first_level;
+  if (kept.empty()) {
+    return;
+  }
+  std::unique_lock<std::mutex> lck(*sv_mtx);
+  files = merged;
+  auto& in_progress = current_->in_progress[c->level() + 1];
+  // Far more than MaxGrandParentOverlapBytes() on either node, without
+  // overflowing the sum.
+  const uint64_t kKeptFileBytes = 1ull << 48;
+  for (const auto& f : kept) {
+    f->UnderCompaction = false;
+    in_progress.erase(std::remove(in_progress.begin(), in_progress.end(), f),
+                      in_progress.end());
+    c->grandparent_bounds_.emplace_back(f->largest, kKeptFileBytes);
+  }
+  std::sort(c->grandparent_bounds_.begin(), c->grandparent_bounds_.end(),
+            [this](const std::pair<InternalKey, uint64_t>& a,
+                   const std::pair<InternalKey, uint64_t>& b) {
+              return icmp_.Compare(a.first, b.first) < 0;
+            });
+  // The files left out may be picked by the next compaction.
+  Finalize(current_);
+}
+
+void VersionSet::SetupOutputs(Compaction* c) {
+  const int level = c->level();
+  c->bloom_bits_ = BloomBitsForLevel(level + 1);
+  InternalKey all_start, all_limit;
+  GetRange2(c->inputs_[0], c->inputs_[1], &all_start, &all_limit);
+  const Slice smallest = all_start.user_key();
+  const Slice largest = all_limit.user_key();
+  c->bottommost_ = true;
+  for (int l = level + 2; l < config::kNumLevels && c->bottommost_; l++) {
+    c->bottommost_ = !current_->OverlapInLevel(l, &smallest, &largest);
+  }
+}
+
 void VersionSet::SetupOtherInputs(Compaction* c) {
   const int level = c->level();
   InternalKey smallest, largest;
@@ -1943,12 +3048,8 @@ void VersionSet::SetupOtherInputs(Compaction* c) {
     }
   }
 
-  // Compute the set of grandparent files that overlap this compaction
-  // (parent == level+1; grandparent == level+2)
-  if (level + 2 < config::kNumLevels) {
-    current_->GetOverlappingInputs(level + 2, &all_start, &all_limit,
-                                   &c->grandparents_);
-  }
+  SetupGrandparents(c);
+  SetupOutputs(c);
 
   // Update the place where we will do the next compaction for this level.
   // We update this immediately instead of waiting for the VersionEdit
@@ -1958,6 +3059,53 @@ void VersionSet::SetupOtherInputs(Compaction* c) {
   c->edit_.SetCompactPointer(level, largest);
 }
 
+bool VersionSet::PickSeekFileToCompact(Compaction* c) {
+  const int level =
+      current_->file_to_compact_level_.load(std::memory_order_acquire);
+  std::shared_ptr<RemoteMemTableMetaData> f = current_->file_to_compact_;
+  // Tried once, a file it cannot take now is marked again in a later
+  // version.
+  current_->file_to_compact_level_.store(-1, std::memory_order_relaxed);
+  if (level + 1 >= config::kNumLevels) {
+    return false;
+  }
+  c->SetLevel(level);
+  if (level == 0) {
+    return PickFileToCompact(level, c);
+  }
+  if (options_->compaction_style == kCompactionStyleTiered) {
+    return PickLevelToCompact(level, c);
+  }
+  if (f->UnderCompaction) {
+    return false;
+  }
+  c->inputs_[0].push_back(f);
+  AddBoundaryInputs(icmp_, current_->levels_[level], &c->inputs_[0]);
+  for (const auto& input : c->inputs_[0]) {
+    if (input->UnderCompaction) {
+      c->inputs_[0].clear();
+      return false;
+    }
+  }
+  InternalKey smallest, largest;
+  GetRange(c->inputs_[0], &smallest, &largest);
+  if (!current_->GetOverlappingInputs(level + 1, &smallest, &largest,
+                                      &c->inputs_[1])) {
+    c->inputs_[0].clear();
+    c->inputs_[1].clear();
+    return false;
+  }
+  for (int which = 0; which < 2; which++) {
+    for (const auto& input : c->inputs_[which]) {
+      input->UnderCompaction = true;
+    }
+    current_->in_progress[level + which].insert(
+        current_->in_progress[level + which].end(), c->inputs_[which].begin(),
+        c->inputs_[which].end());
+  }
+  return true;
+}
+
 Compaction* VersionSet::CompactRange(int level, const InternalKey* begin,
                                      const InternalKey* end) {
   std::vector<std::shared_ptr<RemoteMemTableMetaData>> inputs;
@@ -1986,6 +3134,7 @@ Compaction* VersionSet::CompactRange(int level, const InternalKey* begin,
   Compaction* c = new Compaction(options_, level);
   c->input_version_ = current_;
   c->input_version_->Ref(0);
+  c->range_tombstones_ = current_->range_tombstones_;
   c->inputs_[0] = inputs;
   SetupOtherInputs(c);
   return c;
@@ -1997,10 +3146,10 @@ Compaction::Compaction(const Options* options, int level)
       opt_ptr(options),
       max_output_file_size_(MaxFileSizeForLevel(options, level)),
       input_version_(nullptr),
+      edit_(0),
       grandparent_index_(0),
       seen_key_(false),
-      overlapped_bytes_(0),
-      edit_(0) {
+      overlapped_bytes_(0) {
   for (int i = 0; i < config::kNumLevels; i++) {
     level_ptrs_[i] = 0;
   }
@@ -2009,10 +3158,10 @@ Compaction::Compaction(const Options* options, int level)
 Compaction::Compaction(const Options* options)
     : opt_ptr(options),
       input_version_(nullptr),
+      edit_(0),
       grandparent_index_(0),
       seen_key_(false),
-      overlapped_bytes_(0),
-      edit_(0) {
+      overlapped_bytes_(0) {
   for (int i = 0; i < config::kNumLevels; i++) {
     level_ptrs_[i] = 0;
   }
@@ -2032,9 +3181,11 @@ bool Compaction::IsTrivialMove() const {
   // Avoid a move if there is lots of overlapping grandparent data.
   // Otherwise, the move could create a parent file that will require
   // a very expensive merge later on.
+  // The file would overlap the files of the next level left in place.
   return (num_input_files(0) == 1 && num_input_files(1) == 0 &&
+          grandparent_bounds_.size() == grandparents_.size() &&
           TotalFileSize(grandparents_) <=
-              MaxGrandParentOverlapBytes(vset->options_));
+              MaxGrandParentOverlapBytes(vset->options_, level_));
 }
 
 void Compaction::AddInputDeletions(VersionEdit* edit) {
@@ -2064,7 +3215,27 @@ void Compaction::DecodeFrom(const Slice src, int side) {
     f->DecodeFrom(input);
     inputs_[1].push_back(f);
   }
+  range_tombstones_.DecodeFrom(&input);
+  uint32_t grandparent_len = 0;
+  GetFixed32(&input, &grandparent_len);
+  for (size_t i = 0; i < grandparent_len; i++) {
+    Slice largest;
+    uint64_t file_size = 0;
+    GetLengthPrefixedSlice(&input, &largest);
+    GetFixed64(&input, &file_size);
+    grandparent_bounds_.emplace_back(InternalKey(), file_size);
+    grandparent_bounds_.back().first.DecodeFrom(largest);
+  }
   max_output_file_size_ = MaxFileSizeForLevel(opt_ptr, level);
+  // The bits are sent one up, -1 becomes 0.
+  uint32_t bloom_bits = 0;
+  GetVarint32(&input, &bloom_bits);
+  bloom_bits_ = static_cast<int>(bloom_bits) - 1;
+  bottommost_ = !input.empty() && input[0] != 0;
+  if (!input.empty()) {
+    input.remove_prefix(1);
+  }
+  GetVarint64(&input, &smallest_snapshot_);
 }
 void Compaction::EncodeTo(std::string* dst){
   uint16_t level = level_;
@@ -2089,6 +3260,15 @@ void Compaction::EncodeTo(std::string* dst){
     f->EncodeTo(dst);
 
   }
+  range_tombstones_.EncodeTo(dst);
+  PutFixed32(dst, grandparent_bounds_.size());
+  for (const auto& bound : grandparent_bounds_) {
+    PutLengthPrefixedSlice(dst, bound.first.Encode());
+    PutFixed64(dst, bound.second);
+  }
+  PutVarint32(dst, static_cast<uint32_t>(bloom_bits_ + 1));
+  dst->push_back(bottommost_ ? 1 : 0);
+  PutVarint64(dst, smallest_snapshot_);
 }
 bool Compaction::IsBaseLevelForKey(const Slice& user_key) {
   // Maybe use binary search to find right entry instead of linear search?
@@ -2110,25 +3290,32 @@ bool Compaction::IsBaseLevelForKey(const Slice& user_key) {
   }
   return true;
 }
-//Note do not use it if it is a near data compaction.
 bool Compaction::ShouldStopBefore(const Slice& internal_key) {
-  const VersionSet* vset = input_version_->vset_;
+  return ShouldStopBefore(internal_key, &grandparent_index_, &seen_key_,
+                          &overlapped_bytes_);
+}
+
+bool Compaction::ShouldStopBefore(const Slice& internal_key,
+                                  size_t* grandparent_index, bool* seen_key,
+                                  uint64_t* overlapped_bytes) {
+  // The options of both nodes compare internal keys.
+  const Comparator* icmp = opt_ptr->comparator;
   // Scan to find earliest grandparent file that contains key.
-  const InternalKeyComparator* icmp = &vset->icmp_;
-  while (grandparent_index_ < grandparents_.size() &&
+  while (*grandparent_index < grandparent_bounds_.size() &&
          icmp->Compare(internal_key,
-                       grandparents_[grandparent_index_]->largest.Encode()) >
+                       grandparent_bounds_[*grandparent_index].first.Encode()) >
              0) {
-    if (seen_key_) {
-      overlapped_bytes_ += grandparents_[grandparent_index_]->file_size;
+    if (*seen_key) {
+      *overlapped_bytes += grandparent_bounds_[*grandparent_index].second;
     }
-    grandparent_index_++;
+    (*grandparent_index)++;
   }
-  seen_key_ = true;
+  *seen_key = true;
 
-  if (overlapped_bytes_ > MaxGrandParentOverlapBytes(vset->options_)) {
+  if (*overlapped_bytes >
+      static_cast<uint64_t>(MaxGrandParentOverlapBytes(opt_ptr, level_))) {
     // Too much overlap for current output; start new output
-    overlapped_bytes_ = 0;
+    *overlapped_bytes = 0;
     return true;
   } else {
     return false;
@@ -2141,6 +3328,13 @@ uint64_t Compaction::FirstLevelSize(){
   }
   return sum_size;
 }
+uint64_t Compaction::JobId() const {
+  std::pair<uint64_t, uint8_t> first(UINT64_MAX, UINT8_MAX);
+  for (auto& file : inputs_[0]) {
+    first = std::min(first, std::make_pair(file->number, file->creator_node_id));
+  }
+  return inputs_[0].empty() ? 0 : TimelineJobId(first.first, first.second);
+}
 void Compaction::ReleaseInputs() {
   if (input_version_ != nullptr) {
     input_version_->Unref(2);
@@ -2153,8 +3347,8 @@ void Compaction::GenSubcompactionBoundaries() {
   // by search the key of the same userkey to the startdata, but has a higher sequence number
   std::vector<Slice>& bounds = boundaries_;
   std::vector<uint64_t>& sizes = sizes_;
-  //TODO: for the first time level 0 compaction, we do not have level 1 files, so
-  // we could use the data block index to find out the boundaries.
+  // VersionSet::GenSubcompactionBoundaries() cuts at keys sampled from the
+  // indexes instead, this is its fallback.
 
 //  //insert base level
 //  {
@@ -15,13 +15,17 @@
 #ifndef STORAGE_dLSM_DB_VERSION_SET_H_
 #define STORAGE_dLSM_DB_VERSION_SET_H_
 
+#include "db/blob.h"
 #include "db/dbformat.h"
 #include "db/version_edit.h"
+#include <algorithm>
 #include <atomic>
 #include <map>
 #include <set>
+#include <string>
 #include <vector>
 
+#include "dLSM/env.h"
 #include "port/port.h"
 #include "port/thread_annotations.h"
 
@@ -32,9 +36,11 @@ class Writer;
 }
 
 class Compaction;
+class EditPublisher;
  class FlushJob;
 class Iterator;
 class MemTable;
+class MergeContext;
 class TableBuilder_ComputeSide;
 class TableCache;
 class Version;
@@ -47,27 +53,82 @@ enum SaverState {
   kFound,
   kDeleted,
   kCorrupt,
+  // A merge operand, the entries of the key below it are needed too.
+  kMerge,
 };
 struct Saver {
   SaverState state = kNotFound;// set as not found as default value.
   const Comparator* ucmp;
   Slice user_key;
   std::string* value;
+  // If not null, the value is not copied to *value but referred to by
+  // pinned_value, and pinned later through the cleanups of the lookup.
+  PinnableSlice* pinnable = nullptr;
+  Slice pinned_value;
+  // The value was read from a blob chunk into the pinnable, which holds it
+  // rather than pinning the block.
+  bool blob = false;
+  // If not null, a value in blob chunks is not read, its BlobIndex is
+  // stored here and *value left empty.
+  std::string* blob_index = nullptr;
+  // If not null, the values these tombstones delete at snapshot are
+  // reported as deleted.
+  const RangeTombstones* range_tombstones = nullptr;
+  SequenceNumber snapshot = kMaxSequenceNumber;
+  // Set once the table handed an entry of a data block it read, that is
+  // its filter did not rule the key out.
+  bool read_block = false;
 };
 }  // namespace
 // Callback from TableCache::Get()
 
 static void SaveValue(void* arg, const Slice& ikey, const Slice& v) {
   Saver* s = reinterpret_cast<Saver*>(arg);
+  s->read_block = true;
   ParsedInternalKey parsed_key;
   if (!ParseInternalKey(ikey, &parsed_key)) {
     // TOTHINK: may be the parse internal key is too slow?
     s->state = kCorrupt;
   } else {
     if (s->ucmp->Compare(parsed_key.user_key, s->user_key) == 0) {// if found mark as kFound
-      s->state = (parsed_key.type == kTypeValue) ? kFound : kDeleted;
-      if (s->state == kFound) {
-        s->value->assign(v.data(), v.size());
+      switch (parsed_key.type) {
+        case kTypeValue:
+        case kTypeBlobIndex:
+          s->state = kFound;
+          break;
+        case kTypeMerge:
+          s->state = kMerge;
+          break;
+        default:
+          s->state = kDeleted;
+          break;
+      }
+      if (s->state != kDeleted && s->range_tombstones != nullptr &&
+          s->range_tombstones->ShouldDelete(s->ucmp, parsed_key.user_key,
+                                            parsed_key.sequence,
+                                            s->snapshot)) {
+        s->state = kDeleted;
+      }
+      s->blob = false;
+      if (s->state == kFound && parsed_key.type == kTypeBlobIndex &&
+          s->blob_index != nullptr) {
+        s->blob_index->assign(v.data(), v.size());
+        s->value->clear();
+      } else if (s->state == kFound && parsed_key.type == kTypeBlobIndex) {
+        std::string* dst =
+            s->pinnable != nullptr ? s->pinnable->GetSelf() : s->value;
+        if (!ReadBlob(Env::Default()->rdma_mg.get(), v, dst).ok()) {
+          s->state = kCorrupt;
+        } else if (s->pinnable != nullptr) {
+          s->pinned_value = *dst;
+          s->blob = true;
+        }
+      } else if (s->state == kFound) {
+        if (s->pinnable != nullptr) {
+          s->pinned_value = v;
+        } else {
+          s->value->assign(v.data(), v.size());
+        }
       }
     }
   }
@@ -107,6 +168,39 @@ class Level_Info{
 //  size_t version_id_;
 //  std::shared_ptr<RDMA_Manager> rdma_mg_;
 //};
+// The files of a level of a Version, in the order of their smallest keys.
+// An edit leaves most of the levels as they were, the Version built from it
+// shares the array of those with the one before rather than copying it.
+class LevelFiles {
+ public:
+  typedef std::vector<std::shared_ptr<RemoteMemTableMetaData>> Files;
+  typedef Files::const_iterator const_iterator;
+
+  LevelFiles() : files_(std::make_shared<const Files>()) {}
+
+  const Files& files() const { return *files_; }
+  operator const Files&() const { return *files_; }
+  size_t size() const { return files_->size(); }
+  bool empty() const { return files_->empty(); }
+  const std::shared_ptr<RemoteMemTableMetaData>& operator[](size_t i) const {
+    return (*files_)[i];
+  }
+  const std::shared_ptr<RemoteMemTableMetaData>& front() const {
+    return files_->front();
+  }
+  const std::shared_ptr<RemoteMemTableMetaData>& back() const {
+    return files_->back();
+  }
+  const_iterator begin() const { return files_->begin(); }
+  const_iterator end() const { return files_->end(); }
+
+  void Reset(Files&& files) {
+    files_ = std::make_shared<const Files>(std::move(files));
+  }
+
+ private:
+  std::shared_ptr<const Files> files_;
+};
 class Version {
  public:
 //  Version(const std::shared_ptr<Subversion>& sub_version);
@@ -116,24 +210,63 @@ class Version {
   struct GetStats {
     std::shared_ptr<RemoteMemTableMetaData> seek_file;
     int seek_file_level;
+    // The file which has the entry of the key, if any.
+    std::shared_ptr<RemoteMemTableMetaData> read_file;
+    // If not null, the files which read a data block, their filters passed,
+    // but did not have the key are appended to it.
+    std::vector<std::shared_ptr<RemoteMemTableMetaData>>* missed_files =
+        nullptr;
+    // If not null, a value kept in blob chunks is not read: its BlobIndex
+    // is stored in *blob_index, which is left empty otherwise, and the
+    // value is empty. Not for a pinned value nor a lookup which met merge
+    // operands, those read the value.
+    std::string* blob_index = nullptr;
   };
 //  std::shared_ptr<Subversion> subversion;
 
   // Append to *iters a sequence of iterators that will
   // yield the contents of this Version when merged together.
+  // Unless they are nullptr, the range of the internal keys of every
+  // iterator is appended to *smallest and *largest, for NewMergingIterator.
   // REQUIRES: This version has been saved (see VersionSet::SaveTo)
-  void AddIterators(const ReadOptions&, std::vector<Iterator*>* iters);
+  void AddIterators(const ReadOptions&, std::vector<Iterator*>* iters,
+                    std::vector<Slice>* smallest = nullptr,
+                    std::vector<Slice>* largest = nullptr);
 #ifdef BYTEADDRESSABLE
-  void AddSEQIterators(const ReadOptions&, std::vector<Iterator*>* iters);
+  void AddSEQIterators(const ReadOptions&, std::vector<Iterator*>* iters,
+                       std::vector<Slice>* smallest = nullptr,
+                       std::vector<Slice>* largest = nullptr);
 #endif
+  // The merge operands met before the value or the deletion of the key are
+  // added to *merge_context, which the caller applies.
   Status Get(const ReadOptions&, const LookupKey& key, std::string* val,
-             GetStats* stats);
+             GetStats* stats, MergeContext* merge_context);
+  // Same as above, but *val refers to the value in its data block and
+  // keeps the block alive until it is reset.
+  Status Get(const ReadOptions&, const LookupKey& key, PinnableSlice* val,
+             GetStats* stats, MergeContext* merge_context);
+  // Look up all the "keys" in this version, store the results in *values
+  // and *statuses with the same meaning as Get(). The lookups of all the
+  // keys proceed level by level, and the remote reads of each step are
+  // batched into one RDMA submission per memory node. The keys which meet
+  // merge operands are looked up again one by one and their operands
+  // applied.
+  void MultiGet(const ReadOptions&, const std::vector<const LookupKey*>& keys,
+                const std::vector<std::string*>& values,
+                const std::vector<Status*>& statuses);
 
   // Adds "stats" into the current state.  Returns true if a new
   // compaction may need to be triggered, false otherwise.
   // REQUIRES: lock is held
   bool UpdateStats(const GetStats& stats);
 
+  // Charge "seeks" reads in vain to "f", a file of this version. Once its
+  // allowed seeks run out it is marked for a compaction, see
+  // VersionSet::PickCompaction(), and true is returned. Safe to call from
+  // concurrent readers.
+  bool ChargeSeeks(const std::shared_ptr<RemoteMemTableMetaData>& f,
+                   int64_t seeks);
+
   // Record a sample of bytes read at the specified internal key.
   // Samples are taken approximately once every config::kReadBytesPeriod
   // bytes.  Returns true if a new compaction may need to be triggered.
@@ -166,6 +299,10 @@ class Version {
                                  const Slice& largest_user_key);
 
   int NumFiles(int level) const { return levels_[level].size(); }
+  const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& files(
+      int level) const {
+    return levels_[level].files();
+  }
 
   // Return a human readable string that describes this version's contents.
   std::string DebugString() const;
@@ -178,15 +315,21 @@ class Version {
    public:
     LevelFileNumIterator(const InternalKeyComparator& icmp,
                          const std::vector<std::shared_ptr<RemoteMemTableMetaData>>* flist)
-        : icmp_(icmp), flist_(flist), index_(flist->size()) {  // Marks as invalid
+        : icmp_(icmp), flist_(flist), index_(flist->size()),  // Marks as invalid
+          begin_(0), end_(flist->size()) {
     }
-    bool Valid() const override { return index_ < flist_->size(); }
+    // Only the files overlapping the bounds of "options", see
+    // ReadOptions::iterate_lower_bound.
+    LevelFileNumIterator(const InternalKeyComparator& icmp,
+                         const std::vector<std::shared_ptr<RemoteMemTableMetaData>>* flist,
+                         const ReadOptions& options);
+    bool Valid() const override { return index_ >= begin_ && index_ < end_; }
     void Seek(const Slice& target) override {
-      index_ = FindFile(icmp_, *flist_, target);
+      index_ = std::max<uint32_t>(FindFile(icmp_, *flist_, target), begin_);
     }
-    void SeekToFirst() override { index_ = 0; }
+    void SeekToFirst() override { index_ = begin_; }
     void SeekToLast() override {
-      index_ = flist_->empty() ? 0 : flist_->size() - 1;
+      index_ = end_ > begin_ ? end_ - 1 : flist_->size();
     }
     void Next() override {
       assert(Valid());
@@ -194,7 +337,7 @@ class Version {
     }
     void Prev() override {
       assert(Valid());
-      if (index_ == 0) {
+      if (index_ == begin_) {
         index_ = flist_->size();  // Marks as invalid
       } else {
         index_--;
@@ -219,6 +362,9 @@ class Version {
     const InternalKeyComparator icmp_;
     const std::vector<std::shared_ptr<RemoteMemTableMetaData>>* const flist_;
     uint32_t index_;
+    // The files within the bounds.
+    uint32_t begin_;
+    uint32_t end_;
 
     // Backing store for value().  Holds the file number and size.
     mutable char value_buf_[16];
@@ -231,6 +377,8 @@ class Version {
     }
   }
   std::shared_ptr<RemoteMemTableMetaData> FindFileByNumber(int level, uint64_t file_number, uint8_t node_id);
+  // The tombstones of DB::DeleteRange() which may still delete some data.
+  const RangeTombstones& range_tombstones() const { return range_tombstones_; }
  private:
   friend class Compaction;
   friend class VersionSet;
@@ -243,7 +391,8 @@ class Version {
         prev_(this),
         refs_(0),
         file_to_compact_(nullptr),
-        file_to_compact_level_(-1){}
+        file_to_compact_level_(-1),
+        file_to_compact_marked_(false){}
 
   Version(const Version&) = delete;
   Version& operator=(const Version&) = delete;
@@ -251,9 +400,24 @@ class Version {
   ~Version();
 
   Iterator* NewConcatenatingIterator(const ReadOptions&, int level) const;
+  // Get() into *val, or pinned into *pinnable if it is not null.
+  Status GetImpl(const ReadOptions&, const LookupKey& key, std::string* val,
+                 PinnableSlice* pinnable, GetStats* stats,
+                 MergeContext* merge_context);
+  // Get() for ReadOptions::parallel_probe. The lookups which meet a merge
+  // operand fall back to the file by file one.
+  Status ParallelGet(const ReadOptions&, const LookupKey& key,
+                     std::string* val, GetStats* stats,
+                     MergeContext* merge_context);
 #ifdef BYTEADDRESSABLE
   Iterator* NewConcatenatingSEQIterator(const ReadOptions&, int level) const;
 #endif
+  // FindFile() over levels_[level], level >= 1, through the fences of the
+  // level if there are.
+  uint32_t FindFileInLevel(int level, const Slice& internal_key) const;
+  // Build the fences of levels 1 and up, see LevelFence.
+  void BuildFences();
+
   // Call func(arg, level, f) for every file that overlaps user_key in
   // order from newest to oldest.  If an invocation of func returns
   // false, makes no more calls.
@@ -268,18 +432,43 @@ class Version {
   std::atomic<int> refs_;          // Number of live refs to this version
 
   // List of files per level
-  std::vector<std::shared_ptr<RemoteMemTableMetaData>> levels_[config::kNumLevels];
+  LevelFiles levels_[config::kNumLevels];
   std::vector<std::shared_ptr<RemoteMemTableMetaData>> in_progress[config::kNumLevels];
+  RangeTombstones range_tombstones_;
+
+  // The largest keys of the files of a level as integers in two contiguous
+  // arrays, so that a lookup compares integers on a few cache lines rather
+  // than the keys behind the file pointers: keys[i] is the projection of
+  // the user key of files[i]->largest to the 8 bytes which follow the prefix
+  // shared by all the keys of the level, and top[g] is the last of the
+  // kFenceFanout keys of group g. A projection is only a prefix of the key,
+  // the files whose projection equals the one of the target are told apart
+  // with the comparator. Built for the bytewise comparator only.
+  struct LevelFence {
+    std::string prefix;
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> top;
+  };
+  static constexpr size_t kFenceFanout = 16;
+  // Shared with the Version before, like the files, if the level is the
+  // same. Null for the empty levels.
+  std::shared_ptr<const LevelFence> fences_[config::kNumLevels];
+  bool has_fences_ = false;
 //  double score[config::kNumLevels];
-  // Next file to compact based on seek stats.
+  // Next file to compact based on seek stats. The level is published after
+  // the file, -1 if there is none, and the file is marked once per version.
   std::shared_ptr<RemoteMemTableMetaData> file_to_compact_;
-  int file_to_compact_level_;
+  std::atomic<int> file_to_compact_level_;
+  std::atomic<bool> file_to_compact_marked_;
 
   // Level that should be compacted next and its compaction score.
   // Score < 1 means compaction is not strictly needed.  These fields
   // are initialized by Finalize().
   std::array<double, config::kNumLevels - 1> compaction_score_;
   std::array<int, config::kNumLevels - 1> compaction_level_;
+  // The bytes the compactions are estimated to write before every level is
+  // within its target size, set by Finalize().
+  uint64_t pending_compaction_bytes_ = 0;
 #ifndef NDENUG
   std::vector<int> ref_mark_collection;
   std::vector<int> unref_mark_collection;
@@ -310,8 +499,11 @@ class VersionSet {
 
 #endif
 #ifdef WITHPERSISTENCE
-  void Persistency_pin(VersionEdit* edit);
-  void Persistency_unpin(uint64_t* array, size_t size);
+  // Pin the new files of an edit about to be sent to the memory node until
+  // the memory node has persisted it, and return the epoch of the edit.
+  uint64_t Persistency_pin(VersionEdit* edit);
+  // Drop the pins of all the edits up to the epoch "persisted_epoch".
+  void Persistency_unpin(uint64_t persisted_epoch);
 #endif
   // Apply *edit to the current version to form a new descriptor that
   // is both saved to persistent state and installed as the new
@@ -320,6 +512,11 @@ class VersionSet {
   // REQUIRES: no other thread concurrently calls LogAndApply()
   //TODO: Finalize is not required for the comppute node side.
   Status LogAndApply(VersionEdit* edit);
+  // Publish every edit LogAndApply() applies from now on to the read
+  // replicas of the shard. "publisher" outlives its use here.
+  void SetEditPublisher(EditPublisher* publisher) {
+    edit_publisher_ = publisher;
+  }
 
 
   // Recover the last saved descriptor from persistent storage.
@@ -347,14 +544,32 @@ class VersionSet {
   // Return the number of Table files at the specified level.
   int NumLevelFiles(int level) const;
 
+  // The level 0 files the writes stall on. None with kCompactionStyleFIFO,
+  // whose level 0 is bounded by Options::fifo_max_table_files_size.
+  int NumStallFiles() const;
+
   // Return the combined file size of all files at the specified level.
   int64_t NumLevelBytes(int level) const;
 
+  // The bytes the compactions of the current version are estimated to
+  // write before every level is within its target size.
+  uint64_t PendingCompactionBytes() const;
+
+  // The bits per key of the filters of the tables written to "level", see
+  // Options::bloom_bits_per_level and Options::adaptive_bloom_bits.
+  int BloomBitsForLevel(int level) const;
+  // The bits per key of the filters of "level" which minimize the expected
+  // false positives per missing key over the levels down to "deepest", with
+  // as much filter memory as options.bloom_bits bits per key everywhere.
+  static int AdaptiveBloomBits(const Options& options, int level,
+                               int deepest);
+
   // Return the last sequence number.
   uint64_t LastSequence() const { return last_sequence_.load(); }
   uint64_t LastSequence_nonatomic() const { return last_sequence_; }
+  // Reserve a contiguous range of n sequence numbers and return the first one.
   uint64_t AssignSequnceNumbers(size_t n){
-    assert(n == 1);
+    assert(n >= 1);
     return last_sequence_.fetch_add(n);
   }
 
@@ -379,12 +594,26 @@ class VersionSet {
   uint64_t PrevLogNumber() const { return prev_log_number_; }
 //  static bool check_compaction_state(std::shared_ptr<RemoteMemTableMetaData> sst);
   bool PickFileToCompact(int level, Compaction* c);
+  // With kCompactionStyleTiered, pick all the files of level, which is at
+  // least 1, and the files of level + 1 they overlap.
+  bool PickLevelToCompact(int level, Compaction* c);
+  // The options of the outputs of "c", which depend on the current version
+  // rather than on its inputs only, see Compaction::BloomBits().
+  void SetupOutputs(Compaction* c);
+  // Pick the file the reads marked for a compaction, see
+  // Version::ChargeSeeks(), and the files of the next level it overlaps.
+  bool PickSeekFileToCompact(Compaction* c);
   // Pick level and mem_vec for a new compaction.
   // Returns nullptr if there is no compaction to be done.
   // Otherwise returns a pointer to a heap-allocated object that
   // describes the compaction.  Caller should delete the result.
   Compaction* PickCompaction();
 
+  // Leave out of "c" the files of the output level which hold no key of the
+  // first level of it, so that they stay where they are instead of being
+  // read and written again. The outputs are cut around them.
+  void KeepUntouchedFiles(Compaction* c);
+
 
   // Return a compaction object for compacting the range [begin,end] in
   // the specified level.  Returns nullptr if there is nothing in that
@@ -401,6 +630,17 @@ class VersionSet {
   // The caller should delete the iterator when no longer needed.
   Iterator* MakeInputIterator(Compaction* c);
   Iterator* MakeInputIteratorMemoryServer(Compaction* c);
+  // Cut the key range of "*c" into about "ranges" subcompactions of equal
+  // input bytes, at user keys sampled from the indexes of its inputs, see
+  // TableCache::SampleIndexKeys(). Falls back on the boundaries of the
+  // files of the output level, see Compaction::GenSubcompactionBoundaries(),
+  // if no index could be read.
+  void GenSubcompactionBoundaries(Compaction* c, size_t ranges,
+                                  bool memory_side);
+  // Create an iterator over "files", one vector per level, on the memory
+  // node. The vectors must outlive the iterator.
+  Iterator* MakeScanIteratorMemoryServer(
+      std::vector<std::shared_ptr<RemoteMemTableMetaData>>* files);
 //  Iterator* NewIterator(std::shared_ptr<RemoteMemTableMetaData> f);
   // Returns true iff some level needs a compaction.
   bool NeedsCompaction() const {
@@ -408,10 +648,11 @@ class VersionSet {
     // funciton.
     Version* v = current_;
     //TODO(ruihong): we may also need a lock for changing reading the compaction score.
-    return (v->compaction_score_[0] >= 1) ;
-    //TODO: keep the file_to compact in our implementation in the future.
-//    || (v->file_to_compact_.get() != nullptr)
+    return v->compaction_score_[0] >= 1 ||
+           v->file_to_compact_level_.load(std::memory_order_relaxed) >= 0;
   }
+  // The level the next compaction starts from.
+  int CompactionLevel() const { return current_->compaction_level_[0]; }
   bool AllCompactionNotFinished() {
 
     Version* v = current_;
@@ -428,6 +669,12 @@ class VersionSet {
   // Return the approximate offset in the database of the data for
   // "key" as of version "v".
   uint64_t ApproximateOffsetOf(Version* v, const InternalKey& key);
+  // Same, and the entries before "key" and the bytes of their keys and
+  // values before compression. A table is placed by the key sample of its
+  // metadata, see TableKeyStats, or through its index if it has none.
+  void ApproximateOffsetOf(Version* v, const InternalKey& key,
+                           uint64_t* bytes, uint64_t* entries,
+                           uint64_t* raw_bytes);
 
   // Return a human-readable short (single-line) summary of the number
   // of files per level.  Uses *scratch as backing store.
@@ -457,6 +704,15 @@ class VersionSet {
   bool ReuseManifest(const std::string& dscname, const std::string& dscbase);
 
   void Finalize(Version* v);
+  // The target sizes of the levels of "v" from level 1 on, 0 for the levels
+  // the tables only pass through, see Options::dynamic_level_bytes.
+  void LevelMaxBytes(Version* v, double* max_bytes) const;
+  // With kCompactionStyleFIFO, at least 1 once some tables of "v" are due
+  // to be dropped.
+  double FIFOScore(Version* v) const;
+  // The bytes the compactions of "v" are estimated to write before every
+  // level is within "max_bytes", its scores computed and not yet sorted.
+  uint64_t EstimatePendingBytes(Version* v, const double* max_bytes) const;
 
   void GetRange(const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& inputs, InternalKey* smallest,
                 InternalKey* largest);
@@ -466,6 +722,7 @@ class VersionSet {
                  InternalKey* smallest, InternalKey* largest);
 
   void SetupOtherInputs(Compaction* c);
+  void SetupGrandparents(Compaction* c);
 
   // Save current contents to *log
   Status WriteSnapshot(log::Writer* log);
@@ -482,8 +739,14 @@ class VersionSet {
   std::atomic<uint64_t> last_sequence_;
   uint64_t log_number_;
   uint64_t prev_log_number_;  // 0 or backing store for memtable being compacted
-  std::map<uint64_t, std::shared_ptr<RemoteMemTableMetaData>> persistent_pinner_;
+  // The new files of the edits which are not persisted yet, by epoch.
+  std::map<uint64_t, std::vector<std::shared_ptr<RemoteMemTableMetaData>>>
+      persistent_pinner_;
+  size_t pinned_file_num_ = 0;
+  uint64_t persist_epoch_ = 0;
   std::mutex pinner_mtx;
+  // Null unless the shard has read replicas.
+  EditPublisher* edit_publisher_ = nullptr;
 
   Version dummy_versions_;  // Head of circular doubly-linked list of versions.
   //TODO: make current_ an atomic variable.
@@ -525,10 +788,30 @@ class Compaction {
   // Maximum size of files to build during this compaction.
   uint64_t MaxOutputFileSize() const { return max_output_file_size_; }
 
+  // The bits per key of the filters of the files built, picked by the
+  // compute node, see VersionSet::BloomBitsForLevel(). Options::bloom_bits if
+  // negative.
+  int BloomBits() const { return bloom_bits_; }
+
+  // True if no file below level() + 1 overlaps the inputs, the deletions
+  // no snapshot needs are dropped then.
+  bool bottommost() const { return bottommost_; }
+
+  // The sequence of the oldest snapshot of the compute node, the versions
+  // older than it which a newer one hides are dropped. Set by the compute
+  // node before the compaction goes to the memory node, which has no
+  // snapshots of its own.
+  SequenceNumber smallest_snapshot() const { return smallest_snapshot_; }
+  void set_smallest_snapshot(SequenceNumber s) { smallest_snapshot_ = s; }
+
   // Is this a trivial compaction that can be implemented by just
   // moving a single mem_vec file to the next level (no merging or splitting)
   bool IsTrivialMove() const;
 
+  // The range tombstones of the input version, the compaction drops the
+  // entries they delete.
+  const RangeTombstones& range_tombstones() const { return range_tombstones_; }
+
   // Add all mem_vec to this compaction as delete operations to *edit.
   void AddInputDeletions(VersionEdit* edit);
   void DecodeFrom(const Slice src, int side);
@@ -541,7 +824,15 @@ class Compaction {
   // Returns true iff we should stop building the current output
   // before processing "internal_key".
   bool ShouldStopBefore(const Slice& internal_key);
+  // Same as above for an output whose progress through the grandparent
+  // files is kept by the caller, every subcompaction keeps its own.
+  bool ShouldStopBefore(const Slice& internal_key, size_t* grandparent_index,
+                        bool* seen_key, uint64_t* overlapped_bytes);
   uint64_t FirstLevelSize();
+  // The same on the compute node and on the memory node which runs it, and
+  // at the install of its version edit, whose first deleted file is the
+  // same file, see TimelineJobId().
+  uint64_t JobId() const;
   // Release the mem_vec version for the compaction, once the compaction
   // is successful.
   void ReleaseInputs();
@@ -561,18 +852,28 @@ class Compaction {
   int level_;
   const Options* opt_ptr;
   uint64_t max_output_file_size_;
+  int bloom_bits_ = -1;
+  bool bottommost_ = false;
+  SequenceNumber smallest_snapshot_ = kMaxSequenceNumber;
   Version* input_version_;
   VersionEdit edit_;
+  RangeTombstones range_tombstones_;
 
   // Each compaction reads mem_vec from "level_" and "level_+1"
 
   // State used to check for number of overlapping grandparent files
   // (parent == level_ + 1, grandparent == level_ + 2)
   std::vector<std::shared_ptr<RemoteMemTableMetaData>> grandparents_;
-  size_t grandparent_index_;  // Index in grandparent_starts_
+  // The largest key and the size of every grandparent file, all that
+  // ShouldStopBefore() needs. Unlike grandparents_, they are sent to the
+  // memory node with the compaction. The files of the output level left in
+  // place are among them too, with too many bytes for an output to span
+  // them, see VersionSet::KeepUntouchedFiles().
+  std::vector<std::pair<InternalKey, uint64_t>> grandparent_bounds_;
+  size_t grandparent_index_;  // Index in grandparent_bounds_
   bool seen_key_;             // Some output key has been seen
-  int64_t overlapped_bytes_;  // Bytes of overlap between current output
-                              // and grandparent files
+  uint64_t overlapped_bytes_;  // Bytes of overlap between current output
+                               // and grandparent files
 
   // State for implementing IsBaseLevelForKey
 
@@ -583,16 +884,27 @@ class Compaction {
   size_t level_ptrs_[config::kNumLevels];
   // Stores the Slices that designate the boundaries for each subcompaction
   std::vector<Slice> boundaries_;
+  // The sampled boundaries point here, see
+  // VersionSet::GenSubcompactionBoundaries().
+  std::vector<std::string> boundary_keys_;
   // Stores the approx size of keys covered in the range of each subcompaction
   std::vector<uint64_t> sizes_;
 };
 struct CompactionOutput {
   uint64_t number;
+  // The memory node the table is written to, see Options::stripe_tables.
+  uint8_t node_id = 0;
   uint64_t file_size;
+  uint64_t num_entries = 0;
+  uint64_t num_deletions = 0;
+  TableKeyStats key_stats;
   InternalKey smallest, largest;
-  std::map<uint32_t , ibv_mr*> remote_data_mrs;
-  std::map<uint32_t , ibv_mr*> remote_dataindex_mrs;
-  std::map<uint32_t , ibv_mr*> remote_filter_mrs;
+  SequenceNumber largest_seq;
+  ChunkTable remote_data_mrs;
+  ChunkTable remote_dataindex_mrs;
+  ChunkTable remote_filter_mrs;
+  // The blob chunks the kept kTypeBlobIndex entries point to.
+  std::set<uint64_t> blob_chunks;
 };
 struct SubcompactionState {
   Compaction* const compaction;
@@ -640,6 +952,11 @@ struct SubcompactionState {
   // A flag determine whether the key has been seen in ShouldStopBefore()
   bool seen_key = false;
 
+  bool ShouldStopBefore(const Slice& internal_key) {
+    return compaction->ShouldStopBefore(internal_key, &grandparent_index,
+                                        &seen_key, &overlapped_bytes);
+  }
+
   SubcompactionState(Compaction* c, Slice* _start, Slice* _end, uint64_t size)
   : compaction(c), start(_start), end(_end), approx_size(size) {
     assert(compaction != nullptr);
@@ -677,17 +994,28 @@ struct CompactionState {
 // Per level compaction stats.  stats_[level] stores the stats for
 // compactions that produced data for the specified "level".
 struct CompactionStats {
-  CompactionStats() : micros(0), bytes_read(0), bytes_written(0) {}
+  CompactionStats()
+      : micros(0), bytes_read(0), bytes_written(0), count(0), remote_count(0),
+        remote_queue_micros(0) {}
 
   void Add(const CompactionStats& c) {
     this->micros += c.micros;
     this->bytes_read += c.bytes_read;
     this->bytes_written += c.bytes_written;
+    this->count += c.count;
+    this->remote_count += c.remote_count;
+    this->remote_queue_micros += c.remote_queue_micros;
   }
 
   int64_t micros;
   int64_t bytes_read;
   int64_t bytes_written;
+  // The flushes or compactions, and the ones of them run by the memory
+  // node, whose time this node does not know.
+  int64_t count;
+  int64_t remote_count;
+  // The time the ones run by the memory node waited there for a thread.
+  int64_t remote_queue_micros;
 };
 }  // namespace dLSM
 
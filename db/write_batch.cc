@@ -8,7 +8,8 @@
 //    data: record[count]
 // record :=
 //    kTypeValue varstring varstring         |
-//    kTypeDeletion varstring
+//    kTypeDeletion varstring                |
+//    kTypeMerge varstring varstring
 // varstring :=
 //    len: varint32
 //    data: uint8[len]
@@ -32,6 +33,8 @@ WriteBatch::~WriteBatch() = default;
 
 WriteBatch::Handler::~Handler() = default;
 
+void WriteBatch::Handler::Merge(const Slice& /*key*/, const Slice& /*value*/) {}
+
 void WriteBatch::Clear() {
   rep_.clear();
   rep_.resize(kHeader);
@@ -70,6 +73,14 @@ Status WriteBatch::Iterate(Handler* handler) const {
           return Status::Corruption("bad WriteBatch Delete");
         }
         break;
+      case kTypeMerge:
+        if (GetLengthPrefixedSlice(&input, &key) &&
+            GetLengthPrefixedSlice(&input, &value)) {
+          handler->Merge(key, value);
+        } else {
+          return Status::Corruption("bad WriteBatch Merge");
+        }
+        break;
       default:
         return Status::Corruption("unknown WriteBatch tag");
     }
@@ -97,6 +108,15 @@ void WriteBatchInternal::SetSequence(WriteBatch* b, SequenceNumber seq) {
   EncodeFixed64(&b->rep_[0], seq);
 }
 
+size_t WriteBatchInternal::ByteSize(ValueType type, const Slice& key,
+                                    const Slice& value) {
+  size_t size = kHeader + 1 + VarintLength(key.size()) + key.size();
+  if (type != kTypeDeletion) {
+    size += VarintLength(value.size()) + value.size();
+  }
+  return size;
+}
+
 void WriteBatch::Put(const Slice& key, const Slice& value) {
   WriteBatchInternal::SetCount(this, WriteBatchInternal::Count(this) + 1);
   rep_.push_back(static_cast<char>(kTypeValue));
@@ -109,6 +129,13 @@ void WriteBatch::Delete(const Slice& key) {
   rep_.push_back(static_cast<char>(kTypeDeletion));
   PutLengthPrefixedSlice(&rep_, key);
 }
+
+void WriteBatch::Merge(const Slice& key, const Slice& value) {
+  WriteBatchInternal::SetCount(this, WriteBatchInternal::Count(this) + 1);
+  rep_.push_back(static_cast<char>(kTypeMerge));
+  PutLengthPrefixedSlice(&rep_, key);
+  PutLengthPrefixedSlice(&rep_, value);
+}
 Slice WriteBatch::ParseFirst() {
   Slice input = Slice(rep_.c_str()+1+kHeader, rep_.size());
   Slice output;
@@ -126,23 +153,58 @@ class MemTableInserter : public WriteBatch::Handler {
  public:
   SequenceNumber sequence_;
   MemTable* mem_;
+  // Entries outside [first_, last_] belong to another memtable.
+  SequenceNumber first_ = 0;
+  SequenceNumber last_ = kMaxSequenceNumber;
+  bool insert_hint_ = false;
+  bool update_in_place_ = false;
 
   void Put(const Slice& key, const Slice& value) override {
-    mem_->Add(sequence_, kTypeValue, key, value);
+    if (sequence_ >= first_ && sequence_ <= last_) {
+      mem_->Add(sequence_, kTypeValue, key, value, insert_hint_,
+                update_in_place_);
+    }
     sequence_++;
   }
   void Delete(const Slice& key) override {
-    mem_->Add(sequence_, kTypeDeletion, key, Slice());
+    if (sequence_ >= first_ && sequence_ <= last_) {
+      mem_->Add(sequence_, kTypeDeletion, key, Slice(), insert_hint_);
+    }
+    sequence_++;
+  }
+  void Merge(const Slice& key, const Slice& value) override {
+    if (sequence_ >= first_ && sequence_ <= last_) {
+      mem_->Add(sequence_, kTypeMerge, key, value, insert_hint_);
+    }
     sequence_++;
   }
 };
 }  // namespace
 
-Status WriteBatchInternal::InsertInto(const WriteBatch* b, MemTable* memtable) {
+Status WriteBatchInternal::InsertInto(const WriteBatch* b, MemTable* memtable,
+                                      bool insert_hint, bool update_in_place) {
+  MemTableInserter inserter;
+  assert(!memtable->CheckFlushFinished());
+  inserter.sequence_ = WriteBatchInternal::Sequence(b);
+  inserter.mem_ = memtable;
+  inserter.insert_hint_ = insert_hint;
+  inserter.update_in_place_ = update_in_place;
+  return b->Iterate(&inserter);
+}
+
+Status WriteBatchInternal::InsertInto(const WriteBatch* b, MemTable* memtable,
+                                      SequenceNumber first,
+                                      SequenceNumber last, bool insert_hint,
+                                      bool update_in_place) {
   MemTableInserter inserter;
   assert(!memtable->CheckFlushFinished());
+  assert(first <= last);
   inserter.sequence_ = WriteBatchInternal::Sequence(b);
   inserter.mem_ = memtable;
+  inserter.first_ = first;
+  inserter.last_ = last;
+  inserter.insert_hint_ = insert_hint;
+  inserter.update_in_place_ = update_in_place;
   return b->Iterate(&inserter);
 }
 
@@ -33,9 +33,22 @@ class WriteBatchInternal {
 
   static size_t ByteSize(const WriteBatch* batch) { return batch->rep_.size(); }
 
+  // The ByteSize() of a batch holding only the entry "key" of "type".
+  static size_t ByteSize(ValueType type, const Slice& key, const Slice& value);
+
   static void SetContents(WriteBatch* batch, const Slice& contents);
 
-  static Status InsertInto(const WriteBatch* batch, MemTable* memtable);
+  // See MemTable::Add() for "insert_hint" and "update_in_place".
+  static Status InsertInto(const WriteBatch* batch, MemTable* memtable,
+                           bool insert_hint = false,
+                           bool update_in_place = false);
+
+  // Insert only the entries whose sequence numbers fall in [first, last].
+  // Used when the sequence range of one batch spans several memtables.
+  static Status InsertInto(const WriteBatch* batch, MemTable* memtable,
+                           SequenceNumber first, SequenceNumber last,
+                           bool insert_hint = false,
+                           bool update_in_place = false);
 
   static void Append(WriteBatch* dst, const WriteBatch* src);
 };
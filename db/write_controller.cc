@@ -0,0 +1,112 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/write_controller.h"
+
+#include <algorithm>
+
+#include "dLSM/env.h"
+
+namespace dLSM {
+
+namespace {
+
+// How often the pressure is computed again.
+const uint64_t kPressureRefreshMicros = 1000;
+// At full pressure the writes still get this part of the drain rate.
+const double kMinRateFraction = 1.0 / 16;
+// The bucket holds the bytes of this long at most, which a burst may take
+// at once, and owes the writers this long at most.
+const double kBurstMicros = 1000;
+const double kMaxDebtMicros = 1000000;
+// The weight of a new flush in the moving average.
+const double kDrainRateWeight = 0.25;
+
+}  // namespace
+
+WriteController::WriteController(Env* env, uint64_t initial_rate)
+    : env_(env),
+      pressure_(0),
+      pressure_micros_(0),
+      drain_rate_(static_cast<double>(std::max<uint64_t>(initial_rate, 1))),
+      tokens_(0),
+      refill_micros_(0),
+      delayed_writes_(0),
+      delay_micros_(0),
+      stops_(0),
+      stop_micros_(0) {}
+
+bool WriteController::NeedsPressure() {
+  const uint64_t now = env_->NowMicros();
+  uint64_t last = pressure_micros_.load(std::memory_order_relaxed);
+  return now - last >= kPressureRefreshMicros &&
+         pressure_micros_.compare_exchange_strong(last, now);
+}
+
+void WriteController::SetPressure(double pressure) {
+  pressure_.store(std::min(std::max(pressure, 0.0), 1.0),
+                  std::memory_order_relaxed);
+}
+
+void WriteController::RecordFlush(uint64_t bytes, uint64_t micros) {
+  if (bytes == 0 || micros == 0) {
+    return;
+  }
+  const double rate = bytes * 1e6 / micros;
+  std::unique_lock<std::mutex> lck(mutex_);
+  drain_rate_ += kDrainRateWeight * (rate - drain_rate_);
+}
+
+double WriteController::RateAt(double pressure) const {
+  return drain_rate_ * std::max(1.0 - pressure, kMinRateFraction);
+}
+
+uint64_t WriteController::GetDelay(uint64_t bytes) {
+  const double pressure = pressure_.load(std::memory_order_relaxed);
+  if (pressure <= 0) {
+    return 0;
+  }
+  std::unique_lock<std::mutex> lck(mutex_);
+  const uint64_t now = env_->NowMicros();
+  const double rate = RateAt(pressure);
+  if (now > refill_micros_) {
+    tokens_ += (now - refill_micros_) * rate / 1e6;
+    refill_micros_ = now;
+  }
+  tokens_ = std::min(tokens_, kBurstMicros * rate / 1e6);
+  tokens_ = std::max(tokens_ - bytes, -kMaxDebtMicros * rate / 1e6);
+  if (tokens_ >= 0) {
+    return 0;
+  }
+  const uint64_t delay = static_cast<uint64_t>(-tokens_ * 1e6 / rate);
+  lck.unlock();
+  delayed_writes_.fetch_add(1, std::memory_order_relaxed);
+  delay_micros_.fetch_add(delay, std::memory_order_relaxed);
+  return delay;
+}
+
+void WriteController::RecordStop(uint64_t micros) {
+  stops_.fetch_add(1, std::memory_order_relaxed);
+  stop_micros_.fetch_add(micros, std::memory_order_relaxed);
+}
+
+uint64_t WriteController::DelayedWriteRate() {
+  const double pressure = pressure_.load(std::memory_order_relaxed);
+  if (pressure <= 0) {
+    return 0;
+  }
+  std::unique_lock<std::mutex> lck(mutex_);
+  return static_cast<uint64_t>(RateAt(pressure));
+}
+
+WriteController::Stats WriteController::GetStats() const {
+  Stats stats;
+  stats.delayed_writes = delayed_writes_.load(std::memory_order_relaxed);
+  stats.delay_micros = delay_micros_.load(std::memory_order_relaxed);
+  stats.stops = stops_.load(std::memory_order_relaxed);
+  stats.stop_micros = stop_micros_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+}  // namespace dLSM
@@ -0,0 +1,85 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_WRITE_CONTROLLER_H_
+#define STORAGE_dLSM_DB_WRITE_CONTROLLER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+namespace dLSM {
+
+class Env;
+
+// Paces the writes of a shard while its flushes and compactions fall behind.
+// The background work is summed up in a pressure in [0, 1], 0 where the
+// writes are not paced and 1 where they would stop. Under pressure the
+// writes draw their bytes from a token bucket refilled at the rate the
+// flushes drain the memtables, scaled down as the pressure grows, so that
+// every writer is delayed after the bytes it writes rather than a few of
+// them by a lot.
+class WriteController {
+ public:
+  struct Stats {
+    uint64_t delayed_writes;
+    uint64_t delay_micros;
+    uint64_t stops;
+    uint64_t stop_micros;
+  };
+
+  // "initial_rate" is the drain rate in bytes per second assumed before a
+  // flush is measured.
+  WriteController(Env* env, uint64_t initial_rate);
+
+  WriteController(const WriteController&) = delete;
+  WriteController& operator=(const WriteController&) = delete;
+
+  // Returns true once in a refresh period, for the caller to compute the
+  // pressure and SetPressure() it. The other writers keep the last one.
+  bool NeedsPressure();
+  void SetPressure(double pressure);
+
+  // Record a flush which wrote "bytes" in "micros".
+  void RecordFlush(uint64_t bytes, uint64_t micros);
+
+  // How long the writer of "bytes" of batches sleeps before it takes its
+  // sequences. Counted in the stats as a delayed write.
+  uint64_t GetDelay(uint64_t bytes);
+
+  // Record a writer which stopped for "micros" until there was room for a
+  // new memtable.
+  void RecordStop(uint64_t micros);
+
+  // The rate the writes would be paced at now, 0 without pressure.
+  uint64_t DelayedWriteRate();
+  Stats GetStats() const;
+
+ private:
+  // The rate at "pressure", mutex_ held and pressure above 0.
+  double RateAt(double pressure) const;
+
+  Env* const env_;
+  // Read without the lock by the writers which are not paced.
+  std::atomic<double> pressure_;
+  std::atomic<uint64_t> pressure_micros_;
+
+  std::mutex mutex_;
+  // The fields below are protected by mutex_.
+  // The moving average of the drain rate, in bytes per second.
+  double drain_rate_;
+  // The bytes a writer may take, negative while the earlier writers are
+  // still owed their delay.
+  double tokens_;
+  uint64_t refill_micros_;
+
+  std::atomic<uint64_t> delayed_writes_;
+  std::atomic<uint64_t> delay_micros_;
+  std::atomic<uint64_t> stops_;
+  std::atomic<uint64_t> stop_micros_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_WRITE_CONTROLLER_H_
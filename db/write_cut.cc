@@ -0,0 +1,37 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/write_cut.h"
+
+#include <thread>
+
+namespace dLSM {
+
+uint64_t WriteCut::Enter() {
+  reserve_mtx_.lock_shared();
+  const uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+  in_flight_[epoch & 1].fetch_add(1);
+  return epoch;
+}
+
+void WriteCut::Reserved() { reserve_mtx_.unlock_shared(); }
+
+void WriteCut::Exit(uint64_t epoch) { in_flight_[epoch & 1].fetch_sub(1); }
+
+void WriteCut::Cut(const std::function<void()>& take) {
+  std::unique_lock<std::mutex> cut_lck(cut_mtx_);
+  uint64_t epoch;
+  {
+    std::unique_lock<std::shared_mutex> lck(reserve_mtx_);
+    epoch = epoch_.fetch_add(1);
+    take();
+  }
+  // The epoch before was drained by the last cut, the writes left are the
+  // ones of this epoch.
+  while (in_flight_[epoch & 1].load() != 0) {
+    std::this_thread::yield();
+  }
+}
+
+}  // namespace dLSM
@@ -0,0 +1,51 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_DB_WRITE_CUT_H_
+#define STORAGE_dLSM_DB_WRITE_CUT_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+
+namespace dLSM {
+
+// Orders the writes of the shards of a compute node against the snapshots
+// of all of them. A write takes its sequences inside the cut, between
+// Enter() and Reserved(), and is done at Exit() once it is in the
+// memtables. Cut() reads the last sequences of the shards while no write is
+// taking its sequences, which starts a new epoch, and then waits for the
+// writes of the epochs before to be done. The writes of the new epoch go
+// on meanwhile, their sequences are after the cut in every shard.
+class WriteCut {
+ public:
+  WriteCut() = default;
+
+  WriteCut(const WriteCut&) = delete;
+  WriteCut& operator=(const WriteCut&) = delete;
+
+  // Returns the epoch of the write, for Exit().
+  uint64_t Enter();
+  void Reserved();
+  void Exit(uint64_t epoch);
+
+  // Run "take" with no sequence being taken, then wait for the writes whose
+  // sequences are before it.
+  void Cut(const std::function<void()>& take);
+
+ private:
+  // Held shared while the sequences are taken, exclusively by Cut().
+  std::shared_mutex reserve_mtx_;
+  // One Cut() at a time, so the writes of two epochs at most are in flight.
+  std::mutex cut_mtx_;
+  std::atomic<uint64_t> epoch_{0};
+  // The writes of the even and of the odd epochs not done yet.
+  std::atomic<uint64_t> in_flight_[2] = {{0}, {0}};
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_DB_WRITE_CUT_H_
@@ -97,6 +97,49 @@ dLSM_EXPORT char* dLSM_get(dLSM_t* db,
                                  const char* key, size_t keylen, size_t* vallen,
                                  char** errptr);
 
+/* Same as dLSM_write(), but returns at once and calls callback(state, err)
+   once the batch is applied, from a thread of the DB. err is NULL on
+   success, and only valid during the call otherwise. The batch is copied,
+   the caller may reuse it right away. */
+dLSM_EXPORT void dLSM_write_async(dLSM_t* db,
+                                  const dLSM_writeoptions_t* options,
+                                  const dLSM_writebatch_t* batch, void* state,
+                                  void (*callback)(void* state,
+                                                   const char* err));
+
+/* Same as dLSM_get(), but copies the value into buf instead of a malloc()ed
+   array. Returns 1 if the key was found, 0 otherwise. *vallen is the size
+   of the whole value, of which only the first buflen bytes are copied if
+   it is larger, so that the caller can retry with a larger buffer. */
+dLSM_EXPORT uint8_t dLSM_get_into(dLSM_t* db,
+                                  const dLSM_readoptions_t* options,
+                                  const char* key, size_t keylen, char* buf,
+                                  size_t buflen, size_t* vallen,
+                                  char** errptr);
+
+/* Looks up num_keys keys at once, from the same view of the database.
+   values_list[i] is NULL if the i-th key is not found, a malloc()ed array
+   of values_list_sizes[i] bytes otherwise. errs[i] is set as errptr of
+   dLSM_get() is, and has to be NULL or malloc()ed on entry. */
+dLSM_EXPORT void dLSM_multi_get(dLSM_t* db,
+                                const dLSM_readoptions_t* options,
+                                size_t num_keys,
+                                const char* const* keys_list,
+                                const size_t* keys_list_sizes,
+                                char** values_list, size_t* values_list_sizes,
+                                char** errs);
+
+/* Hints that the num_keys keys, or the keys in [start, limit), are about to
+   be read, see DB::Prefetch(). Returns at once. An empty limit runs to the
+   end of the database. */
+dLSM_EXPORT void dLSM_prefetch(dLSM_t* db, const dLSM_readoptions_t* options,
+                               size_t num_keys, const char* const* keys_list,
+                               const size_t* keys_list_sizes);
+dLSM_EXPORT void dLSM_prefetch_range(dLSM_t* db,
+                                     const dLSM_readoptions_t* options,
+                                     const char* start_key, size_t start_len,
+                                     const char* limit_key, size_t limit_len);
+
 dLSM_EXPORT dLSM_iterator_t* dLSM_create_iterator(
     dLSM_t* db, const dLSM_readoptions_t* options);
 
@@ -115,6 +158,12 @@ dLSM_EXPORT void dLSM_approximate_sizes(
     const size_t* range_start_key_len, const char* const* range_limit_key,
     const size_t* range_limit_key_len, uint64_t* sizes);
 
+/* raw_sizes may be NULL. */
+dLSM_EXPORT void dLSM_approximate_counts(
+    dLSM_t* db, int num_ranges, const char* const* range_start_key,
+    const size_t* range_start_key_len, const char* const* range_limit_key,
+    const size_t* range_limit_key_len, uint64_t* entries, uint64_t* raw_sizes);
+
 dLSM_EXPORT void dLSM_compact_range(dLSM_t* db, const char* start_key,
                                           size_t start_key_len,
                                           const char* limit_key,
@@ -155,6 +204,15 @@ dLSM_EXPORT void dLSM_writebatch_put(dLSM_writebatch_t*,
                                            const char* val, size_t vlen);
 dLSM_EXPORT void dLSM_writebatch_delete(dLSM_writebatch_t*,
                                               const char* key, size_t klen);
+/* Add num pairs, or delete num keys, with one call. */
+dLSM_EXPORT void dLSM_writebatch_put_many(dLSM_writebatch_t*, size_t num,
+                                          const char* const* keys_list,
+                                          const size_t* keys_list_sizes,
+                                          const char* const* values_list,
+                                          const size_t* values_list_sizes);
+dLSM_EXPORT void dLSM_writebatch_delete_many(dLSM_writebatch_t*, size_t num,
+                                             const char* const* keys_list,
+                                             const size_t* keys_list_sizes);
 dLSM_EXPORT void dLSM_writebatch_iterate(
     const dLSM_writebatch_t*, void* state,
     void (*put)(void*, const char* k, size_t klen, const char* v, size_t vlen),
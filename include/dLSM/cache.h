@@ -31,6 +31,15 @@ class dLSM_EXPORT Cache;
 // of Cache uses a least-recently-used eviction policy.
 dLSM_EXPORT Cache* NewLRUCache(size_t capacity);
 
+// Create a new table_cache with a fixed size capacity, which evicts by the
+// CLOCK policy and admits a new entry over an old one only if its key was
+// looked up more often (TinyLFU). Its lookups take no lock, which scales
+// better than NewLRUCache() with many readers, and a scan does not flush
+// it. It holds at most about capacity / estimated_entry_charge entries,
+// whatever their charges, and takes some 80 bytes per entry of those.
+dLSM_EXPORT Cache* NewClockCache(size_t capacity,
+                                 size_t estimated_entry_charge = 1);
+
 class dLSM_EXPORT Cache {
  public:
   Cache() = default;
@@ -0,0 +1,74 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A Cleanable holds a list of function/arg1/arg2 triples which are invoked
+// when it is destroyed or reset. Iterators use it to release the blocks they
+// read, and PinnableSlice to release the memory its data refers to.
+
+#ifndef STORAGE_dLSM_INCLUDE_CLEANABLE_H_
+#define STORAGE_dLSM_INCLUDE_CLEANABLE_H_
+
+#include <cassert>
+
+#include "dLSM/export.h"
+
+namespace dLSM {
+
+class dLSM_EXPORT Cleanable {
+ public:
+  Cleanable();
+
+  Cleanable(const Cleanable&) = delete;
+  Cleanable& operator=(const Cleanable&) = delete;
+
+  ~Cleanable();
+
+  // Clients are allowed to register function/arg1/arg2 triples that
+  // will be invoked when this object is destroyed.
+  //
+  // Note that this method is not virtual and therefore subclasses should
+  // not override it.
+  using CleanupFunction = void (*)(void* arg1, void* arg2);
+  void RegisterCleanup(CleanupFunction function, void* arg1, void* arg2);
+
+  // Move all the cleanups of this object to "other", which runs them when
+  // it is destroyed or reset instead. This object is left without any.
+  void DelegateCleanupsTo(Cleanable* other);
+
+  // Run the cleanups now, after which the object can be used again.
+  void Reset() {
+    DoCleanup();
+    cleanup_head_.function = nullptr;
+    cleanup_head_.next = nullptr;
+  }
+
+ private:
+  // Cleanup functions are stored in a single-linked list.
+  // The list's head node is inlined in the object.
+  struct CleanupNode {
+    // True if the node is not used. Only head nodes might be unused.
+    bool IsEmpty() const { return function == nullptr; }
+    // Invokes the cleanup function.
+    void Run() {
+      assert(function != nullptr);
+      (*function)(arg1, arg2);
+    }
+
+    // The head node is used if the function pointer is not null.
+    CleanupFunction function;
+    void* arg1;
+    void* arg2;
+    CleanupNode* next;
+  };
+
+  void DoCleanup();
+  // Take the node, which was allocated by another object, into the list.
+  void RegisterCleanup(CleanupNode* node);
+
+  CleanupNode cleanup_head_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_INCLUDE_CLEANABLE_H_
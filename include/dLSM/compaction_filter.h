@@ -0,0 +1,48 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A CompactionFilter decides which values the compactions drop, e.g. the
+// records whose time to live is over. The compactions run near the data on
+// the memory node, so the filter lives there: the Server binary registers
+// it by name with RegisterCompactionFilter() before it serves, and the
+// compute node selects it through Options::compaction_filter, whose Name()
+// is sent along with the options.
+
+#ifndef STORAGE_dLSM_INCLUDE_COMPACTION_FILTER_H_
+#define STORAGE_dLSM_INCLUDE_COMPACTION_FILTER_H_
+
+#include <string>
+
+#include "dLSM/export.h"
+#include "dLSM/slice.h"
+
+namespace dLSM {
+
+class dLSM_EXPORT CompactionFilter {
+ public:
+  virtual ~CompactionFilter();
+
+  // The name the filter is registered and selected by.
+  virtual const char* Name() const = 0;
+
+  // Return true to drop the value of "key" from the output of a compaction
+  // of "level". The entry is kept as a deletion, so that the older values of
+  // the key in the deeper levels stay hidden.
+  //
+  // Called concurrently by the compaction threads.
+  virtual bool Filter(int level, const Slice& key, const Slice& value) const = 0;
+};
+
+// Make "filter" selectable by its name on this node, replacing the filter
+// registered before under the same name. The filter is not owned and must
+// live as long as the node.
+dLSM_EXPORT void RegisterCompactionFilter(const CompactionFilter* filter);
+
+// The filter registered under "name", or nullptr if there is none.
+dLSM_EXPORT const CompactionFilter* FindCompactionFilter(
+    const std::string& name);
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_INCLUDE_COMPACTION_FILTER_H_
@@ -7,6 +7,10 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
 
 #include "dLSM/export.h"
 #include "dLSM/iterator.h"
@@ -74,11 +78,51 @@ class dLSM_EXPORT DB {
   // Note: consider setting options.sync = true.
   virtual Status Delete(const WriteOptions& options, const Slice& key) = 0;
 
+  // Apply the operand "value" to the database entry for "key" through
+  // Options::merge_operator, without reading it. The operands are applied
+  // when the key is read or compacted. Returns InvalidArgument if there is
+  // no merge operator.
+  virtual Status Merge(const WriteOptions& options, const Slice& key,
+                       const Slice& value);
+
+  // Remove the database entries (if any) for the keys in [begin, end).
+  // Returns OK on success, and a non-OK status on error. The tables whose
+  // keys are all in the range are dropped without being read. The default
+  // implementation returns NotSupported.
+  virtual Status DeleteRange(const WriteOptions& options, const Slice& begin,
+                             const Slice& end);
+
+  // Build tables straight out of "input", which yields user keys in strictly
+  // ascending order from SeekToFirst() with their values, and install them
+  // at the deepest level where they overlap no table of that level or
+  // above, skipping the memtables and the compactions. The entries take one
+  // sequence number after the writes before. Returns InvalidArgument if the
+  // keys are out of order or the memtables hold keys of their range, which
+  // must not be written meanwhile. The default implementation returns
+  // NotSupported.
+  virtual Status IngestSorted(Iterator* input);
+
   // Apply the specified updates to the database.
   // Returns OK on success, non-OK on failure.
   // Note: consider setting options.sync = true.
   virtual Status Write(const WriteOptions& options, WriteBatch* updates) = 0;
 
+  // Called with the status of a WriteAsync() once its batch is applied.
+  typedef std::function<void(const Status& s)> WriteCallback;
+
+  // Same as Write(), but return at once and call "callback" when the batch
+  // is applied, without blocking the caller on a write stall. The batch is
+  // copied, the caller may reuse it right away. DBImpl queues it on a queue
+  // of the core the caller runs on, and the threads of
+  // Options::async_write_threads merge the batches queued meanwhile into one,
+  // which takes its sequence numbers at once, and run the callbacks. There
+  // is no order between the batches queued together; a write which must
+  // follow another is issued from the callback of the first. The default
+  // implementation calls Write() and then "callback" on the calling thread.
+  virtual void WriteAsync(const WriteOptions& options,
+                          const WriteBatch& updates,
+                          const WriteCallback& callback);
+
   // If the database contains an entry for "key" store the
   // corresponding value in *value and return OK.
   //
@@ -89,6 +133,47 @@ class dLSM_EXPORT DB {
   virtual Status Get(const ReadOptions& options, const Slice& key,
                      std::string* value) = 0;
 
+  // Same as Get() above, but the value may be returned without a copy: on
+  // success *value refers to the memtable or the data block which holds it,
+  // and keeps that memory alive until value->Reset() is called or value is
+  // destroyed. value should be released before this db is deleted. The
+  // default implementation copies the value into the buffer of *value.
+  virtual Status Get(const ReadOptions& options, const Slice& key,
+                     PinnableSlice* value);
+
+  // Called with the pieces of a value of GetLarge() in order.
+  typedef std::function<void(const Slice& piece)> ValueCallback;
+
+  // Same as Get(), but hand the value to "callback" a piece at a time, so
+  // that a value larger than the memory at hand need not be held at once.
+  // DBImpl reads a value spread over several blob chunks chunk by chunk.
+  // The default implementation calls Get() and passes the whole value.
+  virtual Status GetLarge(const ReadOptions& options, const Slice& key,
+                          const ValueCallback& callback);
+
+  // Look up several keys at once.  (*values)[i] and the i-th returned
+  // status have the same meaning as the value and status of
+  // Get(options, keys[i], ...), and all the keys are read from the same
+  // view of the database.  The default implementation simply loops over
+  // Get(); DBImpl batches the remote reads of all the keys.
+  virtual std::vector<Status> MultiGet(const ReadOptions& options,
+                                       const std::vector<Slice>& keys,
+                                       std::vector<std::string>* values);
+
+  // Hint that "keys", or the user keys in [range.start, range.limit), are
+  // about to be read, and return at once. DBImpl looks them up on a thread
+  // of its own with fill_cache set, the keys with the batched remote reads
+  // of MultiGet(), so that the Get() and the scans to come find the blocks,
+  // or with BYTEADDRESSABLE the KVs, in the block_cache. A range with an
+  // empty limit runs to the end of the database, and stops once it has read
+  // the capacity of the block_cache. The hints read the latest state,
+  // whatever options.snapshot, and the oldest waiting are dropped when too
+  // many are. Nothing is done without a block_cache. The default
+  // implementation does nothing.
+  virtual void Prefetch(const ReadOptions& options,
+                        const std::vector<Slice>& keys);
+  virtual void Prefetch(const ReadOptions& options, const Range& range);
+
   // Return a heap-allocated iterator over the contents of the database.
   // The result of NewIterator() is initially invalid (caller must
   // call one of the Seek methods on the iterator before using it).
@@ -96,6 +181,45 @@ class dLSM_EXPORT DB {
   // Caller should delete the iterator when it is no longer needed.
   // The returned iterator should be deleted before this db is deleted.
   virtual Iterator* NewIterator(const ReadOptions& options) = 0;
+
+  // Called with every entry of a ParallelScan(). Returning false stops the
+  // scan.
+  typedef std::function<bool(const Slice& key, const Slice& value)>
+      ScanCallback;
+
+  // Call "callback" with the entries of the user keys in
+  // [range.start, range.limit), an empty limit meaning the end of the
+  // database. DBImpl splits the range into at most "num_partitions" parts of
+  // about the same size at the file boundaries of the current version, and
+  // reads every part with an iterator of its own on a thread of its own,
+  // all of them at the same snapshot.
+  //
+  // With "ordered" the callback runs on the calling thread in key order.
+  // Otherwise it runs on the threads of the parts concurrently, in key order
+  // within a part only, and must be thread safe.
+  virtual Status ParallelScan(const ReadOptions& options, const Range& range,
+                              int num_partitions, bool ordered,
+                              const ScanCallback& callback);
+
+  // Call "callback" in key order with the entries of the user keys in
+  // [range.start, range.limit) which the ScanFilter registered as
+  // "filter_name" keeps, an empty limit meaning the end of the database.
+  // DBImpl runs the scan of the SSTables on the memory node, which sends
+  // back the kept entries only, and merges the memtables in. The filter
+  // must be registered on the memory node too. Not supported with a
+  // merge operator.
+  virtual Status FilteredScan(const ReadOptions& options, const Range& range,
+                              const std::string& filter_name,
+                              const ScanCallback& callback);
+
+  // Record the writes, the Get() and MultiGet() keys and the seeks of the
+  // iterators of NewIterator() into the file "path" until EndTrace(), with
+  // the time and the value size but without the values. db_bench replays
+  // the trace with --benchmarks=replay. Fails if a trace is being recorded
+  // already.
+  virtual Status StartTrace(const std::string& path);
+  // Write out the rest of the trace started by StartTrace() and close it.
+  virtual Status EndTrace();
 #ifdef BYTEADDRESSABLE
   //Sequential access iterator for byteaddressable iterator, only
   // support forward direction now.
@@ -122,13 +246,61 @@ class dLSM_EXPORT DB {
   //  "dLSM.num-files-at-level<N>" - return the number of files at level <N>,
   //     where <N> is an ASCII representation of a level number (e.g. "0").
   //  "dLSM.stats" - returns a multi-line string that describes statistics
-  //     about the internal operation of the DB.
+  //     about the internal operation of the DB: the flushes and the
+  //     compactions into every level, including the ones the memory nodes
+  //     ran, the write stalls, and the filter, block cache and table cache
+  //     counters of the process. See GetMapProperty() for the numbers.
   //  "dLSM.sstables" - returns a multi-line string that describes all
   //     of the sstables that make up the db contents.
   //  "dLSM.approximate-memory-usage" - returns the approximate number of
   //     bytes of memory in use by the DB.
+  //  "dLSM.rate-limiter" - returns the current rate of options.rate_limiter,
+  //     the bytes it let through and the foreground latency it sees.
+  //  "dLSM.remote-memory" - returns per memory node the remote memory
+  //     registered and allocated, the bytes the allocations asked for and
+  //     the free space of the slots split into size classes, and the
+  //     regions given back, see Options::release_remote_regions.
+  //  "dLSM.write-latency" - returns histograms of the time the writes spent
+  //     taking their sequence numbers, picking up their memtable, stalled
+  //     and inserting into the memtable, in microseconds.
+  //  "dLSM.rdma" - returns per queue pair class and memory node the RDMA
+  //     operations posted, their bytes, the signaled ones not polled yet and
+  //     the errors, the bytes per port, histograms of the completion
+  //     latency in microseconds, and the polls and sleeps of the completion
+  //     waits per class, see options.adaptive_read_polling.
+  //  "dLSM.rdma-pools" - returns per pool of registered local memory the
+  //     slots in use, their high-water mark and the regions, and with
+  //     options.track_rdma_slots the slots held per allocating function.
+  //  "dLSM.memory-budget" - counts options.memory_budget again and returns
+  //     its usage per category against its limit, and how often it took
+  //     memory back.
+  //  "dLSM.shard-quota" - returns per shard the memtable bytes and the
+  //     flushes in flight against options.shard_quota, 0 for no limit, the
+  //     time its writers waited for the memtable quota and the rate and
+  //     bytes of its RDMA budget.
+  //  "dLSM.compaction-debt" - returns per shard the bytes its compactions
+  //     are estimated to write before every level is within its target
+  //     size, its level 0 files, the bytes its flushes and compactions wrote
+  //     on the memory nodes per byte written by the users since the start,
+  //     and the time until its writes stall at the rate the level 0 files
+  //     and the pending bytes grew lately, see
+  //     Options::hard_pending_compaction_bytes_limit.
   virtual bool GetProperty(const Slice& property, std::string* value) = 0;
 
+  // As GetProperty(), with the value as counters by name, for the
+  // properties which have such a form:
+  //
+  //  "dLSM.stats" - the counters behind the text of "dLSM.stats", such as
+  //     "flush.bytes", "level1.compaction_bytes_read", "stall.stop_micros"
+  //     or "block_cache.hit".
+  //  "dLSM.compaction-debt" - "pending_compaction_bytes", "level0_files",
+  //     "user_bytes", "flush_bytes", "compaction_bytes" and
+  //     "time_to_stall_micros", UINT64_MAX while the writes are not heading
+  //     for a stall, prefixed with "shard<N>." for every shard of a sharded
+  //     DB.
+  virtual bool GetMapProperty(const Slice& property,
+                              std::map<std::string, uint64_t>* value);
+
   // For each i in [0,n-1], store in "sizes[i]", the approximate
   // file system space used by keys in "[range[i].start .. range[i].limit)".
   //
@@ -140,6 +312,15 @@ class dLSM_EXPORT DB {
   virtual void GetApproximateSizes(const Range* range, int n,
                                    uint64_t* sizes) = 0;
 
+  // For each i in [0,n-1], store in "entries[i]" the approximate number of
+  // entries in "[range[i].start .. range[i].limit)" and, unless raw_sizes
+  // is nullptr, in "raw_sizes[i]" the bytes of their keys and values before
+  // compression. Both come from the statistics kept with the metadata of
+  // the tables, no table is read. Like GetApproximateSizes(), the results
+  // may not include recently written data.
+  virtual void GetApproximateCounts(const Range* range, int n,
+                                    uint64_t* entries, uint64_t* raw_sizes);
+
   // Compact the underlying storage for the key range [*begin,*end].
   // In particular, deleted and overwritten versions are discarded,
   // and the data is rearranged to reduce the cost of operations
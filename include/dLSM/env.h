@@ -199,8 +199,16 @@ class dLSM_EXPORT Env {
   // I.e., the caller may not assume that background work items are
   // serialized.
   virtual void Schedule(void (*function)(void* arg), void* arg) = 0;
-  virtual void Schedule(void (*function)(void* arg), void* arg, ThreadPoolType type) = 0;
+  // Run it in the pool "type" shared by all the DBs of the Env. The pool
+  // runs the work of a higher priority first, takes the work of the tags,
+  // such as the shards, in turns, and drops the work of a tag which has too
+  // much of it waiting already.
+  virtual void Schedule(void (*function)(void* arg), void* arg,
+                        ThreadPoolType type, void* tag = nullptr,
+                        BGPriority priority = kCompactionPriority) = 0;
   virtual unsigned int Queue_Length_Quiry(ThreadPoolType type);
+  // The work of "tag" waiting in the pool "type".
+  virtual unsigned int Queue_Length_Quiry(ThreadPoolType type, void* tag);
   virtual void JoinAllThreads(bool wait_for_jobs_to_complete) = 0;
   // Start a new thread, invoking "function(arg)" within the new thread.
   // When "function(arg)" returns, the thread will be destroyed.
@@ -222,6 +230,10 @@ class dLSM_EXPORT Env {
   // Sleep/delay the thread for the prescribed number of micro-seconds.
   virtual void SleepForMicroseconds(int micros) = 0;
   virtual void SetBackgroundThreads(int num,  ThreadPoolType type) = 0;
+  // Let the pool grow from "min" up to "max" threads with the work waiting
+  // for it, and shrink back as its threads go idle. The default keeps "max"
+  // threads.
+  virtual void SetBackgroundThreads(int min, int max, ThreadPoolType type);
 //  RDMA_Manager* rdma_mg;
   std::shared_ptr<RDMA_Manager> rdma_mg;
   bool initialized = false;
@@ -15,13 +15,16 @@
 #ifndef STORAGE_dLSM_INCLUDE_ITERATOR_H_
 #define STORAGE_dLSM_INCLUDE_ITERATOR_H_
 
+#include "dLSM/cleanable.h"
 #include "dLSM/export.h"
 #include "dLSM/slice.h"
 #include "dLSM/status.h"
 
 namespace dLSM {
 
-class dLSM_EXPORT Iterator {
+// Functions registered with RegisterCleanup() are invoked when the iterator
+// is destroyed.
+class dLSM_EXPORT Iterator : public Cleanable {
  public:
   Iterator();
 
@@ -72,33 +75,10 @@ class dLSM_EXPORT Iterator {
   // If an error has occurred, return it.  Else return an ok status.
   virtual Status status() const = 0;
 
-  // Clients are allowed to register function/arg1/arg2 triples that
-  // will be invoked when this iterator is destroyed.
-  //
-  // Note that unlike all of the preceding methods, this method is
-  // not abstract and therefore clients should not override it.
-  using CleanupFunction = void (*)(void* arg1, void* arg2);
-  void RegisterCleanup(CleanupFunction function, void* arg1, void* arg2);
-
- private:
-  // Cleanup functions are stored in a single-linked list.
-  // The list's head node is inlined in the iterator.
-  struct CleanupNode {
-    // True if the node is not used. Only head nodes might be unused.
-    bool IsEmpty() const { return function == nullptr; }
-    // Invokes the cleanup function.
-    void Run() {
-      assert(function != nullptr);
-      (*function)(arg1, arg2);
-    }
-
-    // The head node is used if the function pointer is not null.
-    CleanupFunction function;
-    void* arg1;
-    void* arg2;
-    CleanupNode* next;
-  };
-  CleanupNode cleanup_head_;
+  // Rebind the iterator to the current state of the database, reusing what
+  // it holds where it can. The iterator is not Valid() afterwards. An
+  // iterator that cannot do so returns NotSupported.
+  virtual Status Refresh();
 };
 
 // Return an empty iterator (yields nothing).
@@ -0,0 +1,72 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A MemoryBudget bounds the memory of a compute node taken by all the DBs
+// and shards opened with it, see Options::memory_budget. It counts the
+// memtables, the index blocks and filters of the open tables, the block
+// caches and the local RDMA buffers, each of which has its own limit
+// otherwise. When the sum goes over the budget it takes memory back: first
+// the unpinned entries of the caches, then the open tables not in use, and
+// then the shard with the largest memtables switches its next memtable
+// early, so that less of it waits for the flush.
+//
+// It has internal synchronization and may be safely shared by all the DBs
+// of a node. It must outlive them.
+
+#ifndef STORAGE_dLSM_INCLUDE_MEMORY_BUDGET_H_
+#define STORAGE_dLSM_INCLUDE_MEMORY_BUDGET_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "dLSM/export.h"
+
+namespace dLSM {
+
+class dLSM_EXPORT MemoryBudget {
+ public:
+  enum Category {
+    kMemtables = 0,
+    // The index blocks and filters of the tables the table caches hold.
+    kTableReaders = 1,
+    kBlockCache = 2,
+    kTableMetaCache = 3,
+    // The local memory registered for RDMA, the buffers of the reads and of
+    // the flushes and the iterators.
+    kRdmaBuffers = 4,
+    kNumCategories = 5
+  };
+
+  MemoryBudget() = default;
+
+  MemoryBudget(const MemoryBudget&) = delete;
+  MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+  virtual ~MemoryBudget();
+
+  virtual size_t GetLimit() const = 0;
+
+  // Change the limit, which takes effect at the next Check().
+  virtual void SetLimit(size_t bytes) = 0;
+
+  // The bytes "category" took at the last check.
+  virtual size_t GetUsage(Category category) const = 0;
+
+  virtual size_t GetTotalUsage() const = 0;
+
+  // Count the memory again, and take some back if it is over the limit.
+  // The DBs check by themselves whenever they open a memtable or a table.
+  virtual void Check() = 0;
+
+  // The usage per category, the limit and how often memory was taken back.
+  virtual std::string ToString() const = 0;
+};
+
+// Create a budget of "limit_bytes". A limit of 0 only counts the memory.
+dLSM_EXPORT MemoryBudget* NewMemoryBudget(size_t limit_bytes);
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_INCLUDE_MEMORY_BUDGET_H_
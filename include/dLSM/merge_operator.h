@@ -0,0 +1,65 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A MergeOperator combines the operands DB::Merge() wrote for a key with the
+// value before them, e.g. adds increments to a counter, so that a
+// read-modify-write takes a single write. The operands are applied when the
+// key is read and when the compactions meet them, on the compute and the
+// memory nodes, so the operator lives on both. The built in ones are known
+// everywhere by their names, others have to be registered with
+// RegisterMergeOperator() on the memory node too.
+
+#ifndef STORAGE_dLSM_INCLUDE_MERGE_OPERATOR_H_
+#define STORAGE_dLSM_INCLUDE_MERGE_OPERATOR_H_
+
+#include <string>
+#include <vector>
+
+#include "dLSM/export.h"
+#include "dLSM/slice.h"
+
+namespace dLSM {
+
+class dLSM_EXPORT MergeOperator {
+ public:
+  virtual ~MergeOperator();
+
+  // The name the operator is selected by.
+  virtual const char* Name() const = 0;
+
+  // Apply "operands", the oldest first, to "existing_value", which is null
+  // if the key has no value before them, and store the result in
+  // *new_value. Returns false if the operands can not be applied, which
+  // the reads and the compactions report as a corruption.
+  //
+  // Called concurrently by the readers and the compaction threads.
+  virtual bool FullMerge(const Slice& key, const Slice* existing_value,
+                         const std::vector<Slice>& operands,
+                         std::string* new_value) const = 0;
+
+  // Combine the operands "left" and the newer "right" of "key" into the one
+  // operand *new_value that has the effect of both, if there is one. The
+  // compactions which do not see the value below the operands keep them
+  // apart if it returns false, which the default does.
+  virtual bool PartialMerge(const Slice& key, const Slice& left,
+                            const Slice& right, std::string* new_value) const;
+};
+
+// Adds up the operands with the value as unsigned 64 bit integers, encoded
+// as 8 bytes in little endian, wrapping around. A missing value counts as 0.
+// Named "dLSM.UInt64Add". The result must be deleted by the caller.
+dLSM_EXPORT const MergeOperator* NewUInt64AddOperator();
+
+// Make "merge_operator" selectable by its name on this node, replacing the
+// operator registered before under the same name. It is not owned and must
+// live as long as the node.
+dLSM_EXPORT void RegisterMergeOperator(const MergeOperator* merge_operator);
+
+// The operator registered under "name", or the built in one of that name,
+// or nullptr if there is none.
+dLSM_EXPORT const MergeOperator* FindMergeOperator(const std::string& name);
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_INCLUDE_MERGE_OPERATOR_H_
@@ -6,6 +6,7 @@
 #define STORAGE_dLSM_INCLUDE_OPTIONS_H_
 
 #include <cstddef>
+#include <vector>
 
 #include "dLSM/export.h"
 #include "table/format.h"
@@ -13,10 +14,16 @@
 namespace dLSM {
 
 class Cache;
+class CompactionFilter;
 class Comparator;
 class Env;
 class FilterPolicy;
 class Logger;
+class MemoryBudget;
+class MergeOperator;
+class RateLimiter;
+class SecondaryCache;
+class SliceTransform;
 class Snapshot;
 // The size for one SStable chunk
 //static size_t RDMA_WRITE_BLOCK = 2*1024*1024;
@@ -49,6 +56,65 @@ enum CompressionType {
   kSnappyCompression = 0x1
 };
 
+// The filter built for every table when bloom_bits is not zero. Both kinds
+// of filter can be read whatever the option is set to.
+enum FilterType {
+  // Cache local Bloom filter of bloom_bits bits per key.
+  kBloomFilter = 0x0,
+  // Binary fuse filter of about 9 bits per key whatever bloom_bits is, with
+  // a false positive rate of about 0.4% (Bloom needs ~13 bits per key).
+  kBinaryFuseFilter = 0x1
+};
+
+// How the files are picked for compaction.
+enum CompactionStyle {
+  // Every level is a sorted run about 10 times larger than the previous
+  // one, filled by the files of the previous level one at a time.
+  kCompactionStyleLevel = 0x0,
+  // Every level is a sorted run which is merged as a whole into the next
+  // level once it is about as large, which writes every byte about once
+  // per level but leaves levels of any size. Suits shards which write
+  // much more than they read.
+  kCompactionStyleTiered = 0x1,
+  // The tables stay where they are flushed and are never merged. The
+  // oldest are dropped whole, by a version edit and without reading them,
+  // once the tables hold more than fifo_max_table_files_size bytes or were
+  // flushed more than ttl seconds ago. Suits shards whose data expire.
+  kCompactionStyleFIFO = 0x2
+};
+
+// How a memtable keeps its entries.
+enum MemTableRep {
+  // A skiplist, sorted as the entries come.
+  kSkipListMemTable = 0x0,
+  // Hashed by user key, which makes a Get one bucket walk. The entries are
+  // only sorted for an iterator or the flush, so the scans of a memtable
+  // which takes writes sort it every time. Suits the shards read by Get.
+  kHashMemTable = 0x1,
+  // Appended to an array, the cheapest insert, and sorted by several
+  // threads at the flush. A Get looks at every entry. Suits bulk loads.
+  kVectorMemTable = 0x2
+};
+
+// The resources one shard of a DB may take on its compute node, so that a
+// burst of writes to one shard does not starve the others sharing the node.
+// 0 leaves a resource unlimited.
+struct dLSM_EXPORT ShardQuota {
+  // The bytes of the memtables of the shard, the mutable one and the
+  // immutables. A writer which fills the memtable waits while switching it
+  // would go over, until a flush of the shard frees some.
+  size_t memtable_bytes = 0;
+
+  // The flushes of the shard scheduled or running at once, out of the flush
+  // threads all the shards share.
+  int max_flushes = 0;
+
+  // The bytes per second the shard moves over RDMA: the blocks its reads
+  // fetch and the tables its flushes write. Can only be changed later for
+  // the shards opened with a budget.
+  int64_t rdma_bytes_per_second = 0;
+};
+
 // Options to control the behavior of a database (passed to DB::Open)
 // The options now do not support dynamically change.
 struct dLSM_EXPORT Options {
@@ -72,8 +138,52 @@ struct dLSM_EXPORT Options {
 
 
   int max_background_compactions = 12;//
+  // If positive, the flush and compaction pools keep this many threads and
+  // start more, up to max_background_flushes and max_background_compactions,
+  // while work waits for a thread. A thread idle for a while quits down to
+  // this many again. 0 keeps the maximum running all the time.
+  int min_background_threads = 0;
   int MaxSubcompaction = 12; // 1-1 setup is 12; M-M  12 as well
   bool usesubcompaction = true;
+  // A flush of many memtable bytes is split into up to this many key
+  // ranges, built by threads of their own into level 0 tables which do not
+  // overlap and are installed by one version edit.
+  int max_flush_partitions = 1;
+  // A flush takes up to this many of the immutable memtables waiting for a
+  // flush and merges them into the same tables, keeping only the entries
+  // the snapshots read, so that a burst of writes leaves fewer level 0
+  // files.
+  int max_memtables_per_flush = 4;
+  // If true, while more immutable memtables wait for a flush than the next
+  // flush takes, a background task merges the newest two of them into one,
+  // keeping only the entries the snapshots read, in a sorted array. An
+  // overwrite heavy workload then flushes fewer bytes and its reads search
+  // fewer memtables.
+  bool merge_immutables = false;
+  // If true, a flush sends the entries it keeps to the memory node of the
+  // shard, which builds the level 0 table, rather than building it on the
+  // compute node. A flush the memory node fails is built here, as is one
+  // with a value too large for a data chunk, which goes to blob chunks, see
+  // min_blob_size. Not with min_blob_size, and the flush is not split by
+  // max_flush_partitions.
+  bool offload_flush = false;
+  // If true, the SSTables this compute node builds for the shard go to the
+  // memory nodes in turn rather than all to the memory node of the shard,
+  // so that the scans and the compactions of one shard use the bandwidth
+  // of every memory node. A compaction whose inputs are not all on the
+  // memory node of the shard runs on this node. The memory node of the
+  // shard does not persist the tables on the others. Not with
+  // min_blob_size, whose values stay on the memory node of the table which
+  // wrote them.
+  bool stripe_tables = false;
+  // If true, concurrent writers are queued and the writer at the head of the
+  // queue merges the pending batches into one group before inserting them.
+  // Otherwise every writer inserts its own batch concurrently.
+  bool enable_group_commit = false;
+  // The threads applying the batches of DB::WriteAsync(), started with the
+  // first of them. While one of them applies a group of batches, another
+  // collects the next one.
+  int async_write_threads = 1;
   // If true, the database will be created if it is missing.
   bool create_if_missing = true;
 
@@ -109,21 +219,149 @@ struct dLSM_EXPORT Options {
   // Also, a larger write buffer will result in a longer recovery time
   // the next time the database is opened.
   // before 64MB
-  // deprecated: This should be revised as number of key value per memtable.
+  // The memtables aim at this size with adaptive_memtable_window.
   size_t write_buffer_size = 64 * 1024 * 1024;
 
+  // A memtable takes a fixed range of sequences, so that a writer finds its
+  // memtable without locking. If true, the range of a new memtable is sized
+  // after the bytes per sequence of the one before, to come close to
+  // write_buffer_size whatever the size of the values. Otherwise every
+  // memtable takes MEMTABLE_SEQ_SIZE sequences.
+  bool adaptive_memtable_window = true;
+
+  // If positive, a writer thread reserves this many sequences at a time and
+  // takes the sequences of its next writes from them, rather than from the
+  // counter all the writers share. A batch of as many entries or more still
+  // takes them from the counter, after the rest of the lease of its writer
+  // is skipped. The sequences a writer has not taken when the memtable
+  // switches are skipped too. GetSnapshot(), the reads without a snapshot,
+  // the flushes and the compactions then take a sequence below the ones the
+  // writers hold. Not used by the shards of a sharded DB.
+  size_t sequence_lease_size = 0;
+
+  // If true, every shard of a sharded DB takes its sequence numbers from a
+  // counter on its memory node, which all the compute nodes writing the
+  // shard share, with one RDMA fetch-and-add per batch. The sequences the
+  // other compute nodes took are skipped in the memtables of this one, so
+  // that the batches of all the writers of a shard are in one order. Each
+  // compute node still keeps its own memtables and version of the shard.
+  bool shard_sequencer = false;
+
+  // Bits per key of the bloom filter kept on every memtable, so that a Get
+  // can skip the memtables which do not have the key. 0 means no filter.
+  int memtable_bloom_bits_per_key = 0;
+
+  // If not 0, the arenas of the memtables take their blocks from huge pages
+  // of this size, e.g. 2MB, and cut the blocks of their writer threads to
+  // fit the pages. The huge pages have to be reserved in the system, without
+  // them the arenas fall back to malloc.
+  size_t memtable_huge_page_size = 0;
+
+  // If true, a Put whose value has the size of the newest value of its key
+  // in the active memtable overwrites that value in place instead of adding
+  // an entry, as long as no snapshot is held. This keeps the memtables of
+  // workloads overwriting the same keys small. The writes of a key, and the
+  // Gets and the iterators reading its entry, are serialized by one of
+  // inplace_update_num_locks locks, and the readers copy the value. An
+  // iterator over keys being updated in place may still see a value newer
+  // than its sequence, or miss the key.
+  bool inplace_update_support = false;
+  size_t inplace_update_num_locks = 10000;
+
+  // How the memtables keep their entries, see MemTableRep. The values are
+  // updated in place with kSkipListMemTable only.
+  MemTableRep memtable_rep = kSkipListMemTable;
+
+  // If above 1, an active kSkipListMemTable is split into that many
+  // skiplists, one per NUMA node of the compute node, and every writer
+  // inserts into the one of its socket. The memtable keeps one sequence
+  // window, a Get looks at every skiplist and the flush merges them into
+  // one table. Ignored with inplace_update_support. Without NUMA support
+  // compiled in the cores are spread over the skiplists.
+  // default : 1
+  int memtable_numa_partitions = 1;
+
   // Number of open files that can be used by the DB.  You may need to
   // increase this if your database has a large working set (budget
   // one open file per 2MB of working set).
   int max_open_files = 5000;
 
+  // If true, the cache of the open tables, and the table_meta_cache dLSM
+  // creates when it is null, are CLOCK caches with TinyLFU admission, see
+  // NewClockCache(). They scale better with many readers, and a long scan
+  // does not flush them.
+  // default : false
+  bool clock_cache = false;
+
   // Control over blocks (user data is stored in a set of blocks, and
   // a block is the unit of reading from disk).
 
   // If non-null, use the specified table_cache for blocks.
   // If null, dLSM will automatically create and use an 64MB internal table_cache.
+  // With BYTEADDRESSABLE, it caches the individual KV records read from the
+  // remote SSTables instead of blocks.
   Cache* block_cache = nullptr;
 
+  // If true, the compute node keeps only a small top level index of every
+  // table. The index partitions and the filter pages stay in the memory node
+  // and are read over RDMA when a lookup needs them, then kept in
+  // table_meta_cache, so that the index and filters of the tables do not
+  // have to fit in the compute node memory.
+  bool partitioned_table_meta = false;
+
+  // With partitioned_table_meta, only the tables of this level and the
+  // deeper ones keep their index and filter on the memory node. The tables
+  // of the upper levels, which most lookups probe, keep theirs whole in the
+  // compute node memory and are searched without a remote read. A table
+  // keeps the choice of the level it was opened at.
+  // default : 0, every table
+  int partitioned_table_meta_level = 0;
+
+  // If true, the tables a flush or a compaction writes are opened in the
+  // table cache before they are installed, with the index blocks and
+  // filters of all of them read in one batch of RDMA reads, so that the
+  // first lookups of a new table do not wait for its open.
+  // default : true
+  bool open_new_tables = true;
+
+  // If true, every table opened keeps a piecewise linear model of its
+  // index block next to it, which cuts the binary search of a lookup down to
+  // a few steps. It fits fixed width keys spread evenly over the key space,
+  // and needs the bytewise comparator. Ignored for the tables
+  // partitioned_table_meta partitions.
+  bool learned_table_index = false;
+
+  // If true, every byte addressable table opened keeps a hash table of its
+  // user keys next to its index block, so that a point lookup finds the
+  // entry of its key without a binary search, and a key the table does not
+  // hold costs no read at all. The ordered index still serves the
+  // iterators. Needs one index entry per record, see index_interval, and
+  // the bytewise comparator. Ignored for the tables
+  // partitioned_table_meta partitions.
+  bool hash_table_index = false;
+
+  // Approximate size of an index partition or a filter page.
+  size_t table_meta_partition_size = 4 * 1024;
+
+  // If non-null, cache for the index partitions and filter pages of
+  // partitioned_table_meta. If null, dLSM will automatically create and use
+  // an 64MB internal one.
+  Cache* table_meta_cache = nullptr;
+
+  // If non-null, the compute node keeps the index partitions and filter
+  // pages the table_meta_cache lets go, and with BYTEADDRESSABLE the KV
+  // records of the block_cache, on its local disk, and reads them from
+  // there instead of from the memory nodes. Its entries outlive a restart
+  // of the compute node, see NewFileSecondaryCache().
+  // default : nullptr
+  SecondaryCache* secondary_cache = nullptr;
+
+  // If not 0, the compute node remembers up to this many user keys that a
+  // Get() without snapshot found missing, and answers the next Get() of such
+  // a key without looking anywhere, until a write to the key. Meant for miss
+  // heavy workloads such as existence checks.
+  size_t negative_lookup_cache_size = 0;
+
   // Approximate size of user data packed per block.  Note that the
   // block size specified here corresponds to uncompressed data.  The
   // actual size of the unit read from disk may be smaller if
@@ -137,6 +375,27 @@ struct dLSM_EXPORT Options {
   // leave this parameter alone.
   int block_restart_interval = 1;
 
+  // With BYTEADDRESSABLE, the number of consecutive KV records an index
+  // entry covers. A Get() reads the whole group in one RDMA read and
+  // searches it, and the keys of the index are prefix compressed, which
+  // cuts the index the compute node keeps by about this factor. A group
+  // ends early at a chunk of the table or at block_size bytes. 1 keeps an
+  // entry per record.
+  int index_interval = 1;
+
+  // With a sparse index, see index_interval, key the entry of a group by a
+  // short key between its last key and the first key of the next group,
+  // see Comparator::FindShortestSeparator(), rather than by its last key.
+  bool index_key_separators = false;
+
+  // With BYTEADDRESSABLE, the number of index entries between the restarts
+  // of the prefix compression of the index keys. With an entry per record,
+  // more than 1 stores the keys after a restart as the bytes they do not
+  // share with the key before, mostly the sequence number, at the cost of
+  // hash_table_index and of a short scan per seek. 0 picks 1 for an entry
+  // per record, and 16 for a sparse index.
+  int index_restart_interval = 0;
+
   // dLSM will write up to this amount of bytes to a file before
   // switching to a new one.
   // Most clients should leave this parameter alone.  However if your
@@ -148,6 +407,11 @@ struct dLSM_EXPORT Options {
   //default 64MB
   size_t max_file_size = 64 * 1024 * 1024;
 
+  // The tables a compaction writes to level L (L >= 1) are cut at
+  // max_file_size * max_file_size_multiplier^(L-1) bytes, so that the
+  // deeper levels are made of fewer and larger tables.
+  int max_file_size_multiplier = 1;
+
   // Compress blocks using the specified compression algorithm.  This
   // parameter can be changed dynamically.
   //
@@ -164,6 +428,37 @@ struct dLSM_EXPORT Options {
   // efficiently detect that and will switch to uncompressed mode.
   CompressionType compression = kNoCompression;
 
+  // With BYTEADDRESSABLE, "compression" compresses the values of the tables
+  // of this level and the deeper ones one by one, so that a record is still
+  // read alone. The levels above take the most reads and may be kept raw.
+  // A value stays raw if compressing it does not save an eighth of it.
+  int compression_start_level = 0;
+
+  // With BYTEADDRESSABLE, a record whose key is shorter than 256 bytes and
+  // whose value is shorter than 4MB stores both sizes in a single fixed32
+  // rather than two. It saves 4 bytes a record in the remote memory and in
+  // every read, which counts with small fixed width keys such as the 20
+  // byte keys of db_bench. The tables tell both layouts apart, so the
+  // option may change between runs.
+  bool packed_kv_records = true;
+
+  // With BYTEADDRESSABLE, every record the tables are built with is
+  // followed by a crc32c of its header, key and value, 4 bytes more and no
+  // packed header. ReadOptions::verify_checksums checks it on the reads and
+  // scans, the compactions on the memory nodes always do. The tables tell
+  // the records with and without apart, so the option may change between
+  // runs.
+  bool kv_checksums = false;
+
+  // The values of at least this many bytes are written to chunks of remote
+  // memory of their own at the flush and by IngestSorted(), the tables keep
+  // where they are. The compactions then move only the keys, while a read
+  // of such a value takes one more RDMA read. A value too large for a data
+  // chunk of a table is always written this way, over as many chunks as it
+  // takes.
+  // 0 keeps all the other values in the tables.
+  size_t min_blob_size = 0;
+
   // EXPERIMENTAL: If true, append to existing MANIFEST and log files
   // when a database is opened.  This can significantly speed up open.
   //
@@ -171,12 +466,239 @@ struct dLSM_EXPORT Options {
   bool reuse_logs = false;
 
   bool near_data_compaction = true;
+  // The compactions of the shards with compactions waiting at a memory node
+  // take turns for its threads, this many of this shard's at a turn. The
+  // level 0 compactions go ahead of the deeper ones, and those of a shard
+  // whose writes are slowed down ahead of all. 1 to 255.
+  int compaction_share = 1;
+  // default : kCompactionStyleLevel
+  CompactionStyle compaction_style = kCompactionStyleLevel;
+  // With kCompactionStyleTiered, a level is merged into the next one once
+  // the next one is at most this many percent larger than it.
+  // default : 1
+  int tiered_size_ratio = 1;
+  // If positive, one in this many Get()s which reach the tables charges
+  // every table that read a data block in vain, its filter passed but the
+  // key was not there, as many reads, and the iterators charge the first
+  // of the tables overlapping a key they sample. A table charged about one
+  // read per 16KB of its size is compacted into the next level, even when
+  // no level is too large. 0 turns the charges off.
+  // default : 0
+  int read_compaction_sample = 0;
+  // If positive, with kCompactionStyleLevel a deletion counts as two
+  // entries in the size of a level, and a level with a table whose share
+  // of deletions is at least this is compacted even when it is not too
+  // large, that table first. The deletions reaching the deepest level
+  // holding the key are dropped.
+  // default : 0
+  double tombstone_compaction_ratio = 0;
+  // If true, with kCompactionStyleLevel the target sizes of the levels
+  // follow the size of the deepest level rather than growing from a fixed
+  // level 1: every level is a tenth of the one below it, and the levels
+  // which would be smaller than a tenth of the fixed level 1 size hold
+  // nothing, their tables are moved on down. Most of the data then sits in
+  // the deepest level whatever its size, which keeps the writes of the
+  // compactions near the least the level ratio allows.
+  // default : false
+  bool dynamic_level_bytes = false;
+  // With kCompactionStyleFIFO, the oldest tables are dropped once all the
+  // tables hold more bytes than this.
+  // default : 1GB
+  uint64_t fifo_max_table_files_size = 1024ull * 1024 * 1024;
+  // If positive, with kCompactionStyleFIFO the tables flushed more than
+  // this many seconds ago are dropped too. The ages are checked whenever
+  // the version changes, so at every flush.
+  // default : 0
+  uint64_t ttl = 0;
+  // If non-null, the table writes of the flushes and the compactions are
+  // throttled by it, the flushes first. Foreground Gets report their
+  // latency to it. The memory node applies its own to the tables its
+  // compactions build and to the tables it persists.
+  // default : nullptr
+  RateLimiter* rate_limiter = nullptr;
+  // If non-null, the blocks the tables read over RDMA and the tables the
+  // flushes write are charged to it as well, the reads at high priority.
+  // Every shard opened with shard_quota.rdma_bytes_per_second has its own.
+  // default : nullptr
+  RateLimiter* rdma_limiter = nullptr;
+  // If non-null, the memory of the DB on the compute node is counted with
+  // the one of every other DB and shard opened with the same budget, and
+  // taken back when their sum goes over it, see MemoryBudget. Must come
+  // from NewMemoryBudget().
+  // default : nullptr
+  MemoryBudget* memory_budget = nullptr;
+  // If true, the function which allocated every slot of the registered
+  // local pools is recorded until the slot is released, and
+  // "dLSM.rdma-pools" counts the slots held per function, to find the ones
+  // which leak. It costs a lock per allocation and release. It applies to
+  // every DB sharing the Env.
+  // default : false
+  bool track_rdma_slots = false;
+  // If true, a local pool with less than a tenth of its slots free gets a
+  // region registered ahead of the allocations which would wait for it, and
+  // a pool less than half used gives its empty regions back. It applies to
+  // every DB sharing the Env.
+  // default : false
+  bool resize_rdma_pools = false;
+  // If true, the remote slots are taken from the first regions with free
+  // ones, and the empty regions at the end are given back to the memory
+  // nodes for the other compute nodes, as long as a quarter of a region
+  // stays free. It applies to every DB sharing the Env.
+  // default : false
+  bool release_remote_regions = false;
+  // If true, a read, or a write of a flush or of a compaction, polls its
+  // RDMA completion for rdma_busy_poll_micros at most and then sleeps on a
+  // completion channel, which frees the core when the client threads
+  // outnumber the cores. Otherwise it spins until the completion arrives.
+  // The queue pairs connected before the DB is opened keep spinning. It
+  // applies to every DB sharing the Env.
+  // default : false
+  bool adaptive_read_polling = false;
+  bool adaptive_flush_polling = false;
+  bool adaptive_compaction_polling = false;
+  // The polls before an adaptive wait sleeps, see adaptive_read_polling.
+  // default : 50
+  uint32_t rdma_busy_poll_micros = 50;
+  // If non-null, the compactions drop the values it filters out. The memory
+  // node uses the filter it has registered under the same name, see
+  // dLSM/compaction_filter.h.
+  // default : nullptr
+  const CompactionFilter* compaction_filter = nullptr;
+  // If non-null, the filters of the tables hold the prefixes it extracts
+  // from the user keys along with the keys, for the iterators of
+  // ReadOptions::iterate_prefix. The memory node uses the extractor of the
+  // same name, see dLSM/slice_transform.h.
+  // default : nullptr
+  const SliceTransform* prefix_extractor = nullptr;
+  // If non-null, DB::Merge() writes operands which it applies to the values
+  // of their keys. The memory node uses the operator of the same name, see
+  // dLSM/merge_operator.h.
+  // default : nullptr
+  const MergeOperator* merge_operator = nullptr;
   // If non-null, use the specified filter policy to reduce disk reads.
   // Many applications will benefit from passing the result of
   // NewBloomFilterPolicy() here.
   const FilterPolicy* filter_policy = nullptr;
   // default : 10
   int bloom_bits = 10;
+  // The kind of filter built with bloom_bits.
+  // default : kBloomFilter
+  FilterType filter_type = kBloomFilter;
+  // If not empty, the bloom filters of the tables of level i get entry i
+  // bits per key instead of bloom_bits, the deeper levels the last entry.
+  // default : empty
+  std::vector<int> bloom_bits_per_level;
+  // If true and bloom_bits_per_level is empty, the bits of the filters of
+  // every level are worked out from the sizes of the levels down to the
+  // deepest one holding tables, so that the filters take as much memory as
+  // bloom_bits bits per key everywhere, but a read of a missing key costs
+  // the fewest RDMA reads of data blocks expected: the deep levels, which
+  // hold most of the keys, get fewer bits per key than the shallow ones. A
+  // level gets at least 1 and at most 2 * bloom_bits bits per key.
+  // Each filter records its own probes, so the tables written before a
+  // change of the bits are still read.
+  // default : false
+  bool adaptive_bloom_bits = false;
+  // If positive, the tables a near-data compaction writes to this level or
+  // a deeper one are moved to the disk of the memory node, which keeps only
+  // their index and filter in its registered memory. Their data blocks are
+  // read through the memory node, and the hottest of them are loaded back
+  // into its memory. The memory node needs a cold storage directory, see
+  // Memory_Node_Keeper::SetColdStorage(), otherwise this is ignored.
+  // default : 0
+  int cold_level = 0;
+  // If positive and there is more than one memory node, the data chunks of
+  // the tables of the levels below this one are copied to a second memory
+  // node in the background, and the point reads of a table go to whichever
+  // of the two has answered faster of late. It takes the read load of the
+  // hot levels off a single NIC, not a copy to recover from.
+  // default : 0
+  int replicated_levels = 0;
+  // If positive, the tables of this level and the deeper ones are protected
+  // by parity rather than copies, see db/parity_stripes.h: the data chunks
+  // of erasure_code_width tables on as many memory nodes are XORed into
+  // chunks on one more memory node, and a read from a memory node which
+  // failed is rebuilt from them. It takes more memory nodes than
+  // erasure_code_width, holding the tables of several shards, and the chunks
+  // of a table are only freed with the last table of its stripe.
+  // default : 0
+  int erasure_coded_level = 0;
+  // default : 3
+  int erasure_code_width = 3;
+  // If not 0, every shard keeps a write-ahead log of this many bytes in the
+  // memory of its memory node, and a write returns once its batch is there.
+  // DB::Open() replays the batches a previous run left unflushed in it. The
+  // log has to hold the batches of all the memtables not flushed yet, while
+  // it is full the writers wait for a flush.
+  // default : 0
+  size_t remote_log_size = 0;
+
+  // The threads which replay the remote log when the DB is opened, see
+  // remote_log_size. The batches take their sequences in the order of the
+  // log and are inserted into their memtables side by side, which are
+  // flushed in the background as they fill. With more than one, the shards
+  // of a sharded DB are opened side by side as well.
+  // default : 1
+  int log_replay_threads = 1;
+
+  // While the flushes and the compactions fall behind, the writes are paced
+  // at the rate the flushes are measured to write, slower as they fall
+  // further behind. This is the rate in bytes per second assumed before the
+  // first flush.
+  // default : 16MB/s
+  uint64_t delayed_write_rate = 16 * 1024 * 1024;
+
+  // The writes of a shard are paced once its compactions are estimated to
+  // have this many bytes to write before every level is within its target
+  // size, as hard as they are at kL0_StopWritesTrigger from the hard limit
+  // on. See the "dLSM.compaction-debt" property. 0 disables the pacing.
+  // default : 64GB and 256GB
+  uint64_t soft_pending_compaction_bytes_limit = 64ull << 30;
+  uint64_t hard_pending_compaction_bytes_limit = 256ull << 30;
+
+  // If positive and ShardInfo is null, the DB is split into this many shards
+  // by the hash of the keys instead of by key ranges, which spreads the
+  // writes of sequential keys over all of them. The iterators merge the
+  // shards. FilteredScan(), the ordered ParallelScan() and the splits and
+  // merges of the shards are not supported.
+  // default : 0
+  int hash_shards = 0;
+
+  // If not 0, every shard publishes its version edits in a ring of this many
+  // bytes on its memory node, which the read replicas of the shard on the
+  // other compute nodes follow. The ring has to hold two snapshots of all
+  // the files of the shard.
+  // default : 0
+  size_t replica_edit_log_size = 0;
+
+  // How long the shards which publish their edits keep the tables the edits
+  // remove, so that the replicas finish the reads of the versions they
+  // still have. It has to be longer than replica_refresh_micros plus the
+  // longest read, or iterator, on the replicas. A replica whose last
+  // refresh is older than this fails its reads until it catches up.
+  // default : 1s
+  uint64_t replica_retire_micros = 1000000;
+
+  // If not 0, the DB is a read replica of the DB of this compute node, whose
+  // options have the same shards and set replica_edit_log_size. It reads
+  // the tables of the owner from the memory nodes and takes no writes. The
+  // reads may lag the owner by replica_refresh_micros.
+  // default : 0
+  int replica_owner_node_id = 0;
+
+  // How often a read replica catches up with the edits of the owner.
+  // default : 10ms
+  uint64_t replica_refresh_micros = 10000;
+
+  // Whether a read replica also reads the batches of the owner which are in
+  // its remote log but not flushed yet, see remote_log_size, so that its
+  // reads do not miss the memtables of the owner.
+  // default : false
+  bool replica_read_tail = false;
+
+  // The quota of every shard, of the DB if it is not sharded.
+  // DBImpl_Sharding::SetShardQuota() changes it for one shard.
+  ShardQuota shard_quota;
 
   std::vector<std::pair<Slice,Slice>>* ShardInfo = nullptr;// [Lower bound, upper bound)
 };
@@ -198,6 +720,73 @@ struct dLSM_EXPORT ReadOptions {
   // not have been released).  If "snapshot" is null, use an implicit
   // snapshot of the state at the beginning of this read operation.
   const Snapshot* snapshot = nullptr;
+
+  // If true, a Get reads all the SSTables which pass the filter check
+  // concurrently instead of one after another, and keeps the answer of the
+  // newest one. This trades remote read bandwidth for fewer round trips.
+  bool parallel_probe = false;
+
+  // If positive, a MultiGet keeps the reads of up to this many of its keys
+  // in flight on the calling thread, and every key goes on to its next
+  // SSTable as soon as its own read completes, rather than all the keys
+  // probing their SSTables round by round. The reads are posted one by
+  // one instead of chained per memory node.
+  int pipeline_depth = 0;
+
+  // The most prefetch windows, of 1MB each, that a sequential iterator of
+  // the byte addressable format keeps in flight ahead of its cursor. It
+  // starts with one and goes deeper whenever the cursor catches up with the
+  // reads, up to the rest of the current chunk and the whole next one.
+  int max_readahead_windows = 8;
+
+  // If non-null, an iterator only returns the user keys at or after
+  // "*iterate_lower_bound" and before "*iterate_upper_bound". The files out
+  // of the bounds are not read at all, and a sequential iterator of the byte
+  // addressable format does not read ahead past them. The slices must
+  // outlive the iterator.
+  const Slice* iterate_lower_bound = nullptr;
+  const Slice* iterate_upper_bound = nullptr;
+
+  // If true, an iterator returns the keys with empty values. The index of
+  // a table of the byte addressable format holds every key, so the keys
+  // are read from it and no data chunk is read. Otherwise the data blocks
+  // are read as usual.
+  bool keys_only = false;
+
+  // If non-null, an iterator is only for the user keys of which
+  // Options::prefix_extractor extracts "*iterate_prefix". The tables whose
+  // filters rule the prefix out are skipped before their iterators are
+  // created. With the bytewise comparator the iterator is bounded to the
+  // range of the prefix unless the bounds above are set, otherwise the
+  // caller stops at the end of the prefix. The slice must outlive the
+  // iterator.
+  const Slice* iterate_prefix = nullptr;
+
+  // If true, a Get() resets the PerfContext of the calling thread and
+  // records the time of its phases in it, see dLSM/perf_context.h. It costs
+  // a few clock reads per table probed.
+  bool perf_context = false;
+
+  // If positive, an iterator moving forward lets go of the memtables and
+  // the SSTables it holds every this many keys, or every this many
+  // microseconds, by refreshing itself and seeking back to its current key,
+  // so that a long scan does not keep the obsolete ones from being freed.
+  // Without a snapshot, the keys after a refresh are read as of the
+  // refresh.
+  uint64_t auto_refresh_keys = 0;
+  uint64_t auto_refresh_micros = 0;
+
+  // If not 0, a Get gives up with Status::TimedOut() once Env::NowMicros()
+  // passes it. The reads of the table data it waits for are abandoned at
+  // the deadline, the lookups in memory are not interrupted.
+  uint64_t deadline = 0;
+
+  // If positive, a read of a table copied to a second memory node, see
+  // Options::replicated_levels, which has not completed after this
+  // percentile of the latencies of the recent reads from its node is sent
+  // to the other copy as well, and the first to answer is used. 99 costs
+  // about 1% more reads for a shorter tail.
+  double hedge_percentile = 0;
 };
 
 
@@ -220,6 +809,12 @@ struct dLSM_EXPORT WriteOptions {
   // with sync==true has similar crash semantics to a "write()"
   // system call followed by "fsync()".
   bool sync = false;
+
+  // If true, the inserts of the write into the memtable start from where
+  // the last write of this thread with the flag ended, rather than from the
+  // head of the skiplist. It pays off for a thread writing its keys in
+  // order, e.g. time ordered keys, and costs a little for random keys.
+  bool memtable_insert_hint = false;
 };
 
 }  // namespace dLSM
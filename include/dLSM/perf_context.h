@@ -0,0 +1,64 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A PerfContext breaks the time of a single Get() down into its phases, for
+// the logging of the slow queries. It is kept per thread and only filled in
+// for the reads with ReadOptions::perf_context set, which reset it first:
+//
+//   ReadOptions options;
+//   options.perf_context = true;
+//   db->Get(options, key, &value);
+//   if (dLSM::GetPerfContext()->get_nanos > threshold) {
+//     log(dLSM::GetPerfContext()->ToString());
+//   }
+
+#ifndef STORAGE_dLSM_INCLUDE_PERF_CONTEXT_H_
+#define STORAGE_dLSM_INCLUDE_PERF_CONTEXT_H_
+
+#include <cstdint>
+#include <string>
+
+#include "dLSM/export.h"
+
+namespace dLSM {
+
+struct dLSM_EXPORT PerfContext {
+  void Reset();
+  // The non-zero counters as "name = value" pairs.
+  std::string ToString() const;
+
+  // The whole Get().
+  uint64_t get_nanos;
+  // The search of the mutable memtable.
+  uint64_t memtable_nanos;
+  // The immutable memtables searched, and the time of all of them.
+  uint64_t imm_searched;
+  uint64_t imm_nanos;
+  // The SSTables whose key range holds the key, and the time spent on them
+  // from the table cache lookup to the value.
+  uint64_t files_probed;
+  uint64_t files_nanos;
+  // The filter checks, and the ones which ruled the table out.
+  uint64_t filter_checks;
+  uint64_t filter_negatives;
+  uint64_t filter_nanos;
+  // The searches of the index of a table for the block or the record.
+  uint64_t index_searches;
+  uint64_t index_nanos;
+  // The reads of data blocks or records from the remote memory, or from the
+  // disk of a memory node for the cold tables, and the wait for them.
+  uint64_t rdma_reads;
+  uint64_t rdma_bytes;
+  uint64_t rdma_wait_nanos;
+  // The reads answered by the other copy of a table after they were
+  // hedged, see ReadOptions::hedge_percentile.
+  uint64_t hedged_reads_won;
+};
+
+// The PerfContext of the calling thread.
+dLSM_EXPORT PerfContext* GetPerfContext();
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_INCLUDE_PERF_CONTEXT_H_
@@ -0,0 +1,60 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A RateLimiter bounds the bytes per second the background jobs write, so
+// that flushes and compactions leave the NIC and the memory bandwidth to the
+// foreground reads. It has internal synchronization and may be safely
+// shared by all the background threads of a node.
+
+#ifndef STORAGE_dLSM_INCLUDE_RATE_LIMITER_H_
+#define STORAGE_dLSM_INCLUDE_RATE_LIMITER_H_
+
+#include <cstdint>
+
+#include "dLSM/export.h"
+
+namespace dLSM {
+
+class dLSM_EXPORT RateLimiter {
+ public:
+  // Flushes go first, since the writers stall when they fall behind.
+  enum Priority { kHigh = 0, kLow = 1, kNumPriorities = 2 };
+
+  RateLimiter() = default;
+
+  RateLimiter(const RateLimiter&) = delete;
+  RateLimiter& operator=(const RateLimiter&) = delete;
+
+  virtual ~RateLimiter();
+
+  // Wait until "bytes" more bytes can be written at the current rate.
+  virtual void Request(int64_t bytes, Priority priority) = 0;
+
+  // Report the latency of a foreground read. The rate goes down while the
+  // average latency is above the target and back up once it is not.
+  virtual void ReportForegroundLatency(uint64_t micros) = 0;
+
+  // The rate the writes are currently limited to.
+  virtual int64_t GetBytesPerSecond() const = 0;
+
+  // Change the rate, the one the tuning stays at or below.
+  virtual void SetBytesPerSecond(int64_t bytes_per_second) = 0;
+
+  // The bytes requested so far at "priority".
+  virtual int64_t GetTotalBytesThrough(Priority priority) const = 0;
+
+  // The average foreground latency reported so far.
+  virtual uint64_t GetForegroundLatency() const = 0;
+};
+
+// Create a rate limiter of "bytes_per_second". If
+// "foreground_latency_target_micros" is not zero, the rate is tuned between
+// 1/16 of "bytes_per_second" and "bytes_per_second" so that the foreground
+// latency stays below the target.
+dLSM_EXPORT RateLimiter* NewRateLimiter(
+    int64_t bytes_per_second, uint64_t foreground_latency_target_micros = 0);
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_INCLUDE_RATE_LIMITER_H_
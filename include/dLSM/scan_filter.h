@@ -0,0 +1,46 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A ScanFilter selects, and may rewrite, the entries of DB::FilteredScan().
+// The scan runs on the memory node over the SSTables and on the compute node
+// over the memtables, so the filter lives on both: the binaries register it
+// by name with RegisterScanFilter() and the scan selects it by its Name().
+
+#ifndef STORAGE_dLSM_INCLUDE_SCAN_FILTER_H_
+#define STORAGE_dLSM_INCLUDE_SCAN_FILTER_H_
+
+#include <string>
+
+#include "dLSM/export.h"
+#include "dLSM/slice.h"
+
+namespace dLSM {
+
+class dLSM_EXPORT ScanFilter {
+ public:
+  virtual ~ScanFilter();
+
+  // The name the filter is registered and selected by.
+  virtual const char* Name() const = 0;
+
+  // Return true to keep the latest value of "key" in the scan. The scan
+  // returns *new_value instead of "value" if *value_changed is set, e.g. to
+  // keep only some of its fields.
+  //
+  // Called concurrently by the scans.
+  virtual bool Filter(const Slice& key, const Slice& value,
+                      std::string* new_value, bool* value_changed) const = 0;
+};
+
+// Make "filter" selectable by its name on this node, replacing the filter
+// registered before under the same name. The filter is not owned and must
+// live as long as the node.
+dLSM_EXPORT void RegisterScanFilter(const ScanFilter* filter);
+
+// The filter registered under "name", or nullptr if there is none.
+dLSM_EXPORT const ScanFilter* FindScanFilter(const std::string& name);
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_INCLUDE_SCAN_FILTER_H_
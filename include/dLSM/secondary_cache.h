@@ -0,0 +1,63 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A SecondaryCache keeps what the compute node read from the memory nodes on
+// its local disk, see Options::secondary_cache: the filter pages and index
+// partitions of Options::partitioned_table_meta, and with BYTEADDRESSABLE
+// the KV records. A miss of the block cache or of the table meta cache looks
+// there before it reads over RDMA. The entries are keyed by the table and
+// the remote address, which stay the same when the process restarts, so a
+// restarted compute node starts with a warm cache.
+//
+// It has internal synchronization and may be safely shared by all the DBs
+// of a node. It must outlive them.
+
+#ifndef STORAGE_dLSM_INCLUDE_SECONDARY_CACHE_H_
+#define STORAGE_dLSM_INCLUDE_SECONDARY_CACHE_H_
+
+#include <cstddef>
+#include <string>
+
+#include "dLSM/export.h"
+#include "dLSM/slice.h"
+#include "dLSM/status.h"
+
+namespace dLSM {
+
+class dLSM_EXPORT SecondaryCache {
+ public:
+  SecondaryCache() = default;
+
+  SecondaryCache(const SecondaryCache&) = delete;
+  SecondaryCache& operator=(const SecondaryCache&) = delete;
+
+  virtual ~SecondaryCache();
+
+  // Copy "value" under "key". It is written in the background and the
+  // Lookup()s before that miss it. May drop it if the writes fall behind.
+  virtual void Insert(const Slice& key, const Slice& value) = 0;
+
+  // Store the value of "key" in *value and return true, or return false if
+  // the cache does not hold it.
+  virtual bool Lookup(const Slice& key, std::string* value) = 0;
+
+  virtual void Erase(const Slice& key) = 0;
+
+  // The bytes of the entries held.
+  virtual size_t GetUsage() const = 0;
+
+  // The usage, the hits and misses and the inserts written and dropped.
+  virtual std::string ToString() const = 0;
+};
+
+// Create a cache of about "capacity" bytes in the files of the directory
+// "dir", which is created if missing, and load the entries the files hold
+// from a previous run.
+dLSM_EXPORT Status NewFileSecondaryCache(const std::string& dir,
+                                         size_t capacity,
+                                         SecondaryCache** cache);
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_INCLUDE_SECONDARY_CACHE_H_
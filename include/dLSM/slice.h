@@ -20,6 +20,7 @@
 #include <cstring>
 #include <string>
 
+#include "dLSM/cleanable.h"
 #include "dLSM/export.h"
 
 namespace dLSM {
@@ -120,6 +121,65 @@ inline int Slice::compare(const Slice& b) const {
   }
   return r;
 }
+// A Slice which keeps the memory it refers to alive. The data is either
+// pinned, in which case it stays where it was found (a memtable or a data
+// block) until the registered cleanups run, or copied to a buffer owned by
+// the PinnableSlice. Reset() or destroy it to release the pin.
+class dLSM_EXPORT PinnableSlice : public Slice, public Cleanable {
+ public:
+  PinnableSlice() : buf_(&self_space_) {}
+  // Copies go to *buf, which must outlive the PinnableSlice.
+  explicit PinnableSlice(std::string* buf) : buf_(buf) {}
+
+  PinnableSlice(const PinnableSlice&) = delete;
+  PinnableSlice& operator=(const PinnableSlice&) = delete;
+
+  // Refer to s, whose memory is released by (*f)(arg1, arg2).
+  void PinSlice(const Slice& s, CleanupFunction f, void* arg1, void* arg2) {
+    assert(!pinned_);
+    pinned_ = true;
+    Slice::operator=(s);
+    RegisterCleanup(f, arg1, arg2);
+  }
+
+  // Refer to s, whose memory is released by the cleanups of cleanable,
+  // which move to this object.
+  void PinSlice(const Slice& s, Cleanable* cleanable) {
+    assert(!pinned_);
+    pinned_ = true;
+    Slice::operator=(s);
+    cleanable->DelegateCleanupsTo(this);
+  }
+
+  // Copy s to the buffer.
+  void PinSelf(const Slice& s) {
+    assert(!pinned_);
+    buf_->assign(s.data(), s.size());
+    Slice::operator=(*buf_);
+  }
+
+  // Refer to the buffer, after it has been filled through GetSelf().
+  void PinSelf() {
+    assert(!pinned_);
+    Slice::operator=(*buf_);
+  }
+
+  std::string* GetSelf() { return buf_; }
+
+  bool IsPinned() const { return pinned_; }
+
+  void Reset() {
+    Cleanable::Reset();
+    pinned_ = false;
+    clear();
+  }
+
+ private:
+  std::string self_space_;
+  std::string* buf_;
+  bool pinned_ = false;
+};
+
 struct SliceParts {
   SliceParts(const Slice* _parts, int _num_parts)
       : parts(_parts), num_parts(_num_parts) {}
@@ -0,0 +1,52 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A SliceTransform maps a user key to its prefix, see
+// Options::prefix_extractor. The SSTables are built on both the compute and
+// the memory nodes, so the extractor lives on both. The built in ones are
+// known everywhere by their names, others have to be registered with
+// RegisterSliceTransform() on the memory node too.
+
+#ifndef STORAGE_dLSM_INCLUDE_SLICE_TRANSFORM_H_
+#define STORAGE_dLSM_INCLUDE_SLICE_TRANSFORM_H_
+
+#include <cstddef>
+#include <string>
+
+#include "dLSM/export.h"
+#include "dLSM/slice.h"
+
+namespace dLSM {
+
+class dLSM_EXPORT SliceTransform {
+ public:
+  virtual ~SliceTransform();
+
+  // The name the extractor is selected by. The filter of a table is only
+  // used for the prefixes of the extractor of the same name.
+  virtual const char* Name() const = 0;
+
+  // Whether "key" has a prefix.
+  virtual bool InDomain(const Slice& key) const = 0;
+
+  // The prefix of "key", which is InDomain(). The keys of a prefix have to
+  // be adjacent in the order of the comparator.
+  virtual Slice Transform(const Slice& key) const = 0;
+};
+
+// The first "prefix_len" bytes of the keys at least as long, named
+// "dLSM.FixedPrefix.<prefix_len>". The result must be deleted by the caller.
+dLSM_EXPORT const SliceTransform* NewFixedPrefixTransform(size_t prefix_len);
+
+// Make "transform" selectable by its name on this node. It is not owned and
+// must live as long as the node.
+dLSM_EXPORT void RegisterSliceTransform(const SliceTransform* transform);
+
+// The extractor registered under "name", or the built in one of that name,
+// or nullptr if there is none.
+dLSM_EXPORT const SliceTransform* FindSliceTransform(const std::string& name);
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_INCLUDE_SLICE_TRANSFORM_H_
@@ -7,7 +7,10 @@
 
 #include <cstdint>
 #include <memory>
+#include <string>
+#include <vector>
 
+#include "dLSM/cache.h"
 #include "dLSM/export.h"
 #include "dLSM/iterator.h"
 #include "db/version_edit.h"
@@ -35,8 +38,11 @@ class dLSM_EXPORT Table {
     }
     ~Rep() {
       delete filter;
+      delete partitioned_filter;
       //    delete[] filter_data;
       delete index_block;
+      delete learned_index;
+      delete hash_index;
     }
 
     Options options;
@@ -50,6 +56,22 @@ class dLSM_EXPORT Table {
 
     BlockHandle metaindex_handle;  // Handle to metaindex_block: saved from footer
     Block* index_block;
+    // With Options::partitioned_table_meta, index_block and filter are null.
+    // The index is cut into partitions read on demand: partition_keys[i] is
+    // the last key of partition i and partition_handles[i] the encoded
+    // BlockHandle of its entries within the index block.
+    std::vector<std::string> partition_keys;
+    std::vector<std::string> partition_handles;
+    PartitionedFilterBlockReader* partitioned_filter = nullptr;
+    // Options::learned_table_index: the model of index_block.
+    LearnedIndex* learned_index = nullptr;
+    // Options::hash_table_index: the user keys of index_block.
+    HashIndex* hash_index = nullptr;
+    uint64_t meta_cache_id = 0;
+    size_t filter_size = 0;
+    // With BYTEADDRESSABLE, whether an index entry covers several records,
+    // see Options::index_interval.
+    bool sparse_index = false;
 #ifdef BYTEADDRESSABLE
 //    Iterator* index_iter;
 //    ThreadLocalPtr* mr_addr;
@@ -70,6 +92,15 @@ class dLSM_EXPORT Table {
   static Status Open(const Options& options, Table** table,
                      const std::shared_ptr<RemoteMemTableMetaData>& Remote_table_meta);
 
+  // Same as Open() for every table of "metas", except that the index blocks
+  // and filters of all of them are read in one batch of RDMA reads per
+  // memory node. Sets (*tables)[i] and (*statuses)[i] as Open() would for
+  // metas[i].
+  static void OpenBatch(
+      const Options& options,
+      const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& metas,
+      std::vector<Table*>* tables, std::vector<Status>* statuses);
+
   Table(const Table&) = delete;
   Table& operator=(const Table&) = delete;
 
@@ -90,6 +121,10 @@ class dLSM_EXPORT Table {
   // E.g., the approximate offset of the last key in the table will
   // be close to the file length.
   uint64_t ApproximateOffsetOf(const Slice& key) const;
+
+  // The bytes the table keeps in memory while it is open: its index block,
+  // its filter and the models of its index.
+  size_t ApproximateMemoryUsage() const;
   Rep* const rep;
 
   static Slice KVReader(void*, const ReadOptions&, const Slice&);
@@ -99,17 +134,82 @@ class dLSM_EXPORT Table {
 //  struct Rep;
 
   static Iterator* BlockReader(void*, const ReadOptions&, const Slice&);
+  static Iterator* IndexPartitionReader(void*, const ReadOptions&,
+                                        const Slice&);
+  static Cache::Handle* FilterPageReader(void*, uint32_t page_index,
+                                         Slice* page);
   explicit Table(Rep* rep) : rep(rep) {}
 
   // Calls (*handle_result)(arg, ...) with the entry found after a call
   // to Seek(key).  May not make such a call if filter policy says
-  // that key is not present.
+  // that key is not present. If pinned is not null, it is given the
+  // cleanups which release the memory of the entry, which then stays valid
+  // after the call.
   Status InternalGet(const ReadOptions&, const Slice& key, void* arg,
                      void (*handle_result)(void* arg, const Slice& k,
-                                           const Slice& v));
+                                           const Slice& v),
+                     Cleanable* pinned = nullptr);
+
+  // InternalGet() split in two for TableCache::MultiGet(). PrepareGet()
+  // runs the filter and the index search, return true and set *handle if the
+  // entry has to be fetched from the remote memory. Otherwise the lookup is
+  // already finished (filtered out or served by the block cache).
+  // "filtered" skips the filter, which FiltersMayMatch() passed the key.
+  bool PrepareGet(const ReadOptions&, const Slice& key, void* arg,
+                  void (*handle_result)(void* arg, const Slice& k,
+                                        const Slice& v),
+                  BlockHandle* handle, Status* s, bool filtered = false);
+  // Whether the filter, if any, lets each of user_keys[0..n-1] through, into
+  // results[0..n-1]. A full filter probes the keys in batches.
+  void FiltersMayMatch(const Slice* user_keys, size_t n, bool* results) const;
+  // Finish the lookup on the "data" read from the remote for "handle".
+  Status FinishGet(const ReadOptions&, const Slice& key,
+                   const BlockHandle& handle, const char* data, void* arg,
+                   void (*handle_result)(void* arg, const Slice& k,
+                                         const Slice& v));
+  // Bytes to read from the remote memory for the entry of "handle".
+  static size_t RemoteReadSize(const BlockHandle& handle);
+  // Wait for options.rdma_limiter, if any, before reading the entry of
+  // "handle".
+  static void ThrottleRead(const Options& options, const BlockHandle& handle);
+#ifdef BYTEADDRESSABLE
+  // Find the KV record of "handle" in the block cache and point *kv to it.
+  // The returned handle has to be released by the caller.
+  Cache::Handle* LookupCachedKV(const BlockHandle& handle, Slice* kv) const;
+  // Admit the KV record fetched for "handle" if options.fill_cache.
+  void InsertCachedKV(const ReadOptions& options, const BlockHandle& handle,
+                      const Slice& kv) const;
+  // Check the KV record "kv" and pass the entry of "key" in it, if any, to
+  // handle_result. Caches nothing.
+  Status SeekKV(const ReadOptions& options, const Slice& key, const Slice& kv,
+                void* arg,
+                void (*handle_result)(void* arg, const Slice& k,
+                                      const Slice& v)) const;
+#endif
 
   void ReadMeta(const Footer& footer);
-  void ReadFilter();
+  // Build the table of the index block read for it, and of its full filter
+  // if "filter" is not null.
+  static Table* OpenWithBlocks(
+      const Options& options,
+      const std::shared_ptr<RemoteMemTableMetaData>& Remote_table_meta,
+      const BlockContents& index_block_contents, const BlockContents* filter);
+  // Set up the filter from *block, or the partitioned filter from its end
+  // read from the remote memory.
+  void ReadFilter(const BlockContents* block);
+  // Iterator over the index block, or over all the index partitions.
+  Iterator* NewIndexIterator(const ReadOptions& options) const;
+  // Whether the filter, if any, lets user_key through.
+  bool FilterMayMatch(const Slice& user_key) const;
+  // Cut the index block read at open into partitions.
+  void PartitionIndex(const Slice& index_contents);
+  // Read bytes [offset, offset + n) of remote_mr, or find them in
+  // table_meta_cache. An index partition gets a restart array appended so
+  // that it is a block. The returned handle has to be released by the
+  // caller, it is null if the read failed.
+  Cache::Handle* ReadMetaPartition(ibv_mr* remote_mr, uint64_t offset,
+                                   size_t n, bool index_partition,
+                                   Slice* data) const;
 
 };
 
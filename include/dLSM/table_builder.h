@@ -15,6 +15,7 @@
 //#include "table/filter_block.h"
 #include "table/full_filter_block.h"
 #include "table/format.h"
+#include "table/key_stats.h"
 //#include "util/coding.h"
 //#include "util/crc32c.h"
 namespace dLSM {
@@ -78,6 +79,17 @@ class dLSM_EXPORT TableBuilder {
   // Number of calls to Add() so far.
   virtual uint64_t NumEntries() const=0;
 
+  // Number of the entries added so far which are deletions.
+  virtual uint64_t NumDeletions() const=0;
+
+  // The sizes and the sampled keys of the entries added so far, kept with
+  // the metadata of the table.
+  const TableKeyStats& KeyStats() const { return key_stats_; }
+
+  // The key of the last call to Add().
+  // REQUIRES: NumEntries() > 0, Finish(), Abandon() have not been called
+  virtual Slice LastKey() const=0;
+
   // Size of the file generated so far.  If invoked after a successful
   // Finish() call, returns the size of the final generated file.
   virtual uint64_t FileSize() const=0;
@@ -90,11 +102,13 @@ class dLSM_EXPORT TableBuilder {
   virtual void FinishFilterBlock(FullFilterBlockBuilder* block, BlockHandle* handle,
                          CompressionType compressiontype,
                          size_t& block_size)=0;
-  virtual void get_datablocks_map(std::map<uint32_t, ibv_mr*>& map)=0;
-  virtual void get_dataindexblocks_map(std::map<uint32_t, ibv_mr*>& map)=0;
-  virtual void get_filter_map(std::map<uint32_t, ibv_mr*>& map)=0;
+  virtual void get_datablocks_map(ChunkTable& map)=0;
+  virtual void get_dataindexblocks_map(ChunkTable& map)=0;
+  virtual void get_filter_map(ChunkTable& map)=0;
   virtual size_t get_numentries()=0;
  protected:
+  // Updated by Add() of the builders.
+  TableKeyStats key_stats_;
 
 
   //  struct Rep;
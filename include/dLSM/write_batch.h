@@ -37,6 +37,9 @@ class dLSM_EXPORT WriteBatch {
     virtual ~Handler();
     virtual void Put(const Slice& key, const Slice& value) = 0;
     virtual void Delete(const Slice& key) = 0;
+    // The default skips the operand, for the handlers of the batches which
+    // do not hold merges.
+    virtual void Merge(const Slice& key, const Slice& value);
   };
 
   WriteBatch();
@@ -53,6 +56,10 @@ class dLSM_EXPORT WriteBatch {
   // If the database contains a mapping for "key", erase it.  Else do nothing.
   void Delete(const Slice& key);
 
+  // Apply the operand "value" to the value of "key" through
+  // Options::merge_operator.
+  void Merge(const Slice& key, const Slice& value);
+
   Slice ParseFirst();
   // Clear all updates buffered in this batch.
   void Clear();
@@ -0,0 +1,220 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "memory_node/cold_table_store.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "db/filename.h"
+#include "db/version_edit.h"
+#include "util/rdma.h"
+
+namespace dLSM {
+
+namespace {
+
+// The files kept open for the reads of the compute nodes.
+const size_t kMaxOpenFiles = 1024;
+
+Status PosixError(const std::string& context, int error_number) {
+  return Status::IOError(context, std::strerror(error_number));
+}
+
+}  // namespace
+
+struct ColdTableStore::OpenFile {
+  explicit OpenFile(int fd) : fd(fd) {}
+  ~OpenFile() { ::close(fd); }
+
+  const int fd;
+};
+
+ColdTableStore::ColdTableStore(const std::string& dir,
+                               SSTablePersister::Backend backend,
+                               int num_workers, RDMA_Manager* rdma_mg)
+    : dir_(dir),
+      rdma_mg_(rdma_mg),
+      persister_(backend, num_workers),
+      next_file_id_(1) {}
+
+ColdTableStore::~ColdTableStore() = default;
+
+Status ColdTableStore::Open(bool keep_files) {
+  if (::mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+    return PosixError(dir_, errno);
+  }
+  ::DIR* dir = ::opendir(dir_.c_str());
+  if (dir == nullptr) {
+    return PosixError(dir_, errno);
+  }
+  uint64_t max_file_id = 0;
+  struct ::dirent* entry;
+  while ((entry = ::readdir(dir)) != nullptr) {
+    uint64_t number;
+    FileType type;
+    if (!ParseFileName(entry->d_name, &number, &type) || type != kTableFile) {
+      continue;
+    }
+    if (keep_files) {
+      max_file_id = std::max(max_file_id, number);
+    } else {
+      ::unlink(TableFileName(dir_, number).c_str());
+    }
+  }
+  ::closedir(dir);
+  next_file_id_.store(max_file_id + 1);
+  return Status::OK();
+}
+
+Status ColdTableStore::Demote(
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables,
+    RateLimiter* rate_limiter) {
+  std::vector<uint64_t> file_ids(tables.size());
+  const uint64_t first = next_file_id_.fetch_add(tables.size());
+  for (size_t i = 0; i < tables.size(); i++) {
+    assert(tables[i]->cold_file_id == 0);
+    file_ids[i] = first + i;
+  }
+  Status s = persister_.PersistAs(dir_, file_ids, tables, rate_limiter);
+  if (!s.ok()) {
+    for (uint64_t file_id : file_ids) {
+      ::unlink(TableFileName(dir_, file_id).c_str());
+    }
+    return s;
+  }
+  for (size_t i = 0; i < tables.size(); i++) {
+    FreeData(tables[i].get());
+    tables[i]->cold_file_id = file_ids[i];
+  }
+  return s;
+}
+
+Status ColdTableStore::OpenForRead(uint64_t file_id,
+                                   std::shared_ptr<OpenFile>* file) {
+  {
+    std::unique_lock<std::mutex> lck(mutex_);
+    auto iter = open_files_.find(file_id);
+    if (iter != open_files_.end()) {
+      lru_.splice(lru_.begin(), lru_, iter->second);
+      *file = iter->second->second;
+      return Status::OK();
+    }
+  }
+  // Opened out of the lock. Two readers may both open the file, the latter
+  // one is dropped.
+  const std::string fname = TableFileName(dir_, file_id);
+  int fd = ::open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return PosixError(fname, errno);
+  }
+  auto opened = std::make_shared<OpenFile>(fd);
+  std::shared_ptr<OpenFile> evicted;
+  std::unique_lock<std::mutex> lck(mutex_);
+  auto iter = open_files_.find(file_id);
+  if (iter != open_files_.end()) {
+    *file = iter->second->second;
+    return Status::OK();
+  }
+  lru_.emplace_front(file_id, opened);
+  open_files_[file_id] = lru_.begin();
+  if (lru_.size() > kMaxOpenFiles) {
+    // Closed by the last reader, out of the lock.
+    evicted = std::move(lru_.back().second);
+    open_files_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  *file = opened;
+  return Status::OK();
+}
+
+Status ColdTableStore::Read(uint64_t file_id, uint64_t offset, size_t n,
+                            char* dst) {
+  std::shared_ptr<OpenFile> file;
+  Status s = OpenForRead(file_id, &file);
+  if (!s.ok()) {
+    return s;
+  }
+  while (n > 0) {
+    ssize_t read = ::pread(file->fd, dst, n, static_cast<off_t>(offset));
+    if (read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return PosixError(TableFileName(dir_, file_id), errno);
+    }
+    if (read == 0) {
+      return Status::Corruption(TableFileName(dir_, file_id),
+                                "read past the end");
+    }
+    dst += read;
+    n -= read;
+    offset += read;
+  }
+  return s;
+}
+
+Status ColdTableStore::LoadData(
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables) {
+  std::vector<uint64_t> file_ids;
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> cold;
+  for (const auto& table : tables) {
+    if (table->cold_file_id != 0) {
+      assert(table->remote_data_mrs.empty());
+      file_ids.push_back(table->cold_file_id);
+      cold.push_back(table);
+    }
+  }
+  return persister_.LoadAs(dir_, file_ids, cold, rdma_mg_, true);
+}
+
+void ColdTableStore::ReleaseData(
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables) {
+  for (const auto& table : tables) {
+    if (table->cold_file_id != 0) {
+      FreeData(table.get());
+    }
+  }
+}
+
+Status ColdTableStore::Load(
+    uint64_t file_id, const std::shared_ptr<RemoteMemTableMetaData>& table) {
+  return persister_.LoadAs(dir_, {file_id}, {table}, rdma_mg_, false);
+}
+
+void ColdTableStore::Delete(uint64_t file_id) {
+  std::shared_ptr<OpenFile> evicted;
+  {
+    std::unique_lock<std::mutex> lck(mutex_);
+    auto iter = open_files_.find(file_id);
+    if (iter != open_files_.end()) {
+      evicted = std::move(iter->second->second);
+      lru_.erase(iter->second);
+      open_files_.erase(iter);
+    }
+  }
+  // A read in flight keeps the file open, the unlink does not disturb it.
+  const std::string fname = TableFileName(dir_, file_id);
+  if (::unlink(fname.c_str()) != 0) {
+    fprintf(stderr, "failed to delete the cold table %s: %s\n", fname.c_str(),
+            std::strerror(errno));
+  }
+}
+
+void ColdTableStore::FreeData(RemoteMemTableMetaData* table) {
+  for (auto& chunk : table->remote_data_mrs) {
+    rdma_mg_->Deallocate_Local_RDMA_Slot(chunk.second->addr, FlushBuffer);
+    delete chunk.second;
+  }
+  table->remote_data_mrs.clear();
+}
+
+}  // namespace dLSM
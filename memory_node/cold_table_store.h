@@ -0,0 +1,93 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_MEMORY_NODE_COLD_TABLE_STORE_H_
+#define STORAGE_dLSM_MEMORY_NODE_COLD_TABLE_STORE_H_
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "memory_node/sstable_persister.h"
+
+namespace dLSM {
+
+class RateLimiter;
+class RDMA_Manager;
+struct RemoteMemTableMetaData;
+
+// The tables of the cold levels of the memory node, see Options::cold_level,
+// kept on its disk rather than in its registered memory. The file of a cold
+// table, in the format of SSTablePersister, holds all of its chunks, while
+// the memory keeps its index and filter chunks only. The data chunks lie at
+// the start of the file, so a data block is at its offset in the table.
+//
+// The files are numbered by the store, apart from the file numbers of the
+// compute nodes, and the number is the cold_file_id of the table.
+class ColdTableStore {
+ public:
+  ColdTableStore(const std::string& dir, SSTablePersister::Backend backend,
+                 int num_workers, RDMA_Manager* rdma_mg);
+
+  ColdTableStore(const ColdTableStore&) = delete;
+  ColdTableStore& operator=(const ColdTableStore&) = delete;
+
+  ~ColdTableStore();
+
+  // Create the directory if it is missing and number the files after the
+  // ones in it. The files there are deleted unless "keep_files", for the
+  // tables recovered from the MANIFEST.
+  Status Open(bool keep_files);
+
+  // Write "tables" to new files and free their data chunks. The writes are
+  // charged to "rate_limiter" unless it is nullptr. On error the tables are
+  // left as they were.
+  Status Demote(const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables,
+                RateLimiter* rate_limiter);
+
+  // Read "n" bytes at "offset" of the file "file_id" into "dst".
+  Status Read(uint64_t file_id, uint64_t offset, size_t n, char* dst);
+
+  // Read the data chunks of the cold ones among "tables" into FlushBuffer
+  // chunks, for a compaction to read them. ReleaseData() frees them again.
+  Status LoadData(const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables);
+  void ReleaseData(const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables);
+
+  // Read all the chunks of the file "file_id" into FlushBuffer chunks of
+  // "table", which has none.
+  Status Load(uint64_t file_id, const std::shared_ptr<RemoteMemTableMetaData>& table);
+
+  // Delete the file "file_id", once its table is not read any more.
+  void Delete(uint64_t file_id);
+
+ private:
+  struct OpenFile;
+
+  // The open file "file_id", opened now if needed.
+  Status OpenForRead(uint64_t file_id, std::shared_ptr<OpenFile>* file);
+  // Free the data chunks of "table".
+  void FreeData(RemoteMemTableMetaData* table);
+
+  const std::string dir_;
+  RDMA_Manager* const rdma_mg_;
+  SSTablePersister persister_;
+  std::atomic<uint64_t> next_file_id_;
+
+  std::mutex mutex_;
+  // The files open for reads, the most recently used first. They are closed
+  // once they are out of the list and not read any more.
+  // The fields below are protected by mutex_.
+  std::list<std::pair<uint64_t, std::shared_ptr<OpenFile>>> lru_;
+  std::unordered_map<uint64_t,
+                     std::list<std::pair<uint64_t, std::shared_ptr<OpenFile>>>::iterator>
+      open_files_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_MEMORY_NODE_COLD_TABLE_STORE_H_
@@ -4,15 +4,61 @@
 #include "memory_node/memory_node_keeper.h"
 
 #include "db/filename.h"
+#include "db/log_reader.h"
+#include "db/merge_helper.h"
+#include "db/scan_pushdown.h"
 #include "db/table_cache.h"
+#include "dLSM/compaction_filter.h"
+#include "dLSM/merge_operator.h"
+#include "dLSM/rate_limiter.h"
+#include "dLSM/scan_filter.h"
+#include "dLSM/slice_transform.h"
+#include <atomic>
+#include <chrono>
 #include <fstream>
+#include <limits>
 #include <list>
+#include <poll.h>
+#include <thread>
 
 #include "table/table_builder_bams.h"
 #include "table/table_builder_memoryside.h"
+#include "util/timeline.h"
+#include "util/work_stealing.h"
 
 namespace dLSM {
 
+// Key ranges of a compaction per subcompaction thread.
+static const int kSubcompactionsPerThread = 4;
+
+// The tag in Compactor_pool_ of the compactions of a shard of a compute
+// node. It is never null, the tag of the other work.
+static void* CompactionTag(uint8_t compute_node_id, uint8_t shard_id) {
+  return reinterpret_cast<void*>(
+      (static_cast<uintptr_t>(compute_node_id) << 8 | shard_id) + 1);
+}
+// The kept entries of a subcompaction are handed to the builder thread in
+// batches of about this many bytes.
+static const size_t kCompactionBatchBytes = 256 << 10;
+// Batches, or full tables, a pipeline stage may run ahead of the next one.
+static const size_t kCompactionPipelineDepth = 4;
+// Recovered files sent to the compute node per batch, below the number of
+// files it may keep pinned for persistence.
+static const size_t kRecoveredFilesPerBatch = 128;
+
+// The names of the RDMA_Command_Type values in GetStats().
+static const char* const kRPCNames[] = {
+    "invalid", "create_qp", "create_mr", "near_data_compaction",
+    "install_version_edit", "sstable_gc", "version_unpin", "sync_option",
+    "qp_reset", "save_fs_serialized_data", "retrieve_fs_serialized_data",
+    "save_log_serialized_data", "retrieve_log_serialized_data",
+    "retrieve_recovered_version", "cold_sstable_read", "promote_sstable",
+    "scan_pushdown", "remote_log", "shard_sequencer", "flush_offload",
+    "release_mr"};
+// How long the stats endpoint waits for a request before it answers a
+// client which sends none.
+static const int kStatsRequestWaitMillis = 100;
+
 std::shared_ptr<RDMA_Manager> Memory_Node_Keeper::rdma_mg = std::shared_ptr<RDMA_Manager>();
 dLSM::Memory_Node_Keeper::Memory_Node_Keeper(bool use_sub_compaction,
                                                   uint32_t tcp_port, int pr_s)
@@ -34,7 +80,14 @@ dLSM::Memory_Node_Keeper::Memory_Node_Keeper(bool use_sub_compaction,
       tcp_port, /* tcp_port */
         1,	 /* ib_port */
         1, /* gid_idx */
-        0};
+        0,
+        1024*1024*1024, /* huge_page_size */
+        true, /* on_demand_paging */
+        0, /* num_ports */
+        0, /* qp_pool_size */
+        true, /* pin_threads */
+        std::getenv("DLSM_CXL_PATH"), /* cxl_path */
+        std::getenv("DLSM_PMEM_PATH") /* pmem_path */};
     //  size_t write_block_size = 4*1024*1024;
     //  size_t read_block_size = 4*1024;
     size_t table_size = 10*1024*1024;
@@ -52,9 +105,11 @@ dLSM::Memory_Node_Keeper::Memory_Node_Keeper(bool use_sub_compaction,
 //    ClipToRange(&opts->write_buffer_size, 64 << 10, 1 << 30);
 //    ClipToRange(&opts->max_file_size, 1 << 20, 1 << 30);
 //    ClipToRange(&opts->block_size, 1 << 10, 4 << 20);
-    Compactor_pool_.SetBackgroundThreads(opts->max_background_compactions);
+    ResizeCompactorPool();
     Message_handler_pool_.SetBackgroundThreads(2);
+    Garbage_collection_pool_.SetBackgroundThreads(1);
     Persistency_bg_pool_.SetBackgroundThreads(1);
+    persister_.reset(new SSTablePersister(SSTablePersister::kIOUring, 4));
 
     // Set up the connection information.
     std::string connection_conf;
@@ -87,6 +142,29 @@ dLSM::Memory_Node_Keeper::Memory_Node_Keeper(bool use_sub_compaction,
   }
 
   Memory_Node_Keeper::~Memory_Node_Keeper() {
+    gc_shutting_down_.store(true);
+    if (gc_ring_thread_.joinable()) {
+      gc_ring_thread_.join();
+    }
+    stats_shutting_down_.store(true);
+    if (stats_thread_.joinable()) {
+      stats_thread_.join();
+    }
+    for (auto& iter : gc_rings_) {
+      char* buff = static_cast<char*>(iter.second.mr->addr);
+      ibv_dereg_mr(iter.second.mr);
+      delete[] buff;
+    }
+    for (auto& iter : remote_logs_) {
+      char* buff = static_cast<char*>(iter.second->addr);
+      ibv_dereg_mr(iter.second);
+      delete[] buff;
+    }
+    if (shard_sequencers_ != nullptr) {
+      uint64_t* counters = static_cast<uint64_t*>(shard_sequencers_->addr);
+      ibv_dereg_mr(shard_sequencers_);
+      delete[] counters;
+    }
     delete opts->filter_policy;
     if (descriptor_log != nullptr){
       delete descriptor_log;
@@ -102,7 +180,16 @@ dLSM::Memory_Node_Keeper::Memory_Node_Keeper(bool use_sub_compaction,
 //    message_handler_pool_.Schedule(background_work_function, background_work_arg);
 //  }
   void Memory_Node_Keeper::SetBackgroundThreads(int num, ThreadPoolType type) {
-    Compactor_pool_.SetBackgroundThreads(num);
+    max_compaction_threads_ = num;
+    ResizeCompactorPool();
+  }
+  void Memory_Node_Keeper::ResizeCompactorPool() {
+    int max = max_compaction_threads_ > 0 ? max_compaction_threads_
+                                          : opts->max_background_compactions;
+    // A thread for every compute node connected, the pool grows beyond with
+    // the compactions waiting.
+    int min = static_cast<int>(rdma_mg->connection_counter.load());
+    Compactor_pool_.SetBackgroundThreads(std::min(min, max), max);
   }
 //  void Memory_Node_Keeper::MaybeScheduleCompaction(std::string& client_ip) {
 //    if (versions_->NeedsCompaction()) {
@@ -124,6 +211,16 @@ dLSM::Memory_Node_Keeper::Memory_Node_Keeper(bool use_sub_compaction,
 //    ((Memory_Node_Keeper*)p->db)->BackgroundCompaction(p->func_args);
 //    delete static_cast<BGThreadMetadata*>(thread_arg);
 //  }
+  void Memory_Node_Keeper::SetPersistence(SSTablePersister::Backend backend,
+                                          int num_workers) {
+    persister_.reset(new SSTablePersister(backend, num_workers, rdma_mg.get()));
+  }
+  void Memory_Node_Keeper::SetColdStorage(const std::string& dir,
+                                          SSTablePersister::Backend backend,
+                                          int num_workers) {
+    cold_store_.reset(
+        new ColdTableStore(dir, backend, num_workers, rdma_mg.get()));
+  }
   void Memory_Node_Keeper::RPC_Compaction_Dispatch(void* thread_args) {
     BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_args);
     ((Memory_Node_Keeper*)p->db)->sst_compaction_handler(p->func_args);
@@ -139,6 +236,37 @@ dLSM::Memory_Node_Keeper::Memory_Node_Keeper(bool use_sub_compaction,
     ((Memory_Node_Keeper*)p->db)->PersistSSTables(p->func_args);
     delete static_cast<BGThreadMetadata*>(thread_args);
   }
+  void Memory_Node_Keeper::RPC_Scan_Dispatch(void* thread_args) {
+    BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_args);
+    ((Memory_Node_Keeper*)p->db)->scan_pushdown_handler(p->func_args);
+    delete static_cast<BGThreadMetadata*>(thread_args);
+  }
+  void Memory_Node_Keeper::RPC_Flush_Offload_Dispatch(void* thread_args) {
+    BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_args);
+    ((Memory_Node_Keeper*)p->db)->flush_offload_handler(p->func_args);
+    delete static_cast<BGThreadMetadata*>(thread_args);
+  }
+  void Memory_Node_Keeper::RPC_Remote_Log_Dispatch(void* thread_args) {
+    BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_args);
+    ((Memory_Node_Keeper*)p->db)->remote_log_handler(p->func_args);
+    delete static_cast<BGThreadMetadata*>(thread_args);
+  }
+  void Memory_Node_Keeper::RPC_Shard_Sequencer_Dispatch(void* thread_args) {
+    BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_args);
+    ((Memory_Node_Keeper*)p->db)->shard_sequencer_handler(p->func_args);
+    delete static_cast<BGThreadMetadata*>(thread_args);
+  }
+  void Memory_Node_Keeper::RPC_Cold_Table_Dispatch(void* thread_args) {
+    BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_args);
+    Memory_Node_Keeper* keeper = (Memory_Node_Keeper*)p->db;
+    if (((Arg_for_handler*)p->func_args)->request->command ==
+        cold_sstable_read_) {
+      keeper->cold_read_handler(p->func_args);
+    } else {
+      keeper->promote_handler(p->func_args);
+    }
+    delete static_cast<BGThreadMetadata*>(thread_args);
+  }
 
 
 //  void Memory_Node_Keeper::BackgroundCompaction(void* p) {
@@ -290,21 +418,39 @@ void Memory_Node_Keeper::PersistSSTables(void* arg) {
 #endif
 //    if (!edit_merger->IsTrival()){
       DEBUG("Persist the files&&&&&&&&&&&&&&&&&&&&&\n");
-      std::thread* threads = new std::thread[thread_number];
-      int i = 0;
+      std::vector<std::shared_ptr<RemoteMemTableMetaData>> tables;
+      tables.reserve(thread_number);
       for (auto iter : *edit_merger->GetNewFiles()) {
-        // do not persist the sstable of trival move
-        if (edit_merger->only_trival_change.find(iter.first) == edit_merger->only_trival_change.end()){
-          threads[i]= std::thread(&Memory_Node_Keeper::PersistSSTable, this, iter.second);
-          i++;
+        // do not persist the sstable of trival move, nor a cold one, whose
+        // file is durable already, nor one striped to another memory node,
+        // whose chunks are not in this memory, see Options::stripe_tables.
+        if (edit_merger->only_trival_change.find(iter.first) == edit_merger->only_trival_change.end() &&
+            iter.second->cold_file_id == 0 &&
+            iter.second->shard_target_node_id == rdma_mg->node_id){
+          tables.push_back(iter.second);
         }
 
       }
-      assert(i == thread_number);
-      for (int j = 0; j < thread_number; ++j) {
-        threads[j].join();
+      assert(tables.size() <= thread_number);
+      Status persist_status;
+      {
+        TimelineScope timeline("persist", -1);
+        uint64_t persist_bytes = 0;
+        for (auto& table : tables) {
+          persist_bytes += table->file_size;
+        }
+        if (!tables.empty()) {
+          timeline.set_job_id(
+              TimelineJobId(tables[0]->number, tables[0]->creator_node_id));
+        }
+        timeline.set_bytes(persist_bytes);
+        persist_status =
+            persister_->Persist("./db_content", tables, opts->rate_limiter);
+      }
+      if (!persist_status.ok()) {
+        fprintf(stderr, "SSTable persistence failed: %s\n",
+                persist_status.ToString().c_str());
       }
-      delete[] threads;
 //    }
 
     // Initialize new descriptor log file if necessary by creating
@@ -335,199 +481,256 @@ void Memory_Node_Keeper::PersistSSTables(void* arg) {
 
     }
     check_point_t_ready.store(true);
-//    if (!edit_merger->IsTrival()){
-      DEBUG("Unpin the SSTables *$$$$$$$$$$$$$$$$$$$\n");
-      UnpinSSTables_RPC(edit_merger, client_ip);
-//    }
+    if (!s.ok()) {
+      fprintf(stderr, "MANIFEST sync failed: %s\n", s.ToString().c_str());
+    }
+    // The compute nodes keep their pins of the edits until they are durable.
+    if (persist_status.ok() && s.ok()) {
+      Publish_Persisted_Epochs(edit_merger, client_ip);
+    }
+    unpersisted_edits_.fetch_sub(
+        static_cast<uint32_t>(edit_merger->persist_epochs.size()));
 //    ve_merger.Clear();
     delete edit_merger;
 
 }
-void Memory_Node_Keeper::PersistSSTable(std::shared_ptr<RemoteMemTableMetaData> sstable_ptr) {
-  DEBUG_arg("Persist SSTable %lu", sstable_ptr->number);
-  std::string fname = TableFileName("./db_content", sstable_ptr->number);
-  WritableFile * f;
-  //      std::vector<uint32_t> chunk_barriers;
-  uint32_t barrier_size = sstable_ptr->remote_data_mrs.size() +
-                          sstable_ptr->remote_dataindex_mrs.size() +
-                          sstable_ptr->remote_filter_mrs.size();
-  uint32_t* barrier_arr = new uint32_t[barrier_size];
-  Status s = NewWritableFile(fname, &f);
-  uint32_t offset = 0;
-  uint32_t chunk_index = 0;
-  for(auto chunk : sstable_ptr->remote_data_mrs){
-    offset +=chunk.second->length;
-    barrier_arr[chunk_index] = offset;
-    f->Append(Slice((char*)chunk.second->addr, chunk.second->length));
-    chunk_index++;
-
-  }
-
-  for(auto chunk : sstable_ptr->remote_dataindex_mrs){
-    offset +=chunk.second->length;
-    barrier_arr[chunk_index] = offset;
-    f->Append(Slice((char*)chunk.second->addr, chunk.second->length));
-    chunk_index++;
-  }
-  for(auto chunk : sstable_ptr->remote_filter_mrs){
-    offset +=chunk.second->length;
-    barrier_arr[chunk_index] = offset;
-    f->Append(Slice((char*)chunk.second->addr, chunk.second->length));
-    chunk_index++;
-  }
-  f->Append(Slice((char*)barrier_arr, barrier_size* sizeof(uint32_t)));
-
-  f->Append(Slice((char*)&barrier_size, sizeof(uint32_t)));
-  f->Flush();
-  f->Sync();
-  f->Close();
-  delete[] barrier_arr;
-}
 
-void Memory_Node_Keeper::UnpinSSTables_RPC(VersionEdit_Merger* edit_merger,
-                                          std::string& client_ip) {
-  RDMA_Request* send_pointer;
-  ibv_mr send_mr = {};
-  ibv_mr send_mr_large = {};
-  ibv_mr receive_mr = {};
-  rdma_mg->Allocate_Local_RDMA_Slot(send_mr_large, Version_edit);
+Status Memory_Node_Keeper::RecoverPersistedSSTables() {
+  const std::string dbname = "./db_content";
+  std::vector<std::string> filenames;
+  if (!GetChildren(dbname, &filenames).ok()) {
+    // Nothing was persisted.
+    return Status::OK();
+  }
+  uint64_t manifest_number = 0;
+  uint64_t number;
+  FileType type;
+  for (const auto& filename : filenames) {
+    if (ParseFileName(filename, &number, &type) && type == kDescriptorFile &&
+        number > manifest_number) {
+      manifest_number = number;
+    }
+  }
+  if (manifest_number == 0) {
+    return Status::OK();
+  }
 
-  rdma_mg->Allocate_Local_RDMA_Slot(receive_mr, Message);
+  struct LogReporter : public log::Reader::Reporter {
+    Status* status;
+    void Corruption(size_t /*bytes*/, const Status& s) override {
+      if (this->status->ok()) *this->status = s;
+    }
+  };
+  const std::string manifest = DescriptorFileName(dbname, manifest_number);
+  SequentialFile* file;
+  Status s = NewSequentialFile(manifest, &file);
+  if (!s.ok()) {
+    return s;
+  }
+  // The merged edits keep the files by number.
+  std::map<uint64_t, std::shared_ptr<RemoteMemTableMetaData>> live;
+  // The range tombstones still in force, by sequence.
+  std::map<SequenceNumber, RangeTombstone> tombstones;
+  SequenceNumber last_sequence = 0;
+  {
+    LogReporter reporter;
+    reporter.status = &s;
+    log::Reader reader(file, &reporter, true /*checksum*/,
+                       0 /*initial_offset*/);
+    Slice record;
+    std::string scratch;
+    while (reader.ReadRecord(&record, &scratch) && s.ok()) {
+      VersionEdit edit(0);
+      s = edit.DecodeFromDiskFormat(record, 1);
+      if (!s.ok()) {
+        break;
+      }
+      // A trivial move deletes the file from its old level and adds it to
+      // the new one in the same record.
+      for (const auto& deleted : *edit.GetDeletedFiles()) {
+        auto iter = live.find(std::get<1>(deleted));
+        if (iter != live.end() &&
+            iter->second->level ==
+                static_cast<uint64_t>(std::get<0>(deleted))) {
+          live.erase(iter);
+        }
+      }
+      for (const auto& added : *edit.GetNewFiles()) {
+        live[added.second->number] = added.second;
+      }
+      for (const RangeTombstone& t : edit.GetRangeTombstones()) {
+        tombstones[t.sequence] = t;
+      }
+      for (SequenceNumber sequence : edit.GetDeletedRangeTombstones()) {
+        tombstones.erase(sequence);
+      }
+      if (edit.HasLastSequence()) {
+        last_sequence = std::max(last_sequence, edit.GetLastSequence());
+      }
+    }
+  }
+  delete file;
+  if (!s.ok()) {
+    return s;
+  }
 
-  rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
-  uint64_t* arr_ptr = (uint64_t*)send_mr_large.addr;
-  uint32_t index = 0;
-  bool empty =  edit_merger->only_trival_change.empty();
-  assert(edit_merger->GetNewFilesNum()>0);
-  for(auto iter : *edit_merger->GetNewFiles()){
-
-    if (!empty && edit_merger->only_trival_change.find(iter.second->number) !=
-                      edit_merger->only_trival_change.end()){
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> tables;
+  tables.reserve(live.size());
+  for (const auto& iter : live) {
+    const std::shared_ptr<RemoteMemTableMetaData>& f = iter.second;
+    // The chunks belong to this node now, whichever node built the table.
+    f->creator_node_id = rdma_mg->node_id;
+    f->shard_target_node_id = rdma_mg->node_id;
+    if (f->largest_seq != kMaxSequenceNumber) {
+      last_sequence = std::max(last_sequence, f->largest_seq + 1);
+    }
+    tables.push_back(f);
+  }
+  // The cold tables come back from their own files, with their data chunks
+  // left on the disk.
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> hot_tables;
+  for (const auto& f : tables) {
+    if (f->cold_file_id == 0) {
+      hot_tables.push_back(f);
       continue;
     }
-#ifndef NDEBUG
-    DEBUG_arg("Unpin file number is %lu, id 1 ****************\n", iter.second->number);
-    assert(edit_merger->debug_map.find(iter.second->number) == edit_merger->debug_map.end());
-    edit_merger->debug_map.insert(iter.second->number);
-#endif
-    arr_ptr[index] = iter.second->number;
-    index++;
-  }
-  assert(index*sizeof(uint64_t) < send_mr_large.length);
-  memset((char*)send_mr_large.addr + index*sizeof(uint64_t), 1, 1);
-  send_pointer = (RDMA_Request*)send_mr.addr;
-  send_pointer->command = persist_unpin_;
-  send_pointer->content.psu.buffer_size = index*sizeof(uint64_t) + 1;
-  send_pointer->content.psu.id = 1;
-  send_pointer->buffer = receive_mr.addr;
-  send_pointer->rkey = receive_mr.rkey;
-  RDMA_Reply* receive_pointer;
-  receive_pointer = (RDMA_Reply*)receive_mr.addr;
-  //Clear the reply buffer for the polling.
-  *receive_pointer = {};
-  asm volatile ("sfence\n" : : );
-  asm volatile ("lfence\n" : : );
-  asm volatile ("mfence\n" : : );
-  rdma_mg->post_send<RDMA_Request>(&send_mr, 0, client_ip);
-  //TODO: Think of a better way to avoid deadlock and guarantee the same
-  // sequence of verision edit between compute node and memory server.
-  ibv_wc wc[2] = {};
-  if (rdma_mg->poll_completion(wc, 1, client_ip, true, 0)){
-    fprintf(stderr, "failed to poll send for remote memory register\n");
-    return;
+    if (cold_store_ == nullptr) {
+      return Status::Corruption("cold table without a cold storage");
+    }
+    s = cold_store_->Load(f->cold_file_id, f);
+    if (!s.ok()) {
+      return s;
+    }
+    cold_store_->ReleaseData({f});
+  }
+  if (persister_->backend() == SSTablePersister::kPmem) {
+    // The tables are taken back where they were, in the regions mapped
+    // again from the persistent memory, before the compute nodes get any.
+    std::unique_lock<std::shared_mutex> lck(rdma_mg->local_mem_mutex);
+    if (!rdma_mg->Has_Persistent_Memory()) {
+      rdma_mg->Preregister_Memory(pr_size);
+    }
+  }
+  s = persister_->Load(dbname, hot_tables, rdma_mg.get());
+  if (!s.ok()) {
+    return s;
   }
 
-  asm volatile ("sfence\n" : : );
-  asm volatile ("lfence\n" : : );
-  asm volatile ("mfence\n" : : );
-  if(!rdma_mg->poll_reply_buffer(receive_pointer)) // poll the receive for 2 entires
-  {
-    printf("Reply buffer is %p", receive_pointer->buffer);
-    printf("Received is %d", receive_pointer->received);
-    printf("receive structure size is %lu", sizeof(RDMA_Reply));
-    printf("version id is %lu", versions_->version_id);
-    exit(0);
+  // Start a new MANIFEST with a snapshot of the files. It is written aside
+  // and renamed, so that a crash leaves either the old or the new one.
+  VersionEdit snapshot(0);
+  snapshot.SetLastSequence(last_sequence);
+  for (const auto& f : tables) {
+    snapshot.AddFile(f->level, f);
   }
-  asm volatile ("sfence\n" : : );
-  asm volatile ("lfence\n" : : );
-  asm volatile ("mfence\n" : : );
-  rdma_mg->RDMA_Write(receive_pointer->buffer_large,
-                      receive_pointer->rkey_large, &send_mr_large,
-                      index * sizeof(uint64_t) + 1, client_ip,
-                      IBV_SEND_SIGNALED, 1, 0);
-  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr_large.addr,Version_edit);
-  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr,Message);
-  rdma_mg->Deallocate_Local_RDMA_Slot(receive_mr.addr,Message);
+  std::vector<RangeTombstone> range_tombstones;
+  range_tombstones.reserve(tombstones.size());
+  for (const auto& iter : tombstones) {
+    snapshot.AddRangeTombstone(iter.second);
+    range_tombstones.push_back(iter.second);
+  }
+  std::string record;
+  snapshot.EncodeToDiskFormat(&record);
+  const uint64_t new_manifest_number = manifest_number + 1;
+  const std::string tmp = TempFileName(dbname, new_manifest_number);
+  const std::string new_manifest =
+      DescriptorFileName(dbname, new_manifest_number);
+  WritableFile* tmp_file;
+  s = NewWritableFile(tmp, &tmp_file);
+  if (s.ok()) {
+    {
+      log::Writer writer(tmp_file);
+      s = writer.AddRecord(record);
+    }
+    if (s.ok()) {
+      s = tmp_file->Sync();
+    }
+    if (s.ok()) {
+      s = tmp_file->Close();
+    }
+    delete tmp_file;
+  }
+  if (s.ok()) {
+    s = RenameFile(tmp, new_manifest);
+  }
+  if (s.ok()) {
+    int fd = ::open(dbname.c_str(), O_RDONLY | kOpenBaseFlags);
+    if (fd < 0) {
+      s = PosixError(dbname, errno);
+    } else {
+      if (::fsync(fd) != 0) {
+        s = PosixError(dbname, errno);
+      }
+      ::close(fd);
+    }
+  }
+  if (!s.ok()) {
+    RemoveFile(tmp);
+    return s;
+  }
+  uint64_t manifest_size;
+  s = GetFileSize(new_manifest, &manifest_size);
+  if (s.ok()) {
+    s = NewAppendableFile(new_manifest, &descriptor_file);
+  }
+  if (!s.ok()) {
+    return s;
+  }
+  descriptor_log = new log::Writer(descriptor_file, manifest_size);
+  manifest_file_number_ = new_manifest_number;
+
+  // The old MANIFEST and the files no longer kept are obsolete.
+  RemoveFile(manifest);
+  for (const auto& filename : filenames) {
+    if (ParseFileName(filename, &number, &type) && type == kTableFile &&
+        live.find(number) == live.end()) {
+      RemoveFile(dbname + "/" + filename);
+    }
+  }
+  printf("Recovered %zu SSTables, last sequence %lu\n", tables.size(),
+         last_sequence);
+  std::unique_lock<std::mutex> lck(recovered_mtx_);
+  recovered_files_ = std::move(tables);
+  recovered_range_tombstones_ = std::move(range_tombstones);
+  recovered_last_sequence_ = last_sequence;
+  return Status::OK();
 }
 
-void Memory_Node_Keeper::UnpinSSTables_RPC(std::list<uint64_t>* merged_file_number,
-                                           std::string& client_ip) {
-  RDMA_Request* send_pointer;
+void Memory_Node_Keeper::Publish_Persisted_Epochs(
+    VersionEdit_Merger* edit_merger, std::string& client_ip) {
+  std::unique_lock<std::mutex> lck(persisted_epochs_mtx_);
+  for (auto& persisted : edit_merger->persist_epochs) {
+    Persisted_Epochs& epochs =
+        persisted_epochs_[{persisted.node_id, persisted.epoch_buffer}];
+    epochs.rkey = persisted.epoch_rkey;
+    epochs.done.insert(persisted.epoch);
+  }
   ibv_mr send_mr = {};
-  ibv_mr send_mr_large = {};
-  ibv_mr receive_mr = {};
-  rdma_mg->Allocate_Local_RDMA_Slot(send_mr_large, Version_edit);
-
-  rdma_mg->Allocate_Local_RDMA_Slot(receive_mr, Message);
-
-  rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
-  uint64_t* arr_ptr = (uint64_t*)send_mr_large.addr;
-  uint32_t index = 0;
-  DEBUG("Unpin RPC for merged files\n");
-  for(auto iter : *merged_file_number){
-#ifndef NDEBUG
-    DEBUG_arg("Unpin file number is %lu, id 2 ****************\n", iter);
-    assert(ve_merger.debug_map.find(iter) == ve_merger.debug_map.end());
-    ve_merger.debug_map.insert(iter);
-#endif
-    arr_ptr[index] = iter;
-    index++;
-  }
-  memset((char*)send_mr_large.addr + index*sizeof(uint64_t), 1, 1);
-
-  send_pointer = (RDMA_Request*)send_mr.addr;
-  send_pointer->command = persist_unpin_;
-  send_pointer->content.psu.buffer_size = index*sizeof(uint64_t) + 1;
-  send_pointer->content.psu.id = 2;
-  send_pointer->buffer = receive_mr.addr;
-  send_pointer->rkey = receive_mr.rkey;
-  RDMA_Reply* receive_pointer;
-  receive_pointer = (RDMA_Reply*)receive_mr.addr;
-  //Clear the reply buffer for the polling.
-  *receive_pointer = {};
-  asm volatile ("sfence\n" : : );
-  asm volatile ("lfence\n" : : );
-  asm volatile ("mfence\n" : : );
-  rdma_mg->post_send<RDMA_Request>(&send_mr, 0, client_ip);
-  //TODO: Think of a better way to avoid deadlock and guarantee the same
-  // sequence of verision edit between compute node and memory server.
-  ibv_wc wc[2] = {};
-  if (rdma_mg->poll_completion(wc, 1, client_ip, true, 0)){
-    fprintf(stderr, "failed to poll send for remote memory register\n");
-    return;
+  for (auto& iter : persisted_epochs_) {
+    Persisted_Epochs& epochs = iter.second;
+    // An edit of an earlier epoch may still be in a merger which is not
+    // persisted yet, so only advance over the contiguous epochs.
+    uint64_t persisted = epochs.persisted;
+    while (!epochs.done.empty() && *epochs.done.begin() == persisted + 1) {
+      persisted++;
+      epochs.done.erase(epochs.done.begin());
+    }
+    if (persisted == epochs.persisted) {
+      continue;
+    }
+    epochs.persisted = persisted;
+    if (send_mr.addr == nullptr) {
+      rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+    }
+    *static_cast<uint64_t*>(send_mr.addr) = persisted;
+    DEBUG_arg("Publish persisted epoch %lu\n", persisted);
+    rdma_mg->RDMA_Write(iter.first.second, epochs.rkey, &send_mr,
+                        sizeof(uint64_t), client_ip, IBV_SEND_SIGNALED, 1,
+                        iter.first.first);
   }
-
-  asm volatile ("sfence\n" : : );
-  asm volatile ("lfence\n" : : );
-  asm volatile ("mfence\n" : : );
-  if(!rdma_mg->poll_reply_buffer(receive_pointer)) // poll the receive for 2 entires
-  {
-    printf("Reply buffer is %p", receive_pointer->buffer);
-    printf("Received is %d", receive_pointer->received);
-    printf("receive structure size is %lu", sizeof(RDMA_Reply));
-    printf("version id is %lu", versions_->version_id);
-    exit(0);
+  if (send_mr.addr != nullptr) {
+    rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
   }
-  asm volatile ("sfence\n" : : );
-  asm volatile ("lfence\n" : : );
-  asm volatile ("mfence\n" : : );
-  rdma_mg->RDMA_Write(receive_pointer->buffer_large,
-                      receive_pointer->rkey_large, &send_mr_large,
-                      index * sizeof(uint64_t) + 1, client_ip,
-                      IBV_SEND_SIGNALED, 1, 0);
-  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr_large.addr,Version_edit);
-  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr,Message);
-  rdma_mg->Deallocate_Local_RDMA_Slot(receive_mr.addr,Message);
 }
 void Memory_Node_Keeper::CleanupCompaction(CompactionState* compact) {
   //  undefine_mutex.AssertHeld();
@@ -549,18 +752,25 @@ Status Memory_Node_Keeper::DoCompactionWork(CompactionState* compact,
                                             std::string& client_ip) {
 //  const uint64_t start_micros = env_->NowMicros();
   int64_t imm_micros = 0;  // Micros spent doing imm_ compactions
+  const uint64_t start_cpu_micros = port::ThreadCpuMicros();
 
 
 //  assert(versions_->NumLevelFiles(compact->compaction->level()) > 0);
   assert(compact->builder == nullptr);
   //  assert(compact->outfile == nullptr);
-//  if (snapshots_.empty()) {
-//    compact->smallest_snapshot = versions_->LastSequence();
-//  } else {
-//    compact->smallest_snapshot = snapshots_.oldest()->sequence_number();
-//  }
+  // The snapshots are on the compute node, which sends the oldest one.
+  compact->smallest_snapshot = compact->compaction->smallest_snapshot();
 
   Iterator* input = versions_->MakeInputIteratorMemoryServer(compact->compaction);
+  if (opts->merge_operator != nullptr) {
+    // The merge operands no snapshot reads are applied to the value below
+    // them before the loop, which drops that value like any hidden one.
+    input = NewCompactionMergeIterator(
+        input, user_comparator(), opts->merge_operator,
+        compact->smallest_snapshot, &compact->compaction->range_tombstones(),
+        compact->compaction->level() + 1 == config::kNumLevels - 1,
+        rdma_mg.get());
+  }
 
   // Release mutex while we're actually doing the compaction work
   //  undefine_mutex.Unlock();
@@ -578,12 +788,15 @@ Status Memory_Node_Keeper::DoCompactionWork(CompactionState* compact,
   bool has_current_user_key = false;
   SequenceNumber last_sequence_for_key = kMaxSequenceNumber;
   Slice key;
+  Slice value;
+  std::string filtered_key;
   assert(input->Valid());
 #ifndef NDEBUG
   printf("first key is %s", input->key().ToString().c_str());
 #endif
   while (input->Valid()) {
     key = input->key();
+    value = input->value();
     //    assert(key.data()[0] == '0');
     //We do not need to check whether the output file have too much overlap with level n + 2.
     // If there is a lot of overlap subcompaction can be triggered.
@@ -603,29 +816,56 @@ Status Memory_Node_Keeper::DoCompactionWork(CompactionState* compact,
       has_current_user_key = false;
       last_sequence_for_key = kMaxSequenceNumber;
     } else {
-      if (!has_current_user_key){
-        //TODO: can we avoid the data copy here, can we set two buffers in block and make
-        // the old user key not be garbage collected so that the old Slice can be
-        // directly used here.
+      if (!has_current_user_key ||
+          user_comparator()->Compare(ikey.user_key, Slice(current_user_key)) !=
+          0) {
+        // First occurrence of this user key
         current_user_key.assign(ikey.user_key.data(), ikey.user_key.size());
         has_current_user_key = true;
+        last_sequence_for_key = kMaxSequenceNumber;
       }
-      else if(user_comparator()->Compare(ikey.user_key, Slice(current_user_key)) !=
-      0) {
-        // First occurrence of this user key
-        current_user_key.assign(ikey.user_key.data(), ikey.user_key.size());
-        //        has_current_user_key = true;
-        //        last_sequence_for_key = kMaxSequenceNumber;
-        // this will result in the key not drop, next if will always be false because of
-        // the last_sequence_for_key.
-      }else{
+
+      if (last_sequence_for_key <= compact->smallest_snapshot) {
+        // Hidden by an newer entry for same user key
+        drop = true;  // (A)
+      } else if ((ikey.type == kTypeValue || ikey.type == kTypeMerge ||
+                  ikey.type == kTypeBlobIndex) &&
+                 compact->compaction->range_tombstones().ShouldDelete(
+                     user_comparator(), ikey.user_key, ikey.sequence,
+                     compact->smallest_snapshot)) {
+        // Deleted by a range tombstone which every snapshot sees.
         drop = true;
+      } else if (ikey.type == kTypeDeletion &&
+                 ikey.sequence <= compact->smallest_snapshot &&
+                 compact->compaction->bottommost()) {
+        // No file below the output level has the key, and the older
+        // entries of the key in this compaction are dropped by rule (A).
+        drop = true;
+      } else if (ikey.sequence <= compact->smallest_snapshot) {
+        // Only the entries no snapshot reads may be filtered.
+        FilterCompactionEntry(opts->compaction_filter,
+                              compact->compaction->level(), ikey,
+                              &filtered_key, &key, &value);
+      }
+
+      if (ikey.type != kTypeMerge) {
+        // A merge operand which is kept needs the entries below it.
+        last_sequence_for_key = ikey.sequence;
       }
     }
 #ifndef NDEBUG
     number_of_key++;
 #endif
     if (!drop) {
+      // Cut the output before it overlaps too many grandparent files, so
+      // that the compaction of the next level reads less.
+      if (compact->compaction->ShouldStopBefore(key) && compact->builder != nullptr) {
+        compact->current_output()->largest.DecodeFrom(compact->builder->LastKey());
+        status = FinishCompactionOutputFile(compact, input);
+        if (!status.ok()) {
+          break;
+        }
+      }
       // Open output file if necessary
       if (compact->builder == nullptr) {
         status = OpenCompactionOutputFile(compact);
@@ -639,7 +879,12 @@ Status Memory_Node_Keeper::DoCompactionWork(CompactionState* compact,
 #ifndef NDEBUG
       Not_drop_counter++;
 #endif
-      compact->builder->Add(key, input->value());
+      compact->builder->Add(key, value);
+      if (ExtractValueType(key) == kTypeBlobIndex) {
+        AddBlobChunks(value, &compact->current_output()->blob_chunks);
+      }
+      compact->current_output()->largest_seq =
+          std::max(compact->current_output()->largest_seq, ikey.sequence);
       //      assert(key.data()[0] == '0');
       // Close output file if it is big enough
       if (compact->builder->FileSize() >=
@@ -709,18 +954,25 @@ printf("For compaction, Total number of key touched is %d, KV left is %d\n", num
   // NOtifying all the waiting threads.
 //  write_stall_cv.notify_all();
 //  Versionset_Sync_To_Compute(VersionEdit* ve);
+  compaction_stage_cpu_micros_[kSerialStage].fetch_add(
+      port::ThreadCpuMicros() - start_cpu_micros, std::memory_order_relaxed);
   return status;
 }
 Status Memory_Node_Keeper::DoCompactionWorkWithSubcompaction(
     CompactionState* compact, std::string& client_ip) {
   Compaction* c = compact->compaction;
   // TODO need to check the snapeshot in the compute node. Or modify the logic in get()
-  c->GenSubcompactionBoundaries();
+  //  int subcompaction_num = std::min((int)c->GetBoundariesNum(), config::MaxSubcompaction);
+  // The ranges are cut finer than the threads, so that the threads which
+  // are done with theirs can steal from the ones stuck on a skewed range.
+  const size_t max_ranges =
+      static_cast<size_t>(opts->MaxSubcompaction) * kSubcompactionsPerThread;
+  // The indexes of the inputs are in the memory of this node.
+  versions_->GenSubcompactionBoundaries(c, max_ranges, true);
   auto boundaries = c->GetBoundaries();
   auto sizes = c->GetSizes();
   assert(boundaries->size() == sizes->size() - 1);
-  //  int subcompaction_num = std::min((int)c->GetBoundariesNum(), config::MaxSubcompaction);
-  if (boundaries->size()<=opts->MaxSubcompaction){
+  if (boundaries->size() < max_ranges){
     for (size_t i = 0; i <= boundaries->size(); i++) {
       Slice* start = i == 0 ? nullptr : &(*boundaries)[i - 1];
       Slice* end = i == boundaries->size() ? nullptr : &(*boundaries)[i];
@@ -735,7 +987,7 @@ Status Memory_Node_Keeper::DoCompactionWorkWithSubcompaction(
         small_files.push_back(i);
     }
     int big_files_num = boundaries->size() - small_files.size();
-    int files_per_subcompaction = big_files_num/opts->MaxSubcompaction + 1;//Due to interger round down, we need add 1.
+    int files_per_subcompaction = big_files_num/static_cast<int>(max_ranges) + 1;//Due to interger round down, we need add 1.
     double mean = sum * 1.0 / opts->MaxSubcompaction;
     for (size_t i = 0; i <= boundaries->size(); i++) {
       size_t range_size = (*sizes)[i];
@@ -764,24 +1016,20 @@ Status Memory_Node_Keeper::DoCompactionWorkWithSubcompaction(
 
   }
   printf("Subcompaction number is %zu", compact->sub_compact_states.size());
-  const size_t num_threads = compact->sub_compact_states.size();
-  assert(num_threads > 0);
+  assert(!compact->sub_compact_states.empty());
 //  const uint64_t start_micros = env_->NowMicros();
 
-  // Launch a thread for each of subcompactions 1...num_threads-1
-  std::vector<port::Thread> thread_pool;
-  thread_pool.reserve(num_threads - 1);
-  for (size_t i = 1; i < compact->sub_compact_states.size(); i++) {
-    thread_pool.emplace_back(&Memory_Node_Keeper::ProcessKeyValueCompaction, this,
-                             &compact->sub_compact_states[i]);
-  }
-
-  // Always schedule the first subcompaction (whether or not there are also
-  // others) in the current thread to be efficient with resources
-  ProcessKeyValueCompaction(&compact->sub_compact_states[0]);
-  for (auto& thread : thread_pool) {
-    thread.join();
+  // At most MaxSubcompaction threads, one of which is the current thread,
+  // run the subcompactions until none is left.
+  std::vector<uint64_t> weights;
+  weights.reserve(compact->sub_compact_states.size());
+  for (auto& sub_compact : compact->sub_compact_states) {
+    weights.push_back(sub_compact.approx_size);
   }
+  WorkStealingRunner runner(opts->MaxSubcompaction, weights);
+  runner.Run([this, compact](size_t i) {
+    ProcessKeyValueCompaction(&compact->sub_compact_states[i]);
+  });
 //  CompactionStats stats;
 ////  stats.micros = env_->NowMicros() - start_micros;
 //  for (int which = 0; which < 2; which++) {
@@ -815,18 +1063,66 @@ Status Memory_Node_Keeper::DoCompactionWorkWithSubcompaction(
 //  write_stall_cv.notify_all();
   return status;
 }
+Status Memory_Node_Keeper::CompactLocally(
+    const Slice& compaction,
+    std::vector<std::shared_ptr<RemoteMemTableMetaData>>* outputs) {
+  Compaction c(opts.get());
+  c.DecodeFrom(compaction, 1);
+  CompactionState* compact = new CompactionState(&c);
+  std::string client_ip;
+  const uint64_t start_micros = Env::Default()->NowMicros();
+  Status status;
+  // The same choice as sst_compaction_handler.
+  if (usesubcompaction && c.num_input_files(0) >= 4 &&
+      c.num_input_files(1) > 1) {
+    status = DoCompactionWorkWithSubcompaction(compact, client_ip);
+  } else {
+    status = DoCompactionWork(compact, client_ip);
+  }
+  InstallCompactionResultsToComputePreparation(compact);
+  outputs->clear();
+  uint64_t bytes_written = 0;
+  for (auto& iter : *c.edit()->GetNewFiles()) {
+    outputs->push_back(iter.second);
+    bytes_written += iter.second->file_size;
+  }
+  if (status.ok()) {
+    uint64_t bytes_read = 0;
+    for (int which = 0; which < 2; which++) {
+      for (auto& f : c.inputs_[which]) {
+        bytes_read += f->file_size;
+      }
+    }
+    compactions_done_.fetch_add(1, std::memory_order_relaxed);
+    compaction_micros_.fetch_add(Env::Default()->NowMicros() - start_micros,
+                                 std::memory_order_relaxed);
+    compaction_bytes_read_.fetch_add(bytes_read, std::memory_order_relaxed);
+    compaction_bytes_written_.fetch_add(bytes_written,
+                                        std::memory_order_relaxed);
+  }
+  CleanupCompaction(compact);
+  return status;
+}
 void Memory_Node_Keeper::ProcessKeyValueCompaction(SubcompactionState* sub_compact){
   assert(sub_compact->builder == nullptr);
+  const uint64_t start_cpu_micros = port::ThreadCpuMicros();
   //Start and End are userkeys.
   Slice* start = sub_compact->start;
   Slice* end = sub_compact->end;
-//  if (snapshots_.empty()) {
-//    sub_compact->smallest_snapshot = versions_->LastSequence();
-//  } else {
-//    sub_compact->smallest_snapshot = snapshots_.oldest()->sequence_number();
-//  }
+  // The snapshots are on the compute node, which sends the oldest one.
+  sub_compact->smallest_snapshot = sub_compact->compaction->smallest_snapshot();
 
   Iterator* input = versions_->MakeInputIteratorMemoryServer(sub_compact->compaction);
+  if (opts->merge_operator != nullptr) {
+    // The merge operands no snapshot reads are applied to the value below
+    // them before the loop, which drops that value like any hidden one.
+    input = NewCompactionMergeIterator(
+        input, user_comparator(), opts->merge_operator,
+        sub_compact->smallest_snapshot,
+        &sub_compact->compaction->range_tombstones(),
+        sub_compact->compaction->level() + 1 == config::kNumLevels - 1,
+        rdma_mg.get());
+  }
 
   // Release mutex while we're actually doing the compaction work
   //  undefine_mutex.Unlock();
@@ -844,11 +1140,38 @@ void Memory_Node_Keeper::ProcessKeyValueCompaction(SubcompactionState* sub_compa
   } else {
     input->SeekToFirst();
   }
+  // The subcompaction is a pipeline of three stages: this thread merges the
+  // inputs and drops the obsolete entries, the builder thread adds the kept
+  // ones to the output tables, and the publisher thread finishes the full
+  // tables, whose filter and index blocks are the costly part. The output
+  // deque keeps the addresses of the outputs stable while both threads use
+  // them.
+  BoundedQueue<std::string> batches(kCompactionPipelineDepth);
+  BoundedQueue<std::pair<TableBuilder*, CompactionOutput*>> full_tables(
+      kCompactionPipelineDepth);
+  std::deque<CompactionOutput> outputs;
+  // Set once the input or a finished table fails, the stages then stop
+  // early and the tables left are abandoned.
+  std::atomic<bool> failed(false);
+  Status publish_status;
+  std::thread builder_thread([this, sub_compact, &batches, &full_tables,
+                              &outputs, &failed]() {
+    BuildCompactionOutputs(sub_compact, &batches, &full_tables, &outputs,
+                           &failed);
+    // The thread ran this stage only.
+    compaction_stage_cpu_micros_[kBuildStage].fetch_add(
+        port::ThreadCpuMicros(), std::memory_order_relaxed);
+  });
+  std::thread publisher_thread([this, sub_compact, &full_tables, &failed,
+                                &publish_status]() {
+    publish_status = PublishCompactionOutputs(sub_compact, &full_tables, &failed);
+    compaction_stage_cpu_micros_[kPublishStage].fetch_add(
+        port::ThreadCpuMicros(), std::memory_order_relaxed);
+  });
 #ifndef NDEBUG
   int Not_drop_counter = 0;
   int number_of_key = 0;
 #endif
-  Status status;
   // TODO: try to create two ikey for parsed key, they can in turn represent the current user key
   //  and former one, which can save the data copy overhead.
   ParsedInternalKey ikey;
@@ -857,6 +1180,9 @@ void Memory_Node_Keeper::ProcessKeyValueCompaction(SubcompactionState* sub_compa
   bool has_current_user_key = false;
   SequenceNumber last_sequence_for_key = kMaxSequenceNumber;
   Slice key;
+  Slice value;
+  std::string filtered_key;
+  std::string batch;
   assert(input->Valid());
 #ifndef NDEBUG
   std::string last_internal_key;
@@ -865,28 +1191,13 @@ void Memory_Node_Keeper::ProcessKeyValueCompaction(SubcompactionState* sub_compa
   while (input->Valid()) {
 
     key = input->key();
+    value = input->value();
     assert(key.ToString() != last_internal_key);
 #ifndef NDEBUG
     if (start){
       assert(internal_comparator_.Compare(key, *start) > 0);
     }
 #endif
-    //    assert(key.data()[0] == '0');
-    //We do not need to check whether the output file have too much overlap with level n + 2.
-    // If there is a lot of overlap subcompaction can be triggered.
-    //compact->compaction->ShouldStopBefore(key) &&
-//    if (sub_compact->builder != nullptr) {
-//
-//      sub_compact->current_output()->largest.SetFrom(ikey);
-//      status = FinishCompactionOutputFile(sub_compact, input);
-//      if (!status.ok()) {
-//        DEBUG("Should stop status not OK\n");
-//        break;
-//      }
-//    }
-    //TODO: record the largest key as the last ikey, find a more efficient way to record
-    // the last key of SSTable.
-
     // key merged below!!!
     // Handle key/value, add to state, etc.
     bool drop = false;
@@ -896,64 +1207,61 @@ void Memory_Node_Keeper::ProcessKeyValueCompaction(SubcompactionState* sub_compa
       has_current_user_key = false;
       last_sequence_for_key = kMaxSequenceNumber;
     } else {
-      if (!has_current_user_key){
-        //TODO: can we avoid the data copy here, can we set two buffers in block and make
-        // the old user key not be garbage collected so that the old Slice can be
-        // directly used here.
+      if (!has_current_user_key ||
+          user_comparator()->Compare(ikey.user_key, Slice(current_user_key)) !=
+          0) {
+        // First occurrence of this user key
         current_user_key.assign(ikey.user_key.data(), ikey.user_key.size());
 #ifndef NDEBUG
         last_internal_key = key.ToString();
 #endif
         has_current_user_key = true;
+        last_sequence_for_key = kMaxSequenceNumber;
       }
-      else if(user_comparator()->Compare(ikey.user_key, Slice(current_user_key)) !=
-      0) {
-        // First occurrence of this user key
-        current_user_key.assign(ikey.user_key.data(), ikey.user_key.size());
-#ifndef NDEBUG
-        last_internal_key = key.ToString();
-#endif
-        //        has_current_user_key = true;
-        //        last_sequence_for_key = kMaxSequenceNumber;
-        // this will result in the key not drop, next if will always be false because of
-        // the last_sequence_for_key.
-      }else{
+
+      if (last_sequence_for_key <= sub_compact->smallest_snapshot) {
+        // Hidden by an newer entry for same user key
+        drop = true;  // (A)
+      } else if ((ikey.type == kTypeValue || ikey.type == kTypeMerge ||
+                  ikey.type == kTypeBlobIndex) &&
+                 sub_compact->compaction->range_tombstones().ShouldDelete(
+                     user_comparator(), ikey.user_key, ikey.sequence,
+                     sub_compact->smallest_snapshot)) {
+        // Deleted by a range tombstone which every snapshot sees.
         drop = true;
+      } else if (ikey.type == kTypeDeletion &&
+                 ikey.sequence <= sub_compact->smallest_snapshot &&
+                 sub_compact->compaction->bottommost()) {
+        // No file below the output level has the key, and the older
+        // entries of the key in this compaction are dropped by rule (A).
+        drop = true;
+      } else if (ikey.sequence <= sub_compact->smallest_snapshot) {
+        // Only the entries no snapshot reads may be filtered.
+        FilterCompactionEntry(opts->compaction_filter,
+                              sub_compact->compaction->level(), ikey,
+                              &filtered_key, &key, &value);
       }
 
+      if (ikey.type != kTypeMerge) {
+        // A merge operand which is kept needs the entries below it.
+        last_sequence_for_key = ikey.sequence;
+      }
     }
 #ifndef NDEBUG
     number_of_key++;
 #endif
     if (!drop) {
-      // Open output file if necessary
-      if (sub_compact->builder == nullptr) {
-        status = OpenCompactionOutputFile(sub_compact);
-        if (!status.ok()) {
-          break;
-        }
-      }
-      if (sub_compact->builder->NumEntries() == 0) {
-//        assert(key.data()[0] == '\000');
-        sub_compact->current_output()->smallest.DecodeFrom(key);
-      }
 #ifndef NDEBUG
       Not_drop_counter++;
 #endif
-      sub_compact->builder->Add(key, input->value());
-      //      assert(key.data()[0] == '0');
-      // Close output file if it is big enough
-      if (sub_compact->builder->FileSize() >=
-      sub_compact->compaction->MaxOutputFileSize()) {
-//        assert(key.data()[0] == '\000');
-        sub_compact->current_output()->largest.DecodeFrom(key);
-        assert(!sub_compact->current_output()->largest.Encode().ToString().empty());
-
-        assert(internal_comparator_.Compare(sub_compact->current_output()->largest,
-                                            sub_compact->current_output()->smallest)>0);
-        status = FinishCompactionOutputFile(sub_compact, input);
-        if (!status.ok()) {
-          DEBUG("Iterator status is not OK\n");
+      // The entries are copied, the blocks they point to may be released
+      // once the iterator moves on.
+      PutLengthPrefixedSlice(&batch, key);
+      PutLengthPrefixedSlice(&batch, value);
+      if (batch.size() >= kCompactionBatchBytes) {
+        batches.Push(std::move(batch));
+        batch.clear();
+        if (failed.load(std::memory_order_relaxed)) {
           break;
         }
       }
@@ -978,50 +1286,120 @@ void Memory_Node_Keeper::ProcessKeyValueCompaction(SubcompactionState* sub_compa
 printf("For compaction, Total number of key touched is %d, KV left is %d\n", number_of_key,
        Not_drop_counter);
 #endif
-  if (status.ok() && sub_compact->builder != nullptr) {
-//    assert(key.size()>0);
-//    assert(key.data()[0] == '\000');
-    sub_compact->current_output()->largest.DecodeFrom(key);// The SSTable for subcompaction range will be (start, end]
-    assert(!sub_compact->current_output()->largest.Encode().ToString().empty());
-    status = FinishCompactionOutputFile(sub_compact, input);
+  Status status = input->status();
+  if (!status.ok()) {
+    printf("iterator Error!!!!!!!!!!!, Error: %s\n", status.ToString().c_str());
+    failed.store(true);
+  }
+  if (!batch.empty()) {
+    batches.Push(std::move(batch));
   }
+  batches.Close();
+  compaction_stage_cpu_micros_[kMergeStage].fetch_add(
+      port::ThreadCpuMicros() - start_cpu_micros, std::memory_order_relaxed);
+  builder_thread.join();
+  publisher_thread.join();
   if (status.ok()) {
-    status = input->status();
+    status = publish_status;
   }
+  sub_compact->outputs.assign(std::make_move_iterator(outputs.begin()),
+                              std::make_move_iterator(outputs.end()));
+  sub_compact->status = status;
   delete input;
   //  input = nullptr;
 }
-Status Memory_Node_Keeper::OpenCompactionOutputFile(SubcompactionState* compact) {
-  assert(compact != nullptr);
-  assert(compact->builder == nullptr);
-  uint64_t file_number;
-  {
-    //    undefine_mutex.Lock();
-    file_number = versions_->NewFileNumber();
-    //    pending_outputs_.insert(file_number);
-    CompactionOutput out;
-    out.number = file_number;
-    out.smallest.Clear();
-    out.largest.Clear();
-    compact->outputs.push_back(out);
-    //    undefine_mutex.Unlock();
+void Memory_Node_Keeper::BuildCompactionOutputs(
+    SubcompactionState* sub_compact, BoundedQueue<std::string>* batches,
+    BoundedQueue<std::pair<TableBuilder*, CompactionOutput*>>* full_tables,
+    std::deque<CompactionOutput>* outputs, std::atomic<bool>* failed) {
+  TableBuilder* builder = nullptr;
+  CompactionOutput* output = nullptr;
+  std::string batch;
+  while (batches->Pop(&batch)) {
+    // The batches still have to be taken after a failure, so that the
+    // merging stage does not block.
+    if (failed->load(std::memory_order_relaxed)) {
+      continue;
+    }
+    Slice entries(batch);
+    Slice key, value;
+    while (GetLengthPrefixedSlice(&entries, &key) &&
+           GetLengthPrefixedSlice(&entries, &value)) {
+      // Cut the output before it overlaps too many grandparent files, so
+      // that the compaction of the next level reads less.
+      if (sub_compact->ShouldStopBefore(key) && builder != nullptr) {
+        output->largest.DecodeFrom(builder->LastKey());
+        full_tables->Push({builder, output});
+        builder = nullptr;
+      }
+      // Open output file if necessary
+      if (builder == nullptr) {
+        outputs->emplace_back();
+        output = &outputs->back();
+        builder = OpenCompactionOutputFile(
+            output, sub_compact->compaction->level() + 1,
+            sub_compact->compaction->BloomBits());
+      }
+      if (builder->NumEntries() == 0) {
+        output->smallest.DecodeFrom(key);
+      }
+      builder->Add(key, value);
+      if (ExtractValueType(key) == kTypeBlobIndex) {
+        AddBlobChunks(value, &output->blob_chunks);
+      }
+      if (key.size() >= 8) {
+        output->largest_seq = std::max(
+            output->largest_seq,
+            DecodeFixed64(key.data() + key.size() - 8) >> 8);
+      }
+      // Close output file if it is big enough
+      if (builder->FileSize() >= sub_compact->compaction->MaxOutputFileSize()) {
+        output->largest.DecodeFrom(key);
+        assert(!output->largest.Encode().ToString().empty());
+        assert(internal_comparator_.Compare(output->largest, output->smallest) > 0);
+        full_tables->Push({builder, output});
+        builder = nullptr;
+      }
+    }
   }
-
-  // Make the output file
-  //  std::string fname = TableFileName(dbname_, file_number);
-  //  Status s = env_->NewWritableFile(fname, &compact->outfile);
-  Status s = Status::OK();
-  if (s.ok()) {
+  if (builder != nullptr) {
+    output->largest.DecodeFrom(builder->LastKey());
+    full_tables->Push({builder, output});
+  }
+  full_tables->Close();
+}
+Status Memory_Node_Keeper::PublishCompactionOutputs(
+    SubcompactionState* sub_compact,
+    BoundedQueue<std::pair<TableBuilder*, CompactionOutput*>>* full_tables,
+    std::atomic<bool>* failed) {
+  Status status;
+  std::pair<TableBuilder*, CompactionOutput*> table;
+  while (full_tables->Pop(&table)) {
+    Status s = FinishCompactionOutputFile(table.first, table.second,
+                                          failed->load());
+    if (!s.ok() && status.ok()) {
+      status = s;
+      failed->store(true);
+    }
+    sub_compact->total_bytes += table.second->file_size;
+  }
+  return status;
+}
+TableBuilder* Memory_Node_Keeper::OpenCompactionOutputFile(CompactionOutput* out,
+                                                          int level,
+                                                          int bloom_bits) {
+  out->number = versions_->NewFileNumber();
+  out->file_size = 0;
+  out->smallest.Clear();
+  out->largest.Clear();
+  out->largest_seq = 0;
 #ifndef BYTEADDRESSABLE
-    compact->builder = new TableBuilder_Memoryside(
-        *opts, Compact, rdma_mg);
+  (void)level;  // Only the byte addressable tables compress by level.
+  return new TableBuilder_Memoryside(*opts, Compact, rdma_mg, bloom_bits);
 #endif
 #ifdef BYTEADDRESSABLE
-    compact->builder = new TableBuilder_BAMS(
-        *opts, Compact, rdma_mg);
+  return new TableBuilder_BAMS(*opts, Compact, rdma_mg, level, bloom_bits);
 #endif
-  }
-  return s;
 }
 Status Memory_Node_Keeper::OpenCompactionOutputFile(CompactionState* compact) {
   assert(compact != nullptr);
@@ -1036,6 +1414,7 @@ Status Memory_Node_Keeper::OpenCompactionOutputFile(CompactionState* compact) {
 //    out.number = file_number;
     out.smallest.Clear();
     out.largest.Clear();
+    out.largest_seq = 0;
     compact->outputs.push_back(out);
     //    undefine_mutex.Unlock();
   }
@@ -1047,32 +1426,60 @@ Status Memory_Node_Keeper::OpenCompactionOutputFile(CompactionState* compact) {
   if (s.ok()) {
 #ifndef BYTEADDRESSABLE
     compact->builder = new TableBuilder_Memoryside(
-        *opts, Compact, rdma_mg);
+        *opts, Compact, rdma_mg, compact->compaction->BloomBits());
 #endif
 #ifdef BYTEADDRESSABLE
     compact->builder = new TableBuilder_BAMS(
-        *opts, Compact, rdma_mg);
+        *opts, Compact, rdma_mg, compact->compaction->level() + 1,
+        compact->compaction->BloomBits());
 #endif
   }
 //  printf("rep_ is %p", compact->builder->get_filter_map())
   return s;
 }
-Status Memory_Node_Keeper::FinishCompactionOutputFile(SubcompactionState* compact,
+Status Memory_Node_Keeper::FinishCompactionOutputFile(TableBuilder* builder,
+                                                      CompactionOutput* out,
+                                                      bool abandon) {
+  assert(builder != nullptr);
+  assert(!out->largest.Encode().empty());
+#ifndef NDEBUG
+    printf("File number %lu largest key size is %lu", out->number,
+           out->largest.Encode().ToString().size());
+#endif
+  assert(out->number != 0);
+
+  Status s;
+  if (!abandon) {
+    s = builder->Finish();
+  } else {
+    builder->Abandon();
+  }
+
+  builder->get_datablocks_map(out->remote_data_mrs);
+  builder->get_dataindexblocks_map(out->remote_dataindex_mrs);
+  builder->get_filter_map(out->remote_filter_mrs);
+#ifndef NDEBUG
+  uint64_t file_size = 0;
+  for(auto iter : out->remote_data_mrs){
+    file_size += iter.second->length;
+  }
+#endif
+  out->file_size = builder->FileSize();
+  out->num_entries = builder->NumEntries();
+  out->num_deletions = builder->NumDeletions();
+  out->key_stats = builder->KeyStats();
+  assert(file_size == out->file_size);
+  delete builder;
+  return s;
+}
+Status Memory_Node_Keeper::FinishCompactionOutputFile(CompactionState* compact,
                                           Iterator* input) {
   assert(compact != nullptr);
   //  assert(compact->outfile != nullptr);
   assert(compact->builder != nullptr);
 
   const uint64_t output_number = compact->current_output()->number;
-  assert(!compact->current_output()->largest.Encode().empty());
-#ifndef NDEBUG
-//  if (output_number == 11 ||output_number == 12 ){
-//    printf("Finish Compaction output number is 11 or 12\n");
-    printf("File number %lu largest key size is %lu", compact->current_output()->number,
-           compact->current_output()->largest.Encode().ToString().size());
-//  }
-#endif
-  assert(output_number != 0);
+//  assert(output_number != 0);
 
   // Check for iterator errors
   Status s = input->status();
@@ -1087,6 +1494,8 @@ Status Memory_Node_Keeper::FinishCompactionOutputFile(SubcompactionState* compac
   compact->builder->get_datablocks_map(compact->current_output()->remote_data_mrs);
   compact->builder->get_dataindexblocks_map(compact->current_output()->remote_dataindex_mrs);
   compact->builder->get_filter_map(compact->current_output()->remote_filter_mrs);
+  assert(compact->current_output()->remote_data_mrs.size()>0);
+  assert(compact->current_output()->remote_dataindex_mrs.size()>0);
 #ifndef NDEBUG
   uint64_t file_size = 0;
   for(auto iter : compact->current_output()->remote_data_mrs){
@@ -1095,62 +1504,10 @@ Status Memory_Node_Keeper::FinishCompactionOutputFile(SubcompactionState* compac
 #endif
   const uint64_t current_bytes = compact->builder->FileSize();
   compact->current_output()->file_size = current_bytes;
-  assert(file_size == current_bytes);
-  compact->total_bytes += current_bytes;
-  delete compact->builder;
-  compact->builder = nullptr;
-
-  // Finish and check for file errors
-  //  if (s.ok()) {
-  //    s = compact->outfile->Sync();
-  //  }
-  //  if (s.ok()) {
-  //    s = compact->outfile->Close();
-  //  }
-  //  delete compact->outfile;
-  //  compact->outfile = nullptr;
-
-  if (s.ok() && current_entries > 0) {
-    // Verify that the table is usable
-    //    Iterator* iter =
-    //        table_cache_->NewIterator(ReadOptions(), output_number, current_bytes);
-    //    s = iter->status();
-    //    delete iter;
-  }
-  return s;
-}
-Status Memory_Node_Keeper::FinishCompactionOutputFile(CompactionState* compact,
-                                          Iterator* input) {
-  assert(compact != nullptr);
-  //  assert(compact->outfile != nullptr);
-  assert(compact->builder != nullptr);
-
-  const uint64_t output_number = compact->current_output()->number;
-//  assert(output_number != 0);
-
-  // Check for iterator errors
-  Status s = input->status();
-  const uint64_t current_entries = compact->builder->NumEntries();
-  if (s.ok()) {
-    s = compact->builder->Finish();
-  } else {
-    printf("iterator Error!!!!!!!!!!!, Error: %s\n", s.ToString().c_str());
-    compact->builder->Abandon();
-  }
-
-  compact->builder->get_datablocks_map(compact->current_output()->remote_data_mrs);
-  compact->builder->get_dataindexblocks_map(compact->current_output()->remote_dataindex_mrs);
-  compact->builder->get_filter_map(compact->current_output()->remote_filter_mrs);
-  assert(compact->current_output()->remote_data_mrs.size()>0);
-  assert(compact->current_output()->remote_dataindex_mrs.size()>0);
-#ifndef NDEBUG
-  uint64_t file_size = 0;
-  for(auto iter : compact->current_output()->remote_data_mrs){
-    file_size += iter.second->length;
-  }
-#endif
-  const uint64_t current_bytes = compact->builder->FileSize();
-  compact->current_output()->file_size = current_bytes;
+  compact->current_output()->num_entries = current_entries;
+  compact->current_output()->num_deletions =
+      compact->builder->NumDeletions();
+  compact->current_output()->key_stats = compact->builder->KeyStats();
   assert(file_size == current_bytes);
   compact->total_bytes += current_bytes;
   delete compact->builder;
@@ -1199,13 +1556,20 @@ compact->compaction->AddInputDeletions(compact->compaction->edit());
       //TODO make all the metadata written into out
       meta->number = out.number;
       meta->file_size = out.file_size;
+      meta->num_entries = out.num_entries;
+      meta->num_deletions = out.num_deletions;
+      meta->key_stats = out.key_stats;
       meta->level = level+1;
       meta->smallest = out.smallest;
       assert(!out.largest.Encode().ToString().empty());
       meta->largest = out.largest;
+      meta->largest_seq = out.largest_seq;
       meta->remote_data_mrs = out.remote_data_mrs;
       meta->remote_dataindex_mrs = out.remote_dataindex_mrs;
       meta->remote_filter_mrs = out.remote_filter_mrs;
+      meta->prefix_extractor = FilterPrefixName(*opts);
+      meta->SetBlobChunks(std::vector<uint64_t>(out.blob_chunks.begin(),
+                                                out.blob_chunks.end()));
       compact->compaction->edit()->AddFile(level + 1, meta);
       assert(!meta->UnderCompaction);
 #ifndef NDEBUG
@@ -1232,12 +1596,19 @@ compact->compaction->AddInputDeletions(compact->compaction->edit());
         // TODO make all the metadata written into out
         meta->number = out.number;
         meta->file_size = out.file_size;
+        meta->num_entries = out.num_entries;
+        meta->num_deletions = out.num_deletions;
+        meta->key_stats = out.key_stats;
         meta->level = level+1;
         meta->smallest = out.smallest;
         meta->largest = out.largest;
+        meta->largest_seq = out.largest_seq;
         meta->remote_data_mrs = out.remote_data_mrs;
         meta->remote_dataindex_mrs = out.remote_dataindex_mrs;
         meta->remote_filter_mrs = out.remote_filter_mrs;
+        meta->prefix_extractor = FilterPrefixName(*opts);
+        meta->SetBlobChunks(std::vector<uint64_t>(out.blob_chunks.begin(),
+                                                  out.blob_chunks.end()));
         compact->compaction->edit()->AddFile(level + 1, meta);
         assert(!meta->UnderCompaction);
       }
@@ -1275,13 +1646,20 @@ Status Memory_Node_Keeper::InstallCompactionResultsToComputePreparation(
       //TODO make all the metadata written into out
 //      meta->number = out.number;
       meta->file_size = out.file_size;
+      meta->num_entries = out.num_entries;
+      meta->num_deletions = out.num_deletions;
+      meta->key_stats = out.key_stats;
       meta->level = level+1;
       meta->smallest = out.smallest;
       assert(!out.largest.Encode().ToString().empty());
       meta->largest = out.largest;
+      meta->largest_seq = out.largest_seq;
       meta->remote_data_mrs = out.remote_data_mrs;
       meta->remote_dataindex_mrs = out.remote_dataindex_mrs;
       meta->remote_filter_mrs = out.remote_filter_mrs;
+      meta->prefix_extractor = FilterPrefixName(*opts);
+      meta->SetBlobChunks(std::vector<uint64_t>(out.blob_chunks.begin(),
+                                                out.blob_chunks.end()));
       compact->compaction->edit()->AddFile(level + 1, meta);
       assert(!meta->UnderCompaction);
 
@@ -1296,12 +1674,19 @@ Status Memory_Node_Keeper::InstallCompactionResultsToComputePreparation(
         // TODO make all the metadata written into out
 //        meta->number = out.number;
         meta->file_size = out.file_size;
+        meta->num_entries = out.num_entries;
+        meta->num_deletions = out.num_deletions;
+        meta->key_stats = out.key_stats;
         meta->level = level+1;
         meta->smallest = out.smallest;
         meta->largest = out.largest;
+        meta->largest_seq = out.largest_seq;
         meta->remote_data_mrs = out.remote_data_mrs;
         meta->remote_dataindex_mrs = out.remote_dataindex_mrs;
         meta->remote_filter_mrs = out.remote_filter_mrs;
+        meta->prefix_extractor = FilterPrefixName(*opts);
+        meta->SetBlobChunks(std::vector<uint64_t>(out.blob_chunks.begin(),
+                                                  out.blob_chunks.end()));
         compact->compaction->edit()->AddFile(level + 1, meta);
         assert(!meta->UnderCompaction);
       }
@@ -1322,6 +1707,7 @@ Status Memory_Node_Keeper::InstallCompactionResultsToComputePreparation(
   void Memory_Node_Keeper::server_communication_thread(std::string client_ip,
                                                  int socket_fd) {
     printf("A new shared memory thread start\n");
+    rdma_mg->Pin_Thread_To_NIC_Node();
     printf("checkpoint1");
     char temp_receive[2];
     char temp_send[] = "Q";
@@ -1330,7 +1716,15 @@ Status Memory_Node_Keeper::InstallCompactionResultsToComputePreparation(
     rdma_mg->ConnectQPThroughSocket(client_ip, socket_fd, compute_node_id);
 
     printf("The connected compute node's id is %d\n", compute_node_id);
+    Detach_Compute_Node(compute_node_id);
     rdma_mg->res->sock_map.insert({compute_node_id, socket_fd});
+    if (rdma_mg->has_shared_receive_queue()) {
+      // Before the compute node can send anything.
+      std::unique_lock<std::mutex> lck(srq_poll_mtx_);
+      Main_Connection& connection = main_connections_[compute_node_id];
+      connection.client_ip = client_ip;
+      connection.socket_fd = socket_fd;
+    }
     //TODO: use Local_Memory_Allocation to bulk allocate, and assign within this function.
 //    ibv_mr send_mr[32] = {};
 //    for(int i = 0; i<32; i++){
@@ -1343,7 +1737,7 @@ Status Memory_Node_Keeper::InstallCompactionResultsToComputePreparation(
 //    }
 //    int buffer_number = 32;
     ibv_mr recv_mr[R_SIZE] = {};
-    for(int i = 0; i<R_SIZE; i++){
+    for(int i = 0; i<R_SIZE && !rdma_mg->has_shared_receive_queue(); i++){
       rdma_mg->Allocate_Local_RDMA_Slot(recv_mr[i], Message);
     }
 
@@ -1353,13 +1747,16 @@ Status Memory_Node_Keeper::InstallCompactionResultsToComputePreparation(
 //      fprintf(stderr, "memory registering failed by size of 0x%x\n", 1000);
 //    }
     //  post_receive<int>(recv_mr, client_ip);
-    for(int i = 0; i<R_SIZE; i++) {
+    for(int i = 0; i<R_SIZE && !rdma_mg->has_shared_receive_queue(); i++) {
       rdma_mg->post_receive<RDMA_Request>(&recv_mr[i], compute_node_id, client_ip);
     }
 //    rdma_mg_->post_receive(recv_mr, client_ip, sizeof(Computing_to_memory_msg));
     // sync after send & recv buffer creation and receive request posting.
     rdma_mg->local_mem_pool.reserve(100);
-    if(rdma_mg->pre_allocated_pool.size() < pr_size)
+    // The persistent memory is mapped once, as it is laid out the same on
+    // every run.
+    if (rdma_mg->pre_allocated_pool.size() < static_cast<size_t>(pr_size) &&
+        !rdma_mg->Has_Persistent_Memory())
     {
       std::unique_lock<std::shared_mutex> lck(rdma_mg->local_mem_mutex);
       rdma_mg->Preregister_Memory(pr_size);
@@ -1375,6 +1772,7 @@ Status Memory_Node_Keeper::InstallCompactionResultsToComputePreparation(
     //  post_send<int>(res->mr_send, client_ip);
     ibv_wc wc[3] = {};
     rdma_mg->connection_counter.fetch_add(1);
+    ResizeCompactorPool();
 //    std::thread* thread_sync;
     if (rdma_mg->connection_counter.load() == rdma_mg->compute_nodes.size()
         && rdma_mg->node_id == 0){
@@ -1396,11 +1794,16 @@ Status Memory_Node_Keeper::InstallCompactionResultsToComputePreparation(
     //  receive_msg_buf->content.qp_config.lid = ntohs(receive_msg_buf->content.qp_config.lid);
     //  ibv_wc wc[3] = {};
     // TODO: implement a heart beat mechanism.
+    if (rdma_mg->has_shared_receive_queue()) {
+      // The pollers take the messages from here on.
+      return;
+    }
     int buffer_position = 0;
     int miss_poll_counter = 0;
+    QP_Type qp_type = QP_Type_From_String(client_ip);
     while (true) {
 //      rdma_mg->poll_completion(wc, 1, client_ip, false, compute_node_id);
-      if (rdma_mg->try_poll_completions(wc, 1, client_ip, false, compute_node_id) == 0){
+      if (rdma_mg->try_poll_completions(wc, 1, qp_type, false, compute_node_id) == 0){
         // exponetial back off to save cpu cycles.
         if(++miss_poll_counter < 256){
           continue;
@@ -1441,72 +1844,11 @@ Status Memory_Node_Keeper::InstallCompactionResultsToComputePreparation(
 
       // copy the pointer of receive buf to a new place because
       // it is the same with send buff pointer.
-      if (receive_msg_buf->command == create_mr_) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_position],
-                                            compute_node_id,
-                                            client_ip);
-
-        create_mr_handler(receive_msg_buf, client_ip, compute_node_id);
-//        rdma_mg_->post_send<ibv_mr>(send_mr,client_ip);  // note here should be the mr point to the send buffer.
-//        rdma_mg_->poll_completion(wc, 1, client_ip, true);
-      } else if (receive_msg_buf->command == create_qp_) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_position],
-                                            compute_node_id,
-                                            client_ip);
-        create_qp_handler(receive_msg_buf, client_ip, compute_node_id);
-        //        rdma_mg_->post_send<registered_qp_config>(send_mr, client_ip);
-//        rdma_mg_->poll_completion(wc, 1, client_ip, true);
-      } else if (receive_msg_buf->command == install_version_edit) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_position],
-                                            compute_node_id,
-                                            client_ip);
-        //TODO: implement a durable bg thread and make a shadow verison set if possible.
-
-        install_version_edit_handler(receive_msg_buf, client_ip,
-                                     compute_node_id);
-      } else if (receive_msg_buf->command == near_data_compaction) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_position],
-                                            compute_node_id,
-                                            client_ip);
-        Arg_for_handler* argforhandler = new Arg_for_handler{.request=receive_msg_buf,
-                           .client_ip = client_ip,.target_node_id = compute_node_id};
-        BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = argforhandler};
-        Compactor_pool_.Schedule(&Memory_Node_Keeper::RPC_Compaction_Dispatch, thread_pool_args);
-//        sst_compaction_handler(nullptr);
-      } else if (receive_msg_buf->command == SSTable_gc) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_position],
-                                            compute_node_id,
-                                            client_ip);
-        Arg_for_handler* argforhandler = new Arg_for_handler{.request=receive_msg_buf,
-                           .client_ip = client_ip,.target_node_id = compute_node_id};
-        BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = argforhandler};
-        Message_handler_pool_.Schedule(
-            &Memory_Node_Keeper::RPC_Garbage_Collection_Dispatch, thread_pool_args);
-//TODO: add a handle function for the option value
-      } else if (receive_msg_buf->command == version_unpin_) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_position],
-                                            compute_node_id,
-                                            client_ip);
-        version_unpin_handler(receive_msg_buf, client_ip);
-      } else if (receive_msg_buf->command == sync_option) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_position],
-                                            compute_node_id,
-                                            client_ip);
-        sync_option_handler(receive_msg_buf, client_ip, compute_node_id);
-      } else if (receive_msg_buf->command == qp_reset_) {// depracated functions
-        //THis should not be called because the recevei mr will be reset and the buffer
-        // counter will be reset as 0
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_position],
-                                            compute_node_id,
-                                            client_ip);
-        qp_reset_handler(receive_msg_buf, client_ip, socket_fd,
-                         compute_node_id);
-        DEBUG("QP has been reconnect from the memory node side\n");
-        //TODO: Pause all the background tasks because the remote qp is not ready.
-        // stop sending back messasges. The compute node may not reconnect its qp yet!
-      } else {
-        printf("corrupt message from client. %d\n", receive_msg_buf->command);
-        assert(false);
+      rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_position],
+                                          compute_node_id,
+                                          client_ip);
+      if (!Dispatch_Request(receive_msg_buf, client_ip, compute_node_id,
+                            socket_fd)) {
         break;
       }
       // increase the buffer index
@@ -1519,10 +1861,232 @@ Status Memory_Node_Keeper::InstallCompactionResultsToComputePreparation(
     assert(false);
     // TODO: Build up a exit method for shared memory side, don't forget to destroy all the RDMA resourses.
   }
+  void Memory_Node_Keeper::shared_receive_polling_thread() {
+    rdma_mg->Pin_Thread_To_NIC_Node();
+    ibv_wc wc[1] = {};
+    uint8_t compute_node_id;
+    int miss_poll_counter = 0;
+    while (true) {
+      Main_Connection* connection = nullptr;
+      uint64_t ticket = 0;
+      int polled;
+      {
+        std::unique_lock<std::mutex> lck(srq_poll_mtx_);
+        polled = rdma_mg->Poll_Shared_Receives(wc, &compute_node_id, 1);
+        if (polled > 0 && !(wc[0].wc_flags & IBV_WC_WITH_IMM)) {
+          connection = &main_connections_.at(compute_node_id);
+          // Taken in the order of the queue, under srq_poll_mtx_.
+          ticket = connection->next_ticket++;
+        }
+      }
+      if (polled <= 0) {
+        // exponetial back off to save cpu cycles.
+        if (++miss_poll_counter < 256) {
+          continue;
+        }
+        usleep(miss_poll_counter < 512 ? 16 :
+               miss_poll_counter < 1024 ? 256 : 1024);
+        continue;
+      }
+      miss_poll_counter = 0;
+      ibv_mr* recv_mr = reinterpret_cast<ibv_mr*>(wc[0].wr_id);
+      if (connection == nullptr) {
+        // A write with immediate.
+        cv_temp.notify_all();
+        rdma_mg->Post_Shared_Receive(recv_mr);
+        continue;
+      }
+      RDMA_Request* receive_msg_buf = new RDMA_Request();
+      *receive_msg_buf = *(RDMA_Request*)recv_mr->addr;
+      rdma_mg->Post_Shared_Receive(recv_mr);
+      // The messages of a compute node are handled in the order they came,
+      // which the edits it installs rely on.
+      std::unique_lock<std::mutex> lck(connection->mtx);
+      connection->cv.wait(lck, [&] { return connection->serving == ticket; });
+      lck.unlock();
+      if (!Dispatch_Request(receive_msg_buf, connection->client_ip,
+                            compute_node_id, connection->socket_fd)) {
+        assert(false);
+      }
+      lck.lock();
+      connection->serving++;
+      lck.unlock();
+      connection->cv.notify_all();
+    }
+  }
+  bool Memory_Node_Keeper::Dispatch_Request(RDMA_Request* receive_msg_buf,
+                                            std::string& client_ip,
+                                            uint8_t compute_node_id,
+                                            int socket_fd) {
+    if (receive_msg_buf->command >= 0 &&
+        receive_msg_buf->command < kNumRPCs) {
+      rpc_counts_[compute_node_id][receive_msg_buf->command].fetch_add(
+          1, std::memory_order_relaxed);
+    }
+    if (receive_msg_buf->command == create_mr_) {
+      create_mr_handler(receive_msg_buf, client_ip, compute_node_id);
+//        rdma_mg_->post_send<ibv_mr>(send_mr,client_ip);  // note here should be the mr point to the send buffer.
+//        rdma_mg_->poll_completion(wc, 1, client_ip, true);
+    } else if (receive_msg_buf->command == release_mr_) {
+      release_mr_handler(receive_msg_buf, client_ip, compute_node_id);
+    } else if (receive_msg_buf->command == create_qp_) {
+      create_qp_handler(receive_msg_buf, client_ip, compute_node_id);
+      //        rdma_mg_->post_send<registered_qp_config>(send_mr, client_ip);
+//        rdma_mg_->poll_completion(wc, 1, client_ip, true);
+    } else if (receive_msg_buf->command == install_version_edit) {
+      //TODO: implement a durable bg thread and make a shadow verison set if possible.
+
+      install_version_edit_handler(receive_msg_buf, client_ip,
+                                   compute_node_id);
+    } else if (receive_msg_buf->command == near_data_compaction) {
+      Arg_for_handler* argforhandler = new Arg_for_handler{.request=receive_msg_buf,
+                         .client_ip = client_ip,.target_node_id = compute_node_id};
+      BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = argforhandler};
+      const sst_compaction& request = receive_msg_buf->content.sstCompact;
+      argforhandler->scheduled_micros = Env::Default()->NowMicros();
+      const int threads = max_compaction_threads_ > 0
+                              ? max_compaction_threads_
+                              : opts->max_background_compactions;
+      argforhandler->hand_back =
+          hand_back_waiting_ >= 0 &&
+          static_cast<int>(compactions_in_flight_.fetch_add(1)) >=
+              threads + hand_back_waiting_;
+      if (argforhandler->hand_back) {
+        // Answered at once, not behind the compactions it would wait for.
+        Message_handler_pool_.Schedule(
+            &Memory_Node_Keeper::RPC_Compaction_Dispatch, thread_pool_args);
+      } else {
+        // The shards take turns, and a compaction from level 0 goes ahead
+        // of the deeper ones, the one of a shard whose writes are slowed
+        // down ahead of all.
+        Compactor_pool_.Schedule(
+            &Memory_Node_Keeper::RPC_Compaction_Dispatch, thread_pool_args,
+            CompactionTag(compute_node_id, request.shard_id),
+            request.stalled       ? kFlushPriority
+            : request.level == 0 ? kL0CompactionPriority
+                                 : kCompactionPriority,
+            request.weight);
+      }
+//        sst_compaction_handler(nullptr);
+    } else if (receive_msg_buf->command == SSTable_gc) {
+      Arg_for_handler* argforhandler = new Arg_for_handler{.request=receive_msg_buf,
+                         .client_ip = client_ip,.target_node_id = compute_node_id};
+      BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = argforhandler};
+      Garbage_collection_pool_.Schedule(
+          &Memory_Node_Keeper::RPC_Garbage_Collection_Dispatch, thread_pool_args,
+          nullptr, kGCPriority);
+    } else if (receive_msg_buf->command == cold_sstable_read_ ||
+               receive_msg_buf->command == promote_sstable_) {
+      Arg_for_handler* argforhandler = new Arg_for_handler{.request=receive_msg_buf,
+                         .client_ip = client_ip,.target_node_id = compute_node_id};
+      BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = argforhandler};
+      Message_handler_pool_.Schedule(
+          &Memory_Node_Keeper::RPC_Cold_Table_Dispatch, thread_pool_args);
+    } else if (receive_msg_buf->command == remote_log_) {
+      Arg_for_handler* argforhandler = new Arg_for_handler{.request=receive_msg_buf,
+                         .client_ip = client_ip,.target_node_id = compute_node_id};
+      BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = argforhandler};
+      Message_handler_pool_.Schedule(
+          &Memory_Node_Keeper::RPC_Remote_Log_Dispatch, thread_pool_args);
+    } else if (receive_msg_buf->command == shard_sequencer_) {
+      Arg_for_handler* argforhandler = new Arg_for_handler{.request=receive_msg_buf,
+                         .client_ip = client_ip,.target_node_id = compute_node_id};
+      BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = argforhandler};
+      Message_handler_pool_.Schedule(
+          &Memory_Node_Keeper::RPC_Shard_Sequencer_Dispatch, thread_pool_args);
+    } else if (receive_msg_buf->command == scan_pushdown_) {
+      Arg_for_handler* argforhandler = new Arg_for_handler{.request=receive_msg_buf,
+                         .client_ip = client_ip,.target_node_id = compute_node_id};
+      BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = argforhandler};
+      // A scan reads as much as a compaction, it runs on the same threads,
+      // ahead of the compactions since the client waits on it.
+      Compactor_pool_.Schedule(&Memory_Node_Keeper::RPC_Scan_Dispatch,
+                               thread_pool_args, nullptr, kFlushPriority);
+    } else if (receive_msg_buf->command == flush_offload_) {
+      Arg_for_handler* argforhandler = new Arg_for_handler{.request=receive_msg_buf,
+                         .client_ip = client_ip,.target_node_id = compute_node_id};
+      BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = argforhandler};
+      // The writes of the compute node stall on its flushes.
+      Compactor_pool_.Schedule(&Memory_Node_Keeper::RPC_Flush_Offload_Dispatch,
+                               thread_pool_args, nullptr, kFlushPriority);
+//TODO: add a handle function for the option value
+    } else if (receive_msg_buf->command == version_unpin_) {
+      version_unpin_handler(receive_msg_buf, client_ip);
+    } else if (receive_msg_buf->command == sync_option) {
+      sync_option_handler(receive_msg_buf, client_ip, compute_node_id);
+    } else if (receive_msg_buf->command == retrieve_recovered_version_) {
+      recovered_version_handler(receive_msg_buf, client_ip,
+                                compute_node_id);
+    } else if (receive_msg_buf->command == qp_reset_) {// depracated functions
+      //THis should not be called because the recevei mr will be reset and the buffer
+      // counter will be reset as 0
+      qp_reset_handler(receive_msg_buf, client_ip, socket_fd,
+                       compute_node_id);
+      DEBUG("QP has been reconnect from the memory node side\n");
+      //TODO: Pause all the background tasks because the remote qp is not ready.
+      // stop sending back messasges. The compute node may not reconnect its qp yet!
+    } else {
+      printf("corrupt message from client. %d\n", receive_msg_buf->command);
+      assert(false);
+      return false;
+    }
+    return true;
+  }
   void Memory_Node_Keeper::Server_to_Client_Communication() {
   if (rdma_mg->resources_create()) {
     fprintf(stderr, "failed to create resources\n");
   }
+  // The threads polling the NIC and the ones working on the registered
+  // memory run on the NUMA node of the NIC.
+  std::function<void()> pin = []() { rdma_mg->Pin_Thread_To_NIC_Node(); };
+  Compactor_pool_.SetThreadInit(pin);
+  Message_handler_pool_.SetThreadInit(pin);
+  Garbage_collection_pool_.SetThreadInit(pin);
+  Persistency_bg_pool_.SetThreadInit(pin);
+  if (cold_store_ != nullptr) {
+    // The files of a former run mean nothing without its MANIFEST.
+    Status s = cold_store_->Open(recover_);
+    if (!s.ok()) {
+      fprintf(stderr, "failed to open the cold storage: %s\n",
+              s.ToString().c_str());
+      cold_store_.reset();
+    }
+  }
+  if (recover_) {
+    Status s = RecoverPersistedSSTables();
+    if (!s.ok()) {
+      fprintf(stderr, "failed to recover the SSTables: %s\n",
+              s.ToString().c_str());
+      return;
+    }
+  }
+  if (srq_pollers_ > 0 && rdma_mg->Create_Shared_Receive_Queue(R_SIZE)) {
+    for (int i = 0; i < srq_pollers_; i++) {
+      srq_poller_threads_.emplace_back(
+          &Memory_Node_Keeper::shared_receive_polling_thread, this);
+    }
+  }
+  // The compute nodes read over RC from a memory node without one.
+  rdma_mg->Create_DC_Target();
+  if (stats_port_ != 0) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int option = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(int));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(stats_port_);
+    if (listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listen_fd, 4) != 0) {
+      fprintf(stderr, "failed to serve the statistics on port %u, errno %d\n",
+              stats_port_, errno);
+      if (listen_fd >= 0) close(listen_fd);
+    } else {
+      stats_thread_ = std::thread(&Memory_Node_Keeper::stats_server_thread,
+                                  this, listen_fd);
+    }
+  }
   int rc;
   if (rdma_mg->rdma_config.gid_idx >= 0) {
     printf("checkpoint0");
@@ -1639,10 +2203,51 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
 //      printf("Now the Remote memory regularated by compute node is %zu GB",
 //             rdma_mg->local_mem_pool.size());
   }
+  {
+    std::unique_lock<std::mutex> lck(reattach_mtx_);
+    regions_[target_node_id].push_back(mr);
+  }
 
   send_pointer->content.mr = *mr;
   send_pointer->received = true;
 
+  rdma_mg->RDMA_Write(request->buffer, request->rkey, &send_mr,
+                      sizeof(RDMA_Reply), client_ip, IBV_SEND_SIGNALED, 1, target_node_id);
+  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
+  delete request;
+  }
+  void Memory_Node_Keeper::release_mr_handler(RDMA_Request* request,
+                                              std::string& client_ip,
+                                              uint8_t target_node_id) {
+    DEBUG("Release mr\n");
+  ibv_mr send_mr;
+  rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+  RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
+  ibv_mr* mr = nullptr;
+  {
+    std::unique_lock<std::mutex> lck(reattach_mtx_);
+    std::vector<ibv_mr*>& regions = regions_[target_node_id];
+    for (auto iter = regions.begin(); iter != regions.end(); ++iter) {
+      if ((*iter)->addr == request->content.rr.addr) {
+        mr = *iter;
+        regions.erase(iter);
+        break;
+      }
+    }
+  }
+  if (mr != nullptr) {
+    assert(mr->length == request->content.rr.size);
+    // The region stays registered, as the preregistered ones.
+    std::unique_lock<std::shared_mutex> lck(rdma_mg->local_mem_mutex);
+    rdma_mg->total_registered_size -= mr->length;
+    rdma_mg->pre_allocated_pool.push_back(mr);
+  } else {
+    fprintf(stderr, "node %u released the unknown region %p\n",
+            target_node_id, request->content.rr.addr);
+  }
+  send_pointer->content.mr = {};
+  send_pointer->received = true;
+
   rdma_mg->RDMA_Write(request->buffer, request->rkey, &send_mr,
                       sizeof(RDMA_Reply), client_ip, IBV_SEND_SIGNALED, 1, target_node_id);
   rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
@@ -1653,7 +2258,6 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
   void Memory_Node_Keeper::create_qp_handler(RDMA_Request* request,
                                              std::string& client_ip,
                                              uint8_t target_node_id) {
-    int rc;
     DEBUG("Create new qp\n");
   assert(request->buffer != nullptr);
   assert(request->rkey != 0);
@@ -1677,21 +2281,8 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
   rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
   RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
   ibv_qp* qp = rdma_mg->create_qp_Mside(false, new_qp_id);
-  if (rdma_mg->rdma_config.gid_idx >= 0) {
-    rc = ibv_query_gid(rdma_mg->res->ib_ctx, rdma_mg->rdma_config.ib_port,
-                       rdma_mg->rdma_config.gid_idx, &(rdma_mg->res->my_gid));
-    if (rc) {
-      fprintf(stderr, "could not get gid for port %d, index %d\n",
-              rdma_mg->rdma_config.ib_port, rdma_mg->rdma_config.gid_idx);
-      return;
-    }
-  } else
-    memset(&(rdma_mg->res->my_gid), 0, sizeof(rdma_mg->res->my_gid));
-  /* exchange using TCP sockets info required to connect QPs */
-  send_pointer->content.qp_config.qp_num =
-      rdma_mg->qp_map_Mside[new_qp_id]->qp_num;
-  send_pointer->content.qp_config.lid = rdma_mg->res->port_attr.lid;
-  memcpy(send_pointer->content.qp_config.gid, &(rdma_mg->res->my_gid), 16);
+  // The queue pairs of the compute nodes are spread over the ports.
+  rdma_mg->Local_QP_Config(qp, &send_pointer->content.qp_config);
   send_pointer->received = true;
   registered_qp_config* remote_con_data = new registered_qp_config(request->content.qp_config);
   std::shared_lock<std::shared_mutex> l1(rdma_mg->qp_cq_map_mutex);
@@ -1705,6 +2296,19 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
   rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
   delete request;
   }
+  uint32_t Memory_Node_Keeper::HotFileFrequency(uint64_t file_number,
+                                                uint8_t creator_node_id) {
+    std::unique_lock<std::mutex> lck(hot_files_mtx_);
+    for (const auto& node : hot_files_) {
+      for (const auto& hot_file : node.second) {
+        if (std::get<0>(hot_file) == file_number &&
+            std::get<1>(hot_file) == creator_node_id) {
+          return std::get<2>(hot_file);
+        }
+      }
+    }
+    return 0;
+  }
   void Memory_Node_Keeper::install_version_edit_handler(
       RDMA_Request* request, std::string& client_ip, uint8_t target_node_id) {
   printf("install version\n");
@@ -1750,28 +2354,41 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
 
     counter++;
   }
-  // Will delete the version edit in the background threads.
-  VersionEdit* version_edit = new VersionEdit(0);
-  version_edit->DecodeFrom(
-      Slice((char*)edit_recv_mr.addr, request->content.ive.buffer_size), 1,
-      table_cache_);
-  assert(version_edit->GetNewFilesNum() > 0);
-  DEBUG_arg("Version edit decoded, new file number is %zu", version_edit->GetNewFilesNum());
+  // The compute node batches the edits queued while its last message was
+  // out.
+  std::vector<VersionEdit*> version_edits;
+  Slice batch((char*)edit_recv_mr.addr, request->content.ive.buffer_size - 1);
+  for (uint32_t i = 0; i < request->content.ive.num_edits; i++) {
+    Slice encoded;
+    if (!GetLengthPrefixedSlice(&batch, &encoded)) {
+      fprintf(stderr, "corrupted version edit batch\n");
+      break;
+    }
+    // Will delete the version edit in the background threads.
+    VersionEdit* version_edit = new VersionEdit(0);
+    version_edit->DecodeFrom(encoded, 1, table_cache_);
+    DEBUG_arg("Version edit decoded, new file number is %zu", version_edit->GetNewFilesNum());
+    if (!version_edit->GetHotFiles().empty()) {
+      std::unique_lock<std::mutex> lck(hot_files_mtx_);
+      hot_files_[target_node_id] = version_edit->GetHotFiles();
+    }
+    Track_Version_Edit(target_node_id, request->content.ive.shard_id,
+                       version_edit);
+    version_edits.push_back(version_edit);
+  }
 //  std::unique_lock<std::mutex> lck(versionset_mtx, std::defer_lock);
 //  versions_->LogAndApply(version_edit, &lck);
   //Merge the version edit below.
 #ifdef WITHPERSISTENCE
     {
       std::unique_lock<std::mutex> lck(merger_mtx);
-      ve_merger.merge_one_edit(version_edit);
-      // NOt digesting enough edit, directly get the next edit.
-
-      // unpin the sstables merged during the edit merge
-      if (ve_merger.ready_to_upin_merged_file){
-        UnpinSSTables_RPC(&ve_merger.merged_file_numbers, client_ip);
-        ve_merger.ready_to_upin_merged_file = false;
-        ve_merger.merged_file_numbers.clear();
+      for (VersionEdit* version_edit : version_edits) {
+        ve_merger.merge_one_edit(version_edit);
       }
+      ve_merger.persist_epochs.push_back(
+          {target_node_id, request->buffer_large, request->rkey_large,
+           request->content.ive.version_id});
+      unpersisted_edits_.fetch_add(1);
 #ifndef NDEBUG
       for(auto iter : *ve_merger.GetNewFiles()){
         printf("The file for this ve_merger is %lu\n", iter.second->number);
@@ -1809,68 +2426,442 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
       RDMA_Request* request = ((Arg_for_handler*)arg)->request;
       std::string client_ip = ((Arg_for_handler*)arg)->client_ip;
       uint8_t target_node_id = ((Arg_for_handler*)arg)->target_node_id;
-      printf("Garbage collection\n");
-
-      void* remote_prt = request->buffer;
-      uint32_t remote_rkey = request->rkey;
-      unsigned int imm_num = request->imm_num;
+      printf("Garbage collection ring for node %d\n", target_node_id);
+      assert(request->content.gc.buffer_size == GC_RING_SIZE);
       ibv_mr send_mr;
-//      ibv_mr recv_mr;
-      ibv_mr large_recv_mr;
-//      ibv_mr large_send_mr;
       rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
-//      rdma_mg->Allocate_Local_RDMA_Slot(recv_mr, "message");
-      rdma_mg->Allocate_Local_RDMA_Slot(large_recv_mr, Version_edit);
-//      rdma_mg->Allocate_Local_RDMA_Slot(large_send_mr, "version_edit");
       RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
-      //    send_pointer->content. = {};
-      // set up the communication buffer information.
-//      send_pointer->reply_buffer = recv_mr.addr;
-//      send_pointer->rkey = recv_mr.rkey;
-      send_pointer->buffer_large = large_recv_mr.addr;
-      send_pointer->rkey_large = large_recv_mr.rkey;
-
-      assert(request->content.gc.buffer_size < large_recv_mr.length);
+      *send_pointer = {};
+      char* buff = new char[GC_RING_SIZE]();
+      ibv_mr* mr = ibv_reg_mr(rdma_mg->res->pd, buff, GC_RING_SIZE,
+                              IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                                  IBV_ACCESS_REMOTE_WRITE);
+      if (mr == nullptr) {
+        // The compute node sees a null ring and asks again later.
+        fprintf(stderr, "garbage collection ring registration failed\n");
+        delete[] buff;
+      } else {
+        std::unique_lock<std::mutex> lck(gc_rings_mtx_);
+        auto iter = gc_rings_.find(target_node_id);
+        if (iter != gc_rings_.end()) {
+          // The compute node restarted, its batches count from 0 again.
+          char* old_buff = static_cast<char*>(iter->second.mr->addr);
+          ibv_dereg_mr(iter->second.mr);
+          delete[] old_buff;
+        }
+        gc_rings_[target_node_id] = {mr, 0};
+        if (!gc_ring_thread_.joinable()) {
+          gc_ring_thread_ = std::thread(&Memory_Node_Keeper::gc_ring_poller, this);
+        }
+        send_pointer->content.mr = *mr;
+      }
       send_pointer->received = true;
-      //TODO: how to check whether the version edit message is ready, we need to know the size of the
-      // version edit in the first REQUEST from compute node.
-      volatile uint64_t * polling_byte = (uint64_t*)((char*)large_recv_mr.addr + request->content.gc.buffer_size - sizeof(uint64_t));
-      *polling_byte = 0;
-      asm volatile ("sfence\n" : : );
-      asm volatile ("lfence\n" : : );
-      asm volatile ("mfence\n" : : );
-      rdma_mg->RDMA_Write(remote_prt, remote_rkey, &send_mr, sizeof(RDMA_Reply),
-                          client_ip, IBV_SEND_SIGNALED, 1, target_node_id);
-      size_t counter = 0;
-      // polling the finishing bit for compaction task transmission.
-      while (*polling_byte == 0){
-        _mm_clflush(polling_byte);
-        asm volatile ("sfence\n" : : );
-        asm volatile ("lfence\n" : : );
-        asm volatile ("mfence\n" : : );
-        if (counter == 10000){
-          std::fprintf(stderr, "Polling Remote Compaction handler\r");
-          std::fflush(stderr);
-          counter = 0;
+      rdma_mg->RDMA_Write(request->buffer, request->rkey, &send_mr,
+                          sizeof(RDMA_Reply), client_ip, IBV_SEND_SIGNALED, 1,
+                          target_node_id);
+      rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
+      delete request;
+      delete (Arg_for_handler*)arg;
+  }
+  void Memory_Node_Keeper::remote_log_handler(void* arg) {
+      RDMA_Request* request = ((Arg_for_handler*)arg)->request;
+      std::string client_ip = ((Arg_for_handler*)arg)->client_ip;
+      uint8_t target_node_id = ((Arg_for_handler*)arg)->target_node_id;
+      const remote_log rl = request->content.rl;
+      ibv_mr send_mr;
+      rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+      RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
+      *send_pointer = {};
+      const uint8_t owner =
+          rl.owner_node_id != 0 ? rl.owner_node_id : target_node_id;
+      const auto key = std::make_tuple(owner, rl.shard_id, rl.edits);
+      {
+        std::unique_lock<std::mutex> lck(remote_logs_mtx_);
+        auto iter = remote_logs_.find(key);
+        if (iter == remote_logs_.end() && owner == target_node_id) {
+          printf("Remote %s of shard %d of node %d\n",
+                 rl.edits ? "edit log" : "log", rl.shard_id, target_node_id);
+          char* buff = new char[rl.size]();
+          ibv_mr* mr = ibv_reg_mr(rdma_mg->res->pd, buff, rl.size,
+                                  IBV_ACCESS_LOCAL_WRITE |
+                                      IBV_ACCESS_REMOTE_READ |
+                                      IBV_ACCESS_REMOTE_WRITE);
+          if (mr == nullptr) {
+            // The compute node sees a null log and fails to open.
+            fprintf(stderr, "remote log registration failed\n");
+            delete[] buff;
+          } else {
+            iter = remote_logs_.emplace(key, mr).first;
+          }
+        }
+        if (iter != remote_logs_.end()) {
+          send_pointer->content.mr = *iter->second;
+        }
+      }
+      send_pointer->received = true;
+      rdma_mg->RDMA_Write(request->buffer, request->rkey, &send_mr,
+                          sizeof(RDMA_Reply), client_ip, IBV_SEND_SIGNALED, 1,
+                          target_node_id);
+      rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
+      delete request;
+      delete (Arg_for_handler*)arg;
+  }
+  void Memory_Node_Keeper::shard_sequencer_handler(void* arg) {
+      RDMA_Request* request = ((Arg_for_handler*)arg)->request;
+      std::string client_ip = ((Arg_for_handler*)arg)->client_ip;
+      uint8_t target_node_id = ((Arg_for_handler*)arg)->target_node_id;
+      const shard_sequencer ss = request->content.ss;
+      ibv_mr send_mr;
+      rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+      RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
+      *send_pointer = {};
+      {
+        std::unique_lock<std::mutex> lck(remote_logs_mtx_);
+        if (shard_sequencers_ == nullptr) {
+          // One counter for every shard id, the sequences start at 1.
+          const size_t num = 1 + std::numeric_limits<uint8_t>::max();
+          uint64_t* counters = new uint64_t[num];
+          std::fill(counters, counters + num, 1);
+          shard_sequencers_ =
+              ibv_reg_mr(rdma_mg->res->pd, counters, num * sizeof(uint64_t),
+                         IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                             IBV_ACCESS_REMOTE_WRITE |
+                             IBV_ACCESS_REMOTE_ATOMIC);
+          if (shard_sequencers_ == nullptr) {
+            // The compute node sees a null counter and fails to open.
+            fprintf(stderr, "shard sequencer registration failed\n");
+            delete[] counters;
+          }
+        }
+        if (shard_sequencers_ != nullptr) {
+          ibv_mr counter = *shard_sequencers_;
+          counter.addr = static_cast<uint64_t*>(counter.addr) + ss.shard_id;
+          counter.length = sizeof(uint64_t);
+          send_pointer->content.mr = counter;
         }
-
-        counter++;
       }
-      assert(request->content.gc.buffer_size%sizeof(uint64_t) == 0);
-      rdma_mg->BatchGarbageCollection((uint64_t*)large_recv_mr.addr, request->content.gc.buffer_size);
+      send_pointer->received = true;
+      rdma_mg->RDMA_Write(request->buffer, request->rkey, &send_mr,
+                          sizeof(RDMA_Reply), client_ip, IBV_SEND_SIGNALED, 1,
+                          target_node_id);
       rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
-//      rdma_mg->Deallocate_Local_RDMA_Slot(recv_mr.addr, "message");
-      rdma_mg->Deallocate_Local_RDMA_Slot(large_recv_mr.addr, Version_edit);
-//      rdma_mg->Deallocate_Local_RDMA_Slot(large_send_mr.addr, "version_edit");
       delete request;
       delete (Arg_for_handler*)arg;
   }
+  void Memory_Node_Keeper::gc_ring_poller() {
+    rdma_mg->Pin_Thread_To_NIC_Node();
+    // The deallocations come in bursts, so back off while the rings are idle
+    // rather than hold a core.
+    const int kMinIdleMicros = 50;
+    const int kMaxIdleMicros = 10000;
+    // The compute nodes read the status every 10ms.
+    const auto kStatusInterval = std::chrono::milliseconds(1);
+    int idle_micros = kMinIdleMicros;
+    auto status_time = std::chrono::steady_clock::time_point();
+    // The local pools are resized as often as on the compute nodes.
+    const auto kResizeInterval = std::chrono::milliseconds(100);
+    auto resize_time = std::chrono::steady_clock::now();
+    std::vector<uint64_t> chunks;
+    std::vector<uint64_t> cold_files;
+    while (!gc_shutting_down_.load()) {
+      if (rdma_mg->pool_resizing_.load(std::memory_order_relaxed) &&
+          std::chrono::steady_clock::now() - resize_time >= kResizeInterval) {
+        rdma_mg->Resize_Local_Pools();
+        resize_time = std::chrono::steady_clock::now();
+      }
+      bool progress = false;
+      bool publish = std::chrono::steady_clock::now() - status_time >=
+                     kStatusInterval;
+      Memory_Node_Status status = {};
+      if (publish) {
+        status = Current_Status();
+        status_time = std::chrono::steady_clock::now();
+      }
+      cold_files.clear();
+      {
+        std::unique_lock<std::mutex> lck(gc_rings_mtx_);
+        for (auto& iter : gc_rings_) {
+          GC_Ring& ring = iter.second;
+          char* base = static_cast<char*>(ring.mr->addr);
+          if (publish) {
+            volatile Memory_Node_Status* published =
+                reinterpret_cast<volatile Memory_Node_Status*>(
+                    base + sizeof(uint64_t));
+            published->free_bytes = status.free_bytes;
+            published->compaction_queue = status.compaction_queue;
+            published->persistence_lag = status.persistence_lag;
+            published->cpu_busy_percent = status.cpu_busy_percent;
+          }
+          GC_Ring_Slot* slot = reinterpret_cast<GC_Ring_Slot*>(base + GC_RING_HEADER) +
+                               ring.consumed % GC_RING_SLOTS;
+          _mm_clflush(const_cast<uint64_t*>(&slot->seq));
+          asm volatile ("mfence\n" : : );
+          if (slot->seq != ring.consumed + 1) {
+            continue;
+          }
+          // The files of the cold tables are marked, see
+          // RemoteMemTableMetaData::Prepare_Batch_Deallocate().
+          chunks.clear();
+          for (uint32_t i = 0; i < slot->num; i++) {
+            if (slot->addrs[i] & GC_COLD_FILE_BIT) {
+              cold_files.push_back(slot->addrs[i] & ~GC_COLD_FILE_BIT);
+            } else {
+              chunks.push_back(slot->addrs[i]);
+            }
+          }
+          Release_Former_Chunks(&chunks);
+          rdma_mg->BatchGarbageCollection(chunks.data(),
+                                          chunks.size() * sizeof(uint64_t));
+          gc_batches_.fetch_add(1, std::memory_order_relaxed);
+          gc_chunks_.fetch_add(chunks.size(), std::memory_order_relaxed);
+          gc_cold_files_.fetch_add(slot->num - chunks.size(),
+                                   std::memory_order_relaxed);
+          ring.consumed++;
+          // Let the compute node reuse the slot.
+          *reinterpret_cast<volatile uint64_t*>(base) = ring.consumed;
+          progress = true;
+        }
+      }
+      // The disk is kept out of the lock of the rings.
+      for (uint64_t file_id : cold_files) {
+        if (cold_store_ != nullptr) {
+          cold_store_->Delete(file_id);
+        }
+      }
+      if (progress) {
+        idle_micros = kMinIdleMicros;
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(idle_micros));
+        idle_micros = std::min(idle_micros * 2, kMaxIdleMicros);
+      }
+    }
+  }
+
+  Memory_Node_Status Memory_Node_Keeper::Current_Status() {
+    Memory_Node_Status status = {};
+    {
+      // The regions the compute nodes have not asked for yet.
+      std::shared_lock<std::shared_mutex> lck(rdma_mg->local_mem_mutex);
+      for (auto mr : rdma_mg->pre_allocated_pool) {
+        status.free_bytes += mr->length;
+      }
+    }
+    status.compaction_queue = compactions_in_flight_.load();
+    status.persistence_lag = unpersisted_edits_.load();
+    status.cpu_busy_percent = cpu_load_.BusyPercent();
+    return status;
+  }
+
+  std::string Memory_Node_Keeper::GetStats() {
+    std::string result;
+    char buf[256];
+    auto metric = [&result](const char* name, const char* type,
+                            const char* help) {
+      result.append("# HELP ").append(name).append(" ").append(help);
+      result.append("\n# TYPE ").append(name).append(" ").append(type);
+      result.append("\n");
+    };
+    auto value = [&result, &buf](const char* name, uint64_t v) {
+      std::snprintf(buf, sizeof(buf), "%s %llu\n", name,
+                    static_cast<unsigned long long>(v));
+      result.append(buf);
+    };
+    uint64_t registered = 0;
+    uint64_t unassigned = 0;
+    std::vector<std::tuple<const char*, uint64_t, uint64_t, uint64_t>> pools;
+    {
+      std::shared_lock<std::shared_mutex> lck(rdma_mg->local_mem_mutex);
+      for (auto mr : rdma_mg->local_mem_pool) {
+        registered += mr->length;
+      }
+      for (auto mr : rdma_mg->pre_allocated_pool) {
+        unassigned += mr->length;
+      }
+      for (auto& pool : rdma_mg->name_to_mem_pool) {
+        uint64_t pool_registered = 0;
+        uint64_t pool_used = 0;
+        for (auto& region : pool.second) {
+          In_Use_Array* chunks = region.second;
+          pool_registered += chunks->get_element_size() *
+                             chunks->get_chunk_size();
+          pool_used += (chunks->get_element_size() - chunks->get_free_num()) *
+                       chunks->get_chunk_size();
+        }
+        pools.emplace_back(
+            EnumStrings[pool.first], pool_registered, pool_used,
+            rdma_mg->Local_Slots_High_Water(pool.first) *
+                rdma_mg->name_to_chunksize.at(pool.first));
+      }
+    }
+    metric("dlsm_memory_registered_bytes", "gauge",
+           "The memory registered with the NIC.");
+    value("dlsm_memory_registered_bytes", registered);
+    metric("dlsm_memory_unassigned_bytes", "gauge",
+           "The registered regions no compute node has asked for yet.");
+    value("dlsm_memory_unassigned_bytes", unassigned);
+    metric("dlsm_pool_registered_bytes", "gauge",
+           "The chunks of a local pool.");
+    for (auto& pool : pools) {
+      std::snprintf(buf, sizeof(buf),
+                    "dlsm_pool_registered_bytes{pool=\"%s\"} %llu\n",
+                    std::get<0>(pool),
+                    static_cast<unsigned long long>(std::get<1>(pool)));
+      result.append(buf);
+    }
+    metric("dlsm_pool_used_bytes", "gauge",
+           "The allocated chunks of a local pool.");
+    for (auto& pool : pools) {
+      std::snprintf(buf, sizeof(buf),
+                    "dlsm_pool_used_bytes{pool=\"%s\"} %llu\n",
+                    std::get<0>(pool),
+                    static_cast<unsigned long long>(std::get<2>(pool)));
+      result.append(buf);
+    }
+    metric("dlsm_pool_high_water_bytes", "gauge",
+           "The most chunks of a local pool allocated at a time.");
+    for (auto& pool : pools) {
+      std::snprintf(buf, sizeof(buf),
+                    "dlsm_pool_high_water_bytes{pool=\"%s\"} %llu\n",
+                    std::get<0>(pool),
+                    static_cast<unsigned long long>(std::get<3>(pool)));
+      result.append(buf);
+    }
+    metric("dlsm_compaction_queue", "gauge",
+           "The compactions queued or running.");
+    value("dlsm_compaction_queue", compactions_in_flight_.load());
+    metric("dlsm_cpu_busy_percent", "gauge",
+           "The share of the time the processors were busy lately.");
+    value("dlsm_cpu_busy_percent", cpu_load_.BusyPercent());
+    metric("dlsm_compactions_total", "counter", "The compactions finished.");
+    value("dlsm_compactions_total", compactions_done_.load());
+    metric("dlsm_compactions_handed_back_total", "counter",
+           "The compactions sent back to the compute nodes undone.");
+    value("dlsm_compactions_handed_back_total",
+          compactions_handed_back_.load());
+    metric("dlsm_compaction_micros_total", "counter",
+           "The time of the finished compactions.");
+    value("dlsm_compaction_micros_total", compaction_micros_.load());
+    metric("dlsm_compaction_queue_micros_total", "counter",
+           "The time the compactions waited for a thread.");
+    value("dlsm_compaction_queue_micros_total",
+          compaction_queue_micros_.load());
+    metric("dlsm_compaction_read_bytes_total", "counter",
+           "The input of the finished compactions.");
+    value("dlsm_compaction_read_bytes_total", compaction_bytes_read_.load());
+    metric("dlsm_compaction_written_bytes_total", "counter",
+           "The output of the finished compactions.");
+    value("dlsm_compaction_written_bytes_total",
+          compaction_bytes_written_.load());
+    metric("dlsm_compaction_stage_cpu_micros_total", "counter",
+           "The processor time of a stage of the compactions.");
+    static const char* const kStageNames[kNumCompactionStages] = {
+        "merge", "build", "publish", "serial"};
+    for (int stage = 0; stage < kNumCompactionStages; stage++) {
+      std::snprintf(
+          buf, sizeof(buf),
+          "dlsm_compaction_stage_cpu_micros_total{stage=\"%s\"} %llu\n",
+          kStageNames[stage],
+          static_cast<unsigned long long>(
+              compaction_stage_cpu_micros_[stage].load()));
+      result.append(buf);
+    }
+    metric("dlsm_persistence_backlog_edits", "gauge",
+           "The version edits merged but not persisted yet.");
+    value("dlsm_persistence_backlog_edits", unpersisted_edits_.load());
+    metric("dlsm_gc_batches_total", "counter",
+           "The garbage collection batches consumed from the rings.");
+    value("dlsm_gc_batches_total", gc_batches_.load());
+    metric("dlsm_gc_chunks_total", "counter",
+           "The SSTable chunks the garbage collection freed.");
+    value("dlsm_gc_chunks_total", gc_chunks_.load());
+    metric("dlsm_gc_cold_files_total", "counter",
+           "The cold SSTable files the garbage collection deleted.");
+    value("dlsm_gc_cold_files_total", gc_cold_files_.load());
+    metric("dlsm_rpc_total", "counter",
+           "The requests of a compute node, by command.");
+    for (int node = 0; node < 256; node++) {
+      for (int command = 0; command < kNumRPCs; command++) {
+        uint64_t count = rpc_counts_[node][command].load();
+        if (count > 0) {
+          std::snprintf(buf, sizeof(buf),
+                        "dlsm_rpc_total{node=\"%d\",command=\"%s\"} %llu\n",
+                        node, kRPCNames[command],
+                        static_cast<unsigned long long>(count));
+          result.append(buf);
+        }
+      }
+    }
+    return result;
+  }
+
+  void Memory_Node_Keeper::stats_server_thread(int listen_fd) {
+    while (!stats_shutting_down_.load()) {
+      struct pollfd pfd = {listen_fd, POLLIN, 0};
+      // Wake up now and then to see whether the node shuts down.
+      if (poll(&pfd, 1, 100) <= 0) {
+        continue;
+      }
+      int fd = accept(listen_fd, nullptr, nullptr);
+      if (fd < 0) {
+        continue;
+      }
+      char request[1024];
+      ssize_t n = 0;
+      pfd = {fd, POLLIN, 0};
+      if (poll(&pfd, 1, kStatsRequestWaitMillis) > 0) {
+        n = read(fd, request, sizeof(request));
+      }
+      // GET /timeline serves the timeline of the background jobs instead.
+      static const char kTimelineRequest[] = "GET /timeline";
+      bool timeline = n >= static_cast<ssize_t>(sizeof(kTimelineRequest) - 1) &&
+                      memcmp(request, kTimelineRequest,
+                             sizeof(kTimelineRequest) - 1) == 0;
+      // GET /pools the slots of the local pools, and who holds them.
+      static const char kPoolsRequest[] = "GET /pools";
+      bool pools = n >= static_cast<ssize_t>(sizeof(kPoolsRequest) - 1) &&
+                   memcmp(request, kPoolsRequest,
+                          sizeof(kPoolsRequest) - 1) == 0;
+      std::string body =
+          timeline ? Timeline::Dump(rdma_mg->node_id,
+                                    "memory node " +
+                                        std::to_string(rdma_mg->node_id))
+          : pools  ? rdma_mg->Local_Pools_String()
+                   : GetStats();
+      std::string response;
+      if (n >= 4 && memcmp(request, "GET ", 4) == 0) {
+        response =
+            std::string("HTTP/1.0 200 OK\r\n") +
+            (timeline ? "Content-Type: application/json\r\n"
+                      : "Content-Type: text/plain; version=0.0.4\r\n") +
+            "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+      }
+      response.append(body);
+      const char* p = response.data();
+      size_t left = response.size();
+      while (left > 0) {
+        ssize_t written = write(fd, p, left);
+        if (written <= 0) {
+          break;
+        }
+        p += written;
+        left -= written;
+      }
+      close(fd);
+    }
+    close(listen_fd);
+  }
 
   void Memory_Node_Keeper::sst_compaction_handler(void* arg) {
     RDMA_Request* request = ((Arg_for_handler*) arg)->request;
     std::string client_ip = ((Arg_for_handler*) arg)->client_ip;
     uint8_t target_node_id = ((Arg_for_handler*) arg)->target_node_id;
+    const bool hand_back = ((Arg_for_handler*) arg)->hand_back;
+    const uint64_t queue_micros =
+        Env::Default()->NowMicros() - ((Arg_for_handler*) arg)->scheduled_micros;
+    compaction_queue_micros_.fetch_add(queue_micros, std::memory_order_relaxed);
     printf("near data compaction\n");
+    // Till the version edit is sent back, the shard is not known here.
+    TimelineScope timeline("compaction", -1, 0, Timeline::kFlowStep);
     void* remote_prt = request->buffer;
     void* remote_large_prt = request->buffer_large;
     uint32_t remote_rkey = request->rkey;
@@ -1904,7 +2895,8 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
 //    asm volatile ("lfence\n" : : );
 //    asm volatile ("mfence\n" : : );
     rdma_mg->RDMA_Write(remote_prt, remote_rkey,
-                        &send_mr, sizeof(RDMA_Reply),client_ip, IBV_SEND_SIGNALED,1);
+                        &send_mr, sizeof(RDMA_Reply),client_ip, IBV_SEND_SIGNALED,1,
+                        target_node_id);
 #endif
 
 
@@ -1951,16 +2943,73 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
     // the slice size is larger than the real size by 1 byte.
     DEBUG_arg("Compaction decoded, the first input file number is %lu \n", c.inputs_[0][0]->number);
     DEBUG_arg("Compaction decoded, input file level is %d \n", c.level());
+    timeline.set_job_id(c.JobId());
     CompactionState* compact = new CompactionState(&c);
-    if (usesubcompaction && c.num_input_files(0)>=4 && c.num_input_files(1)>1){
-//      test_compaction_mutex.lock();
-      status = DoCompactionWorkWithSubcompaction(compact, client_ip);
-//      test_compaction_mutex.unlock();
-      //        status = DoCompactionWork(compact, *client_ip);
-    }else{
-      status = DoCompactionWork(compact, client_ip);
-    }
-    InstallCompactionResultsToComputePreparation(compact);
+    const uint64_t start_micros = Env::Default()->NowMicros();
+    // The cold inputs are read back for the compaction only.
+    std::vector<std::shared_ptr<RemoteMemTableMetaData>> inputs(
+        c.inputs_[0].begin(), c.inputs_[0].end());
+    inputs.insert(inputs.end(), c.inputs_[1].begin(), c.inputs_[1].end());
+    if (!hand_back && cold_store_ != nullptr) {
+      status = cold_store_->LoadData(inputs);
+    }
+    if (hand_back) {
+      // The edit goes back empty and flagged, the compute node keeps the
+      // inputs and runs the compaction itself.
+      compactions_handed_back_.fetch_add(1, std::memory_order_relaxed);
+    } else if (!status.ok()) {
+      // The edit goes back empty, and the compute node only releases the
+      // inputs.
+      fprintf(stderr, "failed to load the cold compaction inputs: %s\n",
+              status.ToString().c_str());
+    } else {
+      if (usesubcompaction && c.num_input_files(0)>=4 && c.num_input_files(1)>1){
+//        test_compaction_mutex.lock();
+        status = DoCompactionWorkWithSubcompaction(compact, client_ip);
+//        test_compaction_mutex.unlock();
+        //        status = DoCompactionWork(compact, *client_ip);
+      }else{
+        status = DoCompactionWork(compact, client_ip);
+      }
+      InstallCompactionResultsToComputePreparation(compact);
+      if (status.ok()) {
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+        for (auto& f : inputs) {
+          bytes_read += f->file_size;
+        }
+        for (auto& iter : *compact->compaction->edit()->GetNewFiles()) {
+          bytes_written += iter.second->file_size;
+        }
+        compactions_done_.fetch_add(1, std::memory_order_relaxed);
+        compaction_micros_.fetch_add(
+            Env::Default()->NowMicros() - start_micros,
+            std::memory_order_relaxed);
+        compaction_bytes_read_.fetch_add(bytes_read, std::memory_order_relaxed);
+        compaction_bytes_written_.fetch_add(bytes_written,
+                                            std::memory_order_relaxed);
+        timeline.set_bytes(bytes_written);
+      }
+    }
+    if (!hand_back && cold_store_ != nullptr) {
+      cold_store_->ReleaseData(inputs);
+      if (opts->cold_level > 0) {
+        std::vector<std::shared_ptr<RemoteMemTableMetaData>> cold_outputs;
+        for (auto iter : *compact->compaction->edit()->GetNewFiles()) {
+          if (iter.second->level >= static_cast<uint64_t>(opts->cold_level)) {
+            cold_outputs.push_back(iter.second);
+          }
+        }
+        if (!cold_outputs.empty()) {
+          // The outputs stay in the memory if the disk fails them.
+          Status s = cold_store_->Demote(cold_outputs, opts->rate_limiter);
+          if (!s.ok()) {
+            fprintf(stderr, "failed to move the compaction outputs to the disk: %s\n",
+                    s.ToString().c_str());
+          }
+        }
+      }
+    }
         //TODO:Send back the new created sstables and wait for another reply.
     std::string serilized_ve;
 #ifndef NDEBUG
@@ -1983,6 +3032,13 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
 #endif
 
 
+    // The load of this node, not counting this compaction, the time the
+    // compaction waited for a thread and whether it was handed back follow
+    // the edit.
+    PutFixed32(&serilized_ve, compactions_in_flight_.fetch_sub(1) - 1);
+    PutFixed32(&serilized_ve, static_cast<uint32_t>(std::min<uint64_t>(
+                                  queue_micros, UINT32_MAX)));
+    PutFixed32(&serilized_ve, hand_back ? 1 : 0);
     memcpy((char*)large_send_mr.addr, serilized_ve.c_str(), serilized_ve.size());
     memset((char*)large_send_mr.addr + serilized_ve.size(), 1, 1);
     _mm_clflush((char*)large_send_mr.addr + serilized_ve.size());
@@ -1990,7 +3046,12 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
     *(size_t*)send_mr.addr = serilized_ve.size() + 1;
 
     // Prepare the receive buffer for the version edit duribility and the file numbers.
+#ifdef WITHPERSISTENCE
+    volatile char* polling_byte_2 =
+        (char*)recv_mr.addr + sizeof(compaction_file_numbers);
+#else
     volatile char* polling_byte_2 = (char*)recv_mr.addr + sizeof(uint64_t);
+#endif
     memset((void*)polling_byte_2, 0, 1);
     asm volatile ("sfence\n" : : );
     asm volatile ("lfence\n" : : );
@@ -2019,7 +3080,7 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
 //                             &large_send_mr, serilized_ve.size() + 1, client_ip,
 //                             IBV_SEND_SIGNALED, 1);
 #ifdef WITHPERSISTENCE
-    int counter = 0;
+    counter = 0;
     // polling the finishing bit for the file number transmission.
     while (*(unsigned char*)polling_byte_2 == 0){
       _mm_clflush(polling_byte_2);
@@ -2034,24 +3095,22 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
 
       counter++;
     }
-    uint64_t file_number_end = *(uint64_t*)recv_mr.addr;
+    compaction_file_numbers file_numbers =
+        *(compaction_file_numbers*)recv_mr.addr;
+    uint64_t file_number_end = file_numbers.file_number_end;
     assert(file_number_end >0);
     compact->compaction->edit()->SetFileNumbers(file_number_end);
     DEBUG_arg("file number end %lu", file_number_end);
 
-    VersionEdit* edit = new VersionEdit();
+    VersionEdit* edit = new VersionEdit(0);
     *edit = *compact->compaction->edit();
     {
       std::unique_lock<std::mutex> lck(merger_mtx);
       ve_merger.merge_one_edit(edit);
-      // NOt digesting enough edit, directly get the next edit.
-
-      // unpin the sstables merged during the edit merge
-      if (ve_merger.ready_to_upin_merged_file){
-        UnpinSSTables_RPC(&ve_merger.merged_file_numbers, client_ip);
-        ve_merger.ready_to_upin_merged_file = false;
-        ve_merger.merged_file_numbers.clear();
-      }
+      ve_merger.persist_epochs.push_back(
+          {target_node_id, file_numbers.epoch_buffer, file_numbers.epoch_rkey,
+           file_numbers.persist_epoch});
+      unpersisted_edits_.fetch_add(1);
       if (check_point_t_ready.load() == true){
         VersionEdit_Merger* ve_m = new VersionEdit_Merger(ve_merger);
         Arg_for_persistent* argforpersistence = new Arg_for_persistent{.edit_merger=ve_m,.client_ip = client_ip};
@@ -2152,15 +3211,631 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
       std::fprintf(stderr, "Polling sync option handler\n");
       std::fflush(stderr);
     }
+    // The rate limiter is the one of this node, the compaction filter the
+    // one registered here under the name the compute node sent.
+    RateLimiter* rate_limiter = opts->rate_limiter;
     *opts = *static_cast<Options*>(edit_recv_mr.addr);
+    const char* name_buf = (char*)edit_recv_mr.addr + sizeof(Options);
+    std::string filter_name(name_buf + 4, DecodeFixed32(name_buf));
+    name_buf += 4 + filter_name.size();
+    std::string extractor_name(name_buf + 4, DecodeFixed32(name_buf));
+    name_buf += 4 + extractor_name.size();
+    std::string merge_operator_name(name_buf + 4, DecodeFixed32(name_buf));
+    opts->rate_limiter = rate_limiter;
+    // The RDMA budget is the one of a shard on the compute node.
+    opts->rdma_limiter = nullptr;
+    opts->compaction_filter = nullptr;
+    if (!filter_name.empty()) {
+      opts->compaction_filter = FindCompactionFilter(filter_name);
+      if (opts->compaction_filter == nullptr) {
+        fprintf(stderr, "Compaction filter %s is not registered\n",
+                filter_name.c_str());
+      }
+    }
+    opts->prefix_extractor = nullptr;
+    if (!extractor_name.empty()) {
+      opts->prefix_extractor = FindSliceTransform(extractor_name);
+      if (opts->prefix_extractor == nullptr) {
+        fprintf(stderr, "Prefix extractor %s is not registered\n",
+                extractor_name.c_str());
+      }
+    }
+    opts->merge_operator = nullptr;
+    if (!merge_operator_name.empty()) {
+      opts->merge_operator = FindMergeOperator(merge_operator_name);
+      if (opts->merge_operator == nullptr) {
+        fprintf(stderr, "Merge operator %s is not registered\n",
+                merge_operator_name.c_str());
+      }
+    }
     opts->ShardInfo = nullptr;
     opts->env = nullptr;
     opts->filter_policy = new InternalFilterPolicy(NewBloomFilterPolicy(opts->bloom_bits));
     opts->comparator = &internal_comparator_;
-    Compactor_pool_.SetBackgroundThreads(opts->max_background_compactions);
+    ResizeCompactorPool();
     printf("Option sync finished\n");
     delete request;
   }
+  void Memory_Node_Keeper::recovered_version_handler(RDMA_Request* request,
+                                                     std::string& client_ip,
+                                                     uint8_t target_node_id) {
+    ibv_mr send_mr;
+    rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+    ibv_mr edit_mr;
+    rdma_mg->Allocate_Local_RDMA_Slot(edit_mr, Version_edit);
+    // Leave room for the tags and the last sequence.
+    const size_t capacity =
+        std::min(request->content.rv.buffer_size, edit_mr.length) - 64;
+    const size_t start = request->content.rv.start;
+    std::string serialized;
+    size_t next = 0;
+    {
+      std::unique_lock<std::mutex> lck(recovered_mtx_);
+      if (start == 0 && recovered_files_.empty()) {
+        const uint8_t shard_id = request->content.rv.shard_id;
+        const std::pair<uint8_t, uint8_t> shard(target_node_id, shard_id);
+        if (request->content.rv.reattach) {
+          recovered_files_ = Reattach_Shard(shard.first, shard.second,
+                                            &recovered_last_sequence_);
+        } else {
+          // A new database: the tables the shard had before are left as
+          // they are.
+          std::unique_lock<std::mutex> reattach_lck(reattach_mtx_);
+          attached_.erase(shard);
+          detached_.erase(shard);
+        }
+      }
+      VersionEdit edit(0);
+      edit.SetLastSequence(recovered_last_sequence_);
+      size_t size = 0;
+      if (start == 0) {
+        // The tombstones go with the first batch, before any file they
+        // delete from can be read.
+        for (const RangeTombstone& t : recovered_range_tombstones_) {
+          size += t.begin.size() + t.end.size() + 16;
+          edit.AddRangeTombstone(t);
+        }
+      }
+      std::string table;
+      size_t i = start;
+      for (; i < recovered_files_.size() &&
+             i - start < kRecoveredFilesPerBatch; i++) {
+        table.clear();
+        recovered_files_[i]->EncodeTo(&table);
+        if (edit.GetNewFilesNum() > 0 &&
+            size + table.size() + 16 > capacity) {
+          break;
+        }
+        size += table.size() + 16;
+        edit.AddFile(recovered_files_[i]->level, recovered_files_[i]);
+      }
+      edit.EncodeTo(&serialized);
+      if (i < recovered_files_.size()) {
+        next = i;
+      } else if (start < recovered_files_.size() ||
+                 !recovered_range_tombstones_.empty()) {
+        // The compute node owns the files, and has this node free their
+        // chunks, from now.
+        printf("Recovered SSTables handed to node %u\n", target_node_id);
+        recovered_files_.clear();
+        recovered_range_tombstones_.clear();
+      }
+    }
+    assert(serialized.size() <= edit_mr.length);
+    memcpy(edit_mr.addr, serialized.data(), serialized.size());
+    RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
+    send_pointer->content.rv.start = start;
+    send_pointer->content.rv.buffer_size = serialized.size();
+    send_pointer->content.rv.next = next;
+    send_pointer->received = true;
+    // The edit lands before the reply on the same queue pair.
+    rdma_mg->RDMA_Write(request->buffer_large, request->rkey_large, &edit_mr,
+                        serialized.size(), client_ip, IBV_SEND_SIGNALED, 1,
+                        target_node_id);
+    rdma_mg->RDMA_Write(request->buffer, request->rkey, &send_mr,
+                        sizeof(RDMA_Reply), client_ip, IBV_SEND_SIGNALED, 1,
+                        target_node_id);
+    rdma_mg->Deallocate_Local_RDMA_Slot(edit_mr.addr, Version_edit);
+    rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
+    delete request;
+  }
+  void Memory_Node_Keeper::Track_Version_Edit(uint8_t compute_node_id,
+                                              uint8_t shard_id,
+                                              VersionEdit* edit) {
+    std::unique_lock<std::mutex> lck(reattach_mtx_);
+    Shard_Tables& tables = attached_[{compute_node_id, shard_id}];
+    // A trivial move deletes the file from its old level and adds it to the
+    // new one in the same edit.
+    for (const auto& deleted : *edit->GetDeletedFiles()) {
+      tables.files.erase({std::get<1>(deleted), std::get<2>(deleted)});
+    }
+    for (const auto& added : *edit->GetNewFiles()) {
+      added.second->level = added.first;
+      tables.files[{added.second->number, added.second->creator_node_id}] =
+          added.second;
+    }
+    if (edit->HasLastSequence()) {
+      tables.last_sequence =
+          std::max(tables.last_sequence, edit->GetLastSequence());
+    }
+  }
+  void Memory_Node_Keeper::Detach_Compute_Node(uint8_t compute_node_id) {
+    std::unique_lock<std::mutex> lck(reattach_mtx_);
+    for (auto iter = attached_.lower_bound({compute_node_id, 0});
+         iter != attached_.end() && iter->first.first == compute_node_id;) {
+      // The shards a run did not open again keep the tables of the run
+      // before.
+      Shard_Tables& former = detached_[iter->first];
+      for (auto& file : iter->second.files) {
+        former.files[file.first] = std::move(file.second);
+      }
+      former.last_sequence =
+          std::max(former.last_sequence, iter->second.last_sequence);
+      iter = attached_.erase(iter);
+    }
+    for (ibv_mr* region : regions_[compute_node_id]) {
+      former_regions_[static_cast<char*>(region->addr)] = region;
+    }
+    regions_.erase(compute_node_id);
+  }
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>>
+  Memory_Node_Keeper::Reattach_Shard(uint8_t compute_node_id,
+                                     uint8_t shard_id,
+                                     SequenceNumber* last_sequence) {
+    std::vector<std::shared_ptr<RemoteMemTableMetaData>> files;
+    const std::pair<uint8_t, uint8_t> shard(compute_node_id, shard_id);
+    std::unique_lock<std::mutex> lck(reattach_mtx_);
+    // The tables of a shard closed and opened again in the same run are
+    // still in the regions the compute node allocates from.
+    Shard_Tables& current = attached_[shard];
+    *last_sequence = current.last_sequence;
+    for (const auto& file : current.files) {
+      files.push_back(file.second);
+    }
+    auto iter = detached_.find(shard);
+    if (iter != detached_.end()) {
+      for (auto& file : iter->second.files) {
+        const std::shared_ptr<RemoteMemTableMetaData>& f = file.second;
+        // The compute node lost the regions of its former runs, so this
+        // node takes the chunks of the tables it built there, as it does
+        // with the tables it recovers. They come back through the garbage
+        // collection ring, see Release_Former_Chunks().
+        if (f->creator_node_id == compute_node_id) {
+          f->creator_node_id = rdma_mg->node_id;
+        }
+        current.files[{f->number, f->creator_node_id}] = f;
+        files.push_back(f);
+      }
+      current.last_sequence =
+          std::max(current.last_sequence, iter->second.last_sequence);
+      *last_sequence = current.last_sequence;
+      detached_.erase(iter);
+    }
+    for (const auto& f : files) {
+      if (f->largest_seq != kMaxSequenceNumber) {
+        *last_sequence = std::max(*last_sequence, f->largest_seq + 1);
+      }
+    }
+    if (!files.empty()) {
+      printf("Shard %u of node %u reattached to %zu SSTables\n", shard_id,
+             compute_node_id, files.size());
+    }
+    return files;
+  }
+  void Memory_Node_Keeper::Release_Former_Chunks(
+      std::vector<uint64_t>* chunks) {
+    std::unique_lock<std::mutex> lck(reattach_mtx_);
+    if (former_regions_.empty()) {
+      return;
+    }
+    size_t kept = 0;
+    for (uint64_t chunk : *chunks) {
+      char* p = reinterpret_cast<char*>(chunk);
+      auto region = former_regions_.upper_bound(p);
+      if (region != former_regions_.begin()) {
+        --region;
+        if (p < region->first + region->second->length) {
+          continue;
+        }
+      }
+      (*chunks)[kept++] = chunk;
+    }
+    chunks->resize(kept);
+  }
+  void Memory_Node_Keeper::cold_read_handler(void* arg) {
+    RDMA_Request* request = ((Arg_for_handler*) arg)->request;
+    std::string client_ip = ((Arg_for_handler*) arg)->client_ip;
+    uint8_t target_node_id = ((Arg_for_handler*) arg)->target_node_id;
+    const cold_sstable& cs = request->content.cs;
+    ibv_mr send_mr;
+    rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+    ibv_mr data_mr;
+    rdma_mg->Allocate_Local_RDMA_Slot(data_mr, FlushBuffer);
+    size_t read_size = 0;
+    if (cold_store_ != nullptr && cs.size <= data_mr.length) {
+      Status s = cold_store_->Read(cs.file_id, cs.offset, cs.size,
+                                   static_cast<char*>(data_mr.addr));
+      if (s.ok()) {
+        read_size = cs.size;
+      } else {
+        fprintf(stderr, "cold table read failed: %s\n", s.ToString().c_str());
+      }
+    }
+    RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
+    send_pointer->content.cs = cs;
+    send_pointer->content.cs.size = read_size;
+    send_pointer->received = true;
+    // The data lands before the reply on the same queue pair.
+    if (read_size > 0) {
+      rdma_mg->RDMA_Write(request->buffer_large, request->rkey_large, &data_mr,
+                          read_size, client_ip, IBV_SEND_SIGNALED, 1,
+                          target_node_id);
+    }
+    rdma_mg->RDMA_Write(request->buffer, request->rkey, &send_mr,
+                        sizeof(RDMA_Reply), client_ip, IBV_SEND_SIGNALED, 1,
+                        target_node_id);
+    rdma_mg->Deallocate_Local_RDMA_Slot(data_mr.addr, FlushBuffer);
+    rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
+    delete request;
+    delete (Arg_for_handler*)arg;
+  }
+  void Memory_Node_Keeper::promote_handler(void* arg) {
+    RDMA_Request* request = ((Arg_for_handler*) arg)->request;
+    std::string client_ip = ((Arg_for_handler*) arg)->client_ip;
+    uint8_t target_node_id = ((Arg_for_handler*) arg)->target_node_id;
+    const cold_sstable& cs = request->content.cs;
+    ibv_mr send_mr;
+    rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+    ibv_mr edit_mr;
+    rdma_mg->Allocate_Local_RDMA_Slot(edit_mr, Version_edit);
+    std::string serialized;
+    auto meta = std::make_shared<RemoteMemTableMetaData>(1);
+    meta->level = cs.level;
+    meta->shard_target_node_id = rdma_mg->node_id;
+    meta->creator_node_id = rdma_mg->node_id;
+    if (cold_store_ != nullptr) {
+      Status s = cold_store_->Load(cs.file_id, meta);
+      if (s.ok()) {
+        VersionEdit edit(0);
+        edit.AddFile(cs.level, meta);
+        edit.EncodeTo(&serialized);
+        if (serialized.size() > std::min<size_t>(cs.size, edit_mr.length)) {
+          fprintf(stderr, "promoted table does not fit the edit buffer\n");
+          serialized.clear();
+        }
+      } else {
+        fprintf(stderr, "cold table load failed: %s\n", s.ToString().c_str());
+      }
+    }
+    if (serialized.empty()) {
+      // Nothing refers to the chunks loaded so far.
+      for (auto* chunks : {&meta->remote_data_mrs, &meta->remote_dataindex_mrs,
+                           &meta->remote_filter_mrs}) {
+        for (auto& chunk : *chunks) {
+          rdma_mg->Deallocate_Local_RDMA_Slot(chunk.second->addr, FlushBuffer);
+        }
+      }
+    }
+    memcpy(edit_mr.addr, serialized.data(), serialized.size());
+    RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
+    send_pointer->content.cs = cs;
+    send_pointer->content.cs.size = serialized.size();
+    send_pointer->received = true;
+    // The edit lands before the reply on the same queue pair.
+    if (!serialized.empty()) {
+      rdma_mg->RDMA_Write(request->buffer_large, request->rkey_large, &edit_mr,
+                          serialized.size(), client_ip, IBV_SEND_SIGNALED, 1,
+                          target_node_id);
+    }
+    rdma_mg->RDMA_Write(request->buffer, request->rkey, &send_mr,
+                        sizeof(RDMA_Reply), client_ip, IBV_SEND_SIGNALED, 1,
+                        target_node_id);
+    rdma_mg->Deallocate_Local_RDMA_Slot(edit_mr.addr, Version_edit);
+    rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
+    delete request;
+    delete (Arg_for_handler*)arg;
+  }
+  void Memory_Node_Keeper::scan_pushdown_handler(void* arg) {
+    RDMA_Request* request = ((Arg_for_handler*) arg)->request;
+    std::string client_ip = ((Arg_for_handler*) arg)->client_ip;
+    uint8_t target_node_id = ((Arg_for_handler*) arg)->target_node_id;
+    const scan_pushdown sp = request->content.sp;
+    // The compute node gives up on a batch it does not consume in time.
+    const auto kCreditTimeout = std::chrono::seconds(10);
+    ibv_mr send_mr;
+    ibv_mr credit_mr;
+    ibv_mr scan_mr;
+    ibv_mr batch_mr;
+    rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+    rdma_mg->Allocate_Local_RDMA_Slot(credit_mr, Message);
+    rdma_mg->Allocate_Local_RDMA_Slot(scan_mr, Version_edit);
+    rdma_mg->Allocate_Local_RDMA_Slot(batch_mr, Version_edit);
+    volatile uint64_t* credit = static_cast<volatile uint64_t*>(credit_mr.addr);
+    *credit = 0;
+
+    ScanPushdownRequest scan;
+    bool ok = sp.size < scan_mr.length;
+    if (ok) {
+      // Polled like the content of a compaction.
+      ibv_mr remote_mr;
+      remote_mr.addr = request->buffer_large;
+      remote_mr.rkey = request->rkey_large;
+      volatile char* polling_byte = (char*)scan_mr.addr + sp.size;
+      memset((void*)polling_byte, 0, 1);
+      asm volatile ("mfence\n" : : );
+      rdma_mg->RDMA_Read(&remote_mr, &scan_mr, sp.size + 1, client_ip, 0, 0,
+                         target_node_id);
+      while (*(unsigned char*)polling_byte == 0) {
+        _mm_clflush(polling_byte);
+        asm volatile ("mfence\n" : : );
+      }
+      ok = scan.DecodeFrom(Slice((char*)scan_mr.addr, sp.size), 1);
+    }
+    const ScanFilter* filter = nullptr;
+    if (ok) {
+      filter = FindScanFilter(scan.filter_name);
+      if (filter == nullptr) {
+        fprintf(stderr, "scan filter %s is not registered\n",
+                scan.filter_name.c_str());
+        ok = false;
+      }
+    }
+    std::vector<std::shared_ptr<RemoteMemTableMetaData>> inputs;
+    for (const auto& level : scan.files) {
+      inputs.insert(inputs.end(), level.begin(), level.end());
+    }
+    if (ok && cold_store_ != nullptr) {
+      Status s = cold_store_->LoadData(inputs);
+      if (!s.ok()) {
+        fprintf(stderr, "failed to load the cold scan inputs: %s\n",
+                s.ToString().c_str());
+        ok = false;
+      }
+    }
+    Iterator* iter = nullptr;
+    std::unique_ptr<ScanResolver> resolver;
+    if (ok) {
+      iter = versions_->MakeScanIteratorMemoryServer(scan.files);
+      resolver.reset(new ScanResolver(iter, user_comparator(), scan.snapshot,
+                                      scan.limit, &scan.tombstones, filter,
+                                      rdma_mg.get()));
+      resolver->Seek(scan.start);
+    }
+    const size_t capacity = std::min(sp.capacity, batch_mr.length);
+    RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
+    uint64_t batches = 0;
+    bool last = false;
+    while (!last) {
+      char* dst = static_cast<char*>(batch_mr.addr);
+      size_t size = 0;
+      for (; ok && resolver->Valid(); resolver->Next()) {
+        if (!resolver->kept()) {
+          continue;
+        }
+        const Slice key = resolver->key();
+        const Slice value = resolver->value();
+        const size_t entry_size = VarintLength(key.size()) + key.size() +
+                                  VarintLength(value.size()) + value.size();
+        if (size + entry_size > capacity) {
+          if (size == 0) {
+            fprintf(stderr, "scan entry does not fit a batch\n");
+            ok = false;
+          }
+          break;
+        }
+        char* p = EncodeVarint32(dst + size, key.size());
+        memcpy(p, key.data(), key.size());
+        p = EncodeVarint32(p + key.size(), value.size());
+        memcpy(p, value.data(), value.size());
+        size += entry_size;
+      }
+      if (ok && !resolver->status().ok()) {
+        fprintf(stderr, "pushed down scan failed: %s\n",
+                resolver->status().ToString().c_str());
+        ok = false;
+      }
+      last = !ok || !resolver->Valid();
+      send_pointer->content.sp = sp;
+      send_pointer->content.sp.size = ok ? size : 0;
+      send_pointer->content.sp.credit = credit_mr.addr;
+      send_pointer->content.sp.credit_rkey = credit_mr.rkey;
+      send_pointer->content.sp.last = last;
+      send_pointer->content.sp.ok = ok;
+      send_pointer->received = true;
+      // The batch lands before the reply on the same queue pair.
+      if (ok && size > 0) {
+        rdma_mg->RDMA_Write(sp.batch, sp.batch_rkey, &batch_mr, size,
+                            client_ip, IBV_SEND_SIGNALED, 1, target_node_id);
+      }
+      rdma_mg->RDMA_Write(request->buffer, request->rkey, &send_mr,
+                          sizeof(RDMA_Reply), client_ip, IBV_SEND_SIGNALED, 1,
+                          target_node_id);
+      batches++;
+      if (last) {
+        break;
+      }
+      // The batch buffer is reused once the compute node has consumed it.
+      const auto deadline = std::chrono::steady_clock::now() + kCreditTimeout;
+      while (*credit < batches) {
+        _mm_clflush((const void*)credit);
+        asm volatile ("mfence\n" : : );
+        if (std::chrono::steady_clock::now() > deadline) {
+          fprintf(stderr, "compute node %u stopped consuming the scan\n",
+                  target_node_id);
+          last = true;
+          break;
+        }
+      }
+      if (*credit == SCAN_PUSHDOWN_ABORT) {
+        last = true;
+      }
+    }
+    resolver.reset();
+    delete iter;
+    if (cold_store_ != nullptr) {
+      cold_store_->ReleaseData(inputs);
+    }
+    rdma_mg->Deallocate_Local_RDMA_Slot(batch_mr.addr, Version_edit);
+    rdma_mg->Deallocate_Local_RDMA_Slot(scan_mr.addr, Version_edit);
+    rdma_mg->Deallocate_Local_RDMA_Slot(credit_mr.addr, Message);
+    rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
+    delete request;
+    delete (Arg_for_handler*)arg;
+  }
+  void Memory_Node_Keeper::flush_offload_handler(void* arg) {
+    RDMA_Request* request = ((Arg_for_handler*) arg)->request;
+    std::string client_ip = ((Arg_for_handler*) arg)->client_ip;
+    uint8_t target_node_id = ((Arg_for_handler*) arg)->target_node_id;
+    const flush_offload fo = request->content.fo;
+    // The compute node gives up on a flush it does not feed in time.
+    const auto kBatchTimeout = std::chrono::seconds(10);
+    ibv_mr send_mr;
+    ibv_mr ready_mr;
+    ibv_mr batch_mr;
+    ibv_mr edit_mr;
+    rdma_mg->Allocate_Local_RDMA_Slot(send_mr, Message);
+    rdma_mg->Allocate_Local_RDMA_Slot(ready_mr, Message);
+    rdma_mg->Allocate_Local_RDMA_Slot(batch_mr, Version_edit);
+    rdma_mg->Allocate_Local_RDMA_Slot(edit_mr, Version_edit);
+    volatile flush_offload_batch* ready =
+        static_cast<flush_offload_batch*>(ready_mr.addr);
+    ready->seq = 0;
+
+    auto meta = std::make_shared<RemoteMemTableMetaData>(1);
+    meta->largest_seq = 0;
+#ifndef BYTEADDRESSABLE
+    TableBuilder* builder =
+        new TableBuilder_Memoryside(*opts, Flush, rdma_mg, fo.bloom_bits);
+#endif
+#ifdef BYTEADDRESSABLE
+    TableBuilder* builder =
+        new TableBuilder_BAMS(*opts, Flush, rdma_mg, 0, fo.bloom_bits);
+#endif
+    ibv_mr remote_mr;
+    remote_mr.addr = fo.batch;
+    remote_mr.rkey = fo.batch_rkey;
+    RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
+    std::string largest;
+    size_t size = fo.size;
+    bool last = fo.last;
+    bool ok = true;
+    uint64_t batches = 0;
+    while (ok) {
+      if (size + 1 > batch_mr.length) {
+        ok = false;
+        break;
+      }
+      // Polled like the content of a compaction.
+      volatile char* polling_byte = (char*)batch_mr.addr + size;
+      memset((void*)polling_byte, 0, 1);
+      asm volatile ("mfence\n" : : );
+      rdma_mg->RDMA_Read(&remote_mr, &batch_mr, size + 1, client_ip, 0, 0,
+                         target_node_id);
+      while (*(unsigned char*)polling_byte == 0) {
+        _mm_clflush(polling_byte);
+        asm volatile ("mfence\n" : : );
+      }
+      Slice input(static_cast<char*>(batch_mr.addr), size);
+      while (ok && !input.empty()) {
+        Slice key, value;
+        ParsedInternalKey ikey;
+        if (!GetLengthPrefixedSlice(&input, &key) ||
+            !GetLengthPrefixedSlice(&input, &value) ||
+            !ParseInternalKey(key, &ikey)) {
+          fprintf(stderr, "bad flush batch from compute node %u\n",
+                  target_node_id);
+          ok = false;
+          break;
+        }
+        if (largest.empty()) {
+          meta->smallest.DecodeFrom(key);
+        }
+        largest.assign(key.data(), key.size());
+        meta->largest_seq = std::max(meta->largest_seq, ikey.sequence);
+        builder->Add(key, value);
+      }
+      batches++;
+      if (!ok || last) {
+        break;
+      }
+      // Hand the batch buffer back for the next batch.
+      send_pointer->content.fo = fo;
+      send_pointer->content.fo.size = 0;
+      send_pointer->content.fo.ready = ready_mr.addr;
+      send_pointer->content.fo.ready_rkey = ready_mr.rkey;
+      send_pointer->content.fo.last = 0;
+      send_pointer->content.fo.ok = 1;
+      send_pointer->received = true;
+      rdma_mg->RDMA_Write(request->buffer, request->rkey, &send_mr,
+                          sizeof(RDMA_Reply), client_ip, IBV_SEND_SIGNALED, 1,
+                          target_node_id);
+      const auto deadline = std::chrono::steady_clock::now() + kBatchTimeout;
+      while (ready->seq < batches) {
+        _mm_clflush((const void*)ready);
+        asm volatile ("mfence\n" : : );
+        if (std::chrono::steady_clock::now() > deadline) {
+          fprintf(stderr, "compute node %u stopped feeding its flush\n",
+                  target_node_id);
+          ok = false;
+          break;
+        }
+      }
+      if (ok && ready->size == FLUSH_OFFLOAD_ABORT) {
+        ok = false;
+      }
+      size = ready->size;
+      last = ready->last;
+    }
+    std::string serialized_ve;
+    if (ok && !largest.empty()) {
+      ok = builder->Finish().ok();
+    } else {
+      ok = false;
+      builder->Abandon();
+    }
+    if (ok) {
+      builder->get_datablocks_map(meta->remote_data_mrs);
+      builder->get_dataindexblocks_map(meta->remote_dataindex_mrs);
+      builder->get_filter_map(meta->remote_filter_mrs);
+      meta->largest.DecodeFrom(largest);
+      // The compute node gives the table a number of its own.
+      meta->number = versions_->NewFileNumber();
+      meta->level = 0;
+      meta->shard_target_node_id = rdma_mg->node_id;
+      meta->file_size = builder->FileSize();
+      meta->num_entries = builder->NumEntries();
+      meta->num_deletions = builder->NumDeletions();
+      meta->key_stats = builder->KeyStats();
+      meta->creation_time = opts->env->NowMicros() / 1000000;
+      meta->prefix_extractor = FilterPrefixName(*opts);
+      VersionEdit edit(0);
+      edit.AddFile(0, meta);
+      edit.EncodeTo(&serialized_ve);
+      ok = serialized_ve.size() <= std::min(fo.capacity, edit_mr.length);
+    }
+    delete builder;
+    if (ok) {
+      memcpy(edit_mr.addr, serialized_ve.data(), serialized_ve.size());
+      // The edit lands before the reply on the same queue pair.
+      rdma_mg->RDMA_Write(request->buffer_large, request->rkey_large,
+                          &edit_mr, serialized_ve.size(), client_ip,
+                          IBV_SEND_SIGNALED, 1, target_node_id);
+    }
+    send_pointer->content.fo = fo;
+    send_pointer->content.fo.size = ok ? serialized_ve.size() : 0;
+    send_pointer->content.fo.last = 1;
+    send_pointer->content.fo.ok = ok;
+    send_pointer->received = true;
+    rdma_mg->RDMA_Write(request->buffer, request->rkey, &send_mr,
+                        sizeof(RDMA_Reply), client_ip, IBV_SEND_SIGNALED, 1,
+                        target_node_id);
+    rdma_mg->Deallocate_Local_RDMA_Slot(edit_mr.addr, Version_edit);
+    rdma_mg->Deallocate_Local_RDMA_Slot(batch_mr.addr, Version_edit);
+    rdma_mg->Deallocate_Local_RDMA_Slot(ready_mr.addr, Message);
+    rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
+    delete request;
+    delete (Arg_for_handler*)arg;
+  }
   void Memory_Node_Keeper::version_unpin_handler(RDMA_Request* request,
                                                  std::string& client_ip) {
     std::unique_lock<std::mutex> lck(versionset_mtx);
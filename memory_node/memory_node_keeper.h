@@ -6,11 +6,17 @@
 #define dLSM_HOME_NODE_KEEPER_H
 
 
+#include <atomic>
+#include <deque>
 #include <queue>
+#include <tuple>
 //#include <fcntl.h>
 #include "util/rdma.h"
 #include "util/env_posix.h"
 #include "util/ThreadPool.h"
+#include "util/bounded_queue.h"
+#include "memory_node/cold_table_store.h"
+#include "memory_node/sstable_persister.h"
 #include "db/log_writer.h"
 #include "db/version_set.h"
 
@@ -32,26 +38,125 @@ class Memory_Node_Keeper {
 
   // this function is for the server.
   void Server_to_Client_Communication();
+  // At most "num" compactions at a time. The compaction pool keeps a thread
+  // for every compute node connected and grows up to "num" with the
+  // compactions waiting. Without it, the bound is max_background_compactions
+  // of the options.
   void SetBackgroundThreads(int num,  ThreadPoolType type);
+  // Persist the SSTables with "backend" on "num_workers" threads.
+  // REQUIRES: called before Server_to_Client_Communication().
+  void SetPersistence(SSTablePersister::Backend backend, int num_workers);
+  // Load the SSTables persisted before a restart, and hand them to the
+  // first compute node that asks for them.
+  // REQUIRES: called after SetPersistence() and before
+  // Server_to_Client_Communication().
+  void SetRecovery(bool recover) { recover_ = recover; }
+  // Keep the tables of Options::cold_level and below in "dir", written with
+  // "backend" on "num_workers" threads. Without it every level stays in the
+  // memory.
+  // REQUIRES: called before Server_to_Client_Communication().
+  void SetColdStorage(const std::string& dir,
+                      SSTablePersister::Backend backend, int num_workers);
+  // Receive the messages of all the compute nodes through one shared receive
+  // queue of R_SIZE buffers polled by "num_pollers" threads, rather than
+  // R_SIZE buffers and a polling thread for each compute node. Without
+  // device support for it, or with 0, every compute node keeps its own.
+  // REQUIRES: called before Server_to_Client_Communication().
+  void SetSharedReceiveQueue(int num_pollers) { srq_pollers_ = num_pollers; }
+  // Hand a compaction back to the compute node asking for it, which runs it
+  // over RDMA on its own cores, rather than queue it behind more than
+  // "max_waiting" others once all the compaction threads are busy. For a
+  // node whose processors can not keep up with the compactions. Negative,
+  // the default, for never.
+  // REQUIRES: called before Server_to_Client_Communication().
+  void SetCompactionHandBack(int max_waiting) {
+    hand_back_waiting_ = max_waiting;
+  }
+  // The RDMA transport statistics of this node, as "dLSM.rdma" reports them
+  // on the compute nodes.
+  std::string GetRDMAStats() { return rdma_mg->Stats_String(); }
+  // Serve GetStats() on the TCP port "port": with the HTTP headers to a
+  // GET request, such as the one of a Prometheus scraper, as is to a client
+  // which sends nothing. 0 for no endpoint.
+  // REQUIRES: called before Server_to_Client_Communication().
+  void SetStatsPort(uint32_t port) { stats_port_ = port; }
+  // Build the compaction outputs with Options::kv_checksums. The inputs
+  // are checked whether or not.
+  // REQUIRES: called before Server_to_Client_Communication().
+  void SetKVChecksums(bool enabled) { opts->kv_checksums = enabled; }
+  // The registered and the used memory per pool, the compaction queue and
+  // throughput, the persistence backlog, the garbage collection and the
+  // RPCs of every compute node, in the Prometheus text format.
+  std::string GetStats();
+  // The stages of a compaction, whose processor time is accounted apart:
+  // the merge of the inputs, the build of the output tables and the finish
+  // of their filter and index blocks, each on its own thread with
+  // subcompactions. DoCompactionWork runs all three on one thread, its time
+  // is kSerialStage.
+  enum CompactionStage {
+    kMergeStage,
+    kBuildStage,
+    kPublishStage,
+    kSerialStage,
+    kNumCompactionStages
+  };
+  // The processor time of "stage" in the compactions since the start.
+  uint64_t CompactionStageCpuMicros(CompactionStage stage) {
+    return compaction_stage_cpu_micros_[stage].load();
+  }
+  // Run a compaction encoded as Compaction::EncodeTo() does, of tables in
+  // the memory of this node, like sst_compaction_handler but without a
+  // compute node, and give the tables it built in *outputs. The caller
+  // frees the chunks of the inputs and of the outputs. For the benchmarks,
+  // see benchmarks/compaction_bench.cc.
+  Status CompactLocally(
+      const Slice& compaction,
+      std::vector<std::shared_ptr<RemoteMemTableMetaData>>* outputs);
+  // At most "num" subcompactions run a compaction at a time, rather than
+  // Options::MaxSubcompaction.
+  void SetMaxSubcompactions(int num) { opts->MaxSubcompaction = num; }
 //  void MaybeScheduleCompaction(std::string& client_ip);
 //  static void BGWork_Compaction(void* thread_args);
   static void RPC_Compaction_Dispatch(void* thread_args);
   static void RPC_Garbage_Collection_Dispatch(void* thread_args);
   static void Persistence_Dispatch(void* thread_args);
+  static void RPC_Cold_Table_Dispatch(void* thread_args);
+  static void RPC_Scan_Dispatch(void* thread_args);
+  static void RPC_Flush_Offload_Dispatch(void* thread_args);
+  static void RPC_Remote_Log_Dispatch(void* thread_args);
+  static void RPC_Shard_Sequencer_Dispatch(void* thread_args);
 //  void BackgroundCompaction(void* p);
   void CleanupCompaction(CompactionState* compact);
   void PersistSSTables(void* arg);
-  void PersistSSTable(std::shared_ptr<RemoteMemTableMetaData> sstable_ptr);
-  void UnpinSSTables_RPC(VersionEdit_Merger* edit_merger, std::string& client_ip);
-  void UnpinSSTables_RPC(std::list<uint64_t>* merged_file_number, std::string& client_ip);
+  // Mark the epochs of a persisted merger as durable, and write every
+  // compute node word whose epochs are now durable up to a later one.
+  void Publish_Persisted_Epochs(VersionEdit_Merger* edit_merger,
+                                std::string& client_ip);
+  // Read frequency of a file as last reported by the compute nodes, 0 if the
+  // file is not among their hot files.
+  uint32_t HotFileFrequency(uint64_t file_number, uint8_t creator_node_id);
   Status DoCompactionWork(CompactionState* compact, std::string& client_ip);
   void ProcessKeyValueCompaction(SubcompactionState* sub_compact);
+  // The builder stage of ProcessKeyValueCompaction: add the batched entries
+  // to the outputs and hand the full tables to the publisher stage.
+  void BuildCompactionOutputs(
+      SubcompactionState* sub_compact, BoundedQueue<std::string>* batches,
+      BoundedQueue<std::pair<TableBuilder*, CompactionOutput*>>* full_tables,
+      std::deque<CompactionOutput>* outputs, std::atomic<bool>* failed);
+  // The publisher stage of ProcessKeyValueCompaction: finish the full
+  // tables and record their chunks in their outputs.
+  Status PublishCompactionOutputs(
+      SubcompactionState* sub_compact,
+      BoundedQueue<std::pair<TableBuilder*, CompactionOutput*>>* full_tables,
+      std::atomic<bool>* failed);
   Status DoCompactionWorkWithSubcompaction(CompactionState* compact,
                                            std::string& client_ip);
-  Status OpenCompactionOutputFile(SubcompactionState* compact);
+  TableBuilder* OpenCompactionOutputFile(CompactionOutput* out, int level,
+                                         int bloom_bits);
   Status OpenCompactionOutputFile(CompactionState* compact);
-  Status FinishCompactionOutputFile(SubcompactionState* compact,
-                                    Iterator* input);
+  // Finish, or abandon, the table of "out" and delete its builder.
+  Status FinishCompactionOutputFile(TableBuilder* builder,
+                                    CompactionOutput* out, bool abandon);
   Status FinishCompactionOutputFile(CompactionState* compact, Iterator* input);
   Status GetFileSize(const std::string& filename, uint64_t* size) {
     struct ::stat file_stat;
@@ -136,6 +241,35 @@ class Memory_Node_Keeper {
   bool FileExists(const std::string& filename)  {
     return ::access(filename.c_str(), F_OK) == 0;
   }
+
+  Status GetChildren(const std::string& directory_path,
+                     std::vector<std::string>* result) {
+    result->clear();
+    ::DIR* dir = ::opendir(directory_path.c_str());
+    if (dir == nullptr) {
+      return PosixError(directory_path, errno);
+    }
+    struct ::dirent* entry;
+    while ((entry = ::readdir(dir)) != nullptr) {
+      result->emplace_back(entry->d_name);
+    }
+    ::closedir(dir);
+    return Status::OK();
+  }
+
+  Status RemoveFile(const std::string& filename) {
+    if (::unlink(filename.c_str()) != 0) {
+      return PosixError(filename, errno);
+    }
+    return Status::OK();
+  }
+
+  Status RenameFile(const std::string& from, const std::string& to) {
+    if (std::rename(from.c_str(), to.c_str()) != 0) {
+      return PosixError(from, errno);
+    }
+    return Status::OK();
+  }
   static std::shared_ptr<RDMA_Manager> rdma_mg;
 //  RDMA_Manager* rdma_mg;
  private:
@@ -159,13 +293,124 @@ class Memory_Node_Keeper {
   TableCache* const table_cache_;
   std::vector<std::thread> main_comm_threads;
   ThreadPool Compactor_pool_;
+  // See SetBackgroundThreads(), 0 if not set.
+  int max_compaction_threads_ = 0;
+  // Compaction RPCs queued in or running on Compactor_pool_. The count is
+  // sent back with the result of every compaction, so that the compute
+  // nodes know how loaded this node is.
+  std::atomic<uint32_t> compactions_in_flight_{0};
+  // See SetCompactionHandBack().
+  int hand_back_waiting_ = -1;
+  // The edits merged since the last persisted checkpoint.
+  std::atomic<uint32_t> unpersisted_edits_{0};
+  // Published with the status, see Current_Status().
+  port::CpuLoad cpu_load_;
+  // For GetStats(), since the start.
+  std::atomic<uint64_t> compactions_done_{0};
+  std::atomic<uint64_t> compactions_handed_back_{0};
+  std::atomic<uint64_t> compaction_micros_{0};
+  std::atomic<uint64_t> compaction_queue_micros_{0};
+  std::atomic<uint64_t> compaction_bytes_read_{0};
+  std::atomic<uint64_t> compaction_bytes_written_{0};
+  std::atomic<uint64_t> compaction_stage_cpu_micros_[kNumCompactionStages] =
+      {};
+  std::atomic<uint64_t> gc_batches_{0};
+  std::atomic<uint64_t> gc_chunks_{0};
+  std::atomic<uint64_t> gc_cold_files_{0};
+  static constexpr int kNumRPCs = release_mr_ + 1;
+  // [compute node id][RDMA_Command_Type] -> the requests received.
+  std::atomic<uint64_t> rpc_counts_[256][kNumRPCs] = {};
+  uint32_t stats_port_ = 0;
+  std::thread stats_thread_;
+  std::atomic<bool> stats_shutting_down_{false};
   ThreadPool Message_handler_pool_;
+  ThreadPool Garbage_collection_pool_;
   ThreadPool Persistency_bg_pool_;
+  // The main connection of a compute node on the shared receive queue. Its
+  // messages are handled in the order of their tickets, taken when polled.
+  struct Main_Connection {
+    std::string client_ip;
+    int socket_fd = -1;
+    uint64_t next_ticket = 0;  // Protected by srq_poll_mtx_.
+    uint64_t serving = 0;      // Protected by mtx.
+    std::mutex mtx;
+    std::condition_variable cv;
+  };
+  int srq_pollers_ = 0;
+  std::vector<std::thread> srq_poller_threads_;
+  std::mutex srq_poll_mtx_;
+  // compute node id -> its connection. Protected by srq_poll_mtx_, never
+  // erased.
+  std::map<uint8_t, Main_Connection> main_connections_;
+  std::unique_ptr<SSTablePersister> persister_;
+  std::unique_ptr<ColdTableStore> cold_store_;
+  bool recover_ = false;
+  std::mutex recovered_mtx_;
+  // The files and range tombstones recovered from the disk and the next
+  // sequence number of the database they belong to, until a compute node
+  // has fetched them.
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> recovered_files_;
+  std::vector<RangeTombstone> recovered_range_tombstones_;
+  SequenceNumber recovered_last_sequence_ = 0;
+  // The garbage collection ring of every compute node, and the batches
+  // consumed from it.
+  struct GC_Ring {
+    ibv_mr* mr;
+    uint64_t consumed;
+  };
+  std::mutex gc_rings_mtx_;
+  std::map<uint8_t, GC_Ring> gc_rings_;  // Protected by gc_rings_mtx_.
+  // Polls all the rings, started with the first one.
+  std::thread gc_ring_thread_;
+  std::atomic<bool> gc_shutting_down_{false};
+  // The write-ahead log, and the ring of the version edits, of every
+  // (compute node id, shard id, edits), kept for the compute node to replay
+  // after it restarted and for the read replicas of the shard. Protected by
+  // remote_logs_mtx_.
+  std::mutex remote_logs_mtx_;
+  std::map<std::tuple<uint8_t, uint8_t, bool>, ibv_mr*> remote_logs_;
+  // The sequence counters of the shards, one per shard id, registered at the
+  // first request. Protected by remote_logs_mtx_.
+  ibv_mr* shard_sequencers_ = nullptr;
   std::mutex versionset_mtx;
   VersionSet* versions_;
   VersionEdit_Merger ve_merger;
   std::atomic<bool> check_point_t_ready = true;
   std::mutex merger_mtx;
+  // The epochs of a compute node word that are durable, all of them up to
+  // "persisted" and the ones after it in "done".
+  struct Persisted_Epochs {
+    uint32_t rkey;
+    uint64_t persisted;
+    std::set<uint64_t> done;
+  };
+  std::mutex persisted_epochs_mtx_;
+  // (compute node id, word) -> its epochs. Protected by persisted_epochs_mtx_.
+  std::map<std::pair<uint8_t, void*>, Persisted_Epochs> persisted_epochs_;
+  std::mutex hot_files_mtx_;
+  // compute node id -> the hot files it reported last.
+  std::map<uint8_t, std::vector<std::tuple<uint64_t, uint8_t, uint32_t>>>
+      hot_files_;
+  // The tables of a shard of a compute node, from the edits it installed,
+  // so that the shard reattaches to them when it is opened again.
+  struct Shard_Tables {
+    // (file number, creator node id) -> the table.
+    std::map<std::pair<uint64_t, uint8_t>,
+             std::shared_ptr<RemoteMemTableMetaData>>
+        files;
+    SequenceNumber last_sequence = 0;
+  };
+  std::mutex reattach_mtx_;
+  // (compute node id, shard id) -> the tables of the shard in the current
+  // run of the compute node, and in its former runs until the shard is
+  // opened again. Protected by reattach_mtx_.
+  std::map<std::pair<uint8_t, uint8_t>, Shard_Tables> attached_;
+  std::map<std::pair<uint8_t, uint8_t>, Shard_Tables> detached_;
+  // compute node id -> the regions registered for its current run, and the
+  // regions of the former runs by address. The new runs do not allocate from
+  // the latter, nor does this node. Protected by reattach_mtx_.
+  std::map<uint8_t, std::vector<ibv_mr*>> regions_;
+  std::map<char*, ibv_mr*> former_regions_;
 //  std::mutex test_compaction_mutex;
 #ifndef NDEBUG
   std::atomic<size_t> debug_counter = 0;
@@ -174,11 +419,23 @@ class Memory_Node_Keeper {
 #endif
   Status InstallCompactionResults(CompactionState* compact,
                                   std::string& client_ip);
+  // Replay the MANIFEST on the disk, load the files it keeps into the
+  // FlushBuffer and start a new MANIFEST with a snapshot of them.
+  Status RecoverPersistedSSTables();
   Status InstallCompactionResultsToComputePreparation(CompactionState* compact);
   int server_sock_connect(const char* servername, int port);
   void server_communication_thread(std::string client_ip, int socket_fd);
+  void shared_receive_polling_thread();
+  // Handle a message copied out of the receive buffer of the compute node,
+  // inline or on the pool of its kind. Returns false if it is corrupt.
+  bool Dispatch_Request(RDMA_Request* receive_msg_buf, std::string& client_ip,
+                        uint8_t compute_node_id, int socket_fd);
   void create_mr_handler(RDMA_Request* request, std::string& client_ip,
                          uint8_t target_node_id);
+  // Take back an empty region create_mr_handler() gave the compute node,
+  // for the next one which asks for a region.
+  void release_mr_handler(RDMA_Request* request, std::string& client_ip,
+                          uint8_t target_node_id);
   void create_qp_handler(RDMA_Request* request, std::string& client_ip,
                          uint8_t target_node_id);
   const Comparator* user_comparator() const {
@@ -187,15 +444,55 @@ class Memory_Node_Keeper {
   void install_version_edit_handler(RDMA_Request* request,
                                     std::string& client_ip,
                                     uint8_t target_node_id);
+  // Set up the garbage collection ring of a compute node.
   void sst_garbage_collection(void* arg);
+  // Consume the batches of all the rings, and keep Current_Status() in
+  // their headers.
+  void gc_ring_poller();
+  // Accept the connections to stats_port_ and answer them one by one.
+  void stats_server_thread(int listen_fd);
+  Memory_Node_Status Current_Status();
+  // Set up the write-ahead log of a shard of a compute node, or give the one
+  // it had again.
+  void remote_log_handler(void* arg);
+  // Give the sequence counter of a shard, the same to every compute node.
+  void shard_sequencer_handler(void* arg);
 
   void sst_compaction_handler(void* arg);
+  // Read a block of a cold table for a compute node.
+  void cold_read_handler(void* arg);
+  // Load a cold table back into the memory for a compute node.
+  void promote_handler(void* arg);
+  // Run a scan pushed down by a compute node and stream the kept entries
+  // back to it.
+  void scan_pushdown_handler(void* arg);
+  // Build the level 0 table of a flush of a compute node from the entries
+  // it streams, and send back the edit adding it.
+  void flush_offload_handler(void* arg);
 
   void qp_reset_handler(RDMA_Request* request, std::string& client_ip,
                         int socket_fd, uint8_t target_node_id);
   void sync_option_handler(RDMA_Request* request, std::string& client_ip,
                            uint8_t target_node_id);
+  // Size Compactor_pool_ to the compute nodes connected.
+  void ResizeCompactorPool();
   void version_unpin_handler(RDMA_Request* request, std::string& client_ip);
+  void recovered_version_handler(RDMA_Request* request,
+                                 std::string& client_ip,
+                                 uint8_t target_node_id);
+  // Keep the files an edit of a shard of a compute node adds and deletes.
+  void Track_Version_Edit(uint8_t compute_node_id, uint8_t shard_id,
+                          VersionEdit* edit);
+  // The compute node connected again: what it had belongs to a former run.
+  void Detach_Compute_Node(uint8_t compute_node_id);
+  // Give the tables a shard had before it was opened again, and their last
+  // sequence in *last_sequence, to the shard.
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> Reattach_Shard(
+      uint8_t compute_node_id, uint8_t shard_id,
+      SequenceNumber* last_sequence);
+  // Take the chunks of "chunks" that lie in the regions of former runs out,
+  // they are not in the FlushBuffer pool and are not used again.
+  void Release_Former_Chunks(std::vector<uint64_t>* chunks);
   void Edit_sync_to_remote(VersionEdit* edit, std::string& client_ip,
                            std::unique_lock<std::mutex>* version_mtx,
                            uint8_t target_node_id);
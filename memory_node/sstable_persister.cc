@@ -0,0 +1,623 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "memory_node/sstable_persister.h"
+
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "db/filename.h"
+#include "db/version_edit.h"
+#include "dLSM/rate_limiter.h"
+#include "util/coding.h"
+#include "util/io_uring.h"
+#include "util/rdma.h"
+
+namespace dLSM {
+
+namespace {
+
+// The files a worker writes, and then syncs, together.
+const size_t kMaxFilesPerRound = 16;
+// The submission entries of the ring of a worker.
+const unsigned kRingEntries = 256;
+// The last 32 bits of the file of a table kept in the persistent memory,
+// larger than any number of filter chunks ends the other files with.
+const uint32_t kPmemMagic = 0x504d454d;
+
+Status PosixError(const std::string& context, int error_number) {
+  return Status::IOError(context, std::strerror(error_number));
+}
+
+// Read "n" bytes at "offset" of "fd" into "data".
+int PreadFully(int fd, char* data, size_t n, uint64_t offset) {
+  while (n > 0) {
+    ssize_t read = ::pread(fd, data, n, static_cast<off_t>(offset));
+    if (read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    if (read == 0) {
+      return EIO;
+    }
+    data += read;
+    n -= read;
+    offset += read;
+  }
+  return 0;
+}
+
+// Write all of "data" at "offset" of "fd".
+int PwriteFully(int fd, const char* data, size_t n, uint64_t offset) {
+  while (n > 0) {
+    ssize_t written = ::pwrite(fd, data, n, static_cast<off_t>(offset));
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    data += written;
+    n -= written;
+    offset += written;
+  }
+  return 0;
+}
+
+// Add "chunks", "num[0]" data, "num[1]" index and "num[2]" filter ones in
+// this order, to "table". The data chunks are keyed by the offset after
+// them, the index and filter chunks by their position from 1, as the table
+// builders do.
+void InsertChunks(RemoteMemTableMetaData* table, const uint32_t num[3],
+                  const std::vector<ibv_mr*>& chunks) {
+  uint32_t offset = 0;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    offset += chunks[i]->length;
+    if (i < num[0]) {
+      table->remote_data_mrs.insert({offset, chunks[i]});
+    } else if (i < num[0] + num[1]) {
+      table->remote_dataindex_mrs.insert(
+          {static_cast<uint32_t>(i - num[0] + 1), chunks[i]});
+    } else {
+      table->remote_filter_mrs.insert(
+          {static_cast<uint32_t>(i - num[0] - num[1] + 1), chunks[i]});
+    }
+  }
+}
+
+// Read all of "fname" into "contents" if it ends with kPmemMagic, leaving
+// "contents" empty otherwise.
+int ReadExtentsFile(const std::string& fname, std::string* contents) {
+  contents->clear();
+  int fd = ::open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return errno;
+  }
+  int error = 0;
+  char magic[sizeof(uint32_t)];
+  off_t file_size = ::lseek(fd, 0, SEEK_END);
+  if (file_size < 0) {
+    error = errno;
+  } else if (file_size >= static_cast<off_t>(sizeof(magic))) {
+    error = PreadFully(fd, magic, sizeof(magic), file_size - sizeof(magic));
+    if (error == 0 && DecodeFixed32(magic) == kPmemMagic) {
+      contents->resize(file_size);
+      error = PreadFully(fd, &(*contents)[0], contents->size(), 0);
+    }
+  }
+  ::close(fd);
+  return error;
+}
+
+}  // namespace
+
+// The tables of one Persist() call.
+struct SSTablePersister::Batch {
+  std::mutex mutex;
+  std::condition_variable cv;
+  // The fields below are protected by mutex.
+  size_t remaining;
+  Status status;
+};
+
+// The file of a table.
+struct SSTablePersister::Job {
+  std::string fname;
+  // The chunks and the footer, in the order of the file.
+  std::vector<Slice> pieces;
+  std::vector<uint32_t> footer;
+  // The file of a table left in the persistent memory.
+  std::string extents;
+  RateLimiter* rate_limiter;
+  Batch* batch;
+  int fd;
+  Status status;
+  // Set for a Load() of "table" rather than a write.
+  RemoteMemTableMetaData* table = nullptr;
+  RDMA_Manager* rdma_mg = nullptr;
+  bool data_only = false;
+
+  // Open the file, setting status on failure.
+  void Open() {
+    fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      status = PosixError(fname, errno);
+    }
+  }
+
+  void Close() {
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+};
+
+SSTablePersister::SSTablePersister(Backend backend, int num_workers,
+                                   RDMA_Manager* rdma_mg)
+    : backend_(backend), rdma_mg_(rdma_mg), shutting_down_(false) {
+  for (int i = 0; i < num_workers; i++) {
+    workers_.emplace_back(&SSTablePersister::WorkerLoop, this);
+  }
+}
+
+SSTablePersister::~SSTablePersister() {
+  {
+    std::unique_lock<std::mutex> lck(mutex_);
+    shutting_down_ = true;
+  }
+  cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+Status SSTablePersister::Persist(
+    const std::string& dbname,
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables,
+    RateLimiter* rate_limiter) {
+  std::vector<uint64_t> numbers;
+  numbers.reserve(tables.size());
+  for (const auto& table : tables) {
+    numbers.push_back(table->number);
+  }
+  return PersistAs(dbname, numbers, tables, rate_limiter);
+}
+
+Status SSTablePersister::PersistAs(
+    const std::string& dbname, const std::vector<uint64_t>& numbers,
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables,
+    RateLimiter* rate_limiter) {
+  assert(numbers.size() == tables.size());
+  std::vector<Job> jobs(tables.size());
+  for (size_t i = 0; i < tables.size(); i++) {
+    Job& job = jobs[i];
+    const RemoteMemTableMetaData& table = *tables[i];
+    job.fname = TableFileName(dbname, numbers[i]);
+    job.rate_limiter = rate_limiter;
+    job.fd = -1;
+    if (backend_ == kPmem && PersistInPlace(table, &job.extents)) {
+      job.pieces.emplace_back(job.extents);
+      continue;
+    }
+    uint32_t offset = 0;
+    for (const auto* chunks : {&table.remote_data_mrs,
+                               &table.remote_dataindex_mrs,
+                               &table.remote_filter_mrs}) {
+      for (const auto& chunk : *chunks) {
+        job.pieces.emplace_back(static_cast<char*>(chunk.second->addr),
+                                chunk.second->length);
+        offset += chunk.second->length;
+        job.footer.push_back(offset);
+      }
+    }
+    job.footer.push_back(static_cast<uint32_t>(table.remote_data_mrs.size()));
+    job.footer.push_back(
+        static_cast<uint32_t>(table.remote_dataindex_mrs.size()));
+    job.footer.push_back(static_cast<uint32_t>(table.remote_filter_mrs.size()));
+    job.pieces.emplace_back(reinterpret_cast<char*>(job.footer.data()),
+                            job.footer.size() * sizeof(uint32_t));
+  }
+  return Run(&jobs);
+}
+
+Status SSTablePersister::Load(
+    const std::string& dbname,
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables,
+    RDMA_Manager* rdma_mg) {
+  std::vector<uint64_t> numbers;
+  numbers.reserve(tables.size());
+  for (const auto& table : tables) {
+    numbers.push_back(table->number);
+  }
+  return LoadAs(dbname, numbers, tables, rdma_mg, false);
+}
+
+Status SSTablePersister::LoadAs(
+    const std::string& dbname, const std::vector<uint64_t>& numbers,
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables,
+    RDMA_Manager* rdma_mg, bool data_only) {
+  assert(numbers.size() == tables.size());
+  std::vector<Job> jobs(tables.size());
+  for (size_t i = 0; i < tables.size(); i++) {
+    Job& job = jobs[i];
+    job.fname = TableFileName(dbname, numbers[i]);
+    job.rate_limiter = nullptr;
+    job.fd = -1;
+    job.table = tables[i].get();
+    job.rdma_mg = rdma_mg;
+    job.data_only = data_only;
+  }
+  if (backend_ == kPmem && !data_only && rdma_mg->Has_Persistent_Memory()) {
+    Status s = LoadInPlace(rdma_mg, &jobs);
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  return Run(&jobs);
+}
+
+bool SSTablePersister::PersistInPlace(const RemoteMemTableMetaData& table,
+                                      std::string* extents) {
+  if (rdma_mg_ == nullptr || !rdma_mg_->Has_Persistent_Memory()) {
+    return false;
+  }
+  extents->clear();
+  for (const auto* chunks : {&table.remote_data_mrs,
+                             &table.remote_dataindex_mrs,
+                             &table.remote_filter_mrs}) {
+    for (const auto& chunk : *chunks) {
+      uint64_t offset;
+      if (!rdma_mg_->Persistent_Offset(chunk.second->addr,
+                                       chunk.second->length, &offset)) {
+        return false;
+      }
+      PutFixed64(extents, offset);
+      PutFixed32(extents, static_cast<uint32_t>(chunk.second->length));
+    }
+  }
+  // Flushed only once the whole table is known to be in place, a table
+  // which is not is written out as a whole.
+  for (const auto* chunks : {&table.remote_data_mrs,
+                             &table.remote_dataindex_mrs,
+                             &table.remote_filter_mrs}) {
+    for (const auto& chunk : *chunks) {
+      if (!rdma_mg_->Persist_Range(chunk.second->addr,
+                                   chunk.second->length)) {
+        return false;
+      }
+    }
+  }
+  PutFixed32(extents, static_cast<uint32_t>(table.remote_data_mrs.size()));
+  PutFixed32(extents,
+             static_cast<uint32_t>(table.remote_dataindex_mrs.size()));
+  PutFixed32(extents, static_cast<uint32_t>(table.remote_filter_mrs.size()));
+  PutFixed32(extents, kPmemMagic);
+  return true;
+}
+
+Status SSTablePersister::LoadInPlace(RDMA_Manager* rdma_mg,
+                                     std::vector<Job>* jobs) {
+  // The tables in place, the numbers of their chunks, and all their
+  // extents, which are taken back together.
+  std::vector<RemoteMemTableMetaData*> tables;
+  std::vector<std::array<uint32_t, 3>> nums;
+  std::vector<std::pair<uint64_t, uint32_t>> extents;
+  Status s;
+  std::vector<Job> rest;
+  for (Job& job : *jobs) {
+    std::string contents;
+    int error = ReadExtentsFile(job.fname, &contents);
+    if (error != 0) {
+      s = PosixError(job.fname, error);
+      break;
+    }
+    if (contents.empty()) {
+      rest.push_back(std::move(job));
+      continue;
+    }
+    const size_t kTrailer = 4 * sizeof(uint32_t);
+    const size_t kExtent = sizeof(uint64_t) + sizeof(uint32_t);
+    if (contents.size() < kTrailer) {
+      s = Status::Corruption(job.fname, "too short for a footer");
+      break;
+    }
+    const char* trailer = contents.data() + contents.size() - kTrailer;
+    std::array<uint32_t, 3> num;
+    for (int i = 0; i < 3; i++) {
+      num[i] = DecodeFixed32(trailer + i * sizeof(uint32_t));
+    }
+    const uint64_t total = uint64_t{num[0]} + num[1] + num[2];
+    if (num[1] == 0 || total * kExtent + kTrailer != contents.size()) {
+      s = Status::Corruption(job.fname, "bad chunk extents");
+      break;
+    }
+    for (uint64_t i = 0; i < total; i++) {
+      const char* p = contents.data() + i * kExtent;
+      extents.emplace_back(DecodeFixed64(p),
+                           DecodeFixed32(p + sizeof(uint64_t)));
+    }
+    tables.push_back(job.table);
+    nums.push_back(num);
+  }
+  if (!s.ok()) {
+    return s;
+  }
+  jobs->swap(rest);
+  if (tables.empty()) {
+    return s;
+  }
+  std::vector<ibv_mr*> chunks;
+  if (!rdma_mg->Adopt_Persistent_Chunks(extents, &chunks)) {
+    return Status::Corruption("persistent memory",
+                              "chunks out of the preregistered regions");
+  }
+  size_t next = 0;
+  for (size_t i = 0; i < tables.size(); i++) {
+    const size_t total = size_t{nums[i][0]} + nums[i][1] + nums[i][2];
+    InsertChunks(tables[i], nums[i].data(),
+                 std::vector<ibv_mr*>(chunks.begin() + next,
+                                      chunks.begin() + next + total));
+    next += total;
+  }
+  return s;
+}
+
+Status SSTablePersister::Run(std::vector<Job>* jobs) {
+  if (jobs->empty()) {
+    return Status::OK();
+  }
+  Batch batch;
+  batch.remaining = jobs->size();
+  {
+    std::unique_lock<std::mutex> lck(mutex_);
+    for (Job& job : *jobs) {
+      job.batch = &batch;
+      queue_.push_back(&job);
+    }
+  }
+  cv_.notify_all();
+  std::unique_lock<std::mutex> lck(batch.mutex);
+  batch.cv.wait(lck, [&batch] { return batch.remaining == 0; });
+  return batch.status;
+}
+
+void SSTablePersister::WorkerLoop() {
+  std::unique_ptr<IOUring> ring;
+  if (backend_ == kIOUring) {
+    ring.reset(new IOUring());
+    if (!ring->Init(kRingEntries)) {
+      fprintf(stderr, "io_uring is not available, persist with pwrite\n");
+      ring.reset();
+    }
+  }
+  std::vector<Job*> jobs;
+  std::vector<Job*> writes;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lck(mutex_);
+      cv_.wait(lck, [this] { return !queue_.empty() || shutting_down_; });
+      if (queue_.empty()) {
+        return;
+      }
+      while (!queue_.empty() && jobs.size() < kMaxFilesPerRound) {
+        jobs.push_back(queue_.front());
+        queue_.pop_front();
+      }
+    }
+    writes.clear();
+    for (Job* job : jobs) {
+      if (job->table != nullptr) {
+        LoadFile(job);
+      } else {
+        writes.push_back(job);
+      }
+    }
+    if (ring != nullptr && !writes.empty() &&
+        !PersistIOUring(ring.get(), writes)) {
+      fprintf(stderr, "io_uring failed, persist with pwrite\n");
+      ring.reset();
+      for (Job* job : writes) {
+        job->status = Status::OK();
+      }
+    }
+    if (ring == nullptr && !writes.empty()) {
+      PersistPosix(writes);
+    }
+    for (Job* job : jobs) {
+      Batch* batch = job->batch;
+      std::unique_lock<std::mutex> lck(batch->mutex);
+      if (!job->status.ok() && batch->status.ok()) {
+        batch->status = job->status;
+      }
+      if (--batch->remaining == 0) {
+        batch->cv.notify_one();
+      }
+    }
+    jobs.clear();
+  }
+}
+
+void SSTablePersister::PersistPosix(const std::vector<Job*>& jobs) {
+  for (Job* job : jobs) {
+    job->Open();
+    uint64_t offset = 0;
+    for (const Slice& piece : job->pieces) {
+      if (!job->status.ok()) {
+        break;
+      }
+      if (job->rate_limiter != nullptr) {
+        job->rate_limiter->Request(piece.size(), RateLimiter::kLow);
+      }
+      int error = PwriteFully(job->fd, piece.data(), piece.size(), offset);
+      if (error != 0) {
+        job->status = PosixError(job->fname, error);
+      }
+      offset += piece.size();
+    }
+  }
+  // The syncs go after all the writes, so that the device may merge them.
+  for (Job* job : jobs) {
+    if (job->status.ok() && ::fdatasync(job->fd) != 0) {
+      job->status = PosixError(job->fname, errno);
+    }
+    job->Close();
+  }
+}
+
+void SSTablePersister::LoadFile(Job* job) {
+  job->fd = ::open(job->fname.c_str(), O_RDONLY | O_CLOEXEC);
+  if (job->fd < 0) {
+    job->status = PosixError(job->fname, errno);
+    return;
+  }
+  RemoteMemTableMetaData* table = job->table;
+  std::vector<ibv_mr*> chunks;
+  // Read the footer from its end: the chunk numbers, then the offsets.
+  off_t file_size = ::lseek(job->fd, 0, SEEK_END);
+  char counts[3 * sizeof(uint32_t)];
+  int error = 0;
+  if (file_size < static_cast<off_t>(sizeof(counts))) {
+    job->status = Status::Corruption(job->fname, "too short for a footer");
+  } else {
+    error = PreadFully(job->fd, counts, sizeof(counts),
+                       file_size - sizeof(counts));
+  }
+  uint32_t num[3] = {0, 0, 0};
+  std::vector<uint32_t> offsets;
+  if (job->status.ok() && error == 0) {
+    for (int i = 0; i < 3; i++) {
+      num[i] = DecodeFixed32(counts + i * sizeof(uint32_t));
+    }
+    uint64_t total = uint64_t{num[0]} + num[1] + num[2];
+    uint64_t footer_size = (total + 3) * sizeof(uint32_t);
+    if (num[1] == 0 || footer_size > static_cast<uint64_t>(file_size)) {
+      job->status = Status::Corruption(job->fname, "bad footer");
+    } else {
+      offsets.resize(total);
+      error = PreadFully(job->fd, reinterpret_cast<char*>(offsets.data()),
+                         total * sizeof(uint32_t), file_size - footer_size);
+      if (error == 0 &&
+          offsets.back() + footer_size != static_cast<uint64_t>(file_size)) {
+        job->status = Status::Corruption(job->fname, "bad chunk offsets");
+      }
+    }
+  }
+  const size_t chunk_size = job->rdma_mg->name_to_chunksize.at(FlushBuffer);
+  // The data chunks come first.
+  const size_t num_read = job->data_only ? num[0] : offsets.size();
+  uint32_t start = 0;
+  for (size_t i = 0; i < num_read && job->status.ok() && error == 0; i++) {
+    if (offsets[i] < start || offsets[i] - start > chunk_size) {
+      job->status = Status::Corruption(job->fname, "bad chunk size");
+      break;
+    }
+    auto* mr = new ibv_mr();
+    job->rdma_mg->Allocate_Local_RDMA_Slot(*mr, FlushBuffer);
+    mr->length = offsets[i] - start;
+    chunks.push_back(mr);
+    error = PreadFully(job->fd, static_cast<char*>(mr->addr), mr->length,
+                       start);
+    start = offsets[i];
+  }
+  if (error != 0) {
+    job->status = PosixError(job->fname, error);
+  }
+  job->Close();
+  if (!job->status.ok()) {
+    for (ibv_mr* mr : chunks) {
+      job->rdma_mg->Deallocate_Local_RDMA_Slot(mr->addr, FlushBuffer);
+      delete mr;
+    }
+    return;
+  }
+  InsertChunks(table, num, chunks);
+}
+
+bool SSTablePersister::PersistIOUring(IOUring* ring,
+                                      const std::vector<Job*>& jobs) {
+  // The operations in the ring, the user data of an entry is its index.
+  struct Operation {
+    Job* job;
+    Slice piece;  // Empty for a sync.
+    uint64_t offset;
+  };
+  std::vector<Operation> operations;
+  bool ring_ok = true;
+  // Submit the operations prepared so far and wait for all of them.
+  auto flush = [&]() {
+    unsigned pending = kRingEntries - ring->SpaceLeft();
+    if (pending == 0 || !ring_ok) {
+      return;
+    }
+    if (ring->Submit(pending) != 0) {
+      ring_ok = false;
+      return;
+    }
+    uint64_t index;
+    int result;
+    while (pending > 0 && ring->Reap(&index, &result)) {
+      pending--;
+      Operation& op = operations[index];
+      if (!op.job->status.ok()) {
+        continue;
+      }
+      if (result < 0) {
+        op.job->status = PosixError(op.job->fname, -result);
+      } else if (static_cast<size_t>(result) < op.piece.size()) {
+        // A short write, finish it in place.
+        int error = PwriteFully(op.job->fd, op.piece.data() + result,
+                                op.piece.size() - result, op.offset + result);
+        if (error != 0) {
+          op.job->status = PosixError(op.job->fname, error);
+        }
+      }
+    }
+    operations.clear();
+  };
+  for (Job* job : jobs) {
+    job->Open();
+    uint64_t offset = 0;
+    for (const Slice& piece : job->pieces) {
+      if (!job->status.ok()) {
+        break;
+      }
+      if (job->rate_limiter != nullptr) {
+        job->rate_limiter->Request(piece.size(), RateLimiter::kLow);
+      }
+      if (ring->SpaceLeft() == 0) {
+        flush();
+      }
+      ring->PrepareWrite(job->fd, piece.data(), piece.size(), offset,
+                         operations.size());
+      operations.push_back({job, piece, offset});
+      offset += piece.size();
+    }
+  }
+  flush();
+  // One round of syncs for all the files.
+  for (Job* job : jobs) {
+    if (job->status.ok()) {
+      if (ring->SpaceLeft() == 0) {
+        flush();
+      }
+      ring->PrepareFdatasync(job->fd, operations.size());
+      operations.push_back({job, Slice(), 0});
+    }
+  }
+  flush();
+  for (Job* job : jobs) {
+    job->Close();
+  }
+  return ring_ok;
+}
+
+}  // namespace dLSM
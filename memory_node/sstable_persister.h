@@ -0,0 +1,127 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_MEMORY_NODE_SSTABLE_PERSISTER_H_
+#define STORAGE_dLSM_MEMORY_NODE_SSTABLE_PERSISTER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dLSM/status.h"
+
+namespace dLSM {
+
+class IOUring;
+class RateLimiter;
+class RDMA_Manager;
+struct RemoteMemTableMetaData;
+
+// Writes the SSTables of the memory node to its disk, straight from their
+// registered chunks, on a fixed pool of worker threads. A worker takes the
+// files queued so far together, writes them all and then syncs them all, so
+// that a version edit with many new files waits for one round of syncs
+// rather than one per file.
+//
+// A file holds the data, index and filter chunks of its table in this
+// order, followed by the offsets after every chunk and by the numbers of
+// data, index and filter chunks, all fixed 32-bit.
+//
+// With kPmem a table whose chunks are all in the persistent memory of the
+// node, see RDMA_Manager::Has_Persistent_Memory(), stays there: its chunks
+// are flushed out of the cache and its file only holds the offset and the
+// length of every chunk in the persistent memory, fixed 64 and 32-bit,
+// then the three numbers of chunks and kPmemMagic.
+class SSTablePersister {
+ public:
+  enum Backend {
+    // pwrite() and fdatasync().
+    kPosix,
+    // io_uring, one ring per worker. A worker whose ring cannot be set up
+    // falls back to kPosix.
+    kIOUring,
+    // The tables in the persistent memory of "rdma_mg" in place, the others
+    // as kPosix. Load() then takes the chunks back where they are rather
+    // than copying them, so it must run before the preregistered memory is
+    // used.
+    kPmem
+  };
+
+  // "rdma_mg" is only used by kPmem, it may be nullptr otherwise.
+  SSTablePersister(Backend backend, int num_workers,
+                   RDMA_Manager* rdma_mg = nullptr);
+
+  SSTablePersister(const SSTablePersister&) = delete;
+  SSTablePersister& operator=(const SSTablePersister&) = delete;
+
+  ~SSTablePersister();
+
+  Backend backend() const { return backend_; }
+
+  // Write "tables" to "dbname" and return once they are durable. The writes
+  // are charged to "rate_limiter" unless it is nullptr.
+  Status Persist(const std::string& dbname,
+                 const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables,
+                 RateLimiter* rate_limiter);
+
+  // Read the files of "tables" from "dbname" back into FlushBuffer chunks of
+  // "rdma_mg", and fill in the chunks of every table. The tables have their
+  // numbers set. On error the tables that failed are left without chunks.
+  Status Load(const std::string& dbname,
+              const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables,
+              RDMA_Manager* rdma_mg);
+
+  // Same as Persist() and Load() with the file of tables[i] named after
+  // numbers[i] rather than the number of the table. With "data_only" only
+  // the data chunks are read, into tables which have the other ones.
+  Status PersistAs(
+      const std::string& dbname, const std::vector<uint64_t>& numbers,
+      const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables,
+      RateLimiter* rate_limiter);
+  Status LoadAs(
+      const std::string& dbname, const std::vector<uint64_t>& numbers,
+      const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& tables,
+      RDMA_Manager* rdma_mg, bool data_only);
+
+ private:
+  struct Batch;
+  struct Job;
+
+  void WorkerLoop();
+  // Write and sync "jobs", setting the status of each. PersistIOUring
+  // returns false if the ring failed, the jobs are then left to be redone.
+  void PersistPosix(const std::vector<Job*>& jobs);
+  bool PersistIOUring(IOUring* ring, const std::vector<Job*>& jobs);
+  // Read the file of a Load() job, setting its status.
+  void LoadFile(Job* job);
+  // The kPmem part of PersistAs(): flush the chunks of "table" and encode
+  // their extents in "extents", false if they are not all in the
+  // persistent memory.
+  bool PersistInPlace(const RemoteMemTableMetaData& table,
+                      std::string* extents);
+  // The kPmem part of LoadAs(): take back in place the chunks of the tables
+  // whose files list them, and leave the other ones in "jobs" to be read.
+  Status LoadInPlace(RDMA_Manager* rdma_mg, std::vector<Job>* jobs);
+  // Queue "jobs" and wait for them.
+  Status Run(std::vector<Job>* jobs);
+
+  const Backend backend_;
+  RDMA_Manager* const rdma_mg_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // The fields below are protected by mutex_.
+  std::deque<Job*> queue_;
+  bool shutting_down_;
+
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_MEMORY_NODE_SSTABLE_PERSISTER_H_
@@ -23,6 +23,7 @@
 #include <sys/resource.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <cstdlib>
 //#include "logging/logging.h"
@@ -224,6 +225,52 @@ void cacheline_aligned_free(void *memblock) {
   free(memblock);
 }
 
+uint32_t CpuLoad::BusyPercent() {
+  static const uint64_t kIntervalMicros = 100000;
+  std::lock_guard<std::mutex> l(mu_);
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  const uint64_t now_micros =
+      static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_usec;
+  if (now_micros - read_micros_ < kIntervalMicros) {
+    return percent_;
+  }
+  read_micros_ = now_micros;
+  FILE* f = fopen("/proc/stat", "r");
+  if (f == nullptr) {
+    return percent_;
+  }
+  // cpu user nice system idle iowait irq softirq steal
+  unsigned long long ticks[8] = {};
+  const int fields = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+                            &ticks[0], &ticks[1], &ticks[2], &ticks[3],
+                            &ticks[4], &ticks[5], &ticks[6], &ticks[7]);
+  fclose(f);
+  if (fields < 4) {
+    return percent_;
+  }
+  uint64_t total = 0;
+  for (unsigned long long t : ticks) {
+    total += t;
+  }
+  const uint64_t busy = total - ticks[3] - ticks[4];
+  if (total_ticks_ != 0 && total > total_ticks_) {
+    percent_ = static_cast<uint32_t>(100 * (busy - busy_ticks_) /
+                                     (total - total_ticks_));
+  }
+  busy_ticks_ = busy;
+  total_ticks_ = total;
+  return percent_;
+}
+
+uint64_t ThreadCpuMicros() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
 static size_t GetPageSize() {
 #if defined(OS_LINUX) || defined(_SC_PAGESIZE)
   long v = sysconf(_SC_PAGESIZE);
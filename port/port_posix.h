@@ -56,6 +56,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <limits>
+#include <mutex>
 #include <string>
 
 #ifndef PLATFORM_IS_LITTLE_ENDIAN
@@ -95,6 +96,8 @@
 //#define PROCESSANALYSIS
 //#define BYTEADDRESSABLE
 #define NEARDATACOMPACTION
+// Keep an 8 byte user key prefix in every memtable skiplist node.
+#define INLINEKEYPREFIX
 //#define GETANALYSIS
 #define ROCKSDB_PTHREAD_ADAPTIVE_MUTEX
 #define R_SIZE 1024
@@ -295,6 +298,29 @@ extern void Crash(const std::string& srcfile, int srcline);
 
 extern int GetMaxOpenFiles();
 
+// The share of the time the processors of the machine were busy, in percent,
+// between the last two reads of /proc/stat, taken at least 100ms apart.
+class CpuLoad {
+ public:
+  CpuLoad() = default;
+  CpuLoad(const CpuLoad&) = delete;
+  void operator=(const CpuLoad&) = delete;
+
+  // 0 until two reads were taken, or where there is no /proc/stat.
+  uint32_t BusyPercent();
+
+ private:
+  std::mutex mu_;
+  uint64_t read_micros_ = 0;
+  uint64_t busy_ticks_ = 0;
+  uint64_t total_ticks_ = 0;
+  uint32_t percent_ = 0;
+};
+
+// The processor time the calling thread has used since it started, 0 where
+// the clock is missing.
+extern uint64_t ThreadCpuMicros();
+
 extern const size_t kPageSize;
 
 using ThreadId = pid_t;
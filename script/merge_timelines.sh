@@ -0,0 +1,20 @@
+#!/bin/bash
+# Merges the timelines of the nodes into one Chrome trace, to be opened in
+# chrome://tracing or ui.perfetto.dev:
+#
+#   script/merge_timelines.sh OUTPUT TIMELINE...
+#
+# A timeline is the --timeline_output of db_bench on a compute node, or the
+# GET /timeline of the statistics port of a Server started with
+# DLSM_TIMELINE set. Every node is a process of the trace, and a compaction
+# is a flow from its dispatch on the compute node to the install of its
+# result, through the memory node which ran it.
+set -eu
+
+if [ $# -lt 2 ]; then
+  echo "usage: $0 OUTPUT TIMELINE..." >&2
+  exit 1
+fi
+out="$1"
+shift
+jq -s '{traceEvents: [.[].traceEvents[]], displayTimeUnit: "ms"}' "$@" > "$out"
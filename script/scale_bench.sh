@@ -0,0 +1,146 @@
+#!/bin/bash
+# Sweeps the memory node, compute node, shard and thread counts of a
+# topology, see script/topology.example, and collects the results of every
+# run into one report:
+#
+#   script/scale_bench.sh TOPOLOGY [OUTPUT_DIR]
+#
+# For every combination it writes connection.conf on the nodes, starts a
+# Server on each memory node and db_bench on each compute node, and keeps
+# under OUTPUT_DIR/m<M>_c<C>_s<S>_t<T>/:
+#   compute_<i>.log  the db_bench output, with its dLSM.stats and dLSM.rdma
+#   memory_<i>.log   the Server output
+#   memory_<i>.prom  the Prometheus statistics of the Server after the run
+#   nic.txt          the bytes every node sent and received over InfiniBand
+# OUTPUT_DIR/report.csv has a line per run and benchmark: the throughput of
+# all the compute nodes together, their mean latency, the worst of their
+# percentiles, the InfiniBand traffic and the compactions of the memory
+# nodes.
+set -u
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 TOPOLOGY [OUTPUT_DIR]" >&2
+  exit 1
+fi
+source "$1"
+out_dir="${2:-scale_results_$(date +%Y%m%d_%H%M%S)}"
+mkdir -p "$out_dir"
+cp "$1" "$out_dir/topology"
+read -r -a memory_nodes <<< "$MEMORY_NODES"
+read -r -a compute_nodes <<< "$COMPUTE_NODES"
+ssh_cmd="ssh -o StrictHostKeyChecking=no -o BatchMode=yes"
+
+# The bytes a node sent and received over all its InfiniBand ports. The
+# counters count 4 byte words.
+function nic_bytes() {
+  $ssh_cmd "$1" 'tx=0; rx=0
+    for d in /sys/class/infiniband/*/ports/*/counters; do
+      [ -r "$d/port_xmit_data" ] || continue
+      tx=$((tx + $(cat $d/port_xmit_data) * 4))
+      rx=$((rx + $(cat $d/port_rcv_data) * 4))
+    done
+    echo $tx $rx'
+}
+
+function stop_servers() {
+  for node in "$@"; do
+    $ssh_cmd "$node" "pkill -x Server" < /dev/null
+  done
+}
+
+function run_once() {
+  local m=$1 c=$2 s=$3 t=$4
+  local dir="$out_dir/m${m}_c${c}_s${s}_t${t}"
+  mkdir -p "$dir"
+  local memory=("${memory_nodes[@]:0:$m}")
+  local compute=("${compute_nodes[@]:0:$c}")
+  local nodes=("${memory[@]}" "${compute[@]}")
+  echo "== $m memory nodes, $c compute nodes, $s shards per compute node, $t threads"
+
+  # The first line of connection.conf lists the compute nodes, the second
+  # the memory nodes.
+  local conf="${compute[*]}"$'\n'"${memory[*]}"
+  for node in "${nodes[@]}"; do
+    printf '%s\n' "$conf" | $ssh_cmd "$node" "cat > $DLSM_BUILD_DIR/../connection.conf"
+  done
+  declare -A nic_before
+  for node in "${nodes[@]}"; do
+    nic_before[$node]="$(nic_bytes "$node")"
+  done
+
+  local i=0
+  for node in "${memory[@]}"; do
+    $ssh_cmd "$node" "cd $DLSM_BUILD_DIR && $LAUNCHER ./Server $SERVER_PORT $SERVER_MEMORY_GB $i $SERVER_STATS_PORT" \
+        > "$dir/memory_$i.log" 2>&1 < /dev/null &
+    i=$((i + 1))
+  done
+  sleep "$SERVER_STARTUP_SECONDS"
+
+  local pids=()
+  i=0
+  for node in "${compute[@]}"; do
+    $ssh_cmd "$node" "cd $DLSM_BUILD_DIR && $LAUNCHER ./db_bench --benchmarks=$BENCHMARKS,stats,rdmastats --threads=$t --fixed_compute_shards_num=$s --compute_node_id=$i $DB_BENCH_FLAGS" \
+        > "$dir/compute_$i.log" 2>&1 < /dev/null &
+    pids+=($!)
+    i=$((i + 1))
+  done
+  wait "${pids[@]}"
+
+  i=0
+  for node in "${memory[@]}"; do
+    curl -s "http://$node:$SERVER_STATS_PORT/metrics" > "$dir/memory_$i.prom"
+    i=$((i + 1))
+  done
+  stop_servers "${memory[@]}"
+  wait
+
+  : > "$dir/nic.txt"
+  for node in "${nodes[@]}"; do
+    read -r tx0 rx0 <<< "${nic_before[$node]}"
+    read -r tx1 rx1 <<< "$(nic_bytes "$node")"
+    echo "$node $((${tx1:-0} - ${tx0:-0})) $((${rx1:-0} - ${rx0:-0}))" >> "$dir/nic.txt"
+  done
+
+  local nic_tx nic_rx compactions
+  nic_tx=$(awk '{ s += $2 } END { print s + 0 }' "$dir/nic.txt")
+  nic_rx=$(awk '{ s += $3 } END { print s + 0 }' "$dir/nic.txt")
+  compactions=$(cat "$dir"/memory_*.prom 2>/dev/null |
+      awk '$1 == "dlsm_compactions_total" { s += $2 } END { print s + 0 }')
+  # "name : X micros/op; Y ops/sec; ...", followed by the percentiles with
+  # --histogram=1.
+  awk -v prefix="$m,$c,$s,$t" -v nic="$nic_tx,$nic_rx" -v comp="$compactions" '
+    / micros\/op; / {
+      name = $1
+      if (!(name in ops)) { order[n++] = name }
+      ops[name] += $5; micros[name] += $3; nodes[name]++
+    }
+    /^P50: / {
+      if ($6 > p99[name]) { p99[name] = $6 }
+      if ($2 > p50[name]) { p50[name] = $2 }
+      if ($8 > p999[name]) { p999[name] = $8 }
+    }
+    END {
+      for (i = 0; i < n; i++) {
+        b = order[i]
+        printf "%s,%s,%d,%.3f,%.2f,%.2f,%.2f,%s,%s\n", prefix, b, ops[b],
+               micros[b] / nodes[b], p50[b], p99[b], p999[b], nic, comp
+      }
+    }' "$dir"/compute_*.log >> "$out_dir/report.csv"
+}
+
+echo "memory_nodes,compute_nodes,shards_per_compute,threads,benchmark,ops_per_sec,micros_per_op,p50_us,p99_us,p99.9_us,nic_tx_bytes,nic_rx_bytes,remote_compactions" \
+    > "$out_dir/report.csv"
+for m in $MEMORY_COUNTS; do
+  for c in $COMPUTE_COUNTS; do
+    if [ "$m" -gt "${#memory_nodes[@]}" ] || [ "$c" -gt "${#compute_nodes[@]}" ]; then
+      echo "skipping $m memory nodes and $c compute nodes, the topology is smaller" >&2
+      continue
+    fi
+    for s in $SHARDS_PER_COMPUTE; do
+      for t in $THREADS; do
+        run_once "$m" "$c" "$s" "$t"
+      done
+    done
+  done
+done
+echo "report in $out_dir/report.csv"
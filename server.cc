@@ -1,13 +1,20 @@
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <memory_node/memory_node_keeper.h>
+#include <thread>
 
 #include "util/rdma.h"
+#include "util/timeline.h"
 
 //namespace dLSM{
 int main(int argc,char* argv[])
 {
   dLSM::Memory_Node_Keeper* mn_keeper;
-  if (argc == 4){
+  // The port of the statistics of the node, see
+  // Memory_Node_Keeper::SetStatsPort().
+  uint32_t stats_port = 0;
+  if (argc == 4 || argc == 5){
     uint32_t tcp_port;
     int pr_size;
     int Memory_server_id;
@@ -27,12 +34,66 @@ int main(int argc,char* argv[])
     strValue3 >> Memory_server_id;
      mn_keeper = new dLSM::Memory_Node_Keeper(true, tcp_port, pr_size);
      dLSM::RDMA_Manager::node_id = 2* Memory_server_id;
+     if (argc == 5) {
+       std::stringstream strValue4;
+       strValue4 << argv[4];
+       strValue4 >> stats_port;
+     }
   }else{
     mn_keeper = new dLSM::Memory_Node_Keeper(true, 19843, 88);
     dLSM::RDMA_Manager::node_id = 0;
   }
 
-  mn_keeper->SetBackgroundThreads(12, dLSM::ThreadPoolType::CompactionThreadPool);
+  mn_keeper->SetStatsPort(stats_port);
+  // DLSM_KV_CHECKSUMS=1 keeps a checksum with every record the compactions
+  // write, as Options::kv_checksums does on the compute nodes.
+  if (const char* checksums = std::getenv("DLSM_KV_CHECKSUMS")) {
+    mn_keeper->SetKVChecksums(std::atoi(checksums) != 0);
+  }
+  // DLSM_TIMELINE=N records the last N background jobs, served as GET
+  // /timeline on the statistics port.
+  if (const char* timeline = std::getenv("DLSM_TIMELINE")) {
+    dLSM::Timeline::Start(std::strtoull(timeline, nullptr, 10));
+  }
+  // DLSM_TRACK_SLOTS=1 records who holds every slot of the local pools,
+  // served as GET /pools on the statistics port, and DLSM_RESIZE_POOLS=1
+  // grows and shrinks the pools with their use.
+  if (const char* track = std::getenv("DLSM_TRACK_SLOTS")) {
+    dLSM::Memory_Node_Keeper::rdma_mg->Set_Slot_Tracking(std::atoi(track) != 0);
+  }
+  if (const char* resize = std::getenv("DLSM_RESIZE_POOLS")) {
+    dLSM::Memory_Node_Keeper::rdma_mg->Set_Pool_Resizing(std::atoi(resize) != 0);
+  }
+  // As many compactions at a time as there are cores, see
+  // Memory_Node_Keeper::SetBackgroundThreads().
+  mn_keeper->SetBackgroundThreads(
+      static_cast<int>(std::max(1u, std::thread::hardware_concurrency())),
+      dLSM::ThreadPoolType::CompactionThreadPool);
+  // The SSTables are persisted through io_uring, or through pwrite where the
+  // kernel does not allow it. DLSM_PMEM_PATH=<dir of a DAX file system>
+  // keeps them in place in persistent memory instead.
+  const char* pmem = std::getenv("DLSM_PMEM_PATH");
+  mn_keeper->SetPersistence(pmem != nullptr && pmem[0] != '\0'
+                                ? dLSM::SSTablePersister::kPmem
+                                : dLSM::SSTablePersister::kIOUring,
+                            4);
+  // DLSM_COMPACTION_HAND_BACK=N sends a compaction which would wait behind
+  // more than N others back to its compute node, for a node whose
+  // processors can not keep up with the compactions.
+  if (const char* hand_back = std::getenv("DLSM_COMPACTION_HAND_BACK")) {
+    mn_keeper->SetCompactionHandBack(std::atoi(hand_back));
+  }
+  // The levels from Options::cold_level on are kept on the local disk.
+  mn_keeper->SetColdStorage("./db_cold", dLSM::SSTablePersister::kIOUring, 2);
+  // With many compute nodes they share the receive buffers and the threads
+  // polling them.
+  if (dLSM::Memory_Node_Keeper::rdma_mg->compute_nodes.size() >= 16) {
+    mn_keeper->SetSharedReceiveQueue(4);
+  }
+#ifdef WITHPERSISTENCE
+  // Serve the SSTables persisted before a restart.
+  mn_keeper->SetRecovery(true);
+#endif
   mn_keeper->Server_to_Client_Communication();
   delete mn_keeper;
 
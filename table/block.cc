@@ -59,7 +59,7 @@ Block::~Block() {
 //      printf("Block RDMA registered memory deallocated successfull\n");
       return;
     }
-    if (type_ == Block_On_Memory_Side){
+    if (type_ == Block_On_Memory_Side || type_ == IndexPartition){
       return;
     }
     DEBUG("Not found in the RDMA mem pool");
@@ -68,7 +68,9 @@ Block::~Block() {
 
 
 
-Iterator* Block::NewIterator(const Comparator* comparator) {
+Iterator* Block::NewIterator(const Comparator* comparator,
+                             const LearnedIndex* model,
+                             const HashIndex* hash) {
 //  if (size_ < sizeof(uint32_t)) {
 //    return NewErrorIterator(Status::Corruption("bad block contents"));
 //  }
@@ -77,8 +79,63 @@ Iterator* Block::NewIterator(const Comparator* comparator) {
   if (num_restarts == 0) {
     return NewEmptyIterator();
   } else {
-    return new Iter(comparator, data_, restart_offset_, num_restarts);
+    return new Iter(comparator, data_, restart_offset_, num_restarts, model,
+                    hash);
   }
 }
 
+bool Block::RestartKeys(std::vector<Slice>* keys) const {
+  const uint32_t num_restarts = NumRestarts();
+  keys->reserve(num_restarts);
+  for (uint32_t i = 0; i < num_restarts; i++) {
+    uint32_t offset =
+        DecodeFixed32(data_ + restart_offset_ + i * sizeof(uint32_t));
+    uint32_t shared, non_shared, value_length;
+    const char* key_ptr = DecodeEntry(data_ + offset, data_ + restart_offset_,
+                                      &shared, &non_shared, &value_length);
+    if (key_ptr == nullptr || shared != 0) {
+      return false;
+    }
+    keys->emplace_back(key_ptr, non_shared);
+  }
+  return true;
+}
+
+bool Block::OneEntryPerRestart() const {
+  const uint32_t num_restarts = NumRestarts();
+  for (uint32_t i = 0; i < num_restarts; i++) {
+    uint32_t offset =
+        DecodeFixed32(data_ + restart_offset_ + i * sizeof(uint32_t));
+    uint32_t next = i + 1 < num_restarts
+                        ? DecodeFixed32(data_ + restart_offset_ +
+                                        (i + 1) * sizeof(uint32_t))
+                        : restart_offset_;
+    uint32_t shared, non_shared, value_length;
+    const char* key_ptr = DecodeEntry(data_ + offset, data_ + restart_offset_,
+                                      &shared, &non_shared, &value_length);
+    if (key_ptr == nullptr ||
+        key_ptr + non_shared + value_length != data_ + next) {
+      return false;
+    }
+  }
+  return true;
+}
+
+LearnedIndex* Block::BuildLearnedIndex() const {
+  std::vector<Slice> restart_keys;
+  if (size_ == 0 || !RestartKeys(&restart_keys)) {
+    return nullptr;
+  }
+  return LearnedIndex::Build(restart_keys);
+}
+
+HashIndex* Block::BuildHashIndex() const {
+  std::vector<Slice> restart_keys;
+  if (size_ == 0 || !RestartKeys(&restart_keys) ||
+      !OneEntryPerRestart()) {
+    return nullptr;
+  }
+  return HashIndex::Build(restart_keys);
+}
+
 }  // namespace dLSM
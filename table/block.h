@@ -15,6 +15,8 @@
 #include "dLSM/iterator.h"
 
 #include "table/format.h"
+#include "table/hash_index.h"
+#include "table/learned_index.h"
 #include "util/coding.h"
 #include "util/logging.h"
 #include "util/rdma.h"
@@ -23,7 +25,9 @@ namespace dLSM {
 struct BlockContents;
 class Comparator;
 //class IterKey;
-enum BlockType {DataBlock, IndexBlock, FilterBlock, Block_On_Memory_Side};
+// IndexPartition blocks are owned by Options::table_meta_cache.
+enum BlockType {DataBlock, IndexBlock, FilterBlock, Block_On_Memory_Side,
+                IndexPartition};
 class Block {
  public:
   // Initialize the block with the specified contents.
@@ -35,12 +39,26 @@ class Block {
   ~Block();
 
   size_t size() const { return size_; }
-  Iterator* NewIterator(const Comparator* comparator);
+  // If model is not null, the iterator narrows its binary search with it.
+  // If hash is not null, a seek to a key the block holds goes straight to
+  // its entry. Both must stay live while the iterator is live.
+  Iterator* NewIterator(const Comparator* comparator,
+                        const LearnedIndex* model = nullptr,
+                        const HashIndex* hash = nullptr);
+  // Learned model of the restart points, see LearnedIndex::Build().
+  LearnedIndex* BuildLearnedIndex() const;
+  // Hash table of the user keys at the restart points, see HashIndex.
+  HashIndex* BuildHashIndex() const;
 
   class Iter;
 
  private:
   uint32_t NumRestarts() const;
+  // The keys at the restart points, false if one of them shares a prefix.
+  bool RestartKeys(std::vector<Slice>* keys) const;
+  // Whether every entry is a restart point, see
+  // Options::index_restart_interval.
+  bool OneEntryPerRestart() const;
 
   const char* data_;
   size_t size_;
@@ -83,13 +101,19 @@ static inline const char* DecodeEntry(const char* p, const char* limit,
 class Block::Iter : public Iterator {
  public:
   inline int Compare(const Slice& a, const Slice& b) const {
-    return comparator_->Compare(a, b);
+    return icmp_ != nullptr ? icmp_->Compare(a, b)
+                            : comparator_->Compare(a, b);
   }
  private:
   const Comparator* const comparator_;
+  // comparator_ if it is an InternalKeyComparator of the bytewise comparator,
+  // whose Compare() is inlined, else nullptr.
+  const InternalKeyComparator* const icmp_;
   const char* const data_;       // underlying block contents
   uint32_t const restarts_;      // Offset of restart array (list of fixed32), should be the end of content.
   uint32_t const num_restarts_;  // Number of uint32_t entries in restart array
+  const LearnedIndex* const model_;
+  const HashIndex* const hash_;
 
   // current_ is offset in data_ of current entry.  >= restarts_ if !Valid
   uint32_t current_;
@@ -135,11 +159,15 @@ class Block::Iter : public Iterator {
 
  public:
   Iter(const Comparator* comparator, const char* data, uint32_t restarts,
-       uint32_t num_restarts)
+       uint32_t num_restarts, const LearnedIndex* model = nullptr,
+       const HashIndex* hash = nullptr)
       : comparator_(comparator),
+        icmp_(InternalKeyComparator::BytewiseOf(comparator)),
         data_(data),
         restarts_(restarts),
         num_restarts_(num_restarts),
+        model_(model),
+        hash_(hash),
         current_(restarts_),
         restart_index_(num_restarts_){
     assert(num_restarts_ > 0);
@@ -204,6 +232,12 @@ class Block::Iter : public Iterator {
     uint32_t left = 0;
     uint32_t right = num_restarts_ - 1;
     int current_key_compare = 0;
+    if (hash_ != nullptr && HashSeek(target)) {
+      return;
+    }
+    if (model_ != nullptr) {
+      PredictRestarts(target, &left, &right);
+    }
 
     if (Valid()) {
       // If we're already scanning, use the current position as a starting
@@ -212,9 +246,9 @@ class Block::Iter : public Iterator {
       current_key_compare = Compare(key_.GetKey(), target);
       if (current_key_compare < 0) {
         // key_ is smaller than target
-        left = restart_index_;
+        left = std::max(left, restart_index_);
       } else if (current_key_compare > 0) {
-        right = restart_index_;
+        right = std::min(right, restart_index_);
       } else {
         // We're seeking to the key we're already at.
         return;
@@ -282,6 +316,57 @@ class Block::Iter : public Iterator {
   }
 
  private:
+  // Position at the first entry >= target if hash_ knows the user key of
+  // target. The entries of a user key follow the newest one, and the keys
+  // before it are smaller.
+  bool HashSeek(const Slice& target) {
+    uint32_t candidates[HashIndex::kMaxCandidates];
+    const size_t n = hash_->Lookup(ExtractUserKey(target), candidates);
+    if (n > HashIndex::kMaxCandidates) {
+      return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+      Slice key;
+      if (candidates[i] >= num_restarts_ || !RestartKey(candidates[i], &key) ||
+          ExtractUserKey(key) != ExtractUserKey(target)) {
+        continue;
+      }
+      SeekToRestartPoint(candidates[i]);
+      while (ParseNextKey() && Compare(key_.GetKey(), target) < 0) {
+      }
+      return true;
+    }
+    return false;
+  }
+  // Narrow [*left, *right] down to the window model_ predicts for target,
+  // if the window turns out to hold the last restart point before target.
+  void PredictRestarts(const Slice& target, uint32_t* left,
+                       uint32_t* right) {
+    uint32_t l, r;
+    model_->Predict(target, &l, &r);
+    Slice key;
+    if (l > 0 && (!RestartKey(l, &key) || Compare(key, target) >= 0)) {
+      return;
+    }
+    if (r + 1 < num_restarts_ &&
+        (!RestartKey(r + 1, &key) || Compare(key, target) < 0)) {
+      return;
+    }
+    *left = l;
+    *right = r;
+  }
+  bool RestartKey(uint32_t index, Slice* key) {
+    uint32_t shared, non_shared, value_length;
+    const char* key_ptr =
+        DecodeEntry(data_ + GetRestartPoint(index), data_ + restarts_,
+                    &shared, &non_shared, &value_length);
+    if (key_ptr == nullptr || shared != 0) {
+      return false;
+    }
+    *key = Slice(key_ptr, non_shared);
+    return true;
+  }
+
   void CorruptionError() {
     assert(false);
     current_ = restarts_;
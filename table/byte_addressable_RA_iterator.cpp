@@ -3,15 +3,24 @@
 //
 
 #include "byte_addressable_RA_iterator.h"
+
+#include <algorithm>
+
 #include "dLSM/env.h"
 #include "table_memoryside.h"
 namespace dLSM {
+// The bytes read before the cursor by a backward step.
+static const size_t kBackwardReadahead = 128 * 1024;
+// The most bytes read after the cursor by a forward step.
+static const size_t kForwardReadahead = 128 * 1024;
 ByteAddressableRAIterator::ByteAddressableRAIterator(Iterator* index_iter,
                                                      KVFunction block_function,
                                                      void* arg,
                                                      const ReadOptions& options,
-                                                     bool compute_side)
+                                                     bool compute_side,
+                                                     const Comparator* comparator)
     : compute_side_(compute_side),
+      comparator_(comparator),
       mr_addr(nullptr),
       kv_function_(block_function),
       arg_(arg),
@@ -32,15 +41,32 @@ ByteAddressableRAIterator::~ByteAddressableRAIterator() {
   if (mr_addr != nullptr){
     auto rdma_mg = Env::Default()->rdma_mg;
     rdma_mg->Deallocate_Local_RDMA_Slot(mr_addr, DataChunk);
+  }
+  if (backward_.mr.addr != nullptr) {
+    Env::Default()->rdma_mg->Release_Iterator_Buffer(backward_.mr);
+  }
+  if (forward_.mr.addr != nullptr) {
+    Env::Default()->rdma_mg->Release_Iterator_Buffer(forward_.mr);
   }
     //  DEBUG_arg("TWOLevelIterator destructing, this pointer is %p\n", this);
 };
 //Note: if the iterator can not seek the same target, it will stop at the key right before or
 // right after the data, we need to make it right before
 void ByteAddressableRAIterator::Seek(const Slice& target) {
+  forward_records_ = 0;
   index_iter_.Seek(target);
   GetKV();
-  assert(valid_);
+  // The group ends at or before the key of its index entry, which is not
+  // before target.
+  while (valid_ && record_ + 1 < record_offsets_.size() &&
+         comparator_->Compare(key_.GetKey(), target) < 0) {
+    SetRecord(record_ + 1);
+  }
+  if (valid_ && comparator_->Compare(key_.GetKey(), target) < 0) {
+    // target lies between the group and its separator, see
+    // Options::index_key_separators, the next group starts after it.
+    Next();
+  }
 //  if ()
 //  //Todo: delete the things below.
 //  for (int i = 0; i < target.size(); ++i) {
@@ -51,6 +77,7 @@ void ByteAddressableRAIterator::Seek(const Slice& target) {
 }
 
 void ByteAddressableRAIterator::SeekToFirst() {
+  forward_records_ = 0;
   index_iter_.SeekToFirst();
   GetKV();
 //  if (data_iter_.iter() != nullptr) {
@@ -64,8 +91,20 @@ void ByteAddressableRAIterator::SeekToFirst() {
 }
 
 void ByteAddressableRAIterator::SeekToLast() {
+  forward_records_ = 0;
   index_iter_.SeekToLast();
+  if (compute_side_ && index_iter_.Valid()) {
+    Slice handle_content = index_iter_.value();
+    BlockHandle handle;
+    DecodeIndexHandle(&handle_content, &handle);
+    if (!backward_.Holds(handle)) {
+      Read_backward(handle);
+    }
+  }
   GetKV();
+  if (valid_) {
+    SetRecord(record_offsets_.size() - 1);
+  }
 //  if (data_iter_.iter() != nullptr){
 //    data_iter_.SeekToLast();
 //    valid_ = true;
@@ -74,15 +113,110 @@ void ByteAddressableRAIterator::SeekToLast() {
 }
 
 void ByteAddressableRAIterator::Next() {
+  assert(Valid());
+  if (record_ + 1 < record_offsets_.size()) {
+    SetRecord(record_ + 1);
+    return;
+  }
   index_iter_.Next();
+  Prepare_forward();
   GetKV();
 
 }
 
+void ByteAddressableRAIterator::Prepare_forward() {
+  if (!compute_side_ || !index_iter_.Valid()) {
+    return;
+  }
+  Slice handle_content = index_iter_.value();
+  BlockHandle handle;
+  DecodeIndexHandle(&handle_content, &handle);
+  if (forward_.Holds(handle) || backward_.Holds(handle)) {
+    return;
+  }
+  // Twice as many records every time the scan runs out of the cursor.
+  forward_records_ = std::max<size_t>(2, forward_records_ * 2);
+  Read_forward(handle);
+}
+
 void ByteAddressableRAIterator::Prev() {
   assert(Valid());
+  if (record_ > 0) {
+    SetRecord(record_ - 1);
+    return;
+  }
   index_iter_.Prev();
+  if (compute_side_ && index_iter_.Valid()) {
+    Slice handle_content = index_iter_.value();
+    BlockHandle handle;
+    DecodeIndexHandle(&handle_content, &handle);
+    if (!backward_.Holds(handle)) {
+      Read_backward(handle);
+    }
+  }
   GetKV();
+  if (valid_) {
+    SetRecord(record_offsets_.size() - 1);
+  }
+}
+
+void ByteAddressableRAIterator::Read_backward(const BlockHandle& handle) {
+  if (backward_.mr.addr == nullptr) {
+    Env::Default()->rdma_mg->Allocate_Iterator_Buffer(backward_.mr);
+  }
+  const size_t end = handle.offset() + handle.size();
+  const size_t readahead = std::min(kBackwardReadahead, backward_.mr.length);
+  Read_cursor(handle, end > readahead ? end - readahead : 0, end, &backward_);
+}
+
+void ByteAddressableRAIterator::Read_forward(const BlockHandle& handle) {
+  if (forward_.mr.addr == nullptr) {
+    Env::Default()->rdma_mg->Allocate_Iterator_Buffer(forward_.mr);
+  }
+  const size_t readahead =
+      std::min({forward_records_ * handle.size(), kForwardReadahead,
+                forward_.mr.length});
+  if (readahead < handle.size()) {
+    // Read record by record then.
+    forward_.size = 0;
+    return;
+  }
+  Read_cursor(handle, handle.offset(), handle.offset() + readahead, &forward_);
+}
+
+void ByteAddressableRAIterator::Read_cursor(const BlockHandle& handle,
+                                            size_t start, size_t end,
+                                            Cursor* cursor) {
+  auto rdma_mg = Env::Default()->rdma_mg;
+  cursor->size = 0;
+  Table* table = reinterpret_cast<Table*>(arg_);
+  auto tablemeta = table->rep->remote_table.lock();
+  if (tablemeta->cold_file_id != 0) {
+    // The data chunks lie one after the other at the start of the file.
+    end = std::min<size_t>(end, tablemeta->file_size);
+    if (!rdma_mg->Remote_Cold_Read(tablemeta->cold_file_id, start, end - start,
+                                   &cursor->mr,
+                                   tablemeta->shard_target_node_id)) {
+      // Read record by record then.
+      return;
+    }
+  } else {
+    // A record does not cross the chunks, nor does the read.
+    auto chunk = tablemeta->remote_data_mrs.upper_bound(handle.offset());
+    assert(chunk != tablemeta->remote_data_mrs.end());
+    const size_t chunk_start = chunk->first - chunk->second->length;
+    start = std::max(start, chunk_start);
+    end = std::min<size_t>(end, chunk->first);
+    ibv_mr remote_mr = *chunk->second;
+    remote_mr.addr = static_cast<char*>(remote_mr.addr) + (start - chunk_start);
+    if (rdma_mg->RDMA_Read(&remote_mr, &cursor->mr, end - start,
+                           QP_READ_LOCAL, IBV_SEND_SIGNALED, 1,
+                           tablemeta->shard_target_node_id) != 0) {
+      return;
+    }
+  }
+  cursor->offset = start;
+  cursor->size = end - start;
 }
 
 
@@ -98,53 +232,73 @@ void ByteAddressableRAIterator::GetKV() {
     Slice handle = index_iter_.value();
 #ifndef NDEBUG
     Slice test_handle = handle;
-    index_handle.DecodeFrom(&test_handle);
+    DecodeIndexHandle(&test_handle, &index_handle);
 //    printf("Iterator pointer is %p, Offset is %lu, this data block size is %lu\n", this, bhandle.offset(), bhandle.size());
 #endif
     if (handle.compare(data_block_handle_) == 0) {
-      // data_iter_ is already constructed with this iterator, so
-      // no need to change anything
+      // The group is already read and parsed, so no need to change anything
+      // but the record.
     } else {
+      Slice KV;
       if (compute_side_){
-        //TODO: just reuse the RDMA registered buffer every time, no need to
-        // allocate and deallocate again. we abandon the function pointer design,
-        // directly call the static function instead.
-        if (mr_addr != nullptr){
-          auto rdma_mg = Env::Default()->rdma_mg;
-          rdma_mg->Deallocate_Local_RDMA_Slot(mr_addr, DataChunk);
+        Slice bhandle_content = handle;
+        BlockHandle bhandle;
+        DecodeIndexHandle(&bhandle_content, &bhandle);
+        const Cursor* cursor = forward_.Holds(bhandle)    ? &forward_
+                               : backward_.Holds(bhandle) ? &backward_
+                                                          : nullptr;
+        if (cursor != nullptr) {
+          KV = Slice(static_cast<char*>(cursor->mr.addr) +
+                         (bhandle.offset() - cursor->offset),
+                     bhandle.size());
+        } else {
+          //TODO: just reuse the RDMA registered buffer every time, no need to
+          // allocate and deallocate again. we abandon the function pointer design,
+          // directly call the static function instead.
+          if (mr_addr != nullptr){
+            auto rdma_mg = Env::Default()->rdma_mg;
+            rdma_mg->Deallocate_Local_RDMA_Slot(mr_addr, DataChunk);
+          }
+          KV = (*kv_function_)(arg_, options_, handle);
+          mr_addr = const_cast<char*>(KV.data());
         }
-        Slice KV = (*kv_function_)(arg_, options_, handle);
-        mr_addr = const_cast<char*>(KV.data());
-        uint32_t key_size, value_size;
-        GetFixed32(&KV, &key_size);
-        GetFixed32(&KV, &value_size);
-        assert(key_size + value_size == KV.size());
-
-
-        key_.SetKey(Slice(KV.data(), key_size), false /* copy */);
-        KV.remove_prefix(key_size);
-        assert(KV.size() == value_size);
-        value_ = KV;
-        data_block_handle_.assign(handle.data(), handle.size());
       }else{
-        Slice KV = (*kv_function_)(arg_, options_, handle);
-        uint32_t key_size, value_size;
-        GetFixed32(&KV, &key_size);
-        GetFixed32(&KV, &value_size);
-
-        assert(key_size + value_size == KV.size());
-
-//        printf("!key is %p, KV.data is %p, the 7 bit is %s \n",
-//               key_.GetKey().data(), KV.data(), KV.data()+7);
-
-        key_.SetKey(Slice(KV.data(), key_size), false /* copy */);
-        KV.remove_prefix(key_size);
-        assert(KV.size() == value_size);
-        value_ = KV;
-        data_block_handle_.assign(handle.data(), handle.size());
+        KV = (*kv_function_)(arg_, options_, handle);
+      }
+      // The records of the group, one unless the index is sparse.
+      group_ = KV;
+      record_offsets_.clear();
+      Slice input = KV;
+      Slice key, value;
+      while (!input.empty()) {
+        record_offsets_.push_back(
+            static_cast<uint32_t>(input.data() - group_.data()));
+        if (!GetKVRecord(&input, &key, &value, nullptr,
+                         options_.verify_checksums)) {
+          record_offsets_.pop_back();
+          SaveError(Status::Corruption("bad KV record"));
+          break;
+        }
+      }
+      data_block_handle_.assign(handle.data(), handle.size());
+      if (record_offsets_.empty()) {
+        valid_ = false;
+        return;
       }
-
     }
+    SetRecord(0);
   }
 }
-}
\ No newline at end of file
+
+void ByteAddressableRAIterator::SetRecord(size_t record) {
+  assert(record < record_offsets_.size());
+  record_ = record;
+  Slice input(group_.data() + record_offsets_[record],
+              group_.size() - record_offsets_[record]);
+  Slice key;
+  if (!GetKVRecord(&input, &key, &value_, &value_buf_)) {
+    SaveError(Status::Corruption("bad compressed value"));
+  }
+  key_.SetKey(key, false /* copy */);
+}
+}
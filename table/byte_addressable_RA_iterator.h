@@ -5,6 +5,8 @@
 #ifndef dLSM_BYTE_ADDRESSABLE_RA_ITERATOR_H
 #define dLSM_BYTE_ADDRESSABLE_RA_ITERATOR_H
 
+#include <vector>
+
 #include "dLSM/iterator.h"
 #include "iterator_wrapper.h"
 #include "dLSM/options.h"
@@ -14,6 +16,7 @@
 #include "table/block.h"
 #include "table/format.h"
 #include "table/iterator_wrapper.h"
+#include "util/rdma.h"
 //#include "two_level_iterator.h"
 namespace dLSM {
 typedef Slice (*KVFunction)(void*, const ReadOptions&, const Slice&);
@@ -22,7 +25,7 @@ class ByteAddressableRAIterator :public Iterator{
    public:
     ByteAddressableRAIterator(Iterator* index_iter, KVFunction block_function,
                               void* arg, const ReadOptions& options,
-                              bool compute_side);
+                              bool compute_side, const Comparator* comparator);
 
     ~ByteAddressableRAIterator() override;
 
@@ -51,9 +54,47 @@ class ByteAddressableRAIterator :public Iterator{
     }
 //    void SkipEmptyDataBlocksForward();
 //    void SkipEmptyDataBlocksBackward();
+    // Read and parse the group of records of the index entry and move to
+    // its first record.
     void GetKV();
+    // Move to the record-th record of the group.
+    void SetRecord(size_t record);
+    // The bytes [offset, offset + size) of the table read at once.
+    struct Cursor {
+      ibv_mr mr = {};
+      size_t offset = 0;
+      size_t size = 0;
+      // Whether the record of "handle" is in the cursor.
+      bool Holds(const BlockHandle& handle) const {
+        return size != 0 && handle.offset() >= offset &&
+               handle.offset() + handle.size() <= offset + size;
+      }
+    };
+    // Read the bytes of the table up to the end of the record of "handle",
+    // at most kBackwardReadahead of them, into the backward cursor.
+    void Read_backward(const BlockHandle& handle);
+    // Read the bytes of the table from the start of the record of "handle",
+    // as many as forward_records_ records of its size, into the forward
+    // cursor.
+    void Read_forward(const BlockHandle& handle);
+    // Read the bytes [start, end) of the table into "cursor", fewer if they
+    // cross the end of the data chunk holding the record of "handle".
+    void Read_cursor(const BlockHandle& handle, size_t start, size_t end,
+                     Cursor* cursor);
+    // Read ahead from the record the index is at, unless a cursor holds
+    // it already.
+    void Prepare_forward();
     bool compute_side_;
+    const Comparator* const comparator_;
     char* mr_addr;
+    // The records before the cursor read at once when it moves backward.
+    // Prev() gets them without a read each.
+    Cursor backward_;
+    // The records after the cursor read at once when it moves forward,
+    // Next() gets them without a read each. The span grows as the scan goes
+    // on, forward_records_ records, and starts over at every seek.
+    Cursor forward_;
+    size_t forward_records_ = 0;
     KVFunction kv_function_;
     void* arg_;
     const ReadOptions options_;
@@ -64,6 +105,13 @@ class ByteAddressableRAIterator :public Iterator{
     // If data_iter_ is non-null, then "data_block_handle_" holds the
     // "index_value" passed to block_function_ to create the data_iter_.
     std::string data_block_handle_;
+    // The records of that entry and the offsets of them in it, see
+    // Options::index_interval, and the one the iterator is at.
+    Slice group_;
+    std::vector<uint32_t> record_offsets_;
+    size_t record_ = 0;
+    // The value of the record if it is compressed, uncompressed.
+    std::string value_buf_;
 #ifndef NDEBUG
     BlockHandle index_handle;
     std::string last_key;
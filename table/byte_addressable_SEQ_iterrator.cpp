@@ -5,6 +5,11 @@
 // would be error
 #define PREFETCH_GRANULARITY  (1024*1024)
 #include "byte_addressable_SEQ_iterrator.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
 #include "dLSM/env.h"
 #include "port/likely.h"
 namespace dLSM {
@@ -13,6 +18,7 @@ ByteAddressableSEQIterator::ByteAddressableSEQIterator(
     Iterator* index_iter, void* arg, const ReadOptions& options,
     bool compute_side)
     : compute_side_(compute_side),
+      max_depth_(std::max(options.max_readahead_windows, 1)),
 //      mr_addr(nullptr),
 //      kv_function_(kv_function),
       arg_(arg),
@@ -20,8 +26,59 @@ ByteAddressableSEQIterator::ByteAddressableSEQIterator(
       status_(Status::OK()),
       index_iter_(index_iter),
       valid_(false) {
-    prefetched_mr = new ibv_mr{};
-    Env::Default()->rdma_mg->Allocate_Local_RDMA_Slot(*prefetched_mr, FlushBuffer);
+    auto rdma_mg = Env::Default()->rdma_mg;
+    for (Prefetch_Buffer& buffer : buffers_) {
+      rdma_mg->Allocate_Iterator_Buffer(buffer.local);
+    }
+    Table* table = reinterpret_cast<Table*>(arg_);
+    comparator_ = table->rep->options.comparator;
+    sparse_index_ = table->rep->sparse_index;
+    auto tablemeta = table->rep->remote_table.lock();
+    target_node_id_ = tablemeta->shard_target_node_id;
+    // The records are in key order in the table, the ones out of the bounds
+    // lie before lower_offset_ and from upper_offset_ on.
+    if (options.iterate_lower_bound != nullptr) {
+      InternalKey bound(*options.iterate_lower_bound, kMaxSequenceNumber,
+                        kValueTypeForSeek);
+      lower_offset_ = Record_offset(bound.Encode(), false);
+    }
+    if (options.iterate_upper_bound != nullptr) {
+      InternalKey bound(*options.iterate_upper_bound, kMaxSequenceNumber,
+                        kValueTypeForSeek);
+      // The records of the group before the bound are read as well.
+      upper_offset_ = Record_offset(bound.Encode(), sparse_index_);
+    }
+}
+size_t ByteAddressableSEQIterator::Record_offset(const Slice& target,
+                                                 bool end) {
+  index_iter_.Seek(target);
+  if (!index_iter_.Valid()) {
+    return std::numeric_limits<size_t>::max();
+  }
+  Slice handle_content = index_iter_.value();
+  BlockHandle handle;
+  DecodeIndexHandle(&handle_content, &handle);
+  return end ? handle.offset() + handle.size() : handle.offset();
+}
+bool ByteAddressableSEQIterator::Clamp_to_bounds(Prefetch_Buffer* buffer) {
+  if (reverse_) {
+    if (buffer->offset < lower_offset_) {
+      const size_t cut = lower_offset_ - buffer->offset;
+      if (cut >= buffer->remote.length) {
+        return false;
+      }
+      buffer->offset += cut;
+      buffer->remote.addr = (char*)buffer->remote.addr + cut;
+      buffer->remote.length -= cut;
+    }
+  } else {
+    if (buffer->offset >= upper_offset_) {
+      return false;
+    }
+    buffer->remote.length =
+        std::min<size_t>(buffer->remote.length, upper_offset_ - buffer->offset);
+  }
+  return true;
 }
 
 ByteAddressableSEQIterator::~ByteAddressableSEQIterator() {
@@ -30,20 +87,30 @@ ByteAddressableSEQIterator::~ByteAddressableSEQIterator() {
 //    ibv_wc* wc = new ibv_wc[poll_number];
 //    rdma_mg->poll_completion(wc, poll_number, "read_local", true);
 //  }
-  rdma_mg->Deallocate_Local_RDMA_Slot(prefetched_mr->addr, FlushBuffer);
-  delete prefetched_mr;
+  // The reads in flight land in the buffers.
+  windows_.clear();
+  for (Prefetch_Buffer& buffer : buffers_) {
+    rdma_mg->Release_Iterator_Buffer(buffer.local);
+  }
 
 
   //  DEBUG_arg("TWOLevelIterator destructing, this pointer is %p\n", this);
 };
 
 void ByteAddressableSEQIterator::Seek(const Slice& target) {
+  Set_direction(false);
   index_iter_.Seek(target);
   GetKVInitial();
-
+  // The group ends at or before the key of its index entry, which is not
+  // before target.
+  while (sparse_index_ && valid_ &&
+         comparator_->Compare(key_.GetKey(), target) < 0) {
+    GetNextKV();
+  }
 }
 
 void ByteAddressableSEQIterator::SeekToFirst() {
+  Set_direction(false);
   index_iter_.SeekToFirst();
   GetKVInitial();
 
@@ -51,30 +118,173 @@ void ByteAddressableSEQIterator::SeekToFirst() {
 }
 
 void ByteAddressableSEQIterator::SeekToLast() {
-  valid_ = false;
-  status_ = Status::NotSupported("SeekToLast");
+  Set_direction(true);
+  index_iter_.SeekToLast();
+  GetKVBackward();
 }
 
 void ByteAddressableSEQIterator::Next() {
+  assert(Valid());
+  if (reverse_) {
+    // Go on forward from the record after the cursor.
+    if (record_ + 1 < record_offsets_.size()) {
+      const size_t offset = group_offset_ + record_offsets_[record_ + 1];
+      Set_direction(false);
+      GetKVAt(offset);
+      return;
+    }
+    Set_direction(false);
+    index_iter_.Next();
+    GetKVInitial();
+    return;
+  }
   GetNextKV();
 
 }
 
 void ByteAddressableSEQIterator::Prev() {
-  assert(false);
-  valid_ = false;
-  status_ = Status::NotSupported("Prev not supported");
+  assert(Valid());
+  if (!reverse_) {
+    // Forward the index is only read by the seeks, find the cursor in it.
+    index_iter_.Seek(key());
+    assert(index_iter_.Valid());
+    if (sparse_index_) {
+      // The records of its group before it come first.
+      std::string current = key().ToString();
+      Set_direction(true);
+      Slice before(current);
+      GetKVBackward(&before);
+      if (valid_ || !status_.ok()) {
+        return;
+      }
+    }
+    Set_direction(true);
+  } else if (record_ > 0) {
+    SetRecord(record_ - 1);
+    return;
+  }
+  index_iter_.Prev();
+  GetKVBackward();
+}
+void ByteAddressableSEQIterator::Set_direction(bool reverse) {
+  if (reverse_ != reverse) {
+    Drop_windows();
+    iter_ptr = nullptr;
+    reverse_ = reverse;
+  }
+}
+void ByteAddressableSEQIterator::GetKVBackward(const Slice* before) {
+  if (!index_iter_.Valid()) {
+    valid_ = false;
+    return;
+  }
+  Slice handle_content = index_iter_.value();
+  BlockHandle handle;
+  DecodeIndexHandle(&handle_content, &handle);
+  const size_t offset = handle.offset();
+  const size_t end = offset + handle.size();
+  if (offset < lower_offset_) {
+    valid_ = false;
+    return;
+  }
+  auto in_buffer = [offset, end](const Prefetch_Buffer& buffer) {
+    return buffer.remote.length != 0 && offset >= buffer.offset &&
+           end <= buffer.offset + buffer.remote.length;
+  };
+  if (!in_buffer(buffers_[cur_buffer_])) {
+    Prefetch_Buffer& prev = buffers_[1 - cur_buffer_];
+    if (in_buffer(prev) &&
+        (windows_.empty() || windows_.front().buffer != cur_buffer_)) {
+      // The previous chunk was read ahead.
+      buffers_[cur_buffer_].remote.length = 0;
+      cur_buffer_ = 1 - cur_buffer_;
+    } else {
+      Drop_windows();
+      Table* table = reinterpret_cast<Table*>(arg_);
+      auto tablemeta = table->rep->remote_table.lock();
+      auto chunk = tablemeta->remote_data_mrs.upper_bound(offset);
+      if (chunk == tablemeta->remote_data_mrs.end()) {
+        valid_ = false;
+        SaveError(Status::Corruption("entry out of the data chunks"));
+        return;
+      }
+      Prefetch_Buffer& cur = buffers_[cur_buffer_];
+      cur.offset = chunk->first - chunk->second->length;
+      cur.remote = *chunk->second;
+      cur.remote.length = end - cur.offset;
+      cur.posted = 0;
+      cur.arrived = 0;
+      assert(cur.remote.length <= cur.local.length);
+      Clamp_to_bounds(&cur);
+    }
+  }
+  Prefetch_Buffer& cur = buffers_[cur_buffer_];
+  const size_t position = offset - cur.offset;
+  Fill_windows();
+  while (position < cur.remote.length - cur.arrived && !windows_.empty()) {
+    Wait_window();
+  }
+  if (position < cur.remote.length - cur.arrived || !status_.ok()) {
+    valid_ = false;
+    return;
+  }
+  group_data_ = (char*)cur.local.addr + position;
+  group_offset_ = offset;
+  record_offsets_.clear();
+  Slice input(group_data_, handle.size());
+  Slice key, value;
+  while (!input.empty()) {
+    const uint32_t record_offset =
+        static_cast<uint32_t>(input.data() - group_data_);
+    if (!GetKVRecord(&input, &key, &value, nullptr,
+                     options_.verify_checksums)) {
+      SaveError(Status::Corruption("bad KV record"));
+      break;
+    }
+    if (before != nullptr && comparator_->Compare(key, *before) >= 0) {
+      break;
+    }
+    record_offsets_.push_back(record_offset);
+  }
+  if (record_offsets_.empty()) {
+    valid_ = false;
+    return;
+  }
+  SetRecord(record_offsets_.size() - 1);
+  valid_ = true;
+}
+void ByteAddressableSEQIterator::SetRecord(size_t record) {
+  assert(record < record_offsets_.size());
+  record_ = record;
+  Slice input(group_data_ + record_offsets_[record],
+              std::numeric_limits<uint32_t>::max());
+  Slice key;
+  if (!GetKVRecord(&input, &key, &value_, &value_buf_)) {
+    SaveError(Status::Corruption("bad compressed value"));
+  }
+  key_.SetKey(key, false /* copy */);
 }
 void ByteAddressableSEQIterator::GetKVInitial(){
   if(index_iter_.Valid()){
     Slice handle_content = index_iter_.value();
     BlockHandle handle;
-    handle.DecodeFrom(&handle_content);
-    iter_offset = handle.offset();
+    DecodeIndexHandle(&handle_content, &handle);
+    GetKVAt(handle.offset());
+  }else{
+    valid_ = false;
+  }
+}
+void ByteAddressableSEQIterator::GetKVAt(size_t offset){
+  record_offsets_.clear();
+  {
+    iter_offset = offset;
 
     valid_ = Fetch_next_buffer_initial(iter_offset);
     DEBUG_arg("Move to the next chunk, iter_ptr now is %p\n", iter_ptr);
-    assert(valid_);
+    if (!valid_) {
+      // Past iterate_upper_bound.
+      return;
+    }
     auto rdma_mg = Env::Default()->rdma_mg;
     // Only support forward iterator for sequential access iterator.
     uint32_t key_size, value_size;
@@ -91,13 +301,21 @@ void ByteAddressableSEQIterator::GetKVInitial(){
 //      poll_number--;
 //      assert(poll_number >= 0);
     }
+    // A record is at least 8 bytes, whatever its header.
     Slice Size_buff = Slice(iter_ptr, 8);
-    GetFixed32(&Size_buff, &key_size);
-    GetFixed32(&Size_buff, &value_size);
-    iter_ptr += 8;
-    iter_offset += 8;
+    bool compressed, checksummed;
+    GetKVRecordHeader(&Size_buff, &key_size, &value_size, &compressed,
+                      &checksummed);
+    const size_t header_size = 8 - Size_buff.size();
+    const size_t trailer_size = checksummed ? kKVRecordChecksumSize : 0;
+    // Kept for the checksum, the fetch below may move iter_ptr.
+    char header[8];
+    memcpy(header, iter_ptr, header_size);
+    iter_ptr += header_size;
+    iter_offset += header_size;
 //    //Check whether the
-    if (UNLIKELY(iter_offset + key_size + value_size > cur_prefetch_status)){
+    if (UNLIKELY(iter_offset + key_size + value_size + trailer_size >
+                 cur_prefetch_status)){
 
       if(!Fetch_next_buffer_middle()){
         assert(iter_offset == cur_prefetch_status);
@@ -114,20 +332,30 @@ void ByteAddressableSEQIterator::GetKVInitial(){
     iter_ptr += key_size;
     iter_offset += key_size;
     value_ = Slice(iter_ptr, value_size);
-    iter_ptr += value_size;
-    iter_offset += value_size;
+    if (checksummed && options_.verify_checksums &&
+        !VerifyKVRecordChecksum(
+            Slice(header, header_size),
+            Slice(iter_ptr - key_size, key_size + value_size),
+            iter_ptr + value_size)) {
+      SaveError(Status::Corruption("KV record checksum mismatch"));
+    }
+    if (compressed && !UncompressKVValue(&value_, &value_buf_)) {
+      SaveError(Status::Corruption("bad compressed value"));
+    }
+    iter_ptr += value_size + trailer_size;
+    iter_offset += value_size + trailer_size;
 //    iter_offset += key_size + value_size + 2*sizeof(uint32_t);
-    assert(iter_ptr - (char*)prefetched_mr->addr <= prefetched_mr->length);
-  }else{
-    valid_ = false;
+    assert(iter_ptr - (char*)buffers_[cur_buffer_].local.addr <=
+           buffers_[cur_buffer_].remote.length);
+    assert(key().size()>0);
   }
-  assert(key().size()>0);
 }
 
 
 void ByteAddressableSEQIterator::GetNextKV() {
-  assert(iter_ptr <= remote_mr_current.length + (char*)prefetched_mr->addr);
-  if (iter_ptr == nullptr || iter_ptr == remote_mr_current.length + (char*)prefetched_mr->addr){
+  const Prefetch_Buffer& cur = buffers_[cur_buffer_];
+  assert(iter_ptr <= cur.remote.length + (char*)cur.local.addr);
+  if (iter_ptr == nullptr || iter_ptr == cur.remote.length + (char*)cur.local.addr){
 
     valid_ = Fetch_next_buffer_initial(iter_offset);
     DEBUG_arg("Move to the next chunk, iter_ptr now is %p\n", iter_ptr);
@@ -152,15 +380,21 @@ void ByteAddressableSEQIterator::GetNextKV() {
     DEBUG_arg("Move to the next subchunk, iter_ptr now is %p\n", iter_ptr);
 
   }
+  // A record is at least 8 bytes, whatever its header.
   Slice Size_buff = Slice(iter_ptr, 8);
-  GetFixed32(&Size_buff, &key_size);
-  GetFixed32(&Size_buff, &value_size);
-  assert(key_size == 29 || key_size == 28);
-  assert(value_size == 400 || value_size == 21);
-  iter_ptr += 8;
-  iter_offset += 8;
+  bool compressed, checksummed;
+  GetKVRecordHeader(&Size_buff, &key_size, &value_size, &compressed,
+                    &checksummed);
+  const size_t header_size = 8 - Size_buff.size();
+  const size_t trailer_size = checksummed ? kKVRecordChecksumSize : 0;
+  // Kept for the checksum, the fetch below may move iter_ptr.
+  char header[8];
+  memcpy(header, iter_ptr, header_size);
+  iter_ptr += header_size;
+  iter_offset += header_size;
   //Check whether the
-  if (UNLIKELY(iter_offset + key_size + value_size > cur_prefetch_status)){
+  if (UNLIKELY(iter_offset + key_size + value_size + trailer_size >
+               cur_prefetch_status)){
 
     if(!Fetch_next_buffer_middle()){
       assert(iter_offset == cur_prefetch_status);
@@ -173,125 +407,189 @@ void ByteAddressableSEQIterator::GetNextKV() {
   iter_ptr += key_size;
   iter_offset += key_size;
   value_ = Slice(iter_ptr, value_size);
-  iter_ptr += value_size;
-  iter_offset += value_size;
+  if (checksummed && options_.verify_checksums &&
+      !VerifyKVRecordChecksum(
+          Slice(header, header_size),
+          Slice(iter_ptr - key_size, key_size + value_size),
+          iter_ptr + value_size)) {
+    SaveError(Status::Corruption("KV record checksum mismatch"));
+  }
+  if (compressed && !UncompressKVValue(&value_, &value_buf_)) {
+    SaveError(Status::Corruption("bad compressed value"));
+  }
+  iter_ptr += value_size + trailer_size;
+  iter_offset += value_size + trailer_size;
 //  DEBUG_arg("Iterator now is at %p \n", iter_ptr);
 //  iter_offset += key_size + value_size + 2*sizeof(uint32_t);
-  assert(iter_ptr - (char*)prefetched_mr->addr <= remote_mr_current.length);
+  assert(iter_ptr - (char*)buffers_[cur_buffer_].local.addr <=
+         buffers_[cur_buffer_].remote.length);
 }
-// The offset has to be the start address of the SSTable chunk, we only fetch
-// PREFETCH_GRANULARITY data every time. THis function is the first prefetch for
-// one specific SSTable chunk
+// The offset has to be the start address of the SSTable chunk, or of the rest
+// of it after a Seek. The chunk is usually posted already, when the cursor was
+// close to the end of the previous one. Returns once the first window landed.
 bool ByteAddressableSEQIterator::Fetch_next_buffer_initial(size_t offset) {
-  Table* table = reinterpret_cast<Table*>(arg_);
-//  ibv_mr mr = {};
-  auto tablemeta = table->rep->remote_table.lock();
-  auto rdma_mg = Env::Default()->rdma_mg;
-//  assert(remote_mr_current.addr == nullptr);
-//  assert(remote_mr_current.length == 0);
-  prefetch_counter = 0;
-  if(Find_prefetch_MR(&tablemeta->remote_data_mrs, offset, &remote_mr_current)){
-//    size_t total_len = remote_mr_current.length;
-//    prefetched_mr->length = remote_mr_current.length;
-    ibv_mr remote_mr = remote_mr_current;
-    ibv_mr local_mr = *prefetched_mr;
-
-    if (remote_mr_current.length > PREFETCH_GRANULARITY){
-      remote_mr.length = PREFETCH_GRANULARITY;
-      local_mr.length = PREFETCH_GRANULARITY;
-      rdma_mg->RDMA_Read(&remote_mr, &local_mr, PREFETCH_GRANULARITY,
-                         "read_local", IBV_SEND_SIGNALED, 1, 0);
-//      remote_mr_current.addr = (void*)((char*)remote_mr_current.addr + PREFETCH_GRANULARITY);
-//      remote_mr_current.length -= PREFETCH_GRANULARITY;
-      cur_prefetch_status = offset + PREFETCH_GRANULARITY;
-    } else {
-//      remote_mr.addr = (void*)((char*)remote_mr.addr );
-//      local_mr.addr = (void*)((char*)local_mr.addr);
-      remote_mr.length = remote_mr_current.length;
-      local_mr.length = remote_mr_current.length;
-      rdma_mg->RDMA_Read(&remote_mr, &local_mr, remote_mr_current.length,
-                         "read_local", IBV_SEND_SIGNALED, 1, 0);
-//      remote_mr_current.addr = nullptr;
-//      remote_mr_current.length = 0;
-      cur_prefetch_status = offset + remote_mr_current.length;
-
+  Prefetch_Buffer& next = buffers_[1 - cur_buffer_];
+  // The windows of the chunk of the cursor must have landed before its
+  // buffer is reused for the chunk after the next one.
+  if (next.remote.length != 0 && next.offset == offset &&
+      (windows_.empty() || windows_.front().buffer != cur_buffer_)) {
+    buffers_[cur_buffer_].remote.length = 0;
+    cur_buffer_ = 1 - cur_buffer_;
+  } else {
+    Drop_windows();
+    Table* table = reinterpret_cast<Table*>(arg_);
+    auto tablemeta = table->rep->remote_table.lock();
+    Prefetch_Buffer& cur = buffers_[cur_buffer_];
+    cur.offset = offset;
+    if (!Find_prefetch_MR(&tablemeta->remote_data_mrs, offset, &cur.remote) ||
+        !Clamp_to_bounds(&cur)) {
+      cur.remote.length = 0;
+      return false;
     }
-    prefetch_counter = 1;
-//    for (size_t i = 0; i < mr.length/PREFETCH_GRANULARITY + 1; ++i) {
-//      remote_mr.addr = (void*)((char*)remote_mr.addr + i*PREFETCH_GRANULARITY);
-//      local_mr.addr = (void*)((char*)local_mr.addr + i*PREFETCH_GRANULARITY);
-//      if (total_len > PREFETCH_GRANULARITY){
-//
-//        rdma_mg->RDMA_Read(&remote_mr, &local_mr, PREFETCH_GRANULARITY, "read_local", IBV_SEND_SIGNALED, 1);
-//        total_len -= PREFETCH_GRANULARITY;
-//      }else if (total_len > 0){
-//        remote_mr.addr = (void*)((char*)remote_mr.addr + i*PREFETCH_GRANULARITY);
-//        local_mr.addr = (void*)((char*)local_mr.addr + i*PREFETCH_GRANULARITY);
-//        remote_mr.length = total_len;
-//        local_mr.length = total_len;
-//        rdma_mg->RDMA_Read(&remote_mr, &local_mr, total_len, "read_local", IBV_SEND_SIGNALED, 0);
-//        total_len = 0;
-//      }
-//    }
-//    prefetched_mr->length = mr.length;
-    iter_ptr = (char*)prefetched_mr->addr;
-//    poll_number = mr.length/PREFETCH_GRANULARITY;
-
-//    assert(total_len == 0);
-    return true;
-  }else{
-    return false;
+    cur.posted = 0;
+    cur.arrived = 0;
   }
-
-  //  return mr;
+  Prefetch_Buffer& cur = buffers_[cur_buffer_];
+  assert(cur.remote.length <= cur.local.length);
+  iter_ptr = (char*)cur.local.addr;
+  Fill_windows();
+  while (cur.arrived == 0 && !windows_.empty()) {
+    Wait_window();
+  }
+  cur_prefetch_status = cur.offset + cur.arrived;
+  return status_.ok();
 }
+// Wait for the next window of the chunk of the cursor. Returns false if the
+// chunk has landed entirely.
 bool ByteAddressableSEQIterator::Fetch_next_buffer_middle() {
-  Table* table = reinterpret_cast<Table*>(arg_);
-  //  ibv_mr mr = {};
-  auto tablemeta = table->rep->remote_table.lock();
-  auto rdma_mg = Env::Default()->rdma_mg;
-//  assert(remote_mr_current.addr != nullptr);
-//  assert(remote_mr_current.length != 0);
-  if (remote_mr_current.length <= PREFETCH_GRANULARITY*prefetch_counter){
+  Prefetch_Buffer& cur = buffers_[cur_buffer_];
+  if (cur.arrived == cur.remote.length) {
     // There is no middle fetch task left we need to start a new chunk.
     return false;
   }
-
-  //    size_t total_len = remote_mr_current.length;
-  ibv_mr remote_mr = remote_mr_current;
-  remote_mr.addr = (char*)remote_mr.addr + PREFETCH_GRANULARITY*prefetch_counter;
-  ibv_mr local_mr = *prefetched_mr;
-  local_mr.addr = (char*)local_mr.addr + PREFETCH_GRANULARITY*prefetch_counter;
-
-  //Note remote_mr_current.length will not be changed in this function, it will only be
-  // changed in the initial function.
-  if (remote_mr_current.length - prefetch_counter*PREFETCH_GRANULARITY > PREFETCH_GRANULARITY){
-    remote_mr.length = PREFETCH_GRANULARITY;
-    local_mr.length = PREFETCH_GRANULARITY;
-    rdma_mg->RDMA_Read(&remote_mr, &local_mr, PREFETCH_GRANULARITY,
-                       "read_local", IBV_SEND_SIGNALED, 1, 0);
-//    remote_mr_current.addr = (void*)((char*)remote_mr_current.addr + PREFETCH_GRANULARITY);
-//    remote_mr_current.length -= PREFETCH_GRANULARITY;
-    cur_prefetch_status += PREFETCH_GRANULARITY;
-  }else {
-    //      remote_mr.addr = (void*)((char*)remote_mr.addr );
-    //      local_mr.addr = (void*)((char*)local_mr.addr);
-    remote_mr.length = remote_mr_current.length;
-    local_mr.length = remote_mr_current.length;
-    rdma_mg->RDMA_Read(
-        &remote_mr, &local_mr,
-        remote_mr_current.length - PREFETCH_GRANULARITY * prefetch_counter,
-        "read_local", IBV_SEND_SIGNALED, 1, 0);
-//    remote_mr_current.addr = nullptr;
-//    remote_mr_current.length = 0;
-    cur_prefetch_status += remote_mr_current.length - PREFETCH_GRANULARITY*prefetch_counter;
-
+  Fill_windows();
+  assert(!windows_.empty() && windows_.front().buffer == cur_buffer_);
+  Wait_window();
+  cur_prefetch_status = cur.offset + cur.arrived;
+  return true;
+}
+bool ByteAddressableSEQIterator::Post_next_window() {
+  if (reverse_) {
+    int b = cur_buffer_;
+    if (buffers_[b].posted == buffers_[b].remote.length) {
+      // Read ahead into the chunk before the one of the cursor.
+      b = 1 - cur_buffer_;
+      Prefetch_Buffer& prev = buffers_[b];
+      if (prev.remote.length == 0) {
+        const Prefetch_Buffer& cur = buffers_[cur_buffer_];
+        if (cur.remote.length == 0 || cur.offset == 0) {
+          return false;
+        }
+        Table* table = reinterpret_cast<Table*>(arg_);
+        auto tablemeta = table->rep->remote_table.lock();
+        auto chunk = tablemeta->remote_data_mrs.upper_bound(cur.offset - 1);
+        if (chunk == tablemeta->remote_data_mrs.end()) {
+          return false;
+        }
+        prev.offset = chunk->first - chunk->second->length;
+        prev.remote = *chunk->second;
+        prev.posted = 0;
+        prev.arrived = 0;
+        assert(prev.remote.length <= prev.local.length);
+        if (!Clamp_to_bounds(&prev)) {
+          prev.remote.length = 0;
+          return false;
+        }
+      }
+      if (prev.posted == prev.remote.length) {
+        return false;
+      }
+    }
+    Prefetch_Buffer& buffer = buffers_[b];
+    const size_t size = std::min<size_t>(PREFETCH_GRANULARITY,
+                                         buffer.remote.length - buffer.posted);
+    const size_t start = buffer.remote.length - buffer.posted - size;
+    Prefetch_Window window{b, buffer.posted + size,
+                           std::unique_ptr<RDMA_Read_Future>(new RDMA_Read_Future())};
+    std::vector<RDMA_Read_Request> request = {
+        {(char*)buffer.remote.addr + start, buffer.remote.rkey,
+         (char*)buffer.local.addr + start, buffer.local.lkey, size}};
+    if (Env::Default()->rdma_mg->RDMA_Read_Batch_Async(
+            request, target_node_id_, window.future.get()) != 0) {
+      SaveError(Status::IOError("RDMA read failed"));
+    }
+    buffer.posted += size;
+    windows_.push_back(std::move(window));
+    return true;
+  }
+  int b = cur_buffer_;
+  if (buffers_[b].posted == buffers_[b].remote.length) {
+    // Read ahead into the chunk after the one of the cursor, which follows it
+    // in the file.
+    b = 1 - cur_buffer_;
+    Prefetch_Buffer& next = buffers_[b];
+    if (next.remote.length == 0) {
+      const Prefetch_Buffer& cur = buffers_[cur_buffer_];
+      Table* table = reinterpret_cast<Table*>(arg_);
+      auto tablemeta = table->rep->remote_table.lock();
+      const size_t next_offset = cur.offset + cur.remote.length;
+      next.offset = next_offset;
+      if (cur.remote.length == 0 ||
+          !Find_prefetch_MR(&tablemeta->remote_data_mrs, next_offset,
+                            &next.remote) ||
+          !Clamp_to_bounds(&next)) {
+        next.remote.length = 0;
+        return false;
+      }
+      next.posted = 0;
+      next.arrived = 0;
+    }
+    if (next.posted == next.remote.length) {
+      return false;
+    }
+  }
+  Prefetch_Buffer& buffer = buffers_[b];
+  const size_t size =
+      std::min<size_t>(PREFETCH_GRANULARITY, buffer.remote.length - buffer.posted);
+  Prefetch_Window window{b, buffer.posted + size,
+                         std::unique_ptr<RDMA_Read_Future>(new RDMA_Read_Future())};
+  std::vector<RDMA_Read_Request> request = {
+      {(char*)buffer.remote.addr + buffer.posted, buffer.remote.rkey,
+       (char*)buffer.local.addr + buffer.posted, buffer.local.lkey, size}};
+  if (Env::Default()->rdma_mg->RDMA_Read_Batch_Async(
+          request, target_node_id_, window.future.get()) != 0) {
+    SaveError(Status::IOError("RDMA read failed"));
   }
-  prefetch_counter++;
-  //    assert(total_len == 0);
+  buffer.posted += size;
+  windows_.push_back(std::move(window));
   return true;
-
-
-  //  return mr;
 }
-}
\ No newline at end of file
+void ByteAddressableSEQIterator::Fill_windows() {
+  while (windows_.size() < depth_ && Post_next_window()) {
+  }
+}
+void ByteAddressableSEQIterator::Wait_window() {
+  Prefetch_Window& window = windows_.front();
+  if (!window.future->IsReady()) {
+    // The cursor caught up with the reads, read further ahead.
+    depth_ = std::min(depth_ * 2, max_depth_);
+  } else if (windows_.back().future->IsReady() && depth_ > 1) {
+    // Everything has landed already, the cursor is the bottleneck.
+    depth_--;
+  }
+  if (window.future->Wait() != 0) {
+    SaveError(Status::IOError("RDMA read failed"));
+  }
+  buffers_[window.buffer].arrived = window.end;
+  windows_.pop_front();
+  Fill_windows();
+}
+void ByteAddressableSEQIterator::Drop_windows() {
+  windows_.clear();
+  for (Prefetch_Buffer& buffer : buffers_) {
+    buffer.remote.length = 0;
+    buffer.posted = 0;
+    buffer.arrived = 0;
+  }
+}
+}
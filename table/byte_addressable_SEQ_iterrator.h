@@ -5,6 +5,11 @@
 #ifndef dLSM_BYTE_ADDRESSABLE_SEQ_ITERRATOR_H
 #define dLSM_BYTE_ADDRESSABLE_SEQ_ITERRATOR_H
 #include "dLSM/iterator.h"
+#include <deque>
+#include <limits>
+#include <memory>
+#include <vector>
+
 #include "iterator_wrapper.h"
 #include "dLSM/options.h"
 #include "two_level_iterator.h"
@@ -13,12 +18,15 @@
 #include "table/block.h"
 #include "table/format.h"
 #include "table/iterator_wrapper.h"
+#include "util/rdma.h"
 namespace dLSM {
 typedef Slice (*KVFunction)(void*, const ReadOptions&, const Slice&);
 // THE SEQ will only be used by the compute side. For the memory node, we
 // still keep using the random access allocator.
 
-//The seq iterator only support forward searching
+// The seq iterator walks the chunks of a table forward, reading ahead of the
+// cursor. Backward it follows the index and reads the chunks from their end
+// down, ahead of the cursor as well.
 class ByteAddressableSEQIterator :public Iterator{
  public:
   ByteAddressableSEQIterator(Iterator* index_iter, void* arg,
@@ -52,20 +60,77 @@ class ByteAddressableSEQIterator :public Iterator{
   //    void SkipEmptyDataBlocksForward();
   //    void SkipEmptyDataBlocksBackward();
   void GetKVInitial();
+  // Read forward from the record at "offset" in the table.
+  void GetKVAt(size_t offset);
   void GetNextKV();
+  // Read the group of records of the index entry for a backward step and
+  // move to its last record, or to the last one before *before if given.
+  void GetKVBackward(const Slice* before = nullptr);
+  // Move to the record-th record of the group read backward.
+  void SetRecord(size_t record);
+  // Switch to the direction "reverse", dropping the reads of the other one.
+  void Set_direction(bool reverse);
+  // The offset of the group of records holding the first record at or after
+  // "target", or of its end if "end" is set, or the largest size_t if there
+  // is none. Moves index_iter_.
+  size_t Record_offset(const Slice& target, bool end);
 
   bool Fetch_next_buffer_initial(size_t offset);
   bool Fetch_next_buffer_middle();
+  // Post the next window, of the current chunk or else of the next one, the
+  // previous one backward. Returns false if both are posted entirely.
+  bool Post_next_window();
+  // Post windows until "depth_" are in flight.
+  void Fill_windows();
+  // Wait for the oldest window in flight.
+  void Wait_window();
+  // Wait for all the windows and forget both chunks.
+  void Drop_windows();
   bool compute_side_;
+  const Comparator* comparator_;
+  // Whether an index entry covers several records, see
+  // Options::index_interval.
+  bool sparse_index_;
 //  char* mr_addr;
 //  ibv_mr* mr;
-  // the memory region for the prefetch buffer, the length represents the border
-  // for current prefetched data.
-  ibv_mr* prefetched_mr;
-  uint32_t prefetch_counter = 0;
-  ibv_mr remote_mr_current = {};
+  // The rest of a chunk from "offset" on, read into "local" window by window.
+  // "remote" has length 0 if the buffer holds no chunk. Backward the buffer
+  // holds the chunk from its start up to "offset" + remote.length, and
+  // "posted" and "arrived" count from the end of it.
+  struct Prefetch_Buffer {
+    ibv_mr local = {};
+    ibv_mr remote = {};
+    size_t offset = 0;
+    // Bytes posted and bytes landed, from the start of the buffer.
+    size_t posted = 0;
+    size_t arrived = 0;
+  };
+  struct Prefetch_Window {
+    int buffer;
+    size_t end;
+    std::unique_ptr<RDMA_Read_Future> future;
+  };
+  // Cut "buffer" at the bound in the direction of the cursor. Returns false
+  // if nothing is left of it.
+  bool Clamp_to_bounds(Prefetch_Buffer* buffer);
+  // The chunk of the cursor, and the next one, or the previous one backward,
+  // once the former is posted.
+  Prefetch_Buffer buffers_[2];
+  int cur_buffer_ = 0;
+  // The windows in flight, the oldest first.
+  std::deque<Prefetch_Window> windows_;
+  size_t depth_ = 1;
+  const size_t max_depth_;
+  // Whether the last move was backward. The cursor then is at index_iter_.
+  bool reverse_ = false;
+  // The records within ReadOptions::iterate_lower_bound and
+  // iterate_upper_bound, no read goes past them.
+  size_t lower_offset_ = 0;
+  size_t upper_offset_ = std::numeric_limits<size_t>::max();
+  uint8_t target_node_id_ = 0;
 //  size_t this_mr_offset;
   size_t iter_offset = 0;
+  // The offset in the table up to which the chunk of the cursor has landed.
   size_t cur_prefetch_status = 0;
   char* iter_ptr = nullptr;
 //  int8_t poll_number = 0;
@@ -81,6 +146,14 @@ class ByteAddressableSEQIterator :public Iterator{
   // If data_iter_ is non-null, then "data_block_handle_" holds the
   // "index_value" passed to block_function_ to create the data_iter_.
   std::string data_block_handle_;
+  // Backward, the group of records of the index entry in the buffer of the
+  // cursor, the offsets of the records in it and the one of the cursor.
+  const char* group_data_ = nullptr;
+  size_t group_offset_ = 0;
+  std::vector<uint32_t> record_offsets_;
+  size_t record_ = 0;
+  // The value of the record if it is compressed, uncompressed.
+  std::string value_buf_;
 #ifndef NDEBUG
   std::string last_key;
   int64_t num_entries=0;
@@ -4,11 +4,19 @@
 
 #include "table/format.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#include "db/parity_stripes.h"
+#include "db/version_edit.h"
+#include "dLSM/comparator.h"
 #include "dLSM/env.h"
 #include "port/port.h"
 #include "table/block.h"
 #include "util/coding.h"
 #include "util/crc32c.h"
+#include "util/perf_context_imp.h"
 
 namespace dLSM {
 
@@ -28,6 +36,37 @@ Status BlockHandle::DecodeFrom(Slice* input) {
   }
 }
 
+namespace {
+const int kFixedHandleOffsetBits = 40;
+const uint64_t kFixedHandleOffsetMask =
+    (uint64_t{1} << kFixedHandleOffsetBits) - 1;
+const uint64_t kFixedHandleLargeSize =
+    (uint64_t{1} << (64 - kFixedHandleOffsetBits)) - 1;
+}  // namespace
+
+void BlockHandle::EncodeFixedTo(std::string* dst) const {
+  assert(offset_ <= kFixedHandleOffsetMask);
+  const uint64_t size = std::min(size_, kFixedHandleLargeSize);
+  PutFixed64(dst, offset_ | (size << kFixedHandleOffsetBits));
+  if (size == kFixedHandleLargeSize) {
+    PutVarint64(dst, size_);
+  }
+}
+
+Status BlockHandle::DecodeFixedFrom(Slice* input) {
+  if (input->size() < sizeof(uint64_t)) {
+    return Status::Corruption("bad block handle");
+  }
+  const uint64_t word = DecodeFixed64(input->data());
+  input->remove_prefix(sizeof(uint64_t));
+  offset_ = word & kFixedHandleOffsetMask;
+  size_ = word >> kFixedHandleOffsetBits;
+  if (size_ == kFixedHandleLargeSize && !GetVarint64(input, &size_)) {
+    return Status::Corruption("bad block handle");
+  }
+  return Status::OK();
+}
+
 void Footer::EncodeTo(std::string* dst) const {
   const size_t original_size = dst->size();
   metaindex_handle_.EncodeTo(dst);
@@ -60,7 +99,7 @@ Status Footer::DecodeFrom(Slice* input) {
   }
   return result;
 }
-void Find_Remote_MR(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+void Find_Remote_MR(ChunkTable* remote_data_blocks,
                     const BlockHandle& handle, ibv_mr* remote_mr) {
   uint64_t  position = handle.offset();
 //  auto iter = remote_data_blocks.begin();
@@ -74,7 +113,7 @@ void Find_Remote_MR(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
 
 }
 
-void Find_Local_MR(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+void Find_Local_MR(ChunkTable* remote_data_blocks,
                     const BlockHandle& handle, Slice& data) {
   uint64_t  position = handle.offset();
   //  auto iter = remote_data_blocks.begin();
@@ -85,7 +124,7 @@ void Find_Local_MR(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
   //      DEBUG_arg("Block buffer position %lu\n", position);
   data.Reset((static_cast<char*>(iter->second->addr) + position), handle.size());
 }
-bool Find_prefetch_MR(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+bool Find_prefetch_MR(ChunkTable* remote_data_blocks,
                       const size_t& offset , ibv_mr* remote_mr) {
   uint64_t  position = offset;
   //  auto iter = remote_data_blocks.begin();
@@ -104,8 +143,9 @@ bool Find_prefetch_MR(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
 }
 //TODO: Make the block mr searching and creating outside this function, so that datablock is
 // the same as data index block and filter block.
-Status ReadDataBlock(std::map<uint32_t, ibv_mr*>* remote_data_blocks, const ReadOptions& options,
-                 const BlockHandle& handle, BlockContents* result) {
+Status ReadDataBlock(ChunkTable* remote_data_blocks, const ReadOptions& options,
+                 const BlockHandle& handle, BlockContents* result,
+                 uint8_t target_node_id) {
 
   //TODO: Make it use thread local read buffer rather than allocate one every time.
 //#ifdef GETANALYSIS
@@ -156,8 +196,11 @@ Status ReadDataBlock(std::map<uint32_t, ibv_mr*>* remote_data_blocks, const Read
 #ifdef PROCESSANALYSIS
   auto start = std::chrono::high_resolution_clock::now();
 #endif
-  rdma_mg->RDMA_Read(&remote_mr, contents, n + kBlockTrailerSize, "read_local",
-                     IBV_SEND_SIGNALED, 1, 0);
+  if (rdma_mg->RDMA_Read(&remote_mr, contents, n + kBlockTrailerSize,
+                         QP_READ_LOCAL, IBV_SEND_SIGNALED, 1,
+                         target_node_id) != 0) {
+    return Status::IOError("data block read failed");
+  }
 #ifdef PROCESSANALYSIS
   auto stop = std::chrono::high_resolution_clock::now();
   auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
@@ -236,7 +279,28 @@ Status ReadDataBlock(std::map<uint32_t, ibv_mr*>* remote_data_blocks, const Read
 //#endif
   return Status::OK();
 }
-Status ReadKVPair(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+Status CopyDataBlock(const char* raw, const ReadOptions& options,
+                     const BlockHandle& handle, BlockContents* result) {
+  result->data = Slice();
+  size_t n = static_cast<size_t>(handle.size());
+  if (options.verify_checksums) {
+    const uint32_t crc = crc32c::Unmask(DecodeFixed32(raw + n + 1));
+    const uint32_t actual = crc32c::Value(raw, n + 1);
+    if (actual != crc) {
+      DEBUG("Data block Checksum mismatch\n");
+      return Status::Corruption("block checksum mismatch");
+    }
+  }
+  if (raw[n] != kNoCompression) {
+    DEBUG("Data block illegal compression type\n");
+    return Status::Corruption("bad block type");
+  }
+  char* data = new char[n];
+  memcpy(data, raw, n);
+  result->data = Slice(data, n);
+  return Status::OK();
+}
+Status ReadKVPair(ChunkTable* remote_data_blocks,
                   const ReadOptions& options, const BlockHandle& handle,
                   Slice* result, uint8_t target_node_id) {
   //#ifdef GETANALYSIS
@@ -291,8 +355,10 @@ Status ReadKVPair(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
 #ifdef PROCESSANALYSIS
   auto start = std::chrono::high_resolution_clock::now();
 #endif
-  rdma_mg->RDMA_Read(&remote_mr, contents, n, "read_local", IBV_SEND_SIGNALED,
-                     1, target_node_id);
+  if (rdma_mg->RDMA_Read(&remote_mr, contents, n, QP_READ_LOCAL,
+                         IBV_SEND_SIGNALED, 1, target_node_id) != 0) {
+    return Status::IOError("KV read failed");
+  }
 #ifdef PROCESSANALYSIS
   auto stop = std::chrono::high_resolution_clock::now();
   auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
@@ -313,142 +379,582 @@ Status ReadKVPair(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
   //#endif
   return Status::OK();
 }
-Status ReadDataIndexBlock(ibv_mr* remote_mr, const ReadOptions& options,
-                          BlockContents* result, uint8_t target_node_id) {
-  result->data = Slice();
-//  result->cachable = false;
-//  result->heap_allocated = false;
-  // Read the block contents as well as the type/crc footer.
-  // See table_builder.cc for the code that built this structure.
-  Status s = Status::OK();
-  std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
-  size_t n = remote_mr->length - kBlockTrailerSize;
-  assert(n>0);
-  assert(n + kBlockTrailerSize < rdma_mg->name_to_chunksize.at(IndexChunk));
-  ibv_mr contents = {};
-  rdma_mg->Allocate_Local_RDMA_Slot(contents, IndexChunk);
-  rdma_mg->RDMA_Read(remote_mr, &contents, n + kBlockTrailerSize, "read_local",
-                     IBV_SEND_SIGNALED, 1, target_node_id);
-
-//  printf("Fetch a Index Block");
+namespace {
+
+// How fast a memory node answered the reads of the replicated tables of
+// late, which picks the copy of a table to read.
+// The latencies are also counted by powers of two, for the percentiles of
+// the hedged reads.
+const int kLatencyBuckets = 40;
+struct NodeReadLoad {
+  std::atomic<uint64_t> average_nanos{0};
+  std::atomic<uint32_t> in_flight{0};
+  std::atomic<uint32_t> samples{0};
+  std::atomic<uint32_t> latencies[kLatencyBuckets] = {};
+};
+NodeReadLoad node_read_loads[256];
+
+// The counts are halved every this many reads, so that the percentiles
+// follow the recent reads.
+const uint32_t kLatencyDecayInterval = 4096;
+// No read is hedged before its node took this many.
+const uint32_t kMinLatencySamples = 64;
+
+void RecordNodeRead(uint8_t node, uint64_t nanos) {
+  NodeReadLoad& load = node_read_loads[node];
+  // A moving average over about the last 8 reads, a lost update of a
+  // concurrent read does not matter.
+  const uint64_t average = load.average_nanos.load(std::memory_order_relaxed);
+  load.average_nanos.store(average - average / 8 + nanos / 8,
+                           std::memory_order_relaxed);
+  int bucket = 0;
+  while (bucket + 1 < kLatencyBuckets && (nanos >> (bucket + 1)) != 0) {
+    bucket++;
+  }
+  load.latencies[bucket].fetch_add(1, std::memory_order_relaxed);
+  if (load.samples.fetch_add(1, std::memory_order_relaxed) %
+          kLatencyDecayInterval ==
+      kLatencyDecayInterval - 1) {
+    for (std::atomic<uint32_t>& count : load.latencies) {
+      count.store(count.load(std::memory_order_relaxed) / 2,
+                  std::memory_order_relaxed);
+    }
+  }
+}
 
-  // Check the crc of the type and the block contents
-  const char* data = static_cast<char*>(contents.addr);  // Pointer to where Read put the data
-  if (options.verify_checksums) {
-    const uint32_t crc = crc32c::Unmask(DecodeFixed32(data + n + 1));
-    const uint32_t actual = crc32c::Value(data, n + 1);
-    if (actual != crc) {
-//      delete[] buf;
-      DEBUG("Index block Checksum mismatch\n");
-      assert(false);
-      s = Status::Corruption("block checksum mismatch");
-      return s;
-    }else{
-//      DEBUG_arg("SSTable %p open successfully\n", remote_mr->addr);
-//      DEBUG_arg("CRC IS %d\n", crc);
-//      DEBUG_arg("Actual IS %d\n", actual);
+// The "percentile" of the recent read latencies of the node, interpolated
+// within its power of two. 0 if the node took too few reads to tell.
+uint64_t NodeReadPercentile(uint8_t node, double percentile) {
+  const NodeReadLoad& load = node_read_loads[node];
+  if (load.samples.load(std::memory_order_relaxed) < kMinLatencySamples) {
+    return 0;
+  }
+  uint32_t counts[kLatencyBuckets];
+  uint64_t total = 0;
+  for (int i = 0; i < kLatencyBuckets; i++) {
+    counts[i] = load.latencies[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  const double target = total * std::min(percentile, 100.0) / 100.0;
+  double below = 0;
+  for (int i = 0; i < kLatencyBuckets; i++) {
+    if (counts[i] > 0 && below + counts[i] >= target) {
+      const double low = static_cast<double>(uint64_t{1} << i);
+      return static_cast<uint64_t>(low + low * (target - below) / counts[i]);
     }
+    below += counts[i];
   }
+  return uint64_t{1} << (kLatencyBuckets - 1);
+}
 
-  switch (data[n]) {
-    case kNoCompression:
-      //block content do not contain compression type and check sum
-      result->data = Slice(data, n);
-//      result->heap_allocated = false;
-//      result->cachable = false;  // Do not double-table_cache
+// Every this many reads go to the other copy, so that the average of a node
+// which was slow once does not keep the reads away from it for good.
+const uint32_t kReplicaProbeInterval = 64;
+
+// The node of the copy expected to answer first, its average latency scaled
+// by the reads waiting on it.
+uint8_t PickReadNode(uint8_t primary, uint8_t secondary) {
+  static thread_local uint32_t reads = 0;
+  auto cost = [](uint8_t node) {
+    const NodeReadLoad& load = node_read_loads[node];
+    return (load.average_nanos.load(std::memory_order_relaxed) + 1) *
+           (load.in_flight.load(std::memory_order_relaxed) + 1);
+  };
+  const bool faster = cost(secondary) < cost(primary);
+  const bool probe = ++reads % kReplicaProbeInterval == 0;
+  return faster != probe ? secondary : primary;
+}
 
+// Accounts a read of a replicated table to its node while in scope.
+class NodeReadTimer {
+ public:
+  explicit NodeReadTimer(uint8_t node)
+      : node_(node),
+        load_(&node_read_loads[node]),
+        start_(std::chrono::steady_clock::now()) {
+    load_->in_flight.fetch_add(1, std::memory_order_relaxed);
+  }
+  ~NodeReadTimer() {
+    const uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start_)
+                               .count();
+    load_->in_flight.fetch_sub(1, std::memory_order_relaxed);
+    RecordNodeRead(node_, nanos);
+  }
 
-      // Ok
-      break;
-//    case kSnappyCompression: {
-//      size_t ulength = 0;
-//      if (!port::Snappy_GetUncompressedLength(data, n, &ulength)) {
-//        rdma_mg->Deallocate_Local_RDMA_Slot(data, "DataBlock")
-//        return Status::Corruption("corrupted compressed block contents");
-//      }
-//      char* ubuf = new char[ulength];
-//      if (!port::Snappy_Uncompress(data, n, ubuf)) {
-//        delete[] buf;
-////        delete[] ubuf;
-//        return Status::Corruption("corrupted compressed block contents");
-//      }
-//      delete[] buf;
-//      result->data = Slice(ubuf, ulength);
-//      result->heap_allocated = true;
-//      result->cachable = true;
-//      break;
-//    }
-    default:
-//      rdma_mg->Deallocate_Local_RDMA_Slot(static_cast<void*>(const_cast<char *>(data)), DataChunk);
-      DEBUG("index block illegal compression type\n");
-      return Status::Corruption("bad block type");
+ private:
+  const uint8_t node_;
+  NodeReadLoad* load_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Read "size" bytes at "offset" of the data chunks of "table" into
+// *contents, under the deadline of "options", and from the other copy as
+// well if the one picked is slower than the hedge percentile of its node.
+Status TimedRead(RemoteMemTableMetaData* table, TableReplica* replica,
+                 const ReadOptions& options, uint64_t offset, size_t size,
+                 ibv_mr** contents) {
+  std::chrono::steady_clock::time_point deadline;
+  if (options.deadline != 0) {
+    const uint64_t now = Env::Default()->NowMicros();
+    if (now >= options.deadline) {
+      return Status::TimedOut("read deadline passed");
+    }
+    deadline = std::chrono::steady_clock::now() +
+               std::chrono::microseconds(options.deadline - now);
+  }
+  uint8_t node = DataChunkNode(*table);
+  ChunkTable* chunks = &table->remote_data_mrs;
+  uint8_t hedge_node = 0;
+  ChunkTable* hedge_chunks = nullptr;
+  if (replica != nullptr) {
+    hedge_node = replica->node_id;
+    hedge_chunks = &replica->data_mrs;
+    if (PickReadNode(node, hedge_node) == hedge_node) {
+      std::swap(node, hedge_node);
+      std::swap(chunks, hedge_chunks);
+    }
+  }
+  BlockHandle handle;
+  handle.set_offset(offset);
+  handle.set_size(size);
+  ibv_mr remote_mr = {};
+  ibv_mr hedge_mr = {};
+  Find_Remote_MR(chunks, handle, &remote_mr);
+  uint64_t hedge_nanos = 0;
+  if (hedge_chunks != nullptr && options.hedge_percentile > 0) {
+    Find_Remote_MR(hedge_chunks, handle, &hedge_mr);
+    hedge_nanos = NodeReadPercentile(node, options.hedge_percentile);
+  }
+  std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+  node_read_loads[node].in_flight.fetch_add(1, std::memory_order_relaxed);
+  const auto start = std::chrono::steady_clock::now();
+  uint8_t from_node = node;
+  uint64_t nanos = 0;
+  int rc = rdma_mg->RDMA_Read_Hedged(
+      &remote_mr, node, hedge_nanos != 0 ? &hedge_mr : nullptr, hedge_node,
+      size, hedge_nanos, deadline, contents, &from_node, &nanos);
+  node_read_loads[node].in_flight.fetch_sub(1, std::memory_order_relaxed);
+  if (rc == 0) {
+    RecordNodeRead(from_node, nanos);
+  }
+  if (rc == 0 && from_node == node) {
+    return Status::OK();
+  }
+  // The read of the node picked took at least this long.
+  RecordNodeRead(node, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count());
+  if (rc == 0) {
+    PERF_COUNTER_ADD(hedged_reads_won, 1);
+    return Status::OK();
   }
+  if (rc < 0) {
+    return Status::TimedOut("read deadline passed");
+  }
+  return Status::IOError("data chunk read failed");
+}
 
-  return Status::OK();
+// Whether the read of "table" goes through TimedRead().
+bool NeedsTimedRead(RemoteMemTableMetaData* table, TableReplica* replica,
+                    const ReadOptions& options) {
+  if (replica == nullptr &&
+      table->stripe.load(std::memory_order_acquire) != nullptr) {
+    // Rebuilt from the parity if the node is down, as it was.
+    return false;
+  }
+  return options.deadline != 0 ||
+         (replica != nullptr && options.hedge_percentile > 0);
 }
-Status ReadFilterBlock(ibv_mr* remote_mr, const ReadOptions& options,
-                       BlockContents* result, uint8_t target_node_id) {
+
+}  // namespace
+
+uint8_t DataChunkNode(const RemoteMemTableMetaData& table) {
+#ifdef BYTEADDRESSABLE
+  return table.shard_target_node_id;
+#else
+  (void)table;
+  return 0;
+#endif
+}
+
+Status ReadDataBlock(RemoteMemTableMetaData* table, const ReadOptions& options,
+                     const BlockHandle& handle, BlockContents* result) {
+  PERF_COUNTER_ADD(rdma_reads, 1);
+  PERF_COUNTER_ADD(rdma_bytes, handle.size() + kBlockTrailerSize);
+  PERF_TIMER_GUARD(rdma_wait_nanos);
+  if (table->cold_file_id == 0) {
+    TableReplica* replica = table->replica.load(std::memory_order_acquire);
+    const uint8_t primary = DataChunkNode(*table);
+    if (NeedsTimedRead(table, replica, options)) {
+      ibv_mr* contents = nullptr;
+      Status s = TimedRead(table, replica, options, handle.offset(),
+                           handle.size() + kBlockTrailerSize, &contents);
+      if (!s.ok()) {
+        return s;
+      }
+      return CopyDataBlock(static_cast<char*>(contents->addr), options,
+                           handle, result);
+    }
+    if (replica != nullptr) {
+      const uint8_t node = PickReadNode(primary, replica->node_id);
+      NodeReadTimer timer(node);
+      return ReadDataBlock(
+          node == primary ? &table->remote_data_mrs : &replica->data_mrs,
+          options, handle, result, node);
+    }
+    if (table->stripe.load(std::memory_order_acquire) == nullptr) {
+      return ReadDataBlock(&table->remote_data_mrs, options, handle, result,
+                           primary);
+    }
+    if (!ParityStripes::IsDown(primary)) {
+      Status s = ReadDataBlock(&table->remote_data_mrs, options, handle,
+                               result, primary);
+      if (!s.IsIOError()) {
+        return s;
+      }
+      ParityStripes::MarkDown(primary);
+    }
+    std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+    ibv_mr* contents = rdma_mg->Get_local_read_mr();
+    Status s = ParityStripes::Rebuild(rdma_mg.get(), *table, handle.offset(),
+                                      handle.size() + kBlockTrailerSize,
+                                      contents);
+    if (!s.ok()) {
+      return s;
+    }
+    return CopyDataBlock(static_cast<char*>(contents->addr), options, handle,
+                         result);
+  }
   result->data = Slice();
-//  result->cachable = false;
-//  result->heap_allocated = false;
-  // Read the block contents as well as the type/crc footer.
-  // See table_builder.cc for the code that built this structure.
-  Status s = Status::OK();
   std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
-  size_t n = remote_mr->length - kBlockTrailerSize;
-  assert(n + kBlockTrailerSize < rdma_mg->name_to_chunksize.at(FilterChunk));
-  ibv_mr contents = {};
-  rdma_mg->Allocate_Local_RDMA_Slot(contents, FilterChunk);
-  rdma_mg->RDMA_Read(remote_mr, &contents, n + kBlockTrailerSize, "read_local",
-                     IBV_SEND_SIGNALED, 1, target_node_id);
-
-  // Check the crc of the type and the block contents
-  const char* data = static_cast<char*>(contents.addr);  // Pointer to where Read put the data
+  size_t n = static_cast<size_t>(handle.size());
+  ibv_mr* contents = rdma_mg->Get_local_read_mr();
+  // The data chunks lie one after the other at the start of the file.
+  if (!rdma_mg->Remote_Cold_Read(table->cold_file_id, handle.offset(),
+                                 n + kBlockTrailerSize, contents,
+                                 table->shard_target_node_id)) {
+    return Status::IOError("cold table read failed");
+  }
+  return CopyDataBlock(static_cast<char*>(contents->addr), options, handle,
+                       result);
+}
+static Status ReadTableKVPair(RemoteMemTableMetaData* table,
+                              const ReadOptions& options,
+                              const BlockHandle& handle, Slice* result) {
+  PERF_COUNTER_ADD(rdma_reads, 1);
+  PERF_COUNTER_ADD(rdma_bytes, handle.size());
+  PERF_TIMER_GUARD(rdma_wait_nanos);
+  if (table->cold_file_id == 0) {
+    TableReplica* replica = table->replica.load(std::memory_order_acquire);
+    const uint8_t primary = DataChunkNode(*table);
+    if (NeedsTimedRead(table, replica, options)) {
+      ibv_mr* contents = nullptr;
+      Status s = TimedRead(table, replica, options, handle.offset(),
+                           handle.size(), &contents);
+      if (s.ok()) {
+        result->Reset(static_cast<char*>(contents->addr), handle.size());
+      }
+      return s;
+    }
+    if (replica != nullptr) {
+      const uint8_t node = PickReadNode(primary, replica->node_id);
+      NodeReadTimer timer(node);
+      return ReadKVPair(
+          node == primary ? &table->remote_data_mrs : &replica->data_mrs,
+          options, handle, result, node);
+    }
+    if (table->stripe.load(std::memory_order_acquire) == nullptr) {
+      return ReadKVPair(&table->remote_data_mrs, options, handle, result,
+                        primary);
+    }
+    if (!ParityStripes::IsDown(primary)) {
+      Status s = ReadKVPair(&table->remote_data_mrs, options, handle, result,
+                            primary);
+      if (!s.IsIOError()) {
+        return s;
+      }
+      ParityStripes::MarkDown(primary);
+    }
+    std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+    ibv_mr* contents = rdma_mg->Get_local_read_mr();
+    Status s = ParityStripes::Rebuild(rdma_mg.get(), *table, handle.offset(),
+                                      handle.size(), contents);
+    if (s.ok()) {
+      result->Reset(static_cast<char*>(contents->addr), handle.size());
+    }
+    return s;
+  }
+  std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+  size_t n = static_cast<size_t>(handle.size());
+  ibv_mr* contents = rdma_mg->Get_local_read_mr();
+  if (!rdma_mg->Remote_Cold_Read(table->cold_file_id, handle.offset(), n,
+                                 contents, table->shard_target_node_id)) {
+    return Status::IOError("cold table read failed");
+  }
+  result->Reset(static_cast<char*>(contents->addr), n);
+  return Status::OK();
+}
+Status ReadKVPair(RemoteMemTableMetaData* table, const ReadOptions& options,
+                  const BlockHandle& handle, Slice* result) {
+  Status s = ReadTableKVPair(table, options, handle, result);
+  if (s.ok() && options.verify_checksums && !VerifyKVRecords(*result)) {
+    return Status::Corruption("KV record checksum mismatch");
+  }
+  return s;
+}
+bool CompressKVValue(uint8_t type, const Slice& value, std::string* output) {
+  switch (type) {
+    case kSnappyCompression:
+      return port::Snappy_Compress(value.data(), value.size(), output) &&
+             output->size() < value.size() - (value.size() / 8u);
+    default:
+      return false;
+  }
+}
+bool UncompressKVValue(Slice* value, std::string* scratch) {
+  size_t ulength = 0;
+  if (!port::Snappy_GetUncompressedLength(value->data(), value->size(),
+                                          &ulength)) {
+    return false;
+  }
+  scratch->resize(ulength);
+  if (!port::Snappy_Uncompress(value->data(), value->size(), &(*scratch)[0])) {
+    return false;
+  }
+  *value = Slice(*scratch);
+  return true;
+}
+static bool PackableKVRecord(size_t key_size, uint32_t value_size) {
+  return key_size < 256 && value_size < (1u << kPackedValueBits);
+}
+size_t KVRecordHeaderSize(bool packed, size_t key_size, uint32_t value_size) {
+  return packed && PackableKVRecord(key_size, value_size)
+             ? sizeof(uint32_t)
+             : 2 * sizeof(uint32_t);
+}
+size_t EncodeKVRecordHeader(char* dst, bool packed, size_t key_size,
+                            uint32_t value_size) {
+  const uint32_t compressed = value_size & kCompressedValueBit;
+  value_size &= ~kCompressedValueBit;
+  if (packed && PackableKVRecord(key_size, value_size)) {
+    EncodeFixed32(dst, kPackedRecordBit | compressed |
+                           static_cast<uint32_t>(key_size) << kPackedValueBits |
+                           value_size);
+    return sizeof(uint32_t);
+  }
+  EncodeFixed32(dst, static_cast<uint32_t>(key_size));
+  EncodeFixed32(dst + sizeof(uint32_t), value_size | compressed);
+  return 2 * sizeof(uint32_t);
+}
+size_t EncodeChecksummedKVRecordHeader(char* dst, size_t key_size,
+                                       uint32_t value_size) {
+  EncodeFixed32(dst, static_cast<uint32_t>(key_size) | kChecksummedRecordBit);
+  EncodeFixed32(dst + sizeof(uint32_t), value_size);
+  return 2 * sizeof(uint32_t);
+}
+void EncodeKVRecordChecksum(char* dst, const Slice& header, const Slice& key,
+                            const Slice& value) {
+  uint32_t crc = crc32c::Value(header.data(), header.size());
+  crc = crc32c::Extend(crc, key.data(), key.size());
+  crc = crc32c::Extend(crc, value.data(), value.size());
+  EncodeFixed32(dst, crc32c::Mask(crc));
+}
+bool VerifyKVRecordChecksum(const Slice& header, const Slice& key_and_value,
+                            const char* checksum) {
+  const uint32_t crc =
+      crc32c::Extend(crc32c::Value(header.data(), header.size()),
+                     key_and_value.data(), key_and_value.size());
+  return crc32c::Unmask(DecodeFixed32(checksum)) == crc;
+}
+bool GetKVRecordHeader(Slice* input, uint32_t* key_size, uint32_t* value_size,
+                       bool* compressed, bool* checksummed) {
+  uint32_t first;
+  if (!GetFixed32(input, &first)) {
+    return false;
+  }
+  if ((first & kPackedRecordBit) != 0) {
+    *compressed = (first & kCompressedValueBit) != 0;
+    *checksummed = false;
+    *key_size = (first >> kPackedValueBits) & 0xff;
+    *value_size = first & ((1u << kPackedValueBits) - 1);
+    return true;
+  }
+  *checksummed = (first & kChecksummedRecordBit) != 0;
+  *key_size = first & ~kChecksummedRecordBit;
+  if (!GetFixed32(input, value_size)) {
+    return false;
+  }
+  *compressed = (*value_size & kCompressedValueBit) != 0;
+  *value_size &= ~kCompressedValueBit;
+  return true;
+}
+bool GetKVRecord(Slice* input, Slice* key, Slice* value,
+                 std::string* scratch, bool verify_checksum) {
+  const char* header = input->data();
+  uint32_t key_size, value_size;
+  bool compressed, checksummed;
+  if (!GetKVRecordHeader(input, &key_size, &value_size, &compressed,
+                         &checksummed)) {
+    return false;
+  }
+  const size_t trailer = checksummed ? kKVRecordChecksumSize : 0;
+  if (input->size() < static_cast<size_t>(key_size) + value_size + trailer) {
+    return false;
+  }
+  *key = Slice(input->data(), key_size);
+  *value = Slice(input->data() + key_size, value_size);
+  if (checksummed && verify_checksum &&
+      !VerifyKVRecordChecksum(
+          Slice(header, input->data() - header),
+          Slice(input->data(), key_size + value_size),
+          input->data() + key_size + value_size)) {
+    return false;
+  }
+  input->remove_prefix(key_size + value_size + trailer);
+  if (compressed && scratch != nullptr) {
+    return UncompressKVValue(value, scratch);
+  }
+  return true;
+}
+bool VerifyKVRecords(Slice group) {
+  Slice key, value;
+  while (!group.empty()) {
+    if (!GetKVRecord(&group, &key, &value, nullptr, true)) {
+      return false;
+    }
+  }
+  return true;
+}
+bool SeekKVRecord(const Comparator* comparator, Slice group,
+                  const Slice& target, Slice* key, Slice* value,
+                  std::string* scratch) {
+  Slice record = group;
+  while (GetKVRecord(&group, key, value, nullptr)) {
+    if (comparator->Compare(*key, target) >= 0) {
+      // Only the value of the record found is uncompressed.
+      return GetKVRecord(&record, key, value, scratch);
+    }
+    record = group;
+  }
+  // A group keyed by a separator may end before target.
+  *key = Slice();
+  return group.empty();
+}
+bool IsSparseIndexEntry(const Slice& index_value) {
+  Slice input = index_value;
+  BlockHandle handle;
+  return DecodeIndexHandle(&input, &handle).ok() && !input.empty();
+}
+// Check the trailer of the n bytes of block read into "data", a local slot
+// which becomes the memory of *result.
+static Status ParseRemoteBlock(const char* data, size_t n,
+                               const ReadOptions& options,
+                               BlockContents* result) {
   if (options.verify_checksums) {
     const uint32_t crc = crc32c::Unmask(DecodeFixed32(data + n + 1));
     const uint32_t actual = crc32c::Value(data, n + 1);
     if (actual != crc) {
-//      delete[] buf;
-      DEBUG("Filter Checksum mismatch\n");
-//      assert(false);
-      s = Status::Corruption("block checksum mismatch");
-      return s;
+      DEBUG("Index or filter block checksum mismatch\n");
+      return Status::Corruption("block checksum mismatch");
     }
   }
-
   switch (data[n]) {
     case kNoCompression:
+      // The index and filter blocks are never compressed.
       result->data = Slice(data, n);
-//      result->heap_allocated = false;
-//      result->cachable = false;  // Do not double-table_cache
-
-
-      // Ok
       break;
-//    case kSnappyCompression: {
-//      size_t ulength = 0;
-//      if (!port::Snappy_GetUncompressedLength(data, n, &ulength)) {
-//        rdma_mg->Deallocate_Local_RDMA_Slot(data, "DataBlock")
-//        return Status::Corruption("corrupted compressed block contents");
-//      }
-//      char* ubuf = new char[ulength];
-//      if (!port::Snappy_Uncompress(data, n, ubuf)) {
-//        delete[] buf;
-////        delete[] ubuf;
-//        return Status::Corruption("corrupted compressed block contents");
-//      }
-//      delete[] buf;
-//      result->data = Slice(ubuf, ulength);
-//      result->heap_allocated = true;
-//      result->cachable = true;
-//      break;
-//    }
     default:
-//      rdma_mg->Deallocate_Local_RDMA_Slot(static_cast<void*>(const_cast<char *>(data)), DataChunk);
-      DEBUG("Filter illegal compression type\n");
+      DEBUG("Index or filter block illegal compression type\n");
       return Status::Corruption("bad block type");
   }
   assert(result->data.size() != 0);
   return Status::OK();
 }
+void ReadRemoteBlocks(std::vector<RemoteBlockRead>* reads,
+                      const ReadOptions& options) {
+  std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+  std::vector<ibv_mr> contents(reads->size());
+  std::map<uint8_t, std::vector<RDMA_Read_Request>> requests;
+  for (size_t i = 0; i < reads->size(); i++) {
+    RemoteBlockRead& read = (*reads)[i];
+    read.result->data = Slice();
+    // The block contents as well as the type/crc trailer, see
+    // table_builder.cc for the code that built this structure.
+    assert(read.remote_mr->length > kBlockTrailerSize);
+    assert(read.remote_mr->length <
+           rdma_mg->name_to_chunksize.at(read.chunk));
+    rdma_mg->Allocate_Local_RDMA_Slot(contents[i], read.chunk);
+    requests[read.target_node_id].push_back(
+        {read.remote_mr->addr, read.remote_mr->rkey, contents[i].addr,
+         contents[i].lkey, read.remote_mr->length});
+  }
+  // Post the reads of all the memory nodes before waiting for any of them.
+  std::vector<RDMA_Read_Future> futures(requests.size());
+  std::map<uint8_t, int> read_rc;
+  size_t j = 0;
+  for (auto& iter : requests) {
+    read_rc[iter.first] =
+        rdma_mg->RDMA_Read_Batch_Async(iter.second, iter.first, &futures[j++]);
+  }
+  j = 0;
+  for (auto& iter : requests) {
+    int rc = futures[j++].Wait();
+    if (read_rc[iter.first] == 0) {
+      read_rc[iter.first] = rc;
+    }
+  }
+  for (size_t i = 0; i < reads->size(); i++) {
+    RemoteBlockRead& read = (*reads)[i];
+    if (read_rc[read.target_node_id] != 0) {
+      read.s = Status::IOError("RDMA read of a table block failed");
+    } else {
+      read.s = ParseRemoteBlock(static_cast<char*>(contents[i].addr),
+                                read.remote_mr->length - kBlockTrailerSize,
+                                options, read.result);
+    }
+    if (!read.s.ok()) {
+      rdma_mg->Deallocate_Local_RDMA_Slot(contents[i].addr, read.chunk);
+    }
+  }
+}
+Status ReadDataIndexBlock(ibv_mr* remote_mr, const ReadOptions& options,
+                          BlockContents* result, uint8_t target_node_id) {
+  std::vector<RemoteBlockRead> reads = {
+      {remote_mr, IndexChunk, target_node_id, result, Status::OK()}};
+  ReadRemoteBlocks(&reads, options);
+  return reads[0].s;
+}
+Status ReadFilterBlock(ibv_mr* remote_mr, const ReadOptions& options,
+                       BlockContents* result, uint8_t target_node_id) {
+  std::vector<RemoteBlockRead> reads = {
+      {remote_mr, FilterChunk, target_node_id, result, Status::OK()}};
+  ReadRemoteBlocks(&reads, options);
+  return reads[0].s;
+}
+Status ReadRemoteRange(ibv_mr* remote_mr, uint64_t offset, size_t n,
+                       char* dst, uint8_t target_node_id) {
+  PERF_COUNTER_ADD(rdma_reads, 1);
+  PERF_COUNTER_ADD(rdma_bytes, n);
+  PERF_TIMER_GUARD(rdma_wait_nanos);
+  std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+  if (offset + n > remote_mr->length) {
+    return Status::Corruption("remote range out of bound");
+  }
+  ibv_mr* contents = rdma_mg->Get_local_read_mr();
+  const size_t buffer_size = rdma_mg->name_to_chunksize.at(DataChunk);
+  ibv_mr remote_mr_current = *remote_mr;
+  while (n > 0) {
+    size_t len = std::min(n, buffer_size);
+    remote_mr_current.addr = static_cast<char*>(remote_mr->addr) + offset;
+    remote_mr_current.length = len;
+    rdma_mg->RDMA_Read(&remote_mr_current, contents, len, QP_READ_LOCAL,
+                       IBV_SEND_SIGNALED, 1, target_node_id);
+    memcpy(dst, contents->addr, len);
+    dst += len;
+    offset += len;
+    n -= len;
+  }
+  return Status::OK();
+}
 }  // namespace dLSM
@@ -7,18 +7,22 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 
 #include "dLSM/slice.h"
 #include "dLSM/status.h"
 #include <map>
+#include "util/chunk_table.h"
 #include "util/rdma.h"
 //#include "dLSM/table_builder.h"
 
 namespace dLSM {
 
 class Block;
+class Comparator;
 class RandomAccessFile;
 struct ReadOptions;
+struct RemoteMemTableMetaData;
 //struct ibv_mr;
 // BlockHandle is a pointer to the extent of a file that stores a data
 // block or a meta block.
@@ -40,11 +44,36 @@ class BlockHandle {
   void EncodeTo(std::string* dst) const;
   Status DecodeFrom(Slice* input);
 
+  // The encoding of the index entries of a byte-addressable table, which
+  // point to groups of records: the offset in the low 40 bits and the size
+  // in the high 24 bits of one fixed64, which a lookup decodes with a single
+  // load. A size of 16MB or more leaves the 24 bits all ones and follows as
+  // a varint64.
+  void EncodeFixedTo(std::string* dst) const;
+  Status DecodeFixedFrom(Slice* input);
+
  private:
   uint64_t offset_;// count in the blocktrailer.
   uint64_t size_;
 };
 
+// The handle of an index entry of the tables of this build, which are
+// byte-addressable with BYTEADDRESSABLE.
+inline void EncodeIndexHandle(const BlockHandle& handle, std::string* dst) {
+#ifdef BYTEADDRESSABLE
+  handle.EncodeFixedTo(dst);
+#else
+  handle.EncodeTo(dst);
+#endif
+}
+inline Status DecodeIndexHandle(Slice* input, BlockHandle* handle) {
+#ifdef BYTEADDRESSABLE
+  return handle->DecodeFixedFrom(input);
+#else
+  return handle->DecodeFrom(input);
+#endif
+}
+
 // Footer encapsulates the fixed information stored at the tail
 // end of every table file.
 class Footer {
@@ -80,29 +109,132 @@ static const uint64_t kTableMagicNumber = 0xdb4775248b80fb57ull;
 // 1-byte type + 32-bit crc
 static const size_t kBlockTrailerSize = 5;
 
+// The keys of a sparse index, see Options::index_interval, are prefix
+// compressed between restarts this many entries apart.
+static const int kSparseIndexRestartInterval = 16;
+
 struct BlockContents {
   Slice data;           // Actual contents of data
 //  bool cachable;        // True iff data can be cached
 //  bool heap_allocated;  // True iff caller should delete[] data.data()
 };
-void Find_Local_MR(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+void Find_Local_MR(ChunkTable* remote_data_blocks,
                     const BlockHandle& handle, Slice& data);
-void Find_Remote_MR(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+void Find_Remote_MR(ChunkTable* remote_data_blocks,
                          const BlockHandle& handle, ibv_mr* remote_mr);
-bool Find_prefetch_MR(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+bool Find_prefetch_MR(ChunkTable* remote_data_blocks,
                        const size_t& offset, ibv_mr* remote_mr);
 
 // Read the block identified by "handle" from "file".  On failure
 // return non-OK.  On success fill *result and return OK.
-Status ReadDataBlock(std::map<uint32_t, ibv_mr*>* remote_data_blocks, const ReadOptions& options,
-                 const BlockHandle& handle, BlockContents* result);
-Status ReadKVPair(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+Status ReadDataBlock(ChunkTable* remote_data_blocks, const ReadOptions& options,
+                 const BlockHandle& handle, BlockContents* result,
+                 uint8_t target_node_id = 0);
+// Copy the data block at "raw", which has been read from the remote
+// together with its trailer, to a heap buffer owned by *result.
+Status CopyDataBlock(const char* raw, const ReadOptions& options,
+                     const BlockHandle& handle, BlockContents* result);
+Status ReadKVPair(ChunkTable* remote_data_blocks,
                   const ReadOptions& options, const BlockHandle& handle,
                   Slice* result, uint8_t target_node_id);
+// The memory node the data chunks of "table" are on. The compute side
+// builders of the block based tables write them to the first one.
+uint8_t DataChunkNode(const RemoteMemTableMetaData& table);
+// Same as the two above for a block of "table", which is read through its
+// memory node if the table is cold, see Options::cold_level, from the
+// faster of its two memory nodes if it has a replica, and rebuilt from its
+// parity stripe if its memory node failed.
+Status ReadDataBlock(RemoteMemTableMetaData* table, const ReadOptions& options,
+                     const BlockHandle& handle, BlockContents* result);
+Status ReadKVPair(RemoteMemTableMetaData* table, const ReadOptions& options,
+                  const BlockHandle& handle, Slice* result);
+// A KV record of the byte addressable tables is the fixed32 sizes of its
+// key and value followed by both. The value size has kCompressedValueBit
+// set if the value is compressed, see Options::compression_start_level. An
+// index entry covers a group of records, see Options::index_interval. Its
+// value is the BlockHandle of the group, followed in a sparse index by the
+// varint32 number of its records.
+static const uint32_t kCompressedValueBit = 1u << 31;
+// With Options::packed_kv_records, a record whose key is shorter than 256
+// bytes and whose value is shorter than 4MB has a single fixed32 instead of
+// the two sizes: kPackedRecordBit, kCompressedValueBit, the key size in bits
+// 22 to 29 and the value size below. The key size of an unpacked record
+// never has kPackedRecordBit set, so the records of both kinds mix.
+static const uint32_t kPackedRecordBit = 1u << 30;
+static const uint32_t kPackedValueBits = 22;
+// With Options::kv_checksums, a record is never packed, its key size has
+// kChecksummedRecordBit set and its value is followed by the masked crc32c
+// of the header, the key and the value as stored.
+static const uint32_t kChecksummedRecordBit = 1u << 31;
+static const size_t kKVRecordChecksumSize = sizeof(uint32_t);
+
+// Size of the header of a record, "value_size" without kCompressedValueBit.
+size_t KVRecordHeaderSize(bool packed, size_t key_size, uint32_t value_size);
+// Write the header of a record to dst, which has room for 8 bytes, and
+// return its size. "value_size" may have kCompressedValueBit set.
+size_t EncodeKVRecordHeader(char* dst, bool packed, size_t key_size,
+                            uint32_t value_size);
+// Same for a record followed by its checksum, always 8 bytes.
+size_t EncodeChecksummedKVRecordHeader(char* dst, size_t key_size,
+                                       uint32_t value_size);
+// Write the checksum of the record of "header", "key" and "value" to dst.
+void EncodeKVRecordChecksum(char* dst, const Slice& header, const Slice& key,
+                            const Slice& value);
+// Whether "checksum", the 4 bytes after the value, matches the record of
+// "header", "key" and "value", which are contiguous from "header" on.
+bool VerifyKVRecordChecksum(const Slice& header, const Slice& key_and_value,
+                            const char* checksum);
+// Parse the header at the start of *input and move *input past it.
+// *checksummed tells whether the value is followed by kKVRecordChecksumSize
+// bytes of checksum. Returns false if *input is too short.
+bool GetKVRecordHeader(Slice* input, uint32_t* key_size, uint32_t* value_size,
+                       bool* compressed, bool* checksummed);
+
+// Compress "value" into *output with "type", a CompressionType. Returns
+// false if that does not save an eighth of it, the value is then stored raw.
+bool CompressKVValue(uint8_t type, const Slice& value, std::string* output);
+// Uncompress the compressed *value into *scratch and point *value to it.
+bool UncompressKVValue(Slice* value, std::string* scratch);
+// Point *key and *value to the record at the start of *input and move
+// *input past it. A compressed value is uncompressed into *scratch, or left
+// as it is stored if scratch is null. Returns false if *input is too short,
+// the value is corrupted, or "verify_checksum" is set and the record has a
+// checksum which does not match.
+bool GetKVRecord(Slice* input, Slice* key, Slice* value,
+                 std::string* scratch, bool verify_checksum = false);
+// Whether every record of "group" parses and matches its checksum if it
+// has one.
+bool VerifyKVRecords(Slice group);
+// Point *key and *value to the first record of "group" at or after
+// "target", which is an internal key, or *key to an empty slice if there is
+// none. Returns false if the group is corrupted.
+bool SeekKVRecord(const Comparator* comparator, Slice group,
+                  const Slice& target, Slice* key, Slice* value,
+                  std::string* scratch);
+// Whether "index_value" is an entry of a sparse index.
+bool IsSparseIndexEntry(const Slice& index_value);
+// One index or filter block to read by ReadRemoteBlocks() into a local slot
+// of "chunk".
+struct RemoteBlockRead {
+  ibv_mr* remote_mr;
+  Chunk_type chunk;
+  uint8_t target_node_id;
+  BlockContents* result;
+  Status s;
+};
+// Read every block of *reads and set its status, with the reads posted as
+// one batch per memory node and waited for together.
+void ReadRemoteBlocks(std::vector<RemoteBlockRead>* reads,
+                      const ReadOptions& options);
 Status ReadDataIndexBlock(ibv_mr* remote_mr, const ReadOptions& options,
                           BlockContents* result, uint8_t target_node_id);
 Status ReadFilterBlock(ibv_mr* remote_mr, const ReadOptions& options,
                        BlockContents* result, uint8_t target_node_id);
+// Copy bytes [offset, offset + n) of remote_mr into dst, through the
+// thread local read buffer. Used for the index partitions and the filter
+// pages which are left in the remote memory.
+Status ReadRemoteRange(ibv_mr* remote_mr, uint64_t offset, size_t n,
+                       char* dst, uint8_t target_node_id);
 // Implementation details follow.  Clients should ignore,
 
 inline BlockHandle::BlockHandle()
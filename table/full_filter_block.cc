@@ -2,22 +2,100 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+// Ahead of util/rdma.h, whose _mm_clflush macro clashes with the intrinsic.
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
 #include "table/full_filter_block.h"
 
+#include <algorithm>
+#include <thread>
 #include <utility>
 
 #include "dLSM/filter_policy.h"
+#include "dLSM/slice_transform.h"
 #include "util/coding.h"
 
 namespace dLSM {
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_BLOOM_PROBE_AVX2
+// LegacyBloomImpl::HashMayMatchPrepared with 8 probes per step. Probe i
+// tests bit (h + i * delta) of the cache line, so the 8 bit positions of a
+// step are computed and gathered as 32 bit words in one go.
+__attribute__((target("avx2"))) static bool HashMayMatchPreparedAVX2(
+    uint32_t h, int num_probes, const char* data_at_offset,
+    int log2_cache_line_bytes) {
+  const uint32_t delta = (h >> 17) | (h << 15);
+  const __m256i bit_mask =
+      _mm256_set1_epi32((1 << (log2_cache_line_bytes + 3)) - 1);
+  const __m256i ones = _mm256_set1_epi32(1);
+  const __m256i step = _mm256_set1_epi32(static_cast<int>(delta * 8));
+  __m256i hv = _mm256_add_epi32(
+      _mm256_set1_epi32(static_cast<int>(h)),
+      _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                         _mm256_set1_epi32(static_cast<int>(delta))));
+  for (int i = 0; i < num_probes; i += 8) {
+    __m256i bitpos = _mm256_and_si256(hv, bit_mask);
+    // Bit b of the line is bit b % 32 of little endian word b / 32.
+    __m256i words = _mm256_i32gather_epi32(
+        reinterpret_cast<const int*>(data_at_offset),
+        _mm256_srli_epi32(bitpos, 5), 4);
+    __m256i bits = _mm256_sllv_epi32(
+        ones, _mm256_and_si256(bitpos, _mm256_set1_epi32(31)));
+    __m256i set = _mm256_cmpeq_epi32(_mm256_and_si256(words, bits), bits);
+    int set_mask = _mm256_movemask_ps(_mm256_castsi256_ps(set));
+    int want = num_probes - i >= 8 ? 0xff : (1 << (num_probes - i)) - 1;
+    if ((set_mask & want) != want) {
+      return false;
+    }
+    hv = _mm256_add_epi32(hv, step);
+  }
+  return true;
+}
+
+static bool CPUHasAVX2() {
+  static const bool has_avx2 = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+  }();
+  return has_avx2;
+}
+#endif
+
 // See doc/table_format.md for an explanation of the filter block format.
 
+// A binary fuse filter is laid out as
+//    [fingerprints]                : array_length bytes
+//    [seed]                        : 8 bytes
+//    [segment_length]              : 4 bytes
+//    [segment_count_length]        : 4 bytes
+//    [kBinaryFuseMarker]           : 1 byte
+//    [array_length]                : 4 bytes
+// so that the last 5 bytes take the place of the Bloom filter's num_probes
+// and num_lines.
+static const char kBinaryFuseMarker = -2;
+static const size_t kBinaryFuseMetaSize = 21;
+static_assert(PartitionedFilterBlockReader::kMaxMetaSize ==
+                  kBinaryFuseMetaSize,
+              "the fuse filter has the largest metadata");
+// The bits of a Bloom filter are set this many cache lines at a time, a
+// stretch which stays in the cache while its hashes are added.
+static const uint32_t kLinesPerStretch = 4096;
+// The fewest hashes a thread adds, a filter of fewer is built by the
+// caller alone.
+static const size_t kMinHashesPerFilterThread = 1 << 18;
+
 FullFilterBlockBuilder::FullFilterBlockBuilder(ibv_mr* mr,
-                                               int bloombits_per_key)
-    : local_mr(mr), bits_per_key_(bloombits_per_key),
+                                               int bloombits_per_key,
+                                               FilterType type,
+                                               const SliceTransform* prefix_extractor)
+    : result((char*)mr->addr,0),
+      local_mr(mr), bits_per_key_(bloombits_per_key),
       num_probes_(LegacyNoLocalityBloomImpl::ChooseNumProbes(bits_per_key_)),
-      result((char*)mr->addr,0) {
+      filter_type_(type),
+      prefix_extractor_(prefix_extractor) {
 //  filter_bits_builder_ = std::make_unique<LegacyBloomImpl>();
 }
 
@@ -29,6 +107,7 @@ FullFilterBlockBuilder::FullFilterBlockBuilder(ibv_mr* mr,
 void FullFilterBlockBuilder::RestartBlock(uint64_t block_offset) {
 //  uint64_t filter_index = (block_offset / kFilterBase);
   hash_entries_.clear();
+  has_last_prefix_ = false;
 
 }
 //size_t FullFilterBlockBuilder::CurrentSizeEstimate() {
@@ -45,6 +124,17 @@ void FullFilterBlockBuilder::AddKey(const Slice& key) {
   if (hash_entries_.size() == 0 || hash != hash_entries_.back()) {
     hash_entries_.push_back(hash);
   }
+  if (prefix_extractor_ != nullptr && prefix_extractor_->InDomain(key)) {
+    Slice prefix = prefix_extractor_->Transform(key);
+    if (!has_last_prefix_ || prefix != Slice(last_prefix_)) {
+      last_prefix_.assign(prefix.data(), prefix.size());
+      has_last_prefix_ = true;
+      hash = BloomHash(prefix);
+      if (hash != hash_entries_.back()) {
+        hash_entries_.push_back(hash);
+      }
+    }
+  }
 }
 inline void FullFilterBlockBuilder::AddHash(uint32_t h, char* data,
                                             uint32_t num_lines,
@@ -89,7 +179,85 @@ uint32_t FullFilterBlockBuilder::CalculateSpace(const int num_entry,
   sz += 5;  // 4 bytes for num_lines, 1 byte for num_probes
   return sz;
 }
+bool FullFilterBlockBuilder::FinishBinaryFuse() {
+  BinaryFuse8 fuse(hash_entries_.size());
+  if (fuse.ArrayLength() + kBinaryFuseMetaSize > local_mr->length) {
+    return false;
+  }
+  char* data = const_cast<char*>(result.data());
+  std::vector<uint64_t> keys(hash_entries_.begin(), hash_entries_.end());
+  if (!fuse.Populate(keys, data)) {
+    return false;
+  }
+  char* meta = data + fuse.ArrayLength();
+  EncodeFixed64(meta, fuse.Seed());
+  EncodeFixed32(meta + 8, fuse.SegmentLength());
+  EncodeFixed32(meta + 12, fuse.SegmentCountLength());
+  meta[16] = kBinaryFuseMarker;
+  EncodeFixed32(meta + 17, fuse.ArrayLength());
+  hash_entries_.clear();
+  result.Reset(data, fuse.ArrayLength() + kBinaryFuseMetaSize);
+  return true;
+}
+void FullFilterBlockBuilder::AddHashes(char* data, uint32_t num_lines) {
+  const int log2_cache_line_bytes = std::log2(CACHE_LINE_SIZE);
+  const uint32_t stretches =
+      (num_lines + kLinesPerStretch - 1) / kLinesPerStretch;
+  if (stretches <= 1) {
+    for (uint32_t h : hash_entries_) {
+      AddHash(h, data, num_lines, num_lines * CACHE_LINE_SIZE * 8);
+    }
+    return;
+  }
+  // Counting sort the hashes by the stretch of their line, so that the
+  // bits are set a stretch at a time rather than all over the filter.
+  auto stretch_of = [&](uint32_t h) {
+    return (LegacyBloomImpl::GetLineOffset(h, num_lines,
+                                           log2_cache_line_bytes) >>
+            log2_cache_line_bytes) /
+           kLinesPerStretch;
+  };
+  std::vector<size_t> starts(stretches + 1, 0);
+  for (uint32_t h : hash_entries_) {
+    starts[stretch_of(h) + 1]++;
+  }
+  for (uint32_t s = 0; s < stretches; s++) {
+    starts[s + 1] += starts[s];
+  }
+  std::vector<uint32_t> sorted(hash_entries_.size());
+  std::vector<size_t> next(starts.begin(), starts.end() - 1);
+  for (uint32_t h : hash_entries_) {
+    sorted[next[stretch_of(h)]++] = h;
+  }
+  // The stretches are whole cache lines apart, the threads each take some
+  // of them.
+  const size_t threads = std::min<size_t>(
+      {std::max(std::thread::hardware_concurrency(), 1u),
+       sorted.size() / kMinHashesPerFilterThread, stretches});
+  auto add = [&](size_t first, size_t last) {
+    for (size_t i = starts[first]; i < starts[last]; i++) {
+      LegacyBloomImpl::AddHash(sorted[i], num_lines, num_probes_, data,
+                               log2_cache_line_bytes);
+    }
+  };
+  if (threads <= 1) {
+    add(0, stretches);
+    return;
+  }
+  std::vector<std::thread> adders;
+  for (size_t t = 0; t < threads; t++) {
+    adders.emplace_back(add, stretches * t / threads,
+                        stretches * (t + 1) / threads);
+  }
+  for (std::thread& adder : adders) {
+    adder.join();
+  }
+}
 void FullFilterBlockBuilder::Finish() {
+  // Fall back to the Bloom filter if the fuse filter can not be built.
+  if (filter_type_ == kBinaryFuseFilter && FinishBinaryFuse()) {
+    return;
+  }
   uint32_t total_bits, num_lines;
   size_t num_entries = hash_entries_.size();
   CalculateSpace(num_entries, &total_bits, &num_lines);
@@ -101,10 +269,7 @@ void FullFilterBlockBuilder::Finish() {
   assert(data);
   assert(total_bits/8 + 5 <= local_mr->length);
   if (total_bits != 0 && num_lines != 0) {
-    for (auto h : hash_entries_) {
-//      int log2_cache_line_bytes = std::log2(CACHE_LINE_SIZE);
-      AddHash(h, data, num_lines, total_bits);
-    }
+    AddHashes(data, num_lines);
 
     // Check for excessive entries for 32-bit hash function
     if (num_entries >= /* minimum of 3 million */ 3000000U) {
@@ -212,6 +377,13 @@ FullFilterBlockReader::FullFilterBlockReader(
   // LegacyBloomBitsBuilder as an API, but we are leaving those cases in
   // limbo with LegacyBloomBitsReader for now.
 
+  if (num_probes_ == kBinaryFuseMarker) {
+    if (!InitBinaryFuse(contents)) {
+      std::cerr << "corrupt binary fuse filter" << std::endl;
+      exit(1);
+    }
+    return;
+  }
   if (num_probes_ < 1) {
     // Note: < 0 (or unsigned > 127) indicate special new implementations
     // (or reserved for future use)
@@ -248,6 +420,29 @@ FullFilterBlockReader::FullFilterBlockReader(
   }
 }
 
+// Decode the binary fuse filter whose metadata ends "tail", the last bytes
+// of a filter of filter_size bytes.
+static BinaryFuse8* DecodeBinaryFuse(const Slice& tail, size_t filter_size) {
+  if (tail.size() < kBinaryFuseMetaSize) {
+    return nullptr;
+  }
+  const char* meta = tail.data() + tail.size() - kBinaryFuseMetaSize;
+  uint32_t array_length = DecodeFixed32(meta + 17);
+  uint32_t segment_length = DecodeFixed32(meta + 8);
+  uint32_t segment_count_length = DecodeFixed32(meta + 12);
+  if (array_length + kBinaryFuseMetaSize != filter_size ||
+      segment_length == 0 ||
+      (segment_length & (segment_length - 1)) != 0 ||
+      segment_count_length + 2 * uint64_t{segment_length} > array_length) {
+    return nullptr;
+  }
+  return new BinaryFuse8(DecodeFixed64(meta), segment_length,
+                         segment_count_length, array_length);
+}
+bool FullFilterBlockReader::InitBinaryFuse(const Slice& contents) {
+  fuse_.reset(DecodeBinaryFuse(contents, contents.size()));
+  return fuse_ != nullptr;
+}
 //bool FullFilterBlockReader::KeyMayMatch(uint64_t block_offset, const Slice& key) {
 //  uint64_t index = block_offset >> base_lg_;
 //  if (index < num_) {
@@ -263,14 +458,27 @@ FullFilterBlockReader::FullFilterBlockReader(
 //  }
 //  return true;  // Errors are treated as potential matches
 //}
+bool FullFilterBlockReader::HashMayMatchPrepared(uint32_t hash,
+                                                 uint32_t byte_offset) const {
+#ifdef HAVE_BLOOM_PROBE_AVX2
+  if (CPUHasAVX2()) {
+    return HashMayMatchPreparedAVX2(hash, num_probes_, data_ + byte_offset,
+                                    log2_cache_line_size_);
+  }
+#endif
+  return LegacyBloomImpl::HashMayMatchPrepared(
+      hash, num_probes_, data_ + byte_offset, log2_cache_line_size_);
+}
 bool FullFilterBlockReader::KeyMayMatch(const Slice& key) {
 //  auto start = std::chrono::high_resolution_clock::now();
   uint32_t hash = BloomHash(key);
+  if (fuse_ != nullptr) {
+    return fuse_->MayContain(hash, data_);
+  }
   uint32_t byte_offset;
   LegacyBloomImpl::PrepareHashMayMatch(
       hash, num_lines_, data_, /*out*/ &byte_offset, log2_cache_line_size_);
-  bool ret = LegacyBloomImpl::HashMayMatchPrepared(
-      hash, num_probes_, data_ + byte_offset, log2_cache_line_size_);
+  bool ret = HashMayMatchPrepared(hash, byte_offset);
 //  auto stop = std::chrono::high_resolution_clock::now();
 //  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
 //      std::printf("bloom filter check time elapse is %zu\n",  duration.count());
@@ -278,6 +486,34 @@ bool FullFilterBlockReader::KeyMayMatch(const Slice& key) {
 
 
 
+}
+void FullFilterBlockReader::KeysMayMatch(const Slice* keys, size_t n,
+                                         bool* results) {
+  constexpr size_t kBatch = 16;
+  uint32_t hashes[kBatch];
+  uint32_t byte_offsets[kBatch];
+  for (size_t start = 0; start < n; start += kBatch) {
+    size_t batch = std::min(kBatch, n - start);
+    if (fuse_ != nullptr) {
+      for (size_t i = 0; i < batch; i++) {
+        hashes[i] = BloomHash(keys[start + i]);
+        fuse_->Prefetch(hashes[i], data_);
+      }
+      for (size_t i = 0; i < batch; i++) {
+        results[start + i] = fuse_->MayContain(hashes[i], data_);
+      }
+      continue;
+    }
+    for (size_t i = 0; i < batch; i++) {
+      hashes[i] = BloomHash(keys[start + i]);
+      LegacyBloomImpl::PrepareHashMayMatch(hashes[i], num_lines_, data_,
+                                           &byte_offsets[i],
+                                           log2_cache_line_size_);
+    }
+    for (size_t i = 0; i < batch; i++) {
+      results[start + i] = HashMayMatchPrepared(hashes[i], byte_offsets[i]);
+    }
+  }
 }
 FullFilterBlockReader::~FullFilterBlockReader() {
   if (filter_side == Compute){
@@ -290,4 +526,80 @@ FullFilterBlockReader::~FullFilterBlockReader() {
 
 }
 
+PartitionedFilterBlockReader::PartitionedFilterBlockReader(
+    const Slice& tail, size_t filter_size, size_t page_size,
+    PageReader page_reader, void* arg, Cache* cache)
+    : page_size_((page_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE *
+                 CACHE_LINE_SIZE),
+      page_reader_(page_reader),
+      arg_(arg),
+      cache_(cache) {
+  if (tail.size() <= 5 || tail.size() > filter_size) {
+    std::cerr << "corrupt bloom filter" << std::endl;
+    always_match_ = true;
+    return;
+  }
+  // The same metadata as FullFilterBlockReader decodes.
+  num_probes_ = static_cast<int>(tail.data()[tail.size() - 5]);
+  if (num_probes_ == kBinaryFuseMarker) {
+    fuse_.reset(DecodeBinaryFuse(tail, filter_size));
+    if (fuse_ == nullptr) {
+      std::cerr << "corrupt binary fuse filter" << std::endl;
+      always_match_ = true;
+    }
+    return;
+  }
+  num_lines_ = DecodeFixed32(tail.data() + tail.size() - 4);
+  if (num_probes_ < 1 || num_lines_ == 0 ||
+      num_lines_ * CACHE_LINE_SIZE != filter_size - 5) {
+    std::cerr << "corrupt bloom filter" << std::endl;
+    always_match_ = true;
+    return;
+  }
+  log2_cache_line_size_ = std::log2(CACHE_LINE_SIZE);
+}
+const char* PartitionedFilterBlockReader::ReadAt(uint32_t offset,
+                                                 Cache::Handle** handle) {
+  Slice page;
+  *handle = (*page_reader_)(arg_, offset / page_size_, &page);
+  if (*handle == nullptr || offset % page_size_ >= page.size()) {
+    if (*handle != nullptr) {
+      cache_->Release(*handle);
+    }
+    return nullptr;
+  }
+  return page.data() + offset % page_size_;
+}
+bool PartitionedFilterBlockReader::KeyMayMatch(const Slice& key) {
+  if (always_match_) {
+    return true;
+  }
+  uint32_t hash = BloomHash(key);
+  Cache::Handle* handle;
+  if (fuse_ != nullptr) {
+    uint32_t h[3];
+    uint8_t f = fuse_->Probe(hash, &h[0], &h[1], &h[2]);
+    for (uint32_t slot : h) {
+      const char* p = ReadAt(slot, &handle);
+      if (p == nullptr) {
+        return true;
+      }
+      f ^= static_cast<uint8_t>(*p);
+      cache_->Release(handle);
+    }
+    return f == 0;
+  }
+  // A probed cache line never crosses a page.
+  const char* line = ReadAt(LegacyBloomImpl::GetLineOffset(
+                                hash, num_lines_, log2_cache_line_size_),
+                            &handle);
+  if (line == nullptr) {
+    return true;
+  }
+  bool ret = LegacyBloomImpl::HashMayMatchPrepared(hash, num_probes_, line,
+                                                   log2_cache_line_size_);
+  cache_->Release(handle);
+  return ret;
+}
+
 }  // namespace dLSM
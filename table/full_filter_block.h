@@ -7,11 +7,14 @@
 #include <complex>
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "dLSM/cache.h"
 #include "dLSM/options.h"
 #include "dLSM/slice.h"
+#include "util/binary_fuse.h"
 #include "util/bloom_impl.h"
 #include "util/hash.h"
 
@@ -22,6 +25,7 @@ using LegacyBloomImpl = LegacyLocalityBloomImpl</*ExtraRotates*/ false>;
 class FilterPolicy;
 class Env;
 class Options;
+class SliceTransform;
 enum FilterSide { Compute, Memory};
 
 // A FullFilterBlockBuilder is used to construct all of the filters for a
@@ -32,7 +36,11 @@ enum FilterSide { Compute, Memory};
 //      (StartBlock AddKey*)* Finish
 class FullFilterBlockBuilder {
  public:
-  explicit FullFilterBlockBuilder(ibv_mr* mr, int bloombits_per_key);
+  // The prefixes "prefix_extractor" extracts from the keys are added along
+  // with them, unless it is nullptr.
+  FullFilterBlockBuilder(ibv_mr* mr, int bloombits_per_key,
+                         FilterType type = kBloomFilter,
+                         const SliceTransform* prefix_extractor = nullptr);
   FullFilterBlockBuilder(const FullFilterBlockBuilder&) = delete;
   FullFilterBlockBuilder& operator=(const FullFilterBlockBuilder&) = delete;
 
@@ -51,6 +59,10 @@ class FullFilterBlockBuilder {
   Slice result;           // Filter data computed so far
  private:
 //  void GenerateFilter();
+  // Finish() for kBinaryFuseFilter, false if the filter could not be built.
+  bool FinishBinaryFuse();
+  // Set the bits of hash_entries_ in the num_lines cache lines of "data".
+  void AddHashes(char* data, uint32_t num_lines);
 
 //  const FilterPolicy* policy_;
 //  std::shared_ptr<RDMA_Manager> rdma_mg_;
@@ -59,6 +71,11 @@ class FullFilterBlockBuilder {
 //  std::unique_ptr<LegacyBloomImpl> filter_bits_builder_;
   int bits_per_key_;
   int num_probes_;
+  FilterType filter_type_;
+  const SliceTransform* prefix_extractor_;
+  // The prefix of the last key added, the keys of a prefix are adjacent.
+  std::string last_prefix_;
+  bool has_last_prefix_ = false;
   std::vector<uint32_t> hash_entries_;
 //  std::string keys_;             // Flattened key contents
 //  std::vector<size_t> start_;    // Starting index in keys_ of each key
@@ -75,7 +92,13 @@ class FullFilterBlockReader {
                         std::shared_ptr<RDMA_Manager> rdma_mg, FilterSide side);
   ~FullFilterBlockReader();
   bool KeyMayMatch(const Slice& key); // full filter.
+  // KeyMayMatch() of keys[0..n-1] into results[0..n-1]. The cache lines of
+  // all the keys are prefetched before any of them is probed.
+  void KeysMayMatch(const Slice* keys, size_t n, bool* results);
  private:
+  bool HashMayMatchPrepared(uint32_t hash, uint32_t byte_offset) const;
+  // Decode a binary fuse filter, false if contents is not one.
+  bool InitBinaryFuse(const Slice& contents);
 //  const FilterPolicy* policy_;
 //  std::unique_ptr<FilterBitsReader> filter_bits_reader_;
 
@@ -84,6 +107,8 @@ class FullFilterBlockReader {
   int num_probes_ = 0;
   uint32_t num_lines_ = 0;
   uint32_t log2_cache_line_size_ = 0;
+  // Set if the filter is a binary fuse filter rather than a Bloom filter.
+  std::unique_ptr<BinaryFuse8> fuse_;
 
 //  const char* data_;    // Pointer to filter data (at block-start)
   size_t filter_size;
@@ -92,5 +117,47 @@ class FullFilterBlockReader {
   FilterSide filter_side;
 };
 
+// Probes a full filter which is left in the remote memory, for
+// Options::partitioned_table_meta. Only the metadata at the end of the
+// filter is local; the pages a key probes are read on demand through
+// page_reader, which returns the cache handle to release once the page is
+// probed.
+class PartitionedFilterBlockReader {
+ public:
+  typedef Cache::Handle* (*PageReader)(void* arg, uint32_t page_index,
+                                       Slice* page);
+  // The largest metadata a filter ends with.
+  static constexpr size_t kMaxMetaSize = 21;
+
+  // "tail" is the end of a filter of filter_size bytes, at least
+  // kMaxMetaSize bytes of it unless the filter is shorter. page_size is
+  // rounded up to whole cache lines.
+  PartitionedFilterBlockReader(const Slice& tail, size_t filter_size,
+                               size_t page_size, PageReader page_reader,
+                               void* arg, Cache* cache);
+  PartitionedFilterBlockReader(const PartitionedFilterBlockReader&) = delete;
+  PartitionedFilterBlockReader& operator=(
+      const PartitionedFilterBlockReader&) = delete;
+
+  bool KeyMayMatch(const Slice& key);
+
+ private:
+  // Point to byte "offset" of the filter within its page, which is pinned
+  // by *handle. Returns nullptr if the page can not be read, which the
+  // caller treats as a match.
+  const char* ReadAt(uint32_t offset, Cache::Handle** handle);
+
+  size_t page_size_;
+  PageReader page_reader_;
+  void* arg_;
+  Cache* cache_;
+  // Set if the filter is broken, every key matches.
+  bool always_match_ = false;
+  int num_probes_ = 0;
+  uint32_t num_lines_ = 0;
+  uint32_t log2_cache_line_size_ = 0;
+  std::unique_ptr<BinaryFuse8> fuse_;
+};
+
 }  // namespace dLSM
 #endif  // dLSM_FULL_FILTER_BLOCK_H
@@ -0,0 +1,61 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "table/hash_index.h"
+
+#include "db/dbformat.h"
+#include "util/hash.h"
+
+namespace dLSM {
+
+uint32_t HashIndex::HashKey(const Slice& user_key) {
+  return Hash(user_key.data(), user_key.size(), 0x9e3779b9);
+}
+
+HashIndex* HashIndex::Build(const std::vector<Slice>& restart_keys) {
+  if (restart_keys.empty()) {
+    return nullptr;
+  }
+  // Open addressing with linear probing, at most 3/4 full.
+  size_t num_slots = 16;
+  while (num_slots * 3 < restart_keys.size() * 4) {
+    num_slots *= 2;
+  }
+  HashIndex* index = new HashIndex(num_slots);
+  Slice last_user_key;
+  for (size_t i = 0; i < restart_keys.size(); i++) {
+    Slice user_key = ExtractUserKey(restart_keys[i]);
+    // The entries of a user key are next to each other, newest first.
+    if (i > 0 && user_key == last_user_key) {
+      continue;
+    }
+    last_user_key = user_key;
+    const uint32_t hash = HashKey(user_key);
+    uint32_t slot = hash & index->mask_;
+    while (index->slots_[slot].index != kEmpty) {
+      slot = (slot + 1) & index->mask_;
+    }
+    index->slots_[slot].hash = hash;
+    index->slots_[slot].index = static_cast<uint32_t>(i);
+  }
+  return index;
+}
+
+size_t HashIndex::Lookup(const Slice& user_key, uint32_t* candidates) const {
+  const uint32_t hash = HashKey(user_key);
+  size_t found = 0;
+  for (uint32_t slot = hash & mask_; slots_[slot].index != kEmpty;
+       slot = (slot + 1) & mask_) {
+    if (slots_[slot].hash != hash) {
+      continue;
+    }
+    if (found == kMaxCandidates) {
+      return kMaxCandidates + 1;
+    }
+    candidates[found++] = slots_[slot].index;
+  }
+  return found;
+}
+
+}  // namespace dLSM
@@ -0,0 +1,62 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_TABLE_HASH_INDEX_H_
+#define STORAGE_dLSM_TABLE_HASH_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "dLSM/slice.h"
+
+namespace dLSM {
+
+// A hash table from the user keys of a dense index block of a byte
+// addressable table, where every record has its own entry, to the restart
+// point of the newest entry of the key. A point lookup goes straight to the
+// entry rather than binary searching the block, and a key the table does
+// not hold is ruled out without looking at the block at all.
+//
+// The table keeps a 32 bit hash of the key only, so a hit has to be checked
+// against the key of the block.
+class HashIndex {
+ public:
+  // Most restart points Lookup() reports for a key.
+  static const size_t kMaxCandidates = 4;
+
+  // restart_keys are the internal keys at the restart points of the block,
+  // in order. Returns nullptr if the block is empty.
+  static HashIndex* Build(const std::vector<Slice>& restart_keys);
+
+  // Store in candidates[] the restart points of the newest entries of the
+  // user keys hashing like "user_key", and return how many there are. 0
+  // means the block does not hold user_key. Returns kMaxCandidates + 1 if
+  // there are more than kMaxCandidates, the caller has to search the block
+  // then.
+  size_t Lookup(const Slice& user_key, uint32_t* candidates) const;
+
+  size_t ApproximateMemoryUsage() const {
+    return sizeof(*this) + slots_.capacity() * sizeof(Slot);
+  }
+
+ private:
+  struct Slot {
+    uint32_t hash;
+    uint32_t index;  // Restart index, kEmpty if the slot is free
+  };
+  static const uint32_t kEmpty = ~static_cast<uint32_t>(0);
+
+  explicit HashIndex(size_t num_slots)
+      : mask_(num_slots - 1), slots_(num_slots, Slot{0, kEmpty}) {}
+
+  static uint32_t HashKey(const Slice& user_key);
+
+  const uint32_t mask_;
+  std::vector<Slot> slots_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_TABLE_HASH_INDEX_H_
@@ -6,12 +6,14 @@
 
 namespace dLSM {
 
-Iterator::Iterator() {
+Cleanable::Cleanable() {
   cleanup_head_.function = nullptr;
   cleanup_head_.next = nullptr;
 }
 
-Iterator::~Iterator() {
+Cleanable::~Cleanable() { DoCleanup(); }
+
+void Cleanable::DoCleanup() {
   if (!cleanup_head_.IsEmpty()) {
     cleanup_head_.Run();
     for (CleanupNode* node = cleanup_head_.next; node != nullptr;) {
@@ -23,7 +25,7 @@ Iterator::~Iterator() {
   }
 }
 
-void Iterator::RegisterCleanup(CleanupFunction func, void* arg1, void* arg2) {
+void Cleanable::RegisterCleanup(CleanupFunction func, void* arg1, void* arg2) {
   assert(func != nullptr);
   CleanupNode* node;
   if (cleanup_head_.IsEmpty()) {
@@ -38,6 +40,41 @@ void Iterator::RegisterCleanup(CleanupFunction func, void* arg1, void* arg2) {
   node->arg2 = arg2;
 }
 
+void Cleanable::RegisterCleanup(CleanupNode* node) {
+  assert(node != nullptr && !node->IsEmpty());
+  if (cleanup_head_.IsEmpty()) {
+    cleanup_head_ = *node;
+    cleanup_head_.next = nullptr;
+    delete node;
+  } else {
+    node->next = cleanup_head_.next;
+    cleanup_head_.next = node;
+  }
+}
+
+void Cleanable::DelegateCleanupsTo(Cleanable* other) {
+  assert(other != nullptr && other != this);
+  if (cleanup_head_.IsEmpty()) {
+    return;
+  }
+  // The head is inlined in this object, only its contents can move.
+  other->RegisterCleanup(cleanup_head_.function, cleanup_head_.arg1,
+                         cleanup_head_.arg2);
+  for (CleanupNode* node = cleanup_head_.next; node != nullptr;) {
+    CleanupNode* next_node = node->next;
+    other->RegisterCleanup(node);
+    node = next_node;
+  }
+  cleanup_head_.function = nullptr;
+  cleanup_head_.next = nullptr;
+}
+
+Iterator::Iterator() = default;
+
+Iterator::~Iterator() = default;
+
+Status Iterator::Refresh() { return Status::NotSupported("Refresh"); }
+
 namespace {
 
 class EmptyIterator : public Iterator {
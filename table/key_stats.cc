@@ -0,0 +1,100 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "table/key_stats.h"
+
+#include <algorithm>
+
+#include "dLSM/comparator.h"
+#include "util/coding.h"
+
+namespace dLSM {
+
+void TableKeyStats::Add(const Slice& key, size_t value_size) {
+  raw_key_size += key.size();
+  raw_value_size += value_size;
+  if (added_++ % stride_ != 0) {
+    return;
+  }
+  samples_.emplace_back(key.data(), key.size());
+  if (samples_.size() == kMaxSamples) {
+    // Keep the keys of the entries at multiples of the doubled stride.
+    for (size_t i = 0; i < kMaxSamples / 2; i++) {
+      samples_[i].swap(samples_[2 * i]);
+    }
+    samples_.resize(kMaxSamples / 2);
+    stride_ *= 2;
+  }
+}
+
+double TableKeyStats::FractionBefore(const Comparator* comparator,
+                                     const Slice& key,
+                                     uint64_t num_entries) const {
+  if (samples_.empty() || num_entries == 0) {
+    return 0;
+  }
+  const size_t n =
+      std::lower_bound(samples_.begin(), samples_.end(), key,
+                       [comparator](const std::string& sample,
+                                    const Slice& k) {
+                         return comparator->Compare(sample, k) < 0;
+                       }) -
+      samples_.begin();
+  if (n == 0) {
+    return 0;
+  }
+  // "key" is after the (n - 1)-th sampled entry and not after the n-th,
+  // taken halfway between them.
+  const double low = static_cast<double>(n - 1) * stride_;
+  const double high = n < samples_.size()
+                          ? static_cast<double>(n) * stride_
+                          : static_cast<double>(num_entries);
+  return std::min(1.0, (low + high) / 2 / num_entries);
+}
+
+void TableKeyStats::EncodeTo(std::string* dst) const {
+  PutVarint64(dst, raw_key_size);
+  PutVarint64(dst, raw_value_size);
+  PutVarint64(dst, stride_);
+  PutVarint32(dst, static_cast<uint32_t>(samples_.size()));
+  // Each key as the length it shares with the one before and the rest.
+  Slice previous;
+  for (const std::string& sample : samples_) {
+    const size_t limit = std::min(previous.size(), sample.size());
+    size_t shared = 0;
+    while (shared < limit && previous[shared] == sample[shared]) {
+      shared++;
+    }
+    PutVarint32(dst, static_cast<uint32_t>(shared));
+    PutLengthPrefixedSlice(
+        dst, Slice(sample.data() + shared, sample.size() - shared));
+    previous = sample;
+  }
+}
+
+bool TableKeyStats::DecodeFrom(Slice* input) {
+  uint32_t count;
+  if (!GetVarint64(input, &raw_key_size) ||
+      !GetVarint64(input, &raw_value_size) || !GetVarint64(input, &stride_) ||
+      stride_ == 0 || !GetVarint32(input, &count) || count > kMaxSamples) {
+    return false;
+  }
+  samples_.clear();
+  samples_.reserve(count);
+  std::string previous;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t shared;
+    Slice rest;
+    if (!GetVarint32(input, &shared) || shared > previous.size() ||
+        !GetLengthPrefixedSlice(input, &rest)) {
+      return false;
+    }
+    previous.resize(shared);
+    previous.append(rest.data(), rest.size());
+    samples_.push_back(previous);
+  }
+  return true;
+}
+
+}  // namespace dLSM
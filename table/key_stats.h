@@ -0,0 +1,59 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_TABLE_KEY_STATS_H_
+#define STORAGE_dLSM_TABLE_KEY_STATS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "dLSM/slice.h"
+
+namespace dLSM {
+
+class Comparator;
+
+// The sizes of the keys and values of a table before compression and a
+// few of its keys evenly spaced by entry, gathered as the table is built
+// and kept with its metadata. They place a key within the table without
+// reading its index, see VersionSet::ApproximateOffsetOf().
+//
+// The sample keeps every stride-th key, the stride doubling whenever the
+// sample fills, so that a table of at least kMaxSamples / 2 entries has
+// between kMaxSamples / 2 and kMaxSamples keys sampled whatever its size.
+class TableKeyStats {
+ public:
+  static const size_t kMaxSamples = 16;
+
+  // Account the next entry of the table.
+  // REQUIRES: "key" is after the keys added before.
+  void Add(const Slice& key, size_t value_size);
+
+  // Whether the stats have a sample, which the tables built before they
+  // were kept have not.
+  bool empty() const { return samples_.empty(); }
+
+  // The fraction of the "num_entries" entries of the table before "key",
+  // from the sample. "comparator" orders the keys added.
+  double FractionBefore(const Comparator* comparator, const Slice& key,
+                        uint64_t num_entries) const;
+
+  void EncodeTo(std::string* dst) const;
+  bool DecodeFrom(Slice* input);
+
+  uint64_t raw_key_size = 0;
+  uint64_t raw_value_size = 0;
+
+ private:
+  // The entries from one sampled key to the next.
+  uint64_t stride_ = 1;
+  uint64_t added_ = 0;
+  std::vector<std::string> samples_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_TABLE_KEY_STATS_H_
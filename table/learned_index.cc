@@ -0,0 +1,130 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "table/learned_index.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "db/dbformat.h"
+
+namespace dLSM {
+
+// Below this many restart points the binary search is as cheap.
+static const size_t kMinRestartsForModel = 64;
+
+LearnedIndex* LearnedIndex::Build(const std::vector<Slice>& restart_keys) {
+  const size_t n = restart_keys.size();
+  if (n < kMinRestartsForModel) {
+    return nullptr;
+  }
+  for (const Slice& key : restart_keys) {
+    if (key.size() < 8) {
+      return nullptr;
+    }
+  }
+  // The keys are sorted, so the prefix all of them share is the one the
+  // first and the last share.
+  Slice first = ExtractUserKey(restart_keys.front());
+  Slice last = ExtractUserKey(restart_keys.back());
+  size_t prefix_length = 0;
+  while (prefix_length < first.size() && prefix_length < last.size() &&
+         first[prefix_length] == last[prefix_length]) {
+    prefix_length++;
+  }
+  LearnedIndex* model = new LearnedIndex(Slice(first.data(), prefix_length),
+                                         static_cast<uint32_t>(n));
+
+  // Greedy shrinking cone: extend the segment while a line through its
+  // first point passes within kMaxError of every point added. The points
+  // are the first restart index of every distinct projection.
+  const double error = kMaxError;
+  Segment segment = {model->Project(first), 0, 0};
+  double slope_low = 0;
+  double slope_high = std::numeric_limits<double>::infinity();
+  uint64_t previous = segment.first_key;
+  for (uint32_t i = 1; i < n; i++) {
+    uint64_t x = model->Project(ExtractUserKey(restart_keys[i]));
+    if (x == previous) {
+      continue;
+    }
+    previous = x;
+    double dx = static_cast<double>(x - segment.first_key);
+    double dy = static_cast<double>(i - segment.first_index);
+    double low = (dy - error) / dx;
+    double high = (dy + error) / dx;
+    if (low <= slope_high && high >= slope_low) {
+      slope_low = std::max(slope_low, low);
+      slope_high = std::min(slope_high, high);
+      continue;
+    }
+    segment.slope = slope_high == std::numeric_limits<double>::infinity()
+                        ? slope_low
+                        : (slope_low + slope_high) / 2;
+    model->segments_.push_back(segment);
+    segment = {x, i, 0};
+    slope_low = 0;
+    slope_high = std::numeric_limits<double>::infinity();
+  }
+  segment.slope = slope_high == std::numeric_limits<double>::infinity()
+                      ? slope_low
+                      : (slope_low + slope_high) / 2;
+  model->segments_.push_back(segment);
+  // Not shrink_to_fit(), which is a no-op without exceptions.
+  std::vector<Segment>(model->segments_).swap(model->segments_);
+  return model;
+}
+
+uint64_t LearnedIndex::Project(const Slice& user_key) const {
+  uint64_t x = 0;
+  for (size_t i = 0; i < 8; i++) {
+    size_t pos = prefix_.size() + i;
+    uint8_t byte =
+        pos < user_key.size() ? static_cast<uint8_t>(user_key[pos]) : 0;
+    x = (x << 8) | byte;
+  }
+  return x;
+}
+
+int64_t LearnedIndex::Position(uint64_t key) const {
+  auto iter = std::upper_bound(
+      segments_.begin(), segments_.end(), key,
+      [](uint64_t k, const Segment& s) { return k < s.first_key; });
+  if (iter == segments_.begin()) {
+    return 0;
+  }
+  --iter;
+  return iter->first_index +
+         static_cast<int64_t>(iter->slope *
+                              static_cast<double>(key - iter->first_key));
+}
+
+void LearnedIndex::Predict(const Slice& target, uint32_t* left,
+                           uint32_t* right) const {
+  Slice user_key = ExtractUserKey(target);
+  // Keys out of the shared prefix are before or after all the block.
+  int r = Slice(user_key.data(), std::min(user_key.size(), prefix_.size()))
+              .compare(prefix_);
+  if (r < 0) {
+    *left = *right = 0;
+    return;
+  }
+  if (r > 0) {
+    *left = *right = num_restarts_ - 1;
+    return;
+  }
+  uint64_t x = Project(user_key);
+  // The restart points whose projection is below x are below target and
+  // the ones whose projection is above x are above it.
+  int64_t low = Position(x) - kMaxError - 1;
+  int64_t high = x == std::numeric_limits<uint64_t>::max()
+                     ? num_restarts_ - 1
+                     : Position(x + 1) + kMaxError;
+  *left = static_cast<uint32_t>(
+      std::min<int64_t>(std::max<int64_t>(low, 0), num_restarts_ - 1));
+  *right = static_cast<uint32_t>(
+      std::min<int64_t>(std::max<int64_t>(high, *left), num_restarts_ - 1));
+}
+
+}  // namespace dLSM
@@ -0,0 +1,66 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_TABLE_LEARNED_INDEX_H_
+#define STORAGE_dLSM_TABLE_LEARNED_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "dLSM/slice.h"
+
+namespace dLSM {
+
+// A piecewise linear model of the restart points of an index block of
+// internal keys under the bytewise comparator. For a key it predicts the
+// window of restart points the binary search of Block::Iter::Seek has to
+// look at, so that the search takes a few steps rather than log2 of the
+// number of entries. The model is a guess: the block iterator checks the
+// window and searches the whole block if it is wrong.
+//
+// The user keys are projected to the 8 bytes following the prefix which
+// all the keys of the block share, which suits fixed width keys.
+class LearnedIndex {
+ public:
+  // Prediction error bound of the model, in restart points.
+  static const uint32_t kMaxError = 32;
+
+  // restart_keys are the keys at the restart points of the block, in order.
+  // Returns nullptr if the block is too small for a model to pay off.
+  static LearnedIndex* Build(const std::vector<Slice>& restart_keys);
+
+  // Set [*left, *right] to the window of the last restart point whose key
+  // is smaller than internal key "target".
+  void Predict(const Slice& target, uint32_t* left, uint32_t* right) const;
+
+  size_t ApproximateMemoryUsage() const {
+    return sizeof(*this) + prefix_.capacity() +
+           segments_.capacity() * sizeof(Segment);
+  }
+
+ private:
+  struct Segment {
+    uint64_t first_key;    // Projection of the first key of the segment
+    uint32_t first_index;  // Restart index of the first key
+    double slope;
+  };
+
+  LearnedIndex(const Slice& prefix, uint32_t num_restarts)
+      : prefix_(prefix.ToString()), num_restarts_(num_restarts) {}
+
+  uint64_t Project(const Slice& user_key) const;
+  // Approximate index of the first restart point whose projection is at
+  // least key.
+  int64_t Position(uint64_t key) const;
+
+  const std::string prefix_;
+  const uint32_t num_restarts_;
+  std::vector<Segment> segments_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_TABLE_LEARNED_INDEX_H_
@@ -4,6 +4,10 @@
 
 #include "table/merger.h"
 
+#include <algorithm>
+#include <vector>
+
+#include "db/dbformat.h"
 #include "dLSM/comparator.h"
 #include "dLSM/iterator.h"
 #include "table/iterator_wrapper.h"
@@ -13,15 +17,31 @@ namespace dLSM {
 //namespace {
 class MergingIterator : public Iterator {
  public:
-  MergingIterator(const Comparator* comparator, Iterator** children, int n)
+  MergingIterator(const Comparator* comparator, Iterator** children, int n,
+                  const InternalKeyComparator* icmp,
+                  const Slice* smallest = nullptr,
+                  const Slice* largest = nullptr)
       : comparator_(comparator),
+        icmp_(icmp),
+        bytewise_(icmp != nullptr),
         children_(new IteratorWrapper[n]),
         n_(n),
+        leaves_(1),
+        pending_(n, kPositioned),
         current_(nullptr),
         direction_(kForward) {
     for (int i = 0; i < n; i++) {
       children_[i].Set(children[i]);
     }
+    while (leaves_ < n_) {
+      leaves_ *= 2;
+    }
+    tree_.resize(leaves_);
+    prefixes_.resize(n_);
+    if (smallest != nullptr) {
+      smallest_.assign(smallest, smallest + n);
+      largest_.assign(largest, largest + n);
+    }
   }
 
   ~MergingIterator() override { delete[] children_; }
@@ -30,9 +50,14 @@ class MergingIterator : public Iterator {
 
   void SeekToFirst() override {
     for (int i = 0; i < n_; i++) {
-      children_[i].SeekToFirst();
+      if (HasRange(i)) {
+        pending_[i] = kFirstPending;
+      } else {
+        children_[i].SeekToFirst();
+      }
     }
-    FindSmallest();
+    BuildTree();
+    PositionWinner();
 #ifndef NDEBUG
     if (!Valid()) assert(false);
 #endif
@@ -41,6 +66,7 @@ class MergingIterator : public Iterator {
 
   void SeekToLast() override {
     for (int i = 0; i < n_; i++) {
+      pending_[i] = kPositioned;
       children_[i].SeekToLast();
     }
     FindLargest();
@@ -48,10 +74,24 @@ class MergingIterator : public Iterator {
   }
 
   void Seek(const Slice& target) override {
+    target_.assign(target.data(), target.size());
     for (int i = 0; i < n_; i++) {
+      pending_[i] = kPositioned;
+      if (HasRange(i)) {
+        if (Compare(target, largest_[i]) > 0) {
+          pending_[i] = kPastEnd;
+          continue;
+        }
+        if (Compare(smallest_[i], target) >= 0) {
+          // Its first key is the next one at or after the target.
+          pending_[i] = kSeekPending;
+          continue;
+        }
+      }
       children_[i].Seek(target);
     }
-    FindSmallest();
+    BuildTree();
+    PositionWinner();
     direction_ = kForward;
   }
 
@@ -68,25 +108,29 @@ class MergingIterator : public Iterator {
         IteratorWrapper* child = &children_[i];
         if (child != current_) {
           //TODO(ruihong): Make the iterator not seek again, it should suppose to stay at the old position.
+          pending_[i] = kPositioned;
           child->Seek(key());
           if (child->Valid() &&
-              comparator_->Compare(key(), child->key()) == 0) {
+              Compare(key(), child->key()) == 0) {
             child->Next();
           }
         }
       }
       direction_ = kForward;
+      current_->Next();
+      BuildTree();
+    } else {
+      current_->Next();
+      ReplayWinner();
+      PositionWinner();
     }
-
-    current_->Next();
-    FindSmallest();
 #ifndef NDEBUG
     if (Valid()){
       if (num_entries > 0) {
 //        printf("key is %.*s look at here\n", 29, key().data());
 //        printf("key length is %zu" , key().size());
 //        printf("key char pointer is %p", key().data());
-        assert(comparator_->Compare(key(), Slice(last_key)) > 0);
+        assert(Compare(key(), Slice(last_key)) > 0);
       }
       num_entries++;
       last_key = current_->key().ToString();
@@ -106,6 +150,7 @@ class MergingIterator : public Iterator {
       for (int i = 0; i < n_; i++) {
         IteratorWrapper* child = &children_[i];
         if (child != current_) {
+          pending_[i] = kPositioned;
           child->Seek(key());
           if (child->Valid()) {
             // Child is at first entry >= key().  Step back one to be < key()
@@ -147,45 +192,157 @@ class MergingIterator : public Iterator {
  private:
   // Which direction is the iterator moving?
   enum Direction { kForward, kReverse };
+  // Where a child is left by the last seek. A pending child stands at the
+  // smallest key of its range until it is positioned.
+  enum Pending : char { kPositioned, kSeekPending, kFirstPending, kPastEnd };
 
-  void FindSmallest();
+  bool HasRange(int i) const {
+    return !smallest_.empty() && !smallest_[i].empty();
+  }
+  bool ChildValid(int i) const {
+    return pending_[i] == kPositioned ? children_[i].Valid()
+                                      : pending_[i] != kPastEnd;
+  }
+  Slice ChildKey(int i) const {
+    return pending_[i] == kPositioned ? children_[i].key() : smallest_[i];
+  }
+  // Position the pending winners until the winner is a positioned child.
+  void PositionWinner();
+
+  // The forward direction goes through a loser tree (tournament tree) over
+  // the children, so that a step costs log2(n) comparisons rather than n:
+  // with up to 32 level 0 files in a compaction the linear scan dominated.
+  // tree_[0] is the smallest child and tree_[i], i >= 1, the child which
+  // lost the match of node i, whose children are nodes 2i and 2i+1. Leaves
+  // leaves_ + i are the children, padded to a power of 2 with exhausted
+  // ones. The reverse direction keeps the linear scan of FindLargest().
+  void BuildTree();
+  // Replay the matches of tree_[0] up from its leaf after it moved.
+  void ReplayWinner();
+  // Whether child a goes before child b. Exhausted children go last, and
+  // equal keys in the order of the children, as the scan did.
+  bool Before(int a, int b) const;
+  void UpdatePrefix(int i);
   void FindLargest();
+  int Compare(const Slice& a, const Slice& b) const {
+    return icmp_ != nullptr ? icmp_->Compare(a, b)
+                            : comparator_->Compare(a, b);
+  }
 
-  // We might want to use a heap in case there are lots of children.
-  // For now we use a simple array since we expect a very small number
-  // of children in dLSM.
   const Comparator* comparator_;
+  // comparator_ if it is an InternalKeyComparator of the bytewise comparator,
+  // whose Compare() is inlined, else nullptr.
+  const InternalKeyComparator* const icmp_;
+  // The keys are internal keys of a bytewise user comparator, the key
+  // prefixes settle most matches without a comparator call.
+  const bool bytewise_;
   IteratorWrapper* children_;
   int n_;
+  int leaves_;
+  // Per child, the range of its keys, empty if unknown or if none is.
+  std::vector<Slice> smallest_;
+  std::vector<Slice> largest_;
+  std::vector<Pending> pending_;
+  // The target of the last Seek(), for the pending children.
+  std::string target_;
+  std::vector<int> tree_;
+  // Per child, the first 8 bytes of its user key in big endian, zero
+  // padded, so that unequal prefixes order the same as the keys. Always 0
+  // if the user comparator is not bytewise.
+  std::vector<uint64_t> prefixes_;
   IteratorWrapper* current_;
   Direction direction_;
   std::string last_key;
   int64_t num_entries=0;
 };
 
-void MergingIterator::FindSmallest() {
-  IteratorWrapper* smallest = nullptr;
+void MergingIterator::UpdatePrefix(int i) {
+  if (!bytewise_ || !ChildValid(i)) {
+    return;
+  }
+  Slice user_key = ExtractUserKey(ChildKey(i));
+  size_t n = std::min(user_key.size(), sizeof(uint64_t));
+  uint64_t prefix = 0;
+  for (size_t j = 0; j < n; j++) {
+    prefix |= static_cast<uint64_t>(static_cast<uint8_t>(user_key[j]))
+              << (56 - 8 * j);
+  }
+  prefixes_[i] = prefix;
+}
+
+bool MergingIterator::Before(int a, int b) const {
+  if (a >= n_ || !ChildValid(a)) {
+    return false;
+  }
+  if (b >= n_ || !ChildValid(b)) {
+    return true;
+  }
+  if (prefixes_[a] != prefixes_[b]) {
+    return prefixes_[a] < prefixes_[b];
+  }
+  int r = Compare(ChildKey(a), ChildKey(b));
+  return r < 0 || (r == 0 && a < b);
+}
+
+void MergingIterator::BuildTree() {
   for (int i = 0; i < n_; i++) {
-    IteratorWrapper* child = &children_[i];
-    if (child->Valid()) {
-      if (smallest == nullptr) {
-        smallest = child;
-      } else if (comparator_->Compare(child->key(), smallest->key()) < 0) {
-        smallest = child;
-      }
+    UpdatePrefix(i);
+  }
+  // winners[node] is the child which won the match of node.
+  std::vector<int> winners(2 * leaves_);
+  for (int i = 0; i < leaves_; i++) {
+    winners[leaves_ + i] = i;
+  }
+  for (int node = leaves_ - 1; node >= 1; node--) {
+    int left = winners[2 * node];
+    int right = winners[2 * node + 1];
+    if (Before(right, left)) {
+      winners[node] = right;
+      tree_[node] = left;
+    } else {
+      winners[node] = left;
+      tree_[node] = right;
     }
   }
-  current_ = smallest;
+  tree_[0] = winners[1];
+  current_ = Before(tree_[0], n_) ? &children_[tree_[0]] : nullptr;
 #ifndef NDEBUG
   if (current_ == nullptr){
     printf("current invalid\n");
   }else{
-    assert(current_->key().size()>0);
+    assert(ChildKey(tree_[0]).size()>0);
 
   }
 #endif
 }
 
+void MergingIterator::ReplayWinner() {
+  int winner = tree_[0];
+  UpdatePrefix(winner);
+  for (int node = (leaves_ + winner) / 2; node >= 1; node /= 2) {
+    if (Before(tree_[node], winner)) {
+      std::swap(tree_[node], winner);
+    }
+  }
+  tree_[0] = winner;
+  current_ = Before(winner, n_) ? &children_[winner] : nullptr;
+}
+
+void MergingIterator::PositionWinner() {
+  // A pending child has no key before the one it stands at, positioning it
+  // only moves it later, which the replay of its matches takes care of.
+  while (current_ != nullptr && pending_[tree_[0]] != kPositioned) {
+    const int winner = tree_[0];
+    if (pending_[winner] == kSeekPending) {
+      children_[winner].Seek(target_);
+    } else {
+      children_[winner].SeekToFirst();
+    }
+    pending_[winner] = kPositioned;
+    ReplayWinner();
+  }
+}
+
 void MergingIterator::FindLargest() {
   IteratorWrapper* largest = nullptr;
   for (int i = n_ - 1; i >= 0; i--) {
@@ -193,7 +350,7 @@ void MergingIterator::FindLargest() {
     if (child->Valid()) {
       if (largest == nullptr) {
         largest = child;
-      } else if (comparator_->Compare(child->key(), largest->key()) > 0) {
+      } else if (Compare(child->key(), largest->key()) > 0) {
         largest = child;
       }
     }
@@ -210,7 +367,37 @@ Iterator* NewMergingIterator(const Comparator* comparator, Iterator** children,
   } else if (n == 1) {
     return children[0];
   } else {
-    return new MergingIterator(comparator, children, n);
+    return new MergingIterator(comparator, children, n,
+                               InternalKeyComparator::BytewiseOf(comparator));
+  }
+}
+
+Iterator* NewMergingIterator(const InternalKeyComparator* comparator,
+                             Iterator** children, int n) {
+  assert(n >= 0);
+  if (n == 0) {
+    return NewEmptyIterator();
+  } else if (n == 1) {
+    return children[0];
+  } else {
+    return new MergingIterator(
+        comparator, children, n,
+        comparator->bytewise() ? comparator : nullptr);
+  }
+}
+
+Iterator* NewMergingIterator(const InternalKeyComparator* comparator,
+                             Iterator** children, int n, const Slice* smallest,
+                             const Slice* largest) {
+  assert(n >= 0);
+  if (n == 0) {
+    return NewEmptyIterator();
+  } else if (n == 1) {
+    return children[0];
+  } else {
+    return new MergingIterator(
+        comparator, children, n,
+        comparator->bytewise() ? comparator : nullptr, smallest, largest);
   }
 }
 
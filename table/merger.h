@@ -8,7 +8,9 @@
 namespace dLSM {
 
 class Comparator;
+class InternalKeyComparator;
 class Iterator;
+class Slice;
 
 // Return an iterator that provided the union of the data in
 // children[0,n-1].  Takes ownership of the child iterators and
@@ -21,6 +23,20 @@ class Iterator;
 Iterator* NewMergingIterator(const Comparator* comparator, Iterator** children,
                              int n);
 
+// Same as above for children over internal keys. If the user comparator is
+// bytewise, most key comparisons are settled on cached key prefixes.
+Iterator* NewMergingIterator(const InternalKeyComparator* comparator,
+                             Iterator** children, int n);
+
+// Same as above with the internal keys of children[i] within
+// [smallest[i], largest[i]], or empty slices if they are not known. A seek
+// leaves a child whose range starts at or after the target where it is
+// until its first key is the next one of the result, and a child whose
+// range ends before the target alone. The slices must outlive the result.
+Iterator* NewMergingIterator(const InternalKeyComparator* comparator,
+                             Iterator** children, int n, const Slice* smallest,
+                             const Slice* largest);
+
 }  // namespace dLSM
 
 #endif  // STORAGE_dLSM_TABLE_MERGER_H_
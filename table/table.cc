@@ -4,6 +4,8 @@
 
 #include "dLSM/table.h"
 
+#include <algorithm>
+
 #include "db/table_cache.h"
 
 #include "dLSM/cache.h"
@@ -11,12 +13,16 @@
 #include "dLSM/env.h"
 #include "dLSM/filter_policy.h"
 #include "dLSM/options.h"
+#include "dLSM/rate_limiter.h"
+#include "dLSM/secondary_cache.h"
 
 
 #include "table/filter_block.h"
 #include "table/format.h"
 #include "table/two_level_iterator.h"
 #include "util/coding.h"
+#include "util/perf_context_imp.h"
+#include "util/statistics.h"
 
 #include "full_filter_block.h"
 #include "byte_addressable_RA_iterator.h"
@@ -24,75 +30,169 @@
 
 namespace dLSM {
 
+// The learned index projects the user keys bytewise, the hash index hashes
+// them.
+static bool IsBytewiseInternalComparator(const Comparator* comparator) {
+  return InternalKeyComparator::BytewiseOf(comparator) != nullptr;
+}
+
+// Whether the table keeps only the top level of its index and filter, see
+// Options::partitioned_table_meta.
+static bool PartitionsTableMeta(const Options& options,
+                                const RemoteMemTableMetaData& meta) {
+  return options.partitioned_table_meta &&
+         options.table_meta_cache != nullptr &&
+         meta.level >= static_cast<uint64_t>(
+                           std::max(options.partitioned_table_meta_level, 0));
+}
+
 //thread_local ibv_mr*  Table::Rep::mr_addr = nullptr;
 //TODO: Make it compatible with multi-node setup.
 Status Table::Open(const Options& options, Table** table,
                    const std::shared_ptr<RemoteMemTableMetaData>& Remote_table_meta) {
-  *table = nullptr;
-
+  std::vector<Table*> tables;
+  std::vector<Status> statuses;
+  OpenBatch(options, {Remote_table_meta}, &tables, &statuses);
+  *table = tables[0];
+  return statuses[0];
+}
 
-  // Read the index block
-  Status s = Status::OK();
-  BlockContents index_block_contents;
+void Table::OpenBatch(
+    const Options& options,
+    const std::vector<std::shared_ptr<RemoteMemTableMetaData>>& metas,
+    std::vector<Table*>* tables, std::vector<Status>* statuses) {
   ReadOptions opt;
   if (options.paranoid_checks) {
     opt.verify_checksums = true;
   }
-  s = ReadDataIndexBlock(
-      Remote_table_meta->remote_dataindex_mrs.begin()->second, opt,
-      &index_block_contents, Remote_table_meta->shard_target_node_id);
+  const size_t n = metas.size();
+  std::vector<BlockContents> index_contents(n);
+  std::vector<BlockContents> filter_contents(n);
+  std::vector<bool> read_filter(n);
+  std::vector<RemoteBlockRead> reads;
+  for (size_t i = 0; i < n; i++) {
+    const RemoteMemTableMetaData& meta = *metas[i];
+    reads.push_back({meta.remote_dataindex_mrs.begin()->second, IndexChunk,
+                     meta.shard_target_node_id, &index_contents[i],
+                     Status::OK()});
+    // Only the end of a partitioned filter is read, by ReadFilter().
+    read_filter[i] = options.filter_policy != nullptr &&
+                     !PartitionsTableMeta(options, meta);
+    if (read_filter[i]) {
+      reads.push_back({meta.remote_filter_mrs.begin()->second, FilterChunk,
+                       meta.shard_target_node_id, &filter_contents[i],
+                       Status::OK()});
+    }
+  }
+  ReadRemoteBlocks(&reads, opt);
 
-  if (s.ok()) {
-    // We've successfully read the footer and the index block: we're
-    // ready to serve requests.
-    Block* index_block = new Block(index_block_contents, IndexBlock);
-    Rep* rep = new Table::Rep(options);
+  tables->assign(n, nullptr);
+  statuses->assign(n, Status::OK());
+  size_t r = 0;
+  for (size_t i = 0; i < n; i++) {
+    Status s = reads[r++].s;
+    const BlockContents* filter = nullptr;
+    if (read_filter[i]) {
+      // A table whose filter failed to read works without one.
+      if (reads[r++].s.ok()) {
+        filter = &filter_contents[i];
+      }
+    }
+    if (s.ok()) {
+      (*tables)[i] = OpenWithBlocks(options, metas[i], index_contents[i],
+                                    filter);
+    } else if (filter != nullptr) {
+      Env::Default()->rdma_mg->Deallocate_Local_RDMA_Slot(
+          const_cast<char*>(filter->data.data()), FilterChunk);
+    }
+    (*statuses)[i] = s;
+  }
+}
+
+Table* Table::OpenWithBlocks(
+    const Options& options,
+    const std::shared_ptr<RemoteMemTableMetaData>& Remote_table_meta,
+    const BlockContents& index_block_contents, const BlockContents* filter) {
+  // We've successfully read the footer and the index block: we're
+  // ready to serve requests.
+  Block* index_block = new Block(index_block_contents, IndexBlock);
+  Rep* rep = new Table::Rep(options);
 //    rep->options = options;
 //    rep->file = file;
-    rep->remote_table = Remote_table_meta;
+  rep->remote_table = Remote_table_meta;
 //    rep->metaindex_handle = footer.metaindex_handle();
-    rep->index_block = index_block;
+  rep->index_block = index_block;
 #ifdef BYTEADDRESSABLE
 //    rep->index_iter = rep->index_block->NewIterator(rep->options.comparator);
+  {
+    // The tables of a DB may have been built with different intervals.
+    Iterator* index_iter = index_block->NewIterator(options.comparator);
+    index_iter->SeekToFirst();
+    rep->sparse_index =
+        index_iter->Valid() && IsSparseIndexEntry(index_iter->value());
+    delete index_iter;
+  }
 #endif
-    assert(rep->index_block->size() > 0);
-    rep->cache_id = (options.block_cache ? options.block_cache->NewId() : 0);
+  assert(rep->index_block->size() > 0);
+  rep->cache_id = (options.block_cache ? options.block_cache->NewId() : 0);
 //    rep->filter_data = nullptr;
-    rep->filter = nullptr;
+  rep->filter = nullptr;
+  if (PartitionsTableMeta(options, *Remote_table_meta)) {
+    // Keep the top level index only, the partitions are read back when
+    // needed.
+    rep->meta_cache_id = options.table_meta_cache->NewId();
+    rep->index_block = nullptr;
+  }
 
-    *table = new Table(rep);
-    (*table)->ReadFilter();
-//    (*table)->ReadMeta(footer);
-  }else{
-    assert(false);
+  if (options.learned_table_index && rep->index_block != nullptr &&
+      IsBytewiseInternalComparator(options.comparator)) {
+    rep->learned_index = rep->index_block->BuildLearnedIndex();
   }
+#ifdef BYTEADDRESSABLE
+  if (options.hash_table_index && rep->index_block != nullptr &&
+      !rep->sparse_index &&
+      IsBytewiseInternalComparator(options.comparator)) {
+    rep->hash_index = rep->index_block->BuildHashIndex();
+  }
+#endif
 
-  return s;
+  Table* table = new Table(rep);
+  if (rep->index_block == nullptr) {
+    table->PartitionIndex(index_block_contents.data);
+    delete index_block;
+  }
+  table->ReadFilter(filter);
+  return table;
 }
 
-void Table::ReadFilter() {
+void Table::ReadFilter(const BlockContents* block) {
   if (rep->options.filter_policy == nullptr) {
     return;  // Do not need any metadata
   }
-  // We might want to unify with ReadDataBlock() if we start
-  // requiring checksum verification in Table::Open.
-  ReadOptions opt;
-  if (rep->options.paranoid_checks) {
-    opt.verify_checksums = true;
-  }
-  BlockContents block;
   auto table_meta_data = rep->remote_table.lock();
-  if (!ReadFilterBlock(
-           table_meta_data->remote_filter_mrs.begin()->second, opt,
-           &block, table_meta_data->shard_target_node_id)
-           .ok()) {
+  if (rep->index_block == nullptr) {
+    // Partitioned: read the metadata at the end of the filter only.
+    ibv_mr* remote_mr = table_meta_data->remote_filter_mrs.begin()->second;
+    rep->filter_size = remote_mr->length - kBlockTrailerSize;
+    size_t tail_size = std::min(rep->filter_size,
+                                PartitionedFilterBlockReader::kMaxMetaSize);
+    char tail[PartitionedFilterBlockReader::kMaxMetaSize];
+    if (!ReadRemoteRange(remote_mr, rep->filter_size - tail_size, tail_size,
+                         tail, table_meta_data->shard_target_node_id)
+             .ok()) {
+      return;
+    }
+    rep->partitioned_filter = new PartitionedFilterBlockReader(
+        Slice(tail, tail_size), rep->filter_size,
+        rep->options.table_meta_partition_size, &Table::FilterPageReader,
+        this, rep->options.table_meta_cache);
+    return;
+  }
+  if (block == nullptr) {
     return;
   }
-//  if (block.heap_allocated) {
-//    rep_->filter_data = block.data.data();  // Will need to delete later
-//  }
-  rep->filter = new FullFilterBlockReader(
-      block.data, rep->remote_table.lock()->rdma_mg, Compute);
+  rep->filter = new FullFilterBlockReader(block->data, table_meta_data->rdma_mg,
+                                          Compute);
 }
 
 Table::~Table() {
@@ -114,6 +214,409 @@ static void ReleaseBlock(void* arg, void* h) {
   Cache::Handle* handle = reinterpret_cast<Cache::Handle*>(h);
   cache->Release(handle);
 }
+namespace {
+// The top level index of a partitioned index: one entry per index
+// partition, keyed by the last key of the partition.
+class TopLevelIndexIter : public Iterator {
+ public:
+  TopLevelIndexIter(const Comparator* comparator,
+                    const std::vector<std::string>* keys,
+                    const std::vector<std::string>* handles)
+      : comparator_(comparator),
+        keys_(keys),
+        handles_(handles),
+        index_(keys->size()) {}
+
+  bool Valid() const override { return index_ < keys_->size(); }
+  void SeekToFirst() override { index_ = 0; }
+  void SeekToLast() override {
+    index_ = keys_->empty() ? 0 : keys_->size() - 1;
+  }
+  void Seek(const Slice& target) override {
+    index_ = std::lower_bound(keys_->begin(), keys_->end(), target,
+                              [this](const std::string& a, const Slice& b) {
+                                return comparator_->Compare(a, b) < 0;
+                              }) -
+             keys_->begin();
+  }
+  void Next() override {
+    assert(Valid());
+    index_++;
+  }
+  void Prev() override {
+    assert(Valid());
+    index_ = index_ == 0 ? keys_->size() : index_ - 1;
+  }
+  Slice key() const override {
+    assert(Valid());
+    return (*keys_)[index_];
+  }
+  Slice value() const override {
+    assert(Valid());
+    return (*handles_)[index_];
+  }
+  Status status() const override { return Status::OK(); }
+
+ private:
+  const Comparator* const comparator_;
+  const std::vector<std::string>* const keys_;
+  const std::vector<std::string>* const handles_;
+  size_t index_;
+};
+}  // namespace
+
+void Table::PartitionIndex(const Slice& index_contents) {
+  // Cut at entries which store their whole key, so that every partition
+  // can be searched on its own.
+  const char* data = index_contents.data();
+  uint32_t num_restarts =
+      DecodeFixed32(data + index_contents.size() - sizeof(uint32_t));
+  const char* limit =
+      data + index_contents.size() - (1 + num_restarts) * sizeof(uint32_t);
+  const size_t target = rep->options.table_meta_partition_size;
+  std::string key;
+  const char* partition_start = data;
+  auto add_partition = [&](const char* partition_end) {
+    BlockHandle handle;
+    handle.set_offset(partition_start - data);
+    handle.set_size(partition_end - partition_start);
+    std::string encoded;
+    handle.EncodeTo(&encoded);
+    rep->partition_keys.push_back(key);
+    rep->partition_handles.push_back(std::move(encoded));
+    partition_start = partition_end;
+  };
+  const char* p = data;
+  while (p < limit) {
+    uint32_t shared, non_shared, value_length;
+    const char* key_delta =
+        DecodeEntry(p, limit, &shared, &non_shared, &value_length);
+    if (key_delta == nullptr || key.size() < shared) {
+      DEBUG("corrupt index block\n");
+      break;
+    }
+    if (shared == 0 && p != partition_start &&
+        static_cast<size_t>(p - partition_start) >= target) {
+      add_partition(p);
+    }
+    key.resize(shared);
+    key.append(key_delta, non_shared);
+    p = key_delta + non_shared + value_length;
+  }
+  if (p != partition_start) {
+    add_partition(p);
+  }
+}
+
+static void DeleteCachedMetaPartition(const Slice& key, void* value) {
+  Slice* partition = reinterpret_cast<Slice*>(value);
+  delete[] partition->data();
+  delete partition;
+}
+// Append the restart array of the index entries buf[0, *n), so that the
+// partition is a block of its own. Every entry storing its whole key is a
+// restart point.
+static char* AppendRestarts(char* buf, size_t* n) {
+  std::vector<uint32_t> restarts;
+  const char* p = buf;
+  const char* limit = buf + *n;
+  while (p < limit) {
+    uint32_t shared, non_shared, value_length;
+    const char* key_delta =
+        DecodeEntry(p, limit, &shared, &non_shared, &value_length);
+    if (key_delta == nullptr) {
+      break;
+    }
+    if (shared == 0) {
+      restarts.push_back(static_cast<uint32_t>(p - buf));
+    }
+    p = key_delta + non_shared + value_length;
+  }
+  size_t size = *n + (restarts.size() + 1) * sizeof(uint32_t);
+  char* block = new char[size];
+  memcpy(block, buf, *n);
+  char* dst = block + *n;
+  for (uint32_t restart : restarts) {
+    EncodeFixed32(dst, restart);
+    dst += sizeof(uint32_t);
+  }
+  EncodeFixed32(dst, static_cast<uint32_t>(restarts.size()));
+  delete[] buf;
+  *n = size;
+  return block;
+}
+
+// The key of an entry of Options::secondary_cache. Unlike the cache ids it
+// stays the same when the compute node restarts: the table, the remote
+// chunk the entry comes from, which tells apart the shards of a memory node,
+// and the offset of the entry.
+static const size_t kSecondaryCacheKeySize = 26;
+static void EncodeSecondaryCacheKey(char kind,
+                                    const RemoteMemTableMetaData& table_meta,
+                                    const ibv_mr* remote_mr, uint64_t offset,
+                                    char* buf) {
+  buf[0] = kind;
+  buf[1] = static_cast<char>(table_meta.shard_target_node_id);
+  EncodeFixed64(buf + 2, table_meta.number);
+  EncodeFixed64(buf + 10, reinterpret_cast<uint64_t>(remote_mr->addr));
+  EncodeFixed64(buf + 18, offset);
+}
+Cache::Handle* Table::ReadMetaPartition(ibv_mr* remote_mr, uint64_t offset,
+                                        size_t n, bool index_partition,
+                                        Slice* data) const {
+  Cache* meta_cache = rep->options.table_meta_cache;
+  char cache_key_buffer[16];
+  EncodeFixed64(cache_key_buffer, rep->meta_cache_id);
+  EncodeFixed64(cache_key_buffer + 8,
+                reinterpret_cast<uint64_t>(remote_mr->addr) + offset);
+  Slice key(cache_key_buffer, sizeof(cache_key_buffer));
+  Cache::Handle* cache_handle = meta_cache->Lookup(key);
+  if (cache_handle == nullptr) {
+    auto table_meta = rep->remote_table.lock();
+    if (table_meta == nullptr) {
+      return nullptr;
+    }
+    SecondaryCache* secondary_cache = rep->options.secondary_cache;
+    char secondary_key[kSecondaryCacheKeySize];
+    std::string secondary_value;
+    char* buf;
+    if (secondary_cache != nullptr) {
+      EncodeSecondaryCacheKey(index_partition ? 'i' : 'f', *table_meta,
+                              remote_mr, offset, secondary_key);
+    }
+    if (secondary_cache != nullptr &&
+        secondary_cache->Lookup(Slice(secondary_key, sizeof(secondary_key)),
+                                &secondary_value)) {
+      RecordTick(kSecondaryCacheHit);
+      n = secondary_value.size();
+      buf = new char[n];
+      memcpy(buf, secondary_value.data(), n);
+    } else {
+      if (secondary_cache != nullptr) {
+        RecordTick(kSecondaryCacheMiss);
+      }
+      buf = new char[n];
+      if (!ReadRemoteRange(remote_mr, offset, n, buf,
+                           table_meta->shard_target_node_id)
+               .ok()) {
+        delete[] buf;
+        return nullptr;
+      }
+      if (index_partition) {
+        buf = AppendRestarts(buf, &n);
+      }
+      if (secondary_cache != nullptr) {
+        secondary_cache->Insert(Slice(secondary_key, sizeof(secondary_key)),
+                                Slice(buf, n));
+      }
+    }
+    cache_handle = meta_cache->Insert(key, new Slice(buf, n), n,
+                                      &DeleteCachedMetaPartition);
+  }
+  *data = *reinterpret_cast<Slice*>(meta_cache->Value(cache_handle));
+  return cache_handle;
+}
+
+Cache::Handle* Table::FilterPageReader(void* arg, uint32_t page_index,
+                                       Slice* page) {
+  Table* table = reinterpret_cast<Table*>(arg);
+  auto table_meta = table->rep->remote_table.lock();
+  if (table_meta == nullptr) {
+    return nullptr;
+  }
+  // The same rounding as PartitionedFilterBlockReader.
+  size_t page_size = (table->rep->options.table_meta_partition_size +
+                      CACHE_LINE_SIZE - 1) /
+                     CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+  uint64_t offset = uint64_t{page_index} * page_size;
+  if (offset >= table->rep->filter_size) {
+    return nullptr;
+  }
+  return table->ReadMetaPartition(
+      table_meta->remote_filter_mrs.begin()->second, offset,
+      std::min<uint64_t>(page_size, table->rep->filter_size - offset), false,
+      page);
+}
+
+Iterator* Table::IndexPartitionReader(void* arg, const ReadOptions& options,
+                                      const Slice& index_value) {
+  Table* table = reinterpret_cast<Table*>(arg);
+  BlockHandle handle;
+  Slice input = index_value;
+  Status s = handle.DecodeFrom(&input);
+  if (!s.ok()) {
+    return NewErrorIterator(s);
+  }
+  auto table_meta = table->rep->remote_table.lock();
+  if (table_meta == nullptr) {
+    return NewErrorIterator(Status::IOError("table has been deleted"));
+  }
+  Cache* meta_cache = table->rep->options.table_meta_cache;
+  Slice entries;
+  Cache::Handle* cache_handle = table->ReadMetaPartition(
+      table_meta->remote_dataindex_mrs.begin()->second, handle.offset(),
+      handle.size(), true, &entries);
+  if (cache_handle == nullptr) {
+    return NewErrorIterator(Status::IOError("index partition read failed"));
+  }
+  BlockContents contents;
+  contents.data = entries;
+  Block* block = new Block(contents, IndexPartition);
+  Iterator* iter = block->NewIterator(table->rep->options.comparator);
+  iter->RegisterCleanup(&DeleteBlock, block, nullptr);
+  iter->RegisterCleanup(&ReleaseBlock, meta_cache, cache_handle);
+  return iter;
+}
+
+Iterator* Table::NewIndexIterator(const ReadOptions& options) const {
+  if (rep->index_block != nullptr) {
+    return rep->index_block->NewIterator(rep->options.comparator,
+                                         rep->learned_index, rep->hash_index);
+  }
+  return NewTwoLevelIterator(
+      new TopLevelIndexIter(rep->options.comparator, &rep->partition_keys,
+                            &rep->partition_handles),
+      &Table::IndexPartitionReader, const_cast<Table*>(this), options);
+}
+
+bool Table::FilterMayMatch(const Slice& user_key) const {
+  PERF_TIMER_GUARD(filter_nanos);
+  bool may_match;
+  if (rep->filter != nullptr) {
+    may_match = rep->filter->KeyMayMatch(user_key);
+  } else if (rep->partitioned_filter != nullptr) {
+    may_match = rep->partitioned_filter->KeyMayMatch(user_key);
+  } else {
+    return true;
+  }
+  RecordTick(kBloomChecked);
+  PERF_COUNTER_ADD(filter_checks, 1);
+  if (!may_match) {
+    RecordTick(kBloomUseful);
+    PERF_COUNTER_ADD(filter_negatives, 1);
+  }
+  return may_match;
+}
+
+void Table::FiltersMayMatch(const Slice* user_keys, size_t n,
+                            bool* results) const {
+  if (rep->filter == nullptr) {
+    for (size_t i = 0; i < n; i++) {
+      results[i] = FilterMayMatch(user_keys[i]);
+    }
+    return;
+  }
+  {
+    PERF_TIMER_GUARD(filter_nanos);
+    rep->filter->KeysMayMatch(user_keys, n, results);
+  }
+  for (size_t i = 0; i < n; i++) {
+    RecordTick(kBloomChecked);
+    PERF_COUNTER_ADD(filter_checks, 1);
+    if (!results[i]) {
+      RecordTick(kBloomUseful);
+      PERF_COUNTER_ADD(filter_negatives, 1);
+    }
+  }
+}
+
+#ifdef BYTEADDRESSABLE
+// False if the hash index rules user_key out.
+static bool HashMayMatch(const Table::Rep* rep, const Slice& user_key) {
+  if (rep->hash_index == nullptr) {
+    return true;
+  }
+  uint32_t candidates[HashIndex::kMaxCandidates];
+  return rep->hash_index->Lookup(user_key, candidates) != 0;
+}
+static void DeleteCachedKV(const Slice& key, void* value) {
+  delete[] reinterpret_cast<char*>(value);
+}
+static void DeletePinnedKV(void* arg, void* ignored) {
+  delete[] reinterpret_cast<char*>(arg);
+}
+// In the byte addressable mode the block cache holds single KV records,
+// keyed by table cache id and offset the same way as the blocks.
+static void EncodeKVCacheKey(uint64_t cache_id, const BlockHandle& handle,
+                             char* buf) {
+  EncodeFixed64(buf, cache_id);
+  EncodeFixed64(buf + 8, handle.offset());
+}
+// The records of a table have no chunk of their own in its metadata, the
+// first index chunk stands for the table.
+static void EncodeKVSecondaryCacheKey(const RemoteMemTableMetaData& table_meta,
+                                      const BlockHandle& handle, char* buf) {
+  EncodeSecondaryCacheKey('k', table_meta,
+                          table_meta.remote_dataindex_mrs.begin()->second,
+                          handle.offset(), buf);
+}
+Cache::Handle* Table::LookupCachedKV(const BlockHandle& handle,
+                                     Slice* kv) const {
+  Cache* kv_cache = rep->options.block_cache;
+  if (kv_cache == nullptr) {
+    return nullptr;
+  }
+  char cache_key_buffer[16];
+  EncodeKVCacheKey(rep->cache_id, handle, cache_key_buffer);
+  Cache::Handle* cache_handle =
+      kv_cache->Lookup(Slice(cache_key_buffer, sizeof(cache_key_buffer)));
+  if (cache_handle != nullptr) {
+    RecordTick(kBlockCacheHit);
+  } else {
+    RecordTick(kBlockCacheMiss);
+    SecondaryCache* secondary_cache = rep->options.secondary_cache;
+    if (secondary_cache == nullptr) {
+      return nullptr;
+    }
+    auto table_meta = rep->remote_table.lock();
+    if (table_meta == nullptr) {
+      return nullptr;
+    }
+    char secondary_key[kSecondaryCacheKeySize];
+    EncodeKVSecondaryCacheKey(*table_meta, handle, secondary_key);
+    std::string record;
+    if (!secondary_cache->Lookup(Slice(secondary_key, sizeof(secondary_key)),
+                                 &record) ||
+        record.size() != handle.size()) {
+      RecordTick(kSecondaryCacheMiss);
+      return nullptr;
+    }
+    RecordTick(kSecondaryCacheHit);
+    char* buf = new char[record.size()];
+    memcpy(buf, record.data(), record.size());
+    cache_handle =
+        kv_cache->Insert(Slice(cache_key_buffer, sizeof(cache_key_buffer)),
+                         buf, record.size(), &DeleteCachedKV);
+  }
+  *kv = Slice(reinterpret_cast<char*>(kv_cache->Value(cache_handle)),
+              handle.size());
+  return cache_handle;
+}
+void Table::InsertCachedKV(const ReadOptions& options,
+                           const BlockHandle& handle, const Slice& kv) const {
+  Cache* kv_cache = rep->options.block_cache;
+  if (kv_cache == nullptr || !options.fill_cache) {
+    return;
+  }
+  assert(kv.size() == handle.size());
+  char cache_key_buffer[16];
+  EncodeKVCacheKey(rep->cache_id, handle, cache_key_buffer);
+  char* record = new char[kv.size()];
+  memcpy(record, kv.data(), kv.size());
+  kv_cache->Release(
+      kv_cache->Insert(Slice(cache_key_buffer, sizeof(cache_key_buffer)),
+                       record, kv.size(), &DeleteCachedKV));
+  SecondaryCache* secondary_cache = rep->options.secondary_cache;
+  if (secondary_cache != nullptr) {
+    auto table_meta = rep->remote_table.lock();
+    if (table_meta != nullptr) {
+      char secondary_key[kSecondaryCacheKeySize];
+      EncodeKVSecondaryCacheKey(*table_meta, handle, secondary_key);
+      secondary_cache->Insert(Slice(secondary_key, sizeof(secondary_key)), kv);
+    }
+  }
+}
+#endif
 
 // Convert an index iterator value (i.e., an encoded BlockHandle)
 // into an iterator over the contents of the corresponding block.
@@ -127,7 +630,7 @@ Iterator* Table::BlockReader(void* arg, const ReadOptions& options,
 
   BlockHandle handle;
   Slice input = index_value;
-  Status s = handle.DecodeFrom(&input);
+  Status s = DecodeIndexHandle(&input, &handle);
   // We intentionally allow extra stuff in index_value so that we
   // can add more features in the future.
 
@@ -148,6 +651,7 @@ Iterator* Table::BlockReader(void* arg, const ReadOptions& options,
       auto lookup_duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
 #endif
       if (cache_handle != nullptr) {
+        RecordTick(kBlockCacheHit);
         block = reinterpret_cast<Block*>(block_cache->Value(cache_handle));
 //        printf("Cache hit\n");
 #ifdef PROCESSANALYSIS
@@ -155,6 +659,7 @@ Iterator* Table::BlockReader(void* arg, const ReadOptions& options,
         TableCache::cache_hit_look_up_time.fetch_add(lookup_duration.count());
 #endif
       } else {
+        RecordTick(kBlockCacheMiss);
 #ifdef PROCESSANALYSIS
         TableCache::cache_miss.fetch_add(1);
 //        if(TableCache::cache_miss < TableCache::not_filtered){
@@ -163,7 +668,8 @@ Iterator* Table::BlockReader(void* arg, const ReadOptions& options,
         start = std::chrono::high_resolution_clock::now();
 
 #endif
-        s = ReadDataBlock(&table->rep->remote_table.lock()->remote_data_mrs, options, handle, &contents);
+        ThrottleRead(table->rep->options, handle);
+        s = ReadDataBlock(table->rep->remote_table.lock().get(), options, handle, &contents);
 #ifdef PROCESSANALYSIS
         stop = std::chrono::high_resolution_clock::now();
         auto blockfetch_duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
@@ -180,7 +686,8 @@ Iterator* Table::BlockReader(void* arg, const ReadOptions& options,
       }
     } else {
 //      printf("NO table_cache found!!\n");
-      s = ReadDataBlock(&table->rep->remote_table.lock()->remote_data_mrs, options, handle, &contents);
+      ThrottleRead(table->rep->options, handle);
+      s = ReadDataBlock(table->rep->remote_table.lock().get(), options, handle, &contents);
       if (s.ok()) {
         block = new Block(contents, DataBlock);
       }
@@ -214,45 +721,90 @@ Slice Table::KVReader(void* arg, const ReadOptions& options,
 
   BlockHandle handle;
   Slice input = index_value;
-  Status s = handle.DecodeFrom(&input);
+  Status s = DecodeIndexHandle(&input, &handle);
   // We intentionally allow extra stuff in index_value so that we
   // can add more features in the future.
   assert(s.ok());
   Slice result;
+#ifdef BYTEADDRESSABLE
+  Cache::Handle* kv_handle = table->LookupCachedKV(handle, &result);
+  if (kv_handle != nullptr) {
+    // The caller expects the record in the thread local read buffer, which
+    // stays valid until the next read of this thread.
+    ibv_mr* local_mr = Env::Default()->rdma_mg->Get_local_read_mr();
+    memcpy(local_mr->addr, result.data(), result.size());
+    result = Slice(static_cast<char*>(local_mr->addr), result.size());
+    block_cache->Release(kv_handle);
+    return result;
+  }
+#endif
   auto table_meta = table->rep->remote_table.lock();
-  ReadKVPair(&table->rep->remote_table.lock()->remote_data_mrs, options, handle,
-             &result, table_meta->shard_target_node_id);
+  ThrottleRead(table->rep->options, handle);
+  ReadKVPair(table_meta.get(), options, handle, &result);
+#ifdef BYTEADDRESSABLE
+  table->InsertCachedKV(options, handle, result);
+#endif
   return result;
 }
 
+#ifdef BYTEADDRESSABLE
+namespace {
+// The keys of the index entries, one per record unless the index is
+// sparse, with empty values.
+class KeysOnlyIterator : public Iterator {
+ public:
+  explicit KeysOnlyIterator(Iterator* index_iter) : index_iter_(index_iter) {}
+  ~KeysOnlyIterator() override { delete index_iter_; }
+
+  bool Valid() const override { return index_iter_->Valid(); }
+  void SeekToFirst() override { index_iter_->SeekToFirst(); }
+  void SeekToLast() override { index_iter_->SeekToLast(); }
+  void Seek(const Slice& target) override { index_iter_->Seek(target); }
+  void Next() override { index_iter_->Next(); }
+  void Prev() override { index_iter_->Prev(); }
+  Slice key() const override { return index_iter_->key(); }
+  Slice value() const override { return Slice(); }
+  Status status() const override { return index_iter_->status(); }
+
+ private:
+  Iterator* const index_iter_;
+};
+}  // namespace
+#endif
+
 Iterator* Table::NewIterator(const ReadOptions& options) const {
 #ifndef BYTEADDRESSABLE
   return NewTwoLevelIterator(
-      rep->index_block->NewIterator(rep->options.comparator),
+      NewIndexIterator(options),
       &Table::BlockReader, const_cast<Table*>(this), options);
 #endif
 #ifdef BYTEADDRESSABLE
+  if (options.keys_only && !rep->sparse_index) {
+    return new KeysOnlyIterator(NewIndexIterator(options));
+  }
   return new ByteAddressableRAIterator(
-      rep->index_block->NewIterator(rep->options.comparator),
-      &Table::KVReader, const_cast<Table*>(this), options, true);
+      NewIndexIterator(options),
+      &Table::KVReader, const_cast<Table*>(this), options, true,
+      rep->options.comparator);
 #endif
 }
 #ifdef BYTEADDRESSABLE
 Iterator* Table::NewSEQIterator(const ReadOptions& options) const {
-
-
+  if (options.keys_only && !rep->sparse_index) {
+    return new KeysOnlyIterator(NewIndexIterator(options));
+  }
   return new ByteAddressableSEQIterator(
-      rep->index_block->NewIterator(rep->options.comparator),
+      NewIndexIterator(options),
       const_cast<Table*>(this), options, true);
 
 }
 #endif
 Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
                           void (*handle_result)(void*, const Slice&,
-                                                const Slice&)) {
+                                                const Slice&),
+                          Cleanable* pinned) {
   Status s;
-  FullFilterBlockReader* filter = rep->filter;
-  if (filter != nullptr && !filter->KeyMayMatch(ExtractUserKey(k))) {
+  if (!FilterMayMatch(ExtractUserKey(k))) {
     // Not found
 #ifdef PROCESSANALYSIS
     int dummy = 0;
@@ -288,11 +840,15 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
 #endif
   } else {
 #ifndef BYTEADDRESSABLE
-    Iterator* iiter = rep->index_block->NewIterator(rep->options.comparator);
+    Iterator* iiter = NewIndexIterator(options);
 #ifdef PROCESSANALYSIS
     auto start = std::chrono::high_resolution_clock::now();
 #endif
-    iiter->Seek(k);//binary search for block index
+    {
+      PERF_COUNTER_ADD(index_searches, 1);
+      PERF_TIMER_GUARD(index_nanos);
+      iiter->Seek(k);//binary search for block index
+    }
 #ifdef PROCESSANALYSIS
     auto stop = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
@@ -326,8 +882,17 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
 //    std::printf("Block Reader time elapse is %zu\n",  duration.count());
       TableCache::DataBinarySearchTimeElapseSum.fetch_add(duration.count());
 #endif
+      if (!block_iter->Valid() ||
+          ExtractUserKey(block_iter->key()) != ExtractUserKey(k)) {
+        RecordTick(kBloomFalsePositive);
+      }
       if (block_iter->Valid()) {
         (*handle_result)(arg, block_iter->key(), block_iter->value());
+        if (pinned != nullptr) {
+          // The block, cached or not, is freed by the cleanups of its
+          // iterator.
+          block_iter->DelegateCleanupsTo(pinned);
+        }
       }
       s = block_iter->status();
       delete block_iter;
@@ -350,12 +915,19 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
     auto start = std::chrono::high_resolution_clock::now();
     TableCache::not_filtered.fetch_add(1);
 #endif
+    if (!HashMayMatch(rep, ExtractUserKey(k))) {
+      return s;
+    }
 
 //    Iterator* iter = NewIterator(options);
 //    iter->Seek(k);
     // todo: Can we directly search by the index block without create a iterator?
-    Iterator* iiter = rep->index_block->NewIterator(rep->options.comparator);
-    iiter->Seek(k);
+    Iterator* iiter = NewIndexIterator(options);
+    {
+      PERF_COUNTER_ADD(index_searches, 1);
+      PERF_TIMER_GUARD(index_nanos);
+      iiter->Seek(k);
+    }
 #ifdef PROCESSANALYSIS
     auto stop = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
@@ -365,7 +937,7 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
     if (iiter->Valid()){
       Slice handle = iiter->value();
       BlockHandle bhandle;
-      bhandle.DecodeFrom(&handle);
+      DecodeIndexHandle(&handle, &bhandle);
 
 //      rdma_mg->Deallocate_Local_RDMA_Slot(mr_addr, DataChunk);
 
@@ -373,22 +945,55 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
       Slice KV;
       Slice key;
       Slice value;
-      auto table_meta = rep->remote_table.lock();
-      s = ReadKVPair(&table_meta->remote_data_mrs, options,
-                     bhandle, &KV, table_meta->shard_target_node_id);
-
-      char* mr_addr = (char*)KV.data();
-      uint32_t key_size, value_size;
-      GetFixed32(&KV, &key_size);
-      GetFixed32(&KV, &value_size);
-      assert(key_size + value_size == KV.size());
-
-
-      key = Slice(KV.data(), key_size);
-      KV.remove_prefix(key_size);
-      assert(KV.size() == value_size);
-      value = KV;
-      (*handle_result)(arg, key, value);
+      Cache::Handle* kv_handle = LookupCachedKV(bhandle, &KV);
+      if (kv_handle == nullptr) {
+        auto table_meta = rep->remote_table.lock();
+        ThrottleRead(rep->options, bhandle);
+        s = ReadKVPair(table_meta.get(), options, bhandle, &KV);
+        if (s.ok()) {
+          InsertCachedKV(options, bhandle, KV);
+        }
+        if (pinned != nullptr) {
+          // The thread local read buffer is overwritten by the next read of
+          // this thread, so the pinned record has to be a copy.
+          char* record = new char[KV.size()];
+          memcpy(record, KV.data(), KV.size());
+          KV = Slice(record, KV.size());
+          pinned->RegisterCleanup(&DeletePinnedKV, record, nullptr);
+        }
+      }
+
+      // The group of the entry ends at or before its key, which is not
+      // before k.
+      std::string scratch;
+      if (!SeekKVRecord(rep->options.comparator, KV, k, &key, &value,
+                        &scratch)) {
+        s = Status::Corruption("bad index entry of a byte addressable table");
+      } else if (key.empty()) {
+        // k falls between the group and its separator, the table does not
+        // hold it.
+        RecordTick(kBloomFalsePositive);
+      } else {
+        if (ExtractUserKey(key) != ExtractUserKey(k)) {
+          RecordTick(kBloomFalsePositive);
+        }
+        if (pinned != nullptr && value.data() == scratch.data()) {
+          // The value was uncompressed, it has to outlive the call.
+          char* uncompressed = new char[value.size()];
+          memcpy(uncompressed, value.data(), value.size());
+          value = Slice(uncompressed, value.size());
+          pinned->RegisterCleanup(&DeletePinnedKV, uncompressed, nullptr);
+        }
+        (*handle_result)(arg, key, value);
+      }
+      if (kv_handle != nullptr) {
+        if (pinned != nullptr) {
+          pinned->RegisterCleanup(&ReleaseBlock, rep->options.block_cache,
+                                  kv_handle);
+        } else {
+          rep->options.block_cache->Release(kv_handle);
+        }
+      }
 //      rdma_mg->Deallocate_Local_RDMA_Slot(mr_addr, DataChunk);
     }
 
@@ -402,17 +1007,172 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
 
   return s;
 }
+bool Table::PrepareGet(const ReadOptions& options, const Slice& k, void* arg,
+                       void (*handle_result)(void*, const Slice&,
+                                             const Slice&),
+                       BlockHandle* handle, Status* s, bool filtered) {
+  *s = Status::OK();
+  if (!filtered && !FilterMayMatch(ExtractUserKey(k))) {
+    // Not found
+    return false;
+  }
+#ifdef BYTEADDRESSABLE
+  if (!HashMayMatch(rep, ExtractUserKey(k))) {
+    return false;
+  }
+#endif
+  Iterator* iiter = NewIndexIterator(options);
+  iiter->Seek(k);
+  if (!iiter->Valid()) {
+    *s = iiter->status();
+    delete iiter;
+    return false;
+  }
+  Slice handle_value = iiter->value();
+  *s = DecodeIndexHandle(&handle_value, handle);
+  delete iiter;
+  if (!s->ok()) {
+    return false;
+  }
+#ifndef BYTEADDRESSABLE
+  Cache* block_cache = rep->options.block_cache;
+  if (block_cache != nullptr) {
+    char cache_key_buffer[16];
+    EncodeFixed64(cache_key_buffer, rep->cache_id);
+    EncodeFixed64(cache_key_buffer + 8, handle->offset());
+    Slice key(cache_key_buffer, sizeof(cache_key_buffer));
+    Cache::Handle* cache_handle = block_cache->Lookup(key);
+    RecordTick(cache_handle != nullptr ? kBlockCacheHit : kBlockCacheMiss);
+    if (cache_handle != nullptr) {
+      Block* block = reinterpret_cast<Block*>(block_cache->Value(cache_handle));
+      Iterator* block_iter = block->NewIterator(rep->options.comparator);
+      block_iter->Seek(k);
+      if (block_iter->Valid()) {
+        (*handle_result)(arg, block_iter->key(), block_iter->value());
+      }
+      *s = block_iter->status();
+      delete block_iter;
+      block_cache->Release(cache_handle);
+      return false;
+    }
+  }
+#else
+  Slice KV;
+  Cache::Handle* kv_handle = LookupCachedKV(*handle, &KV);
+  if (kv_handle != nullptr) {
+    *s = SeekKV(options, k, KV, arg, handle_result);
+    rep->options.block_cache->Release(kv_handle);
+    return false;
+  }
+#endif
+  return true;
+}
+Status Table::FinishGet(const ReadOptions& options, const Slice& k,
+                        const BlockHandle& handle, const char* data, void* arg,
+                        void (*handle_result)(void*, const Slice&,
+                                              const Slice&)) {
+  Status s;
+#ifndef BYTEADDRESSABLE
+  BlockContents contents;
+  s = CopyDataBlock(data, options, handle, &contents);
+  if (!s.ok()) {
+    return s;
+  }
+  Block* block = new Block(contents, DataBlock);
+  Cache* block_cache = rep->options.block_cache;
+  Cache::Handle* cache_handle = nullptr;
+  if (block_cache != nullptr && options.fill_cache) {
+    char cache_key_buffer[16];
+    EncodeFixed64(cache_key_buffer, rep->cache_id);
+    EncodeFixed64(cache_key_buffer + 8, handle.offset());
+    Slice key(cache_key_buffer, sizeof(cache_key_buffer));
+    cache_handle = block_cache->Insert(key, block, block->size(),
+                                       &DeleteCachedBlock);
+  }
+  Iterator* block_iter = block->NewIterator(rep->options.comparator);
+  if (cache_handle == nullptr) {
+    block_iter->RegisterCleanup(&DeleteBlock, block, nullptr);
+  } else {
+    block_iter->RegisterCleanup(&ReleaseBlock, block_cache, cache_handle);
+  }
+  block_iter->Seek(k);
+  if (block_iter->Valid()) {
+    (*handle_result)(arg, block_iter->key(), block_iter->value());
+  }
+  s = block_iter->status();
+  delete block_iter;
+#else
+  Slice KV(data, handle.size());
+  s = SeekKV(options, k, KV, arg, handle_result);
+  if (s.ok()) {
+    InsertCachedKV(options, handle, KV);
+  }
+#endif
+  return s;
+}
+#ifdef BYTEADDRESSABLE
+Status Table::SeekKV(const ReadOptions& options, const Slice& k,
+                     const Slice& kv, void* arg,
+                     void (*handle_result)(void*, const Slice&,
+                                           const Slice&)) const {
+  if (options.verify_checksums && !VerifyKVRecords(kv)) {
+    return Status::Corruption("KV record checksum mismatch");
+  }
+  Slice key, value;
+  std::string scratch;
+  if (!SeekKVRecord(rep->options.comparator, kv, k, &key, &value, &scratch)) {
+    return Status::Corruption("bad index entry of a byte addressable table");
+  }
+  if (!key.empty()) {
+    (*handle_result)(arg, key, value);
+  }
+  return Status::OK();
+}
+#endif
+size_t Table::RemoteReadSize(const BlockHandle& handle) {
+#ifndef BYTEADDRESSABLE
+  return handle.size() + kBlockTrailerSize;
+#else
+  return handle.size();
+#endif
+}
+void Table::ThrottleRead(const Options& options, const BlockHandle& handle) {
+  if (options.rdma_limiter != nullptr) {
+    options.rdma_limiter->Request(static_cast<int64_t>(RemoteReadSize(handle)),
+                                  RateLimiter::kHigh);
+  }
+}
 //void Table::GetKV(Iterator* iiter) {
 //
 //}
+size_t Table::ApproximateMemoryUsage() const {
+  size_t usage = sizeof(*this) + sizeof(Rep);
+  if (rep->index_block != nullptr) {
+    usage += rep->index_block->size();
+  }
+  if (rep->filter != nullptr) {
+    usage += rep->filter_size;
+  }
+  for (size_t i = 0; i < rep->partition_keys.size(); i++) {
+    usage += rep->partition_keys[i].size() + rep->partition_handles[i].size();
+  }
+  if (rep->learned_index != nullptr) {
+    usage += rep->learned_index->ApproximateMemoryUsage();
+  }
+  if (rep->hash_index != nullptr) {
+    usage += rep->hash_index->ApproximateMemoryUsage();
+  }
+  return usage;
+}
+
 uint64_t Table::ApproximateOffsetOf(const Slice& key) const {
-  Iterator* index_iter = rep->index_block->NewIterator(rep->options.comparator);
+  Iterator* index_iter = NewIndexIterator(ReadOptions());
   index_iter->Seek(key);
   uint64_t result;
   if (index_iter->Valid()) {
     BlockHandle handle;
     Slice input = index_iter->value();
-    Status s = handle.DecodeFrom(&input);
+    Status s = DecodeIndexHandle(&input, &handle);
     if (s.ok()) {
       result = handle.offset();
     } else {
@@ -4,13 +4,16 @@
 
 #include "table_builder_bacs.h"
 #include "db/dbformat.h"
+#include <algorithm>
 #include <cassert>
+#include <deque>
 namespace dLSM {
 //TOthink: how to save the remote mr?
 //TOFIX : now we suppose the index and filter block will not over the write buffer.
 // TODO: make the Option of tablebuilder a pointer avoiding large data copying
 struct TableBuilder_BACS::Rep {
-  Rep(const Options& opt, IO_type type, uint8_t target_node_id)
+  Rep(const Options& opt, IO_type type, uint8_t target_node_id,
+      int bloom_bits)
       : options(opt),
         index_block_options(opt),
         type_(type),
@@ -24,7 +27,12 @@ struct TableBuilder_BACS::Rep {
   {
     //TOTHINK: why the block restart interval is 1 by default?
     // This is only for index block, is it the same for rocks DB?
-    index_block_options.block_restart_interval = 1;
+    if (opt.index_restart_interval > 0) {
+      index_block_options.block_restart_interval = opt.index_restart_interval;
+    } else {
+      index_block_options.block_restart_interval =
+          opt.index_interval > 1 ? kSparseIndexRestartInterval : 1;
+    }
     std::shared_ptr<RDMA_Manager> rdma_mg = options.env->rdma_mg;
     ibv_mr* temp_data_mr = new ibv_mr();
     ibv_mr* temp_index_mr = new ibv_mr();
@@ -44,24 +52,27 @@ struct TableBuilder_BACS::Rep {
     rdma_mg->Allocate_Local_RDMA_Slot(*temp_index_mr, IndexChunk);
     rdma_mg->Allocate_Local_RDMA_Slot(*temp_filter_mr, FilterChunk);
     local_data_mr.push_back(temp_data_mr);
+    free_data_mr.push_back(temp_data_mr);
     local_index_mr.push_back(temp_index_mr);
     memset(temp_filter_mr->addr, 0, temp_filter_mr->length);
     local_filter_mr.push_back(temp_filter_mr);
+    filling_data_mr = local_data_mr[0];
     //    delete temp_data_mr;
     //    delete temp_index_mr;
     //    delete temp_filter_mr;
     data_buff = Slice((char*)local_data_mr.at(0)->addr,0);
     index_block = new BlockBuilder(&index_block_options, local_index_mr[0]);
     if (type_ == IO_type::Compact){
-      type_string_ = "write_local_compact";
+      qp_type_ = QP_WRITE_LOCAL_COMPACT;
     }else if(type_ == IO_type::Flush){
-      type_string_ = "write_local_flush";
+      qp_type_ = QP_WRITE_LOCAL_FLUSH;
     }else{
       assert(false);
     }
     filter_block = (opt.filter_policy == nullptr
                         ? nullptr
-                        : new FullFilterBlockBuilder(local_filter_mr[0], opt.bloom_bits));
+                        : new FullFilterBlockBuilder(local_filter_mr[0], bloom_bits,
+                                                     opt.filter_type, opt.prefix_extractor));
 
     status = Status::OK();
   }
@@ -69,23 +80,30 @@ struct TableBuilder_BACS::Rep {
   const Options& options;
   Options index_block_options;
   IO_type type_;
-  std::string type_string_;
+  QP_Type qp_type_;
   //  WritableFile* file;
+  // At most this many flush buffers per table, one is filled while the others
+  // are in flight.
+  static constexpr size_t kMaxFlushBuffers = 3;
+  // All the flush buffers, released at destruction.
   std::vector<ibv_mr*> local_data_mr;
-  // the start index of the in use buffer
-  int data_inuse_start = -1;
-  // the end index of the use buffer
-  int data_inuse_end = -1;
-  // when start larger than end by 1, there could be two scenarios:
-  // First, all the buffer are outstanding
-  // second, no buffer is outstanding, those two status will both have start - end = 1
-  bool data_inuse_empty = true;
+  // The flush buffers neither in flight nor being filled.
+  std::vector<ibv_mr*> free_data_mr;
+  // The flush buffer the data is serialized onto.
+  ibv_mr* filling_data_mr;
+  // Signaled writes in flight in posting order, nullptr for an index or
+  // filter write. The queue pair completes them in the same order.
+  std::deque<ibv_mr*> outstanding_writes;
+  // The writes of the Flush functions not posted yet, and the flush buffer
+  // among them if there is one.
+  std::vector<RDMA_Write_Request> queued_writes;
+  ibv_mr* queued_buffer = nullptr;
   std::vector<ibv_mr*> local_index_mr;
   std::vector<ibv_mr*> local_filter_mr;
   //TODO: make the map offset -> ibv_mr*
-  std::map<uint32_t, ibv_mr*> remote_data_mrs;
-  std::map<uint32_t, ibv_mr*> remote_dataindex_mrs;
-  std::map<uint32_t, ibv_mr*> remote_filter_mrs;
+  ChunkTable remote_data_mrs;
+  ChunkTable remote_dataindex_mrs;
+  ChunkTable remote_filter_mrs;
   //  std::vector<size_t> remote_mr_real_length;
   uint64_t offset_last_flushed = 0;
   uint64_t offset_last_added = 0;
@@ -99,6 +117,7 @@ struct TableBuilder_BACS::Rep {
   BlockBuilder* index_block;
   std::string last_key;
   int64_t num_entries;
+  int64_t num_deletions = 0;
   bool closed;  // Either Finish() or Abandon() has been called.
   FullFilterBlockBuilder* filter_block;
 
@@ -113,13 +132,143 @@ struct TableBuilder_BACS::Rep {
   // Invariant: r->pending_index_filter_entry is true only if data_block is empty.
   bool pending_index_filter_entry;
   BlockHandle pending_data_handle;  // Handle to add to index block
+  // The records the next index entry covers, from group_offset on.
+  uint64_t group_offset = 0;
+  int group_records = 0;
+
+  // Add the index entry of the group of records before "offset", keyed by
+  // its last key, or by a separator from "next_key", the first key of the
+  // next group, see Options::index_key_separators.
+  void FinishGroup(const Slice* next_key) {
+    if (group_records == 0) {
+      return;
+    }
+    BlockHandle handle;
+    handle.set_offset(group_offset);
+    handle.set_size(offset - group_offset);
+    std::string handle_encoding;
+    EncodeIndexHandle(handle, &handle_encoding);
+    if (options.index_interval > 1) {
+      PutVarint32(&handle_encoding, group_records);
+    }
+    if (next_key != nullptr && options.index_interval > 1 &&
+        options.index_key_separators) {
+      // The records of the group end at last_key, those of the next one
+      // start after the separator.
+      options.comparator->FindShortestSeparator(&last_key, *next_key);
+    }
+    index_block->Add(last_key, Slice(handle_encoding));
+    group_offset = offset;
+    group_records = 0;
+  }
+
+  // Pop the finished writes off outstanding_writes and give their flush
+  // buffers back. If wait is set, block until at least one write finishes.
+  void PollWrites(RDMA_Manager* rdma_mg, bool wait) {
+    ibv_wc wc[kMaxFlushBuffers + 2];
+    int poll_num = std::min(outstanding_writes.size(),
+                            sizeof(wc) / sizeof(ibv_wc));
+    if (wait) {
+      rdma_mg->poll_completion(wc, 1, qp_type_, true, target_node_id_);
+      poll_num = 1;
+    } else {
+      poll_num = rdma_mg->try_poll_completions(wc, poll_num, qp_type_, true,
+                                               target_node_id_);
+    }
+    for (int i = 0; i < poll_num; i++) {
+      assert(!outstanding_writes.empty());
+      if (outstanding_writes.front() != nullptr) {
+        free_data_mr.push_back(outstanding_writes.front());
+      }
+      outstanding_writes.pop_front();
+    }
+  }
+  // Queue the write of "local_mr" into "remote_mr", "buffer" is the flush
+  // buffer written or nullptr.
+  void QueueWrite(ibv_mr* remote_mr, ibv_mr* local_mr, size_t msg_size,
+                  ibv_mr* buffer) {
+    queued_writes.push_back(RDMA_Write_Request{
+        remote_mr->addr, remote_mr->rkey, local_mr->addr, local_mr->lkey,
+        msg_size});
+    if (buffer != nullptr) {
+      assert(queued_buffer == nullptr);
+      queued_buffer = buffer;
+    }
+  }
+  // Post the queued writes with one doorbell, only the last is signaled and
+  // gives the flush buffer back once polled.
+  void PostWrites(RDMA_Manager* rdma_mg) {
+    if (queued_writes.empty()) {
+      return;
+    }
+    int signaled = 0;
+    if (rdma_mg->RDMA_Write_Batch(queued_writes, qp_type_, target_node_id_,
+                                  &signaled) != 0) {
+      status = Status::IOError("failed to post the table writes");
+    }
+    for (int i = 0; i < signaled; i++) {
+      outstanding_writes.push_back(i + 1 == signaled ? queued_buffer
+                                                     : nullptr);
+    }
+    if (signaled == 0 && queued_buffer != nullptr) {
+      free_data_mr.push_back(queued_buffer);
+    }
+    queued_writes.clear();
+    queued_buffer = nullptr;
+  }
+  // Pick the next flush buffer to fill, a new one is allocated only when all
+  // of them are in flight and the limit is not reached yet.
+  void NextFlushBuffer(RDMA_Manager* rdma_mg) {
+    PollWrites(rdma_mg, false);
+    while (free_data_mr.empty()) {
+      if (local_data_mr.size() < kMaxFlushBuffers) {
+        ibv_mr* new_local_mr = new ibv_mr();
+        rdma_mg->Allocate_Local_RDMA_Slot(*new_local_mr, FlushBuffer);
+        local_data_mr.push_back(new_local_mr);
+        free_data_mr.push_back(new_local_mr);
+        DEBUG_arg("One more local write buffer is added, now %zu total\n", local_data_mr.size());
+      } else {
+        PollWrites(rdma_mg, true);
+      }
+    }
+    filling_data_mr = free_data_mr.back();
+    free_data_mr.pop_back();
+  }
+  // Wait for all the writes of this table.
+  void WaitForWrites(RDMA_Manager* rdma_mg) {
+    if (outstanding_writes.empty()) {
+      return;
+    }
+    ibv_wc wc[outstanding_writes.size()];
+    rdma_mg->poll_completion(wc, outstanding_writes.size(), qp_type_, true,
+                             target_node_id_); //it does not matter whether it is true or false
+    for (auto mr : outstanding_writes) {
+      if (mr != nullptr) {
+        free_data_mr.push_back(mr);
+      }
+    }
+    outstanding_writes.clear();
+#ifndef NDEBUG
+    usleep(10);
+    int check_poll_number =
+        rdma_mg->try_poll_completions(wc, 1, qp_type_, true, target_node_id_);
+    assert( check_poll_number == 0);
+#endif
+  }
 
   std::string compressed_output;
+  // The compression of the values, see Options::compression_start_level.
+  CompressionType compression = kNoCompression;
   uint8_t target_node_id_;
 };
 TableBuilder_BACS::TableBuilder_BACS(const Options& options, IO_type type,
-                                     uint8_t target_node_id)
-    : rep_(new Rep(options, type, target_node_id)) {
+                                     uint8_t target_node_id, int level,
+                                     int bloom_bits)
+    : rep_(new Rep(options, type, target_node_id,
+                   bloom_bits < 0 ? options.bloom_bits : bloom_bits)) {
+  if (level >= options.compression_start_level) {
+    rep_->compression = options.compression;
+  }
   if (rep_->filter_block != nullptr) {
     rep_->filter_block->RestartBlock(0);
   }
@@ -172,6 +321,7 @@ void TableBuilder_BACS::Add(const Slice& key, const Slice& value) {
   if (r->num_entries > 0) {
     assert(r->options.comparator->Compare(key, Slice(r->last_key)) > 0);
   }
+  key_stats_.Add(key, value.size());
   //  DEBUG_arg("ADD new key data, key is %s\n", key.ToString().c_str());
   //  DEBUG_arg("number of entry is %ld\n", r->num_entries);
   //todo: MAKE IT a remote block size which could be 1M
@@ -183,7 +333,30 @@ void TableBuilder_BACS::Add(const Slice& key, const Slice& value) {
   // *           if not, the flush temporal buffer content to the remote memory.
 
 
-  if ((r->offset - r->offset_last_flushed + key.size() + value.size() + 2*sizeof(uint32_t)) >  r->local_data_mr[0]->length) {
+  Slice stored_value = value;
+  uint32_t value_size = static_cast<uint32_t>(value.size());
+  if (r->compression != kNoCompression &&
+      CompressKVValue(r->compression, value, &r->compressed_output)) {
+    stored_value = r->compressed_output;
+    value_size = static_cast<uint32_t>(stored_value.size()) | kCompressedValueBit;
+  }
+  const bool checksummed = r->options.kv_checksums;
+  const size_t record_size =
+      key.size() + stored_value.size() +
+      (checksummed ? 2 * sizeof(uint32_t) + kKVRecordChecksumSize
+                   : KVRecordHeaderSize(r->options.packed_kv_records,
+                                        key.size(),
+                                        static_cast<uint32_t>(
+                                            stored_value.size())));
+  const bool flush =
+      r->offset - r->offset_last_flushed + record_size > r->local_data_mr[0]->length;
+  // A group is read at once, it stays within a chunk and a block.
+  if (r->group_records >= r->options.index_interval || flush ||
+      r->offset - r->group_offset + record_size + kBlockTrailerSize >
+          r->options.block_size) {
+    r->FinishGroup(&key);
+  }
+  if (flush) {
     FlushData();// reset the buffer inside
 
   }
@@ -192,22 +365,9 @@ void TableBuilder_BACS::Add(const Slice& key, const Slice& value) {
 //
 //  }
 
-  //Create a new index entry for every items.
-  {
-
-    // Add to index block from the second data, and when finishing the index block
-    // add the smallest successor of the last key.
-    std::string handle_encoding;
-    //This index point to this offset and the key is this key.
-    r->pending_data_handle.set_offset(r->offset);// This is the offset of the begginning of this block.
-    r->pending_data_handle.set_size(key.size() + value.size() + 2*sizeof(uint32_t));
-    r->pending_data_handle.EncodeTo(&handle_encoding);
-
-    r->index_block->Add(key, Slice(handle_encoding));
-
-
-
-  }
+  // The index entry of the record is added with the ones after it in its
+  // group, see Rep::FinishGroup().
+  r->group_records++;
 
   if (r->filter_block != nullptr) {
     r->filter_block->AddKey(ExtractUserKey(key));
@@ -216,14 +376,28 @@ void TableBuilder_BACS::Add(const Slice& key, const Slice& value) {
   r->last_key.assign(key.data(), key.size());
   //  assert(key.size() == 28 || key.size() == 29);
   //  assert(r->last_key.c_str()[8] == 060);
+  if (ExtractValueType(key) == kTypeDeletion) {
+    r->num_deletions++;
+  }
   r->num_entries++;
   // append k-V pair to the buffer.
-  PutFixed32(&r->data_buff, key.size());
-  PutFixed32(&r->data_buff, value.size());
+  char header[2 * sizeof(uint32_t)];
+  const size_t header_size =
+      checksummed
+          ? EncodeChecksummedKVRecordHeader(header, key.size(), value_size)
+          : EncodeKVRecordHeader(header, r->options.packed_kv_records,
+                                 key.size(), value_size);
+  r->data_buff.append(header, header_size);
   r->data_buff.append(key.data(), key.size());
-  r->data_buff.append(value.data(), value.size());
+  r->data_buff.append(stored_value.data(), stored_value.size());
+  if (checksummed) {
+    char checksum[kKVRecordChecksumSize];
+    EncodeKVRecordChecksum(checksum, Slice(header, header_size), key,
+                           stored_value);
+    r->data_buff.append(checksum, sizeof(checksum));
+  }
   r->offset_last_added = r->offset;
-  r->offset +=  key.size() + value.size() + 2*sizeof(uint32_t);
+  r->offset += record_size;
 
 
 
@@ -419,62 +593,15 @@ void TableBuilder_BACS::FlushData(){
   size_t msg_size = r->offset - r->offset_last_flushed;
   ibv_mr* remote_mr = new ibv_mr();
   std::shared_ptr<RDMA_Manager> rdma_mg =  r->options.env->rdma_mg;
-  rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr, rep_->target_node_id_);
-  //TOTHINK: check the logic below.
-  // I was thinking that the start represent the oldest outgoing buffer, while the
-  // end is the latest buffer. When polling a result, the start index will moving forward
-  // and the start index will be changed to 0 when meeting the end of this index.
-  // If the start index meet the end index, then we need to allocate a new buffer,
-  // and insert to the local buffer vector.
-  // the end index will move forward because a new buffer will be in used, the start
-  // index will also increased by 1 because the insert will cause all the index
-  // after that position to be increased by 1.
-  if (r->data_inuse_start == -1){
-    // first time flush
-    assert(r->data_inuse_end == -1 && r->local_data_mr.size() == 2);
-    rdma_mg->RDMA_Write(remote_mr, r->local_data_mr[0], msg_size,
-                        r->type_string_, IBV_SEND_SIGNALED,
-                        0, rep_->target_node_id_);
-    r->data_inuse_end = 0;
-    r->data_inuse_start = 0;
-    r->data_inuse_empty = false;
-
-  }else{
-    // check the maximum outstanding buffer number, if not set it the flushing and compaction will be messed up
-    //    int maximum_poll_number = r->data_inuse_end - r->data_inuse_start + 1 >= 0 ?
-    //                      r->data_inuse_end - r->data_inuse_start + 1:
-    //                      (int)(r->local_data_mr.size()) - r->data_inuse_start + r->data_inuse_end +1;
-    int maximum_poll_number = 5;
-    auto* wc = new ibv_wc[maximum_poll_number];
-    int poll_num = 0;
-    poll_num = rdma_mg->try_poll_completions(
-        wc, maximum_poll_number, r->type_string_, true, rep_->target_node_id_);
-    // move the start index
-    r->data_inuse_start += poll_num;
-    if(r->data_inuse_start >= r->local_data_mr.size()){
-      r->data_inuse_start = r->data_inuse_start - r->local_data_mr.size();
-    }
-    //    DEBUG_arg("Poll the completion %d\n", poll_num);
-
-    //move forward the end of the outstanding buffer
-    r->data_inuse_end = r->data_inuse_end == r->local_data_mr.size()-1 ? 0:r->data_inuse_end+1;
-    rdma_mg->RDMA_Write(remote_mr, r->local_data_mr[r->data_inuse_end],
-                        msg_size, r->type_string_, IBV_SEND_SIGNALED, 0, rep_->target_node_id_);
-    //Check whether there is available buffer to serialize the memtable onto,
-    // if not allocate a new one and insert it to the vector
-    if (r->data_inuse_start - r->data_inuse_end == 1 ||
-        r->data_inuse_end - r->data_inuse_start == r->local_data_mr.size()-1){
-      ibv_mr* new_local_mr = new ibv_mr();
-      rdma_mg->Allocate_Local_RDMA_Slot(*new_local_mr,FlushBuffer);
-      if(r->data_inuse_start == 0){// if start is 0 then the insert will also increase the index of end.
-        r->data_inuse_end++;
-      }
-      // insert new mr at start while increase start by 1.
-      r->local_data_mr.insert(r->local_data_mr.begin() + r->data_inuse_start++, new_local_mr);
-      DEBUG_arg("One more local write buffer is added, now %zu total\n", r->local_data_mr.size());
-    }
-    delete[] wc;
+  rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr, rep_->target_node_id_, msg_size);
+  // Post the filled buffer and go on with the next one without waiting, the
+  // writes are only waited at Finish or when all the buffers are in flight.
+  // The last one is posted by Finish together with the filter and the index.
+  r->QueueWrite(remote_mr, r->filling_data_mr, msg_size, r->filling_data_mr);
+  if (!r->closed) {
+    r->PostWrites(rdma_mg.get());
   }
+  r->NextFlushBuffer(rdma_mg.get());
   remote_mr->length = msg_size;
   //  if(r->remote_data_mrs.empty()){
   //    r->remote_data_mrs.insert({0, remote_mr});
@@ -501,25 +628,15 @@ void TableBuilder_BACS::FlushData(){
   r->offset_last_flushed = r->offset;
   // Move the datablock pointer to the start of the next write buffer, the other state of the data_block
   // has already reseted before
-  int next_buffer_index = r->data_inuse_end == r->local_data_mr.size()-1 ? 0:r->data_inuse_end+1;
-
-  assert(next_buffer_index != r->data_inuse_start);
-  r->data_buff.Reset((char*)r->local_data_mr[next_buffer_index]->addr, 0);
-  //  DEBUG_arg("In use start is %d\n", r->data_inuse_start);
-  //  DEBUG_arg("In use end is %d\n", r->data_inuse_end);
-  //  DEBUG_arg("Next write buffer to use %d\n", next_buffer_index);
-  //  DEBUG_arg("Total local write buffer number is %zu\n", r->local_data_mr.size());
-  //  DEBUG_arg("MR element number is %lu\n", r->remote_data_mrs.size());
-  //  assert(r->data_inuse_start!= r->data_inuse_end);
+  r->data_buff.Reset((char*)r->filling_data_mr->addr, 0);
   // No need to record the flushing times, because we can check from the remote mr map element number.
 }
 void TableBuilder_BACS::FlushDataIndex(size_t msg_size) {
   Rep* r = rep_;
   ibv_mr* remote_mr = new ibv_mr();
   std::shared_ptr<RDMA_Manager> rdma_mg =  r->options.env->rdma_mg;
-  rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr, rep_->target_node_id_);
-  rdma_mg->RDMA_Write(remote_mr, r->local_index_mr[0], msg_size,
-                      r->type_string_, IBV_SEND_SIGNALED, 0, rep_->target_node_id_);
+  rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr, rep_->target_node_id_, msg_size);
+  r->QueueWrite(remote_mr, r->local_index_mr[0], msg_size, nullptr);
   remote_mr->length = msg_size;
   if(r->remote_dataindex_mrs.empty()){
     r->remote_dataindex_mrs.insert({1, remote_mr});
@@ -536,9 +653,8 @@ void TableBuilder_BACS::FlushFilter(size_t& msg_size) {
   Rep* r = rep_;
   ibv_mr* remote_mr = new ibv_mr();
   std::shared_ptr<RDMA_Manager> rdma_mg =  r->options.env->rdma_mg;
-  rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr, rep_->target_node_id_);
-  rdma_mg->RDMA_Write(remote_mr, r->local_filter_mr[0], msg_size,
-                      r->type_string_, IBV_SEND_SIGNALED, 0, rep_->target_node_id_);
+  rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr, rep_->target_node_id_, msg_size);
+  r->QueueWrite(remote_mr, r->local_filter_mr[0], msg_size, nullptr);
   remote_mr->length = msg_size;
   if(r->remote_filter_mrs.empty()){
     r->remote_filter_mrs.insert({1, remote_mr});
@@ -556,12 +672,15 @@ Status TableBuilder_BACS::status() const { return rep_->status; }
 Status TableBuilder_BACS::Finish() {
   Rep* r = rep_;
 //  UpdateFunctionBLock();
+  assert(!r->closed);
+  r->closed = true;
+  r->FinishGroup(nullptr);
   if (r->offset - r->offset_last_flushed >0){
     FlushData();
   }
+  // The last data chunk is written while the filter is built.
+  r->PostWrites(r->options.env->rdma_mg.get());
 
-  assert(!r->closed);
-  r->closed = true;
   DEBUG_arg("sst offset is %lu\n", r->offset);
   BlockHandle filter_block_handle, metaindex_block_handle, index_block_handle;
 
@@ -616,26 +735,8 @@ Status TableBuilder_BACS::Finish() {
 //    printf("Index block size is %zu", msg_size);
   }
   //  DEBUG_arg("for a sst the remote data chunks number %zu\n", r->remote_data_mrs.size());
-  //TODO: the polling number here sometime is not correct.
-  int num_of_poll = r->data_inuse_end - r->data_inuse_start + 1 >= 0 ?
-                                                                     r->data_inuse_end - r->data_inuse_start + 1:
-                                                                     (int)(r->local_data_mr.size()) - r->data_inuse_start + r->data_inuse_end +1;
-  // add one more for the index block,if have filter block add 2
-  if (r->filter_block != nullptr){
-    num_of_poll = num_of_poll + 2;
-  }else{
-    num_of_poll = num_of_poll + 1;
-  }
-  ibv_wc wc[num_of_poll];
-  r->options.env->rdma_mg->poll_completion(
-      wc, num_of_poll, r->type_string_, true,
-      rep_->target_node_id_); //it does not matter whether it is true or false
-#ifndef NDEBUG
-  usleep(10);
-  int check_poll_number = r->options.env->rdma_mg->try_poll_completions(
-      wc, 1, r->type_string_, true, rep_->target_node_id_);
-  assert( check_poll_number == 0);
-#endif
+  r->PostWrites(r->options.env->rdma_mg.get());
+  r->WaitForWrites(r->options.env->rdma_mg.get());
   //  printf("A table finsihed flushing\n");
   //  // Write footer
   //  if (ok()) {
@@ -659,15 +760,18 @@ void TableBuilder_BACS::Abandon() {
 }
 
 uint64_t TableBuilder_BACS::NumEntries() const { return rep_->num_entries; }
+uint64_t TableBuilder_BACS::NumDeletions() const { return rep_->num_deletions; }
+
+Slice TableBuilder_BACS::LastKey() const { return rep_->last_key; }
 
 uint64_t TableBuilder_BACS::FileSize() const { return rep_->offset; }
-void TableBuilder_BACS::get_datablocks_map(std::map<uint32_t, ibv_mr*>& map) {
+void TableBuilder_BACS::get_datablocks_map(ChunkTable& map) {
   map = rep_->remote_data_mrs;
 }
-void TableBuilder_BACS::get_dataindexblocks_map(std::map<uint32_t, ibv_mr*>& map) {
+void TableBuilder_BACS::get_dataindexblocks_map(ChunkTable& map) {
   map = rep_->remote_dataindex_mrs;
 }
-void TableBuilder_BACS::get_filter_map(std::map<uint32_t, ibv_mr*>& map) {
+void TableBuilder_BACS::get_filter_map(ChunkTable& map) {
   map = rep_->remote_filter_mrs;
 }
 size_t TableBuilder_BACS::get_numentries() {
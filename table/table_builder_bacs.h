@@ -29,8 +29,12 @@ class dLSM_EXPORT TableBuilder_BACS : public TableBuilder{
   // Create a builder that will store the contents of the table it is
   // building in *file.  Does not close the file.  It is up to the
   // caller to close the file after calling Finish().
+  // "level" is the level the table goes to, see
+  // Options::compression_start_level. The filter gets "bloom_bits" bits
+  // per key, or Options::bloom_bits if negative.
   TableBuilder_BACS(const Options& options, IO_type type,
-                    uint8_t target_node_id);
+                    uint8_t target_node_id, int level = 0,
+                    int bloom_bits = -1);
   //  TableBuilder_ComputeSide() = default;
   TableBuilder_BACS(const TableBuilder_BACS&) = delete;
   TableBuilder_BACS& operator=(const TableBuilder_BACS&) = delete;
@@ -78,6 +82,8 @@ class dLSM_EXPORT TableBuilder_BACS : public TableBuilder{
 
   // Number of calls to Add() so far.
   uint64_t NumEntries() const override;
+  uint64_t NumDeletions() const override;
+  Slice LastKey() const override;
 
   // Size of the file generated so far.  If invoked after a successful
   // Finish() call, returns the size of the final generated file.
@@ -91,9 +97,9 @@ class dLSM_EXPORT TableBuilder_BACS : public TableBuilder{
   void FinishFilterBlock(FullFilterBlockBuilder* block, BlockHandle* handle,
                          CompressionType compressiontype,
                          size_t& block_size) override;
-  void get_datablocks_map(std::map<uint32_t, ibv_mr*>& map) override;
-  void get_dataindexblocks_map(std::map<uint32_t, ibv_mr*>& map) override;
-  void get_filter_map(std::map<uint32_t, ibv_mr*>& map) override;
+  void get_datablocks_map(ChunkTable& map) override;
+  void get_dataindexblocks_map(ChunkTable& map) override;
+  void get_filter_map(ChunkTable& map) override;
   size_t get_numentries() override;
  protected:
 
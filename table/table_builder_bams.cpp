@@ -7,20 +7,26 @@
 #include <cassert>
 namespace dLSM {
 struct TableBuilder_BAMS::Rep {
-  Rep(const Options& opt, IO_type type, std::shared_ptr<RDMA_Manager> rdma)
+  Rep(const Options& opt, IO_type type, std::shared_ptr<RDMA_Manager> rdma,
+      int bloom_bits)
       : options(opt),
-        type_(type),
         index_block_options(opt),
-        offset(0),
+        type_(type),
 //        offset_last_added(0),
         offset_last_flushed(0),
+        offset(0),
         
         num_entries(0),
         closed(false),
         pending_index_filter_entry(false) {
     //TOTHINK: why the block restart interval is 1 by default?
     // This is only for index block, is it the same for rocks DB?
-    index_block_options.block_restart_interval = 1;
+    if (opt.index_restart_interval > 0) {
+      index_block_options.block_restart_interval = opt.index_restart_interval;
+    } else {
+      index_block_options.block_restart_interval =
+          opt.index_interval > 1 ? kSparseIndexRestartInterval : 1;
+    }
     rdma_mg = rdma;
     local_data_mr = new ibv_mr();
     local_index_mr = new ibv_mr();
@@ -50,15 +56,16 @@ struct TableBuilder_BAMS::Rep {
     printf("Sucessfully allocate an block %p", local_index_mr->addr);
 #endif
     if (type_ == IO_type::Compact){
-      type_string_ = "write_local_compact";
+      qp_type_ = QP_WRITE_LOCAL_COMPACT;
     }else if(type_ == IO_type::Flush){
-      type_string_ = "write_local_flush";
+      qp_type_ = QP_WRITE_LOCAL_FLUSH;
     }else{
       assert(false);
     }
     filter_block = (opt.filter_policy == nullptr
                         ? nullptr
-                        : new FullFilterBlockBuilder(local_filter_mr, opt.bloom_bits));
+                        : new FullFilterBlockBuilder(local_filter_mr, bloom_bits,
+                                                     opt.filter_type, opt.prefix_extractor));
 
     status = Status::OK();
   }
@@ -66,7 +73,7 @@ struct TableBuilder_BAMS::Rep {
   const Options& options;
   Options index_block_options;
   IO_type type_;
-  std::string type_string_;
+  QP_Type qp_type_;
   std::shared_ptr<RDMA_Manager> rdma_mg;
   //  WritableFile* file;
 
@@ -83,9 +90,9 @@ struct TableBuilder_BAMS::Rep {
   ibv_mr* local_index_mr;
   ibv_mr* local_filter_mr;
   //TODO: make the map offset -> ibv_mr*
-  std::map<uint32_t, ibv_mr*> local_data_mrs;
-  std::map<uint32_t, ibv_mr*> local_dataindex_mrs;
-  std::map<uint32_t, ibv_mr*> local_filter_mrs;
+  ChunkTable local_data_mrs;
+  ChunkTable local_dataindex_mrs;
+  ChunkTable local_filter_mrs;
   //  std::vector<size_t> remote_mr_real_length;
   uint64_t offset_last_flushed;
 //  uint64_t offset_last_added;
@@ -95,6 +102,7 @@ struct TableBuilder_BAMS::Rep {
   BlockBuilder* index_block;
   std::string last_key;
   int64_t num_entries;
+  int64_t num_deletions = 0;
   bool closed;  // Either Finish() or Abandon() has been called.
   FullFilterBlockBuilder* filter_block;
 
@@ -109,12 +117,49 @@ struct TableBuilder_BAMS::Rep {
   // Invariant: r->pending_index_filter_entry is true only if data_block is empty.
   bool pending_index_filter_entry;
   BlockHandle pending_data_handle;  // Handle to add to index block
+  // The records the next index entry covers, from group_offset on.
+  uint64_t group_offset = 0;
+  int group_records = 0;
+
+  // Add the index entry of the group of records before "offset", keyed by
+  // its last key, or by a separator from "next_key", the first key of the
+  // next group, see Options::index_key_separators.
+  void FinishGroup(const Slice* next_key) {
+    if (group_records == 0) {
+      return;
+    }
+    BlockHandle handle;
+    handle.set_offset(group_offset);
+    handle.set_size(offset - group_offset);
+    std::string handle_encoding;
+    EncodeIndexHandle(handle, &handle_encoding);
+    if (options.index_interval > 1) {
+      PutVarint32(&handle_encoding, group_records);
+    }
+    if (next_key != nullptr && options.index_interval > 1 &&
+        options.index_key_separators) {
+      // The records of the group end at last_key, those of the next one
+      // start after the separator.
+      options.comparator->FindShortestSeparator(&last_key, *next_key);
+    }
+    index_block->Add(last_key, Slice(handle_encoding));
+    group_offset = offset;
+    group_records = 0;
+  }
 
   std::string compressed_output;
+  // The compression of the values, see Options::compression_start_level.
+  CompressionType compression = kNoCompression;
 };
 TableBuilder_BAMS::TableBuilder_BAMS(
-    const Options& options, IO_type type, std::shared_ptr<RDMA_Manager> rdma_mg)
-    :rep_(new TableBuilder_BAMS::Rep(options, type, std::move(rdma_mg))) {
+    const Options& options, IO_type type, std::shared_ptr<RDMA_Manager> rdma_mg,
+    int level, int bloom_bits)
+    :rep_(new TableBuilder_BAMS::Rep(
+          options, type, std::move(rdma_mg),
+          bloom_bits < 0 ? options.bloom_bits : bloom_bits)) {
+  if (level >= options.compression_start_level) {
+    rep_->compression = options.compression;
+  }
   if (rep_->filter_block != nullptr) {
     rep_->filter_block->RestartBlock(0);
   }
@@ -171,6 +216,7 @@ void TableBuilder_BAMS::Add(const Slice& key, const Slice& value) {
   if (r->num_entries > 0) {
     assert(r->options.comparator->Compare(key, Slice(r->last_key)) > 0);
   }
+  key_stats_.Add(key, value.size());
   //  DEBUG_arg("ADD new key data, key is %s\n", key.ToString().c_str());
   //  DEBUG_arg("number of entry is %ld\n", r->num_entries);
   //todo: MAKE IT a remote block size which could be 1M
@@ -180,7 +226,30 @@ void TableBuilder_BAMS::Add(const Slice& key, const Slice& value) {
   // *   if so then finish the old data to a block make it insert to a new block
   // *   Second, if new block finished, check whether the write buffer can hold a new block size.
   // *           if not, the flush temporal buffer content to the remote memory.
-  if ((r->offset - r->offset_last_flushed + key.size() + value.size() + 2*sizeof(uint32_t)) >  r->local_data_mr->length) {
+  Slice stored_value = value;
+  uint32_t value_size = static_cast<uint32_t>(value.size());
+  if (r->compression != kNoCompression &&
+      CompressKVValue(r->compression, value, &r->compressed_output)) {
+    stored_value = r->compressed_output;
+    value_size = static_cast<uint32_t>(stored_value.size()) | kCompressedValueBit;
+  }
+  const bool checksummed = r->options.kv_checksums;
+  const size_t record_size =
+      key.size() + stored_value.size() +
+      (checksummed ? 2 * sizeof(uint32_t) + kKVRecordChecksumSize
+                   : KVRecordHeaderSize(r->options.packed_kv_records,
+                                        key.size(),
+                                        static_cast<uint32_t>(
+                                            stored_value.size())));
+  const bool flush =
+      r->offset - r->offset_last_flushed + record_size > r->local_data_mr->length;
+  // A group is read at once, it stays within a chunk and a block.
+  if (r->group_records >= r->options.index_interval || flush ||
+      r->offset - r->group_offset + record_size + kBlockTrailerSize >
+          r->options.block_size) {
+    r->FinishGroup(&key);
+  }
+  if (flush) {
     FlushData();// reset the buffer inside
 
   }
@@ -189,27 +258,6 @@ void TableBuilder_BAMS::Add(const Slice& key, const Slice& value) {
   //
   //  }
 
-  //Create a new index entry for every items.
-  {
-    //    assert(r->data_block->empty());
-    //#ifndef NDEBUG
-    //    size_t key_length = r->last_key.size();
-    //#endif
-    //    assert(r->last_key.size()>= 8);
-//    if (!r->last_key.empty()){
-//      r->options.comparator->FindShortestSeparator(&r->last_key, key);
-      //    assert(r->last_key.size() >= 8  );
-      std::string handle_encoding;
-      //This index point to this offset and the key is this key.
-      r->pending_data_handle.set_offset(r->offset);// This is the offset of the begginning of this block.
-      r->pending_data_handle.set_size(key.size() + value.size() + 2*sizeof(uint32_t));
-      r->pending_data_handle.EncodeTo(&handle_encoding);
-
-      r->index_block->Add(key, Slice(handle_encoding));
-    }
-
-//  }
-
   if (r->filter_block != nullptr) {
     r->filter_block->AddKey(ExtractUserKey(key));
   }
@@ -217,14 +265,31 @@ void TableBuilder_BAMS::Add(const Slice& key, const Slice& value) {
   r->last_key.assign(key.data(), key.size());
   //  assert(key.size() == 28 || key.size() == 29);
   //  assert(r->last_key.c_str()[8] == 060);
+  if (ExtractValueType(key) == kTypeDeletion) {
+    r->num_deletions++;
+  }
   r->num_entries++;
   // append k-V pair to the buffer.
-  PutFixed32(&r->data_buff, key.size());
-  PutFixed32(&r->data_buff, value.size());
+  char header[2 * sizeof(uint32_t)];
+  const size_t header_size =
+      checksummed
+          ? EncodeChecksummedKVRecordHeader(header, key.size(), value_size)
+          : EncodeKVRecordHeader(header, r->options.packed_kv_records,
+                                 key.size(), value_size);
+  r->data_buff.append(header, header_size);
   r->data_buff.append(key.data(), key.size());
-  r->data_buff.append(value.data(), value.size());
+  r->data_buff.append(stored_value.data(), stored_value.size());
+  if (checksummed) {
+    char checksum[kKVRecordChecksumSize];
+    EncodeKVRecordChecksum(checksum, Slice(header, header_size), key,
+                           stored_value);
+    r->data_buff.append(checksum, sizeof(checksum));
+  }
 //  r->offset_last_added = r->offset;
-  r->offset +=  key.size() + value.size() + 2*sizeof(uint32_t);
+  r->offset += record_size;
+  // The index entry of the record is added with the ones after it in its
+  // group, see Rep::FinishGroup().
+  r->group_records++;
 
 
 
@@ -457,6 +522,7 @@ Status TableBuilder_BAMS::status() const { return rep_->status; }
 Status TableBuilder_BAMS::Finish() {
   Rep* r = rep_;
 //  UpdateFunctionBLock();
+  r->FinishGroup(nullptr);
   if (r->offset - r->offset_last_flushed >0){
     FlushData();
   }
@@ -528,15 +594,18 @@ void TableBuilder_BAMS::Abandon() {
 }
 
 uint64_t TableBuilder_BAMS::NumEntries() const { return rep_->num_entries; }
+uint64_t TableBuilder_BAMS::NumDeletions() const { return rep_->num_deletions; }
+
+Slice TableBuilder_BAMS::LastKey() const { return rep_->last_key; }
 
 uint64_t TableBuilder_BAMS::FileSize() const { return rep_->offset; }
-void TableBuilder_BAMS::get_datablocks_map(std::map<uint32_t, ibv_mr*>& map) {
+void TableBuilder_BAMS::get_datablocks_map(ChunkTable& map) {
   map = rep_->local_data_mrs;
 }
-void TableBuilder_BAMS::get_dataindexblocks_map(std::map<uint32_t, ibv_mr*>& map) {
+void TableBuilder_BAMS::get_dataindexblocks_map(ChunkTable& map) {
   map = rep_->local_dataindex_mrs;
 }
-void TableBuilder_BAMS::get_filter_map(std::map<uint32_t, ibv_mr*>& map) {
+void TableBuilder_BAMS::get_filter_map(ChunkTable& map) {
   map = rep_->local_filter_mrs;
 }
 size_t TableBuilder_BAMS::get_numentries() {
@@ -5,14 +5,30 @@
 #include "table_builder_computeside.h"
 
 #include "db/dbformat.h"
+#include "dLSM/rate_limiter.h"
+#include <algorithm>
 #include <cassert>
+#include <deque>
 
 namespace dLSM {
+// Wait for the rate limiters of the options, if any, before writing "bytes"
+// of a table.
+static void ThrottleWrite(const Options& options, IO_type type, size_t bytes) {
+  const RateLimiter::Priority priority =
+      type == IO_type::Flush ? RateLimiter::kHigh : RateLimiter::kLow;
+  if (options.rate_limiter != nullptr) {
+    options.rate_limiter->Request(static_cast<int64_t>(bytes), priority);
+  }
+  if (options.rdma_limiter != nullptr) {
+    options.rdma_limiter->Request(static_cast<int64_t>(bytes), priority);
+  }
+}
+
 //TOthink: how to save the remote mr?
 //TOFIX : now we suppose the index and filter block will not over the write buffer.
 // TODO: make the Option of tablebuilder a pointer avoiding large data copying
 struct TableBuilder_ComputeSide::Rep {
-  Rep(const Options& opt, IO_type type)
+  Rep(const Options& opt, IO_type type, int bloom_bits)
   : options(opt),
   index_block_options(opt),
   type_(type),
@@ -44,24 +60,27 @@ struct TableBuilder_ComputeSide::Rep {
     rdma_mg->Allocate_Local_RDMA_Slot(*temp_index_mr, IndexChunk);
     rdma_mg->Allocate_Local_RDMA_Slot(*temp_filter_mr, FilterChunk);
     local_data_mr.push_back(temp_data_mr);
+    free_data_mr.push_back(temp_data_mr);
     local_index_mr.push_back(temp_index_mr);
     memset(temp_filter_mr->addr, 0, temp_filter_mr->length);
     local_filter_mr.push_back(temp_filter_mr);
+    filling_data_mr = local_data_mr[0];
     //    delete temp_data_mr;
     //    delete temp_index_mr;
     //    delete temp_filter_mr;
     data_block = new BlockBuilder(&options, local_data_mr[0]);
     index_block = new BlockBuilder(&index_block_options, local_index_mr[0]);
     if (type_ == IO_type::Compact){
-      type_string_ = "write_local_compact";
+      qp_type_ = QP_WRITE_LOCAL_COMPACT;
     }else if(type_ == IO_type::Flush){
-      type_string_ = "write_local_flush";
+      qp_type_ = QP_WRITE_LOCAL_FLUSH;
     }else{
       assert(false);
     }
     filter_block = (opt.filter_policy == nullptr
         ? nullptr
-        : new FullFilterBlockBuilder(local_filter_mr[0], opt.bloom_bits));
+        : new FullFilterBlockBuilder(local_filter_mr[0], bloom_bits,
+                                     opt.filter_type, opt.prefix_extractor));
 
     status = Status::OK();
   }
@@ -69,23 +88,26 @@ struct TableBuilder_ComputeSide::Rep {
   const Options& options;
   Options index_block_options;
   IO_type type_;
-  std::string type_string_;
+  QP_Type qp_type_;
   //  WritableFile* file;
+  // At most this many flush buffers per table, one is filled while the others
+  // are in flight.
+  static constexpr size_t kMaxFlushBuffers = 3;
+  // All the flush buffers, released at destruction.
   std::vector<ibv_mr*> local_data_mr;
-  // the start index of the in use buffer
-  int data_inuse_start = -1;
-  // the end index of the use buffer
-  int data_inuse_end = -1;
-  // when start larger than end by 1, there could be two scenarios:
-  // First, all the buffer are outstanding
-  // second, no buffer is outstanding, those two status will both have start - end = 1
-  bool data_inuse_empty = true;
+  // The flush buffers neither in flight nor being filled.
+  std::vector<ibv_mr*> free_data_mr;
+  // The flush buffer the data is serialized onto.
+  ibv_mr* filling_data_mr;
+  // Signaled writes in flight in posting order, nullptr for an index or
+  // filter write. The queue pair completes them in the same order.
+  std::deque<ibv_mr*> outstanding_writes;
   std::vector<ibv_mr*> local_index_mr;
   std::vector<ibv_mr*> local_filter_mr;
   //TODO: make the map offset -> ibv_mr*
-  std::map<uint32_t, ibv_mr*> remote_data_mrs;
-  std::map<uint32_t, ibv_mr*> remote_dataindex_mrs;
-  std::map<uint32_t, ibv_mr*> remote_filter_mrs;
+  ChunkTable remote_data_mrs;
+  ChunkTable remote_dataindex_mrs;
+  ChunkTable remote_filter_mrs;
   //  std::vector<size_t> remote_mr_real_length;
   uint64_t offset_last_flushed;
   uint64_t offset;
@@ -94,6 +116,7 @@ struct TableBuilder_ComputeSide::Rep {
   BlockBuilder* index_block;
   std::string last_key;
   int64_t num_entries;
+  int64_t num_deletions = 0;
   bool closed;  // Either Finish() or Abandon() has been called.
   FullFilterBlockBuilder* filter_block;
 
@@ -109,12 +132,75 @@ struct TableBuilder_ComputeSide::Rep {
   bool pending_index_filter_entry;
   BlockHandle pending_data_handle;  // Handle to add to index block
 
+  // Pop the finished writes off outstanding_writes and give their flush
+  // buffers back. If wait is set, block until at least one write finishes.
+  void PollWrites(RDMA_Manager* rdma_mg, bool wait) {
+    ibv_wc wc[kMaxFlushBuffers + 2];
+    int poll_num = std::min(outstanding_writes.size(),
+                            sizeof(wc) / sizeof(ibv_wc));
+    if (wait) {
+      rdma_mg->poll_completion(wc, 1, qp_type_, true, 0);
+      poll_num = 1;
+    } else {
+      poll_num = rdma_mg->try_poll_completions(wc, poll_num, qp_type_, true,
+                                               0);
+    }
+    for (int i = 0; i < poll_num; i++) {
+      assert(!outstanding_writes.empty());
+      if (outstanding_writes.front() != nullptr) {
+        free_data_mr.push_back(outstanding_writes.front());
+      }
+      outstanding_writes.pop_front();
+    }
+  }
+  // Pick the next flush buffer to fill, a new one is allocated only when all
+  // of them are in flight and the limit is not reached yet.
+  void NextFlushBuffer(RDMA_Manager* rdma_mg) {
+    PollWrites(rdma_mg, false);
+    while (free_data_mr.empty()) {
+      if (local_data_mr.size() < kMaxFlushBuffers) {
+        ibv_mr* new_local_mr = new ibv_mr();
+        rdma_mg->Allocate_Local_RDMA_Slot(*new_local_mr, FlushBuffer);
+        local_data_mr.push_back(new_local_mr);
+        free_data_mr.push_back(new_local_mr);
+        DEBUG_arg("One more local write buffer is added, now %zu total\n", local_data_mr.size());
+      } else {
+        PollWrites(rdma_mg, true);
+      }
+    }
+    filling_data_mr = free_data_mr.back();
+    free_data_mr.pop_back();
+  }
+  // Wait for all the writes of this table.
+  void WaitForWrites(RDMA_Manager* rdma_mg) {
+    if (outstanding_writes.empty()) {
+      return;
+    }
+    ibv_wc wc[outstanding_writes.size()];
+    rdma_mg->poll_completion(wc, outstanding_writes.size(), qp_type_, true,
+                             0); //it does not matter whether it is true or false
+    for (auto mr : outstanding_writes) {
+      if (mr != nullptr) {
+        free_data_mr.push_back(mr);
+      }
+    }
+    outstanding_writes.clear();
+#ifndef NDEBUG
+    usleep(10);
+    int check_poll_number =
+        rdma_mg->try_poll_completions(wc, 1, qp_type_, true, 0);
+    assert( check_poll_number == 0);
+#endif
+  }
+
   std::string compressed_output;
 };
 TableBuilder_ComputeSide::TableBuilder_ComputeSide(const Options& options,
                                                    IO_type type,
-                                                   uint8_t target_node_id)
-    : rep_(new Rep(options, type)) {
+                                                   uint8_t /*target_node_id*/,
+                                                   int bloom_bits)
+    : rep_(new Rep(options, type,
+                   bloom_bits < 0 ? options.bloom_bits : bloom_bits)) {
   if (rep_->filter_block != nullptr) {
     rep_->filter_block->RestartBlock(0);
   }
@@ -167,6 +253,7 @@ void TableBuilder_ComputeSide::Add(const Slice& key, const Slice& value) {
   if (r->num_entries > 0) {
     assert(r->options.comparator->Compare(key, Slice(r->last_key)) > 0);
   }
+  key_stats_.Add(key, value.size());
 //  DEBUG_arg("ADD new key data, key is %s\n", key.ToString().c_str());
 //  DEBUG_arg("number of entry is %ld\n", r->num_entries);
   //todo: MAKE IT a remote block size which could be 1M
@@ -197,7 +284,7 @@ void TableBuilder_ComputeSide::Add(const Slice& key, const Slice& value) {
 //    assert(r->last_key.size() >= 8  );
     std::string handle_encoding;
     //Note that the handle block size does not contain CRC!
-    r->pending_data_handle.EncodeTo(&handle_encoding);
+    EncodeIndexHandle(r->pending_data_handle, &handle_encoding);
     if (r->index_block->CurrentSizeEstimate()+ r->last_key.size() + handle_encoding.size() +
         sizeof (uint32_t) + kBlockTrailerSize > r->local_index_mr[0]->length){
       assert(false);
@@ -218,6 +305,9 @@ void TableBuilder_ComputeSide::Add(const Slice& key, const Slice& value) {
   r->last_key.assign(key.data(), key.size());
 //  assert(key.size() == 28 || key.size() == 29);
 //  assert(r->last_key.c_str()[8] == 060);
+  if (ExtractValueType(key) == kTypeDeletion) {
+    r->num_deletions++;
+  }
   r->num_entries++;
   r->data_block->Add(key, value);
 
@@ -413,61 +503,14 @@ void TableBuilder_ComputeSide::FlushData(){
   size_t msg_size = r->offset - r->offset_last_flushed;
   ibv_mr* remote_mr = new ibv_mr();
   std::shared_ptr<RDMA_Manager> rdma_mg =  r->options.env->rdma_mg;
-  rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr, 0);
-  //TOTHINK: check the logic below.
-  // I was thinking that the start represent the oldest outgoing buffer, while the
-  // end is the latest buffer. When polling a result, the start index will moving forward
-  // and the start index will be changed to 0 when meeting the end of this index.
-  // If the start index meet the end index, then we need to allocate a new buffer,
-  // and insert to the local buffer vector.
-  // the end index will move forward because a new buffer will be in used, the start
-  // index will also increased by 1 because the insert will cause all the index
-  // after that position to be increased by 1.
-  if (r->data_inuse_start == -1){
-    // first time flush
-    assert(r->data_inuse_end == -1 && r->local_data_mr.size() == 2);
-    rdma_mg->RDMA_Write(remote_mr, r->local_data_mr[0], msg_size,
-                        r->type_string_, IBV_SEND_SIGNALED, 0, 0);
-    r->data_inuse_end = 0;
-    r->data_inuse_start = 0;
-    r->data_inuse_empty = false;
-
-  }else{
-    // check the maximum outstanding buffer number, if not set it the flushing and compaction will be messed up
-//    int maximum_poll_number = r->data_inuse_end - r->data_inuse_start + 1 >= 0 ?
-//                      r->data_inuse_end - r->data_inuse_start + 1:
-//                      (int)(r->local_data_mr.size()) - r->data_inuse_start + r->data_inuse_end +1;
-    int maximum_poll_number = 5;
-    auto* wc = new ibv_wc[maximum_poll_number];
-    int poll_num = 0;
-    poll_num = rdma_mg->try_poll_completions(wc, maximum_poll_number,
-                                             r->type_string_, true, 0);
-    // move the start index
-    r->data_inuse_start += poll_num;
-    if(r->data_inuse_start >= r->local_data_mr.size()){
-      r->data_inuse_start = r->data_inuse_start - r->local_data_mr.size();
-    }
-//    DEBUG_arg("Poll the completion %d\n", poll_num);
-
-    //move forward the end of the outstanding buffer
-    r->data_inuse_end = r->data_inuse_end == r->local_data_mr.size()-1 ? 0:r->data_inuse_end+1;
-    rdma_mg->RDMA_Write(remote_mr, r->local_data_mr[r->data_inuse_end],
-                        msg_size, r->type_string_, IBV_SEND_SIGNALED, 0, 0);
-    //Check whether there is available buffer to serialize the memtable onto,
-    // if not allocate a new one and insert it to the vector
-    if (r->data_inuse_start - r->data_inuse_end == 1 ||
-        r->data_inuse_end - r->data_inuse_start == r->local_data_mr.size()-1){
-      ibv_mr* new_local_mr = new ibv_mr();
-      rdma_mg->Allocate_Local_RDMA_Slot(*new_local_mr,FlushBuffer);
-      if(r->data_inuse_start == 0){// if start is 0 then the insert will also increase the index of end.
-        r->data_inuse_end++;
-      }
-      // insert new mr at start while increase start by 1.
-      r->local_data_mr.insert(r->local_data_mr.begin() + r->data_inuse_start++, new_local_mr);
-      DEBUG_arg("One more local write buffer is added, now %zu total\n", r->local_data_mr.size());
-    }
-    delete[] wc;
-  }
+  rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr, 0, msg_size);
+  ThrottleWrite(r->options, r->type_, msg_size);
+  // Post the filled buffer and go on with the next one without waiting, the
+  // writes are only waited at Finish or when all the buffers are in flight.
+  rdma_mg->RDMA_Write(remote_mr, r->filling_data_mr, msg_size,
+                      r->qp_type_, IBV_SEND_SIGNALED, 0, 0);
+  r->outstanding_writes.push_back(r->filling_data_mr);
+  r->NextFlushBuffer(rdma_mg.get());
   remote_mr->length = msg_size;
 //  if(r->remote_data_mrs.empty()){
 //    r->remote_data_mrs.insert({0, remote_mr});
@@ -494,25 +537,18 @@ void TableBuilder_ComputeSide::FlushData(){
   r->offset_last_flushed = r->offset;
   // Move the datablock pointer to the start of the next write buffer, the other state of the data_block
   // has already reseted before
-  int next_buffer_index = r->data_inuse_end == r->local_data_mr.size()-1 ? 0:r->data_inuse_end+1;
-
-  assert(next_buffer_index != r->data_inuse_start);
-  r->data_block->Move_buffer(const_cast<const char*>(static_cast<char*>(r->local_data_mr[next_buffer_index]->addr)));
-//  DEBUG_arg("In use start is %d\n", r->data_inuse_start);
-//  DEBUG_arg("In use end is %d\n", r->data_inuse_end);
-//  DEBUG_arg("Next write buffer to use %d\n", next_buffer_index);
-//  DEBUG_arg("Total local write buffer number is %zu\n", r->local_data_mr.size());
-//  DEBUG_arg("MR element number is %lu\n", r->remote_data_mrs.size());
-//  assert(r->data_inuse_start!= r->data_inuse_end);
+  r->data_block->Move_buffer(const_cast<const char*>(static_cast<char*>(r->filling_data_mr->addr)));
   // No need to record the flushing times, because we can check from the remote mr map element number.
 }
 void TableBuilder_ComputeSide::FlushDataIndex(size_t msg_size) {
   Rep* r = rep_;
   ibv_mr* remote_mr = new ibv_mr();
   std::shared_ptr<RDMA_Manager> rdma_mg =  r->options.env->rdma_mg;
-  rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr, 0);
+  rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr, 0, msg_size);
+  ThrottleWrite(r->options, r->type_, msg_size);
   rdma_mg->RDMA_Write(remote_mr, r->local_index_mr[0], msg_size,
-                      r->type_string_, IBV_SEND_SIGNALED, 0, 0);
+                      r->qp_type_, IBV_SEND_SIGNALED, 0, 0);
+  r->outstanding_writes.push_back(nullptr);
   remote_mr->length = msg_size;
   if(r->remote_dataindex_mrs.empty()){
     r->remote_dataindex_mrs.insert({1, remote_mr});
@@ -529,9 +565,11 @@ void TableBuilder_ComputeSide::FlushFilter(size_t& msg_size) {
   Rep* r = rep_;
   ibv_mr* remote_mr = new ibv_mr();
   std::shared_ptr<RDMA_Manager> rdma_mg =  r->options.env->rdma_mg;
-  rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr, 0);
+  rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr, 0, msg_size);
+  ThrottleWrite(r->options, r->type_, msg_size);
   rdma_mg->RDMA_Write(remote_mr, r->local_filter_mr[0], msg_size,
-                      r->type_string_, IBV_SEND_SIGNALED, 0, 0);
+                      r->qp_type_, IBV_SEND_SIGNALED, 0, 0);
+  r->outstanding_writes.push_back(nullptr);
   remote_mr->length = msg_size;
   if(r->remote_filter_mrs.empty()){
     r->remote_filter_mrs.insert({1, remote_mr});
@@ -593,7 +631,7 @@ Status TableBuilder_ComputeSide::Finish() {
     if(r->pending_index_filter_entry){
       r->options.comparator->FindShortSuccessor(&r->last_key);
       std::string handle_encoding;
-      r->pending_data_handle.EncodeTo(&handle_encoding);
+      EncodeIndexHandle(r->pending_data_handle, &handle_encoding);
       r->index_block->Add(r->last_key, Slice(handle_encoding));
       r->pending_index_filter_entry = false;
     }
@@ -604,26 +642,7 @@ Status TableBuilder_ComputeSide::Finish() {
 //    printf("Index block size is %zu", msg_size);
   }
 //  DEBUG_arg("for a sst the remote data chunks number %zu\n", r->remote_data_mrs.size());
-  //TODO: the polling number here sometime is not correct.
-  int num_of_poll = r->data_inuse_end - r->data_inuse_start + 1 >= 0 ?
-                    r->data_inuse_end - r->data_inuse_start + 1:
-                    (int)(r->local_data_mr.size()) - r->data_inuse_start + r->data_inuse_end +1;
-  // add one more for the index block,if have filter block add 2
-  if (r->filter_block != nullptr){
-    num_of_poll = num_of_poll + 2;
-  }else{
-    num_of_poll = num_of_poll + 1;
-  }
-  ibv_wc wc[num_of_poll];
-  r->options.env->rdma_mg->poll_completion(
-      wc, num_of_poll, r->type_string_, true,
-      0); //it does not matter whether it is true or false
-#ifndef NDEBUG
-  usleep(10);
-  int check_poll_number = r->options.env->rdma_mg->try_poll_completions(
-      wc, 1, r->type_string_, true, 0);
-  assert( check_poll_number == 0);
-#endif
+  r->WaitForWrites(r->options.env->rdma_mg.get());
 //  printf("A table finsihed flushing\n");
 //  // Write footer
 //  if (ok()) {
@@ -647,15 +666,18 @@ void TableBuilder_ComputeSide::Abandon() {
 }
 
 uint64_t TableBuilder_ComputeSide::NumEntries() const { return rep_->num_entries; }
+uint64_t TableBuilder_ComputeSide::NumDeletions() const { return rep_->num_deletions; }
+
+Slice TableBuilder_ComputeSide::LastKey() const { return rep_->last_key; }
 
 uint64_t TableBuilder_ComputeSide::FileSize() const { return rep_->offset; }
-void TableBuilder_ComputeSide::get_datablocks_map(std::map<uint32_t, ibv_mr*>& map) {
+void TableBuilder_ComputeSide::get_datablocks_map(ChunkTable& map) {
   map = rep_->remote_data_mrs;
 }
-void TableBuilder_ComputeSide::get_dataindexblocks_map(std::map<uint32_t, ibv_mr*>& map) {
+void TableBuilder_ComputeSide::get_dataindexblocks_map(ChunkTable& map) {
   map = rep_->remote_dataindex_mrs;
 }
-void TableBuilder_ComputeSide::get_filter_map(std::map<uint32_t, ibv_mr*>& map) {
+void TableBuilder_ComputeSide::get_filter_map(ChunkTable& map) {
   map = rep_->remote_filter_mrs;
 }
 size_t TableBuilder_ComputeSide::get_numentries() {
@@ -40,8 +40,10 @@ class dLSM_EXPORT TableBuilder_ComputeSide : public TableBuilder{
   // Create a builder that will store the contents of the table it is
   // building in *file.  Does not close the file.  It is up to the
   // caller to close the file after calling Finish().
+  // The filter gets "bloom_bits" bits per key, or Options::bloom_bits if
+  // negative.
   TableBuilder_ComputeSide(const Options& options, IO_type type,
-                           uint8_t target_node_id);
+                           uint8_t target_node_id, int bloom_bits = -1);
 //  TableBuilder_ComputeSide() = default;
   TableBuilder_ComputeSide(const TableBuilder_ComputeSide&) = delete;
   TableBuilder_ComputeSide& operator=(const TableBuilder_ComputeSide&) = delete;
@@ -89,6 +91,8 @@ class dLSM_EXPORT TableBuilder_ComputeSide : public TableBuilder{
 
   // Number of calls to Add() so far.
   uint64_t NumEntries() const override;
+  uint64_t NumDeletions() const override;
+  Slice LastKey() const override;
 
   // Size of the file generated so far.  If invoked after a successful
   // Finish() call, returns the size of the final generated file.
@@ -102,9 +106,9 @@ class dLSM_EXPORT TableBuilder_ComputeSide : public TableBuilder{
   void FinishFilterBlock(FullFilterBlockBuilder* block, BlockHandle* handle,
                          CompressionType compressiontype,
                          size_t& block_size) override;
-  void get_datablocks_map(std::map<uint32_t, ibv_mr*>& map) override;
-  void get_dataindexblocks_map(std::map<uint32_t, ibv_mr*>& map) override;
-  void get_filter_map(std::map<uint32_t, ibv_mr*>& map) override;
+  void get_datablocks_map(ChunkTable& map) override;
+  void get_dataindexblocks_map(ChunkTable& map) override;
+  void get_filter_map(ChunkTable& map) override;
   size_t get_numentries() override;
  protected:
 
@@ -6,16 +6,29 @@
 #include "util/crc32c.h"
 #include <cassert>
 #include "db/dbformat.h"
+#include "dLSM/rate_limiter.h"
 
 namespace dLSM {
+// The compactions of the memory node write the tables in the memory of the
+// node, which the foreground RDMA reads compete for, so that they are
+// throttled as well.
+static void ThrottleWrite(const Options& options, IO_type type, size_t bytes) {
+  if (options.rate_limiter != nullptr) {
+    options.rate_limiter->Request(
+        static_cast<int64_t>(bytes),
+        type == IO_type::Flush ? RateLimiter::kHigh : RateLimiter::kLow);
+  }
+}
+
 // TODO: Add target node id in Rep
 struct TableBuilder_Memoryside::Rep {
-  Rep(const Options& opt, IO_type type, std::shared_ptr<RDMA_Manager> rdma)
+  Rep(const Options& opt, IO_type type, std::shared_ptr<RDMA_Manager> rdma,
+      int bloom_bits)
       : options(opt),
-  type_(type),
   index_block_options(opt),
-  offset(0),
+  type_(type),
   offset_last_flushed(0),
+  offset(0),
 
   num_entries(0),
   closed(false),
@@ -52,15 +65,16 @@ struct TableBuilder_Memoryside::Rep {
     printf("Sucessfully allocate an block %p", local_index_mr->addr);
 #endif
     if (type_ == IO_type::Compact){
-      type_string_ = "write_local_compact";
+      qp_type_ = QP_WRITE_LOCAL_COMPACT;
     }else if(type_ == IO_type::Flush){
-      type_string_ = "write_local_flush";
+      qp_type_ = QP_WRITE_LOCAL_FLUSH;
     }else{
       assert(false);
     }
     filter_block = (opt.filter_policy == nullptr
         ? nullptr
-        : new FullFilterBlockBuilder(local_filter_mr, opt.bloom_bits));
+        : new FullFilterBlockBuilder(local_filter_mr, bloom_bits,
+                                     opt.filter_type, opt.prefix_extractor));
 
     status = Status::OK();
   }
@@ -68,7 +82,7 @@ struct TableBuilder_Memoryside::Rep {
   const Options& options;
   Options index_block_options;
   IO_type type_;
-  std::string type_string_;
+  QP_Type qp_type_;
   std::shared_ptr<RDMA_Manager> rdma_mg;
   //  WritableFile* file;
 
@@ -85,9 +99,9 @@ struct TableBuilder_Memoryside::Rep {
   ibv_mr* local_index_mr;
   ibv_mr* local_filter_mr;
   //TODO: make the map offset -> ibv_mr*
-  std::map<uint32_t, ibv_mr*> local_data_mrs;
-  std::map<uint32_t, ibv_mr*> local_dataindex_mrs;
-  std::map<uint32_t, ibv_mr*> local_filter_mrs;
+  ChunkTable local_data_mrs;
+  ChunkTable local_dataindex_mrs;
+  ChunkTable local_filter_mrs;
   //  std::vector<size_t> remote_mr_real_length;
   uint64_t offset_last_flushed;
   uint64_t offset;
@@ -96,6 +110,7 @@ struct TableBuilder_Memoryside::Rep {
   BlockBuilder* index_block;
   std::string last_key;
   int64_t num_entries;
+  int64_t num_deletions = 0;
   bool closed;  // Either Finish() or Abandon() has been called.
   FullFilterBlockBuilder* filter_block;
 
@@ -114,8 +129,11 @@ struct TableBuilder_Memoryside::Rep {
   std::string compressed_output;
 };
 TableBuilder_Memoryside::TableBuilder_Memoryside(
-    const Options& options, IO_type type, std::shared_ptr<RDMA_Manager> rdma_mg)
-    :rep_(new TableBuilder_Memoryside::Rep(options, type, std::move(rdma_mg))) {
+    const Options& options, IO_type type, std::shared_ptr<RDMA_Manager> rdma_mg,
+    int bloom_bits)
+    :rep_(new TableBuilder_Memoryside::Rep(
+          options, type, std::move(rdma_mg),
+          bloom_bits < 0 ? options.bloom_bits : bloom_bits)) {
   if (rep_->filter_block != nullptr) {
     rep_->filter_block->RestartBlock(0);
   }
@@ -172,6 +190,7 @@ void TableBuilder_Memoryside::Add(const Slice& key, const Slice& value) {
   if (r->num_entries > 0) {
     assert(r->options.comparator->Compare(key, Slice(r->last_key)) > 0);
   }
+  key_stats_.Add(key, value.size());
   //  DEBUG_arg("ADD new key data, key is %s\n", key.ToString().c_str());
   //  DEBUG_arg("number of entry is %ld\n", r->num_entries);
   //todo: MAKE IT a remote block size which could be 1M
@@ -198,7 +217,7 @@ void TableBuilder_Memoryside::Add(const Slice& key, const Slice& value) {
     assert(r->last_key.size()>= 8);
     std::string handle_encoding;
     //Note that the handle block size does not contain CRC!
-    r->pending_data_handle.EncodeTo(&handle_encoding);
+    EncodeIndexHandle(r->pending_data_handle, &handle_encoding);
     if (r->index_block->CurrentSizeEstimate()+ r->last_key.size() + handle_encoding.size() +
     sizeof (uint32_t) + kBlockTrailerSize > r->local_index_mr->length){
       BlockHandle dummy_handle;
@@ -230,6 +249,9 @@ void TableBuilder_Memoryside::Add(const Slice& key, const Slice& value) {
   }
 
   r->last_key.assign(key.data(), key.size());
+  if (ExtractValueType(key) == kTypeDeletion) {
+    r->num_deletions++;
+  }
   r->num_entries++;
   r->data_block->Add(key, value);
 
@@ -415,6 +437,7 @@ void TableBuilder_Memoryside::FlushData(){
 //  std::shared_ptr<RDMA_Manager> rdma_mg =  r->options.env->rdma_mg;
 //  size_t msg_size = r->offset - r->offset_last_flushed;
   r->local_data_mr->length = r->offset - r->offset_last_flushed;
+  ThrottleWrite(r->options, r->type_, r->local_data_mr->length);
   r->local_data_mrs.insert({r->offset, r->local_data_mr});
   r->offset_last_flushed = r->offset;
   r->local_data_mr = new ibv_mr();
@@ -432,6 +455,7 @@ void TableBuilder_Memoryside::FlushDataIndex(size_t msg_size) {
   Rep* r = rep_;
 //  std::shared_ptr<RDMA_Manager> rdma_mg =  r->options.env->rdma_mg;
   r->local_index_mr->length = msg_size;
+  ThrottleWrite(r->options, r->type_, msg_size);
   assert(r->local_index_mr!= nullptr);
   r->local_dataindex_mrs.insert({r->offset, r->local_index_mr});
 
@@ -448,6 +472,7 @@ void TableBuilder_Memoryside::FlushFilter(size_t& msg_size) {
   Rep* r = rep_;
 //  std::shared_ptr<RDMA_Manager> rdma_mg =  r->options.env->rdma_mg;
   r->local_filter_mr->length = msg_size;
+  ThrottleWrite(r->options, r->type_, msg_size);
   r->local_filter_mrs.insert({r->offset, r->local_filter_mr});
   //TOFIX: the index may overflow and need to create a new index write buffer, otherwise
   // it would be overwrited.
@@ -507,7 +532,7 @@ Status TableBuilder_Memoryside::Finish() {
       r->options.comparator->FindShortSuccessor(&r->last_key);
 //      assert(r->last_key.size()>= 8);
       std::string handle_encoding;
-      r->pending_data_handle.EncodeTo(&handle_encoding);
+      EncodeIndexHandle(r->pending_data_handle, &handle_encoding);
       r->index_block->Add(r->last_key, Slice(handle_encoding));
       r->pending_index_filter_entry = false;
     }
@@ -527,15 +552,18 @@ void TableBuilder_Memoryside::Abandon() {
 }
 
 uint64_t TableBuilder_Memoryside::NumEntries() const { return rep_->num_entries; }
+uint64_t TableBuilder_Memoryside::NumDeletions() const { return rep_->num_deletions; }
+
+Slice TableBuilder_Memoryside::LastKey() const { return rep_->last_key; }
 
 uint64_t TableBuilder_Memoryside::FileSize() const { return rep_->offset; }
-void TableBuilder_Memoryside::get_datablocks_map(std::map<uint32_t, ibv_mr*>& map) {
+void TableBuilder_Memoryside::get_datablocks_map(ChunkTable& map) {
   map = rep_->local_data_mrs;
 }
-void TableBuilder_Memoryside::get_dataindexblocks_map(std::map<uint32_t, ibv_mr*>& map) {
+void TableBuilder_Memoryside::get_dataindexblocks_map(ChunkTable& map) {
   map = rep_->local_dataindex_mrs;
 }
-void TableBuilder_Memoryside::get_filter_map(std::map<uint32_t, ibv_mr*>& map) {
+void TableBuilder_Memoryside::get_filter_map(ChunkTable& map) {
   map = rep_->local_filter_mrs;
 }
 size_t TableBuilder_Memoryside::get_numentries() {
@@ -16,9 +16,11 @@ class dLSM_EXPORT TableBuilder_Memoryside : public TableBuilder {
  public:
   // Create a builder that will store the contents of the table it is
   // building in *file.  Does not close the file.  It is up to the
-  // caller to close the file after calling Finish().
+  // caller to close the file after calling Finish(). The filter gets
+  // "bloom_bits" bits per key, or Options::bloom_bits if negative.
   TableBuilder_Memoryside(const Options& options, IO_type type,
-                          std::shared_ptr<RDMA_Manager> rdma_mg);
+                          std::shared_ptr<RDMA_Manager> rdma_mg,
+                          int bloom_bits = -1);
 
   TableBuilder_Memoryside(const TableBuilder_Memoryside&) = delete;
   TableBuilder_Memoryside& operator=(const TableBuilder_Memoryside&) = delete;
@@ -66,13 +68,15 @@ class dLSM_EXPORT TableBuilder_Memoryside : public TableBuilder {
 
   // Number of calls to Add() so far.
   uint64_t NumEntries() const override;
+  uint64_t NumDeletions() const override;
+  Slice LastKey() const override;
 
   // Size of the file generated so far.  If invoked after a successful
   // Finish() call, returns the size of the final generated file.
   uint64_t FileSize() const override;
-  void get_datablocks_map(std::map<uint32_t, ibv_mr*>& map) override;
-  void get_dataindexblocks_map(std::map<uint32_t, ibv_mr*>& map) override;
-  void get_filter_map(std::map<uint32_t, ibv_mr*>& map) override;
+  void get_datablocks_map(ChunkTable& map) override;
+  void get_dataindexblocks_map(ChunkTable& map) override;
+  void get_filter_map(ChunkTable& map) override;
   size_t get_numentries() override;
 
   bool ok() const override { return status().ok(); }
@@ -160,7 +160,7 @@ Iterator* Table_Memory_Side::BlockReader(void* arg, const ReadOptions& options,
 
   BlockHandle handle;
   Slice input = index_value;
-  Status s = handle.DecodeFrom(&input);
+  Status s = DecodeIndexHandle(&input, &handle);
   // We intentionally allow extra stuff in index_value so that we
   // can add more features in the future.
 
@@ -192,7 +192,7 @@ Slice Table_Memory_Side::KVReader(void* arg, const ReadOptions& options,
 
   BlockHandle handle;
   Slice input = index_value;
-  Status s = handle.DecodeFrom(&input);
+  Status s = DecodeIndexHandle(&input, &handle);
   // We intentionally allow extra stuff in index_value so that we
   // can add more features in the future.
 
@@ -214,10 +214,15 @@ Iterator* Table_Memory_Side::NewIterator(const ReadOptions& options) const {
 #ifdef BYTEADDRESSABLE
   return new ByteAddressableRAIterator(
       rep->index_block->NewIterator(rep->options.comparator),
-      &Table_Memory_Side::KVReader, const_cast<Table_Memory_Side*>(this), options, false);
+      &Table_Memory_Side::KVReader, const_cast<Table_Memory_Side*>(this), options, false,
+      rep->options.comparator);
 #endif
 }
 
+Iterator* Table_Memory_Side::NewIndexIterator() const {
+  return rep->index_block->NewIterator(rep->options.comparator);
+}
+
 Status Table_Memory_Side::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
                                       void (*handle_result)(void*, const Slice&,
                                           const Slice&)) {
@@ -327,7 +332,7 @@ uint64_t Table_Memory_Side::ApproximateOffsetOf(const Slice& key) const {
   if (index_iter->Valid()) {
     BlockHandle handle;
     Slice input = index_iter->value();
-    Status s = handle.DecodeFrom(&input);
+    Status s = DecodeIndexHandle(&input, &handle);
     if (s.ok()) {
       result = handle.offset();
     } else {
@@ -61,6 +61,8 @@ class dLSM_EXPORT Table_Memory_Side {
 
   static Iterator* BlockReader(void* arg, const ReadOptions&, const Slice&);
   explicit Table_Memory_Side(Rep* rep) : rep(rep) {}
+  // Iterator over the index block.
+  Iterator* NewIndexIterator() const;
 
   // Calls (*handle_result)(arg, ...) with the entry found after a call
   // to Seek(key).  May not make such a call if filter policy says
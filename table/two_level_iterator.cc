@@ -132,7 +132,7 @@ void TwoLevelIterator::InitDataBlock() {
 #ifndef NDEBUG
     Slice test_handle = handle;
     BlockHandle bhandle;
-    bhandle.DecodeFrom(&test_handle);
+    DecodeIndexHandle(&test_handle, &bhandle);
 //    printf("Iterator pointer is %p, Offset is %lu, this data block size is %lu\n", this, bhandle.offset(), bhandle.size());
 #endif
     if (valid_ &&
@@ -8,19 +8,41 @@
 #include <deque>
 #include <mutex>
 #include <functional>
+#include <unordered_map>
 #include <vector>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <thread>
 #include <port/port_posix.h>
 #include <assert.h>
 namespace dLSM {
 class DBImpl;
 enum ThreadPoolType{FlushThreadPool, CompactionThreadPool, SubcompactionThreadPool};
+// A pool runs the work of a higher priority first: the flushes and the work
+// a client waits on, then the compactions from level 0, which the writes
+// stall on, then the deeper compactions and last the garbage collection.
+enum BGPriority {
+  kGCPriority,
+  kCompactionPriority,
+  kL0CompactionPriority,
+  kFlushPriority,
+  kNumBGPriorities
+};
 struct BGItem {
-  //  void* tag = nullptr;
+  // The owner of the item, such as a shard, see ThreadPool::Schedule().
+  void* tag = nullptr;
   std::function<void(void* args)> function;
   void* args;
   //  std::function<void()> unschedFunction;
 };
+// The items of one tag and priority, and how many of them run in a turn of
+// the tag.
+struct BGTagQueue {
+  std::deque<BGItem> items;
+  int weight = 1;
+  int served = 0;
+};
 struct BGThreadMetadata {
   void* db;
   void* func_args;
@@ -30,43 +52,88 @@ class ThreadPool{
  public:
 //  ThreadPool(std::mutex* mtx, std::condition_variable* signal);
   std::vector<port::Thread> bgthreads_;
-  std::deque<BGItem> queue_;
+  // For every priority, the items of every tag in the order they were
+  // scheduled, and the tags with items in the order they take their turns,
+  // as many items a turn as the weight of the tag. A tag scheduling many
+  // items does not hold up the others.
+  std::unordered_map<void*, BGTagQueue> queues_[kNumBGPriorities];
+  std::deque<void*> turns_[kNumBGPriorities];
+  // The items waiting, of all the priorities.
+  size_t waiting_ = 0;
   ThreadPoolType Type_;
   std::mutex mu_;
   std::condition_variable bgsignal_;
 //  std::mutex RDMA_notify_mtx;
 //  std::condition_variable RDMA_signal;
+  // The pool keeps min_threads_ threads, and starts more up to
+  // total_threads_limit_ while items wait with no idle thread to take them.
+  // A thread above min_threads_ idle for kIdleTimeout quits.
   int total_threads_limit_;
+  int min_threads_ = 0;
+  int live_threads_ = 0;
+  int idle_threads_ = 0;
+  // The threads that quit, not joined yet.
+  std::vector<std::thread::id> exited_;
+  static constexpr std::chrono::seconds kIdleTimeout{10};
   std::atomic_uint queue_len_ = 0;
   bool exit_all_threads_ = false;
   bool wait_for_jobs_to_complete_;
+  std::function<void()> thread_init_;
   void WakeUpAllThreads() { bgsignal_.notify_all();
   }
   void BGThread() {
 //    bool low_io_priority = false;
+    if (thread_init_) {
+      thread_init_();
+    }
     while (true) {
       // Wait until there is an item that is ready to run
       std::unique_lock<std::mutex> lock(mu_);
       // Stop waiting if the thread needs to do work or needs to terminate.
-      while (!exit_all_threads_ && queue_.empty() ) {
-        bgsignal_.wait(lock);
+      while (!exit_all_threads_ && waiting_ == 0) {
+        idle_threads_++;
+        bool timed_out = bgsignal_.wait_for(lock, kIdleTimeout) ==
+                         std::cv_status::timeout;
+        idle_threads_--;
+        if (timed_out && !exit_all_threads_ && waiting_ == 0 &&
+            live_threads_ > min_threads_) {
+          // Joined by the next StartBGThreads() or JoinThreads().
+          live_threads_--;
+          exited_.push_back(std::this_thread::get_id());
+          return;
+        }
       }
 
       if (exit_all_threads_) {  // mechanism to let BG threads exit safely
 
-        if (!wait_for_jobs_to_complete_ ||
-        queue_.empty()) {
+        if (!wait_for_jobs_to_complete_ || waiting_ == 0) {
           break;
         }
       }
 
+      int priority = kNumBGPriorities - 1;
+      while (turns_[priority].empty()) {
+        priority--;
+      }
+      std::deque<void*>& turns = turns_[priority];
+      void* tag = turns.front();
+      auto queue = queues_[priority].find(tag);
+      assert(queue != queues_[priority].end() && !queue->second.items.empty());
+      BGTagQueue& tag_queue = queue->second;
+      auto func = std::move(tag_queue.items.front().function);
+      void* args = std::move(tag_queue.items.front().args);
+      tag_queue.items.pop_front();
+      if (tag_queue.items.empty()) {
+        turns.pop_front();
+        queues_[priority].erase(queue);
+      } else if (++tag_queue.served >= tag_queue.weight) {
+        tag_queue.served = 0;
+        turns.pop_front();
+        turns.push_back(tag);
+      }
+      waiting_--;
 
-      auto func = std::move(queue_.front().function);
-      void* args = std::move(queue_.front().args);
-      queue_.pop_front();
-
-      queue_len_.store(static_cast<unsigned int>(queue_.size()),
-                       std::memory_order_relaxed);
+      queue_len_.fetch_sub(1, std::memory_order_relaxed);
 
       lock.unlock();
 
@@ -74,42 +141,64 @@ class ThreadPool{
       func(args);
     }
   }
+  // Run by every thread of the pool before it takes any work, such as
+  // RDMA_Manager::Pin_Thread_To_NIC_Node(). Set before the first Schedule().
+  void SetThreadInit(std::function<void()> init) {
+    thread_init_ = std::move(init);
+  }
+  // Called with mu_ held, except before the first Schedule().
   void StartBGThreads() {
+    for (auto id : exited_) {
+      for (auto th = bgthreads_.begin(); th != bgthreads_.end(); ++th) {
+        if (th->get_id() == id) {
+          th->join();
+          bgthreads_.erase(th);
+          break;
+        }
+      }
+    }
+    exited_.clear();
     // Start background thread if necessary
-    while ((int)bgthreads_.size() < total_threads_limit_) {
+    while (live_threads_ < total_threads_limit_ &&
+           (live_threads_ < min_threads_ ||
+            static_cast<int>(waiting_) > idle_threads_)) {
 
       port::Thread p_t(&ThreadPool::BGThread, this);
       bgthreads_.push_back(std::move(p_t));
+      live_threads_++;
     }
   }
-  void Schedule(std::function<void(void* args)>&& func, void* args){
+  // The items of one tag and priority run in order as the threads get to
+  // them, the tags take turns of "weight" items, the weight of the last item
+  // scheduled.
+  void Schedule(std::function<void(void* args)>&& func, void* args,
+                void* tag = nullptr,
+                BGPriority priority = kCompactionPriority, int weight = 1){
 
     std::lock_guard<std::mutex> lock(mu_);
     if (exit_all_threads_) {
       return;
     }
 //    printf("schedule a work request!\n");
-    StartBGThreads();
-    // Add to priority queue
-    queue_.push_back(BGItem());
+    BGTagQueue& queue = queues_[priority][tag];
+    if (queue.items.empty()) {
+      turns_[priority].push_back(tag);
+    }
+    queue.weight = std::max(weight, 1);
+    queue.items.push_back(BGItem());
 
-    auto& item = queue_.back();
-    //    item.tag = tag;
+    auto& item = queue.items.back();
+    item.tag = tag;
     item.function = std::move(func);
     item.args = std::move(args);
 
-    queue_len_.store(static_cast<unsigned int>(queue_.size()),
-                     std::memory_order_relaxed);
-
-    //    if (!HasExcessiveThread()) {
-    //      // Wake up at least one waiting thread.
-    //      bgsignal_.notify_one();
-    //    } else {
-    //      // Need to wake up all threads to make sure the one woken
-    //      // up is not the one to terminate.
-    //      WakeUpAllThreads();
-    //    }
-    WakeUpAllThreads();
+    waiting_++;
+    queue_len_.fetch_add(1, std::memory_order_relaxed);
+    StartBGThreads();
+
+    // Any thread takes any item, so one is enough. The threads busy check
+    // for more work before they wait again.
+    bgsignal_.notify_one();
   }
   void JoinThreads(bool wait_for_jobs_to_complete) {
 
@@ -121,6 +210,7 @@ class ThreadPool{
     // prevent threads from being recreated right after they're joined, in case
     // the user is concurrently submitting jobs.
     total_threads_limit_ = 0;
+    min_threads_ = 0;
 
     lock.unlock();
 
@@ -132,11 +222,38 @@ class ThreadPool{
 
     bgthreads_.clear();
 
+    lock.lock();
+    live_threads_ = 0;
+    exited_.clear();
     exit_all_threads_ = false;
     wait_for_jobs_to_complete_ = false;
   }
+  // The items of "tag" waiting for a thread.
+  unsigned int QueueLength(void* tag) {
+    std::lock_guard<std::mutex> lock(mu_);
+    unsigned int length = 0;
+    for (auto& queues : queues_) {
+      auto queue = queues.find(tag);
+      if (queue != queues.end()) {
+        length += static_cast<unsigned int>(queue->second.items.size());
+      }
+    }
+    return length;
+  }
+  // A pool of "num" threads.
   void SetBackgroundThreads(int num){
-    total_threads_limit_ = num;
+    SetBackgroundThreads(num, num);
+  }
+  // A pool between "min" and "max" threads, growing with the items waiting
+  // and shrinking as the threads go idle.
+  void SetBackgroundThreads(int min, int max){
+    std::lock_guard<std::mutex> lock(mu_);
+    total_threads_limit_ = max;
+    min_threads_ = std::min(min, max);
+  }
+  int LiveThreads() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return live_threads_;
   }
   //  void Schedule(std::function<void(void* args)>&& schedule, void* args);
 
@@ -0,0 +1,225 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/binary_fuse.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace dLSM {
+
+namespace {
+
+constexpr int kArity = 3;
+constexpr uint32_t kMaxSegmentLength = 262144;
+constexpr int kMaxIterations = 100;
+
+uint64_t SplitMix64(uint64_t* state) {
+  uint64_t z = (*state += UINT64_C(0x9E3779B97F4A7C15));
+  z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+  return z ^ (z >> 31);
+}
+
+uint32_t CalculateSegmentLength(size_t size) {
+  // These parameters are very sensitive: the peeling fails for much smaller
+  // segments and the filter gets slower for larger ones.
+  return uint32_t{1} << static_cast<int>(
+             std::floor(std::log(static_cast<double>(size)) / std::log(3.33) +
+                        2.25));
+}
+
+double CalculateSizeFactor(size_t size) {
+  return std::max(1.125, 0.875 + 0.25 * std::log(1000000.0) /
+                                     std::log(static_cast<double>(size)));
+}
+
+uint8_t Mod3(uint8_t x) { return x > 2 ? x - 3 : x; }
+
+}  // namespace
+
+BinaryFuse8::BinaryFuse8(size_t num_keys) : seed_(0) {
+  segment_length_ =
+      num_keys == 0 ? 4 : CalculateSegmentLength(num_keys);
+  if (segment_length_ > kMaxSegmentLength) {
+    segment_length_ = kMaxSegmentLength;
+  }
+  size_t capacity = 0;
+  if (num_keys > 1) {
+    capacity = static_cast<size_t>(
+        std::round(num_keys * CalculateSizeFactor(num_keys)));
+  }
+  size_t segments = (capacity + segment_length_ - 1) / segment_length_;
+  segment_count_ = segments > kArity - 1
+                       ? static_cast<uint32_t>(segments - (kArity - 1))
+                       : 1;
+  array_length_ = (segment_count_ + kArity - 1) * segment_length_;
+  segment_count_length_ = segment_count_ * segment_length_;
+}
+
+BinaryFuse8::BinaryFuse8(uint64_t seed, uint32_t segment_length,
+                         uint32_t segment_count_length, uint32_t array_length)
+    : seed_(seed),
+      segment_length_(segment_length),
+      segment_count_(segment_length == 0
+                         ? 0
+                         : segment_count_length / segment_length),
+      segment_count_length_(segment_count_length),
+      array_length_(array_length) {}
+
+bool BinaryFuse8::Populate(const std::vector<uint64_t>& input_keys,
+                           char* fingerprints) {
+  // Not all the duplicates are caught while peeling, and the ones which are
+  // not make it fail for every seed.
+  std::vector<uint64_t> keys(input_keys);
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  const size_t size = keys.size();
+  const uint32_t capacity = array_length_;
+  uint8_t* fp = reinterpret_cast<uint8_t*>(fingerprints);
+  memset(fp, 0, capacity);
+  uint64_t rng_counter = UINT64_C(0x726b2b9d438b9d4d);
+  seed_ = SplitMix64(&rng_counter);
+
+  // reverse_order holds the hashes sorted by segment, then the peeling order.
+  // The extra entry is a sentinel for the bucketing below.
+  std::vector<uint64_t> reverse_order(size + 1, 0);
+  std::vector<uint32_t> alone(capacity);
+  // Per slot: number of keys << 2 | xor of which of the 3 slots of each key.
+  std::vector<uint8_t> t2count(capacity, 0);
+  std::vector<uint8_t> reverse_h(size);
+  std::vector<uint64_t> t2hash(capacity, 0);
+
+  uint32_t block_bits = 1;
+  while ((uint32_t{1} << block_bits) < segment_count_) {
+    block_bits++;
+  }
+  const uint32_t block = uint32_t{1} << block_bits;
+  std::vector<uint32_t> start_pos(block);
+  uint32_t h012[5];
+
+  reverse_order[size] = 1;
+  size_t duplicates = 0;
+  for (int loop = 0;; ++loop) {
+    if (loop + 1 > kMaxIterations) {
+      memset(fp, 0, capacity);
+      return false;
+    }
+    for (uint32_t i = 0; i < block; i++) {
+      start_pos[i] = static_cast<uint32_t>((uint64_t{i} * size) >> block_bits);
+    }
+    // Bucket the hashes by their top bits so that the slots are touched in
+    // order below.
+    const uint32_t mask_block = block - 1;
+    for (size_t i = 0; i < size; i++) {
+      uint64_t hash = MixSplit(keys[i], seed_);
+      uint64_t segment_index = hash >> (64 - block_bits);
+      while (reverse_order[start_pos[segment_index]] != 0) {
+        segment_index++;
+        segment_index &= mask_block;
+      }
+      reverse_order[start_pos[segment_index]] = hash;
+      start_pos[segment_index]++;
+    }
+
+    bool error = false;
+    duplicates = 0;
+    for (size_t i = 0; i < size; i++) {
+      uint64_t hash = reverse_order[i];
+      uint32_t h0 = Hash(0, hash);
+      uint32_t h1 = Hash(1, hash);
+      uint32_t h2 = Hash(2, hash);
+      t2count[h0] += 4;
+      t2hash[h0] ^= hash;
+      t2count[h1] += 4;
+      t2count[h1] ^= 1;
+      t2hash[h1] ^= hash;
+      t2count[h2] += 4;
+      t2hash[h2] ^= hash;
+      t2count[h2] ^= 2;
+      if ((t2hash[h0] & t2hash[h1] & t2hash[h2]) == 0) {
+        if (((t2hash[h0] == 0) && (t2count[h0] == 8)) ||
+            ((t2hash[h1] == 0) && (t2count[h1] == 8)) ||
+            ((t2hash[h2] == 0) && (t2count[h2] == 8))) {
+          // The same hash twice, take it back out.
+          duplicates++;
+          t2count[h0] -= 4;
+          t2hash[h0] ^= hash;
+          t2count[h1] -= 4;
+          t2count[h1] ^= 1;
+          t2hash[h1] ^= hash;
+          t2count[h2] -= 4;
+          t2count[h2] ^= 2;
+          t2hash[h2] ^= hash;
+        }
+      }
+      // The 6 bit counter overflowed.
+      error = error || t2count[h0] < 4 || t2count[h1] < 4 || t2count[h2] < 4;
+    }
+
+    size_t stack_size = 0;
+    if (!error) {
+      // Peel the slots which hold a single key.
+      uint32_t q_size = 0;
+      for (uint32_t i = 0; i < capacity; i++) {
+        alone[q_size] = i;
+        q_size += ((t2count[i] >> 2) == 1) ? 1 : 0;
+      }
+      while (q_size > 0) {
+        q_size--;
+        uint32_t index = alone[q_size];
+        if ((t2count[index] >> 2) == 1) {
+          uint64_t hash = t2hash[index];
+          h012[1] = Hash(1, hash);
+          h012[2] = Hash(2, hash);
+          h012[3] = Hash(0, hash);
+          h012[4] = h012[1];
+          uint8_t found = t2count[index] & 3;
+          reverse_h[stack_size] = found;
+          reverse_order[stack_size] = hash;
+          stack_size++;
+
+          uint32_t other_index1 = h012[found + 1];
+          alone[q_size] = other_index1;
+          q_size += ((t2count[other_index1] >> 2) == 2 ? 1 : 0);
+          t2count[other_index1] -= 4;
+          t2count[other_index1] ^= Mod3(found + 1);
+          t2hash[other_index1] ^= hash;
+
+          uint32_t other_index2 = h012[found + 2];
+          alone[q_size] = other_index2;
+          q_size += ((t2count[other_index2] >> 2) == 2 ? 1 : 0);
+          t2count[other_index2] -= 4;
+          t2count[other_index2] ^= Mod3(found + 2);
+          t2hash[other_index2] ^= hash;
+        }
+      }
+      if (stack_size + duplicates == size) {
+        break;
+      }
+    }
+    // Try again with another seed.
+    std::fill(reverse_order.begin(), reverse_order.begin() + size, 0);
+    std::fill(t2count.begin(), t2count.end(), 0);
+    std::fill(t2hash.begin(), t2hash.end(), 0);
+    seed_ = SplitMix64(&rng_counter);
+  }
+
+  // Assign the fingerprints in the reverse of the peeling order.
+  for (size_t i = size - duplicates; i-- > 0;) {
+    uint64_t hash = reverse_order[i];
+    uint8_t xor2 = Fingerprint(hash);
+    uint8_t found = reverse_h[i];
+    h012[0] = Hash(0, hash);
+    h012[1] = Hash(1, hash);
+    h012[2] = Hash(2, hash);
+    h012[3] = h012[0];
+    h012[4] = h012[1];
+    fp[h012[found]] = xor2 ^ fp[h012[found + 1]] ^ fp[h012[found + 2]];
+  }
+  return true;
+}
+
+}  // namespace dLSM
@@ -0,0 +1,110 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_UTIL_BINARY_FUSE_H_
+#define STORAGE_dLSM_UTIL_BINARY_FUSE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace dLSM {
+
+// Binary fuse filter with 8 bit fingerprints and 3 probes (Graf and Lemire,
+// "Binary Fuse Filters: Fast and Smaller Than Xor Filters"). It takes about
+// 9 bits per key for a false positive rate of 1/256, where a cache local
+// Bloom filter needs about 13 bits per key for the same rate. The filter is
+// built once over the whole key set, which is what a table filter does.
+class BinaryFuse8 {
+ public:
+  // Shape of a filter over num_keys keys.
+  explicit BinaryFuse8(size_t num_keys);
+  // Shape of a filter which has been built, as stored next to it.
+  BinaryFuse8(uint64_t seed, uint32_t segment_length,
+              uint32_t segment_count_length, uint32_t array_length);
+
+  uint64_t Seed() const { return seed_; }
+  uint32_t SegmentLength() const { return segment_length_; }
+  uint32_t SegmentCountLength() const { return segment_count_length_; }
+  // Number of fingerprint bytes.
+  uint32_t ArrayLength() const { return array_length_; }
+
+  // Fill fingerprints[0, ArrayLength()) so that every key of keys matches.
+  // Duplicated keys are fine. Returns false if no seed could be found, which
+  // does not happen in practice, with fingerprints left zeroed.
+  bool Populate(const std::vector<uint64_t>& keys, char* fingerprints);
+
+  bool MayContain(uint64_t key, const char* fingerprints) const {
+    uint32_t h0, h1, h2;
+    uint8_t f = Probe(key, &h0, &h1, &h2);
+    const uint8_t* fp = reinterpret_cast<const uint8_t*>(fingerprints);
+    f ^= fp[h0] ^ fp[h1] ^ fp[h2];
+    return f == 0;
+  }
+  // The 3 fingerprint slots of key, for a filter which is not local. key
+  // may be in the filter if the returned fingerprint equals the xor of the
+  // 3 slots.
+  uint8_t Probe(uint64_t key, uint32_t* h0, uint32_t* h1,
+                uint32_t* h2) const {
+    uint64_t hash = MixSplit(key, seed_);
+    HashBatch(hash, h0, h1, h2);
+    return Fingerprint(hash);
+  }
+  // Prefetch the fingerprints MayContain(key, fingerprints) reads.
+  void Prefetch(uint64_t key, const char* fingerprints) const {
+    uint32_t h0, h1, h2;
+    HashBatch(MixSplit(key, seed_), &h0, &h1, &h2);
+    __builtin_prefetch(fingerprints + h0);
+    __builtin_prefetch(fingerprints + h1);
+    __builtin_prefetch(fingerprints + h2);
+  }
+
+ private:
+  static uint64_t Murmur64(uint64_t h) {
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+  }
+  static uint64_t MixSplit(uint64_t key, uint64_t seed) {
+    return Murmur64(key + seed);
+  }
+  static uint8_t Fingerprint(uint64_t hash) {
+    return static_cast<uint8_t>(hash ^ (hash >> 32));
+  }
+  static uint64_t MulHi(uint64_t a, uint64_t b) {
+    return static_cast<uint64_t>((static_cast<__uint128_t>(a) * b) >> 64);
+  }
+  // The index-th of the 3 fingerprint slots of hash.
+  uint32_t Hash(int index, uint64_t hash) const {
+    uint64_t h = MulHi(hash, segment_count_length_);
+    h += index * segment_length_;
+    // The lower 36 bits of hash pick the slots within the segments.
+    uint64_t hh = hash & ((UINT64_C(1) << 36) - 1);
+    h ^= (hh >> (36 - 18 * index)) & (segment_length_ - 1);
+    return static_cast<uint32_t>(h);
+  }
+  void HashBatch(uint64_t hash, uint32_t* h0, uint32_t* h1,
+                 uint32_t* h2) const {
+    uint64_t hi = MulHi(hash, segment_count_length_);
+    *h0 = static_cast<uint32_t>(hi);
+    *h1 = *h0 + segment_length_;
+    *h2 = *h1 + segment_length_;
+    *h1 ^= static_cast<uint32_t>(hash >> 18) & (segment_length_ - 1);
+    *h2 ^= static_cast<uint32_t>(hash) & (segment_length_ - 1);
+  }
+
+  uint64_t seed_;
+  uint32_t segment_length_;
+  uint32_t segment_count_;
+  uint32_t segment_count_length_;
+  uint32_t array_length_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_BINARY_FUSE_H_
@@ -442,6 +442,12 @@ class LegacyLocalityBloomImpl {
     }
   }
 
+  // Offset of the cache line h probes, for a filter which is not local.
+  static inline uint32_t GetLineOffset(uint32_t h, uint32_t num_lines,
+                                       int log2_cache_line_bytes) {
+    return GetLine(h, num_lines) << log2_cache_line_bytes;
+  }
+
   static inline void PrepareHashMayMatch(uint32_t h, uint32_t num_lines,
                                          const char *data,
                                          uint32_t /*out*/ *byte_offset,
@@ -0,0 +1,81 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_UTIL_BOUNDED_QUEUE_H_
+#define STORAGE_dLSM_UTIL_BOUNDED_QUEUE_H_
+
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace dLSM {
+
+// A queue of at most "capacity" items between one producer and one consumer
+// thread, which connects two stages of a pipeline. The producer blocks while
+// the queue is full and the consumer while it is empty, so that the faster
+// stage waits for the slower one instead of piling up items.
+//
+// The items are expected to be coarse (a batch of entries, a finished
+// table), so a mutex is cheaper than spinning on the slow cores.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity)
+      : items_(capacity), head_(0), size_(0), closed_(false) {
+    assert(capacity > 0);
+  }
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  // Wait for room and append "item".
+  // REQUIRES: Close() has not been called.
+  void Push(T item) {
+    std::unique_lock<std::mutex> lck(mutex_);
+    assert(!closed_);
+    not_full_.wait(lck, [this] { return size_ < items_.size(); });
+    items_[(head_ + size_) % items_.size()] = std::move(item);
+    size_++;
+    not_empty_.notify_one();
+  }
+
+  // Wait for an item and move it to *item. Returns false once the queue is
+  // closed and empty.
+  bool Pop(T* item) {
+    std::unique_lock<std::mutex> lck(mutex_);
+    not_empty_.wait(lck, [this] { return size_ > 0 || closed_; });
+    if (size_ == 0) {
+      return false;
+    }
+    *item = std::move(items_[head_]);
+    head_ = (head_ + 1) % items_.size();
+    size_--;
+    not_full_.notify_one();
+    return true;
+  }
+
+  // No item follows. The consumer still gets the ones already pushed.
+  void Close() {
+    std::unique_lock<std::mutex> lck(mutex_);
+    closed_ = true;
+    not_empty_.notify_one();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  // The fields below are protected by mutex_.
+  std::vector<T> items_;
+  size_t head_;
+  size_t size_;
+  bool closed_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_BOUNDED_QUEUE_H_
@@ -0,0 +1,96 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_UTIL_CHUNK_TABLE_H_
+#define STORAGE_dLSM_UTIL_CHUNK_TABLE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+struct ibv_mr;
+
+namespace dLSM {
+
+// The chunks of a table, keyed by the offset in the table where each chunk
+// ends, in one sorted array. It has the interface of the
+// std::map<uint32_t, ibv_mr*> it replaces, without a tree node per chunk.
+//
+// The chunks of a table are about the same size, so upper_bound() guesses
+// the chunk of an offset from the average size and only corrects the guess
+// by a step or two, rather than binary searching.
+class ChunkTable {
+ public:
+  typedef std::pair<uint32_t, ibv_mr*> value_type;
+  typedef std::vector<value_type>::iterator iterator;
+  typedef std::vector<value_type>::const_iterator const_iterator;
+  typedef std::vector<value_type>::const_reverse_iterator
+      const_reverse_iterator;
+
+  iterator begin() { return chunks_.begin(); }
+  iterator end() { return chunks_.end(); }
+  const_iterator begin() const { return chunks_.begin(); }
+  const_iterator end() const { return chunks_.end(); }
+  const_reverse_iterator rbegin() const { return chunks_.rbegin(); }
+  const_reverse_iterator rend() const { return chunks_.rend(); }
+  size_t size() const { return chunks_.size(); }
+  bool empty() const { return chunks_.empty(); }
+  void clear() { chunks_.clear(); }
+
+  // Like std::map::insert(), an offset already in the table keeps its chunk.
+  // The builders add the chunks in order, which appends.
+  std::pair<iterator, bool> insert(const value_type& chunk) {
+    if (chunks_.empty() || chunks_.back().first < chunk.first) {
+      chunks_.push_back(chunk);
+      return {chunks_.end() - 1, true};
+    }
+    auto iter = std::lower_bound(
+        chunks_.begin(), chunks_.end(), chunk.first,
+        [](const value_type& c, uint32_t offset) { return c.first < offset; });
+    if (iter != chunks_.end() && iter->first == chunk.first) {
+      return {iter, false};
+    }
+    return {chunks_.insert(iter, chunk), true};
+  }
+
+  // The first chunk ending after "offset", which is the one holding it.
+  const_iterator upper_bound(uint64_t offset) const {
+    const size_t n = chunks_.size();
+    if (n == 0 || offset >= chunks_.back().first) {
+      return chunks_.end();
+    }
+    const uint64_t average = std::max<uint64_t>(chunks_.back().first / n, 1);
+    size_t i = std::min<size_t>(offset / average, n - 1);
+    for (int step = 0; step < 2; step++) {
+      if (i > 0 && chunks_[i - 1].first > offset) {
+        i--;
+      } else if (chunks_[i].first <= offset) {
+        i++;
+      } else {
+        return chunks_.begin() + i;
+      }
+    }
+    if (!(chunks_[i].first > offset && (i == 0 ||
+                                        chunks_[i - 1].first <= offset))) {
+      return std::upper_bound(
+          chunks_.begin(), chunks_.end(), offset,
+          [](uint64_t o, const value_type& c) { return o < c.first; });
+    }
+    return chunks_.begin() + i;
+  }
+  iterator upper_bound(uint64_t offset) {
+    return chunks_.begin() +
+           (static_cast<const ChunkTable*>(this)->upper_bound(offset) -
+            chunks_.cbegin());
+  }
+
+ private:
+  std::vector<value_type> chunks_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_CHUNK_TABLE_H_
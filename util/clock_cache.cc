@@ -0,0 +1,539 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "dLSM/cache.h"
+
+#include "util/hash.h"
+
+namespace dLSM {
+
+namespace {
+
+// CLOCK table_cache implementation
+//
+// Each shard keeps its entries in an open addressed table of slots, sized
+// once from the capacity and the expected charge of an entry. The state,
+// the reference count and the CLOCK usage count of a slot share one atomic
+// word, so that Lookup() and Release() take no lock: a hit is one
+// compare-and-swap on its slot, and no list is spliced. Insert(), Erase()
+// and the eviction hold the shard mutex.
+//
+// A slot is in one of these states:
+// - empty: holds nothing, Insert() may claim it.
+// - construction: owned by the one thread filling or emptying it.
+// - visible: holds an entry Lookup() finds and references.
+// - invisible: erased or replaced, but still referenced by clients. The
+//   last Release() empties it.
+// A lookup probes the slots of its key until it finds the key, or an empty
+// slot no entry was displaced past, which every slot counts.
+//
+// The eviction sweeps a CLOCK hand over the slots. A hit raises the usage
+// count of its entry up to kMaxUsage, the hand lowers it, and evicts the
+// unreferenced entries it finds at 0. A new entry which has to evict one is
+// only admitted if a TinyLFU frequency sketch of the lookups rates its key
+// above the first victim, so that a scan of keys read once does not flush
+// the entries read again and again.
+
+static const uint64_t kOneRef = 1;
+static const uint64_t kRefsMask = (uint64_t{1} << 32) - 1;
+static const int kUsageShift = 32;
+static const uint64_t kOneUsage = uint64_t{1} << kUsageShift;
+static const uint64_t kMaxUsage = 3;
+static const int kStateShift = 62;
+static const uint64_t kEmpty = 0;
+static const uint64_t kConstruction = 1;
+static const uint64_t kInvisible = 2;
+static const uint64_t kVisible = 3;
+static const uint64_t kStateMask = uint64_t{3} << kStateShift;
+
+static inline uint64_t Refs(uint64_t meta) { return meta & kRefsMask; }
+static inline uint64_t Usage(uint64_t meta) {
+  return (meta >> kUsageShift) & kMaxUsage;
+}
+static inline uint64_t State(uint64_t meta) { return meta >> kStateShift; }
+
+struct ClockHandle {
+  std::atomic<uint64_t> meta{0};
+  // The entries which passed this slot to be placed further on their
+  // probe sequence.
+  std::atomic<uint32_t> displacements{0};
+  // Read by the lookups before they reference the slot, as a hint.
+  std::atomic<uint32_t> hash{0};
+  // Not in a table, see ClockCacheShard::Detached().
+  bool detached = false;
+  void* value = nullptr;
+  void (*deleter)(const Slice&, void* value) = nullptr;
+  size_t charge = 0;
+  std::string key;
+};
+
+// A count-min sketch of 4 bit counters, which estimates how often a key
+// was looked up since the counters were last halved.
+class FrequencySketch {
+ public:
+  explicit FrequencySketch(size_t entries) : width_bits_(4) {
+    while ((size_t{1} << width_bits_) < entries) {
+      width_bits_++;
+    }
+    counters_.reset(new std::atomic<uint8_t>[Size()]);
+    for (size_t i = 0; i < Size(); i++) {
+      counters_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Racing increments may lose a count, which the estimates tolerate.
+  void Increment(uint32_t hash) {
+    for (int row = 0; row < kDepth; row++) {
+      std::atomic<uint8_t>& counter = counters_[Index(row, hash)];
+      const uint8_t count = counter.load(std::memory_order_relaxed);
+      if (count < kMaxCount) {
+        counter.store(count + 1, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  int Estimate(uint32_t hash) const {
+    int estimate = kMaxCount;
+    for (int row = 0; row < kDepth; row++) {
+      estimate = std::min<int>(
+          estimate, counters_[Index(row, hash)].load(std::memory_order_relaxed));
+    }
+    return estimate;
+  }
+
+  // Age the counts, so that the keys read often long ago lose to the ones
+  // read often lately.
+  void Halve() {
+    for (size_t i = 0; i < Size(); i++) {
+      counters_[i].store(counters_[i].load(std::memory_order_relaxed) >> 1,
+                         std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  static const int kDepth = 4;
+  static const uint8_t kMaxCount = 15;
+
+  size_t Size() const { return static_cast<size_t>(kDepth) << width_bits_; }
+
+  size_t Index(int row, uint32_t hash) const {
+    static const uint64_t kSeeds[kDepth] = {
+        0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull,
+        0xD6E8FEB86659FD93ull};
+    const uint64_t h = (uint64_t{hash} + 1) * kSeeds[row];
+    return (static_cast<size_t>(row) << width_bits_) +
+           static_cast<size_t>(h >> (64 - width_bits_));
+  }
+
+  int width_bits_;
+  std::unique_ptr<std::atomic<uint8_t>[]> counters_;
+};
+
+// A single shard of sharded table_cache.
+class ClockCacheShard {
+ public:
+  ClockCacheShard() = default;
+  ~ClockCacheShard();
+
+  // Separate from constructor so caller can easily make an array of shards.
+  void Init(size_t capacity, size_t max_entries);
+
+  // Like Cache methods, but with an extra "hash" parameter.
+  Cache::Handle* Insert(const Slice& key, uint32_t hash, void* value,
+                        size_t charge,
+                        void (*deleter)(const Slice& key, void* value));
+  Cache::Handle* Lookup(const Slice& key, uint32_t hash);
+  void Release(Cache::Handle* handle);
+  void Erase(const Slice& key, uint32_t hash);
+  void Prune();
+  size_t TotalCharge() const {
+    return usage_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  size_t Length() const { return size_t{1} << length_bits_; }
+  // The i-th slot of the probe sequence of "hash", which visits every slot
+  // once in Length() steps.
+  size_t Probe(uint32_t hash, size_t i) const {
+    const uint64_t h = uint64_t{hash} * 0x9E3779B97F4A7C15ull;
+    const size_t mask = Length() - 1;
+    const size_t base = static_cast<size_t>(h >> (64 - length_bits_));
+    const size_t step = static_cast<size_t>(h >> 16) | 1;
+    return (base + i * step) & mask;
+  }
+  // Reference *h if it is visible, and count the hit.
+  static bool TryRef(ClockHandle* h, uint64_t meta);
+  // A handle of the entry which is not in the cache, for the Insert()s it
+  // does not admit. Its Release() deletes it.
+  static Cache::Handle* Detached(const Slice& key, uint32_t hash,
+                                 void* value, size_t charge,
+                                 void (*deleter)(const Slice& key,
+                                                 void* value));
+  // REQUIRES: mutex_ held.
+  ClockHandle* FindVisible(const Slice& key, uint32_t hash);
+  // Take the entry of *h out of the cache, and empty the slot if no client
+  // references it.
+  // REQUIRES: mutex_ held.
+  void MakeInvisible(ClockHandle* h);
+  // Evict entries until an entry of "charge" for "hash" fits. Returns false
+  // if it is not admitted or no slot can be freed.
+  // REQUIRES: mutex_ held.
+  bool MakeRoom(uint32_t hash, size_t charge);
+  // Delete the entry of *h, which is in construction, and empty the slot.
+  void FreeSlot(ClockHandle* h);
+
+  // Initialized before use.
+  size_t capacity_ = 0;
+  size_t max_occupancy_ = 0;
+  int length_bits_ = 0;
+  size_t aging_period_ = 0;
+  std::unique_ptr<ClockHandle[]> slots_;
+  std::unique_ptr<FrequencySketch> sketch_;
+
+  // The charges of the visible entries.
+  std::atomic<size_t> usage_{0};
+  // The slots which are not empty.
+  std::atomic<size_t> occupancy_{0};
+
+  // mutex_ serializes the writers, and protects the following state.
+  std::mutex mutex_;
+  size_t clock_hand_ = 0;
+  // Inserts since the sketch was last halved. The sketch ages by the inserts
+  // rather than by the lookups, so that a hit updates no shared counter.
+  size_t inserts_since_aging_ = 0;
+};
+
+void ClockCacheShard::Init(size_t capacity, size_t max_entries) {
+  capacity_ = capacity;
+  max_entries = std::max<size_t>(max_entries, 4);
+  // At most 3/4 of the slots are used, so that the probes stay short.
+  length_bits_ = 2;
+  while (Length() * 3 / 4 < max_entries) {
+    length_bits_++;
+  }
+  max_occupancy_ = Length() * 3 / 4;
+  aging_period_ = 10 * max_entries;
+  slots_.reset(new ClockHandle[Length()]);
+  sketch_.reset(new FrequencySketch(max_entries));
+}
+
+ClockCacheShard::~ClockCacheShard() {
+  for (size_t i = 0; i < Length(); i++) {
+    ClockHandle* h = &slots_[i];
+    const uint64_t meta = h->meta.load(std::memory_order_acquire);
+    // Error if caller has an unreleased handle
+    assert(Refs(meta) == 0);
+    if (State(meta) == kVisible) {
+      (*h->deleter)(h->key, h->value);
+    }
+  }
+}
+
+bool ClockCacheShard::TryRef(ClockHandle* h, uint64_t meta) {
+  while (State(meta) == kVisible) {
+    uint64_t desired = meta + kOneRef;
+    if (Usage(meta) < kMaxUsage) {
+      desired += kOneUsage;
+    }
+    if (h->meta.compare_exchange_weak(meta, desired,
+                                      std::memory_order_acq_rel,
+                                      std::memory_order_acquire)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Cache::Handle* ClockCacheShard::Detached(
+    const Slice& key, uint32_t hash, void* value, size_t charge,
+    void (*deleter)(const Slice& key, void* value)) {
+  ClockHandle* h = new ClockHandle;
+  h->detached = true;
+  h->hash.store(hash, std::memory_order_relaxed);
+  h->value = value;
+  h->deleter = deleter;
+  h->charge = charge;
+  h->key.assign(key.data(), key.size());
+  h->meta.store((kVisible << kStateShift) | kOneRef,
+                std::memory_order_relaxed);
+  return reinterpret_cast<Cache::Handle*>(h);
+}
+
+Cache::Handle* ClockCacheShard::Lookup(const Slice& key, uint32_t hash) {
+  if (capacity_ == 0) {
+    return nullptr;
+  }
+  sketch_->Increment(hash);
+  for (size_t i = 0; i < Length(); i++) {
+    ClockHandle* h = &slots_[Probe(hash, i)];
+    const uint64_t meta = h->meta.load(std::memory_order_acquire);
+    if (State(meta) == kVisible &&
+        h->hash.load(std::memory_order_relaxed) == hash) {
+      if (TryRef(h, meta)) {
+        // The slot may have been reused meanwhile, it is stable now.
+        if (h->hash.load(std::memory_order_relaxed) == hash &&
+            key == Slice(h->key)) {
+          return reinterpret_cast<Cache::Handle*>(h);
+        }
+        Release(reinterpret_cast<Cache::Handle*>(h));
+      }
+    } else if (State(meta) == kEmpty &&
+               h->displacements.load(std::memory_order_acquire) == 0) {
+      break;
+    }
+  }
+  return nullptr;
+}
+
+void ClockCacheShard::Release(Cache::Handle* handle) {
+  ClockHandle* h = reinterpret_cast<ClockHandle*>(handle);
+  if (h->detached) {
+    (*h->deleter)(h->key, h->value);
+    delete h;
+    return;
+  }
+  const uint64_t old = h->meta.fetch_sub(kOneRef, std::memory_order_acq_rel);
+  assert(Refs(old) > 0);
+  if (Refs(old) == 1 && State(old) == kInvisible) {
+    // Nobody else changes an unreferenced invisible slot.
+    h->meta.store(kConstruction << kStateShift, std::memory_order_relaxed);
+    FreeSlot(h);
+  }
+}
+
+ClockHandle* ClockCacheShard::FindVisible(const Slice& key, uint32_t hash) {
+  for (size_t i = 0; i < Length(); i++) {
+    ClockHandle* h = &slots_[Probe(hash, i)];
+    // Only the holder of mutex_ takes a visible slot out of the table.
+    const uint64_t meta = h->meta.load(std::memory_order_acquire);
+    if (State(meta) == kVisible &&
+        h->hash.load(std::memory_order_relaxed) == hash &&
+        key == Slice(h->key)) {
+      return h;
+    }
+    if (State(meta) == kEmpty &&
+        h->displacements.load(std::memory_order_acquire) == 0) {
+      break;
+    }
+  }
+  return nullptr;
+}
+
+void ClockCacheShard::MakeInvisible(ClockHandle* h) {
+  uint64_t meta = h->meta.load(std::memory_order_acquire);
+  uint64_t desired;
+  do {
+    assert(State(meta) == kVisible);
+    desired = (meta & ~kStateMask) | (kInvisible << kStateShift);
+  } while (!h->meta.compare_exchange_weak(meta, desired,
+                                          std::memory_order_acq_rel,
+                                          std::memory_order_acquire));
+  usage_.fetch_sub(h->charge, std::memory_order_relaxed);
+  if (Refs(desired) == 0) {
+    // Otherwise the last Release() frees it.
+    h->meta.store(kConstruction << kStateShift, std::memory_order_relaxed);
+    FreeSlot(h);
+  }
+}
+
+void ClockCacheShard::FreeSlot(ClockHandle* h) {
+  const size_t index = h - slots_.get();
+  const uint32_t hash = h->hash.load(std::memory_order_relaxed);
+  for (size_t i = 0; Probe(hash, i) != index; i++) {
+    slots_[Probe(hash, i)].displacements.fetch_sub(1,
+                                                   std::memory_order_release);
+  }
+  (*h->deleter)(h->key, h->value);
+  h->value = nullptr;
+  h->meta.store(kEmpty, std::memory_order_release);
+  occupancy_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool ClockCacheShard::MakeRoom(uint32_t hash, size_t charge) {
+  bool admitted = false;
+  // Every usage count is down to 0 after kMaxUsage turns of the hand, so a
+  // turn more finds any unreferenced entry.
+  const size_t max_steps = Length() * (kMaxUsage + 1);
+  for (size_t steps = 0;
+       (usage_.load(std::memory_order_relaxed) + charge > capacity_ ||
+        occupancy_.load(std::memory_order_relaxed) >= max_occupancy_) &&
+       steps < max_steps;
+       steps++) {
+    ClockHandle* h = &slots_[clock_hand_];
+    clock_hand_ = (clock_hand_ + 1) & (Length() - 1);
+    uint64_t meta = h->meta.load(std::memory_order_acquire);
+    if (State(meta) != kVisible || Refs(meta) != 0) {
+      continue;
+    }
+    if (Usage(meta) > 0) {
+      // Fails if a lookup referenced it meanwhile, which keeps it too.
+      h->meta.compare_exchange_strong(meta, meta - kOneUsage,
+                                      std::memory_order_acq_rel);
+      continue;
+    }
+    if (!admitted) {
+      if (sketch_->Estimate(hash) <=
+          sketch_->Estimate(h->hash.load(std::memory_order_relaxed))) {
+        return false;
+      }
+      admitted = true;
+    }
+    if (h->meta.compare_exchange_strong(meta, kConstruction << kStateShift,
+                                        std::memory_order_acq_rel)) {
+      usage_.fetch_sub(h->charge, std::memory_order_relaxed);
+      FreeSlot(h);
+    }
+  }
+  // Like the LRU cache, it goes over the capacity if all the entries are
+  // referenced, but it needs a slot.
+  return occupancy_.load(std::memory_order_relaxed) < max_occupancy_;
+}
+
+Cache::Handle* ClockCacheShard::Insert(const Slice& key, uint32_t hash,
+                                       void* value, size_t charge,
+                                       void (*deleter)(const Slice& key,
+                                                       void* value)) {
+  if (capacity_ == 0) {
+    // don't table_cache. (capacity_==0 is supported and turns off caching.)
+    return Detached(key, hash, value, charge, deleter);
+  }
+  std::lock_guard<std::mutex> l(mutex_);
+  if (++inserts_since_aging_ >= aging_period_) {
+    sketch_->Halve();
+    inserts_since_aging_ = 0;
+  }
+  ClockHandle* old = FindVisible(key, hash);
+  if (old != nullptr) {
+    MakeInvisible(old);
+  }
+  if (!MakeRoom(hash, charge)) {
+    return Detached(key, hash, value, charge, deleter);
+  }
+  // MakeRoom() left an empty slot, and only the holder of mutex_ claims
+  // one.
+  ClockHandle* h = nullptr;
+  for (size_t i = 0; h == nullptr; i++) {
+    assert(i < Length());
+    ClockHandle* slot = &slots_[Probe(hash, i)];
+    uint64_t expected = kEmpty;
+    if (slot->meta.compare_exchange_strong(expected,
+                                           kConstruction << kStateShift,
+                                           std::memory_order_acq_rel)) {
+      h = slot;
+    } else {
+      slot->displacements.fetch_add(1, std::memory_order_release);
+    }
+  }
+  occupancy_.fetch_add(1, std::memory_order_relaxed);
+  h->hash.store(hash, std::memory_order_relaxed);
+  h->value = value;
+  h->deleter = deleter;
+  h->charge = charge;
+  h->key.assign(key.data(), key.size());
+  usage_.fetch_add(charge, std::memory_order_relaxed);
+  // Referenced by the returned handle, and counted as used once.
+  h->meta.store((kVisible << kStateShift) | kOneUsage | kOneRef,
+                std::memory_order_release);
+  return reinterpret_cast<Cache::Handle*>(h);
+}
+
+void ClockCacheShard::Erase(const Slice& key, uint32_t hash) {
+  std::lock_guard<std::mutex> l(mutex_);
+  ClockHandle* h = FindVisible(key, hash);
+  if (h != nullptr) {
+    MakeInvisible(h);
+  }
+}
+
+void ClockCacheShard::Prune() {
+  std::lock_guard<std::mutex> l(mutex_);
+  for (size_t i = 0; i < Length(); i++) {
+    ClockHandle* h = &slots_[i];
+    uint64_t meta = h->meta.load(std::memory_order_acquire);
+    if (State(meta) == kVisible && Refs(meta) == 0 &&
+        h->meta.compare_exchange_strong(meta, kConstruction << kStateShift,
+                                        std::memory_order_acq_rel)) {
+      usage_.fetch_sub(h->charge, std::memory_order_relaxed);
+      FreeSlot(h);
+    }
+  }
+}
+
+static const int kNumShardBits = 6;
+static const int kNumShards = 1 << kNumShardBits;
+
+class ShardedClockCache : public Cache {
+ private:
+  ClockCacheShard shard_[kNumShards];
+  std::atomic<uint64_t> last_id_{0};
+  size_t capacity_;
+
+  static inline uint32_t HashSlice(const Slice& s) {
+    return Hash(s.data(), s.size(), 0);
+  }
+
+  static uint32_t Shard(uint32_t hash) { return hash >> (32 - kNumShardBits); }
+
+ public:
+  ShardedClockCache(size_t capacity, size_t estimated_entry_charge)
+      : capacity_(capacity) {
+    const size_t per_shard = (capacity + (kNumShards - 1)) / kNumShards;
+    const size_t entries_per_shard =
+        (per_shard + estimated_entry_charge - 1) /
+        std::max<size_t>(estimated_entry_charge, 1);
+    for (int s = 0; s < kNumShards; s++) {
+      shard_[s].Init(per_shard, entries_per_shard);
+    }
+  }
+  ~ShardedClockCache() override {}
+  size_t GetCapacity() override { return capacity_; }
+  Handle* Insert(const Slice& key, void* value, size_t charge,
+                 void (*deleter)(const Slice& key, void* value)) override {
+    const uint32_t hash = HashSlice(key);
+    return shard_[Shard(hash)].Insert(key, hash, value, charge, deleter);
+  }
+  Handle* Lookup(const Slice& key) override {
+    const uint32_t hash = HashSlice(key);
+    return shard_[Shard(hash)].Lookup(key, hash);
+  }
+  void Release(Handle* handle) override {
+    ClockHandle* h = reinterpret_cast<ClockHandle*>(handle);
+    shard_[Shard(h->hash.load(std::memory_order_relaxed))].Release(handle);
+  }
+  void Erase(const Slice& key) override {
+    const uint32_t hash = HashSlice(key);
+    shard_[Shard(hash)].Erase(key, hash);
+  }
+  void* Value(Handle* handle) override {
+    return reinterpret_cast<ClockHandle*>(handle)->value;
+  }
+  uint64_t NewId() override { return ++last_id_; }
+  void Prune() override {
+    for (int s = 0; s < kNumShards; s++) {
+      shard_[s].Prune();
+    }
+  }
+  size_t TotalCharge() const override {
+    size_t total = 0;
+    for (int s = 0; s < kNumShards; s++) {
+      total += shard_[s].TotalCharge();
+    }
+    return total;
+  }
+};
+
+}  // end anonymous namespace
+
+Cache* NewClockCache(size_t capacity, size_t estimated_entry_charge) {
+  return new ShardedClockCache(capacity, estimated_entry_charge);
+}
+
+}  // namespace dLSM
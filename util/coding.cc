@@ -51,8 +51,48 @@ char* EncodeVarint32(char* dst, uint32_t v) {
 #pragma warning(pop)
 #endif
 
+namespace {
+
+// Decode the varint at "p" from one load of the 8 bytes there, which are
+// all before the limit. The high bits of the bytes tell its length at once
+// and its 7 bit groups are packed in three steps rather than a byte at a
+// time. Returns nullptr if the varint is longer than 8 bytes.
+inline const char* DecodeVarintWord(const char* p, uint64_t* value) {
+  if (!port::kLittleEndian) {
+    return nullptr;
+  }
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  // The last byte is the first one without its high bit.
+  const uint64_t ends = ~word & 0x8080808080808080ull;
+  if (ends == 0) {
+    return nullptr;
+  }
+  const int length = (__builtin_ctzll(ends) + 1) / 8;
+  if (length < 8) {
+    word &= (uint64_t{1} << (8 * length)) - 1;
+  }
+  word &= 0x7f7f7f7f7f7f7f7full;
+  word = (word & 0x007f007f007f007full) | ((word & 0x7f007f007f007f00ull) >> 1);
+  word = (word & 0x00003fff00003fffull) | ((word & 0x3fff00003fff0000ull) >> 2);
+  word = (word & 0x000000000fffffffull) | ((word & 0x0fffffff00000000ull) >> 4);
+  *value = word;
+  return p + length;
+}
+
+}  // namespace
+
 const char* GetVarint32PtrFallback(const char* p, const char* limit,
                                    uint32_t* value) {
+  if (limit - p >= 8) {
+    uint64_t result;
+    const char* q = DecodeVarintWord(p, &result);
+    // A varint32 is at most 5 bytes.
+    if (q != nullptr && q - p <= 5) {
+      *value = static_cast<uint32_t>(result);
+      return q;
+    }
+  }
   uint32_t result = 0;
   for (uint32_t shift = 0; shift <= 28 && p < limit; shift += 7) {
     uint32_t byte = *(reinterpret_cast<const unsigned char*>(p));
@@ -70,6 +110,12 @@ const char* GetVarint32PtrFallback(const char* p, const char* limit,
 }
 
 const char* GetVarint64Ptr(const char* p, const char* limit, uint64_t* value) {
+  if (limit - p >= 8) {
+    const char* q = DecodeVarintWord(p, value);
+    if (q != nullptr) {
+      return q;
+    }
+  }
   uint64_t result = 0;
   for (uint32_t shift = 0; shift <= 63 && p < limit; shift += 7) {
     uint64_t byte = *(reinterpret_cast<const unsigned char*>(p));
@@ -0,0 +1,41 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "dLSM/compaction_filter.h"
+
+#include <map>
+#include <mutex>
+
+namespace dLSM {
+
+CompactionFilter::~CompactionFilter() = default;
+
+namespace {
+
+struct Registry {
+  std::mutex mutex;
+  std::map<std::string, const CompactionFilter*> filters;
+};
+
+Registry* GetRegistry() {
+  static Registry* registry = new Registry;
+  return registry;
+}
+
+}  // namespace
+
+void RegisterCompactionFilter(const CompactionFilter* filter) {
+  Registry* registry = GetRegistry();
+  std::lock_guard<std::mutex> lck(registry->mutex);
+  registry->filters[filter->Name()] = filter;
+}
+
+const CompactionFilter* FindCompactionFilter(const std::string& name) {
+  Registry* registry = GetRegistry();
+  std::lock_guard<std::mutex> lck(registry->mutex);
+  auto iter = registry->filters.find(name);
+  return iter == registry->filters.end() ? nullptr : iter->second;
+}
+
+}  // namespace dLSM
@@ -26,11 +26,28 @@ namespace {
 // 1MB, 64 cores will quickly allocate 64MB, and may quickly trigger a
 // flush. Cap the size instead.
 const size_t kMaxShardBlockSize = size_t{128 * 1024};
+
+// With huge pages the shard blocks are cut from the huge pages, whatever
+// block_size is. A power of two divides the pages, so that no shard block
+// straddles two of them and no tail of a page is left unused.
+size_t ShardBlockSize(size_t block_size, size_t huge_page_size) {
+  if (huge_page_size == 0) {
+    return std::min(kMaxShardBlockSize, block_size / 8);
+  }
+  const size_t limit =
+      std::min(kMaxShardBlockSize, std::max(block_size, huge_page_size) / 8);
+  size_t shard_block_size = kMaxShardBlockSize;
+  while (shard_block_size > sizeof(void*) &&
+         (shard_block_size > limit || huge_page_size % shard_block_size != 0)) {
+    shard_block_size /= 2;
+  }
+  return shard_block_size;
+}
 }  // namespace
 
 ConcurrentArena::ConcurrentArena(size_t block_size, AllocTracker* tracker,
                                  size_t huge_page_size)
-    : shard_block_size_(std::min(kMaxShardBlockSize, block_size / 8)),
+    : shard_block_size_(ShardBlockSize(block_size, huge_page_size)),
 //      shards_(),
       arena_(block_size, tracker, huge_page_size) {
 //  thread_local_shard = 0;
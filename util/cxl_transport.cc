@@ -0,0 +1,202 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/cxl_transport.h"
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace dLSM {
+
+namespace {
+
+// A node whose addresses were not found is not scanned again sooner.
+const auto kRescanInterval = std::chrono::milliseconds(100);
+
+// "dlsm_cxl_<node>_<address in hex>", the address the memory node mapped
+// the segment at.
+std::string SegmentName(uint8_t node_id, uintptr_t addr) {
+  char name[64];
+  std::snprintf(name, sizeof(name), "dlsm_cxl_%u_%" PRIxPTR,
+                static_cast<unsigned>(node_id), addr);
+  return name;
+}
+
+bool ParseSegmentName(const char* name, uint8_t node_id, uintptr_t* addr) {
+  unsigned node;
+  if (std::sscanf(name, "dlsm_cxl_%u_%" SCNxPTR, &node, addr) != 2) {
+    return false;
+  }
+  return node == node_id;
+}
+
+// memcpy whose stores bypass the caches where the alignment allows, so
+// that the lines written for the other node are not kept in this one.
+void CopyNontemporal(char* dst, const char* src, size_t size) {
+#ifdef __SSE2__
+  while (size > 0 && reinterpret_cast<uintptr_t>(dst) % 16 != 0) {
+    *dst++ = *src++;
+    size--;
+  }
+  for (; size >= 16; size -= 16, dst += 16, src += 16) {
+    _mm_stream_si128(reinterpret_cast<__m128i*>(dst),
+                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+  }
+  std::memcpy(dst, src, size);
+  _mm_sfence();
+#else
+  std::memcpy(dst, src, size);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+}
+
+}  // namespace
+
+CXL_Transport::CXL_Transport(const std::string& dir) : dir_(dir) {}
+
+CXL_Transport::~CXL_Transport() {
+  for (auto& node : segments_) {
+    for (auto& segment : node) {
+      munmap(segment.second.local, segment.second.size);
+    }
+  }
+  for (const std::string& path : created_) {
+    unlink(path.c_str());
+  }
+}
+
+char* CXL_Transport::Map_Segment(uint8_t node_id, size_t size) {
+  static std::atomic<uint64_t> next_temp{0};
+  const std::string temp = dir_ + "/dlsm_cxl_tmp_" +
+                           std::to_string(getpid()) + "_" +
+                           std::to_string(next_temp.fetch_add(1));
+  int fd = open(temp.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+  if (fd < 0) {
+    std::perror("CXL segment create");
+    return nullptr;
+  }
+  void* addr = MAP_FAILED;
+  if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+    addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (addr == MAP_FAILED) {
+    std::perror("CXL segment map");
+    unlink(temp.c_str());
+    return nullptr;
+  }
+  // Named once mapped, so that a compute node scanning the pool only sees
+  // complete segments.
+  const std::string path =
+      dir_ + "/" + SegmentName(node_id, reinterpret_cast<uintptr_t>(addr));
+  if (rename(temp.c_str(), path.c_str()) != 0) {
+    std::perror("CXL segment rename");
+    munmap(addr, size);
+    unlink(temp.c_str());
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> l(created_mutex_);
+  created_.push_back(path);
+  return static_cast<char*>(addr);
+}
+
+void CXL_Transport::Scan(uint8_t node_id) {
+  last_scan_[node_id] = std::chrono::steady_clock::now();
+  DIR* dir = opendir(dir_.c_str());
+  if (dir == nullptr) {
+    return;
+  }
+  std::map<uintptr_t, Segment>& segments = segments_[node_id];
+  while (dirent* entry = readdir(dir)) {
+    uintptr_t addr;
+    if (!ParseSegmentName(entry->d_name, node_id, &addr) ||
+        segments.count(addr) != 0) {
+      continue;
+    }
+    const std::string path = dir_ + "/" + entry->d_name;
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+      continue;
+    }
+    struct stat st;
+    void* local = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      local = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+    }
+    close(fd);
+    if (local != MAP_FAILED) {
+      segments[addr] = {static_cast<char*>(local),
+                        static_cast<size_t>(st.st_size)};
+    }
+  }
+  closedir(dir);
+}
+
+char* CXL_Transport::Translate(uint8_t node_id, uintptr_t remote_addr,
+                               size_t size) {
+  auto find = [&]() -> char* {
+    const std::map<uintptr_t, Segment>& segments = segments_[node_id];
+    auto it = segments.upper_bound(remote_addr);
+    if (it == segments.begin()) {
+      return nullptr;
+    }
+    --it;
+    const uintptr_t offset = remote_addr - it->first;
+    if (offset + size > it->second.size) {
+      return nullptr;
+    }
+    return it->second.local + offset;
+  };
+  {
+    std::shared_lock<std::shared_mutex> l(mutex_);
+    if (char* local = find()) {
+      return local;
+    }
+  }
+  std::unique_lock<std::shared_mutex> l(mutex_);
+  if (char* local = find()) {
+    return local;
+  }
+  if (std::chrono::steady_clock::now() - last_scan_[node_id] <
+      kRescanInterval) {
+    return nullptr;
+  }
+  Scan(node_id);
+  return find();
+}
+
+bool CXL_Transport::Read(uint8_t node_id, const void* remote_addr,
+                         void* local, size_t size) {
+  const char* src = Translate(
+      node_id, reinterpret_cast<uintptr_t>(remote_addr), size);
+  if (src == nullptr) {
+    return false;
+  }
+  std::memcpy(local, src, size);
+  return true;
+}
+
+bool CXL_Transport::Write(uint8_t node_id, void* remote_addr,
+                          const void* local, size_t size) {
+  char* dst = Translate(node_id, reinterpret_cast<uintptr_t>(remote_addr),
+                        size);
+  if (dst == nullptr) {
+    return false;
+  }
+  CopyNontemporal(dst, static_cast<const char*>(local), size);
+  return true;
+}
+
+}  // namespace dLSM
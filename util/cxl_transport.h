@@ -0,0 +1,78 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// The one-sided reads and writes of RDMA_Manager over a memory pool the
+// compute nodes and the memory nodes all map, such as CXL attached memory
+// exposed as a DAX file system, or /dev/shm on one host. A memory node
+// backs its registered memory with files of the pool directory, named by
+// the node and the address the segment has in the memory node, so that the
+// remote addresses handed out as usual lead a compute node to the file. The
+// compute node maps the files as it meets their addresses and reads and
+// writes them with loads and stores, without the NIC. The RPCs and the
+// atomics still go over the queue pairs.
+
+#ifndef STORAGE_dLSM_UTIL_CXL_TRANSPORT_H_
+#define STORAGE_dLSM_UTIL_CXL_TRANSPORT_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+namespace dLSM {
+
+class CXL_Transport {
+ public:
+  explicit CXL_Transport(const std::string& dir);
+
+  CXL_Transport(const CXL_Transport&) = delete;
+  CXL_Transport& operator=(const CXL_Transport&) = delete;
+
+  // Removes the files of the segments this process created.
+  ~CXL_Transport();
+
+  // On a memory node: map "size" bytes of a new file of the pool for
+  // "node_id". Null if the file can not be created or mapped. The segment
+  // is unmapped by the caller, the file removed with the transport.
+  char* Map_Segment(uint8_t node_id, size_t size);
+
+  // On a compute node: copy "size" bytes at "remote_addr" of the memory
+  // node "node_id" to "local", or "local" to there. False if the range is
+  // not in a segment of the pool, the caller then goes over the NIC. The
+  // writes use non-temporal stores where they can and are visible to the
+  // memory node when Write() returns.
+  bool Read(uint8_t node_id, const void* remote_addr, void* local,
+            size_t size);
+  bool Write(uint8_t node_id, void* remote_addr, const void* local,
+             size_t size);
+
+ private:
+  struct Segment {
+    char* local;
+    size_t size;
+  };
+  // The local address of the "size" bytes at "remote_addr" of "node_id".
+  char* Translate(uint8_t node_id, uintptr_t remote_addr, size_t size);
+  // Map the segments of "node_id" added to the pool since the last scan,
+  // lock held exclusively.
+  void Scan(uint8_t node_id);
+
+  const std::string dir_;
+  // The segments of every memory node by their address in the memory node.
+  std::shared_mutex mutex_;
+  std::map<uintptr_t, Segment> segments_[256];
+  // A node not found is scanned for again after kRescanInterval at most.
+  std::chrono::steady_clock::time_point last_scan_[256];
+  // The files created by this process.
+  std::mutex created_mutex_;
+  std::vector<std::string> created_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_CXL_TRANSPORT_H_
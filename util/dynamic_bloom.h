@@ -0,0 +1,84 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_UTIL_DYNAMIC_BLOOM_H_
+#define STORAGE_dLSM_UTIL_DYNAMIC_BLOOM_H_
+
+#include <atomic>
+#include <memory>
+
+#include "dLSM/slice.h"
+#include "util/bloom_impl.h"
+#include "util/hash.h"
+
+namespace dLSM {
+
+// A bloom filter which takes concurrent Add calls, so that it can be filled
+// along with a memtable. The probes of a key are all in one cache line, in
+// the same way as FastLocalBloomImpl.
+class DynamicBloom {
+ public:
+  DynamicBloom(size_t num_keys, int bits_per_key)
+      : num_probes_(FastLocalBloomImpl::ChooseNumProbes(bits_per_key * 1000)) {
+    size_t total_bits = num_keys * bits_per_key;
+    num_lines_ = static_cast<uint32_t>(
+        (total_bits + kCacheLineBits - 1) / kCacheLineBits);
+    if (num_lines_ == 0) {
+      num_lines_ = 1;
+    }
+    lines_.reset(new CacheLine[num_lines_]);
+  }
+  DynamicBloom(const DynamicBloom&) = delete;
+  DynamicBloom& operator=(const DynamicBloom&) = delete;
+
+  // Safe to call from multiple threads at the same time.
+  void AddConcurrently(const Slice& key) {
+    uint32_t h2;
+    CacheLine* line = Line(key, &h2);
+    for (int i = 0; i < num_probes_; ++i, h2 *= uint32_t{0x9e3779b9}) {
+      uint32_t bitpos = h2 >> (32 - 9);
+      std::atomic<uint64_t>& word = line->words[bitpos >> 6];
+      uint64_t mask = uint64_t{1} << (bitpos & 63);
+      // Skip the write if the bit is already set, to keep the line shared.
+      if ((word.load(std::memory_order_relaxed) & mask) == 0) {
+        word.fetch_or(mask, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool MayContain(const Slice& key) const {
+    uint32_t h2;
+    const CacheLine* line = Line(key, &h2);
+    for (int i = 0; i < num_probes_; ++i, h2 *= uint32_t{0x9e3779b9}) {
+      uint32_t bitpos = h2 >> (32 - 9);
+      uint64_t mask = uint64_t{1} << (bitpos & 63);
+      if ((line->words[bitpos >> 6].load(std::memory_order_relaxed) & mask) ==
+          0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  static constexpr size_t kCacheLineBits = 512;
+  struct alignas(64) CacheLine {
+    std::atomic<uint64_t> words[kCacheLineBits / 64] = {};
+  };
+
+  // h1 picks the cache line and h2 the bits within it.
+  CacheLine* Line(const Slice& key, uint32_t* h2) const {
+    uint32_t h1 = Hash(key.data(), key.size(), 0xbc9f1d34);
+    *h2 = Hash(key.data(), key.size(), 0x5bd1e995);
+    return &lines_[FastRange32(h1, num_lines_)];
+  }
+
+  const int num_probes_;
+  uint32_t num_lines_;
+  std::unique_ptr<CacheLine[]> lines_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_DYNAMIC_BLOOM_H_
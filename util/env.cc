@@ -28,6 +28,12 @@ Status Env::DeleteDir(const std::string& dirname) { return RemoveDir(dirname); }
 Status Env::RemoveFile(const std::string& fname) { return DeleteFile(fname); }
 Status Env::DeleteFile(const std::string& fname) { return RemoveFile(fname); }
 unsigned int Env::Queue_Length_Quiry(ThreadPoolType type) { return 0; }
+unsigned int Env::Queue_Length_Quiry(ThreadPoolType type, void* tag) {
+  return 0;
+}
+void Env::SetBackgroundThreads(int min, int max, ThreadPoolType type) {
+  SetBackgroundThreads(max, type);
+}
 
 SequentialFile::~SequentialFile() = default;
 
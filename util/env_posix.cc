@@ -28,7 +28,14 @@ PosixEnv::PosixEnv()
       19843, /* tcp_port */
       1,	 /* ib_port */ //physical
       1, /* gid_idx */
-      4*10*1024*1024 /*initial local buffer size*/
+      4*10*1024*1024, /*initial local buffer size*/
+      2*1024*1024, /* huge_page_size */
+      true, /* on_demand_paging */
+      0, /* num_ports */
+      32, /* qp_pool_size */
+      true, /* pin_threads */
+      std::getenv("DLSM_CXL_PATH"), /* cxl_path */
+      nullptr /* pmem_path */
   };
   size_t remote_block_size = RDMA_WRITE_BLOCK;
   //Initialize the rdma manager, the remote block size will be configured in the beggining.
@@ -40,6 +47,12 @@ PosixEnv::PosixEnv()
 
   //client will try to connect to the remote memory, now there is only one remote memory.
   rdma_mg->Client_Set_Up_Resources();
+  // The flushes and compactions work on the registered buffers, next to the
+  // NIC. The foreground threads are placed by the application.
+  std::function<void()> pin = [this]() { rdma_mg->Pin_Thread_To_NIC_Node(); };
+  flushing.SetThreadInit(pin);
+  compaction.SetThreadInit(pin);
+  subcompaction.SetThreadInit(pin);
 
 
 
@@ -76,25 +89,28 @@ void PosixEnv::Schedule(
 }
 void PosixEnv::Schedule(
     void (*background_work_function)(void* background_work_arg),
-    void* background_work_arg, ThreadPoolType type) {
+    void* background_work_arg, ThreadPoolType type, void* tag,
+    BGPriority priority) {
   switch (type) {
     case FlushThreadPool:
-      if (flushing.queue_len_.load()>256){
+      if (flushing.QueueLength(tag)>256){
         //If there has already be enough compaction scheduled, then drop this one
-        printf("queue length has been too long %d elements in the queue\n", flushing.queue_len_.load());
+        printf("queue length has been too long %u elements in the queue\n", flushing.QueueLength(tag));
         return;
       }
-//      DEBUG_arg("flushing thread pool task queue length %zu\n", flushing.queue_.size());
-      flushing.Schedule(background_work_function, background_work_arg);
+//      DEBUG_arg("flushing thread pool task queue length %u\n", flushing.queue_len_.load());
+      flushing.Schedule(background_work_function, background_work_arg, tag,
+                        priority);
       break;
     case CompactionThreadPool:
-      if (compaction.queue_len_.load()>256){
+      if (compaction.QueueLength(tag)>256){
         //If there has already be enough compaction scheduled, then drop this one
-        printf("queue length has been too long %d elements in the queue\n", compaction.queue_len_.load());
+        printf("queue length has been too long %u elements in the queue\n", compaction.QueueLength(tag));
         return;
       }
-//      DEBUG_arg("compaction thread pool task queue length %zu\n", compaction.queue_.size());
-      compaction.Schedule(background_work_function, background_work_arg);
+//      DEBUG_arg("compaction thread pool task queue length %u\n", compaction.queue_len_.load());
+      compaction.Schedule(background_work_function, background_work_arg, tag,
+                          priority);
       break;
 //    case SubcompactionThreadPool:
 //      subcompaction.Schedule(background_work_function, background_work_arg);
@@ -104,11 +120,11 @@ void PosixEnv::Schedule(
 unsigned int PosixEnv::Queue_Length_Quiry(ThreadPoolType type){
   switch (type) {
     case FlushThreadPool:
-      DEBUG_arg("flushing thread pool task queue length %zu\n", flushing.queue_.size());
+      DEBUG_arg("flushing thread pool task queue length %u\n", flushing.queue_len_.load());
       return flushing.queue_len_.load();
       break;
     case CompactionThreadPool:
-      DEBUG_arg("compaction thread pool task queue length %zu\n", compaction.queue_.size());
+      DEBUG_arg("compaction thread pool task queue length %u\n", compaction.queue_len_.load());
       return compaction.queue_len_.load();
       break;
     case SubcompactionThreadPool:
@@ -118,6 +134,18 @@ unsigned int PosixEnv::Queue_Length_Quiry(ThreadPoolType type){
       return 0-1;
   }
 }
+unsigned int PosixEnv::Queue_Length_Quiry(ThreadPoolType type, void* tag) {
+  switch (type) {
+    case FlushThreadPool:
+      return flushing.QueueLength(tag);
+    case CompactionThreadPool:
+      return compaction.QueueLength(tag);
+    case SubcompactionThreadPool:
+      return subcompaction.QueueLength(tag);
+    default:
+      return 0-1;
+  }
+}
 void PosixEnv::JoinAllThreads(bool wait_for_jobs_to_complete) {
   flushing.JoinThreads(wait_for_jobs_to_complete);
   compaction.JoinThreads(wait_for_jobs_to_complete);
@@ -672,8 +672,10 @@ class PosixEnv : public Env {
                 void* background_work_arg) override;
   void Schedule(
       void (*background_work_function)(void* background_work_arg),
-      void* background_work_arg, ThreadPoolType type) override;
+      void* background_work_arg, ThreadPoolType type, void* tag = nullptr,
+      BGPriority priority = kCompactionPriority) override;
   unsigned int Queue_Length_Quiry(ThreadPoolType type) override;
+  unsigned int Queue_Length_Quiry(ThreadPoolType type, void* tag) override;
   void JoinAllThreads(bool wait_for_jobs_to_complete) override;
   void StartThread(void (*thread_main)(void* thread_main_arg),
                    void* thread_main_arg) override {
@@ -740,6 +742,19 @@ class PosixEnv : public Env {
         break;
     }
   }
+  void SetBackgroundThreads(int min, int max, ThreadPoolType type) override{
+    switch (type) {
+      case FlushThreadPool:
+        flushing.SetBackgroundThreads(min, max);
+        break;
+      case CompactionThreadPool:
+        compaction.SetBackgroundThreads(min, max);
+        break;
+      case SubcompactionThreadPool:
+        subcompaction.SetBackgroundThreads(min, max);
+        break;
+    }
+  }
 
  private:
   void BackgroundThreadMain();
@@ -0,0 +1,95 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/frequency_sketch.h"
+
+#include <algorithm>
+
+namespace dLSM {
+
+namespace {
+
+// 16 counters of 4 bits per word.
+constexpr int kCountersPerWord = 16;
+
+uint64_t Mix(uint64_t key) {
+  key ^= key >> 33;
+  key *= UINT64_C(0xff51afd7ed558ccd);
+  key ^= key >> 33;
+  key *= UINT64_C(0xc4ceb9fe1a85ec53);
+  key ^= key >> 33;
+  return key;
+}
+
+}  // namespace
+
+FrequencySketch::FrequencySketch(size_t width, uint64_t sample_size)
+    : sample_size_(std::max<uint64_t>(sample_size, 2)), samples_(0) {
+  size_t w = kCountersPerWord;
+  while (w < width) {
+    w <<= 1;
+  }
+  width_mask_ = w - 1;
+  row_words_ = w / kCountersPerWord;
+  table_.reset(new std::atomic<uint64_t>[kDepth * row_words_]);
+  for (size_t i = 0; i < kDepth * row_words_; i++) {
+    table_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void FrequencySketch::Locate(uint64_t hash, int i, size_t* word,
+                             int* shift) const {
+  // Double hashing, the rows take different halves of the mix.
+  uint64_t h = hash + static_cast<uint64_t>(i) * ((hash >> 32) | 1);
+  size_t index = static_cast<size_t>(h) & width_mask_;
+  *word = i * row_words_ + index / kCountersPerWord;
+  *shift = static_cast<int>(index % kCountersPerWord) * 4;
+}
+
+void FrequencySketch::Increment(uint64_t key) {
+  uint64_t hash = Mix(key);
+  for (int i = 0; i < kDepth; i++) {
+    size_t word;
+    int shift;
+    Locate(hash, i, &word, &shift);
+    std::atomic<uint64_t>& w = table_[word];
+    uint64_t old_value = w.load(std::memory_order_relaxed);
+    while (((old_value >> shift) & 0xF) < kMaxFrequency &&
+           !w.compare_exchange_weak(old_value,
+                                    old_value + (uint64_t{1} << shift),
+                                    std::memory_order_relaxed)) {
+    }
+  }
+  uint64_t samples = samples_.fetch_add(1, std::memory_order_relaxed) + 1;
+  // Only the thread which reaches the sample size ages the counters.
+  if (samples == sample_size_) {
+    Age();
+  }
+}
+
+uint32_t FrequencySketch::Estimate(uint64_t key) const {
+  uint64_t hash = Mix(key);
+  uint32_t frequency = kMaxFrequency;
+  for (int i = 0; i < kDepth; i++) {
+    size_t word;
+    int shift;
+    Locate(hash, i, &word, &shift);
+    uint64_t w = table_[word].load(std::memory_order_relaxed);
+    frequency = std::min(frequency, static_cast<uint32_t>((w >> shift) & 0xF));
+  }
+  return frequency;
+}
+
+void FrequencySketch::Age() {
+  for (size_t i = 0; i < kDepth * row_words_; i++) {
+    uint64_t old_value = table_[i].load(std::memory_order_relaxed);
+    while (!table_[i].compare_exchange_weak(
+        old_value, (old_value >> 1) & UINT64_C(0x7777777777777777),
+        std::memory_order_relaxed)) {
+    }
+  }
+  samples_.fetch_sub(sample_size_ / 2, std::memory_order_relaxed);
+}
+
+}  // namespace dLSM
@@ -0,0 +1,55 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_UTIL_FREQUENCY_SKETCH_H_
+#define STORAGE_dLSM_UTIL_FREQUENCY_SKETCH_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace dLSM {
+
+// Approximate access frequencies of 64 bit keys, a count-min sketch of 4
+// rows of 4 bit counters with the aging of TinyLFU (Einziger et al.,
+// "TinyLFU: A Highly Efficient Cache Admission Policy"): once sample_size
+// increments have been seen, all the counters are halved, so that the
+// estimates follow the recent accesses.
+//
+// Safe for concurrent use without external synchronization. An estimate
+// may be a little off while the counters are being halved.
+class FrequencySketch {
+ public:
+  // width is the number of counters per row, rounded up to a power of 2.
+  // A key with a share of the increments above about 15 / sample_size
+  // saturates its counters.
+  FrequencySketch(size_t width, uint64_t sample_size);
+
+  FrequencySketch(const FrequencySketch&) = delete;
+  FrequencySketch& operator=(const FrequencySketch&) = delete;
+
+  void Increment(uint64_t key);
+  // Estimated number of recent accesses to key, at most 15.
+  uint32_t Estimate(uint64_t key) const;
+
+  static constexpr uint32_t kMaxFrequency = 15;
+
+ private:
+  static constexpr int kDepth = 4;
+
+  // Word and bit offset of the counter of key in row i.
+  void Locate(uint64_t hash, int i, size_t* word, int* shift) const;
+  void Age();
+
+  size_t width_mask_;
+  size_t row_words_;
+  uint64_t sample_size_;
+  std::atomic<uint64_t> samples_;
+  std::unique_ptr<std::atomic<uint64_t>[]> table_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_FREQUENCY_SKETCH_H_
@@ -4,6 +4,7 @@
 
 #include "util/histogram.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 
@@ -180,11 +181,11 @@ void Histogram::Clear() {
 }
 
 void Histogram::Add(double value) {
-  // Linear search is fast enough for our usage in db_bench
-  int b = 0;
-  while (b < kNumBuckets - 1 && kBucketLimit[b] <= value) {
-    b++;
-  }
+  // The first bucket whose limit is above the value, the write path adds
+  // to the histograms on every write.
+  int b = std::upper_bound(kBucketLimit, kBucketLimit + kNumBuckets - 1,
+                           value) -
+          kBucketLimit;
   buckets_[b] += 1.0;
   if (min_ > value) min_ = value;
   if (max_ < value) max_ = value;
@@ -269,4 +270,14 @@ std::string Histogram::ToString() const {
   return r;
 }
 
+std::string Histogram::PercentileString() const {
+  char buf[200];
+  std::snprintf(buf, sizeof(buf),
+                "P50: %.2f  P90: %.2f  P99: %.2f  P99.9: %.2f  P99.99: %.2f  "
+                "Max: %.2f",
+                Median(), Percentile(90), Percentile(99), Percentile(99.9),
+                Percentile(99.99), max_);
+  return buf;
+}
+
 }  // namespace dLSM
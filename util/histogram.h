@@ -19,15 +19,17 @@ class Histogram {
   void Merge(const Histogram& other);
 
   std::string ToString() const;
-
- private:
-  enum { kNumBuckets = 154 };
+  // One line of the P50, P90, P99, P99.9 and P99.99 values and the maximum.
+  std::string PercentileString() const;
 
   double Median() const;
   double Percentile(double p) const;
   double Average() const;
   double StandardDeviation() const;
 
+ private:
+  enum { kNumBuckets = 154 };
+
   static const double kBucketLimit[kNumBuckets];
 
   double min_;
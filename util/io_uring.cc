@@ -0,0 +1,183 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/io_uring.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+namespace dLSM {
+
+namespace {
+
+int SysIOUringSetup(unsigned entries, io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int SysIOUringEnter(int fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                  min_complete, flags, nullptr, 0));
+}
+
+unsigned* RingField(void* ring, uint32_t offset) {
+  return reinterpret_cast<unsigned*>(static_cast<char*>(ring) + offset);
+}
+
+}  // namespace
+
+IOUring::IOUring()
+    : ring_fd_(-1),
+      sq_ptr_(MAP_FAILED),
+      sq_size_(0),
+      cq_ptr_(MAP_FAILED),
+      cq_size_(0),
+      sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)),
+      sqes_size_(0),
+      sq_entries_(0),
+      pending_(0) {}
+
+IOUring::~IOUring() {
+  if (sqes_ != MAP_FAILED) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+    munmap(cq_ptr_, cq_size_);
+  }
+  if (sq_ptr_ != MAP_FAILED) {
+    munmap(sq_ptr_, sq_size_);
+  }
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+  }
+}
+
+bool IOUring::Init(unsigned entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd_ = SysIOUringSetup(entries, &params);
+  if (ring_fd_ < 0) {
+    return false;
+  }
+  sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  // Newer kernels map both rings at once.
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+  }
+  sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ptr_ == MAP_FAILED) {
+    return false;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr_ = sq_ptr_;
+  } else {
+    cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ptr_ == MAP_FAILED) {
+      return false;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = static_cast<io_uring_sqe*>(
+      mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+  if (sqes_ == MAP_FAILED) {
+    return false;
+  }
+  sq_head_ = RingField(sq_ptr_, params.sq_off.head);
+  sq_tail_ = RingField(sq_ptr_, params.sq_off.tail);
+  sq_mask_ = RingField(sq_ptr_, params.sq_off.ring_mask);
+  sq_array_ = RingField(sq_ptr_, params.sq_off.array);
+  sq_entries_ = params.sq_entries;
+  cq_head_ = RingField(cq_ptr_, params.cq_off.head);
+  cq_tail_ = RingField(cq_ptr_, params.cq_off.tail);
+  cq_mask_ = RingField(cq_ptr_, params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(static_cast<char*>(cq_ptr_) +
+                                          params.cq_off.cqes);
+  return true;
+}
+
+unsigned IOUring::SpaceLeft() const {
+  // Without SQPOLL the kernel consumes every submitted entry in Submit().
+  return sq_entries_ - pending_;
+}
+
+io_uring_sqe* IOUring::NextSqe() {
+  assert(SpaceLeft() > 0);
+  unsigned tail = *sq_tail_ + pending_;
+  unsigned index = tail & *sq_mask_;
+  io_uring_sqe* sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  pending_++;
+  return sqe;
+}
+
+void IOUring::PrepareWrite(int fd, const void* buf, size_t n, uint64_t offset,
+                           uint64_t user_data) {
+  io_uring_sqe* sqe = NextSqe();
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = static_cast<uint32_t>(n);
+  sqe->off = offset;
+  sqe->user_data = user_data;
+}
+
+void IOUring::PrepareFdatasync(int fd, uint64_t user_data) {
+  io_uring_sqe* sqe = NextSqe();
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = fd;
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe->user_data = user_data;
+}
+
+int IOUring::Submit(unsigned wait_nr) {
+  // Publish the prepared entries before the kernel reads the tail.
+  __atomic_store_n(sq_tail_, *sq_tail_ + pending_, __ATOMIC_RELEASE);
+  unsigned remaining = pending_;
+  pending_ = 0;
+  // Submit first and wait apart, so that an interrupted wait does not lose
+  // the count of the submitted entries.
+  while (remaining > 0) {
+    int ret = SysIOUringEnter(ring_fd_, remaining, 0, 0);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return ret < 0 ? -errno : -EAGAIN;
+    }
+    remaining -= ret;
+  }
+  while (wait_nr > 0 &&
+         SysIOUringEnter(ring_fd_, 0, wait_nr, IORING_ENTER_GETEVENTS) < 0) {
+    if (errno != EINTR) {
+      return -errno;
+    }
+  }
+  return 0;
+}
+
+bool IOUring::Reap(uint64_t* user_data, int* result) {
+  unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+  *user_data = cqe.user_data;
+  *result = cqe.res;
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+}  // namespace dLSM
@@ -0,0 +1,78 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A minimal io_uring ring over the raw system calls, for the few operations
+// the persistence of the memory node needs. A ring is used by one thread.
+
+#ifndef STORAGE_dLSM_UTIL_IO_URING_H_
+#define STORAGE_dLSM_UTIL_IO_URING_H_
+
+#include <cstddef>
+#include <cstdint>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace dLSM {
+
+class IOUring {
+ public:
+  IOUring();
+
+  IOUring(const IOUring&) = delete;
+  IOUring& operator=(const IOUring&) = delete;
+
+  ~IOUring();
+
+  // Set up a ring of at least "entries" submission entries. Returns false
+  // if the kernel does not support io_uring, or does not allow it.
+  bool Init(unsigned entries);
+
+  // The submission entries which may still be prepared before Submit().
+  unsigned SpaceLeft() const;
+
+  // Prepare the write of "n" bytes at "offset" of "fd", or an fdatasync of
+  // "fd". "user_data" comes back with the completion.
+  // REQUIRES: SpaceLeft() > 0.
+  void PrepareWrite(int fd, const void* buf, size_t n, uint64_t offset,
+                    uint64_t user_data);
+  void PrepareFdatasync(int fd, uint64_t user_data);
+
+  // Submit the prepared entries and wait until "wait_nr" completions are
+  // available. Returns 0, or -errno; the ring should not be used after an
+  // error, since some entries may be left unsubmitted.
+  int Submit(unsigned wait_nr);
+
+  // Take the next completion, if any. "*result" is the result of the
+  // operation: the bytes written, 0, or -errno.
+  bool Reap(uint64_t* user_data, int* result);
+
+ private:
+  io_uring_sqe* NextSqe();
+
+  int ring_fd_;
+  // The mapped rings.
+  void* sq_ptr_;
+  size_t sq_size_;
+  void* cq_ptr_;
+  size_t cq_size_;
+  io_uring_sqe* sqes_;
+  size_t sqes_size_;
+  // Pointers into the mapped rings.
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned sq_entries_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  io_uring_cqe* cqes_;
+  // The entries prepared since the last Submit().
+  unsigned pending_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_IO_URING_H_
@@ -0,0 +1,217 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/memory_budget.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "dLSM/cache.h"
+#include "util/rdma.h"
+
+namespace dLSM {
+
+MemoryBudget::~MemoryBudget() = default;
+
+namespace {
+
+// MaybeCheckMemoryBudget() counts at most this often.
+static const int64_t kCheckPeriodMicros = 10000;
+
+static const char* const kCategoryNames[MemoryBudget::kNumCategories] = {
+    "memtables", "table readers", "block cache", "table meta cache",
+    "rdma buffers"};
+
+class MemoryBudgetImpl : public MemoryBudget {
+ public:
+  explicit MemoryBudgetImpl(size_t limit) : limit_(limit) {
+    for (int i = 0; i < kNumCategories; i++) {
+      usage_[i].store(0);
+    }
+  }
+
+  size_t GetLimit() const override { return limit_.load(); }
+
+  void SetLimit(size_t bytes) override { limit_.store(bytes); }
+
+  size_t GetUsage(Category category) const override {
+    return usage_[category].load(std::memory_order_relaxed);
+  }
+
+  size_t GetTotalUsage() const override {
+    size_t total = 0;
+    for (int i = 0; i < kNumCategories; i++) {
+      total += usage_[i].load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  void Check() override {
+    std::lock_guard<std::mutex> l(mutex_);
+    last_check_micros_.store(NowMicros(), std::memory_order_relaxed);
+    const size_t limit = limit_.load();
+    if (Count() <= limit || limit == 0) {
+      return;
+    }
+    reclaims_++;
+    // The cheapest first: the cache entries are read again on demand.
+    for (Cache* cache : Caches(kBlockCache)) {
+      cache->Prune();
+    }
+    for (Cache* cache : Caches(kTableMetaCache)) {
+      cache->Prune();
+    }
+    if (Count() <= limit) {
+      return;
+    }
+    // The tables opened again read their index and filter over RDMA.
+    for (MemoryBudgetMember* member : members_) {
+      member->EvictTableReaders();
+    }
+    if (Count() <= limit) {
+      return;
+    }
+    // The memtables are only freed by their flush, the largest ones switch
+    // early so that they go sooner.
+    MemoryBudgetMember* largest = nullptr;
+    size_t largest_usage = 0;
+    for (MemoryBudgetMember* member : members_) {
+      const size_t usage = member->MemtableMemoryUsage();
+      if (largest == nullptr || usage > largest_usage) {
+        largest = member;
+        largest_usage = usage;
+      }
+    }
+    if (largest != nullptr) {
+      largest->ShrinkMemtables();
+      memtable_shrinks_++;
+    }
+  }
+
+  std::string ToString() const override {
+    std::string result;
+    char buf[100];
+    for (int i = 0; i < kNumCategories; i++) {
+      std::snprintf(buf, sizeof(buf), "%s: %llu bytes\n", kCategoryNames[i],
+                    static_cast<unsigned long long>(
+                        GetUsage(static_cast<Category>(i))));
+      result.append(buf);
+    }
+    std::lock_guard<std::mutex> l(mutex_);
+    std::snprintf(buf, sizeof(buf),
+                  "total: %llu of %llu bytes, reclaims: %llu, memtable "
+                  "shrinks: %llu\n",
+                  static_cast<unsigned long long>(GetTotalUsage()),
+                  static_cast<unsigned long long>(limit_.load()),
+                  static_cast<unsigned long long>(reclaims_),
+                  static_cast<unsigned long long>(memtable_shrinks_));
+    result.append(buf);
+    return result;
+  }
+
+  void Register(MemoryBudgetMember* member) {
+    std::lock_guard<std::mutex> l(mutex_);
+    members_.push_back(member);
+  }
+
+  void Unregister(MemoryBudgetMember* member) {
+    std::lock_guard<std::mutex> l(mutex_);
+    members_.erase(std::remove(members_.begin(), members_.end(), member),
+                   members_.end());
+  }
+
+  void MaybeCheck() {
+    // One of the threads coming by after the period checks.
+    const int64_t now = NowMicros();
+    int64_t last = last_check_micros_.load(std::memory_order_relaxed);
+    if (now - last >= kCheckPeriodMicros &&
+        last_check_micros_.compare_exchange_strong(last, now)) {
+      Check();
+    }
+  }
+
+ private:
+  static int64_t NowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // The caches of "category" the members use, each once.
+  std::set<Cache*> Caches(Category category) {
+    std::set<Cache*> caches;
+    for (MemoryBudgetMember* member : members_) {
+      Cache* cache = category == kBlockCache ? member->BlockCache()
+                                             : member->TableMetaCache();
+      if (cache != nullptr) {
+        caches.insert(cache);
+      }
+    }
+    return caches;
+  }
+
+  // REQUIRES: mutex_ held.
+  size_t Count() {
+    size_t usage[kNumCategories] = {};
+    std::set<RDMA_Manager*> rdma_managers;
+    for (MemoryBudgetMember* member : members_) {
+      usage[kMemtables] += member->MemtableMemoryUsage();
+      usage[kTableReaders] += member->TableReaderMemoryUsage();
+      RDMA_Manager* rdma_mg = member->RdmaManager();
+      if (rdma_mg != nullptr && rdma_managers.insert(rdma_mg).second) {
+        usage[kRdmaBuffers] += rdma_mg->total_registered_size;
+      }
+    }
+    for (Cache* cache : Caches(kBlockCache)) {
+      usage[kBlockCache] += cache->TotalCharge();
+    }
+    for (Cache* cache : Caches(kTableMetaCache)) {
+      usage[kTableMetaCache] += cache->TotalCharge();
+    }
+    size_t total = 0;
+    for (int i = 0; i < kNumCategories; i++) {
+      usage_[i].store(usage[i], std::memory_order_relaxed);
+      total += usage[i];
+    }
+    return total;
+  }
+
+  std::atomic<size_t> limit_;
+  std::atomic<size_t> usage_[kNumCategories];
+  std::atomic<int64_t> last_check_micros_{0};
+  // Held while counting, so that no member is unregistered meanwhile.
+  mutable std::mutex mutex_;
+  std::vector<MemoryBudgetMember*> members_;
+  uint64_t reclaims_ = 0;
+  uint64_t memtable_shrinks_ = 0;
+};
+
+}  // namespace
+
+MemoryBudget* NewMemoryBudget(size_t limit_bytes) {
+  return new MemoryBudgetImpl(limit_bytes);
+}
+
+void RegisterMemoryBudgetMember(MemoryBudget* budget,
+                                MemoryBudgetMember* member) {
+  static_cast<MemoryBudgetImpl*>(budget)->Register(member);
+}
+
+void UnregisterMemoryBudgetMember(MemoryBudget* budget,
+                                  MemoryBudgetMember* member) {
+  static_cast<MemoryBudgetImpl*>(budget)->Unregister(member);
+}
+
+void MaybeCheckMemoryBudget(MemoryBudget* budget) {
+  if (budget != nullptr) {
+    static_cast<MemoryBudgetImpl*>(budget)->MaybeCheck();
+  }
+}
+
+}  // namespace dLSM
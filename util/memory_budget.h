@@ -0,0 +1,51 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_UTIL_MEMORY_BUDGET_H_
+#define STORAGE_dLSM_UTIL_MEMORY_BUDGET_H_
+
+#include <cstddef>
+
+#include "dLSM/memory_budget.h"
+
+namespace dLSM {
+
+class Cache;
+class RDMA_Manager;
+
+// A DB, or a shard of one, counted by a MemoryBudget.
+class MemoryBudgetMember {
+ public:
+  virtual ~MemoryBudgetMember() = default;
+
+  // The mutable memtable and the immutables.
+  virtual size_t MemtableMemoryUsage() = 0;
+  // The index blocks and the filters of the tables in the table cache.
+  virtual size_t TableReaderMemoryUsage() = 0;
+  // The caches and the RDMA manager of the member, null if it has none. The
+  // members share them and the budget counts each once.
+  virtual Cache* BlockCache() = 0;
+  virtual Cache* TableMetaCache() = 0;
+  virtual RDMA_Manager* RdmaManager() = 0;
+
+  // Close the tables no reader holds, which drops their index and filters.
+  virtual void EvictTableReaders() = 0;
+  // Switch the mutable memtable after a smaller sequence window next time.
+  virtual void ShrinkMemtables() = 0;
+};
+
+// "member" is counted by "budget" until it is unregistered, which must be
+// before it is destroyed.
+void RegisterMemoryBudgetMember(MemoryBudget* budget,
+                                MemoryBudgetMember* member);
+void UnregisterMemoryBudgetMember(MemoryBudget* budget,
+                                  MemoryBudgetMember* member);
+
+// MemoryBudget::Check(), at most every few milliseconds. Does nothing if
+// "budget" is null.
+void MaybeCheckMemoryBudget(MemoryBudget* budget);
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_MEMORY_BUDGET_H_
@@ -0,0 +1,106 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "dLSM/merge_operator.h"
+
+#include <map>
+#include <mutex>
+
+#include "util/coding.h"
+
+namespace dLSM {
+
+MergeOperator::~MergeOperator() = default;
+
+bool MergeOperator::PartialMerge(const Slice& /*key*/, const Slice& /*left*/,
+                                 const Slice& /*right*/,
+                                 std::string* /*new_value*/) const {
+  return false;
+}
+
+namespace {
+
+const char kUInt64AddName[] = "dLSM.UInt64Add";
+
+class UInt64AddOperator : public MergeOperator {
+ public:
+  const char* Name() const override { return kUInt64AddName; }
+
+  bool FullMerge(const Slice& /*key*/, const Slice* existing_value,
+                 const std::vector<Slice>& operands,
+                 std::string* new_value) const override {
+    uint64_t sum = 0;
+    if (existing_value != nullptr && !Decode(*existing_value, &sum)) {
+      return false;
+    }
+    for (const Slice& operand : operands) {
+      uint64_t n;
+      if (!Decode(operand, &n)) {
+        return false;
+      }
+      sum += n;
+    }
+    new_value->clear();
+    PutFixed64(new_value, sum);
+    return true;
+  }
+
+  bool PartialMerge(const Slice& /*key*/, const Slice& left,
+                    const Slice& right, std::string* new_value) const override {
+    uint64_t a, b;
+    if (!Decode(left, &a) || !Decode(right, &b)) {
+      return false;
+    }
+    new_value->clear();
+    PutFixed64(new_value, a + b);
+    return true;
+  }
+
+ private:
+  static bool Decode(const Slice& s, uint64_t* n) {
+    if (s.size() != sizeof(uint64_t)) {
+      return false;
+    }
+    *n = DecodeFixed64(s.data());
+    return true;
+  }
+};
+
+struct Registry {
+  std::mutex mutex;
+  std::map<std::string, const MergeOperator*> operators;
+};
+
+Registry* GetRegistry() {
+  static Registry* registry = new Registry;
+  return registry;
+}
+
+}  // namespace
+
+const MergeOperator* NewUInt64AddOperator() { return new UInt64AddOperator; }
+
+void RegisterMergeOperator(const MergeOperator* merge_operator) {
+  Registry* registry = GetRegistry();
+  std::lock_guard<std::mutex> lck(registry->mutex);
+  registry->operators[merge_operator->Name()] = merge_operator;
+}
+
+const MergeOperator* FindMergeOperator(const std::string& name) {
+  Registry* registry = GetRegistry();
+  std::lock_guard<std::mutex> lck(registry->mutex);
+  auto iter = registry->operators.find(name);
+  if (iter != registry->operators.end()) {
+    return iter->second;
+  }
+  if (name != kUInt64AddName) {
+    return nullptr;
+  }
+  // Kept for the next lookups of the name.
+  const MergeOperator* merge_operator = NewUInt64AddOperator();
+  registry->operators[name] = merge_operator;
+  return merge_operator;
+}
+
+}  // namespace dLSM
@@ -0,0 +1,48 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/perf_context_imp.h"
+
+#include <cstdio>
+#include <cstring>
+
+namespace dLSM {
+
+thread_local PerfContext perf_context;
+thread_local bool perf_context_enabled = false;
+
+PerfContext* GetPerfContext() { return &perf_context; }
+
+void PerfContext::Reset() { memset(this, 0, sizeof(*this)); }
+
+std::string PerfContext::ToString() const {
+  std::string result;
+  auto append = [&result](const char* name, uint64_t value) {
+    if (value == 0) {
+      return;
+    }
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%s%s = %llu", result.empty() ? "" : ", ",
+                  name, static_cast<unsigned long long>(value));
+    result.append(buf);
+  };
+  append("get_nanos", get_nanos);
+  append("memtable_nanos", memtable_nanos);
+  append("imm_searched", imm_searched);
+  append("imm_nanos", imm_nanos);
+  append("files_probed", files_probed);
+  append("files_nanos", files_nanos);
+  append("filter_checks", filter_checks);
+  append("filter_negatives", filter_negatives);
+  append("filter_nanos", filter_nanos);
+  append("index_searches", index_searches);
+  append("index_nanos", index_nanos);
+  append("rdma_reads", rdma_reads);
+  append("rdma_bytes", rdma_bytes);
+  append("rdma_wait_nanos", rdma_wait_nanos);
+  append("hedged_reads_won", hedged_reads_won);
+  return result;
+}
+
+}  // namespace dLSM
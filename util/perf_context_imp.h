@@ -0,0 +1,83 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_UTIL_PERF_CONTEXT_IMP_H_
+#define STORAGE_dLSM_UTIL_PERF_CONTEXT_IMP_H_
+
+#include <chrono>
+
+#include "dLSM/perf_context.h"
+
+namespace dLSM {
+
+extern thread_local PerfContext perf_context;
+// Whether the Get() of this thread records into perf_context, which costs a
+// clock read per phase. Off but for ReadOptions::perf_context.
+extern thread_local bool perf_context_enabled;
+
+// Turns the recording on for the Get() of the thread, if "enabled", for the
+// lifetime of the guard, and adds the time of the Get() to get_nanos.
+class PerfContextGuard {
+ public:
+  explicit PerfContextGuard(bool enabled) : enabled_(enabled) {
+    if (enabled_) {
+      perf_context.Reset();
+      perf_context_enabled = true;
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+  ~PerfContextGuard() {
+    if (enabled_) {
+      perf_context.get_nanos +=
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start_).count();
+      perf_context_enabled = false;
+    }
+  }
+
+  PerfContextGuard(const PerfContextGuard&) = delete;
+  PerfContextGuard& operator=(const PerfContextGuard&) = delete;
+
+ private:
+  const bool enabled_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Adds the time from its construction to its destruction to "*nanos", a
+// counter of perf_context, while the recording is on.
+class PerfTimer {
+ public:
+  explicit PerfTimer(uint64_t* nanos)
+      : nanos_(perf_context_enabled ? nanos : nullptr) {
+    if (nanos_ != nullptr) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+  ~PerfTimer() {
+    if (nanos_ != nullptr) {
+      *nanos_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start_).count();
+    }
+  }
+
+  PerfTimer(const PerfTimer&) = delete;
+  PerfTimer& operator=(const PerfTimer&) = delete;
+
+ private:
+  uint64_t* const nanos_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#define PERF_TIMER_GUARD(metric) \
+  PerfTimer perf_timer_##metric(&perf_context.metric)
+#define PERF_COUNTER_ADD(metric, value) \
+  do {                                  \
+    if (perf_context_enabled) {         \
+      perf_context.metric += (value);   \
+    }                                   \
+  } while (0)
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_PERF_CONTEXT_IMP_H_
@@ -0,0 +1,162 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "dLSM/rate_limiter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace dLSM {
+
+RateLimiter::~RateLimiter() = default;
+
+namespace {
+
+// The bucket is refilled, and the rate tuned, every period.
+static const int64_t kRefillPeriodMicros = 100000;
+// The tuned rate stays above the maximum rate divided by this.
+static const int64_t kMinRateDivisor = 16;
+
+class TokenBucketRateLimiter : public RateLimiter {
+ public:
+  TokenBucketRateLimiter(int64_t bytes_per_second,
+                         uint64_t foreground_latency_target_micros)
+      : max_bytes_per_second_(bytes_per_second),
+        latency_target_micros_(foreground_latency_target_micros),
+        bytes_per_second_(bytes_per_second),
+        foreground_latency_(0),
+        available_bytes_(RefillBytes(bytes_per_second)),
+        next_refill_micros_(NowMicros() + kRefillPeriodMicros),
+        waiting_high_(0) {
+    for (int i = 0; i < kNumPriorities; i++) {
+      total_bytes_[i].store(0);
+    }
+  }
+
+  void Request(int64_t bytes, Priority priority) override {
+    total_bytes_[priority].fetch_add(bytes, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lck(mutex_);
+    if (priority == kHigh) {
+      waiting_high_++;
+    }
+    while (true) {
+      Refill();
+      // A high priority request may borrow up to one period ahead, a low
+      // priority one waits for the bucket and for the high priority ones.
+      bool granted =
+          priority == kHigh
+              ? available_bytes_ > -RefillBytes(bytes_per_second_.load())
+              : available_bytes_ > 0 && waiting_high_ == 0;
+      if (granted) {
+        break;
+      }
+      cv_.wait_for(lck, std::chrono::microseconds(
+                            static_cast<int64_t>(next_refill_micros_) -
+                            static_cast<int64_t>(NowMicros())));
+    }
+    if (priority == kHigh) {
+      waiting_high_--;
+    }
+    // A request larger than the bucket leaves a debt the next ones repay.
+    available_bytes_ -= bytes;
+  }
+
+  void ReportForegroundLatency(uint64_t micros) override {
+    // Moving average with a weight of 1/8. Concurrent reports may overwrite
+    // each other, which only loses samples.
+    uint64_t average = foreground_latency_.load(std::memory_order_relaxed);
+    foreground_latency_.store(average - average / 8 + micros / 8,
+                              std::memory_order_relaxed);
+  }
+
+  int64_t GetBytesPerSecond() const override {
+    return bytes_per_second_.load(std::memory_order_relaxed);
+  }
+
+  void SetBytesPerSecond(int64_t bytes_per_second) override {
+    std::lock_guard<std::mutex> lck(mutex_);
+    max_bytes_per_second_.store(bytes_per_second);
+    bytes_per_second_.store(bytes_per_second);
+    cv_.notify_all();
+  }
+
+  int64_t GetTotalBytesThrough(Priority priority) const override {
+    return total_bytes_[priority].load(std::memory_order_relaxed);
+  }
+
+  uint64_t GetForegroundLatency() const override {
+    return foreground_latency_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static uint64_t NowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static int64_t RefillBytes(int64_t bytes_per_second) {
+    return std::max<int64_t>(
+        bytes_per_second * kRefillPeriodMicros / 1000000, 1);
+  }
+
+  // REQUIRES: mutex_ held.
+  void Refill() {
+    uint64_t now = NowMicros();
+    if (now < next_refill_micros_) {
+      return;
+    }
+    uint64_t periods = (now - next_refill_micros_) / kRefillPeriodMicros + 1;
+    next_refill_micros_ += periods * kRefillPeriodMicros;
+    Tune();
+    // The bytes left unused do not pile up beyond one period.
+    int64_t refill = RefillBytes(bytes_per_second_.load());
+    available_bytes_ = std::min(
+        available_bytes_ + static_cast<int64_t>(periods) * refill, refill);
+  }
+
+  // Halve the rate while the foreground latency is above the target, and
+  // increase it by steps of the minimum rate otherwise.
+  void Tune() {
+    if (latency_target_micros_ == 0) {
+      return;
+    }
+    const int64_t max_rate = max_bytes_per_second_.load();
+    const int64_t min_rate = std::max<int64_t>(max_rate / kMinRateDivisor, 1);
+    int64_t rate = bytes_per_second_.load();
+    if (foreground_latency_.load(std::memory_order_relaxed) >
+        latency_target_micros_) {
+      rate = std::max(rate / 2, min_rate);
+    } else {
+      rate = std::min(rate + min_rate, max_rate);
+    }
+    bytes_per_second_.store(rate);
+  }
+
+  std::atomic<int64_t> max_bytes_per_second_;
+  const uint64_t latency_target_micros_;
+  std::atomic<int64_t> bytes_per_second_;
+  std::atomic<uint64_t> foreground_latency_;
+  std::atomic<int64_t> total_bytes_[kNumPriorities];
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // The fields below are protected by mutex_.
+  int64_t available_bytes_;
+  uint64_t next_refill_micros_;
+  int waiting_high_;
+};
+
+}  // namespace
+
+RateLimiter* NewRateLimiter(int64_t bytes_per_second,
+                            uint64_t foreground_latency_target_micros) {
+  return new TokenBucketRateLimiter(bytes_per_second,
+                                    foreground_latency_target_micros);
+}
+
+}  // namespace dLSM
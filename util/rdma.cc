@@ -1,7 +1,18 @@
+#include <fcntl.h>
 #include <fstream>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <util/rdma.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#ifdef NUMA
+#include <numa.h>
+#endif
 
 #include "dLSM/env.h"
+#include "util/rdma_rpc.h"
 
 namespace dLSM {
 uint8_t RDMA_Manager::node_id = 1;
@@ -15,6 +26,64 @@ std::atomic<uint64_t> RDMA_Manager::RDMAMemoryAllocElapseSum = 0;
 std::atomic<uint64_t> RDMA_Manager::ReadCount1 = 0;
 #endif
 //#define R_SIZE 32
+// The remote memory is registered one region of this size at a time.
+static const size_t kRemoteRegionSize = 1024ull * 1024 * 1024;
+static const size_t kHugePage2MB = 2ull * 1024 * 1024;
+static const size_t kHugePage1GB = 1024ull * 1024 * 1024;
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+// The smallest size class of the chunks carved out of the remote slots.
+static const size_t kMinRemoteChunkSize = 64 * 1024;
+// The addresses in a batch of the garbage collection ring, and how long
+// released chunks may wait for a batch to fill up.
+static const size_t kGCBatchAddrs =
+    sizeof(GC_Ring_Slot::addrs) / sizeof(uint64_t);
+static const std::chrono::milliseconds kReclaimInterval(100);
+// How often the reclaimer reads the status the memory nodes publish in the
+// headers of the rings.
+static const std::chrono::milliseconds kStatusInterval(10);
+#if defined(__x86_64__)
+// The instruction writing back a cache line, the best the CPU has.
+enum Cache_Flush { kClflush, kClflushopt, kClwb };
+static Cache_Flush Detect_Cache_Flush() {
+  unsigned eax, ebx, ecx, edx;
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    if (ebx & (1u << 24)) {
+      return kClwb;
+    }
+    if (ebx & (1u << 23)) {
+      return kClflushopt;
+    }
+  }
+  return kClflush;
+}
+// Write back the cache lines of the "size" bytes at "addr" and wait for
+// them. clwb and clflushopt are spelled out in bytes, so that they build
+// without -mclwb.
+static void Flush_Cache_Lines(const void* addr, size_t size) {
+  static const Cache_Flush flush = Detect_Cache_Flush();
+  const uintptr_t end = reinterpret_cast<uintptr_t>(addr) + size;
+  for (uintptr_t line = reinterpret_cast<uintptr_t>(addr) &
+                        ~static_cast<uintptr_t>(CACHE_LINE_SIZE - 1);
+       line < end; line += CACHE_LINE_SIZE) {
+    char* p = reinterpret_cast<char*>(line);
+    if (flush == kClwb) {
+      asm volatile(".byte 0x66; xsaveopt %0" : "+m"(*p));
+    } else if (flush == kClflushopt) {
+      asm volatile(".byte 0x66; clflush %0" : "+m"(*p));
+    } else {
+      asm volatile("clflush %0" : "+m"(*p));
+    }
+  }
+  asm volatile("sfence" ::: "memory");
+}
+#endif
+// The share of the slots of a local pool in use over which
+// Resize_Local_Pools() registers a region ahead, and under which it gives
+// back the empty ones.
+static const int64_t kPoolGrowPercent = 90;
+static const int64_t kPoolShrinkPercent = 50;
 void UnrefHandle_rdma(void* ptr) { delete static_cast<std::string*>(ptr); }
 void UnrefHandle_qp(void* ptr) {
   if (ptr == nullptr) return;
@@ -26,17 +95,72 @@ void UnrefHandle_qp(void* ptr) {
 }
 void UnrefHandle_cq(void* ptr) {
   if (ptr == nullptr) return;
+  ibv_comp_channel* channel = static_cast<ibv_cq*>(ptr)->channel;
   if (ibv_destroy_cq(static_cast<ibv_cq*>(ptr))) {
     fprintf(stderr, "Thread local cq failed to destroy QP\n");
   } else {
     printf("thread local cq destroy successfully!");
+    if (channel != nullptr) ibv_destroy_comp_channel(channel);
   }
 }
+// The statistics stay with the manager for the threads to come.
+void Stats_Slot_UnrefHandle(void* ptr) {
+  if (ptr == nullptr) return;
+  static_cast<RDMA_Stats_Slot*>(ptr)->in_use = false;
+}
 void Destroy_mr(void* ptr) {
   if (ptr == nullptr) return;
   ibv_dereg_mr((ibv_mr*)ptr);
   delete (char*)((ibv_mr*)ptr)->addr;
 }
+// The FlushBuffer slots a thread keeps for its iterators, given back to the
+// pool when the thread exits.
+struct Iterator_Buffer_Cache {
+  RDMA_Manager* rdma_mg;
+  std::vector<ibv_mr> slots;
+};
+// Enough for the two buffers of the seq iterators over a few levels.
+static const size_t kMaxCachedIteratorBuffers = 16;
+void Destroy_iterator_buffers(void* ptr) {
+  if (ptr == nullptr) return;
+  auto* cache = reinterpret_cast<Iterator_Buffer_Cache*>(ptr);
+  for (ibv_mr& mr : cache->slots) {
+    cache->rdma_mg->Deallocate_Local_RDMA_Slot(mr.addr, FlushBuffer);
+  }
+  delete cache;
+}
+// The buffers of the hedged reads of a thread, see
+// RDMA_Manager::RDMA_Read_Hedged(). An abandoned read keeps its buffer until
+// it completes.
+struct Hedged_Read_State {
+  struct Abandoned {
+    uint8_t node_id;
+    std::unique_ptr<RDMA_Read_Future> future;
+    ibv_mr* buffer;
+  };
+  std::vector<ibv_mr*> free_buffers;
+  // Holds the data the last hedged read returned.
+  ibv_mr* result = nullptr;
+  std::vector<Abandoned> abandoned;
+};
+// Beyond this many abandoned reads, a thread waits for the oldest one
+// rather than registering one more buffer.
+static const size_t kMaxAbandonedReads = 8;
+void Destroy_hedged_reads(void* ptr) {
+  if (ptr == nullptr) return;
+  auto* state = reinterpret_cast<Hedged_Read_State*>(ptr);
+  for (Hedged_Read_State::Abandoned& read : state->abandoned) {
+    read.future->Wait();
+    Destroy_mr(read.buffer);
+  }
+  for (ibv_mr* buffer : state->free_buffers) {
+    Destroy_mr(buffer);
+  }
+  Destroy_mr(state->result);
+  delete state;
+}
+// Gives every RDMA_Manager an id for the thread local queue pair cache.
+static std::atomic<uint64_t> rdma_manager_instance_counter(1);
 template<typename T>
 void General_Destroy(void* ptr){
   delete (T) ptr;
@@ -56,6 +180,9 @@ RDMA_Manager::RDMA_Manager(config_t config, size_t remote_block_size)
     : total_registered_size(0),
       Table_Size(remote_block_size),
       read_buffer(new ThreadLocalPtr(&Destroy_mr)),
+      iterator_buffers(new ThreadLocalPtr(&Destroy_iterator_buffers)),
+      hedged_reads(new ThreadLocalPtr(&Destroy_hedged_reads)),
+      instance_id_(rdma_manager_instance_counter.fetch_add(1)),
 //      qp_local_write_flush(new ThreadLocalPtr(&UnrefHandle_qp)),
 //      cq_local_write_flush(new ThreadLocalPtr(&UnrefHandle_cq)),
 //      local_write_flush_qp_info(new ThreadLocalPtr(&General_Destroy<registered_qp_config*>)),
@@ -92,7 +219,14 @@ RDMA_Manager::RDMA_Manager(config_t config, size_t remote_block_size)
   Mempool_initialize(Message,
                      std::max(sizeof(RDMA_Request), sizeof(RDMA_Reply)), 32*std::max(sizeof(RDMA_Request), sizeof(RDMA_Reply)));
   Mempool_initialize(Version_edit, 1024 * 1024, 32*1024*1024);
-
+#ifdef DCTRANSPORT
+  qp_local_dci_ = new ThreadLocalPtr(&UnrefHandle_qp);
+  cq_local_dci_ = new ThreadLocalPtr(&UnrefHandle_cq);
+#endif
+  local_stats_slot_ = new ThreadLocalPtr(&Stats_Slot_UnrefHandle);
+  if (config.cxl_path != nullptr && config.cxl_path[0] != '\0') {
+    cxl_.reset(new CXL_Transport(config.cxl_path));
+  }
 }
 /******************************************************************************
 * Function: ~RDMA_Manager
@@ -106,6 +240,19 @@ RDMA_Manager::RDMA_Manager(config_t config, size_t remote_block_size)
 * Cleanup and deallocate all resources used for RDMA
 ******************************************************************************/
 RDMA_Manager::~RDMA_Manager() {
+  if (reclaim_thread.joinable()) {
+    {
+      std::unique_lock<std::mutex> lck(reclaim_mtx);
+      reclaim_shutdown = true;
+    }
+    reclaim_cv.notify_one();
+    reclaim_thread.join();
+  }
+  for (auto iter : Remote_Region_Indexes) {
+    if (iter.second->register_thread.joinable()) {
+      iter.second->register_thread.join();
+    }
+  }
   if (!res->qp_map.empty())
     for (auto it = res->qp_map.begin(); it != res->qp_map.end(); it++) {
       if (ibv_destroy_qp(it->second)) {
@@ -115,15 +262,27 @@ RDMA_Manager::~RDMA_Manager() {
   printf("RDMA Manager get destroyed\n");
   if (!local_mem_pool.empty()) {
     for (ibv_mr* p : local_mem_pool) {
-      ibv_dereg_mr(p);
-      //       local buffer is registered on this machine need deregistering.
-      delete (char*)p->addr;
+      if (implicit_mr != nullptr) {
+        delete p;
+      } else {
+        ibv_dereg_mr(p);
+      }
     }
     //    local_mem_pool.clear();
   }
+  if (implicit_mr != nullptr) {
+    ibv_dereg_mr(implicit_mr);
+  }
+  //       local buffer is registered on this machine need deregistering.
+  for (auto iter : mapped_buffers) {
+    munmap(iter.first, iter.second);
+  }
   for(auto iter : dealloc_mr){
-    ibv_dereg_mr(iter.second);
-    //The mr will be deleted in the end.
+    if (iter.second != nullptr) {
+      uint64_t* buff = static_cast<uint64_t*>(iter.second->addr);
+      ibv_dereg_mr(iter.second);
+      delete[] buff;
+    }
   }
   if (!remote_mem_pool.empty()) {
     for (auto p : remote_mem_pool) {
@@ -138,7 +297,9 @@ RDMA_Manager::~RDMA_Manager() {
       }else{
         delete it->second.first;
       }
-      if (it->second.second!= nullptr && ibv_destroy_cq(it->second.second)){
+      if (it->second.second == srq_cq_) {
+        // Shared by the main queue pairs, destroyed with srq_.
+      } else if (it->second.second!= nullptr && ibv_destroy_cq(it->second.second)){
         fprintf(stderr, "failed to destroy CQ\n");
       }else{
         delete it->second.second;
@@ -158,6 +319,47 @@ RDMA_Manager::~RDMA_Manager() {
       delete it->second;
     }
   }
+#ifdef DCTRANSPORT
+  delete qp_local_dci_;
+  delete cq_local_dci_;
+  for (auto& iter : dc_targets_) {
+    ibv_destroy_ah(iter.second.ah);
+  }
+#endif
+  if (dct_ != nullptr) {
+    ibv_destroy_qp(dct_);
+    ibv_destroy_srq(dct_srq_);
+    ibv_destroy_cq(dct_cq_);
+  }
+  delete local_stats_slot_;
+  for (auto slot : stats_slots_) {
+    delete slot;
+  }
+  for (auto& pool : qp_pool_) {
+    for (auto& iter : pool) {
+      for (auto& pooled : iter.second) {
+        UnrefHandle_qp(pooled.qp);
+        UnrefHandle_cq(pooled.cq);
+        delete pooled.remote_con_data;
+      }
+    }
+  }
+  for (auto& iter : shared_read_qp_map_) {
+    for (int i = 0; i < shared_read_qps_; i++) {
+      if (iter.second[i].qp != nullptr) {
+        UnrefHandle_qp(iter.second[i].qp);
+        UnrefHandle_cq(iter.second[i].cq);
+      }
+    }
+  }
+  if (srq_ != nullptr) {
+    if (ibv_destroy_srq(srq_)) {
+      fprintf(stderr, "failed to destroy SRQ\n");
+    }
+    if (ibv_destroy_cq(srq_cq_)) {
+      fprintf(stderr, "failed to destroy CQ\n");
+    }
+  }
   if (res->pd)
     if (ibv_dealloc_pd(res->pd)) {
       fprintf(stderr, "failed to deallocate PD\n");
@@ -184,6 +386,9 @@ RDMA_Manager::~RDMA_Manager() {
     }
     delete iter.second;
   }
+  for (auto iter : Remote_Region_Indexes) {
+    delete iter.second;
+  }
   delete res;
   for(auto iter :qp_local_write_flush ){
     delete iter.second;
@@ -209,33 +414,83 @@ RDMA_Manager::~RDMA_Manager() {
   for(auto iter :local_read_qp_info ){
     delete iter.second;
   }
-  for(auto iter : deallocation_buffers){
+  for(auto iter : dealloc_queues){
     delete iter.second;
   }
-  for(auto iter : dealloc_mtx){
-    delete iter.second;
+
+}
+bool RDMA_Manager::check_reply_buffer(const RDMA_Reply* rdma_reply) {
+  // The NIC writes the reply into coherent memory, no flush is needed. The
+  // acquire orders the reads of the content after the received byte, which
+  // the remote side writes last.
+  return __atomic_load_n(&rdma_reply->received, __ATOMIC_ACQUIRE);
+}
+void RDMA_Manager::Allocate_RPC_Slot(ibv_mr& mr, const char* tag) {
+  {
+    std::unique_lock<std::mutex> lck(rpc_slots_mtx);
+    if (!rpc_slots.empty()) {
+      mr = rpc_slots.back();
+      rpc_slots.pop_back();
+      return;
+    }
   }
-  for(auto iter : dealloc_cv){
-    delete iter.second;
+  Allocate_Local_RDMA_Slot(mr, Message, tag);
+}
+void RDMA_Manager::Deallocate_RPC_Slot(const ibv_mr& mr) {
+  // Enough for the calls in flight of all the threads, the rest go back to
+  // the pool.
+  static const size_t kMaxCachedSlots = 256;
+  {
+    std::unique_lock<std::mutex> lck(rpc_slots_mtx);
+    if (rpc_slots.size() < kMaxCachedSlots) {
+      rpc_slots.push_back(mr);
+      return;
+    }
   }
-
+  Deallocate_Local_RDMA_Slot(mr.addr, Message);
 }
-bool RDMA_Manager::poll_reply_buffer(RDMA_Reply* rdma_reply) {
-  volatile bool* check_byte = &(rdma_reply->received);
-//  size_t counter = 0;
-  while(!*check_byte){
-    _mm_clflush(check_byte);
-    asm volatile ("sfence\n" : : );
-    asm volatile ("lfence\n" : : );
-    asm volatile ("mfence\n" : : );
-    std::fprintf(stderr, "Polling reply buffer\r");
-    std::fflush(stderr);
-//    counter++;
-//    if (counter == 1000000){
-//      printf("Polling not get a result\n");
-//      return false;
-//    }
-
+int RDMA_Manager::post_send_batch(ibv_mr* const* mr_list, size_t num,
+                                  size_t size, uint8_t target_node_id) {
+  std::vector<ibv_sge> sge(num);
+  std::vector<ibv_send_wr> sr(num);
+  for (size_t i = 0; i < num; i++) {
+    sge[i] = {};
+    sge[i].addr = (uintptr_t)mr_list[i]->addr;
+    sge[i].length = size;
+    sge[i].lkey = mr_list[i]->lkey;
+    sr[i] = {};
+    sr[i].next = i + 1 < num ? &sr[i + 1] : nullptr;
+    sr[i].sg_list = &sge[i];
+    sr[i].num_sge = 1;
+    sr[i].opcode = IBV_WR_SEND;
+    sr[i].send_flags = (i + 1 < num ? 0 : IBV_SEND_SIGNALED) |
+                       Inline_Flag(size);
+  }
+  struct ibv_send_wr* bad_wr = nullptr;
+  int rc = ibv_post_send(Get_QP(QP_MAIN, target_node_id), sr.data(), &bad_wr);
+  if (rc == 0)
+    Count_Posted(QP_MAIN, target_node_id, num, num * size, 1);
+  else
+    Count_Completed(QP_MAIN, target_node_id, 0, 1);
+  return rc;
+}
+bool RDMA_Manager::poll_reply_buffer(RDMA_Reply* rdma_reply,
+                                     uint64_t timeout_micros) {
+  // About a few microseconds of pauses, the round trip of a small RPC.
+  static const int kSpinRounds = 4096;
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::microseconds(timeout_micros);
+  int rounds = 0;
+  while (!check_reply_buffer(rdma_reply)) {
+    if (rounds < kSpinRounds) {
+      rounds++;
+      port::AsmVolatilePause();
+      continue;
+    }
+    if (timeout_micros != 0 && std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    std::this_thread::yield();
   }
   return true;
 }
@@ -613,10 +868,11 @@ void RDMA_Manager::compute_message_handling_thread(std::string q_id, uint8_t sha
   assert(*imme_data == 0);
   uint32_t* byte_len = byte_len_map.at(shard_target_node_id);
   std::condition_variable* cv_imme = cv_imme_map.at(shard_target_node_id);
+  QP_Type qp_type = QP_Type_From_String(q_id);
   while (1) {
     // we can only use try_poll... rather than poll_com.. because we need to
     // make sure the shutting down signal can work.
-    if(try_poll_completions(wc, 1, q_id, false,
+    if(try_poll_completions(wc, 1, qp_type, false,
                                       shard_target_node_id) >0){
       if(wc[0].wc_flags & IBV_WC_WITH_IMM){
         wc[0].imm_data;// use this to find the correct condition variable.
@@ -656,20 +912,6 @@ void RDMA_Manager::compute_message_handling_thread(std::string q_id, uint8_t sha
                                             shard_target_node_id,
                                             "main");
 //        install_version_edit_handler(receive_msg_buf, q_id);
-#ifdef WITHPERSISTENCE
-      } else if(receive_msg_buf->command == persist_unpin_) {
-        //TODO: implement the persistent unpin dispatch machenism
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_counter], "main");
-        auto start = std::chrono::high_resolution_clock::now();
-        Arg_for_handler* argforhandler = new Arg_for_handler{.request=receive_msg_buf,.client_ip = "main"};
-        BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = argforhandler};
-        Unpin_bg_pool_.Schedule(&DBImpl::SSTable_Unpin_Dispatch, thread_pool_args);
-        auto stop = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-        printf("unpin for %lu files time elapse is %ld",
-               (receive_msg_buf->content.psu.buffer_size-1)/sizeof(uint64_t),
-               duration.count());
-#endif
       } else {
         printf("corrupt message from client.");
         break;
@@ -714,7 +956,9 @@ void RDMA_Manager::ConnectQPThroughSocket(std::string qp_type, int socket_fd,
     // cq1 send queue, cq2 receive queue
     ibv_cq* cq1 = ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
     ibv_cq* cq2;
-    if (seperated_cq)
+    if (srq_ != nullptr)
+      cq2 = srq_cq_;
+    else if (seperated_cq)
       cq2 = ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
 
     if (!cq1) {
@@ -736,8 +980,8 @@ void RDMA_Manager::ConnectQPThroughSocket(std::string qp_type, int socket_fd,
     qp_init_attr.cap.max_recv_wr = 2500;
     qp_init_attr.cap.max_send_sge = 30;
     qp_init_attr.cap.max_recv_sge = 30;
-    //  qp_init_attr.cap.max_inline_data = -1;
-    ibv_qp* qp = ibv_create_qp(res->pd, &qp_init_attr);
+    qp_init_attr.srq = srq_;
+    ibv_qp* qp = Create_QP(&qp_init_attr);
     if (!qp) {
       fprintf(stderr, "failed to create QP\n");
     }
@@ -747,6 +991,7 @@ void RDMA_Manager::ConnectQPThroughSocket(std::string qp_type, int socket_fd,
   local_con_data.qp_num = htonl(qp->qp_num);
   local_con_data.lid = htons(res->port_attr.lid);
   memcpy(local_con_data.gid, &res->my_gid, 16);
+  local_con_data.dct_num = htonl(dct_ != nullptr ? dct_->qp_num : 0);
   printf("checkpoint2");
 
   fprintf(stdout, "\nLocal LID = 0x%x\n", res->port_attr.lid);
@@ -765,6 +1010,10 @@ void RDMA_Manager::ConnectQPThroughSocket(std::string qp_type, int socket_fd,
   std::unique_lock<std::shared_mutex> l(qp_cq_map_mutex);
   res->qp_map[target_node_id] = qp;
   res->cq_map.insert({target_node_id, std::make_pair(cq1, cq2)});
+  qp_ports_[qp->qp_num] = 0;
+  if (srq_ != nullptr) {
+    srq_qp_nodes_[qp->qp_num] = target_node_id;
+  }
   assert(qp_type != "read_local");
   assert(qp_type != "write_local_compact");
   assert(qp_type != "write_local_flush");
@@ -784,6 +1033,148 @@ void RDMA_Manager::ConnectQPThroughSocket(std::string qp_type, int socket_fd,
     fprintf(stderr, "failed to connect QPs\n");
   }
 
+}
+bool RDMA_Manager::Create_Shared_Receive_Queue(int num_buffers) {
+  assert(srq_ == nullptr);
+  ibv_srq_init_attr srq_init_attr;
+  memset(&srq_init_attr, 0, sizeof(srq_init_attr));
+  srq_init_attr.attr.max_wr = num_buffers;
+  srq_init_attr.attr.max_sge = 1;
+  ibv_srq* srq = ibv_create_srq(res->pd, &srq_init_attr);
+  if (srq == nullptr) {
+    fprintf(stderr, "failed to create a shared receive queue of %d entries\n",
+            num_buffers);
+    return false;
+  }
+  ibv_cq* cq = ibv_create_cq(res->ib_ctx, num_buffers, NULL, NULL, 0);
+  if (cq == nullptr) {
+    fprintf(stderr, "failed to create CQ with %d entries\n", num_buffers);
+    ibv_destroy_srq(srq);
+    return false;
+  }
+  srq_ = srq;
+  srq_cq_ = cq;
+  srq_buffers_.resize(num_buffers);
+  for (auto& mr : srq_buffers_) {
+    Allocate_Local_RDMA_Slot(mr, Message);
+    if (Post_Shared_Receive(&mr)) {
+      fprintf(stderr, "failed to post a shared receive\n");
+    }
+  }
+  return true;
+}
+int RDMA_Manager::Poll_Shared_Receives(ibv_wc* wc_p, uint8_t* node_ids,
+                                       int num_entries) {
+  assert(srq_cq_ != nullptr);
+  int poll_result = ibv_poll_cq(srq_cq_, num_entries, wc_p);
+  if (poll_result <= 0) {
+    return poll_result;
+  }
+  std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
+  for (int i = 0; i < poll_result; i++) {
+#ifndef NDEBUG
+    if (wc_p[i].status != IBV_WC_SUCCESS) {
+      fprintf(stderr,
+              "number %d got bad completion with status: 0x%x, vendor syndrome: 0x%x\n",
+              i, wc_p[i].status, wc_p[i].vendor_err);
+      assert(false);
+    }
+#endif
+    node_ids[i] = srq_qp_nodes_.at(wc_p[i].qp_num);
+  }
+  return poll_result;
+}
+int RDMA_Manager::Post_Shared_Receive(ibv_mr* mr) {
+  struct ibv_recv_wr rr;
+  struct ibv_sge sge;
+  struct ibv_recv_wr* bad_wr;
+  memset(&sge, 0, sizeof(sge));
+  sge.addr = (uintptr_t)mr->addr;
+  sge.length = sizeof(RDMA_Request);
+  sge.lkey = mr->lkey;
+  memset(&rr, 0, sizeof(rr));
+  rr.next = NULL;
+  rr.wr_id = reinterpret_cast<uint64_t>(mr);
+  rr.sg_list = &sge;
+  rr.num_sge = 1;
+  return ibv_post_srq_recv(srq_, &rr, &bad_wr);
+}
+#ifdef DCTRANSPORT
+// The key the DC initiators present to the DC targets, only the ones of
+// this cluster reach them.
+static const uint64_t kDCAccessKey = 0x646c534d;
+#endif
+bool RDMA_Manager::Create_DC_Target() {
+#ifdef DCTRANSPORT
+  assert(dct_ == nullptr);
+  // Nothing is sent to the target, the queues only have to exist.
+  ibv_cq* cq = ibv_create_cq(res->ib_ctx, 16, NULL, NULL, 0);
+  ibv_srq_init_attr srq_init_attr;
+  memset(&srq_init_attr, 0, sizeof(srq_init_attr));
+  srq_init_attr.attr.max_wr = 1;
+  srq_init_attr.attr.max_sge = 1;
+  ibv_srq* srq = ibv_create_srq(res->pd, &srq_init_attr);
+  ibv_qp* qp = nullptr;
+  if (cq != nullptr && srq != nullptr) {
+    ibv_qp_init_attr_ex qp_init_attr;
+    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+    qp_init_attr.qp_type = IBV_QPT_DRIVER;
+    qp_init_attr.send_cq = cq;
+    qp_init_attr.recv_cq = cq;
+    qp_init_attr.srq = srq;
+    qp_init_attr.pd = res->pd;
+    qp_init_attr.comp_mask = IBV_QP_INIT_ATTR_PD;
+    mlx5dv_qp_init_attr dv_init_attr;
+    memset(&dv_init_attr, 0, sizeof(dv_init_attr));
+    dv_init_attr.comp_mask = MLX5DV_QP_INIT_ATTR_MASK_DC;
+    dv_init_attr.dc_init_attr.dc_type = MLX5DV_DCTYPE_DCT;
+    dv_init_attr.dc_init_attr.dct_access_key = kDCAccessKey;
+    qp = mlx5dv_create_qp(res->ib_ctx, &qp_init_attr, &dv_init_attr);
+  }
+  int rc = qp == nullptr;
+  if (!rc) {
+    ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = rdma_config.ib_port;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
+    rc = ibv_modify_qp(qp, &attr,
+                       IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT |
+                           IBV_QP_ACCESS_FLAGS);
+  }
+  if (!rc) {
+    ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = IBV_MTU_4096;
+    attr.min_rnr_timer = 0xc;
+    attr.ah_attr.port_num = rdma_config.ib_port;
+    if (rdma_config.gid_idx >= 0) {
+      attr.ah_attr.is_global = 1;
+      attr.ah_attr.grh.hop_limit = 0xFF;
+      attr.ah_attr.grh.sgid_index = rdma_config.gid_idx;
+    }
+    rc = ibv_modify_qp(qp, &attr,
+                       IBV_QP_STATE | IBV_QP_MIN_RNR_TIMER | IBV_QP_AV |
+                           IBV_QP_PATH_MTU);
+  }
+  if (rc) {
+    fprintf(stderr, "failed to create the DC target, read over RC\n");
+    if (qp != nullptr) ibv_destroy_qp(qp);
+    if (srq != nullptr) ibv_destroy_srq(srq);
+    if (cq != nullptr) ibv_destroy_cq(cq);
+    return false;
+  }
+  dct_ = qp;
+  dct_srq_ = srq;
+  dct_cq_ = cq;
+  fprintf(stdout, "DC target was created, DCT number=0x%x\n", qp->qp_num);
+  return true;
+#else
+  return false;
+#endif
 }
 //    Register the memory through ibv_reg_mr on the local side. this function will be called by both of the server side and client side.
 bool RDMA_Manager::Local_Memory_Register(char** p2buffpointer,
@@ -792,25 +1183,24 @@ bool RDMA_Manager::Local_Memory_Register(char** p2buffpointer,
   int mr_flags = 0;
   if (node_id%2 == 1 || pre_allocated_pool.empty()){
 
-    *p2buffpointer = new char[size];
+    *p2buffpointer = Allocate_Registered_Buffer(size);
     if (!*p2buffpointer) {
       fprintf(stderr, "failed to malloc bytes to memory buffer\n");
       return false;
     }
-    memset(*p2buffpointer, 0, size);
 
     /* register the memory buffer */
     mr_flags =
         IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-    //  auto start = std::chrono::high_resolution_clock::now();
-    *p2mrpointer = ibv_reg_mr(res->pd, *p2buffpointer, size, mr_flags);
-    //  auto stop = std::chrono::high_resolution_clock::now();
-    //  auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start); std::printf("Memory registeration size: %zu time elapse (%ld) us\n", size, duration.count());
-    local_mem_pool.push_back(*p2mrpointer);
-    fprintf(stdout,
-            "New MR was registered with addr=%p, lkey=0x%x, rkey=0x%x, flags=0x%x, size=%lu, total registered size is %lu\n",
-            (*p2mrpointer)->addr, (*p2mrpointer)->lkey, (*p2mrpointer)->rkey,
-            mr_flags, size, total_registered_size);
+    *p2mrpointer = Register_Buffer(*p2buffpointer, size);
+    if (*p2mrpointer) {
+      local_mem_pool.push_back(*p2mrpointer);
+      fprintf(stdout,
+              "New MR was registered with addr=%p, lkey=0x%x, rkey=0x%x, flags=0x%x, size=%lu, total registered size is %lu, registration time %lu ms\n",
+              (*p2mrpointer)->addr, (*p2mrpointer)->lkey, (*p2mrpointer)->rkey,
+              mr_flags, size, total_registered_size,
+              registration_micros / 1000);
+    }
   }else{
     *p2mrpointer = pre_allocated_pool.back();
     pre_allocated_pool.pop_back();
@@ -844,108 +1234,246 @@ bool RDMA_Manager::Local_Memory_Register(char** p2buffpointer,
 
   return true;
 };
-bool RDMA_Manager::Remote_Memory_Deallocation_Fetch_Buff(
-    uint64_t** ptr, size_t size, uint8_t target_node_id) {
-  std::unique_lock<std::mutex> lck(*dealloc_mtx.at(target_node_id));
-//  memcpy(deallocation_buffers + top * sizeof(uint64_t), ptr, size);
-  while(top.at(target_node_id) >= REMOTE_DEALLOC_BUFF_SIZE / sizeof(uint64_t) - 128){
-    dealloc_cv.at(target_node_id)->wait(lck);
-  }
-  *ptr = deallocation_buffers.at(target_node_id) + top.at(target_node_id);
-  top[target_node_id] += size;
-  if (top.at(target_node_id) >= REMOTE_DEALLOC_BUFF_SIZE / sizeof(uint64_t) - 128)
-    return true;
-  else
-    return false;
-
+void RDMA_Manager::Remote_Memory_Deallocate(const uint64_t* addrs, size_t num,
+                                            uint8_t target_node_id) {
+  Remote_Dealloc_Queue* queue = dealloc_queues.at(target_node_id);
+  bool full;
+  {
+    std::unique_lock<std::mutex> lck(reclaim_mtx);
+    queue->pending.insert(queue->pending.end(), addrs, addrs + num);
+    full = queue->pending.size() >= kGCBatchAddrs;
+  }
+  if (full) {
+    reclaim_cv.notify_one();
+  }
 }
-void RDMA_Manager::Memory_Deallocation_RPC(uint8_t target_node_id) {
-  RDMA_Request* send_pointer;
-  ibv_mr send_mr = {};
-//  ibv_mr send_mr_ve = {};
-
-  ibv_mr receive_mr = {};
-  Allocate_Local_RDMA_Slot(send_mr, Message);
-//  Allocate_Local_RDMA_Slot(send_mr_ve, "version_edit");
-  Allocate_Local_RDMA_Slot(receive_mr, Message);
-  send_pointer = (RDMA_Request*)send_mr.addr;
-  send_pointer->command = SSTable_gc;
-  send_pointer->content.gc.buffer_size = top.at(target_node_id) * sizeof(uint64_t);
-  send_pointer->buffer = receive_mr.addr;
-  send_pointer->rkey = receive_mr.rkey;
-  send_pointer->imm_num = 0;
-  RDMA_Reply* receive_pointer;
-  receive_pointer = (RDMA_Reply*)receive_mr.addr;
-  //Clear the reply buffer for the polling.
-  *receive_pointer = {};
-  asm volatile ("sfence\n" : : );
-  asm volatile ("lfence\n" : : );
-  asm volatile ("mfence\n" : : );
-  post_send<RDMA_Request>(&send_mr, target_node_id, std::string("main"));
-  ibv_wc wc[2] = {};
-  if (poll_completion(wc, 1, std::string("main"), true, target_node_id)){
-    fprintf(stderr, "failed to poll send for edit version edit sync\n");
+void RDMA_Manager::Pin_Thread_To_NIC_Node() {
+#ifdef NUMA
+  if (!rdma_config.pin_threads || nic_numa_node < 0 ||
+      numa_available() < 0) {
     return;
   }
-  asm volatile ("sfence\n" : : );
-  asm volatile ("lfence\n" : : );
-  asm volatile ("mfence\n" : : );
-  if(!poll_reply_buffer(receive_pointer)) // poll the receive for 2 entires
-  {
-    printf("Reply buffer is %p", receive_pointer->buffer);
-    printf("Received is %d", receive_pointer->received);
-    printf("receive structure size is %lu", sizeof(RDMA_Reply));
-    exit(0);
-  }
-  //  end = std::chrono::high_resolution_clock::now();
-  //  duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-  //  printf("Sync version edit time elapse: %ld us part 5 receive the reply\n", duration.count());
-
-  //Note: here multiple threads will RDMA_Write the "main" qp at the same time,
-  // which means the polling result may not belongs to this thread, but it does not
-  // matter in our case because we do not care when will the message arrive at the other side.
-  asm volatile ("sfence\n" : : );
-  asm volatile ("lfence\n" : : );
-  asm volatile ("mfence\n" : : );
-  RDMA_Write(receive_pointer->buffer_large, receive_pointer->rkey_large,
-             dealloc_mr.at(target_node_id), top.at(target_node_id) * sizeof(uint64_t), "main", IBV_SEND_SIGNALED, 1,
-             target_node_id);
-  //TODO: implement a wait function for the received bit. THe problem is when to
-  // reset the buffer to zero (we may need different buffer for the compaction reply)
-  // and how to make sure that the reply will wake up this waiting thread. The
-  // signal may comes befoer the thread go to sleep.
-  //
-  //  start = std::chrono::high_resolution_clock::now();
-  Deallocate_Local_RDMA_Slot(send_mr.addr,Message);
-  Deallocate_Local_RDMA_Slot(receive_mr.addr,Message);
-  // Notify all the other deallocation threads that the buffer has been cleared.
-  std::unique_lock<std::mutex> lck(*dealloc_mtx.at(target_node_id));
-  assert(top.find(target_node_id) != top.end());
-  top[target_node_id] = 0;
-  dealloc_cv.at(target_node_id)->notify_all();
+  if (numa_run_on_node(nic_numa_node) != 0) {
+    fprintf(stderr, "failed to pin a thread to NUMA node %d\n",
+            nic_numa_node);
+    return;
+  }
+  numa_set_preferred(nic_numa_node);
+#endif
+}
+void RDMA_Manager::Remote_Reclaimer_Loop() {
+  Pin_Thread_To_NIC_Node();
+  std::unique_lock<std::mutex> lck(reclaim_mtx);
+  auto last_flush = std::chrono::steady_clock::now();
+  while (true) {
+    reclaim_cv.wait_for(lck, kStatusInterval, [this] {
+      if (reclaim_shutdown) {
+        return true;
+      }
+      for (auto& iter : dealloc_queues) {
+        if (iter.second->pending.size() >= kGCBatchAddrs) {
+          return true;
+        }
+      }
+      return false;
+    });
+    bool shutting_down = reclaim_shutdown;
+    auto now = std::chrono::steady_clock::now();
+    // The queues without a full batch wait for kReclaimInterval.
+    bool flush_all = shutting_down || now - last_flush >= kReclaimInterval;
+    if (flush_all) {
+      last_flush = now;
+    }
+    if (flush_all && !shutting_down &&
+        pool_resizing_.load(std::memory_order_relaxed)) {
+      lck.unlock();
+      Resize_Local_Pools();
+      lck.lock();
+    }
+    if (flush_all && !shutting_down &&
+        remote_region_release_.load(std::memory_order_relaxed)) {
+      lck.unlock();
+      for (auto& node : memory_nodes) {
+        Release_Empty_Remote_Regions(node.first);
+      }
+      lck.lock();
+    }
+    for (auto& iter : dealloc_queues) {
+      Remote_Dealloc_Queue* queue = iter.second;
+      if (queue->pending.empty() ||
+          (!flush_all && queue->pending.size() < kGCBatchAddrs)) {
+        continue;
+      }
+      std::vector<uint64_t> addrs;
+      addrs.swap(queue->pending);
+      lck.unlock();
+      size_t shipped =
+          Ship_Dealloc_Batches(iter.first, queue, addrs, shutting_down);
+      lck.lock();
+      if (shipped < addrs.size()) {
+        if (shutting_down) {
+          fprintf(stderr, "%zu remote chunks of node %d are not reclaimed\n",
+                  addrs.size() - shipped, iter.first);
+        } else {
+          // Put them back in front of the ones released meanwhile.
+          queue->pending.insert(queue->pending.begin(), addrs.begin() + shipped,
+                                addrs.end());
+        }
+      }
+    }
+    if (shutting_down) {
+      return;
+    }
+    lck.unlock();
+    for (auto& iter : dealloc_queues) {
+      Remote_Dealloc_Queue* queue = iter.second;
+      // A ring which failed to be set up is asked for again at the next
+      // flush only.
+      if (!queue->ring_ready &&
+          (!flush_all || !Remote_GC_Ring_Setup(iter.first, queue))) {
+        continue;
+      }
+      Refresh_Memory_Node_Status(iter.first, queue);
+    }
+    lck.lock();
+  }
+}
+void RDMA_Manager::Refresh_Memory_Node_Status(uint8_t target_node_id,
+                                              Remote_Dealloc_Queue* queue) {
+  ibv_mr header = {};
+  header.addr = queue->ring_addr;
+  header.rkey = queue->ring_rkey;
+  ibv_mr read_mr = {};
+  Allocate_Local_RDMA_Slot(read_mr, Message);
+  if (RDMA_Read(&header, &read_mr, sizeof(uint64_t) + sizeof(Memory_Node_Status),
+                QP_READ_LOCAL, IBV_SEND_SIGNALED, 1, target_node_id) == 0) {
+    // Only the reclaimer writes "consumed", and it is not shipping now.
+    queue->consumed = *static_cast<volatile uint64_t*>(read_mr.addr);
+    Memory_Node_Status status;
+    memcpy(&status, static_cast<char*>(read_mr.addr) + sizeof(uint64_t),
+           sizeof(status));
+    std::unique_lock<std::mutex> lck(reclaim_mtx);
+    queue->status = status;
+    queue->status_time = std::chrono::steady_clock::now();
+    queue->status_ready = true;
+  }
+  Deallocate_Local_RDMA_Slot(read_mr.addr, Message);
+}
+bool RDMA_Manager::Get_Memory_Node_Status(uint8_t target_node_id,
+                                          uint64_t max_age_micros,
+                                          Memory_Node_Status* status) {
+  auto iter = dealloc_queues.find(target_node_id);
+  if (iter == dealloc_queues.end()) {
+    return false;
+  }
+  std::unique_lock<std::mutex> lck(reclaim_mtx);
+  Remote_Dealloc_Queue* queue = iter->second;
+  if (!queue->status_ready ||
+      std::chrono::steady_clock::now() - queue->status_time >
+          std::chrono::microseconds(max_age_micros)) {
+    return false;
+  }
+  *status = queue->status;
+  return true;
+}
+size_t RDMA_Manager::Ship_Dealloc_Batches(uint8_t target_node_id,
+                                          Remote_Dealloc_Queue* queue,
+                                          const std::vector<uint64_t>& addrs,
+                                          bool shutting_down) {
+  if (!queue->ring_ready && !Remote_GC_Ring_Setup(target_node_id, queue)) {
+    // Do not retry at once, the queue may hold a full batch.
+    if (!shutting_down) {
+      std::this_thread::sleep_for(kReclaimInterval);
+    }
+    return 0;
+  }
+  ibv_mr* local_mr = dealloc_mr.at(target_node_id);
+  auto* slot = static_cast<GC_Ring_Slot*>(local_mr->addr);
+  size_t shipped = 0;
+  while (shipped < addrs.size()) {
+    while (queue->written - queue->consumed >= GC_RING_SLOTS) {
+      // The ring looks full, read how far the memory node has got.
+      ibv_mr header = {};
+      header.addr = queue->ring_addr;
+      header.rkey = queue->ring_rkey;
+      ibv_mr read_mr = {};
+      Allocate_Local_RDMA_Slot(read_mr, Message);
+      RDMA_Read(&header, &read_mr, sizeof(uint64_t), QP_READ_LOCAL,
+                IBV_SEND_SIGNALED, 1, target_node_id);
+      queue->consumed = *static_cast<volatile uint64_t*>(read_mr.addr);
+      Deallocate_Local_RDMA_Slot(read_mr.addr, Message);
+      if (queue->written - queue->consumed < GC_RING_SLOTS) {
+        break;
+      }
+      if (shutting_down) {
+        return shipped;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    size_t num = std::min(addrs.size() - shipped, kGCBatchAddrs);
+    memcpy(slot->addrs, addrs.data() + shipped, num * sizeof(uint64_t));
+    slot->num = num;
+    slot->seq = queue->written + 1;
+    char* remote_slot = static_cast<char*>(queue->ring_addr) + GC_RING_HEADER +
+                        (queue->written % GC_RING_SLOTS) * sizeof(GC_Ring_Slot);
+    if (RDMA_Write(remote_slot, queue->ring_rkey, local_mr,
+                   sizeof(GC_Ring_Slot), QP_WRITE_LOCAL_COMPACT,
+                   IBV_SEND_SIGNALED, 1, target_node_id) != 0) {
+      return shipped;
+    }
+    queue->written++;
+    shipped += num;
+  }
+  return shipped;
+}
+bool RDMA_Manager::Remote_GC_Ring_Setup(uint8_t target_node_id,
+                                        Remote_Dealloc_Queue* queue) {
+  RPC_Call call(this, target_node_id, SSTable_gc);
+  call.request()->content.gc.buffer_size = GC_RING_SIZE;
+  if (!call.Send()) {
+    fprintf(stderr, "failed to poll send for garbage collection ring\n");
+    return false;
+  }
+  if (!call.Wait(RPC_REPLY_TIMEOUT_MICROS)) {
+    fprintf(stderr, "no reply for the garbage collection ring\n");
+    return false;
+  }
+  queue->ring_addr = call.reply().content.mr.addr;
+  queue->ring_rkey = call.reply().content.mr.rkey;
+  queue->ring_ready = queue->ring_addr != nullptr;
+  return queue->ring_ready;
 }
 bool RDMA_Manager::Preregister_Memory(int gb_number) {
-  int mr_flags = 0;
+  int mr_flags =
+      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
   size_t size = 1024*1024*1024;
   if (node_id == 2){
     void* dummy = malloc(size*2);
   }
+  const uint64_t start_micros = registration_micros;
+  // The regions come from the persistent memory file in the same order on
+  // every run.
+  char* pmem = nullptr;
+  if (node_id % 2 == 0 && pmem_base_ == nullptr &&
+      rdma_config.pmem_path != nullptr && rdma_config.pmem_path[0] != '\0') {
+    pmem = Map_Persistent_Memory(size * gb_number);
+    if (pmem != nullptr) {
+      gb_number = static_cast<int>(pmem_size_ / size);
+    }
+  }
   for (int i = 0; i < gb_number; ++i) {
     total_registered_size = total_registered_size + size;
     std::fprintf(stderr, "Pre allocate registered memory %d GB %30s\r", i, "");
     std::fflush(stderr);
-    char* buff_pointer = new char[size];
+    char* buff_pointer =
+        pmem != nullptr ? pmem + i * size : Allocate_Registered_Buffer(size);
     if (!buff_pointer) {
       fprintf(stderr, "failed to malloc bytes to memory buffer\n");
       return false;
     }
-    memset(buff_pointer, 0, size);
 
     /* register the memory buffer */
-    mr_flags =
-        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-    //  auto start = std::chrono::high_resolution_clock::now();
-    ibv_mr* mrpointer = ibv_reg_mr(res->pd, buff_pointer, size, mr_flags);
+    ibv_mr* mrpointer = Register_Buffer(buff_pointer, size);
     if (!mrpointer) {
       fprintf(
           stderr,
@@ -956,8 +1484,252 @@ bool RDMA_Manager::Preregister_Memory(int gb_number) {
     local_mem_pool.push_back(mrpointer);
     pre_allocated_pool.push_back(mrpointer);
   }
+  fprintf(stdout,
+          "Pre registered %d GB on %zu KB pages, NIC on NUMA node %d, "
+          "registration time %lu ms\n",
+          gb_number, rdma_config.huge_page_size == 0
+                         ? static_cast<size_t>(sysconf(_SC_PAGESIZE)) / 1024
+                         : rdma_config.huge_page_size / 1024,
+          nic_numa_node, (registration_micros - start_micros) / 1000);
+  return true;
+}
+char* RDMA_Manager::Allocate_Registered_Buffer(size_t size) {
+  // The NIC caches the translations of the registered pages, hugepages
+  // keep far fewer of them. A buffer smaller than a hugepage would waste
+  // most of it. A page size which cannot be mapped, as none is reserved or
+  // they ran out, is not tried again.
+  if (cxl_ != nullptr && node_id % 2 == 0) {
+    // The compute nodes load and store the memory of the pool directly.
+    char* segment = cxl_->Map_Segment(node_id, size);
+    if (segment != nullptr) {
+      mapped_buffers.insert({segment, size});
+      return segment;
+    }
+  }
+  void* buff = MAP_FAILED;
+  size_t length = size;
+  while (rdma_config.huge_page_size >= kHugePage2MB &&
+         size >= rdma_config.huge_page_size) {
+    size_t page_size = rdma_config.huge_page_size;
+    length = (size + page_size - 1) / page_size * page_size;
+    int page_flag = (page_size >= kHugePage1GB ? 30 : 21) << MAP_HUGE_SHIFT;
+    buff = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | page_flag, -1, 0);
+    if (buff != MAP_FAILED) {
+      break;
+    }
+    rdma_config.huge_page_size = page_size >= kHugePage1GB ? kHugePage2MB : 0;
+    fprintf(stderr, "No %zu KB hugepages left, fall back to %zu KB pages\n",
+            page_size / 1024,
+            rdma_config.huge_page_size == 0
+                ? static_cast<size_t>(sysconf(_SC_PAGESIZE)) / 1024
+                : rdma_config.huge_page_size / 1024);
+  }
+  if (buff == MAP_FAILED) {
+    length = size;
+    buff = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buff == MAP_FAILED) {
+      return nullptr;
+    }
+  }
+#ifdef NUMA
+  // The pages are placed when ibv_reg_mr faults them in.
+  if (nic_numa_node >= 0 && numa_available() >= 0) {
+    numa_tonode_memory(buff, length, nic_numa_node);
+  }
+#endif
+  mapped_buffers.insert({buff, length});
+  return static_cast<char*>(buff);
+}
+char* RDMA_Manager::Map_Persistent_Memory(size_t size) {
+  const std::string path = std::string(rdma_config.pmem_path) +
+                           "/dlsm_pmem_" + std::to_string(node_id);
+  int fd = open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror("persistent memory open");
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("persistent memory stat");
+    close(fd);
+    return nullptr;
+  }
+  const size_t length =
+      std::max(size, static_cast<size_t>(st.st_size) / kRemoteRegionSize *
+                         kRemoteRegionSize);
+  // Allocate the blocks up front, a store to a hole of a full file system
+  // would raise SIGBUS.
+  int error = posix_fallocate(fd, 0, static_cast<off_t>(length));
+  if (error != 0) {
+    fprintf(stderr, "persistent memory allocate: %s\n", strerror(error));
+    close(fd);
+    return nullptr;
+  }
+  void* base = MAP_FAILED;
+#if defined(__x86_64__) && defined(MAP_SYNC) && defined(MAP_SHARED_VALIDATE)
+  base = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+              MAP_SHARED_VALIDATE | MAP_SYNC, fd, 0);
+  pmem_sync_ = base != MAP_FAILED;
+#endif
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "%s is not on a DAX file system, persist with msync\n",
+            path.c_str());
+    base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror("persistent memory map");
+    return nullptr;
+  }
+  mapped_buffers.insert({base, length});
+  pmem_base_ = static_cast<char*>(base);
+  pmem_size_ = length;
+  return pmem_base_;
+}
+bool RDMA_Manager::Persistent_Offset(const void* addr, size_t size,
+                                     uint64_t* offset) const {
+  const char* p = static_cast<const char*>(addr);
+  if (pmem_base_ == nullptr || p < pmem_base_ ||
+      p + size > pmem_base_ + pmem_size_) {
+    return false;
+  }
+  *offset = p - pmem_base_;
+  return true;
+}
+bool RDMA_Manager::Persist_Range(const void* addr, size_t size) {
+#if defined(__x86_64__)
+  if (pmem_sync_) {
+    Flush_Cache_Lines(addr, size);
+    return true;
+  }
+#endif
+  const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  const uintptr_t start = reinterpret_cast<uintptr_t>(addr) & ~(page - 1);
+  const uintptr_t end = reinterpret_cast<uintptr_t>(addr) + size;
+  return msync(reinterpret_cast<void*>(start), end - start, MS_SYNC) == 0;
+}
+bool RDMA_Manager::Adopt_Persistent_Chunks(
+    const std::vector<std::pair<uint64_t, uint32_t>>& extents,
+    std::vector<ibv_mr*>* chunks) {
+  const size_t chunk_size = name_to_chunksize.at(FlushBuffer);
+  // The slots under the extents, by region.
+  std::map<ibv_mr*, std::vector<bool>> taken;
+  std::unique_lock<std::shared_mutex> lck(local_mem_mutex);
+  chunks->clear();
+  for (const auto& extent : extents) {
+    char* addr = nullptr;
+    auto region = pre_allocated_pool.end();
+    if (pmem_base_ != nullptr && extent.first + extent.second <= pmem_size_) {
+      addr = pmem_base_ + extent.first;
+      region = std::find_if(
+          pre_allocated_pool.begin(), pre_allocated_pool.end(),
+          [&](ibv_mr* mr) {
+            char* begin = static_cast<char*>(mr->addr);
+            return addr >= begin && addr + extent.second <= begin + mr->length;
+          });
+    }
+    if (region == pre_allocated_pool.end()) {
+      for (ibv_mr* mr : *chunks) {
+        delete mr;
+      }
+      chunks->clear();
+      return false;
+    }
+    std::vector<bool>& slots = taken[*region];
+    slots.resize((*region)->length / chunk_size);
+    const size_t offset = addr - static_cast<char*>((*region)->addr);
+    const size_t last = offset + std::max<size_t>(extent.second, 1) - 1;
+    for (size_t i = offset / chunk_size; i <= last / chunk_size; i++) {
+      slots[i] = true;
+    }
+    auto* mr = new ibv_mr(**region);
+    mr->addr = addr;
+    mr->length = extent.second;
+    chunks->push_back(mr);
+  }
+  for (auto& region : taken) {
+    pre_allocated_pool.erase(std::find(pre_allocated_pool.begin(),
+                                       pre_allocated_pool.end(), region.first));
+    name_to_mem_pool.at(FlushBuffer)
+        .insert({region.first->addr,
+                 new In_Use_Array(region.second.size(), chunk_size,
+                                  region.first, region.second)});
+    total_registered_size = total_registered_size + region.first->length;
+  }
+  lck.unlock();
+  for (auto& region : taken) {
+    for (size_t i = 0; i < region.second.size(); i++) {
+      if (region.second[i]) {
+        Account_Local_Slot(
+            static_cast<char*>(region.first->addr) + i * chunk_size,
+            FlushBuffer, "recovered");
+      }
+    }
+  }
   return true;
 }
+ibv_mr* RDMA_Manager::Register_Buffer(char* buff, size_t size) {
+  int mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                 IBV_ACCESS_REMOTE_WRITE | odp_access;
+  auto start = std::chrono::high_resolution_clock::now();
+  ibv_mr* mr;
+  if (implicit_mr != nullptr) {
+    mr = new ibv_mr(*implicit_mr);
+    mr->addr = buff;
+    mr->length = size;
+  } else {
+    mr = ibv_reg_mr(res->pd, buff, size, mr_flags);
+  }
+  if (mr != nullptr && odp_access != 0) {
+    // Let the NIC map the pages in the background, so that the first
+    // accesses do not all take a page fault. The advice is best effort.
+    for (size_t offset = 0; offset < size; offset += kHugePage1GB) {
+      ibv_sge sge;
+      sge.addr = reinterpret_cast<uint64_t>(buff) + offset;
+      sge.length =
+          static_cast<uint32_t>(std::min(size - offset, kHugePage1GB));
+      sge.lkey = mr->lkey;
+      ibv_advise_mr(res->pd, IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE, 0, &sge, 1);
+    }
+  }
+  auto stop = std::chrono::high_resolution_clock::now();
+  registration_micros +=
+      std::chrono::duration_cast<std::chrono::microseconds>(stop - start)
+          .count();
+  return mr;
+}
+void RDMA_Manager::Setup_On_Demand_Paging() {
+  if (!rdma_config.on_demand_paging) {
+    return;
+  }
+  ibv_device_attr_ex attr = {};
+  if (ibv_query_device_ex(res->ib_ctx, nullptr, &attr)) {
+    fprintf(stderr, "ibv_query_device_ex failed, pin the registered memory\n");
+    return;
+  }
+  // The message buffers are sent and received on, the others read and
+  // written.
+  const uint32_t rc_caps = IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_RECV |
+                           IBV_ODP_SUPPORT_WRITE | IBV_ODP_SUPPORT_READ;
+  if (!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT) ||
+      (attr.odp_caps.per_transport_caps.rc_odp_caps & rc_caps) != rc_caps) {
+    fprintf(stdout, "No on-demand paging for RC, pin the registered memory\n");
+    return;
+  }
+  odp_access = IBV_ACCESS_ON_DEMAND;
+  if (attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT) {
+    implicit_mr = ibv_reg_mr(res->pd, nullptr, SIZE_MAX,
+                             IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                                 IBV_ACCESS_REMOTE_WRITE | odp_access);
+    if (implicit_mr == nullptr) {
+      fprintf(stderr, "implicit MR registration failed\n");
+    }
+  }
+  fprintf(stdout, "On-demand paging with %s\n",
+          implicit_mr != nullptr ? "an implicit MR" : "an MR per region");
+}
 
 /******************************************************************************
 * Function: set_up_RDMA
@@ -1036,9 +1808,24 @@ void RDMA_Manager::Client_Set_Up_Resources() {
     threads.back().detach();
   }
   while (connection_counter.load() != memory_nodes.size());
+  if (rdma_config.qp_pool_size > 0) {
+    // Off the path of the first reads of every thread.
+    std::vector<std::thread> fillers;
+    for (auto& iter : memory_nodes) {
+#ifdef DCTRANSPORT
+      if (dc_targets_.count(iter.first) != 0) continue;
+#endif
+      fillers.emplace_back(&RDMA_Manager::Fill_QP_Pool, this, QP_READ_LOCAL,
+                           iter.first, rdma_config.qp_pool_size);
+    }
+    for (auto& filler : fillers) {
+      filler.join();
+    }
+  }
 //  for (auto & thread : threads) {
 //    thread.join();
 //  }
+  reclaim_thread = std::thread(&RDMA_Manager::Remote_Reclaimer_Loop, this);
 }
 void RDMA_Manager::Initialize_threadlocal_map(){
   uint8_t target_node_id;
@@ -1054,11 +1841,9 @@ void RDMA_Manager::Initialize_threadlocal_map(){
     cq_local_read.insert({target_node_id, new ThreadLocalPtr(&UnrefHandle_cq)});
     local_read_qp_info.insert({target_node_id, new ThreadLocalPtr(&General_Destroy<registered_qp_config*>)});
     Remote_Mem_Bitmap.insert({target_node_id, new std::map<void*, In_Use_Array*>()});
-    deallocation_buffers.insert({target_node_id, new uint64_t[REMOTE_DEALLOC_BUFF_SIZE / sizeof(uint64_t)]});
-    dealloc_mtx.insert({target_node_id, new std::mutex});
-    dealloc_cv.insert({target_node_id, new std::condition_variable});
+    Remote_Region_Indexes.insert({target_node_id, new Remote_Region_Index()});
+    dealloc_queues.insert({target_node_id, new Remote_Dealloc_Queue()});
     dealloc_mr.insert({target_node_id, nullptr});
-    top.insert({target_node_id,0});
     mtx_imme_map.insert({target_node_id, new std::mutex});
     imm_gen_map.insert({target_node_id, new std::atomic<uint32_t>{0}});
     imme_data_map.insert({target_node_id, new  uint32_t{0}});
@@ -1125,6 +1910,13 @@ int RDMA_Manager::resources_create() {
   if (!ib_dev) {
     fprintf(stderr, "IB device %s wasn't found\n", rdma_config.dev_name);
     rc = 1;
+  } else {
+    // The registered memory is placed on the NUMA node of the NIC.
+    std::ifstream numa_file(std::string(ib_dev->ibdev_path) +
+                            "/device/numa_node");
+    if (!(numa_file >> nic_numa_node)) {
+      nic_numa_node = -1;
+    }
   }
   /* get device handle */
   res->ib_ctx = ibv_open_device(ib_dev);
@@ -1141,11 +1933,30 @@ int RDMA_Manager::resources_create() {
     fprintf(stderr, "ibv_query_port on port %u failed\n", rdma_config.ib_port);
     rc = 1;
   }
+  int num_ports = std::min(std::max(rdma_config.num_ports, 1), RDMA_MAX_PORTS);
+  for (int i = 0; i < num_ports && rc == 0; i++) {
+    int port = rdma_config.ib_port + i;
+    ibv_port_attr port_attr;
+    ibv_gid port_gid;
+    memset(&port_gid, 0, sizeof(port_gid));
+    if (ibv_query_port(res->ib_ctx, port, &port_attr) ||
+        port_attr.state != IBV_PORT_ACTIVE ||
+        (rdma_config.gid_idx >= 0 &&
+         ibv_query_gid(res->ib_ctx, port, rdma_config.gid_idx, &port_gid))) {
+      // Striped over the ports before it.
+      fprintf(stderr, "port %d is not usable, use %d ports\n", port, i);
+      break;
+    }
+    res->port_attrs.push_back(port_attr);
+    res->port_gids.push_back(port_gid);
+  }
   /* allocate Protection Domain */
   res->pd = ibv_alloc_pd(res->ib_ctx);
   if (!res->pd) {
     fprintf(stderr, "ibv_alloc_pd failed\n");
     rc = 1;
+  } else {
+    Setup_On_Demand_Paging();
   }
 
   /* computing node allocate local buffers */
@@ -1173,8 +1984,9 @@ int RDMA_Manager::resources_create() {
       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
   //  auto start = std::chrono::high_resolution_clock::now();
   // Register the deallocation buffers.
-  for(auto iter : deallocation_buffers){
-    dealloc_mr[iter.first] = ibv_reg_mr(res->pd, iter.second,
+  for(auto iter : dealloc_queues){
+    dealloc_mr[iter.first] = ibv_reg_mr(res->pd,
+                            new uint64_t[REMOTE_DEALLOC_BUFF_SIZE / sizeof(uint64_t)],
                             REMOTE_DEALLOC_BUFF_SIZE, mr_flags);
     if (dealloc_mr[iter.first] == nullptr){
       fprintf(stdout, "dealloc_mr registration failed\n");
@@ -1225,6 +2037,7 @@ bool RDMA_Manager::Get_Remote_qp_Info_Then_Connect(uint8_t target_node_id) {
   local_con_data.lid = htons(res->port_attr.lid);
   memcpy(local_con_data.gid, &my_gid, 16);
   local_con_data.node_id = node_id;
+  local_con_data.dct_num = 0;
   fprintf(stdout, "\nLocal LID = 0x%x\n", res->port_attr.lid);
   if (sock_sync_data(res->sock_map[target_node_id], sizeof(struct registered_qp_config),
                      (char*)&local_con_data, (char*)&tmp_con_data) < 0) {
@@ -1234,10 +2047,32 @@ bool RDMA_Manager::Get_Remote_qp_Info_Then_Connect(uint8_t target_node_id) {
   remote_con_data->qp_num = ntohl(tmp_con_data.qp_num);
   remote_con_data->lid = ntohs(tmp_con_data.lid);
   memcpy(remote_con_data->gid, tmp_con_data.gid, 16);
+  remote_con_data->dct_num = ntohl(tmp_con_data.dct_num);
 
   fprintf(stdout, "Remote QP number = 0x%x\n", remote_con_data->qp_num);
   fprintf(stdout, "Remote LID = 0x%x\n", remote_con_data->lid);
   std::unique_lock<std::shared_mutex> l(qp_cq_map_mutex);
+#ifdef DCTRANSPORT
+  if (remote_con_data->dct_num != 0) {
+    ibv_ah_attr ah_attr;
+    memset(&ah_attr, 0, sizeof(ah_attr));
+    ah_attr.dlid = remote_con_data->lid;
+    ah_attr.port_num = rdma_config.ib_port;
+    if (rdma_config.gid_idx >= 0) {
+      ah_attr.is_global = 1;
+      memcpy(&ah_attr.grh.dgid, remote_con_data->gid, 16);
+      ah_attr.grh.hop_limit = 0xFF;
+      ah_attr.grh.sgid_index = rdma_config.gid_idx;
+    }
+    ibv_ah* ah = ibv_create_ah(res->pd, &ah_attr);
+    if (ah == nullptr) {
+      fprintf(stderr, "failed to create AH to node %d, read over RC\n",
+              target_node_id);
+    } else {
+      dc_targets_[target_node_id] = {ah, remote_con_data->dct_num};
+    }
+  }
+#endif
   if (qp_type == "read_local" ){
     assert(local_read_qp_info.at(target_node_id) != nullptr);
     local_read_qp_info.at(target_node_id)->Reset(remote_con_data);
@@ -1307,6 +2142,27 @@ ibv_mr* RDMA_Manager::Get_local_read_mr() {
   }
   return ret;
 }
+void RDMA_Manager::Allocate_Iterator_Buffer(ibv_mr& mr, const char* tag) {
+  auto* cache = reinterpret_cast<Iterator_Buffer_Cache*>(iterator_buffers->Get());
+  if (cache != nullptr && !cache->slots.empty()) {
+    mr = cache->slots.back();
+    cache->slots.pop_back();
+    return;
+  }
+  Allocate_Local_RDMA_Slot(mr, FlushBuffer, tag);
+}
+void RDMA_Manager::Release_Iterator_Buffer(const ibv_mr& mr) {
+  auto* cache = reinterpret_cast<Iterator_Buffer_Cache*>(iterator_buffers->Get());
+  if (cache == nullptr) {
+    cache = new Iterator_Buffer_Cache{this, {}};
+    iterator_buffers->Reset(cache);
+  }
+  if (cache->slots.size() < kMaxCachedIteratorBuffers) {
+    cache->slots.push_back(mr);
+  } else {
+    Deallocate_Local_RDMA_Slot(mr.addr, FlushBuffer);
+  }
+}
 void RDMA_Manager::sync_with_computes_Mside() {
   char buffer[100];
   int number_of_ready = 0;
@@ -1380,13 +2236,13 @@ ibv_qp* RDMA_Manager::create_qp_Mside(bool seperated_cq,
   qp_init_attr.cap.max_recv_wr = 2500;
   qp_init_attr.cap.max_send_sge = 30;
   qp_init_attr.cap.max_recv_sge = 30;
-  //  qp_init_attr.cap.max_inline_data = -1;
-  ibv_qp* qp = ibv_create_qp(res->pd, &qp_init_attr);
+  ibv_qp* qp = Create_QP(&qp_init_attr);
   if (!qp) {
     fprintf(stderr, "failed to create QP\n");
   }
 
     qp_map_Mside[qp_id] = qp;
+  qp_ports_[qp->qp_num] = next_port_.fetch_add(1) % Num_Ports();
   fprintf(stdout, "QP was created, QP number=0x%x\n", qp->qp_num);
   //  uint8_t* p = qp->gid;
   //  fprintf(stdout,
@@ -1395,6 +2251,534 @@ ibv_qp* RDMA_Manager::create_qp_Mside(bool seperated_cq,
   //          p[11], p[12], p[13], p[14], p[15]);
   return qp;
 }
+const char* QP_Type_Name(QP_Type qp_type) {
+  switch (qp_type) {
+    case QP_READ_LOCAL:
+      return "read_local";
+    case QP_WRITE_LOCAL_FLUSH:
+      return "write_local_flush";
+    case QP_WRITE_LOCAL_COMPACT:
+      return "write_local_compact";
+    default:
+      return "main";
+  }
+}
+QP_Type QP_Type_From_String(const std::string& qp_type) {
+  if (qp_type == "read_local") return QP_READ_LOCAL;
+  if (qp_type == "write_local_flush") return QP_WRITE_LOCAL_FLUSH;
+  if (qp_type == "write_local_compact") return QP_WRITE_LOCAL_COMPACT;
+  return QP_MAIN;
+}
+namespace {
+// The thread local queue pairs and completion queues of one RDMA_Manager,
+// indexed by (queue pair type, node id). It caches the ThreadLocalPtr maps
+// so that posting a request does not go through a map lookup. The entries
+// only change in create_qp, which is called by the owning thread itself.
+struct Local_QP_Cache {
+  uint64_t owner_id;
+  ibv_qp* qp[QP_TYPE_NUM][256];
+  ibv_cq* cq[QP_TYPE_NUM][256];
+  // The lock of a queue pair shared by the threads, nullptr for the ones of
+  // this thread.
+  std::mutex* mtx[QP_TYPE_NUM][256];
+  // The DC target the "read_local" queue pair, then the DC initiator of the
+  // thread, reads from, nullptr for a queue pair connected to the node.
+  ibv_ah* dc_ah[256];
+  uint32_t dct_num[256];
+  // The port index of the queue pair in qp.
+  uint8_t port[QP_TYPE_NUM][256];
+  // The port index the queue pairs of this thread are created on, plus one,
+  // 0 until it is chosen.
+  int local_port;
+};
+thread_local Local_QP_Cache local_qp_cache;
+}  // namespace
+static inline Local_QP_Cache* Get_Local_QP_Cache(uint64_t owner_id) {
+  // Another RDMA_Manager has been used by this thread, start over.
+  if (local_qp_cache.owner_id != owner_id) {
+    memset(&local_qp_cache, 0, sizeof(Local_QP_Cache));
+    local_qp_cache.owner_id = owner_id;
+  }
+  return &local_qp_cache;
+}
+ThreadLocalPtr* RDMA_Manager::Local_QP_Ptr(QP_Type qp_type,
+                                           uint8_t target_node_id) {
+  switch (qp_type) {
+    case QP_READ_LOCAL:
+      return qp_local_read.at(target_node_id);
+    case QP_WRITE_LOCAL_FLUSH:
+      return qp_local_write_flush.at(target_node_id);
+    case QP_WRITE_LOCAL_COMPACT:
+      return qp_local_write_compact.at(target_node_id);
+    default:
+      assert(false);
+      return nullptr;
+  }
+}
+ThreadLocalPtr* RDMA_Manager::Local_CQ_Ptr(QP_Type qp_type,
+                                           uint8_t target_node_id) {
+  switch (qp_type) {
+    case QP_READ_LOCAL:
+      return cq_local_read.at(target_node_id);
+    case QP_WRITE_LOCAL_FLUSH:
+      return cq_local_write_flush.at(target_node_id);
+    case QP_WRITE_LOCAL_COMPACT:
+      return cq_local_write_compact.at(target_node_id);
+    default:
+      assert(false);
+      return nullptr;
+  }
+}
+ThreadLocalPtr* RDMA_Manager::Local_QP_Info_Ptr(QP_Type qp_type,
+                                                uint8_t target_node_id) {
+  switch (qp_type) {
+    case QP_READ_LOCAL:
+      return local_read_qp_info.at(target_node_id);
+    case QP_WRITE_LOCAL_FLUSH:
+      return local_write_flush_qp_info.at(target_node_id);
+    case QP_WRITE_LOCAL_COMPACT:
+      return local_write_compact_qp_info.at(target_node_id);
+    default:
+      assert(false);
+      return nullptr;
+  }
+}
+void RDMA_Manager::Connect_Local_QP(QP_Type qp_type, uint8_t target_node_id) {
+  Pooled_QP pooled = {nullptr, nullptr, nullptr};
+  std::unique_lock<std::mutex> lck(qp_pool_mtx_);
+  auto iter = qp_pool_[qp_type].find(target_node_id);
+  if (iter != qp_pool_[qp_type].end() && !iter->second.empty()) {
+    pooled = iter->second.back();
+    iter->second.pop_back();
+  }
+  lck.unlock();
+  if (pooled.qp == nullptr) {
+    std::string qp_name(QP_Type_Name(qp_type));
+    Remote_Query_Pair_Connection(qp_name, target_node_id);
+    return;
+  }
+  Local_QP_Ptr(qp_type, target_node_id)->Reset(pooled.qp);
+  Local_CQ_Ptr(qp_type, target_node_id)->Reset(pooled.cq);
+  Local_QP_Info_Ptr(qp_type, target_node_id)->Reset(pooled.remote_con_data);
+}
+int RDMA_Manager::Fill_QP_Pool(QP_Type qp_type, uint8_t target_node_id,
+                               int num) {
+  assert(qp_type != QP_MAIN);
+  std::vector<Pooled_QP> qps;
+  std::vector<std::unique_ptr<RPC_Call>> calls;
+  RPC_Batch batch(this, target_node_id);
+  for (int i = 0; i < num; i++) {
+    int cq_size = 1024;
+    ibv_cq* cq = Create_CQ(qp_type, cq_size);
+    if (cq == nullptr) {
+      fprintf(stderr, "failed to create CQ with %u entries\n", cq_size);
+      break;
+    }
+    struct ibv_qp_init_attr qp_init_attr;
+    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+    qp_init_attr.qp_type = IBV_QPT_RC;
+    qp_init_attr.sq_sig_all = 0;
+    qp_init_attr.send_cq = cq;
+    qp_init_attr.recv_cq = cq;
+    qp_init_attr.cap.max_send_wr = 2500;
+    qp_init_attr.cap.max_recv_wr = 2500;
+    qp_init_attr.cap.max_send_sge = 30;
+    qp_init_attr.cap.max_recv_sge = 30;
+    ibv_qp* qp = Create_QP(&qp_init_attr);
+    if (qp == nullptr) {
+      fprintf(stderr, "failed to create QP\n");
+      UnrefHandle_cq(cq);
+      break;
+    }
+    std::unique_lock<std::shared_mutex> l(qp_cq_map_mutex);
+    // The threads which take them are not known yet, spread them.
+    qp_ports_[qp->qp_num] = next_port_.fetch_add(1) % Num_Ports();
+    l.unlock();
+    calls.emplace_back(new RPC_Call(this, target_node_id, create_qp_));
+    Local_QP_Config(qp, &calls.back()->request()->content.qp_config);
+    batch.Add(calls.back().get());
+    qps.push_back({qp, cq, nullptr});
+  }
+  bool sent = batch.Send();
+  if (!sent) {
+    fprintf(stderr, "failed to send the queue pair creation to node %d\n",
+            target_node_id);
+  }
+  int added = 0;
+  for (size_t i = 0; i < qps.size(); i++) {
+    if (sent && calls[i]->Wait(RPC_REPLY_TIMEOUT_MICROS)) {
+      qps[i].remote_con_data =
+          new registered_qp_config(calls[i]->reply().content.qp_config);
+      if (connect_qp(qps[i].qp, qps[i].remote_con_data) == 0) {
+        std::unique_lock<std::mutex> lck(qp_pool_mtx_);
+        qp_pool_[qp_type][target_node_id].push_back(qps[i]);
+        added++;
+        continue;
+      }
+      delete qps[i].remote_con_data;
+    }
+    UnrefHandle_qp(qps[i].qp);
+    UnrefHandle_cq(qps[i].cq);
+  }
+  return added;
+}
+ibv_qp* RDMA_Manager::Get_QP(QP_Type qp_type, uint8_t target_node_id) {
+  if (qp_type == QP_MAIN) {
+    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
+    return res->qp_map.at(target_node_id);
+  }
+  Local_QP_Cache* cache = Get_Local_QP_Cache(instance_id_);
+  ibv_qp* qp = cache->qp[qp_type][target_node_id];
+#ifdef DCTRANSPORT
+  if (qp == nullptr && qp_type == QP_READ_LOCAL) {
+    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
+    auto iter = dc_targets_.find(target_node_id);
+    DC_Target target = {nullptr, 0};
+    if (iter != dc_targets_.end()) target = iter->second;
+    l.unlock();
+    if (target.ah != nullptr && (qp = Get_Local_DCI()) != nullptr) {
+      cache->qp[qp_type][target_node_id] = qp;
+      cache->cq[qp_type][target_node_id] =
+          static_cast<ibv_cq*>(cq_local_dci_->Get());
+      cache->dc_ah[target_node_id] = target.ah;
+      cache->dct_num[target_node_id] = target.dct_num;
+      return qp;
+    }
+  }
+#endif
+  if (qp == nullptr && qp_type == QP_READ_LOCAL && shared_read_qps_ > 0) {
+    Shared_QP* shared = Get_Shared_Read_QP(target_node_id);
+    cache->qp[qp_type][target_node_id] = shared->qp;
+    cache->cq[qp_type][target_node_id] = shared->cq;
+    cache->mtx[qp_type][target_node_id] = &shared->mtx;
+    cache->port[qp_type][target_node_id] = shared->port;
+    return shared->qp;
+  }
+  if (qp == nullptr) {
+    ThreadLocalPtr* qp_ptr = Local_QP_Ptr(qp_type, target_node_id);
+    qp = static_cast<ibv_qp*>(qp_ptr->Get());
+    if (qp == NULL) {
+      Connect_Local_QP(qp_type, target_node_id);
+      qp = static_cast<ibv_qp*>(qp_ptr->Get());
+    }
+    cache->qp[qp_type][target_node_id] = qp;
+    cache->port[qp_type][target_node_id] = Port_Of(qp);
+  }
+  return qp;
+}
+uint8_t RDMA_Manager::Local_Port() {
+  Local_QP_Cache* cache = Get_Local_QP_Cache(instance_id_);
+  if (cache->local_port == 0) {
+    cache->local_port = next_port_.fetch_add(1) % Num_Ports() + 1;
+  }
+  return cache->local_port - 1;
+}
+uint8_t RDMA_Manager::Port_Of(ibv_qp* qp) {
+  std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
+  auto iter = qp_ports_.find(qp->qp_num);
+  return iter == qp_ports_.end() ? 0 : iter->second;
+}
+void RDMA_Manager::Count_Posted(QP_Type qp_type, uint8_t target_node_id,
+                                size_t ops, size_t bytes, size_t signaled) {
+  uint8_t port = qp_type == QP_MAIN
+                     ? 0
+                     : Get_Local_QP_Cache(instance_id_)
+                           ->port[qp_type][target_node_id];
+  port_bytes_[port].fetch_add(bytes, std::memory_order_relaxed);
+  RDMA_Stats_Slot* slot = Get_Stats_Slot();
+  std::unique_lock<std::mutex> lck(slot->mutex);
+  RDMA_Stats_Slot::Counters& counters = slot->counters[qp_type][target_node_id];
+  counters.ops += ops;
+  counters.bytes += bytes;
+  counters.signaled += signaled;
+}
+void RDMA_Manager::Count_Completed(QP_Type qp_type, uint8_t target_node_id,
+                                   size_t completed, size_t errors) {
+  RDMA_Stats_Slot* slot = Get_Stats_Slot();
+  std::unique_lock<std::mutex> lck(slot->mutex);
+  RDMA_Stats_Slot::Counters& counters = slot->counters[qp_type][target_node_id];
+  counters.completed += completed;
+  counters.errors += errors;
+}
+void RDMA_Manager::Record_Latency(QP_Type qp_type,
+                                  std::chrono::steady_clock::time_point start) {
+  double micros = std::chrono::duration<double, std::micro>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+  RDMA_Stats_Slot* slot = Get_Stats_Slot();
+  std::unique_lock<std::mutex> lck(slot->mutex);
+  slot->latency[qp_type].Add(micros);
+}
+RDMA_Stats_Slot* RDMA_Manager::Get_Stats_Slot() {
+  auto* slot = static_cast<RDMA_Stats_Slot*>(local_stats_slot_->Get());
+  if (slot == nullptr) {
+    std::unique_lock<std::mutex> lck(stats_slots_mtx_);
+    for (auto free_slot : stats_slots_) {
+      if (!free_slot->in_use) {
+        slot = free_slot;
+        break;
+      }
+    }
+    if (slot == nullptr) {
+      slot = new RDMA_Stats_Slot();
+      stats_slots_.push_back(slot);
+    }
+    slot->in_use = true;
+    local_stats_slot_->Reset(slot);
+  }
+  return slot;
+}
+std::string RDMA_Manager::Stats_String() {
+  std::vector<RDMA_Stats_Slot::Counters> counters(QP_TYPE_NUM * 256);
+  memset(counters.data(), 0, counters.size() * sizeof(counters[0]));
+  Histogram latency[QP_TYPE_NUM];
+  for (Histogram& histogram : latency) {
+    histogram.Clear();
+  }
+  std::unique_lock<std::mutex> lck(stats_slots_mtx_);
+  for (auto slot : stats_slots_) {
+    std::unique_lock<std::mutex> slot_lck(slot->mutex);
+    for (int type = 0; type < QP_TYPE_NUM; type++) {
+      for (int node = 0; node < 256; node++) {
+        const RDMA_Stats_Slot::Counters& from = slot->counters[type][node];
+        RDMA_Stats_Slot::Counters& to = counters[type * 256 + node];
+        to.ops += from.ops;
+        to.bytes += from.bytes;
+        to.signaled += from.signaled;
+        to.completed += from.completed;
+        to.errors += from.errors;
+      }
+      latency[type].Merge(slot->latency[type]);
+    }
+  }
+  lck.unlock();
+  std::string result;
+  char buf[300];
+  for (int type = 0; type < QP_TYPE_NUM; type++) {
+    for (int node = 0; node < 256; node++) {
+      const RDMA_Stats_Slot::Counters& c = counters[type * 256 + node];
+      if (c.ops == 0 && c.errors == 0) continue;
+      // Completions polled for the requests of another class may come first.
+      int64_t outstanding = static_cast<int64_t>(c.signaled - c.completed);
+      std::snprintf(buf, sizeof(buf),
+                    "%s node %d: ops %llu, %.1f MB, outstanding %lld, "
+                    "errors %llu\n",
+                    QP_Type_Name(static_cast<QP_Type>(type)), node,
+                    static_cast<unsigned long long>(c.ops),
+                    c.bytes / 1048576.0,
+                    static_cast<long long>(std::max<int64_t>(outstanding, 0)),
+                    static_cast<unsigned long long>(c.errors));
+      result.append(buf);
+    }
+  }
+  for (size_t port = 0; port < Num_Ports(); port++) {
+    std::snprintf(buf, sizeof(buf), "port %d: %.1f MB\n",
+                  static_cast<int>(rdma_config.ib_port + port),
+                  Get_Port_Bytes(port) / 1048576.0);
+    result.append(buf);
+  }
+  for (int type = 0; type < QP_TYPE_NUM; type++) {
+    result.append(QP_Type_Name(static_cast<QP_Type>(type)));
+    result.append(" completion latency (micros):\n");
+    result.append(latency[type].ToString());
+  }
+  for (int type = 0; type < QP_TYPE_NUM; type++) {
+    QP_Type qp_type = static_cast<QP_Type>(type);
+    std::snprintf(buf, sizeof(buf), "%s polls: spins %llu, wakeups %llu\n",
+                  QP_Type_Name(qp_type),
+                  static_cast<unsigned long long>(Get_Poll_Spins(qp_type)),
+                  static_cast<unsigned long long>(Get_Poll_Wakeups(qp_type)));
+    result.append(buf);
+  }
+  return result;
+}
+void RDMA_Manager::Local_QP_Config(ibv_qp* qp, registered_qp_config* config) {
+  uint8_t port = Port_Of(qp);
+  config->qp_num = qp->qp_num;
+  if (port < res->port_attrs.size()) {
+    config->lid = res->port_attrs[port].lid;
+    memcpy(config->gid, &res->port_gids[port], 16);
+  } else {
+    config->lid = res->port_attr.lid;
+    memcpy(config->gid, &res->my_gid, 16);
+  }
+}
+std::mutex* RDMA_Manager::Shared_QP_Mutex(QP_Type qp_type,
+                                          uint8_t target_node_id) {
+  if (qp_type != QP_READ_LOCAL || shared_read_qps_ == 0) {
+    return nullptr;
+  }
+  Get_QP(qp_type, target_node_id);
+  return Get_Local_QP_Cache(instance_id_)->mtx[qp_type][target_node_id];
+}
+RDMA_Manager::Shared_QP* RDMA_Manager::Get_Shared_Read_QP(
+    uint8_t target_node_id) {
+  int cpu = sched_getcpu();
+  size_t index = (cpu < 0 ? 0 : cpu) % shared_read_qps_;
+  std::unique_lock<std::mutex> lck(shared_read_qps_mtx_);
+  std::unique_ptr<Shared_QP[]>& qps = shared_read_qp_map_[target_node_id];
+  if (qps == nullptr) {
+    qps.reset(new Shared_QP[shared_read_qps_]);
+  }
+  Shared_QP* shared = &qps[index];
+  if (shared->qp == nullptr) {
+    // Connected as a queue pair of this thread, and taken from it.
+    Connect_Local_QP(QP_READ_LOCAL, target_node_id);
+    shared->qp =
+        static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Swap(nullptr));
+    shared->cq =
+        static_cast<ibv_cq*>(cq_local_read.at(target_node_id)->Swap(nullptr));
+    shared->port = Port_Of(shared->qp);
+    assert(shared->qp != nullptr && shared->cq != nullptr);
+  }
+  return shared;
+}
+ibv_qp* RDMA_Manager::Create_QP(ibv_qp_init_attr* qp_init_attr) {
+  uint32_t max_inline_data = max_inline_data_.load();
+  qp_init_attr->cap.max_inline_data = max_inline_data;
+  ibv_qp* qp = ibv_create_qp(res->pd, qp_init_attr);
+  if (qp == nullptr && max_inline_data != 0) {
+    qp_init_attr->cap.max_inline_data = 0;
+    qp = ibv_create_qp(res->pd, qp_init_attr);
+  }
+  if (qp != nullptr) {
+    // The device writes back what it gives, which may be more.
+    uint32_t given = qp_init_attr->cap.max_inline_data;
+    while (given < max_inline_data &&
+           !max_inline_data_.compare_exchange_weak(max_inline_data, given)) {
+    }
+  }
+  return qp;
+}
+#ifdef DCTRANSPORT
+ibv_qp* RDMA_Manager::Get_Local_DCI() {
+  ibv_qp* qp = static_cast<ibv_qp*>(qp_local_dci_->Get());
+  if (qp != nullptr) {
+    return qp;
+  }
+  int cq_size = 1024;
+  ibv_cq* cq = Create_CQ(QP_READ_LOCAL, cq_size);
+  if (cq == nullptr) {
+    fprintf(stderr, "failed to create CQ with %u entries\n", cq_size);
+    return nullptr;
+  }
+  ibv_qp_init_attr_ex qp_init_attr;
+  memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+  qp_init_attr.qp_type = IBV_QPT_DRIVER;
+  qp_init_attr.send_cq = cq;
+  qp_init_attr.recv_cq = cq;
+  qp_init_attr.cap.max_send_wr = 2500;
+  qp_init_attr.cap.max_send_sge = 30;
+  qp_init_attr.pd = res->pd;
+  qp_init_attr.comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+  qp_init_attr.send_ops_flags = IBV_QP_EX_WITH_RDMA_READ;
+  mlx5dv_qp_init_attr dv_init_attr;
+  memset(&dv_init_attr, 0, sizeof(dv_init_attr));
+  dv_init_attr.comp_mask = MLX5DV_QP_INIT_ATTR_MASK_DC;
+  dv_init_attr.dc_init_attr.dc_type = MLX5DV_DCTYPE_DCI;
+  qp = mlx5dv_create_qp(res->ib_ctx, &qp_init_attr, &dv_init_attr);
+  int rc = qp == nullptr;
+  if (!rc) {
+    ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = rdma_config.ib_port;
+    rc = ibv_modify_qp(qp, &attr,
+                       IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT);
+  }
+  if (!rc) {
+    ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = IBV_MTU_4096;
+    attr.ah_attr.port_num = rdma_config.ib_port;
+    if (rdma_config.gid_idx >= 0) {
+      attr.ah_attr.is_global = 1;
+      attr.ah_attr.grh.hop_limit = 0xFF;
+      attr.ah_attr.grh.sgid_index = rdma_config.gid_idx;
+    }
+    rc = ibv_modify_qp(qp, &attr,
+                       IBV_QP_STATE | IBV_QP_PATH_MTU | IBV_QP_AV);
+  }
+  if (!rc) {
+    rc = modify_qp_to_rts(qp);
+  }
+  if (rc) {
+    fprintf(stderr, "failed to create the DC initiator, read over RC\n");
+    if (qp != nullptr) ibv_destroy_qp(qp);
+    UnrefHandle_cq(cq);
+    return nullptr;
+  }
+  qp_local_dci_->Reset(qp);
+  cq_local_dci_->Reset(cq);
+  fprintf(stdout, "DC initiator was created, QP number=0x%x\n", qp->qp_num);
+  return qp;
+}
+#endif
+int RDMA_Manager::Post_Send(ibv_qp* qp, uint8_t target_node_id,
+                            ibv_send_wr* wr, ibv_send_wr** bad_wr) {
+#ifdef DCTRANSPORT
+  if (qp->qp_type == IBV_QPT_DRIVER) {
+    const Local_QP_Cache* cache = Get_Local_QP_Cache(instance_id_);
+    ibv_qp_ex* qpx = ibv_qp_to_qp_ex(qp);
+    mlx5dv_qp_ex* mqpx = mlx5dv_qp_ex_from_ibv_qp_ex(qpx);
+    ibv_wr_start(qpx);
+    for (ibv_send_wr* iter = wr; iter != NULL; iter = iter->next) {
+      assert(iter->opcode == IBV_WR_RDMA_READ && iter->num_sge == 1);
+      qpx->wr_id = iter->wr_id;
+      qpx->wr_flags = iter->send_flags;
+      ibv_wr_rdma_read(qpx, iter->wr.rdma.rkey, iter->wr.rdma.remote_addr);
+      mlx5dv_wr_set_dc_addr(mqpx, cache->dc_ah[target_node_id],
+                            cache->dct_num[target_node_id], kDCAccessKey);
+      ibv_wr_set_sge(qpx, iter->sg_list->lkey, iter->sg_list->addr,
+                     iter->sg_list->length);
+    }
+    int rc = ibv_wr_complete(qpx);
+    // Nothing is posted if any of them fails.
+    if (rc) *bad_wr = wr;
+    return rc;
+  }
+#endif
+  return ibv_post_send(qp, wr, bad_wr);
+}
+ibv_cq* RDMA_Manager::Get_CQ(QP_Type qp_type, bool send_cq,
+                             uint8_t target_node_id) {
+  if (qp_type == QP_MAIN) {
+    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
+    if (send_cq)
+      return res->cq_map.at(target_node_id).first;
+    else
+      return res->cq_map.at(target_node_id).second;
+  }
+  Local_QP_Cache* cache = Get_Local_QP_Cache(instance_id_);
+  ibv_cq* cq = cache->cq[qp_type][target_node_id];
+  if (cq == nullptr && qp_type == QP_READ_LOCAL) {
+    // Shared, a DC initiator or connected on first use, Get_QP() knows.
+    Get_QP(qp_type, target_node_id);
+    cq = cache->cq[qp_type][target_node_id];
+  }
+  if (cq == nullptr) {
+    cq = static_cast<ibv_cq*>(Local_CQ_Ptr(qp_type, target_node_id)->Get());
+    assert(cq != nullptr);
+    cache->cq[qp_type][target_node_id] = cq;
+  }
+  return cq;
+}
+ibv_cq* RDMA_Manager::Create_CQ(QP_Type qp_type, int cq_size) {
+  ibv_comp_channel* channel = nullptr;
+  if (poll_policy_[qp_type].mode == POLL_ADAPTIVE) {
+    channel = ibv_create_comp_channel(res->ib_ctx);
+    if (channel == nullptr) {
+      fprintf(stderr, "failed to create completion channel, busy poll instead\n");
+    }
+  }
+  ibv_cq* cq = ibv_create_cq(res->ib_ctx, cq_size, NULL, channel, 0);
+  if (cq == nullptr && channel != nullptr) {
+    ibv_destroy_comp_channel(channel);
+  }
+  return cq;
+}
 ibv_qp* RDMA_Manager::create_qp(uint8_t target_node_id, bool seperated_cq,
                                 std::string& qp_type) {
   struct ibv_qp_init_attr qp_init_attr;
@@ -1402,11 +2786,12 @@ ibv_qp* RDMA_Manager::create_qp(uint8_t target_node_id, bool seperated_cq,
   /* each side will send only one WR, so Completion Queue with 1 entry is enough
    */
   int cq_size = 1024;
+  QP_Type type = QP_Type_From_String(qp_type);
   // cq1 send queue, cq2 receive queue
-  ibv_cq* cq1 = ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
+  ibv_cq* cq1 = Create_CQ(type, cq_size);
   ibv_cq* cq2;
   if (seperated_cq)
-    cq2 = ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
+    cq2 = Create_CQ(type, cq_size);
 
   if (!cq1) {
     fprintf(stderr, "failed to create CQ with %u entries\n", cq_size);
@@ -1447,8 +2832,7 @@ ibv_qp* RDMA_Manager::create_qp(uint8_t target_node_id, bool seperated_cq,
   qp_init_attr.cap.max_recv_wr = 2500;
   qp_init_attr.cap.max_send_sge = 30;
   qp_init_attr.cap.max_recv_sge = 30;
-  //  qp_init_attr.cap.max_inline_data = -1;
-  ibv_qp* qp = ibv_create_qp(res->pd, &qp_init_attr);
+  ibv_qp* qp = Create_QP(&qp_init_attr);
   if (!qp) {
     fprintf(stderr, "failed to create QP\n");
   }
@@ -1472,6 +2856,14 @@ ibv_qp* RDMA_Manager::create_qp(uint8_t target_node_id, bool seperated_cq,
 //    qp_local_write_compact->Reset(qp);
   else
     res->qp_map[target_node_id] = qp;
+  // The main queue pairs stay on ib_port, where the sockets connected them.
+  qp_ports_[qp->qp_num] = type == QP_MAIN ? 0 : Local_Port();
+  if (type != QP_MAIN) {
+    Local_QP_Cache* cache = Get_Local_QP_Cache(instance_id_);
+    cache->qp[type][target_node_id] = qp;
+    cache->cq[type][target_node_id] = cq1;
+    cache->port[type][target_node_id] = qp_ports_[qp->qp_num];
+  }
   fprintf(stdout, "QP was created, QP number=0x%x\n", qp->qp_num);
 //  uint8_t* p = qp->gid;
 //  fprintf(stdout,
@@ -1701,7 +3093,7 @@ int RDMA_Manager::modify_qp_to_init(struct ibv_qp* qp) {
   int rc;
   memset(&attr, 0, sizeof(attr));
   attr.qp_state = IBV_QPS_INIT;
-  attr.port_num = rdma_config.ib_port;
+  attr.port_num = rdma_config.ib_port + Port_Of(qp);
   attr.pkey_index = 0;
   attr.qp_access_flags =
       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE |IBV_ACCESS_REMOTE_ATOMIC;
@@ -1744,10 +3136,9 @@ int RDMA_Manager::modify_qp_to_rtr(struct ibv_qp* qp, uint32_t remote_qpn,
   attr.ah_attr.dlid = dlid;
   attr.ah_attr.sl = 0;
   attr.ah_attr.src_path_bits = 0;
-  attr.ah_attr.port_num = rdma_config.ib_port;
+  attr.ah_attr.port_num = rdma_config.ib_port + Port_Of(qp);
   if (rdma_config.gid_idx >= 0) {
     attr.ah_attr.is_global = 1;
-    attr.ah_attr.port_num = 1;
     memcpy(&attr.ah_attr.grh.dgid, dgid, 16);
     attr.ah_attr.grh.flow_label = 0;
     attr.ah_attr.grh.hop_limit = 0xFF;
@@ -1847,12 +3238,16 @@ End of socket operations
 
 // return 0 means success
 int RDMA_Manager::RDMA_Read(ibv_mr* remote_mr, ibv_mr* local_mr,
-                            size_t msg_size, std::string qp_type,
+                            size_t msg_size, QP_Type qp_type,
                             size_t send_flag, int poll_num, uint8_t target_node_id) {
 //#ifdef GETANALYSIS
 //  auto start = std::chrono::high_resolution_clock::now();
 //#endif
 //  assert(poll_num == 1);
+  if (Use_CXL(target_node_id, send_flag, poll_num) &&
+      cxl_->Read(target_node_id, remote_mr->addr, local_mr->addr, msg_size)) {
+    return 0;
+  }
   struct ibv_send_wr sr;
   struct ibv_sge sge;
   struct ibv_send_wr* bad_wr = NULL;
@@ -1880,42 +3275,27 @@ int RDMA_Manager::RDMA_Read(ibv_mr* remote_mr, ibv_mr* local_mr,
   // start = std::chrono::steady_clock::now();
   //  auto stop = std::chrono::high_resolution_clock::now();
   //  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start); std::printf("rdma read  send prepare for (%zu), time elapse : (%ld)\n", msg_size, duration.count()); start = std::chrono::high_resolution_clock::now();
-  ibv_qp* qp;
-  if (qp_type == "read_local"){
-//    assert(false);// Never comes to here
-    // TODO: Need a mutex to protect the map access. (shared exclusive lock)
-    qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (qp_type == "write_local_flush"){
-    assert(false);
-//    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-//    if (qp == NULL) {
-//      Remote_Query_Pair_Connection(qp_type);
-//      qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-//    }
-//    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (qp_type == "write_local_compact"){
-    assert(false);
-//    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-//    if (qp == NULL) {
-//      Remote_Query_Pair_Connection(qp_type);
-//      qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-//    }
-//    rc = ibv_post_send(qp, &sr, &bad_wr);
-  } else {
-//    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    rc = ibv_post_send(res->qp_map.at(target_node_id), &sr, &bad_wr);
-//    l.unlock();
+  if (qp_type == QP_READ_LOCAL) {
+    Drain_Abandoned_Reads(target_node_id);
   }
+  // A shared queue pair is kept until the completion is polled.
+  std::unique_lock<std::mutex> shared_lck;
+  if (std::mutex* shared_mtx = Shared_QP_Mutex(qp_type, target_node_id)) {
+    assert(poll_num != 0 || !(send_flag & IBV_SEND_SIGNALED));
+    shared_lck = std::unique_lock<std::mutex>(*shared_mtx);
+  }
+  ibv_qp* qp;
+  qp = Get_QP(qp_type, target_node_id);
+  auto post_time = std::chrono::steady_clock::now();
+  rc = Post_Send(qp, target_node_id, &sr, &bad_wr);
+  if (rc == 0)
+    Count_Posted(qp_type, target_node_id, 1, msg_size,
+                 (sr.send_flags & IBV_SEND_SIGNALED) ? 1 : 0);
   //    std::cout << " " << msg_size << "time elapse :" <<  << std::endl;
   //  start = std::chrono::high_resolution_clock::now();
 
   if (rc) {
-    fprintf(stderr, "failed to post SR %s \n", qp_type.c_str());
+    fprintf(stderr, "failed to post SR %s \n", QP_Type_Name(qp_type));
     exit(1);
 
   } else {
@@ -1926,17 +3306,17 @@ int RDMA_Manager::RDMA_Read(ibv_mr* remote_mr, ibv_mr* local_mr,
 //      fprintf(stdout, "RDMA Read Request was posted, OPCODE is %d\n", sr.opcode);
   //  }
   if (poll_num != 0) {
-    ibv_wc* wc = new ibv_wc[poll_num]();
+    ibv_wc wc[poll_num];
     //  auto start = std::chrono::high_resolution_clock::now();
     //  while(std::chrono::high_resolution_clock::now
     //  ()-start < std::chrono::nanoseconds(msg_size+200000));
     rc = poll_completion(wc, poll_num, qp_type, true, target_node_id);
+    if (rc == 0) Record_Latency(qp_type, post_time);
     if (rc != 0) {
       std::cout << "RDMA Read Failed" << std::endl;
-      std::cout << "q id is" << qp_type << std::endl;
+      std::cout << "q id is" << QP_Type_Name(qp_type) << std::endl;
       fprintf(stdout, "QP number=0x%x\n", res->qp_map[target_node_id]->qp_num);
     }
-    delete[] wc;
   }
   ibv_wc wc;
 //#ifdef GETANALYSIS
@@ -1951,9 +3331,316 @@ int RDMA_Manager::RDMA_Read(ibv_mr* remote_mr, ibv_mr* local_mr,
 //#endif
   return rc;
 }
+int RDMA_Manager::RDMA_FAA(const ibv_mr* remote_mr, ibv_mr* local_mr,
+                           uint64_t add, QP_Type qp_type,
+                           uint8_t target_node_id) {
+  assert(reinterpret_cast<uintptr_t>(remote_mr->addr) % sizeof(uint64_t) ==
+             0 &&
+         reinterpret_cast<uintptr_t>(local_mr->addr) % sizeof(uint64_t) == 0);
+  struct ibv_send_wr sr;
+  struct ibv_sge sge;
+  struct ibv_send_wr* bad_wr = NULL;
+  memset(&sge, 0, sizeof(sge));
+  sge.addr = (uintptr_t)local_mr->addr;
+  sge.length = sizeof(uint64_t);
+  sge.lkey = local_mr->lkey;
+  memset(&sr, 0, sizeof(sr));
+  sr.sg_list = &sge;
+  sr.num_sge = 1;
+  sr.opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+  sr.send_flags = IBV_SEND_SIGNALED;
+  sr.wr.atomic.remote_addr = reinterpret_cast<uint64_t>(remote_mr->addr);
+  sr.wr.atomic.rkey = remote_mr->rkey;
+  sr.wr.atomic.compare_add = add;
+  if (qp_type == QP_READ_LOCAL) {
+    Drain_Abandoned_Reads(target_node_id);
+  }
+  std::unique_lock<std::mutex> shared_lck;
+  if (std::mutex* shared_mtx = Shared_QP_Mutex(qp_type, target_node_id)) {
+    shared_lck = std::unique_lock<std::mutex>(*shared_mtx);
+  }
+  ibv_qp* qp = Get_QP(qp_type, target_node_id);
+  auto post_time = std::chrono::steady_clock::now();
+  int rc = Post_Send(qp, target_node_id, &sr, &bad_wr);
+  if (rc) {
+    fprintf(stderr, "failed to post SR %s \n", QP_Type_Name(qp_type));
+    return rc;
+  }
+  Count_Posted(qp_type, target_node_id, 1, sizeof(uint64_t), 1);
+  ibv_wc wc[2];
+  rc = poll_completion(wc, 1, qp_type, true, target_node_id);
+  if (rc == 0) {
+    Record_Latency(qp_type, post_time);
+  }
+  return rc;
+}
+// One work request out of kReadSignalInterval is signaled, which keeps the
+// send queue from overflowing without paying a completion per read.
+static const int kReadSignalInterval = 64;
+// Never have more work requests than this in flight for one batch, the
+// thread-local queue pairs are created with max_send_wr = 2500.
+static const size_t kMaxReadBatchInFlight = 1024;
+int RDMA_Manager::RDMA_Read_Batch_Async(
+    const std::vector<RDMA_Read_Request>& requests, uint8_t target_node_id,
+    RDMA_Read_Future* future) {
+  assert(future->Done());
+  future->rc_ = 0;
+  if (requests.empty()) {
+    return 0;
+  }
+  if (Use_CXL(target_node_id, 0, 0)) {
+    size_t copied = 0;
+    while (copied < requests.size() &&
+           cxl_->Read(target_node_id, requests[copied].remote_addr,
+                      requests[copied].local_addr, requests[copied].size)) {
+      copied++;
+    }
+    if (copied == requests.size()) {
+      return 0;
+    }
+    // A range out of the pool, the whole batch goes over the NIC.
+  }
+  // A shared queue pair is kept until the whole batch is done.
+  std::unique_lock<std::mutex> shared_lck;
+  if (std::mutex* shared_mtx = Shared_QP_Mutex(QP_READ_LOCAL, target_node_id)) {
+    shared_lck = std::unique_lock<std::mutex>(*shared_mtx);
+  }
+  ibv_qp* qp = Get_QP(QP_READ_LOCAL, target_node_id);
+  future->cq_ = Get_CQ(QP_READ_LOCAL, true, target_node_id);
+  assert(future->cq_ != nullptr);
+  size_t batch = std::min(requests.size(), kMaxReadBatchInFlight);
+  ibv_send_wr* sr = new ibv_send_wr[batch];
+  ibv_sge* sge = new ibv_sge[batch];
+  int rc = 0;
+  for (size_t start = 0; start < requests.size(); start += batch) {
+    size_t end = std::min(requests.size(), start + batch);
+    if (start != 0) {
+      // The previous segment has to drain before its slots can be reused.
+      rc = future->Wait();
+      if (rc != 0) break;
+    }
+    size_t bytes = 0;
+    for (size_t i = start; i < end; i++) {
+      size_t j = i - start;
+      const RDMA_Read_Request& request = requests[i];
+      bytes += request.size;
+      memset(&sge[j], 0, sizeof(ibv_sge));
+      sge[j].addr = (uintptr_t)request.local_addr;
+      sge[j].length = request.size;
+      sge[j].lkey = request.lkey;
+      memset(&sr[j], 0, sizeof(ibv_send_wr));
+      sr[j].wr_id = reinterpret_cast<uint64_t>(future);
+      sr[j].sg_list = &sge[j];
+      sr[j].num_sge = 1;
+      sr[j].opcode = IBV_WR_RDMA_READ;
+      sr[j].wr.rdma.remote_addr = reinterpret_cast<uint64_t>(request.remote_addr);
+      sr[j].wr.rdma.rkey = request.rkey;
+      sr[j].next = (i + 1 < end) ? &sr[j + 1] : NULL;
+      if (i + 1 == end || (j + 1) % kReadSignalInterval == 0) {
+        sr[j].send_flags = IBV_SEND_SIGNALED;
+        future->outstanding_++;
+      }
+    }
+    struct ibv_send_wr* bad_wr = NULL;
+    rc = Post_Send(qp, target_node_id, &sr[0], &bad_wr);
+    if (rc) {
+      fprintf(stderr, "failed to post batched RDMA read, return is %d\n", rc);
+      // Nothing after bad_wr was posted, only wait for what is in flight.
+      for (ibv_send_wr* wr = bad_wr; wr != NULL; wr = wr->next) {
+        if (wr->send_flags & IBV_SEND_SIGNALED) future->outstanding_--;
+      }
+      future->rc_ = rc;
+      break;
+    }
+    // The future polls its completions itself.
+    Count_Posted(QP_READ_LOCAL, target_node_id, end - start, bytes, 0);
+  }
+  delete[] sr;
+  delete[] sge;
+  if (shared_lck.owns_lock()) {
+    int wait_rc = future->Wait();
+    if (rc == 0) rc = wait_rc;
+  }
+  return rc;
+}
+void RDMA_Manager::Drain_Abandoned_Reads(uint8_t target_node_id) {
+  auto* state = reinterpret_cast<Hedged_Read_State*>(hedged_reads->Get());
+  if (state == nullptr || state->abandoned.empty()) {
+    return;
+  }
+  auto& abandoned = state->abandoned;
+  for (auto it = abandoned.begin(); it != abandoned.end();) {
+    if (it->node_id == target_node_id) {
+      it->future->Wait();
+      state->free_buffers.push_back(it->buffer);
+      it = abandoned.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+int RDMA_Manager::RDMA_Read_Hedged(
+    ibv_mr* remote_mr, uint8_t target_node_id, ibv_mr* hedge_mr,
+    uint8_t hedge_node_id, size_t msg_size, uint64_t hedge_nanos,
+    std::chrono::steady_clock::time_point deadline, ibv_mr** buffer,
+    uint8_t* from_node, uint64_t* nanos) {
+  auto* state = reinterpret_cast<Hedged_Read_State*>(hedged_reads->Get());
+  if (state == nullptr) {
+    state = new Hedged_Read_State();
+    hedged_reads->Reset(state);
+  }
+  if (state->result != nullptr) {
+    state->free_buffers.push_back(state->result);
+    state->result = nullptr;
+  }
+  // The abandoned reads done by now give their buffers back.
+  auto& abandoned = state->abandoned;
+  for (auto it = abandoned.begin(); it != abandoned.end();) {
+    if (it->future->IsReady() ||
+        abandoned.size() > kMaxAbandonedReads) {
+      it->future->Wait();
+      state->free_buffers.push_back(it->buffer);
+      it = abandoned.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  auto take_buffer = [&]() {
+    if (state->free_buffers.empty()) {
+      const size_t size = name_to_chunksize.at(DataChunk);
+      auto mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                      IBV_ACCESS_REMOTE_WRITE;
+      return ibv_reg_mr(res->pd, new char[size], size, mr_flags);
+    }
+    ibv_mr* mr = state->free_buffers.back();
+    state->free_buffers.pop_back();
+    return mr;
+  };
+  struct Read {
+    uint8_t node_id;
+    std::unique_ptr<RDMA_Read_Future> future;
+    ibv_mr* buffer;
+    std::chrono::steady_clock::time_point post_time;
+  };
+  std::vector<Read> reads;
+  auto post = [&](ibv_mr* remote, uint8_t node_id) {
+    Read read{node_id, std::unique_ptr<RDMA_Read_Future>(new RDMA_Read_Future()),
+              take_buffer(), std::chrono::steady_clock::now()};
+    RDMA_Read_Request request{remote->addr, remote->rkey, read.buffer->addr,
+                              read.buffer->lkey, msg_size};
+    int rc = RDMA_Read_Batch_Async({request}, node_id, read.future.get());
+    if (rc != 0) {
+      read.future->Wait();
+      state->free_buffers.push_back(read.buffer);
+      return rc;
+    }
+    reads.push_back(std::move(read));
+    return 0;
+  };
+  int rc = post(remote_mr, target_node_id);
+  bool hedged = hedge_mr == nullptr || hedge_nanos == 0;
+  if (rc != 0 && !hedged) {
+    rc = post(hedge_mr, hedge_node_id);
+    hedged = true;
+  }
+  const auto start = std::chrono::steady_clock::now();
+  while (!reads.empty()) {
+    for (auto it = reads.begin(); it != reads.end(); ++it) {
+      if (!it->future->IsReady()) {
+        continue;
+      }
+      rc = it->future->Wait();
+      if (rc != 0) {
+        // The other read may still bring the data.
+        state->free_buffers.push_back(it->buffer);
+        reads.erase(it);
+        break;
+      }
+      *buffer = it->buffer;
+      *from_node = it->node_id;
+      *nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - it->post_time)
+                   .count();
+      state->result = it->buffer;
+      reads.erase(it);
+      for (Read& loser : reads) {
+        abandoned.push_back(
+            {loser.node_id, std::move(loser.future), loser.buffer});
+      }
+      return 0;
+    }
+    if (reads.empty()) {
+      break;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (deadline != std::chrono::steady_clock::time_point() &&
+        now >= deadline) {
+      for (Read& read : reads) {
+        abandoned.push_back({read.node_id, std::move(read.future), read.buffer});
+      }
+      return -1;
+    }
+    if (!hedged && now - start >= std::chrono::nanoseconds(hedge_nanos)) {
+      hedged = true;
+      if (post(hedge_mr, hedge_node_id) != 0) {
+        continue;
+      }
+    }
+  }
+  if (!hedged) {
+    // The first read failed, the copy is read at once.
+    return RDMA_Read_Hedged(hedge_mr, hedge_node_id, nullptr, 0, msg_size, 0,
+                            deadline, buffer, from_node, nanos);
+  }
+  return rc != 0 ? rc : 1;
+}
+bool RDMA_Read_Future::IsReady() {
+  if (outstanding_ > 0) {
+    Poll(false);
+  }
+  return outstanding_ == 0;
+}
+int RDMA_Read_Future::Wait() {
+  while (outstanding_ > 0) {
+    Poll(true);
+  }
+  return rc_;
+}
+int RDMA_Read_Future::Poll(bool blocking) {
+  ibv_wc wc[kReadSignalInterval];
+  do {
+    int n = ibv_poll_cq(cq_, kReadSignalInterval, wc);
+    if (n < 0) {
+      fprintf(stderr, "poll CQ failed\n");
+      rc_ = 1;
+      outstanding_ = 0;
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      if (wc[i].status != IBV_WC_SUCCESS) {
+        fprintf(stderr,
+                "batched read got bad completion with status: 0x%x, vendor syndrome: 0x%x\n",
+                wc[i].status, wc[i].vendor_err);
+        rc_ = 1;
+      }
+      // The completion may belong to another batch of this thread.
+      RDMA_Read_Future* owner =
+          reinterpret_cast<RDMA_Read_Future*>(wc[i].wr_id);
+      assert(owner != nullptr);
+      owner->outstanding_--;
+    }
+    if (n > 0) break;
+  } while (blocking);
+  return rc_;
+}
 int RDMA_Manager::RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr,
-                             size_t msg_size, std::string qp_type,
+                             size_t msg_size, QP_Type qp_type,
                              size_t send_flag, int poll_num, uint8_t target_node_id) {
+  if (Use_CXL(target_node_id, send_flag, poll_num) &&
+      cxl_->Write(target_node_id, remote_mr->addr, local_mr->addr,
+                  msg_size)) {
+    return 0;
+  }
   //  auto start = std::chrono::high_resolution_clock::now();
   struct ibv_send_wr sr;
   struct ibv_sge sge;
@@ -1972,6 +3659,7 @@ int RDMA_Manager::RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr,
   sr.num_sge = 1;
   sr.opcode = IBV_WR_RDMA_WRITE;
   if (send_flag != 0) sr.send_flags = send_flag;
+  sr.send_flags |= Inline_Flag(msg_size);
   sr.wr.rdma.remote_addr = reinterpret_cast<uint64_t>(remote_mr->addr);
   sr.wr.rdma.rkey = remote_mr->rkey;
   /* there is a Receive Request in the responder side, so we won't get any into RNR flow */
@@ -1980,34 +3668,14 @@ int RDMA_Manager::RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr,
   //  auto stop = std::chrono::high_resolution_clock::now();
   //  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start); printf("RDMA Write send preparation size: %zu elapse: %ld\n", msg_size, duration.count()); start = std::chrono::high_resolution_clock::now();
   ibv_qp* qp;
-  if (qp_type == "read_local"){
-    //    assert(false);// Never comes to here
-    qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (qp_type == "write_local_flush"){
-    qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-
-  }else if (qp_type == "write_local_compact"){
-    qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  } else {
-    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    rc = ibv_post_send(res->qp_map.at(target_node_id), &sr, &bad_wr);
-    l.unlock();
-  }
+  qp = Get_QP(qp_type, target_node_id);
+  auto post_time = std::chrono::steady_clock::now();
+  rc = ibv_post_send(qp, &sr, &bad_wr);
+  if (rc == 0)
+    Count_Posted(qp_type, target_node_id, 1, msg_size,
+                 (sr.send_flags & IBV_SEND_SIGNALED) ? 1 : 0);
+  else
+    Count_Completed(qp_type, target_node_id, 0, 1);
 
   //  start = std::chrono::high_resolution_clock::now();
   if (rc) fprintf(stderr, "failed to post SR, return is %d\n", rc);
@@ -2016,25 +3684,29 @@ int RDMA_Manager::RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr,
 //      fprintf(stdout, "RDMA Write Request was posted, OPCODE is %d\n", sr.opcode);
   //  }
   if (poll_num != 0) {
-    ibv_wc* wc = new ibv_wc[poll_num]();
+    ibv_wc wc[poll_num];
     //  auto start = std::chrono::high_resolution_clock::now();
     //  while(std::chrono::high_resolution_clock::now()-start < std::chrono::nanoseconds(msg_size+200000));
     // wait until the job complete.
     rc = poll_completion(wc, poll_num, qp_type, true, 0);
+    if (rc == 0) Record_Latency(qp_type, post_time);
     if (rc != 0) {
       std::cout << "RDMA Write Failed" << std::endl;
-      std::cout << "q id is" << qp_type << std::endl;
+      std::cout << "q id is" << QP_Type_Name(qp_type) << std::endl;
       fprintf(stdout, "QP number=0x%x\n", res->qp_map[target_node_id]->qp_num);
     }
-    delete[] wc;
   }
   //  stop = std::chrono::high_resolution_clock::now();
   //  duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start); printf("RDMA Write post send and poll size: %zu elapse: %ld\n", msg_size, duration.count());
   return rc;
 }
 int RDMA_Manager::RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr,
-                             size_t msg_size, std::string qp_type,
+                             size_t msg_size, QP_Type qp_type,
                              size_t send_flag, int poll_num, uint8_t target_node_id) {
+    if (Use_CXL(target_node_id, send_flag, poll_num) &&
+        cxl_->Write(target_node_id, addr, local_mr->addr, msg_size)) {
+      return 0;
+    }
     //  auto start = std::chrono::high_resolution_clock::now();
     struct ibv_send_wr sr;
     struct ibv_sge sge;
@@ -2053,6 +3725,7 @@ int RDMA_Manager::RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr,
     sr.num_sge = 1;
     sr.opcode = IBV_WR_RDMA_WRITE;
     if (send_flag != 0) sr.send_flags = send_flag;
+    sr.send_flags |= Inline_Flag(msg_size);
     sr.wr.rdma.remote_addr = (uint64_t)addr;
     sr.wr.rdma.rkey = rkey;
     /* there is a Receive Request in the responder side, so we won't get any into RNR flow */
@@ -2060,35 +3733,15 @@ int RDMA_Manager::RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr,
     // start = std::chrono::steady_clock::now();
     //  auto stop = std::chrono::high_resolution_clock::now();
     //  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start); printf("RDMA Write send preparation size: %zu elapse: %ld\n", msg_size, duration.count()); start = std::chrono::high_resolution_clock::now();
-    ibv_qp* qp;
-    if (qp_type == "read_local"){
-      //    assert(false);// Never comes to here
-      qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(qp_type,target_node_id);
-        qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-      }
-      rc = ibv_post_send(qp, &sr, &bad_wr);
-    }else if (qp_type == "write_local_flush"){
-      qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(qp_type,target_node_id);
-        qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-      }
-      rc = ibv_post_send(qp, &sr, &bad_wr);
-
-    }else if (qp_type == "write_local_compact"){
-      qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(qp_type,target_node_id);
-        qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-      }
-      rc = ibv_post_send(qp, &sr, &bad_wr);
-    } else {
-      std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-      rc = ibv_post_send(res->qp_map.at(target_node_id), &sr, &bad_wr);
-      l.unlock();
-    }
+    ibv_qp* qp;
+    qp = Get_QP(qp_type, target_node_id);
+    auto post_time = std::chrono::steady_clock::now();
+    rc = ibv_post_send(qp, &sr, &bad_wr);
+    if (rc == 0)
+      Count_Posted(qp_type, target_node_id, 1, msg_size,
+                   (sr.send_flags & IBV_SEND_SIGNALED) ? 1 : 0);
+    else
+      Count_Completed(qp_type, target_node_id, 0, 1);
 
     //  start = std::chrono::high_resolution_clock::now();
     if (rc) fprintf(stderr, "failed to post SR, return is %d\n", rc);
@@ -2097,27 +3750,86 @@ int RDMA_Manager::RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr,
     //      fprintf(stdout, "RDMA Write Request was posted, OPCODE is %d\n", sr.opcode);
     //  }
     if (poll_num != 0) {
-      ibv_wc* wc = new ibv_wc[poll_num]();
+      ibv_wc wc[poll_num];
       //  auto start = std::chrono::high_resolution_clock::now();
       //  while(std::chrono::high_resolution_clock::now()-start < std::chrono::nanoseconds(msg_size+200000));
       // wait until the job complete.
       rc = poll_completion(wc, poll_num, qp_type, true, target_node_id);
+      if (rc == 0) Record_Latency(qp_type, post_time);
       if (rc != 0) {
         std::cout << "RDMA Write Failed" << std::endl;
-        std::cout << "q id is" << qp_type << std::endl;
+        std::cout << "q id is" << QP_Type_Name(qp_type) << std::endl;
         fprintf(stdout, "QP number=0x%x\n", res->qp_map[target_node_id]->qp_num);
       }else{
         DEBUG("RDMA write successfully\n");
       }
-      delete[] wc;
     }
     //  stop = std::chrono::high_resolution_clock::now();
     //  duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start); printf("RDMA Write post send and poll size: %zu elapse: %ld\n", msg_size, duration.count());
     return rc;
 }
 
+// One write out of kWriteSignalInterval of a batch is signaled.
+static const int kWriteSignalInterval = 64;
+int RDMA_Manager::RDMA_Write_Batch(
+    const std::vector<RDMA_Write_Request>& requests, QP_Type qp_type,
+    uint8_t target_node_id, int* signaled) {
+  *signaled = 0;
+  if (requests.empty()) {
+    return 0;
+  }
+  if (Use_CXL(target_node_id, 0, 0)) {
+    size_t copied = 0;
+    while (copied < requests.size() &&
+           cxl_->Write(target_node_id, requests[copied].remote_addr,
+                       requests[copied].local_addr, requests[copied].size)) {
+      copied++;
+    }
+    if (copied == requests.size()) {
+      return 0;
+    }
+    // Writing the batch again over the NIC stores the same bytes.
+  }
+  std::vector<ibv_send_wr> sr(requests.size());
+  std::vector<ibv_sge> sge(requests.size());
+  size_t bytes = 0;
+  for (size_t i = 0; i < requests.size(); i++) {
+    const RDMA_Write_Request& request = requests[i];
+    bytes += request.size;
+    memset(&sge[i], 0, sizeof(ibv_sge));
+    sge[i].addr = (uintptr_t)request.local_addr;
+    sge[i].length = request.size;
+    sge[i].lkey = request.lkey;
+    memset(&sr[i], 0, sizeof(ibv_send_wr));
+    sr[i].wr_id = 0;
+    sr[i].sg_list = &sge[i];
+    sr[i].num_sge = 1;
+    sr[i].opcode = IBV_WR_RDMA_WRITE;
+    sr[i].wr.rdma.remote_addr =
+        reinterpret_cast<uint64_t>(request.remote_addr);
+    sr[i].wr.rdma.rkey = request.rkey;
+    sr[i].next = (i + 1 < requests.size()) ? &sr[i + 1] : NULL;
+    if (i + 1 == requests.size() || (i + 1) % kWriteSignalInterval == 0) {
+      sr[i].send_flags = IBV_SEND_SIGNALED;
+      (*signaled)++;
+    }
+  }
+  struct ibv_send_wr* bad_wr = NULL;
+  int rc = ibv_post_send(Get_QP(qp_type, target_node_id), &sr[0], &bad_wr);
+  if (rc) {
+    fprintf(stderr, "failed to post batched RDMA write, return is %d\n", rc);
+    // Nothing from bad_wr on was posted.
+    for (ibv_send_wr* wr = bad_wr; wr != NULL; wr = wr->next) {
+      if (wr->send_flags & IBV_SEND_SIGNALED) (*signaled)--;
+    }
+    Count_Completed(qp_type, target_node_id, 0, 1);
+  } else {
+    Count_Posted(qp_type, target_node_id, requests.size(), bytes, *signaled);
+  }
+  return rc;
+}
 int RDMA_Manager::RDMA_Write_Imme(void* addr, uint32_t rkey, ibv_mr* local_mr,
-                                  size_t msg_size, std::string qp_type,
+                                  size_t msg_size, QP_Type qp_type,
                                   size_t send_flag, int poll_num,
                                   unsigned int imme, uint8_t target_node_id) {
   //  auto start = std::chrono::high_resolution_clock::now();
@@ -2139,6 +3851,7 @@ int RDMA_Manager::RDMA_Write_Imme(void* addr, uint32_t rkey, ibv_mr* local_mr,
   sr.imm_data = imme;
   sr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
   if (send_flag != 0) sr.send_flags = send_flag;
+  sr.send_flags |= Inline_Flag(msg_size);
   sr.wr.rdma.remote_addr = (uint64_t)addr;
   sr.wr.rdma.rkey = rkey;
   /* there is a Receive Request in the responder side, so we won't get any into RNR flow */
@@ -2147,36 +3860,12 @@ int RDMA_Manager::RDMA_Write_Imme(void* addr, uint32_t rkey, ibv_mr* local_mr,
   //  auto stop = std::chrono::high_resolution_clock::now();
   //  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start); printf("RDMA Write send preparation size: %zu elapse: %ld\n", msg_size, duration.count()); start = std::chrono::high_resolution_clock::now();
   ibv_qp* qp;
-  if (qp_type == "read_local"){
-    //    assert(false);// Never comes to here
-    qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (qp_type == "write_local_flush"){
-    qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-
-  }else if (qp_type == "write_local_compact"){
-    qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  } else {
-    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    qp = res->qp_map.at(target_node_id);
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-    l.unlock();
-  }
+  qp = Get_QP(qp_type, target_node_id);
+  rc = ibv_post_send(qp, &sr, &bad_wr);
   assert(rc == 0);
+  if (rc == 0)
+    Count_Posted(qp_type, target_node_id, 1, msg_size,
+                 (sr.send_flags & IBV_SEND_SIGNALED) ? 1 : 0);
   //  start = std::chrono::high_resolution_clock::now();
   if (rc) fprintf(stderr, "failed to post SR, return is %d\n", rc);
   //  else
@@ -2184,19 +3873,18 @@ int RDMA_Manager::RDMA_Write_Imme(void* addr, uint32_t rkey, ibv_mr* local_mr,
   //      fprintf(stdout, "RDMA Write Request was posted, OPCODE is %d\n", sr.opcode);
   //  }
   if (poll_num != 0) {
-    ibv_wc* wc = new ibv_wc[poll_num]();
+    ibv_wc wc[poll_num];
     //  auto start = std::chrono::high_resolution_clock::now();
     //  while(std::chrono::high_resolution_clock::now()-start < std::chrono::nanoseconds(msg_size+200000));
     // wait until the job complete.
     rc = poll_completion(wc, poll_num, qp_type, true, target_node_id);
     if (rc != 0) {
       std::cout << "RDMA Write Failed" << std::endl;
-      std::cout << "q id is" << qp_type << std::endl;
+      std::cout << "q id is" << QP_Type_Name(qp_type) << std::endl;
       fprintf(stdout, "QP number=0x%x\n", res->qp_map[target_node_id]->qp_num);
     }else{
       DEBUG("RDMA write successfully\n");
     }
-    delete[] wc;
   }
   //  stop = std::chrono::high_resolution_clock::now();
   //  duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start); printf("RDMA Write post send and poll size: %zu elapse: %ld\n", msg_size, duration.count());
@@ -2255,7 +3943,7 @@ int RDMA_Manager::RDMA_Write_Imme(void* addr, uint32_t rkey, ibv_mr* local_mr,
 //  return rc;
 //}
 
-int RDMA_Manager::post_send(ibv_mr* mr, std::string qp_type, size_t size,
+int RDMA_Manager::post_send(ibv_mr* mr, QP_Type qp_type, size_t size,
                             uint8_t target_node_id) {
   struct ibv_send_wr sr;
   struct ibv_sge sge;
@@ -2283,7 +3971,7 @@ int RDMA_Manager::post_send(ibv_mr* mr, std::string qp_type, size_t size,
   sr.sg_list = &sge;
   sr.num_sge = 1;
   sr.opcode = static_cast<ibv_wr_opcode>(IBV_WR_SEND);
-  sr.send_flags = IBV_SEND_SIGNALED;
+  sr.send_flags = IBV_SEND_SIGNALED | Inline_Flag(size);
 
   /* there is a Receive Request in the responder side, so we won't get any into RNR flow */
   //*(start) = std::chrono::steady_clock::now();
@@ -2294,33 +3982,12 @@ int RDMA_Manager::post_send(ibv_mr* mr, std::string qp_type, size_t size,
 //  else
 //    rc = ibv_post_send(res->qp_map[qp_id], &sr, &bad_wr);
   ibv_qp* qp;
-  if (qp_type == "read_local"){
-    //    assert(false);// Never comes to here
-    qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (qp_type == "write_local_flush"){
-    qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-
-  }else if (qp_type == "write_local_compact"){
-    qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
+  qp = Get_QP(qp_type, target_node_id);
+  rc = ibv_post_send(qp, &sr, &bad_wr);
+  if (rc == 0) {
+    Count_Posted(qp_type, target_node_id, 1, size, 1);
   } else {
-    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    rc = ibv_post_send(res->qp_map.at(target_node_id), &sr, &bad_wr);
-    l.unlock();
+    Count_Completed(qp_type, target_node_id, 0, 1);
   }
 #ifndef NDEBUG
   if (rc)
@@ -2332,7 +3999,7 @@ int RDMA_Manager::post_send(ibv_mr* mr, std::string qp_type, size_t size,
   return rc;
 }
 int RDMA_Manager::post_send(ibv_mr** mr_list, size_t sge_size,
-                            std::string qp_type, uint8_t target_node_id) {
+                            QP_Type qp_type, uint8_t target_node_id) {
   struct ibv_send_wr sr;
   struct ibv_sge sge[sge_size];
   struct ibv_send_wr* bad_wr = NULL;
@@ -2373,33 +4040,16 @@ int RDMA_Manager::post_send(ibv_mr** mr_list, size_t sge_size,
 //  else
 //    rc = ibv_post_send(res->qp_map[qp_id], &sr, &bad_wr);
   ibv_qp* qp;
-  if (qp_type == "read_local"){
-    //    assert(false);// Never comes to here
-    qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (qp_type == "write_local_flush"){
-    qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
+  qp = Get_QP(qp_type, target_node_id);
+  rc = ibv_post_send(qp, &sr, &bad_wr);
+  if (rc == 0) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < sge_size; i++) {
+      bytes += mr_list[i]->length;
     }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-
-  }else if (qp_type == "write_local_compact"){
-    qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
+    Count_Posted(qp_type, target_node_id, 1, bytes, 1);
   } else {
-    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    rc = ibv_post_send(res->qp_map.at(target_node_id), &sr, &bad_wr);
-    l.unlock();
+    Count_Completed(qp_type, target_node_id, 0, 1);
   }
 #ifndef NDEBUG
   if (rc)
@@ -2411,7 +4061,7 @@ int RDMA_Manager::post_send(ibv_mr** mr_list, size_t sge_size,
   return rc;
 }
 int RDMA_Manager::post_receive(ibv_mr** mr_list, size_t sge_size,
-                               std::string qp_type, uint8_t target_node_id) {
+                               QP_Type qp_type, uint8_t target_node_id) {
   struct ibv_recv_wr rr;
   struct ibv_sge sge[sge_size];
   struct ibv_recv_wr* bad_wr;
@@ -2447,34 +4097,8 @@ int RDMA_Manager::post_receive(ibv_mr** mr_list, size_t sge_size,
 //  else
 //    rc = ibv_post_recv(res->qp_map[qp_id], &rr, &bad_wr);
   ibv_qp* qp;
-  if (qp_type == "read_local"){
-    //    assert(false);// Never comes to here
-    qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    }
-    rc = ibv_post_recv(qp, &rr, &bad_wr);
-  }else if (qp_type == "write_local_flush"){
-    qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-    }
-    rc = ibv_post_recv(qp, &rr, &bad_wr);
-
-  }else if (qp_type == "write_local_compact"){
-    qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-    }
-    rc = ibv_post_recv(qp, &rr, &bad_wr);
-  } else {
-    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    rc = ibv_post_recv(res->qp_map.at(target_node_id), &rr, &bad_wr);
-    l.unlock();
-  }
+  qp = Get_QP(qp_type, target_node_id);
+  rc = ibv_post_recv(qp, &rr, &bad_wr);
   if (rc)
     fprintf(stderr, "failed to post RR\n");
   else
@@ -2482,7 +4106,7 @@ int RDMA_Manager::post_receive(ibv_mr** mr_list, size_t sge_size,
   return rc;
 }
 
-int RDMA_Manager::post_receive(ibv_mr* mr, std::string qp_type, size_t size,
+int RDMA_Manager::post_receive(ibv_mr* mr, QP_Type qp_type, size_t size,
                                uint8_t target_node_id) {
   struct ibv_recv_wr rr;
   struct ibv_sge sge;
@@ -2517,34 +4141,8 @@ int RDMA_Manager::post_receive(ibv_mr* mr, std::string qp_type, size_t size,
 //  else
 //    rc = ibv_post_recv(res->qp_map[q_id], &rr, &bad_wr);
   ibv_qp* qp;
-  if (qp_type == "read_local"){
-    //    assert(false);// Never comes to here
-    qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-    }
-    rc = ibv_post_recv(qp, &rr, &bad_wr);
-  }else if (qp_type == "write_local_flush"){
-    qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-    }
-    rc = ibv_post_recv(qp, &rr, &bad_wr);
-
-  }else if (qp_type == "write_local_compact"){
-    qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(qp_type,target_node_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-    }
-    rc = ibv_post_recv(qp, &rr, &bad_wr);
-  } else {
-    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    rc = ibv_post_recv(res->qp_map.at(target_node_id), &rr, &bad_wr);
-    l.unlock();
-  }
+  qp = Get_QP(qp_type, target_node_id);
+  rc = ibv_post_recv(qp, &rr, &bad_wr);
   if (rc)
     fprintf(stderr, "failed to post RR\n");
   else
@@ -2570,7 +4168,7 @@ int RDMA_Manager::post_receive(ibv_mr* mr, std::string qp_type, size_t size,
 *
 ******************************************************************************/
 int RDMA_Manager::poll_completion(ibv_wc* wc_p, int num_entries,
-                                  std::string qp_type, bool send_cq,
+                                  QP_Type qp_type, bool send_cq,
                                   uint8_t target_node_id) {
   // unsigned long start_time_msec;
   // unsigned long cur_time_msec;
@@ -2582,40 +4180,55 @@ int RDMA_Manager::poll_completion(ibv_wc* wc_p, int num_entries,
   /* poll the completion for a while before giving up of doing it .. */
   // gettimeofday(&cur_time, NULL);
   // start_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-  std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-  if (qp_type == "write_local_flush"){
-    cq = (ibv_cq*)cq_local_write_flush.at(target_node_id)->Get();
-    assert(cq != nullptr);
-  }else if (qp_type == "write_local_compact"){
-    cq = (ibv_cq*)cq_local_write_compact.at(target_node_id)->Get();
-//    cq = ((CQ_Map*)cq_local_write_compact->Get())->at(shard_target_node_id);
-//    cq = static_cast<ibv_cq*>(cq_local_write_compact->Get());
-    assert(cq != nullptr);
-
-  }else if (qp_type == "read_local"){
-    cq = (ibv_cq*)cq_local_read.at(target_node_id)->Get();
-//    cq = ((CQ_Map*)cq_local_read->Get())->at(shard_target_node_id);
-//    cq = static_cast<ibv_cq*>(cq_local_read->Get());
-    assert(cq != nullptr);
-  }
-  else{
-//    assert(res->cq_map.contains());
-    if (send_cq)
-      cq = res->cq_map.at(target_node_id).first;
-    else
-      cq = res->cq_map.at(target_node_id).second;
-    assert(cq != nullptr);
-  }
-  l.unlock();
+  cq = Get_CQ(qp_type, send_cq, target_node_id);
+  assert(cq != nullptr);
+  // A cq with a completion channel spins for busy_poll_us at most, then
+  // sleeps on the channel until the next completion arrives.
+  const Poll_Policy& policy = poll_policy_[qp_type];
+  uint64_t spins = 0;
+  uint64_t wakeups = 0;
+  bool armed = false;
+  std::chrono::steady_clock::time_point deadline;
   do {
-    poll_result = ibv_poll_cq(cq, num_entries, &wc_p[poll_num]);
+    poll_result = ibv_poll_cq(cq, num_entries - poll_num, &wc_p[poll_num]);
     if (poll_result < 0)
       break;
     else
       poll_num = poll_num + poll_result;
+    if (poll_num >= num_entries || cq->channel == nullptr) {
+      spins++;
+      continue;
+    }
+    if (armed) {
+      // The cq is polled once after arming, so no completion is missed.
+      ibv_cq* ev_cq;
+      void* ev_ctx;
+      if (ibv_get_cq_event(cq->channel, &ev_cq, &ev_ctx)) {
+        poll_result = -1;
+        break;
+      }
+      ibv_ack_cq_events(ev_cq, 1);
+      armed = false;
+      wakeups++;
+    } else if ((spins++ & 63) == 0) {
+      auto now = std::chrono::steady_clock::now();
+      if (spins == 1) {
+        deadline = now + std::chrono::microseconds(policy.busy_poll_us);
+      } else if (now >= deadline) {
+        if (ibv_req_notify_cq(cq, 0)) {
+          poll_result = -1;
+          break;
+        }
+        armed = true;
+      }
+    }
     /*gettimeofday(&cur_time, NULL);
     cur_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);*/
   } while (poll_num < num_entries);  // && ((cur_time_msec - start_time_msec) < MAX_POLL_CQ_TIMEOUT));
+  poll_spin_count_[qp_type].fetch_add(spins, std::memory_order_relaxed);
+  if (wakeups != 0) {
+    poll_wakeup_count_[qp_type].fetch_add(wakeups, std::memory_order_relaxed);
+  }
   //*(end) = std::chrono::steady_clock::now();
   // end = std::chrono::steady_clock::now();
   assert(poll_num == num_entries);
@@ -2642,12 +4255,15 @@ int RDMA_Manager::poll_completion(ibv_wc* wc_p, int num_entries,
       }
     }
   }
+  if (send_cq) {
+    Count_Completed(qp_type, target_node_id, poll_num, rc);
+  }
   return rc;
 }
 
 int RDMA_Manager::try_poll_completions(ibv_wc* wc_p,
                                                    int num_entries,
-                                                   std::string& qp_type,
+                                                   QP_Type qp_type,
                                                    bool send_cq,
                                                    uint8_t target_node_id) {
   int poll_result = 0;
@@ -2656,28 +4272,8 @@ int RDMA_Manager::try_poll_completions(ibv_wc* wc_p,
   /* poll the completion for a while before giving up of doing it .. */
   // gettimeofday(&cur_time, NULL);
   // start_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-  if (qp_type == "write_local_flush"){
-    cq = (ibv_cq*)cq_local_write_flush.at(target_node_id)->Get();
-    assert(cq != nullptr);
-  }else if (qp_type == "write_local_compact"){
-    cq = (ibv_cq*)cq_local_write_compact.at(target_node_id)->Get();
-    //    cq = ((CQ_Map*)cq_local_write_compact->Get())->at(shard_target_node_id);
-    //    cq = static_cast<ibv_cq*>(cq_local_write_compact->Get());
-    assert(cq != nullptr);
-
-  }else if (qp_type == "read_local"){
-    cq = (ibv_cq*)cq_local_read.at(target_node_id)->Get();
-    //    cq = ((CQ_Map*)cq_local_read->Get())->at(shard_target_node_id);
-    //    cq = static_cast<ibv_cq*>(cq_local_read->Get());
-    assert(cq != nullptr);
-  }
-  else{
-    if (send_cq)
-      cq = res->cq_map.at(target_node_id).first;
-    else
-      cq = res->cq_map.at(target_node_id).second;
-    assert(cq != nullptr);
-  }
+  cq = Get_CQ(qp_type, send_cq, target_node_id);
+  assert(cq != nullptr);
 
   poll_result = ibv_poll_cq(cq, num_entries, &wc_p[poll_num]);
 #ifndef NDEBUG
@@ -2692,6 +4288,9 @@ int RDMA_Manager::try_poll_completions(ibv_wc* wc_p,
     }
   }
 #endif
+  if (send_cq && poll_result > 0) {
+    Count_Completed(qp_type, target_node_id, poll_result, 0);
+  }
   return poll_result;
 }
 /******************************************************************************
@@ -2790,39 +4389,127 @@ bool RDMA_Manager::Remote_Memory_Register(size_t size, uint8_t target_node_id) {
   // Memory leak?, No, the ibv_mr pointer will be push to the remote mem pool,
   // Please remember to delete it when diregistering mem region from the remote memory
   *temp_pointer = receive_pointer->content.mr;  // create a new ibv_mr for storing the new remote memory region handler
-  remote_mem_pool.push_back(
-      temp_pointer);  // push the new pointer for the new ibv_mr (different from the receive buffer) to remote_mem_pool
-
   // push the bitmap of the new registed buffer to the bitmap vector in resource.
   int placeholder_num =
       static_cast<int>(temp_pointer->length) /
       (Table_Size);  // here we supposing the SSTables are 4 megabytes
   In_Use_Array* in_use_array = new In_Use_Array(placeholder_num, Table_Size, temp_pointer);
-  //    std::unique_lock l(remote_pool_mutex);
-  Remote_Mem_Bitmap.at(target_node_id)->insert({temp_pointer->addr, in_use_array});
-  //    l.unlock();
-  //  l.unlock();
+  {
+    std::unique_lock<std::shared_mutex> mem_write_lock(remote_mem_mutex);
+    remote_mem_pool.push_back(
+        temp_pointer);  // push the new pointer for the new ibv_mr (different from the receive buffer) to remote_mem_pool
+    Remote_Mem_Bitmap.at(target_node_id)->insert({temp_pointer->addr, in_use_array});
+    Remote_Region_Index* index = Remote_Region_Indexes.at(target_node_id);
+    size_t i = index->regions.size();
+    in_use_array->set_region_index(i);
+    index->regions.push_back(in_use_array);
+    if (i / 64 == index->summary.size()) {
+      index->summary.emplace_back(0);
+    }
+    index->summary[i / 64].fetch_or(uint64_t{1} << (i % 64));
+    index->free_slots.fetch_add(placeholder_num);
+    index->registered_bytes.fetch_add(
+        static_cast<uint64_t>(placeholder_num) * Table_Size);
+  }
   Deallocate_Local_RDMA_Slot(send_mr.addr, Message);
   Deallocate_Local_RDMA_Slot(receive_mr.addr, Message);
   return true;
 }
+size_t RDMA_Manager::Release_Empty_Remote_Regions(uint8_t target_node_id) {
+  Remote_Region_Index* index = Remote_Region_Indexes.at(target_node_id);
+  // What Maybe_Prefetch_Remote_Region() registers a region below.
+  const int64_t watermark =
+      static_cast<int64_t>(kRemoteRegionSize / Table_Size / 4);
+  std::vector<ibv_mr*> released;
+  {
+    // A region registered meanwhile would go after the ones released.
+    std::unique_lock<std::mutex> lck(index->register_mtx);
+    if (index->registering.load()) {
+      return 0;
+    }
+    std::unique_lock<std::shared_mutex> mem_write_lock(remote_mem_mutex);
+    // The allocations and the releases of slots hold the lock shared, the
+    // counts are exact here.
+    while (index->regions.size() > 1) {
+      const size_t i = index->regions.size() - 1;
+      In_Use_Array* region = index->regions[i];
+      const int64_t slots = static_cast<int64_t>(region->get_element_size());
+      if (region->get_free_num() != slots ||
+          index->free_slots.load() - slots < watermark) {
+        break;
+      }
+      ibv_mr* mr = region->get_mr_ori();
+      index->summary[i / 64].fetch_and(~(uint64_t{1} << (i % 64)));
+      index->regions.pop_back();
+      index->free_slots.fetch_sub(slots);
+      index->registered_bytes.fetch_sub(static_cast<uint64_t>(slots) *
+                                        Table_Size);
+      Remote_Mem_Bitmap.at(target_node_id)->erase(mr->addr);
+      remote_mem_pool.erase(
+          std::find(remote_mem_pool.begin(), remote_mem_pool.end(), mr));
+      delete region;
+      released.push_back(mr);
+    }
+    if (index->hint.load() >= index->regions.size()) {
+      index->hint.store(0);
+    }
+  }
+  for (ibv_mr* mr : released) {
+    RPC_Call call(this, target_node_id, release_mr_);
+    call.request()->content.rr.addr = mr->addr;
+    call.request()->content.rr.size = mr->length;
+    if (!call.Send()) {
+      fprintf(stderr, "failed to poll send for remote memory release\n");
+    } else {
+      call.Wait();
+    }
+    delete mr;
+    index->released_regions.fetch_add(1);
+  }
+  return released.size();
+}
+bool RDMA_Manager::Remote_Cold_Read(uint64_t file_id, uint64_t offset,
+                                    size_t size, ibv_mr* local_mr,
+                                    uint8_t target_node_id) {
+  assert(size <= local_mr->length);
+  RPC_Call call(this, target_node_id, cold_sstable_read_);
+  RDMA_Request* request = call.request();
+  request->content.cs.file_id = file_id;
+  request->content.cs.offset = offset;
+  request->content.cs.size = size;
+  request->buffer_large = local_mr->addr;
+  request->rkey_large = local_mr->rkey;
+  if (!call.Send()) {
+    fprintf(stderr, "failed to poll send for cold table read\n");
+    return false;
+  }
+  // The memory node writes the data before the reply on the same queue
+  // pair, so it is in place once the reply is.
+  call.Wait();
+  return call.reply().content.cs.size == size;
+}
+size_t RDMA_Manager::Remote_Promote_SSTable(uint64_t file_id, uint8_t level,
+                                            ibv_mr* edit_mr,
+                                            uint8_t target_node_id) {
+  RPC_Call call(this, target_node_id, promote_sstable_);
+  RDMA_Request* request = call.request();
+  request->content.cs.file_id = file_id;
+  request->content.cs.offset = 0;
+  request->content.cs.size = edit_mr->length;
+  request->content.cs.level = level;
+  request->buffer_large = edit_mr->addr;
+  request->rkey_large = edit_mr->rkey;
+  if (!call.Send()) {
+    fprintf(stderr, "failed to poll send for cold table promotion\n");
+    return 0;
+  }
+  call.Wait();
+  return call.reply().content.cs.size;
+}
 bool RDMA_Manager::Remote_Query_Pair_Connection(std::string& qp_type,
                                                 uint8_t target_node_id) {
   ibv_qp* qp = create_qp(target_node_id, false, qp_type);
 
-  union ibv_gid my_gid;
-  int rc;
-  if (rdma_config.gid_idx >= 0) {
-    rc = ibv_query_gid(res->ib_ctx, rdma_config.ib_port, rdma_config.gid_idx,
-                       &my_gid);
-
-    if (rc) {
-      fprintf(stderr, "could not get gid for port %d, index %d\n",
-              rdma_config.ib_port, rdma_config.gid_idx);
-      return false;
-    }
-  } else
-    memset(&my_gid, 0, sizeof my_gid);
 //  std::unique_lock<std::shared_mutex> l(main_qp_mutex);
   // lock should be here because from here on we will modify the send buffer.
   // TODO: Try to understand whether this kind of memcopy without serialization is correct.
@@ -2834,11 +4521,10 @@ bool RDMA_Manager::Remote_Query_Pair_Connection(std::string& qp_type,
   Allocate_Local_RDMA_Slot(receive_mr, Message);
   send_pointer = (RDMA_Request*)send_mr.addr;
   send_pointer->command = create_qp_;
-  send_pointer->content.qp_config.qp_num = qp->qp_num;
+  // From the port the queue pair is on.
+  Local_QP_Config(qp, &send_pointer->content.qp_config);
   fprintf(stdout, "\nQP num to be sent = 0x%x\n", qp->qp_num);
-  send_pointer->content.qp_config.lid = res->port_attr.lid;
-  memcpy(send_pointer->content.qp_config.gid, &my_gid, 16);
-  fprintf(stdout, "Local LID = 0x%x\n", res->port_attr.lid);
+  fprintf(stdout, "Local LID = 0x%x\n", send_pointer->content.qp_config.lid);
   send_pointer->buffer = receive_mr.addr;
   send_pointer->rkey = receive_mr.rkey;
   RDMA_Reply* receive_pointer;
@@ -2900,67 +4586,168 @@ bool RDMA_Manager::Remote_Query_Pair_Connection(std::string& qp_type,
   //    return false;
 }
 
+bool RDMA_Manager::Try_Allocate_Remote_RDMA_Slot(ibv_mr& remote_mr,
+                                                 Remote_Region_Index* index) {
+  const size_t words = index->summary.size();
+  if (words == 0) {
+    return false;
+  }
+  // Start at the word of the last hit, which most likely has free slots
+  // left, then go round the others. The regions released from the end start
+  // at the first word instead, so that the last ones drain.
+  const size_t first_word =
+      remote_region_release_.load(std::memory_order_relaxed)
+          ? 0
+          : index->hint.load(std::memory_order_relaxed) / 64;
+  for (size_t w = 0; w < words; w++) {
+    const size_t word = (first_word + w) % words;
+    uint64_t bits = index->summary[word].load(std::memory_order_acquire);
+    while (bits != 0) {
+      const size_t i = word * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      In_Use_Array* region = index->regions[i];
+      int sst_index = region->allocate_memory_slot();
+      if (sst_index >= 0) {
+        index->hint.store(i, std::memory_order_relaxed);
+        index->free_slots.fetch_sub(1);
+        remote_mr = *(region->get_mr_ori());
+        remote_mr.addr = static_cast<void*>(static_cast<char*>(remote_mr.addr) +
+                                             sst_index * Table_Size);
+        remote_mr.length = Table_Size;
+        return true;
+      }
+      // The region is full. A slot freed meanwhile sets the bit again after
+      // it is pushed, so set it back if the clearing raced with one.
+      const uint64_t bit = uint64_t{1} << (i % 64);
+      index->summary[word].fetch_and(~bit);
+      if (region->get_free_num() > 0) {
+        index->summary[word].fetch_or(bit);
+      }
+    }
+  }
+  return false;
+}
+void RDMA_Manager::Maybe_Prefetch_Remote_Region(uint8_t target_node_id,
+                                               Remote_Region_Index* index) {
+  // A quarter of a region left.
+  const int64_t watermark =
+      static_cast<int64_t>(kRemoteRegionSize / Table_Size / 4);
+  if (index->free_slots.load(std::memory_order_relaxed) >= watermark ||
+      index->registering.exchange(true)) {
+    return;
+  }
+  // The former registration is over, since it cleared the flag.
+  if (index->register_thread.joinable()) {
+    index->register_thread.join();
+  }
+  index->register_thread = std::thread([this, target_node_id, index, watermark]() {
+    {
+      std::unique_lock<std::mutex> lck(index->register_mtx);
+      if (index->free_slots.load() < watermark) {
+        Remote_Memory_Register(kRemoteRegionSize, target_node_id);
+      }
+    }
+    index->registering.store(false);
+  });
+}
+void RDMA_Manager::Allocate_Remote_Whole_Slot(ibv_mr& remote_mr,
+                                              uint8_t target_node_id,
+                                              Remote_Region_Index* index) {
+  while (true) {
+    {
+      std::shared_lock<std::shared_mutex> mem_read_lock(remote_mem_mutex);
+      if (Try_Allocate_Remote_RDMA_Slot(remote_mr, index)) {
+        mem_read_lock.unlock();
+        Maybe_Prefetch_Remote_Region(target_node_id, index);
+        return;
+      }
+    }
+    // If not find remote buffers are all used, allocate another remote memory
+    // region, unless another thread did while this one waited for the lock.
+    std::unique_lock<std::mutex> lck(index->register_mtx);
+    if (index->free_slots.load() <= 0) {
+      Remote_Memory_Register(kRemoteRegionSize, target_node_id);
+      //  fs_meta_save();
+    }
+  }
+}
+int RDMA_Manager::Remote_Size_Class(size_t size) const {
+  if (size == 0 || size > Table_Size / 2) {
+    return -1;
+  }
+  int size_class = 0;
+  while ((kMinRemoteChunkSize << size_class) < size) {
+    size_class++;
+  }
+  return size_class;
+}
 void RDMA_Manager::Allocate_Remote_RDMA_Slot(ibv_mr& remote_mr,
-                                             uint8_t target_node_id) {
-  // If the Remote buffer is empty, register one from the remote memory.
-  //  remote_mr = new ibv_mr;
-  if (Remote_Mem_Bitmap.at(target_node_id)->empty()) {
-    // this lock is to prevent the system register too much remote memory at the
-    // begginning.
-    std::unique_lock<std::shared_mutex> mem_write_lock(remote_mem_mutex);
-    if (Remote_Mem_Bitmap.at(target_node_id)->empty()) {
-      Remote_Memory_Register(1 * 1024 * 1024 * 1024, target_node_id);
-      //      fs_meta_save();
+                                             uint8_t target_node_id,
+                                             size_t size) {
+  Remote_Region_Index* index = Remote_Region_Indexes.at(target_node_id);
+  const int size_class = Remote_Size_Class(size);
+  if (size_class < 0) {
+    Allocate_Remote_Whole_Slot(remote_mr, target_node_id, index);
+    index->allocated_bytes.fetch_add(Table_Size);
+    index->requested_bytes.fetch_add(size == 0 ? Table_Size : size);
+    return;
+  }
+  const size_t chunk_size = kMinRemoteChunkSize << size_class;
+  std::unique_lock<std::mutex> lck(index->slab_mtx);
+  if (index->partial_slabs.size() <= static_cast<size_t>(size_class)) {
+    index->partial_slabs.resize(size_class + 1);
+  }
+  if (index->partial_slabs[size_class].empty()) {
+    // Split a new slot, without the lock since it may wait for a region to
+    // be registered.
+    lck.unlock();
+    Remote_Slab* slab = new Remote_Slab();
+    Allocate_Remote_Whole_Slot(slab->slot, target_node_id, index);
+    slab->chunk_size = chunk_size;
+    slab->size_class = size_class;
+    slab->chunk_num = Table_Size / chunk_size;
+    slab->used_num = 0;
+    slab->used.assign((slab->chunk_num + 63) / 64, 0);
+    lck.lock();
+    index->slabs.insert({slab->slot.addr, slab});
+    index->partial_slabs[size_class].push_back(slab);
+    index->slab_free_bytes.fetch_add(slab->chunk_num * chunk_size);
+  }
+  Remote_Slab* slab = index->partial_slabs[size_class].front();
+  size_t i = 0;
+  for (size_t w = 0; w < slab->used.size(); w++) {
+    if (~slab->used[w] != 0) {
+      i = w * 64 + __builtin_ctzll(~slab->used[w]);
+      break;
     }
-    mem_write_lock.unlock();
   }
-  std::shared_lock<std::shared_mutex> mem_read_lock(remote_mem_mutex);
-  auto ptr = Remote_Mem_Bitmap.at(target_node_id)->begin();
-
-  while (ptr != Remote_Mem_Bitmap.at(target_node_id)->end()) {
-    // iterate among all the remote memory region
-    // find the first empty SSTable Placeholder's iterator, iterator->first is ibv_mr* second is the bool vector for this ibv_mr*. Each ibv_mr is the origin block get from the remote memory. The memory was divided into chunks with size == SSTable size.
-    int sst_index = ptr->second->allocate_memory_slot();
-    if (sst_index >= 0) {
-      remote_mr = *((ptr->second)->get_mr_ori());
-      remote_mr.addr = static_cast<void*>(static_cast<char*>(remote_mr.addr) +
-                                           sst_index * Table_Size);
-      remote_mr.length = Table_Size;
-
-//        remote_data_mrs->fname = file_name;
-//        remote_data_mrs->map_pointer =
-//          (ptr->second).get_mr_ori();  // it could be confused that the map_pointer is for the memtadata deletion
-// so that we can easily find where to deallocate our RDMA buffer. The key is a pointer to ibv_mr.
-//      remote_data_mrs->file_size = 0;
-//      DEBUG_arg("Allocate Remote pointer %p",  remote_mr.addr);
-      return;
-    } else
-      ptr++;
+  assert(i < slab->chunk_num);
+  slab->used[i / 64] |= uint64_t{1} << (i % 64);
+  if (++slab->used_num == slab->chunk_num) {
+    index->partial_slabs[size_class].pop_front();
   }
-  mem_read_lock.unlock();
-  // If not find remote buffers are all used, allocate another remote memory region.
-  std::unique_lock<std::shared_mutex> mem_write_lock(remote_mem_mutex);
-  Remote_Memory_Register(1 * 1024 * 1024 * 1024, target_node_id);
-  //  fs_meta_save();
-  ibv_mr* mr_last;
-  mr_last = remote_mem_pool.back();
-  int sst_index = Remote_Mem_Bitmap.at(target_node_id)->at(mr_last->addr)->allocate_memory_slot();
-  assert(sst_index >= 0);
-  mem_write_lock.unlock();
-
-  //  sst_meta->mr = new ibv_mr();
-  remote_mr = *(mr_last);
-  remote_mr.addr = static_cast<void*>(static_cast<char*>(remote_mr.addr) +
-                                       sst_index * Table_Size);
-  remote_mr.length = Table_Size;
-  //    remote_data_mrs->fname = file_name;
-  //    remote_data_mrs->map_pointer = mr_last;
-//  DEBUG_arg("Allocate Remote pointer %p",  remote_mr.addr);
-  return;
+  index->slab_free_bytes.fetch_sub(chunk_size);
+  index->allocated_bytes.fetch_add(chunk_size);
+  index->requested_bytes.fetch_add(size);
+  remote_mr = slab->slot;
+  remote_mr.addr = static_cast<char*>(remote_mr.addr) + i * chunk_size;
+  remote_mr.length = chunk_size;
+}
+Remote_Memory_Stats RDMA_Manager::Get_Remote_Memory_Stats(
+    uint8_t target_node_id) {
+  Remote_Region_Index* index = Remote_Region_Indexes.at(target_node_id);
+  Remote_Memory_Stats stats;
+  stats.registered = index->registered_bytes.load();
+  stats.allocated = index->allocated_bytes.load();
+  stats.requested = index->requested_bytes.load();
+  stats.slab_free = index->slab_free_bytes.load();
+  stats.released_regions = index->released_regions.load();
+  return stats;
 }
 // A function try to allocate RDMA registered local memory
 void RDMA_Manager::Allocate_Local_RDMA_Slot(ibv_mr& mr_input,
-                                            Chunk_type pool_name) {
+                                            Chunk_type pool_name,
+                                            const char* tag) {
   // allocate the RDMA slot is seperate into two situation, read and write.
   size_t chunk_size;
   std::shared_lock<std::shared_mutex> mem_read_lock(local_mem_mutex);
@@ -3000,6 +4787,8 @@ void RDMA_Manager::Allocate_Local_RDMA_Slot(ibv_mr& mr_input,
                                           block_index * chunk_size);
       mr_input.length = chunk_size;
 //      DEBUG_arg("Allocate pointer %p", mr_input.addr);
+      mem_read_lock.unlock();
+      Account_Local_Slot(mr_input.addr, pool_name, tag);
       return;
     } else
       ptr++;
@@ -3034,9 +4823,139 @@ void RDMA_Manager::Allocate_Local_RDMA_Slot(ibv_mr& mr_input,
     mr_input.length = chunk_size;
 //    DEBUG_arg("Allocate pointer %p", mr_input.addr);
     //  mr_input.fname = file_name;
+    Account_Local_Slot(mr_input.addr, pool_name, tag);
     return;
   }
 }
+void RDMA_Manager::Account_Local_Slot(void* addr, Chunk_type pool_name,
+                                      const char* tag) {
+  int64_t in_use =
+      slots_in_use_[pool_name].fetch_add(1, std::memory_order_relaxed) + 1;
+  int64_t high = slots_high_water_[pool_name].load(std::memory_order_relaxed);
+  while (in_use > high && !slots_high_water_[pool_name].compare_exchange_weak(
+                              high, in_use, std::memory_order_relaxed)) {
+  }
+  if (slot_tracking_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lck(slot_tags_mtx_);
+    slot_tags_[addr] = {pool_name, tag};
+  }
+}
+void RDMA_Manager::Unaccount_Local_Slot(void* addr, Chunk_type pool_name) {
+  slots_in_use_[pool_name].fetch_sub(1, std::memory_order_relaxed);
+  if (slot_tracking_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lck(slot_tags_mtx_);
+    slot_tags_.erase(addr);
+  }
+}
+void RDMA_Manager::Resize_Local_Pools() {
+  std::unique_lock<std::shared_mutex> lck(local_mem_mutex);
+  for (auto& pool : name_to_mem_pool) {
+    std::map<void*, In_Use_Array*>& regions = pool.second;
+    if (pool.first == Default || regions.empty()) {
+      continue;
+    }
+    // The allocations and the releases hold the lock shared, the counts are
+    // exact here.
+    int64_t total = 0;
+    int64_t used = 0;
+    for (auto& region : regions) {
+      total += region.second->get_element_size();
+      used += region.second->get_element_size() - region.second->get_free_num();
+    }
+    if (used * 100 > total * kPoolGrowPercent) {
+      ibv_mr* mr;
+      char* buff;
+      size_t size = name_to_allocated_size.at(pool.first) == 0
+                        ? 1024 * 1024 * 1024
+                        : name_to_allocated_size.at(pool.first);
+      if (Local_Memory_Register(&buff, &mr, size, pool.first)) {
+        pool_grows_[pool.first].fetch_add(1, std::memory_order_relaxed);
+      }
+      continue;
+    }
+    for (auto iter = regions.begin();
+         iter != regions.end() && regions.size() > 1;) {
+      In_Use_Array* region = iter->second;
+      const int64_t slots = region->get_element_size();
+      if (region->get_free_num() != slots ||
+          used * 100 >= (total - slots) * kPoolShrinkPercent) {
+        ++iter;
+        continue;
+      }
+      ibv_mr* mr = region->get_mr_ori();
+      total -= slots;
+      iter = regions.erase(iter);
+      delete region;
+      pool_shrinks_[pool.first].fetch_add(1, std::memory_order_relaxed);
+      total_registered_size -= mr->length;
+      if (node_id % 2 == 0) {
+        // The regions of a memory node stay registered for the compute
+        // nodes which ask for more.
+        pre_allocated_pool.push_back(mr);
+        continue;
+      }
+      local_mem_pool.erase(
+          std::find(local_mem_pool.begin(), local_mem_pool.end(), mr));
+      void* buff = mr->addr;
+      if (implicit_mr != nullptr) {
+        delete mr;
+      } else {
+        ibv_dereg_mr(mr);
+      }
+      auto mapped = mapped_buffers.find(buff);
+      if (mapped != mapped_buffers.end()) {
+        munmap(mapped->first, mapped->second);
+        mapped_buffers.erase(mapped);
+      }
+    }
+  }
+}
+std::string RDMA_Manager::Local_Pools_String() {
+  std::string result;
+  char buf[256];
+  std::map<std::pair<Chunk_type, std::string>, uint64_t> held;
+  {
+    std::shared_lock<std::shared_mutex> lck(local_mem_mutex);
+    for (auto& pool : name_to_mem_pool) {
+      uint64_t total = 0;
+      uint64_t free = 0;
+      for (auto& region : pool.second) {
+        total += region.second->get_element_size();
+        free += region.second->get_free_num();
+      }
+      std::snprintf(
+          buf, sizeof(buf),
+          "%s: %lld of %llu slots of %zu bytes in use, high-water mark "
+          "%lld, %zu regions, %llu grown, %llu shrunk\n",
+          EnumStrings[pool.first],
+          static_cast<long long>(Local_Slots_In_Use(pool.first)),
+          static_cast<unsigned long long>(total),
+          name_to_chunksize.at(pool.first),
+          static_cast<long long>(Local_Slots_High_Water(pool.first)),
+          pool.second.size(),
+          static_cast<unsigned long long>(pool_grows_[pool.first].load()),
+          static_cast<unsigned long long>(pool_shrinks_[pool.first].load()));
+      result.append(buf);
+    }
+  }
+  if (!slot_tracking_.load()) {
+    return result;
+  }
+  {
+    std::lock_guard<std::mutex> lck(slot_tags_mtx_);
+    for (auto& slot : slot_tags_) {
+      held[{slot.second.first, slot.second.second}]++;
+    }
+  }
+  result.append("slots held per caller:\n");
+  for (auto& iter : held) {
+    std::snprintf(buf, sizeof(buf), "  %s %s: %llu\n",
+                  EnumStrings[iter.first.first], iter.first.second.c_str(),
+                  static_cast<unsigned long long>(iter.second));
+    result.append(buf);
+  }
+  return result;
+}
 size_t RDMA_Manager::Calculate_size_of_pool(Chunk_type pool_name) {
   size_t Sum = 0;
   Sum = name_to_mem_pool.at(pool_name).size();
@@ -3062,6 +4981,7 @@ bool RDMA_Manager::Deallocate_Local_RDMA_Slot(ibv_mr* mr, ibv_mr* map_pointer,
       static_cast<char*>(mr->addr) - static_cast<char*>(map_pointer->addr);
   size_t chunksize = name_to_chunksize.at(buffer_type);
   assert(buff_offset % chunksize == 0);
+  Unaccount_Local_Slot(mr->addr, buffer_type);
   std::shared_lock<std::shared_mutex> read_lock(local_mem_mutex);
   return name_to_mem_pool.at(buffer_type)
       .at(map_pointer->addr)
@@ -3086,6 +5006,9 @@ bool RDMA_Manager::Deallocate_Local_RDMA_Slot(void* p, Chunk_type buff_type) {
       bool status = mr_iter->second->deallocate_memory_slot(
           buff_offset / mr_iter->second->get_chunk_size());
       assert(status);
+      if (status) {
+        Unaccount_Local_Slot(p, buff_type);
+      }
       return status;
     }
     else
@@ -3101,6 +5024,9 @@ bool RDMA_Manager::Deallocate_Local_RDMA_Slot(void* p, Chunk_type buff_type) {
       bool status = mr_iter->second->deallocate_memory_slot(
           buff_offset / mr_iter->second->get_chunk_size());
       assert(status);
+      if (status) {
+        Unaccount_Local_Slot(p, buff_type);
+      }
       return status;
     }
     else
@@ -3110,7 +5036,8 @@ bool RDMA_Manager::Deallocate_Local_RDMA_Slot(void* p, Chunk_type buff_type) {
   return false;
 }
 bool RDMA_Manager::Deallocate_Remote_RDMA_Slot(void* p,
-                                               uint8_t target_node_id) {
+                                               uint8_t target_node_id,
+                                               size_t size) {
 //  DEBUG_arg("Delete Remote pointer %p", p);
   std::shared_lock<std::shared_mutex> read_lock(remote_mem_mutex);
   std::map<void*, In_Use_Array*>* Bitmap;
@@ -3118,37 +5045,55 @@ bool RDMA_Manager::Deallocate_Remote_RDMA_Slot(void* p,
   auto mr_iter = Bitmap->upper_bound(p);
   if (mr_iter == Bitmap->begin()) {
     return false;
-  } else if (mr_iter == Bitmap->end()) {
-    mr_iter--;
-    size_t buff_offset =
-        static_cast<char*>(p) - static_cast<char*>(mr_iter->first);
-    //      assert(buff_offset>=0);
-    if (buff_offset < mr_iter->second->get_mr_ori()->length){
-      assert(buff_offset % mr_iter->second->get_chunk_size() == 0);
-      bool status = mr_iter->second->deallocate_memory_slot(
-          buff_offset / mr_iter->second->get_chunk_size());
-      assert(status);
-      return status;
-    }
-    else
-      return false;
-  } else {
-    mr_iter--;
-    size_t buff_offset =
-        static_cast<char*>(p) - static_cast<char*>(mr_iter->first);
-    //      assert(buff_offset>=0);
-    if (buff_offset < mr_iter->second->get_mr_ori()->length){
-      assert(buff_offset % mr_iter->second->get_chunk_size() == 0);
-      bool status = mr_iter->second->deallocate_memory_slot(
-          buff_offset / mr_iter->second->get_chunk_size());
-      assert(status);
-      return status;
-    }else{
-      return false;
+  }
+  mr_iter--;
+  size_t buff_offset =
+      static_cast<char*>(p) - static_cast<char*>(mr_iter->first);
+  In_Use_Array* region = mr_iter->second;
+  if (buff_offset >= region->get_mr_ori()->length) {
+    return false;
+  }
+  Remote_Region_Index* index = Remote_Region_Indexes.at(target_node_id);
+  const size_t slot = buff_offset / region->get_chunk_size();
+  void* slot_addr =
+      static_cast<char*>(mr_iter->first) + slot * region->get_chunk_size();
+  {
+    std::unique_lock<std::mutex> lck(index->slab_mtx);
+    auto slab_iter = index->slabs.find(slot_addr);
+    if (slab_iter != index->slabs.end()) {
+      // A chunk of a split slot, the slot is freed with its last chunk.
+      Remote_Slab* slab = slab_iter->second;
+      size_t chunk_offset = static_cast<char*>(p) - static_cast<char*>(slot_addr);
+      assert(chunk_offset % slab->chunk_size == 0);
+      size_t i = chunk_offset / slab->chunk_size;
+      assert(slab->used[i / 64] & (uint64_t{1} << (i % 64)));
+      slab->used[i / 64] &= ~(uint64_t{1} << (i % 64));
+      index->allocated_bytes.fetch_sub(slab->chunk_size);
+      index->requested_bytes.fetch_sub(size);
+      index->slab_free_bytes.fetch_add(slab->chunk_size);
+      std::list<Remote_Slab*>& partial = index->partial_slabs[slab->size_class];
+      if (slab->used_num-- == slab->chunk_num) {
+        partial.push_back(slab);
+      }
+      if (slab->used_num > 0) {
+        return true;
+      }
+      partial.remove(slab);
+      index->slabs.erase(slab_iter);
+      index->slab_free_bytes.fetch_sub(slab->chunk_num * slab->chunk_size);
+      delete slab;
+    } else {
+      assert(buff_offset % region->get_chunk_size() == 0);
+      index->allocated_bytes.fetch_sub(Table_Size);
+      index->requested_bytes.fetch_sub(size == 0 ? Table_Size : size);
     }
-
   }
-  return false;
+  bool status = region->deallocate_memory_slot(slot);
+  assert(status);
+  index->free_slots.fetch_add(1);
+  size_t i = region->get_region_index();
+  index->summary[i / 64].fetch_or(uint64_t{1} << (i % 64));
+  return status;
 }
 // bool RDMA_Manager::Deallocate_Remote_RDMA_Slot(SST_Metadata* sst_meta)  {
 //
@@ -3206,7 +5151,7 @@ bool RDMA_Manager::CheckInsideRemoteBuff(void* p, uint8_t target_node_id) {
         static_cast<char*>(p) - static_cast<char*>(mr_iter->first);
     //      assert(buff_offset>=0);
     if (buff_offset < mr_iter->second->get_mr_ori()->length){
-      assert(buff_offset % mr_iter->second->get_chunk_size() == 0);
+      assert(buff_offset % kMinRemoteChunkSize == 0);
       return true;
     }
     else
@@ -3217,7 +5162,7 @@ bool RDMA_Manager::CheckInsideRemoteBuff(void* p, uint8_t target_node_id) {
         static_cast<char*>(p) - static_cast<char*>(mr_iter->first);
     //      assert(buff_offset>=0);
     if (buff_offset < mr_iter->second->get_mr_ori()->length){
-      assert(buff_offset % mr_iter->second->get_chunk_size() == 0);
+      assert(buff_offset % kMinRemoteChunkSize == 0);
       return true;
     }else{
       return false;
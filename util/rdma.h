@@ -20,12 +20,21 @@
 #include <sstream>
 #include <arpa/inet.h>
 #include <infiniband/verbs.h>
+#ifdef DCTRANSPORT
+#include <infiniband/mlx5dv.h>
+#endif
+#ifdef RDMA_EMULATION
+#include "util/rdma_emulation.h"
+#endif
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include "util/histogram.h"
 #include "util/thread_local.h"
 #include "port/port_posix.h"
+#include "util/core_local.h"
+#include "util/cxl_transport.h"
 #include "mutexlock.h"
 #include <atomic>
 #include <chrono>
@@ -33,6 +42,8 @@
 #include <map>
 #include <unordered_map>
 #include <shared_mutex>
+#include <condition_variable>
+#include <deque>
 #include <vector>
 #include <list>
 //#include <boost/lockfree/spsc_queue.hpp>
@@ -68,7 +79,8 @@ namespace dLSM {
 
 enum Chunk_type {Message, Version_edit, IndexChunk, FilterChunk, FlushBuffer, DataChunk, Default};
 static const char * EnumStrings[] = { "Message", "Version_edit",
-      "IndexChunk", "FilterChunk", "FlushBuffer", "Default" };
+      "IndexChunk", "FilterChunk", "FlushBuffer", "DataChunk", "Default" };
+static const int kNumChunkTypes = Default + 1;
 
 static char config_file_name[100] = "../connection.conf";
 
@@ -79,6 +91,13 @@ struct config_t {
   int ib_port; /* local IB port to work with, or physically port number */
   int gid_idx; /* gid index to use */
   int init_local_buffer_size; /*initial local SST buffer size*/
+  size_t huge_page_size; /* 0, or 2MB or 1GB hugepages for the registered memory */
+  bool on_demand_paging; /* register the memory without pinning where the NIC can */
+  int num_ports; /* ports from ib_port on to stripe the queue pairs over, 0 for ib_port alone */
+  int qp_pool_size; /* "read_local" queue pairs per memory node connected at set up */
+  bool pin_threads; /* with NUMA, run the pollers and the background threads on the NUMA node of the NIC */
+  const char* cxl_path; /* a directory of a memory pool every node maps, see util/cxl_transport.h, null for the NIC only */
+  const char* pmem_path; /* on a memory node, a directory of a DAX file system to preregister the memory from, null for DRAM */
 };
 /* structure to exchange data which is needed to connect the QPs */
 struct registered_qp_config {
@@ -86,6 +105,7 @@ struct registered_qp_config {
   uint16_t lid;    /* LID of the IB port */
   uint8_t gid[16]; /* gid */
   uint8_t node_id;
+  uint32_t dct_num; /* DC target of a memory node, 0 if it has none */
 } __attribute__((packed));
 using QP_Map = std::map<uint8_t, ibv_qp*>;
 using QP_Info_Map = std::map<uint8_t, registered_qp_config*>;
@@ -93,20 +113,141 @@ using CQ_Map = std::map<uint8_t, ibv_cq*>;
 struct install_versionedit {
   bool trival;
   size_t buffer_size;
-  size_t version_id;
+  size_t version_id; // the persistence epoch of the edit with WITHPERSISTENCE
+  // From a compute node, the buffer holds this many edits, each prefixed
+  // with its varint32 length, and version_id is the epoch of the last.
+  uint32_t num_edits;
   uint8_t check_byte;
   int level;
   uint64_t file_number;
   uint8_t node_id;
+  // The shard of the compute node the edits are of.
+  uint8_t shard_id;
 } __attribute__((packed));
-struct sst_unpin {
-  uint16_t id;
+// A batch of the files a restarted memory node recovered from its disk. The
+// request asks for the batch from file "start" into a buffer of
+// "buffer_size" bytes, the reply gives the size of the edit written there
+// and the start of the next batch, 0 after the last one.
+struct recovered_version {
+  size_t start;
   size_t buffer_size;
+  size_t next;
+  // From a compute node reopening shard "shard_id": also give the tables the
+  // shard had before, which the memory node still keeps. Otherwise it
+  // forgets them.
+  bool reattach;
+  uint8_t shard_id;
 } __attribute__((packed));
 struct sst_compaction {
   size_t buffer_size;
+  // The level of the compaction, for the priority the memory node gives it.
+  int level;
+  // The shard of the compute node, whose compactions take turns with those
+  // of the other shards, "weight" at a time, see Options::compaction_share.
+  uint8_t shard_id;
+  uint8_t weight;
+  // The writes of the shard are slowed down on its level 0 files, the
+  // compaction goes ahead of the others.
+  uint8_t stalled;
 
 } __attribute__((packed));
+// What the compute node writes back to the memory node after it installed
+// the result of a near-data compaction, followed by a flag byte: the end of
+// the numbers it gave the new files, the persistence epoch of the edit and
+// the word of the compute node to write the persisted epoch to.
+struct compaction_file_numbers {
+  uint64_t file_number_end;
+  uint64_t persist_epoch;
+  void* epoch_buffer;
+  uint32_t epoch_rkey;
+} __attribute__((packed));
+// A table of a memory node kept on its disk, see Options::cold_level. For
+// cold_sstable_read_ the request asks for "size" bytes at "offset" of its
+// file, which the memory node writes to buffer_large before it replies. For
+// promote_sstable_ it asks for the table to be loaded back into memory at
+// "level", and "size" is the room at buffer_large for the edit adding the
+// loaded table. The reply gives the bytes written there, 0 on failure.
+struct cold_sstable {
+  uint64_t file_id;
+  uint64_t offset;
+  size_t size;
+  uint8_t level;
+} __attribute__((packed));
+// A scan of the SSTables of a compute node run on the memory node, see
+// DB::FilteredScan(). The request gives the "size" bytes of the encoded
+// ScanPushdownRequest at buffer_large and the buffer of "capacity" bytes at
+// "batch" the kept entries go to. The memory node writes a batch of "size"
+// bytes there and then a reply, and waits until the compute node wrote the
+// number of batches it consumed, or SCAN_PUSHDOWN_ABORT, to "credit" before
+// it writes the next batch. "last" is set on the last batch, and "ok" unless
+// the scan failed.
+struct scan_pushdown {
+  size_t size;
+  void* batch;
+  uint32_t batch_rkey;
+  size_t capacity;
+  void* credit;
+  uint32_t credit_rkey;
+  uint8_t last;
+  uint8_t ok;
+} __attribute__((packed));
+#define SCAN_PUSHDOWN_ABORT (~0ull)
+// A flush whose level 0 table the memory node builds, see
+// Options::offload_flush. The compute node writes the entries the flush
+// keeps, in order, as length prefixed keys and values to its buffer at
+// "batch", followed by a flag byte. The request gives the "size" bytes of
+// the first batch, whether it is the "last" one, and at buffer_large the
+// buffer of "capacity" bytes for the edit adding the table. The memory node
+// reads a batch, and unless it was the last one replies with its "ready"
+// buffer and waits for a flush_offload_batch there before it reads the
+// next. After the last batch it writes the edit and replies with its "size",
+// with "ok" unset if the table could not be built. The filter of the table
+// gets "bloom_bits" bits per key, see FlushJob::bloom_bits.
+struct flush_offload {
+  size_t size;
+  void* batch;
+  uint32_t batch_rkey;
+  size_t capacity;
+  void* ready;
+  uint32_t ready_rkey;
+  uint8_t last;
+  uint8_t ok;
+  int32_t bloom_bits;
+} __attribute__((packed));
+// What the compute node writes to the "ready" buffer of a flush_offload once
+// the next batch is in its buffer, or with "size" FLUSH_OFFLOAD_ABORT to
+// drop the table. "seq" is the number of batches sent before and lands last.
+struct flush_offload_batch {
+  uint64_t size;
+  uint64_t last;
+  volatile uint64_t seq;
+};
+#define FLUSH_OFFLOAD_ABORT (~0ull)
+// The write-ahead log of shard "shard_id" of a compute node, see RemoteLog,
+// or the ring of its version edits if "edits" is set, see EditPublisher.
+// The request asks for a ring of "size" bytes, the reply gives its region.
+// The ring a compute node set up before it restarted is given again, with
+// the size it had. The ring of another compute node "owner_node_id", which
+// the read replicas of the shard read, is only looked up, the region is
+// null if there is none. An owner_node_id of 0 is the requester.
+struct remote_log {
+  size_t size;
+  uint8_t shard_id;
+  uint8_t owner_node_id;
+  bool edits;
+} __attribute__((packed));
+// The sequence counter of shard "shard_id", the same one for every compute
+// node writing to the shard, see ShardSequencer. The reply gives its 8
+// bytes, which the compute nodes add to with RDMA fetch-and-add.
+struct shard_sequencer {
+  uint8_t shard_id;
+} __attribute__((packed));
+// An empty region of "size" bytes at "addr", which create_mr_ gave the
+// compute node, given back to the pool of the memory node for the others.
+struct region_release {
+  void* addr;
+  size_t size;
+} __attribute__((packed));
 enum RDMA_Command_Type {
   invalid_command_,
   create_qp_,
@@ -117,11 +258,18 @@ enum RDMA_Command_Type {
   version_unpin_,
   sync_option,
   qp_reset_,
-  persist_unpin_,
   save_fs_serialized_data,
   retrieve_fs_serialized_data,
   save_log_serialized_data,
-  retrieve_log_serialized_data
+  retrieve_log_serialized_data,
+  retrieve_recovered_version_,
+  cold_sstable_read_,
+  promote_sstable_,
+  scan_pushdown_,
+  remote_log_,
+  shard_sequencer_,
+  flush_offload_,
+  release_mr_
 };
 enum file_type { log_type, others };
 struct fs_sync_command {
@@ -132,6 +280,42 @@ struct sst_gc {
   size_t buffer_size;
 //  file_type type;
 };
+// The garbage collection ring of a compute node on a memory node, which
+// SSTable_gc sets up: a header of GC_RING_HEADER bytes whose first word is
+// the number of batches the memory node has consumed, followed by the
+// Memory_Node_Status, then GC_RING_SLOTS slots. The compute node writes its
+// batch n into slot n % GC_RING_SLOTS with one RDMA write, and the memory
+// node polls the seq of the slot.
+#define GC_RING_SLOTS 64
+#define GC_RING_HEADER 64
+// An entry of a batch with this bit set is not a chunk but the number of a
+// cold table, see cold_sstable, whose file the memory node deletes.
+#define GC_COLD_FILE_BIT (1ull << 63)
+// The pressure on a memory node, which it keeps up to date in the header of
+// every ring for the compute nodes to read with one RDMA read. The fields
+// are written one by one, a reader may see some of them a little older.
+struct Memory_Node_Status {
+  // The registered memory which is not handed out yet.
+  uint64_t free_bytes;
+  // The compactions queued or running.
+  uint32_t compaction_queue;
+  // The edits merged but not persisted yet, 0 without WITHPERSISTENCE.
+  uint32_t persistence_lag;
+  // The share of the time the processors of the memory node were busy
+  // lately, in percent.
+  uint32_t cpu_busy_percent;
+};
+static_assert(sizeof(uint64_t) + sizeof(Memory_Node_Status) <= GC_RING_HEADER,
+              "the status fits in the header of the ring");
+struct GC_Ring_Slot {
+  uint64_t addrs[REMOTE_DEALLOC_BUFF_SIZE / sizeof(uint64_t) - 2];
+  uint64_t num;
+  // n + 1 for batch n. It is the last word, so it lands last.
+  volatile uint64_t seq;
+};
+static_assert(sizeof(GC_Ring_Slot) == REMOTE_DEALLOC_BUFF_SIZE,
+              "a batch is the registered deallocation buffer");
+#define GC_RING_SIZE (GC_RING_HEADER + GC_RING_SLOTS * sizeof(GC_Ring_Slot))
 //TODO (ruihong): add the reply message address to avoid request&response conflict for the same queue pair.
 // In other word, the threads will not need to figure out whether this message is a reply or response,
 // when receive a message from the main queue pair.
@@ -142,13 +326,23 @@ union RDMA_Request_Content {
   install_versionedit ive;
   sst_gc gc;
   sst_compaction sstCompact;
-  sst_unpin psu;
   size_t unpinned_version_id;
+  recovered_version rv;
+  cold_sstable cs;
+  scan_pushdown sp;
+  remote_log rl;
+  shard_sequencer ss;
+  flush_offload fo;
+  region_release rr;
 };
 union RDMA_Reply_Content {
   ibv_mr mr;
   registered_qp_config qp_config;
   install_versionedit ive;
+  recovered_version rv;
+  cold_sstable cs;
+  scan_pushdown sp;
+  flush_offload fo;
 };
 struct RDMA_Request {
   RDMA_Command_Type command;
@@ -170,6 +364,13 @@ struct RDMA_Reply {
   uint32_t rkey_large;
   volatile bool received;
 } __attribute__((packed));
+// How long the control RPCs whose callers can fail wait for their reply.
+#define RPC_REPLY_TIMEOUT_MICROS (10ull * 1000 * 1000)
+// The inline data asked for every queue pair, more than the control messages
+// and the small writes need.
+#define RDMA_MAX_INLINE_DATA 256
+// The ports of the device the queue pairs are striped over at most.
+#define RDMA_MAX_PORTS 4
 // Structure for the file handle in RDMA file system. it could be a link list
 // for large files
 struct SST_Metadata {
@@ -186,6 +387,12 @@ struct Arg_for_handler{
   RDMA_Request* request;
   std::string client_ip;
   uint8_t target_node_id;
+  // When the request was queued for a thread, for the ones which report
+  // how long they waited.
+  uint64_t scheduled_micros = 0;
+  // A compaction to send back undone, see
+  // Memory_Node_Keeper::SetCompactionHandBack().
+  bool hand_back = false;
 };
 template <typename T>
 struct atomwrapper {
@@ -201,13 +408,23 @@ struct atomwrapper {
     _a.store(other._a.load());
   }
 };
-#define ALLOCATOR_SHARD_NUM 16
+// Free slots of a registered memory region. The free slots are kept in
+// per-core lock-free stacks linked through next_, so there is no heap node per
+// slot. A thread allocates from and frees to the stack of its own core, and
+// steals from the other stacks when its own one runs dry.
 class In_Use_Array {
  public:
   In_Use_Array(size_t size, size_t chunk_size, ibv_mr* mr_ori)
-      : element_size_(size), chunk_size_(chunk_size), mr_ori_(mr_ori) {
-    for (size_t i = 0; i < element_size_; ++i) {
-      free_list.push_back(i);
+      : element_size_(size),
+        chunk_size_(chunk_size),
+        mr_ori_(mr_ori),
+        next_(new std::atomic<int>[size]),
+        free_num_(static_cast<int64_t>(size)) {
+    // Spread the slots over the shards in contiguous runs.
+    size_t shard_num = free_lists_.Size();
+    size_t per_shard = (element_size_ + shard_num - 1) / shard_num;
+    for (size_t i = element_size_; i > 0; --i) {
+      Push(free_lists_.AccessAtCore((i - 1) / per_shard), i - 1);
     }
   }
   In_Use_Array(size_t size, size_t chunk_size, ibv_mr* mr_ori,
@@ -215,22 +432,45 @@ class In_Use_Array {
       : element_size_(size),
         chunk_size_(chunk_size),
 //        in_use_(in_use),
-        mr_ori_(mr_ori) {}
+        mr_ori_(mr_ori),
+        next_(new std::atomic<int>[size]),
+        free_num_(0) {}
+  // The slots set in "taken" start in use.
+  In_Use_Array(size_t size, size_t chunk_size, ibv_mr* mr_ori,
+               const std::vector<bool>& taken)
+      : element_size_(size),
+        chunk_size_(chunk_size),
+        mr_ori_(mr_ori),
+        next_(new std::atomic<int>[size]),
+        free_num_(0) {
+    size_t shard_num = free_lists_.Size();
+    size_t per_shard = (element_size_ + shard_num - 1) / shard_num;
+    for (size_t i = element_size_; i > 0; --i) {
+      if (!taken[i - 1]) {
+        Push(free_lists_.AccessAtCore((i - 1) / per_shard), i - 1);
+        free_num_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  }
+  In_Use_Array(const In_Use_Array&) = delete;
+  In_Use_Array& operator=(const In_Use_Array&) = delete;
   int allocate_memory_slot() {
-    //maybe the conflict comes from here
-    std::unique_lock<SpinMutex> lck(mtx);
-    if (free_list.empty())
-      return -1;  // Not find the empty memory chunk.
-    else{
-      int result = free_list.back();
-      free_list.pop_back();
-      return result;
+    auto local = free_lists_.AccessElementAndIndex();
+    int result = Pop(local.first);
+    // Steal from the other shards.
+    size_t shard_num = free_lists_.Size();
+    for (size_t i = 1; result < 0 && i < shard_num; ++i) {
+      result = Pop(free_lists_.AccessAtCore((local.second + i) % shard_num));
+    }
+    if (result >= 0) {
+      free_num_.fetch_sub(1, std::memory_order_relaxed);
     }
+    return result;  // -1 if not find the empty memory chunk.
   }
   bool deallocate_memory_slot(int index) {
-    std::unique_lock<SpinMutex> lck(mtx);
-    free_list.push_back(index);
-    if (index < element_size_){
+    if (index >= 0 && static_cast<size_t>(index) < element_size_){
+      Push(free_lists_.Access(), index);
+      free_num_.fetch_add(1, std::memory_order_relaxed);
       return true;
     }else{
       assert(false);
@@ -240,23 +480,138 @@ class In_Use_Array {
   size_t get_chunk_size() { return chunk_size_; }
   ibv_mr* get_mr_ori() { return mr_ori_; }
   size_t get_element_size() { return element_size_; }
+  // The free slots, which may lag behind the concurrent allocations.
+  int64_t get_free_num() { return free_num_.load(std::memory_order_relaxed); }
+  // The position of the region in the Remote_Region_Index of its node.
+  void set_region_index(size_t index) { region_index_ = index; }
+  size_t get_region_index() { return region_index_; }
 //  std::atomic<bool>* get_inuse_table() { return in_use_; }
   //  void deserialization(char*& temp, int& size){
   //
   //
   //  }
  private:
+  // Head of a Treiber stack. The lower 32 bits are the top slot index (-1
+  // for empty), the upper 32 bits a version bumped on every update against
+  // ABA.
+  struct alignas(CACHE_LINE_SIZE) Free_List {
+    std::atomic<uint64_t> head{static_cast<uint32_t>(-1)};
+  };
+  static int Top(uint64_t head) {
+    return static_cast<int>(static_cast<uint32_t>(head));
+  }
+  static uint64_t Next_Head(uint64_t head, int top) {
+    return (((head >> 32) + 1) << 32) | static_cast<uint32_t>(top);
+  }
+  void Push(Free_List* list, int index) {
+    uint64_t head = list->head.load(std::memory_order_relaxed);
+    do {
+      next_[index].store(Top(head), std::memory_order_relaxed);
+    } while (!list->head.compare_exchange_weak(head, Next_Head(head, index),
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+  }
+  int Pop(Free_List* list) {
+    uint64_t head = list->head.load(std::memory_order_acquire);
+    int top;
+    do {
+      top = Top(head);
+      if (top < 0) {
+        return -1;
+      }
+    } while (!list->head.compare_exchange_weak(
+        head, Next_Head(head, next_[top].load(std::memory_order_relaxed)),
+        std::memory_order_acquire, std::memory_order_acquire));
+    return top;
+  }
 
   size_t element_size_;
   size_t chunk_size_;
-//  uint32_t shard_number = 16;
-//  std::list<int> free_list[ALLOCATOR_SHARD_NUM];
-  std::list<int> free_list;
-  SpinMutex mtx;
   ibv_mr* mr_ori_;
+  // next_[i] is the slot below slot i in the stack holding it.
+  std::unique_ptr<std::atomic<int>[]> next_;
+  CoreLocalArray<Free_List> free_lists_;
+  std::atomic<int64_t> free_num_;
+  size_t region_index_ = 0;
 
   //  int type_;
 };
+// A slot split into equal chunks of a size class, for the chunks much
+// smaller than a slot, such as the index and filter blocks of a table.
+struct Remote_Slab {
+  ibv_mr slot;  // The whole slot.
+  size_t chunk_size;
+  size_t size_class;
+  // The chunks of the slot, and bit i set while chunk i is allocated.
+  size_t chunk_num;
+  size_t used_num;
+  std::vector<uint64_t> used;
+};
+// The remote memory of a memory node, in bytes.
+struct Remote_Memory_Stats {
+  uint64_t registered;
+  // Given out as slots or chunks.
+  uint64_t allocated;
+  // Asked for by the allocations, which is less than allocated since the
+  // sizes are rounded up to a slot or to a size class.
+  uint64_t requested;
+  // The free chunks of the slots split into chunks.
+  uint64_t slab_free;
+  // The regions given back to the memory node.
+  uint64_t released_regions;
+};
+// The remote memory regions registered on a memory node, indexed for the
+// allocation. A summary bitmap tells which regions may have free slots, so
+// that an allocation goes straight to one of them instead of trying the
+// regions one by one.
+struct Remote_Region_Index {
+  // The regions in the order of their registration, and bit i % 64 of
+  // summary[i / 64] set while regions[i] may have free slots. Both change
+  // under the exclusive remote_mem_mutex, the regions only at their end.
+  std::vector<In_Use_Array*> regions;
+  std::deque<std::atomic<uint64_t>> summary;
+  // The free slots over all the regions.
+  std::atomic<int64_t> free_slots{0};
+  // The region of the last allocation, where the next one starts looking.
+  std::atomic<size_t> hint{0};
+  // Serializes the registrations, so that the threads which run out of
+  // slots at the same time do not all register a region.
+  std::mutex register_mtx;
+  // Set while the next region is registered in the background.
+  std::atomic<bool> registering{false};
+  std::thread register_thread;
+
+  // The slabs by the address of their slot, and per size class the ones
+  // with free chunks. Protected by slab_mtx.
+  std::mutex slab_mtx;
+  std::unordered_map<void*, Remote_Slab*> slabs;
+  std::vector<std::list<Remote_Slab*>> partial_slabs;
+  std::atomic<uint64_t> registered_bytes{0};
+  std::atomic<uint64_t> allocated_bytes{0};
+  std::atomic<uint64_t> requested_bytes{0};
+  std::atomic<uint64_t> slab_free_bytes{0};
+  // The regions given back by Release_Empty_Remote_Regions().
+  std::atomic<uint64_t> released_regions{0};
+};
+// The chunks created by a memory node and released by this compute node,
+// which the reclaimer coalesces over the files and shards and ships to the
+// garbage collection ring of the memory node.
+struct Remote_Dealloc_Queue {
+  // Protected by RDMA_Manager::reclaim_mtx.
+  std::vector<uint64_t> pending;
+  // The fields below are only used by the reclaimer. The ring is set up by
+  // its first batch. "written" and "consumed" count the batches.
+  bool ring_ready = false;
+  void* ring_addr = nullptr;
+  uint32_t ring_rkey = 0;
+  uint64_t written = 0;
+  uint64_t consumed = 0;
+  // The status the memory node published last, read by the reclaimer.
+  // Protected by RDMA_Manager::reclaim_mtx.
+  bool status_ready = false;
+  Memory_Node_Status status = {};
+  std::chrono::steady_clock::time_point status_time;
+};
 /* structure of system resources */
 struct resources {
   union ibv_gid my_gid;
@@ -265,6 +620,9 @@ struct resources {
   struct ibv_sge* sge = nullptr;
   struct ibv_recv_wr* rr = nullptr;
   struct ibv_port_attr port_attr; /* IB port attributes */
+  // The ports the queue pairs are striped over, ib_port first, and their gid.
+  std::vector<ibv_port_attr> port_attrs;
+  std::vector<ibv_gid> port_gids;
   //  std::vector<registered_qp_config> remote_mem_regions; /* memory buffers for RDMA */
   struct ibv_context* ib_ctx = nullptr;  /* device handle */
   struct ibv_pd* pd = nullptr;           /* PD handle */
@@ -298,6 +656,102 @@ struct IBV_Deleter {
   }
 };
 
+// Queue pair types. The local ones are thread local queue pairs, one per
+// thread and memory node, "main" is the shared queue pair of the node.
+enum QP_Type : uint8_t {
+  QP_MAIN = 0,
+  QP_READ_LOCAL,
+  QP_WRITE_LOCAL_FLUSH,
+  QP_WRITE_LOCAL_COMPACT,
+  QP_TYPE_NUM
+};
+const char* QP_Type_Name(QP_Type qp_type);
+// Unknown names are treated as "main", as the string dispatch used to do.
+QP_Type QP_Type_From_String(const std::string& qp_type);
+// How a synchronous operation waits for its completion.
+enum Poll_Mode : uint8_t {
+  // Spin on the completion queue until the completion arrives.
+  POLL_BUSY = 0,
+  // Spin for busy_poll_us at most, then sleep on a completion channel. This
+  // frees the core when there are more client threads than cores.
+  POLL_ADAPTIVE
+};
+struct Poll_Policy {
+  Poll_Mode mode = POLL_BUSY;
+  uint32_t busy_poll_us = 50;
+};
+// One read of an asynchronous read batch: fetch "size" bytes from the remote
+// address into the registered local buffer.
+struct RDMA_Read_Request {
+  void* remote_addr;
+  uint32_t rkey;
+  void* local_addr;
+  uint32_t lkey;
+  size_t size;
+};
+// One write of a batch posted by RDMA_Manager::RDMA_Write_Batch: store "size"
+// bytes of the registered local buffer at the remote address.
+struct RDMA_Write_Request {
+  void* remote_addr;
+  uint32_t rkey;
+  void* local_addr;
+  uint32_t lkey;
+  size_t size;
+};
+// Completion handle of a batch posted by RDMA_Manager::RDMA_Read_Batch_Async.
+// Only a few work requests of the batch are signaled, and because an RC queue
+// pair completes in order, the batch is done when all the signaled completions
+// have been polled. The handle must be polled by the thread which posted the
+// batch, as the batch uses that thread's local read queue pair.
+class RDMA_Read_Future {
+ public:
+  RDMA_Read_Future() = default;
+  RDMA_Read_Future(const RDMA_Read_Future&) = delete;
+  RDMA_Read_Future& operator=(const RDMA_Read_Future&) = delete;
+  // A pending batch must not outlive its local buffers, so wait for it.
+  ~RDMA_Read_Future() { Wait(); }
+  // Poll the completion queue once without blocking, return true if all the
+  // reads of the batch have finished.
+  bool IsReady();
+  // Block until all the reads of the batch finish. Return 0 on success.
+  int Wait();
+  bool Done() const { return outstanding_ == 0; }
+
+ private:
+  friend class RDMA_Manager;
+  int Poll(bool blocking);
+  ibv_cq* cq_ = nullptr;
+  int outstanding_ = 0;  // signaled completions not polled yet.
+  int rc_ = 0;
+};
+// The requests one thread posted and the completions it polled, per queue
+// pair class and node, for RDMA_Manager::Stats_String(). The owner thread
+// adds to them under mutex, which only the readers contend for.
+struct alignas(64) RDMA_Stats_Slot {
+  struct Counters {
+    uint64_t ops;
+    uint64_t bytes;
+    // The signaled work requests posted and the completions polled for them
+    // by poll_completion(), their difference is what is outstanding.
+    uint64_t signaled;
+    uint64_t completed;
+    // Failed posts and bad or missing completions.
+    uint64_t errors;
+  };
+  RDMA_Stats_Slot() {
+    memset(counters, 0, sizeof(counters));
+    for (Histogram& histogram : latency) {
+      histogram.Clear();
+    }
+  }
+  std::mutex mutex;
+  Counters counters[QP_TYPE_NUM][256];
+  // From the post to the completion of the synchronous reads and writes, in
+  // microseconds.
+  Histogram latency[QP_TYPE_NUM];
+  // Whether a live thread owns the slot.
+  std::atomic<bool> in_use{true};
+};
 
 class Memory_Node_Keeper;
 class RDMA_Manager {
@@ -314,6 +768,10 @@ class RDMA_Manager {
   ~RDMA_Manager();
   // RDMA set up create all the resources, and create one query pair for RDMA send & Receive.
   void Client_Set_Up_Resources();
+  // With config_t::pin_threads, run the calling thread on the cores of the
+  // NUMA node of the NIC, where its registered memory is, and allocate its
+  // memory there. Needs the device opened by resources_create().
+  void Pin_Thread_To_NIC_Node();
   void Initialize_threadlocal_map();
   // Set up the socket connection to remote shared memory.
   bool Get_Remote_qp_Info_Then_Connect(uint8_t target_node_id);
@@ -321,6 +779,12 @@ class RDMA_Manager {
   //Computes node sync compute sides (block function)
   void sync_with_computes_Cside();
   ibv_mr* Get_local_read_mr();
+  // A FlushBuffer slot for the prefetch buffers of an iterator. The slots a
+  // thread releases are kept for its next iterators, so that a short scan
+  // does not go through the pool of the chunks.
+  void Allocate_Iterator_Buffer(ibv_mr& mr,
+                                const char* tag = __builtin_FUNCTION());
+  void Release_Iterator_Buffer(const ibv_mr& mr);
   //Computes node sync memory sides (block function)
   void sync_with_computes_Mside();
   void broadcast_to_computes();
@@ -336,6 +800,22 @@ class RDMA_Manager {
   void compute_message_handling_thread(std::string q_id, uint8_t shard_target_node_id);
   void ConnectQPThroughSocket(std::string qp_type, int socket_fd,
                               uint8_t& target_node_id);
+  // Make the main queue pairs connected by ConnectQPThroughSocket() after it
+  // receive into one shared queue of "num_buffers" Message buffers, posted
+  // here, with one completion queue. Returns false if the device can not.
+  bool Create_Shared_Receive_Queue(int num_buffers);
+  bool has_shared_receive_queue() const { return srq_ != nullptr; }
+  // Take at most "num_entries" messages from the shared receive queue.
+  // wc_p[i].wr_id is the ibv_mr* of the buffer of the message, to be posted
+  // again by Post_Shared_Receive() once it is copied out, and node_ids[i] the
+  // node which sent it.
+  int Poll_Shared_Receives(ibv_wc* wc_p, uint8_t* node_ids, int num_entries);
+  int Post_Shared_Receive(ibv_mr* mr);
+  // Make the memory node reachable by the DC initiators of the compute
+  // nodes, which read from it without a queue pair to it per thread. The
+  // number of the target goes out with the main connection, so call it
+  // before. Returns false if the device can not, or DCTRANSPORT is off.
+  bool Create_DC_Target();
   // Local memory register will register RDMA memory in local machine,
   // Both Computing node and share memory will call this function.
   // it also push the new block bit map to the Remote_Mem_Bitmap
@@ -349,47 +829,202 @@ class RDMA_Manager {
   bool Local_Memory_Register(
       char** p2buffpointer, ibv_mr** p2mrpointer, size_t size,
       Chunk_type pool_name);  // register the memory on the local side
-  // bulk deallocation preparation.
-  bool Remote_Memory_Deallocation_Fetch_Buff(uint64_t** ptr, size_t size,
-                                             uint8_t target_node_id);
-  // The RPC to bulk deallocation.
-  void Memory_Deallocation_RPC(uint8_t target_node_id);
+  // Queue the "num" chunks at "addrs", which "target_node_id" created, for
+  // its garbage collection. Returns at once; the reclaimer thread ships
+  // them in batches.
+  void Remote_Memory_Deallocate(const uint64_t* addrs, size_t num,
+                                uint8_t target_node_id);
+  // The status "target_node_id" published last, if it is at most
+  // "max_age_micros" old.
+  bool Get_Memory_Node_Status(uint8_t target_node_id, uint64_t max_age_micros,
+                              Memory_Node_Status* status);
   //TODO: Make it register not per 1GB, allocate and register the memory all at once.
   bool Preregister_Memory(int gb_number); //Pre register the memroy do not allocate bit map
+  // With config_t::pmem_path, the first Preregister_Memory() of a memory
+  // node maps its regions from one file of the directory, which keeps what
+  // was written to them across restarts. The file is as large as the
+  // largest preregistration so far.
+  bool Has_Persistent_Memory() const { return pmem_base_ != nullptr; }
+  // The offset in the persistent memory file of the "size" bytes at "addr",
+  // false if they are not all in it.
+  bool Persistent_Offset(const void* addr, size_t size,
+                         uint64_t* offset) const;
+  // Make the "size" bytes at "addr" of the persistent memory durable: write
+  // back their cache lines with clwb, or clflushopt or clflush where the
+  // CPU lacks it, on a DAX mapping, or msync() them otherwise. The writes
+  // of the NIC may sit in the cache as well.
+  bool Persist_Range(const void* addr, size_t size);
+  // After a restart, turn the "extents" of the persistent memory, offsets
+  // and lengths, into chunks in place, in the order given, before anything
+  // else is allocated from the preregistered regions. The regions they are
+  // in join the FlushBuffer pool with the slots under an extent taken. All
+  // the extents of the node go in one call. False, with nothing changed, if
+  // an extent is out of the file or in a region already used.
+  bool Adopt_Persistent_Chunks(
+      const std::vector<std::pair<uint64_t, uint32_t>>& extents,
+      std::vector<ibv_mr*>* chunks);
   // Remote Memory registering will call RDMA send and receive to the remote memory it also push the new SST bit map to the Remote_Mem_Bitmap
+  // and to the Remote_Region_Index. The RPC runs without remote_mem_mutex,
+  // which is only taken to add the region.
   bool Remote_Memory_Register(size_t size, uint8_t target_node_id);
+  // Give the empty regions at the end of the index of "target_node_id" back
+  // to the memory node, as long as a quarter of a region stays free, and
+  // keeping one region. Returns the regions released.
+  size_t Release_Empty_Remote_Regions(uint8_t target_node_id);
+  // Take the remote slots from the first regions with free ones rather than
+  // from the last one used, so that the last regions drain as their tables
+  // are compacted away, and let the reclaimer thread release them every
+  // kReclaimInterval, see Release_Empty_Remote_Regions().
+  void Set_Remote_Region_Release(bool release) {
+    remote_region_release_.store(release);
+  }
+  // Read "size" bytes at "offset" of the cold table "file_id" of
+  // "target_node_id" into "local_mr", through the memory node. Returns false
+  // if the memory node failed to read them.
+  bool Remote_Cold_Read(uint64_t file_id, uint64_t offset, size_t size,
+                        ibv_mr* local_mr, uint8_t target_node_id);
+  // Have "target_node_id" load the cold table "file_id" of "level" back into
+  // its memory, and write the edit adding the loaded table into "edit_mr".
+  // Returns the size of the edit, 0 if the memory node failed to load it.
+  size_t Remote_Promote_SSTable(uint64_t file_id, uint8_t level,
+                                ibv_mr* edit_mr, uint8_t target_node_id);
   int Remote_Memory_Deregister();
   // new query pair creation and connection to remote Memory by RDMA send and receive
   bool Remote_Query_Pair_Connection(std::string& qp_type,
                                     uint8_t target_node_id);  // Only called by client.
+  // Create and connect "num" thread local queue pairs of "qp_type" to the
+  // node ahead of their use, with the create_qp_ calls sent in one batch. A
+  // thread takes one of them at its first request to the node rather than
+  // connecting its own. Returns how many were added.
+  int Fill_QP_Pool(QP_Type qp_type, uint8_t target_node_id, int num);
 
   int RDMA_Read(ibv_mr* remote_mr, ibv_mr* local_mr, size_t msg_size,
-                std::string qp_type, size_t send_flag, int poll_num,
+                QP_Type qp_type, size_t send_flag, int poll_num,
                 uint8_t target_node_id);
+  int RDMA_Read(ibv_mr* remote_mr, ibv_mr* local_mr, size_t msg_size,
+                const std::string& qp_type, size_t send_flag, int poll_num,
+                uint8_t target_node_id) {
+    return RDMA_Read(remote_mr, local_mr, msg_size,
+                     QP_Type_From_String(qp_type), send_flag, poll_num,
+                     target_node_id);
+  }
+  // Chain all the reads into one ibv_post_send on the thread-local read queue
+  // pair of the target node and return immediately, the completion is
+  // tracked by *future. Do not issue synchronous "read_local" reads to the same
+  // node from this thread before the future is done.
+  int RDMA_Read_Batch_Async(const std::vector<RDMA_Read_Request>& requests,
+                            uint8_t target_node_id, RDMA_Read_Future* future);
+  // Read "msg_size" bytes of "remote_mr" on "target_node_id" into a buffer
+  // of the thread, and if they have not come after "hedge_nanos", the same
+  // bytes of "hedge_mr" on "hedge_node_id" too. No hedge if "hedge_mr" is
+  // null or "hedge_nanos" is 0. The first read to complete is used, the
+  // other is abandoned: RDMA cannot take it back, so its buffer is only
+  // reused once it completes. Returns 0 and sets *buffer, which holds the
+  // data until the next hedged read of the thread, *from_node and *nanos,
+  // the latency of the read used. Returns -1 once "deadline" passes, unless
+  // it is the epoch, and the error of the reads if all of them fail.
+  int RDMA_Read_Hedged(ibv_mr* remote_mr, uint8_t target_node_id,
+                       ibv_mr* hedge_mr, uint8_t hedge_node_id,
+                       size_t msg_size, uint64_t hedge_nanos,
+                       std::chrono::steady_clock::time_point deadline,
+                       ibv_mr** buffer, uint8_t* from_node, uint64_t* nanos);
   int RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr, size_t msg_size,
-                 std::string qp_type, size_t send_flag, int poll_num,
+                 QP_Type qp_type, size_t send_flag, int poll_num,
                  uint8_t target_node_id);
+  int RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr, size_t msg_size,
+                 const std::string& qp_type, size_t send_flag, int poll_num,
+                 uint8_t target_node_id) {
+    return RDMA_Write(remote_mr, local_mr, msg_size,
+                      QP_Type_From_String(qp_type), send_flag, poll_num,
+                      target_node_id);
+  }
   int RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr, size_t msg_size,
-                 std::string qp_type, size_t send_flag, int poll_num,
+                 QP_Type qp_type, size_t send_flag, int poll_num,
                  uint8_t target_node_id);
+  // Chain all the writes into one ibv_post_send on the queue pair and return
+  // without waiting. Only the last write and one out of every 64 before it
+  // are signaled, *signaled is set to how many were posted, for the caller
+  // to poll. The queue pair completes in order, so once they are polled all
+  // the writes are done. The caller keeps the writes in flight under the
+  // send queue depth.
+  int RDMA_Write_Batch(const std::vector<RDMA_Write_Request>& requests,
+                       QP_Type qp_type, uint8_t target_node_id,
+                       int* signaled);
+  int RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr, size_t msg_size,
+                 const std::string& qp_type, size_t send_flag, int poll_num,
+                 uint8_t target_node_id) {
+    return RDMA_Write(addr, rkey, local_mr, msg_size,
+                      QP_Type_From_String(qp_type), send_flag, poll_num,
+                      target_node_id);
+  }
   int RDMA_Write_Imme(void* addr, uint32_t rkey, ibv_mr* local_mr,
-                      size_t msg_size, std::string qp_type, size_t send_flag,
+                      size_t msg_size, QP_Type qp_type, size_t send_flag,
                       int poll_num, unsigned int imme, uint8_t target_node_id);
+  // Add "add" to the 8 bytes of "remote_mr" with an RDMA fetch-and-add and
+  // wait for it, the value before the add lands in the first 8 bytes of
+  // "local_mr". Both have to be 8 byte aligned.
+  int RDMA_FAA(const ibv_mr* remote_mr, ibv_mr* local_mr, uint64_t add,
+               QP_Type qp_type, uint8_t target_node_id);
+  int RDMA_Write_Imme(void* addr, uint32_t rkey, ibv_mr* local_mr,
+                      size_t msg_size, const std::string& qp_type,
+                      size_t send_flag, int poll_num, unsigned int imme,
+                      uint8_t target_node_id) {
+    return RDMA_Write_Imme(addr, rkey, local_mr, msg_size,
+                           QP_Type_From_String(qp_type), send_flag, poll_num,
+                           imme, target_node_id);
+  }
   // the coder need to figure out whether the queue pair has two seperated queue,
   // if not, only send_cq==true is a valid option.
   // For a thread-local queue pair, the send_cq does not matter.
-  int poll_completion(ibv_wc* wc_p, int num_entries, std::string qp_type,
+  int poll_completion(ibv_wc* wc_p, int num_entries, QP_Type qp_type,
                       bool send_cq, uint8_t target_node_id);
+  int poll_completion(ibv_wc* wc_p, int num_entries,
+                      const std::string& qp_type, bool send_cq,
+                      uint8_t target_node_id) {
+    return poll_completion(wc_p, num_entries, QP_Type_From_String(qp_type),
+                           send_cq, target_node_id);
+  }
   void BatchGarbageCollection(uint64_t* ptr, size_t size);
   bool Deallocate_Local_RDMA_Slot(ibv_mr* mr, ibv_mr* map_pointer,
                                   Chunk_type buffer_type);
   bool Deallocate_Local_RDMA_Slot(void* p, Chunk_type buff_type);
   //  bool Deallocate_Remote_RDMA_Slot(SST_Metadata* sst_meta);
-  bool Deallocate_Remote_RDMA_Slot(void* p, uint8_t target_node_id);
+  // "size" is the size asked for at the allocation, for the statistics.
+  bool Deallocate_Remote_RDMA_Slot(void* p, uint8_t target_node_id,
+                                   size_t size = 0);
   //TOFIX: There will be memory leak for the remote_mr and mr_input for local/remote memory
   // allocation.
-  void Allocate_Remote_RDMA_Slot(ibv_mr& remote_mr, uint8_t target_node_id);
-  void Allocate_Local_RDMA_Slot(ibv_mr& mr_input, Chunk_type pool_name);
+  // Allocate at least "size" bytes of remote memory, a whole slot of
+  // Table_Size bytes if "size" is 0. The sizes below half a slot get a chunk
+  // of the smallest size class which fits, carved out of a shared slot.
+  void Allocate_Remote_RDMA_Slot(ibv_mr& remote_mr, uint8_t target_node_id,
+                                 size_t size = 0);
+  Remote_Memory_Stats Get_Remote_Memory_Stats(uint8_t target_node_id);
+  // "tag" names the caller for Set_Slot_Tracking().
+  void Allocate_Local_RDMA_Slot(ibv_mr& mr_input, Chunk_type pool_name,
+                                const char* tag = __builtin_FUNCTION());
+  // Record the caller of every local slot allocation still held, which
+  // Local_Pools_String() counts per pool. It costs a lock per allocation
+  // and release, and only the slots allocated after it are tracked.
+  void Set_Slot_Tracking(bool track) { slot_tracking_.store(track); }
+  // Let the reclaimer thread register a region ahead for the local pools
+  // with few free slots left, and deregister the empty regions of the pools
+  // mostly unused, every kReclaimInterval, see Resize_Local_Pools().
+  void Set_Pool_Resizing(bool resize) { pool_resizing_.store(resize); }
+  // Grow the local pools more than kPoolGrowPercent in use by a region, and
+  // give back the empty regions of a pool as long as it stays less than
+  // kPoolShrinkPercent in use, keeping one region per pool.
+  void Resize_Local_Pools();
+  // The slots in use, their high-water mark, the regions and the resizes
+  // of every local pool, and the slots held per caller if tracked.
+  std::string Local_Pools_String();
+  // The slots of "pool_name" in use now and at most so far.
+  int64_t Local_Slots_In_Use(Chunk_type pool_name) const {
+    return slots_in_use_[pool_name].load(std::memory_order_relaxed);
+  }
+  int64_t Local_Slots_High_Water(Chunk_type pool_name) const {
+    return slots_high_water_[pool_name].load(std::memory_order_relaxed);
+  }
   size_t Calculate_size_of_pool(Chunk_type pool_name);
   // this function will determine whether the pointer is with in the registered memory
   bool CheckInsideLocalBuff(
@@ -399,9 +1034,54 @@ class RDMA_Manager {
   bool CheckInsideRemoteBuff(void* p, uint8_t target_node_id);
   void mr_serialization(char*& temp, size_t& size, ibv_mr* mr);
   void mr_deserialization(char*& temp, size_t& size, ibv_mr*& mr);
+  // Set how poll_completion waits on the queue pairs of a class. A completion
+  // channel is attached to the completion queues created after this call, so
+  // set it before the queue pairs are connected. Only the thread local
+  // classes can be adaptive, the "main" completion queue is shared.
+  void Set_Poll_Policy(QP_Type qp_type, const Poll_Policy& policy) {
+    assert(qp_type != QP_MAIN || policy.mode == POLL_BUSY);
+    poll_policy_[qp_type] = policy;
+  }
+  // Share "num_per_node" "read_local" queue pairs to every node among all the
+  // threads, rather than one for each thread and node, to bound the queue
+  // pairs the NIC has to cache. A thread takes the one of the core it first
+  // reads on, and holds its lock from the post of a read to its completion,
+  // so batched reads are waited for before RDMA_Read_Batch_Async() returns.
+  // 0, the default, keeps them thread local. Set it before the first read.
+  void Set_Shared_Read_QPs(int num_per_node) {
+    shared_read_qps_ = num_per_node;
+  }
+  // Polls spent in and sleeps woken up by poll_completion for a class.
+  uint64_t Get_Poll_Spins(QP_Type qp_type) const {
+    return poll_spin_count_[qp_type].load(std::memory_order_relaxed);
+  }
+  uint64_t Get_Poll_Wakeups(QP_Type qp_type) const {
+    return poll_wakeup_count_[qp_type].load(std::memory_order_relaxed);
+  }
+  // The ports in use, see config_t::num_ports. Port i is ib_port + i.
+  size_t Num_Ports() const {
+    return std::max<size_t>(1, res->port_attrs.size());
+  }
+  // Bytes this node read and wrote over the port, in the one-sided requests
+  // it posted.
+  uint64_t Get_Port_Bytes(size_t port_index) const {
+    return port_bytes_[port_index].load(std::memory_order_relaxed);
+  }
+  // The qp_num, lid and gid of "qp", for the other side to connect to it.
+  void Local_QP_Config(ibv_qp* qp, registered_qp_config* config);
+  // The requests, bytes, outstanding completions and errors of every queue
+  // pair class and node, and the completion latencies, summed over the
+  // threads, then the polls and wakeups of poll_completion per class.
+  std::string Stats_String();
+  int try_poll_completions(ibv_wc* wc_p, int num_entries, QP_Type qp_type,
+                           bool send_cq, uint8_t target_node_id);
   int try_poll_completions(ibv_wc* wc_p, int num_entries,
-                                       std::string& qp_type, bool send_cq,
-                                       uint8_t target_node_id);
+                           const std::string& qp_type, bool send_cq,
+                           uint8_t target_node_id) {
+    return try_poll_completions(wc_p, num_entries,
+                                QP_Type_From_String(qp_type), send_cq,
+                                target_node_id);
+  }
   void fs_serialization(
       char*& buff, size_t& size, std::string& db_name,
       std::unordered_map<std::string, SST_Metadata*>& file_to_sst_meta,
@@ -412,7 +1092,28 @@ class RDMA_Manager {
       std::unordered_map<std::string, SST_Metadata*>& file_to_sst_meta,
       std::map<void*, In_Use_Array*>& remote_mem_bitmap, ibv_mr* local_mr);
   //  void mem_pool_serialization
-  bool poll_reply_buffer(RDMA_Reply* rdma_reply);
+  // Wait until the remote side has written *rdma_reply, spinning with pause
+  // hints for the short RPCs and yielding the core between the checks after
+  // that. Returns false if "timeout_micros", unless it is 0, passes first.
+  bool poll_reply_buffer(RDMA_Reply* rdma_reply, uint64_t timeout_micros = 0);
+  // Whether *rdma_reply has arrived, without waiting, for the callers which
+  // overlap other work with the RPC.
+  static bool check_reply_buffer(const RDMA_Reply* rdma_reply);
+  // A Message slot for an RPC_Call, one of the finished calls if there is
+  // one, and its return.
+  void Allocate_RPC_Slot(ibv_mr& mr, const char* tag = __builtin_FUNCTION());
+  void Deallocate_RPC_Slot(const ibv_mr& mr);
+  // Post the "num" requests of "size" bytes in "mr_list" to the main queue
+  // pair of the node with one doorbell. Only the last one is signaled.
+  int post_send_batch(ibv_mr* const* mr_list, size_t num, size_t size,
+                      uint8_t target_node_id);
+  // IBV_SEND_INLINE if "size" bytes fit in the work request of every queue
+  // pair, so that the NIC need not read them from the memory.
+  unsigned int Inline_Flag(size_t size) const {
+    return size <= max_inline_data_.load(std::memory_order_relaxed)
+               ? IBV_SEND_INLINE
+               : 0;
+  }
   // TODO: Make all the variable more smart pointers.
   resources* res = nullptr;
   std::vector<ibv_mr*>
@@ -423,6 +1124,7 @@ class RDMA_Manager {
   std::list<ibv_mr*> pre_allocated_pool;
 //  std::map<void*, In_Use_Array*>* Remote_Mem_Bitmap;
   std::map<uint8_t, std::map<void*, In_Use_Array*>*> Remote_Mem_Bitmap;
+  std::map<uint8_t, Remote_Region_Index*> Remote_Region_Indexes;
   size_t total_registered_size;
   //  std::shared_mutex remote_pool_mutex;
   //  std::map<void*, In_Use_Array>* Write_Local_Mem_Bitmap = nullptr;
@@ -449,6 +1151,50 @@ class RDMA_Manager {
   std::map<uint8_t, ThreadLocalPtr*> cq_local_read;
   std::map<uint8_t, ThreadLocalPtr*> local_read_qp_info;
   ThreadLocalPtr* read_buffer;
+  // The slots kept by every thread, see Allocate_Iterator_Buffer().
+  ThreadLocalPtr* iterator_buffers;
+  // The buffers and the abandoned reads of every thread, see
+  // RDMA_Read_Hedged().
+  ThreadLocalPtr* hedged_reads;
+  // Null unless config_t::cxl_path is set.
+  std::unique_ptr<CXL_Transport> cxl_;
+  // Key of this manager in the thread local queue pair cache.
+  const uint64_t instance_id_;
+  Poll_Policy poll_policy_[QP_TYPE_NUM];
+  // A "read_local" queue pair shared by the threads, see
+  // Set_Shared_Read_QPs().
+  struct Shared_QP {
+    ibv_qp* qp = nullptr;
+    ibv_cq* cq = nullptr;
+    uint8_t port = 0;
+    // Held from a post to its completion.
+    std::mutex mtx;
+  };
+  int shared_read_qps_ = 0;
+  std::mutex shared_read_qps_mtx_;
+  // node id -> its shared_read_qps_ queue pairs, connected on first use.
+  // Protected by shared_read_qps_mtx_.
+  std::map<uint8_t, std::unique_ptr<Shared_QP[]>> shared_read_qp_map_;
+#ifdef DCTRANSPORT
+  // The DC target of a memory node and the way to it.
+  struct DC_Target {
+    ibv_ah* ah;
+    uint32_t dct_num;
+  };
+  // node id -> its DC target, for the memory nodes which have one.
+  // Protected by qp_cq_map_mutex.
+  std::map<uint8_t, DC_Target> dc_targets_;
+  // The DC initiator of every thread, which takes the place of its
+  // "read_local" queue pairs to all the memory nodes with a DC target.
+  ThreadLocalPtr* qp_local_dci_;
+  ThreadLocalPtr* cq_local_dci_;
+#endif
+  // The DC target of this memory node, see Create_DC_Target().
+  ibv_qp* dct_ = nullptr;
+  ibv_srq* dct_srq_ = nullptr;
+  ibv_cq* dct_cq_ = nullptr;
+  std::atomic<uint64_t> poll_spin_count_[QP_TYPE_NUM] = {};
+  std::atomic<uint64_t> poll_wakeup_count_[QP_TYPE_NUM] = {};
 
 //  ThreadLocalPtr* qp_local_write_flush;
 //  ThreadLocalPtr* cq_local_write_flush;
@@ -470,14 +1216,15 @@ class RDMA_Manager {
   static uint8_t node_id;
   std::unordered_map<uint8_t, ibv_mr*> comm_thread_recv_mrs;
   std::unordered_map<uint8_t , int> comm_thread_buffer;
-  std::map<uint8_t, uint64_t*> deallocation_buffers;
-  std::map<uint8_t, std::mutex*> dealloc_mtx;
-  std::map<uint8_t, std::condition_variable*> dealloc_cv;
+  std::map<uint8_t, Remote_Dealloc_Queue*> dealloc_queues;
+  std::mutex reclaim_mtx;
+  std::condition_variable reclaim_cv;
+  bool reclaim_shutdown = false;  // Protected by reclaim_mtx.
+  std::thread reclaim_thread;
 
   std::atomic<uint64_t> main_comm_thread_ready_num = 0;
-//  uint64_t deallocation_buffers[REMOTE_DEALLOC_BUFF_SIZE / sizeof(uint64_t)];
+  // The registered buffer a batch of dealloc_queues is written from.
   std::map<uint8_t, ibv_mr*>  dealloc_mr;
-  std::map<uint8_t, size_t>  top;
 
   // The variables for immutable notification RPC.
   std::map<uint8_t, std::mutex*> mtx_imme_map;
@@ -510,7 +1257,12 @@ class RDMA_Manager {
   // use thread local qp and cq instead of map, this could be lock free.
   //  static __thread std::string thread_id;
   template <typename T>
-  int post_send(ibv_mr* mr, uint8_t target_node_id, std::string qp_type = "main") {
+  int post_send(ibv_mr* mr, uint8_t target_node_id,
+                const std::string& qp_type) {
+    return post_send<T>(mr, target_node_id, QP_Type_From_String(qp_type));
+  }
+  template <typename T>
+  int post_send(ibv_mr* mr, uint8_t target_node_id, QP_Type qp_type = QP_MAIN) {
     struct ibv_send_wr sr;
     struct ibv_sge sge;
     struct ibv_send_wr* bad_wr = NULL;
@@ -539,7 +1291,7 @@ class RDMA_Manager {
     sr.sg_list = &sge;
     sr.num_sge = 1;
     sr.opcode = static_cast<ibv_wr_opcode>(IBV_WR_SEND);
-    sr.send_flags = IBV_SEND_SIGNALED;
+    sr.send_flags = IBV_SEND_SIGNALED | Inline_Flag(sizeof(T));
 
     /* there is a Receive Request in the responder side, so we won't get any into RNR flow */
     //*(start) = std::chrono::steady_clock::now();
@@ -550,34 +1302,12 @@ class RDMA_Manager {
 //    else
 //      rc = ibv_post_send(res->qp_map[qp_id], &sr, &bad_wr);
     ibv_qp* qp;
-    if (qp_type == "read_local"){
-      //    assert(false);// Never comes to here
-      qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(qp_type,target_node_id);
-        qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-      }
-      rc = ibv_post_send(qp, &sr, &bad_wr);
-    }else if (qp_type == "write_local_flush"){
-      qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(qp_type,target_node_id);
-        qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-      }
-      rc = ibv_post_send(qp, &sr, &bad_wr);
-
-    }else if (qp_type == "write_local_compact"){
-      qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(qp_type,target_node_id);
-        qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-      }
-      rc = ibv_post_send(qp, &sr, &bad_wr);
-    } else {
-      std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-      rc = ibv_post_send(res->qp_map.at(target_node_id), &sr, &bad_wr);
-      l.unlock();
-    }
+    qp = Get_QP(qp_type, target_node_id);
+    rc = ibv_post_send(qp, &sr, &bad_wr);
+    if (rc == 0)
+      Count_Posted(qp_type, target_node_id, 1, sizeof(T), 1);
+    else
+      Count_Completed(qp_type, target_node_id, 0, 1);
 //    if (rc)
 //      fprintf(stderr, "failed to post SR\n");
 //    else {
@@ -593,15 +1323,128 @@ class RDMA_Manager {
 
  private:
   config_t rdma_config;
+  // The Message slots of the finished RPC_Calls.
+  std::mutex rpc_slots_mtx;
+  std::vector<ibv_mr> rpc_slots;
+  // The inline data all the queue pairs created so far take, lowered when
+  // the device gives one less.
+  std::atomic<uint32_t> max_inline_data_{RDMA_MAX_INLINE_DATA};
+  // The shared receive queue of the main queue pairs and its buffers, set up
+  // before the connections.
+  ibv_srq* srq_ = nullptr;
+  ibv_cq* srq_cq_ = nullptr;
+  std::vector<ibv_mr> srq_buffers_;
+  // qp_num -> the node of a main queue pair on srq_. Protected by
+  // qp_cq_map_mutex.
+  std::unordered_map<uint32_t, uint8_t> srq_qp_nodes_;
+  // qp_num -> the port index of every queue pair created. Protected by
+  // qp_cq_map_mutex.
+  std::unordered_map<uint32_t, uint8_t> qp_ports_;
+  // Round robin of the ports for the threads and the memory side queue
+  // pairs.
+  std::atomic<uint32_t> next_port_{0};
+  std::atomic<uint64_t> port_bytes_[RDMA_MAX_PORTS] = {};
+  // A thread local queue pair connected by Fill_QP_Pool().
+  struct Pooled_QP {
+    ibv_qp* qp;
+    ibv_cq* cq;
+    registered_qp_config* remote_con_data;
+  };
+  std::mutex qp_pool_mtx_;
+  ThreadLocalPtr* local_stats_slot_;
+  std::mutex stats_slots_mtx_;
+  // Every slot ever handed out, kept for the threads which come later.
+  // Protected by stats_slots_mtx_.
+  std::vector<RDMA_Stats_Slot*> stats_slots_;
+  // node id -> the queue pairs of the type not taken yet. Protected by
+  // qp_pool_mtx_.
+  std::map<uint8_t, std::vector<Pooled_QP>> qp_pool_[QP_TYPE_NUM];
+  // The length of every buffer Allocate_Registered_Buffer() mapped.
+  // Protected by local_mem_mutex, or taken before the threads start.
+  std::map<void*, size_t> mapped_buffers;
+  // The mapping of config_t::pmem_path, null without one. Set once, before
+  // the regions in it are used.
+  char* pmem_base_ = nullptr;
+  size_t pmem_size_ = 0;
+  // Whether the mapping is MAP_SYNC, so that the stores are durable once
+  // out of the cache, rather than once the page cache is written back.
+  bool pmem_sync_ = false;
+  // The NUMA node of the NIC, -1 if unknown.
+  int nic_numa_node = -1;
+  // The time spent in ibv_reg_mr so far.
+  uint64_t registration_micros = 0;
+  // IBV_ACCESS_ON_DEMAND if the NIC pages the registered memory in itself.
+  int odp_access = 0;
+  // With implicit on-demand paging, the MR of the whole address space. The
+  // regions are then copies of it with their own address and length, and
+  // are not registered at all.
+  ibv_mr* implicit_mr = nullptr;
   int client_sock_connect(const char* servername, int port);
+  // Map "size" bytes of zeroed memory to register, see huge_page_size.
+  char* Allocate_Registered_Buffer(size_t size);
+  // Map the persistent memory file of config_t::pmem_path, "size" bytes or
+  // more if a former run made it larger, and set pmem_base_. Null on error.
+  char* Map_Persistent_Memory(size_t size);
+  // Register "buff" for local and remote access, and account for the time.
+  ibv_mr* Register_Buffer(char* buff, size_t size);
+  // Use on-demand paging if configured and the NIC supports it for RC.
+  void Setup_On_Demand_Paging();
+  // Take a slot out of a region the summary of "index" marks as free.
+  // REQUIRES: remote_mem_mutex held, shared or exclusive.
+  void Allocate_Remote_Whole_Slot(ibv_mr& remote_mr, uint8_t target_node_id,
+                                  Remote_Region_Index* index);
+  // The size class of a chunk of "size" bytes, or -1 for a whole slot.
+  int Remote_Size_Class(size_t size) const;
+  bool Try_Allocate_Remote_RDMA_Slot(ibv_mr& remote_mr,
+                                     Remote_Region_Index* index);
+  // Register the next region of "target_node_id" in the background once its
+  // free slots drop below the watermark, so that the allocations do not
+  // wait for the RPC.
+  void Maybe_Prefetch_Remote_Region(uint8_t target_node_id,
+                                    Remote_Region_Index* index);
+  // The loop of reclaim_thread, which flushes dealloc_queues once a queue
+  // holds a full batch, and every kReclaimInterval otherwise. It refreshes
+  // the status of the memory nodes every kStatusInterval, and resizes the
+  // local pools and releases the empty remote regions every
+  // kReclaimInterval if asked to.
+  void Remote_Reclaimer_Loop();
+  // Count a local slot taken from, or given back to, "pool_name".
+  void Account_Local_Slot(void* addr, Chunk_type pool_name, const char* tag);
+  void Unaccount_Local_Slot(void* addr, Chunk_type pool_name);
+  std::atomic<int64_t> slots_in_use_[kNumChunkTypes] = {};
+  std::atomic<int64_t> slots_high_water_[kNumChunkTypes] = {};
+  // The regions Resize_Local_Pools() registered and deregistered.
+  std::atomic<uint64_t> pool_grows_[kNumChunkTypes] = {};
+  std::atomic<uint64_t> pool_shrinks_[kNumChunkTypes] = {};
+  std::atomic<bool> slot_tracking_{false};
+  std::atomic<bool> pool_resizing_{false};
+  std::atomic<bool> remote_region_release_{false};
+  std::mutex slot_tags_mtx_;
+  // The address of every tracked slot held -> its pool and the caller which
+  // allocated it. Protected by slot_tags_mtx_.
+  std::unordered_map<void*, std::pair<Chunk_type, const char*>> slot_tags_;
+  // Write "addrs" into the ring of "target_node_id" batch by batch, waiting
+  // for room in the ring unless "shutting_down". Returns the addresses
+  // shipped.
+  size_t Ship_Dealloc_Batches(uint8_t target_node_id,
+                              Remote_Dealloc_Queue* queue,
+                              const std::vector<uint64_t>& addrs,
+                              bool shutting_down);
+  // Ask "target_node_id" for its garbage collection ring.
+  bool Remote_GC_Ring_Setup(uint8_t target_node_id,
+                            Remote_Dealloc_Queue* queue);
+  // Read the header of the ring of "target_node_id", for both the consumed
+  // batches and the status.
+  void Refresh_Memory_Node_Status(uint8_t target_node_id,
+                                  Remote_Dealloc_Queue* queue);
 
   int sock_sync_data(int sock, int xfer_size, char* local_data,
                      char* remote_data);
 
-  int post_send(ibv_mr* mr, std::string qp_type, size_t size, uint8_t target_node_id);
+  int post_send(ibv_mr* mr, QP_Type qp_type, size_t size, uint8_t target_node_id);
   //  int post_receives(int len);
 
-  int post_receive(ibv_mr* mr, std::string qp_type, size_t size,
+  int post_receive(ibv_mr* mr, QP_Type qp_type, size_t size,
                    uint8_t target_node_id);
 
   int resources_create();
@@ -621,13 +1464,76 @@ class RDMA_Manager {
   void print_config(void);
   void usage(const char* argv0);
 
-  int post_receive(ibv_mr** mr_list, size_t sge_size, std::string qp_type,
+  int post_receive(ibv_mr** mr_list, size_t sge_size, QP_Type qp_type,
                    uint8_t target_node_id);
-  int post_send(ibv_mr** mr_list, size_t sge_size, std::string qp_type,
+  int post_send(ibv_mr** mr_list, size_t sge_size, QP_Type qp_type,
                 uint8_t target_node_id);
+  // Queue pair and completion queue of "qp_type" to the target node. The
+  // thread local ones are served from a flat per-thread array, and the queue
+  // pair is connected on first use.
+  ibv_qp* Get_QP(QP_Type qp_type, uint8_t target_node_id);
+  // The lock of the queue pair if it is shared by the threads, or nullptr.
+  std::mutex* Shared_QP_Mutex(QP_Type qp_type, uint8_t target_node_id);
+  // Whether a read or write of "target_node_id" goes through the memory
+  // pool of config_t::cxl_path. Only from a compute node, and only for an
+  // operation the caller polls no earlier completion with, as none comes.
+  bool Use_CXL(uint8_t target_node_id, size_t send_flag, int poll_num) const {
+    if (cxl_ == nullptr || node_id % 2 == 0 || target_node_id % 2 != 0) {
+      return false;
+    }
+    const bool signaled = (send_flag & IBV_SEND_SIGNALED) != 0;
+    return poll_num == 1 ? signaled : poll_num == 0 && !signaled;
+  }
+  // Wait for the reads this thread abandoned on the "read_local" queue pair
+  // of the node, whose completions a synchronous read would take for its
+  // own.
+  void Drain_Abandoned_Reads(uint8_t target_node_id);
+  Shared_QP* Get_Shared_Read_QP(uint8_t target_node_id);
+  ibv_cq* Get_CQ(QP_Type qp_type, bool send_cq, uint8_t target_node_id);
+  // ibv_create_qp() with the inline data of max_inline_data_, or none if the
+  // device does not take it.
+  ibv_qp* Create_QP(ibv_qp_init_attr* qp_init_attr);
+  // The port index the thread local queue pairs of this thread are created
+  // on, so the reads of a thread and the writes of a flush or compaction go
+  // out of one port and the threads are spread over all of them.
+  uint8_t Local_Port();
+  // The port index of "qp", 0 for one not created by this manager.
+  uint8_t Port_Of(ibv_qp* qp);
+  // Account "ops" work requests of "bytes" in total, "signaled" of them
+  // signaled, to the port and the stats of the thread.
+  void Count_Posted(QP_Type qp_type, uint8_t target_node_id, size_t ops,
+                    size_t bytes, size_t signaled);
+  void Count_Completed(QP_Type qp_type, uint8_t target_node_id,
+                       size_t completed, size_t errors);
+  void Record_Latency(QP_Type qp_type,
+                      std::chrono::steady_clock::time_point start);
+  RDMA_Stats_Slot* Get_Stats_Slot();
+#ifdef DCTRANSPORT
+  // The DC initiator of this thread, created on first use. nullptr if the
+  // device can not, then the "read_local" queue pairs are used.
+  ibv_qp* Get_Local_DCI();
+#endif
+  // ibv_post_send(), or the same work requests through the DC initiator to
+  // the DC target of the node if "qp" is one.
+  int Post_Send(ibv_qp* qp, uint8_t target_node_id, ibv_send_wr* wr,
+                ibv_send_wr** bad_wr);
+  ThreadLocalPtr* Local_QP_Ptr(QP_Type qp_type, uint8_t target_node_id);
+  ThreadLocalPtr* Local_CQ_Ptr(QP_Type qp_type, uint8_t target_node_id);
+  ThreadLocalPtr* Local_QP_Info_Ptr(QP_Type qp_type, uint8_t target_node_id);
+  // Give this thread its queue pair of "qp_type" to the node, from the pool
+  // if there is one left, or by Remote_Query_Pair_Connection().
+  void Connect_Local_QP(QP_Type qp_type, uint8_t target_node_id);
+  // Create a completion queue, with a completion channel if the class polls
+  // adaptively.
+  ibv_cq* Create_CQ(QP_Type qp_type, int cq_size);
+  template <typename T>
+  int post_receive(ibv_mr* mr, uint8_t target_node_id,
+                   const std::string& qp_type) {
+    return post_receive<T>(mr, target_node_id, QP_Type_From_String(qp_type));
+  }
   template <typename T>
   int post_receive(ibv_mr* mr, uint8_t target_node_id,
-                   std::string qp_type = "main") {
+                   QP_Type qp_type = QP_MAIN) {
     struct ibv_recv_wr rr;
     struct ibv_sge sge;
     struct ibv_recv_wr* bad_wr;
@@ -661,34 +1567,8 @@ class RDMA_Manager {
 //    else
 //      rc = ibv_post_recv(res->qp_map[qp_id], &rr, &bad_wr);
     ibv_qp* qp;
-    if (qp_type == "read_local"){
-      //    assert(false);// Never comes to here
-      qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(qp_type,target_node_id);
-        qp = static_cast<ibv_qp*>(qp_local_read.at(target_node_id)->Get());
-      }
-      rc = ibv_post_recv(qp, &rr, &bad_wr);
-    }else if (qp_type == "write_local_flush"){
-      qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(qp_type,target_node_id);
-        qp = static_cast<ibv_qp*>(qp_local_write_flush.at(target_node_id)->Get());
-      }
-      rc = ibv_post_recv(qp, &rr, &bad_wr);
-
-    }else if (qp_type == "write_local_compact"){
-      qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(qp_type,target_node_id);
-        qp = static_cast<ibv_qp*>(qp_local_write_compact.at(target_node_id)->Get());
-      }
-      rc = ibv_post_recv(qp, &rr, &bad_wr);
-    } else {
-      std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-      rc = ibv_post_recv(res->qp_map.at(target_node_id), &rr, &bad_wr);
-      l.unlock();
-    }
+    qp = Get_QP(qp_type, target_node_id);
+    rc = ibv_post_recv(qp, &rr, &bad_wr);
 //    if (rc)
 //#ifndef NDEBUG
 //      fprintf(stderr, "failed to post RR\n");
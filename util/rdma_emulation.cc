@@ -0,0 +1,851 @@
+#include "util/rdma_emulation.h"
+
+#ifdef RDMA_EMULATION
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace dLSM {
+namespace emu {
+
+namespace {
+
+const char kRegistryDir[] = "/dev/shm/dlsm_rdma_emulation";
+// The payload of a datagram, the longer sends are split into fragments.
+const size_t kFragmentSize = 32 * 1024;
+
+enum MessageType : uint32_t { kSend, kWriteImm, kAtomic, kAtomicDone };
+
+struct MessageHeader {
+  uint32_t type;
+  uint32_t dest_qp_num;
+  uint32_t src_qp_num;
+  int32_t src_pid;
+  uint32_t imm_data;
+  uint32_t has_imm;
+  // The bytes of the send, or written by a write with immediate, and the
+  // offset of the fragment in them.
+  uint32_t length;
+  uint32_t offset;
+  // When the completion of the receiver is due.
+  uint64_t ready_at;
+  // The atomics.
+  uint64_t remote_addr;
+  uint64_t add;
+  uint64_t local_addr;
+  uint64_t wr_id;
+  uint32_t signaled;
+};
+
+uint64_t NowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct Completion {
+  ibv_wc wc;
+  uint64_t ready_at;
+};
+
+struct EmuCQ;
+
+struct EmuChannel {
+  ibv_comp_channel channel;
+  std::mutex mu;
+  std::condition_variable cv;
+  std::deque<EmuCQ*> events;
+};
+
+struct EmuCQ {
+  ibv_cq cq;
+  std::mutex mu;
+  std::deque<Completion> entries;
+  bool armed = false;
+};
+
+struct RecvRequest {
+  uint64_t wr_id;
+  std::vector<ibv_sge> sges;
+};
+
+struct EmuQP;
+
+// A send or a write with immediate which arrived at a QP.
+struct Arrival {
+  EmuQP* qp;
+  MessageHeader header;
+  std::string payload;
+};
+
+// The posted receives of a QP, or of a shared receive queue, and the
+// messages which arrived before them.
+struct RecvQueue {
+  std::mutex mu;
+  std::deque<RecvRequest> requests;
+  std::deque<Arrival> arrivals;
+};
+
+struct EmuSRQ {
+  ibv_srq srq;
+  RecvQueue rq;
+};
+
+struct EmuQP {
+  ibv_qp qp;
+  bool sq_sig_all = false;
+  RecvQueue own_rq;
+  RecvQueue* rq = nullptr;
+  uint32_t dest_qp_num = 0;
+  pid_t dest_pid = 0;
+};
+
+void Notify(EmuChannel* channel, EmuCQ* cq) {
+  std::lock_guard<std::mutex> l(channel->mu);
+  channel->events.push_back(cq);
+  channel->cv.notify_one();
+}
+
+void PushCompletion(ibv_cq* ibcq, const ibv_wc& wc, uint64_t ready_at) {
+  EmuCQ* cq = reinterpret_cast<EmuCQ*>(ibcq);
+  EmuChannel* channel = nullptr;
+  {
+    std::lock_guard<std::mutex> l(cq->mu);
+    cq->entries.push_back({wc, ready_at});
+    if (cq->armed) {
+      cq->armed = false;
+      channel = reinterpret_cast<EmuChannel*>(cq->cq.channel);
+    }
+  }
+  if (channel != nullptr) {
+    Notify(channel, cq);
+  }
+}
+
+// Scatter "arrival" into the buffers of "request" and complete it.
+void Receive(const Arrival& arrival, const RecvRequest& request) {
+  ibv_wc wc;
+  memset(&wc, 0, sizeof(wc));
+  wc.wr_id = request.wr_id;
+  wc.status = IBV_WC_SUCCESS;
+  wc.opcode = arrival.header.type == kWriteImm ? IBV_WC_RECV_RDMA_WITH_IMM
+                                               : IBV_WC_RECV;
+  wc.byte_len = arrival.header.length;
+  wc.qp_num = arrival.qp->qp.qp_num;
+  wc.src_qp = arrival.header.src_qp_num;
+  if (arrival.header.has_imm) {
+    wc.wc_flags = IBV_WC_WITH_IMM;
+    wc.imm_data = arrival.header.imm_data;
+  }
+  size_t copied = 0;
+  for (const ibv_sge& sge : request.sges) {
+    if (copied == arrival.payload.size()) break;
+    size_t n = std::min<size_t>(sge.length, arrival.payload.size() - copied);
+    memcpy(reinterpret_cast<void*>(sge.addr), arrival.payload.data() + copied,
+           n);
+    copied += n;
+  }
+  if (copied < arrival.payload.size()) {
+    wc.status = IBV_WC_LOC_LEN_ERR;
+  }
+  PushCompletion(arrival.qp->qp.recv_cq, wc, arrival.header.ready_at);
+}
+
+void Arrive(Arrival&& arrival) {
+  RecvQueue* rq = arrival.qp->rq;
+  RecvRequest request;
+  {
+    std::lock_guard<std::mutex> l(rq->mu);
+    if (rq->requests.empty()) {
+      rq->arrivals.push_back(std::move(arrival));
+      return;
+    }
+    request = std::move(rq->requests.front());
+    rq->requests.pop_front();
+  }
+  Receive(arrival, request);
+}
+
+void PostReceives(RecvQueue* rq, ibv_recv_wr* wr) {
+  for (; wr != nullptr; wr = wr->next) {
+    RecvRequest request;
+    request.wr_id = wr->wr_id;
+    request.sges.assign(wr->sg_list, wr->sg_list + wr->num_sge);
+    Arrival arrival;
+    {
+      std::lock_guard<std::mutex> l(rq->mu);
+      if (rq->arrivals.empty()) {
+        rq->requests.push_back(std::move(request));
+        continue;
+      }
+      arrival = std::move(rq->arrivals.front());
+      rq->arrivals.pop_front();
+    }
+    Receive(arrival, request);
+  }
+}
+
+// The emulated NIC of the process.
+class Device {
+ public:
+  static Device* Get() {
+    static Device* device = new Device();
+    return device;
+  }
+
+  bool ok() const { return fd_ >= 0; }
+  pid_t pid() const { return pid_; }
+
+  // When a transfer of "bytes" posted now completes at the other side.
+  uint64_t Reserve(size_t bytes) {
+    const uint64_t now = NowNanos();
+    if (ns_per_byte_ == 0) {
+      return now + latency_ns_;
+    }
+    const uint64_t transfer = static_cast<uint64_t>(bytes * ns_per_byte_);
+    uint64_t free_at = link_free_at_.load();
+    uint64_t done;
+    do {
+      done = std::max(free_at, now) + transfer;
+    } while (!link_free_at_.compare_exchange_weak(free_at, done));
+    return done + latency_ns_;
+  }
+
+  // Give "qp" a QP number no process on the host uses and publish it.
+  bool AddQP(EmuQP* qp) {
+    std::lock_guard<std::mutex> l(qps_mu_);
+    for (int attempt = 0; attempt < 1000; attempt++) {
+      uint32_t qp_num = (rand_() & 0xffffff) | 1;
+      std::string path = RegistryPath(qp_num);
+      int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
+      if (fd < 0 && errno == EEXIST && !OwnerAlive(qp_num)) {
+        // Left over by a process which did not destroy its QPs.
+        unlink(path.c_str());
+        fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
+      }
+      if (fd < 0) {
+        continue;
+      }
+      std::string pid = std::to_string(pid_);
+      bool written = write(fd, pid.data(), pid.size()) ==
+                     static_cast<ssize_t>(pid.size());
+      close(fd);
+      if (!written) {
+        unlink(path.c_str());
+        return false;
+      }
+      qp->qp.qp_num = qp_num;
+      qps_[qp_num] = qp;
+      return true;
+    }
+    return false;
+  }
+
+  void RemoveQP(EmuQP* qp) {
+    std::lock_guard<std::mutex> l(qps_mu_);
+    qps_.erase(qp->qp.qp_num);
+    unlink(RegistryPath(qp->qp.qp_num).c_str());
+  }
+
+  // The process of the QP "qp_num", 0 if there is none.
+  pid_t Owner(uint32_t qp_num) {
+    char buf[32];
+    int fd = open(RegistryPath(qp_num).c_str(), O_RDONLY);
+    if (fd < 0) {
+      return 0;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+      return 0;
+    }
+    buf[n] = '\0';
+    return static_cast<pid_t>(atoi(buf));
+  }
+
+  // Copy between the local "iov" and the "length" bytes at "remote_addr"
+  // of process "pid". False if the remote range can not be accessed.
+  bool Transfer(pid_t pid, const std::vector<iovec>& iov, uint64_t remote_addr,
+                size_t length, bool write) {
+    if (pid == pid_) {
+      char* remote = reinterpret_cast<char*>(remote_addr);
+      for (const iovec& v : iov) {
+        if (write) {
+          memcpy(remote, v.iov_base, v.iov_len);
+        } else {
+          memcpy(v.iov_base, remote, v.iov_len);
+        }
+        remote += v.iov_len;
+      }
+      return true;
+    }
+    iovec remote = {reinterpret_cast<void*>(remote_addr), length};
+    ssize_t n = write ? process_vm_writev(pid, iov.data(), iov.size(), &remote,
+                                          1, 0)
+                      : process_vm_readv(pid, iov.data(), iov.size(), &remote,
+                                         1, 0);
+    return n == static_cast<ssize_t>(length);
+  }
+
+  // Send "header" with "payload" to the device of process "pid", in
+  // fragments if it is long.
+  bool Deliver(pid_t pid, MessageHeader header, const std::string& payload) {
+    sockaddr_un addr;
+    socklen_t addr_len = Address(pid, &addr);
+    std::vector<char> buf(sizeof(MessageHeader) + kFragmentSize);
+    std::lock_guard<std::mutex> l(send_mu_);
+    size_t offset = 0;
+    do {
+      size_t n = std::min(kFragmentSize, payload.size() - offset);
+      header.offset = static_cast<uint32_t>(offset);
+      memcpy(buf.data(), &header, sizeof(header));
+      memcpy(buf.data() + sizeof(header), payload.data() + offset, n);
+      ssize_t rc;
+      do {
+        rc = sendto(fd_, buf.data(), sizeof(header) + n, 0,
+                    reinterpret_cast<sockaddr*>(&addr), addr_len);
+      } while (rc < 0 && errno == EINTR);
+      if (rc < 0) {
+        fprintf(stderr, "RDMA emulation: send to process %d failed: %s\n",
+                pid, strerror(errno));
+        return false;
+      }
+      offset += n;
+    } while (offset < payload.size());
+    return true;
+  }
+
+ private:
+  Device() : pid_(getpid()), rand_(getpid() ^ NowNanos()) {
+    const char* latency = std::getenv("DLSM_RDMA_EMULATION_LATENCY_US");
+    latency_ns_ = latency != nullptr ? std::strtoull(latency, nullptr, 10) * 1000
+                                     : 0;
+    const char* gbps = std::getenv("DLSM_RDMA_EMULATION_GBPS");
+    ns_per_byte_ = gbps != nullptr && std::atof(gbps) > 0
+                       ? 8.0 / std::atof(gbps)
+                       : 0;
+    // The other processes of the host read and write the memory of this one.
+    prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY, 0, 0, 0);
+    mkdir(kRegistryDir, 0777);
+    fd_ = socket(AF_UNIX, SOCK_DGRAM, 0);
+    sockaddr_un addr;
+    socklen_t addr_len = Address(pid_, &addr);
+    if (fd_ >= 0 &&
+        bind(fd_, reinterpret_cast<sockaddr*>(&addr), addr_len) != 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+    if (fd_ < 0) {
+      fprintf(stderr, "RDMA emulation: no socket for the device: %s\n",
+              strerror(errno));
+      return;
+    }
+    std::thread(&Device::Loop, this).detach();
+  }
+
+  static std::string RegistryPath(uint32_t qp_num) {
+    return std::string(kRegistryDir) + "/" + std::to_string(qp_num);
+  }
+
+  bool OwnerAlive(uint32_t qp_num) {
+    pid_t pid = Owner(qp_num);
+    return pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+  }
+
+  // The abstract socket address of the device of process "pid".
+  static socklen_t Address(pid_t pid, sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                     "dlsm_rdma_emulation_%d", pid);
+    return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + n);
+  }
+
+  void Loop() {
+    std::vector<char> buf(sizeof(MessageHeader) + kFragmentSize);
+    // The sends being reassembled, by sending process and QP.
+    std::map<std::pair<pid_t, uint32_t>, std::string> partial;
+    while (true) {
+      ssize_t n = recv(fd_, buf.data(), buf.size(), 0);
+      if (n < static_cast<ssize_t>(sizeof(MessageHeader))) {
+        continue;
+      }
+      MessageHeader header;
+      memcpy(&header, buf.data(), sizeof(header));
+      const char* data = buf.data() + sizeof(header);
+      const size_t data_size = n - sizeof(header);
+      switch (header.type) {
+        case kSend:
+        case kWriteImm: {
+          std::string payload;
+          if (header.type == kSend) {
+            auto key = std::make_pair(header.src_pid, header.src_qp_num);
+            std::string& received = partial[key];
+            received.append(data, data_size);
+            if (received.size() < header.length) {
+              continue;
+            }
+            payload.swap(received);
+            partial.erase(key);
+          }
+          std::lock_guard<std::mutex> l(qps_mu_);
+          auto it = qps_.find(header.dest_qp_num);
+          if (it != qps_.end()) {
+            Arrive(Arrival{it->second, header, std::move(payload)});
+          }
+          break;
+        }
+        case kAtomic: {
+          uint64_t* target = reinterpret_cast<uint64_t*>(header.remote_addr);
+          uint64_t old = __atomic_fetch_add(target, header.add,
+                                            __ATOMIC_SEQ_CST);
+          std::vector<iovec> iov = {{&old, sizeof(old)}};
+          MessageHeader reply = header;
+          reply.type = kAtomicDone;
+          reply.dest_qp_num = header.src_qp_num;
+          if (!Transfer(header.src_pid, iov, header.local_addr, sizeof(old),
+                        true)) {
+            reply.has_imm = 0;
+            reply.signaled = 2;
+          }
+          Deliver(header.src_pid, reply, std::string());
+          break;
+        }
+        case kAtomicDone: {
+          std::lock_guard<std::mutex> l(qps_mu_);
+          auto it = qps_.find(header.dest_qp_num);
+          if (it != qps_.end() && header.signaled != 0) {
+            ibv_wc wc;
+            memset(&wc, 0, sizeof(wc));
+            wc.wr_id = header.wr_id;
+            wc.status =
+                header.signaled == 2 ? IBV_WC_REM_ACCESS_ERR : IBV_WC_SUCCESS;
+            wc.opcode = IBV_WC_FETCH_ADD;
+            wc.byte_len = sizeof(uint64_t);
+            wc.qp_num = header.dest_qp_num;
+            PushCompletion(it->second->qp.send_cq, wc, header.ready_at);
+          }
+          break;
+        }
+      }
+    }
+  }
+
+  int fd_;
+  const pid_t pid_;
+  uint64_t latency_ns_;
+  double ns_per_byte_;
+  std::atomic<uint64_t> link_free_at_{0};
+  std::mutex send_mu_;
+  std::mutex qps_mu_;
+  std::unordered_map<uint32_t, EmuQP*> qps_;
+  std::mt19937 rand_;
+};
+
+ibv_device* TheDevice() {
+  static ibv_device* device = [] {
+    ibv_device* d = new ibv_device();
+    memset(d, 0, sizeof(*d));
+    d->node_type = IBV_NODE_CA;
+    d->transport_type = IBV_TRANSPORT_IB;
+    snprintf(d->name, sizeof(d->name), "emu0");
+    snprintf(d->dev_name, sizeof(d->dev_name), "uverbs_emu0");
+    return d;
+  }();
+  return device;
+}
+
+std::atomic<uint32_t> next_key{1};
+
+}  // namespace
+
+ibv_device** get_device_list(int* num_devices) {
+  ibv_device** list = new ibv_device*[2];
+  list[0] = TheDevice();
+  list[1] = nullptr;
+  if (num_devices != nullptr) {
+    *num_devices = 1;
+  }
+  return list;
+}
+
+void free_device_list(ibv_device** list) { delete[] list; }
+
+const char* get_device_name(ibv_device* device) { return device->name; }
+
+ibv_context* open_device(ibv_device* device) {
+  if (device == nullptr || !Device::Get()->ok()) {
+    return nullptr;
+  }
+  ibv_context* context = new ibv_context();
+  memset(context, 0, sizeof(*context));
+  context->device = device;
+  context->cmd_fd = -1;
+  context->async_fd = -1;
+  context->num_comp_vectors = 1;
+  return context;
+}
+
+int close_device(ibv_context* context) {
+  delete context;
+  return 0;
+}
+
+int query_device(ibv_context* /*context*/, ibv_device_attr* device_attr) {
+  memset(device_attr, 0, sizeof(*device_attr));
+  snprintf(device_attr->fw_ver, sizeof(device_attr->fw_ver), "emulated");
+  device_attr->max_mr_size = UINT64_MAX;
+  device_attr->max_qp = 1 << 20;
+  device_attr->max_qp_wr = 1 << 15;
+  device_attr->max_sge = 30;
+  device_attr->max_cq = 1 << 20;
+  device_attr->max_cqe = 1 << 22;
+  device_attr->max_mr = 1 << 20;
+  device_attr->max_pd = 1 << 10;
+  device_attr->max_srq = 1 << 10;
+  device_attr->max_srq_wr = 1 << 15;
+  device_attr->max_srq_sge = 30;
+  device_attr->atomic_cap = IBV_ATOMIC_HCA;
+  device_attr->phys_port_cnt = 1;
+  return 0;
+}
+
+int query_device_ex(ibv_context* /*context*/,
+                    const ibv_query_device_ex_input* /*input*/,
+                    ibv_device_attr_ex* /*attr*/) {
+  return EOPNOTSUPP;
+}
+
+int query_port(ibv_context* /*context*/, uint8_t /*port_num*/,
+               ibv_port_attr* port_attr) {
+  memset(port_attr, 0, sizeof(*port_attr));
+  port_attr->state = IBV_PORT_ACTIVE;
+  port_attr->max_mtu = IBV_MTU_4096;
+  port_attr->active_mtu = IBV_MTU_4096;
+  port_attr->lid = static_cast<uint16_t>(Device::Get()->pid());
+  port_attr->link_layer = IBV_LINK_LAYER_INFINIBAND;
+  return 0;
+}
+
+int query_gid(ibv_context* /*context*/, uint8_t /*port_num*/, int /*index*/,
+              ibv_gid* gid) {
+  memset(gid, 0, sizeof(*gid));
+  uint64_t pid = static_cast<uint64_t>(Device::Get()->pid());
+  memcpy(gid->raw + 8, &pid, sizeof(pid));
+  return 0;
+}
+
+ibv_pd* alloc_pd(ibv_context* context) {
+  ibv_pd* pd = new ibv_pd();
+  memset(pd, 0, sizeof(*pd));
+  pd->context = context;
+  return pd;
+}
+
+int dealloc_pd(ibv_pd* pd) {
+  delete pd;
+  return 0;
+}
+
+ibv_mr* reg_mr(ibv_pd* pd, void* addr, size_t length, int /*access*/) {
+  if (addr == nullptr) {
+    // No implicit on demand paging.
+    errno = EINVAL;
+    return nullptr;
+  }
+  ibv_mr* mr = new ibv_mr();
+  memset(mr, 0, sizeof(*mr));
+  mr->context = pd->context;
+  mr->pd = pd;
+  mr->addr = addr;
+  mr->length = length;
+  mr->lkey = mr->rkey = next_key.fetch_add(1);
+  mr->handle = mr->lkey;
+  return mr;
+}
+
+int dereg_mr(ibv_mr* mr) {
+  delete mr;
+  return 0;
+}
+
+int advise_mr(ibv_pd* /*pd*/, ibv_advise_mr_advice /*advice*/,
+              uint32_t /*flags*/, ibv_sge* /*sg_list*/, uint32_t /*num_sge*/) {
+  return 0;
+}
+
+ibv_comp_channel* create_comp_channel(ibv_context* context) {
+  EmuChannel* channel = new EmuChannel();
+  memset(&channel->channel, 0, sizeof(channel->channel));
+  channel->channel.context = context;
+  channel->channel.fd = -1;
+  return &channel->channel;
+}
+
+int destroy_comp_channel(ibv_comp_channel* channel) {
+  delete reinterpret_cast<EmuChannel*>(channel);
+  return 0;
+}
+
+ibv_cq* create_cq(ibv_context* context, int cqe, void* cq_context,
+                  ibv_comp_channel* channel, int /*comp_vector*/) {
+  EmuCQ* cq = new EmuCQ();
+  memset(&cq->cq, 0, sizeof(cq->cq));
+  cq->cq.context = context;
+  cq->cq.channel = channel;
+  cq->cq.cq_context = cq_context;
+  cq->cq.cqe = cqe;
+  return &cq->cq;
+}
+
+int destroy_cq(ibv_cq* cq) {
+  delete reinterpret_cast<EmuCQ*>(cq);
+  return 0;
+}
+
+int poll_cq(ibv_cq* ibcq, int num_entries, ibv_wc* wc) {
+  EmuCQ* cq = reinterpret_cast<EmuCQ*>(ibcq);
+  std::lock_guard<std::mutex> l(cq->mu);
+  if (cq->entries.empty()) {
+    return 0;
+  }
+  const uint64_t now = NowNanos();
+  int n = 0;
+  // In order, a completion which is not due holds back the ones after it.
+  while (n < num_entries && !cq->entries.empty() &&
+         cq->entries.front().ready_at <= now) {
+    wc[n++] = cq->entries.front().wc;
+    cq->entries.pop_front();
+  }
+  return n;
+}
+
+int req_notify_cq(ibv_cq* ibcq, int /*solicited_only*/) {
+  EmuCQ* cq = reinterpret_cast<EmuCQ*>(ibcq);
+  bool pending;
+  {
+    std::lock_guard<std::mutex> l(cq->mu);
+    // The completions which are not due yet wake the poller up at once,
+    // it polls until they are.
+    pending = !cq->entries.empty();
+    cq->armed = !pending;
+  }
+  if (pending && cq->cq.channel != nullptr) {
+    Notify(reinterpret_cast<EmuChannel*>(cq->cq.channel), cq);
+  }
+  return 0;
+}
+
+int get_cq_event(ibv_comp_channel* ibchannel, ibv_cq** cq, void** cq_context) {
+  EmuChannel* channel = reinterpret_cast<EmuChannel*>(ibchannel);
+  std::unique_lock<std::mutex> l(channel->mu);
+  channel->cv.wait(l, [channel] { return !channel->events.empty(); });
+  EmuCQ* event = channel->events.front();
+  channel->events.pop_front();
+  *cq = &event->cq;
+  *cq_context = event->cq.cq_context;
+  return 0;
+}
+
+void ack_cq_events(ibv_cq* /*cq*/, unsigned int /*nevents*/) {}
+
+ibv_srq* create_srq(ibv_pd* pd, ibv_srq_init_attr* srq_init_attr) {
+  EmuSRQ* srq = new EmuSRQ();
+  memset(&srq->srq, 0, sizeof(srq->srq));
+  srq->srq.context = pd->context;
+  srq->srq.pd = pd;
+  srq->srq.srq_context = srq_init_attr->srq_context;
+  return &srq->srq;
+}
+
+int destroy_srq(ibv_srq* srq) {
+  delete reinterpret_cast<EmuSRQ*>(srq);
+  return 0;
+}
+
+int post_srq_recv(ibv_srq* srq, ibv_recv_wr* recv_wr,
+                  ibv_recv_wr** /*bad_wr*/) {
+  PostReceives(&reinterpret_cast<EmuSRQ*>(srq)->rq, recv_wr);
+  return 0;
+}
+
+ibv_qp* create_qp(ibv_pd* pd, ibv_qp_init_attr* qp_init_attr) {
+  if (qp_init_attr->qp_type != IBV_QPT_RC) {
+    errno = EOPNOTSUPP;
+    return nullptr;
+  }
+  EmuQP* qp = new EmuQP();
+  memset(&qp->qp, 0, sizeof(qp->qp));
+  qp->qp.context = pd->context;
+  qp->qp.qp_context = qp_init_attr->qp_context;
+  qp->qp.pd = pd;
+  qp->qp.send_cq = qp_init_attr->send_cq;
+  qp->qp.recv_cq = qp_init_attr->recv_cq;
+  qp->qp.srq = qp_init_attr->srq;
+  qp->qp.qp_type = IBV_QPT_RC;
+  qp->qp.state = IBV_QPS_RESET;
+  qp->sq_sig_all = qp_init_attr->sq_sig_all != 0;
+  qp->rq = qp->qp.srq != nullptr
+               ? &reinterpret_cast<EmuSRQ*>(qp->qp.srq)->rq
+               : &qp->own_rq;
+  if (!Device::Get()->AddQP(qp)) {
+    delete qp;
+    errno = ENOMEM;
+    return nullptr;
+  }
+  return &qp->qp;
+}
+
+int modify_qp(ibv_qp* ibqp, ibv_qp_attr* attr, int attr_mask) {
+  EmuQP* qp = reinterpret_cast<EmuQP*>(ibqp);
+  if (attr_mask & IBV_QP_DEST_QPN) {
+    pid_t pid = Device::Get()->Owner(attr->dest_qp_num);
+    if (pid == 0) {
+      fprintf(stderr, "RDMA emulation: no process has QP %u\n",
+              attr->dest_qp_num);
+      return EINVAL;
+    }
+    qp->dest_qp_num = attr->dest_qp_num;
+    qp->dest_pid = pid;
+  }
+  if (attr_mask & IBV_QP_STATE) {
+    qp->qp.state = attr->qp_state;
+  }
+  return 0;
+}
+
+int destroy_qp(ibv_qp* ibqp) {
+  EmuQP* qp = reinterpret_cast<EmuQP*>(ibqp);
+  Device::Get()->RemoveQP(qp);
+  delete qp;
+  return 0;
+}
+
+int post_send(ibv_qp* ibqp, ibv_send_wr* wr, ibv_send_wr** bad_wr) {
+  EmuQP* qp = reinterpret_cast<EmuQP*>(ibqp);
+  Device* device = Device::Get();
+  for (; wr != nullptr; wr = wr->next) {
+    if (qp->dest_pid == 0) {
+      *bad_wr = wr;
+      return EINVAL;
+    }
+    std::vector<iovec> iov;
+    size_t length = 0;
+    for (int i = 0; i < wr->num_sge; i++) {
+      iov.push_back({reinterpret_cast<void*>(wr->sg_list[i].addr),
+                     wr->sg_list[i].length});
+      length += wr->sg_list[i].length;
+    }
+    const bool signaled =
+        qp->sq_sig_all || (wr->send_flags & IBV_SEND_SIGNALED) != 0;
+    const uint64_t ready_at = device->Reserve(length);
+    ibv_wc wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.wr_id = wr->wr_id;
+    wc.status = IBV_WC_SUCCESS;
+    wc.qp_num = qp->qp.qp_num;
+    MessageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.dest_qp_num = qp->dest_qp_num;
+    header.src_qp_num = qp->qp.qp_num;
+    header.src_pid = device->pid();
+    header.length = static_cast<uint32_t>(length);
+    header.ready_at = ready_at;
+    switch (wr->opcode) {
+      case IBV_WR_RDMA_READ:
+        wc.opcode = IBV_WC_RDMA_READ;
+        wc.byte_len = static_cast<uint32_t>(length);
+        if (!device->Transfer(qp->dest_pid, iov, wr->wr.rdma.remote_addr,
+                              length, false)) {
+          wc.status = IBV_WC_REM_ACCESS_ERR;
+        }
+        break;
+      case IBV_WR_RDMA_WRITE:
+      case IBV_WR_RDMA_WRITE_WITH_IMM:
+        wc.opcode = IBV_WC_RDMA_WRITE;
+        if (!device->Transfer(qp->dest_pid, iov, wr->wr.rdma.remote_addr,
+                              length, true)) {
+          wc.status = IBV_WC_REM_ACCESS_ERR;
+        } else if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+          header.type = kWriteImm;
+          header.has_imm = 1;
+          header.imm_data = wr->imm_data;
+          if (!device->Deliver(qp->dest_pid, header, std::string())) {
+            wc.status = IBV_WC_RETRY_EXC_ERR;
+          }
+        }
+        break;
+      case IBV_WR_SEND:
+      case IBV_WR_SEND_WITH_IMM: {
+        wc.opcode = IBV_WC_SEND;
+        std::string payload;
+        payload.reserve(length);
+        for (const iovec& v : iov) {
+          payload.append(static_cast<const char*>(v.iov_base), v.iov_len);
+        }
+        header.type = kSend;
+        if (wr->opcode == IBV_WR_SEND_WITH_IMM) {
+          header.has_imm = 1;
+          header.imm_data = wr->imm_data;
+        }
+        if (!device->Deliver(qp->dest_pid, header, payload)) {
+          wc.status = IBV_WC_RETRY_EXC_ERR;
+        }
+        break;
+      }
+      case IBV_WR_ATOMIC_FETCH_AND_ADD:
+        // The device of the other side completes it.
+        header.type = kAtomic;
+        header.remote_addr = wr->wr.atomic.remote_addr;
+        header.add = wr->wr.atomic.compare_add;
+        header.local_addr = wr->sg_list[0].addr;
+        header.wr_id = wr->wr_id;
+        header.signaled = signaled ? 1 : 0;
+        if (device->Deliver(qp->dest_pid, header, std::string())) {
+          continue;
+        }
+        wc.opcode = IBV_WC_FETCH_ADD;
+        wc.status = IBV_WC_RETRY_EXC_ERR;
+        break;
+      default:
+        *bad_wr = wr;
+        return EINVAL;
+    }
+    if (signaled || wc.status != IBV_WC_SUCCESS) {
+      PushCompletion(qp->qp.send_cq, wc, ready_at);
+    }
+  }
+  return 0;
+}
+
+int post_recv(ibv_qp* ibqp, ibv_recv_wr* wr, ibv_recv_wr** /*bad_wr*/) {
+  PostReceives(reinterpret_cast<EmuQP*>(ibqp)->rq, wr);
+  return 0;
+}
+
+}  // namespace emu
+}  // namespace dLSM
+
+#endif  // RDMA_EMULATION
@@ -0,0 +1,111 @@
+#ifndef STORAGE_dLSM_UTIL_RDMA_EMULATION_H_
+#define STORAGE_dLSM_UTIL_RDMA_EMULATION_H_
+
+// A software RDMA device for running the compute nodes and the memory nodes
+// on one host without an RDMA NIC, enabled by RDMA_EMULATION (the CMake
+// option WITH_RDMA_EMULATION). Included by util/rdma.h right after the verbs
+// header, it maps the verbs RDMA_Manager and the memory node call onto the
+// functions below.
+//
+// Every process is a node with one port. The one-sided reads and writes go
+// straight into the address space of the process owning the remote QP, the
+// sends, the immediates of the writes and the atomics through a datagram
+// socket of that process, which a thread of the device serves. The QP
+// numbers are published under /dev/shm/dlsm_rdma_emulation, so that the
+// QPs exchanged over TCP as usual find the process of the other side. The
+// processes have to run as the same user.
+//
+// The completions can be delayed as a link would, see the environment
+// variables:
+//   DLSM_RDMA_EMULATION_LATENCY_US: the one-way latency, 0 by default.
+//   DLSM_RDMA_EMULATION_GBPS: the bandwidth of the link of every process
+//     in Gbit/s, unlimited by default.
+
+#ifdef RDMA_EMULATION
+#include <infiniband/verbs.h>
+
+namespace dLSM {
+namespace emu {
+
+ibv_device** get_device_list(int* num_devices);
+void free_device_list(ibv_device** list);
+const char* get_device_name(ibv_device* device);
+ibv_context* open_device(ibv_device* device);
+int close_device(ibv_context* context);
+int query_device(ibv_context* context, ibv_device_attr* device_attr);
+// Fails, so that the memory is registered pinned rather than on demand.
+int query_device_ex(ibv_context* context,
+                    const ibv_query_device_ex_input* input,
+                    ibv_device_attr_ex* attr);
+int query_port(ibv_context* context, uint8_t port_num,
+               ibv_port_attr* port_attr);
+int query_gid(ibv_context* context, uint8_t port_num, int index,
+              ibv_gid* gid);
+
+ibv_pd* alloc_pd(ibv_context* context);
+int dealloc_pd(ibv_pd* pd);
+ibv_mr* reg_mr(ibv_pd* pd, void* addr, size_t length, int access);
+int dereg_mr(ibv_mr* mr);
+int advise_mr(ibv_pd* pd, ibv_advise_mr_advice advice, uint32_t flags,
+              ibv_sge* sg_list, uint32_t num_sge);
+
+ibv_comp_channel* create_comp_channel(ibv_context* context);
+int destroy_comp_channel(ibv_comp_channel* channel);
+ibv_cq* create_cq(ibv_context* context, int cqe, void* cq_context,
+                  ibv_comp_channel* channel, int comp_vector);
+int destroy_cq(ibv_cq* cq);
+int poll_cq(ibv_cq* cq, int num_entries, ibv_wc* wc);
+int req_notify_cq(ibv_cq* cq, int solicited_only);
+int get_cq_event(ibv_comp_channel* channel, ibv_cq** cq, void** cq_context);
+void ack_cq_events(ibv_cq* cq, unsigned int nevents);
+
+ibv_srq* create_srq(ibv_pd* pd, ibv_srq_init_attr* srq_init_attr);
+int destroy_srq(ibv_srq* srq);
+int post_srq_recv(ibv_srq* srq, ibv_recv_wr* recv_wr, ibv_recv_wr** bad_wr);
+
+// Only the RC QPs are emulated.
+ibv_qp* create_qp(ibv_pd* pd, ibv_qp_init_attr* qp_init_attr);
+int modify_qp(ibv_qp* qp, ibv_qp_attr* attr, int attr_mask);
+int destroy_qp(ibv_qp* qp);
+int post_send(ibv_qp* qp, ibv_send_wr* wr, ibv_send_wr** bad_wr);
+int post_recv(ibv_qp* qp, ibv_recv_wr* wr, ibv_recv_wr** bad_wr);
+
+}  // namespace emu
+}  // namespace dLSM
+
+#undef ibv_get_device_list
+#undef ibv_query_port
+#undef ibv_reg_mr
+#define ibv_get_device_list ::dLSM::emu::get_device_list
+#define ibv_free_device_list ::dLSM::emu::free_device_list
+#define ibv_get_device_name ::dLSM::emu::get_device_name
+#define ibv_open_device ::dLSM::emu::open_device
+#define ibv_close_device ::dLSM::emu::close_device
+#define ibv_query_device ::dLSM::emu::query_device
+#define ibv_query_device_ex ::dLSM::emu::query_device_ex
+#define ibv_query_port ::dLSM::emu::query_port
+#define ibv_query_gid ::dLSM::emu::query_gid
+#define ibv_alloc_pd ::dLSM::emu::alloc_pd
+#define ibv_dealloc_pd ::dLSM::emu::dealloc_pd
+#define ibv_reg_mr ::dLSM::emu::reg_mr
+#define ibv_dereg_mr ::dLSM::emu::dereg_mr
+#define ibv_advise_mr ::dLSM::emu::advise_mr
+#define ibv_create_comp_channel ::dLSM::emu::create_comp_channel
+#define ibv_destroy_comp_channel ::dLSM::emu::destroy_comp_channel
+#define ibv_create_cq ::dLSM::emu::create_cq
+#define ibv_destroy_cq ::dLSM::emu::destroy_cq
+#define ibv_poll_cq ::dLSM::emu::poll_cq
+#define ibv_req_notify_cq ::dLSM::emu::req_notify_cq
+#define ibv_get_cq_event ::dLSM::emu::get_cq_event
+#define ibv_ack_cq_events ::dLSM::emu::ack_cq_events
+#define ibv_create_srq ::dLSM::emu::create_srq
+#define ibv_destroy_srq ::dLSM::emu::destroy_srq
+#define ibv_post_srq_recv ::dLSM::emu::post_srq_recv
+#define ibv_create_qp ::dLSM::emu::create_qp
+#define ibv_modify_qp ::dLSM::emu::modify_qp
+#define ibv_destroy_qp ::dLSM::emu::destroy_qp
+#define ibv_post_send ::dLSM::emu::post_send
+#define ibv_post_recv ::dLSM::emu::post_recv
+#endif  // RDMA_EMULATION
+
+#endif  // STORAGE_dLSM_UTIL_RDMA_EMULATION_H_
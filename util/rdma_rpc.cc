@@ -0,0 +1,101 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/rdma_rpc.h"
+
+#include <algorithm>
+
+namespace dLSM {
+
+namespace {
+
+// The sends of a batch posted at once, far below the send queue depth.
+const size_t kMaxBatchedSends = 64;
+
+ibv_mr AllocateSlot(RDMA_Manager* rdma_mg) {
+  ibv_mr mr = {};
+  rdma_mg->Allocate_RPC_Slot(mr);
+  return mr;
+}
+
+}  // namespace
+
+RPC_Call::RPC_Call(RDMA_Manager* rdma_mg, uint8_t target_node_id,
+                   RDMA_Command_Type command)
+    : rdma_mg_(rdma_mg),
+      target_node_id_(target_node_id),
+      send_mr_(AllocateSlot(rdma_mg)),
+      reply_mr_(AllocateSlot(rdma_mg)),
+      request_(static_cast<RDMA_Request*>(send_mr_.addr)),
+      reply_(static_cast<RDMA_Reply*>(reply_mr_.addr)),
+      sent_(false) {
+  *request_ = {};
+  request_->command = command;
+  request_->buffer = reply_mr_.addr;
+  request_->rkey = reply_mr_.rkey;
+}
+
+RPC_Call::~RPC_Call() {
+  rdma_mg_->Deallocate_RPC_Slot(send_mr_);
+  if (!sent_ || Done()) {
+    rdma_mg_->Deallocate_RPC_Slot(reply_mr_);
+  }
+  // Otherwise the late reply may still land in the slot, it is leaked.
+}
+
+bool RPC_Call::Send() {
+  assert(!sent_);
+  // Cleared before the request goes out, the memory node sets it.
+  *reply_ = {};
+  if (rdma_mg_->post_send<RDMA_Request>(&send_mr_, target_node_id_) != 0) {
+    return false;
+  }
+  // Sent as far as the reply slot is concerned.
+  sent_ = true;
+  ibv_wc wc[2] = {};
+  return rdma_mg_->poll_completion(wc, 1, QP_MAIN, true, target_node_id_) ==
+         0;
+}
+
+bool RPC_Call::Wait(uint64_t timeout_micros) {
+  assert(sent_);
+  return rdma_mg_->poll_reply_buffer(reply_, timeout_micros);
+}
+
+RPC_Batch::RPC_Batch(RDMA_Manager* rdma_mg, uint8_t target_node_id)
+    : rdma_mg_(rdma_mg), target_node_id_(target_node_id) {}
+
+void RPC_Batch::Add(RPC_Call* call) {
+  assert(call->rdma_mg_ == rdma_mg_ &&
+         call->target_node_id_ == target_node_id_ && !call->sent_);
+  calls_.push_back(call);
+}
+
+bool RPC_Batch::Send() {
+  std::vector<ibv_mr*> mr_list;
+  for (size_t start = 0; start < calls_.size(); start += kMaxBatchedSends) {
+    const size_t end = std::min(calls_.size(), start + kMaxBatchedSends);
+    mr_list.clear();
+    for (size_t i = start; i < end; i++) {
+      *calls_[i]->reply_ = {};
+      mr_list.push_back(&calls_[i]->send_mr_);
+    }
+    if (rdma_mg_->post_send_batch(mr_list.data(), mr_list.size(),
+                                  sizeof(RDMA_Request), target_node_id_) != 0) {
+      return false;
+    }
+    for (size_t i = start; i < end; i++) {
+      calls_[i]->sent_ = true;
+    }
+    // The completion of the last send covers the ones before it.
+    ibv_wc wc[2] = {};
+    if (rdma_mg_->poll_completion(wc, 1, QP_MAIN, true, target_node_id_)) {
+      return false;
+    }
+  }
+  calls_.clear();
+  return true;
+}
+
+}  // namespace dLSM
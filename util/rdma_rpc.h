@@ -0,0 +1,84 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_UTIL_RDMA_RPC_H_
+#define STORAGE_dLSM_UTIL_RDMA_RPC_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "util/rdma.h"
+
+namespace dLSM {
+
+// A control plane call to a memory node over its "main" queue pair. The
+// request goes out of a registered Message slot and names the reply slot of
+// the call, which the memory node writes the RDMA_Reply into, the received
+// byte last. The reply slot identifies the call, so any number of calls may
+// be in flight on one connection, from any thread. The slots come from the
+// cache of the RDMA_Manager rather than being allocated per call.
+class RPC_Call {
+ public:
+  RPC_Call(RDMA_Manager* rdma_mg, uint8_t target_node_id,
+           RDMA_Command_Type command);
+  // Returns the slots, but keeps the reply slot out of use if a reply may
+  // still be written into it.
+  ~RPC_Call();
+
+  RPC_Call(const RPC_Call&) = delete;
+  RPC_Call& operator=(const RPC_Call&) = delete;
+
+  // The request to fill in before Send(), its command and reply slot are
+  // set.
+  RDMA_Request* request() const { return request_; }
+  // Valid once Done().
+  const RDMA_Reply& reply() const { return *reply_; }
+
+  // Post the request and wait for the send to complete, the reply comes
+  // later. Returns false if the request could not be sent.
+  bool Send();
+  // Whether the reply has arrived, without waiting.
+  bool Done() const { return RDMA_Manager::check_reply_buffer(reply_); }
+  // Wait for the reply, at most "timeout_micros" unless it is 0. Returns
+  // false if it did not arrive.
+  bool Wait(uint64_t timeout_micros = 0);
+
+ private:
+  friend class RPC_Batch;
+
+  RDMA_Manager* const rdma_mg_;
+  const uint8_t target_node_id_;
+  ibv_mr send_mr_;
+  ibv_mr reply_mr_;
+  RDMA_Request* const request_;
+  RDMA_Reply* const reply_;
+  bool sent_;
+};
+
+// Calls to one memory node posted together, with a single doorbell and a
+// single signaled completion, for the callers which issue several small
+// requests at once.
+class RPC_Batch {
+ public:
+  RPC_Batch(RDMA_Manager* rdma_mg, uint8_t target_node_id);
+
+  RPC_Batch(const RPC_Batch&) = delete;
+  RPC_Batch& operator=(const RPC_Batch&) = delete;
+
+  // "call" must be to the node of the batch, not sent yet, and live until
+  // Send().
+  void Add(RPC_Call* call);
+  // Send all the calls added, as RPC_Call::Send() does. Returns false if
+  // any could not be sent, the calls sent before stay sent.
+  bool Send();
+
+ private:
+  RDMA_Manager* const rdma_mg_;
+  const uint8_t target_node_id_;
+  std::vector<RPC_Call*> calls_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_RDMA_RPC_H_
@@ -0,0 +1,445 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// The file secondary cache. The entries are appended to one of a ring of
+// segment files, and when it is full the oldest segment is emptied and
+// written next, so that the cache forgets in insertion order without any
+// bookkeeping on the disk. Each segment starts with its generation, which
+// orders the segments when they are read back at the next open.
+//
+// Segment:  magic (fixed64) | generation (fixed64) | record*
+// Record:   masked crc32c (fixed32) | key size (fixed32) |
+//           value size (fixed32) | key | value
+//
+// The crc covers the sizes, the key and the value. The files are not
+// synced: a record torn by a crash fails its crc and ends the scan of its
+// segment. The lookups read the files without the lock and check the crc
+// and the key, so a record overwritten meanwhile is a miss.
+
+#include "dLSM/secondary_cache.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "util/coding.h"
+#include "util/crc32c.h"
+
+namespace dLSM {
+
+SecondaryCache::~SecondaryCache() = default;
+
+namespace {
+
+static const int kNumSegments = 16;
+static const uint64_t kSegmentMagic = 0x64534c4d32636163ull;
+static const size_t kSegmentHeaderSize = 16;
+static const size_t kRecordHeaderSize = 12;
+static const size_t kMinSegmentSize = 64 << 10;
+// The inserts wait for the writer in at most this many bytes, the ones
+// beyond are dropped.
+static const size_t kMaxPendingBytes = 16 << 20;
+
+Status PosixError(const std::string& context, int error_number) {
+  return Status::IOError(context, std::strerror(error_number));
+}
+
+// Read "n" bytes at "offset" of "fd" into "data".
+int PreadFully(int fd, char* data, size_t n, uint64_t offset) {
+  while (n > 0) {
+    ssize_t read = ::pread(fd, data, n, static_cast<off_t>(offset));
+    if (read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    if (read == 0) {
+      return EIO;
+    }
+    data += read;
+    n -= read;
+    offset += read;
+  }
+  return 0;
+}
+
+// Write the "n" bytes of "data" at "offset" of "fd".
+int PwriteFully(int fd, const char* data, size_t n, uint64_t offset) {
+  while (n > 0) {
+    ssize_t written = ::pwrite(fd, data, n, static_cast<off_t>(offset));
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    data += written;
+    n -= written;
+    offset += written;
+  }
+  return 0;
+}
+
+// Check the record of "buf", which holds its header and "n" more bytes, and
+// point *key and *value into it.
+bool ParseRecord(const char* buf, size_t n, Slice* key, Slice* value) {
+  const uint32_t key_size = DecodeFixed32(buf + 4);
+  const uint32_t value_size = DecodeFixed32(buf + 8);
+  if (uint64_t{key_size} + value_size != n) {
+    return false;
+  }
+  const uint32_t crc = crc32c::Unmask(DecodeFixed32(buf));
+  if (crc32c::Value(buf + 4, kRecordHeaderSize - 4 + n) != crc) {
+    return false;
+  }
+  *key = Slice(buf + kRecordHeaderSize, key_size);
+  *value = Slice(buf + kRecordHeaderSize + key_size, value_size);
+  return true;
+}
+
+class FileSecondaryCache : public SecondaryCache {
+ public:
+  FileSecondaryCache(const std::string& dir, size_t capacity)
+      : dir_(dir),
+        segment_size_(std::max(capacity / kNumSegments, kMinSegmentSize)) {
+    for (int i = 0; i < kNumSegments; i++) {
+      fds_[i] = -1;
+      generations_[i] = 0;
+    }
+  }
+
+  ~FileSecondaryCache() override {
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      shutting_down_ = true;
+    }
+    work_cv_.notify_all();
+    if (writer_.joinable()) {
+      writer_.join();
+    }
+    for (int i = 0; i < kNumSegments; i++) {
+      if (fds_[i] >= 0) {
+        ::close(fds_[i]);
+      }
+    }
+  }
+
+  // Open the segments and read the entries they hold.
+  Status Open() {
+    if (::mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+      return PosixError(dir_, errno);
+    }
+    for (int i = 0; i < kNumSegments; i++) {
+      const std::string fname = SegmentName(i);
+      fds_[i] = ::open(fname.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (fds_[i] < 0) {
+        return PosixError(fname, errno);
+      }
+      char header[kSegmentHeaderSize];
+      if (PreadFully(fds_[i], header, sizeof(header), 0) == 0 &&
+          DecodeFixed64(header) == kSegmentMagic) {
+        generations_[i] = DecodeFixed64(header + 8);
+      }
+    }
+    // The older segments first, so that the newer copies of a key win.
+    int order[kNumSegments];
+    for (int i = 0; i < kNumSegments; i++) {
+      order[i] = i;
+    }
+    std::sort(order, order + kNumSegments, [this](int a, int b) {
+      return generations_[a] < generations_[b];
+    });
+    uint64_t end = 0;
+    for (int i : order) {
+      if (generations_[i] != 0) {
+        end = Scan(i);
+      }
+    }
+    active_ = order[kNumSegments - 1];
+    if (generations_[active_] == 0) {
+      Status s = Reset(active_, 1);
+      if (!s.ok()) {
+        return s;
+      }
+    } else {
+      // Drop the torn tail, the new records go after the valid ones.
+      active_offset_ = end;
+      if (::ftruncate(fds_[active_], static_cast<off_t>(end)) != 0) {
+        return PosixError(SegmentName(active_), errno);
+      }
+    }
+    writer_ = std::thread(&FileSecondaryCache::WriterLoop, this);
+    return Status::OK();
+  }
+
+  void Insert(const Slice& key, const Slice& value) override {
+    const size_t bytes = kRecordHeaderSize + key.size() + value.size();
+    if (kSegmentHeaderSize + bytes > segment_size_) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    std::unique_lock<std::mutex> l(mutex_);
+    if (index_.count(key.ToString()) != 0) {
+      return;
+    }
+    if (pending_bytes_ + bytes > kMaxPendingBytes) {
+      l.unlock();
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    pending_.emplace_back(key.ToString(), value.ToString());
+    pending_bytes_ += bytes;
+    l.unlock();
+    work_cv_.notify_one();
+  }
+
+  bool Lookup(const Slice& key, std::string* value) override {
+    Location location;
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      auto iter = index_.find(key.ToString());
+      if (iter == index_.end()) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      location = iter->second;
+    }
+    const size_t n = key.size() + location.value_size;
+    std::string buf(kRecordHeaderSize + n, '\0');
+    Slice found_key, found_value;
+    if (PreadFully(fds_[location.segment], &buf[0], buf.size(),
+                   location.offset) != 0 ||
+        !ParseRecord(buf.data(), n, &found_key, &found_value) ||
+        found_key != key) {
+      misses_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    value->assign(found_value.data(), found_value.size());
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  void Erase(const Slice& key) override {
+    std::lock_guard<std::mutex> l(mutex_);
+    auto iter = index_.find(key.ToString());
+    if (iter != index_.end()) {
+      usage_ -= iter->first.size() + iter->second.value_size;
+      index_.erase(iter);
+    }
+  }
+
+  size_t GetUsage() const override {
+    std::lock_guard<std::mutex> l(mutex_);
+    return usage_;
+  }
+
+  std::string ToString() const override {
+    size_t usage, entries;
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      usage = usage_;
+      entries = index_.size();
+    }
+    char buf[200];
+    std::snprintf(
+        buf, sizeof(buf),
+        "usage: %llu of %llu bytes, entries: %llu, hits: %llu, misses: "
+        "%llu, inserts: %llu, dropped: %llu\n",
+        static_cast<unsigned long long>(usage),
+        static_cast<unsigned long long>(segment_size_ * kNumSegments),
+        static_cast<unsigned long long>(entries),
+        static_cast<unsigned long long>(hits_.load()),
+        static_cast<unsigned long long>(misses_.load()),
+        static_cast<unsigned long long>(inserts_.load()),
+        static_cast<unsigned long long>(dropped_.load()));
+    return buf;
+  }
+
+ private:
+  struct Location {
+    int segment;
+    uint64_t offset;
+    uint32_t value_size;
+  };
+
+  std::string SegmentName(int segment) const {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "/segment-%02d", segment);
+    return dir_ + buf;
+  }
+
+  // Add the valid records of "segment" to the index and return the offset
+  // after the last one.
+  uint64_t Scan(int segment) {
+    const int fd = fds_[segment];
+    uint64_t offset = kSegmentHeaderSize;
+    std::string buf;
+    for (;;) {
+      char header[kRecordHeaderSize];
+      if (PreadFully(fd, header, sizeof(header), offset) != 0) {
+        break;
+      }
+      const uint64_t n =
+          uint64_t{DecodeFixed32(header + 4)} + DecodeFixed32(header + 8);
+      if (offset + kRecordHeaderSize + n > segment_size_) {
+        break;
+      }
+      buf.resize(kRecordHeaderSize + n);
+      Slice key, value;
+      if (PreadFully(fd, &buf[0], buf.size(), offset) != 0 ||
+          !ParseRecord(buf.data(), n, &key, &value)) {
+        break;
+      }
+      AddToIndex(key.ToString(), Location{segment, offset,
+                                          static_cast<uint32_t>(value.size())});
+      offset += buf.size();
+    }
+    return offset;
+  }
+
+  // REQUIRES: mutex_ held, or the writer not started.
+  void AddToIndex(std::string key, const Location& location) {
+    auto result = index_.emplace(key, location);
+    if (!result.second) {
+      usage_ -= key.size() + result.first->second.value_size;
+      result.first->second = location;
+    }
+    usage_ += key.size() + location.value_size;
+    segment_keys_[location.segment].push_back(std::move(key));
+  }
+
+  // Empty "segment" and make it of "generation".
+  Status Reset(int segment, uint64_t generation) {
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      for (const std::string& key : segment_keys_[segment]) {
+        auto iter = index_.find(key);
+        if (iter != index_.end() && iter->second.segment == segment) {
+          usage_ -= key.size() + iter->second.value_size;
+          index_.erase(iter);
+        }
+      }
+      segment_keys_[segment].clear();
+    }
+    generations_[segment] = generation;
+    active_offset_ = kSegmentHeaderSize;
+    char header[kSegmentHeaderSize];
+    EncodeFixed64(header, kSegmentMagic);
+    EncodeFixed64(header + 8, generation);
+    int error = 0;
+    if (::ftruncate(fds_[segment], 0) != 0) {
+      error = errno;
+    } else {
+      error = PwriteFully(fds_[segment], header, sizeof(header), 0);
+    }
+    return error == 0 ? Status::OK() : PosixError(SegmentName(segment), error);
+  }
+
+  void WriterLoop() {
+    std::unique_lock<std::mutex> l(mutex_);
+    for (;;) {
+      work_cv_.wait(l, [this] { return shutting_down_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        return;
+      }
+      std::deque<std::pair<std::string, std::string>> batch;
+      batch.swap(pending_);
+      pending_bytes_ = 0;
+      l.unlock();
+      for (auto& entry : batch) {
+        Write(std::move(entry.first), entry.second);
+      }
+      l.lock();
+    }
+  }
+
+  // Append the record of "key" to the active segment, after switching to
+  // the next one if it is full. Only the writer thread calls it.
+  void Write(std::string key, const std::string& value) {
+    const size_t n = key.size() + value.size();
+    if (active_offset_ + kRecordHeaderSize + n > segment_size_) {
+      const int next = (active_ + 1) % kNumSegments;
+      if (!Reset(next, generations_[active_] + 1).ok()) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      active_ = next;
+    }
+    std::string record(kRecordHeaderSize, '\0');
+    EncodeFixed32(&record[4], static_cast<uint32_t>(key.size()));
+    EncodeFixed32(&record[8], static_cast<uint32_t>(value.size()));
+    record.append(key);
+    record.append(value);
+    EncodeFixed32(&record[0], crc32c::Mask(crc32c::Value(
+                                  record.data() + 4, record.size() - 4)));
+    const uint64_t offset = active_offset_;
+    if (PwriteFully(fds_[active_], record.data(), record.size(), offset) !=
+        0) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    active_offset_ += record.size();
+    inserts_.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> l(mutex_);
+    AddToIndex(std::move(key),
+               Location{active_, offset, static_cast<uint32_t>(value.size())});
+  }
+
+  const std::string dir_;
+  const size_t segment_size_;
+  int fds_[kNumSegments];
+
+  // Only used by the writer thread, or by Open() before it starts.
+  uint64_t generations_[kNumSegments];
+  int active_ = 0;
+  uint64_t active_offset_ = 0;
+
+  mutable std::mutex mutex_;
+  std::condition_variable work_cv_;
+  bool shutting_down_ = false;
+  std::deque<std::pair<std::string, std::string>> pending_;
+  size_t pending_bytes_ = 0;
+  std::unordered_map<std::string, Location> index_;
+  // The keys written into each segment, some of which may have been
+  // written again into a later one.
+  std::vector<std::string> segment_keys_[kNumSegments];
+  size_t usage_ = 0;
+
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+  std::atomic<uint64_t> inserts_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::thread writer_;
+};
+
+}  // namespace
+
+Status NewFileSecondaryCache(const std::string& dir, size_t capacity,
+                             SecondaryCache** cache) {
+  *cache = nullptr;
+  FileSecondaryCache* file_cache = new FileSecondaryCache(dir, capacity);
+  Status s = file_cache->Open();
+  if (!s.ok()) {
+    delete file_cache;
+    return s;
+  }
+  *cache = file_cache;
+  return s;
+}
+
+}  // namespace dLSM
@@ -0,0 +1,88 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "dLSM/slice_transform.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+
+namespace dLSM {
+
+SliceTransform::~SliceTransform() = default;
+
+namespace {
+
+const char kFixedPrefixName[] = "dLSM.FixedPrefix.";
+
+class FixedPrefixTransform : public SliceTransform {
+ public:
+  explicit FixedPrefixTransform(size_t prefix_len)
+      : prefix_len_(prefix_len),
+        name_(kFixedPrefixName + std::to_string(prefix_len)) {}
+
+  const char* Name() const override { return name_.c_str(); }
+
+  bool InDomain(const Slice& key) const override {
+    return key.size() >= prefix_len_;
+  }
+
+  Slice Transform(const Slice& key) const override {
+    assert(InDomain(key));
+    return Slice(key.data(), prefix_len_);
+  }
+
+ private:
+  const size_t prefix_len_;
+  const std::string name_;
+};
+
+struct Registry {
+  std::mutex mutex;
+  std::map<std::string, const SliceTransform*> transforms;
+};
+
+Registry* GetRegistry() {
+  static Registry* registry = new Registry;
+  return registry;
+}
+
+}  // namespace
+
+const SliceTransform* NewFixedPrefixTransform(size_t prefix_len) {
+  return new FixedPrefixTransform(prefix_len);
+}
+
+void RegisterSliceTransform(const SliceTransform* transform) {
+  Registry* registry = GetRegistry();
+  std::lock_guard<std::mutex> lck(registry->mutex);
+  registry->transforms[transform->Name()] = transform;
+}
+
+const SliceTransform* FindSliceTransform(const std::string& name) {
+  Registry* registry = GetRegistry();
+  std::lock_guard<std::mutex> lck(registry->mutex);
+  auto iter = registry->transforms.find(name);
+  if (iter != registry->transforms.end()) {
+    return iter->second;
+  }
+  const size_t prefix_size = sizeof(kFixedPrefixName) - 1;
+  if (name.compare(0, prefix_size, kFixedPrefixName) != 0 ||
+      name.size() == prefix_size) {
+    return nullptr;
+  }
+  char* end;
+  const unsigned long long prefix_len =
+      std::strtoull(name.c_str() + prefix_size, &end, 10);
+  if (*end != '\0') {
+    return nullptr;
+  }
+  // Kept for the next lookups of the name.
+  const SliceTransform* transform = NewFixedPrefixTransform(prefix_len);
+  registry->transforms[name] = transform;
+  return transform;
+}
+
+}  // namespace dLSM
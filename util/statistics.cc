@@ -0,0 +1,48 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/statistics.h"
+
+#include <atomic>
+
+#include "util/core_local.h"
+
+namespace dLSM {
+
+const char* const kTickerNames[kNumTickers] = {
+    "bloom.checked",   "bloom.useful",     "bloom.false_positive",
+    "block_cache.hit", "block_cache.miss", "table_cache.hit",
+    "table_cache.miss", "secondary_cache.hit", "secondary_cache.miss"};
+
+namespace {
+
+struct alignas(64) TickerSlot {
+  std::atomic<uint64_t> counts[kNumTickers] = {};
+};
+
+CoreLocalArray<TickerSlot>* Slots() {
+  // Never destroyed, the background threads may count while the process
+  // exits.
+  static CoreLocalArray<TickerSlot>* slots = new CoreLocalArray<TickerSlot>();
+  return slots;
+}
+
+}  // namespace
+
+void RecordTick(Ticker ticker, uint64_t count) {
+  Slots()->Access()->counts[ticker].fetch_add(count,
+                                              std::memory_order_relaxed);
+}
+
+uint64_t GetTickerCount(Ticker ticker) {
+  CoreLocalArray<TickerSlot>* slots = Slots();
+  uint64_t sum = 0;
+  for (size_t i = 0; i < slots->Size(); i++) {
+    sum += slots->AccessAtCore(i)->counts[ticker].load(
+        std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+}  // namespace dLSM
@@ -0,0 +1,44 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_UTIL_STATISTICS_H_
+#define STORAGE_dLSM_UTIL_STATISTICS_H_
+
+#include <cstdint>
+
+namespace dLSM {
+
+// Counters of the lookups of the tables and of the caches, kept for the
+// whole process as the shards share the caches and the tables. Every core
+// has its own counters, so that counting is an add to a cache line no other
+// core writes. Always on, see the "dLSM.stats" property.
+enum Ticker : uint32_t {
+  // The filters consulted by the lookups of keys, and the ones which ruled
+  // the key out.
+  kBloomChecked,
+  kBloomUseful,
+  // Get() only: the filter let the key through but the table does not
+  // hold it.
+  kBloomFalsePositive,
+  kBlockCacheHit,
+  kBlockCacheMiss,
+  kTableCacheHit,
+  kTableCacheMiss,
+  // The misses of the table meta cache and of the block cache that looked
+  // into Options::secondary_cache.
+  kSecondaryCacheHit,
+  kSecondaryCacheMiss,
+  kNumTickers
+};
+
+extern const char* const kTickerNames[kNumTickers];
+
+void RecordTick(Ticker ticker, uint64_t count = 1);
+
+// The sum of the counters of all the cores.
+uint64_t GetTickerCount(Ticker ticker);
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_STATISTICS_H_
@@ -0,0 +1,140 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/timeline.h"
+
+#include <chrono>
+#include <cstdio>
+
+#include "dLSM/env.h"
+
+namespace dLSM {
+
+namespace {
+
+// A slot is written under a sequence lock: seq is 0 while it is written,
+// and the index of the job plus 1 afterwards.
+struct TimelineSlot {
+  std::atomic<uint64_t> seq{0};
+  std::atomic<const char*> name{nullptr};
+  std::atomic<uint64_t> start_micros{0};
+  std::atomic<uint64_t> micros{0};
+  std::atomic<uint64_t> job_id{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint32_t> tid{0};
+  std::atomic<int32_t> shard{0};
+  std::atomic<char> flow{0};
+};
+
+TimelineSlot* slots = nullptr;
+size_t num_slots = 0;
+std::atomic<uint64_t> next_slot{0};
+std::atomic<uint32_t> next_tid{1};
+
+uint32_t ThreadId() {
+  static thread_local uint32_t tid = next_tid.fetch_add(1);
+  return tid;
+}
+
+}  // namespace
+
+std::atomic<bool> Timeline::enabled_{false};
+
+void Timeline::Start(size_t capacity) {
+  static std::atomic<bool> started{false};
+  if (capacity == 0 || started.exchange(true)) {
+    return;
+  }
+  // Kept until the exit, the jobs may record into it to the end.
+  slots = new TimelineSlot[capacity];
+  num_slots = capacity;
+  enabled_.store(true, std::memory_order_release);
+}
+
+uint64_t Timeline::NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+void Timeline::Record(const char* name, uint64_t start_micros, int shard,
+                      uint64_t job_id, uint64_t bytes, Flow flow) {
+  if (!enabled()) {
+    return;
+  }
+  uint64_t index = next_slot.fetch_add(1, std::memory_order_relaxed);
+  TimelineSlot* slot = &slots[index % num_slots];
+  uint64_t now = NowMicros();
+  slot->seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->name.store(name, std::memory_order_relaxed);
+  slot->start_micros.store(start_micros, std::memory_order_relaxed);
+  slot->micros.store(now > start_micros ? now - start_micros : 0,
+                     std::memory_order_relaxed);
+  slot->job_id.store(job_id, std::memory_order_relaxed);
+  slot->bytes.store(bytes, std::memory_order_relaxed);
+  slot->tid.store(ThreadId(), std::memory_order_relaxed);
+  slot->shard.store(shard, std::memory_order_relaxed);
+  slot->flow.store(flow, std::memory_order_relaxed);
+  slot->seq.store(index + 1, std::memory_order_release);
+}
+
+std::string Timeline::Dump(int pid, const std::string& process_name) {
+  std::string result = "{\"traceEvents\":[\n";
+  char buf[512];
+  std::snprintf(buf, sizeof(buf),
+                "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}",
+                pid, process_name.c_str());
+  result.append(buf);
+  for (size_t i = 0; enabled() && i < num_slots; i++) {
+    TimelineSlot* slot = &slots[i];
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    if (seq == 0) {
+      continue;
+    }
+    const char* name = slot->name.load(std::memory_order_relaxed);
+    uint64_t start = slot->start_micros.load(std::memory_order_relaxed);
+    uint64_t micros = slot->micros.load(std::memory_order_relaxed);
+    uint64_t job_id = slot->job_id.load(std::memory_order_relaxed);
+    uint64_t bytes = slot->bytes.load(std::memory_order_relaxed);
+    uint32_t tid = slot->tid.load(std::memory_order_relaxed);
+    int32_t shard = slot->shard.load(std::memory_order_relaxed);
+    char flow = slot->flow.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->seq.load(std::memory_order_relaxed) != seq) {
+      // Overwritten while it was read.
+      continue;
+    }
+    std::snprintf(buf, sizeof(buf),
+                  ",\n{\"ph\":\"X\",\"name\":\"%s\",\"cat\":\"dLSM\","
+                  "\"pid\":%d,\"tid\":%u,\"ts\":%llu,\"dur\":%llu,"
+                  "\"args\":{\"shard\":%d,\"job\":\"%llx\",\"bytes\":%llu}}",
+                  name, pid, tid, static_cast<unsigned long long>(start),
+                  static_cast<unsigned long long>(micros), shard,
+                  static_cast<unsigned long long>(job_id),
+                  static_cast<unsigned long long>(bytes));
+    result.append(buf);
+    if (flow != kNoFlow) {
+      // The flow binds to the slice it starts in.
+      std::snprintf(buf, sizeof(buf),
+                    ",\n{\"ph\":\"%c\",\"name\":\"compaction\","
+                    "\"cat\":\"flow\",\"id\":\"%llx\",\"pid\":%d,"
+                    "\"tid\":%u,\"ts\":%llu%s}",
+                    flow, static_cast<unsigned long long>(job_id), pid, tid,
+                    static_cast<unsigned long long>(start),
+                    flow == kFlowStart ? "" : ",\"bp\":\"e\"");
+      result.append(buf);
+    }
+  }
+  result.append("\n],\"displayTimeUnit\":\"ms\"}\n");
+  return result;
+}
+
+Status Timeline::DumpToFile(const std::string& path, int pid,
+                            const std::string& process_name) {
+  return WriteStringToFile(Env::Default(), Dump(pid, process_name), path);
+}
+
+}  // namespace dLSM
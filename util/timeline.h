@@ -0,0 +1,100 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A timeline of the background jobs of a process, the flushes, the
+// compactions, the persistence and the version installs, in the Chrome trace
+// format, for chrome://tracing or Perfetto. It is off until Start(), then
+// every job costs a slot of a ring, which keeps the latest ones.
+//
+// A compaction the compute node sends to a memory node carries the same job
+// id on both, see Compaction::JobId(), and is recorded as a flow from the
+// dispatch through the run on the memory node to the install of the result.
+// The traces of the nodes, with the node ids as their pids, are merged with
+// script/merge_timelines.sh. The times are of the system clock, the nodes
+// are as aligned as their clocks.
+
+#ifndef STORAGE_dLSM_UTIL_TIMELINE_H_
+#define STORAGE_dLSM_UTIL_TIMELINE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "dLSM/status.h"
+
+namespace dLSM {
+
+class Timeline {
+ public:
+  // The part of a job in a flow across the nodes.
+  enum Flow : char {
+    kNoFlow = 0,
+    kFlowStart = 's',
+    kFlowStep = 't',
+    kFlowEnd = 'f'
+  };
+
+  // Record the latest "capacity" jobs from now on. Only the first call has
+  // an effect.
+  static void Start(size_t capacity);
+  static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+  static uint64_t NowMicros();
+
+  // Record the job "name", a string literal, of "shard" from "start_micros"
+  // to now. The shard is -1 where it is not known, as on a memory node. Lock free, a job which wraps around the ring onto a slot while
+  // it is dumped is left out of the dump.
+  static void Record(const char* name, uint64_t start_micros, int shard,
+                     uint64_t job_id, uint64_t bytes, Flow flow = kNoFlow);
+
+  // The recorded jobs as a Chrome trace of the process "pid", named
+  // "process_name".
+  static std::string Dump(int pid, const std::string& process_name);
+  static Status DumpToFile(const std::string& path, int pid,
+                           const std::string& process_name);
+
+ private:
+  static std::atomic<bool> enabled_;
+};
+
+// Records a job from its construction to its destruction, if the timeline
+// is on.
+class TimelineScope {
+ public:
+  TimelineScope(const char* name, int shard, uint64_t job_id = 0,
+                Timeline::Flow flow = Timeline::kNoFlow)
+      : name_(name),
+        shard_(shard),
+        job_id_(job_id),
+        flow_(flow),
+        start_(Timeline::enabled() ? Timeline::NowMicros() : 0) {}
+  ~TimelineScope() {
+    if (start_ != 0) {
+      Timeline::Record(name_, start_, shard_, job_id_, bytes_, flow_);
+    }
+  }
+
+  TimelineScope(const TimelineScope&) = delete;
+  TimelineScope& operator=(const TimelineScope&) = delete;
+
+  // Known once the job is done, such as the number of its output.
+  void set_job_id(uint64_t job_id) { job_id_ = job_id; }
+  void set_bytes(uint64_t bytes) { bytes_ = bytes; }
+
+ private:
+  const char* const name_;
+  const int shard_;
+  uint64_t job_id_;
+  const Timeline::Flow flow_;
+  const uint64_t start_;
+  uint64_t bytes_ = 0;
+};
+
+// The job id of the SSTable "number" made by "node_id".
+inline uint64_t TimelineJobId(uint64_t number, uint8_t node_id) {
+  return (static_cast<uint64_t>(node_id) << 56) | number;
+}
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_TIMELINE_H_
@@ -0,0 +1,77 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/work_stealing.h"
+
+#include <algorithm>
+#include <cassert>
+#include <numeric>
+
+#include "port/port.h"
+
+namespace dLSM {
+
+WorkStealingRunner::WorkStealingRunner(size_t num_workers,
+                                       const std::vector<uint64_t>& weights)
+    : workers_(std::max<size_t>(1, std::min(num_workers, weights.size()))) {
+  std::vector<size_t> order(weights.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return weights[a] > weights[b];
+  });
+  std::vector<uint64_t> load(workers_.size(), 0);
+  for (size_t i : order) {
+    size_t w = std::min_element(load.begin(), load.end()) - load.begin();
+    workers_[w].tasks.push_back(i);
+    // A task of no weight still costs something.
+    load[w] += std::max<uint64_t>(weights[i], 1);
+  }
+}
+
+void WorkStealingRunner::Run(const std::function<void(size_t)>& task) {
+  std::vector<port::Thread> threads;
+  threads.reserve(workers_.size() - 1);
+  for (size_t w = 1; w < workers_.size(); w++) {
+    threads.emplace_back(&WorkStealingRunner::WorkerLoop, this, w,
+                         std::cref(task));
+  }
+  WorkerLoop(0, task);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+void WorkStealingRunner::WorkerLoop(size_t self,
+                                    const std::function<void(size_t)>& task) {
+  size_t i;
+  while (Next(self, &i)) {
+    task(i);
+  }
+}
+
+bool WorkStealingRunner::Next(size_t self, size_t* task) {
+  {
+    Worker& own = workers_[self];
+    std::lock_guard<std::mutex> lock(own.mu);
+    if (!own.tasks.empty()) {
+      *task = own.tasks.front();
+      own.tasks.pop_front();
+      return true;
+    }
+  }
+  // No task is ever added, so one pass over the others which finds them
+  // all empty means there is nothing left to do.
+  for (size_t k = 1; k < workers_.size(); k++) {
+    Worker& victim = workers_[(self + k) % workers_.size()];
+    std::lock_guard<std::mutex> lock(victim.mu);
+    if (!victim.tasks.empty()) {
+      *task = victim.tasks.back();
+      victim.tasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace dLSM
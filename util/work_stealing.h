@@ -0,0 +1,53 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_dLSM_UTIL_WORK_STEALING_H_
+#define STORAGE_dLSM_UTIL_WORK_STEALING_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace dLSM {
+
+// Runs a fixed set of independent tasks on a few threads. The tasks are
+// dealt to per worker deques up front, heaviest first to the least loaded
+// worker, and a worker whose deque runs dry steals from the others, so
+// that no thread idles while tasks are left, whatever the dealing missed
+// about their real cost.
+//
+// A worker takes its own tasks from the front of its deque, heaviest
+// first, and steals from the back of the others, where the light ones are.
+class WorkStealingRunner {
+ public:
+  // weights[i] is the expected cost of task i.
+  WorkStealingRunner(size_t num_workers, const std::vector<uint64_t>& weights);
+
+  WorkStealingRunner(const WorkStealingRunner&) = delete;
+  WorkStealingRunner& operator=(const WorkStealingRunner&) = delete;
+
+  // Call task(i) once for every task and return when all have returned.
+  // Worker 0 is the calling thread, the others are threads of their own.
+  void Run(const std::function<void(size_t)>& task);
+
+ private:
+  struct alignas(64) Worker {
+    std::mutex mu;
+    std::deque<size_t> tasks;
+  };
+
+  void WorkerLoop(size_t self, const std::function<void(size_t)>& task);
+  // Take the next task of worker self, its own or a stolen one. Returns
+  // false once all the deques are empty.
+  bool Next(size_t self, size_t* task);
+
+  std::vector<Worker> workers_;
+};
+
+}  // namespace dLSM
+
+#endif  // STORAGE_dLSM_UTIL_WORK_STEALING_H_